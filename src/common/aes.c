@@ -36,6 +36,7 @@ DISABLE_GCC_WARNING(redundant-decls)
 ENABLE_GCC_WARNING(redundant-decls)
 
 #include "compat.h"
+#include "compat_time.h"
 #include "aes.h"
 #include "util.h"
 #include "torlog.h"
@@ -84,6 +85,28 @@ ENABLE_GCC_WARNING(redundant-decls)
  * make sure that we have a fixed version.)
  */
 
+/** Largest number of bytes per second that we measured for the counter-mode
+ * implementation we picked in aes_select_implementation(), or 0 if we
+ * haven't measured it. */
+static uint64_t aes_measured_throughput = 0;
+
+static uint64_t aes_measure_throughput(void);
+
+#if OPENSSL_VERSION_NUMBER >= OPENSSL_V_NOPATCH(1,0,1)
+/** Return OpenSSL's counter-mode AES cipher for <b>key_bits</b>-bit keys. */
+static const EVP_CIPHER *
+aes_get_evp_ctr_cipher(int key_bits)
+{
+  switch (key_bits) {
+    case 128: return EVP_aes_128_ctr();
+    case 192: return EVP_aes_192_ctr();
+    case 256: return EVP_aes_256_ctr();
+    default: tor_assert(0); // LCOV_EXCL_LINE
+  }
+  return NULL; // LCOV_EXCL_LINE
+}
+#endif
+
 #ifdef USE_EVP_AES_CTR
 
 /* We don't actually define the struct here. */
@@ -92,14 +115,7 @@ aes_cnt_cipher_t *
 aes_new_cipher(const uint8_t *key, const uint8_t *iv, int key_bits)
 {
   EVP_CIPHER_CTX *cipher = EVP_CIPHER_CTX_new();
-  const EVP_CIPHER *c;
-  switch (key_bits) {
-    case 128: c = EVP_aes_128_ctr(); break;
-    case 192: c = EVP_aes_192_ctr(); break;
-    case 256: c = EVP_aes_256_ctr(); break;
-    default: tor_assert(0); // LCOV_EXCL_LINE
-  }
-  EVP_EncryptInit(cipher, c, key, iv);
+  EVP_EncryptInit(cipher, aes_get_evp_ctr_cipher(key_bits), key, iv);
   return (aes_cnt_cipher_t *) cipher;
 }
 void
@@ -135,6 +151,24 @@ evaluate_ctr_for_aes(void)
 {
   return 0;
 }
+
+/** Measure how fast our AES counter mode is.  There is only one
+ * implementation to choose from here: OpenSSL picks the fastest code for
+ * this CPU behind EVP on its own. */
+void
+aes_select_implementation(void)
+{
+  aes_measured_throughput = aes_measure_throughput();
+  log_info(LD_CRYPTO, "Using OpenSSL's EVP counter mode for AES: "
+           U64_FORMAT" bytes/sec.", U64_PRINTF_ARG(aes_measured_throughput));
+}
+
+/** Return the name of the AES counter-mode implementation we're using. */
+const char *
+aes_get_implementation_name(void)
+{
+  return "openssl-evp-ctr";
+}
 #else
 
 /*======================================================================*/
@@ -174,11 +208,34 @@ struct aes_cnt_cipher {
 
   /** True iff we're using the evp implementation of this cipher. */
   uint8_t using_evp;
+  /** True iff key.evp does counter mode by itself, so we don't use our
+   * counter at all. */
+  uint8_t using_evp_ctr;
+};
+
+#if OPENSSL_VERSION_NUMBER >= OPENSSL_V_NOPATCH(1,0,1)
+#define CAN_USE_EVP_AES_CTR
+#endif
+
+/** Ways to do AES counter mode when we aren't sure that EVP is best. */
+typedef enum {
+  /** Our counter mode, on top of AES_encrypt(). */
+  AES_IMPL_AES_BLOCK = 0,
+  /** Our counter mode, on top of EVP in ECB mode. */
+  AES_IMPL_EVP_BLOCK = 1,
+  /** OpenSSL's EVP counter mode. */
+  AES_IMPL_EVP_CTR = 2,
+} aes_impl_t;
+
+/** Names for aes_impl_t values, for aes_get_implementation_name(). */
+static const char *aes_impl_names[] = {
+  "openssl-aes-block", "openssl-evp-block", "openssl-evp-ctr"
 };
 
-/** True iff we should prefer the EVP implementation for AES, either because
- * we're testing it or because we have hardware acceleration configured */
-static int should_use_EVP = 0;
+/** Which implementation should new ciphers use?  We prefer the EVP
+ * implementation for AES if we're testing it, if we have hardware
+ * acceleration configured, or if it's fastest. */
+static aes_impl_t aes_impl = AES_IMPL_AES_BLOCK;
 
 /** Check whether we should use the EVP interface for AES. If <b>force_val</b>
  * is nonnegative, we use use EVP iff it is true.  Otherwise, we use EVP
@@ -189,21 +246,21 @@ evaluate_evp_for_aes(int force_val)
   ENGINE *e;
 
   if (force_val >= 0) {
-    should_use_EVP = force_val;
+    aes_impl = force_val ? AES_IMPL_EVP_BLOCK : AES_IMPL_AES_BLOCK;
     return 0;
   }
 #ifdef DISABLE_ENGINES
-  should_use_EVP = 0;
+  aes_impl = AES_IMPL_AES_BLOCK;
 #else
   e = ENGINE_get_cipher_engine(NID_aes_128_ecb);
 
   if (e) {
     log_info(LD_CRYPTO, "AES engine \"%s\" found; using EVP_* functions.",
                ENGINE_get_name(e));
-    should_use_EVP = 1;
+    aes_impl = AES_IMPL_EVP_BLOCK;
   } else {
     log_info(LD_CRYPTO, "No AES engine found; using AES_* functions.");
-    should_use_EVP = 0;
+    aes_impl = AES_IMPL_AES_BLOCK;
   }
 #endif
 
@@ -253,6 +310,44 @@ evaluate_ctr_for_aes(void)
   return 0;
 }
 
+/** Measure each of the AES counter-mode implementations we have on
+ * relay-cell-sized inputs, and use the fastest one from now on.  Call this
+ * after evaluate_evp_for_aes() and evaluate_ctr_for_aes(). */
+void
+aes_select_implementation(void)
+{
+  aes_impl_t impl, best = aes_impl;
+  uint64_t best_throughput = 0;
+#ifdef CAN_USE_EVP_AES_CTR
+  const aes_impl_t last_impl = AES_IMPL_EVP_CTR;
+#else
+  const aes_impl_t last_impl = AES_IMPL_EVP_BLOCK;
+#endif
+
+  for (impl = AES_IMPL_AES_BLOCK; impl <= last_impl; ++impl) {
+    uint64_t throughput;
+    aes_impl = impl;
+    throughput = aes_measure_throughput();
+    log_info(LD_CRYPTO, "AES counter mode via %s: "U64_FORMAT" bytes/sec.",
+             aes_impl_names[impl], U64_PRINTF_ARG(throughput));
+    if (throughput > best_throughput) {
+      best = impl;
+      best_throughput = throughput;
+    }
+  }
+
+  aes_impl = best;
+  aes_measured_throughput = best_throughput;
+  log_info(LD_CRYPTO, "Using %s for AES counter mode.", aes_impl_names[best]);
+}
+
+/** Return the name of the AES counter-mode implementation we're using. */
+const char *
+aes_get_implementation_name(void)
+{
+  return aes_impl_names[aes_impl];
+}
+
 #if !defined(USING_COUNTER_VARS)
 #define COUNTER(c, n) ((c)->ctr_buf.buf32[3-(n)])
 #else
@@ -272,6 +367,14 @@ aes_new_cipher(const uint8_t *key, const uint8_t *iv, int bits)
 {
   aes_cnt_cipher_t* result = tor_malloc_zero(sizeof(aes_cnt_cipher_t));
 
+#ifdef CAN_USE_EVP_AES_CTR
+  if (aes_impl == AES_IMPL_EVP_CTR) {
+    EVP_EncryptInit(&result->key.evp, aes_get_evp_ctr_cipher(bits), key, iv);
+    result->using_evp = result->using_evp_ctr = 1;
+    return result;
+  }
+#endif
+
   aes_set_key(result, key, bits);
   aes_set_iv(result, iv);
 
@@ -285,7 +388,7 @@ aes_new_cipher(const uint8_t *key, const uint8_t *iv, int bits)
 static void
 aes_set_key(aes_cnt_cipher_t *cipher, const uint8_t *key, int key_bits)
 {
-  if (should_use_EVP) {
+  if (aes_impl == AES_IMPL_EVP_BLOCK) {
     const EVP_CIPHER *c = 0;
     switch (key_bits) {
       case 128: c = EVP_aes_128_ecb(); break;
@@ -354,6 +457,14 @@ evp_block128_fn(const uint8_t in[16],
 void
 aes_crypt_inplace(aes_cnt_cipher_t *cipher, char *data, size_t len)
 {
+  if (cipher->using_evp_ctr) {
+    int outl;
+    tor_assert(len < INT_MAX);
+    EVP_EncryptUpdate(&cipher->key.evp, (unsigned char*)data,
+                      &outl, (unsigned char*)data, (int)len);
+    return;
+  }
+
   /* Note that the "128" below refers to the length of the counter,
    * not the length of the AES key. */
   if (cipher->using_evp) {
@@ -396,3 +507,95 @@ aes_set_iv(aes_cnt_cipher_t *cipher, const uint8_t *iv)
 
 #endif
 
+/** How many bytes do we encrypt at a time when we measure an AES
+ * implementation?  This is the size of a relay cell payload, since that's
+ * what we'll mostly be encrypting. */
+#define AES_CALIBRATION_CHUNK_LEN 509
+/** How many chunks do we encrypt when we measure an AES implementation? */
+#define AES_CALIBRATION_N_CHUNKS 512
+
+/** Encrypt a few hundred kilobytes, one relay cell payload at a time, with
+ * the AES counter-mode implementation that aes_new_cipher() currently
+ * returns, and return how many bytes per second we managed. */
+static uint64_t
+aes_measure_throughput(void)
+{
+  uint8_t key[16], iv[16];
+  char chunk[AES_CALIBRATION_CHUNK_LEN];
+  aes_cnt_cipher_t *cipher;
+  monotime_t start, end;
+  int64_t usec;
+  int i;
+
+  memset(key, 0x5a, sizeof(key));
+  memset(iv, 0, sizeof(iv));
+  memset(chunk, 0, sizeof(chunk));
+
+  cipher = aes_new_cipher(key, iv, 128);
+  monotime_get(&start);
+  for (i = 0; i < AES_CALIBRATION_N_CHUNKS; ++i)
+    aes_crypt_inplace(cipher, chunk, sizeof(chunk));
+  monotime_get(&end);
+  aes_cipher_free(cipher);
+
+  usec = monotime_diff_usec(&start, &end);
+  if (usec < 1)
+    usec = 1;
+  return ((uint64_t)AES_CALIBRATION_N_CHUNKS * AES_CALIBRATION_CHUNK_LEN *
+          1000000) / (uint64_t)usec;
+}
+
+/** Return how many bytes per second the AES counter-mode implementation we
+ * picked in aes_select_implementation() encrypted when we measured it, or
+ * 0 if we haven't measured it. */
+uint64_t
+aes_get_measured_throughput(void)
+{
+  return aes_measured_throughput;
+}
+
+/** Largest number of bytes that aes_crypt_inplace_multi() will gather into
+ * a single call to the underlying counter-mode implementation. */
+#define AES_MULTI_SCRATCH_LEN 4096
+
+/** Encrypt the <b>len</b>-byte buffers in <b>bufs</b>[0..<b>n_bufs</b>-1]
+ * in place, in order, using the key in <b>cipher</b>.  The result is the
+ * same as calling aes_crypt_inplace() on each buffer in turn, but we
+ * gather as many buffers as will fit into a scratch buffer first, so that
+ * the counter-mode implementation sees a few long runs instead of many short
+ * ones.
+ */
+void
+aes_crypt_inplace_multi(aes_cnt_cipher_t *cipher, char * const *bufs,
+                        int n_bufs, size_t len)
+{
+  char scratch[AES_MULTI_SCRATCH_LEN];
+  int i = 0, j;
+  size_t off;
+
+  tor_assert(n_bufs >= 0);
+
+  if (len == 0)
+    return;
+
+  if (len > sizeof(scratch) / 2) {
+    /* Batching would buy us nothing. */
+    for (i = 0; i < n_bufs; ++i)
+      aes_crypt_inplace(cipher, bufs[i], len);
+    return;
+  }
+
+  while (i < n_bufs) {
+    for (j = i, off = 0; j < n_bufs && off + len <= sizeof(scratch);
+         ++j, off += len) {
+      memcpy(scratch + off, bufs[j], len);
+    }
+    aes_crypt_inplace(cipher, scratch, off);
+    for (off = 0; i < j; ++i, off += len) {
+      memcpy(bufs[i], scratch + off, len);
+    }
+  }
+
+  memwipe(scratch, 0, sizeof(scratch));
+}
+
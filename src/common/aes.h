@@ -19,9 +19,14 @@ aes_cnt_cipher_t* aes_new_cipher(const uint8_t *key, const uint8_t *iv,
                                  int key_bits);
 void aes_cipher_free(aes_cnt_cipher_t *cipher);
 void aes_crypt_inplace(aes_cnt_cipher_t *cipher, char *data, size_t len);
+void aes_crypt_inplace_multi(aes_cnt_cipher_t *cipher, char * const *bufs,
+                             int n_bufs, size_t len);
 
 int evaluate_evp_for_aes(int force_value);
 int evaluate_ctr_for_aes(void);
+void aes_select_implementation(void);
+const char *aes_get_implementation_name(void);
+uint64_t aes_get_measured_throughput(void);
 
 #endif
 
@@ -30,6 +30,12 @@
 #ifdef HAVE_SIGNAL_H
 #include <signal.h>
 #endif
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+#ifdef HAVE_TIME_H
+#include <time.h>
+#endif
 
 #ifdef HAVE_CYGWIN_SIGNAL_H
 #include <cygwin/signal.h>
@@ -51,6 +57,10 @@
 #define NO_BACKTRACE_IMPL
 #endif
 
+#if defined(USE_BACKTRACE) && defined(HAVE_PTHREAD_H)
+#define USE_BACKTRACE_SAMPLING
+#endif
+
 /** Version of Tor to report in backtrace messages. */
 static char *bt_version = NULL;
 
@@ -204,6 +214,130 @@ remove_bt_handler(void)
 }
 #endif
 
+#ifdef USE_BACKTRACE_SAMPLING
+/** Signal we send to the sampled thread to make it record its stack. */
+#define SAMPLE_SIGNAL SIGPROF
+/** How long do we wait for the sampled thread to answer, in msec? */
+#define SAMPLE_TIMEOUT_MSEC 100
+
+/** The thread that called configure_backtrace_sampling(). */
+static pthread_t sampled_thread;
+/** True iff configure_backtrace_sampling() has succeeded. */
+static int sampling_configured = 0;
+/** Protects sample_buf from concurrent requests for a sample. */
+static tor_mutex_t sample_mutex;
+/** Stack recorded by sample_handler(). */
+static void *sample_buf[MAX_DEPTH];
+/** Depth of the stack in sample_buf, or -1 if sample_handler() has not
+ * run since we last asked it to. */
+static volatile sig_atomic_t sample_depth = -1;
+
+/** Signal handler: record the current stack for log_sampled_backtrace(),
+ * and return. */
+static void
+sample_handler(int sig, siginfo_t *si, void *ctx_)
+{
+  int saved_errno = errno;
+  int depth;
+  (void) sig;
+  (void) si;
+
+  depth = backtrace(sample_buf, MAX_DEPTH);
+  clean_backtrace(sample_buf, depth, (ucontext_t *) ctx_);
+  sample_depth = depth;
+
+  errno = saved_errno;
+}
+
+/** Arrange for log_sampled_backtrace(), when called from any other thread,
+ * to log the stack of the calling thread.  Return 0 on success, -1 on
+ * failure. */
+int
+configure_backtrace_sampling(void)
+{
+  struct sigaction sa;
+
+  if (sampling_configured)
+    return pthread_equal(sampled_thread, pthread_self()) ? 0 : -1;
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_sigaction = sample_handler;
+  sa.sa_flags = SA_SIGINFO|SA_RESTART;
+  sigfillset(&sa.sa_mask);
+  if (sigaction(SAMPLE_SIGNAL, &sa, NULL) == -1) {
+    /* LCOV_EXCL_START */
+    log_warn(LD_BUG, "Sigaction failed: %s", strerror(errno));
+    return -1;
+    /* LCOV_EXCL_STOP */
+  }
+
+  tor_mutex_init(&sample_mutex);
+  sampled_thread = pthread_self();
+  sampling_configured = 1;
+  return 0;
+}
+
+/** Interrupt the thread that called configure_backtrace_sampling(), and
+ * log a message <b>msg</b> at <b>severity</b> in <b>domain</b>, followed
+ * by the stack that thread was running when we interrupted it.  Must not
+ * be called from the sampled thread itself. */
+void
+log_sampled_backtrace(int severity, int domain, const char *msg)
+{
+  char **symbols = NULL;
+  int depth = -1, i, r;
+
+  if (!sampling_configured) {
+    tor_log(severity, domain, "%s. (Stack trace not available)", msg);
+    return;
+  }
+
+  tor_mutex_acquire(&sample_mutex);
+  sample_depth = -1;
+  if ((r = pthread_kill(sampled_thread, SAMPLE_SIGNAL)) == 0) {
+    struct timespec ts;
+    ts.tv_sec = 0;
+    ts.tv_nsec = 1000000;
+    for (i = 0; i < SAMPLE_TIMEOUT_MSEC && sample_depth < 0; ++i)
+      nanosleep(&ts, NULL);
+    depth = sample_depth;
+  }
+
+  if (depth < 0) {
+    tor_log(severity, domain, "%s. (Unable to sample stack: %s)", msg,
+            r ? strerror(r) : "timed out");
+    goto done;
+  }
+  symbols = backtrace_symbols(sample_buf, depth);
+  tor_log(severity, domain, "%s. Stack trace:", msg);
+  if (!symbols) {
+    /* LCOV_EXCL_START */
+    tor_log(severity, domain, "    Unable to generate backtrace.");
+    goto done;
+    /* LCOV_EXCL_STOP */
+  }
+  for (i = 0; i < depth; ++i) {
+    tor_log(severity, domain, "    %s", symbols[i]);
+  }
+  raw_free(symbols);
+
+ done:
+  tor_mutex_release(&sample_mutex);
+}
+#else
+int
+configure_backtrace_sampling(void)
+{
+  return -1;
+}
+
+void
+log_sampled_backtrace(int severity, int domain, const char *msg)
+{
+  tor_log(severity, domain, "%s. (Stack trace not available)", msg);
+}
+#endif
+
 #ifdef NO_BACKTRACE_IMPL
 void
 log_backtrace(int severity, int domain, const char *msg)
@@ -9,6 +9,8 @@
 void log_backtrace(int severity, int domain, const char *msg);
 int configure_backtrace_handler(const char *tor_version);
 void clean_up_backtrace_handler(void);
+int configure_backtrace_sampling(void);
+void log_sampled_backtrace(int severity, int domain, const char *msg);
 
 #ifdef EXPOSE_CLEAN_BACKTRACE
 #if defined(HAVE_EXECINFO_H) && defined(HAVE_BACKTRACE) && \
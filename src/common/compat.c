@@ -438,6 +438,112 @@ tor_munmap_file(tor_mmap_t *handle)
 }
 #endif
 
+/** Tell the kernel how we expect to use the mapping <b>handle</b>, as a
+ * bitwise OR of TOR_MMAP_ADVISE_* flags.  With neither SEQUENTIAL nor
+ * RANDOM, restore the default access pattern.  These are only hints:
+ * return 0 if the platform took all of them, and -1 otherwise. */
+int
+tor_mmap_advise(const tor_mmap_t *handle, unsigned flags)
+{
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MADVISE)
+  void *start = (void*)handle->data;
+  size_t len = handle->mapping_size;
+  int pattern, r = 0;
+
+  if (flags & TOR_MMAP_ADVISE_SEQUENTIAL)
+    pattern = MADV_SEQUENTIAL;
+  else if (flags & TOR_MMAP_ADVISE_RANDOM)
+    pattern = MADV_RANDOM;
+  else
+    pattern = MADV_NORMAL;
+  if (madvise(start, len, pattern) < 0)
+    r = -1;
+
+  if ((flags & TOR_MMAP_ADVISE_WILLNEED) &&
+      madvise(start, len, MADV_WILLNEED) < 0)
+    r = -1;
+
+  if (flags & TOR_MMAP_ADVISE_HUGEPAGE) {
+#ifdef MADV_HUGEPAGE
+    if (madvise(start, len, MADV_HUGEPAGE) < 0)
+      r = -1;
+#else
+    r = -1;
+#endif
+  }
+  return r;
+#else
+  (void)handle;
+  return flags ? -1 : 0;
+#endif
+}
+
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MINCORE)
+/* Linux wants an unsigned vector for mincore(); the BSDs want a signed
+ * one. */
+#ifdef __linux__
+typedef unsigned char mincore_vec_t;
+#else
+typedef char mincore_vec_t;
+#endif
+#endif
+
+/** Set *<b>resident_out</b> to the number of bytes of the mapping
+ * <b>handle</b> that are in memory right now, and return 0.  Return -1 if
+ * we can't tell. */
+int
+tor_mmap_get_resident(const tor_mmap_t *handle, size_t *resident_out)
+{
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MINCORE)
+  const size_t page_size = getpagesize();
+  const size_t n_pages = handle->mapping_size / page_size;
+  mincore_vec_t *vec;
+  size_t i, n_resident = 0;
+
+  if (n_pages == 0) {
+    *resident_out = 0;
+    return 0;
+  }
+  vec = tor_malloc(n_pages);
+  if (mincore((void*)handle->data, handle->mapping_size, vec) < 0) {
+    tor_free(vec);
+    return -1;
+  }
+  for (i = 0; i < n_pages; ++i) {
+    if (vec[i] & 1)
+      ++n_resident;
+  }
+  tor_free(vec);
+  *resident_out = MIN(n_resident * page_size, handle->size);
+  return 0;
+#elif defined(HAVE_SYS_MMAN_H) || defined(_WIN32)
+  (void)handle;
+  (void)resident_out;
+  return -1;
+#else
+  /* We read the whole file into memory. */
+  *resident_out = handle->size;
+  return 0;
+#endif
+}
+
+/** Set *<b>faults_out</b> to the number of page faults this process has
+ * taken that needed disk I/O, and return 0.  Return -1 if we can't tell. */
+int
+tor_get_major_page_faults(uint64_t *faults_out)
+{
+#ifdef HAVE_SYS_RESOURCE_H
+  struct rusage ru;
+  if (getrusage(RUSAGE_SELF, &ru) < 0)
+    return -1;
+  *faults_out = (uint64_t) ru.ru_majflt;
+  return 0;
+#else
+  (void)faults_out;
+  return -1;
+#endif
+}
+
 /** Replacement for snprintf.  Differs from platform snprintf in two
  * ways: First, always NUL-terminates its output.  Second, always
  * returns -1 if the result is truncated.  (Note that this return
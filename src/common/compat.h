@@ -323,6 +323,22 @@ typedef struct tor_mmap_t {
 tor_mmap_t *tor_mmap_file(const char *filename) ATTR_NONNULL((1));
 int tor_munmap_file(tor_mmap_t *handle) ATTR_NONNULL((1));
 
+/** Flags for tor_mmap_advise(). */
+/** We'll read the mapping once, from start to end. */
+#define TOR_MMAP_ADVISE_SEQUENTIAL (1u<<0)
+/** We'll read small pieces of the mapping in no particular order. */
+#define TOR_MMAP_ADVISE_RANDOM     (1u<<1)
+/** We'll need the whole mapping soon: start reading it in now. */
+#define TOR_MMAP_ADVISE_WILLNEED   (1u<<2)
+/** Back the mapping with huge pages if the kernel can. */
+#define TOR_MMAP_ADVISE_HUGEPAGE   (1u<<3)
+
+int tor_mmap_advise(const tor_mmap_t *handle, unsigned flags)
+  ATTR_NONNULL((1));
+int tor_mmap_get_resident(const tor_mmap_t *handle, size_t *resident_out)
+  ATTR_NONNULL((1,2));
+int tor_get_major_page_faults(uint64_t *faults_out) ATTR_NONNULL((1));
+
 int tor_snprintf(char *str, size_t size, const char *format, ...)
   CHECK_PRINTF(3,4) ATTR_NONNULL((1,3));
 int tor_vsnprintf(char *str, size_t size, const char *format, va_list args)
@@ -150,6 +150,18 @@ tor_libevent_get_method(void)
   return event_base_get_method(the_event_base);
 }
 
+/** Return true iff the Libevent backend we're using can deliver
+ * edge-triggered (EV_ET) notifications. */
+int
+tor_libevent_supports_edge_triggered(void)
+{
+#ifdef EV_ET
+  return (event_base_get_features(the_event_base) & EV_FEATURE_ET) != 0;
+#else
+  return 0;
+#endif
+}
+
 /** Return a string representation of the version of the currently running
  * version of Libevent. */
 const char *
@@ -31,6 +31,12 @@ void periodic_timer_free(periodic_timer_t *);
 
 #define tor_event_base_loopexit event_base_loopexit
 
+#ifndef EV_ET
+/* Libevents without edge-triggered events; tor_libevent_supports_edge_
+ * triggered() always says no there, so the flag is never used. */
+#define EV_ET 0
+#endif
+
 /** Defines a configuration for using libevent with Tor: passed as an argument
  * to tor_libevent_initialize() to describe how we want to set up. */
 typedef struct tor_libevent_cfg {
@@ -44,6 +50,7 @@ typedef struct tor_libevent_cfg {
 void tor_libevent_initialize(tor_libevent_cfg *cfg);
 MOCK_DECL(struct event_base *, tor_libevent_get_base, (void));
 const char *tor_libevent_get_method(void);
+int tor_libevent_supports_edge_triggered(void);
 void tor_check_libevent_header_compatibility(void);
 const char *tor_libevent_get_version_str(void);
 const char *tor_libevent_get_header_version_str(void);
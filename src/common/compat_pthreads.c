@@ -14,6 +14,9 @@
 #include <pthread.h>
 #include <signal.h>
 #include <time.h>
+#if defined(HAVE_PTHREAD_SETAFFINITY_NP) || defined(HAVE_SCHED_GETCPU)
+#include <sched.h>
+#endif
 
 #include "compat.h"
 #include "torlog.h"
@@ -185,6 +188,49 @@ tor_get_thread_id(void)
   return r.id;
 }
 
+/** Restrict the calling thread to run only on CPU number <b>cpu</b>, or
+ * let it run on any CPU if <b>cpu</b> is negative.  Return 0 on success,
+ * or -1 on failure or if we can't do that on this platform. */
+int
+tor_set_current_thread_cpu(int cpu)
+{
+#if defined(HAVE_PTHREAD_SETAFFINITY_NP) && defined(CPU_SET)
+  cpu_set_t set;
+  int i, r;
+  if (cpu >= CPU_SETSIZE)
+    return -1;
+  CPU_ZERO(&set);
+  if (cpu < 0) {
+    for (i = 0; i < CPU_SETSIZE; ++i)
+      CPU_SET(i, &set);
+  } else {
+    CPU_SET(cpu, &set);
+  }
+  r = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  if (r) {
+    log_warn(LD_GENERAL, "Unable to bind thread to CPU %d: %s",
+             cpu, strerror(r));
+    return -1;
+  }
+  return 0;
+#else
+  (void) cpu;
+  return -1;
+#endif
+}
+
+/** Return the number of the CPU that the calling thread is running on, or
+ * -1 if we can't tell. */
+int
+tor_get_current_cpu(void)
+{
+#ifdef HAVE_SCHED_GETCPU
+  return sched_getcpu();
+#else
+  return -1;
+#endif
+}
+
 /* Conditions. */
 
 /** Initialize an already-allocated condition variable. */
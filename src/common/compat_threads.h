@@ -53,6 +53,8 @@ void tor_mutex_release(tor_mutex_t *m);
 void tor_mutex_free(tor_mutex_t *m);
 void tor_mutex_uninit(tor_mutex_t *m);
 unsigned long tor_get_thread_id(void);
+int tor_set_current_thread_cpu(int cpu);
+int tor_get_current_cpu(void);
 void tor_threads_init(void);
 
 /** Conditions need nonrecursive mutexes with pthreads. */
@@ -627,3 +627,37 @@ monotime_coarse_absolute_msec(void)
 }
 #endif
 
+/** Cached value for monotime_coarse_absolute_msec_cached(), or 0 if we need
+ * to look at the clock again. */
+static uint64_t cached_coarse_msec = 0;
+
+/**
+ * Return the value of monotime_coarse_absolute_msec() as of the first time
+ * this function was called since the last monotime_coarse_cache_clear().
+ *
+ * This is for timestamping queued cells and data, where we do it often
+ * enough that even a vDSO clock call per item adds up, and where we care
+ * more that stamps taken while handling one event agree with each other
+ * than that they are exact.  The event loop clears the cache at the start
+ * of each event it handles.  Only call this from the main thread.
+ */
+uint64_t
+monotime_coarse_absolute_msec_cached(void)
+{
+#ifdef TOR_UNIT_TESTS
+  if (monotime_mocking_enabled)
+    return monotime_coarse_absolute_msec();
+#endif
+  if (PREDICT_UNLIKELY(cached_coarse_msec == 0))
+    cached_coarse_msec = monotime_coarse_absolute_msec();
+  return cached_coarse_msec;
+}
+
+/** Make the next call to monotime_coarse_absolute_msec_cached() look at the
+ * clock again. */
+void
+monotime_coarse_cache_clear(void)
+{
+  cached_coarse_msec = 0;
+}
+
@@ -87,6 +87,32 @@ tor_get_thread_id(void)
   return (unsigned long)GetCurrentThreadId();
 }
 
+int
+tor_set_current_thread_cpu(int cpu)
+{
+  DWORD_PTR mask, sys_mask;
+  if (cpu >= (int)(sizeof(DWORD_PTR)*8))
+    return -1;
+  if (cpu < 0) {
+    if (!GetProcessAffinityMask(GetCurrentProcess(), &mask, &sys_mask))
+      return -1;
+  } else {
+    mask = ((DWORD_PTR)1) << cpu;
+  }
+  if (SetThreadAffinityMask(GetCurrentThread(), mask) == 0) {
+    log_warn(LD_GENERAL, "Unable to bind thread to CPU %d: %d",
+             cpu, (int)GetLastError());
+    return -1;
+  }
+  return 0;
+}
+
+int
+tor_get_current_cpu(void)
+{
+  return (int)GetCurrentProcessorNumber();
+}
+
 int
 tor_cond_init(tor_cond_t *cond)
 {
@@ -122,6 +122,10 @@ void *smartlist_bsearch(smartlist_t *sl, const void *key,
 int smartlist_bsearch_idx(const smartlist_t *sl, const void *key,
                           int (*compare)(const void *key, const void **member),
                           int *found_out);
+void *smartlist_bsearch_digest(const smartlist_t *sl, const char *digest,
+                               int offset);
+int smartlist_bsearch_digest_idx(const smartlist_t *sl, const char *digest,
+                                 int offset, int *found_out);
 
 void smartlist_pqueue_add(smartlist_t *sl,
                           int (*compare)(const void *a, const void *b),
@@ -636,27 +640,50 @@ bitarray_is_set(bitarray_t *b, int bit)
   return b[bit >> BITARRAY_SHIFT] & (1u << (bit & BITARRAY_MASK));
 }
 
-/** A set of digests, implemented as a Bloom filter. */
+/** A set of digests, implemented as a blocked Bloom filter.
+ *
+ * Every digest maps to one DIGESTSET_BLOCK_WORDS-word block, chosen by one
+ * half of its hash, and sets one bit in each word of that block, chosen by
+ * multiplying the other half of its hash by a per-word constant.  So a
+ * lookup touches one cache line, and its per-word work has no dependencies
+ * between words, which compilers can vectorize. */
 typedef struct {
-  int mask; /**< One less than the number of bits in <b>ba</b>; always one less
-             * than a power of two. */
-  bitarray_t *ba; /**< A bit array to implement the Bloom filter. */
+  int mask; /**< One less than the number of blocks in <b>blocks</b>; always
+             * one less than a power of two. */
+  uint64_t *blocks; /**< The filter bits, aligned to a cache line. */
+  void *mem; /**< The allocation that holds <b>blocks</b>. */
 } digestset_t;
 
-#define BIT(n) ((n) & set->mask)
+/** How many 64-bit words are in each block of a digestset_t? */
+#define DIGESTSET_BLOCK_WORDS 8
+
+/** Helper: set each of <b>bits_out</b> to the single bit to check in the
+ * corresponding word of a digest's block, given the low 32 bits of its
+ * hash. */
+static inline void
+digestset_block_bits_(uint32_t h, uint64_t *bits_out)
+{
+  static const uint32_t salt[DIGESTSET_BLOCK_WORDS] = {
+    0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU,
+    0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U
+  };
+  int i;
+  for (i = 0; i < DIGESTSET_BLOCK_WORDS; ++i)
+    bits_out[i] = U64_LITERAL(1) << ((uint32_t)(h * salt[i]) >> 26);
+}
+
 /** Add the digest <b>digest</b> to <b>set</b>. */
 static inline void
 digestset_add(digestset_t *set, const char *digest)
 {
   const uint64_t x = siphash24g(digest, 20);
-  const uint32_t d1 = (uint32_t) x;
-  const uint32_t d2 = (uint32_t)( (x>>16) + x);
-  const uint32_t d3 = (uint32_t)( (x>>32) + x);
-  const uint32_t d4 = (uint32_t)( (x>>48) + x);
-  bitarray_set(set->ba, BIT(d1));
-  bitarray_set(set->ba, BIT(d2));
-  bitarray_set(set->ba, BIT(d3));
-  bitarray_set(set->ba, BIT(d4));
+  uint64_t *block =
+    set->blocks + ((uint32_t)(x >> 32) & set->mask) * DIGESTSET_BLOCK_WORDS;
+  uint64_t bits[DIGESTSET_BLOCK_WORDS];
+  int i;
+  digestset_block_bits_((uint32_t)x, bits);
+  for (i = 0; i < DIGESTSET_BLOCK_WORDS; ++i)
+    block[i] |= bits[i];
 }
 
 /** If <b>digest</b> is in <b>set</b>, return nonzero.  Otherwise,
@@ -665,20 +692,42 @@ static inline int
 digestset_contains(const digestset_t *set, const char *digest)
 {
   const uint64_t x = siphash24g(digest, 20);
-  const uint32_t d1 = (uint32_t) x;
-  const uint32_t d2 = (uint32_t)( (x>>16) + x);
-  const uint32_t d3 = (uint32_t)( (x>>32) + x);
-  const uint32_t d4 = (uint32_t)( (x>>48) + x);
-  return bitarray_is_set(set->ba, BIT(d1)) &&
-         bitarray_is_set(set->ba, BIT(d2)) &&
-         bitarray_is_set(set->ba, BIT(d3)) &&
-         bitarray_is_set(set->ba, BIT(d4));
+  const uint64_t *block =
+    set->blocks + ((uint32_t)(x >> 32) & set->mask) * DIGESTSET_BLOCK_WORDS;
+  uint64_t bits[DIGESTSET_BLOCK_WORDS];
+  uint64_t missing = 0;
+  int i;
+  digestset_block_bits_((uint32_t)x, bits);
+  for (i = 0; i < DIGESTSET_BLOCK_WORDS; ++i)
+    missing |= bits[i] & ~block[i];
+  return missing == 0;
 }
-#undef BIT
 
 digestset_t *digestset_new(int max_elements);
 void digestset_free(digestset_t* set);
 
+/** A table of objects, each named by a 64-bit handle that encodes its slot
+ * in the table and that slot's generation.  Looking up a handle takes one
+ * array access, and a handle for an object that has been removed never
+ * matches again, even once its slot is reused.  Handle 0 is never used. */
+typedef struct slottable_t slottable_t;
+/** How many low bits of a handle give its slot; the rest give the slot's
+ * generation. */
+#define SLOTTABLE_INDEX_BITS 24
+slottable_t *slottable_new(void);
+void slottable_free(slottable_t *table);
+uint64_t slottable_add(slottable_t *table, void *obj);
+void *slottable_get(const slottable_t *table, uint64_t handle);
+void *slottable_remove(slottable_t *table, uint64_t handle);
+int slottable_size(const slottable_t *table);
+
+/* Interned strings: each distinct string is stored once, with a reference
+ * count, no matter how many times it is interned.  These functions are for
+ * the main thread only. */
+const char *tor_intern_string(const char *s);
+void tor_intern_string_release(const char *s);
+int tor_intern_string_n_entries(void);
+
 /* These functions, given an <b>array</b> of <b>n_elements</b>, return the
  * <b>nth</b> lowest element. <b>nth</b>=0 gives the lowest element;
  * <b>n_elements</b>-1 gives the highest; and (<b>n_elements</b>-1) / 2 gives
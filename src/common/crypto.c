@@ -28,6 +28,8 @@
 #include "crypto_curve25519.h"
 #include "crypto_ed25519.h"
 #include "crypto_format.h"
+#include "crypto_async.h"
+#include "crypto_rand_fast.h"
 
 DISABLE_GCC_WARNING(redundant-decls)
 
@@ -424,6 +426,10 @@ crypto_global_init(int useAccel, const char *accelName, const char *accelDir)
 
     evaluate_evp_for_aes(-1);
     evaluate_ctr_for_aes();
+    aes_select_implementation();
+
+    if (crypto_fast_rng_global_init() < 0)
+      return -1;
   }
   return 0;
 }
@@ -432,6 +438,8 @@ crypto_global_init(int useAccel, const char *accelName, const char *accelDir)
 void
 crypto_thread_cleanup(void)
 {
+  crypto_fast_rng_thread_cleanup();
+  crypto_async_thread_cleanup();
 #ifndef NEW_THREAD_API
   ERR_remove_thread_state(NULL);
 #endif
@@ -1636,6 +1644,21 @@ crypto_cipher_crypt_inplace(crypto_cipher_t *env, char *buf, size_t len)
   aes_crypt_inplace(env, buf, len);
 }
 
+/** Encrypt each of the <b>n_bufs</b> buffers in <b>bufs</b>, all of which
+ * are <b>len</b> bytes long, in place and in order, using the cipher in
+ * <b>env</b>.  Equivalent to calling crypto_cipher_crypt_inplace() on each
+ * buffer, but cheaper when there are many short buffers.
+ */
+void
+crypto_cipher_crypt_inplace_multi(crypto_cipher_t *env, char * const *bufs,
+                                  int n_bufs, size_t len)
+{
+  tor_assert(env);
+  tor_assert(n_bufs == 0 || bufs);
+  tor_assert(len < SIZE_T_CEILING);
+  aes_crypt_inplace_multi(env, bufs, n_bufs, len);
+}
+
 /** Encrypt <b>fromlen</b> bytes (at least 1) from <b>from</b> with the key in
  * <b>key</b> to the buffer in <b>to</b> of length
  * <b>tolen</b>. <b>tolen</b> must be at least <b>fromlen</b> plus
@@ -2053,6 +2076,35 @@ crypto_digest_assign(crypto_digest_t *into,
   memcpy(into,from,alloc_bytes);
 }
 
+/** Save the state of <b>digest</b> into <b>checkpoint</b>, so that it can
+ * later be restored with crypto_digest_restore().  Only SHA1 and SHA256
+ * digests fit in a checkpoint.  Unlike crypto_digest_dup(), this does not
+ * allocate: it is meant for hot paths where we usually throw the saved
+ * state away. */
+void
+crypto_digest_checkpoint(crypto_digest_checkpoint_t *checkpoint,
+                         const crypto_digest_t *digest)
+{
+  tor_assert(checkpoint);
+  tor_assert(digest);
+  const size_t bytes = crypto_digest_alloc_bytes(digest->algorithm);
+  tor_assert(bytes <= sizeof(checkpoint->mem));
+  memcpy(checkpoint->mem, digest, bytes);
+}
+
+/** Restore the state of <b>digest</b> from <b>checkpoint</b>, which must
+ * have been filled in by crypto_digest_checkpoint() from a digest using the
+ * same algorithm. */
+void
+crypto_digest_restore(crypto_digest_t *digest,
+                      const crypto_digest_checkpoint_t *checkpoint)
+{
+  tor_assert(digest);
+  tor_assert(checkpoint);
+  const size_t bytes = crypto_digest_alloc_bytes(digest->algorithm);
+  memcpy(digest, checkpoint->mem, bytes);
+}
+
 /** Given a list of strings in <b>lst</b>, set the <b>len_out</b>-byte digest
  * at <b>digest_out</b> to the hash of the concatenation of those strings,
  * plus the optional string <b>append</b>, computed with the algorithm
@@ -3375,6 +3427,7 @@ setup_openssl_threading(void)
 int
 crypto_global_cleanup(void)
 {
+  crypto_fast_rng_global_cleanup();
   EVP_cleanup();
 #ifndef NEW_THREAD_API
   ERR_remove_thread_state(NULL);
@@ -120,6 +120,15 @@ typedef struct crypto_pk_t crypto_pk_t;
 typedef struct aes_cnt_cipher crypto_cipher_t;
 typedef struct crypto_digest_t crypto_digest_t;
 typedef struct crypto_xof_t crypto_xof_t;
+
+/** Length of a buffer large enough to hold a saved SHA1 or SHA256 digest
+ * state.  (The space for the algorithm tag is included.) */
+#define DIGEST_CHECKPOINT_BYTES (SIZEOF_VOID_P + 128)
+/** Structure used to temporarily save a SHA1 or SHA256 digest state, so
+ * that we can roll back to it without a heap allocation. */
+typedef struct crypto_digest_checkpoint_t {
+  uint8_t mem[DIGEST_CHECKPOINT_BYTES];
+} crypto_digest_checkpoint_t;
 typedef struct crypto_dh_t crypto_dh_t;
 
 /* global state */
@@ -214,6 +223,9 @@ int crypto_cipher_encrypt(crypto_cipher_t *env, char *to,
 int crypto_cipher_decrypt(crypto_cipher_t *env, char *to,
                           const char *from, size_t fromlen);
 void crypto_cipher_crypt_inplace(crypto_cipher_t *env, char *d, size_t len);
+void crypto_cipher_crypt_inplace_multi(crypto_cipher_t *env,
+                                      char * const *bufs, int n_bufs,
+                                      size_t len);
 
 int crypto_cipher_encrypt_with_iv(const char *key,
                                   char *to, size_t tolen,
@@ -252,6 +264,10 @@ void crypto_digest_get_digest(crypto_digest_t *digest,
 crypto_digest_t *crypto_digest_dup(const crypto_digest_t *digest);
 void crypto_digest_assign(crypto_digest_t *into,
                           const crypto_digest_t *from);
+void crypto_digest_checkpoint(crypto_digest_checkpoint_t *checkpoint,
+                              const crypto_digest_t *digest);
+void crypto_digest_restore(crypto_digest_t *digest,
+                           const crypto_digest_checkpoint_t *checkpoint);
 void crypto_hmac_sha256(char *hmac_out,
                         const char *key, size_t key_len,
                         const char *msg, size_t msg_len);
@@ -0,0 +1,243 @@
+/* Copyright (c) 2016, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file crypto_async.c
+ *
+ * \brief Run batches of crypto operations as OpenSSL async jobs.
+ *
+ * A hardware crypto accelerator, loaded as an OpenSSL engine with
+ * HardwareAccel and AccelName, can have many requests in flight at once.
+ * But a synchronous caller submits one request and then waits for it,
+ * leaving the accelerator mostly idle.
+ *
+ * With OpenSSL 1.1.0 or later, an async-capable engine can instead pause
+ * the job that made a request, and let the thread go on to start others.
+ * crypto_async_run_batch() runs each function in a batch as its own async
+ * job, starts them all, and then resumes the paused ones as the engine
+ * signals that their results are ready.  Functions that never pause (as
+ * with software crypto) just run to completion one after another.
+ *
+ * We don't use this unless HardwareAccelAsync is set, and we can't use it
+ * with older OpenSSLs, or with OpenSSLs built without async support.
+ */
+
+#include "orconfig.h"
+#include "crypto.h"
+#include "compat_openssl.h"
+#include "crypto_async.h"
+#include "util.h"
+
+#if defined(OPENSSL_1_1_API) && !defined(OPENSSL_NO_ASYNC)
+#define USE_OPENSSL_ASYNC
+#include <openssl/async.h>
+#ifndef _WIN32
+#include <poll.h>
+#endif
+#endif
+
+/** True iff we should run batches as async jobs. */
+static int crypto_async_enabled = 0;
+
+/** Return true iff this OpenSSL can run crypto operations as async
+ * jobs on this platform. */
+int
+crypto_async_is_supported(void)
+{
+#ifdef USE_OPENSSL_ASYNC
+  return ASYNC_is_capable();
+#else
+  return 0;
+#endif
+}
+
+/** Enable async jobs for crypto batches if <b>enabled</b> is true and we
+ * can support them; disable them otherwise.  Return 0 on success, or -1 if
+ * we were asked to enable async jobs but can't. */
+int
+crypto_async_set_enabled(int enabled)
+{
+  if (enabled && !crypto_async_is_supported()) {
+    crypto_async_enabled = 0;
+    return -1;
+  }
+  crypto_async_enabled = enabled;
+  return 0;
+}
+
+/** Return true iff we run crypto batches as async jobs. */
+int
+crypto_async_is_enabled(void)
+{
+  return crypto_async_enabled;
+}
+
+#ifdef USE_OPENSSL_ASYNC
+/** The argument that OpenSSL copies into each async job. */
+typedef struct crypto_async_work_t {
+  crypto_async_fn_t fn;
+  void *arg;
+} crypto_async_work_t;
+
+/** State for one function in a batch that we are running as a job. */
+typedef struct crypto_async_slot_t {
+  ASYNC_JOB *job;
+  ASYNC_WAIT_CTX *ctx;
+  /** True iff this function has finished. */
+  unsigned done : 1;
+} crypto_async_slot_t;
+
+/** Async job body: run the function in <b>work_</b>. */
+static int
+crypto_async_job_main(void *work_)
+{
+  crypto_async_work_t *work = work_;
+  return work->fn(work->arg);
+}
+
+/** Start or resume the job in <b>slot</b>, which runs <b>fn</b> on
+ * <b>arg</b>.  If it finishes, or can't run as a job, store its result in
+ * *<b>result_out</b> and mark it done. */
+static void
+crypto_async_slot_run(crypto_async_slot_t *slot, crypto_async_fn_t fn,
+                      void *arg, int *result_out)
+{
+  crypto_async_work_t work;
+  int ret = 0;
+
+  work.fn = fn;
+  work.arg = arg;
+  if (!slot->ctx)
+    slot->ctx = ASYNC_WAIT_CTX_new();
+  switch (slot->ctx ? ASYNC_start_job(&slot->job, slot->ctx, &ret,
+                                      crypto_async_job_main, &work,
+                                      sizeof(work))
+                    : ASYNC_ERR) {
+    case ASYNC_PAUSE:
+      return;
+    case ASYNC_FINISH:
+      break;
+    case ASYNC_NO_JOBS:
+    case ASYNC_ERR:
+    default:
+      /* We couldn't start a job: run the function the ordinary way. */
+      tor_assert(slot->job == NULL);
+      ret = fn(arg);
+      break;
+  }
+  *result_out = ret;
+  slot->done = 1;
+  slot->job = NULL;
+  ASYNC_WAIT_CTX_free(slot->ctx);
+  slot->ctx = NULL;
+}
+
+#ifndef _WIN32
+/** Wait for up to <b>msec</b> msec until the engine signals that some
+ * paused job among the <b>n</b> in <b>slots</b> can make progress.  If
+ * the engine gives us nothing to wait on, return at once. */
+static void
+crypto_async_wait_for_slots(crypto_async_slot_t *slots, int n, int msec)
+{
+  struct pollfd *pfds = NULL;
+  size_t n_pfds = 0, n_alloc = 0;
+  int i;
+
+  for (i = 0; i < n; ++i) {
+    size_t numfds = 0;
+    if (slots[i].done ||
+        !ASYNC_WAIT_CTX_get_all_fds(slots[i].ctx, NULL, &numfds) ||
+        numfds == 0)
+      continue;
+    if (n_pfds + numfds > n_alloc) {
+      n_alloc = MAX(n_alloc * 2, n_pfds + numfds);
+      pfds = tor_reallocarray(pfds, n_alloc, sizeof(struct pollfd));
+    }
+    {
+      OSSL_ASYNC_FD *fds = tor_calloc(numfds, sizeof(OSSL_ASYNC_FD));
+      size_t j;
+      if (ASYNC_WAIT_CTX_get_all_fds(slots[i].ctx, fds, &numfds)) {
+        for (j = 0; j < numfds; ++j) {
+          pfds[n_pfds].fd = fds[j];
+          pfds[n_pfds].events = POLLIN;
+          pfds[n_pfds].revents = 0;
+          ++n_pfds;
+        }
+      }
+      tor_free(fds);
+    }
+  }
+  if (n_pfds)
+    poll(pfds, (nfds_t)n_pfds, msec);
+  tor_free(pfds);
+}
+#endif
+#endif
+
+/** How long do we wait at a time for an accelerator to finish a paused
+ * job, in msec? */
+#define CRYPTO_ASYNC_WAIT_MSEC 10
+
+/** Run <b>fn</b> on each of the <b>n</b> arguments in <b>args</b>, and
+ * store the results in <b>results</b> (if it's provided).  If async jobs
+ * are enabled, run each call as a job, so that an async engine can work on
+ * all of them at once.  Return the number of calls that ran as async jobs.
+ *
+ * The functions all run in this thread, but their order is unspecified,
+ * and with an async engine their executions may interleave wherever they
+ * call into the engine. */
+int
+crypto_async_run_batch(crypto_async_fn_t fn, void **args, int *results,
+                       int n)
+{
+  int i;
+  tor_assert(fn);
+  tor_assert(args || n == 0);
+
+#ifdef USE_OPENSSL_ASYNC
+  if (crypto_async_enabled && n > 0) {
+    crypto_async_slot_t *slots = tor_calloc(n, sizeof(crypto_async_slot_t));
+    int *tmp_results = results ? NULL : tor_calloc(n, sizeof(int));
+    int *res = results ? results : tmp_results;
+    int n_left = n;
+
+    for (i = 0; i < n; ++i) {
+      crypto_async_slot_run(&slots[i], fn, args[i], &res[i]);
+      if (slots[i].done)
+        --n_left;
+    }
+    while (n_left > 0) {
+#ifndef _WIN32
+      crypto_async_wait_for_slots(slots, n, CRYPTO_ASYNC_WAIT_MSEC);
+#endif
+      for (i = 0; i < n; ++i) {
+        if (slots[i].done)
+          continue;
+        crypto_async_slot_run(&slots[i], fn, args[i], &res[i]);
+        if (slots[i].done)
+          --n_left;
+      }
+    }
+    tor_free(slots);
+    tor_free(tmp_results);
+    return n;
+  }
+#endif
+
+  for (i = 0; i < n; ++i) {
+    int r = fn(args[i]);
+    if (results)
+      results[i] = r;
+  }
+  return 0;
+}
+
+/** Release any async job state that OpenSSL holds for this thread. */
+void
+crypto_async_thread_cleanup(void)
+{
+#ifdef USE_OPENSSL_ASYNC
+  ASYNC_cleanup_thread();
+#endif
+}
+
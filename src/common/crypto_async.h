@@ -0,0 +1,24 @@
+/* Copyright (c) 2016, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file crypto_async.h
+ * \brief Headers for crypto_async.c
+ **/
+
+#ifndef TOR_CRYPTO_ASYNC_H
+#define TOR_CRYPTO_ASYNC_H
+
+/** A function to run as part of a batch: takes an argument, and returns
+ * an integer result. */
+typedef int (*crypto_async_fn_t)(void *arg);
+
+int crypto_async_is_supported(void);
+int crypto_async_set_enabled(int enabled);
+int crypto_async_is_enabled(void);
+int crypto_async_run_batch(crypto_async_fn_t fn, void **args, int *results,
+                           int n);
+void crypto_async_thread_cleanup(void);
+
+#endif
+
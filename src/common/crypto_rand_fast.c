@@ -0,0 +1,242 @@
+/* Copyright (c) 2016, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file crypto_rand_fast.c
+ *
+ * \brief A fast, buffered, userspace random number generator.
+ *
+ * crypto_rand() goes through OpenSSL's RAND_bytes() for every request, and
+ * takes its locks each time.  That's fine for keys, but wasteful for the
+ * many small requests we make on hot paths, like picking circuit IDs and
+ * choosing nodes by weight.
+ *
+ * This generator uses "fast key erasure": we run AES-256-CTR under a
+ * secret seed to fill a buffer, take the first bytes of the keystream as
+ * the next seed, and hand out the rest, wiping each byte as we give it
+ * away.  So an attacker who learns the generator's state can't recover
+ * anything we generated before.  Every FAST_RNG_RESEED_AFTER buffers we
+ * replace the seed with output from crypto_strongest_rand().
+ *
+ * Each thread gets its own generator, so there is no locking.  Use this
+ * for randomness that has to be unpredictable but doesn't need to be
+ * key material; use crypto_rand() or crypto_strongest_rand() for keys.
+ *
+ * A forked child shares its parent's generator state: don't use this
+ * generator in a child process that doesn't exec.
+ */
+
+#define CRYPTO_RAND_FAST_PRIVATE
+#include "crypto.h"
+#include "crypto_rand_fast.h"
+#include "aes.h"
+#include "compat_threads.h"
+#include "util.h"
+#include "torlog.h"
+
+/** Length of the AES key we use. */
+#define FAST_RNG_KEY_LEN 32
+/** Length of the seed: an AES key and an IV. */
+#define FAST_RNG_SEED_LEN (FAST_RNG_KEY_LEN + CIPHER_IV_LEN)
+
+/** State for a fast random number generator. */
+struct crypto_fast_rng_t {
+  /** How many more times will we refill the buffer before we reseed from
+   * crypto_strongest_rand()? */
+  int n_till_reseed;
+  /** How many bytes at the end of buf.bytes are still unused? */
+  size_t bytes_left;
+  struct {
+    /** Secret key and IV for the next refill. */
+    uint8_t seed[FAST_RNG_SEED_LEN];
+    /** Output we haven't handed out yet, at the end of this array. */
+    uint8_t bytes[FAST_RNG_BUFLEN];
+  } buf;
+};
+
+/** Return a new fast random number generator, seeded from
+ * crypto_strongest_rand(). */
+crypto_fast_rng_t *
+crypto_fast_rng_new(void)
+{
+  crypto_fast_rng_t *rng = tor_malloc_zero(sizeof(crypto_fast_rng_t));
+  crypto_strongest_rand(rng->buf.seed, sizeof(rng->buf.seed));
+  rng->n_till_reseed = FAST_RNG_RESEED_AFTER;
+  rng->bytes_left = 0;
+  return rng;
+}
+
+/** Wipe and release all storage held by <b>rng</b>. */
+void
+crypto_fast_rng_free(crypto_fast_rng_t *rng)
+{
+  if (!rng)
+    return;
+  memwipe(rng, 0, sizeof(*rng));
+  tor_free(rng);
+}
+
+/** Replace the seed of <b>rng</b> and the buffer of output with new
+ * keystream from the current seed, reseeding first if it's time. */
+static void
+crypto_fast_rng_refill(crypto_fast_rng_t *rng)
+{
+  aes_cnt_cipher_t *cipher;
+
+  if (--rng->n_till_reseed <= 0) {
+    crypto_strongest_rand(rng->buf.seed, sizeof(rng->buf.seed));
+    rng->n_till_reseed = FAST_RNG_RESEED_AFTER;
+  }
+
+  cipher = aes_new_cipher(rng->buf.seed, rng->buf.seed + FAST_RNG_KEY_LEN,
+                          FAST_RNG_KEY_LEN * 8);
+  /* Encrypting zeros gives us the keystream, which overwrites the old seed
+   * with the new one, and fills the buffer. */
+  memset(&rng->buf, 0, sizeof(rng->buf));
+  aes_crypt_inplace(cipher, (char *)&rng->buf, sizeof(rng->buf));
+  aes_cipher_free(cipher);
+  rng->bytes_left = sizeof(rng->buf.bytes);
+}
+
+/** Write <b>n</b> random bytes from <b>rng</b> into <b>out</b>. */
+void
+crypto_fast_rng_getbytes(crypto_fast_rng_t *rng, uint8_t *out, size_t n)
+{
+  tor_assert(rng);
+  tor_assert(out || n == 0);
+
+  while (n) {
+    uint8_t *cp;
+    size_t take;
+    if (rng->bytes_left == 0)
+      crypto_fast_rng_refill(rng);
+    take = MIN(n, rng->bytes_left);
+    cp = rng->buf.bytes + sizeof(rng->buf.bytes) - rng->bytes_left;
+    memcpy(out, cp, take);
+    memwipe(cp, 0, take);
+    out += take;
+    n -= take;
+    rng->bytes_left -= take;
+  }
+}
+
+/** Thread-local storage for each thread's generator. */
+static tor_threadlocal_t fast_rng_threadlocal;
+/** True iff we have initialized fast_rng_threadlocal. */
+static int fast_rng_threadlocal_initialized = 0;
+
+/** Set up the per-thread fast random number generators.  Must be called
+ * before any other thread starts; crypto_global_init() does this.  Return 0
+ * on success, -1 on failure. */
+int
+crypto_fast_rng_global_init(void)
+{
+  if (fast_rng_threadlocal_initialized)
+    return 0;
+  if (tor_threadlocal_init(&fast_rng_threadlocal) < 0)
+    return -1;
+  fast_rng_threadlocal_initialized = 1;
+  return 0;
+}
+
+/** Return this thread's fast random number generator, creating it if
+ * needed. */
+static crypto_fast_rng_t *
+get_thread_fast_rng(void)
+{
+  crypto_fast_rng_t *rng;
+
+  tor_assert(fast_rng_threadlocal_initialized);
+  rng = tor_threadlocal_get(&fast_rng_threadlocal);
+  if (PREDICT_UNLIKELY(rng == NULL)) {
+    rng = crypto_fast_rng_new();
+    tor_threadlocal_set(&fast_rng_threadlocal, rng);
+  }
+  return rng;
+}
+
+/** Release this thread's fast random number generator, if it has one. */
+void
+crypto_fast_rng_thread_cleanup(void)
+{
+  if (!fast_rng_threadlocal_initialized)
+    return;
+  crypto_fast_rng_free(tor_threadlocal_get(&fast_rng_threadlocal));
+  tor_threadlocal_set(&fast_rng_threadlocal, NULL);
+}
+
+/** Release this thread's fast random number generator, and stop using
+ * per-thread generators.  Other threads must have exited, or called
+ * crypto_fast_rng_thread_cleanup(), already. */
+void
+crypto_fast_rng_global_cleanup(void)
+{
+  if (!fast_rng_threadlocal_initialized)
+    return;
+  crypto_fast_rng_thread_cleanup();
+  tor_threadlocal_destroy(&fast_rng_threadlocal);
+  fast_rng_threadlocal_initialized = 0;
+}
+
+/** Write <b>n</b> bytes of random data to <b>to</b>, from this thread's
+ * fast generator.  Not for key material; see crypto_rand() for that. */
+void
+crypto_fast_rand(char *to, size_t n)
+{
+  crypto_fast_rng_getbytes(get_thread_fast_rng(), (uint8_t *)to, n);
+}
+
+/** As crypto_rand_int(), but use this thread's fast generator. */
+int
+crypto_fast_rand_int(unsigned int max)
+{
+  crypto_fast_rng_t *rng = get_thread_fast_rng();
+  unsigned int val;
+  unsigned int cutoff;
+  tor_assert(max <= ((unsigned int)INT_MAX)+1);
+  tor_assert(max > 0); /* don't div by 0 */
+
+  /* As in crypto_rand_int(), reject values >= cutoff so that we don't bias
+   * the result. */
+  cutoff = UINT_MAX - (UINT_MAX%max);
+  while (1) {
+    crypto_fast_rng_getbytes(rng, (uint8_t *)&val, sizeof(val));
+    if (val < cutoff)
+      return val % max;
+  }
+}
+
+/** As crypto_rand_uint64(), but use this thread's fast generator. */
+uint64_t
+crypto_fast_rand_uint64(uint64_t max)
+{
+  crypto_fast_rng_t *rng = get_thread_fast_rng();
+  uint64_t val;
+  uint64_t cutoff;
+  tor_assert(max < UINT64_MAX);
+  tor_assert(max > 0); /* don't div by 0 */
+
+  cutoff = UINT64_MAX - (UINT64_MAX%max);
+  while (1) {
+    crypto_fast_rng_getbytes(rng, (uint8_t *)&val, sizeof(val));
+    if (val < cutoff)
+      return val % max;
+  }
+}
+
+#ifdef TOR_UNIT_TESTS
+/** Return the number of buffered bytes <b>rng</b> has left. */
+size_t
+crypto_fast_rng_bytes_left(const crypto_fast_rng_t *rng)
+{
+  return rng->bytes_left;
+}
+
+/** Return how many more refills <b>rng</b> will do before it reseeds. */
+int
+crypto_fast_rng_refills_till_reseed(const crypto_fast_rng_t *rng)
+{
+  return rng->n_till_reseed;
+}
+#endif
+
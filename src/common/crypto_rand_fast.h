@@ -0,0 +1,44 @@
+/* Copyright (c) 2016, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file crypto_rand_fast.h
+ * \brief Headers for crypto_rand_fast.c
+ **/
+
+#ifndef TOR_CRYPTO_RAND_FAST_H
+#define TOR_CRYPTO_RAND_FAST_H
+
+#include "torint.h"
+#include "testsupport.h"
+
+typedef struct crypto_fast_rng_t crypto_fast_rng_t;
+
+crypto_fast_rng_t *crypto_fast_rng_new(void);
+void crypto_fast_rng_free(crypto_fast_rng_t *rng);
+void crypto_fast_rng_getbytes(crypto_fast_rng_t *rng, uint8_t *out,
+                              size_t n);
+
+void crypto_fast_rand(char *to, size_t n);
+int crypto_fast_rand_int(unsigned int max);
+uint64_t crypto_fast_rand_uint64(uint64_t max);
+
+int crypto_fast_rng_global_init(void);
+void crypto_fast_rng_thread_cleanup(void);
+void crypto_fast_rng_global_cleanup(void);
+
+#ifdef CRYPTO_RAND_FAST_PRIVATE
+/** How many bytes of output we generate with each key. */
+#define FAST_RNG_BUFLEN 4096
+/** How many keys we derive from each other before we reseed from
+ * crypto_strongest_rand(). */
+#define FAST_RNG_RESEED_AFTER 16
+
+#ifdef TOR_UNIT_TESTS
+size_t crypto_fast_rng_bytes_left(const crypto_fast_rng_t *rng);
+int crypto_fast_rng_refills_till_reseed(const crypto_fast_rng_t *rng);
+#endif
+#endif
+
+#endif
+
@@ -11,6 +11,31 @@
 #include "torlog.h"
 #include "util.h"
 
+/** Return the <b>n</b> (at most 8) bytes at <b>p</b> as a big-endian
+ * integer, padded on the right with zero bytes to 64 bits, so that
+ * comparing two such integers compares the bytes lexically. */
+static inline uint64_t
+load_be64_padded(const uint8_t *p, size_t n)
+{
+  uint64_t w = 0;
+  size_t i;
+  for (i = 0; i < 8; ++i) {
+    w <<= 8;
+    if (i < n)
+      w |= p[i];
+  }
+  return w;
+}
+
+/** Return 1 if <b>x</b> &lt; <b>y</b>, and 0 otherwise, without branching
+ * or using a comparison that the compiler could turn into one.  (This is
+ * the borrow out of x - y; see Hacker's Delight, section 2-12.) */
+static inline uint64_t
+lt_u64_timei(uint64_t x, uint64_t y)
+{
+  return ((~x & y) | (~(x ^ y) & (x - y))) >> 63;
+}
+
 /**
  * Timing-safe version of memcmp.  As memcmp, compare the <b>sz</b> bytes at
  * <b>a</b> with the <b>sz</b> bytes at <b>b</b>, and return less than 0 if
@@ -30,59 +55,31 @@ tor_memcmp(const void *a, const void *b, size_t len)
 #else
   const uint8_t *x = a;
   const uint8_t *y = b;
-  size_t i = len;
+  size_t i;
   int retval = 0;
+  /* ~0 once we have seen a difference, and 0 before. */
+  int decided = 0;
 
-  /* This loop goes from the end of the arrays to the start.  At the
-   * start of every iteration, before we decrement i, we have set
-   * "retval" equal to the result of memcmp(a+i,b+i,len-i).  During the
-   * loop, we update retval by leaving it unchanged if x[i]==y[i] and
-   * setting it to x[i]-y[i] if x[i]!= y[i].
+  /* We compare 8 bytes at a time, as big-endian words, from the start of
+   * the arrays to the end.  Every word is read and compared whatever the
+   * result so far: retval takes the result of the first word that
+   * differs, and "decided" masks out all the later ones.
    *
    * The following assumes we are on a system with two's-complement
    * arithmetic.  We check for this at configure-time with the check
    * that sets USING_TWOS_COMPLEMENT.  If we aren't two's complement, then
    * torint.h will stop compilation with an error.
    */
-  while (i--) {
-    int v1 = x[i];
-    int v2 = y[i];
-    int equal_p = v1 ^ v2;
-
-    /* The following sets bits 8 and above of equal_p to 'equal_p ==
-     * 0', and thus to v1 == v2.  (To see this, note that if v1 ==
-     * v2, then v1^v2 == equal_p == 0, so equal_p-1 == -1, which is the
-     * same as ~0 on a two's-complement machine.  Then note that if
-     * v1 != v2, then 0 < v1 ^ v2 < 256, so 0 <= equal_p - 1 < 255.)
-     */
-    --equal_p;
+  for (i = 0; i < len; i += 8) {
+    const size_t n = MIN(len - i, 8);
+    const uint64_t v1 = load_be64_padded(x + i, n);
+    const uint64_t v2 = load_be64_padded(y + i, n);
+    const int lt = (int) lt_u64_timei(v1, v2);
+    const int gt = (int) lt_u64_timei(v2, v1);
 
-    equal_p >>= 8;
-    /* Thanks to (sign-preserving) arithmetic shift, equal_p is now
-     * equal to -(v1 == v2), which is exactly what we need below.
-     * (Since we're assuming two's-complement arithmetic, -1 is the
-     * same as ~0 (all bits set).)
-     *
-     * (The result of an arithmetic shift on a negative value is
-     * actually implementation-defined in standard C.  So how do we
-     * get away with assuming it?  Easy.  We check.) */
-#if ((-60 >> 8) != -1)
-#error "According to cpp, right-shift doesn't perform sign-extension."
-#endif
-#ifndef RSHIFT_DOES_SIGN_EXTEND
-#error "According to configure, right-shift doesn't perform sign-extension."
-#endif
-
-    /* If v1 == v2, equal_p is ~0, so this will leave retval
-     * unchanged; otherwise, equal_p is 0, so this will zero it. */
-    retval &= equal_p;
-
-    /* If v1 == v2, then this adds 0, and leaves retval unchanged.
-     * Otherwise, we just zeroed retval, so this sets it to v1 - v2. */
-    retval += (v1 - v2);
-
-    /* There.  Now retval is equal to its previous value if v1 == v2, and
-     * equal to v1 - v2 if v1 != v2. */
+    /* gt - lt is 1, 0, or -1, as memcmp would have it. */
+    retval |= (gt - lt) & ~decided;
+    decided |= -(lt | gt);
   }
 
   return retval;
@@ -103,15 +100,20 @@ tor_memeq(const void *a, const void *b, size_t sz)
 {
   /* Treat a and b as byte ranges. */
   const uint8_t *ba = a, *bb = b;
-  uint32_t any_difference = 0;
-  while (sz--) {
-    /* Set byte_diff to all of those bits that are different in *ba and *bb,
-     * and advance both ba and bb. */
-    const uint8_t byte_diff = *ba++ ^ *bb++;
+  uint64_t any_difference = 0;
+  uint32_t folded;
 
-    /* Set bits in any_difference if they are set in byte_diff. */
-    any_difference |= byte_diff;
+  /* Set bits in any_difference wherever the ranges differ, a word at a
+   * time.  The loop has no branches that depend on the data, and is simple
+   * enough that the compiler can vectorize it. */
+  for (; sz >= 8; sz -= 8, ba += 8, bb += 8) {
+    uint64_t wa, wb;
+    memcpy(&wa, ba, 8);
+    memcpy(&wb, bb, 8);
+    any_difference |= wa ^ wb;
   }
+  while (sz--)
+    any_difference |= (uint8_t)(*ba++ ^ *bb++);
 
   /* Now any_difference is 0 if there are no bits different between
    * a and b, and is nonzero if there are bits different between a
@@ -120,22 +122,22 @@ tor_memeq(const void *a, const void *b, size_t sz)
    * (If we say "!any_difference", the compiler might get smart enough
    * to optimize-out our data-independence stuff above.)
    *
-   * To unpack:
+   * To unpack: fold it to 32 bits, keeping it zero iff it was zero.
    *
-   * If any_difference == 0:
-   *            any_difference - 1 == ~0
-   *     (any_difference - 1) >> 8 == 0x00ffffff
-   *     1 & ((any_difference - 1) >> 8) == 1
+   * If folded == 0:
+   *            (uint64_t)folded - 1 == 2^64 - 1
+   *     ((uint64_t)folded - 1) >> 32 == 0xffffffff
+   *     1 & that == 1
    *
-   * If any_difference != 0:
-   *            0 < any_difference < 256, so
-   *            0 <= any_difference - 1 < 255
-   *            (any_difference - 1) >> 8 == 0
-   *            1 & ((any_difference - 1) >> 8) == 0
+   * If folded != 0:
+   *            0 <= (uint64_t)folded - 1 < 2^32 - 1
+   *     ((uint64_t)folded - 1) >> 32 == 0
+   *     1 & that == 0
    */
+  folded = (uint32_t)(any_difference >> 32) | (uint32_t)any_difference;
 
   /*coverity[overflow]*/
-  return 1 & ((any_difference - 1) >> 8);
+  return (int) (1 & (((uint64_t)folded - 1) >> 32));
 }
 
 /* Implement di_digest256_map_t as a linked list of entries. */
@@ -215,15 +217,23 @@ dimap_search(const di_digest256_map_t *map, const uint8_t *key,
 int
 safe_mem_is_zero(const void *mem, size_t sz)
 {
-  uint32_t total = 0;
+  uint64_t total = 0;
+  uint32_t folded;
   const uint8_t *ptr = mem;
 
+  /* As in tor_memeq(), a word at a time. */
+  for (; sz >= 8; sz -= 8, ptr += 8) {
+    uint64_t w;
+    memcpy(&w, ptr, 8);
+    total |= w;
+  }
   while (sz--) {
     total |= *ptr++;
   }
 
+  folded = (uint32_t)(total >> 32) | (uint32_t)total;
   /*coverity[overflow]*/
-  return 1 & ((total - 1) >> 8);
+  return (int) (1 & (((uint64_t)folded - 1) >> 32));
 }
 
 /** Time-invariant 64-bit greater-than; works on two integers in the range
@@ -0,0 +1,279 @@
+/* Copyright (c) 2016, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file handoffqueue.c
+ *
+ * \brief Bounded queues for passing fixed-size items (such as cells) from
+ * other threads to a thread running an event loop.
+ *
+ * A handoff_queue_t is a ring buffer of fixed-size items protected by a
+ * mutex.  Any number of threads may push items onto it; one thread, which
+ * listens for read events on handoff_queue_get_socket(), pops them off.
+ *
+ * The consumer is woken through an alert_sockets_t, the same mechanism the
+ * workqueue reply queues use.  Only a push that finds the queue empty sends
+ * an alert, so a producer that pushes thousands of items in a burst costs
+ * the consumer at most one wakeup.  In return, the consumer must clear the
+ * alert <em>before</em> popping, and must keep popping until the queue is
+ * empty: any item it leaves behind will not generate another alert.
+ *
+ * Since the queue is bounded, handoff_queue_push() may accept fewer items
+ * than it was given.  Producers that can afford to block (worker threads,
+ * never the main thread) may use handoff_queue_push_wait() instead.
+ */
+
+#include "orconfig.h"
+#include "compat.h"
+#include "compat_threads.h"
+#include "handoffqueue.h"
+#include "util.h"
+#include "torlog.h"
+
+/** Largest capacity we'll allow for a handoff queue. */
+#define HANDOFF_QUEUE_MAX_CAPACITY (1<<20)
+
+struct handoff_queue_t {
+  /** Mutex to protect every field below except alert, item_size, and
+   * mask. */
+  tor_mutex_t lock;
+  /** Condition signalled when a full queue gets room. */
+  tor_cond_t not_full;
+  /** Number of producers blocked on not_full. */
+  int n_waiting;
+  /** Storage for (mask+1) items of item_size bytes each. */
+  char *ring;
+  /** Size of each item, in bytes. */
+  size_t item_size;
+  /** Capacity of the ring, minus one.  The capacity is a power of two. */
+  unsigned mask;
+  /** Index of the next item to pop. */
+  unsigned head;
+  /** Number of items currently in the ring. */
+  unsigned n_items;
+  /** Number of times we have woken the consumer. */
+  uint64_t n_alerts;
+  /** Mechanism to wake up the consumer when items arrive. */
+  alert_sockets_t alert;
+};
+
+/** Allocate and return a new handoff queue holding up to <b>capacity</b>
+ * items (rounded up to a power of two) of <b>item_size</b> bytes each.
+ * <b>alertsocks_flags</b> is as for alert_sockets_create().  Return NULL on
+ * failure. */
+handoff_queue_t *
+handoff_queue_new(size_t item_size, int capacity, uint32_t alertsocks_flags)
+{
+  handoff_queue_t *queue;
+  unsigned cap = 1;
+
+  tor_assert(item_size > 0);
+  tor_assert(capacity > 0 && capacity <= HANDOFF_QUEUE_MAX_CAPACITY);
+  while (cap < (unsigned)capacity)
+    cap <<= 1;
+
+  queue = tor_malloc_zero(sizeof(*queue));
+  if (alert_sockets_create(&queue->alert, alertsocks_flags) < 0) {
+    //LCOV_EXCL_START
+    tor_free(queue);
+    return NULL;
+    //LCOV_EXCL_STOP
+  }
+  queue->ring = tor_calloc(cap, item_size);
+  queue->item_size = item_size;
+  queue->mask = cap - 1;
+  tor_mutex_init_for_cond(&queue->lock);
+  tor_cond_init(&queue->not_full);
+  return queue;
+}
+
+/** Release all storage held in <b>queue</b>.  No other thread may be using
+ * the queue. */
+void
+handoff_queue_free(handoff_queue_t *queue)
+{
+  if (!queue)
+    return;
+  alert_sockets_close(&queue->alert);
+  tor_cond_uninit(&queue->not_full);
+  tor_mutex_uninit(&queue->lock);
+  tor_free(queue->ring);
+  tor_free(queue);
+}
+
+/** Return the socket that becomes readable when items are pushed onto an
+ * empty <b>queue</b>. */
+tor_socket_t
+handoff_queue_get_socket(handoff_queue_t *queue)
+{
+  return queue->alert.read_fd;
+}
+
+/** Copy up to <b>n_items</b> items from <b>items</b> into the free space of
+ * <b>queue</b>.  Set *<b>was_empty_out</b> to true iff the queue was empty
+ * and we added something to it.  Return the number of items copied.  The
+ * lock must be held. */
+static int
+handoff_queue_push_locked(handoff_queue_t *queue, const char *items,
+                          int n_items, int *was_empty_out)
+{
+  const unsigned cap = queue->mask + 1;
+  const size_t sz = queue->item_size;
+  unsigned n = cap - queue->n_items, tail, first;
+
+  if ((unsigned)n_items < n)
+    n = n_items;
+  *was_empty_out = (queue->n_items == 0 && n > 0);
+  if (n == 0)
+    return 0;
+
+  /* The free space may wrap around the end of the ring. */
+  tail = (queue->head + queue->n_items) & queue->mask;
+  first = MIN(n, cap - tail);
+  memcpy(queue->ring + tail * sz, items, first * sz);
+  if (n > first)
+    memcpy(queue->ring, items + first * sz, (n - first) * sz);
+  queue->n_items += n;
+  if (*was_empty_out)
+    ++queue->n_alerts;
+  return (int)n;
+}
+
+/** Wake the consumer of <b>queue</b>. */
+static void
+handoff_queue_alert(handoff_queue_t *queue)
+{
+  if (queue->alert.alert_fn(queue->alert.write_fd) < 0) {
+    //LCOV_EXCL_START
+    static ratelim_t warn_limit = RATELIM_INIT(3600);
+    log_fn_ratelim(&warn_limit, LOG_WARN, LD_GENERAL,
+                   "Unable to alert handoff queue consumer: %s",
+                   tor_socket_strerror(tor_socket_errno(
+                                                 queue->alert.write_fd)));
+    //LCOV_EXCL_STOP
+  }
+}
+
+/** Copy as many of the <b>n_items</b> items in <b>items</b> onto
+ * <b>queue</b> as will fit, waking the consumer if the queue was empty.
+ * Return the number of items pushed.  May be called from any thread; never
+ * blocks on the consumer. */
+int
+handoff_queue_push(handoff_queue_t *queue, const void *items, int n_items)
+{
+  int n, was_empty;
+
+  tor_mutex_acquire(&queue->lock);
+  n = handoff_queue_push_locked(queue, items, n_items, &was_empty);
+  tor_mutex_release(&queue->lock);
+
+  if (was_empty)
+    handoff_queue_alert(queue);
+  return n;
+}
+
+/** As handoff_queue_push(), but wait for the consumer to make room until
+ * all <b>n_items</b> items have been pushed.  Must not be called from the
+ * consumer's thread. */
+void
+handoff_queue_push_wait(handoff_queue_t *queue,
+                        const void *items, int n_items)
+{
+  const char *cp = items;
+
+  while (n_items > 0) {
+    int n, was_empty;
+
+    tor_mutex_acquire(&queue->lock);
+    while (queue->n_items == queue->mask + 1) {
+      ++queue->n_waiting;
+      tor_cond_wait(&queue->not_full, &queue->lock, NULL);
+      --queue->n_waiting;
+    }
+    n = handoff_queue_push_locked(queue, cp, n_items, &was_empty);
+    tor_mutex_release(&queue->lock);
+
+    if (was_empty)
+      handoff_queue_alert(queue);
+    cp += n * queue->item_size;
+    n_items -= n;
+  }
+}
+
+/** Acknowledge a wakeup on <b>queue</b>.  The consumer must call this
+ * before popping items in response to a read event on the queue's
+ * socket. */
+void
+handoff_queue_clear_alert(handoff_queue_t *queue)
+{
+  if (queue->alert.drain_fn(queue->alert.read_fd) < 0) {
+    //LCOV_EXCL_START
+    static ratelim_t warn_limit = RATELIM_INIT(7200);
+    log_fn_ratelim(&warn_limit, LOG_WARN, LD_GENERAL,
+                   "Failure from drain_fd: %s",
+                   tor_socket_strerror(tor_socket_errno(
+                                                 queue->alert.read_fd)));
+    //LCOV_EXCL_STOP
+  }
+}
+
+/** Move up to <b>max_items</b> items from the front of <b>queue</b> into
+ * <b>items_out</b>, and return the number moved.  If this returns fewer
+ * than <b>max_items</b>, the queue was empty when it returned and the next
+ * push will wake the consumer again. */
+int
+handoff_queue_pop(handoff_queue_t *queue, void *items_out, int max_items)
+{
+  const unsigned cap = queue->mask + 1;
+  const size_t sz = queue->item_size;
+  char *out = items_out;
+  unsigned n, first;
+
+  tor_assert(max_items >= 0);
+
+  tor_mutex_acquire(&queue->lock);
+  n = MIN((unsigned)max_items, queue->n_items);
+  if (n) {
+    first = MIN(n, cap - queue->head);
+    memcpy(out, queue->ring + queue->head * sz, first * sz);
+    if (n > first)
+      memcpy(out + first * sz, queue->ring, (n - first) * sz);
+    queue->head = (queue->head + n) & queue->mask;
+    queue->n_items -= n;
+    if (queue->n_waiting)
+      tor_cond_signal_all(&queue->not_full);
+  }
+  tor_mutex_release(&queue->lock);
+
+  return (int)n;
+}
+
+/** Return the number of items currently waiting on <b>queue</b>. */
+int
+handoff_queue_get_len(handoff_queue_t *queue)
+{
+  int n;
+  tor_mutex_acquire(&queue->lock);
+  n = (int)queue->n_items;
+  tor_mutex_release(&queue->lock);
+  return n;
+}
+
+/** Return the number of items <b>queue</b> can hold. */
+int
+handoff_queue_get_capacity(const handoff_queue_t *queue)
+{
+  return (int)(queue->mask + 1);
+}
+
+/** Return the number of times <b>queue</b> has woken its consumer. */
+uint64_t
+handoff_queue_get_n_alerts(handoff_queue_t *queue)
+{
+  uint64_t n;
+  tor_mutex_acquire(&queue->lock);
+  n = queue->n_alerts;
+  tor_mutex_release(&queue->lock);
+  return n;
+}
+
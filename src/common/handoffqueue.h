@@ -0,0 +1,33 @@
+/* Copyright (c) 2016, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file handoffqueue.h
+ * \brief Header file for handoffqueue.c.
+ **/
+
+#ifndef TOR_HANDOFFQUEUE_H
+#define TOR_HANDOFFQUEUE_H
+
+#include "compat.h"
+
+/** A bounded queue of fixed-size items, passed from any number of producer
+ * threads to one consumer that runs an event loop. */
+typedef struct handoff_queue_t handoff_queue_t;
+
+handoff_queue_t *handoff_queue_new(size_t item_size, int capacity,
+                                   uint32_t alertsocks_flags);
+void handoff_queue_free(handoff_queue_t *queue);
+tor_socket_t handoff_queue_get_socket(handoff_queue_t *queue);
+int handoff_queue_push(handoff_queue_t *queue,
+                       const void *items, int n_items);
+void handoff_queue_push_wait(handoff_queue_t *queue,
+                             const void *items, int n_items);
+void handoff_queue_clear_alert(handoff_queue_t *queue);
+int handoff_queue_pop(handoff_queue_t *queue, void *items_out, int max_items);
+int handoff_queue_get_len(handoff_queue_t *queue);
+int handoff_queue_get_capacity(const handoff_queue_t *queue);
+uint64_t handoff_queue_get_n_alerts(handoff_queue_t *queue);
+
+#endif
+
@@ -0,0 +1,214 @@
+/* Copyright (c) 2016, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file latency_trace.c
+ *
+ * \brief Histograms of how long our hot-path event handlers take.
+ *
+ * Each trace point wraps a handler in LATENCY_TRACE_START() and
+ * LATENCY_TRACE_END(), which read the monotonic clock on the way in and on
+ * the way out, and add the difference to a log-scale histogram here.  That
+ * costs two clock reads and a handful of increments per call; building
+ * with --disable-latency-tracing removes even that.
+ *
+ * The histograms are exposed through the "latency/histograms" GETINFO key
+ * and summarized in the heartbeat.  All the trace points run in the main
+ * thread, so nothing here is locked.
+ */
+
+#include "orconfig.h"
+#include "latency_trace.h"
+#include "container.h"
+#include "torlog.h"
+#include "util.h"
+
+/** One histogram per trace point. */
+static latency_hist_t latency_hists[LT_N_POINTS];
+
+/** Names of the trace points, as used in GETINFO and the heartbeat. */
+static const char *latency_point_names[LT_N_POINTS] = {
+  "conn-read",
+  "conn-write",
+  "process-cell",
+  "relay-cell",
+  "scheduler",
+  "replyqueue",
+};
+
+/** Return the name of trace point <b>pt</b>. */
+const char *
+latency_trace_point_name(latency_trace_point_t pt)
+{
+  tor_assert((int)pt >= 0 && pt < LT_N_POINTS);
+  return latency_point_names[pt];
+}
+
+/** Return the histogram bucket for a call that took <b>nsec</b>
+ * nanoseconds. */
+static inline int
+latency_bucket_for_nsec(uint64_t nsec)
+{
+  uint64_t usec = nsec / 1000;
+  int b;
+  if (!usec)
+    return 0;
+  b = tor_log2(usec) + 1;
+  return MIN(b, LATENCY_HIST_N_BUCKETS - 1);
+}
+
+/** Add a duration of <b>nsec</b> nanoseconds to <b>hist</b>. */
+void
+latency_hist_add(latency_hist_t *hist, uint64_t nsec)
+{
+  ++hist->buckets[latency_bucket_for_nsec(nsec)];
+  ++hist->n;
+  hist->total_nsec += nsec;
+  if (nsec > hist->max_nsec)
+    hist->max_nsec = nsec;
+}
+
+/** Add everything recorded in <b>src</b> to <b>dst</b>. */
+void
+latency_hist_merge(latency_hist_t *dst, const latency_hist_t *src)
+{
+  int i;
+  for (i = 0; i < LATENCY_HIST_N_BUCKETS; ++i)
+    dst->buckets[i] += src->buckets[i];
+  dst->n += src->n;
+  dst->total_nsec += src->total_nsec;
+  if (src->max_nsec > dst->max_nsec)
+    dst->max_nsec = src->max_nsec;
+}
+
+/** Return a newly allocated string listing the bucket counts of
+ * <b>hist</b>, separated by commas. */
+char *
+latency_hist_format_buckets(const latency_hist_t *hist)
+{
+  smartlist_t *sl = smartlist_new();
+  char *result;
+  int i;
+  for (i = 0; i < LATENCY_HIST_N_BUCKETS; ++i)
+    smartlist_add_asprintf(sl, U64_FORMAT, U64_PRINTF_ARG(hist->buckets[i]));
+  result = smartlist_join_strings(sl, ",", 0, NULL);
+  SMARTLIST_FOREACH(sl, char *, cp, tor_free(cp));
+  smartlist_free(sl);
+  return result;
+}
+
+/** Record that a call at trace point <b>pt</b> took <b>nsec</b>
+ * nanoseconds. */
+void
+latency_trace_record(latency_trace_point_t pt, uint64_t nsec)
+{
+  latency_hist_add(&latency_hists[pt], nsec);
+}
+
+/** Record the time elapsed since <b>start</b> at trace point <b>pt</b>.
+ * Used by LATENCY_TRACE_END(). */
+void
+latency_trace_end(const monotime_t *start, latency_trace_point_t pt)
+{
+  monotime_t now;
+  int64_t nsec;
+  monotime_get(&now);
+  nsec = monotime_diff_nsec(start, &now);
+  latency_trace_record(pt, nsec > 0 ? (uint64_t)nsec : 0);
+}
+
+/** Return the histogram for trace point <b>pt</b>. */
+const latency_hist_t *
+latency_trace_get_hist(latency_trace_point_t pt)
+{
+  tor_assert((int)pt >= 0 && pt < LT_N_POINTS);
+  return &latency_hists[pt];
+}
+
+/** Return an upper bound, in microseconds, on the duration of the
+ * fastest <b>frac</b> of the calls recorded in <b>hist</b>.  Return 0 if
+ * nothing has been recorded. */
+uint64_t
+latency_hist_percentile_usec(const latency_hist_t *hist, double frac)
+{
+  uint64_t target, seen = 0;
+  int i;
+  if (!hist->n)
+    return 0;
+  /* Round up: the median of 5 calls is the 3rd fastest. */
+  target = (uint64_t)(frac * U64_TO_DBL(hist->n));
+  if (U64_TO_DBL(target) < frac * U64_TO_DBL(hist->n) || target < 1)
+    ++target;
+  for (i = 0; i < LATENCY_HIST_N_BUCKETS - 1; ++i) {
+    seen += hist->buckets[i];
+    if (seen >= target)
+      return U64_LITERAL(1) << i;
+  }
+  /* The last bucket has no upper bound but the largest value we saw. */
+  return hist->max_nsec / 1000;
+}
+
+/** Return a newly allocated string describing every trace point's
+ * histogram, one line per point, in the format used by the
+ * "latency/histograms" GETINFO key. */
+char *
+latency_trace_format(void)
+{
+  smartlist_t *lines = smartlist_new();
+  char *result;
+  int pt;
+
+  for (pt = 0; pt < LT_N_POINTS; ++pt) {
+    const latency_hist_t *h = &latency_hists[pt];
+    char *bucket_str = latency_hist_format_buckets(h);
+    smartlist_add_asprintf(lines,
+                           "%s count="U64_FORMAT" mean-usec="U64_FORMAT
+                           " p50-usec="U64_FORMAT" p99-usec="U64_FORMAT
+                           " max-usec="U64_FORMAT" buckets=%s",
+                           latency_point_names[pt],
+                           U64_PRINTF_ARG(h->n),
+                           U64_PRINTF_ARG(h->n ?
+                                          h->total_nsec / h->n / 1000 : 0),
+                           U64_PRINTF_ARG(
+                                      latency_hist_percentile_usec(h, .5)),
+                           U64_PRINTF_ARG(
+                                      latency_hist_percentile_usec(h, .99)),
+                           U64_PRINTF_ARG(h->max_nsec / 1000),
+                           bucket_str);
+    tor_free(bucket_str);
+  }
+
+  result = smartlist_join_strings(lines, "\n", 0, NULL);
+  SMARTLIST_FOREACH(lines, char *, cp, tor_free(cp));
+  smartlist_free(lines);
+  return result;
+}
+
+/** Log a one-line summary of each trace point that has recorded any calls,
+ * at severity <b>severity</b>. */
+void
+latency_trace_log(int severity)
+{
+  int pt;
+  for (pt = 0; pt < LT_N_POINTS; ++pt) {
+    const latency_hist_t *h = &latency_hists[pt];
+    if (!h->n)
+      continue;
+    tor_log(severity, LD_HEARTBEAT,
+            "Heartbeat: %s handler ran "U64_FORMAT" times: median under "
+            U64_FORMAT" usec, 99th percentile under "U64_FORMAT" usec, "
+            "slowest "U64_FORMAT" usec.",
+            latency_point_names[pt], U64_PRINTF_ARG(h->n),
+            U64_PRINTF_ARG(latency_hist_percentile_usec(h, .5)),
+            U64_PRINTF_ARG(latency_hist_percentile_usec(h, .99)),
+            U64_PRINTF_ARG(h->max_nsec / 1000));
+  }
+}
+
+/** Forget everything we've recorded. */
+void
+latency_trace_reset(void)
+{
+  memset(latency_hists, 0, sizeof(latency_hists));
+}
+
@@ -0,0 +1,72 @@
+/* Copyright (c) 2016, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file latency_trace.h
+ * \brief Header file for latency_trace.c.
+ **/
+
+#ifndef TOR_LATENCY_TRACE_H
+#define TOR_LATENCY_TRACE_H
+
+#include "compat.h"
+#include "compat_time.h"
+
+/** The places in our event-handling code where we measure how long each
+ * call takes. */
+typedef enum latency_trace_point_t {
+  LT_CONN_READ = 0,
+  LT_CONN_WRITE,
+  LT_PROCESS_CELL,
+  LT_RELAY_CELL,
+  LT_SCHEDULER,
+  LT_REPLYQUEUE,
+} latency_trace_point_t;
+#define LT_N_POINTS (LT_REPLYQUEUE + 1)
+
+/** Number of buckets in a latency histogram.  Bucket 0 counts calls that
+ * took under 1 usec; bucket i > 0 counts calls that took at least
+ * 2^(i-1) and under 2^i usec, except that the last bucket also counts
+ * everything slower. */
+#define LATENCY_HIST_N_BUCKETS 24
+
+/** A log-scale histogram of how long the calls at one trace point took. */
+typedef struct latency_hist_t {
+  uint64_t buckets[LATENCY_HIST_N_BUCKETS];
+  /** Number of calls recorded. */
+  uint64_t n;
+  /** Sum and maximum of the recorded durations, in nanoseconds. */
+  uint64_t total_nsec;
+  uint64_t max_nsec;
+} latency_hist_t;
+
+void latency_hist_add(latency_hist_t *hist, uint64_t nsec);
+void latency_hist_merge(latency_hist_t *dst, const latency_hist_t *src);
+char *latency_hist_format_buckets(const latency_hist_t *hist);
+
+void latency_trace_record(latency_trace_point_t pt, uint64_t nsec);
+void latency_trace_end(const monotime_t *start, latency_trace_point_t pt);
+const latency_hist_t *latency_trace_get_hist(latency_trace_point_t pt);
+const char *latency_trace_point_name(latency_trace_point_t pt);
+uint64_t latency_hist_percentile_usec(const latency_hist_t *hist,
+                                      double frac);
+char *latency_trace_format(void);
+void latency_trace_log(int severity);
+void latency_trace_reset(void);
+
+#ifdef ENABLE_LATENCY_TRACING
+/** Note the time at which a traced section starts, in a new variable
+ * <b>var</b>. */
+#define LATENCY_TRACE_START(var) \
+  monotime_t var;                \
+  monotime_get(&var)
+/** Record the time since LATENCY_TRACE_START(<b>var</b>) at trace point
+ * <b>pt</b>. */
+#define LATENCY_TRACE_END(var, pt) latency_trace_end(&(var), (pt))
+#else
+#define LATENCY_TRACE_START(var) STMT_NIL
+#define LATENCY_TRACE_END(var, pt) STMT_NIL
+#endif
+
+#endif
+
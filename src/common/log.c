@@ -61,9 +61,14 @@ typedef struct logfile_t {
   log_callback callback; /**< If not NULL, send messages to this function. */
   log_severity_list_t *severities; /**< Which severity of messages should we
                                     * log for each log domain? */
+  /** Number of messages for this log that we have dropped because the
+   * asynchronous log buffer was full, and not yet reported. */
+  unsigned n_async_dropped;
 } logfile_t;
 
 static void log_free(logfile_t *victim);
+static int log_async_enqueue(logfile_t *lf, const char *msg, size_t msg_len);
+static void log_async_flush(void);
 
 /** Helper: map a log severity to descriptive string. */
 static inline const char *
@@ -149,6 +154,47 @@ static int pretty_fn_has_parens = 0;
  * logs to get configured. */
 #define MAX_STARTUP_MSG_LEN (1<<16)
 
+/** Size of each of the two buffers used by the asynchronous log writer. */
+#define LOG_ASYNC_BUF_LEN (1<<20)
+
+/** Header for each message in an asynchronous log buffer; it is followed
+ * by <b>len</b> bytes of message to write to <b>fd</b>. */
+typedef struct log_async_record_t {
+  int fd;
+  uint32_t len;
+} log_async_record_t;
+
+/** True iff file and stream logs are handed to the writer thread rather
+ * than written by the logging thread. Protected by log_mutex. */
+static int log_async_enabled = 0;
+/** True iff we have registered log_async_atexit(). */
+static int log_async_atexit_registered = 0;
+/** Lock protecting the rest of the log_async_* state below, which is
+ * shared with the writer thread. Never take log_mutex while holding it. */
+static tor_mutex_t log_async_mutex;
+/** Signalled when there is data to write, or the writer should exit. */
+static tor_cond_t log_async_work_cond;
+/** Signalled when the writer has taken a batch, finished a batch, or
+ * exited. */
+static tor_cond_t log_async_done_cond;
+/** True iff the writer thread is running. */
+static int log_async_running = 0;
+/** True iff we have asked the writer thread to exit. */
+static int log_async_stopping = 0;
+/** True iff the writer thread is currently writing a batch. */
+static int log_async_writing = 0;
+/** If true, drop messages when the buffer is full; otherwise wait for the
+ * writer to catch up. */
+static int log_async_drop_when_full = 0;
+/** Buffer of log_async_record_t entries that producers append to. */
+static char *log_async_buf = NULL;
+/** Number of bytes used in log_async_buf. */
+static size_t log_async_buf_len = 0;
+/** The other buffer, or NULL while the writer thread is writing it. */
+static char *log_async_spare = NULL;
+/** An fd that the writer thread failed to write to, or -1. */
+static int log_async_failed_fd = -1;
+
 /** Lock the log_mutex to prevent others from changing the logfile_t list */
 #define LOCK_LOGS() STMT_BEGIN                                          \
   tor_assert(log_mutex_initialized);                                    \
@@ -164,6 +210,36 @@ static int pretty_fn_has_parens = 0;
  * bail out early from log_debug if we aren't debugging.  */
 int log_global_min_severity_ = LOG_NOTICE;
 
+/** For each severity no more verbose than log_global_min_severity_, the
+ * union of the domains that any log wants at that severity.  Checking this
+ * lets us bail out early, before formatting, from messages in domains that
+ * nobody is logging.  More verbose severities are left as "every domain",
+ * since log_global_min_severity_ already filters them. */
+log_domain_mask_t log_global_domain_masks_[LOG_DEBUG-LOG_ERR+1] = {
+  ~0u, ~0u, ~0u, ~0u, ~0u
+};
+
+/** Recompute log_global_min_severity_ and log_global_domain_masks_ from
+ * the current list of logs.  Caller must hold log_mutex. */
+static void
+update_log_global_filter(void)
+{
+  logfile_t *lf;
+  int i;
+  log_global_min_severity_ = get_min_log_level();
+  for (i = LOG_ERR; i <= LOG_DEBUG; ++i) {
+    log_domain_mask_t mask = 0;
+    if (queue_startup_messages || i > log_global_min_severity_) {
+      /* Everything might be wanted by a log we haven't opened yet. */
+      mask = ~0u;
+    } else {
+      for (lf = logfiles; lf; lf = lf->next)
+        mask |= lf->severities->masks[SEVERITY_MASK_IDX(i)];
+    }
+    log_global_domain_masks_[SEVERITY_MASK_IDX(i)] = mask;
+  }
+}
+
 static void delete_log(logfile_t *victim);
 static void close_log(logfile_t *victim);
 
@@ -202,6 +278,12 @@ set_log_time_granularity(int granularity_msec)
   log_time_granularity = granularity_msec;
 }
 
+/** The last second for which log_prefix_() formatted a timestamp, and
+ * what it got.  Protected by log_mutex. */
+static time_t log_prefix_cached_t = -1;
+static char log_prefix_cached_buf[32];
+static size_t log_prefix_cached_len = 0;
+
 /** Helper: Write the standard prefix for log lines to a
  * <b>buf_len</b> character buffer in <b>buf</b>.
  */
@@ -224,7 +306,16 @@ log_prefix_(char *buf, size_t buf_len, int severity)
     ms -= ((int)now.tv_usec / 1000) % log_time_granularity;
   }
 
-  n = strftime(buf, buf_len, "%b %d %H:%M:%S", tor_localtime_r(&t, &tm));
+  if (t != log_prefix_cached_t) {
+    log_prefix_cached_len = strftime(log_prefix_cached_buf,
+                                     sizeof(log_prefix_cached_buf),
+                                     "%b %d %H:%M:%S",
+                                     tor_localtime_r(&t, &tm));
+    log_prefix_cached_t = log_prefix_cached_len ? t : -1;
+  }
+  n = MIN(log_prefix_cached_len, buf_len-1);
+  memcpy(buf, log_prefix_cached_buf, n);
+  buf[n] = '\0';
   r = tor_snprintf(buf+n, buf_len-n, ".%.3i [%s] ", ms,
                    sev_to_string(severity));
 
@@ -416,6 +507,126 @@ logfile_wants_message(const logfile_t *lf, int severity,
   return 1;
 }
 
+/** Main function for the asynchronous log writer thread: repeatedly take
+ * the filled buffer and write out every message in it, until we are asked
+ * to stop and have nothing left to write. */
+static void
+log_async_writer_main(void *arg)
+{
+  (void) arg;
+  tor_mutex_acquire(&log_async_mutex);
+  for (;;) {
+    char *batch;
+    size_t batch_len, off = 0;
+    int failed_fd = -1;
+    while (log_async_buf_len == 0 && !log_async_stopping)
+      tor_cond_wait(&log_async_work_cond, &log_async_mutex, NULL);
+    if (log_async_buf_len == 0)
+      break;
+
+    batch = log_async_buf;
+    batch_len = log_async_buf_len;
+    log_async_buf = log_async_spare;
+    log_async_buf_len = 0;
+    log_async_spare = NULL;
+    log_async_writing = 1;
+    tor_cond_signal_all(&log_async_done_cond);
+    tor_mutex_release(&log_async_mutex);
+
+    while (off < batch_len) {
+      log_async_record_t rec;
+      memcpy(&rec, batch + off, sizeof(rec));
+      off += sizeof(rec);
+      /* We can't log the error; let the next producer mark the log dead. */
+      if (write_all(rec.fd, batch + off, rec.len, 0) < 0)
+        failed_fd = rec.fd;
+      off += rec.len;
+    }
+
+    tor_mutex_acquire(&log_async_mutex);
+    log_async_spare = batch;
+    log_async_writing = 0;
+    if (failed_fd >= 0)
+      log_async_failed_fd = failed_fd;
+    tor_cond_signal_all(&log_async_done_cond);
+  }
+  log_async_running = 0;
+  tor_cond_signal_all(&log_async_done_cond);
+  tor_mutex_release(&log_async_mutex);
+  spawn_exit();
+}
+
+/** Queue the <b>msg_len</b>-byte message in <b>msg</b> for the writer
+ * thread to write to <b>lf</b>. If the buffer is full, drop the message or
+ * wait for room, depending on our policy. Return -1 if an earlier write to
+ * <b>lf</b> failed, and 0 otherwise. */
+static int
+log_async_enqueue(logfile_t *lf, const char *msg, size_t msg_len)
+{
+  log_async_record_t rec;
+  char note[64];
+  size_t note_len = 0;
+
+  tor_mutex_acquire(&log_async_mutex);
+  if (log_async_failed_fd == lf->fd) {
+    log_async_failed_fd = -1;
+    tor_mutex_release(&log_async_mutex);
+    return -1;
+  }
+  if (lf->n_async_dropped) {
+    tor_snprintf(note, sizeof(note),
+                 "[%u log messages dropped: log buffer was full]\n",
+                 lf->n_async_dropped);
+    note_len = strlen(note);
+  }
+  while (log_async_buf_len + sizeof(rec) + note_len + msg_len >
+         LOG_ASYNC_BUF_LEN) {
+    if (log_async_drop_when_full) {
+      ++lf->n_async_dropped;
+      tor_mutex_release(&log_async_mutex);
+      return 0;
+    }
+    tor_cond_wait(&log_async_done_cond, &log_async_mutex, NULL);
+  }
+  rec.fd = lf->fd;
+  rec.len = (uint32_t)(note_len + msg_len);
+  memcpy(log_async_buf + log_async_buf_len, &rec, sizeof(rec));
+  log_async_buf_len += sizeof(rec);
+  if (note_len) {
+    memcpy(log_async_buf + log_async_buf_len, note, note_len);
+    log_async_buf_len += note_len;
+    lf->n_async_dropped = 0;
+  }
+  memcpy(log_async_buf + log_async_buf_len, msg, msg_len);
+  log_async_buf_len += msg_len;
+  tor_cond_signal_one(&log_async_work_cond);
+  tor_mutex_release(&log_async_mutex);
+  return 0;
+}
+
+/** Block until the asynchronous log writer, if any, has written every
+ * message queued so far. */
+static void
+log_async_flush(void)
+{
+  if (!log_mutex_initialized)
+    return;
+  tor_mutex_acquire(&log_async_mutex);
+  while (log_async_running && (log_async_buf_len || log_async_writing)) {
+    tor_cond_signal_one(&log_async_work_cond);
+    tor_cond_wait(&log_async_done_cond, &log_async_mutex, NULL);
+  }
+  tor_mutex_release(&log_async_mutex);
+}
+
+/** Helper for atexit(): make sure that queued messages reach the disk when
+ * we exit without calling logs_free_all(). */
+static void
+log_async_atexit(void)
+{
+  log_async_flush();
+}
+
 /** Send a message to <b>lf</b>.  The full message, with time prefix and
  * severity, is in <b>buf</b>.  The message itself is in
  * <b>msg_after_prefix</b>.  If <b>callbacks_deferred</b> points to true, then
@@ -459,7 +670,15 @@ logfile_deliver(logfile_t *lf, const char *buf, size_t msg_len,
     } else {
       lf->callback(severity, domain, msg_after_prefix);
     }
+  } else if (log_async_enabled && severity != LOG_ERR) {
+    if (log_async_enqueue(lf, buf, msg_len) < 0) {
+      lf->seems_dead = 1;
+    }
   } else {
+    /* Errors are written synchronously, after anything already queued,
+     * so that they are on disk if we are about to crash. */
+    if (log_async_enabled)
+      log_async_flush();
     if (write_all(lf->fd, buf, msg_len, 0) < 0) { /* error */
       /* don't log the error! mark this log entry to be blown away, and
        * continue. */
@@ -533,7 +752,7 @@ void
 tor_log(int severity, log_domain_mask_t domain, const char *format, ...)
 {
   va_list ap;
-  if (severity > log_global_min_severity_)
+  if (!log_global_wants_(severity, domain))
     return;
   va_start(ap,format);
 #ifdef TOR_UNIT_TESTS
@@ -696,7 +915,7 @@ log_fn_(int severity, log_domain_mask_t domain, const char *fn,
         const char *format, ...)
 {
   va_list ap;
-  if (severity > log_global_min_severity_)
+  if (!log_global_wants_(severity, domain))
     return;
   va_start(ap,format);
   logv(severity, domain, fn, NULL, format, ap);
@@ -708,7 +927,7 @@ log_fn_ratelim_(ratelim_t *ratelim, int severity, log_domain_mask_t domain,
 {
   va_list ap;
   char *m;
-  if (severity > log_global_min_severity_)
+  if (!log_global_wants_(severity, domain))
     return;
   m = rate_limit_log(ratelim, approx_time());
   if (m == NULL)
@@ -736,6 +955,7 @@ logs_free_all(void)
 {
   logfile_t *victim, *next;
   smartlist_t *messages, *messages2;
+  logs_set_async(0, 0);
   LOCK_LOGS();
   next = logfiles;
   logfiles = NULL;
@@ -798,6 +1018,7 @@ delete_log(logfile_t *victim)
 static void
 close_log(logfile_t *victim)
 {
+  log_async_flush();
   if (victim->needs_close && victim->fd >= 0) {
     close(victim->fd);
     victim->fd = -1;
@@ -842,7 +1063,7 @@ add_stream_log_impl(const log_severity_list_t *severity,
   lf->next = logfiles;
 
   logfiles = lf;
-  log_global_min_severity_ = get_min_log_level();
+  update_log_global_filter();
 }
 
 /** Add a log handler named <b>name</b> to send all messages in <b>severity</b>
@@ -862,6 +1083,9 @@ init_logging(int disable_startup_queue)
 {
   if (!log_mutex_initialized) {
     tor_mutex_init(&log_mutex);
+    tor_mutex_init(&log_async_mutex);
+    tor_cond_init(&log_async_work_cond);
+    tor_cond_init(&log_async_done_cond);
     log_mutex_initialized = 1;
   }
 #ifdef __GNUC__
@@ -888,6 +1112,52 @@ logs_set_domain_logging(int enabled)
   UNLOCK_LOGS();
 }
 
+/** If <b>enabled</b>, hand messages for file and stream logs to a writer
+ * thread, so that logging never blocks on disk I/O; otherwise, flush any
+ * queued messages, stop the writer thread, and write messages directly.
+ * When the writer falls behind, drop messages if <b>drop_when_full</b> is
+ * set, and otherwise wait for it. Messages at LOG_ERR are always written
+ * directly. Return 0 on success, -1 if we couldn't start the thread. */
+int
+logs_set_async(int enabled, int drop_when_full)
+{
+  int r = 0;
+  LOCK_LOGS();
+  tor_mutex_acquire(&log_async_mutex);
+  log_async_drop_when_full = drop_when_full;
+  if (enabled && !log_async_running) {
+    log_async_buf = tor_malloc(LOG_ASYNC_BUF_LEN);
+    log_async_spare = tor_malloc(LOG_ASYNC_BUF_LEN);
+    log_async_buf_len = 0;
+    log_async_stopping = 0;
+    log_async_failed_fd = -1;
+    if (spawn_func(log_async_writer_main, NULL) < 0) {
+      tor_free(log_async_buf);
+      tor_free(log_async_spare);
+      r = -1;
+    } else {
+      log_async_running = 1;
+      log_async_enabled = 1;
+      if (!log_async_atexit_registered) {
+        atexit(log_async_atexit);
+        log_async_atexit_registered = 1;
+      }
+    }
+  } else if (!enabled && log_async_running) {
+    log_async_enabled = 0;
+    log_async_stopping = 1;
+    tor_cond_signal_one(&log_async_work_cond);
+    while (log_async_running)
+      tor_cond_wait(&log_async_done_cond, &log_async_mutex, NULL);
+    tor_free(log_async_buf);
+    tor_free(log_async_spare);
+    log_async_buf_len = 0;
+  }
+  tor_mutex_release(&log_async_mutex);
+  UNLOCK_LOGS();
+  return r;
+}
+
 /** Add a log handler to receive messages during startup (before the real
  * logs are initialized).
  */
@@ -920,7 +1190,7 @@ add_callback_log(const log_severity_list_t *severity, log_callback cb)
 
   LOCK_LOGS();
   logfiles = lf;
-  log_global_min_severity_ = get_min_log_level();
+  update_log_global_filter();
   UNLOCK_LOGS();
   return 0;
 }
@@ -940,7 +1210,7 @@ change_callback_log_severity(int loglevelMin, int loglevelMax,
       memcpy(lf->severities, &severities, sizeof(severities));
     }
   }
-  log_global_min_severity_ = get_min_log_level();
+  update_log_global_filter();
   UNLOCK_LOGS();
 }
 
@@ -996,6 +1266,7 @@ flush_log_messages_from_startup(void)
   LOCK_LOGS();
   queue_startup_messages = 0;
   pending_startup_messages_len = 0;
+  update_log_global_filter();
   if (! pending_startup_messages)
     goto out;
 
@@ -1044,7 +1315,7 @@ close_temp_logs(void)
     }
   }
 
-  log_global_min_severity_ = get_min_log_level();
+  update_log_global_filter();
   UNLOCK_LOGS();
 }
 
@@ -1098,7 +1369,7 @@ add_file_log(const log_severity_list_t *severity, const char *filename,
   add_stream_log_impl(severity, filename, fd);
   logfiles->needs_close = 1;
   lf = logfiles;
-  log_global_min_severity_ = get_min_log_level();
+  update_log_global_filter();
 
   if (log_tor_version(lf, 0) < 0) {
     delete_log(lf);
@@ -1140,7 +1411,7 @@ add_syslog_log(const log_severity_list_t *severity,
   LOCK_LOGS();
   lf->next = logfiles;
   logfiles = lf;
-  log_global_min_severity_ = get_min_log_level();
+  update_log_global_filter();
   UNLOCK_LOGS();
   return 0;
 }
@@ -1377,7 +1648,7 @@ switch_logs_debug(void)
     for (i = LOG_DEBUG; i >= LOG_ERR; --i)
       lf->severities->masks[SEVERITY_MASK_IDX(i)] = ~0u;
   }
-  log_global_min_severity_ = get_min_log_level();
+  update_log_global_filter();
   UNLOCK_LOGS();
 }
 
@@ -1386,6 +1657,7 @@ void
 truncate_logs(void)
 {
   logfile_t *lf;
+  log_async_flush();
   for (lf = logfiles; lf; lf = lf->next) {
     if (lf->fd >= 0) {
       tor_ftruncate(lf->fd);
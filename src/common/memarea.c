@@ -12,6 +12,7 @@
 #include "util.h"
 #include "compat.h"
 #include "torlog.h"
+#include "compat_threads.h"
 
 /** If true, we try to detect any attempts to write beyond the length of a
  * memarea. */
@@ -109,6 +110,50 @@ struct memarea_t {
   memarea_chunk_t *first; /**< Top of the chunk stack: never NULL. */
 };
 
+/** How many CHUNK_SIZE chunks will we keep around for reuse in each
+ * thread? */
+#define MAX_FREELIST_LEN 16
+
+/** A thread's list of unused CHUNK_SIZE chunks, so that parsing one document
+ * after another doesn't need to go back to the allocator for every one.
+ * Each thread has its own list, since we parse on worker threads too. */
+typedef struct memarea_freelist_t {
+  memarea_chunk_t *first; /**< Chunks linked by their next_chunk field. */
+  int len; /**< How many chunks are in the list? */
+} memarea_freelist_t;
+
+/** Points to each thread's memarea_freelist_t. */
+static tor_threadlocal_t freelist_key;
+/** True iff we have initialized freelist_key, and may use freelists. */
+static int freelists_enabled = 0;
+
+/** Start keeping freelists of memarea chunks.  Call this once, before
+ * starting any threads. */
+void
+memarea_init_freelists(void)
+{
+  if (freelists_enabled)
+    return;
+  if (tor_threadlocal_init(&freelist_key) == 0)
+    freelists_enabled = 1;
+}
+
+/** Return the calling thread's freelist, creating it if <b>create</b> is
+ * true.  Return NULL if there is none. */
+static memarea_freelist_t *
+get_freelist(int create)
+{
+  memarea_freelist_t *fl;
+  if (!freelists_enabled)
+    return NULL;
+  fl = tor_threadlocal_get(&freelist_key);
+  if (PREDICT_UNLIKELY(fl == NULL) && create) {
+    fl = tor_malloc_zero(sizeof(memarea_freelist_t));
+    tor_threadlocal_set(&freelist_key, fl);
+  }
+  return fl;
+}
+
 /** Helper: allocate a new memarea chunk of around <b>chunk_size</b> bytes. */
 static memarea_chunk_t *
 alloc_chunk(size_t sz)
@@ -117,6 +162,17 @@ alloc_chunk(size_t sz)
 
   size_t chunk_size = sz < CHUNK_SIZE ? CHUNK_SIZE : sz;
   memarea_chunk_t *res;
+  if (chunk_size == CHUNK_SIZE) {
+    memarea_freelist_t *fl = get_freelist(0);
+    if (fl && fl->first) {
+      res = fl->first;
+      fl->first = res->next_chunk;
+      --fl->len;
+      res->next_chunk = NULL;
+      res->next_mem = res->U_MEM;
+      return res;
+    }
+  }
   chunk_size += SENTINEL_LEN;
   res = tor_malloc(chunk_size);
   res->next_chunk = NULL;
@@ -129,14 +185,48 @@ alloc_chunk(size_t sz)
   return res;
 }
 
-/** Release <b>chunk</b> from a memarea. */
+/** Release <b>chunk</b> from a memarea.  If it is a CHUNK_SIZE chunk and
+ * this thread's freelist has room, keep it there for reuse. */
 static void
 memarea_chunk_free_unchecked(memarea_chunk_t *chunk)
 {
   CHECK_SENTINEL(chunk);
+  if (chunk->mem_size == CHUNK_SIZE - CHUNK_HEADER_SIZE) {
+    memarea_freelist_t *fl = get_freelist(1);
+    if (fl && fl->len < MAX_FREELIST_LEN) {
+      chunk->next_chunk = fl->first;
+      fl->first = chunk;
+      ++fl->len;
+      return;
+    }
+  }
   tor_free(chunk);
 }
 
+/** Release all the chunks held in the calling thread's freelist. */
+void
+memarea_clear_freelist(void)
+{
+  memarea_freelist_t *fl = get_freelist(0);
+  memarea_chunk_t *chunk, *next;
+  if (!fl)
+    return;
+  for (chunk = fl->first; chunk; chunk = next) {
+    next = chunk->next_chunk;
+    tor_free(chunk);
+  }
+  tor_threadlocal_set(&freelist_key, NULL);
+  tor_free(fl);
+}
+
+/** Return the number of bytes held in the calling thread's freelist. */
+size_t
+memarea_get_freelist_size(void)
+{
+  memarea_freelist_t *fl = get_freelist(0);
+  return fl ? (size_t)fl->len * (CHUNK_SIZE + SENTINEL_LEN) : 0;
+}
+
 /** Allocate and return new memarea. */
 memarea_t *
 memarea_new(void)
@@ -4,13 +4,38 @@
 /**
  * \file pubsub.c
  *
- * \brief DOCDOC
+ * \brief Generic code for the publish/subscribe topics declared with the
+ * macros in pubsub.h.
  */
 
 #include "orconfig.h"
 #include "pubsub.h"
 #include "container.h"
 
+/** Topics that have a deferred notification waiting for
+ * pubsub_flush_deferred(), in the order they were first notified.  NULL
+ * when empty. */
+static smartlist_t *deferred_topics = NULL;
+
+/** Function to call when a deferred notification is first pending, so
+ * that pubsub_flush_deferred() gets called soon. */
+static void (*deferred_scheduler)(void) = NULL;
+/** True iff we have called deferred_scheduler, and pubsub_flush_deferred()
+ * hasn't run since. */
+static int deferred_flush_scheduled = 0;
+
+/** Helper: if there are deferred notifications pending, and we haven't yet
+ * asked for them to be flushed, do so. */
+static void
+pubsub_schedule_flush(void)
+{
+  if (deferred_flush_scheduled || !deferred_scheduler ||
+      !deferred_topics || smartlist_len(deferred_topics) == 0)
+    return;
+  deferred_flush_scheduled = 1;
+  deferred_scheduler();
+}
+
 /** Helper: insert <b>s</b> into <b>topic's</b> list of subscribers, keeping
  * them sorted in priority order. */
 static void
@@ -82,22 +107,17 @@ pubsub_unsubscribe_(pubsub_topic_t *topic,
   return 0;
 }
 
-/**
- * For every subscriber s in <b>topic</b>, invoke notify_fn on s and
- * event_data.  Return 0 if there were no nonzero return values, and -1 if
- * there were any.
- */
-int
-pubsub_notify_(pubsub_topic_t *topic, pubsub_notify_fn_t notify_fn,
-               void *event_data, unsigned notify_flags)
+/** Helper: invoke every subscriber to <b>topic</b> with notify_fn and
+ * event_data, as pubsub_notify_() does. */
+static int
+pubsub_deliver(pubsub_topic_t *topic, pubsub_notify_fn_t notify_fn,
+               void *event_data)
 {
-  tor_assert(! topic->locked);
-  (void) notify_flags;
   smartlist_t *sl = topic->subscribers;
   int n_bad = 0;
-  ++topic->n_events_fired;
   if (sl == NULL)
     return -1;
+  ++topic->n_deliveries;
   topic->locked = 1;
   SMARTLIST_FOREACH_BEGIN(sl, pubsub_subscriber_t *, s) {
     int r = notify_fn(s, event_data);
@@ -108,6 +128,80 @@ pubsub_notify_(pubsub_topic_t *topic, pubsub_notify_fn_t notify_fn,
   return (n_bad == 0) ? 0 : -1;
 }
 
+/**
+ * For every subscriber s in <b>topic</b>, invoke notify_fn on s and
+ * event_data.  Return 0 if there were no nonzero return values, and -1 if
+ * there were any.
+ *
+ * If NOTIFY_DEFERRED is set in <b>notify_flags</b>, just remember to do
+ * that from the next pubsub_flush_deferred(), and return 0.
+ */
+int
+pubsub_notify_(pubsub_topic_t *topic, pubsub_notify_fn_t notify_fn,
+               void *event_data, unsigned notify_flags)
+{
+  tor_assert(! topic->locked);
+  ++topic->n_events_fired;
+
+  if (notify_flags & NOTIFY_DEFERRED) {
+    topic->deferred_notify_fn = notify_fn;
+    topic->deferred_data = event_data;
+    if (topic->deferred_pending) {
+      ++topic->n_events_coalesced;
+      return 0;
+    }
+    topic->deferred_pending = 1;
+    if (deferred_topics == NULL)
+      deferred_topics = smartlist_new();
+    smartlist_add(deferred_topics, topic);
+    pubsub_schedule_flush();
+    return 0;
+  }
+
+  return pubsub_deliver(topic, notify_fn, event_data);
+}
+
+/**
+ * Deliver every deferred notification that is pending.  Notifications
+ * that subscribers defer while we do so wait for the next call.  Return
+ * the number of topics whose subscribers we invoked.
+ */
+int
+pubsub_flush_deferred(void)
+{
+  smartlist_t *topics = deferred_topics;
+  int n = 0;
+  deferred_flush_scheduled = 0;
+  if (topics == NULL)
+    return 0;
+  deferred_topics = NULL;
+
+  SMARTLIST_FOREACH_BEGIN(topics, pubsub_topic_t *, topic) {
+    /* A topic cleared since it was notified isn't pending any more. */
+    if (! topic->deferred_pending)
+      continue;
+    topic->deferred_pending = 0;
+    pubsub_deliver(topic, topic->deferred_notify_fn, topic->deferred_data);
+    ++n;
+  } SMARTLIST_FOREACH_END(topic);
+  smartlist_free(topics);
+  return n;
+}
+
+/**
+ * Set the function to call when a deferred notification becomes pending,
+ * and nothing else was: it should arrange for pubsub_flush_deferred() to
+ * run soon, for example at the end of this turn of the event loop.  If
+ * notifications are already pending, call it right away.
+ */
+void
+pubsub_set_deferred_scheduler(void (*fn)(void))
+{
+  deferred_scheduler = fn;
+  deferred_flush_scheduled = 0;
+  pubsub_schedule_flush();
+}
+
 /**
  * Release all storage held by <b>topic</b>.
  */
@@ -116,6 +210,11 @@ pubsub_clear_(pubsub_topic_t *topic)
 {
   tor_assert(! topic->locked);
 
+  /* If it's on deferred_topics, pubsub_flush_deferred() will skip it. */
+  topic->deferred_pending = 0;
+  topic->n_events_coalesced = 0;
+  topic->n_deliveries = 0;
+
   smartlist_t *sl = topic->subscribers;
   if (sl == NULL)
     return;
@@ -37,6 +37,12 @@
  * T_subscribe().  Each has an associated function pointer, data pointer,
  * and priority. Later, you can invoke T_notify() to declare that the
  * event has occurred. Each of the subscribers will be invoked once.
+ *
+ * If you pass NOTIFY_DEFERRED to T_notify(), the subscribers are instead
+ * invoked later, from pubsub_flush_deferred(), and any further deferred
+ * notifications on T before then are folded into the same delivery.  That
+ * way, a burst of changes makes subscribers recompute once, not once per
+ * change.
  **/
 
 #ifndef TOR_PUBSUB_H
@@ -51,6 +57,14 @@
  */
 #define SUBSCRIBE_ATSTART (1u<<0)
 
+/**
+ * Flag for T_notify: don't invoke the subscribers now, but from the next
+ * pubsub_flush_deferred().  Repeated deferred notifications on a topic
+ * before then are delivered once, with the event data from the last of
+ * them, which must stay valid until delivery.
+ */
+#define NOTIFY_DEFERRED (1u<<0)
+
 #define DECLARE_PUBSUB_STRUCT_TYPES(name)                               \
   /* You define this type. */                                           \
   typedef struct name ## _event_data_t name ## _event_data_t;           \
@@ -74,7 +88,7 @@
   int name ## _unsubscribe(const name##_subscriber_t *s);
 
 #define DECLARE_NOTIFY_PUBSUB_TOPIC(linkage, name)                          \
-  /* Call this function to notify all subscribers. Flags not yet used. */   \
+  /* Call this function to notify all subscribers. */                       \
   linkage int name ## _notify(name ## _event_data_t *data, unsigned flags); \
   /* Call this function to release storage held by the topic. */            \
   linkage void name ## _clear(void);
@@ -117,6 +131,19 @@ typedef struct pubsub_topic_t {
   /** True iff we're running 'notify' on this topic, and shouldn't allow
    * any concurrent modifications or events. */
   unsigned locked;
+  /** True iff this topic has a deferred notification waiting for
+   * pubsub_flush_deferred(). */
+  unsigned deferred_pending;
+  /** If deferred_pending is set, how to invoke the subscribers, and the
+   * event data to pass them. */
+  int (*deferred_notify_fn)(struct pubsub_subscriber_t *subscriber,
+                            void *notify_data);
+  void *deferred_data;
+  /** Total number of deferred notifications that were folded into one
+   * that was already pending. */
+  uint64_t n_events_coalesced;
+  /** Total number of times that we have invoked the subscribers. */
+  uint64_t n_deliveries;
 } pubsub_topic_t;
 
 const pubsub_subscriber_t *pubsub_subscribe_(pubsub_topic_t *topic,
@@ -130,9 +157,11 @@ typedef int (*pubsub_notify_fn_t)(pubsub_subscriber_t *subscriber,
                                   void *notify_data);
 int pubsub_notify_(pubsub_topic_t *topic, pubsub_notify_fn_t notify_fn,
                    void *notify_data, unsigned notify_flags);
+int pubsub_flush_deferred(void);
+void pubsub_set_deferred_scheduler(void (*fn)(void));
 
 #define IMPLEMENT_PUBSUB_TOPIC(notify_linkage, name)                    \
-  static pubsub_topic_t name ## _topic_ = { NULL, 0, 0 };               \
+  static pubsub_topic_t name ## _topic_;                                \
   const name ## _subscriber_t *                                         \
   name ## _subscribe(name##_subscriber_fn_t subscriber,                 \
                      name##_subscriber_data_t *extra_data,              \
@@ -173,6 +202,13 @@ int pubsub_notify_(pubsub_topic_t *topic, pubsub_notify_fn_t notify_fn,
   name ## _clear(void)                                                  \
   {                                                                     \
     pubsub_clear_(&name##_topic_);                                      \
+  }                                                                     \
+  /* Return the number of times the subscribers to this topic have been   \
+   * invoked. */                                                        \
+  static inline uint64_t                                                \
+  name ## _n_deliveries(void)                                           \
+  {                                                                     \
+    return name##_topic_.n_deliveries;                                  \
   }
 
 #endif /* TOR_PUBSUB_H */
@@ -141,6 +141,7 @@ static int filter_nopar_gen[] = {
 #ifdef __NR_fstat64
     SCMP_SYS(fstat64),
 #endif
+    SCMP_SYS(fsync),
     SCMP_SYS(futex),
     SCMP_SYS(getdents64),
     SCMP_SYS(getegid),
@@ -182,6 +183,7 @@ static int filter_nopar_gen[] = {
     SCMP_SYS(prlimit64),
 #endif
     SCMP_SYS(read),
+    SCMP_SYS(readv),
     SCMP_SYS(rt_sigreturn),
     SCMP_SYS(sched_getaffinity),
 #ifdef __NR_sched_yield
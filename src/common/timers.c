@@ -161,6 +161,7 @@ libevent_timer_callback(evutil_socket_t fd, short what, void *arg)
 
   monotime_t now;
   monotime_get(&now);
+  monotime_coarse_cache_clear();
   timer_advance_to_cur_time(&now);
 
   tor_timer_t *t;
@@ -5,7 +5,8 @@
 
 /**
  * \file torgzip.c
- * \brief A simple in-memory gzip implementation.
+ * \brief A simple in-memory gzip implementation, along with optional
+ * Zstandard and LZMA backends behind the same streaming interface.
  **/
 
 #include "orconfig.h"
@@ -50,12 +51,29 @@
 #error "We require zlib version 1.2 or later."
 #endif
 
+#ifdef HAVE_LZMA
+#include <lzma.h>
+#endif
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
 static size_t tor_zlib_state_size_precalc(int inflate,
                                           int windowbits, int memlevel);
+static int tor_compress_via_state(char **out, size_t *out_len,
+                                  const char *in, size_t in_len,
+                                  compress_method_t method, int compress,
+                                  int complete_only,
+                                  int protocol_warn_level);
 
 /** Total number of bytes allocated for zlib state */
 static size_t total_zlib_allocation = 0;
 
+/** Total number of microseconds we have spent compressing in
+ * tor_zlib_process(). */
+static uint64_t total_compression_usec = 0;
+
 /** Return a string representation of the version of the currently running
  * version of zlib. */
 const char *
@@ -97,6 +115,120 @@ get_memlevel(zlib_compression_level_t level)
   }
 }
 
+/** Return the deflate compression level to use for <b>level</b>.  The
+ * lower levels run several times faster, for a few percent more output. */
+static inline int
+get_deflate_level(zlib_compression_level_t level)
+{
+  switch (level) {
+    default:
+    case HIGH_COMPRESSION: return Z_BEST_COMPRESSION;
+    case MEDIUM_COMPRESSION: return 6;
+    case LOW_COMPRESSION: return Z_BEST_SPEED;
+  }
+}
+
+#ifdef HAVE_LZMA
+/** Return the liblzma preset to use for <b>level</b>.  Presets above 6 need
+ * hundreds of megabytes to compress, so we never use them. */
+static inline uint32_t
+lzma_preset(zlib_compression_level_t level)
+{
+  switch (level) {
+    default:
+    case HIGH_COMPRESSION: return 6;
+    case MEDIUM_COMPRESSION: return 4;
+    case LOW_COMPRESSION: return 2;
+  }
+}
+
+/** The most memory we let a single LZMA decoder use.  Our own encoders never
+ * need a decoder anywhere near this large. */
+#define LZMA_DECODER_MEMORY_LIMIT (16*1024*1024)
+#endif
+
+#ifdef HAVE_ZSTD
+/** Return the Zstandard compression level to use for <b>level</b>. */
+static inline int
+zstd_level(zlib_compression_level_t level)
+{
+  switch (level) {
+    default:
+    case HIGH_COMPRESSION: return 9;
+    case MEDIUM_COMPRESSION: return 3;
+    case LOW_COMPRESSION: return 1;
+  }
+}
+#endif
+
+/** Return true iff we can compress and uncompress with <b>method</b>. */
+int
+tor_compress_supports_method(compress_method_t method)
+{
+  switch (method) {
+    case GZIP_METHOD:
+    case ZLIB_METHOD:
+      return 1;
+    case ZSTD_METHOD:
+#ifdef HAVE_ZSTD
+      return 1;
+#else
+      return 0;
+#endif
+    case LZMA_METHOD:
+#ifdef HAVE_LZMA
+      return 1;
+#else
+      return 0;
+#endif
+    case NO_METHOD:
+    case UNKNOWN_METHOD:
+    default:
+      return 0;
+  }
+}
+
+/** Table mapping HTTP Content-Encoding names to compression methods.  When
+ * a method has more than one name, the first one is the one we send. */
+static const struct {
+  const char *name;
+  compress_method_t method;
+} compression_method_names[] = {
+  { "identity", NO_METHOD },
+  { "deflate", ZLIB_METHOD },
+  { "x-deflate", ZLIB_METHOD },
+  { "gzip", GZIP_METHOD },
+  { "x-gzip", GZIP_METHOD },
+  { "x-zstd", ZSTD_METHOD },
+  { "x-tor-lzma", LZMA_METHOD },
+};
+
+/** Return the Content-Encoding name for <b>method</b>, or NULL if it has
+ * none. */
+const char *
+compression_method_get_name(compress_method_t method)
+{
+  unsigned i;
+  for (i = 0; i < ARRAY_LENGTH(compression_method_names); ++i) {
+    if (compression_method_names[i].method == method)
+      return compression_method_names[i].name;
+  }
+  return NULL;
+}
+
+/** Return the compression method whose Content-Encoding name is
+ * <b>name</b>, or UNKNOWN_METHOD if there is none. */
+compress_method_t
+compression_method_get_by_name(const char *name)
+{
+  unsigned i;
+  for (i = 0; i < ARRAY_LENGTH(compression_method_names); ++i) {
+    if (!strcmp(compression_method_names[i].name, name))
+      return compression_method_names[i].method;
+  }
+  return UNKNOWN_METHOD;
+}
+
 /** @{ */
 /* These macros define the maximum allowable compression factor.  Anything of
  * size greater than CHECK_FOR_COMPRESSION_BOMB_AFTER is not allowed to
@@ -145,6 +277,10 @@ tor_gzip_compress(char **out, size_t *out_len,
   tor_assert(in);
   tor_assert(in_len < UINT_MAX);
 
+  if (method == ZSTD_METHOD || method == LZMA_METHOD)
+    return tor_compress_via_state(out, out_len, in, in_len, method, 1, 1,
+                                  LOG_WARN);
+
   *out = NULL;
 
   stream = tor_malloc_zero(sizeof(struct z_stream_s));
@@ -268,6 +404,10 @@ tor_gzip_uncompress(char **out, size_t *out_len,
   tor_assert(in);
   tor_assert(in_len < UINT_MAX);
 
+  if (method == ZSTD_METHOD || method == LZMA_METHOD)
+    return tor_compress_via_state(out, out_len, in, in_len, method, 0,
+                                  complete_only, protocol_warn_level);
+
   *out = NULL;
 
   stream = tor_malloc_zero(sizeof(struct z_stream_s));
@@ -391,6 +531,11 @@ detect_compression_method(const char *in, size_t in_len)
 {
   if (in_len > 2 && fast_memeq(in, "\x1f\x8b", 2)) {
     return GZIP_METHOD;
+  } else if (in_len > 4 && fast_memeq(in, "\x28\xb5\x2f\xfd", 4)) {
+    /* Check this before zlib: 0x28 looks like the start of a zlib header. */
+    return ZSTD_METHOD;
+  } else if (in_len > 6 && fast_memeq(in, "\xfd" "7zXZ\x00", 6)) {
+    return LZMA_METHOD;
   } else if (in_len > 2 && (in[0] & 0x0f) == 8 &&
              (ntohs(get_uint16(in)) % 31) == 0) {
     return ZLIB_METHOD;
@@ -399,11 +544,25 @@ detect_compression_method(const char *in, size_t in_len)
   }
 }
 
-/** Internal state for an incremental zlib compression/decompression.  The
- * body of this struct is not exposed. */
+/** Internal state for an incremental compression/decompression.  The body
+ * of this struct is not exposed. */
 struct tor_zlib_state_t {
-  struct z_stream_s stream; /**< The zlib stream */
+  compress_method_t method; /**< Which backend this stream uses. */
   int compress; /**< True if we are compressing; false if we are inflating */
+  union {
+    /** The zlib stream, for GZIP_METHOD and ZLIB_METHOD. */
+    struct z_stream_s stream;
+#ifdef HAVE_LZMA
+    /** The liblzma stream, for LZMA_METHOD. */
+    lzma_stream lzma;
+#endif
+#ifdef HAVE_ZSTD
+    /** The Zstandard compression stream, for compressing ZSTD_METHOD. */
+    ZSTD_CStream *zstd_compress;
+    /** The Zstandard decompression stream, for inflating ZSTD_METHOD. */
+    ZSTD_DStream *zstd_decompress;
+#endif
+  } u;
 
   /** Number of bytes read so far.  Used to detect zlib bombs. */
   size_t input_so_far;
@@ -414,9 +573,163 @@ struct tor_zlib_state_t {
   size_t allocation;
 };
 
+#ifdef HAVE_LZMA
+/** Set up the liblzma stream in <b>state</b>.  Return 0 on success, -1 on
+ * failure. */
+static int
+lzma_state_init(tor_zlib_state_t *state, zlib_compression_level_t level)
+{
+  const lzma_stream init = LZMA_STREAM_INIT;
+  uint64_t memusage;
+  lzma_ret r;
+
+  state->u.lzma = init;
+  if (state->compress) {
+    r = lzma_easy_encoder(&state->u.lzma, lzma_preset(level),
+                          LZMA_CHECK_CRC64);
+    memusage = lzma_easy_encoder_memusage(lzma_preset(level));
+  } else {
+    r = lzma_stream_decoder(&state->u.lzma, LZMA_DECODER_MEMORY_LIMIT,
+                            LZMA_CONCATENATED);
+    /* We can't know what the decoder will need until it sees a header;
+     * guess that the other side used the same preset we would. */
+    memusage = lzma_easy_decoder_memusage(lzma_preset(HIGH_COMPRESSION));
+  }
+  if (r != LZMA_OK) {
+    // LCOV_EXCL_START -- only fails when out of memory.
+    log_warn(LD_GENERAL, "Error from liblzma initialization: %d", (int)r);
+    return -1;
+    // LCOV_EXCL_STOP
+  }
+  if (memusage == UINT64_MAX || memusage > SIZE_T_CEILING)
+    memusage = LZMA_DECODER_MEMORY_LIMIT;
+  state->allocation = sizeof(tor_zlib_state_t) + (size_t)memusage;
+  return 0;
+}
+
+/** As tor_zlib_process(), for a state using LZMA_METHOD. */
+static tor_zlib_output_t
+lzma_state_process(tor_zlib_state_t *state,
+                   char **out, size_t *out_len,
+                   const char **in, size_t *in_len,
+                   int finish)
+{
+  lzma_stream *stream = &state->u.lzma;
+  lzma_ret r;
+
+  stream->next_in = (const uint8_t *) *in;
+  stream->avail_in = *in_len;
+  stream->next_out = (uint8_t *) *out;
+  stream->avail_out = *out_len;
+
+  r = lzma_code(stream, finish ? LZMA_FINISH : LZMA_RUN);
+
+  *out = (char *) stream->next_out;
+  *out_len = stream->avail_out;
+  *in = (const char *) stream->next_in;
+  *in_len = stream->avail_in;
+
+  if (r == LZMA_STREAM_END) {
+    return TOR_ZLIB_DONE;
+  } else if (r == LZMA_BUF_ERROR) {
+    if (stream->avail_in == 0 && !finish)
+      return TOR_ZLIB_OK;
+    return TOR_ZLIB_BUF_FULL;
+  } else if (r == LZMA_OK) {
+    if (stream->avail_out == 0 || finish)
+      return TOR_ZLIB_BUF_FULL;
+    return TOR_ZLIB_OK;
+  } else {
+    log_warn(LD_GENERAL, "LZMA returned an error: %d", (int)r);
+    return TOR_ZLIB_ERR;
+  }
+}
+#endif
+
+#ifdef HAVE_ZSTD
+/** Set up the Zstandard stream in <b>state</b>.  Return 0 on success, -1 on
+ * failure. */
+static int
+zstd_state_init(tor_zlib_state_t *state, zlib_compression_level_t level)
+{
+  size_t r;
+  if (state->compress) {
+    state->u.zstd_compress = ZSTD_createCStream();
+    if (!state->u.zstd_compress)
+      return -1; // LCOV_EXCL_LINE
+    r = ZSTD_initCStream(state->u.zstd_compress, zstd_level(level));
+    state->allocation = sizeof(tor_zlib_state_t) +
+      ZSTD_sizeof_CStream(state->u.zstd_compress);
+  } else {
+    state->u.zstd_decompress = ZSTD_createDStream();
+    if (!state->u.zstd_decompress)
+      return -1; // LCOV_EXCL_LINE
+    r = ZSTD_initDStream(state->u.zstd_decompress);
+    state->allocation = sizeof(tor_zlib_state_t) +
+      ZSTD_sizeof_DStream(state->u.zstd_decompress);
+  }
+  if (ZSTD_isError(r)) {
+    // LCOV_EXCL_START -- we can only provoke failure with junk arguments.
+    log_warn(LD_GENERAL, "Error from Zstandard initialization: %s",
+             ZSTD_getErrorName(r));
+    return -1;
+    // LCOV_EXCL_STOP
+  }
+  return 0;
+}
+
+/** As tor_zlib_process(), for a state using ZSTD_METHOD. */
+static tor_zlib_output_t
+zstd_state_process(tor_zlib_state_t *state,
+                   char **out, size_t *out_len,
+                   const char **in, size_t *in_len,
+                   int finish)
+{
+  ZSTD_inBuffer input = { *in, *in_len, 0 };
+  ZSTD_outBuffer output = { *out, *out_len, 0 };
+  size_t r;
+
+  if (state->compress) {
+    r = ZSTD_compressStream(state->u.zstd_compress, &output, &input);
+    /* Once all the input is in, keep asking for the end of the frame until
+     * it has all been flushed: endStream returns how much is left. */
+    if (!ZSTD_isError(r) && finish && input.pos == input.size)
+      r = ZSTD_endStream(state->u.zstd_compress, &output);
+  } else {
+    /* Returns 0 exactly when a frame has been decoded and flushed. */
+    r = ZSTD_decompressStream(state->u.zstd_decompress, &output, &input);
+  }
+
+  *out += output.pos;
+  *out_len -= output.pos;
+  *in += input.pos;
+  *in_len -= input.pos;
+
+  if (ZSTD_isError(r)) {
+    log_warn(LD_GENERAL, "Zstandard returned an error: %s",
+             ZSTD_getErrorName(r));
+    return TOR_ZLIB_ERR;
+  }
+
+  if (state->compress) {
+    if (finish && *in_len == 0 && r == 0)
+      return TOR_ZLIB_DONE;
+  } else {
+    if (r == 0 && *in_len == 0)
+      return TOR_ZLIB_DONE;
+    /* Another frame follows this one: keep going. */
+    if (*in_len)
+      return TOR_ZLIB_BUF_FULL;
+  }
+  if (*out_len == 0 || finish)
+    return TOR_ZLIB_BUF_FULL;
+  return TOR_ZLIB_OK;
+}
+#endif
+
 /** Construct and return a tor_zlib_state_t object using <b>method</b>.  If
  * <b>compress</b>, it's for compression; otherwise it's for
- * decompression. */
+ * decompression.  Return NULL if we can't use <b>method</b>. */
 tor_zlib_state_t *
 tor_zlib_new(int compress_, compress_method_t method,
              zlib_compression_level_t compression_level)
@@ -431,22 +744,54 @@ tor_zlib_new(int compress_, compress_method_t method,
  }
 
  out = tor_malloc_zero(sizeof(tor_zlib_state_t));
- out->stream.zalloc = Z_NULL;
- out->stream.zfree = Z_NULL;
- out->stream.opaque = NULL;
+ out->method = method;
  out->compress = compress_;
- bits = method_bits(method, compression_level);
- memlevel = get_memlevel(compression_level);
- if (compress_) {
-   if (deflateInit2(&out->stream, Z_BEST_COMPRESSION, Z_DEFLATED,
-                    bits, memlevel,
-                    Z_DEFAULT_STRATEGY) != Z_OK)
-     goto err; // LCOV_EXCL_LINE
- } else {
-   if (inflateInit2(&out->stream, bits) != Z_OK)
-     goto err; // LCOV_EXCL_LINE
+
+ switch (method) {
+   case GZIP_METHOD:
+   case ZLIB_METHOD:
+     out->u.stream.zalloc = Z_NULL;
+     out->u.stream.zfree = Z_NULL;
+     out->u.stream.opaque = NULL;
+     bits = method_bits(method, compression_level);
+     memlevel = get_memlevel(compression_level);
+     if (compress_) {
+       if (deflateInit2(&out->u.stream, get_deflate_level(compression_level),
+                        Z_DEFLATED, bits, memlevel,
+                        Z_DEFAULT_STRATEGY) != Z_OK)
+         goto err; // LCOV_EXCL_LINE
+     } else {
+       if (inflateInit2(&out->u.stream, bits) != Z_OK)
+         goto err; // LCOV_EXCL_LINE
+     }
+     out->allocation = tor_zlib_state_size_precalc(!compress_, bits,
+                                                   memlevel);
+     break;
+#ifdef HAVE_LZMA
+   case LZMA_METHOD:
+     if (lzma_state_init(out, compression_level) < 0)
+       goto err; // LCOV_EXCL_LINE
+     break;
+#endif
+#ifdef HAVE_ZSTD
+   case ZSTD_METHOD:
+     if (zstd_state_init(out, compression_level) < 0)
+       goto err; // LCOV_EXCL_LINE
+     break;
+#endif
+   case NO_METHOD:
+   case UNKNOWN_METHOD:
+#ifndef HAVE_LZMA
+   case LZMA_METHOD:
+#endif
+#ifndef HAVE_ZSTD
+   case ZSTD_METHOD:
+#endif
+   default:
+     log_warn(LD_GENERAL, "Asked for unsupported compression method %d",
+              (int)method);
+     goto err;
  }
- out->allocation = tor_zlib_state_size_precalc(!compress_, bits, memlevel);
 
  total_zlib_allocation += out->allocation;
 
@@ -457,6 +802,52 @@ tor_zlib_new(int compress_, compress_method_t method,
  return NULL;
 }
 
+/** As tor_zlib_process(), for a state using GZIP_METHOD or ZLIB_METHOD. */
+static tor_zlib_output_t
+zlib_state_process(tor_zlib_state_t *state,
+                   char **out, size_t *out_len,
+                   const char **in, size_t *in_len,
+                   int finish)
+{
+  struct z_stream_s *stream = &state->u.stream;
+  int err;
+  tor_assert(*in_len <= UINT_MAX);
+  tor_assert(*out_len <= UINT_MAX);
+  stream->next_in = (unsigned char*) *in;
+  stream->avail_in = (unsigned int)*in_len;
+  stream->next_out = (unsigned char*) *out;
+  stream->avail_out = (unsigned int)*out_len;
+
+  if (state->compress) {
+    err = deflate(stream, finish ? Z_FINISH : Z_NO_FLUSH);
+  } else {
+    err = inflate(stream, finish ? Z_FINISH : Z_SYNC_FLUSH);
+  }
+
+  *out = (char*) stream->next_out;
+  *out_len = stream->avail_out;
+  *in = (const char *) stream->next_in;
+  *in_len = stream->avail_in;
+
+  switch (err)
+    {
+    case Z_STREAM_END:
+      return TOR_ZLIB_DONE;
+    case Z_BUF_ERROR:
+      if (stream->avail_in == 0 && !finish)
+        return TOR_ZLIB_OK;
+      return TOR_ZLIB_BUF_FULL;
+    case Z_OK:
+      if (stream->avail_out == 0 || finish)
+        return TOR_ZLIB_BUF_FULL;
+      return TOR_ZLIB_OK;
+    default:
+      log_warn(LD_GENERAL, "Gzip returned an error: %s",
+               stream->msg ? stream->msg : "<no message>");
+      return TOR_ZLIB_ERR;
+    }
+}
+
 /** Compress/decompress some bytes using <b>state</b>.  Read up to
  * *<b>in_len</b> bytes from *<b>in</b>, and write up to *<b>out_len</b> bytes
  * to *<b>out</b>, adjusting the values as we go.  If <b>finish</b> is true,
@@ -473,27 +864,51 @@ tor_zlib_process(tor_zlib_state_t *state,
                  const char **in, size_t *in_len,
                  int finish)
 {
-  int err;
-  tor_assert(*in_len <= UINT_MAX);
-  tor_assert(*out_len <= UINT_MAX);
-  state->stream.next_in = (unsigned char*) *in;
-  state->stream.avail_in = (unsigned int)*in_len;
-  state->stream.next_out = (unsigned char*) *out;
-  state->stream.avail_out = (unsigned int)*out_len;
+  const size_t in_len_orig = *in_len;
+  const size_t out_len_orig = *out_len;
+  tor_zlib_output_t rv;
+  monotime_t start, end;
 
-  if (state->compress) {
-    err = deflate(&state->stream, finish ? Z_FINISH : Z_NO_FLUSH);
-  } else {
-    err = inflate(&state->stream, finish ? Z_FINISH : Z_SYNC_FLUSH);
+  if (state->compress)
+    monotime_get(&start);
+
+  switch (state->method) {
+    case GZIP_METHOD:
+    case ZLIB_METHOD:
+      rv = zlib_state_process(state, out, out_len, in, in_len, finish);
+      break;
+#ifdef HAVE_LZMA
+    case LZMA_METHOD:
+      rv = lzma_state_process(state, out, out_len, in, in_len, finish);
+      break;
+#endif
+#ifdef HAVE_ZSTD
+    case ZSTD_METHOD:
+      rv = zstd_state_process(state, out, out_len, in, in_len, finish);
+      break;
+#endif
+    case NO_METHOD:
+    case UNKNOWN_METHOD:
+#ifndef HAVE_LZMA
+    case LZMA_METHOD:
+#endif
+#ifndef HAVE_ZSTD
+    case ZSTD_METHOD:
+#endif
+    default:
+      // LCOV_EXCL_START -- tor_zlib_new() refuses to make such a state.
+      tor_assert_nonfatal_unreached();
+      return TOR_ZLIB_ERR;
+      // LCOV_EXCL_STOP
   }
 
-  state->input_so_far += state->stream.next_in - ((unsigned char*)*in);
-  state->output_so_far += state->stream.next_out - ((unsigned char*)*out);
+  state->input_so_far += in_len_orig - *in_len;
+  state->output_so_far += out_len_orig - *out_len;
 
-  *out = (char*) state->stream.next_out;
-  *out_len = state->stream.avail_out;
-  *in = (const char *) state->stream.next_in;
-  *in_len = state->stream.avail_in;
+  if (state->compress) {
+    monotime_get(&end);
+    total_compression_usec += monotime_diff_usec(&start, &end);
+  }
 
   if (! state->compress &&
       is_compression_bomb(state->input_so_far, state->output_so_far)) {
@@ -501,23 +916,7 @@ tor_zlib_process(tor_zlib_state_t *state,
     return TOR_ZLIB_ERR;
   }
 
-  switch (err)
-    {
-    case Z_STREAM_END:
-      return TOR_ZLIB_DONE;
-    case Z_BUF_ERROR:
-      if (state->stream.avail_in == 0 && !finish)
-        return TOR_ZLIB_OK;
-      return TOR_ZLIB_BUF_FULL;
-    case Z_OK:
-      if (state->stream.avail_out == 0 || finish)
-        return TOR_ZLIB_BUF_FULL;
-      return TOR_ZLIB_OK;
-    default:
-      log_warn(LD_GENERAL, "Gzip returned an error: %s",
-               state->stream.msg ? state->stream.msg : "<no message>");
-      return TOR_ZLIB_ERR;
-    }
+  return rv;
 }
 
 /** Deallocate <b>state</b>. */
@@ -529,14 +928,134 @@ tor_zlib_free(tor_zlib_state_t *state)
 
  total_zlib_allocation -= state->allocation;
 
-  if (state->compress)
-    deflateEnd(&state->stream);
-  else
-    inflateEnd(&state->stream);
+  switch (state->method) {
+    case GZIP_METHOD:
+    case ZLIB_METHOD:
+      if (state->compress)
+        deflateEnd(&state->u.stream);
+      else
+        inflateEnd(&state->u.stream);
+      break;
+#ifdef HAVE_LZMA
+    case LZMA_METHOD:
+      lzma_end(&state->u.lzma);
+      break;
+#endif
+#ifdef HAVE_ZSTD
+    case ZSTD_METHOD:
+      if (state->compress)
+        ZSTD_freeCStream(state->u.zstd_compress);
+      else
+        ZSTD_freeDStream(state->u.zstd_decompress);
+      break;
+#endif
+    case NO_METHOD:
+    case UNKNOWN_METHOD:
+#ifndef HAVE_LZMA
+    case LZMA_METHOD:
+#endif
+#ifndef HAVE_ZSTD
+    case ZSTD_METHOD:
+#endif
+    default:
+      break;
+  }
 
   tor_free(state);
 }
 
+/** Helper for tor_gzip_compress() and tor_gzip_uncompress() with methods
+ * that we only drive through a tor_zlib_state_t.  Compress (if
+ * <b>compress</b>) or uncompress all <b>in_len</b> bytes at <b>in</b> with
+ * <b>method</b>, and store the NUL-terminated result in a newly allocated
+ * *<b>out</b> and its length in *<b>out_len</b>.  The other arguments are as
+ * for tor_gzip_uncompress().  Return 0 on success, -1 on failure. */
+static int
+tor_compress_via_state(char **out, size_t *out_len,
+                       const char *in, size_t in_len,
+                       compress_method_t method, int compress,
+                       int complete_only,
+                       int protocol_warn_level)
+{
+  const size_t in_len_orig = in_len;
+  const int finish = compress || complete_only;
+  tor_zlib_state_t *state;
+  size_t out_alloc, out_avail;
+  char *outp;
+
+  *out = NULL;
+
+  state = tor_zlib_new(compress, method, HIGH_COMPRESSION);
+  if (!state)
+    return -1;
+
+  /* Guess 50% compression, as for the zlib case. */
+  out_alloc = compress ? in_len / 2 : in_len * 2;
+  if (out_alloc < 1024) out_alloc = 1024;
+  if (out_alloc >= SIZE_T_CEILING)
+    goto err;
+  *out = tor_malloc(out_alloc);
+  outp = *out;
+  out_avail = out_alloc;
+
+  while (1) {
+    const size_t in_before = in_len, out_before = out_avail;
+    switch (tor_zlib_process(state, &outp, &out_avail, &in, &in_len,
+                             finish)) {
+      case TOR_ZLIB_DONE:
+        goto done;
+      case TOR_ZLIB_OK:
+        if (in_len == 0 && !finish)
+          goto done;
+        break;
+      case TOR_ZLIB_BUF_FULL:
+        if (out_avail == 0) {
+          const size_t offset = outp - *out;
+          if (out_alloc >= SIZE_T_CEILING / 2) {
+            log_warn(LD_GENERAL, "Size overflow in compression.");
+            goto err;
+          }
+          out_alloc *= 2;
+          *out = tor_realloc(*out, out_alloc);
+          outp = *out + offset;
+          out_avail = out_alloc - offset;
+        } else if (in_len == in_before && out_avail == out_before) {
+          /* No room was the problem, and the stream made no progress: we
+           * ran out of input before it ended. */
+          log_fn(protocol_warn_level, LD_PROTOCOL,
+                 "possible truncated or corrupt compressed data");
+          goto err;
+        }
+        break;
+      case TOR_ZLIB_ERR:
+      default:
+        goto err;
+    }
+  }
+
+ done:
+  *out_len = outp - *out;
+  tor_zlib_free(state);
+  state = NULL;
+
+  if (compress && is_compression_bomb(*out_len, in_len_orig)) {
+    log_warn(LD_BUG, "We compressed something and got an insanely high "
+          "compression factor; other Tors would think this was a zlib bomb.");
+    goto err;
+  }
+
+  /* NUL-terminate output. */
+  if (out_alloc == *out_len)
+    *out = tor_realloc(*out, out_alloc + 1);
+  (*out)[*out_len] = '\0';
+  return 0;
+
+ err:
+  tor_zlib_free(state);
+  tor_free(*out);
+  return -1;
+}
+
 /** Return an approximate number of bytes used in RAM to hold a state with
  * window bits <b>windowBits</b> and compression level 'memlevel' */
 static size_t
@@ -582,3 +1101,11 @@ tor_zlib_get_total_allocation(void)
   return total_zlib_allocation;
 }
 
+/** Return the number of microseconds we have spent compressing in
+ * tor_zlib_process() since we started. */
+uint64_t
+tor_zlib_get_total_compression_usec(void)
+{
+  return total_compression_usec;
+}
+
@@ -14,9 +14,12 @@
 /** Enumeration of what kind of compression to use.  Only ZLIB_METHOD is
  * guaranteed to be supported by the compress/uncompress functions here;
  * GZIP_METHOD may be supported if we built against zlib version 1.2 or later
- * and is_gzip_supported() returns true. */
+ * and is_gzip_supported() returns true.  ZSTD_METHOD and LZMA_METHOD are
+ * supported only if we were built with libzstd or liblzma respectively; use
+ * tor_compress_supports_method() to check. */
 typedef enum {
-  NO_METHOD=0, GZIP_METHOD=1, ZLIB_METHOD=2, UNKNOWN_METHOD=3
+  NO_METHOD=0, GZIP_METHOD=1, ZLIB_METHOD=2, ZSTD_METHOD=3, LZMA_METHOD=4,
+  UNKNOWN_METHOD=5
 } compress_method_t;
 
 /**
@@ -49,12 +52,17 @@ tor_zlib_get_header_version_str(void);
 
 compress_method_t detect_compression_method(const char *in, size_t in_len);
 
+int tor_compress_supports_method(compress_method_t method);
+const char *compression_method_get_name(compress_method_t method);
+compress_method_t compression_method_get_by_name(const char *name);
+
 /** Return values from tor_zlib_process; see that function's documentation for
  * details. */
 typedef enum {
   TOR_ZLIB_OK, TOR_ZLIB_DONE, TOR_ZLIB_BUF_FULL, TOR_ZLIB_ERR
 } tor_zlib_output_t;
-/** Internal state for an incremental zlib compression/decompression. */
+/** Internal state for an incremental compression/decompression, using any
+ * of the methods in compress_method_t. */
 typedef struct tor_zlib_state_t tor_zlib_state_t;
 tor_zlib_state_t *tor_zlib_new(int compress, compress_method_t method,
                                zlib_compression_level_t level);
@@ -67,6 +75,7 @@ void tor_zlib_free(tor_zlib_state_t *state);
 
 size_t tor_zlib_state_size(const tor_zlib_state_t *state);
 size_t tor_zlib_get_total_allocation(void);
+uint64_t tor_zlib_get_total_compression_usec(void);
 
 #endif
 
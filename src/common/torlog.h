@@ -145,6 +145,7 @@ int add_syslog_log(const log_severity_list_t *severity,
 #endif
 int add_callback_log(const log_severity_list_t *severity, log_callback cb);
 void logs_set_domain_logging(int enabled);
+int logs_set_async(int enabled, int drop_when_full);
 int get_min_log_level(void);
 void switch_logs_debug(void);
 void logs_free_all(void);
@@ -171,6 +172,13 @@ struct smartlist_t;
 void tor_log_get_logfile_names(struct smartlist_t *out);
 
 extern int log_global_min_severity_;
+extern log_domain_mask_t log_global_domain_masks_[LOG_DEBUG-LOG_ERR+1];
+
+/** Return true iff some log might want a message at <b>severity</b> in
+ * <b>domain</b>.  Used to skip formatting messages that nobody wants. */
+#define log_global_wants_(severity, domain)                             \
+  ((severity) <= log_global_min_severity_ &&                            \
+   (log_global_domain_masks_[(severity) - LOG_ERR] & (domain)))
 
 void log_fn_(int severity, log_domain_mask_t domain,
              const char *funcname, const char *format, ...)
@@ -197,11 +205,14 @@ void log_fn_ratelim_(struct ratelim_t *ratelim, int severity,
   log_fn_ratelim_(ratelim, severity, domain, __FUNCTION__, args)
 #define log_debug(domain, args...)                                      \
   STMT_BEGIN                                                            \
-    if (PREDICT_UNLIKELY(log_global_min_severity_ == LOG_DEBUG))        \
+    if (PREDICT_UNLIKELY(log_global_wants_(LOG_DEBUG, domain)))         \
       log_fn_(LOG_DEBUG, domain, __FUNCTION__, args);            \
   STMT_END
-#define log_info(domain, args...)                           \
-  log_fn_(LOG_INFO, domain, __FUNCTION__, args)
+#define log_info(domain, args...)                                       \
+  STMT_BEGIN                                                            \
+    if (PREDICT_UNLIKELY(log_global_wants_(LOG_INFO, domain)))          \
+      log_fn_(LOG_INFO, domain, __FUNCTION__, args);                    \
+  STMT_END
 #define log_notice(domain, args...)                         \
   log_fn_(LOG_NOTICE, domain, __FUNCTION__, args)
 #define log_warn(domain, args...)                           \
@@ -215,11 +226,14 @@ void log_fn_ratelim_(struct ratelim_t *ratelim, int severity,
 
 #define log_debug(domain, args, ...)                                        \
   STMT_BEGIN                                                                \
-    if (PREDICT_UNLIKELY(log_global_min_severity_ == LOG_DEBUG))            \
+    if (PREDICT_UNLIKELY(log_global_wants_(LOG_DEBUG, domain)))             \
       log_fn_(LOG_DEBUG, domain, __FUNCTION__, args, ##__VA_ARGS__); \
   STMT_END
-#define log_info(domain, args,...)                                      \
-  log_fn_(LOG_INFO, domain, __FUNCTION__, args, ##__VA_ARGS__)
+#define log_info(domain, args,...)                                          \
+  STMT_BEGIN                                                                \
+    if (PREDICT_UNLIKELY(log_global_wants_(LOG_INFO, domain)))              \
+      log_fn_(LOG_INFO, domain, __FUNCTION__, args, ##__VA_ARGS__);         \
+  STMT_END
 #define log_notice(domain, args,...)                                    \
   log_fn_(LOG_NOTICE, domain, __FUNCTION__, args, ##__VA_ARGS__)
 #define log_warn(domain, args,...)                                      \
@@ -134,6 +134,7 @@ tor_tls_get_by_ssl(const SSL *ssl)
 
 static void tor_tls_context_decref(tor_tls_context_t *ctx);
 static void tor_tls_context_incref(tor_tls_context_t *ctx);
+static tor_tls_t *tor_tls_new_impl(int sock, int isServer, int use_membio);
 
 static int check_cert_lifetime_internal(int severity, const X509 *cert,
                                    int past_tolerance, int future_tolerance);
@@ -149,6 +150,52 @@ STATIC tor_tls_context_t *client_tls_context = NULL;
 /** True iff tor_tls_init() has been called. */
 static int tls_library_is_initialized = 0;
 
+/** How long, in seconds, may we keep a TLS session around for resumption?
+ * This is short, since a resumed session reuses the old master secret. */
+#define TOR_TLS_SESSION_LIFETIME (10*60)
+
+/** A TLS session that we might resume on our next connection to a relay. */
+typedef struct tor_tls_cached_session_t {
+  /** The session, with a reference held by us. */
+  SSL_SESSION *session;
+  /** When does this session stop being worth offering? */
+  time_t expires;
+} tor_tls_cached_session_t;
+
+/** True iff the TLS contexts were built with TOR_TLS_CTX_ALLOW_RESUMPTION. */
+static int tls_session_resumption_enabled = 0;
+/** Map from relay identity digest to tor_tls_cached_session_t. */
+static digestmap_t *tls_session_cache = NULL;
+/** How many times have we offered to resume a session? */
+static uint64_t n_tls_resumptions_attempted = 0;
+/** How many times did the relay accept our offer to resume a session? */
+static uint64_t n_tls_resumptions_succeeded = 0;
+
+/** How many certificate signatures do we remember having checked?  Must be
+ * a power of two. */
+#define CERT_SIG_CACHE_SIZE 256
+
+/** A certificate whose signature we have checked, and the certificate whose
+ * key made that signature. */
+typedef struct cert_sig_cache_ent_t {
+  /** True iff this entry holds a checked signature. */
+  int used;
+  /** SHA256 digest of the signed certificate. */
+  uint8_t cert_digest[DIGEST256_LEN];
+  /** SHA256 digest of the signing certificate. */
+  uint8_t signer_digest[DIGEST256_LEN];
+} cert_sig_cache_ent_t;
+
+/** Direct-mapped cache of the certificate signatures that
+ * tor_tls_cert_is_valid() has found to be good, indexed by the first bytes
+ * of the signed certificate's digest.  Relays present the same link and
+ * identity certificates on every connection until they rotate their keys,
+ * so after a restart we can skip most of the X509_verify() calls for the
+ * relays we reconnect to. */
+static cert_sig_cache_ent_t cert_sig_cache[CERT_SIG_CACHE_SIZE];
+/** How many times have we found a signature in cert_sig_cache? */
+STATIC uint64_t n_cert_sig_cache_hits = 0;
+
 /* Module-internal error codes. */
 #define TOR_TLS_SYSCALL_    (MIN_TOR_TLS_ERROR_VAL_ - 2)
 #define TOR_TLS_ZERORETURN_ (MIN_TOR_TLS_ERROR_VAL_ - 1)
@@ -396,12 +443,35 @@ tor_tls_init(void)
   }
 }
 
+/** Release all storage held by the cached session <b>ent</b>. */
+static void
+tor_tls_cached_session_free(void *ent_)
+{
+  tor_tls_cached_session_t *ent = ent_;
+  if (!ent)
+    return;
+  SSL_SESSION_free(ent->session);
+  tor_free(ent);
+}
+
+/** Forget all the TLS sessions we were keeping for resumption. */
+static void
+tls_session_cache_clear(void)
+{
+  digestmap_free(tls_session_cache, tor_tls_cached_session_free);
+  tls_session_cache = NULL;
+}
+
 /** Free all global TLS structures. */
 void
 tor_tls_free_all(void)
 {
   check_no_tls_errors();
 
+  tls_session_cache_clear();
+  tls_session_resumption_enabled = 0;
+  memset(cert_sig_cache, 0, sizeof(cert_sig_cache));
+
   if (server_tls_context) {
     tor_tls_context_t *ctx = server_tls_context;
     server_tls_context = NULL;
@@ -850,7 +920,11 @@ tor_tls_cert_matches_key,(const tor_tls_t *tls, const tor_x509_cert_t *cert))
  * signed by the public key in <b>signing_cert</b>.  If <b>check_rsa_1024</b>,
  * make sure that it has an RSA key with 1024 bits; otherwise, just check that
  * the key is long enough. Return 1 if the cert is good, and 0 if it's bad or
- * we couldn't check it. */
+ * we couldn't check it.
+ *
+ * We remember the signatures we have found to be good in cert_sig_cache,
+ * so that we don't need to check them again; we check the lifetime and the
+ * key every time. */
 int
 tor_tls_cert_is_valid(int severity,
                       const tor_x509_cert_t *cert,
@@ -860,17 +934,34 @@ tor_tls_cert_is_valid(int severity,
   check_no_tls_errors();
   EVP_PKEY *cert_key;
   int r, key_ok = 0;
+  cert_sig_cache_ent_t *ent;
 
-  if (!signing_cert || !cert)
+  if (!signing_cert || !cert || !signing_cert->cert || !cert->cert)
     goto bad;
 
-  EVP_PKEY *signing_key = X509_get_pubkey(signing_cert->cert);
-  if (!signing_key)
-    goto bad;
-  r = X509_verify(cert->cert, signing_key);
-  EVP_PKEY_free(signing_key);
-  if (r <= 0)
-    goto bad;
+  ent = &cert_sig_cache[get_uint32(cert->cert_digests.d[DIGEST_SHA256]) &
+                        (CERT_SIG_CACHE_SIZE - 1)];
+  if (ent->used &&
+      tor_memeq(ent->cert_digest, cert->cert_digests.d[DIGEST_SHA256],
+                DIGEST256_LEN) &&
+      tor_memeq(ent->signer_digest,
+                signing_cert->cert_digests.d[DIGEST_SHA256],
+                DIGEST256_LEN)) {
+    ++n_cert_sig_cache_hits;
+  } else {
+    EVP_PKEY *signing_key = X509_get_pubkey(signing_cert->cert);
+    if (!signing_key)
+      goto bad;
+    r = X509_verify(cert->cert, signing_key);
+    EVP_PKEY_free(signing_key);
+    if (r <= 0)
+      goto bad;
+    ent->used = 1;
+    memcpy(ent->cert_digest, cert->cert_digests.d[DIGEST_SHA256],
+           DIGEST256_LEN);
+    memcpy(ent->signer_digest, signing_cert->cert_digests.d[DIGEST_SHA256],
+           DIGEST256_LEN);
+  }
 
   /* okay, the signature checked out right.  Now let's check the check the
    * lifetime. */
@@ -924,7 +1015,10 @@ tor_tls_context_incref(tor_tls_context_t *ctx)
  * the same TLS context for incoming and outgoing connections, and
  * ignore <b>client_identity</b>. If one of TOR_TLS_CTX_USE_ECDHE_P{224,256}
  * is set in <b>flags</b>, use that ECDHE group if possible; otherwise use
- * the default ECDHE group. */
+ * the default ECDHE group.  If TOR_TLS_CTX_ALLOW_RESUMPTION is set, let
+ * clients resume recent sessions with our server context, and offer to
+ * resume our own recent sessions with relays; see
+ * tor_tls_try_resume_session(). */
 int
 tor_tls_context_init(unsigned flags,
                      crypto_pk_t *client_identity,
@@ -936,6 +1030,12 @@ tor_tls_context_init(unsigned flags,
   const int is_public_server = flags & TOR_TLS_CTX_IS_PUBLIC_SERVER;
   check_no_tls_errors();
 
+  /* Sessions from our old contexts would tie new connections to old keys;
+   * start over. */
+  tls_session_cache_clear();
+  tls_session_resumption_enabled =
+    (flags & TOR_TLS_CTX_ALLOW_RESUMPTION) ? 1 : 0;
+
   if (is_public_server) {
     tor_tls_context_t *new_ctx;
     tor_tls_context_t *old_ctx;
@@ -1161,7 +1261,17 @@ tor_tls_context_new(crypto_pk_t *identity, unsigned int key_lifetime,
       idcert = NULL;
     }
   }
-  SSL_CTX_set_session_cache_mode(result->ctx, SSL_SESS_CACHE_OFF);
+  if (!is_client && (flags & TOR_TLS_CTX_ALLOW_RESUMPTION)) {
+    /* Keep sessions in a server-side cache for a little while, so that
+     * clients can resume them.  We still refuse session tickets: the cache
+     * goes away with this context, but a ticket key would not. */
+    static const unsigned char sid_ctx[] = "tor-link";
+    SSL_CTX_set_session_cache_mode(result->ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_set_session_id_context(result->ctx, sid_ctx, sizeof(sid_ctx)-1);
+    SSL_CTX_set_timeout(result->ctx, TOR_TLS_SESSION_LIFETIME);
+  } else {
+    SSL_CTX_set_session_cache_mode(result->ctx, SSL_SESS_CACHE_OFF);
+  }
   if (!is_client) {
     tor_assert(rsa);
     if (!(pkey = crypto_pk_get_evp_pkey_(rsa,1)))
@@ -1571,13 +1681,64 @@ tor_tls_setup_session_secret_cb(tor_tls_t *tls)
   SSL_set_session_secret_cb(tls->ssl, tor_tls_session_secret_cb, NULL);
 }
 
+/** True iff new TLS objects should read ahead: see tor_tls_set_read_ahead().
+ */
+static int tls_read_ahead = 0;
+
+/** Set whether TLS objects created from now on should read ahead.  With
+ * read-ahead, OpenSSL reads as much as the socket has ready into its own
+ * buffer, instead of making one recv() call for each record header and
+ * another for each record body; that can save several system calls per
+ * read when many cells are arriving.  The bytes it reads ahead are only
+ * visible through tor_tls_has_buffered_input(), so we only allow this
+ * where that can see them.  Return 0 on success, -1 if <b>enabled</b> was
+ * set and read-ahead is unsupported. */
+int
+tor_tls_set_read_ahead(int enabled)
+{
+#if OPENSSL_VERSION_NUMBER >= OPENSSL_V_SERIES(1,1,0)
+  tls_read_ahead = enabled;
+  return 0;
+#else
+  tls_read_ahead = 0;
+  return enabled ? -1 : 0;
+#endif
+}
+
 /** Create a new TLS object from a file descriptor, and a flag to
  * determine whether it is functioning as a server.
  */
 tor_tls_t *
 tor_tls_new(int sock, int isServer)
 {
-  BIO *bio = NULL;
+  return tor_tls_new_impl(sock, isServer, 0);
+}
+
+/** Create a new TLS object that does no network I/O of its own, and a flag
+ * to determine whether it is functioning as a server.
+ *
+ * The object reads and writes ciphertext through a pair of memory BIOs:
+ * hand it what arrives from the network with tor_tls_membio_add_input(),
+ * and collect what it wants sent with tor_tls_membio_get_output().  That
+ * lets the caller read and write the socket in bulk, apart from the
+ * decryption and encryption, which can then run wherever is convenient.
+ * TOR_TLS_WANTREAD from such an object means it needs more input;
+ * TOR_TLS_WANTWRITE never happens, since output is buffered without
+ * limit until collected.
+ */
+tor_tls_t *
+tor_tls_new_membio(int isServer)
+{
+  return tor_tls_new_impl(TOR_INVALID_SOCKET, isServer, 1);
+}
+
+/** Helper for tor_tls_new() and tor_tls_new_membio(): create a new TLS
+ * object that works on the socket <b>sock</b>, or on memory BIOs if
+ * <b>use_membio</b> is set. */
+static tor_tls_t *
+tor_tls_new_impl(int sock, int isServer, int use_membio)
+{
+  BIO *bio = NULL, *wbio = NULL;
   tor_tls_t *result = tor_malloc_zero(sizeof(tor_tls_t));
   tor_tls_context_t *context = isServer ? server_tls_context :
     client_tls_context;
@@ -1611,7 +1772,21 @@ tor_tls_new(int sock, int isServer)
     goto err;
   }
   result->socket = sock;
-  bio = BIO_new_socket(sock, BIO_NOCLOSE);
+  if (use_membio) {
+    bio = BIO_new(BIO_s_mem());
+    wbio = BIO_new(BIO_s_mem());
+    if (bio && wbio) {
+      /* An empty input BIO means "not yet", not end-of-file. */
+      BIO_set_mem_eof_return(bio, -1);
+    } else {
+      BIO_free(bio);
+      BIO_free(wbio);
+      bio = NULL;
+    }
+  } else {
+    bio = BIO_new_socket(sock, BIO_NOCLOSE);
+    wbio = bio;
+  }
   if (! bio) {
     tls_log_errors(NULL, LOG_WARN, LD_NET, "opening BIO");
 #ifdef SSL_set_tlsext_host_name
@@ -1629,13 +1804,16 @@ tor_tls_new(int sock, int isServer)
                "Couldn't set the tls for an SSL*; connection will fail");
     }
   }
-  SSL_set_bio(result->ssl, bio, bio);
+  SSL_set_bio(result->ssl, bio, wbio);
+  result->use_membio = use_membio;
+  if (tls_read_ahead && !use_membio)
+    SSL_set_read_ahead(result->ssl, 1);
   tor_tls_context_incref(context);
   result->context = context;
   result->state = TOR_TLS_ST_HANDSHAKE;
   result->isServer = isServer;
   result->wantwrite_n = 0;
-  result->last_write_count = BIO_number_written(bio);
+  result->last_write_count = BIO_number_written(wbio);
   result->last_read_count = BIO_number_read(bio);
   if (result->last_write_count || result->last_read_count) {
     log_warn(LD_NET, "Newly created BIO has read count %lu, write count %lu",
@@ -1763,6 +1941,88 @@ tor_tls_free(tor_tls_t *tls)
   tor_free(tls);
 }
 
+/** If session resumption is enabled, and we have a recent session with the
+ * relay whose identity digest is <b>identity_digest</b>, offer to resume it
+ * on the client-side connection <b>tls</b>, which must not have started its
+ * handshake yet.  We offer each session only once.  Return 1 if we offered
+ * a session, and 0 otherwise. */
+int
+tor_tls_try_resume_session(tor_tls_t *tls, const char *identity_digest)
+{
+  tor_tls_cached_session_t *ent;
+  int r = 0;
+
+  tor_assert(tls);
+  tor_assert(identity_digest);
+
+  if (!tls_session_resumption_enabled || !tls_session_cache ||
+      tls->isServer || tor_digest_is_zero(identity_digest))
+    return 0;
+
+  ent = digestmap_remove(tls_session_cache, identity_digest);
+  if (!ent)
+    return 0;
+  if (ent->expires > time(NULL)) {
+    if (SSL_set_session(tls->ssl, ent->session)) {
+      tls->offered_session = 1;
+      ++n_tls_resumptions_attempted;
+      r = 1;
+    } else {
+      tls_log_errors(tls, LOG_INFO, LD_HANDSHAKE, "offering a TLS session");
+    }
+  }
+  tor_tls_cached_session_free(ent);
+  return r;
+}
+
+/** Remember the session of the client-side connection <b>tls</b>, which has
+ * finished its handshake and proven that it goes to the relay whose identity
+ * digest is <b>identity_digest</b>, so that we can try to resume it next
+ * time we connect there.  Also note whether we resumed an earlier session
+ * on <b>tls</b>.
+ *
+ * Resuming a session changes nothing about our link authentication: the
+ * peer's link certificate is stored with the session, and the AUTHENTICATE
+ * cell covers this connection's own client and server randoms. */
+void
+tor_tls_remember_session(tor_tls_t *tls, const char *identity_digest)
+{
+  tor_tls_cached_session_t *ent;
+  SSL_SESSION *session;
+
+  tor_assert(tls);
+  tor_assert(identity_digest);
+
+  if (!tls_session_resumption_enabled || tls->isServer ||
+      tor_digest_is_zero(identity_digest))
+    return;
+
+  if (tls->offered_session && SSL_session_reused(tls->ssl))
+    ++n_tls_resumptions_succeeded;
+
+  if (!(session = SSL_get1_session(tls->ssl)))
+    return;
+
+  if (!tls_session_cache)
+    tls_session_cache = digestmap_new();
+  ent = tor_malloc_zero(sizeof(tor_tls_cached_session_t));
+  ent->session = session;
+  ent->expires = time(NULL) + TOR_TLS_SESSION_LIFETIME;
+  tor_tls_cached_session_free(
+                  digestmap_set(tls_session_cache, identity_digest, ent));
+}
+
+/** Set *<b>attempted_out</b> to the number of times we have offered to
+ * resume a TLS session, and *<b>resumed_out</b> to the number of times the
+ * relay accepted. */
+void
+tor_tls_get_session_resumption_counts(uint64_t *attempted_out,
+                                      uint64_t *resumed_out)
+{
+  *attempted_out = n_tls_resumptions_attempted;
+  *resumed_out = n_tls_resumptions_succeeded;
+}
+
 /** Underlying function for TLS reading.  Reads up to <b>len</b>
  * characters from <b>tls</b> into <b>cp</b>.  On success, returns the
  * number of characters read.  On failure, returns TOR_TLS_ERROR,
@@ -2234,6 +2494,88 @@ tor_tls_get_pending_bytes(tor_tls_t *tls)
   return SSL_pending(tls->ssl);
 }
 
+/** Return true iff <b>tls</b> holds input that it has taken from the
+ * network and we haven't read from it yet: either decrypted bytes, as
+ * counted by tor_tls_get_pending_bytes(), or the raw bytes of further
+ * records that it read ahead. */
+int
+tor_tls_has_buffered_input(tor_tls_t *tls)
+{
+  tor_assert(tls);
+#if OPENSSL_VERSION_NUMBER >= OPENSSL_V_SERIES(1,1,0)
+  return SSL_has_pending(tls->ssl);
+#else
+  return SSL_pending(tls->ssl) > 0;
+#endif
+}
+
+/** Give the memory-BIO TLS object <b>tls</b> the <b>len</b> bytes of
+ * ciphertext in <b>data</b>, which arrived from the network.  Return the
+ * number of bytes taken (always all of them), or -1 on error. */
+int
+tor_tls_membio_add_input(tor_tls_t *tls, const char *data, size_t len)
+{
+  int r;
+  tor_assert(tls);
+  tor_assert(tls->use_membio);
+  tor_assert(len < INT_MAX);
+  if (!len)
+    return 0;
+  r = BIO_write(SSL_get_rbio(tls->ssl), data, (int)len);
+  if (r != (int)len) {
+    tls_log_errors(tls, LOG_WARN, LD_NET, "buffering TLS input");
+    return -1;
+  }
+  return r;
+}
+
+/** Tell the memory-BIO TLS object <b>tls</b> that the network connection
+ * has closed: once it has used up its input, its reads should report the
+ * close instead of asking for more. */
+void
+tor_tls_membio_note_eof(tor_tls_t *tls)
+{
+  tor_assert(tls);
+  tor_assert(tls->use_membio);
+  BIO_set_mem_eof_return(SSL_get_rbio(tls->ssl), 0);
+}
+
+/** Return the number of bytes of ciphertext that the memory-BIO TLS object
+ * <b>tls</b> has produced and that we haven't collected yet. */
+size_t
+tor_tls_membio_output_len(tor_tls_t *tls)
+{
+  tor_assert(tls);
+  tor_assert(tls->use_membio);
+  return BIO_ctrl_pending(SSL_get_wbio(tls->ssl));
+}
+
+/** Move up to <b>len</b> bytes of ciphertext that the memory-BIO TLS
+ * object <b>tls</b> has produced into <b>out</b>, for sending on the
+ * network.  Return the number of bytes moved. */
+size_t
+tor_tls_membio_get_output(tor_tls_t *tls, char *out, size_t len)
+{
+  int r;
+  tor_assert(tls);
+  tor_assert(tls->use_membio);
+  if (len > INT_MAX)
+    len = INT_MAX;
+  if (!len || !tor_tls_membio_output_len(tls))
+    return 0;
+  r = BIO_read(SSL_get_wbio(tls->ssl), out, (int)len);
+  return r > 0 ? (size_t)r : 0;
+}
+
+/** Return true iff <b>tls</b> does its network I/O through memory BIOs;
+ * see tor_tls_new_membio(). */
+int
+tor_tls_uses_membio(const tor_tls_t *tls)
+{
+  tor_assert(tls);
+  return tls->use_membio;
+}
+
 /** If <b>tls</b> requires that the next write be of a particular size,
  * return that size.  Otherwise, return 0. */
 size_t
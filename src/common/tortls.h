@@ -53,6 +53,9 @@ typedef struct tor_x509_cert_t tor_x509_cert_t;
 
 #define TOR_TLS_IS_ERROR(rv) ((rv) < TOR_TLS_CLOSE)
 
+/** The largest number of plaintext bytes one TLS record can carry. */
+#define TOR_TLS_MAX_RECORD_PLAINTEXT 16384
+
 #ifdef TORTLS_PRIVATE
 #define TOR_TLS_MAGIC 0x71571571
 
@@ -106,6 +109,11 @@ struct tor_tls_t {
                                   * one certificate). */
   /** True iff we should call negotiated_callback when we're done reading. */
   unsigned int got_renegotiate:1;
+  /** True iff we offered to resume an earlier session on this connection. */
+  unsigned int offered_session:1;
+  /** True iff this object reads and writes ciphertext through memory BIOs
+   * rather than a socket. */
+  unsigned int use_membio:1;
   /** Return value from tor_tls_classify_client_ciphers, or 0 if we haven't
    * called that function yet. */
   int8_t client_cipher_list_type;
@@ -172,6 +180,7 @@ extern tor_tls_context_t *client_tls_context;
 extern uint16_t v2_cipher_list[];
 extern uint64_t total_bytes_written_over_tls;
 extern uint64_t total_bytes_written_by_tls;
+extern uint64_t n_cert_sig_cache_hits;
 #endif
 
 #endif /* endif TORTLS_PRIVATE */
@@ -184,18 +193,24 @@ void tor_tls_free_all(void);
 #define TOR_TLS_CTX_IS_PUBLIC_SERVER (1u<<0)
 #define TOR_TLS_CTX_USE_ECDHE_P256   (1u<<1)
 #define TOR_TLS_CTX_USE_ECDHE_P224   (1u<<2)
+#define TOR_TLS_CTX_ALLOW_RESUMPTION (1u<<3)
 
 int tor_tls_context_init(unsigned flags,
                          crypto_pk_t *client_identity,
                          crypto_pk_t *server_identity,
                          unsigned int key_lifetime);
 tor_tls_t *tor_tls_new(int sock, int is_server);
+tor_tls_t *tor_tls_new_membio(int is_server);
 void tor_tls_set_logged_address(tor_tls_t *tls, const char *address);
 void tor_tls_set_renegotiate_callback(tor_tls_t *tls,
                                       void (*cb)(tor_tls_t *, void *arg),
                                       void *arg);
 int tor_tls_is_server(tor_tls_t *tls);
 void tor_tls_free(tor_tls_t *tls);
+int tor_tls_try_resume_session(tor_tls_t *tls, const char *identity_digest);
+void tor_tls_remember_session(tor_tls_t *tls, const char *identity_digest);
+void tor_tls_get_session_resumption_counts(uint64_t *attempted_out,
+                                           uint64_t *resumed_out);
 int tor_tls_peer_has_cert(tor_tls_t *tls);
 MOCK_DECL(tor_x509_cert_t *,tor_tls_get_peer_cert,(tor_tls_t *tls));
 int tor_tls_verify(int severity, tor_tls_t *tls, crypto_pk_t **identity);
@@ -211,6 +226,13 @@ void tor_tls_block_renegotiation(tor_tls_t *tls);
 void tor_tls_assert_renegotiation_unblocked(tor_tls_t *tls);
 int tor_tls_shutdown(tor_tls_t *tls);
 int tor_tls_get_pending_bytes(tor_tls_t *tls);
+int tor_tls_has_buffered_input(tor_tls_t *tls);
+int tor_tls_set_read_ahead(int enabled);
+int tor_tls_uses_membio(const tor_tls_t *tls);
+int tor_tls_membio_add_input(tor_tls_t *tls, const char *data, size_t len);
+void tor_tls_membio_note_eof(tor_tls_t *tls);
+size_t tor_tls_membio_output_len(tor_tls_t *tls);
+size_t tor_tls_membio_get_output(tor_tls_t *tls, char *out, size_t len);
 size_t tor_tls_get_forced_write_size(tor_tls_t *tls);
 
 void tor_tls_get_n_raw_bytes(tor_tls_t *tls,
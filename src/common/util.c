@@ -381,6 +381,20 @@ tor_log_mallinfo(int severity)
                       );
 #endif
 }
+
+/** Return the number of bytes that the platform malloc says we have
+ * allocated, or 0 if we can't tell. */
+size_t
+tor_get_malloc_in_use(void)
+{
+#ifdef HAVE_MALLINFO
+  struct mallinfo mi;
+  mi = mallinfo();
+  return (size_t)(unsigned)mi.uordblks + (size_t)(unsigned)mi.hblkhd;
+#else
+  return 0;
+#endif
+}
 ENABLE_GCC_WARNING(aggregate-return)
 
 /* =====
@@ -1654,6 +1668,49 @@ static const char *MONTH_NAMES[] =
   { "Jan", "Feb", "Mar", "Apr", "May", "Jun",
     "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
 
+/** The most recent time we formatted in some format, and how it came out.
+ * We log, and put Date: headers on, many things in the same second, so
+ * remembering one answer saves most of our calls to gmtime and strftime.
+ * Only the main thread uses these caches, so they need no locking. */
+typedef struct time_format_cache_t {
+  /** True iff <b>buf</b> holds the formatted value of <b>t</b>. */
+  int valid;
+  /** The time we formatted. */
+  time_t t;
+  /** The formatted time, NUL-terminated. */
+  char buf[RFC1123_TIME_LEN+1];
+} time_format_cache_t;
+
+static time_format_cache_t rfc1123_time_cache;
+static time_format_cache_t local_iso_time_cache;
+static time_format_cache_t iso_time_cache;
+
+/** If <b>cache</b> holds <b>t</b>, formatted in <b>len</b> characters,
+ * copy it into <b>buf</b> and return true.  Otherwise return false. */
+static int
+time_format_cache_get(const time_format_cache_t *cache, time_t t,
+                      char *buf, size_t len)
+{
+  if (!cache->valid || cache->t != t || !in_main_thread())
+    return 0;
+  memcpy(buf, cache->buf, len+1);
+  return 1;
+}
+
+/** Remember that <b>t</b> is formatted, in <b>len</b> characters, as
+ * <b>buf</b>. */
+static void
+time_format_cache_set(time_format_cache_t *cache, time_t t,
+                      const char *buf, size_t len)
+{
+  if (!in_main_thread())
+    return;
+  tor_assert(len < sizeof(cache->buf));
+  memcpy(cache->buf, buf, len+1);
+  cache->t = t;
+  cache->valid = 1;
+}
+
 /** Set <b>buf</b> to the RFC1123 encoding of the UTC value of <b>t</b>.
  * The buffer must be at least RFC1123_TIME_LEN+1 bytes long.
  *
@@ -1665,6 +1722,9 @@ format_rfc1123_time(char *buf, time_t t)
 {
   struct tm tm;
 
+  if (time_format_cache_get(&rfc1123_time_cache, t, buf, RFC1123_TIME_LEN))
+    return;
+
   tor_gmtime_r(&t, &tm);
 
   strftime(buf, RFC1123_TIME_LEN+1, "___, %d ___ %Y %H:%M:%S GMT", &tm);
@@ -1674,6 +1734,7 @@ format_rfc1123_time(char *buf, time_t t)
   tor_assert(tm.tm_mon >= 0);
   tor_assert(tm.tm_mon <= 11);
   memcpy(buf+8, MONTH_NAMES[tm.tm_mon], 3);
+  time_format_cache_set(&rfc1123_time_cache, t, buf, RFC1123_TIME_LEN);
 }
 
 /** Parse the (a subset of) the RFC1123 encoding of some time (in UTC) from
@@ -1767,7 +1828,10 @@ void
 format_local_iso_time(char *buf, time_t t)
 {
   struct tm tm;
+  if (time_format_cache_get(&local_iso_time_cache, t, buf, ISO_TIME_LEN))
+    return;
   strftime(buf, ISO_TIME_LEN+1, "%Y-%m-%d %H:%M:%S", tor_localtime_r(&t, &tm));
+  time_format_cache_set(&local_iso_time_cache, t, buf, ISO_TIME_LEN);
 }
 
 /** Set <b>buf</b> to the ISO8601 encoding of the GMT value of <b>t</b>.
@@ -1777,7 +1841,10 @@ void
 format_iso_time(char *buf, time_t t)
 {
   struct tm tm;
+  if (time_format_cache_get(&iso_time_cache, t, buf, ISO_TIME_LEN))
+    return;
   strftime(buf, ISO_TIME_LEN+1, "%Y-%m-%d %H:%M:%S", tor_gmtime_r(&t, &tm));
+  time_format_cache_set(&iso_time_cache, t, buf, ISO_TIME_LEN);
 }
 
 /** As format_iso_time, but use the yyyy-mm-ddThh:mm:ss format to avoid
@@ -2644,10 +2711,11 @@ abort_writing_to_file(open_file_t *file_data)
 /** Helper: given a set of flags as passed to open(2), open the file
  * <b>fname</b> and write all the sized_chunk_t structs in <b>chunks</b> to
  * the file.  Do so as atomically as possible e.g. by opening temp files and
- * renaming. */
+ * renaming.  If <b>sync_to_disk</b> is true, make sure the data has reached
+ * the disk before we replace the original file. */
 static int
 write_chunks_to_file_impl(const char *fname, const smartlist_t *chunks,
-                          int open_flags)
+                          int open_flags, int sync_to_disk)
 {
   open_file_t *file = NULL;
   int fd;
@@ -2666,6 +2734,19 @@ write_chunks_to_file_impl(const char *fname, const smartlist_t *chunks,
     tor_assert((size_t)result == chunk->len);
   });
 
+  if (sync_to_disk) {
+#ifdef _WIN32
+    result = _commit(fd);
+#else
+    result = fsync(fd);
+#endif
+    if (result < 0) {
+      log_warn(LD_FS, "Error syncing \"%s\" to disk: %s", fname,
+               strerror(errno));
+      goto err;
+    }
+  }
+
   return finish_writing_to_file(file);
  err:
   abort_writing_to_file(file);
@@ -2686,7 +2767,7 @@ write_chunks_to_file(const char *fname, const smartlist_t *chunks, int bin,
     /* O_APPEND stops write_chunks_to_file from using tempfiles */
     flags |= O_APPEND;
   }
-  return write_chunks_to_file_impl(fname, chunks, flags);
+  return write_chunks_to_file_impl(fname, chunks, flags, 0);
 }
 
 /** Write <b>len</b> bytes, starting at <b>str</b>, to <b>fname</b>
@@ -2699,7 +2780,7 @@ write_bytes_to_file_impl(const char *fname, const char *str, size_t len,
   sized_chunk_t c = { str, len };
   smartlist_t *chunks = smartlist_new();
   smartlist_add(chunks, &c);
-  r = write_chunks_to_file_impl(fname, chunks, flags);
+  r = write_chunks_to_file_impl(fname, chunks, flags, 0);
   smartlist_free(chunks);
   return r;
 }
@@ -2724,6 +2805,32 @@ append_bytes_to_file(const char *fname, const char *str, size_t len,
                                   OPEN_FLAGS_APPEND|(bin?O_BINARY:O_TEXT));
 }
 
+/** As write_chunks_to_file, but if the file already exists, append the
+ * chunks to the end of the file instead of overwriting it. */
+int
+append_chunks_to_file(const char *fname, const smartlist_t *chunks, int bin)
+{
+  return write_chunks_to_file_impl(fname, chunks,
+                                   OPEN_FLAGS_APPEND|(bin?O_BINARY:O_TEXT), 0);
+}
+
+/** As write_str_to_file, but flush the new contents to the disk before
+ * renaming them into place, so that after a crash or power loss we find
+ * either the old file or the complete new one.  This can block for a long
+ * time on slow storage, so don't call it from the main thread. */
+int
+write_str_to_file_synced(const char *fname, const char *str, int bin)
+{
+  int r;
+  sized_chunk_t c = { str, strlen(str) };
+  smartlist_t *chunks = smartlist_new();
+  smartlist_add(chunks, &c);
+  r = write_chunks_to_file_impl(fname, chunks,
+                                OPEN_FLAGS_REPLACE|(bin?O_BINARY:O_TEXT), 1);
+  smartlist_free(chunks);
+  return r;
+}
+
 /** Like write_str_to_file(), but also return -1 if there was a file
     already residing in <b>fname</b>. */
 int
@@ -3532,6 +3639,131 @@ smartlist_add_vasprintf(struct smartlist_t *sl, const char *pattern,
   smartlist_add(sl, str);
 }
 
+/** A string we are building by appending to its end. */
+struct strbuf_t {
+  char *mem; /**< The string so far, always NUL-terminated. */
+  size_t len; /**< Length of mem, not counting the NUL. */
+  size_t alloc; /**< Number of bytes allocated for mem. */
+};
+
+/** Return a new empty strbuf_t.  If we know roughly how long the result
+ * will be, <b>size_hint</b> is that length, so that we don't need to grow
+ * the buffer while we build it. */
+strbuf_t *
+strbuf_new(size_t size_hint)
+{
+  strbuf_t *sb = tor_malloc_zero(sizeof(strbuf_t));
+  sb->alloc = MAX(size_hint + 1, 256);
+  sb->mem = tor_malloc(sb->alloc);
+  sb->mem[0] = '\0';
+  return sb;
+}
+
+/** Release all storage held by <b>sb</b>. */
+void
+strbuf_free(strbuf_t *sb)
+{
+  if (!sb)
+    return;
+  tor_free(sb->mem);
+  tor_free(sb);
+}
+
+/** Make sure that <b>sb</b> has room for <b>n</b> more bytes and a NUL. */
+static void
+strbuf_reserve(strbuf_t *sb, size_t n)
+{
+  size_t want;
+  tor_assert(n < SIZE_T_CEILING - sb->len - 1);
+  want = sb->len + n + 1;
+  if (want <= sb->alloc)
+    return;
+  while (sb->alloc < want)
+    sb->alloc = (sb->alloc < SIZE_T_CEILING / 2) ? sb->alloc * 2 : want;
+  sb->mem = tor_realloc(sb->mem, sb->alloc);
+}
+
+/** Append the <b>n</b> bytes at <b>s</b> to <b>sb</b>. */
+void
+strbuf_add_bytes(strbuf_t *sb, const char *s, size_t n)
+{
+  strbuf_reserve(sb, n);
+  memcpy(sb->mem + sb->len, s, n);
+  sb->len += n;
+  sb->mem[sb->len] = '\0';
+}
+
+/** Append the NUL-terminated string <b>s</b> to <b>sb</b>. */
+void
+strbuf_add(strbuf_t *sb, const char *s)
+{
+  strbuf_add_bytes(sb, s, strlen(s));
+}
+
+/** Append the result of printf(<b>pattern</b>, ...) to <b>sb</b>. */
+void
+strbuf_add_printf(strbuf_t *sb, const char *pattern, ...)
+{
+  va_list ap;
+  va_start(ap, pattern);
+  strbuf_add_vprintf(sb, pattern, ap);
+  va_end(ap);
+}
+
+/** va_list-based backend of strbuf_add_printf. */
+void
+strbuf_add_vprintf(strbuf_t *sb, const char *pattern, va_list args)
+{
+  va_list tmp_args;
+  char *str = NULL;
+  int r;
+
+  /* Usually the result fits in the space we have, and we can format it in
+   * place. */
+  va_copy(tmp_args, args);
+  r = tor_vsnprintf(sb->mem + sb->len, sb->alloc - sb->len,
+                    pattern, tmp_args);
+  va_end(tmp_args);
+  if (r >= 0) {
+    sb->len += r;
+    return;
+  }
+
+  sb->mem[sb->len] = '\0';
+  r = tor_vasprintf(&str, pattern, args);
+  tor_assert(r >= 0 && str);
+  strbuf_add_bytes(sb, str, r);
+  tor_free(str);
+}
+
+/** Return the string that <b>sb</b> holds so far.  The pointer is only
+ * good until the next change to <b>sb</b>. */
+const char *
+strbuf_get(const strbuf_t *sb)
+{
+  return sb->mem;
+}
+
+/** Return the length of the string that <b>sb</b> holds so far. */
+size_t
+strbuf_len(const strbuf_t *sb)
+{
+  return sb->len;
+}
+
+/** Free <b>sb</b>, and return the string it held, which the caller must
+ * free.  If <b>len_out</b> is provided, set *<b>len_out</b> to its
+ * length. */
+char *
+strbuf_extract(strbuf_t *sb, size_t *len_out)
+{
+  char *result = sb->mem;
+  if (len_out)
+    *len_out = sb->len;
+  tor_free(sb);
+  return result;
+}
+
 /** Return a new list containing the filenames in the directory <b>dirname</b>.
  * Return NULL on error or if <b>dirname</b> is not a directory.
  */
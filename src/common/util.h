@@ -108,6 +108,7 @@ extern int dmalloc_free(const char *file, const int line, void *pnt,
 #define raw_strdup  strdup
 
 void tor_log_mallinfo(int severity);
+size_t tor_get_malloc_in_use(void);
 
 /** Return the offset of <b>member</b> within the type <b>tp</b>, in bytes */
 #if defined(__GNUC__) && __GNUC__ > 3
@@ -240,6 +241,21 @@ void smartlist_add_vasprintf(struct smartlist_t *sl, const char *pattern,
                              va_list args)
   CHECK_PRINTF(2, 0);
 
+/** A growable string that documents are written into one piece at a time.
+ * Opaque; see strbuf_new(). */
+typedef struct strbuf_t strbuf_t;
+strbuf_t *strbuf_new(size_t size_hint);
+void strbuf_free(strbuf_t *sb);
+void strbuf_add(strbuf_t *sb, const char *s);
+void strbuf_add_bytes(strbuf_t *sb, const char *s, size_t n);
+void strbuf_add_printf(strbuf_t *sb, const char *pattern, ...)
+  CHECK_PRINTF(2, 3);
+void strbuf_add_vprintf(strbuf_t *sb, const char *pattern, va_list args)
+  CHECK_PRINTF(2, 0);
+const char *strbuf_get(const strbuf_t *sb);
+size_t strbuf_len(const strbuf_t *sb);
+char *strbuf_extract(strbuf_t *sb, size_t *len_out);
+
 /* Time helpers */
 long tv_udiff(const struct timeval *start, const struct timeval *end);
 long tv_mdiff(const struct timeval *start, const struct timeval *end);
@@ -358,6 +374,7 @@ write_str_to_file,(const char *fname, const char *str, int bin));
 MOCK_DECL(int,
 write_bytes_to_file,(const char *fname, const char *str, size_t len,
                      int bin));
+int write_str_to_file_synced(const char *fname, const char *str, int bin);
 /** An ad-hoc type to hold a string of characters and a count; used by
  * write_chunks_to_file. */
 typedef struct sized_chunk_t {
@@ -368,6 +385,8 @@ int write_chunks_to_file(const char *fname, const struct smartlist_t *chunks,
                          int bin, int no_tempfile);
 int append_bytes_to_file(const char *fname, const char *str, size_t len,
                          int bin);
+int append_chunks_to_file(const char *fname,
+                          const struct smartlist_t *chunks, int bin);
 int write_bytes_to_new_file(const char *fname, const char *str, size_t len,
                             int bin);
 
@@ -38,7 +38,7 @@ void
 base32_encode(char *dest, size_t destlen, const char *src, size_t srclen)
 {
   unsigned int i, v, u;
-  size_t nbits = srclen * 8;
+  size_t nbits;
   size_t bit;
 
   tor_assert(srclen < SIZE_T_CEILING/8);
@@ -49,6 +49,27 @@ base32_encode(char *dest, size_t destlen, const char *src, size_t srclen)
   /* Make sure we leave no uninitialized data in the destination buffer. */
   memset(dest, 0, destlen);
 
+  /* Every 5 bytes of input make exactly 8 characters of output, so encode
+   * as many whole 40-bit groups as we can without any bit bookkeeping. */
+  while (srclen >= 5) {
+    const uint8_t *s = (const uint8_t *)src;
+    uint64_t n = ((uint64_t)s[0] << 32) | ((uint64_t)s[1] << 24) |
+      ((uint64_t)s[2] << 16) | ((uint64_t)s[3] << 8) | s[4];
+    dest[0] = BASE32_CHARS[(n >> 35) & 0x1f];
+    dest[1] = BASE32_CHARS[(n >> 30) & 0x1f];
+    dest[2] = BASE32_CHARS[(n >> 25) & 0x1f];
+    dest[3] = BASE32_CHARS[(n >> 20) & 0x1f];
+    dest[4] = BASE32_CHARS[(n >> 15) & 0x1f];
+    dest[5] = BASE32_CHARS[(n >> 10) & 0x1f];
+    dest[6] = BASE32_CHARS[(n >> 5) & 0x1f];
+    dest[7] = BASE32_CHARS[n & 0x1f];
+    dest += 8;
+    src += 5;
+    srclen -= 5;
+  }
+
+  /* Encode the last partial group a bit at a time. */
+  nbits = srclen * 8;
   for (i=0,bit=0; bit < nbits; ++i, bit+=5) {
     /* set v to the 16-bit value starting at src[bits/8], 0-padded. */
     v = ((uint8_t)src[bit/8]) << 8;
@@ -169,6 +190,27 @@ static const char base64_encode_table[64] = {
   '4', '5', '6', '7', '8', '9', '+', '/'
 };
 
+/** Number of input bytes that make one full line of multiline output. */
+#define BASE64_OPENSSL_LINE_BYTES (BASE64_OPENSSL_LINELEN / 4 * 3)
+
+/** Helper: Base64 encode the <b>n_groups</b>*3 bytes at <b>src</b> into
+ * <b>n_groups</b>*4 characters at <b>dest</b>, with no padding or
+ * newlines.  Return a pointer to the end of the output. */
+static inline char *
+base64_encode_groups_(char *dest, const unsigned char *src, size_t n_groups)
+{
+  while (n_groups--) {
+    uint32_t n = ((uint32_t)src[0] << 16) | ((uint32_t)src[1] << 8) | src[2];
+    dest[0] = base64_encode_table[n >> 18];
+    dest[1] = base64_encode_table[(n >> 12) & 0x3f];
+    dest[2] = base64_encode_table[(n >> 6) & 0x3f];
+    dest[3] = base64_encode_table[n & 0x3f];
+    dest += 4;
+    src += 3;
+  }
+  return dest;
+}
+
 /** Base64 encode <b>srclen</b> bytes of data from <b>src</b>.  Write
  * the result into <b>dest</b>, if it will fit within <b>destlen</b>
  * bytes. Return the number of bytes written on success; -1 if
@@ -184,10 +226,10 @@ base64_encode(char *dest, size_t destlen, const char *src, size_t srclen,
   const unsigned char *usrc = (unsigned char *)src;
   const unsigned char *eous = usrc + srclen;
   char *d = dest;
-  uint32_t n = 0;
-  size_t linelen = 0;
+  char *line_start;
+  uint32_t n;
+  size_t n_groups;
   size_t enclen;
-  int n_idx = 0;
 
   if (!src || !dest)
     return -1;
@@ -204,42 +246,23 @@ base64_encode(char *dest, size_t destlen, const char *src, size_t srclen,
   /* Make sure we leave no uninitialized data in the destination buffer. */
   memset(dest, 0, destlen);
 
-  /* XXX/Yawning: If this ends up being too slow, this can be sped up
-   * by separating the multiline format case and the normal case, and
-   * processing 48 bytes of input at a time when newlines are desired.
-   */
-#define ENCODE_CHAR(ch) \
-  STMT_BEGIN                                                    \
-    *d++ = ch;                                                  \
-    if (flags & BASE64_ENCODE_MULTILINE) {                      \
-      if (++linelen % BASE64_OPENSSL_LINELEN == 0) {            \
-        linelen = 0;                                            \
-        *d++ = '\n';                                            \
-      }                                                         \
-    }                                                           \
-  STMT_END
-
-#define ENCODE_N(idx) \
-  ENCODE_CHAR(base64_encode_table[(n >> ((3 - idx) * 6)) & 0x3f])
-
-#define ENCODE_PAD() ENCODE_CHAR('=')
-
-  /* Iterate over all the bytes in src.  Each one will add 8 bits to the
-   * value we're encoding.  Accumulate bits in <b>n</b>, and whenever we
-   * have 24 bits, batch them into 4 bytes and flush those bytes to dest.
-   */
-  for ( ; usrc < eous; ++usrc) {
-    n = (n << 8) | *usrc;
-    if ((++n_idx) == 3) {
-      ENCODE_N(0);
-      ENCODE_N(1);
-      ENCODE_N(2);
-      ENCODE_N(3);
-      n_idx = 0;
-      n = 0;
+  /* In the multiline format, every 48 bytes of input make one full line of
+   * output, so we can encode those a line at a time. */
+  if (flags & BASE64_ENCODE_MULTILINE) {
+    while (eous - usrc >= BASE64_OPENSSL_LINE_BYTES) {
+      d = base64_encode_groups_(d, usrc, BASE64_OPENSSL_LINE_BYTES / 3);
+      usrc += BASE64_OPENSSL_LINE_BYTES;
+      *d++ = '\n';
     }
   }
-  switch (n_idx) {
+  line_start = d;
+
+  /* Encode every whole group of 3 bytes that remains. */
+  n_groups = (eous - usrc) / 3;
+  d = base64_encode_groups_(d, usrc, n_groups);
+  usrc += n_groups * 3;
+
+  switch (eous - usrc) {
   case 0:
     /* 0 leftover bits, no pading to add. */
     break;
@@ -247,21 +270,21 @@ base64_encode(char *dest, size_t destlen, const char *src, size_t srclen,
     /* 8 leftover bits, pad to 12 bits, write the 2 6-bit values followed
      * by 2 padding characters.
      */
-    n <<= 4;
-    ENCODE_N(2);
-    ENCODE_N(3);
-    ENCODE_PAD();
-    ENCODE_PAD();
+    n = (uint32_t)usrc[0] << 16;
+    *d++ = base64_encode_table[n >> 18];
+    *d++ = base64_encode_table[(n >> 12) & 0x3f];
+    *d++ = '=';
+    *d++ = '=';
     break;
   case 2:
     /* 16 leftover bits, pad to 18 bits, write the 3 6-bit values followed
      * by 1 padding character.
      */
-    n <<= 2;
-    ENCODE_N(1);
-    ENCODE_N(2);
-    ENCODE_N(3);
-    ENCODE_PAD();
+    n = ((uint32_t)usrc[0] << 16) | ((uint32_t)usrc[1] << 8);
+    *d++ = base64_encode_table[n >> 18];
+    *d++ = base64_encode_table[(n >> 12) & 0x3f];
+    *d++ = base64_encode_table[(n >> 6) & 0x3f];
+    *d++ = '=';
     break;
   default:
     /* Something went catastrophically wrong. */
@@ -269,12 +292,8 @@ base64_encode(char *dest, size_t destlen, const char *src, size_t srclen,
     return -1;
   }
 
-#undef ENCODE_N
-#undef ENCODE_PAD
-#undef ENCODE_CHAR
-
   /* Multiline output always includes at least one newline. */
-  if (flags & BASE64_ENCODE_MULTILINE && linelen != 0)
+  if (flags & BASE64_ENCODE_MULTILINE && d != line_start)
     *d++ = '\n';
 
   tor_assert(d - dest == (ptrdiff_t)enclen);
@@ -343,6 +362,7 @@ base64_decode_nopad(uint8_t *dest, size_t destlen,
   return n;
 }
 
+#undef BASE64_OPENSSL_LINE_BYTES
 #undef BASE64_OPENSSL_LINELEN
 
 /** @{ */
@@ -411,8 +431,34 @@ base64_decode(char *dest, size_t destlen, const char *src, size_t srclen)
    * 24 bits, batch them into 3 bytes and flush those bytes to dest.
    */
   for ( ; src < eos; ++src) {
-    unsigned char c = (unsigned char) *src;
-    uint8_t v = base64_decode_table[c];
+    unsigned char c;
+    uint8_t v;
+    if (n_idx == 0) {
+      /* Most of our input is long runs of base64 characters: decode them
+       * 4 at a time until we hit anything else, which is the only case
+       * that needs the per-character logic below.  (SP, PAD, and X all
+       * have one of the top two bits set.) */
+      const unsigned char *us = (const unsigned char *) src;
+      while (eos - src >= 4) {
+        uint8_t v0 = base64_decode_table[us[0]];
+        uint8_t v1 = base64_decode_table[us[1]];
+        uint8_t v2 = base64_decode_table[us[2]];
+        uint8_t v3 = base64_decode_table[us[3]];
+        if ((v0 | v1 | v2 | v3) & 0xc0)
+          break;
+        n = ((uint32_t)v0 << 18) | ((uint32_t)v1 << 12) | (v2 << 6) | v3;
+        *dest++ = (n>>16);
+        *dest++ = (n>>8) & 0xff;
+        *dest++ = (n) & 0xff;
+        src += 4;
+        us += 4;
+      }
+      n = 0;
+      if (src == eos)
+        break;
+    }
+    c = (unsigned char) *src;
+    v = base64_decode_table[c];
     switch (v) {
       case X:
         /* This character isn't allowed in base64. */
@@ -465,6 +511,31 @@ base64_decode(char *dest, size_t destlen, const char *src, size_t srclen)
 #undef SP
 #undef PAD
 
+/** @{ */
+/** Special value used for the base16_decode_table */
+#define X 255
+/** @} */
+/** Internal table mapping byte values to the hex digit they represent.
+ * Xs are not hex digits. */
+static const uint8_t base16_decode_table[256] = {
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  0, 1, 2, 3, 4, 5, 6, 7, 8, 9, X, X, X, X, X, X,
+  X, 10, 11, 12, 13, 14, 15, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, 10, 11, 12, 13, 14, 15, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+  X, X, X, X, X, X, X, X, X, X, X, X, X, X, X, X,
+};
+
 /** Encode the <b>srclen</b> bytes at <b>src</b> in a NUL-terminated,
  * uppercase hexadecimal string; store it in the <b>destlen</b>-byte buffer
  * <b>dest</b>.
@@ -495,26 +566,8 @@ base16_encode(char *dest, size_t destlen, const char *src, size_t srclen)
 static inline int
 hex_decode_digit_(char c)
 {
-  switch (c) {
-    case '0': return 0;
-    case '1': return 1;
-    case '2': return 2;
-    case '3': return 3;
-    case '4': return 4;
-    case '5': return 5;
-    case '6': return 6;
-    case '7': return 7;
-    case '8': return 8;
-    case '9': return 9;
-    case 'A': case 'a': return 10;
-    case 'B': case 'b': return 11;
-    case 'C': case 'c': return 12;
-    case 'D': case 'd': return 13;
-    case 'E': case 'e': return 14;
-    case 'F': case 'f': return 15;
-    default:
-      return -1;
-  }
+  uint8_t v = base16_decode_table[(uint8_t)c];
+  return v == X ? -1 : v;
 }
 
 /** Helper: given a hex digit, return its value, or -1 if it isn't hex. */
@@ -546,9 +599,9 @@ base16_decode(char *dest, size_t destlen, const char *src, size_t srclen)
 
   end = src+srclen;
   while (src<end) {
-    v1 = hex_decode_digit_(*src);
-    v2 = hex_decode_digit_(*(src+1));
-    if (v1<0||v2<0)
+    v1 = base16_decode_table[*(const uint8_t*)src];
+    v2 = base16_decode_table[*(const uint8_t*)(src+1)];
+    if ((v1|v2) == X)
       return -1;
     *(uint8_t*)dest = (v1<<4)|v2;
     ++dest;
@@ -559,4 +612,5 @@ base16_decode(char *dest, size_t destlen, const char *src, size_t srclen)
 
   return (int) (dest-dest_orig);
 }
+#undef X
 
@@ -12,6 +12,18 @@
  * is a workqueue_entry_t, containing data to process and a function to
  * process it with.
  *
+ * Pending work is spread across several work queue "shards", one for each
+ * worker thread, each with its own lock.  A worker takes work from its own
+ * shard first, and steals work from the other shards when its own is empty,
+ * so that busy workers only contend with the main thread and with each
+ * other on a per-shard basis.
+ *
+ * Each shard has a queue for every workqueue_priority_t.  Workers take
+ * work from the highest-priority nonempty queue in any shard, except that
+ * one take in every WORKQUEUE_STARVATION_INTERVAL goes to the
+ * lowest-priority nonempty queue instead, so that a steady stream of
+ * urgent work can delay background work but never stop it.
+ *
  * The main thread informs the worker threads of pending work by using a
  * condition variable.  The workers inform the main process of completed work
  * by using an alert_sockets_t object, as implemented in compat_threads.c.
@@ -19,27 +31,58 @@
  * The main thread can also queue an "update" that will be handled by all the
  * workers.  This is useful for updating state that all the workers share.
  *
+ * A pool may be allowed to change size between a minimum and a maximum
+ * number of threads: see threadpool_set_size_limits().  When every worker
+ * is busy and the oldest item in a shard has been waiting for
+ * WORKQUEUE_GROW_DELAY_MSEC, queueing more work starts another thread;
+ * threads that find nothing to do for WORKQUEUE_IDLE_TIMEOUT_SEC exit
+ * while there are more than the minimum.  The slot of a thread that has
+ * exited can be reused by the next one we start.
+ *
  * In Tor today, there is currently only one thread pool, used in cpuworker.c.
  */
 
 #include "orconfig.h"
 #include "compat.h"
 #include "compat_threads.h"
+#include "latency_trace.h"
+#include "memarea.h"
 #include "util.h"
 #include "workqueue.h"
 #include "tor_queue.h"
 #include "torlog.h"
 
+/** One shard of a threadpool's pending work. */
+typedef struct workqueue_shard_s {
+  /** Mutex to protect all the fields of this shard, and the pending field of
+   * every entry on it. */
+  tor_mutex_t lock;
+  /** Queues of pending work in this shard, one for each priority. */
+  TOR_TAILQ_HEAD(, workqueue_entry_s) work[WORKQUEUE_N_PRIORITIES];
+  /** Number of entries in each element of work. */
+  int depth[WORKQUEUE_N_PRIORITIES];
+  /** Copy of the threadpool's update generation, so that workers can notice
+   * a pending update without taking the threadpool's lock. */
+  unsigned generation;
+} workqueue_shard_t;
+
 struct threadpool_s {
-  /** An array of pointers to workerthread_t: one for each running worker
-   * thread. */
+  /** An array of pointers to workerthread_t: one for each worker thread we
+   * have started, including ones that have since exited. */
   struct workerthread_s **threads;
 
   /** Condition variable that we wait on when we have no work, and which
-   * gets signaled when our queue becomes nonempty. */
+   * gets signaled when any of our shards becomes nonempty. */
   tor_cond_t condition;
-  /** Queue of pending work that we have to do. */
-  TOR_TAILQ_HEAD(, workqueue_entry_s) work;
+  /** Array of n_shards queues of pending work that we have to do. */
+  workqueue_shard_t *shards;
+  /** Number of elements in shards. Fixed when the pool is created. */
+  int n_shards;
+  /** Index of the shard that will receive the next piece of work. */
+  int next_shard;
+  /** How many items of work of each priority have been queued on this
+   * pool? */
+  uint64_t n_queued[WORKQUEUE_N_PRIORITIES];
 
   /** The current 'update generation' of the threadpool.  Any thread that is
    * at an earlier generation needs to run the update function. */
@@ -49,12 +92,36 @@ struct threadpool_s {
   workqueue_reply_t (*update_fn)(void *, void *);
   /** Function to free update arguments if they can't be run. */
   void (*free_update_arg_fn)(void *);
-  /** Array of n_threads update arguments. */
+  /** Array of n_update_args update arguments, indexed by thread index. */
   void **update_args;
+  /** Number of elements in update_args. */
+  int n_update_args;
 
   /** Number of elements in threads. */
   int n_threads;
-  /** Mutex to protect all the above fields. */
+  /** Number of threads in threads that haven't exited. */
+  int n_running;
+  /** Number of running threads waiting on condition for work. */
+  int n_idle;
+  /** We keep between min_threads and max_threads threads running. */
+  int min_threads;
+  int max_threads;
+  /** When did we last start a thread because work was waiting? */
+  monotime_coarse_t last_grown;
+  /** True iff a worker has exited because a work or update function told it
+   * to; once that has happened, we start no more threads. */
+  unsigned stopped : 1;
+
+  /** Array of n_cpus CPU numbers that the workers should run on: worker i
+   * runs on cpus[i % n_cpus].  If n_cpus is 0, workers may run anywhere. */
+  int *cpus;
+  int n_cpus;
+  /** Incremented whenever cpus changes, so that each worker can notice and
+   * rebind itself. */
+  unsigned cpu_generation;
+
+  /** Mutex to protect all the above fields except for the contents of
+   * shards. When holding both, acquire this lock first. */
   tor_mutex_t lock;
 
   /** A reply queue to use when constructing new threads. */
@@ -64,6 +131,9 @@ struct threadpool_s {
   void *(*new_thread_state_fn)(void*);
   void (*free_thread_state_fn)(void*);
   void *new_thread_state_arg;
+  /** Function for each worker thread to call just before it exits, or
+   * NULL. */
+  void (*thread_exit_fn)(void);
 };
 
 struct workqueue_entry_s {
@@ -74,8 +144,15 @@ struct workqueue_entry_s {
    * is set when the workqueue_entry_t is created, and won't be cleared until
    * after it's handled in the main thread. */
   struct threadpool_s *on_pool;
+  /** The shard on which this entry is pending.  Only meaningful while
+   * pending is true. */
+  workqueue_shard_t *on_shard;
   /** True iff this entry is waiting for a worker to start processing it. */
   uint8_t pending;
+  /** The workqueue_priority_t of this entry. */
+  uint8_t priority;
+  /** When was this entry queued? */
+  monotime_coarse_t queued_at;
   /** Function to run in the worker thread. */
   workqueue_reply_t (*fn)(void *state, void *arg);
   /** Function to run while processing the reply queue. */
@@ -90,15 +167,23 @@ struct replyqueue_s {
   /** Doubly-linked list of answers that the reply queue needs to handle. */
   TOR_TAILQ_HEAD(, workqueue_entry_s) answers;
 
+  /** Number of times replyqueue_process() has run.  Only touched from the
+   * main thread. */
+  uint64_t n_wakeups;
+  /** Number of replies that replyqueue_process() has handled.  Only touched
+   * from the main thread. */
+  uint64_t n_replies;
+
   /** Mechanism to wake up the main thread when it is receiving answers. */
   alert_sockets_t alert;
 };
 
 /** A worker thread represents a single thread in a thread pool.  To avoid
- * contention, each gets its own queue. This breaks the guarantee that that
- * queued work will get executed strictly in order. */
+ * contention, each gets its own shard of the work queue. This breaks the
+ * guarantee that that queued work will get executed strictly in order. */
 typedef struct workerthread_s {
-  /** Which thread it this?  In range 0..in_pool->n_threads-1 */
+  /** Which thread it this?  In range 0..in_pool->n_threads-1.  A thread
+   * that replaces one that has exited takes its index. */
   int index;
   /** The pool this thread is a part of. */
   struct threadpool_s *in_pool;
@@ -109,9 +194,35 @@ typedef struct workerthread_s {
   replyqueue_t *reply_queue;
   /** The current update generation of this thread */
   unsigned generation;
+  /** The value of the pool's cpu_generation when this thread last bound
+   * itself to a CPU.  Protected by the pool's lock. */
+  unsigned cpu_generation;
+  /** The CPU this thread was running on when it last went idle, or -1 if
+   * unknown.  Protected by the pool's lock. */
+  int last_cpu;
+  /** How many items of work has this thread taken?  Only used by the thread
+   * itself, to decide when to look at low-priority work first. */
+  unsigned n_taken;
+  /** True iff this thread has exited.  Protected by the pool's lock. */
+  unsigned dead : 1;
 } workerthread_t;
 
+/** One in this many of a worker's takes looks at the lowest-priority work
+ * first. */
+#define WORKQUEUE_STARVATION_INTERVAL 16
+
+/** When every worker is busy, start another thread once queued work has
+ * waited this long, and at most this often. */
+#define WORKQUEUE_GROW_DELAY_MSEC 10
+/** A worker that has had nothing to do for this long exits, if there are
+ * more than the minimum. */
+#define WORKQUEUE_IDLE_TIMEOUT_SEC 60
+
 static void queue_reply(replyqueue_t *queue, workqueue_entry_t *work);
+static int threadpool_start_thread(threadpool_t *pool);
+static int threadpool_should_grow(threadpool_t *pool,
+                                  workqueue_shard_t *shard,
+                                  const monotime_coarse_t *now);
 
 /** Allocate and return a new workqueue_entry_t, set up to run the function
  * <b>fn</b> in the worker thread, and <b>reply_fn</b> in the main
@@ -160,13 +271,15 @@ workqueue_entry_cancel(workqueue_entry_t *ent)
 {
   int cancelled = 0;
   void *result = NULL;
-  tor_mutex_acquire(&ent->on_pool->lock);
+  workqueue_shard_t *shard = ent->on_shard;
+  tor_mutex_acquire(&shard->lock);
   if (ent->pending) {
-    TOR_TAILQ_REMOVE(&ent->on_pool->work, ent, next_work);
+    TOR_TAILQ_REMOVE(&shard->work[ent->priority], ent, next_work);
+    --shard->depth[ent->priority];
     cancelled = 1;
     result = ent->arg;
   }
-  tor_mutex_release(&ent->on_pool->lock);
+  tor_mutex_release(&shard->lock);
 
   if (cancelled) {
     workqueue_entry_free(ent);
@@ -174,14 +287,138 @@ workqueue_entry_cancel(workqueue_entry_t *ent)
   return result;
 }
 
-/**DOCDOC
+/** Return the argument that was passed along with the work in <b>ent</b>.
+ * Like workqueue_entry_cancel(), this must not be called once the reply
+ * function for <b>ent</b> has run. */
+void *
+workqueue_entry_get_arg(workqueue_entry_t *ent)
+{
+  /* This never changes after the entry is queued, so it's safe to read
+   * without the lock. */
+  return ent->arg;
+}
 
-   must hold lock */
+/** Return true iff <b>thread</b> has an update to run, or there is any
+ * pending work in its pool.
+ *
+ * The caller must hold the pool's lock. */
 static int
 worker_thread_has_work(workerthread_t *thread)
 {
-  return !TOR_TAILQ_EMPTY(&thread->in_pool->work) ||
-    thread->generation != thread->in_pool->generation;
+  threadpool_t *pool = thread->in_pool;
+  int i, prio, found = 0;
+  if (thread->generation != pool->generation)
+    return 1;
+  for (i = 0; i < pool->n_shards && !found; ++i) {
+    workqueue_shard_t *shard = &pool->shards[i];
+    tor_mutex_acquire(&shard->lock);
+    for (prio = 0; prio < WORKQUEUE_N_PRIORITIES && !found; ++prio)
+      found = !TOR_TAILQ_EMPTY(&shard->work[prio]);
+    tor_mutex_release(&shard->lock);
+  }
+  return found;
+}
+
+/** Try to take the first pending item of work with priority <b>prio</b>
+ * from <b>shard</b> on behalf of <b>thread</b>.  On success, return it.  If
+ * there is none, return NULL.  If <b>thread</b> must run an update before
+ * it does any more work, set *<b>update_out</b> to 1 and return NULL. */
+static workqueue_entry_t *
+worker_thread_take_work(workerthread_t *thread, workqueue_shard_t *shard,
+                        int prio, int *update_out)
+{
+  workqueue_entry_t *work = NULL;
+  tor_mutex_acquire(&shard->lock);
+  if (shard->generation != thread->generation) {
+    /* We check this on every shard, not just our own, so that we can never
+     * run work that was queued after an update we haven't seen yet. */
+    *update_out = 1;
+  } else if ((work = TOR_TAILQ_FIRST(&shard->work[prio]))) {
+    TOR_TAILQ_REMOVE(&shard->work[prio], work, next_work);
+    --shard->depth[prio];
+    work->pending = 0;
+  }
+  tor_mutex_release(&shard->lock);
+  return work;
+}
+
+/** Find the next piece of work for <b>thread</b>: the oldest item of the
+ * highest priority that any shard has, looking at its own shard before the
+ * others'.  Now and then, look at priorities from the lowest up instead.
+ * Arguments and return value are as for worker_thread_take_work(). */
+static workqueue_entry_t *
+worker_thread_find_work(workerthread_t *thread, int *update_out)
+{
+  threadpool_t *pool = thread->in_pool;
+  const int n_shards = pool->n_shards;
+  const int first = thread->index % n_shards;
+  const int lowest_first =
+    (++thread->n_taken % WORKQUEUE_STARVATION_INTERVAL) == 0;
+  int i, p;
+  for (p = 0; p < WORKQUEUE_N_PRIORITIES; ++p) {
+    const int prio = lowest_first ? WORKQUEUE_N_PRIORITIES - 1 - p : p;
+    for (i = 0; i < n_shards; ++i) {
+      workqueue_shard_t *shard = &pool->shards[(first + i) % n_shards];
+      workqueue_entry_t *work = worker_thread_take_work(thread, shard,
+                                                        prio, update_out);
+      if (work || *update_out)
+        return work;
+    }
+  }
+  return NULL;
+}
+
+/** If the CPUs assigned to <b>thread</b>'s pool have changed, bind
+ * <b>thread</b> to its new CPU; then note which CPU it is running on.
+ *
+ * Must be called from <b>thread</b> itself, with the pool's lock held. */
+static void
+worker_thread_update_cpu(workerthread_t *thread)
+{
+  threadpool_t *pool = thread->in_pool;
+  if (thread->cpu_generation != pool->cpu_generation) {
+    thread->cpu_generation = pool->cpu_generation;
+    if (pool->n_cpus)
+      tor_set_current_thread_cpu(pool->cpus[thread->index % pool->n_cpus]);
+    else
+      tor_set_current_thread_cpu(-1);
+  }
+  thread->last_cpu = tor_get_current_cpu();
+}
+
+/** Called by <b>thread</b>, with the pool's lock held, when it is about to
+ * exit.  If <b>stopped</b>, it is exiting because a work or update function
+ * told it to.  Otherwise it is retiring because the pool has threads to
+ * spare: return its state, which the caller must free.
+ *
+ * Once the caller has released the lock, the pool may reuse the thread's
+ * slot, so the caller must not touch <b>thread</b> again. */
+static void *
+worker_thread_note_exit(workerthread_t *thread, int stopped)
+{
+  threadpool_t *pool = thread->in_pool;
+  void *state = NULL;
+
+  thread->dead = 1;
+  --pool->n_running;
+  if (stopped) {
+    pool->stopped = 1;
+  } else {
+    state = thread->state;
+    thread->state = NULL;
+  }
+  return state;
+}
+
+/** Release the storage that the calling worker thread holds for itself,
+ * just before it exits: its memarea freelist, and whatever
+ * <b>exit_fn</b> releases, if it is set. */
+static void
+worker_thread_release_locals(void (*exit_fn)(void))
+{
+  memarea_clear_freelist();
+  if (exit_fn)
+    exit_fn();
 }
 
 /**
@@ -194,36 +431,39 @@ worker_thread_main(void *thread_)
   threadpool_t *pool = thread->in_pool;
   workqueue_entry_t *work;
   workqueue_reply_t result;
+  void (*exit_fn)(void);
+  const struct timeval idle_timeout = { WORKQUEUE_IDLE_TIMEOUT_SEC, 0 };
 
-  tor_mutex_acquire(&pool->lock);
   while (1) {
-    /* lock must be held at this point. */
-    while (worker_thread_has_work(thread)) {
-      /* lock must be held at this point. */
-      if (thread->in_pool->generation != thread->generation) {
-        void *arg = thread->in_pool->update_args[thread->index];
-        thread->in_pool->update_args[thread->index] = NULL;
-        workqueue_reply_t (*update_fn)(void*,void*) =
-            thread->in_pool->update_fn;
-        thread->generation = thread->in_pool->generation;
-        tor_mutex_release(&pool->lock);
+    int need_update = 0;
+    /* No lock is held at this point. */
+    work = worker_thread_find_work(thread, &need_update);
 
-        workqueue_reply_t r = update_fn(thread->state, arg);
+    if (need_update) {
+      tor_mutex_acquire(&pool->lock);
+      /* Threads start at the current generation, so we were running when
+       * this update was queued, and have a slot in update_args. */
+      void *arg = pool->update_args[thread->index];
+      pool->update_args[thread->index] = NULL;
+      workqueue_reply_t (*update_fn)(void*,void*) = pool->update_fn;
+      thread->generation = pool->generation;
+      tor_mutex_release(&pool->lock);
 
-        if (r != WQ_RPL_REPLY) {
-          return;
-        }
+      workqueue_reply_t r = update_fn(thread->state, arg);
 
+      if (r != WQ_RPL_REPLY) {
         tor_mutex_acquire(&pool->lock);
-        continue;
+        worker_thread_note_exit(thread, 1);
+        exit_fn = pool->thread_exit_fn;
+        tor_mutex_release(&pool->lock);
+        worker_thread_release_locals(exit_fn);
+        return;
       }
-      work = TOR_TAILQ_FIRST(&pool->work);
-      TOR_TAILQ_REMOVE(&pool->work, work, next_work);
-      work->pending = 0;
-      tor_mutex_release(&pool->lock);
+      continue;
+    }
 
-      /* We run the work function without holding the thread lock. This
-       * is the main thread's first opportunity to give us more work. */
+    if (work) {
+      /* We run the work function without holding any lock. */
       result = work->fn(thread->state, work->arg);
 
       /* Queue the reply for the main thread. */
@@ -231,19 +471,50 @@ worker_thread_main(void *thread_)
 
       /* We may need to exit the thread. */
       if (result != WQ_RPL_REPLY) {
+        tor_mutex_acquire(&pool->lock);
+        worker_thread_note_exit(thread, 1);
+        exit_fn = pool->thread_exit_fn;
+        tor_mutex_release(&pool->lock);
+        worker_thread_release_locals(exit_fn);
         return;
       }
-      tor_mutex_acquire(&pool->lock);
+      continue;
     }
-    /* At this point the lock is held, and there is no work in this thread's
-     * queue. */
+
+    /* There was no work in any shard when we looked. */
 
     /* TODO: support an idle-function */
 
-    /* Okay. Now, wait till somebody has work for us. */
-    if (tor_cond_wait(&pool->condition, &pool->lock, NULL) < 0) {
-      log_warn(LD_GENERAL, "Fail tor_cond_wait.");
+    /* Okay. Now, wait till somebody has work for us. Since work is always
+     * queued with the pool lock held, checking again with the lock held
+     * means we can't miss a wakeup. */
+    tor_mutex_acquire(&pool->lock);
+    worker_thread_update_cpu(thread);
+    if (! worker_thread_has_work(thread)) {
+      int r = 0;
+      if (pool->n_running <= pool->max_threads) {
+        ++pool->n_idle;
+        r = tor_cond_wait(&pool->condition, &pool->lock,
+                          pool->n_running > pool->min_threads ?
+                          &idle_timeout : NULL);
+        --pool->n_idle;
+        if (r < 0)
+          log_warn(LD_GENERAL, "Fail tor_cond_wait.");
+      }
+      /* Retire if there are too many of us, or if we timed out with
+       * nothing to do and there are more of us than we need. */
+      if (pool->n_running > pool->max_threads ||
+          (r == 1 && pool->n_running > pool->min_threads &&
+           ! worker_thread_has_work(thread))) {
+        void *state = worker_thread_note_exit(thread, 0);
+        exit_fn = pool->thread_exit_fn;
+        tor_mutex_release(&pool->lock);
+        pool->free_thread_state_fn(state);
+        worker_thread_release_locals(exit_fn);
+        return;
+      }
     }
+    tor_mutex_release(&pool->lock);
   }
 }
 
@@ -265,12 +536,20 @@ queue_reply(replyqueue_t *queue, workqueue_entry_t *work)
   }
 }
 
-/** Allocate and start a new worker thread to use state object <b>state</b>,
- * and send responses to <b>replyqueue</b>. */
+/** Allocate and start a new worker thread with index <b>index</b> to use
+ * state object <b>state</b>, and send responses to <b>replyqueue</b>.
+ *
+ * Must be called with the pool's lock held.  The new thread starts at the
+ * pool's current update generation: its state is newly made, so it doesn't
+ * need any update that was queued before now. */
 static workerthread_t *
-workerthread_new(void *state, threadpool_t *pool, replyqueue_t *replyqueue)
+workerthread_new(void *state, threadpool_t *pool, replyqueue_t *replyqueue,
+                 int index)
 {
   workerthread_t *thr = tor_malloc_zero(sizeof(workerthread_t));
+  thr->index = index;
+  thr->generation = pool->generation;
+  thr->last_cpu = -1;
   thr->state = state;
   thr->reply_queue = replyqueue;
   thr->in_pool = pool;
@@ -303,20 +582,47 @@ workerthread_new(void *state, threadpool_t *pool, replyqueue_t *replyqueue)
  *
  * Note that because each thread has its own work queue, work items may not
  * be executed strictly in order.
+ *
+ * The work is queued at priority <b>prio</b>: see workqueue_priority_t.
  */
 workqueue_entry_t *
-threadpool_queue_work(threadpool_t *pool,
-                      workqueue_reply_t (*fn)(void *, void *),
-                      void (*reply_fn)(void *),
-                      void *arg)
+threadpool_queue_work_priority(threadpool_t *pool,
+                               workqueue_priority_t prio,
+                               workqueue_reply_t (*fn)(void *, void *),
+                               void (*reply_fn)(void *),
+                               void *arg)
 {
-  workqueue_entry_t *ent = workqueue_entry_new(fn, reply_fn, arg);
+  workqueue_entry_t *ent;
+  workqueue_shard_t *shard;
+  tor_assert((unsigned)prio < WORKQUEUE_N_PRIORITIES);
+  ent = workqueue_entry_new(fn, reply_fn, arg);
   ent->on_pool = pool;
   ent->pending = 1;
+  ent->priority = prio;
+
+  monotime_coarse_get(&ent->queued_at);
 
   tor_mutex_acquire(&pool->lock);
 
-  TOR_TAILQ_INSERT_TAIL(&pool->work, ent, next_work);
+  shard = &pool->shards[pool->next_shard];
+  if (++pool->next_shard == pool->n_shards)
+    pool->next_shard = 0;
+  ent->on_shard = shard;
+  ++pool->n_queued[prio];
+
+  tor_mutex_acquire(&shard->lock);
+  TOR_TAILQ_INSERT_TAIL(&shard->work[prio], ent, next_work);
+  ++shard->depth[prio];
+  if (pool->n_idle == 0 && pool->n_running < pool->max_threads &&
+      !pool->stopped &&
+      threadpool_should_grow(pool, shard, &ent->queued_at)) {
+    monotime_coarse_t now = ent->queued_at;
+    tor_mutex_release(&shard->lock);
+    if (threadpool_start_thread(pool) == 0)
+      pool->last_grown = now;
+  } else {
+    tor_mutex_release(&shard->lock);
+  }
 
   tor_cond_signal_one(&pool->condition);
 
@@ -325,6 +631,19 @@ threadpool_queue_work(threadpool_t *pool,
   return ent;
 }
 
+/**
+ * As threadpool_queue_work_priority(), at priority WQ_PRI_HIGH.
+ */
+workqueue_entry_t *
+threadpool_queue_work(threadpool_t *pool,
+                      workqueue_reply_t (*fn)(void *, void *),
+                      void (*reply_fn)(void *),
+                      void *arg)
+{
+  return threadpool_queue_work_priority(pool, WQ_PRI_HIGH,
+                                        fn, reply_fn, arg);
+}
+
 /**
  * Queue a copy of a work item for every thread in a pool.  This can be used,
  * for example, to tell the threads to update some parameter in their states.
@@ -336,7 +655,9 @@ threadpool_queue_work(threadpool_t *pool,
  * UPDATE FUNCTIONS MUST BE IDEMPOTENT.  We do not guarantee that every update
  * will be run.  If a new update is scheduled before the old update finishes
  * running, then the new will replace the old in any threads that haven't run
- * it yet.
+ * it yet.  Threads that the pool starts later don't run it at all: their
+ * states come from the pool's new_thread_state_fn, which must make states
+ * that are already up to date.
  *
  * Return 0 on success, -1 on failure.
  */
@@ -347,7 +668,7 @@ threadpool_queue_update(threadpool_t *pool,
                          void (*free_fn)(void *),
                          void *arg)
 {
-  int i, n_threads;
+  int i, n_threads, n_old_args;
   void (*old_args_free_fn)(void *arg);
   void **old_args;
   void **new_args;
@@ -355,10 +676,13 @@ threadpool_queue_update(threadpool_t *pool,
   tor_mutex_acquire(&pool->lock);
   n_threads = pool->n_threads;
   old_args = pool->update_args;
+  n_old_args = pool->n_update_args;
   old_args_free_fn = pool->free_update_arg_fn;
 
   new_args = tor_calloc(n_threads, sizeof(void*));
   for (i = 0; i < n_threads; ++i) {
+    if (pool->threads[i]->dead)
+      continue;
     if (dup_fn)
       new_args[i] = dup_fn(arg);
     else
@@ -366,16 +690,24 @@ threadpool_queue_update(threadpool_t *pool,
   }
 
   pool->update_args = new_args;
+  pool->n_update_args = n_threads;
   pool->free_update_arg_fn = free_fn;
   pool->update_fn = fn;
   ++pool->generation;
 
+  for (i = 0; i < pool->n_shards; ++i) {
+    workqueue_shard_t *shard = &pool->shards[i];
+    tor_mutex_acquire(&shard->lock);
+    shard->generation = pool->generation;
+    tor_mutex_release(&shard->lock);
+  }
+
   tor_cond_signal_all(&pool->condition);
 
   tor_mutex_release(&pool->lock);
 
   if (old_args) {
-    for (i = 0; i < n_threads; ++i) {
+    for (i = 0; i < n_old_args; ++i) {
       if (old_args[i] && old_args_free_fn)
         old_args_free_fn(old_args[i]);
     }
@@ -388,38 +720,88 @@ threadpool_queue_update(threadpool_t *pool,
 /** Don't have more than this many threads per pool. */
 #define MAX_THREADS 1024
 
-/** Launch threads until we have <b>n</b>. */
+/** Start one more worker thread in <b>pool</b>, in the slot of a thread
+ * that has exited if there is one.  Return 0 on success, -1 on failure.
+ * Must be called with the pool's lock held. */
+static int
+threadpool_start_thread(threadpool_t *pool)
+{
+  int i, index = -1;
+  void *state;
+  workerthread_t *thr;
+
+  for (i = 0; i < pool->n_threads; ++i) {
+    if (pool->threads[i]->dead) {
+      index = i;
+      break;
+    }
+  }
+  if (index < 0) {
+    if (pool->n_threads >= MAX_THREADS)
+      return -1;
+    index = pool->n_threads;
+  }
+
+  state = pool->new_thread_state_fn(pool->new_thread_state_arg);
+  thr = workerthread_new(state, pool, pool->reply_queue, index);
+  if (!thr) {
+    //LCOV_EXCL_START
+    tor_assert_nonfatal_unreached();
+    pool->free_thread_state_fn(state);
+    return -1;
+    //LCOV_EXCL_STOP
+  }
+
+  if (index == pool->n_threads) {
+    pool->threads = tor_reallocarray(pool->threads,
+                                     sizeof(workerthread_t*), index + 1);
+    ++pool->n_threads;
+  } else {
+    /* The thread that had this slot no longer touches it. */
+    tor_free(pool->threads[index]);
+  }
+  pool->threads[index] = thr;
+  ++pool->n_running;
+  return 0;
+}
+
+/** Launch threads until we have <b>n</b> running. */
 static int
 threadpool_start_threads(threadpool_t *pool, int n)
 {
+  int r = 0;
   if (BUG(n < 0))
     return -1; // LCOV_EXCL_LINE
   if (n > MAX_THREADS)
     n = MAX_THREADS;
 
   tor_mutex_acquire(&pool->lock);
-
-  if (pool->n_threads < n)
-    pool->threads = tor_reallocarray(pool->threads,
-                                     sizeof(workerthread_t*), n);
-
-  while (pool->n_threads < n) {
-    void *state = pool->new_thread_state_fn(pool->new_thread_state_arg);
-    workerthread_t *thr = workerthread_new(state, pool, pool->reply_queue);
-
-    if (!thr) {
-      //LCOV_EXCL_START
-      tor_assert_nonfatal_unreached();
-      pool->free_thread_state_fn(state);
-      tor_mutex_release(&pool->lock);
-      return -1;
-      //LCOV_EXCL_STOP
-    }
-    thr->index = pool->n_threads;
-    pool->threads[pool->n_threads++] = thr;
+  while (pool->n_running < n && !pool->stopped) {
+    if ((r = threadpool_start_thread(pool)) < 0)
+      break;
   }
   tor_mutex_release(&pool->lock);
 
+  return r;
+}
+
+/** Return true iff some work in <b>shard</b> has been waiting long enough
+ * at <b>now</b> that <b>pool</b> should start another thread.  Must be
+ * called with both the pool's lock and the shard's lock held. */
+static int
+threadpool_should_grow(threadpool_t *pool, workqueue_shard_t *shard,
+                       const monotime_coarse_t *now)
+{
+  int prio;
+  if (monotime_coarse_diff_msec(&pool->last_grown, now)
+      < WORKQUEUE_GROW_DELAY_MSEC)
+    return 0;
+  for (prio = 0; prio < WORKQUEUE_N_PRIORITIES; ++prio) {
+    workqueue_entry_t *oldest = TOR_TAILQ_FIRST(&shard->work[prio]);
+    if (oldest && monotime_coarse_diff_msec(&oldest->queued_at, now)
+                    >= WORKQUEUE_GROW_DELAY_MSEC)
+      return 1;
+  }
   return 0;
 }
 
@@ -438,19 +820,36 @@ threadpool_new(int n_threads,
                void *arg)
 {
   threadpool_t *pool;
+  int i;
   pool = tor_malloc_zero(sizeof(threadpool_t));
   tor_mutex_init_nonrecursive(&pool->lock);
   tor_cond_init(&pool->condition);
-  TOR_TAILQ_INIT(&pool->work);
+
+  pool->n_shards = n_threads;
+  if (pool->n_shards < 1)
+    pool->n_shards = 1;
+  if (pool->n_shards > MAX_THREADS)
+    pool->n_shards = MAX_THREADS;
+  pool->shards = tor_calloc(pool->n_shards, sizeof(workqueue_shard_t));
+  for (i = 0; i < pool->n_shards; ++i) {
+    int prio;
+    tor_mutex_init_nonrecursive(&pool->shards[i].lock);
+    for (prio = 0; prio < WORKQUEUE_N_PRIORITIES; ++prio)
+      TOR_TAILQ_INIT(&pool->shards[i].work[prio]);
+  }
 
   pool->new_thread_state_fn = new_thread_state_fn;
   pool->new_thread_state_arg = arg;
   pool->free_thread_state_fn = free_thread_state_fn;
   pool->reply_queue = replyqueue;
+  pool->min_threads = pool->max_threads = MIN(n_threads, MAX_THREADS);
 
   if (threadpool_start_threads(pool, n_threads) < 0) {
     //LCOV_EXCL_START
     tor_assert_nonfatal_unreached();
+    for (i = 0; i < pool->n_shards; ++i)
+      tor_mutex_uninit(&pool->shards[i].lock);
+    tor_free(pool->shards);
     tor_cond_uninit(&pool->condition);
     tor_mutex_uninit(&pool->lock);
     tor_free(pool);
@@ -461,6 +860,117 @@ threadpool_new(int n_threads,
   return pool;
 }
 
+/**
+ * Ask the workers in <b>pool</b> to run only on the <b>n_cpus</b> CPUs
+ * listed in <b>cpus</b>, assigned round-robin: worker i runs on
+ * cpus[i % n_cpus].  If <b>n_cpus</b> is 0, let them run anywhere.
+ *
+ * Each worker rebinds itself the next time it is idle; idle workers are
+ * woken to do so right away.
+ */
+void
+threadpool_set_cpus(threadpool_t *pool, const int *cpus, int n_cpus)
+{
+  tor_assert(n_cpus >= 0);
+  tor_mutex_acquire(&pool->lock);
+  tor_free(pool->cpus);
+  pool->n_cpus = n_cpus;
+  if (n_cpus)
+    pool->cpus = tor_memdup(cpus, sizeof(int) * n_cpus);
+  ++pool->cpu_generation;
+  tor_cond_signal_all(&pool->condition);
+  tor_mutex_release(&pool->lock);
+}
+
+/**
+ * Store in <b>cpus_out</b> the CPU that each of the first <b>max</b>
+ * workers in <b>pool</b> was running on when it last went idle, or -1 for
+ * workers where we don't know.  Return the number of entries stored.
+ */
+int
+threadpool_get_worker_cpus(threadpool_t *pool, int *cpus_out, int max)
+{
+  int i, n;
+  tor_mutex_acquire(&pool->lock);
+  n = 0;
+  for (i = 0; i < pool->n_threads && n < max; ++i) {
+    if (! pool->threads[i]->dead)
+      cpus_out[n++] = pool->threads[i]->last_cpu;
+  }
+  tor_mutex_release(&pool->lock);
+  return n;
+}
+
+/**
+ * Let <b>pool</b> run between <b>min_threads</b> and <b>max_threads</b>
+ * worker threads, growing when queued work has to wait and shrinking when
+ * workers are idle.  Start threads at once if there are fewer than
+ * <b>min_threads</b>; threads over <b>max_threads</b> exit when they are
+ * next idle.  Return 0 on success, -1 if we couldn't start a thread.
+ */
+int
+threadpool_set_size_limits(threadpool_t *pool, int min_threads,
+                           int max_threads)
+{
+  tor_assert(min_threads >= 1);
+  tor_assert(max_threads >= min_threads);
+  tor_mutex_acquire(&pool->lock);
+  pool->min_threads = MIN(min_threads, MAX_THREADS);
+  pool->max_threads = MIN(max_threads, MAX_THREADS);
+  /* Wake idle workers so that they notice any change in their timeout, or
+   * exit if there are now too many of them. */
+  tor_cond_signal_all(&pool->condition);
+  tor_mutex_release(&pool->lock);
+  return threadpool_start_threads(pool, min_threads);
+}
+
+/** Make every worker thread in <b>pool</b> call <b>fn</b> just before it
+ * exits, so that it can release anything it keeps for itself alone. */
+void
+threadpool_set_thread_exit_fn(threadpool_t *pool, void (*fn)(void))
+{
+  tor_mutex_acquire(&pool->lock);
+  pool->thread_exit_fn = fn;
+  tor_mutex_release(&pool->lock);
+}
+
+/** Return the number of worker threads running in <b>pool</b>. */
+int
+threadpool_get_n_threads(threadpool_t *pool)
+{
+  int n;
+  tor_mutex_acquire(&pool->lock);
+  n = pool->n_running;
+  tor_mutex_release(&pool->lock);
+  return n;
+}
+
+/**
+ * For each workqueue_priority_t, store in <b>depth_out</b> how many items
+ * of work of that priority are waiting in <b>pool</b>, and in
+ * <b>n_queued_out</b> how many have ever been queued.  Each array must
+ * have WORKQUEUE_N_PRIORITIES elements.
+ */
+void
+threadpool_get_queue_stats(threadpool_t *pool,
+                           int *depth_out, uint64_t *n_queued_out)
+{
+  int i, prio;
+  tor_mutex_acquire(&pool->lock);
+  for (prio = 0; prio < WORKQUEUE_N_PRIORITIES; ++prio) {
+    depth_out[prio] = 0;
+    n_queued_out[prio] = pool->n_queued[prio];
+  }
+  for (i = 0; i < pool->n_shards; ++i) {
+    workqueue_shard_t *shard = &pool->shards[i];
+    tor_mutex_acquire(&shard->lock);
+    for (prio = 0; prio < WORKQUEUE_N_PRIORITIES; ++prio)
+      depth_out[prio] += shard->depth[prio];
+    tor_mutex_release(&shard->lock);
+  }
+  tor_mutex_release(&pool->lock);
+}
+
 /** Return the reply queue associated with a given thread pool. */
 replyqueue_t *
 threadpool_get_replyqueue(threadpool_t *tp)
@@ -506,10 +1016,20 @@ replyqueue_get_socket(replyqueue_t *rq)
  * Process all pending replies on a reply queue. The main thread should call
  * this function every time the socket returned by replyqueue_get_socket() is
  * readable.
+ *
+ * Workers only alert the main thread when they add a reply to an empty
+ * queue, so a single call here may handle a whole burst of replies.  We
+ * take the entire pending list under one lock acquisition and run the
+ * reply functions without holding the lock.
  */
 void
 replyqueue_process(replyqueue_t *queue)
 {
+  TOR_TAILQ_HEAD(, workqueue_entry_s) batch;
+  workqueue_entry_t *work, *next;
+  LATENCY_TRACE_START(trace_start);
+
+  monotime_coarse_cache_clear();
   if (queue->alert.drain_fn(queue->alert.read_fd) < 0) {
     //LCOV_EXCL_START
     static ratelim_t warn_limit = RATELIM_INIT(7200);
@@ -519,20 +1039,40 @@ replyqueue_process(replyqueue_t *queue)
     //LCOV_EXCL_STOP
   }
 
+  TOR_TAILQ_INIT(&batch);
   tor_mutex_acquire(&queue->lock);
-  while (!TOR_TAILQ_EMPTY(&queue->answers)) {
-    /* lock must be held at this point.*/
-    workqueue_entry_t *work = TOR_TAILQ_FIRST(&queue->answers);
-    TOR_TAILQ_REMOVE(&queue->answers, work, next_work);
-    tor_mutex_release(&queue->lock);
+  if (!TOR_TAILQ_EMPTY(&queue->answers)) {
+    /* Move the whole list onto batch, fixing up the first entry's back
+     * pointer, and leave answers empty. */
+    batch.tqh_first = queue->answers.tqh_first;
+    batch.tqh_last = queue->answers.tqh_last;
+    batch.tqh_first->next_work.tqe_prev = &batch.tqh_first;
+    TOR_TAILQ_INIT(&queue->answers);
+  }
+  tor_mutex_release(&queue->lock);
+
+  ++queue->n_wakeups;
+  for (work = TOR_TAILQ_FIRST(&batch); work; work = next) {
+    next = TOR_TAILQ_NEXT(work, next_work);
     work->on_pool = NULL;
 
     work->reply_fn(work->arg);
     workqueue_entry_free(work);
-
-    tor_mutex_acquire(&queue->lock);
+    ++queue->n_replies;
   }
+  LATENCY_TRACE_END(trace_start, LT_REPLYQUEUE);
+}
 
-  tor_mutex_release(&queue->lock);
+/**
+ * Set *<b>n_wakeups_out</b> to the number of times <b>queue</b> has been
+ * processed, and *<b>n_replies_out</b> to the number of replies handled in
+ * those calls.  Only call this from the main thread.
+ */
+void
+replyqueue_get_stats(const replyqueue_t *queue,
+                     uint64_t *n_wakeups_out, uint64_t *n_replies_out)
+{
+  *n_wakeups_out = queue->n_wakeups;
+  *n_replies_out = queue->n_replies;
 }
 
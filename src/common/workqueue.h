@@ -15,6 +15,20 @@ typedef struct threadpool_s threadpool_t;
  * pool. */
 typedef struct workqueue_entry_s workqueue_entry_t;
 
+/** Priorities for work in a threadpool.  Workers take higher-priority work
+ * first, but now and then take work from the lowest-priority nonempty
+ * queue, so that nothing waits forever. */
+typedef enum {
+  /** Work that something on the network is waiting for, like handshakes. */
+  WQ_PRI_HIGH = 0,
+  /** Work that should happen soon, but that no client is waiting on. */
+  WQ_PRI_MED = 1,
+  /** Background work that can wait behind everything else. */
+  WQ_PRI_LOW = 2,
+} workqueue_priority_t;
+/** Number of values in workqueue_priority_t. */
+#define WORKQUEUE_N_PRIORITIES 3
+
 /** Possible return value from a work function: */
 typedef enum {
   WQ_RPL_REPLY = 0, /** indicates success */
@@ -27,6 +41,11 @@ workqueue_entry_t *threadpool_queue_work(threadpool_t *pool,
                                                                  void *),
                                          void (*reply_fn)(void *),
                                          void *arg);
+workqueue_entry_t *threadpool_queue_work_priority(threadpool_t *pool,
+                                    workqueue_priority_t prio,
+                                    workqueue_reply_t (*fn)(void *, void *),
+                                    void (*reply_fn)(void *),
+                                    void *arg);
 
 int threadpool_queue_update(threadpool_t *pool,
                             void *(*dup_fn)(void *),
@@ -34,16 +53,27 @@ int threadpool_queue_update(threadpool_t *pool,
                             void (*free_fn)(void *),
                             void *arg);
 void *workqueue_entry_cancel(workqueue_entry_t *pending_work);
+void *workqueue_entry_get_arg(workqueue_entry_t *ent);
 threadpool_t *threadpool_new(int n_threads,
                              replyqueue_t *replyqueue,
                              void *(*new_thread_state_fn)(void*),
                              void (*free_thread_state_fn)(void*),
                              void *arg);
 replyqueue_t *threadpool_get_replyqueue(threadpool_t *tp);
+void threadpool_set_cpus(threadpool_t *pool, const int *cpus, int n_cpus);
+int threadpool_get_worker_cpus(threadpool_t *pool, int *cpus_out, int max);
+int threadpool_set_size_limits(threadpool_t *pool, int min_threads,
+                               int max_threads);
+void threadpool_set_thread_exit_fn(threadpool_t *pool, void (*fn)(void));
+int threadpool_get_n_threads(threadpool_t *pool);
+void threadpool_get_queue_stats(threadpool_t *pool,
+                                int *depth_out, uint64_t *n_queued_out);
 
 replyqueue_t *replyqueue_new(uint32_t alertsocks_flags);
 tor_socket_t replyqueue_get_socket(replyqueue_t *rq);
 void replyqueue_process(replyqueue_t *queue);
+void replyqueue_get_stats(const replyqueue_t *queue,
+                         uint64_t *n_wakeups_out, uint64_t *n_replies_out);
 
 #endif
 
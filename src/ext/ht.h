@@ -576,6 +576,354 @@ ht_string_hash(const char *s)
     ++((head)->hth_n_entries);                              \
   }
 
+/*
+  Open-addressing hash tables.
+
+  The OAHT_* macros implement a second kind of hash table, for small
+  fixed-size elements that are cheap to copy (like a digest and a pointer).
+  Instead of chaining separately allocated nodes, the table stores the
+  elements themselves in one flat array of slots, with a parallel array of
+  one-byte control codes.  A control code says whether its slot is empty,
+  deleted, or full; for a full slot, it holds the low 7 bits of the
+  element's hash.  Lookups probe the slots in aligned groups of
+  OAHT_GROUP_LEN_, comparing all the control bytes of a group against the
+  target's hash bits at once, and only touch the slots whose bits match.
+
+  Because elements are copied into the table and move when it grows, you
+  must not hold a pointer to a slot across an insertion.  Removing the
+  current element while iterating with OAHT_START/OAHT_NEXT is fine.
+
+      struct dino_slot { uint8_t id[20]; void *val; };
+      OAHT_HEAD(dinomap, dino_slot) head = OAHT_INITIALIZER();
+      OAHT_PROTOTYPE(dinomap, dino_slot, hashfn, eqfn)
+      OAHT_GENERATE(dinomap, dino_slot, hashfn, eqfn, realloc_fn, free_fn)
+ */
+
+#define OAHT_HEAD(name, type)                                           \
+  struct name {                                                         \
+    /* One control byte for each slot. */                               \
+    uint8_t *oah_ctrl;                                                  \
+    /* The slots themselves. */                                         \
+    struct type *oah_slots;                                             \
+    /* How many slots are there?  Either 0 or a power of two no smaller \
+     * than 2*OAHT_GROUP_LEN_. */                                       \
+    unsigned oah_n_slots;                                               \
+    /* How many slots hold an element? */                               \
+    unsigned oah_n_entries;                                             \
+    /* How many slots are full or deleted (that is, not empty)? */      \
+    unsigned oah_n_used;                                                \
+  }
+
+#define OAHT_INITIALIZER()                      \
+  { NULL, NULL, 0, 0, 0 }
+
+#define OAHT_EMPTY(head)                        \
+  ((head)->oah_n_entries == 0)
+
+#define OAHT_SIZE(head)                         \
+  ((head)->oah_n_entries)
+
+#define OAHT_MEM_USAGE(head, type)                                      \
+  (sizeof(*head) + (head)->oah_n_slots * (sizeof(struct type) + 1))
+
+#define OAHT_FIND(name, head, elm)     name##_OAHT_FIND((head), (elm))
+#define OAHT_FIND_OR_INSERT(name, head, elm, found)                     \
+  name##_OAHT_FIND_OR_INSERT((head), (elm), (found))
+#define OAHT_REMOVE_AT(name, head, slot) name##_OAHT_REMOVE_AT((head), (slot))
+#define OAHT_START(name, head)         name##_OAHT_NEXT_FROM_((head), 0)
+#define OAHT_NEXT(name, head, slot)                                     \
+  name##_OAHT_NEXT_FROM_((head),                                        \
+                         (unsigned)((slot) - (head)->oah_slots) + 1)
+#define OAHT_INIT(name, head)          name##_OAHT_INIT(head)
+#define OAHT_CLEAR(name, head)         name##_OAHT_CLEAR(head)
+#define OAHT_REP_IS_BAD_(name, head)   name##_OAHT_REP_IS_BAD_(head)
+
+/* Number of slots (and control bytes) that we examine together. */
+#define OAHT_GROUP_LEN_ 8
+/* Control byte for a slot that has never been used since the last rehash. */
+#define OAHT_CTRL_EMPTY_ 0x80
+/* Control byte for a slot whose element was removed. */
+#define OAHT_CTRL_DELETED_ 0xfe
+#define OAHT_LSBS_ UINT64_C(0x0101010101010101)
+#define OAHT_MSBS_ UINT64_C(0x8080808080808080)
+
+/* Load the OAHT_GROUP_LEN_ control bytes at <b>p</b> as a little-endian
+ * word, so that the byte for slot i of the group is always in bits
+ * 8i..8i+7. */
+static inline uint64_t
+oaht_load_group_(const uint8_t *p)
+{
+  return ((uint64_t)p[0]) | ((uint64_t)p[1] << 8) |
+    ((uint64_t)p[2] << 16) | ((uint64_t)p[3] << 24) |
+    ((uint64_t)p[4] << 32) | ((uint64_t)p[5] << 40) |
+    ((uint64_t)p[6] << 48) | ((uint64_t)p[7] << 56);
+}
+
+/* Return a word with the high bit of byte i set if control byte i of
+ * <b>group</b> might be <b>h2</b>.  This can give false positives (which
+ * are always full slots) but never false negatives. */
+static inline uint64_t
+oaht_match_h2_(uint64_t group, uint8_t h2)
+{
+  uint64_t x = group ^ (OAHT_LSBS_ * h2);
+  return (x - OAHT_LSBS_) & ~x & OAHT_MSBS_;
+}
+
+/* Return a word with the high bit of byte i set iff control byte i of
+ * <b>group</b> is OAHT_CTRL_EMPTY_. */
+static inline uint64_t
+oaht_match_empty_(uint64_t group)
+{
+  return group & (~group << 6) & OAHT_MSBS_;
+}
+
+/* Return a word with the high bit of byte i set iff control byte i of
+ * <b>group</b> is empty or deleted. */
+static inline uint64_t
+oaht_match_free_(uint64_t group)
+{
+  return group & OAHT_MSBS_;
+}
+
+/* Given a nonzero result from one of the oaht_match_*_ functions, return
+ * the index of the first matching byte. */
+static inline unsigned
+oaht_first_match_(uint64_t m)
+{
+#if defined(__GNUC__)
+  return ((unsigned)__builtin_ctzll(m)) >> 3;
+#else
+  unsigned i = 0;
+  while (!(m & 0x80)) {
+    m >>= 8;
+    ++i;
+  }
+  return i;
+#endif
+}
+
+#define OAHT_PROTOTYPE(name, type, hashfn, eqfn)                        \
+  int name##_OAHT_GROW(struct name *head, unsigned min_capacity);       \
+  void name##_OAHT_CLEAR(struct name *head);                            \
+  int name##_OAHT_REP_IS_BAD_(const struct name *head);                 \
+  static inline void                                                    \
+  name##_OAHT_INIT(struct name *head) {                                 \
+    head->oah_ctrl = NULL;                                              \
+    head->oah_slots = NULL;                                             \
+    head->oah_n_slots = 0;                                              \
+    head->oah_n_entries = 0;                                            \
+    head->oah_n_used = 0;                                               \
+  }                                                                     \
+  /* Return the slot holding an element equal to <b>elm</b>, or NULL if \
+   * there is none. */                                                  \
+  ATTR_UNUSED static inline struct type *                               \
+  name##_OAHT_FIND(const struct name *head, const struct type *elm)     \
+  {                                                                     \
+    unsigned h, mask, g, step = 0;                                      \
+    uint8_t h2;                                                         \
+    if (!head->oah_n_slots)                                             \
+      return NULL;                                                      \
+    h = hashfn(elm);                                                    \
+    h2 = h & 0x7f;                                                      \
+    mask = head->oah_n_slots / OAHT_GROUP_LEN_ - 1;                     \
+    g = (h >> 7) & mask;                                                \
+    for (;;) {                                                          \
+      const uint64_t grp =                                              \
+        oaht_load_group_(head->oah_ctrl + g * OAHT_GROUP_LEN_);         \
+      uint64_t m;                                                       \
+      for (m = oaht_match_h2_(grp, h2); m; m &= m - 1) {                \
+        struct type *s =                                                \
+          &head->oah_slots[g * OAHT_GROUP_LEN_ + oaht_first_match_(m)]; \
+        if (eqfn(s, elm))                                               \
+          return s;                                                     \
+      }                                                                 \
+      /* A probe would have stopped at the first empty slot. */         \
+      if (oaht_match_empty_(grp))                                       \
+        return NULL;                                                    \
+      g = (g + ++step) & mask;                                          \
+    }                                                                   \
+  }                                                                     \
+  /* Return the slot holding an element equal to <b>elm</b>, and set    \
+   * *<b>found_out</b> to 1.  If there is none, copy <b>elm</b> into a  \
+   * new slot, return that slot, and set *<b>found_out</b> to 0.  Return\
+   * NULL if the table could not grow. */                               \
+  ATTR_UNUSED static inline struct type *                               \
+  name##_OAHT_FIND_OR_INSERT(struct name *head, const struct type *elm, \
+                             int *found_out)                            \
+  {                                                                     \
+    unsigned h, mask, g, step = 0, idx = 0;                             \
+    int have_idx = 0;                                                   \
+    uint8_t h2;                                                         \
+    /* Keep an eighth of the slots empty, so that every probe ends. */  \
+    if ((head->oah_n_used + 1) * 8 > head->oah_n_slots * 7) {           \
+      if (name##_OAHT_GROW(head, head->oah_n_entries + 1) < 0)          \
+        return NULL;                                                    \
+    }                                                                   \
+    h = hashfn(elm);                                                    \
+    h2 = h & 0x7f;                                                      \
+    mask = head->oah_n_slots / OAHT_GROUP_LEN_ - 1;                     \
+    g = (h >> 7) & mask;                                                \
+    for (;;) {                                                          \
+      const uint64_t grp =                                              \
+        oaht_load_group_(head->oah_ctrl + g * OAHT_GROUP_LEN_);         \
+      uint64_t m;                                                       \
+      for (m = oaht_match_h2_(grp, h2); m; m &= m - 1) {                \
+        struct type *s =                                                \
+          &head->oah_slots[g * OAHT_GROUP_LEN_ + oaht_first_match_(m)]; \
+        if (eqfn(s, elm)) {                                             \
+          *found_out = 1;                                               \
+          return s;                                                     \
+        }                                                               \
+      }                                                                 \
+      if (!have_idx && (m = oaht_match_free_(grp))) {                   \
+        /* Remember the first reusable slot, but keep looking for a     \
+         * match until we reach an empty one. */                        \
+        idx = g * OAHT_GROUP_LEN_ + oaht_first_match_(m);               \
+        have_idx = 1;                                                   \
+      }                                                                 \
+      if (oaht_match_empty_(grp))                                       \
+        break;                                                          \
+      g = (g + ++step) & mask;                                          \
+    }                                                                   \
+    if (head->oah_ctrl[idx] == OAHT_CTRL_EMPTY_)                        \
+      ++head->oah_n_used;                                               \
+    head->oah_ctrl[idx] = h2;                                           \
+    head->oah_slots[idx] = *elm;                                        \
+    ++head->oah_n_entries;                                              \
+    *found_out = 0;                                                     \
+    return &head->oah_slots[idx];                                       \
+  }                                                                     \
+  /* Remove the element in <b>slot</b>, which must be full. */          \
+  ATTR_UNUSED static inline void                                        \
+  name##_OAHT_REMOVE_AT(struct name *head, struct type *slot)           \
+  {                                                                     \
+    unsigned idx = (unsigned)(slot - head->oah_slots);                  \
+    const uint8_t *grp_ctrl =                                           \
+      head->oah_ctrl + (idx & ~(unsigned)(OAHT_GROUP_LEN_ - 1));        \
+    --head->oah_n_entries;                                              \
+    /* If this slot's group still has an empty slot, no probe has ever  \
+     * passed through the group, so we can mark this slot empty too.    \
+     * Otherwise we must leave a tombstone. */                          \
+    if (oaht_match_empty_(oaht_load_group_(grp_ctrl))) {                \
+      head->oah_ctrl[idx] = OAHT_CTRL_EMPTY_;                           \
+      --head->oah_n_used;                                               \
+    } else {                                                            \
+      head->oah_ctrl[idx] = OAHT_CTRL_DELETED_;                         \
+    }                                                                   \
+  }                                                                     \
+  /* Return the first full slot at index <b>idx</b> or later, or NULL if\
+   * there is none. */                                                  \
+  ATTR_UNUSED static inline struct type *                               \
+  name##_OAHT_NEXT_FROM_(const struct name *head, unsigned idx)         \
+  {                                                                     \
+    for ( ; idx < head->oah_n_slots; ++idx) {                           \
+      if (!(head->oah_ctrl[idx] & 0x80))                                \
+        return &head->oah_slots[idx];                                   \
+    }                                                                   \
+    return NULL;                                                        \
+  }
+
+#define OAHT_GENERATE(name, type, hashfn, eqfn, reallocarrayfn, freefn) \
+  /* Resize <b>head</b> so that it can hold at least <b>min_capacity</b>\
+   * elements with plenty of room to spare, and discard any tombstones. \
+   * Return 0 on success, -1 on failure. */                             \
+  int                                                                   \
+  name##_OAHT_GROW(struct name *head, unsigned min_capacity)            \
+  {                                                                     \
+    unsigned new_n_slots = 2 * OAHT_GROUP_LEN_, mask, i;                \
+    uint8_t *new_ctrl;                                                  \
+    struct type *new_slots;                                             \
+    /* Aim for the table to be at most 7/16 full after resizing, so that\
+     * it can double in size before we need to do this again. */        \
+    while (new_n_slots / 16 * 7 < min_capacity) {                       \
+      if (new_n_slots > ((unsigned)-1) / 2)                             \
+        return -1;                                                      \
+      new_n_slots *= 2;                                                 \
+    }                                                                   \
+    new_ctrl = reallocarrayfn(NULL, new_n_slots, 1);                    \
+    if (!new_ctrl)                                                      \
+      return -1;                                                        \
+    new_slots = reallocarrayfn(NULL, new_n_slots, sizeof(struct type)); \
+    if (!new_slots) {                                                   \
+      freefn(new_ctrl);                                                 \
+      return -1;                                                        \
+    }                                                                   \
+    memset(new_ctrl, OAHT_CTRL_EMPTY_, new_n_slots);                    \
+    mask = new_n_slots / OAHT_GROUP_LEN_ - 1;                           \
+    for (i = 0; i < head->oah_n_slots; ++i) {                           \
+      unsigned h, g, step = 0, idx;                                     \
+      uint64_t m;                                                       \
+      if (head->oah_ctrl[i] & 0x80)                                     \
+        continue;                                                       \
+      h = hashfn(&head->oah_slots[i]);                                  \
+      g = (h >> 7) & mask;                                              \
+      /* The new table has no tombstones and no duplicates, so the first\
+       * empty slot on the probe sequence is the right one. */          \
+      for (;;) {                                                        \
+        m = oaht_match_empty_(                                          \
+                    oaht_load_group_(new_ctrl + g * OAHT_GROUP_LEN_));  \
+        if (m)                                                          \
+          break;                                                        \
+        g = (g + ++step) & mask;                                        \
+      }                                                                 \
+      idx = g * OAHT_GROUP_LEN_ + oaht_first_match_(m);                 \
+      new_ctrl[idx] = h & 0x7f;                                         \
+      new_slots[idx] = head->oah_slots[i];                              \
+    }                                                                   \
+    freefn(head->oah_ctrl);                                             \
+    freefn(head->oah_slots);                                            \
+    head->oah_ctrl = new_ctrl;                                          \
+    head->oah_slots = new_slots;                                        \
+    head->oah_n_slots = new_n_slots;                                    \
+    head->oah_n_used = head->oah_n_entries;                             \
+    return 0;                                                           \
+  }                                                                     \
+  /* Free all storage held by <b>head</b>, and reset it to be empty. */ \
+  void                                                                  \
+  name##_OAHT_CLEAR(struct name *head)                                  \
+  {                                                                     \
+    freefn(head->oah_ctrl);                                             \
+    freefn(head->oah_slots);                                            \
+    name##_OAHT_INIT(head);                                             \
+  }                                                                     \
+  /* Debugging helper: return 0 iff the representation of <b>head</b>   \
+   * is internally consistent. */                                       \
+  int                                                                   \
+  name##_OAHT_REP_IS_BAD_(const struct name *head)                      \
+  {                                                                     \
+    unsigned i, n_full = 0, n_used = 0;                                 \
+    if (!head->oah_n_slots) {                                           \
+      return (head->oah_ctrl || head->oah_slots ||                      \
+              head->oah_n_entries || head->oah_n_used) ? 1 : 0;         \
+    }                                                                   \
+    if (head->oah_n_slots < 2 * OAHT_GROUP_LEN_ ||                      \
+        (head->oah_n_slots & (head->oah_n_slots - 1)))                  \
+      return 2;                                                         \
+    if (!head->oah_ctrl || !head->oah_slots)                            \
+      return 3;                                                         \
+    for (i = 0; i < head->oah_n_slots; ++i) {                           \
+      const uint8_t c = head->oah_ctrl[i];                              \
+      if (c == OAHT_CTRL_EMPTY_)                                        \
+        continue;                                                       \
+      ++n_used;                                                         \
+      if (c == OAHT_CTRL_DELETED_)                                      \
+        continue;                                                       \
+      if (c & 0x80)                                                     \
+        return 4;                                                       \
+      ++n_full;                                                         \
+      if (c != (hashfn(&head->oah_slots[i]) & 0x7f))                    \
+        return 5;                                                       \
+      if (name##_OAHT_FIND(head, &head->oah_slots[i]) !=                \
+          &head->oah_slots[i])                                          \
+        return 6;                                                       \
+    }                                                                   \
+    if (n_full != head->oah_n_entries || n_used != head->oah_n_used)    \
+      return 7;                                                         \
+    if (n_used >= head->oah_n_slots)                                    \
+      return 8;                                                         \
+    return 0;                                                           \
+  }
+
 /*
  * Copyright 2005, Nick Mathewson.  Implementation logic is adapted from code
  * by Christopher Clark, retrofit to allow drop-in memory management, and to
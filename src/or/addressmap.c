@@ -82,6 +82,23 @@ static strmap_t *addressmap=NULL;
  **/
 static strmap_t *virtaddress_reversemap=NULL;
 
+/** How many entries in addressmap have src_wildcard set?  When there are
+ * none, addressmap_match_superdomains() has nothing to find. */
+static int n_src_wildcard_entries = 0;
+
+/** Smallest prefix length for which we track the IPv4 virtual network in a
+ * bitmap; with a shorter prefix, the bitmap would get too large, and we
+ * fall back to picking random addresses. */
+#define VIRTADDR_BITMAP_MIN_BITS 10
+
+/** If not NULL, a bitmap with one bit per address in the IPv4 virtual
+ * network, indexed by offset from the start of the network.  A bit is set
+ * iff that address is a key in addressmap, or is an address we never hand
+ * out (one ending in .0 or .255). */
+static bitarray_t *virtaddr_ipv4_used = NULL;
+
+static void virtaddr_ipv4_note_key(const char *address, int added);
+
 /** Initialize addressmap. */
 void
 addressmap_init(void)
@@ -149,6 +166,9 @@ static void
 addressmap_ent_remove(const char *address, addressmap_entry_t *ent)
 {
   addressmap_virtaddress_remove(address, ent);
+  if (ent->src_wildcard)
+    --n_src_wildcard_entries;
+  virtaddr_ipv4_note_key(address, 0);
   addressmap_ent_free(ent);
 }
 
@@ -316,6 +336,10 @@ addressmap_free_all(void)
 
   strmap_free(virtaddress_reversemap, addressmap_virtaddress_ent_free);
   virtaddress_reversemap = NULL;
+
+  n_src_wildcard_entries = 0;
+  bitarray_free(virtaddr_ipv4_used);
+  virtaddr_ipv4_used = NULL;
 }
 
 /** Try to find a match for AddressMap expressions that use
@@ -332,21 +356,30 @@ addressmap_free_all(void)
 static addressmap_entry_t *
 addressmap_match_superdomains(char *address)
 {
-  addressmap_entry_t *val;
-  char *cp;
+  addressmap_entry_t *val = NULL;
+  char *lc, *cp;
+
+  if (!n_src_wildcard_entries)
+    return NULL;
 
-  cp = address;
+  /* Lowercase the address once, and look up each of its suffixes in
+   * place. */
+  lc = tor_strdup(address);
+  tor_strlower(lc);
+  cp = lc;
   while ((cp = strchr(cp, '.'))) {
     /* cp now points to a suffix of address that begins with a . */
-    val = strmap_get_lc(addressmap, cp+1);
+    val = strmap_get(addressmap, cp+1);
     if (val && val->src_wildcard) {
       if (val->dst_wildcard)
-        *cp = '\0';
-      return val;
+        address[cp - lc] = '\0';
+      break;
     }
+    val = NULL;
     ++cp;
   }
-  return NULL;
+  tor_free(lc);
+  return val;
 }
 
 /** Look at address, and rewrite it until it doesn't want any
@@ -570,6 +603,7 @@ addressmap_register(const char *address, char *new_address, time_t expires,
   if (!ent) { /* make a new one and register it */
     ent = tor_malloc_zero(sizeof(addressmap_entry_t));
     strmap_set(addressmap, address, ent);
+    virtaddr_ipv4_note_key(address, 1);
   } else if (ent->new_address) { /* we need to clean up the old mapping. */
     if (expires > 1) {
       log_info(LD_APP,"Temporary addressmap ('%s' to '%s') not performed, "
@@ -593,7 +627,11 @@ addressmap_register(const char *address, char *new_address, time_t expires,
   ent->expires = expires==2 ? 1 : expires;
   ent->num_resolve_failures = 0;
   ent->source = source;
+  if (ent->src_wildcard)
+    --n_src_wildcard_entries;
   ent->src_wildcard = wildcard_addr ? 1 : 0;
+  if (ent->src_wildcard)
+    ++n_src_wildcard_entries;
   ent->dst_wildcard = wildcard_new_addr ? 1 : 0;
 
   log_info(LD_CONFIG, "Addressmap: (re)mapped '%s' to '%s'",
@@ -614,6 +652,7 @@ client_dns_incr_failures(const char *address)
     ent = tor_malloc_zero(sizeof(addressmap_entry_t));
     ent->expires = time(NULL) + MAX_DNS_ENTRY_AGE;
     strmap_set(addressmap,address,ent);
+    virtaddr_ipv4_note_key(address, 1);
   }
   if (ent->num_resolve_failures < SHORT_MAX)
     ++ent->num_resolve_failures; /* don't overflow */
@@ -817,9 +856,144 @@ parse_virtual_addr_network(const char *val, sa_family_t family,
   tor_addr_copy(&conf->addr, &addr);
   conf->bits = bits;
 
+  if (!ipv6) {
+    /* The network changed, so the bitmap no longer lines up with it; we
+     * rebuild it next time we need it. */
+    bitarray_free(virtaddr_ipv4_used);
+    virtaddr_ipv4_used = NULL;
+  }
+
   return 0;
 }
 
+/** Return the number of addresses in the IPv4 virtual network, if we can
+ * track it with a bitmap; otherwise return 0. */
+static uint32_t
+virtaddr_ipv4_network_size(void)
+{
+  if (tor_addr_family(&virtaddr_conf_ipv4.addr) != AF_INET ||
+      virtaddr_conf_ipv4.bits < VIRTADDR_BITMAP_MIN_BITS ||
+      virtaddr_conf_ipv4.bits > 32)
+    return 0;
+  return (uint32_t)(UINT64_C(1) << (32 - virtaddr_conf_ipv4.bits));
+}
+
+/** Return the first address (in host order) of the IPv4 virtual network. */
+static uint32_t
+virtaddr_ipv4_network_base(void)
+{
+  return tor_addr_to_ipv4h(&virtaddr_conf_ipv4.addr) &
+    ~(virtaddr_ipv4_network_size() - 1);
+}
+
+/** Return true iff we never hand out the IPv4 address <b>a</b> (in host
+ * order) as a virtual address. */
+static inline int
+virtaddr_ipv4_is_reserved(uint32_t a)
+{
+  /* Don't hand out any .0 or .255 address. */
+  return (a & 0xff) == 0 || (a & 0xff) == 0xff;
+}
+
+/** If <b>address</b> is an IPv4 address in our virtual network, set
+ * *<b>offset_out</b> to its offset into the network and return 1.
+ * Otherwise return 0. */
+static int
+virtaddr_ipv4_offset(const char *address, uint32_t *offset_out)
+{
+  struct in_addr in;
+  const uint32_t size = virtaddr_ipv4_network_size();
+  uint32_t a;
+
+  if (!size || !tor_inet_aton(address, &in))
+    return 0;
+  a = ntohl(in.s_addr);
+  if ((a & ~(size - 1)) != virtaddr_ipv4_network_base())
+    return 0;
+  *offset_out = a & (size - 1);
+  return 1;
+}
+
+/** Note that <b>address</b> was just added to (if <b>added</b>) or removed
+ * from addressmap, and keep virtaddr_ipv4_used up to date. */
+static void
+virtaddr_ipv4_note_key(const char *address, int added)
+{
+  uint32_t offset;
+
+  if (!virtaddr_ipv4_used || !virtaddr_ipv4_offset(address, &offset))
+    return;
+  if (added)
+    bitarray_set(virtaddr_ipv4_used, offset);
+  else if (!virtaddr_ipv4_is_reserved(virtaddr_ipv4_network_base() + offset))
+    bitarray_clear(virtaddr_ipv4_used, offset);
+}
+
+/** Build virtaddr_ipv4_used from the current addressmap, if we can track
+ * the IPv4 virtual network with a bitmap and haven't built it yet.  Return
+ * the bitmap, or NULL if we can't use one. */
+static bitarray_t *
+virtaddr_ipv4_get_bitmap(void)
+{
+  const uint32_t size = virtaddr_ipv4_network_size();
+  const uint32_t base = virtaddr_ipv4_network_base();
+  uint32_t offset;
+
+  if (virtaddr_ipv4_used || !size)
+    return virtaddr_ipv4_used;
+
+  virtaddr_ipv4_used = bitarray_init_zero(size);
+  for (offset = 0; offset < size; offset += 0x100) {
+    /* The .0 and .255 addresses of each /24. */
+    if (virtaddr_ipv4_is_reserved(base + offset))
+      bitarray_set(virtaddr_ipv4_used, offset);
+    if (virtaddr_ipv4_is_reserved(base + offset + 0xff))
+      bitarray_set(virtaddr_ipv4_used, offset + 0xff);
+  }
+  STRMAP_FOREACH(addressmap, address, addressmap_entry_t *, ent) {
+    (void)ent;
+    if (virtaddr_ipv4_offset(address, &offset))
+      bitarray_set(virtaddr_ipv4_used, offset);
+  } STRMAP_FOREACH_END;
+
+  return virtaddr_ipv4_used;
+}
+
+/** Pick an unused address from the IPv4 virtual network using the bitmap
+ * <b>used</b>: start at a random offset, and take the first free address
+ * at or after it, wrapping around.  Return 0 and set *<b>addr_out</b> on
+ * success, or return -1 if the network is full. */
+STATIC int
+virtaddr_ipv4_pick_unused(bitarray_t *used, tor_addr_t *addr_out)
+{
+  const uint32_t size = virtaddr_ipv4_network_size();
+  const uint32_t n_words = size >> BITARRAY_SHIFT;
+  const uint32_t start = crypto_rand_int(size);
+  const uint32_t start_word = start >> BITARRAY_SHIFT;
+  uint32_t i;
+
+  tor_assert(n_words);
+  /* Look at the first word twice: once from start onward, and once (at the
+   * end) for the bits before start. */
+  for (i = 0; i <= n_words; ++i) {
+    const uint32_t w = (start_word + i) % n_words;
+    unsigned int bits = ~used[w];
+    if (i == 0)
+      bits &= ~0u << (start & BITARRAY_MASK);
+    if (bits) {
+      uint32_t bit = 0;
+      while (!(bits & 1)) {
+        bits >>= 1;
+        ++bit;
+      }
+      tor_addr_from_ipv4h(addr_out,
+              virtaddr_ipv4_network_base() + (w << BITARRAY_SHIFT) + bit);
+      return 0;
+    }
+  }
+  return -1;
+}
+
 /**
  * Return true iff <b>addr</b> is likely to have been returned by
  * client_dns_get_unused_address.
@@ -907,6 +1081,19 @@ addressmap_get_virtual_address(int type)
     const int ipv6 = (type == RESOLVED_TYPE_IPV6);
     const virtual_addr_conf_t *conf = ipv6 ?
       &virtaddr_conf_ipv6 : &virtaddr_conf_ipv4;
+    bitarray_t *used = ipv6 ? NULL : virtaddr_ipv4_get_bitmap();
+
+    if (used) {
+      /* The bitmap knows exactly which addresses are free, so we don't need
+       * to probe the addressmap. */
+      tor_addr_t addr;
+      if (virtaddr_ipv4_pick_unused(used, &addr) < 0) {
+        log_warn(LD_CONFIG, "Ran out of virtual addresses!");
+        return NULL;
+      }
+      tor_addr_to_str(buf, &addr, sizeof(buf), 1);
+      return tor_strdup(buf);
+    }
 
     /* Don't try more than 1000 times.  This gives us P < 1e-9 for
      * failing to get a good address so long as the address space is
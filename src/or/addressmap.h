@@ -59,6 +59,7 @@ typedef struct virtual_addr_conf_t {
 
 STATIC void get_random_virtual_addr(const virtual_addr_conf_t *conf,
                                     tor_addr_t *addr_out);
+STATIC int virtaddr_ipv4_pick_unused(bitarray_t *used, tor_addr_t *addr_out);
 #endif
 
 #endif
@@ -32,12 +32,19 @@
 #include "connection_or.h"
 #include "control.h"
 #include "reasons.h"
+#include "relay.h"
 #include "ext_orport.h"
 #include "util.h"
 #include "torlog.h"
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
+#ifdef HAVE_SYS_UIO_H
+#include <sys/uio.h>
+#endif
+#ifdef HAVE_LIMITS_H
+#include <limits.h>
+#endif
 
 //#define PARANOIA
 
@@ -71,6 +78,10 @@
 static void socks_request_set_socks5_error(socks_request_t *req,
                               socks5_reply_status_t reason);
 
+static chunk_t *buf_new_chunk_with_capacity(const buf_t *buf,
+                                            size_t capacity, int capped);
+static void buf_append_chunk(buf_t *buf, chunk_t *chunk);
+
 static int parse_socks(const char *data, size_t datalen, socks_request_t *req,
                        int log_sockstype, int safe_socks, ssize_t *drain_out,
                        size_t *want_length_out);
@@ -139,24 +150,90 @@ chunk_repack(chunk_t *chunk)
 
 /** Keep track of total size of allocated chunks for consistency asserts */
 static size_t total_bytes_allocated_in_chunks = 0;
+
+/** A stack of freed chunks that all have the same allocation size, which we
+ * hand out again before going back to the allocator. */
+typedef struct chunk_freelist_t {
+  size_t alloc_size; /**< What size chunks does this freelist hold? */
+  int max_length; /**< Never allow more than this number of chunks in the
+                   * freelist. */
+  int cur_length; /**< How many chunks on the freelist now? */
+  chunk_t *head; /**< First chunk on the freelist, linked through next. */
+  uint64_t n_alloc; /**< How many chunks of this size have we taken from
+                     * the allocator? */
+  uint64_t n_hit; /**< How many allocations were satisfied from the
+                   * freelist? */
+} chunk_freelist_t;
+#define FL(a,m) { a, m, 0, NULL, 0, 0 }
+/** The size classes we keep freed chunks for, smallest first, and how many
+ * of each we are willing to hold on to: about a megabyte per class.  These
+ * are the sizes that preferred_chunk_size() hands out for ordinary reads
+ * and writes; odd sizes go straight back to the allocator. */
+static chunk_freelist_t freelists[] = {
+  FL(4096, 256), FL(8192, 128), FL(16384, 64), FL(32768, 32), FL(0, 0)
+};
+#undef FL
+/** How many chunks have we allocated whose size had no freelist? */
+static uint64_t n_freelist_miss = 0;
+/** Total bytes held in chunks on freelists. */
+static size_t total_bytes_in_chunk_freelists = 0;
+
+/** Return the freelist for chunks of allocation size <b>alloc</b>, or NULL
+ * if there is none. */
+static inline chunk_freelist_t *
+get_freelist(size_t alloc)
+{
+  int i;
+  for (i = 0; freelists[i].alloc_size && freelists[i].alloc_size <= alloc;
+       ++i) {
+    if (freelists[i].alloc_size == alloc)
+      return &freelists[i];
+  }
+  return NULL;
+}
+
 static void
 buf_chunk_free_unchecked(chunk_t *chunk)
 {
+  chunk_freelist_t *freelist;
+  size_t alloc;
   if (!chunk)
     return;
+  alloc = CHUNK_ALLOC_SIZE(chunk->memlen);
 #ifdef DEBUG_CHUNK_ALLOC
-  tor_assert(CHUNK_ALLOC_SIZE(chunk->memlen) == chunk->DBG_alloc);
+  tor_assert(alloc == chunk->DBG_alloc);
 #endif
-  tor_assert(total_bytes_allocated_in_chunks >=
-             CHUNK_ALLOC_SIZE(chunk->memlen));
-  total_bytes_allocated_in_chunks -= CHUNK_ALLOC_SIZE(chunk->memlen);
-  tor_free(chunk);
+  tor_assert(total_bytes_allocated_in_chunks >= alloc);
+  total_bytes_allocated_in_chunks -= alloc;
+  freelist = get_freelist(alloc);
+  if (freelist && freelist->cur_length < freelist->max_length &&
+      ! relay_under_memory_pressure()) {
+    chunk->next = freelist->head;
+    freelist->head = chunk;
+    ++freelist->cur_length;
+    total_bytes_in_chunk_freelists += alloc;
+  } else {
+    tor_free(chunk);
+  }
 }
 static inline chunk_t *
 chunk_new_with_alloc_size(size_t alloc)
 {
   chunk_t *ch;
-  ch = tor_malloc(alloc);
+  chunk_freelist_t *freelist = get_freelist(alloc);
+  if (freelist && freelist->head) {
+    ch = freelist->head;
+    freelist->head = ch->next;
+    --freelist->cur_length;
+    ++freelist->n_hit;
+    total_bytes_in_chunk_freelists -= alloc;
+  } else {
+    if (freelist)
+      ++freelist->n_alloc;
+    else
+      ++n_freelist_miss;
+    ch = tor_malloc(alloc);
+  }
   ch->next = NULL;
   ch->datalen = 0;
 #ifdef DEBUG_CHUNK_ALLOC
@@ -424,6 +501,7 @@ buf_copy(const buf_t *buf)
   chunk_t *ch;
   buf_t *out = buf_new();
   out->default_chunk_size = buf->default_chunk_size;
+  out->read_size_avg = buf->read_size_avg;
   for (ch = buf->head; ch; ch = ch->next) {
     chunk_t *newch = chunk_copy(ch);
     if (out->tail) {
@@ -442,6 +520,16 @@ buf_copy(const buf_t *buf)
  * than MAX_CHUNK_ALLOC. */
 static chunk_t *
 buf_add_chunk_with_capacity(buf_t *buf, size_t capacity, int capped)
+{
+  chunk_t *chunk = buf_new_chunk_with_capacity(buf, capacity, capped);
+  buf_append_chunk(buf, chunk);
+  return chunk;
+}
+
+/** Allocate and return a new chunk, sized as buf_add_chunk_with_capacity()
+ * would size it for <b>buf</b>, but don't link it onto <b>buf</b> yet. */
+static chunk_t *
+buf_new_chunk_with_capacity(const buf_t *buf, size_t capacity, int capped)
 {
   chunk_t *chunk;
 
@@ -452,8 +540,15 @@ buf_add_chunk_with_capacity(buf_t *buf, size_t capacity, int capped)
   } else {
     chunk = chunk_new_with_alloc_size(preferred_chunk_size(capacity));
   }
+  return chunk;
+}
 
-  chunk->inserted_time = (uint32_t)monotime_coarse_absolute_msec();
+/** Link <b>chunk</b>, which must not be on any buffer, onto the tail of
+ * <b>buf</b>, and stamp it with the current time. */
+static void
+buf_append_chunk(buf_t *buf, chunk_t *chunk)
+{
+  chunk->inserted_time = (uint32_t)monotime_coarse_absolute_msec_cached();
 
   if (buf->tail) {
     tor_assert(buf->head);
@@ -463,8 +558,8 @@ buf_add_chunk_with_capacity(buf_t *buf, size_t capacity, int capped)
     tor_assert(!buf->head);
     buf->head = buf->tail = chunk;
   }
+  buf->datalen += chunk->datalen;
   check();
-  return chunk;
 }
 
 /** Return the age of the oldest chunk in the buffer <b>buf</b>, in
@@ -487,6 +582,72 @@ buf_get_total_allocation(void)
   return total_bytes_allocated_in_chunks;
 }
 
+/** Return the number of bytes held in freed chunks that we are keeping
+ * around for reuse. */
+size_t
+buf_get_freelist_allocation(void)
+{
+  return total_bytes_in_chunk_freelists;
+}
+
+/** Return every chunk on every freelist to the allocator.  Return the
+ * number of bytes released. */
+size_t
+buf_freelists_clear(void)
+{
+  size_t released = total_bytes_in_chunk_freelists;
+  int i;
+  for (i = 0; freelists[i].alloc_size; ++i) {
+    while (freelists[i].head) {
+      chunk_t *chunk = freelists[i].head;
+      freelists[i].head = chunk->next;
+      tor_free(chunk);
+    }
+    freelists[i].cur_length = 0;
+  }
+  total_bytes_in_chunk_freelists = 0;
+  return released;
+}
+
+/** Log current statistics for chunk freelists at log level
+ * <b>severity</b>. */
+void
+buf_dump_freelist_sizes(int severity)
+{
+  int i;
+  tor_log(severity, LD_MM, "====== Buffer freelists:");
+  for (i = 0; freelists[i].alloc_size; ++i) {
+    tor_log(severity, LD_MM,
+            "  %d bytes: %d chunks kept for reuse. "U64_FORMAT" reused, "
+            U64_FORMAT" newly allocated.",
+            (int)freelists[i].alloc_size, freelists[i].cur_length,
+            U64_PRINTF_ARG(freelists[i].n_hit),
+            U64_PRINTF_ARG(freelists[i].n_alloc));
+  }
+  tor_log(severity, LD_MM, U64_FORMAT" allocations in other sizes.",
+          U64_PRINTF_ARG(n_freelist_miss));
+}
+
+/** Return how much room a fresh chunk for a read of up to <b>at_most</b>
+ * bytes into <b>buf</b> should have: room for a couple of this buffer's
+ * typical reads, but no more than the read could use.  Buffers that carry
+ * bulk transfers work their way up to big chunks; chatty ones keep small
+ * chunks and little slack. */
+static inline size_t
+buf_read_chunk_capacity(const buf_t *buf, size_t at_most)
+{
+  return MIN(at_most, buf->read_size_avg * 2);
+}
+
+/** Note that we just read <b>n</b> bytes into <b>buf</b> in one go, and
+ * update its running average read size. */
+static inline void
+buf_note_read_size(buf_t *buf, size_t n)
+{
+  if (n)
+    buf->read_size_avg = buf->read_size_avg - buf->read_size_avg / 8 + n / 8;
+}
+
 /** Read up to <b>at_most</b> bytes from the socket <b>fd</b> into
  * <b>chunk</b> (which must be on <b>buf</b>). If we get an EOF, set
  * *<b>reached_eof</b> to 1.  Return -1 on error, 0 on eof or blocking,
@@ -542,6 +703,146 @@ read_to_chunk_tls(buf_t *buf, chunk_t *chunk, tor_tls_t *tls,
   return read_result;
 }
 
+#if defined(_WIN32) || (defined(HAVE_READV) && defined(HAVE_WRITEV))
+/** Defined if we can hand several chunks to the kernel in one read or write
+ * call on a plain socket. */
+#define USE_BUF_IOVEC
+#endif
+
+#ifdef USE_BUF_IOVEC
+/** The largest number of chunks that we'll pass to one gathering write.
+ * (Reads never need more than two: the tail and one new chunk.) */
+#if defined(IOV_MAX) && IOV_MAX < 64
+#define BUF_MAX_IOVECS IOV_MAX
+#else
+#define BUF_MAX_IOVECS 64
+#endif
+
+#ifdef _WIN32
+typedef WSABUF buf_iovec_t;
+#define BUF_IOVEC_SET(iov, ptr, len) STMT_BEGIN                         \
+    (iov).buf = (char *)(ptr);                                          \
+    (iov).len = (ULONG)(len);                                           \
+  STMT_END
+#else
+typedef struct iovec buf_iovec_t;
+#define BUF_IOVEC_SET(iov, ptr, len) STMT_BEGIN                         \
+    (iov).iov_base = (void *)(ptr);                                     \
+    (iov).iov_len = (len);                                              \
+  STMT_END
+#endif
+
+/** Scatter-read from <b>s</b> into the <b>n</b> regions in <b>iov</b>.
+ * Behaves as recv(): return the number of bytes read, 0 on EOF, or -1 on
+ * error with the socket errno set. */
+static ssize_t
+buf_socket_readv(tor_socket_t s, buf_iovec_t *iov, int n)
+{
+#ifdef _WIN32
+  DWORD n_read = 0, flags = 0;
+  if (WSARecv(s, iov, (DWORD)n, &n_read, &flags, NULL, NULL) != 0)
+    return -1;
+  return (ssize_t)n_read;
+#else
+  return readv(s, iov, n);
+#endif
+}
+
+/** Gather-write the <b>n</b> regions in <b>iov</b> onto <b>s</b>.  Behaves
+ * as send(): return the number of bytes written, or -1 on error with the
+ * socket errno set. */
+static ssize_t
+buf_socket_writev(tor_socket_t s, const buf_iovec_t *iov, int n)
+{
+#ifdef _WIN32
+  DWORD n_written = 0;
+  if (WSASend(s, (LPWSABUF)iov, (DWORD)n, &n_written, 0, NULL, NULL) != 0)
+    return -1;
+  return (ssize_t)n_written;
+#else
+  return writev(s, iov, n);
+#endif
+}
+
+/** Helper for read_to_buf(): read up to <b>at_most</b> bytes from <b>s</b>
+ * with a single system call, filling whatever room is left in the tail of
+ * <b>buf</b>.  Only when that room is smaller than <b>at_most</b>, and
+ * smaller than what reads on <b>buf</b> usually bring in, do we spill the
+ * rest into a fresh chunk; that chunk is only linked onto <b>buf</b> if some
+ * data landed in it.  Return values are as for read_to_chunk();
+ * *<b>wanted_out</b> is set to the number of bytes we asked for. */
+static int
+read_to_buf_iovec(buf_t *buf, tor_socket_t s, size_t at_most,
+                  size_t *wanted_out, int *reached_eof, int *socket_error)
+{
+  buf_iovec_t iov[2];
+  int n_iov = 0;
+  chunk_t *tail = buf->tail, *fresh = NULL;
+  size_t tail_len = 0, fresh_len = 0;
+  ssize_t read_result;
+
+  if (tail && CHUNK_REMAINING_CAPACITY(tail) >= MIN_READ_LEN) {
+    tail_len = MIN(CHUNK_REMAINING_CAPACITY(tail), at_most);
+    BUF_IOVEC_SET(iov[n_iov], CHUNK_WRITE_PTR(tail), tail_len);
+    ++n_iov;
+  } else {
+    tail = NULL;
+  }
+  /* If the tail has room for a typical read, don't allocate a chunk we
+   * would most likely free again: a read that fills the tail just goes
+   * around read_to_buf()'s loop once more. */
+  if (tail_len < at_most &&
+      (!tail || tail_len < buf_read_chunk_capacity(buf, at_most))) {
+    fresh = buf_new_chunk_with_capacity(buf,
+                        buf_read_chunk_capacity(buf, at_most - tail_len), 1);
+    fresh_len = MIN(fresh->memlen, at_most - tail_len);
+    BUF_IOVEC_SET(iov[n_iov], fresh->data, fresh_len);
+    ++n_iov;
+  }
+  *wanted_out = tail_len + fresh_len;
+
+  read_result = buf_socket_readv(s, iov, n_iov);
+
+  if (read_result <= 0) {
+    buf_chunk_free_unchecked(fresh);
+    if (read_result == 0) {
+      log_debug(LD_NET,"Encountered eof on fd %d", (int)s);
+      *reached_eof = 1;
+      return 0;
+    } else {
+      int e = tor_socket_errno(s);
+      if (!ERRNO_IS_EAGAIN(e)) { /* it's a real error */
+#ifdef _WIN32
+        if (e == WSAENOBUFS)
+          log_warn(LD_NET,"recv() failed: WSAENOBUFS. Not enough ram?");
+#endif
+        *socket_error = e;
+        return -1;
+      }
+      return 0; /* would block. */
+    }
+  }
+
+  if (tail) {
+    size_t n = MIN((size_t)read_result, tail_len);
+    tail->datalen += n;
+    buf->datalen += n;
+  }
+  if (fresh) {
+    if ((size_t)read_result > tail_len) {
+      fresh->datalen = read_result - tail_len;
+      buf_append_chunk(buf, fresh);
+    } else {
+      buf_chunk_free_unchecked(fresh);
+    }
+  }
+  log_debug(LD_NET,"Read %ld bytes. %d on inbuf.", (long)read_result,
+            (int)buf->datalen);
+  tor_assert(read_result < INT_MAX);
+  return (int)read_result;
+}
+#endif
+
 /** Read from socket <b>s</b>, writing onto end of <b>buf</b>.  Read at most
  * <b>at_most</b> bytes, growing the buffer as necessary.  If recv() returns 0
  * (because of EOF), set *<b>reached_eof</b> to 1 and return 0. Return -1 on
@@ -564,9 +865,14 @@ read_to_buf(tor_socket_t s, size_t at_most, buf_t *buf, int *reached_eof,
 
   while (at_most > total_read) {
     size_t readlen = at_most - total_read;
+#ifdef USE_BUF_IOVEC
+    r = read_to_buf_iovec(buf, s, readlen, &readlen, reached_eof,
+                          socket_error);
+#else
     chunk_t *chunk;
     if (!buf->tail || CHUNK_REMAINING_CAPACITY(buf->tail) < MIN_READ_LEN) {
-      chunk = buf_add_chunk_with_capacity(buf, at_most, 1);
+      chunk = buf_add_chunk_with_capacity(buf,
+                                 buf_read_chunk_capacity(buf, readlen), 1);
       if (readlen > chunk->memlen)
         readlen = chunk->memlen;
     } else {
@@ -577,6 +883,7 @@ read_to_buf(tor_socket_t s, size_t at_most, buf_t *buf, int *reached_eof,
     }
 
     r = read_to_chunk(buf, chunk, s, readlen, reached_eof, socket_error);
+#endif
     check();
     if (r < 0)
       return r; /* Error */
@@ -586,6 +893,7 @@ read_to_buf(tor_socket_t s, size_t at_most, buf_t *buf, int *reached_eof,
       break;
     }
   }
+  buf_note_read_size(buf, total_read);
   return (int)total_read;
 }
 
@@ -623,7 +931,8 @@ read_to_buf_tls(tor_tls_t *tls, size_t at_most, buf_t *buf)
     size_t readlen = at_most - total_read;
     chunk_t *chunk;
     if (!buf->tail || CHUNK_REMAINING_CAPACITY(buf->tail) < MIN_READ_LEN) {
-      chunk = buf_add_chunk_with_capacity(buf, at_most, 1);
+      chunk = buf_add_chunk_with_capacity(buf,
+                                 buf_read_chunk_capacity(buf, readlen), 1);
       if (readlen > chunk->memlen)
         readlen = chunk->memlen;
     } else {
@@ -642,9 +951,27 @@ read_to_buf_tls(tor_tls_t *tls, size_t at_most, buf_t *buf)
     if ((size_t)r < readlen) /* eof, block, or no more to read. */
       break;
   }
+  buf_note_read_size(buf, total_read);
   return (int)total_read;
 }
 
+/** Note, for the outbuf queue-delay histogram, how long each chunk that
+ * writing the first <b>n</b> bytes of <b>buf</b> will empty has spent in
+ * the buffer. */
+static void
+buf_note_flushed_chunks(const buf_t *buf, size_t n)
+{
+  const chunk_t *chunk;
+  uint32_t now = 0;
+
+  for (chunk = buf->head; chunk && chunk->datalen <= n; chunk = chunk->next) {
+    if (!now)
+      now = (uint32_t)monotime_coarse_absolute_msec_cached();
+    queue_delay_note(QUEUE_DELAY_OUTBUF, now - chunk->inserted_time);
+    n -= chunk->datalen;
+  }
+}
+
 /** Helper for flush_buf(): try to write <b>sz</b> bytes from chunk
  * <b>chunk</b> of buffer <b>buf</b> onto socket <b>s</b>.  On success, deduct
  * the bytes written from *<b>buf_flushlen</b>.  Return the number of bytes
@@ -673,12 +1000,35 @@ flush_chunk(tor_socket_t s, buf_t *buf, chunk_t *chunk, size_t sz,
     return 0;
   } else {
     *buf_flushlen -= write_result;
+    buf_note_flushed_chunks(buf, write_result);
     buf_remove_from_front(buf, write_result);
     tor_assert(write_result < INT_MAX);
     return (int)write_result;
   }
 }
 
+/** The most plaintext that fits in a single TLS record. */
+#define TLS_RECORD_MAX_PLAINTEXT 16384
+
+/** Helper for flush_buf_tls(): we're about to write up to <b>sz</b> bytes
+ * from the front of <b>buf</b> with one tor_tls_write() call.  Return how
+ * many bytes from buf->head that call should write.
+ *
+ * Every tor_tls_write() call makes at least one TLS record, and every
+ * record costs us a header, a MAC, and a separate trip through the cipher.
+ * Our chunks usually hold only 4K, so rather than writing them one at a
+ * time, gather a full record's worth of the data we're flushing into the
+ * first chunk.  We only coalesce data that is already queued, so this never
+ * holds back a cell. */
+STATIC size_t
+buf_prepare_tls_record(buf_t *buf, size_t sz)
+{
+  if (!buf->head)
+    return 0;
+  buf_pullup(buf, MIN(sz, TLS_RECORD_MAX_PLAINTEXT));
+  return MIN(sz, buf->head->datalen);
+}
+
 /** Helper for flush_buf_tls(): try to write <b>sz</b> bytes from chunk
  * <b>chunk</b> of buffer <b>buf</b> onto socket <b>s</b>.  (Tries to write
  * more if there is a forced pending write size.)  On success, deduct the
@@ -710,6 +1060,7 @@ flush_chunk_tls(tor_tls_t *tls, buf_t *buf, chunk_t *chunk,
     *buf_flushlen -= r;
   else
     *buf_flushlen = 0;
+  buf_note_flushed_chunks(buf, r);
   buf_remove_from_front(buf, r);
   log_debug(LD_NET,"flushed %d bytes, %d ready to flush, %d remain.",
             r,(int)*buf_flushlen,(int)buf->datalen);
@@ -737,6 +1088,42 @@ flush_buf(tor_socket_t s, buf_t *buf, size_t sz, size_t *buf_flushlen)
 
   check();
   while (sz) {
+#ifdef USE_BUF_IOVEC
+    /* Hand the kernel as many chunks as we can in one call. */
+    buf_iovec_t iov[BUF_MAX_IOVECS];
+    int n_iov = 0;
+    size_t flushlen0 = 0;
+    const chunk_t *chunk;
+    ssize_t write_result;
+    tor_assert(buf->head);
+    for (chunk = buf->head; chunk && flushlen0 < sz && n_iov < BUF_MAX_IOVECS;
+         chunk = chunk->next) {
+      size_t len = MIN(chunk->datalen, sz - flushlen0);
+      BUF_IOVEC_SET(iov[n_iov], chunk->data, len);
+      ++n_iov;
+      flushlen0 += len;
+    }
+
+    write_result = buf_socket_writev(s, iov, n_iov);
+    if (write_result < 0) {
+      int e = tor_socket_errno(s);
+      if (!ERRNO_IS_EAGAIN(e)) { /* it's a real error */
+#ifdef _WIN32
+        if (e == WSAENOBUFS)
+          log_warn(LD_NET,"write() failed: WSAENOBUFS. Not enough ram?");
+#endif
+        return -1;
+      }
+      log_debug(LD_NET,"write() would block, returning.");
+      r = 0;
+    } else {
+      *buf_flushlen -= write_result;
+      buf_note_flushed_chunks(buf, write_result);
+      buf_remove_from_front(buf, write_result);
+      tor_assert(write_result < INT_MAX);
+      r = (int)write_result;
+    }
+#else
     size_t flushlen0;
     tor_assert(buf->head);
     if (buf->head->datalen >= sz)
@@ -745,6 +1132,7 @@ flush_buf(tor_socket_t s, buf_t *buf, size_t sz, size_t *buf_flushlen)
       flushlen0 = buf->head->datalen;
 
     r = flush_chunk(s, buf, buf->head, flushlen0, buf_flushlen);
+#endif
     check();
     if (r < 0)
       return r;
@@ -778,15 +1166,7 @@ flush_buf_tls(tor_tls_t *tls, buf_t *buf, size_t flushlen,
 
   check();
   do {
-    size_t flushlen0;
-    if (buf->head) {
-      if ((ssize_t)buf->head->datalen >= sz)
-        flushlen0 = sz;
-      else
-        flushlen0 = buf->head->datalen;
-    } else {
-      flushlen0 = 0;
-    }
+    size_t flushlen0 = buf_prepare_tls_record(buf, (size_t)sz);
 
     r = flush_chunk_tls(tls, buf, buf->head, flushlen0, buf_flushlen);
     check();
@@ -801,6 +1181,60 @@ flush_buf_tls(tor_tls_t *tls, buf_t *buf, size_t flushlen,
   return (int)flushed;
 }
 
+/** Hand up to <b>at_most</b> bytes of ciphertext from the front of
+ * <b>buf</b> to the memory-BIO TLS object <b>tls</b>, and remove them from
+ * <b>buf</b>.  Used to feed <b>tls</b> with what read_to_buf() took from
+ * the network in bulk.  Return the number of bytes moved, or -1 on error.
+ */
+int
+move_buf_to_tls_membio(tor_tls_t *tls, buf_t *buf, size_t at_most)
+{
+  chunk_t *chunk;
+  size_t moved = 0;
+
+  check();
+  for (chunk = buf->head; chunk && moved < at_most; chunk = chunk->next) {
+    size_t n = MIN(at_most - moved, chunk->datalen);
+    if (n && tor_tls_membio_add_input(tls, chunk->data, n) < 0) {
+      buf_remove_from_front(buf, moved);
+      return -1;
+    }
+    moved += n;
+  }
+  buf_remove_from_front(buf, moved);
+  tor_assert(moved < INT_MAX);
+  return (int)moved;
+}
+
+/** Append all the ciphertext that the memory-BIO TLS object <b>tls</b> has
+ * produced to <b>buf</b>, writing it straight into <b>buf</b>'s chunks, so
+ * that flush_buf() can send it in bulk.  Return the number of bytes moved.
+ */
+int
+move_tls_membio_to_buf(buf_t *buf, tor_tls_t *tls)
+{
+  size_t pending, moved = 0;
+
+  check();
+  while ((pending = tor_tls_membio_output_len(tls)) > 0) {
+    chunk_t *chunk = buf->tail;
+    size_t n;
+    if (!chunk || !CHUNK_REMAINING_CAPACITY(chunk))
+      chunk = buf_add_chunk_with_capacity(buf, pending, 1);
+    n = tor_tls_membio_get_output(tls, CHUNK_WRITE_PTR(chunk),
+                                  MIN(pending,
+                                      CHUNK_REMAINING_CAPACITY(chunk)));
+    if (!n)
+      break;
+    chunk->datalen += n;
+    buf->datalen += n;
+    moved += n;
+  }
+  check();
+  tor_assert(moved < INT_MAX);
+  return (int)moved;
+}
+
 /** Append <b>string_len</b> bytes from <b>string</b> to the end of
  * <b>buf</b>.
  *
@@ -833,10 +1267,10 @@ write_to_buf(const char *string, size_t string_len, buf_t *buf)
   return (int)buf->datalen;
 }
 
-/** Helper: copy the first <b>string_len</b> bytes from <b>buf</b>
- * onto <b>string</b>.
+/** Copy the first <b>string_len</b> bytes from <b>buf</b> onto
+ * <b>string</b>, without removing them from <b>buf</b>.
  */
-static inline void
+void
 peek_from_buf(char *string, size_t string_len, const buf_t *buf)
 {
   chunk_t *chunk;
@@ -952,30 +1386,88 @@ fetch_var_cell_from_buf(buf_t *buf, var_cell_t **out, int linkproto)
   return 1;
 }
 
+/** Check <b>buf</b> for a complete fixed-length cell, using wide circuit IDs
+ * iff <b>wide_circ_ids</b> is true.  If one is there, pull it off the
+ * buffer, unpack it into *<b>out</b>, and return 1.  Otherwise return 0.
+ *
+ * The payload is copied straight from the buffer's chunks into
+ * <b>out</b>, without first assembling the packed cell in a temporary
+ * buffer. */
+int
+fetch_cell_from_buf(buf_t *buf, cell_t *out, int wide_circ_ids)
+{
+  char hdr[5];
+  const int circ_id_len = get_circ_id_size(wide_circ_ids);
+  const size_t header_len = circ_id_len + 1;
+  check();
+  if (buf->datalen < (size_t) get_cell_network_size(wide_circ_ids))
+    return 0;
+  peek_from_buf(hdr, header_len, buf);
+  if (wide_circ_ids)
+    out->circ_id = ntohl(get_uint32(hdr));
+  else
+    out->circ_id = ntohs(get_uint16(hdr));
+  out->command = get_uint8(hdr + circ_id_len);
+
+  buf_remove_from_front(buf, header_len);
+  peek_from_buf((char*) out->payload, CELL_PAYLOAD_SIZE, buf);
+  buf_remove_from_front(buf, CELL_PAYLOAD_SIZE);
+  check();
+  return 1;
+}
+
+/** Whole chunks holding fewer bytes than this are copied by
+ * move_buf_to_buf() when the destination has room for them, rather than
+ * spliced, so that a stream of small writes doesn't leave buf_out as a long
+ * list of nearly-empty chunks. */
+#define MIN_SPLICE_LEN 1024
+
 /** Move up to *<b>buf_flushlen</b> bytes from <b>buf_in</b> to
  * <b>buf_out</b>, and modify *<b>buf_flushlen</b> appropriately.
- * Return the number of bytes actually copied.
+ * Return the number of bytes actually moved.
  */
 int
 move_buf_to_buf(buf_t *buf_out, buf_t *buf_in, size_t *buf_flushlen)
 {
-  /* We can do way better here, but this doesn't turn up in any profiles. */
-  char b[4096];
   size_t cp, len;
   len = *buf_flushlen;
   if (len > buf_in->datalen)
     len = buf_in->datalen;
 
-  cp = len; /* Remember the number of bytes we intend to copy. */
+  cp = len; /* Remember the number of bytes we intend to move. */
   tor_assert(cp < INT_MAX);
   while (len) {
-    /* This isn't the most efficient implementation one could imagine, since
-     * it does two copies instead of 1, but I kinda doubt that this will be
-     * critical path. */
-    size_t n = len > sizeof(b) ? sizeof(b) : len;
-    fetch_from_buf(b, n, buf_in);
-    write_to_buf(b, n, buf_out);
-    len -= n;
+    chunk_t *chunk = buf_in->head;
+    tor_assert(chunk);
+    if (chunk->datalen <= len &&
+        (chunk->datalen >= MIN_SPLICE_LEN || chunk->datalen == 0 ||
+         !buf_out->tail ||
+         CHUNK_REMAINING_CAPACITY(buf_out->tail) < chunk->datalen)) {
+      /* The whole chunk is going: hand it over rather than copying it.  It
+       * keeps its insertion time, since its bytes haven't gotten any
+       * younger. */
+      len -= chunk->datalen;
+      buf_in->datalen -= chunk->datalen;
+      buf_in->head = chunk->next;
+      if (buf_in->tail == chunk)
+        buf_in->tail = NULL;
+      chunk->next = NULL;
+      if (buf_out->tail) {
+        buf_out->tail->next = chunk;
+        buf_out->tail = chunk;
+      } else {
+        tor_assert(!buf_out->head);
+        buf_out->head = buf_out->tail = chunk;
+      }
+      buf_out->datalen += chunk->datalen;
+    } else {
+      /* Only part of this chunk is going, or it's small enough to pack onto
+       * the end of buf_out: copy it. */
+      size_t n = MIN(len, chunk->datalen);
+      write_to_buf(chunk->data, n, buf_out);
+      buf_remove_from_front(buf_in, n);
+      len -= n;
+    }
   }
   *buf_flushlen -= cp;
   return (int)cp;
@@ -997,38 +1489,6 @@ buf_pos_init(const buf_t *buf, buf_pos_t *out)
   out->chunk_pos = 0;
 }
 
-/** Advance <b>out</b> to the first appearance of <b>ch</b> at the current
- * position of <b>out</b>, or later.  Return -1 if no instances are found;
- * otherwise returns the absolute position of the character. */
-static off_t
-buf_find_pos_of_char(char ch, buf_pos_t *out)
-{
-  const chunk_t *chunk;
-  int pos;
-  tor_assert(out);
-  if (out->chunk) {
-    if (out->chunk->datalen) {
-      tor_assert(out->pos < (off_t)out->chunk->datalen);
-    } else {
-      tor_assert(out->pos == 0);
-    }
-  }
-  pos = out->pos;
-  for (chunk = out->chunk; chunk; chunk = chunk->next) {
-    char *cp = memchr(chunk->data+pos, ch, chunk->datalen - pos);
-    if (cp) {
-      out->chunk = chunk;
-      tor_assert(cp - chunk->data < INT_MAX);
-      out->pos = (int)(cp - chunk->data);
-      return out->chunk_pos + out->pos;
-    } else {
-      out->chunk_pos += chunk->datalen;
-      pos = 0;
-    }
-  }
-  return -1;
-}
-
 /** Advance <b>pos</b> by a single character, if there are any more characters
  * in the buffer.  Returns 0 on success, -1 on failure. */
 static inline int
@@ -1054,6 +1514,10 @@ buf_matches_at_pos(const buf_pos_t *pos, const char *s, size_t n)
   if (!n)
     return 1;
 
+  /* Most of the time, the whole string would be inside this chunk. */
+  if (pos->chunk->datalen - pos->pos >= n)
+    return fast_memeq(pos->chunk->data + pos->pos, s, n);
+
   memcpy(&p, pos, sizeof(p));
 
   while (1) {
@@ -1071,6 +1535,53 @@ buf_matches_at_pos(const buf_pos_t *pos, const char *s, size_t n)
   }
 }
 
+/** Advance <b>pos</b> to the first position at or after it at which the
+ * <b>n</b>-character string <b>s</b> occurs, and return that position's
+ * offset in the buffer; or return -1 if it does not occur.
+ *
+ * We search each chunk with tor_memmem(), which is much faster than
+ * stepping through it a character at a time, and then check by hand only
+ * the last few positions of the chunk, where a match would continue into
+ * the next one. */
+static int
+buf_find_string_pos(const char *s, size_t n, buf_pos_t *pos)
+{
+  tor_assert(n);
+
+  while (pos->chunk) {
+    const chunk_t *chunk = pos->chunk;
+    const char *cp;
+    size_t start = pos->pos;
+
+    if (chunk->datalen - start >= n) {
+      cp = tor_memmem(chunk->data + start, chunk->datalen - start, s, n);
+      if (cp) {
+        pos->pos = (int)(cp - chunk->data);
+        goto found;
+      }
+      start = chunk->datalen - n + 1;
+    }
+
+    /* Every match that starts from here on spans a chunk boundary. */
+    while (chunk->next && start < chunk->datalen &&
+           (cp = memchr(chunk->data + start, *s, chunk->datalen - start))) {
+      pos->pos = (int)(cp - chunk->data);
+      if (buf_matches_at_pos(pos, s, n))
+        goto found;
+      start = pos->pos + 1;
+    }
+
+    pos->chunk_pos += chunk->datalen;
+    pos->chunk = chunk->next;
+    pos->pos = 0;
+  }
+  return -1;
+
+ found:
+  tor_assert(pos->chunk_pos + pos->pos < INT_MAX);
+  return (int)(pos->chunk_pos + pos->pos);
+}
+
 /** Return the first position in <b>buf</b> at which the <b>n</b>-character
  * string <b>s</b> occurs, or -1 if it does not occur. */
 STATIC int
@@ -1078,16 +1589,39 @@ buf_find_string_offset(const buf_t *buf, const char *s, size_t n)
 {
   buf_pos_t pos;
   buf_pos_init(buf, &pos);
-  while (buf_find_pos_of_char(*s, &pos) >= 0) {
-    if (buf_matches_at_pos(&pos, s, n)) {
-      tor_assert(pos.chunk_pos + pos.pos < INT_MAX);
-      return (int)(pos.chunk_pos + pos.pos);
-    } else {
-      if (buf_pos_inc(&pos)<0)
-        return -1;
-    }
+  return buf_find_string_pos(s, n, &pos);
+}
+
+/** Copy up to <b>n</b> bytes starting at <b>pos</b> into <b>out</b>,
+ * without removing them from the buffer.  Return the number of bytes
+ * copied, which is less than <b>n</b> only if the buffer ends first. */
+static size_t
+buf_pos_peek(const buf_pos_t *pos, char *out, size_t n)
+{
+  const chunk_t *chunk = pos->chunk;
+  size_t off = pos->pos, copied = 0;
+
+  while (chunk && copied < n) {
+    size_t k = MIN(chunk->datalen - off, n - copied);
+    memcpy(out + copied, chunk->data + off, k);
+    copied += k;
+    chunk = chunk->next;
+    off = 0;
   }
-  return -1;
+  return copied;
+}
+
+/** If <b>buf</b> begins with a complete set of HTTP headers, return their
+ * length, including the blank line that ends them.  Otherwise return -1.
+ * Leave <b>buf</b> unchanged. */
+int
+peek_buf_http_headers_len(const buf_t *buf)
+{
+  int crlf_offset;
+  if (!buf->head)
+    return -1;
+  crlf_offset = buf_find_string_offset(buf, "\r\n\r\n", 4);
+  return crlf_offset < 0 ? -1 : crlf_offset + 4;
 }
 
 /** There is a (possibly incomplete) http statement on <b>buf</b>, of the
@@ -1115,9 +1649,9 @@ fetch_from_buf_http(buf_t *buf,
                     char **body_out, size_t *body_used, size_t max_bodylen,
                     int force_complete)
 {
-  char *headers, *p;
   size_t headerlen, bodylen, contentlen;
-  int crlf_offset;
+  int crlf_offset, cl_offset;
+  buf_pos_t pos;
 
   check();
   if (!buf->head)
@@ -1132,13 +1666,10 @@ fetch_from_buf_http(buf_t *buf,
     log_debug(LD_HTTP,"headers not all here yet.");
     return 0;
   }
-  /* Okay, we have a full header.  Make sure it all appears in the first
-   * chunk. */
-  if ((int)buf->head->datalen < crlf_offset + 4)
-    buf_pullup(buf, crlf_offset+4);
+  /* Okay, we have a full header.  We look at it in place, even if it
+   * spans several chunks. */
   headerlen = crlf_offset + 4;
 
-  headers = buf->head->data;
   bodylen = buf->datalen - headerlen;
   log_debug(LD_HTTP,"headerlen %d, bodylen %d.", (int)headerlen, (int)bodylen);
 
@@ -1154,10 +1685,20 @@ fetch_from_buf_http(buf_t *buf,
   }
 
 #define CONTENT_LENGTH "\r\nContent-Length: "
-  p = (char*) tor_memstr(headers, headerlen, CONTENT_LENGTH);
-  if (p) {
+  buf_pos_init(buf, &pos);
+  cl_offset = buf_find_string_pos(CONTENT_LENGTH, strlen(CONTENT_LENGTH),
+                                  &pos);
+  if (cl_offset >= 0 &&
+      (size_t)cl_offset + strlen(CONTENT_LENGTH) <= headerlen) {
+    char numbuf[32];
+    size_t n;
     int i;
-    i = atoi(p+strlen(CONTENT_LENGTH));
+    /* Skip the header name, then read the value from wherever it lies. */
+    for (n = 0; n < strlen(CONTENT_LENGTH); ++n)
+      buf_pos_inc(&pos);
+    n = buf_pos_peek(&pos, numbuf, sizeof(numbuf)-1);
+    numbuf[n] = '\0';
+    i = atoi(numbuf);
     if (i < 0) {
       log_warn(LD_PROTOCOL, "Content-Length is less than zero; it looks like "
                "someone is trying to crash us.");
@@ -1232,6 +1773,12 @@ log_unsafe_socks_warning(int socks_protocol, const char *address,
  * actually significantly higher than the longest possible socks message. */
 #define MAX_SOCKS_MESSAGE_LEN 512
 
+/** How much of a SOCKS request spread over several chunks we copy out in
+ * order to parse it.  This covers the longest request parse_socks() will
+ * wait for: a socks4a request with a username and a destination address
+ * of up to 1024 bytes each. */
+#define SOCKS_PARSE_BUF_LEN 2048
+
 /** Return a new socks_request_t. */
 socks_request_t *
 socks_request_new(void)
@@ -1289,26 +1836,47 @@ fetch_from_buf_socks(buf_t *buf, socks_request_t *req,
   int res;
   ssize_t n_drain;
   size_t want_length = 128;
+  char tmp[SOCKS_PARSE_BUF_LEN];
+  const char *data;
+  size_t datalen;
 
   if (buf->datalen < 2) /* version and another byte */
     return 0;
 
   do {
     n_drain = 0;
-    buf_pullup(buf, want_length);
-    tor_assert(buf->head && buf->head->datalen >= 2);
+    tor_assert(buf->head);
+    if (buf->head->datalen >= MAX(want_length, 128) ||
+        buf->head->datalen == buf->datalen) {
+      /* Parse the request where it lies. */
+      data = buf->head->data;
+      datalen = buf->head->datalen;
+    } else {
+      /* The request spans chunks: parse a copy of its start instead of
+       * collapsing the chunks together. */
+      datalen = MIN(buf->datalen, sizeof(tmp));
+      peek_from_buf(tmp, datalen, buf);
+      data = tmp;
+    }
+    tor_assert(datalen >= 2);
     want_length = 0;
 
-    res = parse_socks(buf->head->data, buf->head->datalen, req, log_sockstype,
+    res = parse_socks(data, datalen, req, log_sockstype,
                       safe_socks, &n_drain, &want_length);
+    if (data == tmp)
+      memwipe(tmp, 0, datalen);
 
     if (n_drain < 0)
       buf_clear(buf);
     else if (n_drain > 0)
       buf_remove_from_front(buf, n_drain);
 
-  } while (res == 0 && buf->head && want_length < buf->datalen &&
-           buf->datalen >= 2);
+    /* Go around again if the parser wants data we have but did not show
+     * it, either because we parsed just the first chunk or because it
+     * consumed part of what we showed it. */
+  } while (res == 0 && buf->head && buf->datalen >= 2 &&
+           (want_length < buf->datalen ||
+            (n_drain == 0 && datalen < MIN(buf->datalen, sizeof(tmp)))));
 
   return res;
 }
@@ -27,6 +27,9 @@ size_t buf_slack(const buf_t *buf);
 
 uint32_t buf_get_oldest_chunk_timestamp(const buf_t *buf, uint32_t now);
 size_t buf_get_total_allocation(void);
+size_t buf_get_freelist_allocation(void);
+size_t buf_freelists_clear(void);
+void buf_dump_freelist_sizes(int severity);
 
 int read_to_buf(tor_socket_t s, size_t at_most, buf_t *buf, int *reached_eof,
                 int *socket_error);
@@ -34,17 +37,22 @@ int read_to_buf_tls(tor_tls_t *tls, size_t at_most, buf_t *buf);
 
 int flush_buf(tor_socket_t s, buf_t *buf, size_t sz, size_t *buf_flushlen);
 int flush_buf_tls(tor_tls_t *tls, buf_t *buf, size_t sz, size_t *buf_flushlen);
+int move_buf_to_tls_membio(tor_tls_t *tls, buf_t *buf, size_t at_most);
+int move_tls_membio_to_buf(buf_t *buf, tor_tls_t *tls);
 
 int write_to_buf(const char *string, size_t string_len, buf_t *buf);
 int write_to_buf_zlib(buf_t *buf, tor_zlib_state_t *state,
                       const char *data, size_t data_len, int done);
 int move_buf_to_buf(buf_t *buf_out, buf_t *buf_in, size_t *buf_flushlen);
 int fetch_from_buf(char *string, size_t string_len, buf_t *buf);
+void peek_from_buf(char *string, size_t string_len, const buf_t *buf);
 int fetch_var_cell_from_buf(buf_t *buf, var_cell_t **out, int linkproto);
+int fetch_cell_from_buf(buf_t *buf, cell_t *out, int wide_circ_ids);
 int fetch_from_buf_http(buf_t *buf,
                         char **headers_out, size_t max_headerlen,
                         char **body_out, size_t *body_used, size_t max_bodylen,
                         int force_complete);
+int peek_buf_http_headers_len(const buf_t *buf);
 socks_request_t *socks_request_new(void);
 void socks_request_free(socks_request_t *req);
 int fetch_from_buf_socks(buf_t *buf, socks_request_t *req,
@@ -64,6 +72,7 @@ void assert_buf_ok(buf_t *buf);
 #ifdef BUFFERS_PRIVATE
 STATIC int buf_find_string_offset(const buf_t *buf, const char *s, size_t n);
 STATIC void buf_pullup(buf_t *buf, size_t bytes);
+STATIC size_t buf_prepare_tls_record(buf_t *buf, size_t sz);
 void buf_get_first_chunk_data(const buf_t *buf, const char **cp, size_t *sz);
 STATIC size_t preferred_chunk_size(size_t target);
 
@@ -92,6 +101,8 @@ struct buf_t {
   size_t datalen; /**< How many bytes is this buffer holding right now? */
   size_t default_chunk_size; /**< Don't allocate any chunks smaller than
                               * this for this buffer. */
+  size_t read_size_avg; /**< Running average of how many bytes each
+                         * read_to_buf*() call brought in. */
   chunk_t *head; /**< First chunk in the list, or NULL for none. */
   chunk_t *tail; /**< Last chunk in the list, or NULL for none. */
 };
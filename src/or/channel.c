@@ -55,6 +55,8 @@
 #include "config.h"
 #include "connection_or.h" /* For var_cell_free() */
 #include "circuitmux.h"
+#include "circuitmux_ewma.h"
+#include "circuitmux_wfq.h"
 #include "entrynodes.h"
 #include "geoip.h"
 #include "nodelist.h"
@@ -84,8 +86,12 @@ static smartlist_t *active_listeners = NULL;
 /* All channel_listener_t instances in LISTENING state */
 static smartlist_t *finished_listeners = NULL;
 
-/* Counter for ID numbers */
-static uint64_t n_channels_allocated = 0;
+/* Every channel that hasn't been freed, by global_identifier, which is its
+ * handle in this table. */
+static slottable_t *channel_id_table = NULL;
+
+/* Counter for channel listener ID numbers */
+static uint64_t n_channel_listeners_allocated = 0;
 /*
  * Channel global byte/cell counters, for statistics and for scheduler high
  * /low-water marks.
@@ -711,28 +717,45 @@ channel_remove_from_digest_map(channel_t *chan)
 /**
  * Find channel by global ID
  *
- * This function searches for a channel by the global_identifier assigned
- * at initialization time.  This identifier is unique for the lifetime of the
- * Tor process.
+ * This function searches for a registered channel by the global_identifier
+ * assigned at initialization time.  This identifier is unique for the
+ * lifetime of the Tor process.
  */
 
 channel_t *
 channel_find_by_global_id(uint64_t global_identifier)
 {
-  channel_t *rv = NULL;
+  channel_t *rv;
 
-  if (all_channels && smartlist_len(all_channels) > 0) {
-    SMARTLIST_FOREACH_BEGIN(all_channels, channel_t *, curr) {
-      if (curr->global_identifier == global_identifier) {
-        rv = curr;
-        break;
-      }
-    } SMARTLIST_FOREACH_END(curr);
-  }
+  if (!channel_id_table)
+    return NULL;
+  rv = slottable_get(channel_id_table, global_identifier);
+  if (rv && !rv->registered)
+    rv = NULL;
 
   return rv;
 }
 
+/** Remove <b>chan</b> from channel_id_table, as we are about to free it. */
+static void
+channel_forget_global_id(channel_t *chan)
+{
+  if (channel_id_table &&
+      slottable_get(channel_id_table, chan->global_identifier) == chan)
+    slottable_remove(channel_id_table, chan->global_identifier);
+}
+
+/**
+ * Return a list of every channel we know about, or NULL if there are none.
+ * The caller must not modify the list.
+ */
+
+const smartlist_t *
+channel_list_get_all(void)
+{
+  return all_channels;
+}
+
 /**
  * Find channel by digest of the remote endpoint
  *
@@ -786,8 +809,10 @@ channel_init(channel_t *chan)
 {
   tor_assert(chan);
 
-  /* Assign an ID and bump the counter */
-  chan->global_identifier = n_channels_allocated++;
+  /* Assign an ID */
+  if (!channel_id_table)
+    channel_id_table = slottable_new();
+  chan->global_identifier = slottable_add(channel_id_table, chan);
 
   /* Init timestamp */
   chan->timestamp_last_had_circuits = time(NULL);
@@ -826,7 +851,7 @@ channel_init_listener(channel_listener_t *chan_l)
   tor_assert(chan_l);
 
   /* Assign an ID and bump the counter */
-  chan_l->global_identifier = n_channels_allocated++;
+  chan_l->global_identifier = n_channel_listeners_allocated++;
 
   /* Timestamp it */
   channel_listener_timestamp_created(chan_l);
@@ -852,6 +877,8 @@ channel_free(channel_t *chan)
             "Freeing channel " U64_FORMAT " at %p",
             U64_PRINTF_ARG(chan->global_identifier), chan);
 
+  channel_forget_global_id(chan);
+
   /* Get this one out of the scheduler */
   scheduler_release_channel(chan);
 
@@ -868,14 +895,20 @@ channel_free(channel_t *chan)
 
   channel_clear_remote_end(chan);
 
-  /* Get rid of cmux */
+  /* Get rid of cmux.  We don't bother marking the circuit IDs of its unsent
+   * destroys usable one at a time: channel_clear_circid_map() below drops
+   * all of them in one pass. */
   if (chan->cmux) {
     circuitmux_detach_all_circuits(chan->cmux, NULL);
-    circuitmux_mark_destroyed_circids_usable(chan->cmux, chan);
     circuitmux_free(chan->cmux);
     chan->cmux = NULL;
   }
 
+  /* Drop any circuit IDs still reserved on this channel */
+  channel_clear_circid_map(chan);
+
+  tor_free(chan->circ_queue_delay);
+
   /* We're in CLOSED or ERROR, so the cell queue is already empty */
 
   tor_free(chan);
@@ -930,6 +963,8 @@ channel_force_free(channel_t *chan)
             "Force-freeing channel " U64_FORMAT " at %p",
             U64_PRINTF_ARG(chan->global_identifier), chan);
 
+  channel_forget_global_id(chan);
+
   /* Get this one out of the scheduler */
   scheduler_release_channel(chan);
 
@@ -952,6 +987,11 @@ channel_force_free(channel_t *chan)
     chan->cmux = NULL;
   }
 
+  /* Drop any circuit IDs still reserved on this channel */
+  channel_clear_circid_map(chan);
+
+  tor_free(chan->circ_queue_delay);
+
   /* We might still have a cell queue; kill it */
   TOR_SIMPLEQ_FOREACH_SAFE(cell, &chan->incoming_queue, next, cell_tmp) {
       cell_queue_entry_free(cell, 0);
@@ -1573,6 +1613,52 @@ channel_set_remote_end(channel_t *chan,
     channel_add_to_digest_map(chan);
 }
 
+/** The largest number of freed cell_queue_entry_t objects that we keep
+ * around for reuse. */
+#define MAX_CELL_QUEUE_ENTRY_FREELIST_LEN 256
+
+/** Stack of freed cell_queue_entry_t objects, linked through their
+ * <b>next</b> fields. */
+static cell_queue_entry_t *cell_queue_entry_freelist = NULL;
+/** The number of entries on cell_queue_entry_freelist. */
+static int n_cell_queue_entries_on_freelist = 0;
+
+/**
+ * Return an uninitialized cell_queue_entry_t, reusing a freed one if we
+ * have one.
+ */
+
+static cell_queue_entry_t *
+cell_queue_entry_alloc(void)
+{
+  cell_queue_entry_t *q = cell_queue_entry_freelist;
+
+  if (q) {
+    cell_queue_entry_freelist = TOR_SIMPLEQ_NEXT(q, next);
+    --n_cell_queue_entries_on_freelist;
+    return q;
+  }
+
+  return tor_malloc(sizeof(*q));
+}
+
+/**
+ * Give back the storage for a cell_queue_entry_t whose contents have
+ * already been dealt with.
+ */
+
+static void
+cell_queue_entry_release(cell_queue_entry_t *q)
+{
+  if (n_cell_queue_entries_on_freelist < MAX_CELL_QUEUE_ENTRY_FREELIST_LEN) {
+    TOR_SIMPLEQ_NEXT(q, next) = cell_queue_entry_freelist;
+    cell_queue_entry_freelist = q;
+    ++n_cell_queue_entries_on_freelist;
+  } else {
+    tor_free(q);
+  }
+}
+
 /**
  * Duplicate a cell queue entry; this is a shallow copy intended for use
  * in channel_write_cell_queue_entry().
@@ -1585,7 +1671,7 @@ cell_queue_entry_dup(cell_queue_entry_t *q)
 
   tor_assert(q);
 
-  rv = tor_malloc(sizeof(*rv));
+  rv = cell_queue_entry_alloc();
   memcpy(rv, q, sizeof(*rv));
 
   return rv;
@@ -1644,7 +1730,7 @@ cell_queue_entry_free(cell_queue_entry_t *q, int handed_off)
         break;
     }
   }
-  tor_free(q);
+  cell_queue_entry_release(q);
 }
 
 #if 0
@@ -1689,7 +1775,7 @@ cell_queue_entry_new_fixed(cell_t *cell)
 
   tor_assert(cell);
 
-  q = tor_malloc(sizeof(*q));
+  q = cell_queue_entry_alloc();
   q->type = CELL_QUEUE_FIXED;
   q->u.fixed.cell = cell;
 
@@ -1707,7 +1793,7 @@ cell_queue_entry_new_var(var_cell_t *var_cell)
 
   tor_assert(var_cell);
 
-  q = tor_malloc(sizeof(*q));
+  q = cell_queue_entry_alloc();
   q->type = CELL_QUEUE_VAR;
   q->u.var.var_cell = var_cell;
 
@@ -1824,6 +1910,7 @@ channel_write_cell_queue_entry(channel_t *chan, cell_queue_entry_t *q)
      * used the stack.
      */
     tmp = cell_queue_entry_dup(q);
+    tmp->inserted_time = (uint32_t)monotime_coarse_absolute_msec_cached();
     TOR_SIMPLEQ_INSERT_TAIL(&chan->outgoing_queue, tmp, next);
     /* Update global counters */
     ++n_channel_cells_queued;
@@ -2387,6 +2474,10 @@ channel_flush_some_cells_from_outgoing_queue(channel_t *chan,
           channel_assert_counter_consistency();
           /* Update the channel's queue size too */
           chan->bytes_in_queue -= cell_size;
+          /* Note how long it waited */
+          queue_delay_note(QUEUE_DELAY_CHANNEL,
+               (uint32_t)monotime_coarse_absolute_msec_cached() -
+               q->inserted_time);
           /* Finally, free q */
           cell_queue_entry_free(q, handed_off);
           q = NULL;
@@ -2676,7 +2767,7 @@ channel_process_cells(channel_t *chan)
                 U64_PRINTF_ARG(chan->global_identifier));
       chan->cell_handler(chan, q->u.fixed.cell);
       tor_free(q->u.fixed.cell);
-      tor_free(q);
+      cell_queue_entry_release(q);
     } else if (q->type == CELL_QUEUE_VAR &&
                chan->var_cell_handler) {
       /* Handle a variable-length cell */
@@ -2689,7 +2780,7 @@ channel_process_cells(channel_t *chan)
                 U64_PRINTF_ARG(chan->global_identifier));
       chan->var_cell_handler(chan, q->u.var.var_cell);
       tor_free(q->u.var.var_cell);
-      tor_free(q);
+      cell_queue_entry_release(q);
     } else {
       /* Can't handle this one */
       break;
@@ -3009,6 +3100,22 @@ channel_listener_dumpstats(int severity)
   }
 }
 
+/**
+ * Return the cmux policy that channels should use, given the current
+ * options and consensus: traffic classes if CircuitPriorityWeights is set,
+ * otherwise EWMA if it is enabled, otherwise NULL for round-robin.
+ */
+
+circuitmux_policy_t *
+channel_get_default_cmux_policy(void)
+{
+  if (cell_wfq_enabled())
+    return &wfq_policy;
+  if (cell_ewma_enabled())
+    return &ewma_policy;
+  return NULL;
+}
+
 /**
  * Set the cmux policy on all active channels
  */
@@ -3203,6 +3310,17 @@ channel_free_all(void)
   /* Geez, anything still left over just won't die ... let it leak then */
   HT_CLEAR(channel_idmap, &channel_identity_map);
 
+  slottable_free(channel_id_table);
+  channel_id_table = NULL;
+
+  /* Finally, the spare cell queue entries */
+  while (cell_queue_entry_freelist) {
+    cell_queue_entry_t *q = cell_queue_entry_freelist;
+    cell_queue_entry_freelist = TOR_SIMPLEQ_NEXT(q, next);
+    tor_free(q);
+  }
+  n_cell_queue_entries_on_freelist = 0;
+
   log_debug(LD_CHANNEL,
             "Done cleaning up after channels");
 }
@@ -83,6 +83,12 @@ struct channel_s {
   /** Heap index for use by the scheduler */
   int sched_heap_idx;
 
+  /** For the KIST scheduler: the scheduler run in which we last asked the
+   * kernel about this channel's socket, and how many more bytes we may
+   * write to it during that run. */
+  uint64_t sched_kist_run;
+  int64_t sched_kist_limit;
+
   /** Timestamps for both cell channels and listeners */
   time_t timestamp_created; /* Channel created */
   time_t timestamp_active; /* Any activity */
@@ -188,6 +194,23 @@ struct channel_s {
   /** For how many circuits are we n_chan?  What about p_chan? */
   unsigned int num_n_circuits, num_p_circuits;
 
+  /** Open-addressed table of this channel's entries in the chan,circid map,
+   * probed linearly from a multiplicative hash of the circuit ID.  Owned
+   * by circuitlist.c; NULL when the channel has no entries. */
+  struct chan_circid_circuit_map_t **circid_table;
+  /** log2 of the number of slots in circid_table. */
+  unsigned int circid_table_bits;
+  /** Number of occupied slots in circid_table. */
+  unsigned int circid_table_n;
+  /** Random odd multiplier for hashing circuit IDs into circid_table, so
+   * that the peer can't choose IDs that collide. */
+  uint32_t circid_table_mult;
+  /** If this channel uses narrow circuit IDs, a bitmap over the whole
+   * 16-bit ID space of the IDs that have entries in circid_table, so that
+   * we can pick an unused ID without probing.  Owned by circuitlist.c;
+   * NULL when circid_table is. */
+  bitarray_t *circid_bitmap;
+
   /**
    * True iff this channel shouldn't get any new circs attached to it,
    * because the connection is too old, or because there's a better one.
@@ -232,6 +255,11 @@ struct channel_s {
    * distinct namespace. */
   uint64_t dirreq_id;
 
+  /** Histogram of how long the cells we've sent have waited on their
+   * circuits' queues since the last QUEUE_DELAY event; NULL if nobody has
+   * asked for those events. */
+  struct latency_hist_t *circ_queue_delay;
+
   /** Channel counters for cell channels */
   uint64_t n_cells_recved, n_bytes_recved;
   uint64_t n_cells_xmitted, n_bytes_xmitted;
@@ -350,6 +378,7 @@ void channel_dumpstats(int severity);
 void channel_listener_dumpstats(int severity);
 
 /* Set the cmux policy on all active channels */
+circuitmux_policy_t *channel_get_default_cmux_policy(void);
 void channel_set_cmux_policy_everywhere(circuitmux_policy_t *pol);
 
 #ifdef TOR_CHANNEL_INTERNAL_
@@ -376,6 +405,9 @@ struct cell_queue_entry_s {
       packed_cell_t *packed_cell;
     } packed;
   } u;
+  /** When did this entry get queued on the channel? (In msec since the
+   * epoch, truncated, as with packed_cell_t.inserted_time.) */
+  uint32_t inserted_time;
 };
 
 /* Cell queue functions for benefit of test suite */
@@ -505,6 +537,7 @@ int channel_is_better(time_t now,
  */
 
 channel_t * channel_find_by_global_id(uint64_t global_identifier);
+const smartlist_t *channel_list_get_all(void);
 channel_t * channel_find_by_remote_digest(const char *identity_digest);
 
 /** For things returned by channel_find_by_remote_digest(), walk the list.
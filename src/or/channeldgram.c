@@ -0,0 +1,783 @@
+/* Copyright (c) 2016, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file channeldgram.c
+ *
+ * \brief A channel_t implementation over an unreliable datagram service.
+ *
+ * On a channel_tls_t, every circuit shares one TCP stream, so a single lost
+ * packet holds up the cells of every circuit behind it until it has been
+ * retransmitted.  A channel_dgram_t instead sends each cell in a datagram
+ * of its own, numbered within its circuit, and keeps ordering and
+ * retransmission state separately for each circuit: a lost datagram delays
+ * only the circuit it belonged to.
+ *
+ * Each frame starts with a one-byte type, a four-byte circuit ID, and a
+ * four-byte sequence number.  A DGRAM_FRAME_CELL frame carries one cell,
+ * packed as for a channel with wide circuit IDs.  The receiver hands cells
+ * for a circuit to the upper layer in sequence order, holding on to cells
+ * that arrive early, and answers every cell frame with a DGRAM_FRAME_ACK
+ * frame carrying the next sequence number it expects on that circuit.  The
+ * sender keeps each cell until it is acknowledged, and sends it again if
+ * no acknowledgment arrives within a retransmission timeout derived from
+ * the measured round-trip time.  At most DGRAM_CHAN_SEND_WINDOW cells may
+ * be unacknowledged at once; num_cells_writeable() tells the scheduler
+ * how many more it may write.
+ *
+ * This module doesn't open sockets or authenticate the other end: that is
+ * the job of the secure datagram layer (DTLS, or something QUIC-like) that
+ * provides the channel_dgram_transport_t, and that must hand us datagrams
+ * only once it knows which relay is on the other side.  Variable-length
+ * cells belong to the TLS link handshake and aren't carried.
+ */
+
+/*
+ * Define this so channel.h gives us things only channel_t subclasses
+ * should touch.
+ */
+#define TOR_CHANNEL_INTERNAL_
+
+#include "or.h"
+#include "channel.h"
+#include "channeldgram.h"
+#include "circuitmux.h"
+#include "config.h"
+#include "connection_or.h"
+#include "relay.h"
+#include "scheduler.h"
+#include "timers.h"
+
+/** Retransmission timeout before we have a round-trip sample, in msec. */
+#define DGRAM_INITIAL_RTO_MSEC 1000
+/** Smallest retransmission timeout we use, in msec. */
+#define DGRAM_MIN_RTO_MSEC 200
+
+/** A cell we've sent on a circuit and haven't seen acknowledged. */
+typedef struct dgram_sent_frame_t {
+  /** Sequence number of the cell within its circuit. */
+  uint32_t seq;
+  /** True iff we've sent this frame more than once, so that an
+   * acknowledgment for it doesn't give a round-trip sample. */
+  unsigned int retransmitted:1;
+  /** Monotonic time in msec when we last sent this frame. */
+  uint64_t sent_msec;
+  /** The frame as sent. */
+  uint8_t frame[DGRAM_FRAME_MAX_LEN];
+} dgram_sent_frame_t;
+
+/** A cell that arrived before the cells ahead of it on its circuit. */
+typedef struct dgram_early_cell_t {
+  uint32_t seq;
+  cell_t cell;
+} dgram_early_cell_t;
+
+/** Ordering and retransmission state for one circuit ID on a datagram
+ * channel. */
+typedef struct dgram_circ_stream_t {
+  HT_ENTRY(dgram_circ_stream_t) node;
+  circid_t circ_id;
+  /** Sequence number for the next cell we send on this circuit. */
+  uint32_t next_send_seq;
+  /** List of dgram_sent_frame_t, in order of sequence number. */
+  smartlist_t *unacked;
+  /** Sequence number of the next cell we'll hand to the upper layer. */
+  uint32_t next_recv_seq;
+  /** List of dgram_early_cell_t, in order of sequence number. */
+  smartlist_t *early;
+} dgram_circ_stream_t;
+
+static inline unsigned
+dgram_circ_stream_hash(const dgram_circ_stream_t *s)
+{
+  return (unsigned) s->circ_id;
+}
+
+static inline int
+dgram_circ_stream_eq(const dgram_circ_stream_t *a,
+                     const dgram_circ_stream_t *b)
+{
+  return a->circ_id == b->circ_id;
+}
+
+HT_PROTOTYPE(dgram_stream_map, dgram_circ_stream_t, node,
+             dgram_circ_stream_hash, dgram_circ_stream_eq)
+HT_GENERATE2(dgram_stream_map, dgram_circ_stream_t, node,
+             dgram_circ_stream_hash, dgram_circ_stream_eq, 0.6,
+             tor_reallocarray_, tor_free_)
+
+/* channel_dgram_t method declarations */
+
+static void channel_dgram_close_method(channel_t *chan);
+static const char * channel_dgram_describe_transport_method(channel_t *chan);
+static void channel_dgram_free_method(channel_t *chan);
+static double channel_dgram_get_overhead_estimate_method(channel_t *chan);
+static int channel_dgram_get_remote_addr_method(channel_t *chan,
+                                                tor_addr_t *addr_out);
+static int channel_dgram_get_transport_name_method(channel_t *chan,
+                                                   char **transport_out);
+static const char *
+channel_dgram_get_remote_descr_method(channel_t *chan, int flags);
+static int channel_dgram_has_queued_writes_method(channel_t *chan);
+static int channel_dgram_is_canonical_method(channel_t *chan, int req);
+static int
+channel_dgram_matches_extend_info_method(channel_t *chan,
+                                         extend_info_t *extend_info);
+static int channel_dgram_matches_target_method(channel_t *chan,
+                                               const tor_addr_t *target);
+static size_t channel_dgram_num_bytes_queued_method(channel_t *chan);
+static int channel_dgram_num_cells_writeable_method(channel_t *chan);
+static int channel_dgram_write_cell_method(channel_t *chan, cell_t *cell);
+static int channel_dgram_write_packed_cell_method(channel_t *chan,
+                                                 packed_cell_t *packed_cell);
+static int channel_dgram_write_var_cell_method(channel_t *chan,
+                                              var_cell_t *var_cell);
+
+/**
+ * Create a new datagram channel with the other end at
+ * <b>addr</b>:<b>port</b>, sending its datagrams with <b>transport</b>.
+ * If <b>id_digest</b> is set, the transport has authenticated the other
+ * end as the relay with that identity.  If <b>incoming</b> is true, the
+ * other end opened the transport.  The channel is registered and open
+ * when we return.
+ */
+channel_t *
+channel_dgram_new(const channel_dgram_transport_t *transport,
+                  const tor_addr_t *addr, uint16_t port,
+                  const char *id_digest, int incoming)
+{
+  channel_dgram_t *dgramchan = tor_malloc_zero(sizeof(*dgramchan));
+  channel_t *chan = &(dgramchan->base_);
+
+  tor_assert(transport);
+  tor_assert(transport->send);
+
+  channel_init(chan);
+  chan->magic = DGRAM_CHAN_MAGIC;
+  chan->state = CHANNEL_STATE_OPENING;
+  chan->close = channel_dgram_close_method;
+  chan->describe_transport = channel_dgram_describe_transport_method;
+  chan->free_fn = channel_dgram_free_method;
+  chan->get_overhead_estimate = channel_dgram_get_overhead_estimate_method;
+  chan->get_remote_addr = channel_dgram_get_remote_addr_method;
+  chan->get_remote_descr = channel_dgram_get_remote_descr_method;
+  chan->get_transport_name = channel_dgram_get_transport_name_method;
+  chan->has_queued_writes = channel_dgram_has_queued_writes_method;
+  chan->is_canonical = channel_dgram_is_canonical_method;
+  chan->matches_extend_info = channel_dgram_matches_extend_info_method;
+  chan->matches_target = channel_dgram_matches_target_method;
+  chan->num_bytes_queued = channel_dgram_num_bytes_queued_method;
+  chan->num_cells_writeable = channel_dgram_num_cells_writeable_method;
+  chan->write_cell = channel_dgram_write_cell_method;
+  chan->write_packed_cell = channel_dgram_write_packed_cell_method;
+  chan->write_var_cell = channel_dgram_write_var_cell_method;
+
+  chan->cmux = circuitmux_alloc();
+  if (channel_get_default_cmux_policy()) {
+    circuitmux_set_policy(chan->cmux, channel_get_default_cmux_policy());
+  }
+  /* Every frame has room for a four-byte circuit ID. */
+  chan->wide_circ_ids = 1;
+
+  HT_INIT(dgram_stream_map, &dgramchan->streams);
+  memcpy(&dgramchan->transport, transport, sizeof(*transport));
+  tor_addr_copy(&dgramchan->remote_addr, addr);
+  dgramchan->remote_port = port;
+
+  if (id_digest)
+    channel_set_identity_digest(chan, id_digest);
+  if (incoming)
+    channel_mark_incoming(chan);
+  else
+    channel_mark_outgoing(chan);
+  channel_register(chan);
+  channel_change_state(chan, CHANNEL_STATE_OPEN);
+
+  log_debug(LD_CHANNEL,
+            "New datagram channel " U64_FORMAT " at %p over %s",
+            U64_PRINTF_ARG(chan->global_identifier), chan,
+            transport->name ? transport->name : "an unnamed transport");
+  return chan;
+}
+
+/**
+ * Cast a channel_dgram_t to a channel_t.
+ */
+channel_t *
+channel_dgram_to_base(channel_dgram_t *dgramchan)
+{
+  if (!dgramchan) return NULL;
+
+  return &(dgramchan->base_);
+}
+
+/**
+ * Cast a channel_t to a channel_dgram_t, with appropriate type-checking
+ * asserts.
+ */
+channel_dgram_t *
+channel_dgram_from_base(channel_t *chan)
+{
+  if (!chan) return NULL;
+
+  tor_assert(chan->magic == DGRAM_CHAN_MAGIC);
+
+  return (channel_dgram_t *)(chan);
+}
+
+/** Return the stream state for <b>circ_id</b> on <b>dgramchan</b>.  If
+ * there is none, create it if <b>create</b> is true, and otherwise return
+ * NULL. */
+static dgram_circ_stream_t *
+channel_dgram_get_stream(channel_dgram_t *dgramchan, circid_t circ_id,
+                         int create)
+{
+  dgram_circ_stream_t search, *stream;
+
+  search.circ_id = circ_id;
+  stream = HT_FIND(dgram_stream_map, &dgramchan->streams, &search);
+  if (stream || !create)
+    return stream;
+
+  stream = tor_malloc_zero(sizeof(*stream));
+  stream->circ_id = circ_id;
+  stream->unacked = smartlist_new();
+  stream->early = smartlist_new();
+  HT_INSERT(dgram_stream_map, &dgramchan->streams, stream);
+  return stream;
+}
+
+/** Release all storage held by <b>stream</b>. */
+static void
+dgram_circ_stream_free(dgram_circ_stream_t *stream)
+{
+  if (!stream)
+    return;
+  SMARTLIST_FOREACH(stream->unacked, dgram_sent_frame_t *, f, tor_free(f));
+  smartlist_free(stream->unacked);
+  SMARTLIST_FOREACH(stream->early, dgram_early_cell_t *, e, tor_free(e));
+  smartlist_free(stream->early);
+  tor_free(stream);
+}
+
+/** Write a frame header for <b>type</b>, <b>circ_id</b> and <b>seq</b> to
+ * <b>out</b>. */
+static void
+dgram_frame_header_pack(uint8_t *out, uint8_t type, circid_t circ_id,
+                        uint32_t seq)
+{
+  out[0] = type;
+  set_uint32(out+1, htonl(circ_id));
+  set_uint32(out+5, htonl(seq));
+}
+
+/** Return the retransmission timeout for <b>dgramchan</b>, in msec. */
+static uint32_t
+channel_dgram_get_rto(const channel_dgram_t *dgramchan)
+{
+  if (!dgramchan->srtt_msec)
+    return DGRAM_INITIAL_RTO_MSEC;
+  return MAX(2 * dgramchan->srtt_msec, DGRAM_MIN_RTO_MSEC);
+}
+
+/** Timer callback: retransmit what needs it on the channel <b>arg</b>. */
+static void
+channel_dgram_retransmit_cb(tor_timer_t *timer, void *arg,
+                            const struct monotime_t *now)
+{
+  (void)timer;
+  (void)now;
+  channel_dgram_retransmit(arg, monotime_coarse_absolute_msec());
+}
+
+/** Arrange for channel_dgram_retransmit() to run on <b>dgramchan</b> one
+ * retransmission timeout from now. */
+static void
+channel_dgram_schedule_retransmit(channel_dgram_t *dgramchan)
+{
+  const uint32_t rto = channel_dgram_get_rto(dgramchan);
+  struct timeval delay;
+
+  if (!dgramchan->retransmit_timer)
+    dgramchan->retransmit_timer =
+      timer_new(channel_dgram_retransmit_cb, dgramchan);
+  delay.tv_sec = rto / 1000;
+  delay.tv_usec = (rto % 1000) * 1000;
+  timer_schedule(dgramchan->retransmit_timer, &delay);
+}
+
+/** Send the packed cell body <b>body</b> on <b>dgramchan</b>, and keep it
+ * until it's acknowledged.  Return 1 if we took the cell, or 0 if the send
+ * window is full. */
+static int
+channel_dgram_send_cell_body(channel_dgram_t *dgramchan, const char *body)
+{
+  const circid_t circ_id = ntohl(get_uint32(body));
+  dgram_circ_stream_t *stream;
+  dgram_sent_frame_t *f;
+
+  if (dgramchan->n_unacked >= DGRAM_CHAN_SEND_WINDOW)
+    return 0;
+
+  stream = channel_dgram_get_stream(dgramchan, circ_id, 1);
+  f = tor_malloc(sizeof(*f));
+  f->seq = stream->next_send_seq++;
+  f->retransmitted = 0;
+  f->sent_msec = monotime_coarse_absolute_msec();
+  dgram_frame_header_pack(f->frame, DGRAM_FRAME_CELL, circ_id, f->seq);
+  memcpy(f->frame + DGRAM_FRAME_HEADER_LEN, body, CELL_MAX_NETWORK_SIZE);
+  smartlist_add(stream->unacked, f);
+
+  if (++dgramchan->n_unacked == 1)
+    channel_dgram_schedule_retransmit(dgramchan);
+
+  /* If the transport can't take it now, the retransmit timer will try
+   * again. */
+  if (dgramchan->transport.send(dgramchan->transport.arg, f->frame,
+                                DGRAM_FRAME_MAX_LEN) < 0)
+    log_debug(LD_CHANNEL, "Datagram send failed; will retransmit.");
+  return 1;
+}
+
+/** Send an acknowledgment on <b>dgramchan</b> that we've delivered every
+ * cell on <b>stream</b> before its next_recv_seq. */
+static void
+channel_dgram_send_ack(channel_dgram_t *dgramchan,
+                       const dgram_circ_stream_t *stream)
+{
+  uint8_t frame[DGRAM_FRAME_HEADER_LEN];
+
+  dgram_frame_header_pack(frame, DGRAM_FRAME_ACK, stream->circ_id,
+                          stream->next_recv_seq);
+  dgramchan->transport.send(dgramchan->transport.arg, frame, sizeof(frame));
+}
+
+/** Retransmit every cell on <b>dgramchan</b> that has gone unacknowledged
+ * for longer than the retransmission timeout, as of <b>now_msec</b>. */
+void
+channel_dgram_retransmit(channel_dgram_t *dgramchan, uint64_t now_msec)
+{
+  const uint32_t rto = channel_dgram_get_rto(dgramchan);
+  dgram_circ_stream_t **streamp;
+
+  if (!dgramchan->n_unacked)
+    return;
+
+  HT_FOREACH(streamp, dgram_stream_map, &dgramchan->streams) {
+    SMARTLIST_FOREACH_BEGIN((*streamp)->unacked, dgram_sent_frame_t *, f) {
+      if (f->sent_msec + rto > now_msec)
+        continue;
+      f->sent_msec = now_msec;
+      f->retransmitted = 1;
+      ++dgramchan->n_retransmits;
+      dgramchan->transport.send(dgramchan->transport.arg, f->frame,
+                                DGRAM_FRAME_MAX_LEN);
+    } SMARTLIST_FOREACH_END(f);
+  }
+
+  channel_dgram_schedule_retransmit(dgramchan);
+}
+
+/** Handle an acknowledgment on <b>dgramchan</b> that the other side has
+ * every cell on <b>stream</b> before <b>ack</b>. */
+static void
+channel_dgram_process_ack(channel_dgram_t *dgramchan,
+                          dgram_circ_stream_t *stream, uint32_t ack)
+{
+  const uint64_t now_msec = monotime_coarse_absolute_msec();
+  int n_acked = 0;
+
+  while (smartlist_len(stream->unacked)) {
+    dgram_sent_frame_t *f = smartlist_get(stream->unacked, 0);
+    if (f->seq >= ack)
+      break;
+    if (!f->retransmitted) {
+      const uint32_t sample = (uint32_t)(now_msec - f->sent_msec);
+      dgramchan->srtt_msec = dgramchan->srtt_msec ?
+        (7 * dgramchan->srtt_msec + sample) / 8 : MAX(sample, 1);
+    }
+    smartlist_del_keeporder(stream->unacked, 0);
+    tor_free(f);
+    ++n_acked;
+  }
+  if (!n_acked)
+    return;
+
+  dgramchan->n_unacked -= n_acked;
+  if (!dgramchan->n_unacked && dgramchan->retransmit_timer)
+    timer_disable(dgramchan->retransmit_timer);
+  /* We have room in the send window again: send what the channel queued
+   * while it was full, then let the scheduler give us more. */
+  channel_flush_cells(DGRAM_CHAN_TO_BASE(dgramchan));
+  scheduler_channel_wants_writes(DGRAM_CHAN_TO_BASE(dgramchan));
+}
+
+/** Compare a sequence number <b>key</b> to the dgram_early_cell_t in
+ * *<b>member</b>, for smartlist_bsearch_idx(). */
+static int
+compare_seq_to_early_cell_(const void *key, const void **member)
+{
+  const uint32_t seq = *(const uint32_t *)key;
+  const dgram_early_cell_t *e = *member;
+  if (seq < e->seq)
+    return -1;
+  else if (seq > e->seq)
+    return 1;
+  return 0;
+}
+
+/** Handle a cell frame with sequence number <b>seq</b>, carrying
+ * <b>cell</b>, for <b>stream</b> on <b>dgramchan</b>. */
+static void
+channel_dgram_process_cell_frame(channel_dgram_t *dgramchan,
+                                 dgram_circ_stream_t *stream, uint32_t seq,
+                                 const cell_t *cell)
+{
+  channel_t *chan = DGRAM_CHAN_TO_BASE(dgramchan);
+
+  if (seq < stream->next_recv_seq) {
+    /* Our acknowledgment must have been lost; send another. */
+    ++dgramchan->n_duplicates;
+    channel_dgram_send_ack(dgramchan, stream);
+    return;
+  }
+  if (seq - stream->next_recv_seq >= DGRAM_CHAN_REORDER_MAX) {
+    ++dgramchan->n_dropped_early;
+    return;
+  }
+
+  if (seq != stream->next_recv_seq) {
+    int idx, found;
+    idx = smartlist_bsearch_idx(stream->early, &seq,
+                                compare_seq_to_early_cell_, &found);
+    if (found) {
+      ++dgramchan->n_duplicates;
+    } else {
+      dgram_early_cell_t *e = tor_malloc(sizeof(*e));
+      e->seq = seq;
+      memcpy(&e->cell, cell, sizeof(cell_t));
+      smartlist_insert(stream->early, idx, e);
+    }
+    channel_dgram_send_ack(dgramchan, stream);
+    return;
+  }
+
+  /* Handling a cell might close the channel, but the stream is only freed
+   * along with the channel, so it stays valid here. */
+  ++stream->next_recv_seq;
+  channel_queue_cell(chan, (cell_t *)cell);
+  while (CHANNEL_IS_OPEN(chan) && smartlist_len(stream->early)) {
+    dgram_early_cell_t *e = smartlist_get(stream->early, 0);
+    if (e->seq != stream->next_recv_seq)
+      break;
+    smartlist_del_keeporder(stream->early, 0);
+    ++stream->next_recv_seq;
+    channel_queue_cell(chan, &e->cell);
+    tor_free(e);
+  }
+  if (CHANNEL_IS_OPEN(chan))
+    channel_dgram_send_ack(dgramchan, stream);
+}
+
+/** Handle the <b>len</b>-byte datagram <b>buf</b>, which the transport
+ * received for <b>dgramchan</b>. */
+void
+channel_dgram_handle_datagram(channel_dgram_t *dgramchan,
+                              const uint8_t *buf, size_t len)
+{
+  channel_t *chan = DGRAM_CHAN_TO_BASE(dgramchan);
+  dgram_circ_stream_t *stream;
+  circid_t circ_id;
+  uint32_t seq;
+  cell_t cell;
+
+  if (!CHANNEL_IS_OPEN(chan))
+    return;
+  if (len < DGRAM_FRAME_HEADER_LEN) {
+    log_fn(LOG_PROTOCOL_WARN, LD_PROTOCOL,
+           "Truncated datagram on channel " U64_FORMAT ". Dropping.",
+           U64_PRINTF_ARG(chan->global_identifier));
+    return;
+  }
+  circ_id = ntohl(get_uint32(buf+1));
+  seq = ntohl(get_uint32(buf+5));
+
+  switch (buf[0]) {
+    case DGRAM_FRAME_ACK:
+      stream = channel_dgram_get_stream(dgramchan, circ_id, 0);
+      if (stream)
+        channel_dgram_process_ack(dgramchan, stream, seq);
+      break;
+    case DGRAM_FRAME_CELL:
+      buf += DGRAM_FRAME_HEADER_LEN;
+      if (len != DGRAM_FRAME_MAX_LEN ||
+          ntohl(get_uint32(buf)) != circ_id) {
+        log_fn(LOG_PROTOCOL_WARN, LD_PROTOCOL,
+               "Malformed cell frame on channel " U64_FORMAT ". Dropping.",
+               U64_PRINTF_ARG(chan->global_identifier));
+        return;
+      }
+      memset(&cell, 0, sizeof(cell));
+      cell.circ_id = circ_id;
+      cell.command = buf[4];
+      memcpy(cell.payload, buf+5, CELL_PAYLOAD_SIZE);
+      stream = channel_dgram_get_stream(dgramchan, circ_id, 1);
+      channel_dgram_process_cell_frame(dgramchan, stream, seq, &cell);
+      break;
+    default:
+      log_fn(LOG_PROTOCOL_WARN, LD_PROTOCOL,
+             "Unknown frame type %d on channel " U64_FORMAT ". Dropping.",
+             buf[0], U64_PRINTF_ARG(chan->global_identifier));
+      break;
+  }
+}
+
+/********************************************
+ * Method implementations for channel_dgram_t *
+ *******************************************/
+
+/**
+ * Close a channel_dgram_t
+ *
+ * This implements the close method for channel_dgram_t.  We have no
+ * connection to wait for, so the channel is closed when we return.
+ */
+static void
+channel_dgram_close_method(channel_t *chan)
+{
+  channel_dgram_t *dgramchan = BASE_CHAN_TO_DGRAM(chan);
+
+  tor_assert(dgramchan);
+
+  if (dgramchan->retransmit_timer)
+    timer_disable(dgramchan->retransmit_timer);
+  if (dgramchan->transport.close)
+    dgramchan->transport.close(dgramchan->transport.arg);
+  dgramchan->transport.close = NULL;
+  channel_closed(chan);
+}
+
+/**
+ * Describe the transport for a channel_dgram_t
+ */
+static const char *
+channel_dgram_describe_transport_method(channel_t *chan)
+{
+  static char buf[64];
+  channel_dgram_t *dgramchan = BASE_CHAN_TO_DGRAM(chan);
+
+  tor_assert(dgramchan);
+
+  tor_snprintf(buf, sizeof(buf), "datagram channel over %s",
+               dgramchan->transport.name ?
+               dgramchan->transport.name : "an unnamed transport");
+  return buf;
+}
+
+/**
+ * Free a channel_dgram_t
+ *
+ * This implements the free method for channel_dgram_t.
+ */
+static void
+channel_dgram_free_method(channel_t *chan)
+{
+  channel_dgram_t *dgramchan = BASE_CHAN_TO_DGRAM(chan);
+  dgram_circ_stream_t **iter, *stream;
+
+  tor_assert(dgramchan);
+
+  for (iter = HT_START(dgram_stream_map, &dgramchan->streams); iter; ) {
+    stream = *iter;
+    iter = HT_NEXT_RMV(dgram_stream_map, &dgramchan->streams, iter);
+    dgram_circ_stream_free(stream);
+  }
+  HT_CLEAR(dgram_stream_map, &dgramchan->streams);
+  timer_free(dgramchan->retransmit_timer);
+  dgramchan->retransmit_timer = NULL;
+  dgramchan->n_unacked = 0;
+}
+
+/**
+ * Get an estimate of the framing overhead for the upper layer
+ */
+static double
+channel_dgram_get_overhead_estimate_method(channel_t *chan)
+{
+  (void)chan;
+  return ((double)DGRAM_FRAME_MAX_LEN) / CELL_MAX_NETWORK_SIZE;
+}
+
+/**
+ * Get the remote address of a channel_dgram_t
+ */
+static int
+channel_dgram_get_remote_addr_method(channel_t *chan, tor_addr_t *addr_out)
+{
+  channel_dgram_t *dgramchan = BASE_CHAN_TO_DGRAM(chan);
+
+  tor_assert(dgramchan);
+
+  if (tor_addr_is_null(&dgramchan->remote_addr))
+    return 0;
+  tor_addr_copy(addr_out, &dgramchan->remote_addr);
+  return 1;
+}
+
+/**
+ * Get the name of the pluggable transport used by a channel_dgram_t
+ *
+ * Datagram channels never use a pluggable transport, so return -1.
+ */
+static int
+channel_dgram_get_transport_name_method(channel_t *chan,
+                                        char **transport_out)
+{
+  (void)chan;
+  (void)transport_out;
+  return -1;
+}
+
+/**
+ * Get a text description of the remote endpoint of a channel_dgram_t
+ */
+static const char *
+channel_dgram_get_remote_descr_method(channel_t *chan, int flags)
+{
+  channel_dgram_t *dgramchan = BASE_CHAN_TO_DGRAM(chan);
+
+  tor_assert(dgramchan);
+
+  if (flags & GRD_FLAG_ADDR_ONLY)
+    return fmt_addr(&dgramchan->remote_addr);
+  return fmt_addrport(&dgramchan->remote_addr, dgramchan->remote_port);
+}
+
+/**
+ * Tell the upper layer whether we have writes queued
+ *
+ * Cells go to the transport as soon as we take them; the ones awaiting
+ * acknowledgment aren't waiting to be written.
+ */
+static int
+channel_dgram_has_queued_writes_method(channel_t *chan)
+{
+  (void)chan;
+  return 0;
+}
+
+/**
+ * Tell the upper layer whether a channel_dgram_t is canonical
+ *
+ * We have no NETINFO exchange to compare addresses with, so we never
+ * claim to be.
+ */
+static int
+channel_dgram_is_canonical_method(channel_t *chan, int req)
+{
+  (void)chan;
+  (void)req;
+  return 0;
+}
+
+/**
+ * Check if a channel_dgram_t goes to the address and port in
+ * <b>extend_info</b>
+ */
+static int
+channel_dgram_matches_extend_info_method(channel_t *chan,
+                                         extend_info_t *extend_info)
+{
+  channel_dgram_t *dgramchan = BASE_CHAN_TO_DGRAM(chan);
+
+  tor_assert(dgramchan);
+
+  return extend_info->port == dgramchan->remote_port &&
+    tor_addr_eq(&extend_info->addr, &dgramchan->remote_addr);
+}
+
+/**
+ * Check if a channel_dgram_t goes to <b>target</b>
+ */
+static int
+channel_dgram_matches_target_method(channel_t *chan,
+                                    const tor_addr_t *target)
+{
+  channel_dgram_t *dgramchan = BASE_CHAN_TO_DGRAM(chan);
+
+  tor_assert(dgramchan);
+
+  return tor_addr_eq(&dgramchan->remote_addr, target);
+}
+
+/**
+ * Tell the upper layer how many bytes we've sent and not had acknowledged
+ */
+static size_t
+channel_dgram_num_bytes_queued_method(channel_t *chan)
+{
+  channel_dgram_t *dgramchan = BASE_CHAN_TO_DGRAM(chan);
+
+  tor_assert(dgramchan);
+
+  return (size_t)dgramchan->n_unacked * DGRAM_FRAME_MAX_LEN;
+}
+
+/**
+ * Tell the upper layer how many more cells the send window allows
+ */
+static int
+channel_dgram_num_cells_writeable_method(channel_t *chan)
+{
+  channel_dgram_t *dgramchan = BASE_CHAN_TO_DGRAM(chan);
+
+  tor_assert(dgramchan);
+
+  return MAX(DGRAM_CHAN_SEND_WINDOW - dgramchan->n_unacked, 0);
+}
+
+/**
+ * Write a cell to a channel_dgram_t
+ */
+static int
+channel_dgram_write_cell_method(channel_t *chan, cell_t *cell)
+{
+  packed_cell_t networkcell;
+
+  cell_pack(&networkcell, cell, chan->wide_circ_ids);
+  return channel_dgram_send_cell_body(BASE_CHAN_TO_DGRAM(chan),
+                                      networkcell.body);
+}
+
+/**
+ * Write a packed cell to a channel_dgram_t
+ *
+ * On success, the cell is ours to free.
+ */
+static int
+channel_dgram_write_packed_cell_method(channel_t *chan,
+                                       packed_cell_t *packed_cell)
+{
+  if (!channel_dgram_send_cell_body(BASE_CHAN_TO_DGRAM(chan),
+                                    packed_cell->body))
+    return 0;
+  packed_cell_free(packed_cell);
+  return 1;
+}
+
+/**
+ * Write a variable-length cell to a channel_dgram_t
+ *
+ * Variable-length cells only carry the TLS link handshake, which the
+ * datagram transport replaces, so we drop them.
+ */
+static int
+channel_dgram_write_var_cell_method(channel_t *chan, var_cell_t *var_cell)
+{
+  log_info(LD_CHANNEL,
+           "Dropping variable-length cell (command %d) on datagram channel "
+           U64_FORMAT, var_cell->command,
+           U64_PRINTF_ARG(chan->global_identifier));
+  return 1;
+}
+
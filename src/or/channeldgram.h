@@ -0,0 +1,91 @@
+/* Copyright (c) 2016, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file channeldgram.h
+ * \brief Header file for channeldgram.c
+ **/
+
+#ifndef TOR_CHANNELDGRAM_H
+#define TOR_CHANNELDGRAM_H
+
+#include "or.h"
+#include "channel.h"
+
+#define BASE_CHAN_TO_DGRAM(c) (channel_dgram_from_base((c)))
+#define DGRAM_CHAN_TO_BASE(c) (channel_dgram_to_base((c)))
+
+#define DGRAM_CHAN_MAGIC 0x5d0a7c31U
+
+/** Frame types on a datagram channel. */
+#define DGRAM_FRAME_CELL 1
+#define DGRAM_FRAME_ACK 2
+
+/** Bytes of frame header before the body: type, circuit ID, sequence
+ * number. */
+#define DGRAM_FRAME_HEADER_LEN 9
+/** Largest frame we send: a header and one wide-circuit-ID cell. */
+#define DGRAM_FRAME_MAX_LEN (DGRAM_FRAME_HEADER_LEN + CELL_MAX_NETWORK_SIZE)
+
+/** How many cells may be sent and not yet acknowledged on one datagram
+ * channel? */
+#define DGRAM_CHAN_SEND_WINDOW 256
+/** How far ahead of the next cell we expect on a circuit may a received
+ * cell be before we drop it and wait for a retransmission? */
+#define DGRAM_CHAN_REORDER_MAX 128
+
+/** The datagram service beneath a channel_dgram_t: something that can send
+ * one datagram at a time to the other end, and may drop or reorder them.
+ * Datagrams that arrive go to channel_dgram_handle_datagram(). */
+typedef struct channel_dgram_transport_t {
+  /** Send the <b>len</b>-byte datagram <b>buf</b>. Return 0 if it was
+   * handed to the network, -1 otherwise. */
+  int (*send)(void *arg, const uint8_t *buf, size_t len);
+  /** Called once the channel has closed, if not NULL. */
+  void (*close)(void *arg);
+  /** Name of the transport, for log messages. */
+  const char *name;
+  /** Passed to <b>send</b> and <b>close</b>. */
+  void *arg;
+} channel_dgram_transport_t;
+
+#ifdef TOR_CHANNEL_INTERNAL_
+
+struct dgram_circ_stream_t;
+
+struct channel_dgram_s {
+  /* Base channel_t struct */
+  channel_t base_;
+  /** How we send datagrams. */
+  channel_dgram_transport_t transport;
+  /** Address of the other end, as the transport reported it. */
+  tor_addr_t remote_addr;
+  uint16_t remote_port;
+  /** Ordering and retransmission state for each circuit ID we've seen. */
+  HT_HEAD(dgram_stream_map, dgram_circ_stream_t) streams;
+  /** Number of cells sent on all circuits and not yet acknowledged. */
+  int n_unacked;
+  /** Smoothed round-trip time in msec, or 0 if we have no sample yet. */
+  uint32_t srtt_msec;
+  /** Timer for retransmitting unacknowledged cells. */
+  struct timeout *retransmit_timer;
+  /** Counters for log messages and tests. */
+  uint64_t n_retransmits;
+  uint64_t n_dropped_early;
+  uint64_t n_duplicates;
+};
+
+#endif /* TOR_CHANNEL_INTERNAL_ */
+
+channel_t *channel_dgram_new(const channel_dgram_transport_t *transport,
+                             const tor_addr_t *addr, uint16_t port,
+                             const char *id_digest, int incoming);
+void channel_dgram_handle_datagram(channel_dgram_t *dgramchan,
+                                   const uint8_t *buf, size_t len);
+void channel_dgram_retransmit(channel_dgram_t *dgramchan, uint64_t now_msec);
+
+channel_t * channel_dgram_to_base(channel_dgram_t *dgramchan);
+channel_dgram_t * channel_dgram_from_base(channel_t *chan);
+
+#endif
+
@@ -43,7 +43,6 @@
 #include "channel.h"
 #include "channeltls.h"
 #include "circuitmux.h"
-#include "circuitmux_ewma.h"
 #include "command.h"
 #include "config.h"
 #include "connection.h"
@@ -56,6 +55,12 @@
 #include "routerlist.h"
 #include "scheduler.h"
 
+#ifdef HAVE_KIST_SUPPORT
+#include <netinet/tcp.h>
+#include <linux/sockios.h>
+#include <sys/ioctl.h>
+#endif
+
 /** How many CELL_PADDING cells have we received, ever? */
 uint64_t stats_n_padding_cells_processed = 0;
 /** How many CELL_VERSIONS cells have we received, ever? */
@@ -155,8 +160,8 @@ channel_tls_common_init(channel_tls_t *tlschan)
   chan->write_var_cell = channel_tls_write_var_cell_method;
 
   chan->cmux = circuitmux_alloc();
-  if (cell_ewma_enabled()) {
-    circuitmux_set_policy(chan->cmux, &ewma_policy);
+  if (channel_get_default_cmux_policy()) {
+    circuitmux_set_policy(chan->cmux, channel_get_default_cmux_policy());
   }
 }
 
@@ -305,6 +310,182 @@ channel_tls_free_all(void)
             "Done shutting down TLS channels");
 }
 
+/**
+ * Push <b>sample</b>, which has the kernel's view of <b>chan</b>'s socket
+ * filled in, onto <b>st</b>, after filling in the traffic that
+ * <b>chan</b> has seen since the previous sample.  <b>total_retrans</b> is
+ * the number of segments the socket has retransmitted ever.  On the first
+ * call, just remember the counters.
+ */
+
+STATIC void
+channel_tls_stats_add_sample(channel_tls_stats_t *st, const channel_t *chan,
+                             uint64_t now_msec,
+                             channel_tls_stats_sample_t *sample,
+                             uint32_t total_retrans)
+{
+  if (st->last_msec) {
+    sample->msec = (uint32_t) MIN(now_msec - st->last_msec, UINT32_MAX);
+    sample->bytes_read = (uint32_t)
+      MIN(chan->n_bytes_recved - st->last_bytes_read, UINT32_MAX);
+    sample->bytes_written = (uint32_t)
+      MIN(chan->n_bytes_xmitted - st->last_bytes_written, UINT32_MAX);
+    sample->cells_read = (uint32_t)
+      MIN(chan->n_cells_recved - st->last_cells_read, UINT32_MAX);
+    sample->cells_written = (uint32_t)
+      MIN(chan->n_cells_xmitted - st->last_cells_written, UINT32_MAX);
+    sample->retransmits = total_retrans >= st->last_total_retrans ?
+      total_retrans - st->last_total_retrans : 0;
+    memcpy(&st->samples[st->next], sample, sizeof(*sample));
+    st->next = (st->next + 1) % CHANNEL_TLS_N_STATS_SAMPLES;
+    if (st->n < CHANNEL_TLS_N_STATS_SAMPLES)
+      ++st->n;
+  }
+  st->last_msec = now_msec;
+  st->last_bytes_read = chan->n_bytes_recved;
+  st->last_bytes_written = chan->n_bytes_xmitted;
+  st->last_cells_read = chan->n_cells_recved;
+  st->last_cells_written = chan->n_cells_xmitted;
+  st->last_total_retrans = total_retrans;
+}
+
+/**
+ * Take a sample of <b>tlschan</b>'s traffic and socket state at
+ * <b>now_msec</b> (a monotonic time), starting to keep samples for it if
+ * we weren't already.
+ */
+
+void
+channel_tls_sample_stats(channel_tls_t *tlschan, uint64_t now_msec)
+{
+  channel_tls_stats_sample_t sample;
+  uint32_t total_retrans = 0;
+
+  tor_assert(tlschan);
+
+  if (!tlschan->stats)
+    tlschan->stats = tor_malloc_zero(sizeof(channel_tls_stats_t));
+  memset(&sample, 0, sizeof(sample));
+
+  if (tlschan->conn) {
+    connection_t *conn = TO_CONN(tlschan->conn);
+    sample.outbuf_len = (uint32_t) connection_get_outbuf_len(conn);
+#ifdef HAVE_KIST_SUPPORT
+    if (SOCKET_OK(conn->s)) {
+      struct tcp_info ti;
+      socklen_t ti_len = sizeof(ti);
+      int outq = 0;
+      if (getsockopt(conn->s, SOL_TCP, TCP_INFO, (void *)&ti, &ti_len) == 0) {
+        sample.rtt_usec = ti.tcpi_rtt;
+        sample.rttvar_usec = ti.tcpi_rttvar;
+        sample.cwnd = ti.tcpi_snd_cwnd;
+        total_retrans = ti.tcpi_total_retrans;
+      }
+      if (ioctl(conn->s, SIOCOUTQ, &outq) == 0 && outq > 0)
+        sample.kernel_outq = (uint32_t) outq;
+    }
+#endif
+  }
+
+  channel_tls_stats_add_sample(tlschan->stats, TLS_CHAN_TO_BASE(tlschan),
+                               now_msec, &sample, total_retrans);
+}
+
+/**
+ * Return the most recent sample of <b>tlschan</b>'s traffic and socket
+ * state, or NULL if we have none.
+ */
+
+const channel_tls_stats_sample_t *
+channel_tls_get_last_sample(const channel_tls_t *tlschan)
+{
+  const channel_tls_stats_t *st = tlschan->stats;
+  if (!st || !st->n)
+    return NULL;
+  return &st->samples[(st->next + CHANNEL_TLS_N_STATS_SAMPLES - 1) %
+                      CHANNEL_TLS_N_STATS_SAMPLES];
+}
+
+/**
+ * Return a newly allocated string listing the samples we have of
+ * <b>tlschan</b>, oldest first, for the "channel/stats" GETINFO key: read
+ * and write rates in bytes per second, outbuf and kernel send queue depths
+ * in bytes, and RTTs in usec.  Return NULL if we have no samples.
+ */
+
+char *
+channel_tls_format_stats_history(const channel_tls_t *tlschan)
+{
+  const channel_tls_stats_t *st = tlschan->stats;
+  smartlist_t *read = NULL, *written = NULL, *outbuf = NULL;
+  smartlist_t *outq = NULL, *rtt = NULL;
+  char *r = NULL, *w = NULL, *ob = NULL, *oq = NULL, *rt = NULL;
+  char *result = NULL;
+  uint64_t retrans = 0;
+  int i;
+
+  if (!st || !st->n)
+    return NULL;
+
+  read = smartlist_new();
+  written = smartlist_new();
+  outbuf = smartlist_new();
+  outq = smartlist_new();
+  rtt = smartlist_new();
+  for (i = 0; i < st->n; ++i) {
+    const channel_tls_stats_sample_t *s =
+      &st->samples[(st->next + CHANNEL_TLS_N_STATS_SAMPLES - st->n + i) %
+                   CHANNEL_TLS_N_STATS_SAMPLES];
+    uint32_t msec = MAX(s->msec, 1);
+    smartlist_add_asprintf(read, U64_FORMAT,
+                    U64_PRINTF_ARG(((uint64_t)s->bytes_read) * 1000 / msec));
+    smartlist_add_asprintf(written, U64_FORMAT,
+                 U64_PRINTF_ARG(((uint64_t)s->bytes_written) * 1000 / msec));
+    smartlist_add_asprintf(outbuf, "%u", (unsigned) s->outbuf_len);
+    smartlist_add_asprintf(outq, "%u", (unsigned) s->kernel_outq);
+    smartlist_add_asprintf(rtt, "%u", (unsigned) s->rtt_usec);
+    retrans += s->retransmits;
+  }
+  r = smartlist_join_strings(read, ",", 0, NULL);
+  w = smartlist_join_strings(written, ",", 0, NULL);
+  ob = smartlist_join_strings(outbuf, ",", 0, NULL);
+  oq = smartlist_join_strings(outq, ",", 0, NULL);
+  rt = smartlist_join_strings(rtt, ",", 0, NULL);
+  tor_asprintf(&result,
+               "ChannelID="U64_FORMAT" ReadRate=%s WriteRate=%s "
+               "OutbufLen=%s KernelOutq=%s RTT=%s Retransmits="U64_FORMAT,
+               U64_PRINTF_ARG(tlschan->base_.global_identifier),
+               r, w, ob, oq, rt, U64_PRINTF_ARG(retrans));
+
+  SMARTLIST_FOREACH(read, char *, cp, tor_free(cp));
+  SMARTLIST_FOREACH(written, char *, cp, tor_free(cp));
+  SMARTLIST_FOREACH(outbuf, char *, cp, tor_free(cp));
+  SMARTLIST_FOREACH(outq, char *, cp, tor_free(cp));
+  SMARTLIST_FOREACH(rtt, char *, cp, tor_free(cp));
+  smartlist_free(read);
+  smartlist_free(written);
+  smartlist_free(outbuf);
+  smartlist_free(outq);
+  smartlist_free(rtt);
+  tor_free(r);
+  tor_free(w);
+  tor_free(ob);
+  tor_free(oq);
+  tor_free(rt);
+  return result;
+}
+
+/**
+ * Stop keeping samples of <b>tlschan</b>'s traffic and socket state, and
+ * forget the ones we have.
+ */
+
+void
+channel_tls_free_stats(channel_tls_t *tlschan)
+{
+  tor_free(tlschan->stats);
+}
+
 /**
  * Create a new channel around an incoming or_connection_t
  */
@@ -459,6 +640,7 @@ channel_tls_free_method(channel_t *chan)
     tlschan->conn->chan = NULL;
     tlschan->conn = NULL;
   }
+  channel_tls_free_stats(tlschan);
 }
 
 /**
@@ -17,6 +17,48 @@
 
 #define TLS_CHAN_MAGIC 0x8a192427U
 
+/** How many samples of each TLS channel's traffic and socket state do we
+ * keep? */
+#define CHANNEL_TLS_N_STATS_SAMPLES 16
+
+/** One sample of a TLS channel's traffic and socket state.  The traffic
+ * counts cover the time since the previous sample; the rest is as of when
+ * we took the sample. */
+typedef struct channel_tls_stats_sample_t {
+  /** How long since the previous sample, in msec? */
+  uint32_t msec;
+  /** Bytes and cells that the channel read and wrote. */
+  uint32_t bytes_read, bytes_written;
+  uint32_t cells_read, cells_written;
+  /** Bytes waiting in the connection's outbuf. */
+  uint32_t outbuf_len;
+  /** From the kernel, where we can ask it, or 0: bytes in the socket's send
+   * queue, the smoothed round-trip time and its variance in usec, the
+   * congestion window in segments, and how many segments it retransmitted
+   * since the previous sample. */
+  uint32_t kernel_outq;
+  uint32_t rtt_usec, rttvar_usec;
+  uint32_t cwnd;
+  uint32_t retransmits;
+} channel_tls_stats_sample_t;
+
+/** Recent samples of a TLS channel's traffic and socket state, in a ring
+ * buffer. */
+typedef struct channel_tls_stats_t {
+  channel_tls_stats_sample_t samples[CHANNEL_TLS_N_STATS_SAMPLES];
+  /** Index of the slot for the next sample. */
+  int next;
+  /** How many slots are in use? */
+  int n;
+  /** When we took the previous sample, and the channel's counters then, so
+   * that we can turn them into deltas.  last_msec is 0 before the first
+   * sample. */
+  uint64_t last_msec;
+  uint64_t last_bytes_read, last_bytes_written;
+  uint64_t last_cells_read, last_cells_written;
+  uint32_t last_total_retrans;
+} channel_tls_stats_t;
+
 #ifdef TOR_CHANNEL_INTERNAL_
 
 struct channel_tls_s {
@@ -24,6 +66,9 @@ struct channel_tls_s {
   channel_t base_;
   /* or_connection_t pointer */
   or_connection_t *conn;
+  /** Recent samples of this channel's traffic and socket state; NULL if
+   * nobody has asked for them. */
+  channel_tls_stats_t *stats;
 };
 
 #endif /* TOR_CHANNEL_INTERNAL_ */
@@ -49,6 +94,13 @@ void channel_tls_handle_var_cell(var_cell_t *var_cell,
                                  or_connection_t *conn);
 void channel_tls_update_marks(or_connection_t *conn);
 
+/* Traffic and socket statistics */
+void channel_tls_sample_stats(channel_tls_t *tlschan, uint64_t now_msec);
+const channel_tls_stats_sample_t *channel_tls_get_last_sample(
+                                              const channel_tls_t *tlschan);
+char *channel_tls_format_stats_history(const channel_tls_t *tlschan);
+void channel_tls_free_stats(channel_tls_t *tlschan);
+
 /* Cleanup at shutdown */
 void channel_tls_free_all(void);
 
@@ -68,6 +120,11 @@ STATIC void channel_tls_process_auth_challenge_cell(var_cell_t *cell,
 STATIC void channel_tls_common_init(channel_tls_t *tlschan);
 STATIC void channel_tls_process_authenticate_cell(var_cell_t *cell,
                                                   channel_tls_t *tlschan);
+STATIC void channel_tls_stats_add_sample(channel_tls_stats_t *st,
+                                         const channel_t *chan,
+                                         uint64_t now_msec,
+                                         channel_tls_stats_sample_t *sample,
+                                         uint32_t total_retrans);
 #endif
 
 #endif
@@ -34,6 +34,7 @@ static void pathbias_measure_close_rate(entry_guard_t *guard);
 static void pathbias_scale_use_rates(entry_guard_t *guard);
 static void pathbias_scale_close_rates(entry_guard_t *guard);
 static int entry_guard_inc_circ_attempt_count(entry_guard_t *guard);
+static void pathbias_fold_guard_use_attempts(entry_guard_t *guard);
 
 /** Increment the number of times we successfully extended a circuit to
  * <b>guard</b>, first checking if the failure rate is high enough that
@@ -567,7 +568,12 @@ pathbias_count_build_success(origin_circuit_t *circ)
 
 /**
  * Record an attempt to use a circuit. Changes the circuit's
- * path state and update its guard's usage counter.
+ * path state and notes the attempt in its guard's pending usage
+ * counter.
+ *
+ * We're called whenever a stream first uses a circuit, so we don't check
+ * and scale the guard's use rates here: both mean walking every circuit
+ * we have.  pathbias_fold_use_attempts() does that once a second instead.
  *
  * Used for path bias usage accounting.
  */
@@ -591,15 +597,13 @@ pathbias_count_use_attempt(origin_circuit_t *circ)
     guard = entry_guard_get_by_id_digest(
                 circ->cpath->extend_info->identity_digest);
     if (guard) {
-      pathbias_measure_use_rate(guard);
-      pathbias_scale_use_rates(guard);
-      guard->use_attempts++;
-      entry_guards_changed();
+      guard->pending_use_attempts++;
 
       log_debug(LD_CIRC,
-               "Marked circuit %d (%f/%f) as used for guard %s ($%s).",
+               "Marked circuit %d (%f/%f+%u) as used for guard %s ($%s).",
                circ->global_identifier,
                guard->use_successes, guard->use_attempts,
+               guard->pending_use_attempts,
                guard->nickname, hex_str(guard->identity, DIGEST_LEN));
     }
 
@@ -618,6 +622,44 @@ pathbias_count_use_attempt(origin_circuit_t *circ)
   return;
 }
 
+/**
+ * Add the pending use attempts of <b>guard</b> to its use_attempts count,
+ * then check its use rate and scale its use counts if needed.
+ *
+ * We add the attempts first because the circuits they came from are
+ * already in PATH_STATE_USE_ATTEMPTED, and so are counted as open
+ * circuits by pathbias_measure_use_rate() and pathbias_scale_use_rates().
+ */
+static void
+pathbias_fold_guard_use_attempts(entry_guard_t *guard)
+{
+  if (!guard->pending_use_attempts)
+    return;
+
+  guard->use_attempts += guard->pending_use_attempts;
+  guard->pending_use_attempts = 0;
+  pathbias_measure_use_rate(guard);
+  pathbias_scale_use_rates(guard);
+  entry_guards_changed();
+}
+
+/**
+ * Fold the use attempts counted by pathbias_count_use_attempt() into the
+ * path bias statistics of every guard.  Called once a second, and before
+ * we save the guard state.
+ */
+void
+pathbias_fold_use_attempts(void)
+{
+  const smartlist_t *guards = get_entry_guards();
+
+  if (!guards)
+    return;
+
+  SMARTLIST_FOREACH(guards, entry_guard_t *, guard,
+                    pathbias_fold_guard_use_attempts(guard));
+}
+
 /**
  * Check the circuit's path state is appropriate and mark it as
  * successfully used. Used for path bias usage accounting.
@@ -702,6 +744,8 @@ pathbias_count_use_success(origin_circuit_t *circ)
     guard = entry_guard_get_by_id_digest(
                 circ->cpath->extend_info->identity_digest);
     if (guard) {
+      /* Make sure the attempt for this circuit has been counted. */
+      pathbias_fold_guard_use_attempts(guard);
       guard->use_successes++;
       entry_guards_changed();
 
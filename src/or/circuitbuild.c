@@ -29,6 +29,7 @@
 #include "connection_or.h"
 #include "control.h"
 #include "crypto.h"
+#include "crypto_rand_fast.h"
 #include "directory.h"
 #include "entrynodes.h"
 #include "main.h"
@@ -111,6 +112,19 @@ get_unique_circ_id_by_chan(channel_t *chan)
   max_range = (chan->wide_circ_ids) ? (1u<<31) : (1u<<15);
   mask = max_range - 1;
   high_bit = (chan->circ_id_type == CIRC_ID_TYPE_HIGHER) ? max_range : 0;
+
+  /* Once a narrow ID space gets half full, random probing needs more and
+   * more tries, and can give up while IDs are still free.  Pick uniformly
+   * from the free IDs instead.  (If there are none, the probing below
+   * fails at once and tells us why.)  Wide ID spaces never get that
+   * full. */
+  if (chan->circid_bitmap && chan->circid_table_n * 2 >= max_range) {
+    test_circ_id = channel_pick_unused_circid(chan, high_bit | 1,
+                                              high_bit | mask);
+    if (test_circ_id)
+      return test_circ_id;
+  }
+
   do {
     if (++attempts > MAX_CIRCID_ATTEMPTS) {
       /* Make sure we don't loop forever because all circuit IDs are used.
@@ -186,7 +200,7 @@ get_unique_circ_id_by_chan(channel_t *chan)
     }
 
     do {
-      crypto_rand((char*) &test_circ_id, sizeof(test_circ_id));
+      crypto_fast_rand((char*) &test_circ_id, sizeof(test_circ_id));
       test_circ_id &= mask;
     } while (test_circ_id == 0);
 
@@ -305,13 +319,32 @@ circuit_list_path(origin_circuit_t *circ, int verbose)
   return circuit_list_path_impl(circ, verbose, 0);
 }
 
-/** Allocate and return a comma-separated list of the currently built elements
- * of <b>circ</b>, giving each as a verbose nickname.
- */
-char *
-circuit_list_path_for_controller(origin_circuit_t *circ)
+/** Return a comma-separated list of the currently built elements of
+ * <b>circ</b>, giving each as a verbose nickname.
+ *
+ * We send this in every event about the circuit, so we keep it on
+ * <b>circ</b> until its path or the names of its nodes change.  The
+ * string belongs to <b>circ</b>: don't free it, and don't keep it past
+ * the next change to <b>circ</b>. */
+const char *
+circuit_get_path_for_controller(origin_circuit_t *circ)
 {
-  return circuit_list_path_impl(circ, 0, 1);
+  const unsigned int gen = nodelist_get_names_generation();
+  if (!circ->controller_path || circ->controller_path_names_gen != gen) {
+    tor_free(circ->controller_path);
+    circ->controller_path = circuit_list_path_impl(circ, 0, 1);
+    circ->controller_path_names_gen = gen;
+  }
+  return circ->controller_path;
+}
+
+/** Forget the path string that circuit_get_path_for_controller() made for
+ * <b>circ</b>.  Call this whenever a hop of <b>circ</b> opens or goes
+ * away. */
+void
+circuit_clear_path_for_controller(origin_circuit_t *circ)
+{
+  tor_free(circ->controller_path);
 }
 
 /** Log, at severity <b>severity</b>, the nicknames of each router in
@@ -467,8 +500,11 @@ origin_circuit_init(uint8_t purpose, int flags)
   circ->build_state->need_capacity =
     ((flags & CIRCLAUNCH_NEED_CAPACITY) ? 1 : 0);
   circ->build_state->is_internal =
-    ((flags & CIRCLAUNCH_IS_INTERNAL) ? 1 : 0);
+    ((flags & (CIRCLAUNCH_IS_INTERNAL|CIRCLAUNCH_IS_STEM)) ? 1 : 0);
+  circ->build_state->is_stem =
+    ((flags & CIRCLAUNCH_IS_STEM) ? 1 : 0);
   circ->base_.purpose = purpose;
+  circuit_update_purpose_index(TO_CIRCUIT(circ));
   return circ;
 }
 
@@ -549,7 +585,8 @@ circuit_handle_first_hop(origin_circuit_t *circ)
     log_info(LD_CIRC, "Next router is %s: %s",
              safe_str_client(extend_info_describe(firsthop->extend_info)),
              msg?msg:"???");
-    circ->base_.n_hop = extend_info_dup(firsthop->extend_info);
+    circuit_set_n_hop(TO_CIRCUIT(circ),
+                      extend_info_dup(firsthop->extend_info));
 
     if (should_launch) {
       if (circ->build_state->onehop_tunnel)
@@ -641,8 +678,7 @@ circuit_n_chan_done(channel_t *chan, int status, int close_origin_circuits)
        * chan_circuid_circuit_map, so we don't need to call
        * set_circid_chan here. */
       circ->n_chan = chan;
-      extend_info_free(circ->n_hop);
-      circ->n_hop = NULL;
+      circuit_set_n_hop(circ, NULL);
 
       if (CIRCUIT_IS_ORIGIN(circ)) {
         if ((err_reason =
@@ -1193,12 +1229,12 @@ circuit_extend(cell_t *cell, circuit_t *circ)
               fmt_addrport(&ec.orport_ipv4.addr,ec.orport_ipv4.port),
               msg?msg:"????");
 
-    circ->n_hop = extend_info_new(NULL /*nickname*/,
-                                  (const char*)ec.node_id,
-                                  NULL /*onion_key*/,
-                                  NULL /*curve25519_key*/,
-                                  &ec.orport_ipv4.addr,
-                                  ec.orport_ipv4.port);
+    circuit_set_n_hop(circ, extend_info_new(NULL /*nickname*/,
+                                            (const char*)ec.node_id,
+                                            NULL /*onion_key*/,
+                                            NULL /*curve25519_key*/,
+                                            &ec.orport_ipv4.addr,
+                                            ec.orport_ipv4.port));
 
     circ->n_chan_create_cell = tor_memdup(&ec.create_cell,
                                           sizeof(ec.create_cell));
@@ -1340,6 +1376,7 @@ circuit_finish_handshake(origin_circuit_t *circ,
   }
 
   hop->state = CPATH_STATE_OPEN;
+  circuit_clear_path_for_controller(circ);
   log_info(LD_CIRC,"Finished building circuit hop:");
   circuit_log_path(LOG_INFO,LD_CIRC,circ);
   control_event_circuit_status(circ, CIRC_EVENT_EXTENDED, 0);
@@ -1935,6 +1972,21 @@ choose_good_exit_server(uint8_t purpose,
   return NULL;
 }
 
+/** Choose an exit for a new general-purpose circuit, as we would when
+ * building one from scratch with the CIRCLAUNCH_* <b>flags</b>, and return a
+ * newly allocated extend_info for it.  Return NULL if there is no suitable
+ * exit. */
+extend_info_t *
+circuit_choose_general_exit(int flags)
+{
+  const node_t *node =
+    choose_good_exit_server_general((flags & CIRCLAUNCH_NEED_UPTIME) != 0,
+                                    (flags & CIRCLAUNCH_NEED_CAPACITY) != 0);
+  if (!node)
+    return NULL;
+  return extend_info_from_node(node, 0);
+}
+
 /** Log a warning if the user specified an exit for the circuit that
  * has been excluded from use by ExcludeNodes or ExcludeExitNodes. */
 static void
@@ -2028,6 +2080,12 @@ onion_pick_cpath_exit(origin_circuit_t *circ, extend_info_t *exit_ei)
     int r = new_route_len(circ->base_.purpose, exit_ei, nodelist_get_list());
     if (r < 1) /* must be at least 1 */
       return -1;
+    /* A stem stops one hop early; we add the exit when we know it. */
+    if (state->is_stem) {
+      if (r != DEFAULT_ROUTE_LEN)
+        return -1;
+      --r;
+    }
     state->desired_path_len = r;
   }
 
@@ -2105,8 +2163,10 @@ static int
 count_acceptable_nodes(smartlist_t *nodes)
 {
   int num=0;
+  const uint8_t *summaries = nodelist_get_node_summaries();
 
   SMARTLIST_FOREACH_BEGIN(nodes, const node_t *, node) {
+    uint8_t summary;
     //    log_debug(LD_CIRC,
 //              "Contemplating whether router %d (%s) is a new option.",
 //              i, r->nickname);
@@ -2120,10 +2180,11 @@ count_acceptable_nodes(smartlist_t *nodes)
     if (! node->is_valid)
 //      log_debug(LD_CIRC,"Nope, the directory says %d is not valid.",i);
       continue;
-    if (! node_has_descriptor(node))
+    summary = summaries[node->nodelist_idx];
+    if (! (summary & NODE_SUMMARY_HAS_DESC))
       continue;
     /* The node has a descriptor, so we can just check the ntor key directly */
-    if (!node_has_curve25519_onion_key(node))
+    if (! (summary & NODE_SUMMARY_HAS_NTOR_KEY))
       continue;
     ++num;
   } SMARTLIST_FOREACH_END(node);
@@ -2428,7 +2489,8 @@ extend_info_from_node(const node_t *node, int for_direct_connect)
                              node->ri->onion_curve25519_pkey,
                              &ap.addr,
                              ap.port);
-  else if (valid_addr && node->rs && node->md)
+  else if (valid_addr && node->rs && node->md &&
+           microdesc_get_onion_pkey(node->md))
     return extend_info_new(node->rs->nickname,
                              node->identity,
                              node->md->onion_pkey,
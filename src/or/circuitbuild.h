@@ -13,7 +13,8 @@
 #define TOR_CIRCUITBUILD_H
 
 char *circuit_list_path(origin_circuit_t *circ, int verbose);
-char *circuit_list_path_for_controller(origin_circuit_t *circ);
+const char *circuit_get_path_for_controller(origin_circuit_t *circ);
+void circuit_clear_path_for_controller(origin_circuit_t *circ);
 void circuit_log_path(int severity, unsigned int domain,
                       origin_circuit_t *circ);
 void circuit_rep_hist_note_result(origin_circuit_t *circ);
@@ -45,6 +46,7 @@ int circuit_all_predicted_ports_handled(time_t now, int *need_uptime,
 
 int circuit_append_new_exit(origin_circuit_t *circ, extend_info_t *info);
 int circuit_extend_to_new_exit(origin_circuit_t *circ, extend_info_t *info);
+extend_info_t *circuit_choose_general_exit(int flags);
 void onion_append_to_cpath(crypt_path_t **head_ptr, crypt_path_t *new_hop);
 extend_info_t *extend_info_new(const char *nickname, const char *digest,
                                crypto_pk_t *onion_key,
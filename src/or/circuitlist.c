@@ -15,6 +15,7 @@
 #include "circpathbias.h"
 #include "circuitbuild.h"
 #include "circuitlist.h"
+#include "circuitmux.h"
 #include "circuituse.h"
 #include "circuitstats.h"
 #include "connection.h"
@@ -22,6 +23,7 @@
 #include "connection_edge.h"
 #include "connection_or.h"
 #include "control.h"
+#include "crypto_rand_fast.h"
 #include "main.h"
 #include "networkstatus.h"
 #include "nodelist.h"
@@ -31,24 +33,46 @@
 #include "relay.h"
 #include "rendclient.h"
 #include "rendcommon.h"
+#include "rendservice.h"
 #include "rephist.h"
 #include "routerlist.h"
 #include "routerset.h"
+#include "compat_libevent.h"
 
 #include "ht.h"
 
+#include <event2/event.h>
+
 /********* START VARIABLES **********/
 
 /** A global list of all circuits at this hop. */
 static smartlist_t *global_circuitlist = NULL;
 
-/** A list of all the circuits in CIRCUIT_STATE_CHAN_WAIT. */
-static smartlist_t *circuits_pending_chans = NULL;
+/** A map from identity digest to a list of all the circuits in
+ * CIRCUIT_STATE_CHAN_WAIT whose next hop has that identity, so that we can
+ * find the circuits waiting for a channel without looking at all of them. */
+static digestmap_t *circuits_pending_chans_by_id = NULL;
+
+/** A list of all the circuits in CIRCUIT_STATE_CHAN_WAIT whose next hop
+ * is unkeyed or not yet chosen. */
+static smartlist_t *circuits_pending_other_chans = NULL;
 
 /** A list of all the circuits that have been marked with
  * circuit_mark_for_close and which are waiting for circuit_about_to_free. */
 static smartlist_t *circuits_pending_close = NULL;
 
+/** A priority queue of circuits that have had cells queued, kept ordered by
+ * oom_cell_time so that the OOM handler can find the circuits holding the
+ * oldest cells without looking at every circuit.  Cells only leave a queue
+ * at its front, so a key can only become too old; circuits_handle_oom()
+ * repairs stale keys as it reaches them. */
+static smartlist_t *circuits_by_cell_age = NULL;
+
+/** For each client circuit purpose, a list of the unmarked origin circuits
+ * with that purpose, so that circuit_get_best() need only look at the
+ * circuits it could possibly use.  Created on demand. */
+static smartlist_t *client_circuits_by_purpose[CIRCUIT_PURPOSE_C_MAX_+1];
+
 static void circuit_free_cpath_node(crypt_path_t *victim);
 static void cpath_ref_decref(crypt_path_reference_t *cpath_ref);
 //static void circuit_set_rend_token(or_circuit_t *circ, int is_rend_circ,
@@ -56,11 +80,16 @@ static void cpath_ref_decref(crypt_path_reference_t *cpath_ref);
 static void circuit_clear_rend_token(or_circuit_t *circ);
 static void circuit_about_to_free_atexit(circuit_t *circ);
 static void circuit_about_to_free(circuit_t *circ);
+static void circuit_free_deferred(circuit_t *circ);
+static void circuit_oom_index_remove(circuit_t *circ);
+static void circuit_purpose_index_remove(origin_circuit_t *circ);
 
 /********* END VARIABLES ************/
 
 /** A map from channel and circuit ID to circuit.  (Lookup performance is
- * very important here, since we need to do it every time a cell arrives.) */
+ * very important here, since we need to do it every time a cell arrives.
+ * Lookups go through the per-channel circid_table; the global hash table
+ * only exists so that we can find every entry at once.) */
 typedef struct chan_circid_circuit_map_t {
   HT_ENTRY(chan_circid_circuit_map_t) node;
   channel_t *chan;
@@ -105,11 +134,155 @@ HT_GENERATE2(chan_circid_map, chan_circid_circuit_map_t, node,
              chan_circid_entry_hash_, chan_circid_entries_eq_, 0.6,
              tor_reallocarray_, tor_free_)
 
-/** The most recently returned entry from circuit_get_by_circid_chan;
- * used to improve performance when many cells arrive in a row from the
- * same circuit.
- */
-static chan_circid_circuit_map_t *_last_circid_chan_ent = NULL;
+/** Smallest per-channel circid table we allocate, as log2 of its size. */
+#define CHAN_CIRCID_TABLE_MIN_BITS 3
+
+/** Number of bits in a circid_bitmap: enough for every narrow circuit ID. */
+#define CHAN_CIRCID_BITMAP_BITS (1u<<16)
+
+/** Return the slot in <b>chan</b>'s circid table where probing for
+ * <b>id</b> starts. */
+static inline unsigned
+chan_circid_table_slot(const channel_t *chan, circid_t id)
+{
+  return ((uint32_t)id * chan->circid_table_mult) >>
+    (32 - chan->circid_table_bits);
+}
+
+/** Return the entry on <b>chan</b>'s circid table for <b>id</b>, or NULL if
+ * there is none.  This is in the critical path for every incoming cell. */
+static inline chan_circid_circuit_map_t *
+chan_circid_table_find(const channel_t *chan, circid_t id)
+{
+  chan_circid_circuit_map_t *ent;
+  unsigned mask, i;
+
+  if (!chan->circid_table)
+    return NULL;
+  mask = (1u << chan->circid_table_bits) - 1;
+  for (i = chan_circid_table_slot(chan, id);
+       (ent = chan->circid_table[i]) != NULL;
+       i = (i + 1) & mask) {
+    if (ent->circ_id == id)
+      return ent;
+  }
+  return NULL;
+}
+
+/** Put <b>ent</b> in the first free slot of its probe sequence on
+ * <b>chan</b>'s circid table, which must have room for it. */
+static void
+chan_circid_table_place(channel_t *chan, chan_circid_circuit_map_t *ent)
+{
+  unsigned mask = (1u << chan->circid_table_bits) - 1;
+  unsigned i = chan_circid_table_slot(chan, ent->circ_id);
+  while (chan->circid_table[i])
+    i = (i + 1) & mask;
+  chan->circid_table[i] = ent;
+}
+
+/** Reallocate <b>chan</b>'s circid table with 2^<b>bits</b> slots, and
+ * rehash every entry into it. */
+static void
+chan_circid_table_resize(channel_t *chan, unsigned bits)
+{
+  chan_circid_circuit_map_t **old = chan->circid_table;
+  unsigned old_size = old ? 1u << chan->circid_table_bits : 0;
+  unsigned i;
+
+  chan->circid_table = tor_calloc(1u << bits, sizeof(*old));
+  chan->circid_table_bits = bits;
+  for (i = 0; i < old_size; ++i) {
+    if (old[i])
+      chan_circid_table_place(chan, old[i]);
+  }
+  tor_free(old);
+}
+
+/** Add <b>ent</b> to the circid table of its channel, growing the table to
+ * keep it at most half full. */
+static void
+chan_circid_table_add(chan_circid_circuit_map_t *ent)
+{
+  channel_t *chan = ent->chan;
+
+  if (!chan->circid_table) {
+    while (!(chan->circid_table_mult & 1))
+      crypto_rand((char *)&chan->circid_table_mult,
+                  sizeof(chan->circid_table_mult));
+    chan_circid_table_resize(chan, CHAN_CIRCID_TABLE_MIN_BITS);
+    if (!chan->wide_circ_ids)
+      chan->circid_bitmap = bitarray_init_zero(CHAN_CIRCID_BITMAP_BITS);
+  } else if ((chan->circid_table_n + 1) * 2 >
+             (1u << chan->circid_table_bits)) {
+    chan_circid_table_resize(chan, chan->circid_table_bits + 1);
+  }
+  chan_circid_table_place(chan, ent);
+  ++chan->circid_table_n;
+  if (chan->circid_bitmap && ent->circ_id < CHAN_CIRCID_BITMAP_BITS)
+    bitarray_set(chan->circid_bitmap, ent->circ_id);
+}
+
+/** Remove <b>ent</b> from the circid table of its channel.  Entries later
+ * in the same probe run are shifted back so that lookups never need
+ * tombstones.  Shrinks the table when it gets sparse, and frees it when it
+ * becomes empty. */
+static void
+chan_circid_table_remove(chan_circid_circuit_map_t *ent)
+{
+  channel_t *chan = ent->chan;
+  unsigned mask, i, j, home;
+
+  if (!chan->circid_table)
+    return;
+  mask = (1u << chan->circid_table_bits) - 1;
+  for (i = chan_circid_table_slot(chan, ent->circ_id);
+       chan->circid_table[i] != ent;
+       i = (i + 1) & mask) {
+    if (BUG(chan->circid_table[i] == NULL))
+      return;
+  }
+
+  chan->circid_table[i] = NULL;
+  if (chan->circid_bitmap && ent->circ_id < CHAN_CIRCID_BITMAP_BITS)
+    bitarray_clear(chan->circid_bitmap, ent->circ_id);
+  for (j = (i + 1) & mask; chan->circid_table[j]; j = (j + 1) & mask) {
+    home = chan_circid_table_slot(chan, chan->circid_table[j]->circ_id);
+    /* The entry at j can fill the hole at i unless its home slot lies
+     * cyclically in (i, j]. */
+    if (i <= j ? (home > i && home <= j) : (home > i || home <= j))
+      continue;
+    chan->circid_table[i] = chan->circid_table[j];
+    chan->circid_table[j] = NULL;
+    i = j;
+  }
+
+  if (--chan->circid_table_n == 0) {
+    tor_free(chan->circid_table);
+    chan->circid_table_bits = 0;
+    bitarray_free(chan->circid_bitmap);
+    chan->circid_bitmap = NULL;
+  } else if (chan->circid_table_bits > CHAN_CIRCID_TABLE_MIN_BITS &&
+             chan->circid_table_n * 8 < (1u << chan->circid_table_bits)) {
+    chan_circid_table_resize(chan, chan->circid_table_bits - 1);
+  }
+}
+
+/** Add <b>ent</b> to the chan,circid map. */
+static void
+chan_circid_entry_insert(chan_circid_circuit_map_t *ent)
+{
+  HT_INSERT(chan_circid_map, &chan_circid_map, ent);
+  chan_circid_table_add(ent);
+}
+
+/** Remove <b>ent</b> from the chan,circid map.  Does not free it. */
+static void
+chan_circid_entry_remove(chan_circid_circuit_map_t *ent)
+{
+  HT_REMOVE(chan_circid_map, &chan_circid_map, ent);
+  chan_circid_table_remove(ent);
+}
 
 /** Implementation helper for circuit_set_{p,n}_circid_channel: A circuit ID
  * and/or channel for circ has just changed from <b>old_chan, old_id</b>
@@ -120,7 +293,6 @@ circuit_set_circid_chan_helper(circuit_t *circ, int direction,
                                circid_t id,
                                channel_t *chan)
 {
-  chan_circid_circuit_map_t search;
   chan_circid_circuit_map_t *found;
   channel_t *old_chan, **chan_ptr;
   circid_t old_id, *circid_ptr;
@@ -142,14 +314,6 @@ circuit_set_circid_chan_helper(circuit_t *circ, int direction,
   if (id == old_id && chan == old_chan)
     return;
 
-  if (_last_circid_chan_ent &&
-      ((old_id == _last_circid_chan_ent->circ_id &&
-        old_chan == _last_circid_chan_ent->chan) ||
-       (id == _last_circid_chan_ent->circ_id &&
-        chan == _last_circid_chan_ent->chan))) {
-    _last_circid_chan_ent = NULL;
-  }
-
   if (old_chan) {
     /*
      * If we're changing channels or ID and had an old channel and a non
@@ -164,10 +328,9 @@ circuit_set_circid_chan_helper(circuit_t *circ, int direction,
     }
 
     /* we may need to remove it from the conn-circid map */
-    search.circ_id = old_id;
-    search.chan = old_chan;
-    found = HT_REMOVE(chan_circid_map, &chan_circid_map, &search);
+    found = chan_circid_table_find(old_chan, old_id);
     if (found) {
+      chan_circid_entry_remove(found);
       tor_free(found);
       if (direction == CELL_DIRECTION_OUT) {
         /* One fewer circuits use old_chan as n_chan */
@@ -188,9 +351,7 @@ circuit_set_circid_chan_helper(circuit_t *circ, int direction,
     return;
 
   /* now add the new one to the conn-circid map */
-  search.circ_id = id;
-  search.chan = chan;
-  found = HT_FIND(chan_circid_map, &chan_circid_map, &search);
+  found = chan_circid_table_find(chan, id);
   if (found) {
     found->circuit = circ;
     found->made_placeholder_at = 0;
@@ -199,7 +360,7 @@ circuit_set_circid_chan_helper(circuit_t *circ, int direction,
     found->circ_id = id;
     found->chan = chan;
     found->circuit = circ;
-    HT_INSERT(chan_circid_map, &chan_circid_map, found);
+    chan_circid_entry_insert(found);
   }
 
   /*
@@ -236,14 +397,10 @@ circuit_set_circid_chan_helper(circuit_t *circ, int direction,
 void
 channel_mark_circid_unusable(channel_t *chan, circid_t id)
 {
-  chan_circid_circuit_map_t search;
   chan_circid_circuit_map_t *ent;
 
   /* See if there's an entry there. That wouldn't be good. */
-  memset(&search, 0, sizeof(search));
-  search.chan = chan;
-  search.circ_id = id;
-  ent = HT_FIND(chan_circid_map, &chan_circid_map, &search);
+  ent = chan_circid_table_find(chan, id);
 
   if (ent && ent->circuit) {
     /* we have a problem. */
@@ -259,34 +416,119 @@ channel_mark_circid_unusable(channel_t *chan, circid_t id)
     ent->circ_id = id;
     /* leave circuit at NULL. */
     ent->made_placeholder_at = approx_time();
-    HT_INSERT(chan_circid_map, &chan_circid_map, ent);
+    chan_circid_entry_insert(ent);
   }
 }
 
+/** Return the number of bits set in <b>v</b>. */
+static inline unsigned
+circid_bitmap_word_popcount(uint32_t v)
+{
+  v = v - ((v >> 1) & 0x55555555);
+  v = (v & 0x33333333) + ((v >> 2) & 0x33333333);
+  return (((v + (v >> 4)) & 0x0f0f0f0f) * 0x01010101) >> 24;
+}
+
+/** Return the bits of word <b>w</b> of a circid_bitmap that stand for
+ * IDs in [<b>lo</b>, <b>hi</b>] that have no entry. */
+static inline uint32_t
+circid_bitmap_free_bits(const bitarray_t *bitmap, unsigned w,
+                        circid_t lo, circid_t hi)
+{
+  uint32_t bits = ~(uint32_t)bitmap[w];
+  if (w == (lo >> 5))
+    bits &= ~(uint32_t)0 << (lo & 31);
+  if (w == (hi >> 5))
+    bits &= ~(uint32_t)0 >> (31 - (hi & 31));
+  return bits;
+}
+
+/** Return a circuit ID chosen uniformly at random from among those in
+ * [<b>lo</b>, <b>hi</b>] that have no entry on <b>chan</b>, or 0 if they
+ * are all in use.  Only works for channels that have a circid_bitmap; this
+ * takes time proportional to the size of the range, but never fails while
+ * there is a free ID, however full the channel is. */
+circid_t
+channel_pick_unused_circid(channel_t *chan, circid_t lo, circid_t hi)
+{
+  unsigned w, n_free = 0, target;
+
+  tor_assert(chan->circid_bitmap);
+  tor_assert(lo <= hi);
+  tor_assert(hi < CHAN_CIRCID_BITMAP_BITS);
+
+  for (w = lo >> 5; w <= (hi >> 5); ++w) {
+    n_free += circid_bitmap_word_popcount(
+                   circid_bitmap_free_bits(chan->circid_bitmap, w, lo, hi));
+  }
+  if (!n_free)
+    return 0;
+
+  target = crypto_fast_rand_int(n_free);
+  for (w = lo >> 5; w <= (hi >> 5); ++w) {
+    uint32_t bits = circid_bitmap_free_bits(chan->circid_bitmap, w, lo, hi);
+    unsigned n = circid_bitmap_word_popcount(bits);
+    unsigned b;
+    if (target >= n) {
+      target -= n;
+      continue;
+    }
+    for (b = 0; b < 32; ++b) {
+      if ((bits & (1u << b)) && target-- == 0)
+        return (circid_t)((w << 5) | b);
+    }
+  }
+  /* LCOV_EXCL_START */
+  tor_assert_nonfatal_unreached();
+  return 0;
+  /* LCOV_EXCL_STOP */
+}
+
 /** Mark that a circuit id <b>id</b> can be used again on <b>chan</b>.
  * We use this to re-enable the circuit ID after we've sent a destroy cell.
  */
 void
 channel_mark_circid_usable(channel_t *chan, circid_t id)
 {
-  chan_circid_circuit_map_t search;
   chan_circid_circuit_map_t *ent;
 
   /* See if there's an entry there. That wouldn't be good. */
-  memset(&search, 0, sizeof(search));
-  search.chan = chan;
-  search.circ_id = id;
-  ent = HT_REMOVE(chan_circid_map, &chan_circid_map, &search);
-  if (ent && ent->circuit) {
+  ent = chan_circid_table_find(chan, id);
+  if (!ent)
+    return;
+  if (ent->circuit) {
     log_warn(LD_BUG, "Tried to mark %u usable on %p, but there was already "
              "a circuit there.", (unsigned)id, chan);
     return;
   }
-  if (_last_circid_chan_ent == ent)
-    _last_circid_chan_ent = NULL;
+  chan_circid_entry_remove(ent);
   tor_free(ent);
 }
 
+/** Remove every entry that is left for <b>chan</b> in the chan,circid map,
+ * and release its circid table.  Called when <b>chan</b> is about to be
+ * freed; by then only circuit IDs reserved for unsent destroy cells should
+ * remain. */
+void
+channel_clear_circid_map(channel_t *chan)
+{
+  chan_circid_circuit_map_t *ent;
+  unsigned i;
+
+  while (chan->circid_table) {
+    for (i = 0; !chan->circid_table[i]; ++i)
+      ;
+    ent = chan->circid_table[i];
+    if (ent->circuit) {
+      log_warn(LD_BUG, "Circuit %p still uses circuit ID %u on channel %p, "
+               "which we are freeing.", ent->circuit,
+               (unsigned)ent->circ_id, chan);
+    }
+    chan_circid_entry_remove(ent);
+    tor_free(ent);
+  }
+}
+
 /** Called to indicate that a DESTROY is pending on <b>chan</b> with
  * circuit ID <b>id</b>, but hasn't been sent yet. */
 void
@@ -341,6 +583,10 @@ circuit_set_p_circid_chan(or_circuit_t *or_circ, circid_t id,
 
   circuit_set_circid_chan_helper(circ, CELL_DIRECTION_IN, id, chan);
 
+  /* Housekeeping measures idle time from here, so don't leave it stale. */
+  if (old_chan && old_chan != chan)
+    old_chan->timestamp_last_had_circuits = approx_time();
+
   if (chan) {
     tor_assert(bool_eq(or_circ->p_chan_cells.n,
                        or_circ->next_active_on_p_chan));
@@ -366,6 +612,9 @@ circuit_set_n_circid_chan(circuit_t *circ, circid_t id,
 
   circuit_set_circid_chan_helper(circ, CELL_DIRECTION_OUT, id, chan);
 
+  if (old_chan && old_chan != chan)
+    old_chan->timestamp_last_had_circuits = approx_time();
+
   if (chan) {
     tor_assert(bool_eq(circ->n_chan_cells.n, circ->next_active_on_n_chan));
 
@@ -378,6 +627,55 @@ circuit_set_n_circid_chan(circuit_t *circ, circid_t id,
   }
 }
 
+/** Return the list of waiting circuits that <b>circ</b> belongs in, given
+ * its current next hop.  If there is no such list yet and <b>create</b> is
+ * true, create it; otherwise return NULL. */
+static smartlist_t *
+circuit_get_pending_list(const circuit_t *circ, int create)
+{
+  smartlist_t *lst;
+  if (!circ->n_hop || tor_digest_is_zero(circ->n_hop->identity_digest)) {
+    if (!circuits_pending_other_chans && create)
+      circuits_pending_other_chans = smartlist_new();
+    return circuits_pending_other_chans;
+  }
+  if (!circuits_pending_chans_by_id) {
+    if (!create)
+      return NULL;
+    circuits_pending_chans_by_id = digestmap_new();
+  }
+  lst = digestmap_get(circuits_pending_chans_by_id,
+                      circ->n_hop->identity_digest);
+  if (!lst && create) {
+    lst = smartlist_new();
+    digestmap_set(circuits_pending_chans_by_id,
+                  circ->n_hop->identity_digest, lst);
+  }
+  return lst;
+}
+
+/** Add <b>circ</b> to the lists of circuits waiting for a channel. */
+static void
+circuit_add_to_pending_list(circuit_t *circ)
+{
+  smartlist_add(circuit_get_pending_list(circ, 1), circ);
+}
+
+/** Remove <b>circ</b> from the lists of circuits waiting for a channel. */
+static void
+circuit_remove_from_pending_list(circuit_t *circ)
+{
+  smartlist_t *lst = circuit_get_pending_list(circ, 0);
+  if (!lst)
+    return;
+  smartlist_remove(lst, circ);
+  if (lst != circuits_pending_other_chans && smartlist_len(lst) == 0) {
+    digestmap_remove(circuits_pending_chans_by_id,
+                     circ->n_hop->identity_digest);
+    smartlist_free(lst);
+  }
+}
+
 /** Change the state of <b>circ</b> to <b>state</b>, adding it to or removing
  * it from lists as appropriate. */
 void
@@ -386,48 +684,69 @@ circuit_set_state(circuit_t *circ, uint8_t state)
   tor_assert(circ);
   if (state == circ->state)
     return;
-  if (!circuits_pending_chans)
-    circuits_pending_chans = smartlist_new();
   if (circ->state == CIRCUIT_STATE_CHAN_WAIT) {
     /* remove from waiting-circuit list. */
-    smartlist_remove(circuits_pending_chans, circ);
+    circuit_remove_from_pending_list(circ);
   }
   if (state == CIRCUIT_STATE_CHAN_WAIT) {
     /* add to waiting-circuit list. */
-    smartlist_add(circuits_pending_chans, circ);
+    circuit_add_to_pending_list(circ);
   }
   if (state == CIRCUIT_STATE_OPEN)
     tor_assert(!circ->n_chan_create_cell);
   circ->state = state;
 }
 
+/** Replace the next hop of <b>circ</b> with <b>n_hop</b> (which may be
+ * NULL), freeing the old one, and move <b>circ</b> between the lists of
+ * waiting circuits as appropriate.  Takes ownership of <b>n_hop</b>. */
+void
+circuit_set_n_hop(circuit_t *circ, extend_info_t *n_hop)
+{
+  tor_assert(circ);
+  if (circ->state == CIRCUIT_STATE_CHAN_WAIT)
+    circuit_remove_from_pending_list(circ);
+  extend_info_free(circ->n_hop);
+  circ->n_hop = n_hop;
+  if (circ->state == CIRCUIT_STATE_CHAN_WAIT)
+    circuit_add_to_pending_list(circ);
+}
+
 /** Append to <b>out</b> all circuits in state CHAN_WAIT waiting for
- * the given connection. */
+ * the given connection.  We only need to look at the circuits waiting for
+ * <b>chan</b>'s identity, and at those whose next hop is unkeyed. */
 void
 circuit_get_all_pending_on_channel(smartlist_t *out, channel_t *chan)
 {
+  smartlist_t *keyed = NULL;
   tor_assert(out);
   tor_assert(chan);
 
-  if (!circuits_pending_chans)
+  if (circuits_pending_chans_by_id &&
+      !tor_digest_is_zero(chan->identity_digest))
+    keyed = digestmap_get(circuits_pending_chans_by_id,
+                          chan->identity_digest);
+  if (keyed) {
+    SMARTLIST_FOREACH_BEGIN(keyed, circuit_t *, circ) {
+      if (circ->marked_for_close)
+        continue;
+      tor_assert(circ->state == CIRCUIT_STATE_CHAN_WAIT);
+      smartlist_add(out, circ);
+    } SMARTLIST_FOREACH_END(circ);
+  }
+
+  if (!circuits_pending_other_chans)
     return;
 
-  SMARTLIST_FOREACH_BEGIN(circuits_pending_chans, circuit_t *, circ) {
+  SMARTLIST_FOREACH_BEGIN(circuits_pending_other_chans, circuit_t *, circ) {
     if (circ->marked_for_close)
       continue;
     if (!circ->n_hop)
       continue;
     tor_assert(circ->state == CIRCUIT_STATE_CHAN_WAIT);
-    if (tor_digest_is_zero(circ->n_hop->identity_digest)) {
-      /* Look at addr/port. This is an unkeyed connection. */
-      if (!channel_matches_extend_info(chan, circ->n_hop))
-        continue;
-    } else {
-      /* We expected a key. See if it's the right one. */
-      if (tor_memneq(chan->identity_digest,
-                     circ->n_hop->identity_digest, DIGEST_LEN))
-        continue;
-    }
+    /* Look at addr/port. This is an unkeyed connection. */
+    if (!channel_matches_extend_info(chan, circ->n_hop))
+      continue;
     smartlist_add(out, circ);
   } SMARTLIST_FOREACH_END(circ);
 }
@@ -453,7 +772,11 @@ circuit_count_pending_on_channel(channel_t *chan)
 }
 
 /** Detach from the global circuit list, and deallocate, all
- * circuits that have been marked for close.
+ * circuits that have been marked for close.  Their storage may be
+ * released over several turns of the event loop, but they are gone from
+ * every index at once.  When a channel fails or we run out of memory, this
+ * can close thousands of circuits, so their destroy cells are queued in a
+ * single batch.
  */
 void
 circuit_close_all_marked(void)
@@ -462,6 +785,7 @@ circuit_close_all_marked(void)
     return;
 
   smartlist_t *lst = circuit_get_global_list();
+  circuitmux_destroy_batch_begin();
   SMARTLIST_FOREACH_BEGIN(circuits_pending_close, circuit_t *, circ) {
     tor_assert(circ->marked_for_close);
 
@@ -475,8 +799,9 @@ circuit_close_all_marked(void)
     circ->global_circuitlist_idx = -1;
 
     circuit_about_to_free(circ);
-    circuit_free(circ);
+    circuit_free_deferred(circ);
   } SMARTLIST_FOREACH_END(circ);
+  circuitmux_destroy_batch_end();
 
   smartlist_clear(circuits_pending_close);
 }
@@ -703,6 +1028,7 @@ init_circuit_base(circuit_t *circ)
   circ->package_window = circuit_initial_package_window();
   circ->deliver_window = CIRCWINDOW_START;
   cell_queue_init(&circ->n_chan_cells);
+  circ->oom_index_idx = -1;
 
   smartlist_add(circuit_get_global_list(), circ);
   circ->global_circuitlist_idx = smartlist_len(circuit_get_global_list()) - 1;
@@ -724,6 +1050,7 @@ origin_circuit_new(void)
 
   circ->next_stream_id = crypto_rand_int(1<<16);
   circ->global_identifier = n_circuits_allocated++;
+  circ->purpose_list_idx = -1;
   circ->remaining_relay_early_cells = MAX_RELAY_EARLY_CELLS_PER_CIRCUIT;
   circ->remaining_relay_early_cells -= crypto_rand_int(2);
 
@@ -768,16 +1095,70 @@ circuit_clear_testing_cell_stats(circuit_t *circ)
   circ->testing_cell_stats = NULL;
 }
 
-/** Deallocate space associated with circ.
- */
-STATIC void
-circuit_free(circuit_t *circ)
+/** Remove <b>circ</b> from every index and map that could lead other code
+ * to it, and drop the references that other modules hold to it.  This is
+ * the cheap part of freeing a circuit; circuit_release() does the rest.
+ * Return true iff circuit_release() may deallocate <b>circ</b>. */
+static int
+circuit_unlink(circuit_t *circ)
+{
+  int should_free = 1;
+
+  if (CIRCUIT_IS_ORIGIN(circ)) {
+    origin_circuit_t *ocirc = TO_ORIGIN_CIRCUIT(circ);
+    tor_assert(circ->magic == ORIGIN_CIRCUIT_MAGIC);
+
+    if (ocirc->n_pending_intro_jobs)
+      rend_service_intro_circ_free(ocirc);
+    circuit_purpose_index_remove(ocirc);
+  } else {
+    or_circuit_t *ocirc = TO_OR_CIRCUIT(circ);
+    tor_assert(circ->magic == OR_CIRCUIT_MAGIC);
+    /* Remember cell statistics for this circuit before deallocating. */
+    if (get_options()->CellStatistics)
+      rep_hist_buffer_stats_add_circ(circ, time(NULL));
+
+    should_free = (ocirc->workqueue_entry == NULL);
+
+    circuit_clear_rend_token(ocirc);
+
+    if (ocirc->rend_splice) {
+      or_circuit_t *other = ocirc->rend_splice;
+      tor_assert(other->base_.magic == OR_CIRCUIT_MAGIC);
+      other->rend_splice = NULL;
+    }
+
+    /* remove from map. */
+    circuit_set_p_circid_chan(ocirc, 0, NULL);
+  }
+
+  if (circ->global_circuitlist_idx != -1) {
+    int idx = circ->global_circuitlist_idx;
+    circuit_t *c2 = smartlist_get(global_circuitlist, idx);
+    tor_assert(c2 == circ);
+    smartlist_del(global_circuitlist, idx);
+    if (idx < smartlist_len(global_circuitlist)) {
+      c2 = smartlist_get(global_circuitlist, idx);
+      c2->global_circuitlist_idx = idx;
+    }
+    circ->global_circuitlist_idx = -1;
+  }
+
+  /* Remove from map. */
+  circuit_set_n_circid_chan(circ, 0, NULL);
+  circuit_oom_index_remove(circ);
+
+  return should_free;
+}
+
+/** Release the storage held by <b>circ</b>, which circuit_unlink() has
+ * already removed from everywhere: its crypto state, cell queues, and
+ * the like.  If <b>should_free</b>, deallocate <b>circ</b> itself too. */
+static void
+circuit_release(circuit_t *circ, int should_free)
 {
   void *mem;
   size_t memlen;
-  int should_free = 1;
-  if (!circ)
-    return;
 
   circuit_clear_testing_cell_stats(circ);
 
@@ -785,7 +1166,6 @@ circuit_free(circuit_t *circ)
     origin_circuit_t *ocirc = TO_ORIGIN_CIRCUIT(circ);
     mem = ocirc;
     memlen = sizeof(origin_circuit_t);
-    tor_assert(circ->magic == ORIGIN_CIRCUIT_MAGIC);
     if (ocirc->build_state) {
         extend_info_free(ocirc->build_state->chosen_exit);
         circuit_free_cpath_node(ocirc->build_state->pending_final_cpath);
@@ -810,30 +1190,14 @@ circuit_free(circuit_t *circ)
     addr_policy_list_free(ocirc->prepend_policy);
   } else {
     or_circuit_t *ocirc = TO_OR_CIRCUIT(circ);
-    /* Remember cell statistics for this circuit before deallocating. */
-    if (get_options()->CellStatistics)
-      rep_hist_buffer_stats_add_circ(circ, time(NULL));
     mem = ocirc;
     memlen = sizeof(or_circuit_t);
-    tor_assert(circ->magic == OR_CIRCUIT_MAGIC);
-
-    should_free = (ocirc->workqueue_entry == NULL);
 
     crypto_cipher_free(ocirc->p_crypto);
     crypto_digest_free(ocirc->p_digest);
     crypto_cipher_free(ocirc->n_crypto);
     crypto_digest_free(ocirc->n_digest);
-
-    circuit_clear_rend_token(ocirc);
-
-    if (ocirc->rend_splice) {
-      or_circuit_t *other = ocirc->rend_splice;
-      tor_assert(other->base_.magic == OR_CIRCUIT_MAGIC);
-      other->rend_splice = NULL;
-    }
-
-    /* remove from map. */
-    circuit_set_p_circid_chan(ocirc, 0, NULL);
+    tor_free(ocirc->buffer_stats);
 
     /* Clear cell queue _after_ removing it from the map.  Otherwise our
      * "active" checks will be violated. */
@@ -843,20 +1207,6 @@ circuit_free(circuit_t *circ)
   extend_info_free(circ->n_hop);
   tor_free(circ->n_chan_create_cell);
 
-  if (circ->global_circuitlist_idx != -1) {
-    int idx = circ->global_circuitlist_idx;
-    circuit_t *c2 = smartlist_get(global_circuitlist, idx);
-    tor_assert(c2 == circ);
-    smartlist_del(global_circuitlist, idx);
-    if (idx < smartlist_len(global_circuitlist)) {
-      c2 = smartlist_get(global_circuitlist, idx);
-      c2->global_circuitlist_idx = idx;
-    }
-  }
-
-  /* Remove from map. */
-  circuit_set_n_circid_chan(circ, 0, NULL);
-
   /* Clear cell queue _after_ removing it from the map.  Otherwise our
    * "active" checks will be violated. */
   cell_queue_clear(&circ->n_chan_cells);
@@ -875,6 +1225,99 @@ circuit_free(circuit_t *circ)
   }
 }
 
+/** Deallocate space associated with circ.
+ */
+STATIC void
+circuit_free(circuit_t *circ)
+{
+  if (!circ)
+    return;
+  circuit_release(circ, circuit_unlink(circ));
+}
+
+/** Circuits that circuit_unlink() has removed from everywhere, but whose
+ * storage we have not yet released; see circuit_reap_unlinked(). */
+static smartlist_t *circuits_pending_free = NULL;
+/** Event that calls circuit_reap_unlinked() on a later turn of the event
+ * loop, while circuits_pending_free is not empty. */
+static struct event *circuit_reap_ev = NULL;
+
+/** How long may one call to circuit_reap_unlinked() spend releasing
+ * circuits, in microseconds? */
+#define CIRCUIT_REAP_BUDGET_USEC 5000
+/** How many circuits do we release between looks at the clock? */
+#define CIRCUIT_REAP_BATCH 16
+
+/** Release the storage of circuits on circuits_pending_free, for about
+ * <b>budget_usec</b> microseconds; if any remain, arrange to be called
+ * again once the event loop has had another turn.  If <b>budget_usec</b>
+ * is negative, release them all regardless of the time it takes. */
+STATIC void
+circuit_reap_unlinked(int64_t budget_usec)
+{
+  monotime_t start, now;
+  int n = 0;
+
+  if (!circuits_pending_free)
+    return;
+
+  monotime_get(&start);
+  while (smartlist_len(circuits_pending_free)) {
+    circuit_t *circ = smartlist_pop_last(circuits_pending_free);
+    circuit_release(circ, 1);
+    if (budget_usec >= 0 && ++n % CIRCUIT_REAP_BATCH == 0) {
+      monotime_get(&now);
+      if (monotime_diff_usec(&start, &now) >= budget_usec)
+        break;
+    }
+  }
+
+  if (smartlist_len(circuits_pending_free)) {
+    log_debug(LD_CIRC, "Released %d closed circuits; %d left for later.",
+              n, smartlist_len(circuits_pending_free));
+    if (circuit_reap_ev)
+      event_active(circuit_reap_ev, EV_TIMEOUT, 1);
+  }
+}
+
+/** Libevent callback: release some more closed circuits. */
+static void
+circuit_reap_cb(evutil_socket_t fd, short what, void *arg)
+{
+  (void) fd;
+  (void) what;
+  (void) arg;
+  circuit_reap_unlinked(CIRCUIT_REAP_BUDGET_USEC);
+}
+
+/** Remove <b>circ</b>, which is about to be freed, from everywhere at once,
+ * but leave releasing its storage to circuit_reap_unlinked() on a later
+ * turn of the event loop. */
+static void
+circuit_free_deferred(circuit_t *circ)
+{
+  if (!circuit_unlink(circ)) {
+    /* A cpuworker still refers to it; it must become a dead circuit now. */
+    circuit_release(circ, 0);
+    return;
+  }
+
+  if (!circuits_pending_free)
+    circuits_pending_free = smartlist_new();
+  if (!circuit_reap_ev) {
+    struct event_base *b = tor_libevent_get_base();
+    if (b) {
+      circuit_reap_ev = tor_event_new(b, -1, 0, circuit_reap_cb, NULL);
+      tor_assert(circuit_reap_ev);
+    }
+  }
+  smartlist_add(circuits_pending_free, circ);
+  if (circuit_reap_ev)
+    event_active(circuit_reap_ev, EV_TIMEOUT, 1);
+  else
+    circuit_reap_unlinked(-1);
+}
+
 /** Deallocate the linked list circ-><b>cpath</b>, and remove the cpath from
  * <b>circ</b>. */
 void
@@ -898,6 +1341,7 @@ circuit_clear_cpath(origin_circuit_t *circ)
   circuit_free_cpath_node(cpath);
 
   circ->cpath = NULL;
+  tor_free(circ->controller_path);
 }
 
 /** Release all storage held by circuits. */
@@ -925,12 +1369,38 @@ circuit_free_all(void)
   smartlist_free(lst);
   global_circuitlist = NULL;
 
-  smartlist_free(circuits_pending_chans);
-  circuits_pending_chans = NULL;
+  if (circuits_pending_chans_by_id) {
+    DIGESTMAP_FOREACH(circuits_pending_chans_by_id, key, smartlist_t *,
+                      pending) {
+      smartlist_free(pending);
+    } DIGESTMAP_FOREACH_END;
+    digestmap_free(circuits_pending_chans_by_id, NULL);
+    circuits_pending_chans_by_id = NULL;
+  }
+
+  smartlist_free(circuits_pending_other_chans);
+  circuits_pending_other_chans = NULL;
 
   smartlist_free(circuits_pending_close);
   circuits_pending_close = NULL;
 
+  circuit_reap_unlinked(-1);
+  smartlist_free(circuits_pending_free);
+  circuits_pending_free = NULL;
+  tor_event_free(circuit_reap_ev);
+  circuit_reap_ev = NULL;
+
+  smartlist_free(circuits_by_cell_age);
+  circuits_by_cell_age = NULL;
+
+  {
+    int i;
+    for (i = 0; i <= CIRCUIT_PURPOSE_C_MAX_; ++i) {
+      smartlist_free(client_circuits_by_purpose[i]);
+      client_circuits_by_purpose[i] = NULL;
+    }
+  }
+
   {
     chan_circid_circuit_map_t **elt, **next, *c;
     for (elt = HT_START(chan_circid_map, &chan_circid_map);
@@ -940,6 +1410,8 @@ circuit_free_all(void)
       next = HT_NEXT_RMV(chan_circid_map, &chan_circid_map, elt);
 
       tor_assert(c->circuit == NULL);
+      tor_free(c->chan->circid_table);
+      c->chan->circid_table_bits = c->chan->circid_table_n = 0;
       tor_free(c);
     }
   }
@@ -1070,19 +1542,9 @@ static inline circuit_t *
 circuit_get_by_circid_channel_impl(circid_t circ_id, channel_t *chan,
                                    int *found_entry_out)
 {
-  chan_circid_circuit_map_t search;
   chan_circid_circuit_map_t *found;
 
-  if (_last_circid_chan_ent &&
-      circ_id == _last_circid_chan_ent->circ_id &&
-      chan == _last_circid_chan_ent->chan) {
-    found = _last_circid_chan_ent;
-  } else {
-    search.circ_id = circ_id;
-    search.chan = chan;
-    found = HT_FIND(chan_circid_map, &chan_circid_map, &search);
-    _last_circid_chan_ent = found;
-  }
+  found = chan_circid_table_find(chan, circ_id);
   if (found && found->circuit) {
     log_debug(LD_CIRC,
               "circuit_get_by_circid_channel_impl() returning circuit %p for"
@@ -1179,14 +1641,9 @@ circuit_id_in_use_on_channel(circid_t circ_id, channel_t *chan)
 time_t
 circuit_id_when_marked_unusable_on_channel(circid_t circ_id, channel_t *chan)
 {
-  chan_circid_circuit_map_t search;
   chan_circid_circuit_map_t *found;
 
-  memset(&search, 0, sizeof(search));
-  search.circ_id = circ_id;
-  search.chan = chan;
-
-  found = HT_FIND(chan_circid_map, &chan_circid_map, &search);
+  found = chan_circid_table_find(chan, circ_id);
 
   if (! found || found->circuit)
     return 0;
@@ -1538,7 +1995,8 @@ circuit_set_intro_point_digest(or_circuit_t *circ, const uint8_t *digest)
  * the circuit we want to create, not the purpose of the circuit we want to
  * cannibalize.
  *
- * If !CIRCLAUNCH_NEED_UPTIME, prefer returning non-uptime circuits.
+ * If !CIRCLAUNCH_NEED_UPTIME, prefer returning non-uptime circuits.  If
+ * CIRCLAUNCH_IS_STEM, return only a circuit stem.
  */
 origin_circuit_t *
 circuit_find_to_cannibalize(uint8_t purpose, extend_info_t *info,
@@ -1548,6 +2006,7 @@ circuit_find_to_cannibalize(uint8_t purpose, extend_info_t *info,
   int need_uptime = (flags & CIRCLAUNCH_NEED_UPTIME) != 0;
   int need_capacity = (flags & CIRCLAUNCH_NEED_CAPACITY) != 0;
   int internal = (flags & CIRCLAUNCH_IS_INTERNAL) != 0;
+  int stem = (flags & CIRCLAUNCH_IS_STEM) != 0;
   const or_options_t *options = get_options();
 
   /* Make sure we're not trying to create a onehop circ by
@@ -1568,10 +2027,12 @@ circuit_find_to_cannibalize(uint8_t purpose, extend_info_t *info,
       origin_circuit_t *circ = TO_ORIGIN_CIRCUIT(circ_);
       if ((!need_uptime || circ->build_state->need_uptime) &&
           (!need_capacity || circ->build_state->need_capacity) &&
-          (internal == circ->build_state->is_internal) &&
+          (stem ? circ->build_state->is_stem :
+                  internal == circ->build_state->is_internal) &&
           !circ->unusable_for_new_conns &&
           circ->remaining_relay_early_cells &&
-          circ->build_state->desired_path_len == DEFAULT_ROUTE_LEN &&
+          circ->build_state->desired_path_len ==
+            (stem ? DEFAULT_ROUTE_LEN - 1 : DEFAULT_ROUTE_LEN) &&
           !circ->build_state->onehop_tunnel &&
           !circ->isolation_values_set) {
         if (info) {
@@ -1746,6 +2207,9 @@ circuit_mark_for_close_, (circuit_t *circ, int reason, int line,
   circ->marked_for_close_reason = reason;
   circ->marked_for_close_orig_reason = orig_reason;
 
+  if (CIRCUIT_IS_ORIGIN(circ))
+    circuit_purpose_index_remove(TO_ORIGIN_CIRCUIT(circ));
+
   if (!CIRCUIT_IS_ORIGIN(circ)) {
     or_circuit_t *or_circ = TO_OR_CIRCUIT(circ);
     if (or_circ->rend_splice) {
@@ -1815,8 +2279,7 @@ circuit_about_to_free(circuit_t *circ)
     }
   }
   if (circ->state == CIRCUIT_STATE_CHAN_WAIT) {
-    if (circuits_pending_chans)
-      smartlist_remove(circuits_pending_chans, circ);
+    circuit_remove_from_pending_list(circ);
   }
   if (CIRCUIT_IS_ORIGIN(circ)) {
     control_event_circuit_status(TO_ORIGIN_CIRCUIT(circ),
@@ -1858,10 +2321,13 @@ circuit_about_to_free(circuit_t *circ)
                                               INTRO_POINT_FAILURE_UNREACHABLE);
       }
     }
+  } else if (circ->purpose == CIRCUIT_PURPOSE_S_REND_JOINED) {
+    rend_service_note_rend_circ_closed(TO_ORIGIN_CIRCUIT(circ));
   }
 
+  /* We leave the cell queues for circuit_release() to clear: detaching
+   * the circuit from its cmux forgets about the cells in them. */
   if (circ->n_chan) {
-    circuit_clear_cell_queue(circ, circ->n_chan);
     /* Only send destroy if the channel isn't closing anyway */
     if (!CHANNEL_CONDEMNED(circ->n_chan)) {
       channel_send_destroy(circ->n_circ_id, circ->n_chan, reason);
@@ -1893,7 +2359,6 @@ circuit_about_to_free(circuit_t *circ)
     }
 
     if (or_circ->p_chan) {
-      circuit_clear_cell_queue(circ, or_circ->p_chan);
       /* Only send destroy if the channel isn't closing anyway */
       if (!CHANNEL_CONDEMNED(or_circ->p_chan)) {
         channel_send_destroy(or_circ->p_circ_id, or_circ->p_chan, reason);
@@ -1928,6 +2393,7 @@ marked_circuit_free_cells(circuit_t *circ)
     if (orcirc->p_mux)
       circuitmux_clear_num_cells(orcirc->p_mux, circ);
   }
+  circuit_oom_index_remove(circ);
 }
 
 static size_t
@@ -1993,6 +2459,82 @@ n_cells_in_circ_queues(const circuit_t *c)
   return n;
 }
 
+/** Return the number of bytes that the circuit <b>c</b> holds for itself:
+ * its struct, and any extension blocks and path state hanging off it, but
+ * not its queued cells or its crypto state. */
+STATIC size_t
+circuit_struct_mem_usage(const circuit_t *c)
+{
+  size_t n;
+  if (CIRCUIT_IS_ORIGIN(c)) {
+    const origin_circuit_t *oc = CONST_TO_ORIGIN_CIRCUIT(c);
+    const crypt_path_t *cp = oc->cpath;
+    n = sizeof(origin_circuit_t);
+    if (oc->build_state)
+      n += sizeof(cpath_build_state_t);
+    if (cp) {
+      do {
+        n += sizeof(crypt_path_t);
+        cp = cp->next;
+      } while (cp != oc->cpath);
+    }
+    if (oc->rend_data)
+      n += sizeof(rend_data_t);
+  } else {
+    const or_circuit_t *orc = CONST_TO_OR_CIRCUIT(c);
+    n = sizeof(or_circuit_t);
+    if (orc->rendinfo)
+      n += sizeof(or_circuit_rendinfo_t);
+    if (orc->buffer_stats)
+      n += sizeof(or_circuit_buffer_stats_t);
+  }
+  if (c->n_hop)
+    n += sizeof(extend_info_t);
+  if (c->n_chan_create_cell)
+    n += sizeof(create_cell_t);
+  if (c->testing_cell_stats)
+    n += smartlist_len(c->testing_cell_stats) *
+      (sizeof(testing_cell_stats_entry_t) + sizeof(void*));
+  return n;
+}
+
+/** Log, at severity <b>severity</b>, how much memory our circuits are
+ * using, and how much of it goes to their structs versus their queued
+ * cells. */
+void
+dump_circuit_mem_usage(int severity)
+{
+  int n_origin = 0, n_or = 0;
+  size_t origin_bytes = 0, or_bytes = 0, cell_bytes = 0;
+  size_t n_circs;
+
+  SMARTLIST_FOREACH_BEGIN(circuit_get_global_list(), circuit_t *, c) {
+    if (CIRCUIT_IS_ORIGIN(c)) {
+      ++n_origin;
+      origin_bytes += circuit_struct_mem_usage(c);
+    } else {
+      ++n_or;
+      or_bytes += circuit_struct_mem_usage(c);
+    }
+    cell_bytes += n_cells_in_circ_queues(c) * sizeof(packed_cell_t);
+  } SMARTLIST_FOREACH_END(c);
+
+  n_circs = n_origin + n_or;
+  tor_log(severity, LD_MM,
+          "Circuits: %d origin circuits using "U64_FORMAT" bytes, %d OR "
+          "circuits using "U64_FORMAT" bytes, and "U64_FORMAT" bytes of "
+          "queued cells.",
+          n_origin, U64_PRINTF_ARG(origin_bytes),
+          n_or, U64_PRINTF_ARG(or_bytes), U64_PRINTF_ARG(cell_bytes));
+  tor_log(severity, LD_MM,
+          "That's "U64_FORMAT" bytes per circuit on average, not counting "
+          "crypto state. (Bare structs: %d bytes per origin circuit, %d per "
+          "OR circuit.)",
+          U64_PRINTF_ARG(n_circs ?
+                         (origin_bytes + or_bytes + cell_bytes) / n_circs : 0),
+          (int)sizeof(origin_circuit_t), (int)sizeof(or_circuit_t));
+}
+
 /**
  * Return the age of the oldest cell queued on <b>c</b>, in milliseconds.
  * Return 0 if there are no cells queued on c.  Requires that <b>now</b> be
@@ -2093,6 +2635,158 @@ circuit_max_queued_item_age(const circuit_t *c, uint32_t now)
     return data_age;
 }
 
+/** Set *<b>time_out</b> to the insertion time of the oldest cell queued on
+ * <b>c</b>, and return 1.  Return 0 if no cells are queued on <b>c</b>. */
+STATIC int
+circuit_oldest_cell_time(const circuit_t *c, uint32_t *time_out)
+{
+  const packed_cell_t *cell, *cell2 = NULL;
+
+  cell = TOR_SIMPLEQ_FIRST(&c->n_chan_cells.head);
+  if (! CIRCUIT_IS_ORIGIN(c))
+    cell2 = TOR_SIMPLEQ_FIRST(&CONST_TO_OR_CIRCUIT(c)->p_chan_cells.head);
+  if (!cell || (cell2 &&
+                (int32_t)(cell2->inserted_time - cell->inserted_time) < 0))
+    cell = cell2;
+  if (!cell)
+    return 0;
+  *time_out = cell->inserted_time;
+  return 1;
+}
+
+/** Remove <b>circ</b> from the client circuit index, if it is there. */
+static void
+circuit_purpose_index_remove(origin_circuit_t *circ)
+{
+  smartlist_t *lst;
+  int idx = circ->purpose_list_idx;
+
+  if (idx < 0)
+    return;
+  lst = client_circuits_by_purpose[circ->indexed_purpose];
+  tor_assert(smartlist_get(lst, idx) == circ);
+  smartlist_del(lst, idx);
+  if (idx < smartlist_len(lst)) {
+    origin_circuit_t *replacement = smartlist_get(lst, idx);
+    replacement->purpose_list_idx = idx;
+  }
+  circ->purpose_list_idx = -1;
+}
+
+/** Put <b>circ</b> in the client circuit index under its current purpose,
+ * taking it out of the list for any previous purpose.  Circuits that are
+ * not client origin circuits, or that are marked for close, are kept out
+ * of the index.  Must be called whenever an origin circuit's purpose is
+ * set. */
+void
+circuit_update_purpose_index(circuit_t *circ)
+{
+  origin_circuit_t *ocirc;
+  smartlist_t *lst;
+
+  if (!CIRCUIT_IS_ORIGIN(circ))
+    return;
+  ocirc = TO_ORIGIN_CIRCUIT(circ);
+  if (ocirc->purpose_list_idx >= 0 &&
+      ocirc->indexed_purpose == circ->purpose)
+    return;
+
+  circuit_purpose_index_remove(ocirc);
+  if (!CIRCUIT_PURPOSE_IS_CLIENT(circ->purpose) || circ->marked_for_close)
+    return;
+
+  lst = client_circuits_by_purpose[circ->purpose];
+  if (!lst)
+    lst = client_circuits_by_purpose[circ->purpose] = smartlist_new();
+  smartlist_add(lst, ocirc);
+  ocirc->purpose_list_idx = smartlist_len(lst) - 1;
+  ocirc->indexed_purpose = circ->purpose;
+}
+
+/** Return a list of the unmarked origin circuits with the client purpose
+ * <b>purpose</b>.  The caller must not modify the list, or mark or free
+ * any circuit while iterating over it. */
+const smartlist_t *
+circuit_get_client_circuits_by_purpose(uint8_t purpose)
+{
+  tor_assert(CIRCUIT_PURPOSE_IS_CLIENT(purpose));
+  if (!client_circuits_by_purpose[purpose])
+    client_circuits_by_purpose[purpose] = smartlist_new();
+  return client_circuits_by_purpose[purpose];
+}
+
+/** Helper for circuits_by_cell_age: order circuits by oom_cell_time, oldest
+ * first, allowing for the millisecond counter to wrap. */
+static int
+circuits_compare_by_oom_cell_time_(const void *a_, const void *b_)
+{
+  const circuit_t *a = a_;
+  const circuit_t *b = b_;
+  int32_t diff = (int32_t)(a->oom_cell_time - b->oom_cell_time);
+
+  if (diff < 0)
+    return -1;
+  else if (diff == 0)
+    return 0;
+  else
+    return 1;
+}
+
+/** Called when <b>cell</b> has just been appended to one of the cell queues
+ * on <b>circ</b>: make sure that <b>circ</b> is in the OOM index.  If it is
+ * already there, its key is no newer than any queued cell, so we leave it
+ * alone. */
+void
+circuit_note_cell_queued(circuit_t *circ, const packed_cell_t *cell)
+{
+  if (circ->oom_index_idx >= 0)
+    return;
+  if (!circuits_by_cell_age)
+    circuits_by_cell_age = smartlist_new();
+  circ->oom_cell_time = cell->inserted_time;
+  smartlist_pqueue_add(circuits_by_cell_age,
+                       circuits_compare_by_oom_cell_time_,
+                       STRUCT_OFFSET(circuit_t, oom_index_idx), circ);
+}
+
+/** Remove <b>circ</b> from the OOM index, if it is there. */
+static void
+circuit_oom_index_remove(circuit_t *circ)
+{
+  if (circ->oom_index_idx < 0)
+    return;
+  smartlist_pqueue_remove(circuits_by_cell_age,
+                          circuits_compare_by_oom_cell_time_,
+                          STRUCT_OFFSET(circuit_t, oom_index_idx), circ);
+}
+
+/** Return the circuit in the OOM index with the oldest queued cell, or NULL
+ * if there is none.  Stale entries found at the front of the index along
+ * the way are dropped or re-keyed, so the key of the returned circuit is
+ * exact. */
+STATIC circuit_t *
+circuit_oom_index_get_oldest(void)
+{
+  circuit_t *circ;
+  uint32_t t;
+
+  while (circuits_by_cell_age && smartlist_len(circuits_by_cell_age)) {
+    circ = smartlist_get(circuits_by_cell_age, 0);
+    if (! circuit_oldest_cell_time(circ, &t)) {
+      circuit_oom_index_remove(circ);
+    } else if (t != circ->oom_cell_time) {
+      circuit_oom_index_remove(circ);
+      circ->oom_cell_time = t;
+      smartlist_pqueue_add(circuits_by_cell_age,
+                           circuits_compare_by_oom_cell_time_,
+                           STRUCT_OFFSET(circuit_t, oom_index_idx), circ);
+    } else {
+      return circ;
+    }
+  }
+  return NULL;
+}
+
 /** Helper to sort a list of circuit_t by age of oldest item, in descending
  * order. */
 static int
@@ -2133,15 +2827,25 @@ conns_compare_by_buffer_age_(const void **a_, const void **b_)
 
 #define FRACTION_OF_DATA_TO_RETAIN_ON_OOM 0.90
 
+/** Most circuits we will kill in a single call to circuits_handle_oom().
+ * If that isn't enough, the next cell we queue calls us again. */
+#define OOM_MAX_CIRCUITS_KILLED_PER_CALL 1000
+
 /** We're out of memory for cells, having allocated <b>current_allocation</b>
  * bytes' worth.  Kill the 'worst' circuits until we're under
- * FRACTION_OF_DATA_TO_RETAIN_ON_OOM of our maximum usage. */
+ * FRACTION_OF_DATA_TO_RETAIN_ON_OOM of our maximum usage.
+ *
+ * Circuits are killed in order of the age of their oldest queued cell or
+ * stream data.  We find the oldest cells through circuits_by_cell_age, so
+ * that killing k circuits only costs O(k log n); only the circuits with
+ * attached streams get their stream buffers examined and sorted. */
 void
 circuits_handle_oom(size_t current_allocation)
 {
   smartlist_t *circlist;
+  smartlist_t *stream_circs;
   smartlist_t *connection_array = get_connection_array();
-  int conn_idx;
+  int conn_idx, stream_idx;
   size_t mem_to_recover;
   size_t mem_recovered=0;
   int n_circuits_killed=0;
@@ -2159,21 +2863,22 @@ circuits_handle_oom(size_t current_allocation)
     mem_to_recover = current_allocation - mem_target;
   }
 
-  now_ms = (uint32_t)monotime_coarse_absolute_msec();
+  now_ms = (uint32_t)monotime_coarse_absolute_msec_cached();
 
+  /* Stream buffers aren't indexed, so look at the circuits that have
+   * streams and sort those by the age of their oldest cell or data. */
   circlist = circuit_get_global_list();
+  stream_circs = smartlist_new();
   SMARTLIST_FOREACH_BEGIN(circlist, circuit_t *, circ) {
+    const edge_connection_t *streams = CIRCUIT_IS_ORIGIN(circ) ?
+      TO_ORIGIN_CIRCUIT(circ)->p_streams : TO_OR_CIRCUIT(circ)->n_streams;
+    if (!streams)
+      continue;
     circ->age_tmp = circuit_max_queued_item_age(circ, now_ms);
+    if (circ->age_tmp)
+      smartlist_add(stream_circs, circ);
   } SMARTLIST_FOREACH_END(circ);
-
-  /* This is O(n log n); there are faster algorithms we could use instead.
-   * Let's hope this doesn't happen enough to be in the critical path. */
-  smartlist_sort(circlist, circuits_compare_by_oldest_queued_item_);
-
-  /* Fix up the indices before we run into trouble */
-  SMARTLIST_FOREACH_BEGIN(circlist, circuit_t *, circ) {
-    circ->global_circuitlist_idx = circ_sl_idx;
-  } SMARTLIST_FOREACH_END(circ);
+  smartlist_sort(stream_circs, circuits_compare_by_oldest_queued_item_);
 
   /* Now sort the connection array ... */
   now_ms_for_buf_cmp = now_ms;
@@ -2185,20 +2890,37 @@ circuits_handle_oom(size_t current_allocation)
     conn->conn_array_index = conn_sl_idx;
   } SMARTLIST_FOREACH_END(conn);
 
-  /* Okay, now the worst circuits and connections are at the front of their
-   * respective lists. Let's mark them, and reclaim their storage
-   * aggressively. */
+  /* Okay, now take the worst circuit from either the cell index or the
+   * stream list, and the worst connections from the front of their list.
+   * Let's mark them, and reclaim their storage aggressively. */
   conn_idx = 0;
-  SMARTLIST_FOREACH_BEGIN(circlist, circuit_t *, circ) {
+  stream_idx = 0;
+  while (n_circuits_killed < OOM_MAX_CIRCUITS_KILLED_PER_CALL) {
+    circuit_t *circ = circuit_oom_index_get_oldest();
+    circuit_t *stream_circ = NULL;
+    uint32_t circ_age = 0;
     size_t n;
     size_t freed;
+    int was_marked;
+
+    if (circ)
+      circ_age = now_ms - circ->oom_cell_time;
+    if (stream_idx < smartlist_len(stream_circs))
+      stream_circ = smartlist_get(stream_circs, stream_idx);
+    if (stream_circ && (!circ || stream_circ->age_tmp > circ_age)) {
+      circ = stream_circ;
+      circ_age = stream_circ->age_tmp;
+      ++stream_idx;
+    }
+    if (!circ)
+      break;
 
     /* Free storage in any non-linked directory connections that have buffered
      * data older than this circuit. */
     while (conn_idx < smartlist_len(connection_array)) {
       connection_t *conn = smartlist_get(connection_array, conn_idx);
       uint32_t conn_age = conn_get_buffer_age(conn, now_ms);
-      if (conn_age < circ->age_tmp) {
+      if (conn_age < circ_age) {
         break;
       }
       if (conn->type == CONN_TYPE_DIR && conn->linked_conn == NULL) {
@@ -2214,22 +2936,25 @@ circuits_handle_oom(size_t current_allocation)
       ++conn_idx;
     }
 
-    /* Now, kill the circuit. */
+    /* Now, kill the circuit.  This also takes it out of the cell index. */
     n = n_cells_in_circ_queues(circ);
-    if (! circ->marked_for_close) {
+    was_marked = circ->marked_for_close != 0;
+    if (! was_marked) {
       circuit_mark_for_close(circ, END_CIRC_REASON_RESOURCELIMIT);
     }
     marked_circuit_free_cells(circ);
     freed = marked_circuit_free_stream_bytes(circ);
 
-    ++n_circuits_killed;
+    /* A circuit can come up from both lists; only count it once. */
+    if (!was_marked || n || freed)
+      ++n_circuits_killed;
 
     mem_recovered += n * packed_cell_mem_cost();
     mem_recovered += freed;
 
     if (mem_recovered >= mem_to_recover)
       goto done_recovering_mem;
-  } SMARTLIST_FOREACH_END(circ);
+  }
 
  done_recovering_mem:
 
@@ -2240,6 +2965,7 @@ circuits_handle_oom(size_t current_allocation)
              n_circuits_killed,
              smartlist_len(circlist) - n_circuits_killed,
              n_dirconns_killed);
+  smartlist_free(stream_circs);
 }
 
 /** Verify that cpath layer <b>cp</b> has all of its invariants
@@ -2351,12 +3077,13 @@ assert_circuit_ok(const circuit_t *c)
       tor_assert(or_circ->p_digest);
     }
   }
-  if (c->state == CIRCUIT_STATE_CHAN_WAIT && !c->marked_for_close) {
-    tor_assert(circuits_pending_chans &&
-               smartlist_contains(circuits_pending_chans, c));
-  } else {
-    tor_assert(!circuits_pending_chans ||
-               !smartlist_contains(circuits_pending_chans, c));
+  {
+    const smartlist_t *pending = circuit_get_pending_list(c, 0);
+    if (c->state == CIRCUIT_STATE_CHAN_WAIT && !c->marked_for_close) {
+      tor_assert(pending && smartlist_contains(pending, c));
+    } else {
+      tor_assert(!pending || !smartlist_contains(pending, c));
+    }
   }
   if (origin_circ && origin_circ->cpath) {
     assert_cpath_ok(origin_circ->cpath);
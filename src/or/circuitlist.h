@@ -26,9 +26,13 @@ void circuit_set_n_circid_chan(circuit_t *circ, circid_t id,
                                channel_t *chan);
 void channel_mark_circid_unusable(channel_t *chan, circid_t id);
 void channel_mark_circid_usable(channel_t *chan, circid_t id);
+void channel_clear_circid_map(channel_t *chan);
+circid_t channel_pick_unused_circid(channel_t *chan, circid_t lo,
+                                    circid_t hi);
 time_t circuit_id_when_marked_unusable_on_channel(circid_t circ_id,
                                                   channel_t *chan);
 void circuit_set_state(circuit_t *circ, uint8_t state);
+void circuit_set_n_hop(circuit_t *circ, extend_info_t *n_hop);
 void circuit_close_all_marked(void);
 int32_t circuit_initial_package_window(void);
 origin_circuit_t *origin_circuit_new(void);
@@ -70,6 +74,10 @@ void assert_cpath_layer_ok(const crypt_path_t *cp);
 void assert_circuit_ok(const circuit_t *c);
 void circuit_free_all(void);
 void circuits_handle_oom(size_t current_allocation);
+void circuit_note_cell_queued(circuit_t *circ, const packed_cell_t *cell);
+void circuit_update_purpose_index(circuit_t *circ);
+const smartlist_t *circuit_get_client_circuits_by_purpose(uint8_t purpose);
+void dump_circuit_mem_usage(int severity);
 
 void circuit_clear_testing_cell_stats(circuit_t *circ);
 
@@ -80,9 +88,13 @@ MOCK_DECL(void, channel_note_destroy_not_pending,
 #ifdef CIRCUITLIST_PRIVATE
 STATIC void circuit_free(circuit_t *circ);
 STATIC size_t n_cells_in_circ_queues(const circuit_t *c);
+STATIC size_t circuit_struct_mem_usage(const circuit_t *c);
 STATIC uint32_t circuit_max_queued_data_age(const circuit_t *c, uint32_t now);
 STATIC uint32_t circuit_max_queued_cell_age(const circuit_t *c, uint32_t now);
 STATIC uint32_t circuit_max_queued_item_age(const circuit_t *c, uint32_t now);
+STATIC int circuit_oldest_cell_time(const circuit_t *c, uint32_t *time_out);
+STATIC circuit_t *circuit_oom_index_get_oldest(void);
+STATIC void circuit_reap_unlinked(int64_t budget_usec);
 #endif
 
 #endif
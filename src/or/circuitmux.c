@@ -69,6 +69,7 @@
  *     made to attach all existing circuits to the new policy.
  **/
 
+#define CIRCUITMUX_PRIVATE
 #include "or.h"
 #include "channel.h"
 #include "circuitlist.h"
@@ -123,15 +124,14 @@ struct circuitmux_s {
 
   /** List of queued destroy cells */
   cell_queue_t destroy_cell_queue;
-  /** Boolean: True iff the last cell to circuitmux_get_first_active_circuit
-   * returned the destroy queue. Used to force alternation between
-   * destroy/non-destroy cells.
-   *
-   * XXXX There is no reason to think that alternating is a particularly good
-   * approach -- it's just designed to prevent destroys from starving other
-   * cells completely.
-   */
-  unsigned int last_cell_was_destroy : 1;
+  /** How many destroy cells circuitmux_get_first_active_circuit() has
+   * returned since it last returned a circuit.  We let this run up to
+   * circuitmux_destroy_burst_limit() before giving other cells a turn, so
+   * that destroys neither starve other cells nor get starved by them. */
+  unsigned int destroy_burst;
+  /** Boolean: true iff this cmux has queued destroy cells during the
+   * current destroy batch, and its channel still needs to be primed. */
+  unsigned int in_destroy_batch : 1;
   /** Destroy counter: increment this when a destroy gets queued, decrement
    * when we unqueue it, so we can test to make sure they don't starve.
    */
@@ -220,6 +220,15 @@ static void circuitmux_assert_okay_pass_three(circuitmux_t *cmux);
 /** Count the destroy balance to debug destroy queue logic */
 static int64_t global_destroy_ctr = 0;
 
+/** How many times has circuitmux_destroy_batch_begin() been called without
+ * a matching circuitmux_destroy_batch_end()? */
+static int destroy_batch_depth = 0;
+/** Global identifiers of the channels that had destroy cells queued during
+ * the current destroy batch, as uint64_t *. */
+static smartlist_t *destroy_batch_chans = NULL;
+/** How many destroy cells have been queued during the current batch? */
+static int destroy_batch_n_cells = 0;
+
 /* Function definitions */
 
 /**
@@ -517,31 +526,6 @@ circuitmux_detach_all_circuits(circuitmux_t *cmux, smartlist_t *detached_out)
   cmux->n_cells = 0;
 }
 
-/** Reclaim all circuit IDs currently marked as unusable on <b>chan</b> because
- * of pending destroy cells in <b>cmux</b>.
- *
- * This function must be called AFTER circuits are unlinked from the (channel,
- * circuid-id) map with circuit_unlink_all_from_channel(), but before calling
- * circuitmux_free().
- */
-void
-circuitmux_mark_destroyed_circids_usable(circuitmux_t *cmux, channel_t *chan)
-{
-  packed_cell_t *cell;
-  int n_bad = 0;
-  TOR_SIMPLEQ_FOREACH(cell, &cmux->destroy_cell_queue.head, next) {
-    circid_t circid = 0;
-    if (packed_cell_is_destroy(chan, cell, &circid)) {
-      channel_mark_circid_usable(chan, circid);
-    } else {
-      ++n_bad;
-    }
-  }
-  if (n_bad)
-    log_warn(LD_BUG, "%d cell(s) on destroy queue did not look like a "
-             "DESTROY cell.", n_bad);
-}
-
 /**
  * Free a circuitmux_t; the circuits must be detached first with
  * circuitmux_detach_all_circuits().
@@ -1461,6 +1445,29 @@ circuitmux_set_num_cells(circuitmux_t *cmux, circuit_t *circ,
  * notify that cells have been transmitted.
  */
 
+/** Largest number of destroy cells in a row that
+ * circuitmux_get_first_active_circuit() will hand out while there are
+ * other cells waiting. */
+#define CMUX_MAX_DESTROY_BURST 64
+
+/** Return how many destroy cells in a row <b>cmux</b> may send before it
+ * gives a circuit a turn.  We share the channel between the destroy queue
+ * and the circuits in proportion to how many cells each has waiting: with
+ * just a few destroys pending we alternate, as we always have, but when a
+ * mass close has queued thousands of them we drain them faster, so that
+ * their circuit IDs get reclaimed and the other side frees its state. */
+STATIC unsigned int
+circuitmux_destroy_burst_limit(const circuitmux_t *cmux)
+{
+  unsigned int limit;
+
+  limit = 1 + cmux->destroy_cell_queue.n / (cmux->n_cells + 1);
+  if (limit > CMUX_MAX_DESTROY_BURST)
+    limit = CMUX_MAX_DESTROY_BURST;
+
+  return limit;
+}
+
 /**
  * Pick a circuit to send from, using the active circuits list or a
  * circuitmux policy if one is available.  This is called from channel.c.
@@ -1484,15 +1491,15 @@ circuitmux_get_first_active_circuit(circuitmux_t *cmux,
   *destroy_queue_out = NULL;
 
   if (cmux->destroy_cell_queue.n &&
-        (!cmux->last_cell_was_destroy || cmux->n_active_circuits == 0)) {
-    /* We have destroy cells to send, and either we just sent a relay cell,
-     * or we have no relay cells to send. */
+      (cmux->destroy_burst < circuitmux_destroy_burst_limit(cmux) ||
+       cmux->n_active_circuits == 0)) {
+    /* We have destroy cells to send, and either we haven't used up our
+     * share of the channel on them yet, or we have no relay cells to send. */
 
     /* XXXX We should let the cmux policy have some say in this eventually. */
-    /* XXXX Alternating is not a terribly brilliant approach here. */
     *destroy_queue_out = &cmux->destroy_cell_queue;
 
-    cmux->last_cell_was_destroy = 1;
+    ++cmux->destroy_burst;
   } else if (cmux->n_active_circuits > 0) {
     /* We also must have a cell available for this to be the case */
     tor_assert(cmux->n_cells > 0);
@@ -1505,7 +1512,7 @@ circuitmux_get_first_active_circuit(circuitmux_t *cmux,
       tor_assert(cmux->active_circuits_head);
       circ = cmux->active_circuits_head;
     }
-    cmux->last_cell_was_destroy = 0;
+    cmux->destroy_burst = 0;
   } else {
     tor_assert(cmux->n_cells == 0);
     tor_assert(cmux->destroy_cell_queue.n == 0);
@@ -1883,7 +1890,10 @@ circuitmux_assert_okay_pass_three(circuitmux_t *cmux)
   }
 }
 
-/*DOCDOC */
+/** Queue a destroy cell for circuit ID <b>circ_id</b> with reason
+ * <b>reason</b> on <b>cmux</b>, which belongs to <b>chan</b>.  Inside a
+ * destroy batch, we only remember that <b>chan</b> needs to be primed, and
+ * do it once for all its destroys in circuitmux_destroy_batch_end(). */
 void
 circuitmux_append_destroy_cell(channel_t *chan,
                                circuitmux_t *cmux,
@@ -1902,6 +1912,17 @@ circuitmux_append_destroy_cell(channel_t *chan,
   /* Destroy entering the queue, update counters */
   ++(cmux->destroy_ctr);
   ++global_destroy_ctr;
+
+  if (destroy_batch_depth > 0) {
+    ++destroy_batch_n_cells;
+    if (!cmux->in_destroy_batch) {
+      cmux->in_destroy_batch = 1;
+      smartlist_add(destroy_batch_chans,
+                    tor_memdup(&chan->global_identifier, sizeof(uint64_t)));
+    }
+    return;
+  }
+
   log_debug(LD_CIRC,
             "Cmux at %p queued a destroy for circ %u, cmux counter is now "
             I64_FORMAT", global counter is now "I64_FORMAT,
@@ -1920,6 +1941,61 @@ circuitmux_append_destroy_cell(channel_t *chan,
   }
 }
 
+/** Start a destroy batch: until the matching
+ * circuitmux_destroy_batch_end(), circuitmux_append_destroy_cell() queues
+ * destroy cells without trying to flush anything.  Use this around code
+ * that may close a great many circuits at once, so that each channel is
+ * primed once rather than once per circuit.  Batches may nest. */
+void
+circuitmux_destroy_batch_begin(void)
+{
+  if (destroy_batch_depth++ == 0) {
+    destroy_batch_chans = smartlist_new();
+    destroy_batch_n_cells = 0;
+  }
+}
+
+/** End a destroy batch started with circuitmux_destroy_batch_begin().  When
+ * the outermost batch ends, prime every channel that got destroy cells
+ * during it. */
+void
+circuitmux_destroy_batch_end(void)
+{
+  int n_chans;
+
+  tor_assert(destroy_batch_depth > 0);
+  if (--destroy_batch_depth > 0)
+    return;
+
+  n_chans = smartlist_len(destroy_batch_chans);
+  /* The channels might have gone away since they queued their destroys, so
+   * look them up again by identifier. */
+  SMARTLIST_FOREACH_BEGIN(destroy_batch_chans, uint64_t *, idp) {
+    channel_t *chan = channel_find_by_global_id(*idp);
+    tor_free(idp);
+    if (!chan || !chan->cmux)
+      continue;
+    chan->cmux->in_destroy_batch = 0;
+    if (CHANNEL_CONDEMNED(chan))
+      continue;
+    if (!channel_has_queued_writes(chan)) {
+      log_debug(LD_GENERAL, "Primed a buffer.");
+      channel_flush_from_first_active_circuit(chan, 1);
+    }
+  } SMARTLIST_FOREACH_END(idp);
+  smartlist_free(destroy_batch_chans);
+  destroy_batch_chans = NULL;
+
+  if (destroy_batch_n_cells) {
+    log_debug(LD_CIRC,
+              "Queued %d destroy cells on %d channels in one batch; global "
+              "counter is now "I64_FORMAT,
+              destroy_batch_n_cells, n_chans,
+              I64_PRINTF_ARG(global_destroy_ctr));
+  }
+  destroy_batch_n_cells = 0;
+}
+
 /*DOCDOC; for debugging 12184.  This runs slowly. */
 int64_t
 circuitmux_count_queued_destroy_cells(const channel_t *chan,
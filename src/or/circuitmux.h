@@ -149,12 +149,17 @@ void circuitmux_set_num_cells(circuitmux_t *cmux, circuit_t *circ,
 void circuitmux_append_destroy_cell(channel_t *chan,
                                     circuitmux_t *cmux, circid_t circ_id,
                                     uint8_t reason);
-void circuitmux_mark_destroyed_circids_usable(circuitmux_t *cmux,
-                                              channel_t *chan);
+
+void circuitmux_destroy_batch_begin(void);
+void circuitmux_destroy_batch_end(void);
 
 /* Optional interchannel comparisons for scheduling */
 MOCK_DECL(int, circuitmux_compare_muxes,
           (circuitmux_t *cmux_1, circuitmux_t *cmux_2));
 
+#ifdef CIRCUITMUX_PRIVATE
+STATIC unsigned int circuitmux_destroy_burst_limit(const circuitmux_t *cmux);
+#endif
+
 #endif /* TOR_CIRCUITMUX_H */
 
@@ -15,12 +15,14 @@
  * before now has weight ewma_scale_factor ^ X , where ewma_scale_factor is
  * between 0.0 and 1.0.
  *
- * For efficiency, we do not re-scale these averages every time we send a
- * cell: that would be horribly inefficient.  Instead, we we keep the cell
- * count on all circuits on the same circuitmux scaled relative to a single
- * tick.  When we add a new cell, we scale its weight depending on the time
- * that has elapsed since the tick.  We do re-scale the circuits on the
- * circuitmux periodically, so that we don't overflow double.
+ * For efficiency, we never re-scale these averages when time passes.
+ * Instead, we weight every cell as of a single fixed epoch, so that a cell
+ * sent later counts for more, and we keep the logarithm of each count so
+ * that those weights can't overflow.  Since every count is scaled the same
+ * way, comparing them gives the same answer as comparing the real averages.
+ * Each circuitmux keeps its active circuits in a 4-ary heap ordered by
+ * count, so picking a circuit takes O(1) and sending on it takes
+ * O(log n).
  *
  *
  * This module should be used through the interfaces in circuitmux.c, which it
@@ -32,6 +34,7 @@
 
 #include "orconfig.h"
 
+#include <float.h>
 #include <math.h>
 
 #include "or.h"
@@ -55,6 +58,15 @@
 #define EPSILON 0.00001
 /** The natural logarithm of 0.5. */
 #define LOG_ONEHALF -0.69314718055994529
+/** The natural logarithm of 0.1. */
+#define LOG_ONETENTH -2.30258509299404568
+/** Stands in for log(0), the log cell count of a circuit that hasn't sent
+ * anything.  It's finite, so that we never compute inf - inf. */
+#define EWMA_LOG_ZERO (-DBL_MAX)
+
+/** How many children does each node in the active circuit heap have?  A
+ * wider heap is shallower, so sifting down touches fewer cache lines. */
+#define EWMA_HEAP_ARITY 4
 
 /*** EWMA structures ***/
 
@@ -70,14 +82,15 @@ typedef struct ewma_policy_circ_data_s ewma_policy_circ_data_t;
  */
 
 struct cell_ewma_s {
-  /** The last 'tick' at which we recalibrated cell_count.
-   *
-   * A cell sent at exactly the start of this tick has weight 1.0. Cells sent
-   * since the start of this tick have weight greater than 1.0; ones sent
-   * earlier have less weight. */
-  unsigned int last_adjusted_tick;
-  /** The EWMA of the cell count. */
-  double cell_count;
+  /** The natural logarithm of the EWMA of the cell count, with each cell
+   * weighted as of ewma_epoch_tick rather than as of now; EWMA_LOG_ZERO if
+   * we have never sent a cell.  See "Functions for scaling cell_ewma_t"
+   * below. */
+  double log_cell_count;
+  /** The value of ewma_log_scale_offset when we last rescaled
+   * log_cell_count, and the ewma_scale_generation it had then. */
+  double log_scale_offset;
+  unsigned int scale_generation;
   /** True iff this is the cell count for a circuit's previous
    * channel. */
   unsigned int is_for_p_chan : 1;
@@ -92,17 +105,16 @@ struct ewma_policy_data_s {
   /**
    * Priority queue of cell_ewma_t for circuits with queued cells waiting
    * for room to free up on the channel that owns this circuitmux.  Kept
-   * in heap order according to EWMA.  This was formerly in channel_t, and
-   * in or_connection_t before that.
+   * in EWMA_HEAP_ARITY-ary heap order according to EWMA.  This was formerly
+   * in channel_t, and in or_connection_t before that.
    */
   smartlist_t *active_circuit_pqueue;
 
   /**
-   * The tick on which the cell_ewma_ts in active_circuit_pqueue last had
-   * their ewma values rescaled.  This was formerly in channel_t, and in
-   * or_connection_t before that.
+   * The ewma_scale_generation in which we last rescaled every cell_ewma_t
+   * in active_circuit_pqueue.
    */
-  unsigned int active_circuit_pqueue_last_recalibrated;
+  unsigned int scale_generation;
 };
 
 struct ewma_policy_circ_data_s {
@@ -172,12 +184,12 @@ static int compare_cell_ewma_counts(const void *p1, const void *p2);
 static unsigned cell_ewma_tick_from_timeval(const struct timeval *now,
                                             double *remainder_out);
 static circuit_t * cell_ewma_to_circuit(cell_ewma_t *ewma);
-static inline double get_scale_factor(unsigned from_tick, unsigned to_tick);
-static cell_ewma_t * pop_first_cell_ewma(ewma_policy_data_t *pol);
+static double cell_ewma_ticks_since_epoch(void);
 static void remove_cell_ewma(ewma_policy_data_t *pol, cell_ewma_t *ewma);
-static void scale_single_cell_ewma(cell_ewma_t *ewma, unsigned cur_tick);
-static void scale_active_circuits(ewma_policy_data_t *pol,
-                                  unsigned cur_tick);
+static void rescale_single_cell_ewma(cell_ewma_t *ewma);
+static void rescale_active_circuits(ewma_policy_data_t *pol);
+static void ewma_heap_sift_up(smartlist_t *heap, int idx);
+static void ewma_heap_sift_down(smartlist_t *heap, int idx);
 
 /*** Circuitmux policy methods ***/
 
@@ -219,10 +231,21 @@ ewma_cmp_cmux(circuitmux_t *cmux_1, circuitmux_policy_data_t *pol_data_1,
 /*** EWMA global variables ***/
 
 /** The per-tick scale factor to be used when computing cell-count EWMA
- * values.  (A cell sent N ticks before the start of the current tick
- * has value ewma_scale_factor ** N.)
+ * values.  (A cell sent N ticks ago has value ewma_scale_factor ** N.)
  */
 static double ewma_scale_factor = 0.1;
+/** The natural logarithm of ewma_scale_factor. */
+static double ewma_log_scale_factor = LOG_ONETENTH;
+/** The tick as of which we weight every cell, or 0 if we haven't picked
+ * one yet. */
+static unsigned ewma_epoch_tick = 0;
+/** The sum, over every change to ewma_log_scale_factor so far, of how much
+ * that change moved a log cell count scaled with the old factor to one
+ * scaled with the new.  A count last rescaled when this was X needs this
+ * minus X added to it, however many changes it missed. */
+static double ewma_log_scale_offset = 0.0;
+/** Incremented whenever ewma_log_scale_factor changes. */
+static unsigned int ewma_scale_generation = 0;
 /* DOCDOC ewma_enabled */
 static int ewma_enabled = 0;
 
@@ -258,7 +281,7 @@ ewma_alloc_cmux_data(circuitmux_t *cmux)
   pol = tor_malloc_zero(sizeof(*pol));
   pol->base_.magic = EWMA_POL_DATA_MAGIC;
   pol->active_circuit_pqueue = smartlist_new();
-  pol->active_circuit_pqueue_last_recalibrated = cell_ewma_get_tick();
+  pol->scale_generation = ewma_scale_generation;
 
   return TO_CMUX_POL_DATA(pol);
 }
@@ -313,8 +336,9 @@ ewma_alloc_circ_data(circuitmux_t *cmux,
    * Initialize the cell_ewma_t structure (formerly in
    * init_circuit_base())
    */
-  cdata->cell_ewma.last_adjusted_tick = cell_ewma_get_tick();
-  cdata->cell_ewma.cell_count = 0.0;
+  cdata->cell_ewma.log_cell_count = EWMA_LOG_ZERO;
+  cdata->cell_ewma.log_scale_offset = ewma_log_scale_offset;
+  cdata->cell_ewma.scale_generation = ewma_scale_generation;
   cdata->cell_ewma.heap_index = -1;
   if (direction == CELL_DIRECTION_IN) {
     cdata->cell_ewma.is_for_p_chan = 1;
@@ -401,7 +425,7 @@ ewma_notify_circ_inactive(circuitmux_t *cmux,
 
 /**
  * Update cell_ewma for this circuit after we've sent some cells, and
- * remove/reinsert it in the queue.  This used to be done (brokenly,
+ * move it down the queue.  This used to be done (brokenly,
  * see bug 6816) in channel_flush_from_first_active_circuit().
  */
 
@@ -414,11 +438,8 @@ ewma_notify_xmit_cells(circuitmux_t *cmux,
 {
   ewma_policy_data_t *pol = NULL;
   ewma_policy_circ_data_t *cdata = NULL;
-  unsigned int tick;
-  double fractional_tick, ewma_increment;
-  /* The current (hi-res) time */
-  struct timeval now_hires;
-  cell_ewma_t *cell_ewma, *tmp;
+  double log_ewma_increment;
+  cell_ewma_t *cell_ewma;
 
   tor_assert(cmux);
   tor_assert(pol_data);
@@ -429,29 +450,22 @@ ewma_notify_xmit_cells(circuitmux_t *cmux,
   pol = TO_EWMA_POL_DATA(pol_data);
   cdata = TO_EWMA_POL_CIRC_DATA(pol_circ_data);
 
-  /* Rescale the EWMAs if needed */
-  tor_gettimeofday_cached(&now_hires);
-  tick = cell_ewma_tick_from_timeval(&now_hires, &fractional_tick);
+  /* Catch up with any change to the scale factor */
+  rescale_active_circuits(pol);
 
-  if (tick != pol->active_circuit_pqueue_last_recalibrated) {
-    scale_active_circuits(pol, tick);
-  }
-
-  /* How much do we adjust the cell count in cell_ewma by? */
-  ewma_increment =
-    ((double)(n_cells)) * pow(ewma_scale_factor, -fractional_tick);
+  /* How much do we adjust the cell count in cell_ewma by?  A cell sent
+   * now weighs ewma_scale_factor ^ -(ticks since the epoch). */
+  log_ewma_increment = log((double)n_cells) -
+    cell_ewma_ticks_since_epoch() * ewma_log_scale_factor;
 
   /* Do the adjustment */
   cell_ewma = &(cdata->cell_ewma);
-  cell_ewma->cell_count += ewma_increment;
+  tor_assert(cell_ewma->heap_index != -1);
+  cell_ewma->log_cell_count =
+    cell_ewma_log_add(cell_ewma->log_cell_count, log_ewma_increment);
 
-  /*
-   * Since we just sent on this circuit, it should be at the head of
-   * the queue.  Pop the head, assert that it matches, then re-add.
-   */
-  tmp = pop_first_cell_ewma(pol);
-  tor_assert(tmp == cell_ewma);
-  add_cell_ewma(pol, cell_ewma);
+  /* Its count only went up, so it can only move down the queue. */
+  ewma_heap_sift_down(pol->active_circuit_pqueue, cell_ewma->heap_index);
 }
 
 /**
@@ -500,9 +514,13 @@ ewma_cmp_cmux(circuitmux_t *cmux_1, circuitmux_policy_data_t *pol_data_1,
   tor_assert(pol_data_2);
 
   p1 = TO_EWMA_POL_DATA(pol_data_1);
-  p2 = TO_EWMA_POL_DATA(pol_data_1);
+  p2 = TO_EWMA_POL_DATA(pol_data_2);
 
   if (p1 != p2) {
+    /* Make sure both queues are on the same scale */
+    rescale_active_circuits(p1);
+    rescale_active_circuits(p2);
+
     /* Get the head cell_ewma_t from each queue */
     if (smartlist_len(p1->active_circuit_pqueue) > 0) {
       ce1 = smartlist_get(p1->active_circuit_pqueue, 0);
@@ -540,14 +558,27 @@ compare_cell_ewma_counts(const void *p1, const void *p2)
 {
   const cell_ewma_t *e1 = p1, *e2 = p2;
 
-  if (e1->cell_count < e2->cell_count)
+  if (e1->log_cell_count < e2->log_cell_count)
     return -1;
-  else if (e1->cell_count > e2->cell_count)
+  else if (e1->log_cell_count > e2->log_cell_count)
     return 1;
   else
     return 0;
 }
 
+/** Return log(exp(<b>a</b>) + exp(<b>b</b>)), without overflowing.  Either
+ * argument may be EWMA_LOG_ZERO. */
+STATIC double
+cell_ewma_log_add(double a, double b)
+{
+  if (a < b) {
+    double tmp = a;
+    a = b;
+    b = tmp;
+  }
+  return a + log1p(exp(b - a));
+}
+
 /** Given a cell_ewma_t, return a pointer to the circuit containing it. */
 static circuit_t *
 cell_ewma_to_circuit(cell_ewma_t *ewma)
@@ -584,12 +615,20 @@ cell_ewma_to_circuit(cell_ewma_t *ewma)
    This, however, would mean we'd need to re-scale *ALL* old circuits every
    time we wanted to send a cell.
 
-   So as a compromise, we divide time into 'ticks' (currently, 10-second
-   increments) and say that a cell sent at the start of a current tick is
-   worth 1.0, a cell sent N seconds before the start of the current tick is
-   worth F^N, and a cell sent N seconds after the start of the current tick is
-   worth F^-N.  This way we don't overflow, and we don't need to constantly
-   rescale.
+   We used to compromise: we divided time into 'ticks' (currently, 10-second
+   increments), counted a cell sent at the start of the current tick as 1.0,
+   and re-scaled every active circuit on a circuitmux whenever the tick
+   changed.  With tens of thousands of circuits on a channel, that walk was
+   expensive.
+
+   Instead, we now do the infinite-precision version, in log space: a cell
+   sent N ticks after ewma_epoch_tick has weight F^-N, and we store
+   log(sum of weights), which only grows linearly with N.  Nothing is ever
+   re-scaled as time passes.  The only time we touch every circuit is when
+   F itself changes: then we shift each log count so that it has the same
+   value under the new F as it had under the old one as of the moment of
+   the change.  Since all the circuits on a circuitmux get the same shift,
+   this doesn't change their order.
  */
 
 /** Given a timeval <b>now</b>, compute the cell_ewma tick in which it occurs
@@ -634,6 +673,7 @@ cell_ewma_set_scale_factor(const or_options_t *options,
   int32_t halflife_ms;
   double halflife;
   const char *source;
+  const double old_log_scale_factor = ewma_log_scale_factor;
   if (options && options->CircuitPriorityHalflife >= -EPSILON) {
     halflife = options->CircuitPriorityHalflife;
     source = "CircuitPriorityHalflife in configuration";
@@ -665,54 +705,135 @@ cell_ewma_set_scale_factor(const or_options_t *options,
              "scale factor is %f per %d seconds",
              source, ewma_scale_factor, EWMA_TICK_LEN);
   }
+
+  ewma_log_scale_factor = log(ewma_scale_factor);
+  if (fabs(ewma_log_scale_factor - old_log_scale_factor) > EPSILON) {
+    /* Existing counts get converted lazily; see rescale_single_cell_ewma().
+     * A cell sent at the time of the change must weigh the same under the
+     * old factor as under the new. */
+    ewma_log_scale_offset += cell_ewma_ticks_since_epoch() *
+      (old_log_scale_factor - ewma_log_scale_factor);
+    ++ewma_scale_generation;
+  } else {
+    ewma_log_scale_factor = old_log_scale_factor;
+  }
 }
 
-/** Return the multiplier necessary to convert the value of a cell sent in
- * 'from_tick' to one sent in 'to_tick'. */
-static inline double
-get_scale_factor(unsigned from_tick, unsigned to_tick)
+/** Return the current time in ticks (including fractions of a tick) since
+ * ewma_epoch_tick, picking the epoch if we don't have one yet. */
+static double
+cell_ewma_ticks_since_epoch(void)
 {
+  struct timeval now_hires;
+  unsigned tick;
+  double fractional_tick;
+
+  tor_gettimeofday_cached(&now_hires);
+  tick = cell_ewma_tick_from_timeval(&now_hires, &fractional_tick);
+  if (ewma_epoch_tick == 0)
+    ewma_epoch_tick = tick;
+
   /* This math can wrap around, but that's okay: unsigned overflow is
      well-defined */
-  int diff = (int)(to_tick - from_tick);
-  return pow(ewma_scale_factor, diff);
+  return (double)(int)(tick - ewma_epoch_tick) + fractional_tick;
 }
 
-/** Adjust the cell count of <b>ewma</b> so that it is scaled with respect to
- * <b>cur_tick</b> */
+/** Adjust the log cell count of <b>ewma</b> so that it's scaled with
+ * respect to the current value of ewma_log_scale_factor. */
 static void
-scale_single_cell_ewma(cell_ewma_t *ewma, unsigned cur_tick)
+rescale_single_cell_ewma(cell_ewma_t *ewma)
 {
-  double factor = get_scale_factor(ewma->last_adjusted_tick, cur_tick);
-  ewma->cell_count *= factor;
-  ewma->last_adjusted_tick = cur_tick;
+  if (ewma->scale_generation == ewma_scale_generation)
+    return;
+  ewma->log_cell_count += ewma_log_scale_offset - ewma->log_scale_offset;
+  ewma->log_scale_offset = ewma_log_scale_offset;
+  ewma->scale_generation = ewma_scale_generation;
 }
 
-/** Adjust the cell count of every active circuit on <b>chan</b> so
- * that they are scaled with respect to <b>cur_tick</b> */
+/** If the scale factor has changed since we last looked at <b>pol</b>,
+ * adjust the log cell count of every active circuit on it.  This preserves
+ * their order, so we don't need to touch the heap. */
 static void
-scale_active_circuits(ewma_policy_data_t *pol, unsigned cur_tick)
+rescale_active_circuits(ewma_policy_data_t *pol)
 {
-  double factor;
-
   tor_assert(pol);
   tor_assert(pol->active_circuit_pqueue);
 
-  factor =
-    get_scale_factor(
-      pol->active_circuit_pqueue_last_recalibrated,
-      cur_tick);
-  /** Ordinarily it isn't okay to change the value of an element in a heap,
-   * but it's okay here, since we are preserving the order. */
-  SMARTLIST_FOREACH_BEGIN(
-      pol->active_circuit_pqueue,
-      cell_ewma_t *, e) {
-    tor_assert(e->last_adjusted_tick ==
-               pol->active_circuit_pqueue_last_recalibrated);
-    e->cell_count *= factor;
-    e->last_adjusted_tick = cur_tick;
-  } SMARTLIST_FOREACH_END(e);
-  pol->active_circuit_pqueue_last_recalibrated = cur_tick;
+  if (pol->scale_generation == ewma_scale_generation)
+    return;
+
+  SMARTLIST_FOREACH(pol->active_circuit_pqueue, cell_ewma_t *, e,
+                    rescale_single_cell_ewma(e));
+  pol->scale_generation = ewma_scale_generation;
+}
+
+/* ==== Functions for the active circuit heap ====
+
+   This is the same idea as smartlist_pqueue_*(), but EWMA_HEAP_ARITY-ary
+   rather than binary, and with a sift-down operation so that we can
+   re-position a circuit whose count has grown without removing and
+   re-adding it.
+ */
+
+/** Put <b>ewma</b> at position <b>idx</b> in <b>heap</b>. */
+static inline void
+ewma_heap_place(smartlist_t *heap, int idx, cell_ewma_t *ewma)
+{
+  smartlist_set(heap, idx, ewma);
+  ewma->heap_index = idx;
+}
+
+/** Move the cell_ewma_t at position <b>idx</b> in <b>heap</b> towards the
+ * root until its parent has no greater count. */
+static void
+ewma_heap_sift_up(smartlist_t *heap, int idx)
+{
+  cell_ewma_t *ewma = smartlist_get(heap, idx);
+
+  while (idx > 0) {
+    int parent_idx = (idx - 1) / EWMA_HEAP_ARITY;
+    cell_ewma_t *parent = smartlist_get(heap, parent_idx);
+    if (compare_cell_ewma_counts(parent, ewma) <= 0)
+      break;
+    ewma_heap_place(heap, idx, parent);
+    idx = parent_idx;
+  }
+  ewma_heap_place(heap, idx, ewma);
+}
+
+/** Move the cell_ewma_t at position <b>idx</b> in <b>heap</b> away from the
+ * root until none of its children has a smaller count. */
+static void
+ewma_heap_sift_down(smartlist_t *heap, int idx)
+{
+  const int n = smartlist_len(heap);
+  cell_ewma_t *ewma = smartlist_get(heap, idx);
+
+  for (;;) {
+    int first_child = idx * EWMA_HEAP_ARITY + 1;
+    int last_child, best, i;
+    cell_ewma_t *best_ewma;
+
+    if (first_child >= n)
+      break;
+    last_child = MIN(first_child + EWMA_HEAP_ARITY, n);
+
+    best = first_child;
+    best_ewma = smartlist_get(heap, first_child);
+    for (i = first_child + 1; i < last_child; ++i) {
+      cell_ewma_t *child = smartlist_get(heap, i);
+      if (compare_cell_ewma_counts(child, best_ewma) < 0) {
+        best = i;
+        best_ewma = child;
+      }
+    }
+
+    if (compare_cell_ewma_counts(best_ewma, ewma) >= 0)
+      break;
+    ewma_heap_place(heap, idx, best_ewma);
+    idx = best;
+  }
+  ewma_heap_place(heap, idx, ewma);
 }
 
 /** Rescale <b>ewma</b> to the same scale as <b>pol</b>, and add it to
@@ -725,41 +846,36 @@ add_cell_ewma(ewma_policy_data_t *pol, cell_ewma_t *ewma)
   tor_assert(ewma);
   tor_assert(ewma->heap_index == -1);
 
-  scale_single_cell_ewma(
-      ewma,
-      pol->active_circuit_pqueue_last_recalibrated);
+  rescale_active_circuits(pol);
+  rescale_single_cell_ewma(ewma);
 
-  smartlist_pqueue_add(pol->active_circuit_pqueue,
-                       compare_cell_ewma_counts,
-                       STRUCT_OFFSET(cell_ewma_t, heap_index),
-                       ewma);
+  smartlist_add(pol->active_circuit_pqueue, ewma);
+  ewma_heap_sift_up(pol->active_circuit_pqueue,
+                    smartlist_len(pol->active_circuit_pqueue) - 1);
 }
 
 /** Remove <b>ewma</b> from <b>pol</b>'s priority queue of active circuits */
 static void
 remove_cell_ewma(ewma_policy_data_t *pol, cell_ewma_t *ewma)
 {
+  smartlist_t *heap;
+  int idx;
+
   tor_assert(pol);
   tor_assert(pol->active_circuit_pqueue);
   tor_assert(ewma);
   tor_assert(ewma->heap_index != -1);
 
-  smartlist_pqueue_remove(pol->active_circuit_pqueue,
-                          compare_cell_ewma_counts,
-                          STRUCT_OFFSET(cell_ewma_t, heap_index),
-                          ewma);
-}
-
-/** Remove and return the first cell_ewma_t from pol's priority queue of
- * active circuits.  Requires that the priority queue is nonempty. */
-static cell_ewma_t *
-pop_first_cell_ewma(ewma_policy_data_t *pol)
-{
-  tor_assert(pol);
-  tor_assert(pol->active_circuit_pqueue);
+  heap = pol->active_circuit_pqueue;
+  idx = ewma->heap_index;
+  tor_assert(smartlist_get(heap, idx) == ewma);
 
-  return smartlist_pqueue_pop(pol->active_circuit_pqueue,
-                              compare_cell_ewma_counts,
-                              STRUCT_OFFSET(cell_ewma_t, heap_index));
+  /* Move the last entry into the hole, then restore heap order. */
+  smartlist_del(heap, idx);
+  ewma->heap_index = -1;
+  if (idx < smartlist_len(heap)) {
+    ewma_heap_sift_up(heap, idx);
+    ewma_heap_sift_down(heap, idx);
+  }
 }
 
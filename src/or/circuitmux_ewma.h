@@ -20,5 +20,9 @@ unsigned int cell_ewma_get_tick(void);
 void cell_ewma_set_scale_factor(const or_options_t *options,
                                 const networkstatus_t *consensus);
 
+#ifdef TOR_CIRCUITMUX_EWMA_C_
+STATIC double cell_ewma_log_add(double a, double b);
+#endif
+
 #endif /* TOR_CIRCUITMUX_EWMA_H */
 
@@ -0,0 +1,439 @@
+/* * Copyright (c) 2016, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file circuitmux_wfq.c
+ * \brief Weighted fair queueing between traffic classes, as a circuitmux_t
+ * policy.
+ *
+ * Every circuit on a circuitmux belongs to one of a few traffic classes
+ * (see cmux_wfq_class_t): directory requests, onion service circuits, and
+ * everything else.  The operator gives each class a weight with the
+ * CircuitPriorityWeights option.  While several classes have cells to
+ * send, each gets a share of the channel in proportion to its weight; a
+ * class with nothing to send leaves its share to the others.
+ *
+ * We do this with start-time fair queueing.  Each class has a virtual
+ * time, which goes up by 1/weight for each cell the class sends, and we
+ * always send from the active class with the lowest virtual time.  A class
+ * that has been idle can't save up credit: when it becomes active again,
+ * its virtual time catches up with that of the class we served last.
+ * Within a class, circuits take turns.
+ *
+ * A circuit is classified when it becomes active, so that a circuit that
+ * starts carrying a begindir stream moves to the directory class the next
+ * time it has cells to send.
+ *
+ * This module should be used through the interfaces in circuitmux.c, which it
+ * implements.
+ *
+ **/
+
+#define TOR_CIRCUITMUX_WFQ_C_
+
+#include "orconfig.h"
+
+#include "or.h"
+#include "circuitmux.h"
+#include "circuitmux_wfq.h"
+
+/** Virtual time that a class with weight 1 uses up for one cell. */
+#define WFQ_VTIME_PER_CELL 0x10000
+
+#define WFQ_POL_DATA_MAGIC 0x57465130U
+#define WFQ_POL_CIRC_DATA_MAGIC 0x57465131U
+
+typedef struct wfq_policy_circ_data_s wfq_policy_circ_data_t;
+
+/** Per-class state in a wfq_policy_data_t. */
+typedef struct wfq_class_state_t {
+  /** Active circuits in this class, in the order they will take turns. */
+  TOR_TAILQ_HEAD(wfq_circ_queue_s, wfq_policy_circ_data_s) active;
+  /** Number of circuits in <b>active</b>. */
+  int n_active;
+  /** This class's virtual time. */
+  uint64_t vtime;
+} wfq_class_state_t;
+
+/** The WFQ policy's data for one circuitmux. */
+typedef struct wfq_policy_data_t {
+  circuitmux_policy_data_t base_;
+  wfq_class_state_t classes[CMUX_WFQ_N_CLASSES];
+  /** Virtual time of the class we last sent cells from. */
+  uint64_t vtime_now;
+} wfq_policy_data_t;
+
+/** The WFQ policy's data for one circuit on a circuitmux. */
+struct wfq_policy_circ_data_s {
+  circuitmux_policy_circ_data_t base_;
+  circuit_t *circ;
+  /** The class we put this circuit in when it last became active. */
+  cmux_wfq_class_t cls;
+  /** True iff the circuit is on its class's active queue. */
+  unsigned int is_active : 1;
+  TOR_TAILQ_ENTRY(wfq_policy_circ_data_s) next_active;
+};
+
+/** Downcast a circuitmux_policy_data_t to a wfq_policy_data_t and assert
+ * on failure. */
+static inline wfq_policy_data_t *
+TO_WFQ_POL_DATA(circuitmux_policy_data_t *pol)
+{
+  if (!pol) return NULL;
+  tor_assert(pol->magic == WFQ_POL_DATA_MAGIC);
+  return DOWNCAST(wfq_policy_data_t, pol);
+}
+
+/** Downcast a circuitmux_policy_circ_data_t to a wfq_policy_circ_data_t
+ * and assert on failure. */
+static inline wfq_policy_circ_data_t *
+TO_WFQ_POL_CIRC_DATA(circuitmux_policy_circ_data_t *pol)
+{
+  if (!pol) return NULL;
+  tor_assert(pol->magic == WFQ_POL_CIRC_DATA_MAGIC);
+  return DOWNCAST(wfq_policy_circ_data_t, pol);
+}
+
+/*** WFQ global variables ***/
+
+/** True iff CircuitPriorityWeights is set, so that channels should use
+ * wfq_policy. */
+static int wfq_enabled = 0;
+/** The weight of each class. */
+static uint32_t wfq_weights[CMUX_WFQ_N_CLASSES] = { 1, 1, 1 };
+/** The names of the classes in CircuitPriorityWeights. */
+static const char *wfq_class_names[CMUX_WFQ_N_CLASSES] = {
+  "dir", "onion", "general"
+};
+
+/*** WFQ circuitmux_policy_t method implementations ***/
+
+/** Allocate a wfq_policy_data_t and upcast it to a circuitmux_policy_data_t;
+ * this is called when setting the policy on a circuitmux_t to wfq_policy. */
+static circuitmux_policy_data_t *
+wfq_alloc_cmux_data(circuitmux_t *cmux)
+{
+  wfq_policy_data_t *pol;
+  int i;
+
+  tor_assert(cmux);
+
+  pol = tor_malloc_zero(sizeof(*pol));
+  pol->base_.magic = WFQ_POL_DATA_MAGIC;
+  for (i = 0; i < CMUX_WFQ_N_CLASSES; ++i)
+    TOR_TAILQ_INIT(&pol->classes[i].active);
+
+  return TO_CMUX_POL_DATA(pol);
+}
+
+/** Free a wfq_policy_data_t allocated with wfq_alloc_cmux_data(). */
+static void
+wfq_free_cmux_data(circuitmux_t *cmux, circuitmux_policy_data_t *pol_data)
+{
+  tor_assert(cmux);
+  if (!pol_data) return;
+
+  tor_free(pol_data);
+}
+
+/** Allocate a wfq_policy_circ_data_t and upcast it; this is called when
+ * attaching a circuit to a circuitmux_t with wfq_policy. */
+static circuitmux_policy_circ_data_t *
+wfq_alloc_circ_data(circuitmux_t *cmux, circuitmux_policy_data_t *pol_data,
+                    circuit_t *circ, cell_direction_t direction,
+                    unsigned int cell_count)
+{
+  wfq_policy_circ_data_t *cdata;
+
+  tor_assert(cmux);
+  tor_assert(pol_data);
+  tor_assert(circ);
+  (void)direction;
+  (void)cell_count;
+
+  cdata = tor_malloc_zero(sizeof(*cdata));
+  cdata->base_.magic = WFQ_POL_CIRC_DATA_MAGIC;
+  cdata->circ = circ;
+  cdata->cls = CMUX_WFQ_CLASS_GENERAL;
+
+  return TO_CMUX_POL_CIRC_DATA(cdata);
+}
+
+/** Free a wfq_policy_circ_data_t allocated with wfq_alloc_circ_data(). */
+static void
+wfq_free_circ_data(circuitmux_t *cmux, circuitmux_policy_data_t *pol_data,
+                   circuit_t *circ,
+                   circuitmux_policy_circ_data_t *pol_circ_data)
+{
+  wfq_policy_circ_data_t *cdata;
+
+  tor_assert(cmux);
+  tor_assert(circ);
+  tor_assert(pol_data);
+
+  if (!pol_circ_data) return;
+
+  cdata = TO_WFQ_POL_CIRC_DATA(pol_circ_data);
+  tor_assert(!cdata->is_active);
+  tor_free(cdata);
+}
+
+/** Handle circuit activation: classify the circuit, and put it at the end
+ * of its class's queue. */
+static void
+wfq_notify_circ_active(circuitmux_t *cmux,
+                       circuitmux_policy_data_t *pol_data,
+                       circuit_t *circ,
+                       circuitmux_policy_circ_data_t *pol_circ_data)
+{
+  wfq_policy_data_t *pol;
+  wfq_policy_circ_data_t *cdata;
+  wfq_class_state_t *cls;
+
+  tor_assert(cmux);
+  tor_assert(pol_data);
+  tor_assert(circ);
+  tor_assert(pol_circ_data);
+
+  pol = TO_WFQ_POL_DATA(pol_data);
+  cdata = TO_WFQ_POL_CIRC_DATA(pol_circ_data);
+  if (cdata->is_active)
+    return;
+
+  cdata->cls = cell_wfq_classify_circuit(circ);
+  cls = &pol->classes[cdata->cls];
+  if (cls->n_active == 0 && cls->vtime < pol->vtime_now) {
+    /* Don't let an idle class save up credit. */
+    cls->vtime = pol->vtime_now;
+  }
+  TOR_TAILQ_INSERT_TAIL(&cls->active, cdata, next_active);
+  ++cls->n_active;
+  cdata->is_active = 1;
+}
+
+/** Handle circuit deactivation: take the circuit off its class's queue. */
+static void
+wfq_notify_circ_inactive(circuitmux_t *cmux,
+                         circuitmux_policy_data_t *pol_data,
+                         circuit_t *circ,
+                         circuitmux_policy_circ_data_t *pol_circ_data)
+{
+  wfq_policy_data_t *pol;
+  wfq_policy_circ_data_t *cdata;
+  wfq_class_state_t *cls;
+
+  tor_assert(cmux);
+  tor_assert(pol_data);
+  tor_assert(circ);
+  tor_assert(pol_circ_data);
+
+  pol = TO_WFQ_POL_DATA(pol_data);
+  cdata = TO_WFQ_POL_CIRC_DATA(pol_circ_data);
+  if (!cdata->is_active)
+    return;
+
+  cls = &pol->classes[cdata->cls];
+  TOR_TAILQ_REMOVE(&cls->active, cdata, next_active);
+  --cls->n_active;
+  cdata->is_active = 0;
+}
+
+/** Charge the circuit's class for <b>n_cells</b> sent cells, and send the
+ * circuit to the back of its class's queue. */
+static void
+wfq_notify_xmit_cells(circuitmux_t *cmux,
+                      circuitmux_policy_data_t *pol_data,
+                      circuit_t *circ,
+                      circuitmux_policy_circ_data_t *pol_circ_data,
+                      unsigned int n_cells)
+{
+  wfq_policy_data_t *pol;
+  wfq_policy_circ_data_t *cdata;
+  wfq_class_state_t *cls;
+
+  tor_assert(cmux);
+  tor_assert(pol_data);
+  tor_assert(circ);
+  tor_assert(pol_circ_data);
+  tor_assert(n_cells > 0);
+
+  pol = TO_WFQ_POL_DATA(pol_data);
+  cdata = TO_WFQ_POL_CIRC_DATA(pol_circ_data);
+  tor_assert(cdata->is_active);
+
+  cls = &pol->classes[cdata->cls];
+  pol->vtime_now = cls->vtime;
+  cls->vtime += ((uint64_t)n_cells * WFQ_VTIME_PER_CELL) /
+    wfq_weights[cdata->cls];
+
+  TOR_TAILQ_REMOVE(&cls->active, cdata, next_active);
+  TOR_TAILQ_INSERT_TAIL(&cls->active, cdata, next_active);
+}
+
+/** Pick the circuit to send from next: the one at the front of the queue
+ * of the active class with the lowest virtual time. */
+static circuit_t *
+wfq_pick_active_circuit(circuitmux_t *cmux,
+                        circuitmux_policy_data_t *pol_data)
+{
+  wfq_policy_data_t *pol;
+  wfq_class_state_t *best = NULL;
+  int i;
+
+  tor_assert(cmux);
+  tor_assert(pol_data);
+
+  pol = TO_WFQ_POL_DATA(pol_data);
+
+  /* Ties go to the class listed first. */
+  for (i = 0; i < CMUX_WFQ_N_CLASSES; ++i) {
+    wfq_class_state_t *cls = &pol->classes[i];
+    if (cls->n_active && (!best || cls->vtime < best->vtime))
+      best = cls;
+  }
+
+  if (!best)
+    return NULL;
+  return TOR_TAILQ_FIRST(&best->active)->circ;
+}
+
+/*** WFQ circuitmux_policy_t method table ***/
+
+circuitmux_policy_t wfq_policy = {
+  /*.alloc_cmux_data =*/ wfq_alloc_cmux_data,
+  /*.free_cmux_data =*/ wfq_free_cmux_data,
+  /*.alloc_circ_data =*/ wfq_alloc_circ_data,
+  /*.free_circ_data =*/ wfq_free_circ_data,
+  /*.notify_circ_active =*/ wfq_notify_circ_active,
+  /*.notify_circ_inactive =*/ wfq_notify_circ_inactive,
+  /*.notify_set_n_cells =*/ NULL, /* WFQ doesn't need this */
+  /*.notify_xmit_cells =*/ wfq_notify_xmit_cells,
+  /*.pick_active_circuit =*/ wfq_pick_active_circuit,
+  /* Virtual times on different channels can't be compared. */
+  /*.cmp_cmux =*/ NULL
+};
+
+/*** Classes and weights ***/
+
+/** Return the traffic class that <b>circ</b> belongs in. */
+STATIC cmux_wfq_class_t
+cell_wfq_classify_circuit(const circuit_t *circ)
+{
+  const uint8_t purpose = circ->purpose;
+
+  if (CIRCUIT_IS_ORIGIN(circ)) {
+    const origin_circuit_t *ocirc = CONST_TO_ORIGIN_CIRCUIT(circ);
+    if ((purpose >= CIRCUIT_PURPOSE_C_INTRODUCING &&
+         purpose <= CIRCUIT_PURPOSE_C_REND_JOINED) ||
+        (purpose >= CIRCUIT_PURPOSE_S_ESTABLISH_INTRO &&
+         purpose <= CIRCUIT_PURPOSE_S_REND_JOINED))
+      return CMUX_WFQ_CLASS_ONION;
+    if (ocirc->build_state && ocirc->build_state->onehop_tunnel)
+      return CMUX_WFQ_CLASS_DIR;
+    if (ocirc->p_streams && ocirc->p_streams->base_.type == CONN_TYPE_AP &&
+        EDGE_TO_ENTRY_CONN(ocirc->p_streams)->use_begindir)
+      return CMUX_WFQ_CLASS_DIR;
+  } else {
+    const or_circuit_t *orcirc = CONST_TO_OR_CIRCUIT(circ);
+    const connection_t *stream;
+    if (purpose == CIRCUIT_PURPOSE_INTRO_POINT ||
+        purpose == CIRCUIT_PURPOSE_REND_POINT_WAITING ||
+        purpose == CIRCUIT_PURPOSE_REND_ESTABLISHED)
+      return CMUX_WFQ_CLASS_ONION;
+    /* Begindir streams are linked to a directory connection. */
+    stream = orcirc->n_streams ? TO_CONN(orcirc->n_streams) : NULL;
+    if (stream && stream->linked_conn &&
+        stream->linked_conn->type == CONN_TYPE_DIR)
+      return CMUX_WFQ_CLASS_DIR;
+  }
+  return CMUX_WFQ_CLASS_GENERAL;
+}
+
+/** Tell the caller whether the WFQ policy is enabled. */
+int
+cell_wfq_enabled(void)
+{
+  return wfq_enabled;
+}
+
+/** Parse <b>str</b>, a CircuitPriorityWeights value such as
+ * "dir=8,onion=4,general=1", into <b>weights_out</b> (if it isn't NULL),
+ * an array of CMUX_WFQ_N_CLASSES weights.  Classes that <b>str</b> doesn't
+ * mention get weight 1.  Return 0 on success.  On failure, set
+ * *<b>msg_out</b> to a newly allocated error message and return -1. */
+int
+cell_wfq_parse_weights(const char *str, uint32_t *weights_out,
+                       char **msg_out)
+{
+  smartlist_t *items = smartlist_new();
+  uint32_t weights[CMUX_WFQ_N_CLASSES];
+  int i, r = -1;
+
+  for (i = 0; i < CMUX_WFQ_N_CLASSES; ++i)
+    weights[i] = 1;
+
+  smartlist_split_string(items, str, ",",
+                         SPLIT_SKIP_SPACE|SPLIT_IGNORE_BLANK, 0);
+  SMARTLIST_FOREACH_BEGIN(items, const char *, item) {
+    const char *eq = strchr(item, '=');
+    int ok = 0, cls = -1;
+    unsigned long w;
+    if (eq) {
+      for (i = 0; i < CMUX_WFQ_N_CLASSES; ++i) {
+        if (strlen(wfq_class_names[i]) == (size_t)(eq - item) &&
+            !strcasecmpstart(item, wfq_class_names[i]))
+          cls = i;
+      }
+    }
+    if (cls < 0) {
+      tor_asprintf(msg_out, "CircuitPriorityWeights entry \"%s\" is not "
+                   "of the form dir=N, onion=N or general=N.", item);
+      goto done;
+    }
+    w = tor_parse_ulong(eq + 1, 10, 1, CMUX_WFQ_MAX_WEIGHT, &ok, NULL);
+    if (!ok) {
+      tor_asprintf(msg_out, "CircuitPriorityWeights weight in \"%s\" must "
+                   "be between 1 and %d.", item, CMUX_WFQ_MAX_WEIGHT);
+      goto done;
+    }
+    weights[cls] = (uint32_t)w;
+  } SMARTLIST_FOREACH_END(item);
+
+  if (weights_out)
+    memcpy(weights_out, weights, sizeof(weights));
+  r = 0;
+ done:
+  SMARTLIST_FOREACH(items, char *, cp, tor_free(cp));
+  smartlist_free(items);
+  return r;
+}
+
+/** Enable or disable the WFQ policy, and set the class weights, based on
+ * <b>options</b>. */
+void
+cell_wfq_set_weights(const or_options_t *options)
+{
+  char *msg = NULL;
+  int i;
+
+  if (!options || !options->CircuitPriorityWeights) {
+    wfq_enabled = 0;
+    for (i = 0; i < CMUX_WFQ_N_CLASSES; ++i)
+      wfq_weights[i] = 1;
+    return;
+  }
+  if (cell_wfq_parse_weights(options->CircuitPriorityWeights,
+                             wfq_weights, &msg) < 0) {
+    /* options_validate() should have caught this. */
+    log_warn(LD_BUG, "%s", msg);
+    tor_free(msg);
+    return;
+  }
+  wfq_enabled = 1;
+  log_info(LD_OR, "Sharing channels between traffic classes with weights "
+           "dir=%u, onion=%u, general=%u.",
+           (unsigned)wfq_weights[CMUX_WFQ_CLASS_DIR],
+           (unsigned)wfq_weights[CMUX_WFQ_CLASS_ONION],
+           (unsigned)wfq_weights[CMUX_WFQ_CLASS_GENERAL]);
+}
+
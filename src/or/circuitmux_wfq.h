@@ -0,0 +1,43 @@
+/* * Copyright (c) 2016, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file circuitmux_wfq.h
+ * \brief Header file for circuitmux_wfq.c
+ **/
+
+#ifndef TOR_CIRCUITMUX_WFQ_H
+#define TOR_CIRCUITMUX_WFQ_H
+
+#include "or.h"
+#include "circuitmux.h"
+
+/** The traffic classes between which the WFQ policy shares a channel. */
+typedef enum cmux_wfq_class_t {
+  /** Directory requests: one-hop tunnels and begindir streams. */
+  CMUX_WFQ_CLASS_DIR = 0,
+  /** Onion service circuits, at the client, service or relay. */
+  CMUX_WFQ_CLASS_ONION = 1,
+  /** Everything else, mostly exit traffic. */
+  CMUX_WFQ_CLASS_GENERAL = 2,
+} cmux_wfq_class_t;
+
+/** How many values does cmux_wfq_class_t have? */
+#define CMUX_WFQ_N_CLASSES 3
+
+/** Largest weight a class may have. */
+#define CMUX_WFQ_MAX_WEIGHT 1000
+
+extern circuitmux_policy_t wfq_policy;
+
+int cell_wfq_enabled(void);
+int cell_wfq_parse_weights(const char *str, uint32_t *weights_out,
+                           char **msg_out);
+void cell_wfq_set_weights(const or_options_t *options);
+
+#ifdef TOR_CIRCUITMUX_WFQ_C_
+STATIC cmux_wfq_class_t cell_wfq_classify_circuit(const circuit_t *circ);
+#endif
+
+#endif /* TOR_CIRCUITMUX_WFQ_H */
+
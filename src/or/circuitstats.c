@@ -525,6 +525,9 @@ circuit_build_times_reset(circuit_build_times_t *cbt)
   memset(cbt->circuit_build_times, 0, sizeof(cbt->circuit_build_times));
   cbt->total_build_times = 0;
   cbt->build_times_idx = 0;
+  cbt->num_abandoned = 0;
+  tor_free(cbt->histogram);
+  cbt->histogram_nbins = 0;
   cbt->have_computed_timeout = 0;
 }
 
@@ -570,6 +573,11 @@ circuit_build_times_free_timeouts(circuit_build_times_t *cbt)
   }
 
   cbt->liveness.num_recent_circs = 0;
+
+  /* The histogram can be rebuilt from the build-time array if we need it
+   * again. */
+  tor_free(cbt->histogram);
+  cbt->histogram_nbins = 0;
 }
 
 #if 0
@@ -601,6 +609,54 @@ circuit_build_times_rewind_history(circuit_build_times_t *cbt, int n)
 }
 #endif
 
+/**
+ * Count <b>btime</b> in the histogram of <b>cbt</b>, growing the histogram
+ * if it doesn't have a bin for <b>btime</b> yet.
+ */
+static void
+circuit_build_times_histogram_add(circuit_build_times_t *cbt,
+                                  build_time_t btime)
+{
+  build_time_t bin = btime / CBT_BIN_WIDTH;
+
+  if (bin >= cbt->histogram_nbins) {
+    build_time_t nbins = MAX(bin + 1, cbt->histogram_nbins * 2);
+    cbt->histogram = tor_reallocarray(cbt->histogram, nbins,
+                                      sizeof(uint32_t));
+    memset(cbt->histogram + cbt->histogram_nbins, 0,
+           (nbins - cbt->histogram_nbins) * sizeof(uint32_t));
+    cbt->histogram_nbins = nbins;
+  }
+  cbt->histogram[bin]++;
+}
+
+/**
+ * Replace the build time at <b>idx</b> in the circular array of <b>cbt</b>
+ * with <b>btime</b>, keeping the abandoned count and the histogram (if we
+ * have one) in step.  Every write to the array must go through here.
+ */
+static void
+circuit_build_times_set_slot(circuit_build_times_t *cbt, int idx,
+                             build_time_t btime)
+{
+  build_time_t old = cbt->circuit_build_times[idx];
+
+  if (old == CBT_BUILD_ABANDONED) {
+    cbt->num_abandoned--;
+  } else if (old && cbt->histogram) {
+    tor_assert(old / CBT_BIN_WIDTH < cbt->histogram_nbins);
+    cbt->histogram[old / CBT_BIN_WIDTH]--;
+  }
+
+  if (btime == CBT_BUILD_ABANDONED) {
+    cbt->num_abandoned++;
+  } else if (btime && cbt->histogram) {
+    circuit_build_times_histogram_add(cbt, btime);
+  }
+
+  cbt->circuit_build_times[idx] = btime;
+}
+
 /**
  * Add a new build time value <b>time</b> to the set of build times. Time
  * units are milliseconds.
@@ -620,7 +676,7 @@ circuit_build_times_add_time(circuit_build_times_t *cbt, build_time_t btime)
 
   log_debug(LD_CIRC, "Adding circuit build time %u", btime);
 
-  cbt->circuit_build_times[cbt->build_times_idx] = btime;
+  circuit_build_times_set_slot(cbt, cbt->build_times_idx, btime);
   cbt->build_times_idx = (cbt->build_times_idx + 1) % CBT_NCIRCUITS_TO_OBSERVE;
   if (cbt->total_build_times < CBT_NCIRCUITS_TO_OBSERVE)
     cbt->total_build_times++;
@@ -670,36 +726,39 @@ circuit_build_times_min(circuit_build_times_t *cbt)
 #endif
 
 /**
- * Calculate and return a histogram for the set of build times.
+ * Return the histogram of the completed build times of <b>cbt</b>, and set
+ * *<b>nbins</b> to its number of bins.  Bin <em>i</em> counts build times
+ * between i*CBT_BIN_WIDTH and (i+1)*CBT_BIN_WIDTH msec.
  *
- * Returns an allocated array of histrogram bins representing
- * the frequency of index*CBT_BIN_WIDTH millisecond
- * build times. Also outputs the number of bins in nbins.
- *
- * The return value must be freed by the caller.
+ * The histogram is kept up to date by circuit_build_times_set_slot(), so
+ * this only walks the build-time array if the histogram was discarded.
+ * The return value belongs to <b>cbt</b> and must not be freed.
  */
-static uint32_t *
-circuit_build_times_create_histogram(const circuit_build_times_t *cbt,
-                                     build_time_t *nbins)
+STATIC const uint32_t *
+circuit_build_times_get_histogram(const circuit_build_times_t *cbt,
+                                  build_time_t *nbins)
 {
-  uint32_t *histogram;
-  build_time_t max_build_time = circuit_build_times_max(cbt);
-  int i, c;
-
-  *nbins = 1 + (max_build_time / CBT_BIN_WIDTH);
-  histogram = tor_calloc(*nbins, sizeof(build_time_t));
-
-  // calculate histogram
-  for (i = 0; i < CBT_NCIRCUITS_TO_OBSERVE; i++) {
-    if (cbt->circuit_build_times[i] == 0
-            || cbt->circuit_build_times[i] == CBT_BUILD_ABANDONED)
-      continue; /* 0 <-> uninitialized */
-
-    c = (cbt->circuit_build_times[i] / CBT_BIN_WIDTH);
-    histogram[c]++;
+  if (!cbt->histogram) {
+    /* The histogram is only a cache of the array, so it's fine to fill it
+     * in through a const pointer. */
+    circuit_build_times_t *mut = (circuit_build_times_t *)cbt;
+    build_time_t max_build_time = circuit_build_times_max(cbt);
+    int i;
+
+    mut->histogram_nbins = 1 + (max_build_time / CBT_BIN_WIDTH);
+    mut->histogram = tor_calloc(mut->histogram_nbins, sizeof(uint32_t));
+
+    for (i = 0; i < CBT_NCIRCUITS_TO_OBSERVE; i++) {
+      if (cbt->circuit_build_times[i] == 0
+              || cbt->circuit_build_times[i] == CBT_BUILD_ABANDONED)
+        continue; /* 0 <-> uninitialized */
+
+      mut->histogram[cbt->circuit_build_times[i] / CBT_BIN_WIDTH]++;
+    }
   }
 
-  return histogram;
+  *nbins = cbt->histogram_nbins;
+  return cbt->histogram;
 }
 
 /**
@@ -717,7 +776,7 @@ circuit_build_times_get_xm(circuit_build_times_t *cbt)
   build_time_t *nth_max_bin;
   int32_t bin_counts=0;
   build_time_t ret = 0;
-  uint32_t *histogram = circuit_build_times_create_histogram(cbt, &nbins);
+  const uint32_t *histogram = circuit_build_times_get_histogram(cbt, &nbins);
   int n=0;
   int num_modes = circuit_build_times_default_num_xm_modes();
 
@@ -758,7 +817,6 @@ circuit_build_times_get_xm(circuit_build_times_t *cbt)
   tor_assert(bin_counts > 0);
 
   ret /= bin_counts;
-  tor_free(histogram);
   tor_free(nth_max_bin);
 
   return ret;
@@ -772,24 +830,19 @@ void
 circuit_build_times_update_state(const circuit_build_times_t *cbt,
                                  or_state_t *state)
 {
-  uint32_t *histogram;
+  const uint32_t *histogram;
   build_time_t i = 0;
   build_time_t nbins = 0;
   config_line_t **next, *line;
 
-  histogram = circuit_build_times_create_histogram(cbt, &nbins);
+  histogram = circuit_build_times_get_histogram(cbt, &nbins);
   // write to state
   config_free_lines(state->BuildtimeHistogram);
   next = &state->BuildtimeHistogram;
   *next = NULL;
 
   state->TotalBuildTimes = cbt->total_build_times;
-  state->CircuitBuildAbandonedCount = 0;
-
-  for (i = 0; i < CBT_NCIRCUITS_TO_OBSERVE; i++) {
-    if (cbt->circuit_build_times[i] == CBT_BUILD_ABANDONED)
-      state->CircuitBuildAbandonedCount++;
-  }
+  state->CircuitBuildAbandonedCount = cbt->num_abandoned;
 
   for (i = 0; i < nbins; i++) {
     // compress the histogram by skipping the blanks
@@ -805,8 +858,6 @@ circuit_build_times_update_state(const circuit_build_times_t *cbt,
     if (!get_options()->AvoidDiskWrites)
       or_state_mark_dirty(get_or_state(), 0);
   }
-
-  tor_free(histogram);
 }
 
 /**
@@ -871,7 +922,7 @@ circuit_build_times_filter_timeouts(circuit_build_times_t *cbt)
     if (cbt->circuit_build_times[i] > max_timeout) {
       build_time_t replaced = cbt->circuit_build_times[i];
       num_filtered++;
-      cbt->circuit_build_times[i] = CBT_BUILD_ABANDONED;
+      circuit_build_times_set_slot(cbt, i, CBT_BUILD_ABANDONED);
 
       log_debug(LD_CIRC, "Replaced timeout %d with %d", replaced,
                cbt->circuit_build_times[i]);
@@ -904,6 +955,7 @@ circuit_build_times_parse_state(circuit_build_times_t *cbt,
   unsigned int i;
   build_time_t *loaded_times;
   int err = 0;
+  tor_free(cbt->histogram);
   circuit_build_times_init(cbt);
 
   if (circuit_build_times_disabled()) {
@@ -1483,17 +1535,10 @@ circuit_build_times_timeout_rate(const circuit_build_times_t *cbt)
 double
 circuit_build_times_close_rate(const circuit_build_times_t *cbt)
 {
-  int i=0,closed=0;
-  for (i = 0; i < CBT_NCIRCUITS_TO_OBSERVE; i++) {
-    if (cbt->circuit_build_times[i] == CBT_BUILD_ABANDONED) {
-       closed++;
-    }
-  }
-
   if (!cbt->total_build_times)
     return 0;
 
-  return ((double)closed)/cbt->total_build_times;
+  return ((double)cbt->num_abandoned)/cbt->total_build_times;
 }
 
 /**
@@ -47,6 +47,9 @@ STATIC double circuit_build_times_calculate_timeout(circuit_build_times_t *cbt,
                                              double quantile);
 STATIC int circuit_build_times_update_alpha(circuit_build_times_t *cbt);
 STATIC void circuit_build_times_reset(circuit_build_times_t *cbt);
+STATIC const uint32_t *circuit_build_times_get_histogram(
+                                             const circuit_build_times_t *cbt,
+                                             build_time_t *nbins);
 
 /* Network liveness functions */
 STATIC int circuit_build_times_network_check_changed(
@@ -76,6 +79,15 @@ struct circuit_build_times_s {
   int build_times_idx;
   /** Total number of build times accumulated. Max CBT_NCIRCUITS_TO_OBSERVE */
   int total_build_times;
+  /** How many entries of circuit_build_times are CBT_BUILD_ABANDONED? */
+  int num_abandoned;
+  /** Histogram of the completed build times in circuit_build_times, in bins
+   * of CBT_BIN_WIDTH msec, kept in step with the array as times are added
+   * and replaced.  This is a cache: NULL means it must be rebuilt from the
+   * array before use. */
+  uint32_t *histogram;
+  /** Number of bins allocated in histogram. */
+  build_time_t histogram_nbins;
   /** Information about the state of our local network connection */
   network_liveness_t liveness;
   /** Last time we built a circuit. Used to decide to build new test circs */
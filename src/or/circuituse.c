@@ -102,6 +102,8 @@ circuit_is_acceptable(const origin_circuit_t *origin_circ,
     return 0;
   if (need_internal != build_state->is_internal)
     return 0;
+  if (build_state->is_stem)
+    return 0;
 
   if (purpose == CIRCUIT_PURPOSE_C_GENERAL) {
     tor_addr_t addr;
@@ -271,6 +273,8 @@ circuit_get_best(const entry_connection_t *conn,
   origin_circuit_t *best=NULL;
   struct timeval now;
   int intro_going_on_but_too_old = 0;
+  uint8_t purposes[4];
+  int i, n_purposes = 0;
 
   tor_assert(conn);
 
@@ -280,31 +284,55 @@ circuit_get_best(const entry_connection_t *conn,
 
   tor_gettimeofday(&now);
 
-  SMARTLIST_FOREACH_BEGIN(circuit_get_global_list(), circuit_t *, circ) {
-    origin_circuit_t *origin_circ;
-    if (!CIRCUIT_IS_ORIGIN(circ))
-      continue;
-    origin_circ = TO_ORIGIN_CIRCUIT(circ);
+  /* Only look at circuits with the purposes that circuit_is_acceptable()
+   * would allow. */
+  if (purpose == CIRCUIT_PURPOSE_C_REND_JOINED && !must_be_open) {
+    purposes[n_purposes++] = CIRCUIT_PURPOSE_C_ESTABLISH_REND;
+    purposes[n_purposes++] = CIRCUIT_PURPOSE_C_REND_READY;
+    purposes[n_purposes++] = CIRCUIT_PURPOSE_C_REND_READY_INTRO_ACKED;
+    purposes[n_purposes++] = CIRCUIT_PURPOSE_C_REND_JOINED;
+  } else if (purpose == CIRCUIT_PURPOSE_C_INTRODUCE_ACK_WAIT &&
+             !must_be_open) {
+    purposes[n_purposes++] = CIRCUIT_PURPOSE_C_INTRODUCING;
+    purposes[n_purposes++] = CIRCUIT_PURPOSE_C_INTRODUCE_ACK_WAIT;
+  } else {
+    purposes[n_purposes++] = purpose;
+  }
+
+  for (i = 0; i < n_purposes; ++i) {
+    SMARTLIST_FOREACH_BEGIN(circuit_get_client_circuits_by_purpose(
+                                                             purposes[i]),
+                            origin_circuit_t *, origin_circ) {
+      /* Log an info message if we're going to launch a new intro circ in
+       * parallel */
+      if (purpose == CIRCUIT_PURPOSE_C_INTRODUCE_ACK_WAIT &&
+          !must_be_open && origin_circ->hs_circ_has_timed_out) {
+          intro_going_on_but_too_old = 1;
+          continue;
+      }
 
-    /* Log an info message if we're going to launch a new intro circ in
-     * parallel */
-    if (purpose == CIRCUIT_PURPOSE_C_INTRODUCE_ACK_WAIT &&
-        !must_be_open && origin_circ->hs_circ_has_timed_out) {
-        intro_going_on_but_too_old = 1;
+      if (!circuit_is_acceptable(origin_circ,conn,must_be_open,purpose,
+                                 need_uptime,need_internal,
+                                 (time_t)now.tv_sec))
         continue;
-    }
 
-    if (!circuit_is_acceptable(origin_circ,conn,must_be_open,purpose,
-                               need_uptime,need_internal, (time_t)now.tv_sec))
-      continue;
+      /* When we race intro circuits to different intro points, the first
+       * one to open wins. */
+      if (best && purpose == CIRCUIT_PURPOSE_C_INTRODUCE_ACK_WAIT &&
+          (best->base_.state == CIRCUIT_STATE_OPEN) !=
+          (origin_circ->base_.state == CIRCUIT_STATE_OPEN)) {
+        if (origin_circ->base_.state == CIRCUIT_STATE_OPEN)
+          best = origin_circ;
+        continue;
+      }
 
-    /* now this is an acceptable circ to hand back. but that doesn't
-     * mean it's the *best* circ to hand back. try to decide.
-     */
-    if (!best || circuit_is_better(origin_circ,best,conn))
-      best = origin_circ;
+      /* now this is an acceptable circ to hand back. but that doesn't
+       * mean it's the *best* circ to hand back. try to decide.
+       */
+      if (!best || circuit_is_better(origin_circ,best,conn))
+        best = origin_circ;
+    } SMARTLIST_FOREACH_END(origin_circ);
   }
-  SMARTLIST_FOREACH_END(circ);
 
   if (!best && intro_going_on_but_too_old)
     log_info(LD_REND|LD_CIRC, "There is an intro circuit being created "
@@ -987,6 +1015,18 @@ circuit_stream_is_being_handled(entry_connection_t *conn,
 /** Don't keep more than this many unused open circuits around. */
 #define MAX_UNUSED_OPEN_CIRCUITS 14
 
+/** Return true iff we have made exit connections recently enough that we
+ * predict making more. */
+static int
+have_recent_predicted_ports(time_t now)
+{
+  smartlist_t *ports = rep_hist_get_predicted_ports(now);
+  int result = smartlist_len(ports) > 0;
+  SMARTLIST_FOREACH(ports, uint16_t *, cp, tor_free(cp));
+  smartlist_free(ports);
+  return result;
+}
+
 /** Figure out how many circuits we have open that are clean. Make
  * sure it's enough for all the upcoming behaviors we predict we'll have.
  * But put an upper bound on the total number of circuits.
@@ -994,7 +1034,7 @@ circuit_stream_is_being_handled(entry_connection_t *conn,
 static void
 circuit_predict_and_launch_new(void)
 {
-  int num=0, num_internal=0, num_uptime_internal=0;
+  int num=0, num_internal=0, num_uptime_internal=0, num_stems=0;
   int hidserv_needs_uptime=0, hidserv_needs_capacity=1;
   int port_needs_uptime=0, port_needs_capacity=1;
   time_t now = time(NULL);
@@ -1019,6 +1059,10 @@ circuit_predict_and_launch_new(void)
     if (build_state->onehop_tunnel)
       continue;
     num++;
+    if (build_state->is_stem) {
+      num_stems++;
+      continue;
+    }
     if (build_state->is_internal)
       num_internal++;
     if (build_state->need_uptime && build_state->is_internal)
@@ -1048,9 +1092,24 @@ circuit_predict_and_launch_new(void)
     return;
   }
 
+  /* Next, keep some stems around that we can extend to whatever exit
+   * the next stream turns out to need, if we've been making exit
+   * connections recently. */
+  if (num_stems < get_options()->PreemptiveCircuitStems &&
+      router_have_consensus_path() == CONSENSUS_PATH_EXIT &&
+      have_recent_predicted_ports(now)) {
+    flags = CIRCLAUNCH_NEED_CAPACITY | CIRCLAUNCH_IS_STEM;
+    log_info(LD_CIRC,
+             "Have %d clean circs (%d stems), need another circuit stem.",
+             num, num_stems);
+    circuit_launch(CIRCUIT_PURPOSE_C_GENERAL, flags);
+    return;
+  }
+
   /* Third, see if we need any more hidden service (server) circuits.
-   * HS servers only need an internal circuit. */
-  if (num_rend_services() && num_uptime_internal < 3
+   * HS servers only need an internal circuit; they keep more of them
+   * prebuilt the faster they have been using them up. */
+  if (num_uptime_internal < rend_service_get_n_prebuilt_circs_wanted(now)
       && router_have_consensus_path() != CONSENSUS_PATH_UNKNOWN) {
     flags = (CIRCLAUNCH_NEED_CAPACITY | CIRCLAUNCH_NEED_UPTIME |
              CIRCLAUNCH_IS_INTERNAL);
@@ -1538,14 +1597,14 @@ void
 circuit_try_attaching_streams(origin_circuit_t *circ)
 {
   /* Attach streams to this circuit if we can. */
-  connection_ap_attach_pending(1);
+  connection_ap_attach_pending_for_circuit(circ);
 
   /* The call to circuit_try_clearing_isolation_state here will do
    * nothing and return 0 if we didn't attach any streams to circ
    * above. */
   if (circuit_try_clearing_isolation_state(circ)) {
     /* Maybe *now* we can attach some streams to this circuit. */
-    connection_ap_attach_pending(1);
+    connection_ap_attach_pending_for_circuit(circ);
   }
 }
 
@@ -1689,13 +1748,57 @@ have_enough_path_info(int need_exit)
     return router_have_consensus_path() != CONSENSUS_PATH_UNKNOWN;
 }
 
+/** Try to find an open circuit stem that suits the CIRCLAUNCH_* <b>flags</b>,
+ * pick an exit for it as we would for a new general-purpose circuit, and
+ * start extending the stem to that exit.  Return the circuit on success, or
+ * NULL if we have no suitable stem or could not extend it. */
+static origin_circuit_t *
+circuit_extend_stem_to_new_exit(int flags)
+{
+  origin_circuit_t *circ;
+  extend_info_t *exit_ei;
+  struct timeval old_timestamp_began;
+
+  flags |= CIRCLAUNCH_IS_STEM;
+  if (!circuit_find_to_cannibalize(CIRCUIT_PURPOSE_C_GENERAL, NULL, flags))
+    return NULL;
+  exit_ei = circuit_choose_general_exit(flags);
+  if (!exit_ei)
+    return NULL;
+  /* Look again, now that we know which hops to avoid. */
+  circ = circuit_find_to_cannibalize(CIRCUIT_PURPOSE_C_GENERAL, exit_ei,
+                                     flags);
+  if (!circ) {
+    extend_info_free(exit_ei);
+    return NULL;
+  }
+
+  log_info(LD_CIRC, "Extending circuit stem %u to exit %s",
+           (unsigned)circ->global_identifier, extend_info_describe(exit_ei));
+
+  old_timestamp_began = circ->base_.timestamp_began;
+  circ->build_state->is_stem = 0;
+  circ->build_state->is_internal = 0;
+  control_event_circuit_cannibalized(circ, CIRCUIT_PURPOSE_C_GENERAL,
+                                     &old_timestamp_began);
+
+  if (circuit_extend_to_new_exit(circ, exit_ei) < 0)
+    circ = NULL;
+  extend_info_free(exit_ei);
+  return circ;
+}
+
 /** Launch a new circuit with purpose <b>purpose</b> and exit node
  * <b>extend_info</b> (or NULL to select a random exit node).  If flags
  * contains CIRCLAUNCH_NEED_UPTIME, choose among routers with high uptime.  If
  * CIRCLAUNCH_NEED_CAPACITY is set, choose among routers with high bandwidth.
  * If CIRCLAUNCH_IS_INTERNAL is true, the last hop need not be an exit node.
  * If CIRCLAUNCH_ONEHOP_TUNNEL is set, the circuit will have only one hop.
- * Return the newly allocated circuit on success, or NULL on failure. */
+ * If CIRCLAUNCH_IS_STEM is set, the circuit will stop one hop short of an
+ * exit.  When we need a general-purpose circuit to a random exit, we extend
+ * a stem if we have one.
+ * Return the newly allocated circuit (or extended stem) on success, or NULL
+ * on failure. */
 origin_circuit_t *
 circuit_launch_by_extend_info(uint8_t purpose,
                               extend_info_t *extend_info,
@@ -1723,6 +1826,15 @@ circuit_launch_by_extend_info(uint8_t purpose,
     need_specific_rp = 1;
   }
 
+  if (!extend_info && purpose == CIRCUIT_PURPOSE_C_GENERAL &&
+      !(flags & (CIRCLAUNCH_IS_INTERNAL|CIRCLAUNCH_IS_STEM)) &&
+      !onehop_tunnel && get_options()->PreemptiveCircuitStems) {
+    /* We need a new exit: see if we have a stem ready to extend to one. */
+    circ = circuit_extend_stem_to_new_exit(flags);
+    if (circ)
+      return circ;
+  }
+
   if ((extend_info || purpose != CIRCUIT_PURPOSE_C_GENERAL) &&
       purpose != CIRCUIT_PURPOSE_TESTING &&
       !onehop_tunnel && !need_specific_rp) {
@@ -2127,6 +2239,84 @@ circuit_get_open_circ_or_launch(entry_connection_t *conn,
   return 0;
 }
 
+/** How many intro circuits we may launch in a burst to race others. */
+#define RACE_INTRO_CIRCS_BURST 4
+/** How often, in seconds, we may launch another intro circuit to race
+ * others, once the burst is used up. */
+#define RACE_INTRO_CIRCS_INTERVAL 30
+
+/** If the only intro circuit for <b>conn</b>'s hidden service is still
+ * being built, launch another one to a different intro point, so that we
+ * can use whichever opens first.  rend_client_send_introduction() closes
+ * the loser.  So that racing can't multiply our load on the network, we
+ * only race when a token bucket allows it. */
+static void
+circuit_race_intro_circ(entry_connection_t *conn)
+{
+  static int tokens = RACE_INTRO_CIRCS_BURST;
+  static time_t last_refill = 0;
+  const rend_data_t *rend_data = ENTRY_TO_EDGE_CONN(conn)->rend_data;
+  const or_options_t *options = get_options();
+  const time_t now = approx_time();
+  smartlist_t *exclude_ids;
+  extend_info_t *extend_info = NULL;
+  origin_circuit_t *circ;
+  int n_building = 0, flags;
+
+  tor_assert(rend_data);
+
+  if (tokens < RACE_INTRO_CIRCS_BURST &&
+      now - last_refill >= RACE_INTRO_CIRCS_INTERVAL) {
+    tokens = (int) MIN(RACE_INTRO_CIRCS_BURST,
+                       tokens + (now - last_refill) /
+                       RACE_INTRO_CIRCS_INTERVAL);
+    last_refill = now;
+  }
+  if (tokens == 0)
+    return;
+
+  exclude_ids = smartlist_new();
+  SMARTLIST_FOREACH_BEGIN(circuit_get_client_circuits_by_purpose(
+                                            CIRCUIT_PURPOSE_C_INTRODUCING),
+                          origin_circuit_t *, oc) {
+    if (TO_CIRCUIT(oc)->marked_for_close || !oc->rend_data ||
+        rend_cmp_service_ids(oc->rend_data->onion_address,
+                             rend_data->onion_address))
+      continue;
+    ++n_building;
+    if (oc->build_state->chosen_exit)
+      smartlist_add(exclude_ids,
+                    oc->build_state->chosen_exit->identity_digest);
+  } SMARTLIST_FOREACH_END(oc);
+  if (n_building != 1)
+    goto done;
+
+  extend_info = rend_client_get_random_intro_excluding(rend_data,
+                                                       exclude_ids);
+  if (!extend_info)
+    goto done;
+
+  flags = CIRCLAUNCH_NEED_CAPACITY | CIRCLAUNCH_IS_INTERNAL;
+  if (smartlist_contains_int_as_string(options->LongLivedPorts,
+                                       conn->socks_request->port))
+    flags |= CIRCLAUNCH_NEED_UPTIME;
+  circ = circuit_launch_by_extend_info(CIRCUIT_PURPOSE_C_INTRODUCING,
+                                       extend_info, flags);
+  if (circ) {
+    log_info(LD_REND, "Racing a second intro circuit, to %s, for '%s'.",
+             extend_info_describe(extend_info),
+             safe_str_client(rend_data->onion_address));
+    if (tokens-- == RACE_INTRO_CIRCS_BURST)
+      last_refill = now;
+    circ->rend_data = rend_data_dup(rend_data);
+    connection_edge_update_circuit_isolation(conn, circ, 0);
+  }
+
+ done:
+  extend_info_free(extend_info);
+  smartlist_free(exclude_ids);
+}
+
 /** Return true iff <b>crypt_path</b> is one of the crypt_paths for
  * <b>circ</b>. */
 static int
@@ -2491,6 +2681,11 @@ connection_ap_handshake_attach_circuit(entry_connection_t *conn)
       conn, CIRCUIT_PURPOSE_C_INTRODUCE_ACK_WAIT, &introcirc);
     if (retval < 0) return -1; /* failed */
 
+    if (retval == 0 && introcirc &&
+        introcirc->base_.state != CIRCUIT_STATE_OPEN &&
+        get_options()->HSClientRaceIntroPoints)
+      circuit_race_intro_circ(conn);
+
     if (retval > 0) {
       /* one has already sent the intro. keep waiting. */
       tor_assert(introcirc);
@@ -2578,6 +2773,7 @@ circuit_change_purpose(circuit_t *circ, uint8_t new_purpose)
 
   old_purpose = circ->purpose;
   circ->purpose = new_purpose;
+  circuit_update_purpose_index(circ);
 
   if (CIRCUIT_IS_ORIGIN(circ)) {
     control_event_circuit_purpose_changed(TO_ORIGIN_CIRCUIT(circ),
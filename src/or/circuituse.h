@@ -43,6 +43,9 @@ void circuit_build_failed(origin_circuit_t *circ);
 /** Flag to set when the last hop of a circuit doesn't need to be an
  * exit node. */
 #define CIRCLAUNCH_IS_INTERNAL    (1<<3)
+/** Flag to set when a circuit should stop one hop short of an exit, so that
+ * we can extend it to an exit later.  Implies CIRCLAUNCH_IS_INTERNAL. */
+#define CIRCLAUNCH_IS_STEM        (1<<4)
 origin_circuit_t *circuit_launch_by_extend_info(uint8_t purpose,
                                                 extend_info_t *info,
                                                 int flags);
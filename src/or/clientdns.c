@@ -0,0 +1,370 @@
+/* Copyright (c) 2016, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file clientdns.c
+ * \brief Client-side cache of answers to RESOLVE requests.
+ *
+ * When ClientDNSCacheSize is set, we remember the answers that exits give
+ * to RESOLVE and RESOLVE_PTR requests from SOCKS and DNSPort clients, and
+ * answer repeated requests locally until the answer's TTL runs out.  While
+ * a lookup is in flight, other requests for the same name wait for its
+ * answer instead of launching lookups of their own.
+ *
+ * Unlike the addressmap-based cache (CacheDNS and UseDNSCache), answers are
+ * kept apart by isolation context: a request only gets an answer that was
+ * looked up for a stream it could have shared a circuit with.  The cache
+ * holds at most ClientDNSCacheSize answers, forgetting the least recently
+ * used ones first.
+ **/
+
+#include "or.h"
+#include "clientdns.h"
+#include "config.h"
+#include "connection.h"
+#include "connection_edge.h"
+#include "dns.h"
+#include "tor_queue.h"
+
+/** An answer in the client DNS cache, or a lookup that will provide one. */
+typedef struct client_dns_entry_t {
+  /** Digest of the request and the isolation context it was made in. */
+  uint8_t key[DIGEST256_LEN];
+  /** If this lookup is in flight, the global identifier of the connection
+   * making it; otherwise 0. */
+  uint64_t pending_conn_id;
+  /** While the lookup is in flight, the entry_connection_t * for the
+   * requests that are waiting for its answer. */
+  smartlist_t *waiters;
+
+  /** Once answered: a RESOLVED_TYPE_* value, and the answer itself.
+   * <b>answer</b> is NULL until then. */
+  int answer_type;
+  size_t answer_len;
+  uint8_t *answer;
+  /** Once answered: when the answer stops being good. */
+  time_t expires;
+  /** Once answered: our place in the least-recently-used list. */
+  TOR_TAILQ_ENTRY(client_dns_entry_t) lru_next;
+} client_dns_entry_t;
+
+/** Map from key to client_dns_entry_t, for answers and pending lookups. */
+static digest256map_t *client_dns_map = NULL;
+/** Answered entries, least recently used first. */
+static TOR_TAILQ_HEAD(client_dns_lru_s, client_dns_entry_t) client_dns_lru =
+  TOR_TAILQ_HEAD_INITIALIZER(client_dns_lru);
+/** How many entries are on client_dns_lru? */
+static int client_dns_n_answers = 0;
+/** Largest number of answers to keep; 0 if the cache is off. */
+static int client_dns_max_answers = 0;
+
+/** Add <b>len</b> bytes at <b>data</b> to <b>d</b>, preceded by their
+ * length so that adjacent fields can't run into each other. */
+static void
+digest_add_field(crypto_digest_t *d, const void *data, size_t len)
+{
+  uint8_t lenbuf[4];
+  set_uint32(lenbuf, htonl((uint32_t)len));
+  crypto_digest_add_bytes(d, (const char *)lenbuf, sizeof(lenbuf));
+  if (len)
+    crypto_digest_add_bytes(d, data, len);
+}
+
+/** Compute into <b>key_out</b> the cache key for the request on
+ * <b>conn</b>: what it asks for, what kind of answer it can take, and the
+ * values of every field that its port isolates streams by. */
+static void
+client_dns_compute_key(const entry_connection_t *conn, uint8_t *key_out)
+{
+  const socks_request_t *sr = conn->socks_request;
+  const entry_port_cfg_t *cfg = &conn->entry_cfg;
+  const uint8_t iso = cfg->isolation_flags;
+  crypto_digest_t *d = crypto_digest256_new(DIGEST_SHA256);
+  char *address = tor_strdup(sr->address);
+  uint8_t prefs[4];
+
+  tor_strlower(address);
+  prefs[0] = sr->command;
+  prefs[1] = cfg->ipv4_traffic;
+  prefs[2] = cfg->ipv6_traffic;
+  prefs[3] = cfg->prefer_ipv6;
+  digest_add_field(d, prefs, sizeof(prefs));
+  digest_add_field(d, address, strlen(address));
+  digest_add_field(d, conn->chosen_exit_name,
+                   conn->chosen_exit_name ?
+                   strlen(conn->chosen_exit_name) : 0);
+  tor_free(address);
+
+  if (iso & ISO_SOCKSAUTH) {
+    digest_add_field(d, sr->username, sr->username ? sr->usernamelen : 0);
+    digest_add_field(d, sr->password, sr->password ? sr->passwordlen : 0);
+  }
+  if (iso & ISO_CLIENTPROTO) {
+    uint8_t proto[2];
+    proto[0] = sr->listener_type;
+    proto[1] = sr->socks_version;
+    digest_add_field(d, proto, sizeof(proto));
+  }
+  if (iso & ISO_CLIENTADDR) {
+    char addrbuf[TOR_ADDR_BUF_LEN];
+    tor_addr_to_str(addrbuf, &ENTRY_TO_CONN(conn)->addr, sizeof(addrbuf),
+                    0);
+    digest_add_field(d, addrbuf, strlen(addrbuf));
+  }
+  if (iso & ISO_SESSIONGRP) {
+    uint8_t grp[4];
+    set_uint32(grp, htonl((uint32_t)cfg->session_group));
+    digest_add_field(d, grp, sizeof(grp));
+  }
+  if (iso & ISO_NYM_EPOCH) {
+    uint8_t epoch[4];
+    set_uint32(epoch, htonl(conn->nym_epoch));
+    digest_add_field(d, epoch, sizeof(epoch));
+  }
+
+  crypto_digest_get_digest(d, (char *)key_out, DIGEST256_LEN);
+  crypto_digest_free(d);
+}
+
+/** Free <b>ent</b>, which is no longer in the cache. */
+static void
+client_dns_entry_free(client_dns_entry_t *ent)
+{
+  if (!ent)
+    return;
+  smartlist_free(ent->waiters);
+  tor_free(ent->answer);
+  tor_free(ent);
+}
+
+/** Helper: free a client_dns_entry_t, as a void *. */
+static void
+client_dns_entry_free_(void *ent)
+{
+  client_dns_entry_free(ent);
+}
+
+/** Remove <b>ent</b> from the cache and free it.  Any connections still
+ * waiting on it are forgotten, not closed. */
+static void
+client_dns_entry_remove(client_dns_entry_t *ent)
+{
+  digest256map_remove(client_dns_map, ent->key);
+  if (ent->answer) {
+    TOR_TAILQ_REMOVE(&client_dns_lru, ent, lru_next);
+    --client_dns_n_answers;
+  }
+  client_dns_entry_free(ent);
+}
+
+/** Forget least recently used answers until there are no more than
+ * <b>max</b> of them. */
+static void
+client_dns_cache_shrink(int max)
+{
+  while (client_dns_n_answers > max) {
+    client_dns_entry_t *ent = TOR_TAILQ_FIRST(&client_dns_lru);
+    tor_assert(ent);
+    client_dns_entry_remove(ent);
+  }
+}
+
+/** Set the largest number of answers the cache may hold to
+ * <b>max_entries</b>, forgetting answers if there are too many.  A value
+ * of 0 turns the cache off; lookups that are already in flight still
+ * answer the requests waiting for them. */
+void
+client_dns_cache_set_max_entries(int max_entries)
+{
+  client_dns_max_answers = max_entries;
+  client_dns_cache_shrink(max_entries);
+}
+
+/** Try to answer the RESOLVE or RESOLVE_PTR request on <b>conn</b> from
+ * the cache.
+ *
+ * On CLIENT_DNS_CACHE_HIT, we have sent <b>conn</b> its answer, and the
+ * caller should close it.  On CLIENT_DNS_CACHE_WAIT, <b>conn</b> is in
+ * state AP_CONN_STATE_DNS_CACHE_WAIT until an identical lookup finishes,
+ * and the caller should leave it alone.  On CLIENT_DNS_CACHE_MISS, the
+ * caller should launch the lookup; if the cache is on, we will hold other
+ * identical requests back until it finishes. */
+client_dns_cache_result_t
+client_dns_cache_lookup(entry_connection_t *conn)
+{
+  uint8_t key[DIGEST256_LEN];
+  client_dns_entry_t *ent;
+  time_t now = approx_time();
+
+  tor_assert(SOCKS_COMMAND_IS_RESOLVE(conn->socks_request->command));
+
+  if (!client_dns_max_answers || conn->dns_cache_key ||
+      (conn->entry_cfg.isolation_flags & ISO_STREAM))
+    return CLIENT_DNS_CACHE_MISS;
+
+  if (!client_dns_map)
+    client_dns_map = digest256map_new();
+
+  client_dns_compute_key(conn, key);
+  ent = digest256map_get(client_dns_map, key);
+
+  if (ent && !ent->pending_conn_id && ent->expires <= now) {
+    client_dns_entry_remove(ent);
+    ent = NULL;
+  }
+
+  if (ent && !ent->pending_conn_id) {
+    TOR_TAILQ_REMOVE(&client_dns_lru, ent, lru_next);
+    TOR_TAILQ_INSERT_TAIL(&client_dns_lru, ent, lru_next);
+    log_info(LD_APP, "Answering resolve for %s from the client DNS cache.",
+             safe_str_client(conn->socks_request->address));
+    connection_ap_handshake_socks_resolved(conn, ent->answer_type,
+                                           ent->answer_len, ent->answer,
+                                           (int)(ent->expires - now),
+                                           ent->expires);
+    return CLIENT_DNS_CACHE_HIT;
+  }
+
+  conn->dns_cache_key = tor_memdup(key, DIGEST256_LEN);
+
+  if (ent) {
+    log_info(LD_APP, "Resolve for %s is already in flight; waiting for it.",
+             safe_str_client(conn->socks_request->address));
+    smartlist_add(ent->waiters, conn);
+    ENTRY_TO_CONN(conn)->state = AP_CONN_STATE_DNS_CACHE_WAIT;
+    return CLIENT_DNS_CACHE_WAIT;
+  }
+
+  ent = tor_malloc_zero(sizeof(client_dns_entry_t));
+  memcpy(ent->key, key, DIGEST256_LEN);
+  ent->pending_conn_id = ENTRY_TO_CONN(conn)->global_identifier;
+  ent->waiters = smartlist_new();
+  digest256map_set(client_dns_map, key, ent);
+  return CLIENT_DNS_CACHE_MISS;
+}
+
+/** The lookup for <b>ent</b> has stopped without an answer we can share.
+ * Hand it on to the first request that was waiting for it, or forget it if
+ * there was none. */
+static void
+client_dns_entry_pass_on(client_dns_entry_t *ent)
+{
+  while (smartlist_len(ent->waiters)) {
+    entry_connection_t *next = smartlist_get(ent->waiters, 0);
+    smartlist_del_keeporder(ent->waiters, 0);
+    if (ENTRY_TO_CONN(next)->marked_for_close)
+      continue;
+    log_info(LD_APP, "Resolve for %s is no longer in flight; trying it "
+             "again.", safe_str_client(next->socks_request->address));
+    ent->pending_conn_id = ENTRY_TO_CONN(next)->global_identifier;
+    ENTRY_TO_CONN(next)->state = AP_CONN_STATE_CIRCUIT_WAIT;
+    connection_ap_mark_as_pending_circuit(next);
+    return;
+  }
+  client_dns_entry_remove(ent);
+}
+
+/** Called when the RESOLVE or RESOLVE_PTR request on <b>conn</b> gets the
+ * answer of type <b>answer_type</b> in <b>answer</b>.  If <b>conn</b> made
+ * a lookup for the cache, remember the answer for <b>ttl</b> seconds and
+ * send it to every request that was waiting for it. */
+void
+client_dns_cache_note_answer(entry_connection_t *conn, int answer_type,
+                             size_t answer_len, const uint8_t *answer,
+                             int ttl)
+{
+  client_dns_entry_t *ent;
+  smartlist_t *waiters;
+
+  if (!conn->dns_cache_key)
+    return;
+
+  ent = digest256map_get(client_dns_map, conn->dns_cache_key);
+  tor_free(conn->dns_cache_key);
+  if (!ent || ent->pending_conn_id != ENTRY_TO_CONN(conn)->global_identifier)
+    return;
+
+  if (answer_type == RESOLVED_TYPE_ERROR ||
+      answer_type == RESOLVED_TYPE_ERROR_TRANSIENT) {
+    /* Errors may be particular to the connection or circuit that got them,
+     * so we let the next request try for itself. */
+    client_dns_entry_pass_on(ent);
+    return;
+  }
+
+  waiters = ent->waiters;
+  ent->waiters = NULL;
+  ent->pending_conn_id = 0;
+
+  if (ttl >= 0 && client_dns_max_answers) {
+    ent->answer_type = answer_type;
+    ent->answer_len = answer_len;
+    ent->answer = tor_memdup(answer, answer_len ? answer_len : 1);
+    ent->expires = approx_time() + dns_clip_ttl(ttl);
+    TOR_TAILQ_INSERT_TAIL(&client_dns_lru, ent, lru_next);
+    ++client_dns_n_answers;
+    client_dns_cache_shrink(client_dns_max_answers);
+  } else {
+    client_dns_entry_remove(ent);
+  }
+
+  SMARTLIST_FOREACH_BEGIN(waiters, entry_connection_t *, waiter) {
+    if (ENTRY_TO_CONN(waiter)->marked_for_close)
+      continue;
+    tor_free(waiter->dns_cache_key);
+    connection_ap_handshake_socks_resolved(waiter, answer_type, answer_len,
+                                           answer, ttl, -1);
+    connection_mark_unattached_ap(waiter,
+                              END_STREAM_REASON_DONE |
+                              END_STREAM_REASON_FLAG_ALREADY_SOCKS_REPLIED);
+  } SMARTLIST_FOREACH_END(waiter);
+  smartlist_free(waiters);
+}
+
+/** Called when <b>conn</b> is about to close.  If it was waiting for a
+ * lookup, stop waiting; if it was making one that others wait for, let one
+ * of them make it instead. */
+void
+client_dns_cache_conn_closed(entry_connection_t *conn)
+{
+  client_dns_entry_t *ent;
+
+  if (!conn->dns_cache_key)
+    return;
+
+  ent = digest256map_get(client_dns_map, conn->dns_cache_key);
+  tor_free(conn->dns_cache_key);
+  if (!ent || !ent->pending_conn_id)
+    return;
+
+  if (ent->pending_conn_id == ENTRY_TO_CONN(conn)->global_identifier)
+    client_dns_entry_pass_on(ent);
+  else
+    smartlist_remove(ent->waiters, conn);
+}
+
+/** Forget every cached answer, but not the lookups in flight.  Called when
+ * the user asks for new identities. */
+void
+client_dns_cache_clear(void)
+{
+  client_dns_cache_shrink(0);
+}
+
+/** Return the number of answers in the cache. */
+int
+client_dns_cache_n_entries(void)
+{
+  return client_dns_n_answers;
+}
+
+/** Release all storage held by the client DNS cache. */
+void
+client_dns_cache_free_all(void)
+{
+  digest256map_free(client_dns_map, client_dns_entry_free_);
+  client_dns_map = NULL;
+  TOR_TAILQ_INIT(&client_dns_lru);
+  client_dns_n_answers = 0;
+}
+
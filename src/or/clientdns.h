@@ -0,0 +1,34 @@
+/* Copyright (c) 2016, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file clientdns.h
+ * \brief Header file for clientdns.c.
+ **/
+
+#ifndef TOR_CLIENTDNS_H
+#define TOR_CLIENTDNS_H
+
+/** Possible results of client_dns_cache_lookup(). */
+typedef enum client_dns_cache_result_t {
+  /** No answer: the caller should resolve the name itself. */
+  CLIENT_DNS_CACHE_MISS = 0,
+  /** We answered the request from the cache. */
+  CLIENT_DNS_CACHE_HIT = 1,
+  /** The same lookup is already in flight; the connection now waits for
+   * its answer. */
+  CLIENT_DNS_CACHE_WAIT = 2,
+} client_dns_cache_result_t;
+
+void client_dns_cache_set_max_entries(int max_entries);
+client_dns_cache_result_t client_dns_cache_lookup(entry_connection_t *conn);
+void client_dns_cache_note_answer(entry_connection_t *conn, int answer_type,
+                                  size_t answer_len, const uint8_t *answer,
+                                  int ttl);
+void client_dns_cache_conn_closed(entry_connection_t *conn);
+void client_dns_cache_clear(void);
+int client_dns_cache_n_entries(void);
+void client_dns_cache_free_all(void);
+
+#endif
+
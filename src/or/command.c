@@ -46,7 +46,9 @@
 #include "config.h"
 #include "control.h"
 #include "cpuworker.h"
+#include "dos.h"
 #include "hibernate.h"
+#include "latency_trace.h"
 #include "nodelist.h"
 #include "onion.h"
 #include "rephist.h"
@@ -177,6 +179,7 @@ command_process_cell(channel_t *chan, cell_t *cell)
 #define PROCESS_CELL(tp, cl, cn) command_process_ ## tp ## _cell(cl, cn)
 #endif
 
+  LATENCY_TRACE_START(trace_start);
   switch (cell->command) {
     case CELL_CREATE:
     case CELL_CREATE_FAST:
@@ -206,6 +209,7 @@ command_process_cell(channel_t *chan, cell_t *cell)
              cell->command);
       break;
   }
+  LATENCY_TRACE_END(trace_start, LT_PROCESS_CELL);
 }
 
 /** Process an incoming var_cell from a channel; in the current protocol all
@@ -296,6 +300,17 @@ command_process_create_cell(cell_t *cell, channel_t *chan)
     return;
   }
 
+  /* Relays extend through us legitimately; only clients are limited. */
+  if (!connection_or_digest_is_known_relay(chan->identity_digest) &&
+      dos_create_should_refuse(chan)) {
+    log_info(LD_OR, "Refusing create cell from %s: its address is over "
+             "DoSCircuitCreationRate.",
+             channel_get_canonical_remote_descr(chan));
+    channel_send_destroy(cell->circ_id, chan,
+                         END_CIRC_REASON_RESOURCELIMIT);
+    return;
+  }
+
   /* If the high bit of the circuit ID is not as expected, close the
    * circ. */
   if (chan->wide_circ_ids)
@@ -524,7 +539,12 @@ command_process_relay_cell(cell_t *cell, channel_t *chan)
     }
   }
 
-  if ((reason = circuit_receive_relay_cell(cell, circ, direction)) < 0) {
+  {
+    LATENCY_TRACE_START(relay_start);
+    reason = circuit_receive_relay_cell(cell, circ, direction);
+    LATENCY_TRACE_END(relay_start, LT_RELAY_CELL);
+  }
+  if (reason < 0) {
     log_fn(LOG_PROTOCOL_WARN,LD_PROTOCOL,"circuit_receive_relay_cell "
            "(%s) failed. Closing.",
            direction==CELL_DIRECTION_OUT?"forward":"backward");
@@ -18,7 +18,9 @@
 #include "circuitlist.h"
 #include "circuitmux.h"
 #include "circuitmux_ewma.h"
+#include "circuitmux_wfq.h"
 #include "circuitstats.h"
+#include "clientdns.h"
 #include "config.h"
 #include "connection.h"
 #include "connection_edge.h"
@@ -26,9 +28,11 @@
 #include "control.h"
 #include "confparse.h"
 #include "cpuworker.h"
+#include "crypto_async.h"
 #include "dirserv.h"
 #include "dirvote.h"
 #include "dns.h"
+#include "dos.h"
 #include "entrynodes.h"
 #include "geoip.h"
 #include "hibernate.h"
@@ -47,7 +51,9 @@
 #include "routerset.h"
 #include "scheduler.h"
 #include "statefile.h"
+#include "timers.h"
 #include "transports.h"
+#include "watchdog.h"
 #include "ext_orport.h"
 #include "torgzip.h"
 #ifdef _WIN32
@@ -144,6 +150,7 @@ static config_var_t option_vars_[] = {
   V(AccountingMax,               MEMUNIT,  "0 bytes"),
   VAR("AccountingRule",          STRING,   AccountingRule_option,  "max"),
   V(AccountingStart,             STRING,   NULL),
+  V(AdaptiveStreamWindows,       BOOL,     "0"),
   V(Address,                     STRING,   NULL),
   V(AllowDotExit,                BOOL,     "0"),
   V(AllowInvalidNodes,           CSV,      "middle,rendezvous"),
@@ -176,18 +183,23 @@ static config_var_t option_vars_[] = {
   V(AutomapHostsSuffixes,        CSV,      ".onion,.exit"),
   V(AvoidDiskWrites,             BOOL,     "0"),
   V(BandwidthBurst,              MEMUNIT,  "1 GB"),
+  V(BandwidthFairShare,          BOOL,     "0"),
   V(BandwidthRate,               MEMUNIT,  "1 GB"),
   V(BridgeAuthoritativeDir,      BOOL,     "0"),
   VAR("Bridge",                  LINELIST, Bridges,    NULL),
   V(BridgePassword,              STRING,   NULL),
   V(BridgeRecordUsageByCountry,  BOOL,     "1"),
   V(BridgeRelay,                 BOOL,     "0"),
+  V(CacheFileHugePages,          BOOL,     "0"),
+  V(CacheFilePrefetch,           BOOL,     "0"),
   V(CellStatistics,              BOOL,     "0"),
   V(LearnCircuitBuildTimeout,    BOOL,     "1"),
   V(CircuitBuildTimeout,         INTERVAL, "0"),
   V(CircuitIdleTimeout,          INTERVAL, "1 hour"),
   V(CircuitStreamTimeout,        INTERVAL, "0"),
   V(CircuitPriorityHalflife,     DOUBLE,  "-100.0"), /*negative:'Use default'*/
+  V(CircuitPriorityWeights,      STRING,   NULL),
+  V(ClientDNSCacheSize,          UINT,     "0"),
   V(ClientDNSRejectInternalAddresses, BOOL,"1"),
   V(ClientOnly,                  BOOL,     "0"),
   V(ClientPreferIPv6ORPort,      AUTOBOOL, "auto"),
@@ -213,10 +225,14 @@ static config_var_t option_vars_[] = {
   V(CookieAuthFileGroupReadable, BOOL,     "0"),
   V(CookieAuthFile,              STRING,   NULL),
   V(CountPrivateBandwidth,       BOOL,     "0"),
+  V(CPUAffinity,                 CSV,      ""),
   V(DataDirectory,               FILENAME, NULL),
   V(DataDirectoryGroupReadable,  BOOL,     "0"),
   V(DisableOOSCheck,             BOOL,     "1"),
   V(DisableNetwork,              BOOL,     "0"),
+  V(DoSCircuitCreationBurst,     UINT,     "90"),
+  V(DoSCircuitCreationRate,      UINT,     "0"),
+  V(DoSConnectionMaxConcurrentCount, UINT, "0"),
   V(DirAllowPrivateAddresses,    BOOL,     "0"),
   V(TestingAuthDirTimeToLearnReachability, INTERVAL, "30 minutes"),
   V(DirListenAddress,            LINELIST, NULL),
@@ -229,6 +245,7 @@ static config_var_t option_vars_[] = {
   V(DirAuthorityFallbackRate,    DOUBLE,   "1.0"),
   V(DisableAllSwap,              BOOL,     "0"),
   V(DisableDebuggerAttachment,   BOOL,     "1"),
+  V(EdgeTriggeredIO,             BOOL,     "0"),
   OBSOLETE("DisableIOCP"),
   OBSOLETE("DisableV2DirectoryInfo_"),
   OBSOLETE("DynamicDHGroups"),
@@ -249,6 +266,7 @@ static config_var_t option_vars_[] = {
   V(ExitPolicy,                  LINELIST, NULL),
   V(ExitPolicyRejectPrivate,     BOOL,     "1"),
   V(ExitPolicyRejectLocalInterfaces, BOOL, "0"),
+  V(ExitPreconnect,              BOOL,     "0"),
   V(ExitPortStatistics,          BOOL,     "0"),
   V(ExtendAllowPrivateAddresses, BOOL,     "0"),
   V(ExitRelay,                   AUTOBOOL, "auto"),
@@ -282,6 +300,7 @@ static config_var_t option_vars_[] = {
   OBSOLETE("Group"),
   V(GuardLifetime,               INTERVAL, "0 minutes"),
   V(HardwareAccel,               BOOL,     "0"),
+  V(HardwareAccelAsync,          BOOL,     "0"),
   V(HeartbeatPeriod,             INTERVAL, "6 hours"),
   V(AccelName,                   STRING,   NULL),
   V(AccelDir,                    FILENAME, NULL),
@@ -299,8 +318,10 @@ static config_var_t option_vars_[] = {
   VAR("HiddenServiceNumIntroductionPoints", LINELIST_S, RendConfigLines, NULL),
   V(HiddenServiceStatistics,     BOOL,     "1"),
   V(HidServAuth,                 LINELIST, NULL),
+  V(HSClientRaceIntroPoints,     BOOL,     "0"),
   V(CloseHSClientCircuitsImmediatelyOnTimeout, BOOL, "0"),
   V(CloseHSServiceRendCircuitsImmediatelyOnTimeout, BOOL, "0"),
+  V(HiddenServiceReplayFilter,   BOOL,     "0"),
   V(HiddenServiceSingleHopMode,  BOOL,     "0"),
   V(HiddenServiceNonAnonymousMode,BOOL,    "0"),
   V(HTTPProxy,                   STRING,   NULL),
@@ -321,7 +342,10 @@ static config_var_t option_vars_[] = {
   VAR("Log",                     LINELIST, Logs,             NULL),
   V(LogMessageDomains,           BOOL,     "0"),
   V(LogTimeGranularity,          MSEC_INTERVAL, "1 second"),
+  V(MainLoopStallThreshold,      MSEC_INTERVAL, "0"),
   V(TruncateLogFile,             BOOL,     "0"),
+  V(AsyncLogging,                BOOL,     "0"),
+  V(AsyncLoggingDropWhenFull,    BOOL,     "0"),
   V(SyslogIdentityTag,           STRING,   NULL),
   V(LongLivedPorts,              CSV,
         "21,22,706,1863,5050,5190,5222,5223,6523,6667,6697,8300"),
@@ -340,10 +364,13 @@ static config_var_t option_vars_[] = {
   V(NATDListenAddress,           LINELIST, NULL),
   VPORT(NATDPort,                    LINELIST, NULL),
   V(Nickname,                    STRING,   NULL),
+  V(PersistHSClientCache,        BOOL,     "0"),
+  V(PreemptiveCircuitStems,      UINT,     "0"),
   V(PredictedPortsRelevanceTime,  INTERVAL, "1 hour"),
   V(WarnUnsafeSocks,              BOOL,     "1"),
   VAR("NodeFamily",              LINELIST, NodeFamilies,         NULL),
   V(NumCPUs,                     UINT,     "0"),
+  V(NumCPUsMin,                  UINT,     "0"),
   V(NumDirectoryGuards,          UINT,     "0"),
   V(NumEntryGuards,              UINT,     "0"),
   V(OfflineMasterKey,            BOOL,     "0"),
@@ -417,6 +444,7 @@ static config_var_t option_vars_[] = {
   V(SchedulerLowWaterMark__,     MEMUNIT,  "100 MB"),
   V(SchedulerHighWaterMark__,    MEMUNIT,  "101 MB"),
   V(SchedulerMaxFlushCells__,    UINT,     "1000"),
+  V(Schedulers,                  CSV,      "Vanilla"),
   V(ShutdownWaitLength,          INTERVAL, "30 seconds"),
   V(SocksListenAddress,          LINELIST, NULL),
   V(SocksPolicy,                 LINELIST, NULL),
@@ -432,6 +460,8 @@ static config_var_t option_vars_[] = {
   V(Tor2webMode,                 BOOL,     "0"),
   V(Tor2webRendezvousPoints,      ROUTERSET, NULL),
   V(TLSECGroup,                  STRING,   NULL),
+  V(TLSSessionResumption,        BOOL,     "0"),
+  V(TLSReadAhead,                BOOL,     "0"),
   V(TrackHostExits,              CSV,      NULL),
   V(TrackHostExitsExpire,        INTERVAL, "30 minutes"),
   V(TransListenAddress,          LINELIST, NULL),
@@ -671,6 +701,7 @@ static int options_validate_cb(void *old_options, void *options,
                                int from_setconf, char **msg);
 static uint64_t compute_real_max_mem_in_queues(const uint64_t val,
                                                int log_guess);
+static void file_writes_free_all(void);
 
 /** Magic value for or_options_t. */
 #define OR_OPTIONS_MAGIC 9090909
@@ -768,7 +799,7 @@ set_options(or_options_t *new_val, char **msg)
           var->type == CONFIG_TYPE_OBSOLETE) {
         continue;
       }
-      if (!config_is_same(&options_format, new_val, old_options, var_name)) {
+      if (!config_var_is_same(&options_format, new_val, old_options, var)) {
         line = config_get_assigned_option(&options_format, new_val,
                                           var_name, 1);
 
@@ -868,6 +899,8 @@ config_free_all(void)
   config_free_lines(global_cmdline_options);
   global_cmdline_options = NULL;
 
+  config_free_var_indexes();
+
   config_free_lines(global_cmdline_only_options);
   global_cmdline_only_options = NULL;
 
@@ -884,6 +917,8 @@ config_free_all(void)
 
   tor_free(the_short_tor_version);
   tor_free(the_tor_version);
+
+  file_writes_free_all();
 }
 
 /** Make <b>address</b> -- a piece of information related to our operation as
@@ -1504,6 +1539,9 @@ options_transition_requires_fresh_tls_context(const or_options_t *old_options,
   if (!opt_streq(old_options->TLSECGroup, new_options->TLSECGroup))
     return 1;
 
+  if (old_options->TLSSessionResumption != new_options->TLSSessionResumption)
+    return 1;
+
   return 0;
 }
 
@@ -1525,7 +1563,7 @@ options_act(const or_options_t *old_options)
   char *msg=NULL;
   const int transition_affects_workers =
     old_options && options_transition_affects_workers(old_options, options);
-  int old_ewma_enabled;
+  circuitmux_policy_t *old_cmux_policy;
 
   /* disable ptrace and later, other basic debugging techniques */
   {
@@ -1715,6 +1753,15 @@ options_act(const or_options_t *old_options)
   parse_virtual_addr_network(options->VirtualAddrNetworkIPv4, AF_INET,0,NULL);
   parse_virtual_addr_network(options->VirtualAddrNetworkIPv6, AF_INET6,0,NULL);
 
+  if (crypto_async_set_enabled(options->HardwareAccelAsync) < 0) {
+    log_warn(LD_CONFIG, "HardwareAccelAsync is set, but our OpenSSL can't "
+             "run async jobs on this platform. Ignoring.");
+  }
+  if (tor_tls_set_read_ahead(options->TLSReadAhead) < 0) {
+    log_warn(LD_CONFIG, "TLSReadAhead is set, but our OpenSSL is too old to "
+             "support it safely. Ignoring.");
+  }
+
   /* Update address policies. */
   if (policies_parse_from_options(options) < 0) {
     /* This should be impossible, but let's be sure. */
@@ -1759,6 +1806,7 @@ options_act(const or_options_t *old_options)
                            (uint32_t)options->SchedulerHighWaterMark__,
                            (options->SchedulerMaxFlushCells__ > 0) ?
                            options->SchedulerMaxFlushCells__ : 1000);
+  scheduler_set_schedulers(options->Schedulers);
 
   /* Set up accounting */
   if (accounting_parse_options(options, 0)<0) {
@@ -1768,15 +1816,16 @@ options_act(const or_options_t *old_options)
   if (accounting_is_enabled(options))
     configure_accounting(time(NULL));
 
-  old_ewma_enabled = cell_ewma_enabled();
-  /* Change the cell EWMA settings */
+  client_dns_cache_set_max_entries(options->ClientDNSCacheSize);
+  dos_set_options(options);
+
+  old_cmux_policy = channel_get_default_cmux_policy();
+  /* Change the cell EWMA and traffic class settings */
   cell_ewma_set_scale_factor(options, networkstatus_get_latest_consensus());
-  /* If we just enabled ewma, set the cmux policy on all active channels */
-  if (cell_ewma_enabled() && !old_ewma_enabled) {
-    channel_set_cmux_policy_everywhere(&ewma_policy);
-  } else if (!cell_ewma_enabled() && old_ewma_enabled) {
-    /* Turn it off everywhere */
-    channel_set_cmux_policy_everywhere(NULL);
+  cell_wfq_set_weights(options);
+  /* If that changed the cmux policy, set it on all active channels */
+  if (channel_get_default_cmux_policy() != old_cmux_policy) {
+    channel_set_cmux_policy_everywhere(channel_get_default_cmux_policy());
   }
 
   /* Update the BridgePassword's hashed version as needed.  We store this as a
@@ -1817,6 +1866,10 @@ options_act(const or_options_t *old_options)
       routerset_add_unknown_ccs(&options->ExcludeExitNodesUnion_, is_auto);
   }
 
+  /* Our routersets may have changed, so the nodelist needs to recompute
+   * which nodes are in them. */
+  nodelist_invalidate_node_summaries();
+
   /* Check for transitions that need action. */
   if (old_options) {
     int revise_trackexithosts = 0;
@@ -1913,6 +1966,17 @@ options_act(const or_options_t *old_options)
     if (options->PerConnBWRate != old_options->PerConnBWRate ||
         options->PerConnBWBurst != old_options->PerConnBWBurst)
       connection_or_update_token_buckets(get_connection_array(), options);
+
+    if (!smartlist_strings_eq(options->CPUAffinity, old_options->CPUAffinity))
+      cpuworkers_set_cpu_affinity(options);
+
+    if (options->NumCPUs != old_options->NumCPUs ||
+        options->NumCPUsMin != old_options->NumCPUsMin)
+      cpuworkers_set_pool_size(options);
+
+    if (options->MainLoopStallThreshold !=
+        old_options->MainLoopStallThreshold)
+      watchdog_set_threshold(options->MainLoopStallThreshold);
   }
 
   /* Only collect directory-request statistics on relays and bridges. */
@@ -2735,6 +2799,10 @@ compute_publishserverdescriptor(or_options_t *options)
  * period of time to an uncomfortable level .*/
 #define MAX_PREDICTED_CIRCS_RELEVANCE (60*60)
 
+/** Highest allowable value for PreemptiveCircuitStems; stems count against
+ * the number of unused circuits we are willing to keep open. */
+#define MAX_PREEMPTIVE_CIRCUIT_STEMS 4
+
 /** Highest allowable value for RendPostPeriod. */
 #define MAX_DIR_PERIOD (MIN_ONION_KEY_LIFETIME/2)
 
@@ -2754,6 +2822,10 @@ compute_publishserverdescriptor(or_options_t *options)
  * expose more information than we're comfortable with. */
 #define MIN_HEARTBEAT_PERIOD (30*60)
 
+/** Lowest allowable nonzero value for MainLoopStallThreshold, in msec; if
+ * this is too low, the progress timer would keep the main loop busy. */
+#define MIN_MAIN_LOOP_STALL_THRESHOLD 10
+
 /** Lowest recommended value for CircuitBuildTimeout; if it is set too low
  * and LearnCircuitBuildTimeout is off, the failure rate for circuit
  * construction may be very high.  In that case, if it is set below this
@@ -3081,6 +3153,20 @@ options_validate(or_options_t *old_options, or_options_t *options,
     return -1;
   }
 
+  if (options->Schedulers) {
+    SMARTLIST_FOREACH_BEGIN(options->Schedulers, const char *, name) {
+      if (!scheduler_get_by_name(name)) {
+        tor_asprintf(msg, "Unrecognized scheduler %s in Schedulers.",
+                     escaped(name));
+        return -1;
+      }
+    } SMARTLIST_FOREACH_END(name);
+  }
+
+  if (options->CircuitPriorityWeights &&
+      cell_wfq_parse_weights(options->CircuitPriorityWeights, NULL, msg) < 0)
+    return -1;
+
   if (options->NodeFamilies) {
     options->NodeFamilySets = smartlist_new();
     for (cl = options->NodeFamilies; cl; cl = cl->next) {
@@ -3185,6 +3271,19 @@ options_validate(or_options_t *old_options, or_options_t *options,
     }
   }
 
+  if (options->DoSConnectionMaxConcurrentCount > UINT16_MAX) {
+    tor_asprintf(msg, "DoSConnectionMaxConcurrentCount must be no more than "
+                 "%d.", UINT16_MAX);
+    return -1;
+  }
+
+  if (options->ClientDNSCacheSize > MAX_CLIENT_DNS_CACHE_SIZE) {
+    tor_asprintf(msg,
+                 "ClientDNSCacheSize must be no more than %d, but was set to "
+                 "%d", MAX_CLIENT_DNS_CACHE_SIZE, options->ClientDNSCacheSize);
+    return -1;
+  }
+
   if (options->MaxClientCircuitsPending <= 0 ||
       options->MaxClientCircuitsPending > MAX_MAX_CLIENT_CIRCUITS_PENDING) {
     tor_asprintf(msg,
@@ -3197,6 +3296,25 @@ options_validate(or_options_t *old_options, or_options_t *options,
   if (validate_ports_csv(options->FirewallPorts, "FirewallPorts", msg) < 0)
     return -1;
 
+  if (options->CPUAffinity) {
+    SMARTLIST_FOREACH_BEGIN(options->CPUAffinity, const char *, cp) {
+      int ok;
+      tor_parse_long(cp, 10, 0, 1023, &ok, NULL);
+      if (!ok) {
+        tor_asprintf(msg, "CPU '%s' in CPUAffinity is not a number between "
+                     "0 and 1023.", cp);
+        return -1;
+      }
+    } SMARTLIST_FOREACH_END(cp);
+  }
+
+  if (options->MainLoopStallThreshold &&
+      options->MainLoopStallThreshold < MIN_MAIN_LOOP_STALL_THRESHOLD) {
+    tor_asprintf(msg, "MainLoopStallThreshold must be 0 (disabled) or at "
+                 "least %d msec.", MIN_MAIN_LOOP_STALL_THRESHOLD);
+    return -1;
+  }
+
   if (validate_ports_csv(options->LongLivedPorts, "LongLivedPorts", msg) < 0)
     return -1;
 
@@ -3399,6 +3517,12 @@ options_validate(or_options_t *old_options, or_options_t *options,
     options->RendPostPeriod = MAX_DIR_PERIOD;
   }
 
+  if (options->PreemptiveCircuitStems > MAX_PREEMPTIVE_CIRCUIT_STEMS) {
+    log_warn(LD_CONFIG, "PreemptiveCircuitStems is too large; clipping "
+             "to %d.", MAX_PREEMPTIVE_CIRCUIT_STEMS);
+    options->PreemptiveCircuitStems = MAX_PREEMPTIVE_CIRCUIT_STEMS;
+  }
+
   if (options->PredictedPortsRelevanceTime >
       MAX_PREDICTED_CIRCS_RELEVANCE) {
     log_warn(LD_CONFIG, "PredictedPortsRelevanceTime is too large; "
@@ -4808,13 +4932,14 @@ load_torrc_from_disk(config_line_t *cmd_arg, int defaults_file)
     if (using_default_torrc == 1 || ignore_missing_torrc) {
       if (!defaults_file)
         log_notice(LD_CONFIG, "Configuration file \"%s\" not present, "
-            "using reasonable defaults.", fname);
+            "using reasonable defaults.", fname?fname:"<NULL>");
       tor_free(fname); /* sets fname to NULL */
       *fname_var = NULL;
       cf = tor_strdup("");
     } else {
       log_warn(LD_CONFIG,
-          "Unable to open configuration file \"%s\".", fname);
+          "Unable to open configuration file \"%s\".",
+          fname?fname:"<NULL>");
       goto err;
     }
   } else {
@@ -5405,8 +5530,14 @@ options_init_logs(const or_options_t *old_options, or_options_t *options,
   }
   smartlist_free(elts);
 
-  if (ok && !validate_only)
+  if (ok && !validate_only) {
     logs_set_domain_logging(options->LogMessageDomains);
+    if (logs_set_async(options->AsyncLogging,
+                       options->AsyncLoggingDropWhenFull) < 0) {
+      log_warn(LD_CONFIG, "Couldn't start the asynchronous log writer; "
+               "writing log messages directly.");
+    }
+  }
 
   return ok?0:-1;
 }
@@ -7599,6 +7730,7 @@ init_libevent(const or_options_t *options)
   cfg.msec_per_tick = options->TokenBucketRefillInterval;
 
   tor_libevent_initialize(&cfg);
+  timers_initialize();
 
   suppress_libevent_log_msg(NULL);
 }
@@ -7686,10 +7818,296 @@ write_to_data_subdir(const char* subdir, const char* fname,
     log_warn(LD_HIST, "Unable to write %s to disk!", descr ? descr : fname);
     return_val = -1;
   }
+  router_forget_stats_file(filename);
   tor_free(filename);
   return return_val;
 }
 
+/** A request to replace the contents of a file on a cpuworker thread, as
+ * queued by write_str_to_file_async(). */
+typedef struct file_write_job_t {
+  /** The file to replace. */
+  char *fname;
+  /** The new contents of the file.  Only this job refers to them. */
+  char *contents;
+  /** Function to call from the main thread once we've written the file, or
+   * NULL. */
+  file_write_cb_t cb;
+  /** Argument to pass to <b>cb</b>. */
+  void *cb_arg;
+  /** One of FWJ_PENDING, FWJ_DONE or FWJ_CANCELLED.  Protected by
+   * file_write_mutex. */
+  int state;
+  /** 0 if we wrote the file, -1 if we failed. Only valid once
+   * <b>state</b> is FWJ_DONE. */
+  int status;
+} file_write_job_t;
+
+/** The worker has not yet written this job. */
+#define FWJ_PENDING 0
+/** The worker has written (or failed to write) this job. */
+#define FWJ_DONE 1
+/** The main thread wrote this file itself: the worker should do nothing. */
+#define FWJ_CANCELLED 2
+
+/** The asynchronous writes we know about for a single file.  We keep at
+ * most one of them on a worker at a time, so that an older snapshot can
+ * never overwrite a newer one. */
+typedef struct file_write_entry_t {
+  /** The job we've given to a worker, or NULL. */
+  file_write_job_t *in_flight;
+  /** The newest contents we want to write once <b>in_flight</b> is done,
+   * or NULL. */
+  file_write_job_t *next;
+} file_write_entry_t;
+
+/** Map from filename to file_write_entry_t for every file with an
+ * asynchronous write outstanding.  Only used from the main thread. */
+static strmap_t *file_write_map = NULL;
+/** Held by whichever thread is writing a file for write_str_to_file_async(),
+ * and used to protect the <b>state</b> field of file_write_job_t. */
+static tor_mutex_t *file_write_mutex = NULL;
+/** How many file_write_job_t are waiting for their reply callback? */
+static int n_file_writes_in_flight = 0;
+/** If true, write_str_to_file_async() writes files immediately. */
+static int file_writes_are_synchronous = 0;
+
+/** Release all storage held by <b>job</b>. */
+static void
+file_write_job_free(file_write_job_t *job)
+{
+  if (!job)
+    return;
+  tor_free(job->fname);
+  tor_free(job->contents);
+  tor_free(job);
+}
+
+/** Cpuworker callback: write out the file for <b>job_</b>, unless the main
+ * thread has already done so. */
+static workqueue_reply_t
+file_write_threadfn(void *state_, void *job_)
+{
+  file_write_job_t *job = job_;
+  (void)state_;
+  tor_mutex_acquire(file_write_mutex);
+  if (job->state == FWJ_PENDING) {
+    job->status = write_str_to_file_synced(job->fname, job->contents, 0);
+    job->state = FWJ_DONE;
+  }
+  tor_mutex_release(file_write_mutex);
+  return WQ_RPL_REPLY;
+}
+
+static void file_write_launch(file_write_entry_t *ent, file_write_job_t *job);
+
+/** Main-thread callback: report the outcome of <b>job_</b>, start the next
+ * write of the same file if there is one, and release the job. */
+static void
+file_write_replyfn(void *job_)
+{
+  file_write_job_t *job = job_;
+  file_write_entry_t *ent = NULL;
+
+  --n_file_writes_in_flight;
+  if (job->state == FWJ_DONE && job->cb)
+    job->cb(job->fname, job->status, job->cb_arg);
+
+  if (file_write_map)
+    ent = strmap_get(file_write_map, job->fname);
+  if (ent && ent->in_flight == job) {
+    ent->in_flight = NULL;
+    if (ent->next) {
+      file_write_job_t *next = ent->next;
+      ent->next = NULL;
+      file_write_launch(ent, next);
+    } else {
+      strmap_remove(file_write_map, job->fname);
+      tor_free(ent);
+    }
+  }
+  file_write_job_free(job);
+}
+
+/** Give <b>job</b> to a cpuworker as the current write for <b>ent</b>, or
+ * write it right here if we have no worker threads. */
+static void
+file_write_launch(file_write_entry_t *ent, file_write_job_t *job)
+{
+  ent->in_flight = job;
+  ++n_file_writes_in_flight;
+  if (!cpuworker_queue_work(WQ_PRI_LOW, file_write_threadfn,
+                            file_write_replyfn, job)) {
+    file_write_threadfn(NULL, job);
+    file_write_replyfn(job);
+  }
+}
+
+/** Write <b>contents</b> to <b>fname</b> from the main thread, making sure
+ * that no queued write of the same file can replace it later.  Return 0 on
+ * success and -1 on failure. */
+static int
+file_write_now(const char *fname, const char *contents)
+{
+  file_write_entry_t *ent = NULL;
+  int r;
+
+  if (file_write_map)
+    ent = strmap_get(file_write_map, fname);
+  if (!file_write_mutex)
+    file_write_mutex = tor_mutex_new();
+
+  tor_mutex_acquire(file_write_mutex);
+  if (ent) {
+    if (ent->in_flight && ent->in_flight->state == FWJ_PENDING)
+      ent->in_flight->state = FWJ_CANCELLED;
+    file_write_job_free(ent->next);
+    ent->next = NULL;
+  }
+  r = write_str_to_file_synced(fname, contents, 0);
+  tor_mutex_release(file_write_mutex);
+  return r;
+}
+
+/** Replace the contents of <b>fname</b> with <b>contents</b>, taking
+ * ownership of <b>contents</b>.  The write happens on a cpuworker thread if
+ * we have any, and reaches the disk before it replaces the old file.
+ * When it is done, call <b>cb</b> (if it is set) from the main thread with
+ * <b>fname</b>, 0 on success or -1 on failure, and <b>cb_arg</b>.
+ *
+ * Writes of the same file happen in order; if we're asked to write a file
+ * again before we've started on the last write of it, we only write the
+ * newest contents, and don't call the callback for the skipped ones. */
+void
+write_str_to_file_async(const char *fname, char *contents,
+                        file_write_cb_t cb, void *cb_arg)
+{
+  file_write_entry_t *ent;
+  file_write_job_t *job;
+
+  tor_assert(fname);
+  tor_assert(contents);
+
+  if (file_writes_are_synchronous) {
+    int r = file_write_now(fname, contents);
+    tor_free(contents);
+    if (cb)
+      cb(fname, r, cb_arg);
+    return;
+  }
+
+  if (!file_write_map)
+    file_write_map = strmap_new();
+  if (!file_write_mutex)
+    file_write_mutex = tor_mutex_new();
+
+  job = tor_malloc_zero(sizeof(file_write_job_t));
+  job->fname = tor_strdup(fname);
+  job->contents = contents;
+  job->cb = cb;
+  job->cb_arg = cb_arg;
+
+  ent = strmap_get(file_write_map, fname);
+  if (!ent) {
+    ent = tor_malloc_zero(sizeof(file_write_entry_t));
+    strmap_set(file_write_map, fname, ent);
+  }
+  if (ent->in_flight) {
+    /* Don't race with the write we already started: remember these
+     * contents, and write them when that one is done. */
+    file_write_job_free(ent->next);
+    ent->next = job;
+  } else {
+    file_write_launch(ent, job);
+  }
+}
+
+/** Write every file that is still waiting for write_str_to_file_async()
+ * from the main thread, and make all later calls to
+ * write_str_to_file_async() write their files immediately.  Call this before
+ * we exit, since we won't wait for the workers to finish. */
+void
+file_writes_flush_and_set_synchronous(void)
+{
+  file_writes_are_synchronous = 1;
+  if (!file_write_map)
+    return;
+
+  STRMAP_FOREACH(file_write_map, fname, file_write_entry_t *, ent) {
+    file_write_job_t *job = ent->next;
+    ent->next = NULL;
+
+    tor_mutex_acquire(file_write_mutex);
+    if (ent->in_flight && ent->in_flight->state == FWJ_PENDING) {
+      ent->in_flight->state = FWJ_CANCELLED;
+      if (!job) {
+        /* Steal the contents: the worker won't look at them now. */
+        job = tor_malloc_zero(sizeof(file_write_job_t));
+        job->fname = tor_strdup(fname);
+        job->contents = ent->in_flight->contents;
+        ent->in_flight->contents = NULL;
+        job->cb = ent->in_flight->cb;
+        job->cb_arg = ent->in_flight->cb_arg;
+      }
+    }
+    if (job)
+      job->status = write_str_to_file_synced(job->fname, job->contents, 0);
+    tor_mutex_release(file_write_mutex);
+
+    if (job) {
+      if (job->cb)
+        job->cb(job->fname, job->status, job->cb_arg);
+      file_write_job_free(job);
+    }
+  } STRMAP_FOREACH_END;
+}
+
+/** Release the storage we use for write_str_to_file_async().  Jobs that a
+ * worker still holds are freed when their replies arrive, if ever. */
+static void
+file_writes_free_all(void)
+{
+  if (file_write_map) {
+    STRMAP_FOREACH_MODIFY(file_write_map, fname, file_write_entry_t *, ent) {
+      file_write_job_free(ent->next);
+      tor_free(ent);
+      MAP_DEL_CURRENT(fname);
+    } STRMAP_FOREACH_END;
+    strmap_free(file_write_map, NULL);
+    file_write_map = NULL;
+  }
+  if (file_write_mutex && n_file_writes_in_flight == 0) {
+    tor_mutex_free(file_write_mutex);
+    file_write_mutex = NULL;
+  }
+  file_writes_are_synchronous = 0;
+}
+
+/** Callback for write_to_data_subdir_async(): warn if we couldn't write the
+ * file.  <b>arg</b> is the description of the file's contents. */
+static void
+write_to_data_subdir_done_cb(const char *fname, int status, void *arg)
+{
+  const char *descr = arg;
+  if (status < 0)
+    log_warn(LD_HIST, "Unable to write %s to disk!", descr ? descr : fname);
+  router_forget_stats_file(fname);
+}
+
+/** As write_to_data_subdir(), but make a copy of <b>str</b> and write it
+ * with write_str_to_file_async(), so that we don't block on the disk.
+ * <b>descr</b> must be a string that will outlive the write, such as a
+ * literal. */
+void
+write_to_data_subdir_async(const char* subdir, const char* fname,
+                           const char* str, const char* descr)
+{
+  char *filename = get_datadir_fname2(subdir, fname);
+  write_str_to_file_async(filename, tor_strdup(str),
+                          write_to_data_subdir_done_cb, (void*)descr);
+  tor_free(filename);
+}
+
 /** Given a file name check to see whether the file exists but has not been
  * modified for a very long time.  If so, remove it. */
 void
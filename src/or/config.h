@@ -81,6 +81,15 @@ int using_default_dir_authorities(const or_options_t *options);
 int check_or_create_data_subdir(const char *subdir);
 int write_to_data_subdir(const char* subdir, const char* fname,
                          const char* str, const char* descr);
+void write_to_data_subdir_async(const char* subdir, const char* fname,
+                                const char* str, const char* descr);
+
+/** Callback type for write_str_to_file_async(): <b>status</b> is 0 if we
+ * wrote <b>fname</b>, and -1 if we failed. */
+typedef void (*file_write_cb_t)(const char *fname, int status, void *arg);
+void write_str_to_file_async(const char *fname, char *contents,
+                             file_write_cb_t cb, void *cb_arg);
+void file_writes_flush_and_set_synchronous(void);
 
 int get_num_cpus(const or_options_t *options);
 
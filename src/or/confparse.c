@@ -86,6 +86,44 @@ config_line_append(config_line_t **lst,
   (*lst) = newline;
 }
 
+/** While config_assign() runs, the last line it has appended to each
+ * linelist option, so that assigning n lines takes O(n) time and not
+ * O(n^2). */
+typedef struct config_line_tails_t {
+  /** Number of entries in <b>tail</b>: one for each option in the format,
+   * then one for the format's "extra" lines. */
+  int n;
+  /** Each entry is NULL, or a line still on the corresponding list. */
+  config_line_t **tail;
+} config_line_tails_t;
+
+/** Forget every tail in <b>tails</b>, because a list may have been freed.
+ * (Some linelist options share one list, so we can't tell which.) */
+static void
+config_line_tails_clear(config_line_tails_t *tails)
+{
+  if (tails)
+    memset(tails->tail, 0, sizeof(config_line_t *) * tails->n);
+}
+
+/** As config_line_append(), but if *<b>tailp</b> is a line on *<b>lst</b>,
+ * start looking for the end of the list there, and set *<b>tailp</b> to the
+ * new line.  <b>tailp</b> may be NULL. */
+static void
+config_line_append_with_tail(config_line_t **lst, config_line_t **tailp,
+                             const char *key, const char *val)
+{
+  config_line_t *last;
+  if (tailp && *tailp)
+    lst = &(*tailp)->next;
+  config_line_append(lst, key, val);
+  if (!tailp)
+    return;
+  for (last = *lst; last->next; last = last->next)
+    ;
+  *tailp = last;
+}
+
 /** Return the line in <b>lines</b> whose key is exactly <b>key</b>, or NULL
  * if no such key exists. For handling commandline-only options only; other
  * options should be looked up in the appropriate data structure. */
@@ -201,20 +239,77 @@ config_find_deprecation(const config_format_t *fmt, const char *key)
   return NULL;
 }
 
+/** A case-insensitive index of the options in one config_format_t. */
+typedef struct config_var_index_t {
+  const config_format_t *fmt;
+  /** Map from lowercased option name to its config_var_t in fmt->vars. */
+  strmap_t *by_name;
+} config_var_index_t;
+
+/** List of config_var_index_t, one for each format we have looked up an
+ * option in.  There are only ever a handful of formats. */
+static smartlist_t *config_var_indexes = NULL;
+
+/** Return the index of the options in <b>fmt</b>, building it if this is
+ * the first lookup in <b>fmt</b>. */
+static strmap_t *
+config_get_var_index(const config_format_t *fmt)
+{
+  config_var_index_t *idx;
+  int i;
+
+  if (!config_var_indexes)
+    config_var_indexes = smartlist_new();
+  SMARTLIST_FOREACH(config_var_indexes, config_var_index_t *, ent,
+                    if (ent->fmt == fmt) return ent->by_name);
+
+  idx = tor_malloc_zero(sizeof(config_var_index_t));
+  idx->fmt = fmt;
+  idx->by_name = strmap_new();
+  for (i=0; fmt->vars[i].name; ++i) {
+    char *name = tor_strdup(fmt->vars[i].name);
+    tor_strlower(name);
+    /* If two options differ only in case, the first one wins, as it did
+     * when we scanned the table. */
+    if (!strmap_get(idx->by_name, name))
+      strmap_set(idx->by_name, name, &fmt->vars[i]);
+    tor_free(name);
+  }
+  smartlist_add(config_var_indexes, idx);
+  return idx->by_name;
+}
+
+/** Release the option indexes built by config_find_option(). */
+void
+config_free_var_indexes(void)
+{
+  if (!config_var_indexes)
+    return;
+  SMARTLIST_FOREACH_BEGIN(config_var_indexes, config_var_index_t *, idx) {
+    strmap_free(idx->by_name, NULL);
+    tor_free(idx);
+  } SMARTLIST_FOREACH_END(idx);
+  smartlist_free(config_var_indexes);
+  config_var_indexes = NULL;
+}
+
 /** As config_find_option, but return a non-const pointer. */
 config_var_t *
 config_find_option_mutable(config_format_t *fmt, const char *key)
 {
   int i;
+  char *lower_key;
+  config_var_t *var;
   size_t keylen = strlen(key);
   if (!keylen)
     return NULL; /* if they say "--" on the command line, it's not an option */
   /* First, check for an exact (case-insensitive) match */
-  for (i=0; fmt->vars[i].name; ++i) {
-    if (!strcasecmp(key, fmt->vars[i].name)) {
-      return &fmt->vars[i];
-    }
-  }
+  lower_key = tor_strdup(key);
+  tor_strlower(lower_key);
+  var = strmap_get(config_get_var_index(fmt), lower_key);
+  tor_free(lower_key);
+  if (var)
+    return var;
   /* If none, check for an abbreviated match */
   for (i=0; fmt->vars[i].name; ++i) {
     if (!strncasecmp(key, fmt->vars[i].name, keylen)) {
@@ -256,11 +351,14 @@ config_count_options(const config_format_t *fmt)
 /** <b>c</b>-\>key is known to be a real key. Update <b>options</b>
  * with <b>c</b>-\>value and return 0, or return -1 if bad value.
  *
+ * If <b>tails</b> is set, use it to append to linelists quickly.
+ *
  * Called from config_assign_line() and option_reset().
  */
 static int
 config_assign_value(const config_format_t *fmt, void *options,
-                    config_line_t *c, char **msg)
+                    config_line_t *c, config_line_tails_t *tails,
+                    char **msg)
 {
   int i, ok;
   const config_var_t *var;
@@ -439,12 +537,15 @@ config_assign_value(const config_format_t *fmt, void *options,
         if (c->command != CONFIG_LINE_APPEND) {
           config_free_lines(lastval);
           *(config_line_t**)lvalue = NULL;
+          config_line_tails_clear(tails);
         } else {
           lastval->fragile = 0;
         }
       }
 
-      config_line_append((config_line_t**)lvalue, c->key, c->value);
+      config_line_append_with_tail((config_line_t**)lvalue,
+                        tails ? &tails->tail[var - fmt->vars] : NULL,
+                        c->key, c->value);
     }
     break;
   case CONFIG_TYPE_OBSOLETE:
@@ -505,7 +606,8 @@ warn_deprecated_option(const char *what, const char *why)
 static int
 config_assign_line(const config_format_t *fmt, void *options,
                    config_line_t *c, unsigned flags,
-                   bitarray_t *options_seen, char **msg)
+                   bitarray_t *options_seen, config_line_tails_t *tails,
+                   char **msg)
 {
   const unsigned use_defaults = flags & CAL_USE_DEFAULTS;
   const unsigned clear_first = flags & CAL_CLEAR_FIRST;
@@ -520,7 +622,9 @@ config_assign_line(const config_format_t *fmt, void *options,
       void *lvalue = STRUCT_VAR_P(options, fmt->extra->var_offset);
       log_info(LD_CONFIG,
                "Found unrecognized option '%s'; saving it.", c->key);
-      config_line_append((config_line_t**)lvalue, c->key, c->value);
+      config_line_append_with_tail((config_line_t**)lvalue,
+                                   tails ? &tails->tail[tails->n - 1] : NULL,
+                                   c->key, c->value);
       return 0;
     } else {
       tor_asprintf(msg,
@@ -553,11 +657,13 @@ config_assign_line(const config_format_t *fmt, void *options,
                  "Linelist option '%s' has no value. Skipping.", c->key);
       } else { /* not already cleared */
         config_reset(fmt, options, var, use_defaults);
+        config_line_tails_clear(tails);
       }
     }
     return 0;
   } else if (c->command == CONFIG_LINE_CLEAR && !clear_first) {
     config_reset(fmt, options, var, use_defaults);
+    config_line_tails_clear(tails);
   }
 
   if (options_seen && (var->type != CONFIG_TYPE_LINELIST &&
@@ -572,7 +678,7 @@ config_assign_line(const config_format_t *fmt, void *options,
     bitarray_set(options_seen, var_index);
   }
 
-  if (config_assign_value(fmt, options, c, msg) < 0)
+  if (config_assign_value(fmt, options, c, tails, msg) < 0)
     return -2;
   return 0;
 }
@@ -847,6 +953,7 @@ config_assign(const config_format_t *fmt, void *options, config_line_t *list,
 {
   config_line_t *p;
   bitarray_t *options_seen;
+  config_line_tails_t tails;
   const int n_options = config_count_options(fmt);
   const unsigned clear_first = config_assign_flags & CAL_CLEAR_FIRST;
   const unsigned use_defaults = config_assign_flags & CAL_USE_DEFAULTS;
@@ -870,17 +977,21 @@ config_assign(const config_format_t *fmt, void *options, config_line_t *list,
   }
 
   options_seen = bitarray_init_zero(n_options);
+  tails.n = n_options + 1;
+  tails.tail = tor_calloc(tails.n, sizeof(config_line_t *));
   /* pass 3: assign. */
   while (list) {
     int r;
     if ((r=config_assign_line(fmt, options, list, config_assign_flags,
-                              options_seen, msg))) {
+                              options_seen, &tails, msg))) {
       bitarray_free(options_seen);
+      tor_free(tails.tail);
       return r;
     }
     list = list->next;
   }
   bitarray_free(options_seen);
+  tor_free(tails.tail);
 
   /** Now we're done assigning a group of options to the configuration.
    * Subsequent group assignments should _replace_ linelists, not extend
@@ -973,7 +1084,7 @@ config_reset(const config_format_t *fmt, void *options,
     c = tor_malloc_zero(sizeof(config_line_t));
     c->key = tor_strdup(var->name);
     c->value = tor_strdup(var->initvalue);
-    if (config_assign_value(fmt, options, c, &msg) < 0) {
+    if (config_assign_value(fmt, options, c, NULL, &msg) < 0) {
       log_warn(LD_BUG, "Failed to assign default: %s", msg);
       tor_free(msg); /* if this happens it's a bug */
     }
@@ -1032,27 +1143,197 @@ config_count_key(const config_line_t *a, const char *key)
   return n;
 }
 
-/** Return true iff the option <b>name</b> has the same value in <b>o1</b>
+/** Return the number of elements in the CSV or CSV_INTERVAL list
+ * <b>sl</b>, treating NULL as an empty list. */
+static inline int
+csv_len(const smartlist_t *sl)
+{
+  return sl ? smartlist_len(sl) : 0;
+}
+
+/** Helper for config_var_is_same(): compare the
+ * values of <b>var</b> in <b>o1</b> and <b>o2</b> directly.  Return 1 if
+ * they are the same, 0 if they differ, and -1 if we can only compare
+ * values of this type through their string forms. */
+static int
+config_var_values_eq(const config_var_t *var,
+                     const void *o1, const void *o2)
+{
+  const void *v1 = STRUCT_VAR_P(o1, var->var_offset);
+  const void *v2 = STRUCT_VAR_P(o2, var->var_offset);
+  int i;
+
+  switch (var->type) {
+    case CONFIG_TYPE_STRING:
+    case CONFIG_TYPE_FILENAME:
+      return ! strcmp_opt(*(const char**)v1, *(const char**)v2);
+    case CONFIG_TYPE_ISOTIME:
+      return *(const time_t*)v1 == *(const time_t*)v2;
+    case CONFIG_TYPE_PORT:
+    case CONFIG_TYPE_INTERVAL:
+    case CONFIG_TYPE_MSEC_INTERVAL:
+    case CONFIG_TYPE_UINT:
+    case CONFIG_TYPE_INT:
+      return *(const int*)v1 == *(const int*)v2;
+    case CONFIG_TYPE_MEMUNIT:
+      return *(const uint64_t*)v1 == *(const uint64_t*)v2;
+    case CONFIG_TYPE_AUTOBOOL:
+      if (*(const int*)v1 == -1 || *(const int*)v2 == -1)
+        return *(const int*)v1 == *(const int*)v2;
+      /* fall through */
+    case CONFIG_TYPE_BOOL:
+      return !*(const int*)v1 == !*(const int*)v2;
+    case CONFIG_TYPE_CSV: {
+      const smartlist_t *sl1 = *(const smartlist_t**)v1;
+      const smartlist_t *sl2 = *(const smartlist_t**)v2;
+      if (csv_len(sl1) != csv_len(sl2))
+        return 0;
+      for (i = 0; i < csv_len(sl1); ++i) {
+        if (strcmp(smartlist_get(sl1, i), smartlist_get(sl2, i)))
+          return 0;
+      }
+      return 1;
+    }
+    case CONFIG_TYPE_CSV_INTERVAL: {
+      const smartlist_t *sl1 = *(const smartlist_t**)v1;
+      const smartlist_t *sl2 = *(const smartlist_t**)v2;
+      if (csv_len(sl1) != csv_len(sl2))
+        return 0;
+      for (i = 0; i < csv_len(sl1); ++i) {
+        if (*(const int*)smartlist_get(sl1, i) !=
+            *(const int*)smartlist_get(sl2, i))
+          return 0;
+      }
+      return 1;
+    }
+    case CONFIG_TYPE_LINELIST:
+    case CONFIG_TYPE_LINELIST_V:
+      return config_lines_eq(*(config_line_t**)v1, *(config_line_t**)v2);
+    case CONFIG_TYPE_DOUBLE:
+    case CONFIG_TYPE_ROUTERSET:
+    case CONFIG_TYPE_LINELIST_S:
+    case CONFIG_TYPE_OBSOLETE:
+    default:
+      return -1;
+  }
+}
+
+/** Return true iff the option <b>var</b> has the same value in <b>o1</b>
  * and <b>o2</b>.  Must not be called for LINELIST_S or OBSOLETE options.
  */
 int
-config_is_same(const config_format_t *fmt,
-               const void *o1, const void *o2,
-               const char *name)
+config_var_is_same(const config_format_t *fmt,
+                   const void *o1, const void *o2,
+                   const config_var_t *var)
 {
   config_line_t *c1, *c2;
-  int r = 1;
+  int r;
   CONFIG_CHECK(fmt, o1);
   CONFIG_CHECK(fmt, o2);
 
-  c1 = config_get_assigned_option(fmt, o1, name, 0);
-  c2 = config_get_assigned_option(fmt, o2, name, 0);
+  r = config_var_values_eq(var, o1, o2);
+  if (r >= 0)
+    return r;
+
+  c1 = config_get_assigned_option(fmt, o1, var->name, 0);
+  c2 = config_get_assigned_option(fmt, o2, var->name, 0);
   r = config_lines_eq(c1, c2);
   config_free_lines(c1);
   config_free_lines(c2);
   return r;
 }
 
+/** Return true iff the option <b>name</b> has the same value in <b>o1</b>
+ * and <b>o2</b>.  Must not be called for LINELIST_S or OBSOLETE options.
+ */
+int
+config_is_same(const config_format_t *fmt,
+               const void *o1, const void *o2,
+               const char *name)
+{
+  const config_var_t *var = config_find_option(fmt, name);
+  if (!var) {
+    log_warn(LD_CONFIG, "Unknown option '%s'.  Failing.", name);
+    return 1;
+  }
+  return config_var_is_same(fmt, o1, o2, var);
+}
+
+/** Helper for config_dup(): copy the value of <b>var</b> from <b>old</b>
+ * into the newly allocated (all-zero) object <b>newopts</b>, giving the
+ * same result as formatting it and assigning it back (except that doubles
+ * keep their full precision).  Return 0 on success, or -1 if we can only
+ * copy values of this type through their string forms. */
+static int
+config_dup_var_value(const config_var_t *var, void *newopts,
+                     const void *old)
+{
+  const void *src = STRUCT_VAR_P(old, var->var_offset);
+  void *dst = STRUCT_VAR_P(newopts, var->var_offset);
+  const smartlist_t *sl;
+
+  switch (var->type) {
+    case CONFIG_TYPE_STRING:
+    case CONFIG_TYPE_FILENAME:
+      /* An empty string would be assigned back as "reset to NULL". */
+      if (*(const char**)src && **(const char**)src)
+        *(char**)dst = tor_strdup(*(const char**)src);
+      return 0;
+    case CONFIG_TYPE_ISOTIME:
+      *(time_t*)dst = *(const time_t*)src;
+      return 0;
+    case CONFIG_TYPE_PORT:
+    case CONFIG_TYPE_INTERVAL:
+    case CONFIG_TYPE_MSEC_INTERVAL:
+    case CONFIG_TYPE_UINT:
+    case CONFIG_TYPE_INT:
+      *(int*)dst = *(const int*)src;
+      return 0;
+    case CONFIG_TYPE_MEMUNIT:
+      *(uint64_t*)dst = *(const uint64_t*)src;
+      return 0;
+    case CONFIG_TYPE_DOUBLE:
+      *(double*)dst = *(const double*)src;
+      return 0;
+    case CONFIG_TYPE_AUTOBOOL:
+      if (*(const int*)src == -1) {
+        *(int*)dst = -1;
+        return 0;
+      }
+      /* fall through */
+    case CONFIG_TYPE_BOOL:
+      *(int*)dst = *(const int*)src ? 1 : 0;
+      return 0;
+    case CONFIG_TYPE_CSV:
+      sl = *(const smartlist_t**)src;
+      if (csv_len(sl)) {
+        smartlist_t *copy = smartlist_new();
+        SMARTLIST_FOREACH(sl, const char *, cp,
+                          smartlist_add(copy, tor_strdup(cp)));
+        *(smartlist_t**)dst = copy;
+      }
+      return 0;
+    case CONFIG_TYPE_CSV_INTERVAL:
+      sl = *(const smartlist_t**)src;
+      if (csv_len(sl)) {
+        smartlist_t *copy = smartlist_new();
+        SMARTLIST_FOREACH(sl, const int *, ip,
+                          smartlist_add(copy, tor_memdup(ip, sizeof(int))));
+        *(smartlist_t**)dst = copy;
+      }
+      return 0;
+    case CONFIG_TYPE_LINELIST:
+    case CONFIG_TYPE_LINELIST_V:
+      *(config_line_t**)dst = config_lines_dup(*(config_line_t**)src);
+      return 0;
+    case CONFIG_TYPE_ROUTERSET:
+    case CONFIG_TYPE_LINELIST_S:
+    case CONFIG_TYPE_OBSOLETE:
+    default:
+      return -1;
+  }
+}
+
 /** Copy storage held by <b>old</b> into a new or_options_t and return it. */
 void *
 config_dup(const config_format_t *fmt, const void *old)
@@ -1067,6 +1348,10 @@ config_dup(const config_format_t *fmt, const void *old)
       continue;
     if (fmt->vars[i].type == CONFIG_TYPE_OBSOLETE)
       continue;
+    /* Copy plain values directly: going through config_assign() means a
+     * linear search for the option by name, which made this quadratic. */
+    if (config_dup_var_value(&fmt->vars[i], newopts, old) == 0)
+      continue;
     line = config_get_assigned_option(fmt, old, fmt->vars[i].name, 0);
     if (line) {
       char *msg = NULL;
@@ -1138,10 +1423,10 @@ config_dump(const config_format_t *fmt, const void *default_options,
     /* Don't save 'hidden' control variables. */
     if (!strcmpstart(fmt->vars[i].name, "__"))
       continue;
-    if (minimal && config_is_same(fmt, options, defaults, fmt->vars[i].name))
+    if (minimal && config_var_is_same(fmt, options, defaults, &fmt->vars[i]))
       continue;
     else if (comment_defaults &&
-             config_is_same(fmt, options, defaults, fmt->vars[i].name))
+             config_var_is_same(fmt, options, defaults, &fmt->vars[i]))
       comment_option = 1;
 
     line = assigned =
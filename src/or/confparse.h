@@ -117,6 +117,9 @@ config_line_t *config_get_assigned_option(const config_format_t *fmt,
 int config_is_same(const config_format_t *fmt,
                    const void *o1, const void *o2,
                    const char *name);
+int config_var_is_same(const config_format_t *fmt,
+                       const void *o1, const void *o2,
+                       const config_var_t *var);
 void config_init(const config_format_t *fmt, void *options);
 void *config_dup(const config_format_t *fmt, const void *old);
 char *config_dump(const config_format_t *fmt, const void *default_options,
@@ -129,6 +132,7 @@ config_var_t *config_find_option_mutable(config_format_t *fmt,
                                          const char *key);
 const char *config_find_deprecation(const config_format_t *fmt,
                                      const char *key);
+void config_free_var_indexes(void);
 const config_var_t *config_find_option(const config_format_t *fmt,
                                        const char *key);
 
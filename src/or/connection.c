@@ -78,6 +78,7 @@
 #include "dirserv.h"
 #include "dns.h"
 #include "dnsserv.h"
+#include "dos.h"
 #include "entrynodes.h"
 #include "ext_orport.h"
 #include "geoip.h"
@@ -94,6 +95,7 @@
 #include "transports.h"
 #include "routerparse.h"
 #include "sandbox.h"
+#include "timers.h"
 #include "transports.h"
 
 #ifdef HAVE_PWD_H
@@ -117,6 +119,8 @@ static int connection_init_accepted_conn(connection_t *conn,
 static int connection_handle_listener_read(connection_t *conn, int new_type);
 static int connection_bucket_should_increase(int bucket,
                                              or_connection_t *conn);
+static void connection_bucket_unnote_blocked(connection_t *conn);
+static void connection_bucket_unnote_below_burst(or_connection_t *or_conn);
 static int connection_finished_flushing(connection_t *conn);
 static int connection_flushed_some(connection_t *conn);
 static int connection_finished_connecting(connection_t *conn);
@@ -144,6 +148,9 @@ static tor_addr_t *last_interface_ipv6 = NULL;
 /** A list of tor_addr_t for addresses we've used in outgoing connections.
  * Used to detect IP address changes. */
 static smartlist_t *outgoing_addrs = NULL;
+/** Every connection that hasn't been freed, by global_identifier, which is
+ * its handle in this table. */
+static slottable_t *connection_id_table = NULL;
 
 #define CASE_ANY_LISTENER_TYPE \
     case CONN_TYPE_OR_LISTENER: \
@@ -245,6 +252,8 @@ conn_state_to_string(int type, int state)
         case AP_CONN_STATE_CIRCUIT_WAIT: return "waiting for circuit";
         case AP_CONN_STATE_CONNECT_WAIT: return "waiting for connect response";
         case AP_CONN_STATE_RESOLVE_WAIT: return "waiting for resolve response";
+        case AP_CONN_STATE_DNS_CACHE_WAIT:
+          return "waiting for identical resolve";
         case AP_CONN_STATE_OPEN: return "open";
       }
       break;
@@ -412,8 +421,6 @@ connection_new(int type, int socket_family)
 static void
 connection_init(time_t now, connection_t *conn, int type, int socket_family)
 {
-  static uint64_t n_connections_allocated = 1;
-
   switch (type) {
     case CONN_TYPE_OR:
     case CONN_TYPE_EXT_OR:
@@ -441,7 +448,10 @@ connection_init(time_t now, connection_t *conn, int type, int socket_family)
 
   conn->s = TOR_INVALID_SOCKET; /* give it a default of 'not used' */
   conn->conn_array_index = -1; /* also default to 'not used' */
-  conn->global_identifier = n_connections_allocated++;
+  conn->conn_type_index = -1;
+  if (!connection_id_table)
+    connection_id_table = slottable_new();
+  conn->global_identifier = slottable_add(connection_id_table, conn);
 
   conn->type = type;
   conn->socket_family = socket_family;
@@ -485,6 +495,41 @@ conn_listener_type_supports_af_unix(int type)
   }
 }
 
+/** Return the size of the structure we allocate for a connection of type
+ * <b>type</b>. */
+static size_t
+connection_get_struct_size(int type)
+{
+  switch (type) {
+    case CONN_TYPE_OR:
+    case CONN_TYPE_EXT_OR:
+      return sizeof(or_connection_t);
+    case CONN_TYPE_AP:
+      return sizeof(entry_connection_t);
+    case CONN_TYPE_EXIT:
+      return sizeof(edge_connection_t);
+    case CONN_TYPE_DIR:
+      return sizeof(dir_connection_t);
+    case CONN_TYPE_CONTROL:
+      return sizeof(control_connection_t);
+    CASE_ANY_LISTENER_TYPE:
+      return sizeof(listener_connection_t);
+    default:
+      return sizeof(connection_t);
+  }
+}
+
+/** Return the approximate number of bytes held by our connection
+ * structures, not counting their buffers. */
+size_t
+connection_get_total_allocation(void)
+{
+  size_t total = 0;
+  SMARTLIST_FOREACH(get_connection_array(), const connection_t *, conn,
+                    total += connection_get_struct_size(conn->type));
+  return total;
+}
+
 /** Deallocate memory used by <b>conn</b>. Deallocate its buffers if
  * necessary, close its socket if necessary, and mark the directory as dirty
  * if <b>conn</b> is an OR or OP connection.
@@ -497,6 +542,20 @@ connection_free_(connection_t *conn)
   if (!conn)
     return;
 
+  if (connection_id_table &&
+      slottable_get(connection_id_table, conn->global_identifier) == conn)
+    slottable_remove(connection_id_table, conn->global_identifier);
+  connection_bucket_unnote_blocked(conn);
+  if (conn->type == CONN_TYPE_OR || conn->type == CONN_TYPE_EXT_OR)
+    connection_bucket_unnote_below_burst(TO_OR_CONN(conn));
+  if (conn->type == CONN_TYPE_OR && TO_OR_CONN(conn)->counted_for_dos) {
+    /* addr may have been replaced by a descriptor address; real_addr has
+     * the one we counted, once it's set. */
+    const or_connection_t *or_conn = TO_OR_CONN(conn);
+    dos_conn_note_closed(tor_addr_is_null(&or_conn->real_addr) ?
+                         &conn->addr : &or_conn->real_addr);
+  }
+
   switch (conn->type) {
     case CONN_TYPE_OR:
     case CONN_TYPE_EXT_OR:
@@ -590,6 +649,7 @@ connection_free_(connection_t *conn)
     entry_connection_t *entry_conn = TO_ENTRY_CONN(conn);
     tor_free(entry_conn->chosen_exit_name);
     tor_free(entry_conn->original_dest_address);
+    tor_free(entry_conn->dns_cache_key);
     if (entry_conn->socks_request)
       socks_request_free(entry_conn->socks_request);
     if (entry_conn->pending_optimistic_data) {
@@ -615,6 +675,9 @@ connection_free_(connection_t *conn)
     }
   }
 
+  timer_free(conn->housekeeping_timer);
+  conn->housekeeping_timer = NULL;
+
   /* Probably already freed by connection_free. */
   tor_event_free(conn->read_event);
   tor_event_free(conn->write_event);
@@ -632,6 +695,7 @@ connection_free_(connection_t *conn)
 
     cached_dir_decref(dir_conn->cached_dir);
     rend_data_free(dir_conn->rend_data);
+    dir_stream_free(dir_conn->stream);
   }
 
   if (SOCKET_OK(conn->s)) {
@@ -834,44 +898,38 @@ connection_mark_for_close_internal_, (connection_t *conn,
    * the number of seconds since last successful write, so
    * we get our whole 15 seconds */
   conn->timestamp_lastwritten = time(NULL);
+  connection_schedule_housekeeping(conn);
 }
 
-/** Find each connection that has hold_open_until_flushed set to
- * 1 but hasn't written in the past 15 seconds, and set
- * hold_open_until_flushed to 0. This means it will get cleaned
- * up in the next loop through close_if_marked() in main.c.
+/** If <b>conn</b> has hold_open_until_flushed set to 1 but hasn't written
+ * in the past CONN_HOLD_OPEN_TIMEOUT seconds, set hold_open_until_flushed
+ * to 0. This means it will get cleaned up in the next loop through
+ * close_if_marked() in main.c.  Called from conn's housekeeping timer.
  */
 void
-connection_expire_held_open(void)
+connection_expire_held_open(connection_t *conn, time_t now)
 {
-  time_t now;
-  smartlist_t *conns = get_connection_array();
-
-  now = time(NULL);
-
-  SMARTLIST_FOREACH_BEGIN(conns, connection_t *, conn) {
-    /* If we've been holding the connection open, but we haven't written
-     * for 15 seconds...
-     */
-    if (conn->hold_open_until_flushed) {
-      tor_assert(conn->marked_for_close);
-      if (now - conn->timestamp_lastwritten >= 15) {
-        int severity;
-        if (conn->type == CONN_TYPE_EXIT ||
-            (conn->type == CONN_TYPE_DIR &&
-             conn->purpose == DIR_PURPOSE_SERVER))
-          severity = LOG_INFO;
-        else
-          severity = LOG_NOTICE;
-        log_fn(severity, LD_NET,
-               "Giving up on marked_for_close conn that's been flushing "
-               "for 15s (fd %d, type %s, state %s).",
-               (int)conn->s, conn_type_to_string(conn->type),
-               conn_state_to_string(conn->type, conn->state));
-        conn->hold_open_until_flushed = 0;
-      }
+  /* If we've been holding the connection open, but we haven't written
+   * for 15 seconds...
+   */
+  if (conn->hold_open_until_flushed) {
+    tor_assert(conn->marked_for_close);
+    if (now - conn->timestamp_lastwritten >= CONN_HOLD_OPEN_TIMEOUT) {
+      int severity;
+      if (conn->type == CONN_TYPE_EXIT ||
+          (conn->type == CONN_TYPE_DIR &&
+           conn->purpose == DIR_PURPOSE_SERVER))
+        severity = LOG_INFO;
+      else
+        severity = LOG_NOTICE;
+      log_fn(severity, LD_NET,
+             "Giving up on marked_for_close conn that's been flushing "
+             "for 15s (fd %d, type %s, state %s).",
+             (int)conn->s, conn_type_to_string(conn->type),
+             conn_state_to_string(conn->type, conn->state));
+      conn->hold_open_until_flushed = 0;
     }
-  } SMARTLIST_FOREACH_END(conn);
+  }
 }
 
 #if defined(HAVE_SYS_UN_H) || defined(RUNNING_DOXYGEN)
@@ -1498,6 +1556,7 @@ connection_handle_listener_read(connection_t *conn, int new_type)
   /* length of the remote address. Must be whatever accept() needs. */
   socklen_t remotelen = (socklen_t)sizeof(addrbuf);
   const or_options_t *options = get_options();
+  int dos_counted = 1;
 
   tor_assert((size_t)remotelen >= sizeof(struct sockaddr_in));
   memset(&addrbuf, 0, sizeof(addrbuf));
@@ -1588,9 +1647,21 @@ connection_handle_listener_read(connection_t *conn, int new_type)
         return 0;
       }
     }
+    if (new_type == CONN_TYPE_OR) {
+      /* refuse it before the TLS handshake if its address has too many */
+      dos_counted = dos_conn_note_new(&addr);
+      if (dos_counted < 0) {
+        log_info(LD_OR, "Refusing OR connection from %s: it has too many "
+                 "open already.", fmt_and_decorate_addr(&addr));
+        tor_close_socket(news);
+        return 0;
+      }
+    }
 
     newconn = connection_new(new_type, conn->socket_family);
     newconn->s = news;
+    if (new_type == CONN_TYPE_OR && dos_counted == 0)
+      TO_OR_CONN(newconn)->counted_for_dos = 1;
 
     /* remember the remote address */
     tor_addr_copy(&newconn->addr, &addr);
@@ -1700,26 +1771,24 @@ connection_init_accepted_conn(connection_t *conn,
   return 0;
 }
 
-/** Take conn, make a nonblocking socket; try to connect to
- * sa, binding to bindaddr if sa is not localhost. If fail, return -1 and if
- * applicable put your best guess about errno into *<b>socket_error</b>.
- * If connected return 1, if EAGAIN return 0.
+/** Make a nonblocking socket and start connecting it to sa, binding to
+ * bindaddr if it is set.  If fail, return TOR_INVALID_SOCKET and put your
+ * best guess about errno into *<b>socket_error</b>.  Otherwise return the
+ * socket, and set *<b>inprogress</b> to 1 if the connect is still in
+ * progress or 0 if it has already completed.
  */
-MOCK_IMPL(STATIC int,
-connection_connect_sockaddr,(connection_t *conn,
-                            const struct sockaddr *sa,
-                            socklen_t sa_len,
-                            const struct sockaddr *bindaddr,
-                            socklen_t bindaddr_len,
-                            int *socket_error))
+static tor_socket_t
+connection_open_connecting_socket(const struct sockaddr *sa,
+                                  socklen_t sa_len,
+                                  const struct sockaddr *bindaddr,
+                                  socklen_t bindaddr_len,
+                                  int *inprogress,
+                                  int *socket_error)
 {
   tor_socket_t s;
-  int inprogress = 0;
   const or_options_t *options = get_options();
 
-  tor_assert(conn);
-  tor_assert(sa);
-  tor_assert(socket_error);
+  *inprogress = 0;
 
   if (get_options()->DisableNetwork) {
     /* We should never even try to connect anyplace if DisableNetwork is set.
@@ -1729,7 +1798,7 @@ connection_connect_sockaddr,(connection_t *conn,
     log_fn_ratelim(&disablenet_violated, LOG_WARN, LD_BUG,
                    "Tried to open a socket with DisableNetwork set.");
     tor_fragile_assert();
-    return -1;
+    return TOR_INVALID_SOCKET;
   }
 
   const int protocol_family = sa->sa_family;
@@ -1751,7 +1820,7 @@ connection_connect_sockaddr,(connection_t *conn,
                tor_socket_strerror(*socket_error));
       connection_check_oos(get_n_open_sockets(), 0);
     }
-    return -1;
+    return TOR_INVALID_SOCKET;
   }
 
   if (make_socket_reuseable(s) < 0) {
@@ -1771,7 +1840,7 @@ connection_connect_sockaddr,(connection_t *conn,
     log_warn(LD_NET,"Error binding network socket: %s",
              tor_socket_strerror(*socket_error));
     tor_close_socket(s);
-    return -1;
+    return TOR_INVALID_SOCKET;
   }
 
   tor_assert(options);
@@ -1787,12 +1856,40 @@ connection_connect_sockaddr,(connection_t *conn,
                "connect() to socket failed: %s",
                tor_socket_strerror(e));
       tor_close_socket(s);
-      return -1;
+      return TOR_INVALID_SOCKET;
     } else {
-      inprogress = 1;
+      *inprogress = 1;
     }
   }
 
+  return s;
+}
+
+/** Take conn, make a nonblocking socket; try to connect to
+ * sa, binding to bindaddr if sa is not localhost. If fail, return -1 and if
+ * applicable put your best guess about errno into *<b>socket_error</b>.
+ * If connected return 1, if EAGAIN return 0.
+ */
+MOCK_IMPL(STATIC int,
+connection_connect_sockaddr,(connection_t *conn,
+                            const struct sockaddr *sa,
+                            socklen_t sa_len,
+                            const struct sockaddr *bindaddr,
+                            socklen_t bindaddr_len,
+                            int *socket_error))
+{
+  tor_socket_t s;
+  int inprogress = 0;
+
+  tor_assert(conn);
+  tor_assert(sa);
+  tor_assert(socket_error);
+
+  s = connection_open_connecting_socket(sa, sa_len, bindaddr, bindaddr_len,
+                                        &inprogress, socket_error);
+  if (! SOCKET_OK(s))
+    return -1;
+
   /* it succeeded. we're connected. */
   log_fn(inprogress ? LOG_DEBUG : LOG_INFO, LD_NET,
          "Connection to socket %s (sock "TOR_SOCKET_T_FORMAT").",
@@ -1880,6 +1977,40 @@ connection_connect_log_client_use_ip_version(const connection_t *conn)
   }
 }
 
+/** If we are configured with an outbound bind address for connections to
+ * <b>addr</b>, and <b>addr</b> is not a loopback address, write that bind
+ * address into <b>ss</b> and return its length.  Otherwise return 0. */
+static int
+connection_get_outbound_bind_sockaddr(const tor_addr_t *addr,
+                                      struct sockaddr_storage *ss)
+{
+  const or_options_t *options = get_options();
+  const tor_addr_t *ext_addr = NULL;
+  int len;
+
+  if (tor_addr_is_loopback(addr))
+    return 0;
+
+  if (tor_addr_family(addr) != AF_INET6 &&
+      !tor_addr_is_null(&options->OutboundBindAddressIPv4_))
+    ext_addr = &options->OutboundBindAddressIPv4_;
+  else if (tor_addr_family(addr) == AF_INET6 &&
+           !tor_addr_is_null(&options->OutboundBindAddressIPv6_))
+    ext_addr = &options->OutboundBindAddressIPv6_;
+  if (!ext_addr)
+    return 0;
+
+  memset(ss, 0, sizeof(*ss));
+  len = tor_addr_to_sockaddr(ext_addr, 0, (struct sockaddr *) ss,
+                             sizeof(*ss));
+  if (len == 0) {
+    log_warn(LD_NET,
+             "Error converting OutboundBindAddress %s into sockaddr. "
+             "Ignoring.", fmt_and_decorate_addr(ext_addr));
+  }
+  return len;
+}
+
 /** Take conn, make a nonblocking socket; try to connect to
  * addr:port (port arrives in *host order*). If fail, return -1 and if
  * applicable put your best guess about errno into *<b>socket_error</b>.
@@ -1901,40 +2032,14 @@ connection_connect(connection_t *conn, const char *address,
   struct sockaddr *bind_addr = NULL;
   struct sockaddr *dest_addr;
   int dest_addr_len, bind_addr_len = 0;
-  const or_options_t *options = get_options();
-  int protocol_family;
 
   /* Log if we didn't stick to ClientUseIPv4/6 or ClientPreferIPv6OR/DirPort
    */
   connection_connect_log_client_use_ip_version(conn);
 
-  if (tor_addr_family(addr) == AF_INET6)
-    protocol_family = PF_INET6;
-  else
-    protocol_family = PF_INET;
-
-  if (!tor_addr_is_loopback(addr)) {
-    const tor_addr_t *ext_addr = NULL;
-    if (protocol_family == AF_INET &&
-        !tor_addr_is_null(&options->OutboundBindAddressIPv4_))
-      ext_addr = &options->OutboundBindAddressIPv4_;
-    else if (protocol_family == AF_INET6 &&
-             !tor_addr_is_null(&options->OutboundBindAddressIPv6_))
-      ext_addr = &options->OutboundBindAddressIPv6_;
-    if (ext_addr) {
-      memset(&bind_addr_ss, 0, sizeof(bind_addr_ss));
-      bind_addr_len = tor_addr_to_sockaddr(ext_addr, 0,
-                                           (struct sockaddr *) &bind_addr_ss,
-                                           sizeof(bind_addr_ss));
-      if (bind_addr_len == 0) {
-        log_warn(LD_NET,
-                 "Error converting OutboundBindAddress %s into sockaddr. "
-                 "Ignoring.", fmt_and_decorate_addr(ext_addr));
-      } else {
-        bind_addr = (struct sockaddr *)&bind_addr_ss;
-      }
-    }
-  }
+  bind_addr_len = connection_get_outbound_bind_sockaddr(addr, &bind_addr_ss);
+  if (bind_addr_len)
+    bind_addr = (struct sockaddr *)&bind_addr_ss;
 
   memset(&addrbuf,0,sizeof(addrbuf));
   dest_addr = (struct sockaddr*) &addrbuf;
@@ -1948,6 +2053,56 @@ connection_connect(connection_t *conn, const char *address,
                                      bind_addr, bind_addr_len, socket_error);
 }
 
+/** Open a nonblocking socket and start connecting it to addr:port (port in
+ * host order), binding to our outbound address the way connection_connect()
+ * would, but without attaching it to any connection.  The caller owns the
+ * socket, and can later hand it to a connection with
+ * connection_adopt_socket().  On failure, return TOR_INVALID_SOCKET and put
+ * our best guess about errno into *<b>socket_error</b>.
+ */
+MOCK_IMPL(tor_socket_t,
+connection_preconnect,(const tor_addr_t *addr, uint16_t port,
+                       int *socket_error))
+{
+  struct sockaddr_storage addrbuf;
+  struct sockaddr_storage bind_addr_ss;
+  int dest_addr_len, bind_addr_len;
+  int inprogress;
+
+  memset(&addrbuf,0,sizeof(addrbuf));
+  dest_addr_len = tor_addr_to_sockaddr(addr, port,
+                                       (struct sockaddr *) &addrbuf,
+                                       sizeof(addrbuf));
+  tor_assert(dest_addr_len > 0);
+  bind_addr_len = connection_get_outbound_bind_sockaddr(addr, &bind_addr_ss);
+
+  log_debug(LD_NET, "Preconnecting to %s.", fmt_addrport(addr, port));
+
+  return connection_open_connecting_socket((struct sockaddr *) &addrbuf,
+                            dest_addr_len,
+                            bind_addr_len ?
+                              (struct sockaddr *) &bind_addr_ss : NULL,
+                            bind_addr_len, &inprogress, socket_error);
+}
+
+/** Give <b>conn</b> the socket <b>s</b>, which we opened earlier with
+ * connection_preconnect(), and add it to the list of polled connections
+ * as a connecting socket.  Return 0 on success, or -1 if there was no room
+ * for it; in that case the caller still owns <b>s</b>. */
+int
+connection_adopt_socket(connection_t *conn, tor_socket_t s)
+{
+  tor_assert(conn);
+  tor_assert(!SOCKET_OK(conn->s));
+
+  conn->s = s;
+  if (connection_add_connecting(conn) < 0) {
+    conn->s = TOR_INVALID_SOCKET;
+    return -1;
+  }
+  return 0;
+}
+
 #ifdef HAVE_SYS_UN_H
 
 /** Take conn, make a nonblocking socket; try to connect to
@@ -2735,6 +2890,16 @@ connection_is_rate_limited(connection_t *conn)
     return 1;
 }
 
+/** List of connections with read_blocked_on_bw or write_blocked_on_bw set,
+ * so that a refill only has to look at connections that are waiting for
+ * tokens.  Connections may stay on the list for a while after they are
+ * woken up; connection_bucket_refill() drops them. */
+static smartlist_t *bw_blocked_conns = NULL;
+/** List of open OR connections whose own token buckets are below their
+ * burst.  Full buckets don't need refilling, and most connections are idle
+ * most of the time. */
+static smartlist_t *or_conns_to_refill = NULL;
+
 /** Did either global write bucket run dry last second? If so,
  * we are likely to run dry again this second, so be stingy with the
  * tokens we just put in. */
@@ -2760,6 +2925,73 @@ connection_counts_as_relayed_traffic(connection_t *conn, time_t now)
   return 0;
 }
 
+/** While BandwidthFairShare is set and our read buckets have run dry
+ * recently, the most bytes that one client connection may read in each
+ * refill interval; 0 otherwise. */
+static int fair_read_share = 0;
+/** How many more milliseconds fair_read_share stays in force, unless the
+ * read buckets run dry again. */
+static int fair_share_msec_left = 0;
+/** Counts refill intervals, so that a connection can tell whether its
+ * fair_read_used is from the current one. */
+static uint32_t fair_share_epoch = 1;
+/** How many client connections have read in the current refill
+ * interval? */
+static int n_fair_share_readers = 0;
+
+/** Once the read buckets run dry, how long do we keep limiting each client
+ * connection to its fair share? */
+#define FAIR_SHARE_HOLD_MSEC 1000
+
+/** Return true iff <b>conn</b> is an open OR connection from a client or
+ * bridge, and we're keeping track of how much it reads. */
+static int
+connection_wants_fair_share(connection_t *conn)
+{
+  return get_options()->BandwidthFairShare &&
+    conn->type == CONN_TYPE_OR &&
+    conn->state == OR_CONN_STATE_OPEN &&
+    !TO_OR_CONN(conn)->is_known_relay;
+}
+
+/** Note that the client connection <b>or_conn</b> has read <b>n</b>
+ * bytes. */
+STATIC void
+connection_fair_share_note_read(or_connection_t *or_conn, size_t n)
+{
+  if (or_conn->fair_share_epoch != fair_share_epoch) {
+    or_conn->fair_share_epoch = fair_share_epoch;
+    or_conn->fair_read_used = 0;
+    ++n_fair_share_readers;
+  }
+  if (n > (size_t)(INT_MAX - or_conn->fair_read_used))
+    or_conn->fair_read_used = INT_MAX;
+  else
+    or_conn->fair_read_used += (int)n;
+}
+
+/** Return how many more bytes the client connection <b>or_conn</b> may
+ * read in this refill interval, or -1 if it has no fair share limit. */
+STATIC int
+connection_fair_share_read_left(const or_connection_t *or_conn)
+{
+  if (!fair_read_share)
+    return -1;
+  if (or_conn->fair_share_epoch != fair_share_epoch)
+    return fair_read_share;
+  return MAX(fair_read_share - or_conn->fair_read_used, 0);
+}
+
+/** Return the fair share of <b>available</b> bytes for each of
+ * <b>n_readers</b> client connections.  Never go below one cell, so that
+ * every connection can make progress. */
+STATIC int
+connection_bucket_fair_share(int available, int n_readers)
+{
+  int share = available / MAX(n_readers, 1);
+  return MAX(share, CELL_MAX_NETWORK_SIZE);
+}
+
 /** Helper function to decide how many bytes out of <b>global_bucket</b>
  * we're willing to use for this transaction. <b>base</b> is the size
  * of a cell on the network; <b>priority</b> says whether we should
@@ -2808,6 +3040,11 @@ connection_bucket_read_limit(connection_t *conn, time_t now)
     if (conn->state == OR_CONN_STATE_OPEN)
       conn_bucket = or_conn->read_bucket;
     base = get_cell_network_size(or_conn->wide_circ_ids);
+    if (fair_read_share && connection_wants_fair_share(conn)) {
+      int fair_left = connection_fair_share_read_left(or_conn);
+      if (fair_left >= 0 && (conn_bucket < 0 || fair_left < conn_bucket))
+        conn_bucket = fair_left;
+    }
   }
 
   if (!connection_is_rate_limited(conn)) {
@@ -2906,6 +3143,28 @@ global_write_bucket_low(connection_t *conn, size_t attempt, int priority)
   return 0;
 }
 
+/** Bytes read and written on rate-limited connections during the second
+ * <b>pending_bandwidth_when</b> that we haven't told rephist about yet.  We
+ * batch these so that a busy relay makes one call per second into the
+ * bandwidth history rather than one call per read or write. */
+static uint64_t pending_bandwidth_read = 0;
+static uint64_t pending_bandwidth_written = 0;
+static time_t pending_bandwidth_when = 0;
+
+/** Give rephist all the bytes we've read and written since we last
+ * called this function. */
+void
+connection_flush_bandwidth_history(void)
+{
+  if (pending_bandwidth_read)
+    rep_hist_note_bytes_read((size_t)pending_bandwidth_read,
+                             pending_bandwidth_when);
+  if (pending_bandwidth_written)
+    rep_hist_note_bytes_written((size_t)pending_bandwidth_written,
+                                pending_bandwidth_when);
+  pending_bandwidth_read = pending_bandwidth_written = 0;
+}
+
 /** Helper: adjusts our bandwidth history and informs the controller as
  * appropriate, given that we have just read <b>num_read</b> bytes and written
  * <b>num_written</b> bytes on <b>conn</b>. */
@@ -2928,12 +3187,12 @@ record_num_bytes_transferred_impl(connection_t *conn,
     rep_hist_note_or_conn_bytes(conn->global_identifier, num_read,
                                 num_written, now);
 
-  if (num_read > 0) {
-    rep_hist_note_bytes_read(num_read, now);
-  }
-  if (num_written > 0) {
-    rep_hist_note_bytes_written(num_written, now);
+  if (now != pending_bandwidth_when) {
+    connection_flush_bandwidth_history();
+    pending_bandwidth_when = now;
   }
+  pending_bandwidth_read += num_read;
+  pending_bandwidth_written += num_written;
   if (conn->type == CONN_TYPE_EXIT)
     rep_hist_note_exit_bytes(conn->port, num_written, num_read);
 }
@@ -3041,9 +3300,13 @@ connection_buckets_decrement(connection_t *conn, time_t now,
   }
   global_read_bucket -= (int)num_read;
   global_write_bucket -= (int)num_written;
+  if (num_read && connection_wants_fair_share(conn))
+    connection_fair_share_note_read(TO_OR_CONN(conn), num_read);
   if (connection_speaks_cells(conn) && conn->state == OR_CONN_STATE_OPEN) {
     TO_OR_CONN(conn)->read_bucket -= (int)num_read;
     TO_OR_CONN(conn)->write_bucket -= (int)num_written;
+    if (num_read || num_written)
+      connection_bucket_note_below_burst(TO_OR_CONN(conn));
   }
 }
 
@@ -3066,11 +3329,15 @@ connection_consider_empty_read_buckets(connection_t *conn)
              conn->state == OR_CONN_STATE_OPEN &&
              TO_OR_CONN(conn)->read_bucket <= 0) {
     reason = "connection read bucket exhausted. Pausing.";
+  } else if (fair_read_share && connection_wants_fair_share(conn) &&
+             connection_fair_share_read_left(TO_OR_CONN(conn)) == 0) {
+    reason = "connection fair share exhausted. Pausing.";
   } else
     return; /* all good, no need to stop it */
 
   LOG_FN_CONN(conn, (LOG_DEBUG, LD_NET, "%s", reason));
   conn->read_blocked_on_bw = 1;
+  connection_bucket_note_blocked(conn);
   connection_stop_reading(conn);
 }
 
@@ -3098,9 +3365,72 @@ connection_consider_empty_write_buckets(connection_t *conn)
 
   LOG_FN_CONN(conn, (LOG_DEBUG, LD_NET, "%s", reason));
   conn->write_blocked_on_bw = 1;
+  connection_bucket_note_blocked(conn);
   connection_stop_writing(conn);
 }
 
+/** Note that <b>conn</b> has just set read_blocked_on_bw or
+ * write_blocked_on_bw, so that the next refill will consider waking it. */
+void
+connection_bucket_note_blocked(connection_t *conn)
+{
+  if (conn->on_bw_blocked_list)
+    return;
+  if (!bw_blocked_conns)
+    bw_blocked_conns = smartlist_new();
+  conn->bw_blocked_idx = smartlist_len(bw_blocked_conns);
+  conn->on_bw_blocked_list = 1;
+  smartlist_add(bw_blocked_conns, conn);
+}
+
+/** Take <b>conn</b> off the list of connections blocked on bandwidth, if
+ * it is there. */
+static void
+connection_bucket_unnote_blocked(connection_t *conn)
+{
+  int idx = conn->bw_blocked_idx;
+  if (!conn->on_bw_blocked_list)
+    return;
+  tor_assert(smartlist_get(bw_blocked_conns, idx) == conn);
+  smartlist_del(bw_blocked_conns, idx);
+  if (idx < smartlist_len(bw_blocked_conns)) {
+    connection_t *moved = smartlist_get(bw_blocked_conns, idx);
+    moved->bw_blocked_idx = idx;
+  }
+  conn->on_bw_blocked_list = 0;
+}
+
+/** Note that one of <b>or_conn</b>'s token buckets may be below its burst,
+ * so that connection_bucket_refill() tops it up. */
+void
+connection_bucket_note_below_burst(or_connection_t *or_conn)
+{
+  if (or_conn->on_refill_list)
+    return;
+  if (!or_conns_to_refill)
+    or_conns_to_refill = smartlist_new();
+  or_conn->refill_idx = smartlist_len(or_conns_to_refill);
+  or_conn->on_refill_list = 1;
+  smartlist_add(or_conns_to_refill, or_conn);
+}
+
+/** Take <b>or_conn</b> off the list of OR connections to refill, if it is
+ * there. */
+static void
+connection_bucket_unnote_below_burst(or_connection_t *or_conn)
+{
+  int idx = or_conn->refill_idx;
+  if (!or_conn->on_refill_list)
+    return;
+  tor_assert(smartlist_get(or_conns_to_refill, idx) == or_conn);
+  smartlist_del(or_conns_to_refill, idx);
+  if (idx < smartlist_len(or_conns_to_refill)) {
+    or_connection_t *moved = smartlist_get(or_conns_to_refill, idx);
+    moved->refill_idx = idx;
+  }
+  or_conn->on_refill_list = 0;
+}
+
 /** Initialize the global read bucket to options-\>BandwidthBurst. */
 void
 connection_bucket_init(void)
@@ -3152,8 +3482,8 @@ void
 connection_bucket_refill(int milliseconds_elapsed, time_t now)
 {
   const or_options_t *options = get_options();
-  smartlist_t *conns = get_connection_array();
   int bandwidthrate, bandwidthburst, relayrate, relayburst;
+  int i;
 
   int prev_global_read = global_read_bucket;
   int prev_global_write = global_write_bucket;
@@ -3195,6 +3525,24 @@ connection_bucket_refill(int milliseconds_elapsed, time_t now)
                                   milliseconds_elapsed,
                                   "global_relayed_write_bucket");
 
+  /* If our read buckets ran dry, share what we can read in the next
+   * intervals equally among the client connections that were reading. */
+  if (options->BandwidthFairShare &&
+      (prev_global_read <= 0 || prev_relay_read <= 0)) {
+    fair_share_msec_left = FAIR_SHARE_HOLD_MSEC;
+  } else {
+    fair_share_msec_left -= milliseconds_elapsed;
+  }
+  if (options->BandwidthFairShare && fair_share_msec_left > 0) {
+    fair_read_share = connection_bucket_fair_share(
+                  MIN(global_read_bucket, global_relayed_read_bucket),
+                  n_fair_share_readers);
+  } else {
+    fair_read_share = fair_share_msec_left = 0;
+  }
+  ++fair_share_epoch;
+  n_fair_share_readers = 0;
+
   /* If buckets were empty before and have now been refilled, tell any
    * interested controllers. */
   if (get_options()->TestingEnableTbEmptyEvent) {
@@ -3221,53 +3569,65 @@ connection_bucket_refill(int milliseconds_elapsed, time_t now)
                            relay_write_empty_time, milliseconds_elapsed);
   }
 
-  /* refill the per-connection buckets */
-  SMARTLIST_FOREACH_BEGIN(conns, connection_t *, conn) {
-    if (connection_speaks_cells(conn)) {
-      or_connection_t *or_conn = TO_OR_CONN(conn);
-      int orbandwidthrate = or_conn->bandwidthrate;
-      int orbandwidthburst = or_conn->bandwidthburst;
-
-      int prev_conn_read = or_conn->read_bucket;
-      int prev_conn_write = or_conn->write_bucket;
-
-      if (connection_bucket_should_increase(or_conn->read_bucket, or_conn)) {
-        connection_bucket_refill_helper(&or_conn->read_bucket,
-                                        orbandwidthrate,
-                                        orbandwidthburst,
-                                        milliseconds_elapsed,
-                                        "or_conn->read_bucket");
-      }
-      if (connection_bucket_should_increase(or_conn->write_bucket, or_conn)) {
-        connection_bucket_refill_helper(&or_conn->write_bucket,
-                                        orbandwidthrate,
-                                        orbandwidthburst,
-                                        milliseconds_elapsed,
-                                        "or_conn->write_bucket");
-      }
+  /* refill the per-connection buckets that have been drawn down */
+  for (i = 0; or_conns_to_refill && i < smartlist_len(or_conns_to_refill); ) {
+    or_connection_t *or_conn = smartlist_get(or_conns_to_refill, i);
+    int orbandwidthrate = or_conn->bandwidthrate;
+    int orbandwidthburst = or_conn->bandwidthburst;
 
-      /* If buckets were empty before and have now been refilled, tell any
-       * interested controllers. */
-      if (get_options()->TestingEnableTbEmptyEvent) {
-        char *bucket;
-        uint32_t conn_read_empty_time, conn_write_empty_time;
-        tor_asprintf(&bucket, "ORCONN ID="U64_FORMAT,
-                     U64_PRINTF_ARG(or_conn->base_.global_identifier));
-        conn_read_empty_time = bucket_millis_empty(prev_conn_read,
-                               or_conn->read_emptied_time,
-                               or_conn->read_bucket,
-                               milliseconds_elapsed, &tvnow);
-        conn_write_empty_time = bucket_millis_empty(prev_conn_write,
-                                or_conn->write_emptied_time,
-                                or_conn->write_bucket,
-                                milliseconds_elapsed, &tvnow);
-        control_event_tb_empty(bucket, conn_read_empty_time,
-                               conn_write_empty_time,
-                               milliseconds_elapsed);
-        tor_free(bucket);
-      }
+    int prev_conn_read = or_conn->read_bucket;
+    int prev_conn_write = or_conn->write_bucket;
+
+    if (connection_bucket_should_increase(or_conn->read_bucket, or_conn)) {
+      connection_bucket_refill_helper(&or_conn->read_bucket,
+                                      orbandwidthrate,
+                                      orbandwidthburst,
+                                      milliseconds_elapsed,
+                                      "or_conn->read_bucket");
+    }
+    if (connection_bucket_should_increase(or_conn->write_bucket, or_conn)) {
+      connection_bucket_refill_helper(&or_conn->write_bucket,
+                                      orbandwidthrate,
+                                      orbandwidthburst,
+                                      milliseconds_elapsed,
+                                      "or_conn->write_bucket");
     }
 
+    /* If buckets were empty before and have now been refilled, tell any
+     * interested controllers. */
+    if (get_options()->TestingEnableTbEmptyEvent) {
+      char *bucket;
+      uint32_t conn_read_empty_time, conn_write_empty_time;
+      tor_asprintf(&bucket, "ORCONN ID="U64_FORMAT,
+                   U64_PRINTF_ARG(or_conn->base_.global_identifier));
+      conn_read_empty_time = bucket_millis_empty(prev_conn_read,
+                             or_conn->read_emptied_time,
+                             or_conn->read_bucket,
+                             milliseconds_elapsed, &tvnow);
+      conn_write_empty_time = bucket_millis_empty(prev_conn_write,
+                              or_conn->write_emptied_time,
+                              or_conn->write_bucket,
+                              milliseconds_elapsed, &tvnow);
+      control_event_tb_empty(bucket, conn_read_empty_time,
+                             conn_write_empty_time,
+                             milliseconds_elapsed);
+      tor_free(bucket);
+    }
+
+    /* Once both buckets are full (or the connection isn't open any more),
+     * we can forget about it until it spends some tokens.  Removing it
+     * moves the last list member into slot i. */
+    if (!connection_bucket_should_increase(or_conn->read_bucket, or_conn) &&
+        !connection_bucket_should_increase(or_conn->write_bucket, or_conn))
+      connection_bucket_unnote_below_burst(or_conn);
+    else
+      ++i;
+  }
+
+  /* wake up the connections that are waiting on the buckets */
+  for (i = 0; bw_blocked_conns && i < smartlist_len(bw_blocked_conns); ) {
+    connection_t *conn = smartlist_get(bw_blocked_conns, i);
+
     if (conn->read_blocked_on_bw == 1 /* marked to turn reading back on now */
         && global_read_bucket > 0 /* and we're allowed to read */
         && (!connection_counts_as_relayed_traffic(conn, now) ||
@@ -3294,7 +3654,12 @@ connection_bucket_refill(int milliseconds_elapsed, time_t now)
       conn->write_blocked_on_bw = 0;
       connection_start_writing(conn);
     }
-  } SMARTLIST_FOREACH_END(conn);
+
+    if (!conn->read_blocked_on_bw && !conn->write_blocked_on_bw)
+      connection_bucket_unnote_blocked(conn);
+    else
+      ++i;
+  }
 }
 
 /** Is the <b>bucket</b> for connection <b>conn</b> low enough that we
@@ -3439,6 +3804,7 @@ connection_handle_read(connection_t *conn)
   int res;
 
   tor_gettimeofday_cache_clear();
+  monotime_coarse_cache_clear();
   res = connection_handle_read_impl(conn);
   return res;
 }
@@ -3517,9 +3883,11 @@ connection_read_to_buf(connection_t *conn, ssize_t *max_to_read,
                  conn->address);
         return result;
       case TOR_TLS_WANTWRITE:
+        connection_note_write_blocked(conn);
         connection_start_writing(conn);
         return 0;
       case TOR_TLS_WANTREAD:
+        connection_note_read_blocked(conn);
         if (conn->in_connection_handle_write) {
           /* We've been invoked from connection_handle_write, because we're
            * waiting for a TLS renegotiation, the renegotiation started, and
@@ -3578,6 +3946,8 @@ connection_read_to_buf(connection_t *conn, ssize_t *max_to_read,
                              socket_error));
     if (reached_eof)
       conn->inbuf_reached_eof = 1;
+    if (result >= 0 && result < at_most)
+      connection_note_read_blocked(conn); /* a short read drains the socket */
 
 //  log_fn(LOG_DEBUG,"read_to_buf returned %d.",read_result);
 
@@ -3609,6 +3979,11 @@ connection_read_to_buf(connection_t *conn, ssize_t *max_to_read,
         else
           ocirc->n_read_circ_bw = UINT32_MAX;
       }
+    } else if (conn->type == CONN_TYPE_EXIT) {
+      /* An exit stream on an origin circuit belongs to a hidden service. */
+      circuit_t *circ = TO_EDGE_CONN(conn)->on_circuit;
+      if (circ && CIRCUIT_IS_ORIGIN(circ))
+        TO_ORIGIN_CIRCUIT(circ)->n_service_stream_bytes += n_read;
     }
 
     /* If CONN_BW events are enabled, update conn->n_read_conn_bw for
@@ -3763,6 +4138,7 @@ connection_handle_write_impl(connection_t *conn, int force)
         connection_mark_for_close_internal(conn);
         return -1;
       } else {
+        connection_note_write_blocked(conn);
         return 0; /* no change, see if next time is better */
       }
     }
@@ -3831,6 +4207,7 @@ connection_handle_write_impl(connection_t *conn, int force)
         return -1;
       case TOR_TLS_WANTWRITE:
         log_debug(LD_NET,"wanted write.");
+        connection_note_write_blocked(conn);
         /* we're already writing */
         dont_stop_writing = 1;
         break;
@@ -3840,6 +4217,7 @@ connection_handle_write_impl(connection_t *conn, int force)
         if (!connection_is_reading(conn)) {
           connection_stop_writing(conn);
           conn->write_blocked_on_bw = 1;
+          connection_bucket_note_blocked(conn);
           /* we'll start reading again when we get more tokens in our
            * read bucket; then we'll start writing again too.
            */
@@ -3867,6 +4245,8 @@ connection_handle_write_impl(connection_t *conn, int force)
     CONN_LOG_PROTECT(conn,
              result = flush_buf(conn->s, conn->outbuf,
                                 max_to_write, &conn->outbuf_flushlen));
+    if (result >= 0 && result < max_to_write)
+      connection_note_write_blocked(conn); /* the kernel buffer is full */
     if (result < 0) {
       if (CONN_IS_EDGE(conn))
         connection_edge_end_errno(TO_EDGE_CONN(conn));
@@ -3900,6 +4280,10 @@ connection_handle_write_impl(connection_t *conn, int force)
       else
         ocirc->n_written_circ_bw = UINT32_MAX;
     }
+  } else if (n_written && conn->type == CONN_TYPE_EXIT) {
+    circuit_t *circ = TO_EDGE_CONN(conn)->on_circuit;
+    if (circ && CIRCUIT_IS_ORIGIN(circ))
+      TO_ORIGIN_CIRCUIT(circ)->n_service_stream_bytes += n_written;
   }
 
   /* If CONN_BW events are enabled, update conn->n_written_conn_bw for
@@ -3960,6 +4344,7 @@ connection_handle_write(connection_t *conn, int force)
 {
     int res;
     tor_gettimeofday_cache_clear();
+    monotime_coarse_cache_clear();
     conn->in_connection_handle_write = 1;
     res = connection_handle_write_impl(conn, force);
     conn->in_connection_handle_write = 0;
@@ -4066,6 +4451,22 @@ connection_write_to_buf_impl_,(const char *string, size_t len,
     return NULL;                                   \
   STMT_END
 
+/** As CONN_GET_TEMPLATE, but only look at connections of type
+ * <b>type</b>. */
+#define CONN_GET_BY_TYPE_TEMPLATE(var, type, test)               \
+  STMT_BEGIN                                                     \
+    smartlist_t *conns;                                          \
+    if ((type) < CONN_TYPE_MIN_ || (type) > CONN_TYPE_MAX_)      \
+      return NULL;                                               \
+    conns = get_connection_array_by_type(type);                  \
+    SMARTLIST_FOREACH(conns, connection_t *, var,                \
+    {                                                            \
+      if ((test) && !var->marked_for_close)                      \
+        return var;                                              \
+    });                                                          \
+    return NULL;                                                 \
+  STMT_END
+
 /** Return a connection with given type, address, port, and purpose;
  * or NULL if no such connection exists (or if all such connections are marked
  * for close). */
@@ -4074,11 +4475,10 @@ connection_get_by_type_addr_port_purpose,(int type,
                                          const tor_addr_t *addr, uint16_t port,
                                          int purpose))
 {
-  CONN_GET_TEMPLATE(conn,
-       (conn->type == type &&
-        tor_addr_eq(&conn->addr, addr) &&
-        conn->port == port &&
-        conn->purpose == purpose));
+  CONN_GET_BY_TYPE_TEMPLATE(conn, type,
+       (conn->port == port &&
+        conn->purpose == purpose &&
+        tor_addr_eq(&conn->addr, addr)));
 }
 
 /** Return the stream with id <b>id</b> if it is not already marked for
@@ -4087,7 +4487,20 @@ connection_get_by_type_addr_port_purpose,(int type,
 connection_t *
 connection_get_by_global_id(uint64_t id)
 {
-  CONN_GET_TEMPLATE(conn, conn->global_identifier == id);
+  const smartlist_t *conns = get_connection_array();
+  connection_t *conn;
+
+  if (!connection_id_table)
+    return NULL;
+  conn = slottable_get(connection_id_table, id);
+  /* As with CONN_GET_TEMPLATE, only look at connections in the connection
+   * array. */
+  if (!conn || conn->marked_for_close ||
+      conn->conn_array_index < 0 ||
+      conn->conn_array_index >= smartlist_len(conns) ||
+      smartlist_get(conns, conn->conn_array_index) != conn)
+    return NULL;
+  return conn;
 }
 
 /** Return a connection of type <b>type</b> that is not marked for close.
@@ -4095,7 +4508,7 @@ connection_get_by_global_id(uint64_t id)
 connection_t *
 connection_get_by_type(int type)
 {
-  CONN_GET_TEMPLATE(conn, conn->type == type);
+  CONN_GET_BY_TYPE_TEMPLATE(conn, type, 1);
 }
 
 /** Return a connection of type <b>type</b> that is in state <b>state</b>,
@@ -4104,7 +4517,7 @@ connection_get_by_type(int type)
 connection_t *
 connection_get_by_type_state(int type, int state)
 {
-  CONN_GET_TEMPLATE(conn, conn->type == type && conn->state == state);
+  CONN_GET_BY_TYPE_TEMPLATE(conn, type, conn->state == state);
 }
 
 /** Return a connection of type <b>type</b> that has rendquery equal
@@ -4119,9 +4532,8 @@ connection_get_by_type_state_rendquery(int type, int state,
              type == CONN_TYPE_AP || type == CONN_TYPE_EXIT);
   tor_assert(rendquery);
 
-  CONN_GET_TEMPLATE(conn,
-       (conn->type == type &&
-        (!state || state == conn->state)) &&
+  CONN_GET_BY_TYPE_TEMPLATE(conn, type,
+       (!state || state == conn->state) &&
         (
          (type == CONN_TYPE_DIR &&
           TO_DIR_CONN(conn)->rend_data &&
@@ -4142,12 +4554,10 @@ connection_get_by_type_state_rendquery(int type, int state,
 #define DIR_CONN_LIST_TEMPLATE(conn_var, conn_test,             \
                                dirconn_var, dirconn_test)       \
   STMT_BEGIN                                                    \
-    smartlist_t *conns = get_connection_array();                \
+    smartlist_t *conns = get_connection_array_by_type(CONN_TYPE_DIR); \
     smartlist_t *dir_conns = smartlist_new();                   \
     SMARTLIST_FOREACH_BEGIN(conns, connection_t *, conn_var) {  \
-      if (conn_var && (conn_test)                               \
-          && conn_var->type == CONN_TYPE_DIR                    \
-          && !conn_var->marked_for_close) {                     \
+      if ((conn_test) && !conn_var->marked_for_close) {         \
         dir_connection_t *dirconn_var = TO_DIR_CONN(conn_var);  \
         if (dirconn_var && (dirconn_test)) {                    \
           smartlist_add(dir_conns, dirconn_var);                \
@@ -4203,8 +4613,7 @@ connection_dir_list_by_purpose_resource_and_state(
 static connection_t *
 connection_get_another_active_or_conn(const or_connection_t *this_conn)
 {
-  CONN_GET_TEMPLATE(conn,
-                    conn != TO_CONN(this_conn) && conn->type == CONN_TYPE_OR);
+  CONN_GET_BY_TYPE_TEMPLATE(conn, CONN_TYPE_OR, conn != TO_CONN(this_conn));
 }
 
 /** Return 1 if there are any active OR connections apart from
@@ -4226,6 +4635,7 @@ any_other_active_or_conns(const or_connection_t *this_conn)
 }
 
 #undef CONN_GET_TEMPLATE
+#undef CONN_GET_BY_TYPE_TEMPLATE
 
 /** Return 1 if <b>conn</b> is a listener conn, else return 0. */
 int
@@ -5091,6 +5501,10 @@ connection_free_all(void)
 {
   smartlist_t *conns = get_connection_array();
 
+  /* rephist is already gone by now; just forget the pending bytes. */
+  pending_bandwidth_read = pending_bandwidth_written = 0;
+  pending_bandwidth_when = 0;
+
   /* We don't want to log any messages to controllers. */
   SMARTLIST_FOREACH(conns, connection_t *, conn,
     if (conn->type == CONN_TYPE_CONTROL)
@@ -5101,12 +5515,18 @@ connection_free_all(void)
   /* Unlink everything from the identity map. */
   connection_or_clear_identity_map();
   connection_or_clear_ext_or_id_map();
+  connection_or_clear_certs_cell_cache();
 
   /* Clear out our list of broken connections */
   clear_broken_connection_map(0);
 
   SMARTLIST_FOREACH(conns, connection_t *, conn, connection_free_(conn));
 
+  smartlist_free(bw_blocked_conns);
+  bw_blocked_conns = NULL;
+  smartlist_free(or_conns_to_refill);
+  or_conns_to_refill = NULL;
+
   if (outgoing_addrs) {
     SMARTLIST_FOREACH(outgoing_addrs, tor_addr_t *, addr, tor_free(addr));
     smartlist_free(outgoing_addrs);
@@ -5115,6 +5535,9 @@ connection_free_all(void)
 
   tor_free(last_interface_ipv4);
   tor_free(last_interface_ipv6);
+
+  slottable_free(connection_id_table);
+  connection_id_table = NULL;
 }
 
 /** Log a warning, and possibly emit a control event, that <b>received</b> came
@@ -30,6 +30,7 @@ connection_t *connection_new(int type, int socket_family);
 void connection_link_connections(connection_t *conn_a, connection_t *conn_b);
 MOCK_DECL(void,connection_free,(connection_t *conn));
 void connection_free_all(void);
+size_t connection_get_total_allocation(void);
 void connection_about_to_close_connection(connection_t *conn);
 void connection_close_immediate(connection_t *conn);
 void connection_mark_for_close_(connection_t *conn,
@@ -82,11 +83,17 @@ MOCK_DECL(void, connection_mark_for_close_internal_,
 #define connection_mark_and_flush(c)            \
   connection_mark_and_flush_((c), __LINE__, SHORT_FILE__)
 
-void connection_expire_held_open(void);
+/** How long do we keep flushing a connection that's been marked for close
+ * with hold_open_until_flushed, if it isn't writing anything? */
+#define CONN_HOLD_OPEN_TIMEOUT 15
+void connection_expire_held_open(connection_t *conn, time_t now);
 
 int connection_connect(connection_t *conn, const char *address,
                        const tor_addr_t *addr,
                        uint16_t port, int *socket_error);
+MOCK_DECL(tor_socket_t, connection_preconnect,
+          (const tor_addr_t *addr, uint16_t port, int *socket_error));
+int connection_adopt_socket(connection_t *conn, tor_socket_t s);
 
 #ifdef HAVE_SYS_UN_H
 
@@ -119,6 +126,8 @@ void connection_mark_all_noncontrol_connections(void);
 ssize_t connection_bucket_write_limit(connection_t *conn, time_t now);
 int global_write_bucket_low(connection_t *conn, size_t attempt, int priority);
 void connection_bucket_init(void);
+void connection_bucket_note_blocked(connection_t *conn);
+void connection_bucket_note_below_burst(or_connection_t *or_conn);
 void connection_bucket_refill(int seconds_elapsed, time_t now);
 
 int connection_handle_read(connection_t *conn);
@@ -262,6 +271,7 @@ connection_is_moribund(connection_t *conn)
 }
 
 void connection_check_oos(int n_socks, int failed);
+void connection_flush_bandwidth_history(void);
 
 #ifdef CONNECTION_PRIVATE
 STATIC void connection_free_(connection_t *conn);
@@ -283,6 +293,10 @@ MOCK_DECL(STATIC int,connection_connect_sockaddr,
                                              int *socket_error));
 MOCK_DECL(STATIC void, kill_conn_list_for_oos, (smartlist_t *conns));
 MOCK_DECL(STATIC smartlist_t *, pick_oos_victims, (int n));
+STATIC void connection_fair_share_note_read(or_connection_t *or_conn,
+                                            size_t n);
+STATIC int connection_fair_share_read_left(const or_connection_t *or_conn);
+STATIC int connection_bucket_fair_share(int available, int n_readers);
 
 #endif
 
@@ -65,6 +65,7 @@
 #include "circpathbias.h"
 #include "circuitlist.h"
 #include "circuituse.h"
+#include "clientdns.h"
 #include "config.h"
 #include "connection.h"
 #include "connection_edge.h"
@@ -265,6 +266,7 @@ connection_edge_process_inbuf(edge_connection_t *conn, int package_partial)
     case AP_CONN_STATE_CIRCUIT_WAIT:
     case AP_CONN_STATE_RESOLVE_WAIT:
     case AP_CONN_STATE_CONTROLLER_WAIT:
+    case AP_CONN_STATE_DNS_CACHE_WAIT:
       log_info(LD_EDGE,
                "data from edge while in '%s' state. Leaving it on buffer.",
                conn_state_to_string(conn->base_.type, conn->base_.state));
@@ -453,6 +455,7 @@ connection_edge_finished_flushing(edge_connection_t *conn)
     case AP_CONN_STATE_CONNECT_WAIT:
     case AP_CONN_STATE_CONTROLLER_WAIT:
     case AP_CONN_STATE_RESOLVE_WAIT:
+    case AP_CONN_STATE_DNS_CACHE_WAIT:
       return 0;
     default:
       log_warn(LD_BUG, "Called in unexpected state %d.",conn->base_.state);
@@ -608,6 +611,8 @@ connection_ap_about_to_close(entry_connection_t *entry_conn)
     smartlist_remove(pending_entry_connections, entry_conn);
   }
 
+  client_dns_cache_conn_closed(entry_conn);
+
 #if 1
   /* Check to make sure that this isn't in pending_entry_connections if it
    * didn't actually belong there. */
@@ -659,130 +664,146 @@ compute_retry_timeout(entry_connection_t *conn)
   return 15;
 }
 
-/** Find all general-purpose AP streams waiting for a response that sent their
- * begin/resolve cell too long ago. Detach from their current circuit, and
- * mark their current circuit as unsuitable for new streams. Then call
- * connection_ap_handshake_attach_circuit() to attach to a new circuit (if
- * available) or launch a new one.
+/** Return the next time at which connection_ap_check_expiry() might give
+ * up on <b>entry_conn</b> or retry it on another circuit, or 0 if it is
+ * open or closing and so has no such deadline.  (Rendezvous streams get
+ * SocksTimeout seconds rather than the retry timeout, so for them this is
+ * only the time to start checking.) */
+time_t
+connection_ap_expiry_deadline(entry_connection_t *entry_conn)
+{
+  const connection_t *base_conn = ENTRY_TO_CONN(entry_conn);
+
+  if (base_conn->marked_for_close || base_conn->state == AP_CONN_STATE_OPEN)
+    return 0;
+  if (AP_CONN_STATE_IS_UNATTACHED(base_conn->state))
+    return base_conn->timestamp_created + get_options()->SocksTimeout;
+  return base_conn->timestamp_lastread + compute_retry_timeout(entry_conn);
+}
+
+/** If the AP stream <b>entry_conn</b> has been waiting too long, give up
+ * on it.  That is: if it is still unattached after SocksTimeout seconds,
+ * close it.  If it is a general-purpose stream that sent its begin/resolve
+ * cell too long ago, detach it from its current circuit, mark that circuit
+ * as unsuitable for new streams, and call
+ * connection_ap_handshake_attach_circuit() to attach it to a new circuit
+ * (if available) or launch a new one.
  *
  * For rendezvous streams, simply give up after SocksTimeout seconds (with no
  * retry attempt).
+ *
+ * This runs from the stream's housekeeping timer; see
+ * connection_ap_expiry_deadline().
  */
 void
-connection_ap_expire_beginning(void)
+connection_ap_check_expiry(entry_connection_t *entry_conn, time_t now)
 {
-  edge_connection_t *conn;
-  entry_connection_t *entry_conn;
+  edge_connection_t *conn = ENTRY_TO_EDGE_CONN(entry_conn);
+  connection_t *base_conn = ENTRY_TO_CONN(entry_conn);
   circuit_t *circ;
-  time_t now = time(NULL);
   const or_options_t *options = get_options();
   int severity;
   int cutoff;
   int seconds_idle, seconds_since_born;
-  smartlist_t *conns = get_connection_array();
 
-  SMARTLIST_FOREACH_BEGIN(conns, connection_t *, base_conn) {
-    if (base_conn->type != CONN_TYPE_AP || base_conn->marked_for_close)
-      continue;
-    entry_conn = TO_ENTRY_CONN(base_conn);
-    conn = ENTRY_TO_EDGE_CONN(entry_conn);
-    /* if it's an internal linked connection, don't yell its status. */
-    severity = (tor_addr_is_null(&base_conn->addr) && !base_conn->port)
-      ? LOG_INFO : LOG_NOTICE;
-    seconds_idle = (int)( now - base_conn->timestamp_lastread );
-    seconds_since_born = (int)( now - base_conn->timestamp_created );
-
-    if (base_conn->state == AP_CONN_STATE_OPEN)
-      continue;
+  if (base_conn->marked_for_close)
+    return;
+  /* if it's an internal linked connection, don't yell its status. */
+  severity = (tor_addr_is_null(&base_conn->addr) && !base_conn->port)
+    ? LOG_INFO : LOG_NOTICE;
+  seconds_idle = (int)( now - base_conn->timestamp_lastread );
+  seconds_since_born = (int)( now - base_conn->timestamp_created );
 
-    /* We already consider SocksTimeout in
-     * connection_ap_handshake_attach_circuit(), but we need to consider
-     * it here too because controllers that put streams in controller_wait
-     * state never ask Tor to attach the circuit. */
-    if (AP_CONN_STATE_IS_UNATTACHED(base_conn->state)) {
-      if (seconds_since_born >= options->SocksTimeout) {
-        log_fn(severity, LD_APP,
-            "Tried for %d seconds to get a connection to %s:%d. "
-            "Giving up. (%s)",
-            seconds_since_born,
-            safe_str_client(entry_conn->socks_request->address),
-            entry_conn->socks_request->port,
-            conn_state_to_string(CONN_TYPE_AP, base_conn->state));
-        connection_mark_unattached_ap(entry_conn, END_STREAM_REASON_TIMEOUT);
-      }
-      continue;
+  if (base_conn->state == AP_CONN_STATE_OPEN)
+    return;
+
+  /* We already consider SocksTimeout in
+   * connection_ap_handshake_attach_circuit(), but we need to consider
+   * it here too because controllers that put streams in controller_wait
+   * state never ask Tor to attach the circuit. */
+  if (AP_CONN_STATE_IS_UNATTACHED(base_conn->state)) {
+    if (seconds_since_born >= options->SocksTimeout) {
+      log_fn(severity, LD_APP,
+          "Tried for %d seconds to get a connection to %s:%d. "
+          "Giving up. (%s)",
+          seconds_since_born,
+          safe_str_client(entry_conn->socks_request->address),
+          entry_conn->socks_request->port,
+          conn_state_to_string(CONN_TYPE_AP, base_conn->state));
+      connection_mark_unattached_ap(entry_conn, END_STREAM_REASON_TIMEOUT);
     }
+    return;
+  }
 
-    /* We're in state connect_wait or resolve_wait now -- waiting for a
-     * reply to our relay cell. See if we want to retry/give up. */
+  /* We're in state connect_wait or resolve_wait now -- waiting for a
+   * reply to our relay cell. See if we want to retry/give up. */
 
-    cutoff = compute_retry_timeout(entry_conn);
-    if (seconds_idle < cutoff)
-      continue;
-    circ = circuit_get_by_edge_conn(conn);
-    if (!circ) { /* it's vanished? */
-      log_info(LD_APP,"Conn is waiting (address %s), but lost its circ.",
-               safe_str_client(entry_conn->socks_request->address));
+  cutoff = compute_retry_timeout(entry_conn);
+  if (seconds_idle < cutoff)
+    return;
+  circ = circuit_get_by_edge_conn(conn);
+  if (!circ) { /* it's vanished? */
+    log_info(LD_APP,"Conn is waiting (address %s), but lost its circ.",
+             safe_str_client(entry_conn->socks_request->address));
+    connection_mark_unattached_ap(entry_conn, END_STREAM_REASON_TIMEOUT);
+    return;
+  }
+  if (circ->purpose == CIRCUIT_PURPOSE_C_REND_JOINED) {
+    if (seconds_idle >= options->SocksTimeout) {
+      log_fn(severity, LD_REND,
+             "Rend stream is %d seconds late. Giving up on address"
+             " '%s.onion'.",
+             seconds_idle,
+             safe_str_client(entry_conn->socks_request->address));
+      /* Roll back path bias use state so that we probe the circuit
+       * if nothing else succeeds on it */
+      pathbias_mark_use_rollback(TO_ORIGIN_CIRCUIT(circ));
+
+      connection_edge_end(conn, END_STREAM_REASON_TIMEOUT);
       connection_mark_unattached_ap(entry_conn, END_STREAM_REASON_TIMEOUT);
-      continue;
-    }
-    if (circ->purpose == CIRCUIT_PURPOSE_C_REND_JOINED) {
-      if (seconds_idle >= options->SocksTimeout) {
-        log_fn(severity, LD_REND,
-               "Rend stream is %d seconds late. Giving up on address"
-               " '%s.onion'.",
-               seconds_idle,
-               safe_str_client(entry_conn->socks_request->address));
-        /* Roll back path bias use state so that we probe the circuit
-         * if nothing else succeeds on it */
-        pathbias_mark_use_rollback(TO_ORIGIN_CIRCUIT(circ));
-
-        connection_edge_end(conn, END_STREAM_REASON_TIMEOUT);
-        connection_mark_unattached_ap(entry_conn, END_STREAM_REASON_TIMEOUT);
-      }
-      continue;
-    }
-    if (circ->purpose != CIRCUIT_PURPOSE_C_GENERAL &&
-        circ->purpose != CIRCUIT_PURPOSE_C_MEASURE_TIMEOUT &&
-        circ->purpose != CIRCUIT_PURPOSE_PATH_BIAS_TESTING) {
-      log_warn(LD_BUG, "circuit->purpose == CIRCUIT_PURPOSE_C_GENERAL failed. "
-               "The purpose on the circuit was %s; it was in state %s, "
-               "path_state %s.",
-               circuit_purpose_to_string(circ->purpose),
-               circuit_state_to_string(circ->state),
-               CIRCUIT_IS_ORIGIN(circ) ?
-                pathbias_state_to_string(TO_ORIGIN_CIRCUIT(circ)->path_state) :
-                "none");
-    }
-    log_fn(cutoff < 15 ? LOG_INFO : severity, LD_APP,
-           "We tried for %d seconds to connect to '%s' using exit %s."
-           " Retrying on a new circuit.",
-           seconds_idle,
-           safe_str_client(entry_conn->socks_request->address),
-           conn->cpath_layer ?
-             extend_info_describe(conn->cpath_layer->extend_info):
-             "*unnamed*");
-    /* send an end down the circuit */
-    connection_edge_end(conn, END_STREAM_REASON_TIMEOUT);
-    /* un-mark it as ending, since we're going to reuse it */
-    conn->edge_has_sent_end = 0;
-    conn->end_reason = 0;
-    /* make us not try this circuit again, but allow
-     * current streams on it to survive if they can */
-    mark_circuit_unusable_for_new_conns(TO_ORIGIN_CIRCUIT(circ));
-
-    /* give our stream another 'cutoff' seconds to try */
-    conn->base_.timestamp_lastread += cutoff;
-    if (entry_conn->num_socks_retries < 250) /* avoid overflow */
-      entry_conn->num_socks_retries++;
-    /* move it back into 'pending' state, and try to attach. */
-    if (connection_ap_detach_retriable(entry_conn, TO_ORIGIN_CIRCUIT(circ),
-                                       END_STREAM_REASON_TIMEOUT)<0) {
-      if (!base_conn->marked_for_close)
-        connection_mark_unattached_ap(entry_conn,
-                                      END_STREAM_REASON_CANT_ATTACH);
     }
-  } SMARTLIST_FOREACH_END(base_conn);
+    return;
+  }
+  if (circ->purpose != CIRCUIT_PURPOSE_C_GENERAL &&
+      circ->purpose != CIRCUIT_PURPOSE_C_MEASURE_TIMEOUT &&
+      circ->purpose != CIRCUIT_PURPOSE_PATH_BIAS_TESTING) {
+    log_warn(LD_BUG, "circuit->purpose == CIRCUIT_PURPOSE_C_GENERAL failed. "
+             "The purpose on the circuit was %s; it was in state %s, "
+             "path_state %s.",
+             circuit_purpose_to_string(circ->purpose),
+             circuit_state_to_string(circ->state),
+             CIRCUIT_IS_ORIGIN(circ) ?
+              pathbias_state_to_string(TO_ORIGIN_CIRCUIT(circ)->path_state) :
+              "none");
+  }
+  log_fn(cutoff < 15 ? LOG_INFO : severity, LD_APP,
+         "We tried for %d seconds to connect to '%s' using exit %s."
+         " Retrying on a new circuit.",
+         seconds_idle,
+         safe_str_client(entry_conn->socks_request->address),
+         conn->cpath_layer ?
+           extend_info_describe(conn->cpath_layer->extend_info):
+           "*unnamed*");
+  /* send an end down the circuit */
+  connection_edge_end(conn, END_STREAM_REASON_TIMEOUT);
+  /* un-mark it as ending, since we're going to reuse it */
+  conn->edge_has_sent_end = 0;
+  conn->end_reason = 0;
+  /* make us not try this circuit again, but allow
+   * current streams on it to survive if they can */
+  mark_circuit_unusable_for_new_conns(TO_ORIGIN_CIRCUIT(circ));
+
+  /* give our stream another 'cutoff' seconds to try */
+  conn->base_.timestamp_lastread += cutoff;
+  if (entry_conn->num_socks_retries < 250) /* avoid overflow */
+    entry_conn->num_socks_retries++;
+  /* move it back into 'pending' state, and try to attach. */
+  if (connection_ap_detach_retriable(entry_conn, TO_ORIGIN_CIRCUIT(circ),
+                                     END_STREAM_REASON_TIMEOUT)<0) {
+    if (!base_conn->marked_for_close)
+      connection_mark_unattached_ap(entry_conn,
+                                    END_STREAM_REASON_CANT_ATTACH);
+  }
 }
 
 /**
@@ -829,6 +850,51 @@ connection_ap_rescan_and_attach_pending(void)
 #define UNMARK() do { } while (0)
 #endif
 
+/** Helper: try to attach <b>entry_conn</b>, which we have just taken off
+ * pending_entry_connections, to a circuit.  Put it back on the list if it
+ * still needs one. */
+static void
+connection_ap_attach_one_pending(entry_connection_t *entry_conn)
+{
+  connection_t *conn = ENTRY_TO_CONN(entry_conn);
+  tor_assert(conn && entry_conn);
+  if (conn->marked_for_close) {
+    UNMARK();
+    return;
+  }
+  if (conn->magic != ENTRY_CONNECTION_MAGIC) {
+    log_warn(LD_BUG, "%p has impossible magic value %u.",
+             entry_conn, (unsigned)conn->magic);
+    UNMARK();
+    return;
+  }
+  if (conn->state != AP_CONN_STATE_CIRCUIT_WAIT) {
+    log_warn(LD_BUG, "%p is no longer in circuit_wait. Its current state "
+             "is %s. Why is it on pending_entry_connections?",
+             entry_conn,
+             conn_state_to_string(conn->type, conn->state));
+    UNMARK();
+    return;
+  }
+
+  if (connection_ap_handshake_attach_circuit(entry_conn) < 0) {
+    if (!conn->marked_for_close)
+      connection_mark_unattached_ap(entry_conn,
+                                    END_STREAM_REASON_CANT_ATTACH);
+  }
+
+  if (! conn->marked_for_close &&
+      conn->type == CONN_TYPE_AP &&
+      conn->state == AP_CONN_STATE_CIRCUIT_WAIT) {
+    if (!smartlist_contains(pending_entry_connections, entry_conn)) {
+      smartlist_add(pending_entry_connections, entry_conn);
+      return;
+    }
+  }
+
+  UNMARK();
+}
+
 /** Tell any AP streams that are listed as waiting for a new circuit to try
  * again, either attaching to an available circ or launching a new one.
  *
@@ -850,49 +916,78 @@ connection_ap_attach_pending(int retry)
   smartlist_t *pending = pending_entry_connections;
   pending_entry_connections = smartlist_new();
 
-  SMARTLIST_FOREACH_BEGIN(pending,
-                          entry_connection_t *, entry_conn) {
-    connection_t *conn = ENTRY_TO_CONN(entry_conn);
-    tor_assert(conn && entry_conn);
-    if (conn->marked_for_close) {
-      UNMARK();
-      continue;
-    }
-    if (conn->magic != ENTRY_CONNECTION_MAGIC) {
-      log_warn(LD_BUG, "%p has impossible magic value %u.",
-               entry_conn, (unsigned)conn->magic);
-      UNMARK();
-      continue;
-    }
-    if (conn->state != AP_CONN_STATE_CIRCUIT_WAIT) {
-      log_warn(LD_BUG, "%p is no longer in circuit_wait. Its current state "
-               "is %s. Why is it on pending_entry_connections?",
-               entry_conn,
-               conn_state_to_string(conn->type, conn->state));
-      UNMARK();
-      continue;
-    }
+  SMARTLIST_FOREACH(pending, entry_connection_t *, entry_conn,
+                    connection_ap_attach_one_pending(entry_conn));
 
-    if (connection_ap_handshake_attach_circuit(entry_conn) < 0) {
-      if (!conn->marked_for_close)
-        connection_mark_unattached_ap(entry_conn,
-                                      END_STREAM_REASON_CANT_ATTACH);
-    }
+  smartlist_free(pending);
+  untried_pending_connections = 0;
+}
 
-    if (! conn->marked_for_close &&
-        conn->type == CONN_TYPE_AP &&
-        conn->state == AP_CONN_STATE_CIRCUIT_WAIT) {
-      if (!smartlist_contains(pending_entry_connections, entry_conn)) {
-        smartlist_add(pending_entry_connections, entry_conn);
-        continue;
-      }
-    }
+/** Return false if <b>entry_conn</b> certainly can't use the open circuit
+ * <b>circ</b>, so that offering it <b>circ</b> would only repeat an attach
+ * attempt that already failed.  This is a cheap, conservative version of
+ * the checks in circuit_get_best(): a true answer just means "try". */
+STATIC int
+connection_ap_might_use_circuit(const entry_connection_t *entry_conn,
+                                const origin_circuit_t *circ)
+{
+  const edge_connection_t *edge_conn = ENTRY_TO_EDGE_CONN(entry_conn);
+  cpath_build_state_t *build_state = circ->build_state;
 
-    UNMARK();
-  } SMARTLIST_FOREACH_END(entry_conn);
+  if (TO_CIRCUIT(circ)->purpose == CIRCUIT_PURPOSE_C_GENERAL) {
+    const node_t *exit;
+    if (edge_conn->rend_data || !build_state)
+      return 0;
+    if (!entry_conn->want_onehop != !build_state->onehop_tunnel)
+      return 0;
+    exit = build_state_get_exit_node(build_state);
+    if (exit && !connection_ap_can_use_exit(entry_conn, exit))
+      return 0;
+  } else if (TO_CIRCUIT(circ)->purpose == CIRCUIT_PURPOSE_C_REND_JOINED) {
+    if (!edge_conn->rend_data || !circ->rend_data ||
+        rend_cmp_service_ids(edge_conn->rend_data->onion_address,
+                             circ->rend_data->onion_address))
+      return 0;
+  }
+
+  return connection_edge_compatible_with_circuit(entry_conn, circ);
+}
 
+/** Called when <b>circ</b> has become ready for streams: offer it to the
+ * streams waiting for a circuit that might be able to use it.
+ *
+ * The other pending streams keep waiting without another attach attempt.
+ * Nothing they could use has changed, and each such attempt scans every
+ * circuit; connection_ap_attach_pending() still retries all of them once
+ * a second, and whenever the set of circuits changes in other ways. */
+void
+connection_ap_attach_pending_for_circuit(origin_circuit_t *circ)
+{
+  smartlist_t *pending, *woken;
+
+  if (PREDICT_UNLIKELY(!pending_entry_connections))
+    return;
+
+  pending = pending_entry_connections;
+  pending_entry_connections = smartlist_new();
+  woken = smartlist_new();
+  SMARTLIST_FOREACH_BEGIN(pending, entry_connection_t *, entry_conn) {
+    connection_t *conn = ENTRY_TO_CONN(entry_conn);
+    /* Let connection_ap_attach_one_pending() sort out the broken ones. */
+    if (conn->marked_for_close ||
+        conn->magic != ENTRY_CONNECTION_MAGIC ||
+        conn->state != AP_CONN_STATE_CIRCUIT_WAIT ||
+        connection_ap_might_use_circuit(entry_conn, circ))
+      smartlist_add(woken, entry_conn);
+    else
+      smartlist_add(pending_entry_connections, entry_conn);
+  } SMARTLIST_FOREACH_END(entry_conn);
   smartlist_free(pending);
-  untried_pending_connections = 0;
+
+  SMARTLIST_FOREACH(woken, entry_connection_t *, entry_conn,
+                    connection_ap_attach_one_pending(entry_conn));
+
+  smartlist_free(woken);
 }
 
 /** Mark <b>entry_conn</b> as needing to get attached to a circuit.
@@ -1086,6 +1181,8 @@ connection_ap_detach_retriable(entry_connection_t *conn,
     ENTRY_TO_CONN(conn)->state = AP_CONN_STATE_CONTROLLER_WAIT;
     circuit_detach_stream(TO_CIRCUIT(circ),ENTRY_TO_EDGE_CONN(conn));
   }
+  /* Its expiry deadline is now based on its age, not on the circuit. */
+  connection_schedule_housekeeping(ENTRY_TO_CONN(conn));
   return 0;
 }
 
@@ -1723,6 +1820,22 @@ connection_ap_handshake_rewrite_and_attach(entry_connection_t *conn,
       tor_fragile_assert();
     }
 
+    /* If this is a lookup we've just done, or are doing right now, for a
+     * request we could have shared a circuit with, use that answer. */
+    if (SOCKS_COMMAND_IS_RESOLVE(socks->command) && !circ) {
+      switch (client_dns_cache_lookup(conn)) {
+        case CLIENT_DNS_CACHE_HIT:
+          connection_mark_unattached_ap(conn,
+                                END_STREAM_REASON_DONE |
+                                END_STREAM_REASON_FLAG_ALREADY_SOCKS_REPLIED);
+          return 0;
+        case CLIENT_DNS_CACHE_WAIT:
+          return 0;
+        case CLIENT_DNS_CACHE_MISS:
+          break;
+      }
+    }
+
     /* Okay. At this point we've set chosen_exit_name if needed, rewritten the
      * address, and decided not to reject it for any number of reasons. Now
      * mark the connection as waiting for a circuit, and try to attach it!
@@ -2361,6 +2474,25 @@ connection_ap_get_begincell_flags(entry_connection_t *ap_conn)
   return flags;
 }
 
+/** Return true iff we should let <b>ap_conn</b> adapt its stream-level
+ * deliver window to measured sendme round trips: that is, iff we're
+ * configured to, and the stream exits through a general circuit.
+ *
+ * The window only ever shrinks below STREAMWINDOW_START, by our sending
+ * sendmes later than usual, so this needs nothing from the exit. */
+static int
+connection_ap_may_use_adaptive_window(const entry_connection_t *ap_conn)
+{
+  const edge_connection_t *edge_conn = ENTRY_TO_EDGE_CONN(ap_conn);
+
+  if (!get_options()->AdaptiveStreamWindows)
+    return 0;
+  if (ap_conn->use_begindir ||
+      edge_conn->on_circuit->purpose != CIRCUIT_PURPOSE_C_GENERAL)
+    return 0;
+  return 1;
+}
+
 /** Write a relay begin cell, using destaddr and destport from ap_conn's
  * socks_request field, and send it down circ.
  *
@@ -2450,7 +2582,12 @@ connection_ap_handshake_send_begin(entry_connection_t *ap_conn)
 
   edge_conn->package_window = STREAMWINDOW_START;
   edge_conn->deliver_window = STREAMWINDOW_START;
+  if (connection_ap_may_use_adaptive_window(ap_conn)) {
+    edge_conn->adaptive_window = 1;
+    edge_conn->deliver_window_target = STREAMWINDOW_START;
+  }
   base_conn->state = AP_CONN_STATE_CONNECT_WAIT;
+  connection_schedule_housekeeping(base_conn);
   log_info(LD_APP,"Address/port sent, ap socket "TOR_SOCKET_T_FORMAT
            ", n_circ_id %u",
            base_conn->s, (unsigned)circ->base_.n_circ_id);
@@ -2553,6 +2690,7 @@ connection_ap_handshake_send_resolve(entry_connection_t *ap_conn)
     base_conn->address = tor_addr_to_str_dup(&base_conn->addr);
   }
   base_conn->state = AP_CONN_STATE_RESOLVE_WAIT;
+  connection_schedule_housekeeping(base_conn);
   log_info(LD_APP,"Address sent for resolve, ap socket "TOR_SOCKET_T_FORMAT
            ", n_circ_id %u",
            base_conn->s, (unsigned)circ->base_.n_circ_id);
@@ -2708,6 +2846,8 @@ connection_ap_handshake_socks_resolved,(entry_connection_t *conn,
   char buf[384];
   size_t replylen;
 
+  client_dns_cache_note_answer(conn, answer_type, answer_len, answer, ttl);
+
   if (ttl >= 0) {
     if (answer_type == RESOLVED_TYPE_IPV4 && answer_len == 4) {
       tor_addr_t a;
@@ -3281,6 +3421,250 @@ my_exit_policy_rejects(const tor_addr_t *addr,
   return 0;
 }
 
+/** Most destinations we track for exit preconnection at once. */
+#define EXIT_PRECONNECT_MAX_DESTINATIONS 16
+/** A destination is "hot", and gets preconnected sockets, once its decayed
+ * stream count reaches this many. */
+#define EXIT_PRECONNECT_MIN_STREAMS 3
+/** How many preconnected sockets we keep waiting for each hot
+ * destination. */
+#define EXIT_PRECONNECT_SOCKETS_PER_DESTINATION 2
+/** How long, in seconds, we keep an unused preconnected socket open. Keep
+ * this well under common server idle timeouts. */
+#define EXIT_PRECONNECT_MAX_IDLE 30
+/** How often, in seconds, we halve every destination's stream count. */
+#define EXIT_PRECONNECT_DECAY_INTERVAL 60
+
+/** A preconnected socket waiting for a stream. */
+typedef struct exit_preconnect_socket_t {
+  tor_socket_t s;
+  /** When we opened it. */
+  time_t opened;
+} exit_preconnect_socket_t;
+
+/** An exit destination that recent streams have connected to. */
+typedef struct exit_preconnect_dest_t {
+  tor_addr_t addr;
+  uint16_t port;
+  /** Number of streams to this destination, halved every
+   * EXIT_PRECONNECT_DECAY_INTERVAL seconds. */
+  int n_streams;
+  /** List of exit_preconnect_socket_t waiting for streams, oldest first. */
+  smartlist_t *sockets;
+} exit_preconnect_dest_t;
+
+/** List of exit_preconnect_dest_t for the destinations we track. */
+static smartlist_t *exit_preconnect_dests = NULL;
+/** When did we last decay the stream counts in exit_preconnect_dests? */
+static time_t exit_preconnect_last_decay = 0;
+
+/** Close and free every socket waiting in <b>dest</b>. */
+static void
+exit_preconnect_dest_clear(exit_preconnect_dest_t *dest)
+{
+  SMARTLIST_FOREACH(dest->sockets, exit_preconnect_socket_t *, ps, {
+    tor_close_socket(ps->s);
+    tor_free(ps);
+  });
+  smartlist_clear(dest->sockets);
+}
+
+/** Release all storage held by <b>dest</b>, closing its sockets. */
+static void
+exit_preconnect_dest_free(exit_preconnect_dest_t *dest)
+{
+  if (!dest)
+    return;
+  exit_preconnect_dest_clear(dest);
+  smartlist_free(dest->sockets);
+  tor_free(dest);
+}
+
+/** Return the tracked destination for <b>addr</b>:<b>port</b>, or NULL if
+ * we aren't tracking it. */
+static exit_preconnect_dest_t *
+exit_preconnect_find(const tor_addr_t *addr, uint16_t port)
+{
+  if (!exit_preconnect_dests)
+    return NULL;
+  SMARTLIST_FOREACH(exit_preconnect_dests, exit_preconnect_dest_t *, dest, {
+    if (dest->port == port && tor_addr_eq(&dest->addr, addr))
+      return dest;
+  });
+  return NULL;
+}
+
+/** Return true iff <b>s</b>, a preconnected socket, looks like it can
+ * still carry a stream: its connect hasn't failed, and the server hasn't
+ * closed it.  Any data the server has already sent stays on the socket for
+ * the stream to read. */
+static int
+exit_preconnect_socket_is_usable(tor_socket_t s)
+{
+  char c;
+  int r, e;
+
+  r = (int) tor_socket_recv(s, &c, 1, MSG_PEEK);
+  if (r > 0)
+    return 1;
+  if (r == 0)
+    return 0; /* The server closed it. */
+  e = tor_socket_errno(s);
+  return ERRNO_IS_EAGAIN(e);
+}
+
+/** Open preconnected sockets to <b>dest</b> until it has
+ * EXIT_PRECONNECT_SOCKETS_PER_DESTINATION of them, if it's hot enough to
+ * deserve any. */
+static void
+exit_preconnect_refill(exit_preconnect_dest_t *dest, time_t now)
+{
+  if (dest->n_streams < EXIT_PRECONNECT_MIN_STREAMS)
+    return;
+  if (net_is_disabled())
+    return;
+
+  while (smartlist_len(dest->sockets) <
+         EXIT_PRECONNECT_SOCKETS_PER_DESTINATION) {
+    exit_preconnect_socket_t *ps;
+    int socket_error = 0;
+    tor_socket_t s = connection_preconnect(&dest->addr, dest->port,
+                                           &socket_error);
+    if (! SOCKET_OK(s)) {
+      log_info(LD_EXIT, "Couldn't preconnect to %s: %s",
+               fmt_addrport(&dest->addr, dest->port),
+               tor_socket_strerror(socket_error));
+      return;
+    }
+    ps = tor_malloc_zero(sizeof(exit_preconnect_socket_t));
+    ps->s = s;
+    ps->opened = now;
+    smartlist_add(dest->sockets, ps);
+  }
+}
+
+/** Note that an exit stream is connecting to <b>addr</b>:<b>port</b>, and
+ * top up the preconnected sockets for it if it has become hot.  The caller
+ * must already have checked the destination against our exit policy. */
+STATIC void
+exit_preconnect_note_stream(const tor_addr_t *addr, uint16_t port,
+                            time_t now)
+{
+  exit_preconnect_dest_t *dest;
+
+  if (!exit_preconnect_dests)
+    exit_preconnect_dests = smartlist_new();
+
+  dest = exit_preconnect_find(addr, port);
+  if (!dest) {
+    if (smartlist_len(exit_preconnect_dests) >=
+        EXIT_PRECONNECT_MAX_DESTINATIONS) {
+      /* Replace the coldest destination, if this new one is at least as
+       * hot as it is. */
+      exit_preconnect_dest_t *coldest = NULL;
+      SMARTLIST_FOREACH(exit_preconnect_dests, exit_preconnect_dest_t *, d, {
+        if (!coldest || d->n_streams < coldest->n_streams)
+          coldest = d;
+      });
+      if (coldest->n_streams > 1)
+        return;
+      smartlist_remove(exit_preconnect_dests, coldest);
+      exit_preconnect_dest_free(coldest);
+    }
+    dest = tor_malloc_zero(sizeof(exit_preconnect_dest_t));
+    tor_addr_copy(&dest->addr, addr);
+    dest->port = port;
+    dest->sockets = smartlist_new();
+    smartlist_add(exit_preconnect_dests, dest);
+  }
+
+  ++dest->n_streams;
+  exit_preconnect_refill(dest, now);
+}
+
+/** If we have a usable preconnected socket to <b>addr</b>:<b>port</b>,
+ * remove it from the pool and return it.  Otherwise return
+ * TOR_INVALID_SOCKET.  Each socket is handed to exactly one stream and
+ * never returns to the pool, so streams never share a connection. */
+STATIC tor_socket_t
+exit_preconnect_take(const tor_addr_t *addr, uint16_t port, time_t now)
+{
+  exit_preconnect_dest_t *dest = exit_preconnect_find(addr, port);
+  tor_socket_t s = TOR_INVALID_SOCKET;
+
+  if (!dest)
+    return TOR_INVALID_SOCKET;
+
+  /* Prefer the newest socket: it is the least likely to have been closed by
+   * the server. */
+  while (smartlist_len(dest->sockets) && !SOCKET_OK(s)) {
+    exit_preconnect_socket_t *ps = smartlist_pop_last(dest->sockets);
+    if (ps->opened + EXIT_PRECONNECT_MAX_IDLE >= now &&
+        exit_preconnect_socket_is_usable(ps->s)) {
+      s = ps->s;
+    } else {
+      tor_close_socket(ps->s);
+    }
+    tor_free(ps);
+  }
+  return s;
+}
+
+/** Close preconnected sockets that have waited too long, and decay the
+ * stream counts of the destinations we track, forgetting ones that have
+ * gone cold.  If ExitPreconnect is off, close and forget everything. */
+void
+connection_exit_preconnect_expire(time_t now)
+{
+  int decay;
+
+  if (!exit_preconnect_dests)
+    return;
+
+  if (!get_options()->ExitPreconnect ||
+      router_my_exit_policy_is_reject_star()) {
+    connection_exit_preconnect_free_all();
+    return;
+  }
+
+  decay = exit_preconnect_last_decay + EXIT_PRECONNECT_DECAY_INTERVAL <= now;
+  if (decay)
+    exit_preconnect_last_decay = now;
+
+  SMARTLIST_FOREACH_BEGIN(exit_preconnect_dests,
+                          exit_preconnect_dest_t *, dest) {
+    SMARTLIST_FOREACH_BEGIN(dest->sockets, exit_preconnect_socket_t *, ps) {
+      if (ps->opened + EXIT_PRECONNECT_MAX_IDLE < now) {
+        tor_close_socket(ps->s);
+        tor_free(ps);
+        SMARTLIST_DEL_CURRENT_KEEPORDER(dest->sockets, ps);
+      }
+    } SMARTLIST_FOREACH_END(ps);
+
+    if (decay)
+      dest->n_streams /= 2;
+    if (dest->n_streams < EXIT_PRECONNECT_MIN_STREAMS)
+      exit_preconnect_dest_clear(dest);
+    if (dest->n_streams == 0) {
+      exit_preconnect_dest_free(dest);
+      SMARTLIST_DEL_CURRENT(exit_preconnect_dests, dest);
+    }
+  } SMARTLIST_FOREACH_END(dest);
+}
+
+/** Close every preconnected exit socket and forget every destination we
+ * were tracking. */
+void
+connection_exit_preconnect_free_all(void)
+{
+  if (!exit_preconnect_dests)
+    return;
+  SMARTLIST_FOREACH(exit_preconnect_dests, exit_preconnect_dest_t *, dest,
+                    exit_preconnect_dest_free(dest));
+  smartlist_free(exit_preconnect_dests);
+  exit_preconnect_dests = NULL;
+}
+
 /** Connect to conn's specified addr and port. If it worked, conn
  * has now been added to the connection_array.
  *
@@ -3324,9 +3708,28 @@ connection_exit_connect(edge_connection_t *edge_conn)
     if (tor_addr_family(addr) == AF_INET6)
       conn->socket_family = AF_INET6;
 
-    log_debug(LD_EXIT, "about to try connecting");
-    result = connection_connect(conn, conn->address,
-                                addr, port, &socket_error);
+    result = -2;
+    if (get_options()->ExitPreconnect &&
+        ! connection_edge_is_rendezvous_stream(edge_conn)) {
+      tor_socket_t s = exit_preconnect_take(addr, port, approx_time());
+      if (SOCKET_OK(s)) {
+        if (connection_adopt_socket(conn, s) == 0) {
+          log_debug(LD_EXIT, "using a preconnected socket");
+          /* We don't know whether the connect has finished yet; let the
+           * usual CONNECTING state find out. */
+          result = 0;
+        } else {
+          tor_close_socket(s);
+        }
+      }
+      exit_preconnect_note_stream(addr, port, approx_time());
+    }
+
+    if (result == -2) {
+      log_debug(LD_EXIT, "about to try connecting");
+      result = connection_connect(conn, conn->address,
+                                  addr, port, &socket_error);
+    }
 #ifdef HAVE_SYS_UN_H
   } else {
     /*
@@ -3804,5 +4207,6 @@ connection_edge_free_all(void)
   untried_pending_connections = 0;
   smartlist_free(pending_entry_connections);
   pending_entry_connections = NULL;
+  connection_exit_preconnect_free_all();
 }
 
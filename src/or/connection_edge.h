@@ -63,9 +63,11 @@ void connection_exit_connect(edge_connection_t *conn);
 int connection_edge_is_rendezvous_stream(edge_connection_t *conn);
 int connection_ap_can_use_exit(const entry_connection_t *conn,
                                const node_t *exit);
-void connection_ap_expire_beginning(void);
+time_t connection_ap_expiry_deadline(entry_connection_t *entry_conn);
+void connection_ap_check_expiry(entry_connection_t *entry_conn, time_t now);
 void connection_ap_rescan_and_attach_pending(void);
 void connection_ap_attach_pending(int retry);
+void connection_ap_attach_pending_for_circuit(origin_circuit_t *circ);
 void connection_ap_mark_as_pending_circuit_(entry_connection_t *entry_conn,
                                            const char *file, int line);
 #define connection_ap_mark_as_pending_circuit(c) \
@@ -113,6 +115,8 @@ int connection_edge_update_circuit_isolation(const entry_connection_t *conn,
 void circuit_clear_isolation(origin_circuit_t *circ);
 streamid_t get_unique_stream_id_by_circ(origin_circuit_t *circ);
 
+void connection_exit_preconnect_expire(time_t now);
+void connection_exit_preconnect_free_all(void);
 void connection_edge_free_all(void);
 
 void connection_ap_warn_and_unmark_if_pending_circ(
@@ -186,6 +190,14 @@ typedef struct {
 
 STATIC void connection_ap_handshake_rewrite(entry_connection_t *conn,
                                             rewrite_result_t *out);
+
+STATIC void exit_preconnect_note_stream(const tor_addr_t *addr,
+                                        uint16_t port, time_t now);
+STATIC tor_socket_t exit_preconnect_take(const tor_addr_t *addr,
+                                         uint16_t port, time_t now);
+STATIC int connection_ap_might_use_circuit(
+                                       const entry_connection_t *entry_conn,
+                                       const origin_circuit_t *circ);
 #endif
 
 #endif
@@ -440,23 +440,6 @@ cell_pack(packed_cell_t *dst, const cell_t *src, int wide_circ_ids)
   memcpy(dest+1, src->payload, CELL_PAYLOAD_SIZE);
 }
 
-/** Unpack the network-order buffer <b>src</b> into a host-order
- * cell_t structure <b>dest</b>.
- */
-static void
-cell_unpack(cell_t *dest, const char *src, int wide_circ_ids)
-{
-  if (wide_circ_ids) {
-    dest->circ_id = ntohl(get_uint32(src));
-    src += 4;
-  } else {
-    dest->circ_id = ntohs(get_uint16(src));
-    src += 2;
-  }
-  dest->command = get_uint8(src);
-  memcpy(dest->payload, src+1, CELL_PAYLOAD_SIZE);
-}
-
 /** Write the header of <b>cell</b> into the first VAR_CELL_MAX_HEADER_SIZE
  * bytes of <b>hdr_out</b>. Returns number of bytes used. */
 int
@@ -653,6 +636,8 @@ connection_or_finished_flushing(or_connection_t *conn)
   tor_assert(conn);
   assert_connection_ok(TO_CONN(conn),0);
 
+  conn->timestamp_lastempty = approx_time();
+
   switch (conn->base_.state) {
     case OR_CONN_STATE_PROXY_HANDSHAKING:
     case OR_CONN_STATE_OPEN:
@@ -781,7 +766,9 @@ connection_or_update_token_buckets_helper(or_connection_t *conn, int reset,
                                           const or_options_t *options)
 {
   int rate, burst; /* per-connection rate limiting params */
-  if (connection_or_digest_is_known_relay(conn->identity_digest)) {
+  conn->is_known_relay =
+    connection_or_digest_is_known_relay(conn->identity_digest);
+  if (conn->is_known_relay) {
     /* It's in the consensus, or we have a descriptor for it meaning it
      * was probably in a recent consensus. It's a recognized relay:
      * give it full bandwidth. */
@@ -811,6 +798,8 @@ connection_or_update_token_buckets_helper(or_connection_t *conn, int reset,
     conn->read_bucket = burst;
   if (conn->write_bucket > burst)
     conn->write_bucket = burst;
+  if (conn->read_bucket < burst || conn->write_bucket < burst)
+    connection_bucket_note_below_burst(conn);
 }
 
 /** Either our set of relays or our per-conn rate limits have changed.
@@ -864,6 +853,7 @@ connection_or_set_canonical(or_connection_t *or_conn,
 
   or_conn->is_canonical = !! is_canonical; /* force to a 1-bit boolean */
   or_conn->idle_timeout = timeout_base + crypto_rand_int(timeout_base / 2);
+  connection_schedule_housekeeping(TO_CONN(or_conn));
 }
 
 /** If we don't necessarily know the router we're connecting to, but we
@@ -946,8 +936,12 @@ connection_or_mark_bad_for_new_circs(or_connection_t *or_conn)
 {
   tor_assert(or_conn);
 
-  if (or_conn->chan)
+  if (or_conn->chan &&
+      !channel_is_bad_for_new_circs(TLS_CHAN_TO_BASE(or_conn->chan))) {
     channel_mark_bad_for_new_circs(TLS_CHAN_TO_BASE(or_conn->chan));
+    /* If it has no circuits, housekeeping will want to close it. */
+    connection_schedule_housekeeping_now(TO_CONN(or_conn));
+  }
 }
 
 /** How old do we let a connection to an OR get before deciding it's
@@ -1366,6 +1360,8 @@ connection_tls_start_handshake,(or_connection_t *conn, int receiving))
   }
   tor_tls_set_logged_address(conn->tls, // XXX client and relay?
       escaped_safe_str(conn->base_.address));
+  if (!receiving)
+    tor_tls_try_resume_session(conn->tls, conn->identity_digest);
 
   connection_start_reading(TO_CONN(conn));
   log_debug(LD_HANDSHAKE,"starting TLS handshake on fd "TOR_SOCKET_T_FORMAT,
@@ -1450,10 +1446,12 @@ connection_tls_continue_handshake(or_connection_t *conn)
       tor_assert(tor_tls_is_server(conn->tls));
       return connection_tls_finish_handshake(conn);
     case TOR_TLS_WANTWRITE:
+      connection_note_write_blocked(TO_CONN(conn));
       connection_start_writing(TO_CONN(conn));
       log_debug(LD_OR,"wanted write");
       return 0;
     case TOR_TLS_WANTREAD: /* handshaking conns are *always* reading */
+      connection_note_read_blocked(TO_CONN(conn));
       log_debug(LD_OR,"wanted read");
       return 0;
     case TOR_TLS_CLOSE:
@@ -1878,9 +1876,17 @@ connection_or_set_state_open(or_connection_t *conn)
   connection_or_change_state(conn, OR_CONN_STATE_OPEN);
   control_event_or_conn_status(conn, OR_CONN_EVENT_CONNECTED, 0);
 
+  /* By now we know who is on the other side: if we can, keep our session
+   * with them for the next time we connect. */
+  if (conn->tls && conn->handshake_state &&
+      conn->handshake_state->started_here)
+    tor_tls_remember_session(conn->tls, conn->identity_digest);
+
   or_handshake_state_free(conn->handshake_state);
   conn->handshake_state = NULL;
   connection_start_reading(TO_CONN(conn));
+  /* Open connections have idle timeouts to think about. */
+  connection_schedule_housekeeping(TO_CONN(conn));
 
   return 0;
 }
@@ -1943,6 +1949,15 @@ connection_fetch_var_cell_from_buf(or_connection_t *or_conn, var_cell_t **out)
   return fetch_var_cell_from_buf(conn->inbuf, out, or_conn->link_proto);
 }
 
+/** See whether there's a fixed-length cell waiting on <b>or_conn</b>'s
+ * inbuf.  Return values as for fetch_cell_from_buf(). */
+static int
+connection_fetch_cell_from_buf(or_connection_t *or_conn, cell_t *out)
+{
+  connection_t *conn = TO_CONN(or_conn);
+  return fetch_cell_from_buf(conn->inbuf, out, or_conn->wide_circ_ids);
+}
+
 /** Process cells from <b>conn</b>'s inbuf.
  *
  * Loop: while inbuf contains a cell, pull it off the inbuf, unpack it,
@@ -1986,12 +2001,10 @@ connection_or_process_cells_from_inbuf(or_connection_t *conn)
       channel_tls_handle_var_cell(var_cell, conn);
       var_cell_free(var_cell);
     } else {
-      const int wide_circ_ids = conn->wide_circ_ids;
-      size_t cell_network_size = get_cell_network_size(conn->wide_circ_ids);
-      char buf[CELL_MAX_NETWORK_SIZE];
       cell_t cell;
-      if (connection_get_inbuf_len(TO_CONN(conn))
-          < cell_network_size) /* whole response available? */
+      /* Unpack the cell straight from the inbuf into the host-order
+       * struct, if the whole thing is there. */
+      if (! connection_fetch_cell_from_buf(conn, &cell))
         return 0; /* not yet */
 
       /* Touch the channel's active timestamp if there is one */
@@ -1999,12 +2012,6 @@ connection_or_process_cells_from_inbuf(or_connection_t *conn)
         channel_timestamp_active(TLS_CHAN_TO_BASE(conn->chan));
 
       circuit_build_times_network_is_live(get_circuit_build_times_mutable());
-      connection_fetch_from_buf(buf, cell_network_size, TO_CONN(conn));
-
-      /* retrieve cell info from buf (create the host-order struct from the
-       * network-order string) */
-      cell_unpack(&cell, buf, wide_circ_ids);
-
       channel_tls_handle_cell(&cell, conn);
     }
   }
@@ -2132,25 +2139,38 @@ connection_or_send_netinfo,(or_connection_t *conn))
   return 0;
 }
 
-/** Send a CERTS cell on the connection <b>conn</b>.  Return 0 on success, -1
- * on failure. */
-int
-connection_or_send_certs_cell(or_connection_t *conn)
+/** Our encoded CERTS cells, indexed by whether we send them as the server
+ * side of a handshake.  We encode each one once per key rotation. */
+static var_cell_t *certs_cell_cache[2] = { NULL, NULL };
+/** SHA256 digests of the link and identity certificates in each cell in
+ * certs_cell_cache. */
+static uint8_t certs_cell_cache_digests[2][2][DIGEST256_LEN];
+
+/** Return a CERTS cell holding <b>link_cert</b> and <b>id_cert</b>, for the
+ * server side of a handshake if <b>server</b> is true, and for the client
+ * side otherwise.  The cell belongs to the cache: don't free it. */
+const var_cell_t *
+connection_or_get_certs_cell(int server,
+                             const tor_x509_cert_t *link_cert,
+                             const tor_x509_cert_t *id_cert)
 {
-  const tor_x509_cert_t *link_cert = NULL, *id_cert = NULL;
   const uint8_t *link_encoded = NULL, *id_encoded = NULL;
+  const char *link_digest, *id_digest;
   size_t link_len, id_len;
   var_cell_t *cell;
   size_t cell_len;
   ssize_t pos;
 
-  tor_assert(conn->base_.state == OR_CONN_STATE_OR_HANDSHAKING_V3);
+  server = !!server;
+  link_digest = tor_x509_cert_get_cert_digests(link_cert)->d[DIGEST_SHA256];
+  id_digest = tor_x509_cert_get_cert_digests(id_cert)->d[DIGEST_SHA256];
+  if (certs_cell_cache[server] &&
+      tor_memeq(certs_cell_cache_digests[server][0], link_digest,
+                DIGEST256_LEN) &&
+      tor_memeq(certs_cell_cache_digests[server][1], id_digest,
+                DIGEST256_LEN))
+    return certs_cell_cache[server];
 
-  if (! conn->handshake_state)
-    return -1;
-  const int conn_in_server_mode = ! conn->handshake_state->started_here;
-  if (tor_tls_get_my_certs(conn_in_server_mode, &link_cert, &id_cert) < 0)
-    return -1;
   tor_x509_cert_get_der(link_cert, &link_encoded, &link_len);
   tor_x509_cert_get_der(id_cert, &id_encoded, &id_len);
 
@@ -2162,7 +2182,7 @@ connection_or_send_certs_cell(or_connection_t *conn)
   cell->payload[0] = 2;
   pos = 1;
 
-  if (conn_in_server_mode)
+  if (server)
     cell->payload[pos] = OR_CERT_TYPE_TLS_LINK; /* Link cert  */
   else
     cell->payload[pos] = OR_CERT_TYPE_AUTH_1024; /* client authentication */
@@ -2177,8 +2197,40 @@ connection_or_send_certs_cell(or_connection_t *conn)
 
   tor_assert(pos == (int)cell_len); /* Otherwise we just smashed the heap */
 
-  connection_or_write_var_cell_to_buf(cell, conn);
-  var_cell_free(cell);
+  var_cell_free(certs_cell_cache[server]);
+  certs_cell_cache[server] = cell;
+  memcpy(certs_cell_cache_digests[server][0], link_digest, DIGEST256_LEN);
+  memcpy(certs_cell_cache_digests[server][1], id_digest, DIGEST256_LEN);
+  return cell;
+}
+
+/** Release the CERTS cells we have cached. */
+void
+connection_or_clear_certs_cell_cache(void)
+{
+  var_cell_free(certs_cell_cache[0]);
+  var_cell_free(certs_cell_cache[1]);
+  certs_cell_cache[0] = certs_cell_cache[1] = NULL;
+}
+
+/** Send a CERTS cell on the connection <b>conn</b>.  Return 0 on success, -1
+ * on failure. */
+int
+connection_or_send_certs_cell(or_connection_t *conn)
+{
+  const tor_x509_cert_t *link_cert = NULL, *id_cert = NULL;
+
+  tor_assert(conn->base_.state == OR_CONN_STATE_OR_HANDSHAKING_V3);
+
+  if (! conn->handshake_state)
+    return -1;
+  const int conn_in_server_mode = ! conn->handshake_state->started_here;
+  if (tor_tls_get_my_certs(conn_in_server_mode, &link_cert, &id_cert) < 0)
+    return -1;
+
+  connection_or_write_var_cell_to_buf(
+         connection_or_get_certs_cell(conn_in_server_mode, link_cert, id_cert),
+         conn);
 
   return 0;
 }
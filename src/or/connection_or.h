@@ -82,6 +82,10 @@ MOCK_DECL(void,connection_or_write_var_cell_to_buf,(const var_cell_t *cell,
                                                    or_connection_t *conn));
 int connection_or_send_versions(or_connection_t *conn, int v3_plus);
 MOCK_DECL(int,connection_or_send_netinfo,(or_connection_t *conn));
+const var_cell_t *connection_or_get_certs_cell(int server,
+                                       const tor_x509_cert_t *link_cert,
+                                       const tor_x509_cert_t *id_cert);
+void connection_or_clear_certs_cell_cache(void);
 int connection_or_send_certs_cell(or_connection_t *conn);
 int connection_or_send_auth_challenge_cell(or_connection_t *conn);
 int connection_or_compute_authenticate_cell_body(or_connection_t *conn,
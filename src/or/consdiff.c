@@ -0,0 +1,556 @@
+/* Copyright (c) 2016, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file consdiff.c
+ * \brief Generate and apply diffs between consensus documents.
+ *
+ * A consensus changes only a little from one hour to the next, so a
+ * directory cache can save a lot of bandwidth by sending a client an
+ * ed-style diff against a consensus that the client already has, rather
+ * than the whole document.  A diff looks like:
+ *
+ * <pre>
+ *   network-status-diff-version 1
+ *   hash <hex digest of base> <hex digest of target>
+ *   <ed commands>
+ * </pre>
+ *
+ * where the digests are the SHA256 digests of the signed part of each
+ * consensus: the same digests that the authorities sign, and that we use
+ * to identify a consensus elsewhere.  We only emit "d", "a", and "c"
+ * commands, and we emit them from the end of the document to the start, so
+ * that the line numbers in one command are not disturbed by the commands
+ * before it.  When applying a diff we insist on that ordering, which lets
+ * us apply it in one forward pass over the base document.
+ *
+ * A consensus has tens of thousands of lines, so rather than running a
+ * general-purpose diff over the whole thing, we split each document into
+ * its header, one section per router entry (starting with the router's "r"
+ * line), and its footer.  Consensuses list routers sorted by identity, so
+ * we can pair up the sections of the two documents in a single merge pass,
+ * and only run a longest-common-subsequence diff on the handful of lines
+ * inside each pair of sections, and on the header and footer.  If the
+ * routers aren't sorted, the diff we generate is still correct, just
+ * larger.
+ **/
+
+#define CONSDIFF_PRIVATE
+
+#include "or.h"
+#include "consdiff.h"
+#include "routerparse.h"
+
+/** Don't run an LCS over a pair of line ranges whose lengths multiply to
+ * more than this; replace the whole range instead. */
+#define CONSDIFF_MAX_LCS_CELLS (1<<20)
+
+/** Split the string <b>s</b> into a newly allocated list of newly allocated
+ * lines, without their trailing newlines.  Return NULL if <b>s</b> is empty
+ * or does not end with a newline. */
+STATIC smartlist_t *
+consdiff_split_lines(const char *s)
+{
+  smartlist_t *lines;
+  size_t len = strlen(s);
+
+  if (!len || s[len-1] != '\n')
+    return NULL;
+
+  lines = smartlist_new();
+  while (*s) {
+    const char *eol = strchr(s, '\n');
+    smartlist_add(lines, tor_strndup(s, eol - s));
+    s = eol + 1;
+  }
+  return lines;
+}
+
+/** Return the value of the base64 digit <b>c</b>.  Characters that aren't
+ * base64 digits sort after all the ones that are. */
+static inline int
+base64_digit_value(char c)
+{
+  if (c >= 'A' && c <= 'Z')
+    return c - 'A';
+  if (c >= 'a' && c <= 'z')
+    return c - 'a' + 26;
+  if (c >= '0' && c <= '9')
+    return c - '0' + 52;
+  if (c == '+')
+    return 62;
+  if (c == '/')
+    return 63;
+  return 64 + (unsigned char)c;
+}
+
+/** Compare the base64-encoded identities <b>a</b> and <b>b</b> (of length
+ * <b>a_len</b> and <b>b_len</b>) in the order of the digests they encode,
+ * which is the order routers appear in a consensus.  Return negative, zero,
+ * or positive as for strcmp(). */
+STATIC int
+consdiff_compare_identities(const char *a, size_t a_len,
+                            const char *b, size_t b_len)
+{
+  size_t i;
+  for (i = 0; i < a_len && i < b_len; ++i) {
+    int va = base64_digit_value(a[i]), vb = base64_digit_value(b[i]);
+    if (va != vb)
+      return va < vb ? -1 : 1;
+  }
+  if (a_len == b_len)
+    return 0;
+  return a_len < b_len ? -1 : 1;
+}
+
+/** If <b>line</b> is a router's "r" line, return a pointer to its identity
+ * field and set *<b>len_out</b> to that field's length.  Otherwise return
+ * NULL. */
+static const char *
+router_line_get_identity(const char *line, size_t *len_out)
+{
+  const char *cp;
+  if (strcmpstart(line, "r "))
+    return NULL;
+  cp = strchr(line + 2, ' '); /* skip the nickname */
+  if (!cp)
+    return NULL;
+  ++cp;
+  *len_out = strcspn(cp, " ");
+  return cp;
+}
+
+/** Add a hunk replacing <b>base_len</b> base lines at <b>base_start</b> with
+ * <b>target_len</b> target lines at <b>target_start</b> to <b>hunks</b>,
+ * merging it into the last hunk if the two are adjacent. */
+static void
+hunks_add(smartlist_t *hunks, int base_start, int base_len,
+          int target_start, int target_len)
+{
+  consdiff_hunk_t *last = smartlist_len(hunks) ? smartlist_get(hunks,
+                                                 smartlist_len(hunks)-1)
+                                               : NULL;
+  if (last &&
+      last->base_start + last->base_len == base_start &&
+      last->target_start + last->target_len == target_start) {
+    last->base_len += base_len;
+    last->target_len += target_len;
+  } else {
+    consdiff_hunk_t *h = tor_malloc(sizeof(consdiff_hunk_t));
+    h->base_start = base_start;
+    h->base_len = base_len;
+    h->target_start = target_start;
+    h->target_len = target_len;
+    smartlist_add(hunks, h);
+  }
+}
+
+/** Add to <b>hunks</b> the changes needed to turn lines [<b>bs</b>,
+ * <b>be</b>) of <b>base</b> into lines [<b>ts</b>, <b>te</b>) of
+ * <b>target</b>, using a longest-common-subsequence diff when the ranges
+ * are small enough. */
+static void
+hunks_add_lcs(smartlist_t *hunks,
+              const smartlist_t *base, int bs, int be,
+              const smartlist_t *target, int ts, int te)
+{
+  int nb, nt, i, j;
+  uint32_t *lcs;
+
+  /* Trim the common prefix and suffix, which is usually most of it. */
+  while (bs < be && ts < te &&
+         !strcmp(smartlist_get(base, bs), smartlist_get(target, ts))) {
+    ++bs;
+    ++ts;
+  }
+  while (bs < be && ts < te &&
+         !strcmp(smartlist_get(base, be-1), smartlist_get(target, te-1))) {
+    --be;
+    --te;
+  }
+  nb = be - bs;
+  nt = te - ts;
+  if (!nb && !nt)
+    return;
+  if (!nb || !nt || (uint64_t)nb * nt > CONSDIFF_MAX_LCS_CELLS) {
+    hunks_add(hunks, bs, nb, ts, nt);
+    return;
+  }
+
+  /* lcs[i*(nt+1)+j] is the length of the LCS of base[bs+i..be) and
+   * target[ts+j..te). */
+#define LCS(i,j) lcs[(i)*(nt+1)+(j)]
+  lcs = tor_calloc((nb+1)*(nt+1), sizeof(uint32_t));
+  for (i = nb-1; i >= 0; --i) {
+    for (j = nt-1; j >= 0; --j) {
+      if (!strcmp(smartlist_get(base, bs+i), smartlist_get(target, ts+j)))
+        LCS(i,j) = LCS(i+1,j+1) + 1;
+      else
+        LCS(i,j) = MAX(LCS(i+1,j), LCS(i,j+1));
+    }
+  }
+  i = j = 0;
+  while (i < nb || j < nt) {
+    if (i < nb && j < nt &&
+        !strcmp(smartlist_get(base, bs+i), smartlist_get(target, ts+j))) {
+      ++i;
+      ++j;
+    } else if (j < nt && (i == nb || LCS(i,j+1) >= LCS(i+1,j))) {
+      hunks_add(hunks, bs+i, 0, ts+j, 1);
+      ++j;
+    } else {
+      hunks_add(hunks, bs+i, 1, ts+j, 0);
+      ++i;
+    }
+  }
+#undef LCS
+  tor_free(lcs);
+}
+
+/** Find the router sections in <b>lines</b>.  Set *<b>header_end_out</b> to
+ * the index of the first "r" line, and *<b>footer_start_out</b> to the index
+ * of the "directory-footer" line (or the first signature, or the end of the
+ * document).  Return a newly allocated array holding the index of each "r"
+ * line, and set *<b>n_out</b> to its length. */
+static int *
+find_router_sections(const smartlist_t *lines, int *header_end_out,
+                     int *footer_start_out, int *n_out)
+{
+  int n_lines = smartlist_len(lines);
+  int *starts = tor_calloc(n_lines + 1, sizeof(int));
+  int i, n = 0, footer_start = n_lines, header_end = -1;
+
+  for (i = 0; i < n_lines; ++i) {
+    const char *line = smartlist_get(lines, i);
+    if (!strcmpstart(line, "r ")) {
+      if (header_end < 0)
+        header_end = i;
+      starts[n++] = i;
+    } else if (!strcmp(line, "directory-footer") ||
+               !strcmpstart(line, "directory-signature ")) {
+      footer_start = i;
+      break;
+    }
+  }
+  *header_end_out = header_end < 0 ? footer_start : header_end;
+  *footer_start_out = footer_start;
+  *n_out = n;
+  return starts;
+}
+
+/** Return a newly allocated list of consdiff_hunk_t, in increasing order of
+ * position, that turns the lines in <b>base</b> into the lines in
+ * <b>target</b>. */
+STATIC smartlist_t *
+consdiff_find_hunks(const smartlist_t *base, const smartlist_t *target)
+{
+  smartlist_t *hunks = smartlist_new();
+  int b_hdr_end, b_footer, n_b, t_hdr_end, t_footer, n_t;
+  int *b_starts = find_router_sections(base, &b_hdr_end, &b_footer, &n_b);
+  int *t_starts = find_router_sections(target, &t_hdr_end, &t_footer, &n_t);
+  int i = 0, j = 0;
+
+  /* Each section runs up to the start of the next one. */
+  b_starts[n_b] = b_footer;
+  t_starts[n_t] = t_footer;
+
+  hunks_add_lcs(hunks, base, 0, b_hdr_end, target, 0, t_hdr_end);
+
+  while (i < n_b || j < n_t) {
+    int c;
+    if (i < n_b && j < n_t) {
+      size_t b_len = 0, t_len = 0;
+      const char *b_id =
+        router_line_get_identity(smartlist_get(base, b_starts[i]), &b_len);
+      const char *t_id =
+        router_line_get_identity(smartlist_get(target, t_starts[j]), &t_len);
+      if (b_id && t_id)
+        c = consdiff_compare_identities(b_id, b_len, t_id, t_len);
+      else
+        c = strcmp(smartlist_get(base, b_starts[i]),
+                   smartlist_get(target, t_starts[j]));
+    } else {
+      c = (i < n_b) ? -1 : 1;
+    }
+
+    if (c == 0) {
+      hunks_add_lcs(hunks, base, b_starts[i], b_starts[i+1],
+                    target, t_starts[j], t_starts[j+1]);
+      ++i;
+      ++j;
+    } else if (c < 0) {
+      /* This router is gone. */
+      hunks_add(hunks, b_starts[i], b_starts[i+1] - b_starts[i],
+                t_starts[j], 0);
+      ++i;
+    } else {
+      /* This router is new. */
+      hunks_add(hunks, b_starts[i], 0,
+                t_starts[j], t_starts[j+1] - t_starts[j]);
+      ++j;
+    }
+  }
+
+  hunks_add_lcs(hunks, base, b_footer, smartlist_len(base),
+                target, t_footer, smartlist_len(target));
+
+  tor_free(b_starts);
+  tor_free(t_starts);
+  return hunks;
+}
+
+/** Return true iff <b>s</b> looks like a consensus diff rather than a
+ * consensus. */
+int
+consdiff_looks_like_diff(const char *s)
+{
+  return !strcmpstart(s, CONSDIFF_FORMAT_LINE "\n");
+}
+
+/** Return a newly allocated diff that turns the consensus <b>base</b> into
+ * the consensus <b>target</b>, or NULL if we can't build one. */
+char *
+consdiff_gen_diff(const char *base, const char *target)
+{
+  common_digests_t base_digests, target_digests;
+  smartlist_t *base_lines = NULL, *target_lines = NULL, *hunks = NULL;
+  smartlist_t *out = NULL;
+  char base_hex[HEX_DIGEST256_LEN+1], target_hex[HEX_DIGEST256_LEN+1];
+  char *result = NULL;
+  int i, j;
+
+  if (router_get_networkstatus_v3_hashes(base, &base_digests) < 0 ||
+      router_get_networkstatus_v3_hashes(target, &target_digests) < 0) {
+    log_info(LD_DIR, "Can't compute the digest of a consensus to diff.");
+    goto done;
+  }
+  base_lines = consdiff_split_lines(base);
+  target_lines = consdiff_split_lines(target);
+  if (!base_lines || !target_lines) {
+    log_info(LD_DIR, "Consensus to diff doesn't end with a newline.");
+    goto done;
+  }
+
+  hunks = consdiff_find_hunks(base_lines, target_lines);
+
+  base16_encode(base_hex, sizeof(base_hex),
+                base_digests.d[DIGEST_SHA256], DIGEST256_LEN);
+  base16_encode(target_hex, sizeof(target_hex),
+                target_digests.d[DIGEST_SHA256], DIGEST256_LEN);
+  out = smartlist_new();
+  smartlist_add_asprintf(out, "%s\n", CONSDIFF_FORMAT_LINE);
+  smartlist_add_asprintf(out, "hash %s %s\n", base_hex, target_hex);
+
+  for (i = smartlist_len(hunks) - 1; i >= 0; --i) {
+    const consdiff_hunk_t *h = smartlist_get(hunks, i);
+    /* ed counts lines from 1. */
+    const int first = h->base_start + 1, last = h->base_start + h->base_len;
+    if (!h->target_len) {
+      if (first == last)
+        smartlist_add_asprintf(out, "%dd\n", first);
+      else
+        smartlist_add_asprintf(out, "%d,%dd\n", first, last);
+      continue;
+    }
+    if (!h->base_len)
+      smartlist_add_asprintf(out, "%da\n", h->base_start);
+    else if (first == last)
+      smartlist_add_asprintf(out, "%dc\n", first);
+    else
+      smartlist_add_asprintf(out, "%d,%dc\n", first, last);
+    for (j = h->target_start; j < h->target_start + h->target_len; ++j) {
+      const char *line = smartlist_get(target_lines, j);
+      if (!strcmp(line, ".")) {
+        /* ed can't insert a line holding only a dot. */
+        log_info(LD_DIR, "Can't diff a consensus with a lone-dot line.");
+        goto done;
+      }
+      smartlist_add_asprintf(out, "%s\n", line);
+    }
+    smartlist_add(out, tor_strdup(".\n"));
+  }
+
+  result = smartlist_join_strings(out, "", 0, NULL);
+
+ done:
+  if (base_lines) {
+    SMARTLIST_FOREACH(base_lines, char *, cp, tor_free(cp));
+    smartlist_free(base_lines);
+  }
+  if (target_lines) {
+    SMARTLIST_FOREACH(target_lines, char *, cp, tor_free(cp));
+    smartlist_free(target_lines);
+  }
+  if (hunks) {
+    SMARTLIST_FOREACH(hunks, consdiff_hunk_t *, h, tor_free(h));
+    smartlist_free(hunks);
+  }
+  if (out) {
+    SMARTLIST_FOREACH(out, char *, cp, tor_free(cp));
+    smartlist_free(out);
+  }
+  return result;
+}
+
+/** Parse the ed command at <b>line</b>, which applies to a document of
+ * <b>n_lines</b> lines, into <b>hunk</b> (leaving its target fields for the
+ * caller) and set *<b>cmd_out</b> to the command letter.  Return 0 on
+ * success and -1 if the command is malformed or out of range. */
+static int
+parse_ed_command(const char *line, int n_lines, consdiff_hunk_t *hunk,
+                 char *cmd_out)
+{
+  char *end = NULL;
+  long first, last;
+  int ok = 0;
+
+  first = tor_parse_long(line, 10, 0, INT_MAX, &ok, &end);
+  if (!ok)
+    return -1;
+  last = first;
+  if (*end == ',') {
+    last = tor_parse_long(end+1, 10, first, INT_MAX, &ok, &end);
+    if (!ok)
+      return -1;
+  }
+  if (end[0] == '\0' || end[1] != '\0')
+    return -1;
+  *cmd_out = end[0];
+
+  switch (end[0]) {
+    case 'a':
+      if (last != first || first > n_lines)
+        return -1;
+      hunk->base_start = (int)first;
+      hunk->base_len = 0;
+      break;
+    case 'c':
+    case 'd':
+      if (first < 1 || last > n_lines)
+        return -1;
+      hunk->base_start = (int)first - 1;
+      hunk->base_len = (int)(last - first + 1);
+      break;
+    default:
+      return -1;
+  }
+  return 0;
+}
+
+/** Apply the consensus diff <b>diff</b> to the consensus <b>base</b>, and
+ * return the resulting consensus as a newly allocated string.  Return NULL
+ * if the diff is malformed, if it wasn't made from <b>base</b>, or if the
+ * result isn't the consensus the diff says it should be. */
+char *
+consdiff_apply_diff(const char *base, const char *diff)
+{
+  common_digests_t digests;
+  uint8_t want_base[DIGEST256_LEN], want_target[DIGEST256_LEN];
+  smartlist_t *base_lines = NULL, *diff_lines = NULL, *hunks = NULL;
+  smartlist_t *hash_line = NULL, *out = NULL;
+  char *result = NULL;
+  int i, n_base, n_diff, pos, prev_start;
+
+  diff_lines = consdiff_split_lines(diff);
+  if (!diff_lines || smartlist_len(diff_lines) < 2 ||
+      strcmp(smartlist_get(diff_lines, 0), CONSDIFF_FORMAT_LINE)) {
+    log_info(LD_DIR, "Consensus diff has no valid format line.");
+    goto done;
+  }
+  hash_line = smartlist_new();
+  smartlist_split_string(hash_line, smartlist_get(diff_lines, 1), " ", 0, 0);
+  if (smartlist_len(hash_line) != 3 ||
+      strcmp(smartlist_get(hash_line, 0), "hash") ||
+      base16_decode((char*)want_base, sizeof(want_base),
+                    smartlist_get(hash_line, 1),
+                    strlen(smartlist_get(hash_line, 1))) != DIGEST256_LEN ||
+      base16_decode((char*)want_target, sizeof(want_target),
+                    smartlist_get(hash_line, 2),
+                    strlen(smartlist_get(hash_line, 2))) != DIGEST256_LEN) {
+    log_info(LD_DIR, "Consensus diff has no valid hash line.");
+    goto done;
+  }
+
+  if (router_get_networkstatus_v3_hashes(base, &digests) < 0 ||
+      tor_memneq(digests.d[DIGEST_SHA256], want_base, DIGEST256_LEN)) {
+    log_info(LD_DIR, "Consensus diff doesn't apply to the consensus we "
+             "have.");
+    goto done;
+  }
+  base_lines = consdiff_split_lines(base);
+  if (!base_lines)
+    goto done;
+  n_base = smartlist_len(base_lines);
+  n_diff = smartlist_len(diff_lines);
+
+  /* Parse the commands, making sure that each one comes before the last. */
+  hunks = smartlist_new();
+  prev_start = n_base;
+  for (i = 2; i < n_diff; ++i) {
+    consdiff_hunk_t *h = tor_malloc_zero(sizeof(consdiff_hunk_t));
+    char cmd = 0;
+    smartlist_add(hunks, h);
+    if (parse_ed_command(smartlist_get(diff_lines, i), n_base, h, &cmd) < 0 ||
+        h->base_start + h->base_len > prev_start) {
+      log_info(LD_DIR, "Bad or misordered command in consensus diff: %s",
+               escaped(smartlist_get(diff_lines, i)));
+      goto done;
+    }
+    prev_start = h->base_start;
+    if (cmd == 'd')
+      continue;
+    /* For "a" and "c", the new lines follow, up to a lone dot. */
+    h->target_start = i + 1;
+    while (++i < n_diff && strcmp(smartlist_get(diff_lines, i), "."))
+      ++h->target_len;
+    if (i == n_diff) {
+      log_info(LD_DIR, "Unterminated command in consensus diff.");
+      goto done;
+    }
+  }
+
+  /* The commands are in reverse order; walk them back to front, so that we
+   * walk the base document front to back. */
+  out = smartlist_new();
+  pos = 0;
+  for (i = smartlist_len(hunks) - 1; i >= 0; --i) {
+    const consdiff_hunk_t *h = smartlist_get(hunks, i);
+    int k;
+    for (k = pos; k < h->base_start; ++k)
+      smartlist_add(out, smartlist_get(base_lines, k));
+    for (k = h->target_start; k < h->target_start + h->target_len; ++k)
+      smartlist_add(out, smartlist_get(diff_lines, k));
+    pos = h->base_start + h->base_len;
+  }
+  for ( ; pos < n_base; ++pos)
+    smartlist_add(out, smartlist_get(base_lines, pos));
+
+  result = smartlist_join_strings(out, "\n", 1, NULL);
+  if (router_get_networkstatus_v3_hashes(result, &digests) < 0 ||
+      tor_memneq(digests.d[DIGEST_SHA256], want_target, DIGEST256_LEN)) {
+    log_info(LD_DIR, "Consensus diff didn't produce the consensus it "
+             "promised.");
+    tor_free(result);
+  }
+
+ done:
+  if (diff_lines) {
+    SMARTLIST_FOREACH(diff_lines, char *, cp, tor_free(cp));
+    smartlist_free(diff_lines);
+  }
+  if (base_lines) {
+    SMARTLIST_FOREACH(base_lines, char *, cp, tor_free(cp));
+    smartlist_free(base_lines);
+  }
+  if (hash_line) {
+    SMARTLIST_FOREACH(hash_line, char *, cp, tor_free(cp));
+    smartlist_free(hash_line);
+  }
+  if (hunks) {
+    SMARTLIST_FOREACH(hunks, consdiff_hunk_t *, h, tor_free(h));
+    smartlist_free(hunks);
+  }
+  smartlist_free(out);
+  return result;
+}
+
@@ -0,0 +1,43 @@
+/* Copyright (c) 2016, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file consdiff.h
+ * \brief Headers for consdiff.c
+ **/
+
+#ifndef TOR_CONSDIFF_H
+#define TOR_CONSDIFF_H
+
+#include "or.h"
+
+/** The first line of every consensus diff. */
+#define CONSDIFF_FORMAT_LINE "network-status-diff-version 1"
+
+/** The HTTP header a client uses to tell a directory cache which consensus
+ * it already has, as the hex SHA256 digest of its signed part. */
+#define X_OR_DIFF_FROM_CONSENSUS_HEADER "X-Or-Diff-From-Consensus: "
+
+char *consdiff_gen_diff(const char *base, const char *target);
+char *consdiff_apply_diff(const char *base, const char *diff);
+int consdiff_looks_like_diff(const char *s);
+
+#ifdef CONSDIFF_PRIVATE
+/** A run of lines in the base document that a diff replaces with a run of
+ * lines from the target document.  Either run may be empty. */
+typedef struct consdiff_hunk_t {
+  int base_start; /**< Index of the first base line replaced. */
+  int base_len; /**< Number of base lines replaced. */
+  int target_start; /**< Index of the first target line inserted. */
+  int target_len; /**< Number of target lines inserted. */
+} consdiff_hunk_t;
+
+STATIC smartlist_t *consdiff_split_lines(const char *s);
+STATIC smartlist_t *consdiff_find_hunks(const smartlist_t *base,
+                                        const smartlist_t *target);
+STATIC int consdiff_compare_identities(const char *a, size_t a_len,
+                                       const char *b, size_t b_len);
+#endif
+
+#endif
+
@@ -51,17 +51,22 @@
 #include "connection_edge.h"
 #include "connection_or.h"
 #include "control.h"
+#include "cpuworker.h"
 #include "directory.h"
 #include "dirserv.h"
 #include "dnsserv.h"
 #include "entrynodes.h"
 #include "geoip.h"
 #include "hibernate.h"
+#include "latency_trace.h"
 #include "main.h"
+#include "memacct.h"
 #include "networkstatus.h"
 #include "nodelist.h"
+#include "onion.h"
 #include "policies.h"
 #include "reasons.h"
+#include "relay.h"
 #include "rendclient.h"
 #include "rendcommon.h"
 #include "rendservice.h"
@@ -69,6 +74,7 @@
 #include "router.h"
 #include "routerlist.h"
 #include "routerparse.h"
+#include "watchdog.h"
 
 #ifndef _WIN32
 #include <pwd.h>
@@ -78,6 +84,7 @@
 #include <event2/event.h>
 
 #include "crypto_s2k.h"
+#include "aes.h"
 #include "procmon.h"
 
 /** Yield true iff <b>s</b> is the state of a control_connection_t that has
@@ -403,6 +410,63 @@ write_escaped_data(const char *data, size_t len, char **out)
   return outp - *out;
 }
 
+/** Size of the stack buffer that write_escaped_data_to_conn() escapes
+ * into before handing bytes to the connection. */
+#define ESCAPED_DATA_CHUNK_LEN 4096
+
+/** As write_escaped_data(), but write the escaped form of the
+ * <b>len</b>-character string in <b>data</b> directly onto the outbuf of
+ * <b>conn</b>, a chunk at a time, rather than building a second heap copy
+ * of the whole (possibly multi-megabyte) answer. */
+STATIC void
+write_escaped_data_to_conn(const char *data, size_t len,
+                           control_connection_t *conn)
+{
+  char chunk[ESCAPED_DATA_CHUNK_LEN];
+  size_t n = 0;
+  const char *start = data, *end = data + len;
+  int start_of_line = 1;
+  /* The last two bytes we have emitted, and how many bytes that was. */
+  char prev1 = 0, prev2 = 0;
+  size_t n_written = 0;
+
+#define PUT_ESCAPED_CHAR(c) STMT_BEGIN                  \
+    chunk[n++] = (c);                                   \
+    prev2 = prev1;                                      \
+    prev1 = (c);                                        \
+    ++n_written;                                        \
+  STMT_END
+
+  while (data < end) {
+    /* Each input byte expands to at most two output bytes. */
+    if (n + 2 > sizeof(chunk)) {
+      connection_write_to_buf(chunk, n, TO_CONN(conn));
+      n = 0;
+    }
+    if (*data == '\n') {
+      if (data > start && data[-1] != '\r')
+        PUT_ESCAPED_CHAR('\r');
+      start_of_line = 1;
+    } else if (*data == '.') {
+      if (start_of_line) {
+        start_of_line = 0;
+        PUT_ESCAPED_CHAR('.');
+      }
+    } else {
+      start_of_line = 0;
+    }
+    PUT_ESCAPED_CHAR(*data);
+    ++data;
+  }
+#undef PUT_ESCAPED_CHAR
+  if (n)
+    connection_write_to_buf(chunk, n, TO_CONN(conn));
+  if (n_written < 2 || prev2 != '\r' || prev1 != '\n')
+    connection_write_str_to_buf("\r\n.\r\n", conn);
+  else
+    connection_write_str_to_buf(".\r\n", conn);
+}
+
 /** Given a <b>len</b>-character string in <b>data</b>, made of lines
  * terminated by CRLF, allocate a new string in *<b>out</b>, and copy
  * the contents of <b>data</b> into *<b>out</b>, removing any period
@@ -624,6 +688,9 @@ static tor_threadlocal_t block_event_queue_flag;
  * to one or more controllers */
 static smartlist_t *queued_control_events = NULL;
 
+/** Approximate number of bytes held by queued_control_events. */
+static size_t queued_control_events_allocation = 0;
+
 /** True if the flush_queued_events_event is pending. */
 static int flush_queued_event_pending = 0;
 
@@ -705,6 +772,7 @@ queue_control_event_string,(uint16_t event, char *msg))
   tor_mutex_acquire(queued_control_events_lock);
   tor_assert(queued_control_events);
   smartlist_add(queued_control_events, ev);
+  queued_control_events_allocation += sizeof(*ev) + strlen(msg) + 1;
 
   int activate_event = 0;
   if (! flush_queued_event_pending && in_main_thread()) {
@@ -726,6 +794,20 @@ queue_control_event_string,(uint16_t event, char *msg))
   }
 }
 
+/** Return the approximate number of bytes held by events waiting to be
+ * sent to controllers. */
+size_t
+control_get_queued_event_allocation(void)
+{
+  size_t n;
+  if (!queued_control_events_lock)
+    return 0;
+  tor_mutex_acquire(queued_control_events_lock);
+  n = queued_control_events_allocation;
+  tor_mutex_release(queued_control_events_lock);
+  return n;
+}
+
 /** Release all storage held by <b>ev</b>. */
 static void
 queued_event_free(queued_event_t *ev)
@@ -740,8 +822,11 @@ queued_event_free(queued_event_t *ev)
 /** Send every queued event to every controller that's interested in it,
  * and remove the events from the queue.  If <b>force</b> is true,
  * then make all controllers send their data out immediately, since we
- * may be about to shut down. */
-static void
+ * may be about to shut down.
+ *
+ * Each controller gets all of its events in a single write; controllers
+ * that want the same events share the string we build for that write. */
+STATIC void
 queued_events_flush_all(int force)
 {
   if (PREDICT_UNLIKELY(queued_control_events == NULL)) {
@@ -759,6 +844,7 @@ queued_events_flush_all(int force)
   flush_queued_event_pending = 0;
   queued_events = queued_control_events;
   queued_control_events = smartlist_new();
+  queued_control_events_allocation = 0;
   tor_mutex_release(queued_control_events_lock);
 
   /* Gather all the controllers that will care... */
@@ -772,18 +858,43 @@ queued_events_flush_all(int force)
     }
   } SMARTLIST_FOREACH_END(conn);
 
-  SMARTLIST_FOREACH_BEGIN(queued_events, queued_event_t *, ev) {
-    const event_mask_t bit = ((event_mask_t)1) << ev->event;
-    const size_t msg_len = strlen(ev->msg);
-    SMARTLIST_FOREACH_BEGIN(controllers, control_connection_t *,
-                            control_conn) {
-      if (control_conn->event_mask & bit) {
-        connection_write_to_buf(ev->msg, msg_len, TO_CONN(control_conn));
+  /* batches[i] is the text we wrote to the i'th controller, or NULL if it
+   * wanted nothing or reused an earlier controller's text. */
+  smartlist_t *batches = smartlist_new();
+  SMARTLIST_FOREACH_BEGIN(controllers, control_connection_t *,
+                          control_conn) {
+    const event_mask_t mask = control_conn->event_mask;
+    const char *batch = NULL;
+    char *new_batch = NULL;
+
+    SMARTLIST_FOREACH_BEGIN(controllers, control_connection_t *, other) {
+      if (other_sl_idx >= control_conn_sl_idx)
+        break;
+      if (other->event_mask == mask) {
+        batch = smartlist_get(batches, other_sl_idx);
+        break;
       }
-    } SMARTLIST_FOREACH_END(control_conn);
+    } SMARTLIST_FOREACH_END(other);
+
+    if (!batch) {
+      smartlist_t *msgs = smartlist_new();
+      SMARTLIST_FOREACH(queued_events, queued_event_t *, ev,
+                        if (mask & (((event_mask_t)1) << ev->event))
+                          smartlist_add(msgs, ev->msg));
+      if (smartlist_len(msgs))
+        batch = new_batch = smartlist_join_strings(msgs, "", 0, NULL);
+      smartlist_free(msgs);
+    }
+    smartlist_add(batches, new_batch);
+
+    if (batch)
+      connection_write_to_buf(batch, strlen(batch), TO_CONN(control_conn));
+  } SMARTLIST_FOREACH_END(control_conn);
 
-    queued_event_free(ev);
-  } SMARTLIST_FOREACH_END(ev);
+  SMARTLIST_FOREACH(batches, char *, b, tor_free(b));
+  smartlist_free(batches);
+  SMARTLIST_FOREACH(queued_events, queued_event_t *, ev,
+                    queued_event_free(ev));
 
   if (force) {
     SMARTLIST_FOREACH_BEGIN(controllers, control_connection_t *,
@@ -855,6 +966,22 @@ send_control_event(uint16_t event,
   va_end(ap);
 }
 
+/** Send the events in <b>lines</b>, each a complete event line of type
+ * <b>event</b>, to all v1 controllers that are listening for it, as a
+ * single queued event; then free and clear <b>lines</b>.  Used by events
+ * that we send for many streams, circuits, or connections at once, so that
+ * we only queue them once per tick. */
+static void
+send_control_event_lines(uint16_t event, smartlist_t *lines)
+{
+  if (smartlist_len(lines)) {
+    queue_control_event_string(event,
+                               smartlist_join_strings(lines, "", 0, NULL));
+    SMARTLIST_FOREACH(lines, char *, cp, tor_free(cp));
+    smartlist_clear(lines);
+  }
+}
+
 /** Given a text circuit <b>id</b>, return the corresponding circuit. */
 static origin_circuit_t *
 get_circ(const char *id)
@@ -1163,6 +1290,9 @@ static const struct control_event_t control_event_table[] = {
   { EVENT_HS_DESC, "HS_DESC" },
   { EVENT_HS_DESC_CONTENT, "HS_DESC_CONTENT" },
   { EVENT_NETWORK_LIVENESS, "NETWORK_LIVENESS" },
+  { EVENT_QUEUE_DELAY, "QUEUE_DELAY" },
+  { EVENT_CPUWORKER_TIMING, "CPUWORKER_TIMING" },
+  { EVENT_CHAN_STATS, "CHAN_STATS" },
   { 0, NULL },
 };
 
@@ -1653,6 +1783,31 @@ handle_control_mapaddress(control_connection_t *conn, uint32_t len,
   return 0;
 }
 
+/** Return a newly allocated string with one line for each TLS channel
+ * that we have samples of, for the "channel/stats" GETINFO key. */
+static char *
+getinfo_channel_stats(void)
+{
+  const smartlist_t *chans = channel_list_get_all();
+  smartlist_t *lines = smartlist_new();
+  char *result;
+
+  if (chans) {
+    SMARTLIST_FOREACH_BEGIN(chans, channel_t *, chan) {
+      char *line;
+      if (chan->magic != TLS_CHAN_MAGIC)
+        continue;
+      line = channel_tls_format_stats_history(BASE_CHAN_TO_TLS(chan));
+      if (line)
+        smartlist_add(lines, line);
+    } SMARTLIST_FOREACH_END(chan);
+  }
+  result = smartlist_join_strings(lines, "\n", 0, NULL);
+  SMARTLIST_FOREACH(lines, char *, cp, tor_free(cp));
+  smartlist_free(lines);
+  return result;
+}
+
 /** Implementation helper for GETINFO: knows the answers for various
  * trivial-to-implement questions. */
 static int
@@ -1676,6 +1831,11 @@ getinfo_helper_misc(control_connection_t *conn, const char *question,
     *answer = options_dump(get_options(), OPTIONS_DUMP_MINIMAL);
   } else if (!strcmp(question, "info/names")) {
     *answer = list_getinfo_options();
+  } else if (!strcmp(question, "aes/implementation")) {
+    *answer = tor_strdup(aes_get_implementation_name());
+  } else if (!strcmp(question, "aes/throughput")) {
+    tor_asprintf(answer, U64_FORMAT,
+                 U64_PRINTF_ARG(aes_get_measured_throughput()));
   } else if (!strcmp(question, "dormant")) {
     int dormant = rep_hist_circbuilding_dormant(time(NULL));
     *answer = tor_strdup(dormant ? "1" : "0");
@@ -1746,6 +1906,20 @@ getinfo_helper_misc(control_connection_t *conn, const char *question,
   } else if (!strcmp(question, "process/descriptor-limit")) {
     int max_fds = get_max_sockets();
     tor_asprintf(answer, "%d", max_fds);
+  } else if (!strcmp(question, "process/cpus")) {
+    *answer = cpuworker_get_cpu_info();
+  } else if (!strcmp(question, "latency/histograms")) {
+    *answer = latency_trace_format();
+  } else if (!strcmp(question, "memory/breakdown")) {
+    *answer = memacct_format_breakdown();
+  } else if (!strcmp(question, "mainloop/stalls")) {
+    *answer = watchdog_format_stats();
+  } else if (!strcmp(question, "onion-queue/stats")) {
+    *answer = onion_queue_get_stats();
+  } else if (!strcmp(question, "cpuworker/timing")) {
+    *answer = cpuworker_timing_format();
+  } else if (!strcmp(question, "channel/stats")) {
+    *answer = getinfo_channel_stats();
   } else if (!strcmp(question, "limits/max-mem-in-queues")) {
     tor_asprintf(answer, U64_FORMAT,
                  U64_PRINTF_ARG(get_options()->MaxMemInQueues));
@@ -2489,14 +2663,13 @@ circuit_describe_status_for_controller(origin_circuit_t *circ)
 {
   char *rv;
   smartlist_t *descparts = smartlist_new();
+  /* The path string belongs to circ, so we mustn't free it with the rest. */
+  const char *vpath = circuit_get_path_for_controller(circ);
+  const int have_path = *vpath != '\0';
 
-  {
-    char *vpath = circuit_list_path_for_controller(circ);
-    if (*vpath) {
-      smartlist_add(descparts, vpath);
-    } else {
-      tor_free(vpath); /* empty path; don't put an extra space in the result */
-    }
+  if (have_path) {
+    /* Empty paths are left out, so there's no extra space in the result. */
+    smartlist_add(descparts, (char *)vpath);
   }
 
   {
@@ -2567,6 +2740,8 @@ circuit_describe_status_for_controller(origin_circuit_t *circ)
 
   rv = smartlist_join_strings(descparts, " ", 0, NULL);
 
+  if (have_path)
+    smartlist_del_keeporder(descparts, 0);
   SMARTLIST_FOREACH(descparts, char *, cp, tor_free(cp));
   smartlist_free(descparts);
 
@@ -2629,6 +2804,7 @@ getinfo_helper_events(control_connection_t *control_conn,
         {
         case AP_CONN_STATE_CONTROLLER_WAIT:
         case AP_CONN_STATE_CIRCUIT_WAIT:
+        case AP_CONN_STATE_DNS_CACHE_WAIT:
           if (conn->socks_request &&
               SOCKS_COMMAND_IS_RESOLVE(conn->socks_request->command))
             state = "NEWRESOLVE";
@@ -2818,7 +2994,8 @@ getinfo_helper_events(control_connection_t *control_conn,
 }
 
 /** Implementation helper for GETINFO: knows how to enumerate hidden services
- * created via the control port. */
+ * created via the control port, and how to report what our hidden services
+ * have cost us. */
 static int
 getinfo_helper_onions(control_connection_t *control_conn,
                       const char *question, char **answer,
@@ -2826,6 +3003,15 @@ getinfo_helper_onions(control_connection_t *control_conn,
 {
   smartlist_t *onion_list = NULL;
 
+  if (!strcmp(question, "onions/stats")) {
+    *answer = rend_service_get_stats_string();
+    if (!*answer) {
+      *errmsg = "No onion services configured.";
+      return -1;
+    }
+    return 0;
+  }
+
   if (control_conn && !strcmp(question, "onions/current")) {
     onion_list = control_conn->ephemeral_onion_services;
   } else if (!strcmp(question, "onions/detached")) {
@@ -2899,6 +3085,10 @@ static const getinfo_item_t getinfo_items[] = {
   ITEM("config-defaults-file", misc, "Current location of the defaults file."),
   ITEM("config-text", misc,
        "Return the string that would be written by a saveconf command."),
+  ITEM("aes/implementation", misc,
+       "Which AES counter-mode implementation we picked at startup."),
+  ITEM("aes/throughput", misc,
+       "Bytes per second the chosen AES implementation managed at startup."),
   ITEM("accounting/bytes", accounting,
        "Number of bytes read/written so far in the accounting interval."),
   ITEM("accounting/bytes-left", accounting,
@@ -3035,7 +3225,24 @@ static const getinfo_item_t getinfo_items[] = {
   ITEM("process/user", misc,
        "Username under which the tor process is running."),
   ITEM("process/descriptor-limit", misc, "File descriptor limit."),
+  ITEM("process/cpus", misc,
+       "CPUs that the main thread and each cpuworker last ran on."),
+  ITEM("latency/histograms", misc,
+       "How long hot-path event handlers have taken, as histograms."),
+  ITEM("memory/breakdown", misc,
+       "Approximate bytes held by each subsystem, one per line."),
+  ITEM("mainloop/stalls", misc,
+       "How often and how long the main loop has stalled."),
   ITEM("limits/max-mem-in-queues", misc, "Actual limit on memory in queues"),
+  ITEM("onion-queue/stats", misc,
+       "Pending, processed, refused and expired create requests, and how "
+       "long recent ones waited in msec."),
+  ITEM("cpuworker/timing", misc,
+       "How long onion handshakes have waited for, run on, and come back "
+       "from the cpuworkers, as histograms."),
+  ITEM("channel/stats", misc,
+       "Recent throughput, queue depths and RTTs of each TLS channel, while "
+       "a controller listens for CHAN_STATS events."),
   PREFIX("desc-annotations/id/", dir, "Router annotations by hexdigest."),
   PREFIX("dir/server/", dir,"Router descriptors as retrieved from a DirPort."),
   PREFIX("dir/status/", dir,
@@ -3058,6 +3265,8 @@ static const getinfo_item_t getinfo_items[] = {
        "Onion services owned by the current control connection."),
   ITEM("onions/detached", onions,
        "Onion services detached from the control connection."),
+  ITEM("onions/stats", onions,
+       "Per-service introduction, rendezvous, bandwidth and CPU counters."),
   { NULL, NULL, NULL, 0 }
 };
 
@@ -3162,13 +3371,15 @@ handle_control_getinfo(control_connection_t *conn, uint32_t len,
       connection_write_str_to_buf(v, conn);
       connection_write_str_to_buf("\r\n", conn);
     } else {
-      char *esc = NULL;
-      size_t esc_len;
-      esc_len = write_escaped_data(v, strlen(v), &esc);
       connection_printf_to_buf(conn, "250+%s=\r\n", k);
-      connection_write_to_buf(esc, esc_len, TO_CONN(conn));
-      tor_free(esc);
+      write_escaped_data_to_conn(v, strlen(v), conn);
     }
+    /* Large answers (ns/all, md/all, ...) can be many megabytes: release
+     * each one as soon as it is on the outbuf. */
+    tor_free(k);
+    tor_free(v);
+    smartlist_set(answers, i, NULL);
+    smartlist_set(answers, i+1, NULL);
   }
   connection_write_str_to_buf("250 OK\r\n", conn);
 
@@ -3509,6 +3720,7 @@ handle_control_attachstream(control_connection_t *conn, uint32_t len,
       circuit_detach_stream(tmpcirc, edge_conn);
     CONNECTION_AP_EXPECT_NONPENDING(ap_conn);
     TO_CONN(edge_conn)->state = AP_CONN_STATE_CONTROLLER_WAIT;
+    connection_schedule_housekeeping(TO_CONN(edge_conn));
   }
 
   if (circ && (circ->base_.state != CIRCUIT_STATE_OPEN)) {
@@ -5494,6 +5706,7 @@ control_event_stream_bandwidth_used(void)
 {
   if (EVENT_IS_INTERESTING(EVENT_STREAM_BANDWIDTH_USED)) {
     smartlist_t *conns = get_connection_array();
+    smartlist_t *lines = smartlist_new();
     edge_connection_t *edge_conn;
 
     SMARTLIST_FOREACH_BEGIN(conns, connection_t *, conn)
@@ -5504,7 +5717,7 @@ control_event_stream_bandwidth_used(void)
         if (!edge_conn->n_read && !edge_conn->n_written)
           continue;
 
-        send_control_event(EVENT_STREAM_BANDWIDTH_USED,
+        smartlist_add_asprintf(lines,
                            "650 STREAM_BW "U64_FORMAT" %lu %lu\r\n",
                            U64_PRINTF_ARG(edge_conn->base_.global_identifier),
                            (unsigned long)edge_conn->n_read,
@@ -5513,6 +5726,9 @@ control_event_stream_bandwidth_used(void)
         edge_conn->n_written = edge_conn->n_read = 0;
     }
     SMARTLIST_FOREACH_END(conn);
+
+    send_control_event_lines(EVENT_STREAM_BANDWIDTH_USED, lines);
+    smartlist_free(lines);
   }
 
   return 0;
@@ -5524,16 +5740,18 @@ int
 control_event_circ_bandwidth_used(void)
 {
   origin_circuit_t *ocirc;
+  smartlist_t *lines;
   if (!EVENT_IS_INTERESTING(EVENT_CIRC_BANDWIDTH_USED))
     return 0;
 
+  lines = smartlist_new();
   SMARTLIST_FOREACH_BEGIN(circuit_get_global_list(), circuit_t *, circ) {
     if (!CIRCUIT_IS_ORIGIN(circ))
       continue;
     ocirc = TO_ORIGIN_CIRCUIT(circ);
     if (!ocirc->n_read_circ_bw && !ocirc->n_written_circ_bw)
       continue;
-    send_control_event(EVENT_CIRC_BANDWIDTH_USED,
+    smartlist_add_asprintf(lines,
                        "650 CIRC_BW ID=%d READ=%lu WRITTEN=%lu\r\n",
                        ocirc->global_identifier,
                        (unsigned long)ocirc->n_read_circ_bw,
@@ -5542,20 +5760,21 @@ control_event_circ_bandwidth_used(void)
   }
   SMARTLIST_FOREACH_END(circ);
 
+  send_control_event_lines(EVENT_CIRC_BANDWIDTH_USED, lines);
+  smartlist_free(lines);
   return 0;
 }
 
-/** Print out CONN_BW event for a single OR/DIR/EXIT <b>conn</b> and reset
-  * bandwidth counters. */
-int
-control_event_conn_bandwidth(connection_t *conn)
+/** Return a CONN_BW event line for a single OR/DIR/EXIT <b>conn</b> and
+ * reset its bandwidth counters, or return NULL if there is nothing to
+ * report for it. */
+static char *
+conn_bandwidth_event_line(connection_t *conn)
 {
   const char *conn_type_str;
-  if (!get_options()->TestingEnableConnBwEvent ||
-      !EVENT_IS_INTERESTING(EVENT_CONN_BW))
-    return 0;
+  char *line = NULL;
   if (!conn->n_read_conn_bw && !conn->n_written_conn_bw)
-    return 0;
+    return NULL;
   switch (conn->type) {
     case CONN_TYPE_OR:
       conn_type_str = "OR";
@@ -5567,16 +5786,30 @@ control_event_conn_bandwidth(connection_t *conn)
       conn_type_str = "EXIT";
       break;
     default:
-      return 0;
-  }
-  send_control_event(EVENT_CONN_BW,
-                     "650 CONN_BW ID="U64_FORMAT" TYPE=%s "
-                     "READ=%lu WRITTEN=%lu\r\n",
-                     U64_PRINTF_ARG(conn->global_identifier),
-                     conn_type_str,
-                     (unsigned long)conn->n_read_conn_bw,
-                     (unsigned long)conn->n_written_conn_bw);
+      return NULL;
+  }
+  tor_asprintf(&line,
+               "650 CONN_BW ID="U64_FORMAT" TYPE=%s "
+               "READ=%lu WRITTEN=%lu\r\n",
+               U64_PRINTF_ARG(conn->global_identifier),
+               conn_type_str,
+               (unsigned long)conn->n_read_conn_bw,
+               (unsigned long)conn->n_written_conn_bw);
   conn->n_written_conn_bw = conn->n_read_conn_bw = 0;
+  return line;
+}
+
+/** Print out CONN_BW event for a single OR/DIR/EXIT <b>conn</b> and reset
+  * bandwidth counters. */
+int
+control_event_conn_bandwidth(connection_t *conn)
+{
+  char *line;
+  if (!get_options()->TestingEnableConnBwEvent ||
+      !EVENT_IS_INTERESTING(EVENT_CONN_BW))
+    return 0;
+  if ((line = conn_bandwidth_event_line(conn)))
+    queue_control_event_string(EVENT_CONN_BW, line);
   return 0;
 }
 
@@ -5587,8 +5820,14 @@ control_event_conn_bandwidth_used(void)
 {
   if (get_options()->TestingEnableConnBwEvent &&
       EVENT_IS_INTERESTING(EVENT_CONN_BW)) {
-    SMARTLIST_FOREACH(get_connection_array(), connection_t *, conn,
-                      control_event_conn_bandwidth(conn));
+    smartlist_t *lines = smartlist_new();
+    SMARTLIST_FOREACH_BEGIN(get_connection_array(), connection_t *, conn) {
+      char *line = conn_bandwidth_event_line(conn);
+      if (line)
+        smartlist_add(lines, line);
+    } SMARTLIST_FOREACH_END(conn);
+    send_control_event_lines(EVENT_CONN_BW, lines);
+    smartlist_free(lines);
   }
   return 0;
 }
@@ -5705,24 +5944,199 @@ control_event_circuit_cell_stats(void)
 {
   cell_stats_t *cell_stats;
   char *event_string;
+  smartlist_t *lines;
   if (!get_options()->TestingEnableCellStatsEvent ||
       !EVENT_IS_INTERESTING(EVENT_CELL_STATS))
     return 0;
-  cell_stats = tor_malloc(sizeof(cell_stats_t));;
+  cell_stats = tor_malloc(sizeof(cell_stats_t));
+  lines = smartlist_new();
   SMARTLIST_FOREACH_BEGIN(circuit_get_global_list(), circuit_t *, circ) {
     if (!circ->testing_cell_stats)
       continue;
     sum_up_cell_stats_by_command(circ, cell_stats);
     format_cell_stats(&event_string, circ, cell_stats);
-    send_control_event(EVENT_CELL_STATS,
-                       "650 CELL_STATS %s\r\n", event_string);
+    smartlist_add_asprintf(lines, "650 CELL_STATS %s\r\n", event_string);
     tor_free(event_string);
   }
   SMARTLIST_FOREACH_END(circ);
+  send_control_event_lines(EVENT_CELL_STATS, lines);
+  smartlist_free(lines);
   tor_free(cell_stats);
   return 0;
 }
 
+/** Helper for control_event_queue_delay() and
+ * control_event_cpuworker_timing(): add a line for event <b>event</b>
+ * describing <b>hist</b> to <b>lines</b>.  <b>what</b> names the queue or
+ * queues it describes. */
+static void
+latency_hist_add_event_line(smartlist_t *lines, const char *event,
+                            const char *what, const latency_hist_t *hist)
+{
+  char *buckets = latency_hist_format_buckets(hist);
+  uint64_t p50 = latency_hist_percentile_usec(hist, .5);
+  uint64_t p90 = latency_hist_percentile_usec(hist, .9);
+  uint64_t p99 = latency_hist_percentile_usec(hist, .99);
+  smartlist_add_asprintf(lines,
+                         "650 %s %s Count="U64_FORMAT
+                         " P50="U64_FORMAT" P90="U64_FORMAT
+                         " P99="U64_FORMAT" Max="U64_FORMAT
+                         " Buckets=%s\r\n",
+                         event, what, U64_PRINTF_ARG(hist->n),
+                         U64_PRINTF_ARG(p50), U64_PRINTF_ARG(p90),
+                         U64_PRINTF_ARG(p99),
+                         U64_PRINTF_ARG(hist->max_nsec / 1000),
+                         buckets);
+  tor_free(buckets);
+}
+
+/** A second or more has elapsed: tell any interested control connections
+ * how long cells have waited in our circuit queues, channel queues, and
+ * outbufs since the last time we were called, both in total and for each
+ * channel's circuits.  Then start a new interval. */
+int
+control_event_queue_delay(void)
+{
+  const smartlist_t *chans = channel_list_get_all();
+  int interesting = EVENT_IS_INTERESTING(EVENT_QUEUE_DELAY);
+  smartlist_t *lines = NULL;
+  int kind;
+
+  if (interesting)
+    lines = smartlist_new();
+
+  for (kind = QUEUE_DELAY_CIRCUIT; kind < QUEUE_DELAY_N_KINDS; ++kind) {
+    const latency_hist_t *hist = queue_delay_get_hist(kind);
+    char *what;
+    if (!interesting || !hist->n)
+      continue;
+    tor_asprintf(&what, "Queue=%s", queue_delay_kind_name(kind));
+    latency_hist_add_event_line(lines, "QUEUE_DELAY", what, hist);
+    tor_free(what);
+  }
+
+  if (chans) {
+    SMARTLIST_FOREACH_BEGIN(chans, channel_t *, chan) {
+      char *what;
+      if (!chan->circ_queue_delay)
+        continue;
+      if (interesting && chan->circ_queue_delay->n) {
+        tor_asprintf(&what, "Queue=circuit ChannelID="U64_FORMAT,
+                     U64_PRINTF_ARG(chan->global_identifier));
+        latency_hist_add_event_line(lines, "QUEUE_DELAY", what,
+                                    chan->circ_queue_delay);
+        tor_free(what);
+      }
+      /* Free these rather than clearing them, so that channels stop
+       * paying for them once nobody is listening. */
+      tor_free(chan->circ_queue_delay);
+    } SMARTLIST_FOREACH_END(chan);
+  }
+
+  if (lines) {
+    send_control_event_lines(EVENT_QUEUE_DELAY, lines);
+    smartlist_free(lines);
+  }
+  queue_delay_reset();
+  return 0;
+}
+
+/** A second or more has elapsed: tell any interested control connections
+ * how long each type of onion handshake has waited for the cpuworkers,
+ * run on them, and waited for us to handle the replies since the last
+ * time we were called.  Then start a new interval. */
+int
+control_event_cpuworker_timing(void)
+{
+  smartlist_t *lines;
+  const uint16_t *types;
+  int n_types, i, phase;
+
+  if (!EVENT_IS_INTERESTING(EVENT_CPUWORKER_TIMING)) {
+    cpuworker_timing_reset_interval();
+    return 0;
+  }
+
+  lines = smartlist_new();
+  n_types = cpuworker_timing_get_handshake_types(&types);
+  for (i = 0; i < n_types; ++i) {
+    for (phase = 0; phase < CPUWORKER_N_PHASES; ++phase) {
+      const latency_hist_t *hist =
+        cpuworker_timing_get_interval_hist(types[i], phase);
+      char *what;
+      if (!hist->n)
+        continue;
+      tor_asprintf(&what, "Type=%s Phase=%s",
+                   cpuworker_handshake_type_name(types[i]),
+                   cpuworker_phase_name(phase));
+      latency_hist_add_event_line(lines, "CPUWORKER_TIMING", what, hist);
+      tor_free(what);
+    }
+  }
+  send_control_event_lines(EVENT_CPUWORKER_TIMING, lines);
+  smartlist_free(lines);
+  cpuworker_timing_reset_interval();
+  return 0;
+}
+
+/** True iff we are sampling our TLS channels for CHAN_STATS events. */
+static int sampling_chan_stats = 0;
+
+/** A second or more has elapsed: sample the traffic and socket state of
+ * each open TLS channel, and tell any interested control connections
+ * about them.  If nobody is interested any more, stop sampling. */
+int
+control_event_chan_stats(void)
+{
+  const smartlist_t *chans = channel_list_get_all();
+  smartlist_t *lines;
+  uint64_t now_msec;
+
+  if (!chans)
+    return 0;
+
+  if (!EVENT_IS_INTERESTING(EVENT_CHAN_STATS)) {
+    if (sampling_chan_stats) {
+      SMARTLIST_FOREACH(chans, channel_t *, chan,
+        if (chan->magic == TLS_CHAN_MAGIC)
+          channel_tls_free_stats(BASE_CHAN_TO_TLS(chan)));
+      sampling_chan_stats = 0;
+    }
+    return 0;
+  }
+
+  sampling_chan_stats = 1;
+  lines = smartlist_new();
+  now_msec = monotime_absolute_msec();
+  SMARTLIST_FOREACH_BEGIN(chans, channel_t *, chan) {
+    channel_tls_t *tlschan;
+    const channel_tls_stats_sample_t *s;
+    if (chan->magic != TLS_CHAN_MAGIC || !CHANNEL_IS_OPEN(chan))
+      continue;
+    tlschan = BASE_CHAN_TO_TLS(chan);
+    channel_tls_sample_stats(tlschan, now_msec);
+    if (!(s = channel_tls_get_last_sample(tlschan)))
+      continue;
+    smartlist_add_asprintf(lines,
+                           "650 CHAN_STATS ChannelID="U64_FORMAT
+                           " Msec=%u Read=%u Written=%u CellsRead=%u"
+                           " CellsWritten=%u OutbufLen=%u KernelOutq=%u"
+                           " RTT=%u RTTVar=%u Cwnd=%u Retransmits=%u\r\n",
+                           U64_PRINTF_ARG(chan->global_identifier),
+                           (unsigned)s->msec, (unsigned)s->bytes_read,
+                           (unsigned)s->bytes_written,
+                           (unsigned)s->cells_read,
+                           (unsigned)s->cells_written,
+                           (unsigned)s->outbuf_len,
+                           (unsigned)s->kernel_outq,
+                           (unsigned)s->rtt_usec, (unsigned)s->rttvar_usec,
+                           (unsigned)s->cwnd, (unsigned)s->retransmits);
+  } SMARTLIST_FOREACH_END(chan);
+  send_control_event_lines(EVENT_CHAN_STATS, lines);
+  smartlist_free(lines);
+  return 0;
+}
+
 /** Tokens in <b>bucket</b> have been refilled: the read bucket was empty
  * for <b>read_empty_time</b> millis, the write bucket was empty for
  * <b>write_empty_time</b> millis, and buckets were last refilled
@@ -7161,6 +7575,7 @@ control_free_all(void)
                       queued_event_free(ev));
     smartlist_free(queued_control_events);
     queued_control_events = NULL;
+    queued_control_events_allocation = 0;
   }
   if (flush_queued_events_event) {
     tor_event_free(flush_queued_events_event);
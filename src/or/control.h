@@ -13,6 +13,7 @@
 #define TOR_CONTROL_H
 
 void control_initialize_event_queue(void);
+size_t control_get_queued_event_allocation(void);
 
 void control_update_global_event_mask(void);
 void control_adjust_event_log_severity(void);
@@ -35,6 +36,7 @@ int connection_control_process_inbuf(control_connection_t *conn);
 
 #define EVENT_AUTHDIR_NEWDESCS 0x000D
 #define EVENT_NS 0x000F
+#define EVENT_QUEUE_DELAY 0x0024
 int control_event_is_interesting(int event);
 
 int control_event_circuit_status(origin_circuit_t *circ,
@@ -56,6 +58,9 @@ int control_event_circ_bandwidth_used(void);
 int control_event_conn_bandwidth(connection_t *conn);
 int control_event_conn_bandwidth_used(void);
 int control_event_circuit_cell_stats(void);
+int control_event_queue_delay(void);
+int control_event_cpuworker_timing(void);
+int control_event_chan_stats(void);
 int control_event_tb_empty(const char *bucket, uint32_t read_empty_time,
                            uint32_t write_empty_time,
                            int milliseconds_elapsed);
@@ -192,7 +197,10 @@ void control_free_all(void);
 #define EVENT_HS_DESC                 0x0021
 #define EVENT_HS_DESC_CONTENT         0x0022
 #define EVENT_NETWORK_LIVENESS        0x0023
-#define EVENT_MAX_                    0x0023
+// #define EVENT_QUEUE_DELAY          0x0024
+#define EVENT_CPUWORKER_TIMING        0x0025
+#define EVENT_CHAN_STATS              0x0026
+#define EVENT_MAX_                    0x0026
 
 /* sizeof(control_connection_t.event_mask) in bits, currently a uint64_t */
 #define EVENT_CAPACITY_               0x0040
@@ -219,6 +227,8 @@ void control_free_all(void);
 /* Used only by control.c and test.c */
 STATIC size_t write_escaped_data(const char *data, size_t len, char **out);
 STATIC size_t read_escaped_data(const char *data, size_t len, char **out);
+STATIC void write_escaped_data_to_conn(const char *data, size_t len,
+                                       control_connection_t *conn);
 
 #ifdef TOR_UNIT_TESTS
 MOCK_DECL(STATIC void,
@@ -230,6 +240,8 @@ MOCK_DECL(STATIC void,
 void control_testing_set_global_event_mask(uint64_t mask);
 #endif
 
+STATIC void queued_events_flush_all(int force);
+
 /** Helper structure: temporarily stores cell statistics for a circuit. */
 typedef struct cell_stats_t {
   /** Number of cells added in app-ward direction by command. */
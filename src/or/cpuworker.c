@@ -11,9 +11,11 @@
  * The multithreading backend for this module is in workqueue.c; this module
  * specializes workqueue.c.
  *
- * Right now, we only use this for processing onionskins, and invoke it mostly
- * from onion.c.
+ * Right now, we mostly use this for processing onionskins, and invoke it
+ * mostly from onion.c.  Other modules can hand CPU-heavy work to the same
+ * threads with cpuworker_queue_work().
  **/
+#define CPUWORKER_PRIVATE
 #include "or.h"
 #include "channel.h"
 #include "circuitbuild.h"
@@ -21,6 +23,8 @@
 #include "connection_or.h"
 #include "config.h"
 #include "cpuworker.h"
+#include "crypto_async.h"
+#include "latency_trace.h"
 #include "main.h"
 #include "onion.h"
 #include "rephist.h"
@@ -30,6 +34,8 @@
 #include <event2/event.h>
 
 static void queue_pending_tasks(void);
+static void tap_dh_pool_maybe_refill(void);
+static void tap_dh_pool_note_used(void);
 
 typedef struct worker_state_s {
   int generation;
@@ -42,7 +48,10 @@ worker_state_new(void *arg)
   worker_state_t *ws;
   (void)arg;
   ws = tor_malloc_zero(sizeof(worker_state_t));
-  ws->onion_keys = server_onion_keys_new();
+  /* Clients run workers too, to precompute ntor keypairs, but they have no
+   * onion keys of their own. */
+  if (server_mode(get_options()))
+    ws->onion_keys = server_onion_keys_new();
   return ws;
 }
 static void
@@ -94,10 +103,83 @@ cpu_init(void)
                                 worker_state_new,
                                 worker_state_free,
                                 NULL);
+    /* Workers come and go as the pool resizes: make each one wipe its
+     * random number generator on the way out. */
+    threadpool_set_thread_exit_fn(threadpool, crypto_thread_cleanup);
   }
-  /* Total voodoo. Can we make this more sensible? */
-  max_pending_tasks = get_num_cpus(get_options()) * 64;
+  cpuworkers_set_pool_size(get_options());
   crypto_seed_weak_rng(&request_sample_rng);
+  cpuworkers_set_cpu_affinity(get_options());
+}
+
+/** Let the cpuworker pool in <b>options</b> shrink to NumCPUsMin threads
+ * while it is idle, and grow back to NumCPUs when work has to wait.  If
+ * NumCPUsMin is 0, keep NumCPUs threads running all the time. */
+void
+cpuworkers_set_pool_size(const or_options_t *options)
+{
+  int max_threads = get_num_cpus(options);
+  int min_threads = options->NumCPUsMin;
+
+  if (min_threads <= 0 || min_threads > max_threads)
+    min_threads = max_threads;
+  /* Total voodoo. Can we make this more sensible? */
+  max_pending_tasks = max_threads * 64;
+  if (threadpool &&
+      threadpool_set_size_limits(threadpool, min_threads, max_threads) < 0)
+    log_warn(LD_GENERAL, "Couldn't start enough cpuworker threads.");
+}
+
+/** Bind the main thread and the cpuworkers to the CPUs listed in the
+ * CPUAffinity option in <b>options</b>: the main thread gets the first one,
+ * and the workers share the rest round-robin.  With a single CPU listed,
+ * everything runs there; with none, nothing is bound. */
+void
+cpuworkers_set_cpu_affinity(const or_options_t *options)
+{
+  const smartlist_t *sl = options->CPUAffinity;
+  int *cpus = NULL;
+  int n = sl ? smartlist_len(sl) : 0;
+
+  if (n) {
+    cpus = tor_calloc(n, sizeof(int));
+    SMARTLIST_FOREACH(sl, const char *, cp,
+                      cpus[cp_sl_idx] = (int)tor_parse_long(cp, 10, 0,
+                                                            INT_MAX,
+                                                            NULL, NULL));
+  }
+  tor_set_current_thread_cpu(n ? cpus[0] : -1);
+  if (threadpool) {
+    if (n > 1)
+      threadpool_set_cpus(threadpool, cpus + 1, n - 1);
+    else
+      threadpool_set_cpus(threadpool, cpus, n);
+  }
+  tor_free(cpus);
+}
+
+/** Return a newly allocated string describing the CPU that the main thread
+ * and each cpuworker last ran on, as "main=N workers=N,N,...", with -1 for
+ * any we don't know. */
+char *
+cpuworker_get_cpu_info(void)
+{
+  smartlist_t *sl = smartlist_new();
+  char *workers, *result;
+  int cpus[64];
+  int i, n = 0;
+
+  if (threadpool)
+    n = threadpool_get_worker_cpus(threadpool, cpus, ARRAY_LENGTH(cpus));
+  for (i = 0; i < n; ++i)
+    smartlist_add_asprintf(sl, "%d", cpus[i]);
+  workers = smartlist_join_strings(sl, ",", 0, NULL);
+  tor_asprintf(&result, "main=%d workers=%s", tor_get_current_cpu(), workers);
+
+  SMARTLIST_FOREACH(sl, char *, cp, tor_free(cp));
+  smartlist_free(sl);
+  tor_free(workers);
+  return result;
 }
 
 /** Magic numbers to make sure our cpuworker_requests don't grow any
@@ -110,10 +192,11 @@ typedef struct cpuworker_request_t {
   /** Magic number; must be CPUWORKER_REQUEST_MAGIC. */
   uint32_t magic;
 
-  /** Flag: Are we timing this request? */
+  /** Flag: Should this request count toward our average handshake
+   * times? */
   unsigned timed : 1;
-  /** If we're timing this request, when was it sent to the cpuworker? */
-  struct timeval started_at;
+  /** When did we hand this request to the threadpool? */
+  monotime_t queued_at;
 
   /** A create cell for the cpuworker to process. */
   create_cell_t create_cell;
@@ -129,16 +212,15 @@ typedef struct cpuworker_reply_t {
   /** True iff we got a successful request. */
   uint8_t success;
 
-  /** Are we timing this request? */
+  /** Should this request count toward our average handshake times? */
   unsigned int timed : 1;
   /** What handshake type was the request? (Used for timing) */
   uint16_t handshake_type;
-  /** When did we send the request to the cpuworker? */
-  struct timeval started_at;
-  /** Once the cpuworker received the request, how many microseconds did it
-   * take? (This shouldn't overflow; 4 billion micoseconds is over an hour,
-   * and we'll never have an onion handshake that takes so long.) */
-  uint32_t n_usec;
+  /** When did we hand the request to the threadpool? */
+  monotime_t queued_at;
+  /** When did the cpuworker start and finish the handshake? */
+  monotime_t run_started;
+  monotime_t run_ended;
 
   /** Output of processing a create cell
    *
@@ -152,14 +234,53 @@ typedef struct cpuworker_reply_t {
   uint8_t rend_auth_material[DIGEST_LEN];
 } cpuworker_reply_t;
 
-typedef struct cpuworker_job_u {
+/** One onion handshake within a cpuworker_job_t. */
+typedef struct cpuworker_task_t {
+  /** The circuit that wants this handshake, or NULL if the circuit has
+   * stopped caring about the answer. Only touched from the main thread. */
   or_circuit_t *circ;
   union {
     cpuworker_request_t request;
     cpuworker_reply_t reply;
   } u;
+} cpuworker_task_t;
+
+/** The largest number of onion handshakes we'll hand to a cpuworker in a
+ * single job. */
+#define CPUWORKER_MAX_TASKS_PER_JOB 8
+
+/** A batch of onion handshakes that we hand to a cpuworker all at once.
+ * When the onion queue is backed up, batching saves a trip through the
+ * threadpool's locks and the reply queue's socket for each handshake. */
+typedef struct cpuworker_job_t {
+  /** How many entries of tasks are in use? */
+  int n_tasks;
+  /** How many tasks have had their circuit cleared by
+   * cpuworker_cancel_circ_handshake()? */
+  int n_abandoned;
+  cpuworker_task_t tasks[FLEXIBLE_ARRAY_MEMBER];
 } cpuworker_job_t;
 
+/** Return a new cpuworker_job_t with room for <b>n</b> tasks. */
+static cpuworker_job_t *
+cpuworker_job_new(int n)
+{
+  tor_assert(n >= 1 && n <= CPUWORKER_MAX_TASKS_PER_JOB);
+  return tor_malloc_zero(offsetof(cpuworker_job_t, tasks) +
+                         n * sizeof(cpuworker_task_t));
+}
+
+/** Wipe and release the storage held by <b>job</b>. */
+static void
+cpuworker_job_free(cpuworker_job_t *job, uint8_t wipe_byte)
+{
+  if (!job)
+    return;
+  memwipe(job, wipe_byte, offsetof(cpuworker_job_t, tasks) +
+          job->n_tasks * sizeof(cpuworker_task_t));
+  tor_free(job);
+}
+
 static workqueue_reply_t
 update_state_threadfn(void *state_, void *work_)
 {
@@ -210,8 +331,140 @@ static uint64_t onionskins_usec_roundtrip[MAX_ONION_HANDSHAKE_TYPE+1];
  * time. (microseconds) */
 #define MAX_BELIEVABLE_ONIONSKIN_DELAY (2*1000*1000)
 
-/** Return true iff we'd like to measure a handshake of type
- * <b>onionskin_type</b>. Call only from the main thread. */
+/** Indexed by handshake type and cpuworker_phase_t: histograms of how long
+ * each phase of that kind of handshake has taken since we started. */
+static latency_hist_t
+  onionskin_timing[MAX_ONION_HANDSHAKE_TYPE+1][CPUWORKER_N_PHASES];
+/** As onionskin_timing, but only since the last call to
+ * cpuworker_timing_reset_interval(). */
+static latency_hist_t
+  onionskin_timing_interval[MAX_ONION_HANDSHAKE_TYPE+1][CPUWORKER_N_PHASES];
+
+/** The handshake types that we hand to cpuworkers, in the order in which
+ * we report them. */
+static const uint16_t cpuworker_handshake_types[] = {
+  ONION_HANDSHAKE_TYPE_NTOR, ONION_HANDSHAKE_TYPE_TAP,
+};
+
+/** Note that a handshake of type <b>handshake_type</b> spent
+ * <b>queue_nsec</b> nanoseconds waiting for a cpuworker, <b>run_nsec</b>
+ * running on it, and <b>reply_nsec</b> waiting for us to handle the
+ * reply. */
+STATIC void
+cpuworker_note_handshake_timing(uint16_t handshake_type, int64_t queue_nsec,
+                                int64_t run_nsec, int64_t reply_nsec)
+{
+  const int64_t nsec[CPUWORKER_N_PHASES] = {
+    queue_nsec, run_nsec, reply_nsec
+  };
+  int phase;
+
+  if (handshake_type > MAX_ONION_HANDSHAKE_TYPE)
+    return;
+  for (phase = 0; phase < CPUWORKER_N_PHASES; ++phase) {
+    uint64_t n = nsec[phase] > 0 ? (uint64_t)nsec[phase] : 0;
+    latency_hist_add(&onionskin_timing[handshake_type][phase], n);
+    latency_hist_add(&onionskin_timing_interval[handshake_type][phase], n);
+  }
+}
+
+/** Return the name we use for the handshake type <b>handshake_type</b> in
+ * timing reports. */
+const char *
+cpuworker_handshake_type_name(uint16_t handshake_type)
+{
+  switch (handshake_type) {
+    case ONION_HANDSHAKE_TYPE_TAP: return "tap";
+    case ONION_HANDSHAKE_TYPE_FAST: return "fast";
+    case ONION_HANDSHAKE_TYPE_NTOR: return "ntor";
+  }
+  return "unknown";
+}
+
+/** Return the name we use for <b>phase</b> in timing reports. */
+const char *
+cpuworker_phase_name(cpuworker_phase_t phase)
+{
+  switch (phase) {
+    case CPUWORKER_PHASE_QUEUE: return "queue";
+    case CPUWORKER_PHASE_RUN: return "run";
+    case CPUWORKER_PHASE_REPLY: return "reply";
+  }
+  tor_assert_unreached();
+  return NULL;
+}
+
+/** Return the histogram of how long <b>phase</b> of handshakes of type
+ * <b>handshake_type</b> has taken since the last call to
+ * cpuworker_timing_reset_interval(). */
+const latency_hist_t *
+cpuworker_timing_get_interval_hist(uint16_t handshake_type,
+                                   cpuworker_phase_t phase)
+{
+  tor_assert(handshake_type <= MAX_ONION_HANDSHAKE_TYPE);
+  tor_assert((int)phase >= 0 && phase < CPUWORKER_N_PHASES);
+  return &onionskin_timing_interval[handshake_type][phase];
+}
+
+/** Start a new interval for cpuworker_timing_get_interval_hist(). */
+void
+cpuworker_timing_reset_interval(void)
+{
+  memset(onionskin_timing_interval, 0, sizeof(onionskin_timing_interval));
+}
+
+/** Return the number of handshake types that we report timing for, and
+ * set *<b>types_out</b> to point to them. */
+int
+cpuworker_timing_get_handshake_types(const uint16_t **types_out)
+{
+  *types_out = cpuworker_handshake_types;
+  return (int)ARRAY_LENGTH(cpuworker_handshake_types);
+}
+
+/** Return a newly allocated string describing how long each phase of each
+ * type of handshake has taken on the cpuworkers since we started, for the
+ * "cpuworker/timing" GETINFO key. */
+char *
+cpuworker_timing_format(void)
+{
+  smartlist_t *lines = smartlist_new();
+  char *result;
+  unsigned i;
+  int phase;
+
+  for (i = 0; i < ARRAY_LENGTH(cpuworker_handshake_types); ++i) {
+    uint16_t type = cpuworker_handshake_types[i];
+    for (phase = 0; phase < CPUWORKER_N_PHASES; ++phase) {
+      const latency_hist_t *h = &onionskin_timing[type][phase];
+      char *bucket_str = latency_hist_format_buckets(h);
+      smartlist_add_asprintf(lines,
+                             "%s %s count="U64_FORMAT" mean-usec="U64_FORMAT
+                             " p50-usec="U64_FORMAT" p99-usec="U64_FORMAT
+                             " max-usec="U64_FORMAT" buckets=%s",
+                             cpuworker_handshake_type_name(type),
+                             cpuworker_phase_name(phase),
+                             U64_PRINTF_ARG(h->n),
+                             U64_PRINTF_ARG(h->n ?
+                                            h->total_nsec / h->n / 1000 : 0),
+                             U64_PRINTF_ARG(
+                                      latency_hist_percentile_usec(h, .5)),
+                             U64_PRINTF_ARG(
+                                      latency_hist_percentile_usec(h, .99)),
+                             U64_PRINTF_ARG(h->max_nsec / 1000),
+                             bucket_str);
+      tor_free(bucket_str);
+    }
+  }
+
+  result = smartlist_join_strings(lines, "\n", 0, NULL);
+  SMARTLIST_FOREACH(lines, char *, cp, tor_free(cp));
+  smartlist_free(lines);
+  return result;
+}
+
+/** Return true iff we'd like a handshake of type <b>onionskin_type</b> to
+ * count toward our averages. Call only from the main thread. */
 static int
 should_time_request(uint16_t onionskin_type)
 {
@@ -222,8 +475,9 @@ should_time_request(uint16_t onionskin_type)
    * sample */
   if (onionskins_n_processed[onionskin_type] < 4096)
     return 1;
-  /** Otherwise, measure with P=1/128.  We avoid doing this for every
-   * handshake, since the measurement itself can take a little time. */
+  /** Otherwise, sample with P=1/128.  (We time every handshake for
+   * cpuworker_note_handshake_timing(), but the averages only need a
+   * sample.) */
   return tor_weak_random_one_in_n(&request_sample_rng, 128);
 }
 
@@ -297,35 +551,73 @@ cpuworker_log_onionskin_overhead(int severity, int onionskin_type,
          onionskin_type_name, (unsigned)overhead, relative_overhead*100);
 }
 
-/** Handle a reply from the worker threads. */
+/** Log how many replies from the cpuworkers we have handled, and how many
+ * of them we handled per main-thread wakeup. */
+void
+cpuworker_log_reply_stats(int severity)
+{
+  uint64_t n_wakeups, n_replies;
+  int depth[WORKQUEUE_N_PRIORITIES];
+  uint64_t n_queued[WORKQUEUE_N_PRIORITIES];
+  if (!replyqueue)
+    return;
+  replyqueue_get_stats(replyqueue, &n_wakeups, &n_replies);
+  if (!n_wakeups)
+    return;
+  tor_log(severity, LD_OR,
+          "Handled "U64_FORMAT" cpuworker replies in "U64_FORMAT" wakeups "
+          "(%.2f replies per wakeup).",
+          U64_PRINTF_ARG(n_replies), U64_PRINTF_ARG(n_wakeups),
+          U64_TO_DBL(n_replies) / U64_TO_DBL(n_wakeups));
+  threadpool_get_queue_stats(threadpool, depth, n_queued);
+  tor_log(severity, LD_OR,
+          "Cpuworker jobs queued (waiting now): "
+          "high "U64_FORMAT" (%d), normal "U64_FORMAT" (%d), "
+          "background "U64_FORMAT" (%d).",
+          U64_PRINTF_ARG(n_queued[WQ_PRI_HIGH]), depth[WQ_PRI_HIGH],
+          U64_PRINTF_ARG(n_queued[WQ_PRI_MED]), depth[WQ_PRI_MED],
+          U64_PRINTF_ARG(n_queued[WQ_PRI_LOW]), depth[WQ_PRI_LOW]);
+  tor_log(severity, LD_OR, "%d cpuworker threads are running.",
+          threadpool_get_n_threads(threadpool));
+}
+
+/** Handle the reply to a single onion handshake, <b>task</b>. */
 static void
-cpuworker_onion_handshake_replyfn(void *work_)
+cpuworker_onion_handshake_reply_task(cpuworker_task_t *task)
 {
-  cpuworker_job_t *job = work_;
   cpuworker_reply_t rpl;
   or_circuit_t *circ = NULL;
-
-  tor_assert(total_pending_tasks > 0);
-  --total_pending_tasks;
+  monotime_t now;
 
   /* Could avoid this, but doesn't matter. */
-  memcpy(&rpl, &job->u.reply, sizeof(rpl));
+  memcpy(&rpl, &task->u.reply, sizeof(rpl));
 
   tor_assert(rpl.magic == CPUWORKER_REPLY_MAGIC);
 
-  if (rpl.timed && rpl.success &&
-      rpl.handshake_type <= MAX_ONION_HANDSHAKE_TYPE) {
+  monotime_get(&now);
+  if (rpl.handshake_type <= MAX_ONION_HANDSHAKE_TYPE) {
     /* Time how long this request took. The handshake_type check should be
        needless, but let's leave it in to be safe. */
-    struct timeval tv_end, tv_diff;
-    int64_t usec_roundtrip;
-    tor_gettimeofday(&tv_end);
-    timersub(&tv_end, &rpl.started_at, &tv_diff);
-    usec_roundtrip = ((int64_t)tv_diff.tv_sec)*1000000 + tv_diff.tv_usec;
-    if (usec_roundtrip >= 0 &&
+    int64_t queue_nsec, run_nsec, reply_nsec;
+    queue_nsec = monotime_diff_nsec(&rpl.queued_at, &rpl.run_started);
+    run_nsec = monotime_diff_nsec(&rpl.run_started, &rpl.run_ended);
+    reply_nsec = monotime_diff_nsec(&rpl.run_ended, &now);
+    cpuworker_note_handshake_timing(rpl.handshake_type, queue_nsec,
+                                    run_nsec, reply_nsec);
+  }
+
+  if (rpl.timed && rpl.success &&
+      rpl.handshake_type <= MAX_ONION_HANDSHAKE_TYPE) {
+    /* Keep the averages that estimated_usec_for_onionskins() uses. */
+    int64_t usec_roundtrip = monotime_diff_usec(&rpl.queued_at, &now);
+    int64_t usec_internal = monotime_diff_usec(&rpl.run_started,
+                                               &rpl.run_ended);
+    if (usec_internal > MAX_BELIEVABLE_ONIONSKIN_DELAY)
+      usec_internal = MAX_BELIEVABLE_ONIONSKIN_DELAY;
+    if (usec_roundtrip >= 0 && usec_internal >= 0 &&
         usec_roundtrip < MAX_BELIEVABLE_ONIONSKIN_DELAY) {
       ++onionskins_n_processed[rpl.handshake_type];
-      onionskins_usec_internal[rpl.handshake_type] += rpl.n_usec;
+      onionskins_usec_internal[rpl.handshake_type] += usec_internal;
       onionskins_usec_roundtrip[rpl.handshake_type] += usec_roundtrip;
       if (onionskins_n_processed[rpl.handshake_type] >= 500000) {
         /* Scale down every 500000 handshakes.  On a busy server, that's
@@ -337,16 +629,25 @@ cpuworker_onion_handshake_replyfn(void *work_)
     }
   }
 
-  circ = job->circ;
+  if (rpl.success && rpl.handshake_type == ONION_HANDSHAKE_TYPE_TAP)
+    tap_dh_pool_note_used();
+
+  circ = task->circ;
 
   log_debug(LD_OR,
             "Unpacking cpuworker reply %p, circ=%p, success=%d",
-            job, circ, rpl.success);
+            task, circ, rpl.success);
+
+  if (!circ) {
+    /* cpuworker_cancel_circ_handshake() told us nobody wants this. */
+    log_debug(LD_OR, "Circuit abandoned its handshake. Ignoring reply.");
+    goto done_processing;
+  }
 
   if (circ->base_.magic == DEAD_CIRCUIT_MAGIC) {
     /* The circuit was supposed to get freed while the reply was
      * pending. Instead, it got left for us to free so that we wouldn't freak
-     * out when the job->circ field wound up pointing to nothing. */
+     * out when the task->circ field wound up pointing to nothing. */
     log_debug(LD_OR, "Circuit died while reply was pending. Freeing memory.");
     circ->base_.magic = 0;
     tor_free(circ);
@@ -381,43 +682,53 @@ cpuworker_onion_handshake_replyfn(void *work_)
 
  done_processing:
   memwipe(&rpl, 0, sizeof(rpl));
-  memwipe(job, 0, sizeof(*job));
-  tor_free(job);
-  queue_pending_tasks();
 }
 
-/** Implementation function for onion handshake requests. */
-static workqueue_reply_t
-cpuworker_onion_handshake_threadfn(void *state_, void *work_)
+/** Handle a reply from the worker threads. */
+static void
+cpuworker_onion_handshake_replyfn(void *work_)
 {
-  worker_state_t *state = state_;
   cpuworker_job_t *job = work_;
+  int i;
+
+  tor_assert(total_pending_tasks >= job->n_tasks);
+  total_pending_tasks -= job->n_tasks;
+
+  for (i = 0; i < job->n_tasks; ++i)
+    cpuworker_onion_handshake_reply_task(&job->tasks[i]);
+
+  cpuworker_job_free(job, 0);
+  queue_pending_tasks();
+  tap_dh_pool_maybe_refill();
+}
 
-  /* variables for onion processing */
-  server_onion_keys_t *onion_keys = state->onion_keys;
+/** Perform the onion handshake for a single <b>task</b>, using the keys in
+ * <b>onion_keys</b>, and replace its request with the reply.  Return 0 on
+ * success, or -1 if we got a cell type that should be impossible. */
+static int
+cpuworker_onion_handshake_task(server_onion_keys_t *onion_keys,
+                               cpuworker_task_t *task)
+{
   cpuworker_request_t req;
   cpuworker_reply_t rpl;
 
-  memcpy(&req, &job->u.request, sizeof(req));
+  memcpy(&req, &task->u.request, sizeof(req));
 
   tor_assert(req.magic == CPUWORKER_REQUEST_MAGIC);
   memset(&rpl, 0, sizeof(rpl));
 
   const create_cell_t *cc = &req.create_cell;
   created_cell_t *cell_out = &rpl.created_cell;
-  struct timeval tv_start = {0,0}, tv_end;
+  monotime_t run_started, run_ended;
   int n;
-  rpl.timed = req.timed;
-  rpl.started_at = req.started_at;
-  rpl.handshake_type = cc->handshake_type;
-  if (req.timed)
-    tor_gettimeofday(&tv_start);
+  monotime_get(&run_started);
   n = onion_skin_server_handshake(cc->handshake_type,
                                   cc->onionskin, cc->handshake_len,
                                   onion_keys,
                                   cell_out->reply,
                                   rpl.keys, CPATH_KEY_MATERIAL_LEN,
                                   rpl.rend_auth_material);
+  monotime_get(&run_ended);
   if (n < 0) {
     /* failure */
     log_debug(LD_OR,"onion_skin_server_handshake failed.");
@@ -436,30 +747,143 @@ cpuworker_onion_handshake_threadfn(void *state_, void *work_)
       cell_out->cell_type = CELL_CREATED_FAST; break;
     default:
       tor_assert(0);
-      return WQ_RPL_SHUTDOWN;
+      return -1;
     }
     rpl.success = 1;
   }
   rpl.magic = CPUWORKER_REPLY_MAGIC;
-  if (req.timed) {
-    struct timeval tv_diff;
-    int64_t usec;
-    tor_gettimeofday(&tv_end);
-    timersub(&tv_end, &tv_start, &tv_diff);
-    usec = ((int64_t)tv_diff.tv_sec)*1000000 + tv_diff.tv_usec;
-    if (usec < 0 || usec > MAX_BELIEVABLE_ONIONSKIN_DELAY)
-      rpl.n_usec = MAX_BELIEVABLE_ONIONSKIN_DELAY;
-    else
-      rpl.n_usec = (uint32_t) usec;
-  }
+  rpl.timed = req.timed;
+  rpl.handshake_type = cc->handshake_type;
+  rpl.queued_at = req.queued_at;
+  rpl.run_started = run_started;
+  rpl.run_ended = run_ended;
 
-  memcpy(&job->u.reply, &rpl, sizeof(rpl));
+  memcpy(&task->u.reply, &rpl, sizeof(rpl));
 
   memwipe(&req, 0, sizeof(req));
   memwipe(&rpl, 0, sizeof(req));
+  return 0;
+}
+
+/** Argument for cpuworker_onion_handshake_async_fn(): a task, and the keys
+ * to answer it with. */
+typedef struct cpuworker_async_task_t {
+  server_onion_keys_t *onion_keys;
+  cpuworker_task_t *task;
+} cpuworker_async_task_t;
+
+/** Adapter to run cpuworker_onion_handshake_task() in a crypto_async
+ * batch. */
+static int
+cpuworker_onion_handshake_async_fn(void *arg)
+{
+  cpuworker_async_task_t *at = arg;
+  return cpuworker_onion_handshake_task(at->onion_keys, at->task);
+}
+
+/** Implementation function for onion handshake requests. */
+static workqueue_reply_t
+cpuworker_onion_handshake_threadfn(void *state_, void *work_)
+{
+  worker_state_t *state = state_;
+  cpuworker_job_t *job = work_;
+  int i;
+
+  if (job->n_tasks > 1 && crypto_async_is_enabled()) {
+    /* Start every task in the job as an async job, so that an async engine
+     * can work on all of their RSA and DH operations at once. */
+    cpuworker_async_task_t at[CPUWORKER_MAX_TASKS_PER_JOB];
+    void *args[CPUWORKER_MAX_TASKS_PER_JOB];
+    int results[CPUWORKER_MAX_TASKS_PER_JOB];
+    for (i = 0; i < job->n_tasks; ++i) {
+      at[i].onion_keys = state->onion_keys;
+      at[i].task = &job->tasks[i];
+      args[i] = &at[i];
+    }
+    crypto_async_run_batch(cpuworker_onion_handshake_async_fn, args,
+                           results, job->n_tasks);
+    for (i = 0; i < job->n_tasks; ++i) {
+      if (results[i] < 0)
+        return WQ_RPL_SHUTDOWN;
+    }
+    return WQ_RPL_REPLY;
+  }
+
+  for (i = 0; i < job->n_tasks; ++i) {
+    if (cpuworker_onion_handshake_task(state->onion_keys, &job->tasks[i]) < 0)
+      return WQ_RPL_SHUTDOWN;
+  }
   return WQ_RPL_REPLY;
 }
 
+/** Fill in the next free task in <b>job</b> with a request to answer
+ * <b>onionskin</b> for <b>circ</b>, and free <b>onionskin</b>. */
+static void
+cpuworker_job_add_task(cpuworker_job_t *job, or_circuit_t *circ,
+                       create_cell_t *onionskin)
+{
+  cpuworker_task_t *task = &job->tasks[job->n_tasks++];
+  cpuworker_request_t *req = &task->u.request;
+
+  if (connection_or_digest_is_known_relay(circ->p_chan->identity_digest))
+    rep_hist_note_circuit_handshake_assigned(onionskin->handshake_type);
+
+  task->circ = circ;
+  req->magic = CPUWORKER_REQUEST_MAGIC;
+  req->timed = should_time_request(onionskin->handshake_type);
+
+  memcpy(&req->create_cell, onionskin, sizeof(create_cell_t));
+  memwipe(onionskin, 0, sizeof(create_cell_t));
+  tor_free(onionskin);
+
+  monotime_get(&req->queued_at);
+}
+
+/** Hand <b>job</b> to the cpuworkers. Return 0 on success, or -1 on
+ * failure, in which case <b>job</b> is freed and its circuits are left
+ * alone. */
+static int
+cpuworker_queue_job(cpuworker_job_t *job)
+{
+  workqueue_entry_t *queue_entry;
+  int i;
+
+  total_pending_tasks += job->n_tasks;
+  queue_entry = threadpool_queue_work_priority(threadpool, WQ_PRI_HIGH,
+                                      cpuworker_onion_handshake_threadfn,
+                                      cpuworker_onion_handshake_replyfn,
+                                      job);
+  if (!queue_entry) {
+    log_warn(LD_BUG, "Couldn't queue work on threadpool");
+    total_pending_tasks -= job->n_tasks;
+    cpuworker_job_free(job, 0);
+    return -1;
+  }
+
+  log_debug(LD_OR, "Queued job %p with %d task(s) (qe=%p)",
+            job, job->n_tasks, queue_entry);
+
+  for (i = 0; i < job->n_tasks; ++i)
+    job->tasks[i].circ->workqueue_entry = queue_entry;
+
+  return 0;
+}
+
+/** Return how many onion handshakes we should put in the next job that we
+ * hand to the cpuworkers.  When only a few are waiting, we give each one a
+ * job of its own, so that idle workers can run them in parallel; when the
+ * queue is backed up, every worker will be busy anyway, so we take them in
+ * batches. */
+static int
+cpuworker_choose_job_size(void)
+{
+  int n_waiting = onion_num_pending(ONION_HANDSHAKE_TYPE_NTOR) +
+    onion_num_pending(ONION_HANDSHAKE_TYPE_TAP);
+  int n = n_waiting / get_num_cpus(get_options());
+  n = MIN(n, max_pending_tasks - total_pending_tasks);
+  return CLAMP(1, n, CPUWORKER_MAX_TASKS_PER_JOB);
+}
+
 /** Take pending tasks from the queue and assign them to cpuworkers. */
 static void
 queue_pending_tasks(void)
@@ -468,14 +892,234 @@ queue_pending_tasks(void)
   create_cell_t *onionskin = NULL;
 
   while (total_pending_tasks < max_pending_tasks) {
-    circ = onion_next_task(&onionskin);
+    int n = cpuworker_choose_job_size();
+    cpuworker_job_t *job;
+
+    if (n == 1) {
+      circ = onion_next_task(&onionskin);
+
+      if (!circ)
+        return;
 
-    if (!circ)
+      if (assign_onionskin_to_cpuworker(circ, onionskin))
+        log_warn(LD_OR,"assign_to_cpuworker failed. Ignoring.");
+      continue;
+    }
+
+    job = cpuworker_job_new(n);
+    while (job->n_tasks < n && (circ = onion_next_task(&onionskin))) {
+      if (!circ->p_chan) {
+        log_info(LD_OR,"circ->p_chan gone. Failing circ.");
+        tor_free(onionskin);
+        continue;
+      }
+      cpuworker_job_add_task(job, circ, onionskin);
+    }
+    if (job->n_tasks == 0) {
+      cpuworker_job_free(job, 0);
       return;
+    }
+    if (cpuworker_queue_job(job) < 0)
+      log_warn(LD_OR,"Couldn't queue a batch of onionskins. Ignoring.");
+  }
+}
+
+/** How many precomputed ntor client keypairs do we try to keep around? */
+#define NTOR_KEYPAIR_POOL_SIZE 64
+/** How many ntor client keypairs does a worker generate in one job? */
+#define NTOR_KEYPAIR_BATCH_SIZE 32
+
+/** Ephemeral curve25519 keypairs that a worker thread has generated for our
+ * ntor handshakes as a client, so that the main thread doesn't have to do
+ * the scalar multiplication while building a circuit.  Each one is used
+ * once and then wiped. */
+static curve25519_keypair_t ntor_keypair_pool[NTOR_KEYPAIR_POOL_SIZE];
+/** How many entries at the start of ntor_keypair_pool are ready to use? */
+static int ntor_keypair_pool_len = 0;
+/** True iff we have asked a worker to generate more keypairs and haven't
+ * heard back yet. */
+static int ntor_keypair_refill_pending = 0;
+
+/** A request to a cpuworker to generate some ntor client keypairs. */
+typedef struct ntor_keypair_job_t {
+  /** How many keypairs did the worker manage to generate? */
+  int n_generated;
+  curve25519_keypair_t keypairs[NTOR_KEYPAIR_BATCH_SIZE];
+} ntor_keypair_job_t;
+
+/** Worker function: fill in a ntor_keypair_job_t. */
+static workqueue_reply_t
+ntor_keypair_threadfn(void *state_, void *work_)
+{
+  ntor_keypair_job_t *job = work_;
+  (void) state_;
+  for (job->n_generated = 0; job->n_generated < NTOR_KEYPAIR_BATCH_SIZE;
+       ++job->n_generated) {
+    if (curve25519_keypair_generate(&job->keypairs[job->n_generated], 0) <0)
+      break;
+  }
+  return WQ_RPL_REPLY;
+}
+
+/** Reply function: add the keypairs from a ntor_keypair_job_t to
+ * ntor_keypair_pool. */
+static void
+ntor_keypair_replyfn(void *work_)
+{
+  ntor_keypair_job_t *job = work_;
+  int n = MIN(job->n_generated,
+              NTOR_KEYPAIR_POOL_SIZE - ntor_keypair_pool_len);
+  memcpy(&ntor_keypair_pool[ntor_keypair_pool_len], job->keypairs,
+         n * sizeof(curve25519_keypair_t));
+  ntor_keypair_pool_len += n;
+  ntor_keypair_refill_pending = 0;
+  memwipe(job, 0, sizeof(*job));
+  tor_free(job);
+}
+
+/** If ntor_keypair_pool is running low and we have worker threads, ask one
+ * of them to make more keypairs. */
+static void
+ntor_keypair_pool_maybe_refill(void)
+{
+  ntor_keypair_job_t *job;
+  if (ntor_keypair_refill_pending || !threadpool ||
+      ntor_keypair_pool_len > NTOR_KEYPAIR_POOL_SIZE - NTOR_KEYPAIR_BATCH_SIZE)
+    return;
+  job = tor_malloc_zero(sizeof(ntor_keypair_job_t));
+  if (!threadpool_queue_work_priority(threadpool, WQ_PRI_MED,
+                                      ntor_keypair_threadfn,
+                                      ntor_keypair_replyfn, job)) {
+    tor_free(job);
+    return;
+  }
+  ntor_keypair_refill_pending = 1;
+}
 
-    if (assign_onionskin_to_cpuworker(circ, onionskin))
-      log_warn(LD_OR,"assign_to_cpuworker failed. Ignoring.");
+/** If we have a precomputed ntor client keypair available, move it into
+ * *<b>keypair_out</b> and return 0.  Otherwise return -1; the caller should
+ * generate its own. Either way, ask the workers for more if we're running
+ * low. */
+int
+cpuworker_take_ntor_keypair(curve25519_keypair_t *keypair_out)
+{
+  int r = -1;
+  if (ntor_keypair_pool_len > 0) {
+    curve25519_keypair_t *kp = &ntor_keypair_pool[--ntor_keypair_pool_len];
+    memcpy(keypair_out, kp, sizeof(curve25519_keypair_t));
+    memwipe(kp, 0, sizeof(curve25519_keypair_t));
+    r = 0;
   }
+  ntor_keypair_pool_maybe_refill();
+  return r;
+}
+
+/** How many TAP DH keys does a worker generate in one idle-time job? */
+#define TAP_DH_REFILL_BATCH 4
+
+/** About how many of the workers' precomputed TAP DH keys have been used
+ * since the workers last replaced them.  We use this to decide whether to
+ * ask for more when the workers are idle. */
+static int tap_dh_keys_wanted = 0;
+/** True iff we have asked a worker to precompute TAP DH keys and haven't
+ * heard back yet. */
+static int tap_dh_refill_pending = 0;
+
+/** A request to a cpuworker to precompute some TAP DH keys for its own
+ * pool. */
+typedef struct tap_dh_refill_job_t {
+  /** How many keys did the worker generate? */
+  int n_generated;
+} tap_dh_refill_job_t;
+
+/** Note that a worker has answered a TAP handshake, and so probably used
+ * one of its precomputed DH keys. */
+static void
+tap_dh_pool_note_used(void)
+{
+  int max_wanted = TAP_DH_POOL_SIZE * get_num_cpus(get_options());
+  if (tap_dh_keys_wanted < max_wanted)
+    ++tap_dh_keys_wanted;
+}
+
+/** Worker function: top up this worker's pool of TAP DH keys. */
+static workqueue_reply_t
+tap_dh_refill_threadfn(void *state_, void *work_)
+{
+  worker_state_t *state = state_;
+  tap_dh_refill_job_t *job = work_;
+  if (state->onion_keys)
+    job->n_generated = server_onion_keys_refill_tap_dh_pool(
+                                     state->onion_keys, TAP_DH_REFILL_BATCH);
+  return WQ_RPL_REPLY;
+}
+
+/** Reply function: note that a TAP DH refill job is done, and maybe ask
+ * for another. */
+static void
+tap_dh_refill_replyfn(void *work_)
+{
+  tap_dh_refill_job_t *job = work_;
+  log_debug(LD_OR, "A cpuworker precomputed %d TAP DH keys.",
+            job->n_generated);
+  /* The job may have landed on a worker whose pool was already full; count
+   * it as a full batch anyway, so that we stop eventually. */
+  tap_dh_keys_wanted -= TAP_DH_REFILL_BATCH;
+  if (tap_dh_keys_wanted < 0)
+    tap_dh_keys_wanted = 0;
+  tap_dh_refill_pending = 0;
+  tor_free(job);
+  tap_dh_pool_maybe_refill();
+}
+
+/** If the workers have used precomputed TAP DH keys, and they have nothing
+ * else to do, ask one of them to make some more.  We only do this when no
+ * onion skins are waiting, and one small batch at a time, so that a burst
+ * of CREATE cells never waits long behind a refill. */
+static void
+tap_dh_pool_maybe_refill(void)
+{
+  tap_dh_refill_job_t *job;
+  if (tap_dh_refill_pending || !threadpool || tap_dh_keys_wanted <= 0 ||
+      total_pending_tasks > 0 ||
+      onion_num_pending(ONION_HANDSHAKE_TYPE_TAP) > 0 ||
+      onion_num_pending(ONION_HANDSHAKE_TYPE_NTOR) > 0)
+    return;
+  job = tor_malloc_zero(sizeof(tap_dh_refill_job_t));
+  if (!threadpool_queue_work_priority(threadpool, WQ_PRI_LOW,
+                                      tap_dh_refill_threadfn,
+                                      tap_dh_refill_replyfn, job)) {
+    tor_free(job);
+    return;
+  }
+  tap_dh_refill_pending = 1;
+}
+
+/** Queue <b>fn</b> to be run on one of the cpuworker threads with argument
+ * <b>arg</b> at <b>priority</b>, and <b>reply_fn</b> to be run on the main
+ * thread once it is done.  Onionskins go at WQ_PRI_HIGH; use that only for
+ * work that the network or the main thread is waiting on.
+ *
+ * Semantics are as for threadpool_queue_work_priority(); in particular,
+ * replies may arrive in a different order from the one in which work was
+ * queued, and the reply function is responsible for freeing <b>arg</b>.
+ *
+ * The worker function receives the cpuworker's thread state as its first
+ * argument, and must not use it.
+ *
+ * Return the new workqueue_entry_t on success, or NULL on failure
+ * (including when the cpuworkers haven't been started, as on clients). */
+MOCK_IMPL(workqueue_entry_t *,
+cpuworker_queue_work,(workqueue_priority_t priority,
+                      workqueue_reply_t (*fn)(void *, void *),
+                      void (*reply_fn)(void *),
+                      void *arg))
+{
+  if (!threadpool)
+    return NULL;
+
+  return threadpool_queue_work_priority(threadpool, priority,
+                                        fn, reply_fn, arg);
 }
 
 /** Try to tell a cpuworker to perform the public key operations necessary to
@@ -487,10 +1131,7 @@ int
 assign_onionskin_to_cpuworker(or_circuit_t *circ,
                               create_cell_t *onionskin)
 {
-  workqueue_entry_t *queue_entry;
   cpuworker_job_t *job;
-  cpuworker_request_t req;
-  int should_time;
 
   tor_assert(threadpool);
 
@@ -509,43 +1150,9 @@ assign_onionskin_to_cpuworker(or_circuit_t *circ,
     return 0;
   }
 
-  if (connection_or_digest_is_known_relay(circ->p_chan->identity_digest))
-    rep_hist_note_circuit_handshake_assigned(onionskin->handshake_type);
-
-  should_time = should_time_request(onionskin->handshake_type);
-  memset(&req, 0, sizeof(req));
-  req.magic = CPUWORKER_REQUEST_MAGIC;
-  req.timed = should_time;
-
-  memcpy(&req.create_cell, onionskin, sizeof(create_cell_t));
-
-  tor_free(onionskin);
-
-  if (should_time)
-    tor_gettimeofday(&req.started_at);
-
-  job = tor_malloc_zero(sizeof(cpuworker_job_t));
-  job->circ = circ;
-  memcpy(&job->u.request, &req, sizeof(req));
-  memwipe(&req, 0, sizeof(req));
-
-  ++total_pending_tasks;
-  queue_entry = threadpool_queue_work(threadpool,
-                                      cpuworker_onion_handshake_threadfn,
-                                      cpuworker_onion_handshake_replyfn,
-                                      job);
-  if (!queue_entry) {
-    log_warn(LD_BUG, "Couldn't queue work on threadpool");
-    tor_free(job);
-    return -1;
-  }
-
-  log_debug(LD_OR, "Queued task %p (qe=%p, circ=%p)",
-            job, queue_entry, job->circ);
-
-  circ->workqueue_entry = queue_entry;
-
-  return 0;
+  job = cpuworker_job_new(1);
+  cpuworker_job_add_task(job, circ, onionskin);
+  return cpuworker_queue_job(job);
 }
 
 /** If <b>circ</b> has a pending handshake that hasn't been processed yet,
@@ -554,18 +1161,31 @@ void
 cpuworker_cancel_circ_handshake(or_circuit_t *circ)
 {
   cpuworker_job_t *job;
+  int i;
   if (circ->workqueue_entry == NULL)
     return;
 
-  job = workqueue_entry_cancel(circ->workqueue_entry);
-  if (job) {
-    /* It successfully cancelled. */
-    memwipe(job, 0xe0, sizeof(*job));
-    tor_free(job);
-    tor_assert(total_pending_tasks > 0);
-    --total_pending_tasks;
-    /* if (!job), this is done in cpuworker_onion_handshake_replyfn. */
-    circ->workqueue_entry = NULL;
+  /* Other circuits may share this job, so just tell the reply function not
+   * to bother with this one. */
+  job = workqueue_entry_get_arg(circ->workqueue_entry);
+  for (i = 0; i < job->n_tasks; ++i) {
+    if (job->tasks[i].circ == circ) {
+      job->tasks[i].circ = NULL;
+      ++job->n_abandoned;
+      break;
+    }
+  }
+  tor_assert(i < job->n_tasks);
+
+  if (job->n_abandoned == job->n_tasks &&
+      workqueue_entry_cancel(circ->workqueue_entry)) {
+    /* Nobody wants anything from this job, and we cancelled it before a
+     * worker got to it. */
+    tor_assert(total_pending_tasks >= job->n_tasks);
+    total_pending_tasks -= job->n_tasks;
+    cpuworker_job_free(job, 0xe0);
+    /* Otherwise, this is done in cpuworker_onion_handshake_replyfn. */
   }
+  circ->workqueue_entry = NULL;
 }
 
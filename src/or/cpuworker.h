@@ -12,7 +12,12 @@
 #ifndef TOR_CPUWORKER_H
 #define TOR_CPUWORKER_H
 
+#include "workqueue.h"
+
 void cpu_init(void);
+void cpuworkers_set_cpu_affinity(const or_options_t *options);
+void cpuworkers_set_pool_size(const or_options_t *options);
+char *cpuworker_get_cpu_info(void);
 void cpuworkers_rotate_keyinfo(void);
 
 struct create_cell_t;
@@ -23,7 +28,45 @@ uint64_t estimated_usec_for_onionskins(uint32_t n_requests,
                                        uint16_t onionskin_type);
 void cpuworker_log_onionskin_overhead(int severity, int onionskin_type,
                                       const char *onionskin_type_name);
+void cpuworker_log_reply_stats(int severity);
 void cpuworker_cancel_circ_handshake(or_circuit_t *circ);
+int cpuworker_take_ntor_keypair(curve25519_keypair_t *keypair_out);
+
+MOCK_DECL(workqueue_entry_t *, cpuworker_queue_work,
+          (workqueue_priority_t priority,
+           workqueue_reply_t (*fn)(void *, void *),
+           void (*reply_fn)(void *),
+           void *arg));
+
+/** The parts of an onion handshake's trip through the cpuworkers that we
+ * keep histograms of. */
+typedef enum cpuworker_phase_t {
+  /** From handing the handshake to the threadpool until a worker starts
+   * on it. */
+  CPUWORKER_PHASE_QUEUE = 0,
+  /** The handshake itself, on the worker. */
+  CPUWORKER_PHASE_RUN,
+  /** From the worker finishing until the main thread handles the reply. */
+  CPUWORKER_PHASE_REPLY,
+} cpuworker_phase_t;
+#define CPUWORKER_N_PHASES (CPUWORKER_PHASE_REPLY + 1)
+
+struct latency_hist_t;
+const char *cpuworker_handshake_type_name(uint16_t handshake_type);
+const char *cpuworker_phase_name(cpuworker_phase_t phase);
+int cpuworker_timing_get_handshake_types(const uint16_t **types_out);
+const struct latency_hist_t *cpuworker_timing_get_interval_hist(
+                                              uint16_t handshake_type,
+                                              cpuworker_phase_t phase);
+void cpuworker_timing_reset_interval(void);
+char *cpuworker_timing_format(void);
+
+#ifdef CPUWORKER_PRIVATE
+STATIC void cpuworker_note_handshake_timing(uint16_t handshake_type,
+                                            int64_t queue_nsec,
+                                            int64_t run_nsec,
+                                            int64_t reply_nsec);
+#endif
 
 #endif
 
@@ -18,6 +18,11 @@
  * ignored Ed25519 keys.  We need to support those too until we're completely
  * sure that authorities will never downgrade.
  *
+ * Every vote lists its routerstatus entries sorted by RSA identity digest,
+ * so we collate with a merge over all the votes at once: we walk the
+ * identities in order, gather each one's entries from every vote, and
+ * decide about it on the spot.
+ *
  * This module is invoked exclusively from dirvote.c.
  */
 
@@ -25,117 +30,31 @@
 #include "dircollate.h"
 #include "dirvote.h"
 
-static void dircollator_collate_by_rsa(dircollator_t *dc);
-static void dircollator_collate_by_ed25519(dircollator_t *dc);
-
-/** Hashtable entry mapping a pair of digests (actually an ed25519 key and an
- * RSA SHA1 digest) to an array of vote_routerstatus_t. */
-typedef struct ddmap_entry_s {
-  HT_ENTRY(ddmap_entry_s) node;
-  /** A SHA1-RSA1024 identity digest and Ed25519 identity key,
-   * concatenated.  (If there is no ed25519 identity key, there is no
-   * entry in this table.) */
-  uint8_t d[DIGEST_LEN + DIGEST256_LEN];
-  /* The nth member of this array corresponds to the vote_routerstatus_t (if
-   * any) received for this digest pair from the nth voter. */
+/** One RSA identity that collation decided to include in the consensus. */
+typedef struct collated_router_t {
+  /** True iff we matched this identity by its <ed,rsa> pair. */
+  int is_ed25519_collated;
+  /* The nth member of this array is the vote_routerstatus_t (if any) from
+   * the nth voter that we matched for this identity. */
   vote_routerstatus_t *vrs_lst[FLEXIBLE_ARRAY_MEMBER];
-} ddmap_entry_t;
-
-/** Release all storage held by e. */
-static void
-ddmap_entry_free(ddmap_entry_t *e)
-{
-  tor_free(e);
-}
+} collated_router_t;
 
-/** Return a new empty ddmap_entry, with <b>n_votes</b> elements in
- * vrs_list. */
-static ddmap_entry_t *
-ddmap_entry_new(int n_votes)
+/** Return a new collated_router_t, with <b>n_votes</b> elements in
+ * vrs_lst. */
+static collated_router_t *
+collated_router_new(int n_votes)
 {
-  return tor_malloc_zero(STRUCT_OFFSET(ddmap_entry_t, vrs_lst) +
+  return tor_malloc_zero(STRUCT_OFFSET(collated_router_t, vrs_lst) +
                          sizeof(vote_routerstatus_t *) * n_votes);
 }
 
-/** Helper: compute a hash of a single ddmap_entry_t's identity (or
- * identities) */
-static unsigned
-ddmap_entry_hash(const ddmap_entry_t *ent)
-{
-  return (unsigned) siphash24g(ent->d, sizeof(ent->d));
-}
-
-/** Helper: return true if <b>a</b> and <b>b</b> have the same
- * identity/identities. */
-static unsigned
-ddmap_entry_eq(const ddmap_entry_t *a, const ddmap_entry_t *b)
-{
-  return fast_memeq(a->d, b->d, sizeof(a->d));
-}
-
-/** Record the RSA identity of <b>ent</b> as <b>rsa_sha1</b>, and the
- * ed25519 identity as <b>ed25519</b>.  Both must be provided. */
-static void
-ddmap_entry_set_digests(ddmap_entry_t *ent,
-                        const uint8_t *rsa_sha1,
-                        const uint8_t *ed25519)
+/** Helper for sorting: compare two vote_routerstatus_t by RSA identity. */
+static int
+compare_vrs_by_rsa_id_(const void **a_, const void **b_)
 {
-  memcpy(ent->d, rsa_sha1, DIGEST_LEN);
-  memcpy(ent->d + DIGEST_LEN, ed25519, DIGEST256_LEN);
-}
-
-HT_PROTOTYPE(double_digest_map, ddmap_entry_s, node, ddmap_entry_hash,
-             ddmap_entry_eq)
-HT_GENERATE2(double_digest_map, ddmap_entry_s, node, ddmap_entry_hash,
-             ddmap_entry_eq, 0.6, tor_reallocarray, tor_free_)
-
-/** Helper: add a single vote_routerstatus_t <b>vrs</b> to the collator
- * <b>dc</b>, indexing it by its RSA key digest, and by the 2-tuple of its RSA
- * key digest and Ed25519 key.   It must come from the <b>vote_num</b>th
- * vote.
- *
- * Requires that the vote is well-formed -- that is, that it has no duplicate
- * routerstatus entries.  We already checked for that when parsing the vote. */
-static void
-dircollator_add_routerstatus(dircollator_t *dc,
-                             int vote_num,
-                             networkstatus_t *vote,
-                             vote_routerstatus_t *vrs)
-{
-  const char *id = vrs->status.identity_digest;
-
-  /* Clear this flag; we might set it later during the voting process */
-  vrs->ed25519_reflects_consensus = 0;
-
-  (void) vote; // We don't currently need this.
-
-  /* First, add this item to the appropriate RSA-SHA-Id array. */
-  vote_routerstatus_t **vrs_lst = digestmap_get(dc->by_rsa_sha1, id);
-  if (NULL == vrs_lst) {
-    vrs_lst = tor_calloc(dc->n_votes, sizeof(vote_routerstatus_t *));
-    digestmap_set(dc->by_rsa_sha1, id, vrs_lst);
-  }
-  tor_assert(vrs_lst[vote_num] == NULL);
-  vrs_lst[vote_num] = vrs;
-
-  const uint8_t *ed = vrs->ed25519_id;
-
-  if (! vrs->has_ed25519_listing)
-    return;
-
-  /* Now add it to the appropriate <Ed,RSA-SHA-Id> array. */
-  ddmap_entry_t search, *found;
-  memset(&search, 0, sizeof(search));
-  ddmap_entry_set_digests(&search, (const uint8_t *)id, ed);
-  found = HT_FIND(double_digest_map, &dc->by_both_ids, &search);
-  if (NULL == found) {
-    found = ddmap_entry_new(dc->n_votes);
-    ddmap_entry_set_digests(found, (const uint8_t *)id, ed);
-    HT_INSERT(double_digest_map, &dc->by_both_ids, found);
-  }
-  vrs_lst = found->vrs_lst;
-  tor_assert(vrs_lst[vote_num] == NULL);
-  vrs_lst[vote_num] = vrs;
+  const vote_routerstatus_t *a = *a_, *b = *b_;
+  return fast_memcmp(a->status.identity_digest, b->status.identity_digest,
+                     DIGEST_LEN);
 }
 
 /** Create and return a new dircollator object to use when collating
@@ -150,8 +69,9 @@ dircollator_new(int n_votes, int n_authorities)
   dc->n_votes = n_votes;
   dc->n_authorities = n_authorities;
 
-  dc->by_rsa_sha1 = digestmap_new();
-  HT_INIT(double_digest_map, &dc->by_both_ids);
+  dc->vote_lists = tor_calloc(n_votes, sizeof(smartlist_t *));
+  dc->owned_lists = smartlist_new();
+  dc->collated = smartlist_new();
 
   return dc;
 }
@@ -163,20 +83,11 @@ dircollator_free(dircollator_t *dc)
   if (!dc)
     return;
 
-  if (dc->by_collated_rsa_sha1 != dc->by_rsa_sha1)
-    digestmap_free(dc->by_collated_rsa_sha1, NULL);
-
-  digestmap_free(dc->by_rsa_sha1, tor_free_);
-  smartlist_free(dc->all_rsa_sha1_lst);
-
-  ddmap_entry_t **e, **next, *this;
-  for (e = HT_START(double_digest_map, &dc->by_both_ids);
-       e != NULL; e = next) {
-    this = *e;
-    next = HT_NEXT_RMV(double_digest_map, &dc->by_both_ids, e);
-    ddmap_entry_free(this);
-  }
-  HT_CLEAR(double_digest_map, &dc->by_both_ids);
+  SMARTLIST_FOREACH(dc->owned_lists, smartlist_t *, sl, smartlist_free(sl));
+  smartlist_free(dc->owned_lists);
+  tor_free(dc->vote_lists);
+  SMARTLIST_FOREACH(dc->collated, collated_router_t *, r, tor_free(r));
+  smartlist_free(dc->collated);
 
   tor_free(dc);
 }
@@ -184,145 +95,166 @@ dircollator_free(dircollator_t *dc)
 /** Add a single vote <b>v</b> to a dircollator <b>dc</b>.  This function must
  * be called exactly once for each vote to be used in the consensus. It may
  * only be called before dircollator_collate().
+ *
+ * Requires that the vote is well-formed -- that is, that it has no duplicate
+ * routerstatus entries.  We already checked for that when parsing the vote,
+ * along with their order; but if the entries are out of order anyway, we
+ * sort a copy of them.
  */
 void
 dircollator_add_vote(dircollator_t *dc, networkstatus_t *v)
 {
+  smartlist_t *lst = v->routerstatus_list;
+  int i;
+
   tor_assert(v->type == NS_TYPE_VOTE);
   tor_assert(dc->next_vote_num < dc->n_votes);
   tor_assert(!dc->is_collated);
 
-  const int votenum = dc->next_vote_num++;
-
-  SMARTLIST_FOREACH_BEGIN(v->routerstatus_list, vote_routerstatus_t *, vrs) {
-    dircollator_add_routerstatus(dc, votenum, v, vrs);
-  } SMARTLIST_FOREACH_END(vrs);
-}
-
-/** Sort the entries in <b>dc</b> according to <b>consensus_method</b>, so
- * that the consensus process can iterate over them with
- * dircollator_n_routers() and dircollator_get_votes_for_router(). */
-void
-dircollator_collate(dircollator_t *dc, int consensus_method)
-{
-  tor_assert(!dc->is_collated);
-  dc->all_rsa_sha1_lst = smartlist_new();
-
-  if (consensus_method < MIN_METHOD_FOR_ED25519_ID_VOTING)
-    dircollator_collate_by_rsa(dc);
-  else
-    dircollator_collate_by_ed25519(dc);
+  for (i = 1; i < smartlist_len(lst); ++i) {
+    const vote_routerstatus_t *a = smartlist_get(lst, i-1);
+    const vote_routerstatus_t *b = smartlist_get(lst, i);
+    if (fast_memcmp(a->status.identity_digest, b->status.identity_digest,
+                    DIGEST_LEN) >= 0)
+      break;
+  }
+  if (i < smartlist_len(lst)) {
+    lst = smartlist_new();
+    smartlist_add_all(lst, v->routerstatus_list);
+    smartlist_sort(lst, compare_vrs_by_rsa_id_);
+    smartlist_add(dc->owned_lists, lst);
+  }
 
-  smartlist_sort_digests(dc->all_rsa_sha1_lst);
-  dc->is_collated = 1;
+  dc->vote_lists[dc->next_vote_num++] = lst;
 }
 
-/**
- * Collation function for RSA-only consensuses: collate the votes for each
- * entry in <b>dc</b> by their RSA keys.
+/** Helper for dircollator_collate(): decide whether to include the RSA
+ * identity whose entries from every vote are in <b>vrs_lst</b> (which has
+ * <b>n_listing</b> non-NULL members), according to
+ * <b>consensus_method</b>.  If so, add it to the end of dc-\>collated.
  *
- * The rule is:
+ * For RSA-only consensus methods, the rule is:
  *    If an RSA identity key is listed by more than half of the authorities,
  *    include that identity, and treat all descriptors with that RSA identity
  *    as describing the same router.
- */
-static void
-dircollator_collate_by_rsa(dircollator_t *dc)
-{
-  const int total_authorities = dc->n_authorities;
-
-  DIGESTMAP_FOREACH(dc->by_rsa_sha1, k, vote_routerstatus_t **, vrs_lst) {
-    int n = 0, i;
-    for (i = 0; i < dc->n_votes; ++i) {
-      if (vrs_lst[i] != NULL)
-        ++n;
-    }
-
-    if (n <= total_authorities / 2)
-      continue;
-
-    smartlist_add(dc->all_rsa_sha1_lst, (char *)k);
-  } DIGESTMAP_FOREACH_END;
-
-  dc->by_collated_rsa_sha1 = dc->by_rsa_sha1;
-}
-
-/**
- * Collation function for ed25519 consensuses: collate the votes for each
- * entry in <b>dc</b> by ed25519 key and by RSA key.
  *
- * The rule is, approximately:
+ * For ed25519 consensus methods, the rule is, approximately:
  *    If a (ed,rsa) identity is listed by more than half of authorities,
  *    include it.  And include all (rsa)-only votes about that node as
  *    matching.
  *
  *    Otherwise, if an (*,rsa) or (rsa) identity is listed by more than
- *    half of the authorities, and no (ed,rsa) pair for the same RSA key
- *    has been already been included based on the rule above, include
- *    that RSA identity.
+ *    half of the authorities, include that RSA identity.
+ *
+ * No vote lists an RSA identity twice, so at most one (ed,rsa) pair can
+ * have a majority.
  */
 static void
-dircollator_collate_by_ed25519(dircollator_t *dc)
+dircollator_collate_one(dircollator_t *dc, int consensus_method,
+                        vote_routerstatus_t **vrs_lst, int n_listing)
 {
   const int total_authorities = dc->n_authorities;
-  digestmap_t *rsa_digests = digestmap_new();
+  collated_router_t *r;
+  int i, j;
 
-  ddmap_entry_t **iter;
+  if (n_listing <= total_authorities / 2)
+    return; /* Not enough votes, however we count them. */
 
-  /* Go over all <ed,rsa> pairs */
-  HT_FOREACH(iter, double_digest_map, &dc->by_both_ids) {
-    ddmap_entry_t *ent = *iter;
-    int n = 0, i;
+  if (consensus_method >= MIN_METHOD_FOR_ED25519_ID_VOTING) {
     for (i = 0; i < dc->n_votes; ++i) {
-      if (ent->vrs_lst[i] != NULL)
-        ++n;
+      const uint8_t *ed;
+      int n = 0;
+      if (!vrs_lst[i] || !vrs_lst[i]->has_ed25519_listing)
+        continue;
+      ed = vrs_lst[i]->ed25519_id;
+      for (j = 0; j < dc->n_votes; ++j) {
+        if (vrs_lst[j] && vrs_lst[j]->has_ed25519_listing &&
+            fast_memeq(vrs_lst[j]->ed25519_id, ed, DIGEST256_LEN))
+          ++n;
+      }
+      if (n <= total_authorities / 2)
+        continue;
+
+      /* Include the votes for this pair, and the votes that say this
+       * identity has no ed25519 key. */
+      r = collated_router_new(dc->n_votes);
+      r->is_ed25519_collated = 1;
+      for (j = 0; j < dc->n_votes; ++j) {
+        if (vrs_lst[j] && (!vrs_lst[j]->has_ed25519_listing ||
+                fast_memeq(vrs_lst[j]->ed25519_id, ed, DIGEST256_LEN)))
+          r->vrs_lst[j] = vrs_lst[j];
+      }
+      smartlist_add(dc->collated, r);
+      return;
     }
+  }
 
-    /* If not enough authorties listed this exact <ed,rsa> pair,
-     * don't include it. */
-    if (n <= total_authorities / 2)
-      continue;
+  r = collated_router_new(dc->n_votes);
+  memcpy(r->vrs_lst, vrs_lst, sizeof(vote_routerstatus_t *) * dc->n_votes);
+  smartlist_add(dc->collated, r);
+}
 
-    /* Now consider whether there are any other entries with the same
-     * RSA key (but with possibly different or missing ed value). */
-    vote_routerstatus_t **vrs_lst2 = digestmap_get(dc->by_rsa_sha1,
-                                                   (char*)ent->d);
-    tor_assert(vrs_lst2);
+/** Collate the entries in <b>dc</b> according to <b>consensus_method</b>,
+ * so that the consensus process can iterate over them with
+ * dircollator_n_routers() and dircollator_get_votes_for_router(). */
+void
+dircollator_collate(dircollator_t *dc, int consensus_method)
+{
+  int *pos; /* pos[j] is our position in the jth vote's entries. */
+  vote_routerstatus_t **vrs_lst;
+  int i;
 
-    for (i = 0; i < dc->n_votes; ++i) {
-      if (ent->vrs_lst[i] != NULL) {
-        ent->vrs_lst[i]->ed25519_reflects_consensus = 1;
-      } else if (vrs_lst2[i] && ! vrs_lst2[i]->has_ed25519_listing) {
-        ent->vrs_lst[i] = vrs_lst2[i];
-      }
-    }
+  tor_assert(!dc->is_collated);
+  tor_assert(dc->next_vote_num == dc->n_votes);
 
-    /* Record that we have seen this RSA digest. */
-    digestmap_set(rsa_digests, (char*)ent->d, ent->vrs_lst);
-    smartlist_add(dc->all_rsa_sha1_lst, ent->d);
-  }
+  pos = tor_calloc(dc->n_votes, sizeof(int));
+  vrs_lst = tor_calloc(dc->n_votes, sizeof(vote_routerstatus_t *));
 
-  /* Now look over all entries with an RSA digest, looking for RSA digests
-   * we didn't put in yet.
-   */
-  DIGESTMAP_FOREACH(dc->by_rsa_sha1, k, vote_routerstatus_t **, vrs_lst) {
-    if (digestmap_get(rsa_digests, k) != NULL)
-      continue; /* We already included this RSA digest */
+  while (1) {
+    const char *lowest = NULL;
+    int n_listing = 0;
 
-    int n = 0, i;
+    /* Which is the lowest RSA identity that we haven't done yet? */
     for (i = 0; i < dc->n_votes; ++i) {
-      if (vrs_lst[i] != NULL)
-        ++n;
+      vote_routerstatus_t *vrs;
+      if (pos[i] >= smartlist_len(dc->vote_lists[i]))
+        continue;
+      vrs = smartlist_get(dc->vote_lists[i], pos[i]);
+      if (!lowest ||
+          fast_memcmp(vrs->status.identity_digest, lowest, DIGEST_LEN) < 0)
+        lowest = vrs->status.identity_digest;
     }
+    if (!lowest)
+      break;
 
-    if (n <= total_authorities / 2)
-      continue; /* Not enough votes */
+    /* Take every vote's entry for it. */
+    for (i = 0; i < dc->n_votes; ++i) {
+      vote_routerstatus_t *vrs = NULL;
+      if (pos[i] < smartlist_len(dc->vote_lists[i]))
+        vrs = smartlist_get(dc->vote_lists[i], pos[i]);
+      if (vrs && fast_memeq(vrs->status.identity_digest, lowest,
+                            DIGEST_LEN)) {
+        vrs_lst[i] = vrs;
+        ++pos[i];
+        ++n_listing;
+        /* A well-formed vote doesn't list anybody twice. */
+        if (pos[i] < smartlist_len(dc->vote_lists[i])) {
+          vote_routerstatus_t *next = smartlist_get(dc->vote_lists[i],
+                                                    pos[i]);
+          tor_assert(fast_memneq(next->status.identity_digest, lowest,
+                                 DIGEST_LEN));
+        }
+      } else {
+        vrs_lst[i] = NULL;
+      }
+    }
 
-    digestmap_set(rsa_digests, k, vrs_lst);
-    smartlist_add(dc->all_rsa_sha1_lst, (char *)k);
-  } DIGESTMAP_FOREACH_END;
+    dircollator_collate_one(dc, consensus_method, vrs_lst, n_listing);
+  }
 
-  dc->by_collated_rsa_sha1 = rsa_digests;
+  tor_free(pos);
+  tor_free(vrs_lst);
+  dc->is_collated = 1;
 }
 
 /** Return the total number of collated router entries.  This function may
@@ -331,7 +263,7 @@ int
 dircollator_n_routers(dircollator_t *dc)
 {
   tor_assert(dc->is_collated);
-  return smartlist_len(dc->all_rsa_sha1_lst);
+  return smartlist_len(dc->collated);
 }
 
 /** Return an array of vote_routerstatus_t entries for the <b>idx</b>th router
@@ -345,9 +277,26 @@ dircollator_n_routers(dircollator_t *dc)
 vote_routerstatus_t **
 dircollator_get_votes_for_router(dircollator_t *dc, int idx)
 {
+  collated_router_t *r;
+  tor_assert(dc->is_collated);
+  tor_assert(idx < smartlist_len(dc->collated));
+  r = smartlist_get(dc->collated, idx);
+  return r->vrs_lst;
+}
+
+/** Return true iff the <b>idx</b>th router in the collation order was
+ * matched by its <ed,rsa> identity pair.  If so, exactly the entries
+ * returned by dircollator_get_votes_for_router() that have an ed25519
+ * listing agree with the consensus on its ed25519 identity.
+ *
+ * This function may only be called after dircollator_collate. */
+int
+dircollator_router_is_ed25519_collated(dircollator_t *dc, int idx)
+{
+  collated_router_t *r;
   tor_assert(dc->is_collated);
-  tor_assert(idx < smartlist_len(dc->all_rsa_sha1_lst));
-  return digestmap_get(dc->by_collated_rsa_sha1,
-                       smartlist_get(dc->all_rsa_sha1_lst, idx));
+  tor_assert(idx < smartlist_len(dc->collated));
+  r = smartlist_get(dc->collated, idx);
+  return r->is_ed25519_collated;
 }
 
@@ -26,10 +26,9 @@ void dircollator_collate(dircollator_t *dc, int consensus_method);
 int dircollator_n_routers(dircollator_t *dc);
 vote_routerstatus_t **dircollator_get_votes_for_router(dircollator_t *dc,
                                                        int idx);
+int dircollator_router_is_ed25519_collated(dircollator_t *dc, int idx);
 
 #ifdef DIRCOLLATE_PRIVATE
-struct ddmap_entry_s;
-typedef HT_HEAD(double_digest_map, ddmap_entry_s) double_digest_map_t;
 /** A dircollator keeps track of all the routerstatus entries in a
  * set of networkstatus votes, and matches them by an appropriate rule. */
 struct dircollator_s {
@@ -43,24 +42,19 @@ struct dircollator_s {
   /** The index which the next vote to be added to this collator should
    * receive. */
   int next_vote_num;
-  /** Map from RSA-SHA1 identity digest to an array of <b>n_votes</b>
-   * vote_routerstatus_t* pointers, such that the i'th member of the
-   * array is the i'th vote's entry for that RSA-SHA1 ID.*/
-  digestmap_t *by_rsa_sha1;
-  /** Map from <ed, RSA-SHA1> pair to an array similar to that used in
-   * by_rsa_sha1 above. We include <NULL,RSA-SHA1> entries for votes that
-   * say that there is no Ed key. */
-  struct double_digest_map by_both_ids;
-
-  /** One of two outputs created by collation: a map from RSA-SHA1
-   * identity digest to an array of the vote_routerstatus_t objects.  Entries
-   * only exist in this map for identities that we should include in the
-   * consensus. */
-  digestmap_t *by_collated_rsa_sha1;
-
-  /** One of two outputs created by collation: a sorted array of RSA-SHA1
-   * identity digests .*/
-  smartlist_t *all_rsa_sha1_lst;
+  /** An array of <b>n_votes</b> lists: the i'th is the i'th vote's
+   * vote_routerstatus_t entries, sorted by RSA-SHA1 identity digest. */
+  smartlist_t **vote_lists;
+  /** Those members of vote_lists that we had to sort ourselves, and so
+   * must free. */
+  smartlist_t *owned_lists;
+
+  /** The output of collation: a list of collated_router_t, one for each
+   * identity that we should include in the consensus, sorted by RSA-SHA1
+   * identity digest.  We keep the ed25519 matches here rather than marking
+   * the votes' entries so that several collators can share the same votes
+   * at once. */
+  smartlist_t *collated;
 };
 #endif
 
@@ -10,6 +10,7 @@
 #include "config.h"
 #include "connection.h"
 #include "connection_edge.h"
+#include "consdiff.h"
 #include "control.h"
 #include "directory.h"
 #include "dirserv.h"
@@ -81,7 +82,15 @@ static void dir_routerdesc_download_failed(smartlist_t *failed,
                                            int was_descriptor_digests);
 static void dir_microdesc_download_failed(smartlist_t *failed,
                                           int status_code);
+static void connection_dir_note_md_throughput(const dir_connection_t *conn,
+                                              int n_received);
+static void connection_dir_close_redundant_md_fetches(
+                                         const dir_connection_t *except);
 static int client_likes_consensus(networkstatus_t *v, const char *want_url);
+static void connection_dir_client_note_headers(dir_connection_t *conn,
+                                               const char *headers,
+                                               time_t date_header);
+static int connection_dir_client_stream_finish(dir_connection_t *conn);
 
 static void directory_initiate_command_rend(
                                           const tor_addr_port_t *or_addr_port,
@@ -440,6 +449,27 @@ directory_pick_generic_dirserver(dirinfo_type_t type, int pds_flags,
   return rs;
 }
 
+/** If directory_get_from_dirserver() would download information for
+ * <b>dir_purpose</b> directly from a mirror that it picks with
+ * directory_pick_generic_dirserver() -- not from a bridge or an authority,
+ * and not over a Tor circuit -- pick that mirror using <b>pds_flags</b> and
+ * return its routerstatus.  Otherwise, return NULL. */
+MOCK_IMPL(const routerstatus_t *,
+directory_pick_mirror_for_fetch,(uint8_t dir_purpose, int pds_flags))
+{
+  const or_options_t *options = get_options();
+  dirinfo_type_t type = dir_fetch_type(dir_purpose, ROUTER_PURPOSE_GENERAL,
+                                       NULL);
+
+  if (type == NO_DIRINFO || (type & BRIDGE_DIRINFO) ||
+      !options->FetchServerDescriptors ||
+      options->UseBridges ||
+      directory_fetches_from_authorities(options) ||
+      purpose_needs_anonymity(dir_purpose, ROUTER_PURPOSE_GENERAL))
+    return NULL;
+  return directory_pick_generic_dirserver(type, pds_flags, dir_purpose);
+}
+
 /** Start a connection to a random running directory server, using
  * connection purpose <b>dir_purpose</b>, intending to fetch descriptors
  * of purpose <b>router_purpose</b>, and requesting <b>resource</b>.
@@ -1179,6 +1209,7 @@ directory_initiate_command_rend(const tor_addr_port_t *or_addr_port,
   }
 
   conn = dir_connection_new(tor_addr_family(&addr));
+  conn->request_started_msec = monotime_coarse_absolute_msec();
 
   /* set up conn so it's got all the data we need to remember */
   tor_addr_copy(&conn->base_.addr, &addr);
@@ -1372,6 +1403,29 @@ copy_ipv6_address(char* destination, const char* source, size_t len,
   }
 }
 
+/** Return a newly allocated value for the Accept-Encoding header we send
+ * with our requests: every compression method we can decode, best first. */
+STATIC char *
+directory_get_accept_encoding(void)
+{
+  static const compress_method_t client_meth_pref[] = {
+    LZMA_METHOD, ZSTD_METHOD, ZLIB_METHOD, GZIP_METHOD,
+  };
+  smartlist_t *names = smartlist_new();
+  char *result;
+  unsigned i;
+
+  for (i = 0; i < ARRAY_LENGTH(client_meth_pref); ++i) {
+    if (tor_compress_supports_method(client_meth_pref[i]))
+      smartlist_add(names,
+             (char *) compression_method_get_name(client_meth_pref[i]));
+  }
+  smartlist_add(names, (char *) compression_method_get_name(NO_METHOD));
+  result = smartlist_join_strings(names, ", ", 0, NULL);
+  smartlist_free(names);
+  return result;
+}
+
 /** Queue an appropriate HTTP command on conn-\>outbuf.  The other args
  * are as in directory_initiate_command().
  */
@@ -1421,6 +1475,18 @@ directory_send_command(dir_connection_t *conn,
     smartlist_add_asprintf(headers, "If-Modified-Since: %s\r\n", b);
   }
 
+  /* Offer to take a diff from the consensus we already have. */
+  if (purpose == DIR_PURPOSE_FETCH_CONSENSUS) {
+    uint8_t digest[DIGEST256_LEN];
+    if (networkstatus_get_diff_base_digest(resource ? resource : "ns",
+                                           digest) == 0) {
+      char hex[HEX_DIGEST256_LEN+1];
+      base16_encode(hex, sizeof(hex), (const char*)digest, DIGEST256_LEN);
+      smartlist_add_asprintf(headers, "%s%s\r\n",
+                             X_OR_DIFF_FROM_CONSENSUS_HEADER, hex);
+    }
+  }
+
   /* come up with some proxy lines, if we're using one. */
   if (direct && get_options()->HTTPProxy) {
     char *base64_authenticator=NULL;
@@ -1538,6 +1604,13 @@ directory_send_command(dir_connection_t *conn,
   connection_write_to_buf(url, strlen(url), TO_CONN(conn));
   tor_free(url);
 
+  if (!strcmp(httpcommand, "GET")) {
+    char *accept_encoding = directory_get_accept_encoding();
+    smartlist_add_asprintf(headers, "Accept-Encoding: %s\r\n",
+                           accept_encoding);
+    tor_free(accept_encoding);
+  }
+
   if (!strcmp(httpcommand, "POST") || payload) {
     smartlist_add_asprintf(headers, "Content-Length: %lu\r\n",
                  payload ? (unsigned long)payload_len : 0);
@@ -1743,16 +1816,13 @@ parse_http_response(const char *headers, int *code, time_t *date,
       if (!strcmpstart(s, "Content-Encoding: ")) {
         enc = s+18; break;
       });
-    if (!enc || !strcmp(enc, "identity")) {
+    if (!enc) {
       *compression = NO_METHOD;
-    } else if (!strcmp(enc, "deflate") || !strcmp(enc, "x-deflate")) {
-      *compression = ZLIB_METHOD;
-    } else if (!strcmp(enc, "gzip") || !strcmp(enc, "x-gzip")) {
-      *compression = GZIP_METHOD;
     } else {
-      log_info(LD_HTTP, "Unrecognized content encoding: %s. Trying to deal.",
-               escaped(enc));
-      *compression = UNKNOWN_METHOD;
+      *compression = compression_method_get_by_name(enc);
+      if (*compression == UNKNOWN_METHOD)
+        log_info(LD_HTTP, "Unrecognized content encoding: %s. Trying to deal.",
+                 escaped(enc));
     }
   }
   SMARTLIST_FOREACH(parsed_headers, char *, s, tor_free(s));
@@ -1788,15 +1858,17 @@ body_is_plausible(const char *body, size_t len, int purpose)
 }
 
 /** Called when we've just fetched a bunch of router descriptors in
- * <b>body</b>.  The list <b>which</b>, if present, holds digests for
- * descriptors we requested: descriptor digests if <b>descriptor_digests</b>
- * is true, or identity digests otherwise.  Parse the descriptors, validate
+ * <b>body</b> (ending just before <b>eos</b>, if <b>eos</b> is provided).
+ * The list <b>which</b>, if present, holds digests for descriptors we
+ * requested: descriptor digests if <b>descriptor_digests</b> is true, or
+ * identity digests otherwise.  Parse the descriptors, validate
  * them, and annotate them as having purpose <b>purpose</b> and as having been
  * downloaded from <b>source</b>.
  *
  * Return the number of routers actually added. */
 static int
-load_downloaded_routers(const char *body, smartlist_t *which,
+load_downloaded_routers(const char *body, const char *eos,
+                        smartlist_t *which,
                         int descriptor_digests,
                         int router_purpose,
                         const char *source)
@@ -1817,7 +1889,7 @@ load_downloaded_routers(const char *body, smartlist_t *which,
                    !general ? "\n" : "")<0)
     return added;
 
-  added = router_load_routers_from_string(body, NULL, SAVED_NOWHERE, which,
+  added = router_load_routers_from_string(body, eos, SAVED_NOWHERE, which,
                                   descriptor_digests, buf);
   if (added && general)
     control_event_bootstrap(BOOTSTRAP_STATUS_LOADING_DESCRIPTORS,
@@ -1825,6 +1897,42 @@ load_downloaded_routers(const char *body, smartlist_t *which,
   return added;
 }
 
+/** We are a client, and we've received the <b>headers</b> of the server's
+ * response, with a Date header of <b>date_header</b> (or 0 if it had none).
+ * Learn what we can from them about our address and our clock. */
+static void
+connection_dir_client_note_headers(dir_connection_t *conn,
+                                   const char *headers, time_t date_header)
+{
+  long apparent_skew;
+
+  /* now check if it's got any hints for us about our IP address. */
+  if (conn->dirconn_direct) {
+    char *guess = http_get_header(headers, X_ADDRESS_HEADER);
+    if (guess) {
+      router_new_address_suggestion(guess, conn);
+      tor_free(guess);
+    }
+  }
+
+  if (date_header > 0) {
+    /* The date header was written very soon after we sent our request,
+     * so compute the skew as the difference between sending the request
+     * and the date header.  (We used to check now-date_header, but that's
+     * inaccurate if we spend a lot of time downloading.)
+     */
+    apparent_skew = conn->base_.timestamp_lastwritten - date_header;
+    if (labs(apparent_skew)>ALLOW_DIRECTORY_TIME_SKEW) {
+      int trusted = router_digest_is_trusted_dir(conn->identity_digest);
+      clock_skew_warning(TO_CONN(conn), apparent_skew, trusted, LD_HTTP,
+                         "directory", "DIRSERV");
+    } else {
+      log_debug(LD_HTTP, "Time on received directory is within tolerance; "
+                "we are %ld seconds skewed.  (That's okay.)", apparent_skew);
+    }
+  }
+}
+
 /** We are a client, and we've finished reading the server's
  * response. Parse it and act appropriately.
  *
@@ -1843,16 +1951,18 @@ connection_dir_client_reached_eof(dir_connection_t *conn)
   size_t body_len = 0;
   int status_code;
   time_t date_header = 0;
-  long apparent_skew;
   compress_method_t compression;
   int plausible;
-  int skewed = 0;
   int allow_partial = (conn->base_.purpose == DIR_PURPOSE_FETCH_SERVERDESC ||
                        conn->base_.purpose == DIR_PURPOSE_FETCH_EXTRAINFO ||
                        conn->base_.purpose == DIR_PURPOSE_FETCH_MICRODESC);
   time_t now = time(NULL);
   int src_code;
 
+  /* If we've been parsing the body as it arrived, just finish up. */
+  if (conn->stream)
+    return connection_dir_client_stream_finish(conn);
+
   switch (connection_fetch_from_buf_http(TO_CONN(conn),
                               &headers, MAX_HEADERS_SIZE,
                               &body, &body_len, MAX_DIR_DL_SIZE,
@@ -1885,33 +1995,7 @@ connection_dir_client_reached_eof(dir_connection_t *conn)
             escaped(reason),
             conn->base_.purpose);
 
-  /* now check if it's got any hints for us about our IP address. */
-  if (conn->dirconn_direct) {
-    char *guess = http_get_header(headers, X_ADDRESS_HEADER);
-    if (guess) {
-      router_new_address_suggestion(guess, conn);
-      tor_free(guess);
-    }
-  }
-
-  if (date_header > 0) {
-    /* The date header was written very soon after we sent our request,
-     * so compute the skew as the difference between sending the request
-     * and the date header.  (We used to check now-date_header, but that's
-     * inaccurate if we spend a lot of time downloading.)
-     */
-    apparent_skew = conn->base_.timestamp_lastwritten - date_header;
-    if (labs(apparent_skew)>ALLOW_DIRECTORY_TIME_SKEW) {
-      int trusted = router_digest_is_trusted_dir(conn->identity_digest);
-      clock_skew_warning(TO_CONN(conn), apparent_skew, trusted, LD_HTTP,
-                         "directory", "DIRSERV");
-      skewed = 1; /* don't check the recommended-versions line */
-    } else {
-      log_debug(LD_HTTP, "Time on received directory is within tolerance; "
-                "we are %ld seconds skewed.  (That's okay.)", apparent_skew);
-    }
-  }
-  (void) skewed; /* skewed isn't used yet. */
+  connection_dir_client_note_headers(conn, headers, date_header);
 
   if (status_code == 503) {
     routerstatus_t *rs;
@@ -1942,6 +2026,10 @@ connection_dir_client_reached_eof(dir_connection_t *conn)
         description1 = "as deflated";
       else if (compression == GZIP_METHOD)
         description1 = "as gzipped";
+      else if (compression == ZSTD_METHOD)
+        description1 = "as Zstandard-compressed";
+      else if (compression == LZMA_METHOD)
+        description1 = "as LZMA-compressed";
       else if (compression == NO_METHOD)
         description1 = "as uncompressed";
       else
@@ -1950,6 +2038,10 @@ connection_dir_client_reached_eof(dir_connection_t *conn)
         description2 = "deflated";
       else if (guessed == GZIP_METHOD)
         description2 = "gzipped";
+      else if (guessed == ZSTD_METHOD)
+        description2 = "Zstandard-compressed";
+      else if (guessed == LZMA_METHOD)
+        description2 = "LZMA-compressed";
       else if (!plausible)
         description2 = "confusing binary junk";
       else
@@ -1962,13 +2054,13 @@ connection_dir_client_reached_eof(dir_connection_t *conn)
                (compression>0 && guessed>0)?"  Trying both.":"");
     }
     /* Try declared compression first if we can. */
-    if (compression == GZIP_METHOD  || compression == ZLIB_METHOD)
+    if (tor_compress_supports_method(compression))
       tor_gzip_uncompress(&new_body, &new_len, body, body_len, compression,
                           !allow_partial, LOG_PROTOCOL_WARN);
     /* Okay, if that didn't work, and we think that it was compressed
      * differently, try that. */
     if (!new_body &&
-        (guessed == GZIP_METHOD || guessed == ZLIB_METHOD) &&
+        tor_compress_supports_method(guessed) &&
         compression != guessed)
       tor_gzip_uncompress(&new_body, &new_len, body, body_len, guessed,
                           !allow_partial, LOG_PROTOCOL_WARN);
@@ -2174,7 +2266,7 @@ connection_dir_client_reached_eof(dir_connection_t *conn)
       } else {
         //router_load_routers_from_string(body, NULL, SAVED_NOWHERE, which,
         //                       descriptor_digests, conn->router_purpose);
-        if (load_downloaded_routers(body, which, descriptor_digests,
+        if (load_downloaded_routers(body, NULL, which, descriptor_digests,
                                 conn->router_purpose,
                                 conn->base_.address))
           directory_info_has_arrived(now, 0, 0);
@@ -2221,9 +2313,12 @@ connection_dir_client_reached_eof(dir_connection_t *conn)
       return 0;
     } else {
       smartlist_t *mds;
+      int n_asked_for = smartlist_len(which);
       mds = microdescs_add_to_cache(get_microdesc_cache(),
                                     body, body+body_len, SAVED_NOWHERE, 0,
                                     now, which);
+      connection_dir_note_md_throughput(conn,
+                                        n_asked_for - smartlist_len(which));
       if (smartlist_len(which)) {
         /* Mark remaining ones as failed. */
         dir_microdesc_download_failed(which, status_code);
@@ -2231,6 +2326,7 @@ connection_dir_client_reached_eof(dir_connection_t *conn)
       if (mds && smartlist_len(mds)) {
         control_event_bootstrap(BOOTSTRAP_STATUS_LOADING_DESCRIPTORS,
                                 count_loading_descriptors_progress());
+        connection_dir_close_redundant_md_fetches(conn);
         directory_info_has_arrived(now, 0, 1);
       }
       SMARTLIST_FOREACH(which, char *, cp, tor_free(cp));
@@ -2486,6 +2582,362 @@ connection_dir_reached_eof(dir_connection_t *conn)
 
 #define MAX_VOTE_DL_SIZE (MAX_DIRECTORY_OBJECT_SIZE * 5)
 
+/** How many bytes of body do we look at to check that a response is
+ * compressed the way it says it is? */
+#define DIR_STREAM_SNIFF_LEN 32
+
+/** State for parsing a descriptor download as it arrives, so that we don't
+ * need to hold the whole compressed and decompressed response, and so that
+ * we can use each descriptor as soon as we have it. */
+typedef struct dir_stream_t {
+  /** The response headers. */
+  char *headers;
+  /** State for decompressing the body, or NULL if it isn't compressed. */
+  tor_zlib_state_t *zlib_state;
+  /** How the body is compressed. */
+  compress_method_t compression;
+  /** Decompressed text that we haven't parsed yet, and its length.  We
+   * keep room for a NUL after the text. */
+  char *text;
+  size_t text_len;
+  /** Number of bytes allocated for text. */
+  size_t text_alloc;
+  /** Number of body bytes we've received so far. */
+  size_t body_len;
+  /** The descriptors we asked for and haven't received yet, as for
+   * router_load_routers_from_string() or microdescs_add_to_cache(). */
+  smartlist_t *which;
+  /** How many descriptors we asked for. */
+  int n_asked_for;
+  /** True iff <b>which</b> holds descriptor digests rather than identity
+   * digests. */
+  int descriptor_digests;
+} dir_stream_t;
+
+/** Release all storage held by <b>stream</b>. */
+void
+dir_stream_free(dir_stream_t *stream)
+{
+  if (!stream)
+    return;
+  tor_free(stream->headers);
+  tor_zlib_free(stream->zlib_state);
+  tor_free(stream->text);
+  if (stream->which) {
+    SMARTLIST_FOREACH(stream->which, char *, cp, tor_free(cp));
+    smartlist_free(stream->which);
+  }
+  tor_free(stream);
+}
+
+/** Decide whether to parse the response on <b>conn</b> as it arrives, and
+ * if so, take its headers off the inbuf and set up conn-\>stream.
+ *
+ * We only do this for successful descriptor and microdescriptor downloads
+ * by digest whose compression is what the server says it is.  For anything
+ * unusual, we leave the response for connection_dir_client_reached_eof(). */
+static void
+connection_dir_client_stream_start(dir_connection_t *conn)
+{
+  buf_t *inbuf = TO_CONN(conn)->inbuf;
+  const int purpose = conn->base_.purpose;
+  dir_stream_t *stream;
+  char *headers = NULL, *reason = NULL;
+  char sniff[DIR_STREAM_SNIFF_LEN];
+  int headers_len, status_code;
+  time_t date_header = 0;
+  compress_method_t compression;
+  const char *resource = conn->requested_resource;
+  int descriptor_digests;
+
+  if (purpose != DIR_PURPOSE_FETCH_SERVERDESC &&
+      purpose != DIR_PURPOSE_FETCH_EXTRAINFO &&
+      purpose != DIR_PURPOSE_FETCH_MICRODESC)
+    goto decline;
+  if (!resource)
+    goto decline;
+  descriptor_digests = !strcmpstart(resource, "d/");
+  if (!descriptor_digests &&
+      (purpose == DIR_PURPOSE_FETCH_MICRODESC || strcmpstart(resource, "fp/")))
+    goto decline;
+
+  headers_len = peek_buf_http_headers_len(inbuf);
+  if (headers_len < 0) {
+    if (buf_datalen(inbuf) > MAX_HEADERS_SIZE)
+      goto decline;
+    return; /* Not all here yet. */
+  }
+  if (headers_len >= MAX_HEADERS_SIZE)
+    goto decline;
+  if (buf_datalen(inbuf) < (size_t)headers_len + DIR_STREAM_SNIFF_LEN)
+    return; /* Wait until we can check the compression. */
+
+  headers = tor_malloc(headers_len + 1);
+  peek_from_buf(headers, headers_len, inbuf);
+  headers[headers_len] = '\0';
+  if (parse_http_response(headers, &status_code, &date_header,
+                          &compression, &reason) < 0 ||
+      status_code != 200)
+    goto decline;
+
+  /* Check the start of the body. */
+  {
+    char *tmp = tor_malloc(headers_len + DIR_STREAM_SNIFF_LEN);
+    peek_from_buf(tmp, headers_len + DIR_STREAM_SNIFF_LEN, inbuf);
+    memcpy(sniff, tmp + headers_len, DIR_STREAM_SNIFF_LEN);
+    tor_free(tmp);
+  }
+  if (compression == NO_METHOD) {
+    if (!body_is_plausible(sniff, DIR_STREAM_SNIFF_LEN, purpose))
+      goto decline;
+  } else if (!tor_compress_supports_method(compression) ||
+             detect_compression_method(sniff, DIR_STREAM_SNIFF_LEN) !=
+               compression) {
+    goto decline;
+  }
+
+  stream = tor_malloc_zero(sizeof(dir_stream_t));
+  stream->compression = compression;
+  if (compression != NO_METHOD) {
+    stream->zlib_state = tor_zlib_new(0, compression, HIGH_COMPRESSION);
+    if (!stream->zlib_state) {
+      dir_stream_free(stream);
+      goto decline;
+    }
+  }
+  stream->descriptor_digests = descriptor_digests;
+  stream->which = smartlist_new();
+  if (purpose == DIR_PURPOSE_FETCH_MICRODESC) {
+    dir_split_resource_into_fingerprints(resource + 2, stream->which, NULL,
+                                         DSR_DIGEST256|DSR_BASE64);
+  } else {
+    dir_split_resource_into_fingerprints(resource +
+                                           (descriptor_digests ? 2 : 3),
+                                         stream->which, NULL, 0);
+  }
+  stream->n_asked_for = smartlist_len(stream->which);
+
+  /* Take the headers off the inbuf: from here on, we consume the body as it
+   * arrives. */
+  fetch_from_buf(headers, headers_len, inbuf);
+  headers[headers_len] = '\0';
+  stream->headers = headers;
+  conn->stream = stream;
+  conn->stream_checked = 1;
+  connection_dir_client_note_headers(conn, headers, date_header);
+  log_debug(LD_DIR, "Parsing response from '%s:%d' as it arrives.",
+            conn->base_.address, conn->base_.port);
+  tor_free(reason);
+  return;
+
+ decline:
+  conn->stream_checked = 1;
+  tor_free(headers);
+  tor_free(reason);
+}
+
+/** Make sure that <b>stream</b> has room for at least <b>n</b> more bytes
+ * of text, plus a NUL. */
+static void
+dir_stream_reserve(dir_stream_t *stream, size_t n)
+{
+  if (stream->text_alloc - stream->text_len > n)
+    return;
+  stream->text_alloc = MAX(stream->text_alloc * 2,
+                           stream->text_len + n + 1024);
+  stream->text = tor_realloc(stream->text, stream->text_alloc);
+}
+
+/** Decompress <b>len</b> bytes of body from <b>data</b> onto the end of
+ * <b>stream</b>'s text.  Return 0 on success, -1 if the data is corrupt. */
+static int
+dir_stream_add_body(dir_stream_t *stream, const char *data, size_t len)
+{
+  if (!stream->zlib_state) {
+    dir_stream_reserve(stream, len);
+    memcpy(stream->text + stream->text_len, data, len);
+    stream->text_len += len;
+    return 0;
+  }
+
+  while (1) {
+    char *out;
+    size_t out_len, out_avail, in_avail = len;
+    tor_zlib_output_t r;
+    dir_stream_reserve(stream, MAX(len * 2, 1024));
+    out = stream->text + stream->text_len;
+    out_len = out_avail = stream->text_alloc - stream->text_len - 1;
+    r = tor_zlib_process(stream->zlib_state, &out, &out_len, &data, &len, 0);
+    stream->text_len += out_avail - out_len;
+    switch (r) {
+      case TOR_ZLIB_DONE:
+        if (len == 0)
+          return 0;
+        /* There may be more compressed data after this. */
+        tor_zlib_free(stream->zlib_state);
+        stream->zlib_state = tor_zlib_new(0, stream->compression,
+                                          HIGH_COMPRESSION);
+        if (!stream->zlib_state)
+          return -1;
+        break;
+      case TOR_ZLIB_OK:
+      case TOR_ZLIB_BUF_FULL:
+        /* If we used all our input without filling the output, we've
+         * flushed everything we can. */
+        if (len == 0 && out_len > 0)
+          return 0;
+        /* If we had room, and still made no progress, we're stuck. */
+        if (len == in_avail && out_len == out_avail)
+          return -1;
+        break;
+      case TOR_ZLIB_ERR:
+      default:
+        return -1;
+    }
+  }
+}
+
+/** Parse and add every complete descriptor at the start of the text on
+ * <b>conn</b>'s stream, and remove them from the text.  If <b>finish</b>,
+ * there's no more text coming, so parse all of it. */
+static void
+connection_dir_client_stream_parse(dir_connection_t *conn, int finish)
+{
+  dir_stream_t *stream = conn->stream;
+  const int purpose = conn->base_.purpose;
+  const char *keyword, *end, *cp, *found;
+  time_t now = time(NULL);
+
+  if (!stream->text_len)
+    return;
+  stream->text[stream->text_len] = '\0';
+
+  if (purpose == DIR_PURPOSE_FETCH_MICRODESC)
+    keyword = "\nonion-key";
+  else if (purpose == DIR_PURPOSE_FETCH_EXTRAINFO)
+    keyword = "\nextra-info ";
+  else
+    keyword = "\nrouter ";
+
+  if (finish) {
+    end = stream->text + stream->text_len;
+  } else {
+    /* Everything before the start of the last descriptor is complete. */
+    end = NULL;
+    cp = stream->text;
+    while ((found = tor_memstr(cp, stream->text + stream->text_len - cp,
+                               keyword))) {
+      end = found + 1;
+      cp = found + 1;
+    }
+    if (!end)
+      return;
+  }
+
+  if (purpose == DIR_PURPOSE_FETCH_MICRODESC) {
+    smartlist_t *mds = microdescs_add_to_cache(get_microdesc_cache(),
+                                               stream->text, end,
+                                               SAVED_NOWHERE, 0, now,
+                                               stream->which);
+    if (mds && smartlist_len(mds)) {
+      control_event_bootstrap(BOOTSTRAP_STATUS_LOADING_DESCRIPTORS,
+                              count_loading_descriptors_progress());
+      connection_dir_close_redundant_md_fetches(conn);
+      directory_info_has_arrived(now, 0, 1);
+    }
+    smartlist_free(mds);
+  } else if (purpose == DIR_PURPOSE_FETCH_EXTRAINFO) {
+    router_load_extrainfo_from_string(stream->text, end, SAVED_NOWHERE,
+                                      stream->which,
+                                      stream->descriptor_digests);
+  } else {
+    if (load_downloaded_routers(stream->text, end, stream->which,
+                                stream->descriptor_digests,
+                                conn->router_purpose,
+                                conn->base_.address))
+      directory_info_has_arrived(now, 0, 0);
+  }
+
+  stream->text_len -= end - stream->text;
+  memmove(stream->text, end, stream->text_len);
+}
+
+/** Move everything on <b>conn</b>'s inbuf into its stream, and parse any
+ * complete descriptors.  If <b>finish</b>, we've reached EOF, so parse
+ * whatever we have.  Return 0 on success, or -1 if the response was too
+ * large or corrupt. */
+static int
+connection_dir_client_stream_body(dir_connection_t *conn, int finish)
+{
+  dir_stream_t *stream = conn->stream;
+  buf_t *inbuf = TO_CONN(conn)->inbuf;
+  size_t len = buf_datalen(inbuf);
+
+  if (len) {
+    char *data;
+    int r;
+    stream->body_len += len;
+    if (stream->body_len > MAX_DIRECTORY_OBJECT_SIZE) {
+      log_warn(LD_HTTP,
+               "Too much data received from directory connection (%s): "
+               "denial of service attempt, or you need to upgrade?",
+               conn->base_.address);
+      return -1;
+    }
+    data = tor_malloc(len);
+    fetch_from_buf(data, len, inbuf);
+    r = dir_stream_add_body(stream, data, len);
+    tor_free(data);
+    if (r < 0) {
+      log_fn(LOG_PROTOCOL_WARN, LD_HTTP,
+             "Unable to decompress HTTP body (server '%s:%d').",
+             conn->base_.address, conn->base_.port);
+      return -1;
+    }
+  }
+  connection_dir_client_stream_parse(conn, finish);
+  return 0;
+}
+
+/** We are a client parsing a descriptor download as it arrives, and we've
+ * reached EOF.  Parse what's left, and note which of the descriptors we
+ * asked for never arrived.  Return values are as for
+ * connection_dir_client_reached_eof(). */
+static int
+connection_dir_client_stream_finish(dir_connection_t *conn)
+{
+  dir_stream_t *stream = conn->stream;
+  const int purpose = conn->base_.purpose;
+  const int was_ei = purpose == DIR_PURPOSE_FETCH_EXTRAINFO;
+
+  if (connection_dir_client_stream_body(conn, 1) < 0)
+    return -1;
+
+  if (purpose == DIR_PURPOSE_FETCH_MICRODESC) {
+    log_info(LD_DIR, "Received %d/%d microdescriptors requested from %s:%d "
+             "(%d bytes)",
+             stream->n_asked_for - smartlist_len(stream->which),
+             stream->n_asked_for, conn->base_.address,
+             (int)conn->base_.port, (int)stream->body_len);
+    connection_dir_note_md_throughput(conn, stream->n_asked_for -
+                                      smartlist_len(stream->which));
+    if (smartlist_len(stream->which))
+      dir_microdesc_download_failed(stream->which, 200);
+  } else {
+    log_info(LD_DIR, "Received %d/%d %s requested from %s:%d (%d bytes)",
+             stream->n_asked_for - smartlist_len(stream->which),
+             stream->n_asked_for,
+             was_ei ? "extra-info documents" : "router descriptors",
+             conn->base_.address, (int)conn->base_.port,
+             (int)stream->body_len);
+    if (smartlist_len(stream->which))
+      dir_routerdesc_download_failed(stream->which, 200,
+                                     conn->router_purpose,
+                                     was_ei, stream->descriptor_digests);
+  }
+  return 0;
+}
+
 /** Read handler for directory connections.  (That's connections <em>to</em>
  * directory servers and connections <em>at</em> directory servers.)
  */
@@ -2511,6 +2963,16 @@ connection_dir_process_inbuf(dir_connection_t *conn)
     return 0;
   }
 
+  /* If this is a descriptor download, parse it as it arrives if we can. */
+  if (conn->base_.state == DIR_CONN_STATE_CLIENT_READING) {
+    if (!conn->stream && !conn->stream_checked)
+      connection_dir_client_stream_start(conn);
+    if (conn->stream && connection_dir_client_stream_body(conn, 0) < 0) {
+      connection_mark_for_close(TO_CONN(conn));
+      return -1;
+    }
+  }
+
   max_size =
     (TO_CONN(conn)->purpose == DIR_PURPOSE_FETCH_STATUS_VOTE) ?
     MAX_VOTE_DL_SIZE : MAX_DIRECTORY_OBJECT_SIZE;
@@ -2642,14 +3104,14 @@ write_http_response_header_impl(dir_connection_t *conn, ssize_t length,
 }
 
 /** As write_http_response_header_impl, but sets encoding and content-typed
- * based on whether the response will be <b>compressed</b> or not. */
+ * based on the compression <b>method</b> the response will use. */
 static void
 write_http_response_header(dir_connection_t *conn, ssize_t length,
-                           int compressed, long cache_lifetime)
+                           compress_method_t method, long cache_lifetime)
 {
   write_http_response_header_impl(conn, length,
-                          compressed?"application/octet-stream":"text/plain",
-                          compressed?"deflate":"identity",
+              method != NO_METHOD ? "application/octet-stream" : "text/plain",
+              compression_method_get_name(method),
                              NULL,
                              cache_lifetime);
 }
@@ -2708,28 +3170,160 @@ client_likes_consensus(networkstatus_t *v, const char *want_url)
   return (have >= need_at_least);
 }
 
+/** If compressing takes at least this percentage of the main thread's time,
+ * we drop to MEDIUM_COMPRESSION for on-the-fly responses. */
+#define COMPRESSION_BUSY_PCT_MEDIUM 10
+/** If compressing takes at least this percentage of the main thread's time,
+ * we drop to LOW_COMPRESSION for on-the-fly responses. */
+#define COMPRESSION_BUSY_PCT_LOW 25
+
+/** When did we last sample how much time we spend compressing? */
+static time_t compression_load_sampled_at = 0;
+/** How many microseconds had we spent compressing at that time? */
+static uint64_t compression_usec_at_sample = 0;
+/** What percentage of the main thread's time did compression take between
+ * the last two samples? */
+static int compression_busy_pct = 0;
+
+/** Update compression_busy_pct, if a second or more has passed since we
+ * last did. */
+static void
+update_compression_load(time_t now)
+{
+  const uint64_t usec = tor_zlib_get_total_compression_usec();
+  if (compression_load_sampled_at && now > compression_load_sampled_at) {
+    const uint64_t elapsed =
+      (uint64_t)(now - compression_load_sampled_at) * 1000000;
+    compression_busy_pct =
+      (int)MIN(100, (usec - compression_usec_at_sample) * 100 / elapsed);
+  }
+  if (now != compression_load_sampled_at) {
+    compression_load_sampled_at = now;
+    compression_usec_at_sample = usec;
+  }
+}
+
+/** Return true iff our write bucket is nearly empty, so that bytes are
+ * scarcer than CPU. */
+static int
+write_bandwidth_is_scarce(void)
+{
+  const uint32_t burst = get_effective_bwburst(get_options());
+  return burst && global_write_bucket < (int)(burst / 4);
+}
+
+/** Return <b>level</b>, or a cheaper compression level if compressing has
+ * been taking <b>busy_pct</b> percent of the main thread's time and
+ * <b>bandwidth_scarce</b> is false.  When bandwidth is scarce, spending CPU
+ * to save bytes is still the right trade. */
+STATIC zlib_compression_level_t
+compression_level_for_load(zlib_compression_level_t level, int busy_pct,
+                           int bandwidth_scarce)
+{
+  zlib_compression_level_t cheapest = HIGH_COMPRESSION;
+  if (bandwidth_scarce)
+    return level;
+  if (busy_pct >= COMPRESSION_BUSY_PCT_LOW)
+    cheapest = LOW_COMPRESSION;
+  else if (busy_pct >= COMPRESSION_BUSY_PCT_MEDIUM)
+    cheapest = MEDIUM_COMPRESSION;
+  /* The levels run from HIGH_COMPRESSION to LOW_COMPRESSION, most to least
+   * expensive. */
+  return MAX(level, cheapest);
+}
+
 /** Return the compression level we should use for sending a compressed
  * response of size <b>n_bytes</b>. */
 STATIC zlib_compression_level_t
 choose_compression_level(ssize_t n_bytes)
 {
+  zlib_compression_level_t level;
   if (! have_been_under_memory_pressure()) {
-    return HIGH_COMPRESSION; /* we have plenty of RAM. */
+    level = HIGH_COMPRESSION; /* we have plenty of RAM. */
   } else if (n_bytes < 0) {
-    return HIGH_COMPRESSION; /* unknown; might be big. */
+    level = HIGH_COMPRESSION; /* unknown; might be big. */
   } else if (n_bytes < 1024) {
-    return LOW_COMPRESSION;
+    level = LOW_COMPRESSION;
   } else if (n_bytes < 2048) {
-    return MEDIUM_COMPRESSION;
+    level = MEDIUM_COMPRESSION;
   } else {
-    return HIGH_COMPRESSION;
+    level = HIGH_COMPRESSION;
   }
+
+  update_compression_load(approx_time());
+  level = compression_level_for_load(level, compression_busy_pct,
+                                     write_bandwidth_is_scarce());
+  geoip_note_dirreq_compression(level);
+  return level;
+}
+
+/** Compression methods we're willing to send a response in when we have to
+ * compress it on the fly, best first.  LZMA would save more bandwidth, but
+ * it costs far too much CPU and RAM to run for every request. */
+static const compress_method_t srv_meth_pref_streaming[] = {
+  ZSTD_METHOD, ZLIB_METHOD, GZIP_METHOD,
+};
+
+/** Compression methods we're willing to send a response in when we compressed
+ * its body ahead of time, best first. */
+static const compress_method_t srv_meth_pref_precompressed[] = {
+  LZMA_METHOD, ZLIB_METHOD, ZSTD_METHOD, GZIP_METHOD,
+};
+
+/** Parse the value <b>h</b> of an Accept-Encoding header, and return a
+ * bitmask, with bit (1u<<method) set for every compression method in
+ * it that we support.  We ignore quality values, since Tor never sends
+ * them. */
+STATIC unsigned
+parse_accept_encoding_header(const char *h)
+{
+  unsigned result = 1u << NO_METHOD;
+  smartlist_t *methods = smartlist_new();
+
+  smartlist_split_string(methods, h, ",",
+             SPLIT_SKIP_SPACE|SPLIT_STRIP_SPACE|SPLIT_IGNORE_BLANK, 0);
+  SMARTLIST_FOREACH_BEGIN(methods, char *, m) {
+    compress_method_t method;
+    char *semi = strchr(m, ';');
+    if (semi)
+      *semi = '\0';
+    method = compression_method_get_by_name(m);
+    if (tor_compress_supports_method(method))
+      result |= 1u << method;
+    tor_free(m);
+  } SMARTLIST_FOREACH_END(m);
+  smartlist_free(methods);
+
+  return result;
+}
+
+/** Return the first of the <b>n_prefs</b> compression methods in
+ * <b>prefs</b> that is set in the bitmask <b>methods</b>.  If there is none,
+ * return ZLIB_METHOD: asking for a ".z" URL has always meant that the client
+ * can handle deflate. */
+STATIC compress_method_t
+srv_choose_compression_method(unsigned methods,
+                              const compress_method_t *prefs,
+                              size_t n_prefs)
+{
+  size_t i;
+  for (i = 0; i < n_prefs; ++i) {
+    if (methods & (1u << prefs[i]))
+      return prefs[i];
+  }
+  return ZLIB_METHOD;
 }
 
 /** Information passed to handle a GET request. */
 typedef struct get_handler_args_t {
   /** True if the client asked for compressed data. */
   int compressed;
+  /** If <b>compressed</b>, a bitmask of the compression methods the client
+   * accepts, as returned by parse_accept_encoding_header(). */
+  unsigned accepted_methods;
+  /** The compression method to use if we compress the response on the fly,
+   * or NO_METHOD if the client didn't ask for compressed data. */
+  compress_method_t compress_method;
   /** If nonzero, the time included an if-modified-since header with this
    * value. */
   time_t if_modified_since;
@@ -2845,6 +3439,20 @@ directory_handle_command_get(dir_connection_t *conn, const char *headers,
   args.headers = headers;
   args.if_modified_since = if_modified_since;
   args.compressed = compressed;
+  args.accepted_methods = 0;
+  args.compress_method = NO_METHOD;
+  if (compressed) {
+    if ((header = http_get_header(headers, "Accept-Encoding: "))) {
+      args.accepted_methods = parse_accept_encoding_header(header);
+      tor_free(header);
+    } else {
+      args.accepted_methods = 1u << ZLIB_METHOD;
+    }
+    args.compress_method =
+      srv_choose_compression_method(args.accepted_methods,
+                                    srv_meth_pref_streaming,
+                                    ARRAY_LENGTH(srv_meth_pref_streaming));
+  }
 
   int i, result = -1;
   for (i = 0; url_table[i].string; ++i) {
@@ -2908,6 +3516,7 @@ handle_get_current_consensus(dir_connection_t *conn,
     /* v3 network status fetch. */
     smartlist_t *dir_fps = smartlist_new();
     long lifetime = NETWORKSTATUS_CACHE_LIFETIME;
+    cached_dir_t *diff = NULL;
 
     if (1) {
       networkstatus_t *v;
@@ -2956,6 +3565,18 @@ handle_get_current_consensus(dir_connection_t *conn,
         smartlist_add(dir_fps, fp);
       }
       lifetime = (v && v->fresh_until > now) ? v->fresh_until - now : 0;
+
+      /* If the client told us which consensus it has, and we have a diff
+       * from that one, we can send the diff instead. */
+      {
+        char *diff_from = http_get_header(args->headers,
+                                          X_OR_DIFF_FROM_CONSENSUS_HEADER);
+        if (diff_from) {
+          const char *flavor_name = networkstatus_get_flavor_name(flav);
+          diff = dirserv_get_consensus_diff(flavor_name, diff_from);
+          tor_free(diff_from);
+        }
+      }
     }
 
     if (!smartlist_len(dir_fps)) { /* we failed to create/cache cp */
@@ -2979,7 +3600,24 @@ handle_get_current_consensus(dir_connection_t *conn,
       goto done;
     }
 
-    size_t dlen = dirserv_estimate_data_size(dir_fps, 0, compressed);
+    compress_method_t method = NO_METHOD;
+    if (compressed) {
+      /* We only ever have LZMA bodies for consensuses, and only once a
+       * cpuworker has finished building them. */
+      unsigned methods = args->accepted_methods;
+      if (diff ||
+          !dirserv_networkstatus_has_compressed_body(dir_fps, LZMA_METHOD))
+        methods &= ~(1u << LZMA_METHOD);
+      method = srv_choose_compression_method(methods,
+                                 srv_meth_pref_precompressed,
+                                 ARRAY_LENGTH(srv_meth_pref_precompressed));
+    }
+
+    size_t dlen;
+    if (diff)
+      dlen = (compressed && diff->dir_z) ? diff->dir_z_len : diff->dir_len;
+    else
+      dlen = dirserv_estimate_data_size(dir_fps, 0, compressed);
     if (global_write_bucket_low(TO_CONN(conn), dlen, 2)) {
       log_debug(LD_DIRSERV,
                "Client asked for network status lists, but we've been "
@@ -3009,11 +3647,18 @@ handle_get_current_consensus(dir_connection_t *conn,
       }
     }
 
-    write_http_response_header(conn, -1, compressed,
+    write_http_response_header(conn, -1, method,
                                smartlist_len(dir_fps) == 1 ? lifetime : 0);
+    if (diff) {
+      /* Spool the diff, and nothing else. */
+      SMARTLIST_FOREACH(dir_fps, char *, fp, tor_free(fp));
+      smartlist_clear(dir_fps);
+      ++diff->refcnt;
+      conn->cached_dir = diff;
+      conn->cached_dir_offset = 0;
+    }
     conn->fingerprint_stack = dir_fps;
-    if (! compressed)
-      conn->zlib_state = tor_zlib_new(0, ZLIB_METHOD, HIGH_COMPRESSION);
+    conn->spool_compress_method = method;
 
     /* Prime the connection with some data. */
     conn->dir_spool_src = DIR_SPOOL_NETWORKSTATUS;
@@ -3032,6 +3677,7 @@ handle_get_status_vote(dir_connection_t *conn, const get_handler_args_t *args)
 {
   const char *url = args->url;
   const int compressed = args->compressed;
+  const compress_method_t method = args->compress_method;
   {
     int current;
     ssize_t body_len = 0;
@@ -3088,8 +3734,13 @@ handle_get_status_vote(dir_connection_t *conn, const get_handler_args_t *args)
       goto vote_done;
     }
     SMARTLIST_FOREACH(dir_items, cached_dir_t *, d,
-                      body_len += compressed ? d->dir_z_len : d->dir_len);
+                      body_len += method == ZLIB_METHOD ? d->dir_z_len
+                                                        : d->dir_len);
     estimated_len += body_len;
+    /* Votes are only precompressed with deflate; for anything else, we
+     * compress on the fly and can't know the length ahead of time. */
+    if (method != NO_METHOD && method != ZLIB_METHOD)
+      body_len = 0;
     SMARTLIST_FOREACH(items, const char *, item, {
         size_t ln = strlen(item);
         if (compressed) {
@@ -3103,12 +3754,12 @@ handle_get_status_vote(dir_connection_t *conn, const get_handler_args_t *args)
       write_http_status_line(conn, 503, "Directory busy, try again later");
       goto vote_done;
     }
-    write_http_response_header(conn, body_len ? body_len : -1, compressed,
+    write_http_response_header(conn, body_len ? body_len : -1, method,
                  lifetime);
 
     if (smartlist_len(items)) {
       if (compressed) {
-        conn->zlib_state = tor_zlib_new(1, ZLIB_METHOD,
+        conn->zlib_state = tor_zlib_new(1, method,
                                     choose_compression_level(estimated_len));
         SMARTLIST_FOREACH(items, const char *, c,
                  connection_write_to_buf_zlib(c, strlen(c), conn, 0));
@@ -3117,6 +3768,12 @@ handle_get_status_vote(dir_connection_t *conn, const get_handler_args_t *args)
         SMARTLIST_FOREACH(items, const char *, c,
                          connection_write_to_buf(c, strlen(c), TO_CONN(conn)));
       }
+    } else if (method != NO_METHOD && method != ZLIB_METHOD) {
+      conn->zlib_state = tor_zlib_new(1, method,
+                                      choose_compression_level(estimated_len));
+      SMARTLIST_FOREACH(dir_items, cached_dir_t *, d,
+                 connection_write_to_buf_zlib(d->dir, d->dir_len, conn, 0));
+      connection_write_to_buf_zlib("", 0, conn, 1);
     } else {
       SMARTLIST_FOREACH(dir_items, cached_dir_t *, d,
           connection_write_to_buf(compressed ? d->dir_z : d->dir,
@@ -3163,12 +3820,13 @@ handle_get_microdesc(dir_connection_t *conn, const get_handler_args_t *args)
       goto done;
     }
 
-    write_http_response_header(conn, -1, compressed, MICRODESC_CACHE_LIFETIME);
+    write_http_response_header(conn, -1, args->compress_method,
+                               MICRODESC_CACHE_LIFETIME);
     conn->dir_spool_src = DIR_SPOOL_MICRODESC;
     conn->fingerprint_stack = fps;
 
     if (compressed)
-      conn->zlib_state = tor_zlib_new(1, ZLIB_METHOD,
+      conn->zlib_state = tor_zlib_new(1, args->compress_method,
                                       choose_compression_level(dlen));
 
     connection_dirserv_flushed_some(conn);
@@ -3239,9 +3897,10 @@ handle_get_descriptor(dir_connection_t *conn, const get_handler_args_t *args)
         conn->dir_spool_src = DIR_SPOOL_NONE;
         goto done;
       }
-      write_http_response_header(conn, -1, compressed, cache_lifetime);
+      write_http_response_header(conn, -1, args->compress_method,
+                                 cache_lifetime);
       if (compressed)
-        conn->zlib_state = tor_zlib_new(1, ZLIB_METHOD,
+        conn->zlib_state = tor_zlib_new(1, args->compress_method,
                                         choose_compression_level(dlen));
       /* Prime the connection with some data. */
       connection_dirserv_flushed_some(conn);
@@ -3326,9 +3985,10 @@ handle_get_keys(dir_connection_t *conn, const get_handler_args_t *args)
       goto keys_done;
     }
 
-    write_http_response_header(conn, compressed?-1:len, compressed, 60*60);
+    write_http_response_header(conn, compressed?-1:len,
+                               args->compress_method, 60*60);
     if (compressed) {
-      conn->zlib_state = tor_zlib_new(1, ZLIB_METHOD,
+      conn->zlib_state = tor_zlib_new(1, args->compress_method,
                                       choose_compression_level(len));
       SMARTLIST_FOREACH(certs, authority_cert_t *, c,
             connection_write_to_buf_zlib(c->cache_info.signed_descriptor_body,
@@ -3364,7 +4024,7 @@ handle_get_rendezvous2(dir_connection_t *conn, const get_handler_args_t *args)
                safe_str(escaped(query)));
       switch (rend_cache_lookup_v2_desc_as_dir(query, &descp)) {
         case 1: /* valid */
-          write_http_response_header(conn, strlen(descp), 0, 0);
+          write_http_response_header(conn, strlen(descp), NO_METHOD, 0);
           connection_write_to_buf(descp, strlen(descp), TO_CONN(conn));
           break;
         case 0: /* well-formed but not present */
@@ -3418,7 +4078,7 @@ handle_get_networkstatus_bridges(dir_connection_t *conn,
     /* all happy now. send an answer. */
     status = networkstatus_getinfo_by_purpose("bridge", time(NULL));
     size_t dlen = strlen(status);
-    write_http_response_header(conn, dlen, 0, 0);
+    write_http_response_header(conn, dlen, NO_METHOD, 0);
     connection_write_to_buf(status, dlen, TO_CONN(conn));
     tor_free(status);
     goto done;
@@ -3435,12 +4095,43 @@ handle_get_robots(dir_connection_t *conn, const get_handler_args_t *args)
   {
     const char robots[] = "User-agent: *\r\nDisallow: /\r\n";
     size_t len = strlen(robots);
-    write_http_response_header(conn, len, 0, ROBOTS_CACHE_LIFETIME);
+    write_http_response_header(conn, len, NO_METHOD, ROBOTS_CACHE_LIFETIME);
     connection_write_to_buf(robots, len, TO_CONN(conn));
   }
   return 0;
 }
 
+/** Answer the descriptor upload on <b>conn</b>, given the result <b>r</b>
+ * of adding its descriptors and the message <b>msg</b> that goes with
+ * it. */
+void
+directory_send_descriptor_upload_response(dir_connection_t *conn,
+                                          was_router_added_t r,
+                                          const char *msg)
+{
+  tor_assert(msg);
+
+  if (r == ROUTER_ADDED_NOTIFY_GENERATOR) {
+    /* Accepted with a message. */
+    log_info(LD_DIRSERV,
+             "Problematic router descriptor or extra-info from %s "
+             "(\"%s\").",
+             conn->base_.address, msg);
+    write_http_status_line(conn, 400, msg);
+  } else if (r == ROUTER_ADDED_SUCCESSFULLY) {
+    write_http_status_line(conn, 200, msg);
+  } else if (WRA_WAS_OUTDATED(r)) {
+    write_http_response_header_impl(conn, -1, NULL, NULL,
+                                    "X-Descriptor-Not-New: Yes\r\n", -1);
+  } else {
+    log_info(LD_DIRSERV,
+             "Rejected router descriptor or extra-info from %s "
+             "(\"%s\").",
+             conn->base_.address, msg);
+    write_http_status_line(conn, 400, msg);
+  }
+}
+
 /** Helper function: called when a dirserver gets a complete HTTP POST
  * request.  Look for an uploaded server descriptor or rendezvous
  * service descriptor.  On finding one, process it and write a
@@ -3495,32 +4186,11 @@ directory_handle_command_post(dir_connection_t *conn, const char *headers,
 
   if (authdir_mode_handles_descs(options, -1) &&
       !strcmp(url,"/tor/")) { /* server descriptor post */
-    const char *msg = "[None]";
     uint8_t purpose = authdir_mode_bridge(options) ?
                       ROUTER_PURPOSE_BRIDGE : ROUTER_PURPOSE_GENERAL;
-    was_router_added_t r = dirserv_add_multiple_descriptors(body, purpose,
-                                             conn->base_.address, &msg);
-    tor_assert(msg);
-
-    if (r == ROUTER_ADDED_NOTIFY_GENERATOR) {
-      /* Accepted with a message. */
-      log_info(LD_DIRSERV,
-               "Problematic router descriptor or extra-info from %s "
-               "(\"%s\").",
-               conn->base_.address, msg);
-      write_http_status_line(conn, 400, msg);
-    } else if (r == ROUTER_ADDED_SUCCESSFULLY) {
-      write_http_status_line(conn, 200, msg);
-    } else if (WRA_WAS_OUTDATED(r)) {
-      write_http_response_header_impl(conn, -1, NULL, NULL,
-                                      "X-Descriptor-Not-New: Yes\r\n", -1);
-    } else {
-      log_info(LD_DIRSERV,
-               "Rejected router descriptor or extra-info from %s "
-               "(\"%s\").",
-               conn->base_.address, msg);
-      write_http_status_line(conn, 400, msg);
-    }
+    /* This answers with directory_send_descriptor_upload_response(),
+     * perhaps later. */
+    dirserv_add_multiple_descriptors_async(body, purpose, conn);
     goto done;
   }
 
@@ -4146,6 +4816,190 @@ dir_microdesc_download_failed(smartlist_t *failed,
   } SMARTLIST_FOREACH_END(d);
 }
 
+/** How much weight does each new measurement of a mirror's throughput get,
+ * compared to everything we measured before? */
+#define DIR_MIRROR_THROUGHPUT_WEIGHT 0.3
+/** Remember the throughput of at most this many mirrors.  If we measure
+ * more, forget them all and start over. */
+#define MAX_DIR_MIRROR_THROUGHPUT_ENTRIES 1024
+
+/** Map from the identity digest of a directory mirror to a double holding
+ * a moving average of how fast it has sent us microdescriptors, in
+ * microdescriptors per second. */
+static digestmap_t *dir_mirror_throughput = NULL;
+
+/** Note that the directory mirror with identity <b>identity_digest</b>
+ * sent us <b>n_descs</b> microdescriptors in <b>msec</b> msec. */
+void
+dir_mirror_note_throughput(const char *identity_digest, int n_descs,
+                           int64_t msec)
+{
+  double rate, *entry;
+
+  if (tor_digest_is_zero(identity_digest) || n_descs <= 0)
+    return;
+  if (msec < 1)
+    msec = 1;
+  rate = n_descs * 1000.0 / msec;
+
+  if (!dir_mirror_throughput)
+    dir_mirror_throughput = digestmap_new();
+  entry = digestmap_get(dir_mirror_throughput, identity_digest);
+  if (entry) {
+    *entry += DIR_MIRROR_THROUGHPUT_WEIGHT * (rate - *entry);
+    return;
+  }
+  if (digestmap_size(dir_mirror_throughput) >=
+      MAX_DIR_MIRROR_THROUGHPUT_ENTRIES) {
+    digestmap_free(dir_mirror_throughput, tor_free_);
+    dir_mirror_throughput = digestmap_new();
+  }
+  entry = tor_malloc(sizeof(double));
+  *entry = rate;
+  digestmap_set(dir_mirror_throughput, identity_digest, entry);
+}
+
+/** Return the throughput we've measured for the directory mirror with
+ * identity <b>identity_digest</b>, in microdescriptors per second, or 0 if
+ * we haven't measured it. */
+double
+dir_mirror_get_throughput(const char *identity_digest)
+{
+  double *entry;
+  if (!dir_mirror_throughput)
+    return 0.0;
+  entry = digestmap_get(dir_mirror_throughput, identity_digest);
+  return entry ? *entry : 0.0;
+}
+
+/** Return the mean throughput of all the directory mirrors we've measured,
+ * in microdescriptors per second, or 0 if we haven't measured any. */
+double
+dir_mirror_get_mean_throughput(void)
+{
+  double total = 0.0;
+  int n = 0;
+  if (!dir_mirror_throughput)
+    return 0.0;
+  DIGESTMAP_FOREACH(dir_mirror_throughput, id, double *, rate) {
+    (void)id;
+    total += *rate;
+    ++n;
+  } DIGESTMAP_FOREACH_END;
+  return n ? total / n : 0.0;
+}
+
+/** If the directory mirror with identity <b>identity_digest</b> looks
+ * usable for a descriptor download, return its routerstatus; otherwise
+ * return NULL.  We never return an authority: we don't want to add to their
+ * load just to speed up a download. */
+static const routerstatus_t *
+dir_mirror_get_routerstatus(const char *identity_digest)
+{
+  const node_t *node;
+  dir_server_t *ds;
+
+  if (router_digest_is_trusted_dir(identity_digest))
+    return NULL;
+  node = node_get_by_id(identity_digest);
+  if (node && node->rs && node->is_running && node_is_dir(node))
+    return node->rs;
+  ds = router_get_fallback_dirserver_by_digest(identity_digest);
+  if (ds && ds->is_running)
+    return &ds->fake_status;
+  return NULL;
+}
+
+/** Return the routerstatus of the usable directory mirror that we've
+ * measured to be fastest, other than <b>exclude_digest</b> (if provided).
+ * Only consider mirrors whose throughput is more than
+ * <b>min_throughput</b>.  Return NULL if there is no such mirror. */
+const routerstatus_t *
+dir_mirror_pick_fastest(const char *exclude_digest, double min_throughput)
+{
+  const routerstatus_t *best = NULL;
+  double best_rate = min_throughput;
+
+  if (!dir_mirror_throughput)
+    return NULL;
+  DIGESTMAP_FOREACH(dir_mirror_throughput, id, double *, rate) {
+    const routerstatus_t *rs;
+    if (*rate <= best_rate ||
+        (exclude_digest && tor_memeq(id, exclude_digest, DIGEST_LEN)))
+      continue;
+    if ((rs = dir_mirror_get_routerstatus(id))) {
+      best = rs;
+      best_rate = *rate;
+    }
+  } DIGESTMAP_FOREACH_END;
+  return best;
+}
+
+/** Forget every directory mirror throughput we've measured. */
+void
+dir_mirror_throughput_free_all(void)
+{
+  digestmap_free(dir_mirror_throughput, tor_free_);
+  dir_mirror_throughput = NULL;
+}
+
+/** Called when <b>conn</b>, a microdescriptor download, has finished,
+ * having given us <b>n_received</b> of the microdescriptors we asked
+ * for. Record how fast its mirror was. */
+static void
+connection_dir_note_md_throughput(const dir_connection_t *conn,
+                                  int n_received)
+{
+  int64_t msec = (int64_t)(monotime_coarse_absolute_msec() -
+                           conn->request_started_msec);
+  dir_mirror_note_throughput(conn->identity_digest, n_received, msec);
+}
+
+/** Close every microdescriptor download other than <b>except</b> that is
+ * still waiting for microdescriptors we now have all of.  This happens
+ * when we've asked a second mirror for the microdescriptors from a slow
+ * download, and one of the copies has arrived. */
+static void
+connection_dir_close_redundant_md_fetches(const dir_connection_t *except)
+{
+  microdesc_cache_t *cache = get_microdesc_cache();
+  smartlist_t *wanted = smartlist_new();
+
+  SMARTLIST_FOREACH_BEGIN(get_connection_array_by_type(CONN_TYPE_DIR),
+                          connection_t *, conn) {
+    dir_connection_t *dir_conn;
+    int have_all = 1;
+    if (conn->purpose != DIR_PURPOSE_FETCH_MICRODESC ||
+        conn->marked_for_close ||
+        conn->state >= DIR_CONN_STATE_CLIENT_FINISHED)
+      continue;
+    dir_conn = TO_DIR_CONN(conn);
+    if (dir_conn == except || !dir_conn->requested_resource ||
+        strcmpstart(dir_conn->requested_resource, "d/"))
+      continue;
+    dir_split_resource_into_fingerprints(dir_conn->requested_resource+2,
+                                         wanted, NULL,
+                                         DSR_DIGEST256|DSR_BASE64);
+    SMARTLIST_FOREACH(wanted, const char *, d, {
+      if (!microdesc_cache_lookup_by_digest256(cache, d)) {
+        have_all = 0;
+        break;
+      }
+    });
+    if (have_all && smartlist_len(wanted)) {
+      log_info(LD_DIR, "We already have all %d microdescriptors we asked "
+               "%s:%d for; closing that request.", smartlist_len(wanted),
+               conn->address, (int)conn->port);
+      /* This isn't a failure of the mirror's: don't count it as one. */
+      conn->state = DIR_CONN_STATE_CLIENT_FINISHED;
+      connection_mark_for_close(conn);
+    }
+    SMARTLIST_FOREACH(wanted, char *, d, tor_free(d));
+    smartlist_clear(wanted);
+  } SMARTLIST_FOREACH_END(conn);
+  smartlist_free(wanted);
+}
+
 /** Helper.  Compare two fp_pair_t objects, and return negative, 0, or
  * positive as appropriate. */
 static int
@@ -22,6 +22,8 @@ MOCK_DECL(void, directory_get_from_dirserver, (
                           const char *resource,
                           int pds_flags,
                           download_want_authority_t want_authority));
+MOCK_DECL(const routerstatus_t *, directory_pick_mirror_for_fetch,
+          (uint8_t dir_purpose, int pds_flags));
 void directory_get_from_all_authorities(uint8_t dir_purpose,
                                         uint8_t router_purpose,
                                         const char *resource);
@@ -70,6 +72,10 @@ int connection_dir_process_inbuf(dir_connection_t *conn);
 int connection_dir_finished_flushing(dir_connection_t *conn);
 int connection_dir_finished_connecting(dir_connection_t *conn);
 void connection_dir_about_to_close(dir_connection_t *dir_conn);
+void dir_stream_free(struct dir_stream_t *stream);
+void directory_send_descriptor_upload_response(dir_connection_t *conn,
+                                               was_router_added_t r,
+                                               const char *msg);
 void directory_initiate_command(const tor_addr_t *or_addr, uint16_t or_port,
                                 const tor_addr_t *dir_addr, uint16_t dir_port,
                                 const char *digest,
@@ -89,6 +95,14 @@ int dir_split_resource_into_fingerprints(const char *resource,
 
 int dir_split_resource_into_fingerprint_pairs(const char *res,
                                               smartlist_t *pairs_out);
+void dir_mirror_note_throughput(const char *identity_digest, int n_descs,
+                                int64_t msec);
+double dir_mirror_get_throughput(const char *identity_digest);
+double dir_mirror_get_mean_throughput(void);
+const routerstatus_t *dir_mirror_pick_fastest(const char *exclude_digest,
+                                              double min_throughput);
+void dir_mirror_throughput_free_all(void);
+
 char *directory_dump_request_log(void);
 void note_request(const char *key, size_t bytes);
 int router_supports_extrainfo(const char *identity_digest, int is_authority);
@@ -152,7 +166,15 @@ STATIC int download_status_schedule_get_delay(download_status_t *dls,
 STATIC char* authdir_type_to_string(dirinfo_type_t auth);
 STATIC const char * dir_conn_purpose_to_string(int purpose);
 STATIC int should_use_directory_guards(const or_options_t *options);
+STATIC zlib_compression_level_t compression_level_for_load(
+                                     zlib_compression_level_t level,
+                                     int busy_pct, int bandwidth_scarce);
 STATIC zlib_compression_level_t choose_compression_level(ssize_t n_bytes);
+STATIC char *directory_get_accept_encoding(void);
+STATIC unsigned parse_accept_encoding_header(const char *h);
+STATIC compress_method_t srv_choose_compression_method(unsigned methods,
+                                       const compress_method_t *prefs,
+                                       size_t n_prefs);
 STATIC const smartlist_t *find_dl_schedule(download_status_t *dls,
                                            const or_options_t *options);
 STATIC void find_dl_min_and_max_delay(download_status_t *dls,
@@ -13,7 +13,9 @@
 #include "command.h"
 #include "connection.h"
 #include "connection_or.h"
+#include "consdiff.h"
 #include "control.h"
+#include "cpuworker.h"
 #include "directory.h"
 #include "dirserv.h"
 #include "dirvote.h"
@@ -522,56 +524,62 @@ WRA_MORE_SEVERE(was_router_added_t a, was_router_added_t b)
   return a < b;
 }
 
-/** As for dirserv_add_descriptor(), but accepts multiple documents, and
- * returns the most severe error that occurred for any one of them. */
-was_router_added_t
-dirserv_add_multiple_descriptors(const char *desc, uint8_t purpose,
-                                 const char *source,
-                                 const char **msg)
+/** Helper: write the annotations that we put on a descriptor uploaded by
+ * <b>source</b> for <b>purpose</b> into the ROUTER_ANNOTATION_BUF_LEN-byte
+ * buffer <b>annotation_buf</b>.  Return 0 on success, -1 on failure. */
+static int
+dirserv_format_upload_annotations(char *annotation_buf, uint8_t purpose,
+                                  const char *source)
 {
-  was_router_added_t r, r_tmp;
-  const char *msg_out;
-  smartlist_t *list;
-  const char *s;
-  int n_parsed = 0;
-  time_t now = time(NULL);
-  char annotation_buf[ROUTER_ANNOTATION_BUF_LEN];
   char time_buf[ISO_TIME_LEN+1];
   int general = purpose == ROUTER_PURPOSE_GENERAL;
-  tor_assert(msg);
 
-  r=ROUTER_ADDED_SUCCESSFULLY; /*Least severe return value. */
-
-  format_iso_time(time_buf, now);
-  if (tor_snprintf(annotation_buf, sizeof(annotation_buf),
+  format_iso_time(time_buf, time(NULL));
+  if (tor_snprintf(annotation_buf, ROUTER_ANNOTATION_BUF_LEN,
                    "@uploaded-at %s\n"
                    "@source %s\n"
                    "%s%s%s", time_buf, escaped(source),
                    !general ? "@purpose " : "",
                    !general ? router_purpose_to_string(purpose) : "",
-                   !general ? "\n" : "")<0) {
-    *msg = "Couldn't format annotations";
+                   !general ? "\n" : "")<0)
     return -1;
-  }
+  return 0;
+}
 
-  s = desc;
-  list = smartlist_new();
-  if (!router_parse_list_from_string(&s, NULL, list, SAVED_NOWHERE, 0, 0,
-                                     annotation_buf, NULL)) {
-    SMARTLIST_FOREACH(list, routerinfo_t *, ri, {
-        msg_out = NULL;
-        tor_assert(ri->purpose == purpose);
-        r_tmp = dirserv_add_descriptor(ri, &msg_out, source);
-        if (WRA_MORE_SEVERE(r_tmp, r)) {
-          r = r_tmp;
-          *msg = msg_out;
-        }
-      });
-  }
-  n_parsed += smartlist_len(list);
-  smartlist_clear(list);
+/** Helper for dirserv_add_multiple_descriptors() and
+ * dirserv_add_multiple_descriptors_async(): add every routerinfo_t in
+ * <b>routers</b>, which came from the upload <b>desc</b> by <b>source</b>,
+ * and then every extra-info document in <b>desc</b>.  Empties
+ * <b>routers</b>.  Return the most severe error that occurred for any one
+ * of them, and set *<b>msg</b> to go with it. */
+static was_router_added_t
+dirserv_add_parsed_descriptors(smartlist_t *routers, const char *desc,
+                               uint8_t purpose, const char *source,
+                               const char **msg)
+{
+  was_router_added_t r, r_tmp;
+  const char *msg_out;
+  smartlist_t *list;
+  const char *s;
+  int n_parsed = 0;
+
+  r=ROUTER_ADDED_SUCCESSFULLY; /*Least severe return value. */
+  *msg = NULL;
+
+  SMARTLIST_FOREACH(routers, routerinfo_t *, ri, {
+      msg_out = NULL;
+      tor_assert(ri->purpose == purpose);
+      r_tmp = dirserv_add_descriptor(ri, &msg_out, source);
+      if (WRA_MORE_SEVERE(r_tmp, r)) {
+        r = r_tmp;
+        *msg = msg_out;
+      }
+    });
+  n_parsed += smartlist_len(routers);
+  smartlist_clear(routers);
 
   s = desc;
+  list = smartlist_new();
   if (!router_parse_list_from_string(&s, NULL, list, SAVED_NOWHERE, 1, 0,
                                      NULL, NULL)) {
     SMARTLIST_FOREACH(list, extrainfo_t *, ei, {
@@ -600,6 +608,150 @@ dirserv_add_multiple_descriptors(const char *desc, uint8_t purpose,
   return r;
 }
 
+/** As for dirserv_add_descriptor(), but accepts multiple documents, and
+ * returns the most severe error that occurred for any one of them. */
+was_router_added_t
+dirserv_add_multiple_descriptors(const char *desc, uint8_t purpose,
+                                 const char *source,
+                                 const char **msg)
+{
+  was_router_added_t r;
+  smartlist_t *list;
+  const char *s;
+  char annotation_buf[ROUTER_ANNOTATION_BUF_LEN];
+  tor_assert(msg);
+
+  if (dirserv_format_upload_annotations(annotation_buf, purpose, source)) {
+    *msg = "Couldn't format annotations";
+    return -1;
+  }
+
+  s = desc;
+  list = smartlist_new();
+  if (router_parse_list_from_string(&s, NULL, list, SAVED_NOWHERE, 0, 0,
+                                    annotation_buf, NULL)) {
+    SMARTLIST_FOREACH(list, routerinfo_t *, ri, routerinfo_free(ri));
+    smartlist_clear(list);
+  }
+  r = dirserv_add_parsed_descriptors(list, desc, purpose, source, msg);
+  smartlist_free(list);
+  return r;
+}
+
+/** How many descriptor uploads may be waiting on the cpuworkers at once?
+ * Past this, we handle uploads on the main thread again. */
+#define MAX_PENDING_DESC_UPLOADS 64
+
+/** How many descriptor uploads are waiting on the cpuworkers? */
+static int n_pending_desc_uploads = 0;
+
+/** A descriptor upload whose ed25519 signatures we're checking on a
+ * cpuworker, so that a burst of uploads doesn't stall the main thread. */
+typedef struct desc_upload_job_t {
+  /** The global identifier of the connection that uploaded it. */
+  uint64_t conn_id;
+  /** The uploaded document.  The parsed descriptors point into it. */
+  char *body;
+  /** The address that uploaded it. */
+  char *source;
+  /** The purpose that the descriptors have. */
+  uint8_t purpose;
+  /** The routerinfo_t that we parsed from <b>body</b>. */
+  smartlist_t *routers;
+  /** Their signatures that the cpuworker should check. */
+  desc_sig_checks_t *checks;
+} desc_upload_job_t;
+
+/** Cpuworker callback: check the signatures in the desc_upload_job_t
+ * <b>job_</b>. */
+static workqueue_reply_t
+desc_upload_threadfn(void *state_, void *job_)
+{
+  desc_upload_job_t *job = job_;
+  (void)state_;
+  desc_sig_checks_run(job->checks);
+  return WQ_RPL_REPLY;
+}
+
+/** Main-thread callback: drop the descriptors from <b>job_</b> with bad
+ * signatures, add the rest as dirserv_add_multiple_descriptors() would,
+ * answer the uploader if it's still there, and release the job. */
+static void
+desc_upload_replyfn(void *job_)
+{
+  desc_upload_job_t *job = job_;
+  const char *msg = NULL;
+  was_router_added_t r;
+  connection_t *conn;
+
+  --n_pending_desc_uploads;
+  desc_sig_checks_finish(job->checks, job->routers, NULL);
+  r = dirserv_add_parsed_descriptors(job->routers, job->body, job->purpose,
+                                     job->source, &msg);
+  tor_assert(msg);
+
+  conn = connection_get_by_global_id(job->conn_id);
+  if (conn && conn->type == CONN_TYPE_DIR && !conn->marked_for_close)
+    directory_send_descriptor_upload_response(TO_DIR_CONN(conn), r, msg);
+
+  smartlist_free(job->routers);
+  tor_free(job->body);
+  tor_free(job->source);
+  tor_free(job);
+}
+
+/** Add the descriptors in <b>desc</b>, which were uploaded on <b>conn</b>
+ * with <b>purpose</b>, as dirserv_add_multiple_descriptors() would; when
+ * done, answer with directory_send_descriptor_upload_response().
+ *
+ * We parse the descriptors now, but check their ed25519 signatures on a
+ * cpuworker.  Keypinning and adding them to the routerlist happen back on
+ * the main thread, one upload at a time.  Meanwhile, we stop reading from
+ * <b>conn</b>.  If we have no cpuworkers, or too many uploads are waiting
+ * for them already, we do it all at once. */
+void
+dirserv_add_multiple_descriptors_async(const char *desc, uint8_t purpose,
+                                       dir_connection_t *conn)
+{
+  desc_upload_job_t *job;
+  char annotation_buf[ROUTER_ANNOTATION_BUF_LEN];
+  const char *s;
+
+  if (dirserv_format_upload_annotations(annotation_buf, purpose,
+                                        conn->base_.address)) {
+    directory_send_descriptor_upload_response(conn, -1,
+                                          "Couldn't format annotations");
+    return;
+  }
+
+  job = tor_malloc_zero(sizeof(desc_upload_job_t));
+  job->conn_id = conn->base_.global_identifier;
+  job->body = tor_strdup(desc);
+  job->source = tor_strdup(conn->base_.address);
+  job->purpose = purpose;
+  job->routers = smartlist_new();
+  s = job->body;
+  if (router_parse_list_from_string_unchecked(&s, NULL, job->routers,
+                                              SAVED_NOWHERE, 0, 0,
+                                              annotation_buf, NULL,
+                                              &job->checks)) {
+    SMARTLIST_FOREACH(job->routers, routerinfo_t *, ri, routerinfo_free(ri));
+    smartlist_clear(job->routers);
+  }
+
+  ++n_pending_desc_uploads;
+  if (n_pending_desc_uploads > MAX_PENDING_DESC_UPLOADS ||
+      !cpuworker_queue_work(WQ_PRI_MED, desc_upload_threadfn,
+                            desc_upload_replyfn, job)) {
+    /* No worker threads, too much waiting already, or we couldn't queue:
+     * do it right here. */
+    desc_upload_threadfn(NULL, job);
+    desc_upload_replyfn(job);
+    return;
+  }
+  connection_stop_reading(TO_CONN(conn));
+}
+
 /** Examine the parsed server descriptor in <b>ri</b> and maybe insert it into
  * the list of server descriptors. Set *<b>msg</b> to a message that should be
  * passed back to the origin of this descriptor, or NULL if there is no such
@@ -1124,6 +1276,24 @@ directory_too_idle_to_fetch_descriptors(const or_options_t *options,
  * currently serving. */
 static strmap_t *cached_consensuses = NULL;
 
+/** How many of our previous consensuses of each flavor do we keep, so that
+ * we can serve diffs from them to clients that still have them? */
+#define MAX_CONSENSUS_DIFF_BASES 3
+
+/** The consensuses we can serve diffs from, and the diffs themselves, for
+ * one flavor of consensus. */
+typedef struct consensus_diff_cache_t {
+  /** The cached_dir_t for each of our previous consensuses, oldest first. */
+  smartlist_t *bases;
+  /** Map from the SHA256 digest of the signed part of each entry in
+   * <b>bases</b> to a cached_dir_t holding a diff from it to the consensus
+   * we're currently serving. */
+  digest256map_t *diffs;
+} consensus_diff_cache_t;
+
+/** Map from flavor name to consensus_diff_cache_t. */
+static strmap_t *consensus_diff_caches = NULL;
+
 /** Decrement the reference count on <b>d</b>, and free it if it no longer has
  * any references. */
 void
@@ -1136,15 +1306,24 @@ cached_dir_decref(cached_dir_t *d)
 }
 
 /** Allocate and return a new cached_dir_t containing the string <b>s</b>,
- * published at <b>published</b>. */
-cached_dir_t *
-new_cached_dir(char *s, time_t published)
+ * published at <b>published</b>.  Don't compress it yet. */
+static cached_dir_t *
+new_cached_dir_uncompressed(char *s, time_t published)
 {
   cached_dir_t *d = tor_malloc_zero(sizeof(cached_dir_t));
   d->refcnt = 1;
   d->dir = s;
   d->dir_len = strlen(s);
   d->published = published;
+  return d;
+}
+
+/** Allocate and return a new cached_dir_t containing the string <b>s</b>,
+ * published at <b>published</b>. */
+cached_dir_t *
+new_cached_dir(char *s, time_t published)
+{
+  cached_dir_t *d = new_cached_dir_uncompressed(s, published);
   if (tor_gzip_compress(&(d->dir_z), &(d->dir_z_len), d->dir, d->dir_len,
                         ZLIB_METHOD)) {
     log_warn(LD_BUG, "Error compressing directory");
@@ -1152,12 +1331,119 @@ new_cached_dir(char *s, time_t published)
   return d;
 }
 
+/** A request to build the compressed body of a cached_dir_t on a
+ * cpuworker thread. */
+typedef struct cached_dir_compress_job_t {
+  /** The object to compress.  We hold a reference to it, and the worker
+   * only reads its <b>dir</b> field, which never changes. */
+  cached_dir_t *dir;
+  /** The compressed body, as built by the worker. */
+  char *dir_z;
+  /** Length of <b>dir_z</b>. */
+  size_t dir_z_len;
+  /** The LZMA-compressed body, as built by the worker, if we support LZMA. */
+  char *dir_lzma;
+  /** Length of <b>dir_lzma</b>. */
+  size_t dir_lzma_len;
+} cached_dir_compress_job_t;
+
+/** Cpuworker callback: compress the body of the cached_dir_t in
+ * <b>job_</b>. */
+static workqueue_reply_t
+cached_dir_compress_threadfn(void *state_, void *job_)
+{
+  cached_dir_compress_job_t *job = job_;
+  (void)state_;
+  if (tor_gzip_compress(&job->dir_z, &job->dir_z_len,
+                        job->dir->dir, job->dir->dir_len, ZLIB_METHOD)) {
+    job->dir_z = NULL;
+    job->dir_z_len = 0;
+  }
+  /* LZMA is far too slow to run for every request, but it gives clients
+   * the smallest download, so build it here where it doesn't block us. */
+  if (tor_compress_supports_method(LZMA_METHOD) &&
+      tor_gzip_compress(&job->dir_lzma, &job->dir_lzma_len,
+                        job->dir->dir, job->dir->dir_len, LZMA_METHOD)) {
+    job->dir_lzma = NULL;
+    job->dir_lzma_len = 0;
+  }
+  return WQ_RPL_REPLY;
+}
+
+/** Main-thread callback: install the compressed body built by
+ * cached_dir_compress_threadfn(), and release the job. */
+static void
+cached_dir_compress_replyfn(void *job_)
+{
+  cached_dir_compress_job_t *job = job_;
+  cached_dir_t *d = job->dir;
+  if (!job->dir_z) {
+    log_warn(LD_BUG, "Error compressing directory");
+  } else if (!d->dir_z) {
+    d->dir_z = job->dir_z;
+    d->dir_z_len = job->dir_z_len;
+    job->dir_z = NULL;
+  }
+  if (job->dir_lzma && !d->dir_lzma) {
+    d->dir_lzma = job->dir_lzma;
+    d->dir_lzma_len = job->dir_lzma_len;
+    job->dir_lzma = NULL;
+  }
+  tor_free(job->dir_z);
+  tor_free(job->dir_lzma);
+  cached_dir_decref(d);
+  tor_free(job);
+}
+
+/** Allocate and return a new cached_dir_t containing the string <b>s</b>,
+ * published at <b>published</b>, and build its compressed form on a
+ * cpuworker if we have any.  Until that finishes, <b>dir_z</b> is NULL, and
+ * compressed requests for this object get compressed on the fly. */
+static cached_dir_t *
+new_cached_dir_compress_async(char *s, time_t published)
+{
+  cached_dir_t *d = new_cached_dir_uncompressed(s, published);
+  cached_dir_compress_job_t *job =
+    tor_malloc_zero(sizeof(cached_dir_compress_job_t));
+  job->dir = d;
+  ++d->refcnt;
+  if (!cpuworker_queue_work(WQ_PRI_LOW, cached_dir_compress_threadfn,
+                            cached_dir_compress_replyfn, job)) {
+    /* No worker threads (or we couldn't queue): compress right here. */
+    cached_dir_compress_threadfn(NULL, job);
+    cached_dir_compress_replyfn(job);
+  }
+  return d;
+}
+
+/** Return the body of <b>d</b> as we precompressed it with <b>method</b>,
+ * and set *<b>len_out</b> to its length; or return NULL if we don't have
+ * such a body (yet). */
+const char *
+cached_dir_get_compressed_body(const cached_dir_t *d,
+                               compress_method_t method, size_t *len_out)
+{
+  const char *body = NULL;
+  size_t len = 0;
+  if (method == ZLIB_METHOD) {
+    body = d->dir_z;
+    len = d->dir_z_len;
+  } else if (method == LZMA_METHOD) {
+    body = d->dir_lzma;
+    len = d->dir_lzma_len;
+  }
+  if (len_out)
+    *len_out = len;
+  return body;
+}
+
 /** Remove all storage held in <b>d</b>, but do not free <b>d</b> itself. */
 static void
 clear_cached_dir(cached_dir_t *d)
 {
   tor_free(d->dir);
   tor_free(d->dir_z);
+  tor_free(d->dir_lzma);
   memset(d, 0, sizeof(cached_dir_t));
 }
 
@@ -1173,6 +1459,176 @@ free_cached_dir_(void *_d)
   cached_dir_decref(d);
 }
 
+/** Release all storage held in the consensus_diff_cache_t <b>cache_</b>. */
+static void
+consensus_diff_cache_free_(void *cache_)
+{
+  consensus_diff_cache_t *cache = cache_;
+  if (!cache)
+    return;
+  SMARTLIST_FOREACH(cache->bases, cached_dir_t *, d, cached_dir_decref(d));
+  smartlist_free(cache->bases);
+  digest256map_free(cache->diffs, free_cached_dir_);
+  tor_free(cache);
+}
+
+/** A request to build a diff between two consensuses on a cpuworker. */
+typedef struct consensus_diff_job_t {
+  /** The flavor of the two consensuses. */
+  char *flavor;
+  /** The consensus the client has.  We hold a reference. */
+  cached_dir_t *base;
+  /** The consensus the client wants.  We hold a reference. */
+  cached_dir_t *target;
+  /** The diff, as built by the worker, or NULL if we couldn't build one. */
+  char *diff;
+  /** The compressed diff. */
+  char *diff_z;
+  /** Length of <b>diff_z</b>. */
+  size_t diff_z_len;
+} consensus_diff_job_t;
+
+/** Build the diff and compressed diff for <b>job</b>.  Safe to call from a
+ * cpuworker: the only shared state it reads is the <b>dir</b> fields of its
+ * two cached_dir_t objects, which never change. */
+static void
+consensus_diff_job_build(consensus_diff_job_t *job)
+{
+  job->diff = consdiff_gen_diff(job->base->dir, job->target->dir);
+  if (job->diff &&
+      tor_gzip_compress(&job->diff_z, &job->diff_z_len,
+                        job->diff, strlen(job->diff), ZLIB_METHOD)) {
+    tor_free(job->diff);
+  }
+}
+
+/** Cpuworker callback: build the diff for the consensus_diff_job_t in
+ * <b>job_</b>. */
+static workqueue_reply_t
+consensus_diff_threadfn(void *state_, void *job_)
+{
+  (void)state_;
+  consensus_diff_job_build(job_);
+  return WQ_RPL_REPLY;
+}
+
+/** Main-thread callback: if the consensus we built a diff to in
+ * <b>job_</b> is still the one we're serving, remember the diff so we can
+ * serve it.  Then release the job. */
+static void
+consensus_diff_replyfn(void *job_)
+{
+  consensus_diff_job_t *job = job_;
+  consensus_diff_cache_t *cache = consensus_diff_caches ?
+    strmap_get(consensus_diff_caches, job->flavor) : NULL;
+
+  if (!job->diff) {
+    log_info(LD_DIRSERV, "Couldn't build a %s consensus diff.", job->flavor);
+  } else if (cache && job->target == dirserv_get_consensus(job->flavor)) {
+    cached_dir_t *d = new_cached_dir_uncompressed(job->diff,
+                                                  job->target->published);
+    cached_dir_t *old;
+    d->dir_z = job->diff_z;
+    d->dir_z_len = job->diff_z_len;
+    memcpy(&d->digests, &job->target->digests, sizeof(common_digests_t));
+    job->diff = job->diff_z = NULL;
+    old = digest256map_set(cache->diffs,
+                   (const uint8_t*)job->base->digests.d[DIGEST_SHA256], d);
+    cached_dir_decref(old);
+    log_info(LD_DIRSERV, "Built a %s consensus diff of %lu bytes "
+             "(%lu compressed) against a consensus of %lu bytes.",
+             job->flavor, (unsigned long)d->dir_len,
+             (unsigned long)d->dir_z_len,
+             (unsigned long)job->target->dir_len);
+  }
+
+  cached_dir_decref(job->base);
+  cached_dir_decref(job->target);
+  tor_free(job->flavor);
+  tor_free(job->diff);
+  tor_free(job->diff_z);
+  tor_free(job);
+}
+
+/** Called when we replace our consensus of flavor <b>flavor_name</b>,
+ * <b>old_consensus</b> (if any), with <b>new_consensus</b>.  Keep the old
+ * one around as a base for diffs, forget our diffs to the old one, and start
+ * building diffs from each base to the new one. */
+static void
+consensus_diffs_note_new_consensus(const char *flavor_name,
+                                   cached_dir_t *old_consensus,
+                                   cached_dir_t *new_consensus)
+{
+  consensus_diff_cache_t *cache;
+
+  if (!consensus_diff_caches)
+    consensus_diff_caches = strmap_new();
+  cache = strmap_get(consensus_diff_caches, flavor_name);
+  if (!cache) {
+    cache = tor_malloc_zero(sizeof(consensus_diff_cache_t));
+    cache->bases = smartlist_new();
+    cache->diffs = digest256map_new();
+    strmap_set(consensus_diff_caches, flavor_name, cache);
+  }
+
+  digest256map_free(cache->diffs, free_cached_dir_);
+  cache->diffs = digest256map_new();
+
+  if (old_consensus) {
+    ++old_consensus->refcnt;
+    smartlist_add(cache->bases, old_consensus);
+  }
+  while (smartlist_len(cache->bases) > MAX_CONSENSUS_DIFF_BASES) {
+    cached_dir_decref(smartlist_get(cache->bases, 0));
+    smartlist_del_keeporder(cache->bases, 0);
+  }
+
+  SMARTLIST_FOREACH_BEGIN(cache->bases, cached_dir_t *, base) {
+    consensus_diff_job_t *job = tor_malloc_zero(sizeof(consensus_diff_job_t));
+    job->flavor = tor_strdup(flavor_name);
+    job->base = base;
+    job->target = new_consensus;
+    ++base->refcnt;
+    ++new_consensus->refcnt;
+    if (!cpuworker_queue_work(WQ_PRI_LOW, consensus_diff_threadfn,
+                              consensus_diff_replyfn, job)) {
+      /* No worker threads: build it right here. */
+      consensus_diff_job_build(job);
+      consensus_diff_replyfn(job);
+    }
+  } SMARTLIST_FOREACH_END(base);
+}
+
+/** Return a diff to our current consensus of flavor <b>flavor_name</b> from
+ * any one of the consensuses in <b>hex_digests</b>, a comma-separated list
+ * of hex SHA256 digests of signed consensus parts, as sent by a client.
+ * Return NULL if we don't have any such diff. */
+cached_dir_t *
+dirserv_get_consensus_diff(const char *flavor_name, const char *hex_digests)
+{
+  consensus_diff_cache_t *cache;
+  smartlist_t *wanted;
+  cached_dir_t *result = NULL;
+
+  if (!consensus_diff_caches ||
+      !(cache = strmap_get(consensus_diff_caches, flavor_name)))
+    return NULL;
+
+  wanted = smartlist_new();
+  smartlist_split_string(wanted, hex_digests, ",",
+                         SPLIT_SKIP_SPACE|SPLIT_IGNORE_BLANK, 0);
+  SMARTLIST_FOREACH_BEGIN(wanted, const char *, hex) {
+    uint8_t digest[DIGEST256_LEN];
+    if (!result && strlen(hex) == HEX_DIGEST256_LEN &&
+        base16_decode((char*)digest, sizeof(digest), hex, strlen(hex)) ==
+          DIGEST256_LEN)
+      result = digest256map_get(cache->diffs, digest);
+  } SMARTLIST_FOREACH_END(hex);
+  SMARTLIST_FOREACH(wanted, char *, cp, tor_free(cp));
+  smartlist_free(wanted);
+  return result;
+}
+
 /** Replace the v3 consensus networkstatus of type <b>flavor_name</b> that
  * we're serving with <b>networkstatus</b>, published at <b>published</b>.  No
  * validation is performed. */
@@ -1187,10 +1643,13 @@ dirserv_set_cached_consensus_networkstatus(const char *networkstatus,
   if (!cached_consensuses)
     cached_consensuses = strmap_new();
 
-  new_networkstatus = new_cached_dir(tor_strdup(networkstatus), published);
+  new_networkstatus = new_cached_dir_compress_async(tor_strdup(networkstatus),
+                                                    published);
   memcpy(&new_networkstatus->digests, digests, sizeof(common_digests_t));
   old_networkstatus = strmap_set(cached_consensuses, flavor_name,
                                  new_networkstatus);
+  consensus_diffs_note_new_consensus(flavor_name, old_networkstatus,
+                                     new_networkstatus);
   if (old_networkstatus)
     cached_dir_decref(old_networkstatus);
 }
@@ -1824,11 +2283,17 @@ routerstatus_format_entry(const routerstatus_t *rs, const char *version,
   char published[ISO_TIME_LEN+1];
   char identity64[BASE64_DIGEST_LEN+1];
   char digest64[BASE64_DIGEST_LEN+1];
+  char ipaddr[INET_NTOA_BUF_LEN];
+  struct in_addr in;
   smartlist_t *chunks = smartlist_new();
 
   format_iso_time(published, rs->published_on);
   digest_to_base64(identity64, rs->identity_digest);
   digest_to_base64(digest64, rs->descriptor_digest);
+  /* Format addresses into our own buffers rather than with fmt_addr32()
+   * and friends: authorities compute consensus flavors on cpuworkers. */
+  in.s_addr = htonl(rs->addr);
+  tor_inet_ntoa(&in, ipaddr, sizeof(ipaddr));
 
   smartlist_add_asprintf(chunks,
                    "r %s %s %s%s%s %s %d %d\n",
@@ -1837,7 +2302,7 @@ routerstatus_format_entry(const routerstatus_t *rs, const char *version,
                    (format==NS_V3_CONSENSUS_MICRODESC)?"":digest64,
                    (format==NS_V3_CONSENSUS_MICRODESC)?"":" ",
                    published,
-                   fmt_addr32(rs->addr),
+                   ipaddr,
                    (int)rs->or_port,
                    (int)rs->dir_port);
 
@@ -1852,8 +2317,11 @@ routerstatus_format_entry(const routerstatus_t *rs, const char *version,
 
   /* Possible "a" line. At most one for now. */
   if (!tor_addr_is_null(&rs->ipv6_addr)) {
-    smartlist_add_asprintf(chunks, "a %s\n",
-                           fmt_addrport(&rs->ipv6_addr, rs->ipv6_orport));
+    char ipv6addr[TOR_ADDR_BUF_LEN];
+    if (!tor_addr_to_str(ipv6addr, &rs->ipv6_addr, sizeof(ipv6addr), 1))
+      strlcpy(ipv6addr, "???", sizeof(ipv6addr));
+    smartlist_add_asprintf(chunks, "a %s:%u\n",
+                           ipv6addr, (unsigned)rs->ipv6_orport);
   }
 
   if (format == NS_V3_CONSENSUS)
@@ -2263,8 +2731,9 @@ guardfraction_line_apply(const char *guard_id,
 
   tor_assert(vote_routerstatuses);
 
-  vrs = smartlist_bsearch(vote_routerstatuses, guard_id,
-                         compare_digest_to_vote_routerstatus_entry);
+  vrs = smartlist_bsearch_digest(vote_routerstatuses, guard_id,
+                                 STRUCT_OFFSET(vote_routerstatus_t,
+                                               status.identity_digest));
 
   if (!vrs) {
     return 0;
@@ -2653,8 +3122,9 @@ measured_bw_line_apply(measured_bw_line_t *parsed_line,
   if (!routerstatuses)
     return 0;
 
-  rs = smartlist_bsearch(routerstatuses, parsed_line->node_id,
-                         compare_digest_to_vote_routerstatus_entry);
+  rs = smartlist_bsearch_digest(routerstatuses, parsed_line->node_id,
+                                STRUCT_OFFSET(vote_routerstatus_t,
+                                              status.identity_digest));
 
   if (rs) {
     rs->has_measured_bw = 1;
@@ -3200,6 +3670,13 @@ dirserv_orconn_tls_done(const tor_addr_t *addr,
       if (tor_addr_family(addr) == AF_INET) {
         rep_hist_note_router_reachable(digest_rcvd, addr, or_port, now);
         node->last_reachable = now;
+        if (node->reachability_test_started_msec) {
+          uint64_t elapsed = monotime_coarse_absolute_msec() -
+            node->reachability_test_started_msec;
+          rep_hist_note_router_reachability_latency(digest_rcvd,
+                  elapsed > UINT32_MAX ? UINT32_MAX : (uint32_t)elapsed);
+          node->reachability_test_started_msec = 0;
+        }
       } else if (tor_addr_family(addr) == AF_INET6) {
         /* No rephist for IPv6.  */
         node->last_reachable6 = now;
@@ -3242,12 +3719,14 @@ dirserv_single_reachability_test(time_t now, routerinfo_t *router)
   channel_t *chan = NULL;
   node_t *node = NULL;
   tor_addr_t router_addr;
-  (void) now;
 
   tor_assert(router);
   node = node_get_mutable_by_id(router->cache_info.identity_digest);
   tor_assert(node);
 
+  node->last_reachability_test = now;
+  node->reachability_test_started_msec = monotime_coarse_absolute_msec();
+
   /* IPv4. */
   log_debug(LD_OR,"Testing reachability of %s at %s:%u.",
             router->nickname, fmt_addr32(router->addr), router->or_port);
@@ -3270,42 +3749,110 @@ dirserv_single_reachability_test(time_t now, routerinfo_t *router)
   }
 }
 
+/** How long (in seconds) must it have been since we launched a reachability
+ * test that did not succeed, before we give the relay precedence over relays
+ * whose last test succeeded? */
+#define REACHABILITY_FAILED_RETEST_DELAY (REACHABILITY_TEST_CYCLE_PERIOD/4)
+
+/** Return the scheduling class for a reachability test of <b>node</b> at
+ * <b>now</b>: relays we have never tested come first, then relays whose
+ * last test didn't succeed (once they have had a while to come back), then
+ * everything else. */
+STATIC int
+dirserv_reachability_test_priority(const node_t *node, time_t now)
+{
+  if (!node->last_reachability_test)
+    return REACHABILITY_PRIO_NEW;
+  if (node->last_reachable < node->last_reachability_test &&
+      node->last_reachability_test + REACHABILITY_FAILED_RETEST_DELAY <= now)
+    return REACHABILITY_PRIO_FAILED;
+  return REACHABILITY_PRIO_NORMAL;
+}
+
+/** A node waiting for a reachability test, with its sort key. */
+typedef struct reachability_candidate_t {
+  node_t *node;
+  int priority;
+} reachability_candidate_t;
+
+/** Helper for sorting reachability_candidate_t: order by scheduling class,
+ * then by least recently tested, then by identity. */
+static int
+compare_reachability_candidates_(const void **a_, const void **b_)
+{
+  const reachability_candidate_t *a = *a_, *b = *b_;
+  if (a->priority != b->priority)
+    return a->priority < b->priority ? -1 : 1;
+  if (a->node->last_reachability_test != b->node->last_reachability_test)
+    return a->node->last_reachability_test < b->node->last_reachability_test
+      ? -1 : 1;
+  return fast_memcmp(a->node->identity, b->node->identity, DIGEST_LEN);
+}
+
+/** Given a list of <b>nodes</b> that want reachability testing, add to
+ * <b>out</b> the <b>n_to_launch</b> (or fewer) that we should test next at
+ * time <b>now</b>, most urgent first. */
+STATIC void
+dirserv_select_reachability_tests(const smartlist_t *nodes, int n_to_launch,
+                                  time_t now, smartlist_t *out)
+{
+  smartlist_t *candidates = smartlist_new();
+
+  SMARTLIST_FOREACH_BEGIN(nodes, node_t *, node) {
+    reachability_candidate_t *c = tor_malloc(sizeof(*c));
+    c->node = node;
+    c->priority = dirserv_reachability_test_priority(node, now);
+    smartlist_add(candidates, c);
+  } SMARTLIST_FOREACH_END(node);
+
+  smartlist_sort(candidates, compare_reachability_candidates_);
+
+  SMARTLIST_FOREACH_BEGIN(candidates, reachability_candidate_t *, c) {
+    if (c_sl_idx < n_to_launch)
+      smartlist_add(out, c->node);
+    tor_free(c);
+  } SMARTLIST_FOREACH_END(c);
+  smartlist_free(candidates);
+}
+
 /** Auth dir server only: load balance such that we only
  * try a few connections per call.
  *
- * The load balancing is such that if we get called once every ten
- * seconds, we will cycle through all the tests in
- * REACHABILITY_TEST_CYCLE_PERIOD seconds (a bit over 20 minutes).
+ * Each call launches the same share of the tests, so that if we get called
+ * once every REACHABILITY_TEST_INTERVAL seconds, we will cycle through all
+ * the relays in about REACHABILITY_TEST_CYCLE_PERIOD seconds (a bit over 20
+ * minutes) without bursts of connections.  Relays we have not tested yet,
+ * and relays whose last test failed, jump the queue.
  */
 void
 dirserv_test_reachability(time_t now)
 {
-  /* XXX decide what to do here; see or-talk thread "purging old router
-   * information, revocation." -NM
-   * We can't afford to mess with this in 0.1.2.x. The reason is that
-   * if we stop doing reachability tests on some of routerlist, then
-   * we'll for-sure think they're down, which may have unexpected
-   * effects in other parts of the code. It doesn't hurt much to do
-   * the testing, and directory authorities are easy to upgrade. Let's
-   * wait til 0.2.0. -RD */
-//  time_t cutoff = now - ROUTER_MAX_AGE_TO_PUBLISH;
   routerlist_t *rl = router_get_routerlist();
-  static char ctr = 0;
   int bridge_auth = authdir_mode_bridge(get_options());
+  smartlist_t *nodes = smartlist_new();
+  smartlist_t *to_test = smartlist_new();
+  int n_to_launch;
 
   SMARTLIST_FOREACH_BEGIN(rl->routers, routerinfo_t *, router) {
-    const char *id_digest = router->cache_info.identity_digest;
+    node_t *node;
     if (router_is_me(router))
       continue;
     if (bridge_auth && router->purpose != ROUTER_PURPOSE_BRIDGE)
       continue; /* bridge authorities only test reachability on bridges */
-//    if (router->cache_info.published_on > cutoff)
-//      continue;
-    if ((((uint8_t)id_digest[0]) % REACHABILITY_MODULO_PER_TEST) == ctr) {
-      dirserv_single_reachability_test(now, router);
-    }
+    node = node_get_mutable_by_id(router->cache_info.identity_digest);
+    if (node && node->ri == router)
+      smartlist_add(nodes, node);
   } SMARTLIST_FOREACH_END(router);
-  ctr = (ctr + 1) % REACHABILITY_MODULO_PER_TEST; /* increment ctr */
+
+  n_to_launch = (smartlist_len(nodes) + REACHABILITY_MODULO_PER_TEST - 1) /
+    REACHABILITY_MODULO_PER_TEST;
+  dirserv_select_reachability_tests(nodes, n_to_launch, now, to_test);
+
+  SMARTLIST_FOREACH(to_test, node_t *, node,
+                    dirserv_single_reachability_test(now, node->ri));
+
+  smartlist_free(to_test);
+  smartlist_free(nodes);
 }
 
 /** Given a fingerprint <b>fp</b> which is either set if we're looking for a
@@ -3440,12 +3987,27 @@ dirserv_estimate_data_size(smartlist_t *fps, int is_serverdescs,
     SMARTLIST_FOREACH(fps, const char *, digest, {
         cached_dir_t *dir = lookup_cached_dir_by_fp(digest);
         if (dir)
-          result += compressed ? dir->dir_z_len : dir->dir_len;
+          result += (compressed && dir->dir_z) ? dir->dir_z_len
+                                               : dir->dir_len;
       });
   }
   return result;
 }
 
+/** Return true iff every networkstatus object listed in <b>fps</b> that we
+ * have is already precompressed with <b>method</b>. */
+int
+dirserv_networkstatus_has_compressed_body(const smartlist_t *fps,
+                                          compress_method_t method)
+{
+  SMARTLIST_FOREACH(fps, const char *, digest, {
+      cached_dir_t *dir = lookup_cached_dir_by_fp(digest);
+      if (dir && !cached_dir_get_compressed_body(dir, method, NULL))
+        return 0;
+    });
+  return 1;
+}
+
 /** Given a list of microdescriptor hashes, guess how many bytes will be
  * needed to transmit them, and return the guess. */
 size_t
@@ -3476,6 +4038,29 @@ connection_dirserv_finish_spooling(dir_connection_t *conn)
   return 0;
 }
 
+/** Spooling helper: write the <b>len</b>-byte object at <b>body</b> onto
+ * the outbuf of <b>conn</b>, compressing it if we have a zlib state.  If
+ * <b>last</b> is true, this is the final object we're spooling, so flush and
+ * release the zlib state.
+ *
+ * <b>body</b> usually points straight into a mmapped cache file; zlib reads
+ * it from there and writes the compressed bytes directly into the outbuf's
+ * chunks, so no intermediate copy is made. */
+static void
+connection_dirserv_spool_body(dir_connection_t *conn, const char *body,
+                              size_t len, int last)
+{
+  if (conn->zlib_state) {
+    connection_write_to_buf_zlib(body, len, conn, last);
+    if (last) {
+      tor_zlib_free(conn->zlib_state);
+      conn->zlib_state = NULL;
+    }
+  } else {
+    connection_write_to_buf(body, len, TO_CONN(conn));
+  }
+}
+
 /** Spooling helper: called when we're sending a bunch of server descriptors,
  * and the outbuf has become too empty. Pulls some entries from
  * fingerprint_stack, and writes the corresponding servers onto outbuf.  If we
@@ -3526,19 +4111,8 @@ connection_dirserv_add_servers_to_outbuf(dir_connection_t *conn)
         rep_hist_note_desc_served(sd->identity_digest);
     }
     body = signed_descriptor_get_body(sd);
-    if (conn->zlib_state) {
-      int last = ! smartlist_len(conn->fingerprint_stack);
-      connection_write_to_buf_zlib(body, sd->signed_descriptor_len, conn,
-                                   last);
-      if (last) {
-        tor_zlib_free(conn->zlib_state);
-        conn->zlib_state = NULL;
-      }
-    } else {
-      connection_write_to_buf(body,
-                              sd->signed_descriptor_len,
-                              TO_CONN(conn));
-    }
+    connection_dirserv_spool_body(conn, body, sd->signed_descriptor_len,
+                                  ! smartlist_len(conn->fingerprint_stack));
   }
 
   if (!smartlist_len(conn->fingerprint_stack)) {
@@ -3572,16 +4146,8 @@ connection_dirserv_add_microdescs_to_outbuf(dir_connection_t *conn)
     tor_free(fp256);
     if (!md || !md->body)
       continue;
-    if (conn->zlib_state) {
-      int last = !smartlist_len(conn->fingerprint_stack);
-      connection_write_to_buf_zlib(md->body, md->bodylen, conn, last);
-      if (last) {
-        tor_zlib_free(conn->zlib_state);
-        conn->zlib_state = NULL;
-      }
-    } else {
-      connection_write_to_buf(md->body, md->bodylen, TO_CONN(conn));
-    }
+    connection_dirserv_spool_body(conn, md->body, md->bodylen,
+                                  !smartlist_len(conn->fingerprint_stack));
   }
   if (!smartlist_len(conn->fingerprint_stack)) {
     if (conn->zlib_state) {
@@ -3598,35 +4164,55 @@ connection_dirserv_add_microdescs_to_outbuf(dir_connection_t *conn)
 
 /** Spooling helper: Called when we're sending a directory or networkstatus,
  * and the outbuf has become too empty.  Pulls some bytes from
- * <b>conn</b>-\>cached_dir-\>dir_z, uncompresses them if appropriate, and
- * puts them on the outbuf.  If we run out of entries, flushes the zlib state
- * and sets the spool source to NONE.  Returns 0 on success, negative on
- * failure. */
+ * <b>conn</b>-\>cached_dir and puts them on the outbuf: from its precompressed
+ * body if the client wants compressed data and we have one, from its plain
+ * body (compressing on the fly) if the client wants compressed data and the
+ * precompressed body isn't built yet, and from its plain body otherwise.  If
+ * we run out of bytes, flushes the zlib state and sets the spool source to
+ * NONE.  Returns 0 on success, negative on failure. */
 static int
 connection_dirserv_add_dir_bytes_to_outbuf(dir_connection_t *conn)
 {
   ssize_t bytes;
   int64_t remaining;
+  const cached_dir_t *d = conn->cached_dir;
+  const char *body;
+  size_t body_len;
 
   bytes = DIRSERV_BUFFER_MIN - connection_get_outbuf_len(TO_CONN(conn));
   tor_assert(bytes > 0);
-  tor_assert(conn->cached_dir);
+  tor_assert(d);
   if (bytes < 8192)
     bytes = 8192;
-  remaining = conn->cached_dir->dir_z_len - conn->cached_dir_offset;
+
+  /* Decide where to serve from when we start on an object, and stick with
+   * that choice even if the compressed body shows up halfway through. */
+  if (conn->cached_dir_offset == 0 &&
+      conn->spool_compress_method != NO_METHOD && !conn->zlib_state &&
+      !cached_dir_get_compressed_body(d, conn->spool_compress_method, NULL))
+    conn->zlib_state = tor_zlib_new(1, conn->spool_compress_method,
+                                    HIGH_COMPRESSION);
+  if (conn->spool_compress_method != NO_METHOD && !conn->zlib_state) {
+    body = cached_dir_get_compressed_body(d, conn->spool_compress_method,
+                                          &body_len);
+  } else {
+    body = d->dir;
+    body_len = d->dir_len;
+  }
+
+  remaining = body_len - conn->cached_dir_offset;
   if (bytes > remaining)
     bytes = (ssize_t) remaining;
 
   if (conn->zlib_state) {
-    connection_write_to_buf_zlib(
-                             conn->cached_dir->dir_z + conn->cached_dir_offset,
-                             bytes, conn, bytes == remaining);
+    connection_write_to_buf_zlib(body + conn->cached_dir_offset,
+                                 bytes, conn, bytes == remaining);
   } else {
-    connection_write_to_buf(conn->cached_dir->dir_z + conn->cached_dir_offset,
+    connection_write_to_buf(body + conn->cached_dir_offset,
                             bytes, TO_CONN(conn));
   }
   conn->cached_dir_offset += bytes;
-  if (conn->cached_dir_offset == (int)conn->cached_dir->dir_z_len) {
+  if (conn->cached_dir_offset == (off_t)body_len) {
     /* We just wrote the last one; finish up. */
     connection_dirserv_finish_spooling(conn);
     cached_dir_decref(conn->cached_dir);
@@ -3649,20 +4235,11 @@ connection_dirserv_add_networkstatus_bytes_to_outbuf(dir_connection_t *conn)
 
   while (connection_get_outbuf_len(TO_CONN(conn)) < DIRSERV_BUFFER_MIN) {
     if (conn->cached_dir) {
-      int uncompressing = (conn->zlib_state != NULL);
       int r = connection_dirserv_add_dir_bytes_to_outbuf(conn);
       if (conn->dir_spool_src == DIR_SPOOL_NONE) {
         /* add_dir_bytes thinks we're done with the cached_dir.  But we
          * may have more cached_dirs! */
         conn->dir_spool_src = DIR_SPOOL_NETWORKSTATUS;
-        /* This bit is tricky.  If we were uncompressing the last
-         * networkstatus, we may need to make a new zlib object to
-         * uncompress the next one. */
-        if (uncompressing && ! conn->zlib_state &&
-            conn->fingerprint_stack &&
-            smartlist_len(conn->fingerprint_stack)) {
-          conn->zlib_state = tor_zlib_new(0, ZLIB_METHOD, HIGH_COMPRESSION);
-        }
       }
       if (r) return r;
     } else if (conn->fingerprint_stack &&
@@ -3798,6 +4375,8 @@ dirserv_free_all(void)
 
   strmap_free(cached_consensuses, free_cached_dir_);
   cached_consensuses = NULL;
+  strmap_free(consensus_diff_caches, consensus_diff_cache_free_);
+  consensus_diff_caches = NULL;
 
   dirserv_clear_measured_bw_cache();
 }
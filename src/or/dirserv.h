@@ -14,9 +14,8 @@
 
 #include "testsupport.h"
 
-/** What fraction (1 over this number) of the relay ID space do we
- * (as a directory authority) launch connections to at each reachability
- * test? */
+/** What fraction (1 over this number) of the relays do we (as a directory
+ * authority) launch connections to at each reachability test? */
 #define REACHABILITY_MODULO_PER_TEST 128
 
 /** How often (in seconds) do we launch reachability tests? */
@@ -41,6 +40,9 @@ enum was_router_added_t dirserv_add_multiple_descriptors(
                                      const char *desc, uint8_t purpose,
                                      const char *source,
                                      const char **msg);
+void dirserv_add_multiple_descriptors_async(const char *desc,
+                                            uint8_t purpose,
+                                            dir_connection_t *conn);
 enum was_router_added_t dirserv_add_descriptor(routerinfo_t *ri,
                                                const char **msg,
                                                const char *source);
@@ -60,6 +62,8 @@ int directory_too_idle_to_fetch_descriptors(const or_options_t *options,
                                             time_t now);
 
 cached_dir_t *dirserv_get_consensus(const char *flavor_name);
+cached_dir_t *dirserv_get_consensus_diff(const char *flavor_name,
+                                         const char *hex_digests);
 void dirserv_set_cached_consensus_networkstatus(const char *consensus,
                                               const char *flavor_name,
                                               const common_digests_t *digests,
@@ -94,6 +98,8 @@ int dirserv_have_any_microdesc(const smartlist_t *fps);
 size_t dirserv_estimate_data_size(smartlist_t *fps, int is_serverdescs,
                                   int compressed);
 size_t dirserv_estimate_microdesc_size(const smartlist_t *fps, int compressed);
+int dirserv_networkstatus_has_compressed_body(const smartlist_t *fps,
+                                              compress_method_t method);
 
 char *routerstatus_format_entry(
                               const routerstatus_t *rs,
@@ -104,6 +110,9 @@ char *routerstatus_format_entry(
 void dirserv_free_all(void);
 void cached_dir_decref(cached_dir_t *d);
 cached_dir_t *new_cached_dir(char *s, time_t published);
+const char *cached_dir_get_compressed_body(const cached_dir_t *d,
+                                           compress_method_t method,
+                                           size_t *len_out);
 
 int validate_recommended_package_line(const char *line);
 
@@ -111,6 +120,18 @@ int validate_recommended_package_line(const char *line);
 
 STATIC void dirserv_set_routerstatus_testing(routerstatus_t *rs);
 
+/** Scheduling classes for reachability tests, in the order we launch
+ * them. */
+#define REACHABILITY_PRIO_NEW 0
+#define REACHABILITY_PRIO_FAILED 1
+#define REACHABILITY_PRIO_NORMAL 2
+
+STATIC int dirserv_reachability_test_priority(const node_t *node,
+                                              time_t now);
+STATIC void dirserv_select_reachability_tests(const smartlist_t *nodes,
+                                              int n_to_launch, time_t now,
+                                              smartlist_t *out);
+
 /* Put the MAX_MEASUREMENT_AGE #define here so unit tests can see it */
 #define MAX_MEASUREMENT_AGE (3*24*60*60) /* 3 days */
 
@@ -6,6 +6,7 @@
 #define DIRVOTE_PRIVATE
 #include "or.h"
 #include "config.h"
+#include "cpuworker.h"
 #include "dircollate.h"
 #include "directory.h"
 #include "dirserv.h"
@@ -57,6 +58,7 @@ static int dirvote_perform_vote(void);
 static void dirvote_clear_votes(int all_votes);
 static int dirvote_compute_consensuses(void);
 static int dirvote_publish_consensus(void);
+static void microdesc_creation_cache_free_all(void);
 
 /* =====
  * Voting
@@ -121,7 +123,7 @@ STATIC char *
 format_networkstatus_vote(crypto_pk_t *private_signing_key,
                           networkstatus_t *v3_ns)
 {
-  smartlist_t *chunks = smartlist_new();
+  strbuf_t *sb = NULL;
   char *packages = NULL;
   char fingerprint[FINGERPRINT_LEN+1];
   char digest[DIGEST_LEN];
@@ -138,6 +140,7 @@ format_networkstatus_vote(crypto_pk_t *private_signing_key,
   voter = smartlist_get(v3_ns->voters, 0);
 
   addr = voter->addr;
+  sb = strbuf_new(4096 + 512 * smartlist_len(v3_ns->routerstatus_list));
 
   base16_encode(fingerprint, sizeof(fingerprint),
                 v3_ns->cert->cache_info.identity_digest, DIGEST_LEN);
@@ -188,7 +191,7 @@ format_networkstatus_vote(crypto_pk_t *private_signing_key,
       params = tor_strdup("");
 
     tor_assert(cert);
-    smartlist_add_asprintf(chunks,
+    strbuf_add_printf(sb,
                  "network-status-version 3\n"
                  "vote-status %s\n"
                  "consensus-methods %s\n"
@@ -232,11 +235,11 @@ format_networkstatus_vote(crypto_pk_t *private_signing_key,
     if (!tor_digest_is_zero(voter->legacy_id_digest)) {
       char fpbuf[HEX_DIGEST_LEN+1];
       base16_encode(fpbuf, sizeof(fpbuf), voter->legacy_id_digest, DIGEST_LEN);
-      smartlist_add_asprintf(chunks, "legacy-dir-key %s\n", fpbuf);
+      strbuf_add_printf(sb, "legacy-dir-key %s\n", fpbuf);
     }
 
-    smartlist_add(chunks, tor_strndup(cert->cache_info.signed_descriptor_body,
-                                      cert->cache_info.signed_descriptor_len));
+    strbuf_add_bytes(sb, cert->cache_info.signed_descriptor_body,
+                     cert->cache_info.signed_descriptor_len);
   }
 
   SMARTLIST_FOREACH_BEGIN(v3_ns->routerstatus_list, vote_routerstatus_t *,
@@ -246,20 +249,23 @@ format_networkstatus_vote(crypto_pk_t *private_signing_key,
     rsf = routerstatus_format_entry(&vrs->status,
                                     vrs->version, vrs->protocols,
                                     NS_V3_VOTE, vrs);
-    if (rsf)
-      smartlist_add(chunks, rsf);
+    if (rsf) {
+      strbuf_add(sb, rsf);
+      tor_free(rsf);
+    }
 
     for (h = vrs->microdesc; h; h = h->next) {
-      smartlist_add(chunks, tor_strdup(h->microdesc_hash_line));
+      strbuf_add(sb, h->microdesc_hash_line);
     }
   } SMARTLIST_FOREACH_END(vrs);
 
-  smartlist_add(chunks, tor_strdup("directory-footer\n"));
+  strbuf_add(sb, "directory-footer\n"
+                 "directory-signature ");
 
   /* The digest includes everything up through the space after
-   * directory-signature.  (Yuck.) */
-  crypto_digest_smartlist(digest, DIGEST_LEN, chunks,
-                          "directory-signature ", DIGEST_SHA1);
+   * directory-signature.  (Yuck.)  Since the document is in one piece, we
+   * can take it right here, without joining or rescanning anything. */
+  crypto_digest(digest, strbuf_get(sb), strbuf_len(sb));
 
   {
     char signing_key_fingerprint[FINGERPRINT_LEN+1];
@@ -269,8 +275,7 @@ format_networkstatus_vote(crypto_pk_t *private_signing_key,
       goto err;
     }
 
-    smartlist_add_asprintf(chunks, "directory-signature %s %s\n", fingerprint,
-                           signing_key_fingerprint);
+    strbuf_add_printf(sb, "%s %s\n", fingerprint, signing_key_fingerprint);
   }
 
   note_crypto_pk_op(SIGN_DIR);
@@ -281,10 +286,12 @@ format_networkstatus_vote(crypto_pk_t *private_signing_key,
       log_warn(LD_BUG, "Unable to sign networkstatus vote.");
       goto err;
     }
-    smartlist_add(chunks, sig);
+    strbuf_add(sb, sig);
+    tor_free(sig);
   }
 
-  status = smartlist_join_strings(chunks, "", 0, NULL);
+  status = strbuf_extract(sb, NULL);
+  sb = NULL;
 
   {
     networkstatus_t *v;
@@ -308,8 +315,7 @@ format_networkstatus_vote(crypto_pk_t *private_signing_key,
   tor_free(protocols_lines);
   tor_free(packages);
 
-  SMARTLIST_FOREACH(chunks, char *, cp, tor_free(cp));
-  smartlist_free(chunks);
+  strbuf_free(sb);
   return status;
 }
 
@@ -524,10 +530,12 @@ compute_routerstatus_consensus(smartlist_t *votes, int consensus_method,
     most_alt_orport = smartlist_get_most_frequent(alt_orports,
                                                   compare_orports_);
     if (most_alt_orport) {
+      char addrbuf[TOR_ADDR_BUF_LEN];
       memcpy(best_alt_orport_out, most_alt_orport, sizeof(tor_addr_port_t));
-      log_debug(LD_DIR, "\"a\" line winner for %s is %s",
-                most->status.nickname,
-                fmt_addrport(&most_alt_orport->addr, most_alt_orport->port));
+      tor_addr_to_str(addrbuf, &most_alt_orport->addr, sizeof(addrbuf), 1);
+      log_debug(LD_DIR, "\"a\" line winner for %s is %s:%u",
+                most->status.nickname, addrbuf,
+                (unsigned)most_alt_orport->port);
     }
 
     SMARTLIST_FOREACH(alt_orports, tor_addr_port_t *, ap, tor_free(ap));
@@ -881,7 +889,7 @@ networkstatus_check_weights(int64_t Wgg, int64_t Wgd, int64_t Wmg,
  * It returns true if weights could be computed, false otherwise.
  */
 static int
-networkstatus_compute_bw_weights_v10(smartlist_t *chunks, int64_t G,
+networkstatus_compute_bw_weights_v10(strbuf_t *sb, int64_t G,
                                      int64_t M, int64_t E, int64_t D,
                                      int64_t T, int64_t weight_scale)
 {
@@ -1097,7 +1105,7 @@ networkstatus_compute_bw_weights_v10(smartlist_t *chunks, int64_t G,
    *
    * NOTE: This list is sorted.
    */
-  smartlist_add_asprintf(chunks,
+  strbuf_add_printf(sb,
      "bandwidth-weights Wbd=%d Wbe=%d Wbg=%d Wbm=%d "
      "Wdb=%d "
      "Web=%d Wed=%d Wee=%d Weg=%d Wem=%d "
@@ -1266,6 +1274,17 @@ compute_nth_protocol_set(int n, int n_voters, const smartlist_t *votes)
   return result;
 }
 
+/** Return the consensus method that we will use for a consensus built
+ * from <b>votes</b>. */
+static int
+consensus_method_to_use(smartlist_t *votes)
+{
+  int consensus_method = compute_consensus_method(votes);
+  if (!consensus_method_is_supported(consensus_method))
+    consensus_method = MAX_SUPPORTED_CONSENSUS_METHOD;
+  return consensus_method;
+}
+
 /** Given a list of vote networkstatus_t in <b>votes</b>, our public
  * authority <b>identity_key</b>, our private authority <b>signing_key</b>,
  * and the number of <b>total_authorities</b> that we believe exist in our
@@ -1283,7 +1302,30 @@ networkstatus_compute_consensus(smartlist_t *votes,
                                 crypto_pk_t *legacy_signing_key,
                                 consensus_flavor_t flavor)
 {
-  smartlist_t *chunks;
+  return networkstatus_compute_consensus_collated(votes, total_authorities,
+                                                  identity_key, signing_key,
+                                                  legacy_id_key_digest,
+                                                  legacy_signing_key, flavor,
+                                                  NULL);
+}
+
+/** As networkstatus_compute_consensus(), but if <b>shared_collator</b> is
+ * set, use it instead of collating the votes ourselves.  It must hold
+ * <b>votes</b>, added in order of authority identity, already collated with
+ * the method that consensus_method_to_use() picks for them.  Collation
+ * doesn't depend on the flavor, so every flavor can share one collator; we
+ * only read from it, so they can do so at the same time. */
+STATIC char *
+networkstatus_compute_consensus_collated(smartlist_t *votes,
+                                         int total_authorities,
+                                         crypto_pk_t *identity_key,
+                                         crypto_pk_t *signing_key,
+                                         const char *legacy_id_key_digest,
+                                         crypto_pk_t *legacy_signing_key,
+                                         consensus_flavor_t flavor,
+                                         dircollator_t *shared_collator)
+{
+  strbuf_t *sb = NULL;
   char *result = NULL;
   int consensus_method;
   time_t valid_after, fresh_until, valid_until;
@@ -1408,7 +1450,7 @@ networkstatus_compute_consensus(smartlist_t *votes,
     tor_free(distsec_list);
   }
 
-  chunks = smartlist_new();
+  sb = strbuf_new(4096 + 256 * smartlist_len(votes));
 
   {
     char va_buf[ISO_TIME_LEN+1], fu_buf[ISO_TIME_LEN+1],
@@ -1419,15 +1461,15 @@ networkstatus_compute_consensus(smartlist_t *votes,
     format_iso_time(vu_buf, valid_until);
     flaglist = smartlist_join_strings(flags, " ", 0, NULL);
 
-    smartlist_add_asprintf(chunks, "network-status-version 3%s%s\n"
+    strbuf_add_printf(sb, "network-status-version 3%s%s\n"
                  "vote-status consensus\n",
                  flavor == FLAV_NS ? "" : " ",
                  flavor == FLAV_NS ? "" : flavor_name);
 
-    smartlist_add_asprintf(chunks, "consensus-method %d\n",
+    strbuf_add_printf(sb, "consensus-method %d\n",
                            consensus_method);
 
-    smartlist_add_asprintf(chunks,
+    strbuf_add_printf(sb,
                  "valid-after %s\n"
                  "fresh-until %s\n"
                  "valid-until %s\n"
@@ -1452,7 +1494,8 @@ networkstatus_compute_consensus(smartlist_t *votes,
       char *proto_line = compute_nth_protocol_set(idx, num_dirauth, votes);
       if (BUG(!proto_line))
         continue;
-      smartlist_add(chunks, proto_line);
+      strbuf_add(sb, proto_line);
+      tor_free(proto_line);
     }
   }
 
@@ -1460,9 +1503,7 @@ networkstatus_compute_consensus(smartlist_t *votes,
                                       total_authorities);
   if (smartlist_len(param_list)) {
     params = smartlist_join_strings(param_list, " ", 0, NULL);
-    smartlist_add(chunks, tor_strdup("params "));
-    smartlist_add(chunks, params);
-    smartlist_add(chunks, tor_strdup("\n"));
+    strbuf_add_printf(sb, "params %s\n", params);
   }
 
   if (consensus_method >= MIN_METHOD_FOR_SHARED_RANDOM) {
@@ -1477,7 +1518,8 @@ networkstatus_compute_consensus(smartlist_t *votes,
     /* Add the shared random value. */
     char *srv_lines = sr_get_string_for_consensus(votes, num_srv_agreements);
     if (srv_lines != NULL) {
-      smartlist_add(chunks, srv_lines);
+      strbuf_add(sb, srv_lines);
+      tor_free(srv_lines);
     }
   }
 
@@ -1505,21 +1547,26 @@ networkstatus_compute_consensus(smartlist_t *votes,
     SMARTLIST_FOREACH_BEGIN(dir_sources, const dir_src_ent_t *, e) {
       char fingerprint[HEX_DIGEST_LEN+1];
       char votedigest[HEX_DIGEST_LEN+1];
+      char addrbuf[INET_NTOA_BUF_LEN];
+      struct in_addr in;
       networkstatus_t *v = e->v;
       networkstatus_voter_info_t *voter = get_voter(v);
 
       base16_encode(fingerprint, sizeof(fingerprint), e->digest, DIGEST_LEN);
       base16_encode(votedigest, sizeof(votedigest), voter->vote_digest,
                     DIGEST_LEN);
+      /* Not fmt_addr32(): we may be running on a cpuworker. */
+      in.s_addr = htonl(voter->addr);
+      tor_inet_ntoa(&in, addrbuf, sizeof(addrbuf));
 
-      smartlist_add_asprintf(chunks,
+      strbuf_add_printf(sb,
                    "dir-source %s%s %s %s %s %d %d\n",
                    voter->nickname, e->is_legacy ? "-legacy" : "",
-                   fingerprint, voter->address, fmt_addr32(voter->addr),
+                   fingerprint, voter->address, addrbuf,
                    voter->dir_port,
                    voter->or_port);
       if (! e->is_legacy) {
-        smartlist_add_asprintf(chunks,
+        strbuf_add_printf(sb,
                      "contact %s\n"
                      "vote-digest %s\n",
                      voter->contact,
@@ -1546,8 +1593,11 @@ networkstatus_compute_consensus(smartlist_t *votes,
         max_unmeasured_bw_kb = (uint32_t)
           tor_parse_ulong(eq+1, 10, 1, UINT32_MAX, &ok, NULL);
         if (!ok) {
+          /* Not escaped(): we may be running on a cpuworker. */
+          char *esc = esc_for_log(max_unmeasured_param);
           log_warn(LD_DIR, "Bad element '%s' in max unmeasured bw param",
-                   escaped(max_unmeasured_param));
+                   esc);
+          tor_free(esc);
           max_unmeasured_bw_kb = DEFAULT_MAX_UNMEASURED_BW_KB;
         }
       }
@@ -1687,13 +1737,17 @@ networkstatus_compute_consensus(smartlist_t *votes,
        }
     );
 
-    /* Populate the collator */
-    collator = dircollator_new(smartlist_len(votes), total_authorities);
-    SMARTLIST_FOREACH_BEGIN(votes, networkstatus_t *, v) {
-      dircollator_add_vote(collator, v);
-    } SMARTLIST_FOREACH_END(v);
+    /* Populate the collator, unless somebody already did it for us. */
+    if (shared_collator) {
+      collator = shared_collator;
+    } else {
+      collator = dircollator_new(smartlist_len(votes), total_authorities);
+      SMARTLIST_FOREACH_BEGIN(votes, networkstatus_t *, v) {
+        dircollator_add_vote(collator, v);
+      } SMARTLIST_FOREACH_END(v);
 
-    dircollator_collate(collator, consensus_method);
+      dircollator_collate(collator, consensus_method);
+    }
 
     /* Now go through all the votes */
     flag_counts = tor_calloc(smartlist_len(flags), sizeof(int));
@@ -1726,6 +1780,8 @@ networkstatus_compute_consensus(smartlist_t *votes,
       num_guardfraction_inputs = 0;
       int ed_consensus = 0;
       const uint8_t *ed_consensus_val = NULL;
+      const int ed_collated =
+        dircollator_router_is_ed25519_collated(collator, i);
 
       /* Okay, go through all the entries for this digest. */
       for (int voter_idx = 0; voter_idx < smartlist_len(votes); ++voter_idx) {
@@ -1775,7 +1831,7 @@ networkstatus_compute_consensus(smartlist_t *votes,
           bandwidths_kb[num_bandwidths++] = rs->status.bandwidth_kb;
 
         /* Count number for which ed25519 is canonical. */
-        if (rs->ed25519_reflects_consensus) {
+        if (ed_collated && rs->has_ed25519_listing) {
           ++ed_consensus;
           if (ed_consensus_val) {
             tor_assert(fast_memeq(ed_consensus_val, rs->ed25519_id,
@@ -2034,28 +2090,33 @@ networkstatus_compute_consensus(smartlist_t *votes,
         /* Okay!! Now we can write the descriptor... */
         /*     First line goes into "buf". */
         buf = routerstatus_format_entry(&rs_out, NULL, NULL, rs_format, NULL);
-        if (buf)
-          smartlist_add(chunks, buf);
+        if (buf) {
+          strbuf_add(sb, buf);
+          tor_free(buf);
+        }
       }
       /*     Now an m line, if applicable. */
       if (flavor == FLAV_MICRODESC &&
           !tor_digest256_is_zero(microdesc_digest)) {
         char m[BASE64_DIGEST256_LEN+1];
         digest256_to_base64(m, microdesc_digest);
-        smartlist_add_asprintf(chunks, "m %s\n", m);
+        strbuf_add_printf(sb, "m %s\n", m);
       }
       /*     Next line is all flags.  The "\n" is missing. */
-      smartlist_add(chunks,
-                    smartlist_join_strings(chosen_flags, " ", 0, NULL));
+      SMARTLIST_FOREACH_BEGIN(chosen_flags, const char *, fl) {
+        if (fl_sl_idx)
+          strbuf_add(sb, " ");
+        strbuf_add(sb, fl);
+      } SMARTLIST_FOREACH_END(fl);
       /*     Now the version line. */
       if (chosen_version) {
-        smartlist_add(chunks, tor_strdup("\nv "));
-        smartlist_add(chunks, tor_strdup(chosen_version));
+        strbuf_add(sb, "\nv ");
+        strbuf_add(sb, chosen_version);
       }
-      smartlist_add(chunks, tor_strdup("\n"));
+      strbuf_add(sb, "\n");
       if (chosen_protocol_list &&
           consensus_method >= MIN_METHOD_FOR_RS_PROTOCOLS) {
-        smartlist_add_asprintf(chunks, "pr %s\n", chosen_protocol_list);
+        strbuf_add_printf(sb, "pr %s\n", chosen_protocol_list);
       }
       /*     Now the weight line. */
       if (rs_out.has_bandwidth) {
@@ -2068,17 +2129,17 @@ networkstatus_compute_consensus(smartlist_t *votes,
           tor_asprintf(&guardfraction_str,
                        " GuardFraction=%u", rs_out.guardfraction_percentage);
         }
-        smartlist_add_asprintf(chunks, "w Bandwidth=%d%s%s\n",
-                               rs_out.bandwidth_kb,
-                               unmeasured?" Unmeasured=1":"",
-                               guardfraction_str ? guardfraction_str : "");
+        strbuf_add_printf(sb, "w Bandwidth=%d%s%s\n",
+                          rs_out.bandwidth_kb,
+                          unmeasured?" Unmeasured=1":"",
+                          guardfraction_str ? guardfraction_str : "");
 
         tor_free(guardfraction_str);
       }
 
       /*     Now the exitpolicy summary line. */
       if (rs_out.has_exitsummary && flavor == FLAV_NS) {
-        smartlist_add_asprintf(chunks, "p %s\n", rs_out.exitsummary);
+        strbuf_add_printf(sb, "p %s\n", rs_out.exitsummary);
       }
 
       /* And the loop is over and we move on to the next router */
@@ -2105,7 +2166,7 @@ networkstatus_compute_consensus(smartlist_t *votes,
   }
 
   /* Mark the directory footer region */
-  smartlist_add(chunks, tor_strdup("directory-footer\n"));
+  strbuf_add(sb, "directory-footer\n");
 
   {
     int64_t weight_scale = BW_WEIGHT_SCALE;
@@ -2129,18 +2190,20 @@ networkstatus_compute_consensus(smartlist_t *votes,
         weight_scale = tor_parse_long(eq+1, 10, 1, INT32_MAX, &ok,
                                          NULL);
         if (!ok) {
-          log_warn(LD_DIR, "Bad element '%s' in bw weight param",
-              escaped(bw_weight_param));
+          char *esc = esc_for_log(bw_weight_param);
+          log_warn(LD_DIR, "Bad element '%s' in bw weight param", esc);
+          tor_free(esc);
           weight_scale = BW_WEIGHT_SCALE;
         }
       } else {
-        log_warn(LD_DIR, "Bad element '%s' in bw weight param",
-            escaped(bw_weight_param));
+        char *esc = esc_for_log(bw_weight_param);
+        log_warn(LD_DIR, "Bad element '%s' in bw weight param", esc);
+        tor_free(esc);
         weight_scale = BW_WEIGHT_SCALE;
       }
     }
 
-    added_weights = networkstatus_compute_bw_weights_v10(chunks, G, M, E, D,
+    added_weights = networkstatus_compute_bw_weights_v10(sb, G, M, E, D,
                                                          T, weight_scale);
   }
 
@@ -2156,10 +2219,14 @@ networkstatus_compute_consensus(smartlist_t *votes,
     const char *algname = crypto_digest_algorithm_get_name(digest_alg);
     char *signature;
 
-    smartlist_add(chunks, tor_strdup("directory-signature "));
+    strbuf_add(sb, "directory-signature ");
 
-    /* Compute the hash of the chunks. */
-    crypto_digest_smartlist(digest, digest_len, chunks, "", digest_alg);
+    /* Compute the hash of everything so far.  The consensus is in one
+     * piece, so we don't need to join or rescan anything first. */
+    if (digest_alg == DIGEST_SHA1)
+      crypto_digest(digest, strbuf_get(sb), strbuf_len(sb));
+    else
+      crypto_digest256(digest, strbuf_get(sb), strbuf_len(sb), digest_alg);
 
     /* Get the fingerprints */
     crypto_pk_get_fingerprint(identity_key, fingerprint, 0);
@@ -2167,12 +2234,12 @@ networkstatus_compute_consensus(smartlist_t *votes,
 
     /* add the junk that will go at the end of the line. */
     if (flavor == FLAV_NS) {
-      smartlist_add_asprintf(chunks, "%s %s\n", fingerprint,
-                   signing_key_fingerprint);
+      strbuf_add_printf(sb, "%s %s\n", fingerprint,
+                        signing_key_fingerprint);
     } else {
-      smartlist_add_asprintf(chunks, "%s %s %s\n",
-                   algname, fingerprint,
-                   signing_key_fingerprint);
+      strbuf_add_printf(sb, "%s %s %s\n",
+                        algname, fingerprint,
+                        signing_key_fingerprint);
     }
     /* And the signature. */
     if (!(signature = router_get_dirobj_signature(digest, digest_len,
@@ -2180,21 +2247,22 @@ networkstatus_compute_consensus(smartlist_t *votes,
       log_warn(LD_BUG, "Couldn't sign consensus networkstatus.");
       goto done;
     }
-    smartlist_add(chunks, signature);
+    strbuf_add(sb, signature);
+    tor_free(signature);
 
     if (legacy_id_key_digest && legacy_signing_key) {
-      smartlist_add(chunks, tor_strdup("directory-signature "));
+      strbuf_add(sb, "directory-signature ");
       base16_encode(fingerprint, sizeof(fingerprint),
                     legacy_id_key_digest, DIGEST_LEN);
       crypto_pk_get_fingerprint(legacy_signing_key,
                                 signing_key_fingerprint, 0);
       if (flavor == FLAV_NS) {
-        smartlist_add_asprintf(chunks, "%s %s\n", fingerprint,
-                     signing_key_fingerprint);
+        strbuf_add_printf(sb, "%s %s\n", fingerprint,
+                          signing_key_fingerprint);
       } else {
-        smartlist_add_asprintf(chunks, "%s %s %s\n",
-                     algname, fingerprint,
-                     signing_key_fingerprint);
+        strbuf_add_printf(sb, "%s %s %s\n",
+                          algname, fingerprint,
+                          signing_key_fingerprint);
       }
 
       if (!(signature = router_get_dirobj_signature(digest, digest_len,
@@ -2202,11 +2270,13 @@ networkstatus_compute_consensus(smartlist_t *votes,
         log_warn(LD_BUG, "Couldn't sign consensus networkstatus.");
         goto done;
       }
-      smartlist_add(chunks, signature);
+      strbuf_add(sb, signature);
+      tor_free(signature);
     }
   }
 
-  result = smartlist_join_strings(chunks, "", 0, NULL);
+  result = strbuf_extract(sb, NULL);
+  sb = NULL;
 
   {
     networkstatus_t *c;
@@ -2226,14 +2296,15 @@ networkstatus_compute_consensus(smartlist_t *votes,
 
  done:
 
-  dircollator_free(collator);
+  if (collator != shared_collator)
+    dircollator_free(collator);
   tor_free(client_versions);
   tor_free(server_versions);
   tor_free(packages);
   SMARTLIST_FOREACH(flags, char *, cp, tor_free(cp));
   smartlist_free(flags);
-  SMARTLIST_FOREACH(chunks, char *, cp, tor_free(cp));
-  smartlist_free(chunks);
+  tor_free(params);
+  strbuf_free(sb);
   SMARTLIST_FOREACH(param_list, char *, cp, tor_free(cp));
   smartlist_free(param_list);
 
@@ -3285,6 +3356,140 @@ write_v3_votes_to_disk(const smartlist_t *pending_votes)
   smartlist_free(votestrings);
 }
 
+/** Worker function: compute the consensus flavor described by the
+ * consensus_job_t <b>job_</b>.  Runs on a cpuworker thread, so it must not
+ * touch anything but the job and the votes, which nobody changes while we
+ * run. */
+static workqueue_reply_t
+consensus_job_threadfn(void *state_, void *job_)
+{
+  consensus_job_t *job = job_;
+  (void)state_;
+
+  job->body = networkstatus_compute_consensus_collated(
+                                              job->votes,
+                                              job->total_authorities,
+                                              job->identity_key,
+                                              job->signing_key,
+                                              job->legacy_id_key_digest,
+                                              job->legacy_signing_key,
+                                              job->flavor,
+                                              job->collator);
+
+  if (job->batch) {
+    consensus_job_batch_t *batch = job->batch;
+    tor_mutex_acquire(&batch->lock);
+    --batch->n_pending;
+    tor_cond_signal_one(&batch->cond);
+    tor_mutex_release(&batch->lock);
+  }
+  return WQ_RPL_REPLY;
+}
+
+/** Main-thread callback for consensus_job_threadfn(): the result was
+ * collected long ago, so just release the job. */
+static void
+consensus_job_replyfn(void *job_)
+{
+  tor_free(job_);
+}
+
+/** Compute a consensus of every flavor from <b>votes</b>, exactly as
+ * networkstatus_compute_consensus() would with the other arguments, and
+ * set <b>bodies_out</b>[<i>f</i>] to the one for flavor <i>f</i>, or to
+ * NULL if we couldn't make it.
+ *
+ * The flavors don't depend on one another, so we give all but the first to
+ * the cpuworkers and compute the first ourselves while they work.  Nor
+ * does collating the votes depend on the flavor, so we do that just once,
+ * beforehand.  This blocks until every flavor is done. */
+STATIC void
+dirvote_compute_consensus_bodies(smartlist_t *votes, int total_authorities,
+                                 crypto_pk_t *identity_key,
+                                 crypto_pk_t *signing_key,
+                                 const char *legacy_id_key_digest,
+                                 crypto_pk_t *legacy_signing_key,
+                                 char **bodies_out)
+{
+  consensus_job_batch_t batch;
+  consensus_job_t *jobs[N_CONSENSUS_FLAVORS];
+  smartlist_t *sorted_votes;
+  dircollator_t *collator = NULL;
+  int flav;
+
+  /* Collate the votes in the order that computing a consensus will put
+   * them in. */
+  sorted_votes = smartlist_new();
+  smartlist_add_all(sorted_votes, votes);
+  smartlist_sort(sorted_votes, compare_votes_by_authority_id_);
+  if (smartlist_len(sorted_votes) &&
+      total_authorities >= smartlist_len(sorted_votes)) {
+    collator = dircollator_new(smartlist_len(sorted_votes),
+                               total_authorities);
+    SMARTLIST_FOREACH(sorted_votes, networkstatus_t *, v,
+                      dircollator_add_vote(collator, v));
+    dircollator_collate(collator, consensus_method_to_use(sorted_votes));
+  }
+
+  tor_mutex_init_for_cond(&batch.lock);
+  tor_cond_init(&batch.cond);
+  batch.n_pending = 0;
+
+  for (flav = 0; flav < N_CONSENSUS_FLAVORS; ++flav) {
+    consensus_job_t *job = tor_malloc_zero(sizeof(consensus_job_t));
+    job->votes = smartlist_new();
+    smartlist_add_all(job->votes, sorted_votes);
+    job->collator = collator;
+    job->total_authorities = total_authorities;
+    job->identity_key = identity_key;
+    job->signing_key = signing_key;
+    job->legacy_id_key_digest = legacy_id_key_digest;
+    job->legacy_signing_key = legacy_signing_key;
+    job->flavor = flav;
+    jobs[flav] = job;
+
+    if (flav == 0) {
+      /* The first flavor is ours. */
+      continue;
+    }
+    job->batch = &batch;
+    tor_mutex_acquire(&batch.lock);
+    ++batch.n_pending;
+    tor_mutex_release(&batch.lock);
+    /* We wait for this below, so it can't sit behind background work. */
+    if (!cpuworker_queue_work(WQ_PRI_HIGH, consensus_job_threadfn,
+                              consensus_job_replyfn, job)) {
+      /* No worker threads (or we couldn't queue): do it right here. */
+      job->batch = NULL;
+      tor_mutex_acquire(&batch.lock);
+      --batch.n_pending;
+      tor_mutex_release(&batch.lock);
+      consensus_job_threadfn(NULL, job);
+    }
+  }
+
+  consensus_job_threadfn(NULL, jobs[0]);
+
+  tor_mutex_acquire(&batch.lock);
+  while (batch.n_pending > 0)
+    tor_cond_wait(&batch.cond, &batch.lock, NULL);
+  tor_mutex_release(&batch.lock);
+  tor_cond_uninit(&batch.cond);
+  tor_mutex_uninit(&batch.lock);
+
+  for (flav = 0; flav < N_CONSENSUS_FLAVORS; ++flav) {
+    consensus_job_t *job = jobs[flav];
+    bodies_out[flav] = job->body;
+    job->body = NULL;
+    smartlist_free(job->votes);
+    /* Jobs that went to a cpuworker are freed by consensus_job_replyfn(). */
+    if (!job->batch)
+      tor_free(job);
+  }
+  dircollator_free(collator);
+  smartlist_free(sorted_votes);
+}
+
 /** Try to compute a v3 networkstatus consensus from the currently pending
  * votes.  Return 0 on success, -1 on failure.  Store the consensus in
  * pending_consensus: it won't be ready to be published until we have
@@ -3347,6 +3552,7 @@ dirvote_compute_consensuses(void)
     char legacy_dbuf[DIGEST_LEN];
     crypto_pk_t *legacy_sign=NULL;
     char *legacy_id_digest = NULL;
+    char *bodies[N_CONSENSUS_FLAVORS];
     int n_generated = 0;
     if (get_options()->V3AuthUseLegacyKey) {
       authority_cert_t *cert = get_my_v3_legacy_cert();
@@ -3361,13 +3567,15 @@ dirvote_compute_consensuses(void)
       }
     }
 
+    dirvote_compute_consensus_bodies(votes, n_voters,
+                                     my_cert->identity_key,
+                                     get_my_v3_authority_signing_key(),
+                                     legacy_id_digest, legacy_sign,
+                                     bodies);
+
     for (flav = 0; flav < N_CONSENSUS_FLAVORS; ++flav) {
       const char *flavor_name = networkstatus_get_flavor_name(flav);
-      consensus_body = networkstatus_compute_consensus(
-        votes, n_voters,
-        my_cert->identity_key,
-        get_my_v3_authority_signing_key(), legacy_id_digest, legacy_sign,
-        flav);
+      consensus_body = bodies[flav];
 
       if (!consensus_body) {
         log_warn(LD_DIR, "Couldn't generate a %s consensus at all!",
@@ -3659,6 +3867,8 @@ dirvote_free_all(void)
     smartlist_free(pending_consensus_signature_list);
     pending_consensus_signature_list = NULL;
   }
+
+  microdesc_creation_cache_free_all();
 }
 
 /* ====
@@ -3827,15 +4037,13 @@ dirvote_create_microdescriptor(const routerinfo_t *ri, int consensus_method)
   return result;
 }
 
-/** Format the appropriate vote line to describe the microdescriptor <b>md</b>
- * in a consensus vote document.  Write it into the <b>out_len</b>-byte buffer
- * in <b>out</b>.  Return -1 on failure and the number of characters written
- * on success. */
-ssize_t
-dirvote_format_microdesc_vote_line(char *out_buf, size_t out_buf_len,
-                                   const microdesc_t *md,
-                                   int consensus_method_low,
-                                   int consensus_method_high)
+/** As dirvote_format_microdesc_vote_line(), but for the microdescriptor with
+ * SHA256 digest <b>digest</b>. */
+static ssize_t
+format_microdesc_vote_line_by_digest(char *out_buf, size_t out_buf_len,
+                                     const char *digest,
+                                     int consensus_method_low,
+                                     int consensus_method_high)
 {
   ssize_t ret = -1;
   char d64[BASE64_DIGEST256_LEN+1];
@@ -3845,7 +4053,7 @@ dirvote_format_microdesc_vote_line(char *out_buf, size_t out_buf_len,
                                ",");
   tor_assert(microdesc_consensus_methods);
 
-  if (digest256_to_base64(d64, md->digest)<0)
+  if (digest256_to_base64(d64, digest)<0)
     goto out;
 
   if (tor_snprintf(out_buf, out_buf_len, "m %s sha256=%s\n",
@@ -3859,6 +4067,22 @@ dirvote_format_microdesc_vote_line(char *out_buf, size_t out_buf_len,
   return ret;
 }
 
+/** Format the appropriate vote line to describe the microdescriptor <b>md</b>
+ * in a consensus vote document.  Write it into the <b>out_len</b>-byte buffer
+ * in <b>out</b>.  Return -1 on failure and the number of characters written
+ * on success. */
+ssize_t
+dirvote_format_microdesc_vote_line(char *out_buf, size_t out_buf_len,
+                                   const microdesc_t *md,
+                                   int consensus_method_low,
+                                   int consensus_method_high)
+{
+  return format_microdesc_vote_line_by_digest(out_buf, out_buf_len,
+                                              md->digest,
+                                              consensus_method_low,
+                                              consensus_method_high);
+}
+
 /** Array of start and end of consensus methods used for supported
     microdescriptor formats. */
 static const struct consensus_method_range_t {
@@ -3879,10 +4103,118 @@ static const struct consensus_method_range_t {
 typedef struct microdesc_vote_line_t {
   int low;
   int high;
+  /** The microdescriptor we generated, or NULL if we already had it in our
+   * microdescriptor cache. */
   microdesc_t *md;
+  /** The SHA256 digest of the microdescriptor. */
+  char digest[DIGEST256_LEN];
   struct microdesc_vote_line_t *next;
 } microdesc_vote_line_t;
 
+/** Map from a router descriptor digest and the low end of a range in
+ * microdesc_consensus_methods (as built by microdesc_creation_cache_key())
+ * to the microdesc_creation_cache_ent_t for the microdescriptor we made
+ * from that descriptor for those methods.  Most relays don't change their
+ * descriptors between votes, so this lets us skip rebuilding and reparsing
+ * the same microdescriptors every time we vote. */
+static digest256map_t *microdesc_creation_cache = NULL;
+/** When should we next remove stale entries from
+ * microdesc_creation_cache? */
+static time_t microdesc_creation_cache_next_clean = 0;
+/** How long do we remember a microdescriptor we haven't voted for? */
+#define MICRODESC_CREATION_CACHE_MAX_AGE (6*60*60)
+
+/** An entry in microdesc_creation_cache. */
+typedef struct microdesc_creation_cache_ent_t {
+  /** The SHA256 digest of the microdescriptor. */
+  char digest[DIGEST256_LEN];
+  /** When did we last vote for this microdescriptor? */
+  time_t last_used;
+} microdesc_creation_cache_ent_t;
+
+/** Release all storage held in microdesc_creation_cache. */
+static void
+microdesc_creation_cache_free_all(void)
+{
+  digest256map_free(microdesc_creation_cache, tor_free_);
+  microdesc_creation_cache = NULL;
+  microdesc_creation_cache_next_clean = 0;
+}
+
+/** Set <b>key_out</b> to the microdesc_creation_cache key for the
+ * microdescriptor made from <b>ri</b> with <b>consensus_method</b>. */
+static void
+microdesc_creation_cache_key(char *key_out, const routerinfo_t *ri,
+                             int consensus_method)
+{
+  memset(key_out, 0, DIGEST256_LEN);
+  memcpy(key_out, ri->cache_info.signed_descriptor_digest, DIGEST_LEN);
+  set_uint32(key_out + DIGEST_LEN, htonl((uint32_t)consensus_method));
+}
+
+/** If we've already made the microdescriptor for <b>ri</b> with
+ * <b>consensus_method</b>, and it's still in our microdescriptor cache,
+ * note that we're voting for it at <b>now</b>, copy its digest into
+ * <b>digest_out</b>, and return 1.  Otherwise return 0. */
+static int
+microdesc_creation_cache_lookup(char *digest_out, const routerinfo_t *ri,
+                                int consensus_method, time_t now)
+{
+  char key[DIGEST256_LEN];
+  microdesc_creation_cache_ent_t *ent;
+  microdesc_t *md;
+
+  if (!microdesc_creation_cache)
+    return 0;
+  microdesc_creation_cache_key(key, ri, consensus_method);
+  ent = digest256map_get(microdesc_creation_cache, (const uint8_t *)key);
+  if (!ent)
+    return 0;
+  md = microdesc_cache_lookup_by_digest256(NULL, ent->digest);
+  if (!md)
+    return 0;
+
+  ent->last_used = now;
+  if (md->last_listed < now)
+    md->last_listed = now;
+  memcpy(digest_out, ent->digest, DIGEST256_LEN);
+  return 1;
+}
+
+/** Remember that the microdescriptor we made from <b>ri</b> with
+ * <b>consensus_method</b> has the digest <b>digest</b>. */
+static void
+microdesc_creation_cache_add(const routerinfo_t *ri, int consensus_method,
+                             const char *digest, time_t now)
+{
+  char key[DIGEST256_LEN];
+  microdesc_creation_cache_ent_t *ent;
+
+  if (!microdesc_creation_cache)
+    microdesc_creation_cache = digest256map_new();
+  if (now >= microdesc_creation_cache_next_clean) {
+    time_t cutoff = now - MICRODESC_CREATION_CACHE_MAX_AGE;
+    DIGEST256MAP_FOREACH_MODIFY(microdesc_creation_cache, k,
+                                microdesc_creation_cache_ent_t *, e) {
+      if (e->last_used < cutoff) {
+        tor_free(e);
+        MAP_DEL_CURRENT(k);
+      }
+    } DIGEST256MAP_FOREACH_END;
+    microdesc_creation_cache_next_clean = now +
+      MICRODESC_CREATION_CACHE_MAX_AGE;
+  }
+
+  microdesc_creation_cache_key(key, ri, consensus_method);
+  ent = digest256map_get(microdesc_creation_cache, (const uint8_t *)key);
+  if (!ent) {
+    ent = tor_malloc_zero(sizeof(microdesc_creation_cache_ent_t));
+    digest256map_set(microdesc_creation_cache, (const uint8_t *)key, ent);
+  }
+  memcpy(ent->digest, digest, DIGEST256_LEN);
+  ent->last_used = now;
+}
+
 /** Generate and return a linked list of all the lines that should appear to
  * describe a router's microdescriptor versions in a directory vote.
  * Add the generated microdescriptors to <b>microdescriptors_out</b>. */
@@ -3894,15 +4226,25 @@ dirvote_format_all_microdesc_vote_lines(const routerinfo_t *ri, time_t now,
   microdesc_vote_line_t *entries = NULL, *ep;
   vote_microdesc_hash_t *result = NULL;
 
-  /* Generate the microdescriptors. */
+  /* Generate the microdescriptors, unless we already made them for an
+   * earlier vote. */
   for (cmr = microdesc_consensus_methods;
        cmr->low != -1 && cmr->high != -1;
        cmr++) {
-    microdesc_t *md = dirvote_create_microdescriptor(ri, cmr->low);
-    if (md) {
+    char digest[DIGEST256_LEN];
+    microdesc_t *md = NULL;
+    if (!microdesc_creation_cache_lookup(digest, ri, cmr->low, now)) {
+      md = dirvote_create_microdescriptor(ri, cmr->low);
+      if (!md)
+        continue;
+      memcpy(digest, md->digest, DIGEST256_LEN);
+      microdesc_creation_cache_add(ri, cmr->low, digest, now);
+    }
+    {
       microdesc_vote_line_t *e =
         tor_malloc_zero(sizeof(microdesc_vote_line_t));
       e->md = md;
+      memcpy(e->digest, digest, DIGEST256_LEN);
       e->low = cmr->low;
       e->high = cmr->high;
       e->next = entries;
@@ -3913,7 +4255,7 @@ dirvote_format_all_microdesc_vote_lines(const routerinfo_t *ri, time_t now,
   /* Compress adjacent identical ones */
   for (ep = entries; ep; ep = ep->next) {
     while (ep->next &&
-           fast_memeq(ep->md->digest, ep->next->md->digest, DIGEST256_LEN) &&
+           fast_memeq(ep->digest, ep->next->digest, DIGEST256_LEN) &&
            ep->low == ep->next->high + 1) {
       microdesc_vote_line_t *next = ep->next;
       ep->low = next->low;
@@ -3927,14 +4269,16 @@ dirvote_format_all_microdesc_vote_lines(const routerinfo_t *ri, time_t now,
   while ((ep = entries)) {
     char buf[128];
     vote_microdesc_hash_t *h;
-    dirvote_format_microdesc_vote_line(buf, sizeof(buf), ep->md,
-                                       ep->low, ep->high);
+    format_microdesc_vote_line_by_digest(buf, sizeof(buf), ep->digest,
+                                         ep->low, ep->high);
     h = tor_malloc_zero(sizeof(vote_microdesc_hash_t));
     h->microdesc_hash_line = tor_strdup(buf);
     h->next = result;
     result = h;
-    ep->md->last_listed = now;
-    smartlist_add(microdescriptors_out, ep->md);
+    if (ep->md) {
+      ep->md->last_listed = now;
+      smartlist_add(microdescriptors_out, ep->md);
+    }
     entries = ep->next;
     tor_free(ep);
   }
@@ -234,6 +234,50 @@ STATIC smartlist_t *dirvote_compute_params(smartlist_t *votes, int method,
                              int total_authorities);
 STATIC char *compute_consensus_package_lines(smartlist_t *votes);
 STATIC char *make_consensus_method_list(int low, int high, const char *sep);
+
+/** Shared state for a set of consensus_job_t that the main thread is
+ * waiting on. */
+typedef struct consensus_job_batch_t {
+  tor_mutex_t lock; /**< Protects n_pending. */
+  tor_cond_t cond; /**< Signalled whenever n_pending drops. */
+  int n_pending; /**< How many jobs haven't finished yet? */
+} consensus_job_batch_t;
+
+/** One consensus flavor to be computed by consensus_job_threadfn(),
+ * possibly on a cpuworker thread.  Everything but the job itself belongs to
+ * the main thread once the job is done; a job that went to a cpuworker is
+ * freed by consensus_job_replyfn(). */
+typedef struct consensus_job_t {
+  consensus_job_batch_t *batch; /**< The batch to report to when done, or
+                                 * NULL if we ran on the main thread. */
+  /** Our own copy of the list of votes: computing a consensus sorts it. */
+  smartlist_t *votes;
+  int total_authorities;
+  crypto_pk_t *identity_key;
+  crypto_pk_t *signing_key;
+  const char *legacy_id_key_digest;
+  crypto_pk_t *legacy_signing_key;
+  consensus_flavor_t flavor;
+  /** The votes, already collated; shared with the other jobs. */
+  struct dircollator_s *collator;
+  char *body; /**< The consensus we computed, or NULL on failure. */
+} consensus_job_t;
+
+STATIC char *networkstatus_compute_consensus_collated(smartlist_t *votes,
+                                  int total_authorities,
+                                  crypto_pk_t *identity_key,
+                                  crypto_pk_t *signing_key,
+                                  const char *legacy_id_key_digest,
+                                  crypto_pk_t *legacy_signing_key,
+                                  consensus_flavor_t flavor,
+                                  struct dircollator_s *shared_collator);
+STATIC void dirvote_compute_consensus_bodies(smartlist_t *votes,
+                                             int total_authorities,
+                                             crypto_pk_t *identity_key,
+                                             crypto_pk_t *signing_key,
+                                             const char *legacy_id_key_digest,
+                                             crypto_pk_t *legacy_signing_key,
+                                             char **bodies_out);
 #endif
 
 #endif
@@ -70,6 +70,14 @@
  * that the resolver is wedged? */
 #define RESOLVE_MAX_TIMEOUT 300
 
+/** How many successful answers will we keep in our cache at once?  When we
+ * have more, we forget the least recently used ones. */
+#define DNS_CACHE_MAX_POSITIVE_ENTRIES 65536
+/** How many failed answers will we keep in our cache at once?  These are
+ * kept apart from the successful ones, so that a flood of lookups for
+ * names that don't exist can't push out the answers we use. */
+#define DNS_CACHE_MAX_NEGATIVE_ENTRIES 16384
+
 /** Our evdns_base; this structure handles all our name lookups. */
 static struct evdns_base *the_evdns_base = NULL;
 
@@ -95,6 +103,7 @@ static int configure_nameservers(int force);
 static int answer_is_wildcarded(const char *ip);
 static int evdns_err_is_transient(int err);
 static void inform_pending_connections(cached_resolve_t *resolve);
+static void inform_pending_connections_early(cached_resolve_t *resolve);
 static void make_pending_resolve_cached(cached_resolve_t *cached);
 
 #ifdef DEBUG_DNS_CACHE
@@ -378,6 +387,170 @@ set_expiry(cached_resolve_t *resolve, time_t expires)
                        resolve);
 }
 
+/** Type of a least-recently-used list of cached answers. */
+TOR_TAILQ_HEAD(cached_resolve_lru_t, cached_resolve_t);
+
+/** Cached answers for which at least one lookup succeeded, least recently
+ * used first. */
+static struct cached_resolve_lru_t positive_lru =
+  TOR_TAILQ_HEAD_INITIALIZER(positive_lru);
+/** Cached answers for which every lookup failed, least recently used
+ * first. */
+static struct cached_resolve_lru_t negative_lru =
+  TOR_TAILQ_HEAD_INITIALIZER(negative_lru);
+/** Number of entries on positive_lru. */
+static int n_positive_cached = 0;
+/** Number of entries on negative_lru. */
+static int n_negative_cached = 0;
+/** Total bytes held by the entries on positive_lru and negative_lru. */
+static size_t dns_cache_allocation = 0;
+
+/** How many lookups have we answered from the cache, or by waiting on a
+ * pending resolve? */
+static uint64_t n_cache_hits = 0;
+/** How many of n_cache_hits were answered with a failed lookup? */
+static uint64_t n_cache_negative_hits = 0;
+/** How many lookups have we had to launch a resolve for? */
+static uint64_t n_cache_misses = 0;
+/** How many cached answers have we forgotten before they expired? */
+static uint64_t n_cache_evictions = 0;
+
+/** Return the number of bytes used by the cached answer <b>resolve</b>. */
+static size_t
+cached_resolve_allocation(const cached_resolve_t *resolve)
+{
+  size_t n = sizeof(cached_resolve_t);
+  if (resolve->res_status_hostname == RES_STATUS_DONE_OK)
+    n += strlen(resolve->result_ptr.hostname) + 1;
+  return n;
+}
+
+/** Add the cached answer <b>resolve</b> to the end of the appropriate LRU
+ * list. */
+static void
+cached_resolve_lru_add(cached_resolve_t *resolve)
+{
+  tor_assert(resolve->state == CACHE_STATE_CACHED);
+  tor_assert(!resolve->on_lru);
+
+  resolve->is_negative = resolve->res_status_ipv4 != RES_STATUS_DONE_OK &&
+    resolve->res_status_ipv6 != RES_STATUS_DONE_OK &&
+    resolve->res_status_hostname != RES_STATUS_DONE_OK;
+  if (resolve->is_negative) {
+    TOR_TAILQ_INSERT_TAIL(&negative_lru, resolve, lru_link);
+    ++n_negative_cached;
+  } else {
+    TOR_TAILQ_INSERT_TAIL(&positive_lru, resolve, lru_link);
+    ++n_positive_cached;
+  }
+  resolve->on_lru = 1;
+  dns_cache_allocation += cached_resolve_allocation(resolve);
+}
+
+/** Remove <b>resolve</b> from its LRU list, if it is on one. */
+static void
+cached_resolve_lru_remove(cached_resolve_t *resolve)
+{
+  if (!resolve->on_lru)
+    return;
+
+  if (resolve->is_negative) {
+    TOR_TAILQ_REMOVE(&negative_lru, resolve, lru_link);
+    --n_negative_cached;
+  } else {
+    TOR_TAILQ_REMOVE(&positive_lru, resolve, lru_link);
+    --n_positive_cached;
+  }
+  resolve->on_lru = 0;
+  dns_cache_allocation -= cached_resolve_allocation(resolve);
+}
+
+/** Note that we just used the cached answer <b>resolve</b>. */
+static void
+cached_resolve_lru_touch(cached_resolve_t *resolve)
+{
+  if (!resolve->on_lru)
+    return;
+
+  if (resolve->is_negative) {
+    TOR_TAILQ_REMOVE(&negative_lru, resolve, lru_link);
+    TOR_TAILQ_INSERT_TAIL(&negative_lru, resolve, lru_link);
+  } else {
+    TOR_TAILQ_REMOVE(&positive_lru, resolve, lru_link);
+    TOR_TAILQ_INSERT_TAIL(&positive_lru, resolve, lru_link);
+  }
+}
+
+/** Forget the cached answer <b>resolve</b> before it expires, and return
+ * the number of bytes that freed. */
+static size_t
+evict_cached_resolve(cached_resolve_t *resolve)
+{
+  cached_resolve_t *removed;
+  size_t freed;
+
+  tor_assert(resolve->state == CACHE_STATE_CACHED);
+  tor_assert(!resolve->pending_connections);
+
+  log_debug(LD_EXIT, "Evicting cached resolve (address %s, expires %lu)",
+            escaped_safe_str(resolve->address),
+            (unsigned long)resolve->expire);
+
+  freed = cached_resolve_allocation(resolve);
+  cached_resolve_lru_remove(resolve);
+  removed = HT_REMOVE(cache_map, &cache_root, resolve);
+  tor_assert(removed == resolve);
+  smartlist_pqueue_remove(cached_resolve_pqueue,
+                          compare_cached_resolves_by_expiry_,
+                          STRUCT_OFFSET(cached_resolve_t, minheap_idx),
+                          resolve);
+  free_cached_resolve_(resolve);
+  ++n_cache_evictions;
+  return freed;
+}
+
+/** Forget least recently used cached answers until we're within
+ * DNS_CACHE_MAX_POSITIVE_ENTRIES and DNS_CACHE_MAX_NEGATIVE_ENTRIES. */
+static void
+dns_cache_enforce_limits(void)
+{
+  while (n_negative_cached > DNS_CACHE_MAX_NEGATIVE_ENTRIES)
+    evict_cached_resolve(TOR_TAILQ_FIRST(&negative_lru));
+  while (n_positive_cached > DNS_CACHE_MAX_POSITIVE_ENTRIES)
+    evict_cached_resolve(TOR_TAILQ_FIRST(&positive_lru));
+}
+
+/** Return the number of bytes used by the answers in our DNS cache. */
+size_t
+dns_cache_get_total_allocation(void)
+{
+  return dns_cache_allocation;
+}
+
+/** We're out of memory: remove expired answers from the DNS cache, then
+ * forget least recently used answers, failed ones first, until we've freed
+ * at least <b>min_remove_bytes</b> bytes.  Return the number of bytes
+ * freed. */
+size_t
+dns_cache_handle_oom(time_t now, size_t min_remove_bytes)
+{
+  const size_t start = dns_cache_allocation;
+  size_t removed = 0;
+
+  purge_expired_resolves(now);
+  if (start > dns_cache_allocation)
+    removed = start - dns_cache_allocation;
+
+  while (removed < min_remove_bytes && !TOR_TAILQ_EMPTY(&negative_lru))
+    removed += evict_cached_resolve(TOR_TAILQ_FIRST(&negative_lru));
+  while (removed < min_remove_bytes && !TOR_TAILQ_EMPTY(&positive_lru))
+    removed += evict_cached_resolve(TOR_TAILQ_FIRST(&positive_lru));
+
+  log_notice(LD_EXIT, "We're low on memory. Removed %lu bytes of cached "
+             "DNS answers.", (unsigned long)removed);
+  return removed;
+}
+
 /** Free all storage held in the DNS cache and related structures. */
 void
 dns_free_all(void)
@@ -399,6 +572,10 @@ dns_free_all(void)
   HT_CLEAR(cache_map, &cache_root);
   smartlist_free(cached_resolve_pqueue);
   cached_resolve_pqueue = NULL;
+  TOR_TAILQ_INIT(&positive_lru);
+  TOR_TAILQ_INIT(&negative_lru);
+  n_positive_cached = n_negative_cached = 0;
+  dns_cache_allocation = 0;
   tor_free(resolv_conf_fname);
 }
 
@@ -434,6 +611,7 @@ purge_expired_resolves(time_t now)
                 escaped_safe_str(resolve->address),
                 (unsigned long)resolve->expire);
       tor_assert(!resolve->pending_connections);
+      cached_resolve_lru_remove(resolve);
     } else {
       tor_assert(resolve->state == CACHE_STATE_DONE);
       tor_assert(!resolve->pending_connections);
@@ -775,19 +953,25 @@ dns_resolve_impl,(edge_connection_t *exitconn, int is_resolve,
   strlcpy(search.address, exitconn->base_.address, sizeof(search.address));
   resolve = HT_FIND(cache_map, &cache_root, &search);
   if (resolve && resolve->expire > now) { /* already there */
+    ++n_cache_hits;
     switch (resolve->state) {
-      case CACHE_STATE_PENDING:
-        /* add us to the pending list */
+      case CACHE_STATE_PENDING: {
+        /* add us to the end of the pending list, so that when a client
+         * opens a burst of streams to one name, we connect them in the
+         * order they were asked for. */
+        pending_connection_t **tailp = &resolve->pending_connections;
+        while (*tailp)
+          tailp = &(*tailp)->next;
         pending_connection = tor_malloc_zero(
                                       sizeof(pending_connection_t));
         pending_connection->conn = exitconn;
-        pending_connection->next = resolve->pending_connections;
-        resolve->pending_connections = pending_connection;
+        *tailp = pending_connection;
         *made_connection_pending_out = 1;
         log_debug(LD_EXIT,"Connection (fd "TOR_SOCKET_T_FORMAT") waiting "
                   "for pending DNS resolve of %s", exitconn->base_.s,
                   escaped_safe_str(exitconn->base_.address));
         return 0;
+      }
       case CACHE_STATE_CACHED:
         log_debug(LD_EXIT,"Connection (fd "TOR_SOCKET_T_FORMAT") found "
                   "cached answer for %s",
@@ -795,6 +979,9 @@ dns_resolve_impl,(edge_connection_t *exitconn, int is_resolve,
                   escaped_safe_str(resolve->address));
 
         *resolve_out = resolve;
+        cached_resolve_lru_touch(resolve);
+        if (resolve->is_negative)
+          ++n_cache_negative_hits;
 
         return set_exitconn_info_from_resolve(exitconn, resolve, hostname_out);
       case CACHE_STATE_DONE:
@@ -805,6 +992,7 @@ dns_resolve_impl,(edge_connection_t *exitconn, int is_resolve,
   }
   tor_assert(!resolve);
   /* not there, need to add it */
+  ++n_cache_misses;
   resolve = tor_malloc_zero(sizeof(cached_resolve_t));
   resolve->magic = CACHED_RESOLVE_MAGIC;
   resolve->state = CACHE_STATE_PENDING;
@@ -1174,92 +1362,175 @@ dns_found_answer(const char *address, uint8_t query_type,
     inform_pending_connections(resolve);
 
     make_pending_resolve_cached(resolve);
+  } else if (dns_answer == DNS_ERR_NONE) {
+    inform_pending_connections_early(resolve);
   }
 }
 
-/** Given a pending cached_resolve_t that we just finished resolving,
- * inform every connection that was waiting for the outcome of that
- * resolution.
+/** Tell <b>pendconn</b>, which was waiting for the outcome of the pending
+ * cached_resolve_t <b>resolve</b>, about that outcome.
  *
  * Do this by sending a RELAY_RESOLVED cell (if the pending stream had sent us
  * RELAY_RESOLVE cell), or by launching an exit connection (if the pending
- * stream had send us a RELAY_BEGIN cell).
+ * stream had send us a RELAY_BEGIN cell).  The caller must remove
+ * <b>pendconn</b> from <b>resolve</b>'s pending connections.
  */
 static void
-inform_pending_connections(cached_resolve_t *resolve)
+inform_pending_connection(cached_resolve_t *resolve,
+                          edge_connection_t *pendconn)
 {
-  pending_connection_t *pend;
-  edge_connection_t *pendconn;
+  char *hostname = NULL;
   int r;
 
-  while (resolve->pending_connections) {
-    char *hostname = NULL;
-    pend = resolve->pending_connections;
-    pendconn = pend->conn; /* don't pass complex things to the
-                              connection_mark_for_close macro */
-    assert_connection_ok(TO_CONN(pendconn),time(NULL));
+  assert_connection_ok(TO_CONN(pendconn),time(NULL));
 
-    if (pendconn->base_.marked_for_close) {
-      /* prevent double-remove. */
-      pendconn->base_.state = EXIT_CONN_STATE_RESOLVEFAILED;
-      resolve->pending_connections = pend->next;
-      tor_free(pend);
-      continue;
-    }
+  if (pendconn->base_.marked_for_close) {
+    /* prevent double-remove. */
+    pendconn->base_.state = EXIT_CONN_STATE_RESOLVEFAILED;
+    return;
+  }
 
-    r = set_exitconn_info_from_resolve(pendconn,
-                                       resolve,
-                                       &hostname);
+  r = set_exitconn_info_from_resolve(pendconn,
+                                     resolve,
+                                     &hostname);
 
-    if (r < 0) {
+  if (r < 0) {
+    /* prevent double-remove. */
+    pendconn->base_.state = EXIT_CONN_STATE_RESOLVEFAILED;
+    if (pendconn->base_.purpose == EXIT_PURPOSE_CONNECT) {
+      connection_edge_end(pendconn, END_STREAM_REASON_RESOLVEFAILED);
+      /* This detach must happen after we send the end cell. */
+      circuit_detach_stream(circuit_get_by_edge_conn(pendconn), pendconn);
+    } else {
+      send_resolved_cell(pendconn, r == -1 ?
+                       RESOLVED_TYPE_ERROR : RESOLVED_TYPE_ERROR_TRANSIENT,
+                       NULL);
+      /* This detach must happen after we send the resolved cell. */
+      circuit_detach_stream(circuit_get_by_edge_conn(pendconn), pendconn);
+    }
+    connection_free(TO_CONN(pendconn));
+  } else {
+    circuit_t *circ;
+    if (pendconn->base_.purpose == EXIT_PURPOSE_CONNECT) {
       /* prevent double-remove. */
+      pendconn->base_.state = EXIT_CONN_STATE_CONNECTING;
+
+      circ = circuit_get_by_edge_conn(pendconn);
+      tor_assert(circ);
+      tor_assert(!CIRCUIT_IS_ORIGIN(circ));
+      /* unlink pendconn from resolving_streams, */
+      circuit_detach_stream(circ, pendconn);
+      /* and link it to n_streams */
+      pendconn->next_stream = TO_OR_CIRCUIT(circ)->n_streams;
+      pendconn->on_circuit = circ;
+      TO_OR_CIRCUIT(circ)->n_streams = pendconn;
+
+      connection_exit_connect(pendconn);
+    } else {
+      /* prevent double-remove.  This isn't really an accurate state,
+       * but it does the right thing. */
       pendconn->base_.state = EXIT_CONN_STATE_RESOLVEFAILED;
-      if (pendconn->base_.purpose == EXIT_PURPOSE_CONNECT) {
-        connection_edge_end(pendconn, END_STREAM_REASON_RESOLVEFAILED);
-        /* This detach must happen after we send the end cell. */
-        circuit_detach_stream(circuit_get_by_edge_conn(pendconn), pendconn);
-      } else {
-        send_resolved_cell(pendconn, r == -1 ?
-                         RESOLVED_TYPE_ERROR : RESOLVED_TYPE_ERROR_TRANSIENT,
-                         NULL);
-        /* This detach must happen after we send the resolved cell. */
-        circuit_detach_stream(circuit_get_by_edge_conn(pendconn), pendconn);
-      }
+      if (pendconn->is_reverse_dns_lookup)
+        send_resolved_hostname_cell(pendconn, hostname);
+      else
+        send_resolved_cell(pendconn, RESOLVED_TYPE_AUTO, resolve);
+      circ = circuit_get_by_edge_conn(pendconn);
+      tor_assert(circ);
+      circuit_detach_stream(circ, pendconn);
       connection_free(TO_CONN(pendconn));
-    } else {
-      circuit_t *circ;
-      if (pendconn->base_.purpose == EXIT_PURPOSE_CONNECT) {
-        /* prevent double-remove. */
-        pend->conn->base_.state = EXIT_CONN_STATE_CONNECTING;
-
-        circ = circuit_get_by_edge_conn(pend->conn);
-        tor_assert(circ);
-        tor_assert(!CIRCUIT_IS_ORIGIN(circ));
-        /* unlink pend->conn from resolving_streams, */
-        circuit_detach_stream(circ, pend->conn);
-        /* and link it to n_streams */
-        pend->conn->next_stream = TO_OR_CIRCUIT(circ)->n_streams;
-        pend->conn->on_circuit = circ;
-        TO_OR_CIRCUIT(circ)->n_streams = pend->conn;
-
-        connection_exit_connect(pend->conn);
-      } else {
-        /* prevent double-remove.  This isn't really an accurate state,
-         * but it does the right thing. */
-        pendconn->base_.state = EXIT_CONN_STATE_RESOLVEFAILED;
-        if (pendconn->is_reverse_dns_lookup)
-          send_resolved_hostname_cell(pendconn, hostname);
-        else
-          send_resolved_cell(pendconn, RESOLVED_TYPE_AUTO, resolve);
-        circ = circuit_get_by_edge_conn(pendconn);
-        tor_assert(circ);
-        circuit_detach_stream(circ, pendconn);
-        connection_free(TO_CONN(pendconn));
-      }
     }
+  }
+  tor_free(hostname);
+}
+
+/** Given a pending cached_resolve_t that we just finished resolving,
+ * inform every connection that was waiting for the outcome of that
+ * resolution.
+ */
+static void
+inform_pending_connections(cached_resolve_t *resolve)
+{
+  pending_connection_t *pend;
+
+  while (resolve->pending_connections) {
+    pend = resolve->pending_connections;
+    inform_pending_connection(resolve, pend->conn);
     resolve->pending_connections = pend->next;
     tor_free(pend);
-    tor_free(hostname);
+  }
+}
+
+/** Return true iff the pending connection <b>conn</b> would be given the
+ * same address from <b>resolve</b> whatever the outcome of its lookups
+ * that are still in flight, so that we can let it go ahead now.
+ *
+ * Only BEGIN cells can go early: a RESOLVE wants every answer.  A BEGIN can
+ * go once we have a successful answer for the address family it would pick
+ * even if the other lookup succeeded too; see
+ * set_exitconn_info_from_resolve().
+ */
+STATIC int
+pending_connection_can_use_partial_answer(const cached_resolve_t *resolve,
+                                          const edge_connection_t *conn)
+{
+  const uint32_t flags = conn->begincell_flags;
+  const int ipv6_usable = (flags & BEGIN_FLAG_IPV6_OK) &&
+    get_options()->IPv6Exit;
+
+  if (conn->base_.purpose != EXIT_PURPOSE_CONNECT ||
+      conn->is_reverse_dns_lookup)
+    return 0;
+
+  if (resolve->res_status_ipv4 == RES_STATUS_DONE_OK &&
+      resolve->res_status_ipv6 == RES_STATUS_INFLIGHT &&
+      !(flags & BEGIN_FLAG_IPV4_NOT_OK)) {
+    tor_addr_t a4;
+    /* An IPv6 answer could only win if the client prefers it, or if our
+     * exit policy rejects the IPv4 answer. */
+    if (!ipv6_usable)
+      return 1;
+    tor_addr_from_ipv4h(&a4, resolve->result_ipv4.addr_ipv4);
+    return !(flags & BEGIN_FLAG_IPV6_PREFERRED) &&
+      !router_compare_to_my_exit_policy(&a4, conn->base_.port);
+  }
+
+  if (resolve->res_status_ipv6 == RES_STATUS_DONE_OK &&
+      resolve->res_status_ipv4 == RES_STATUS_INFLIGHT && ipv6_usable) {
+    tor_addr_t a6;
+    /* An IPv4 answer could only win if the client accepts it and prefers
+     * it, or if our exit policy rejects the IPv6 answer. */
+    if (flags & BEGIN_FLAG_IPV4_NOT_OK)
+      return 1;
+    tor_addr_from_in6(&a6, &resolve->result_ipv6.addr_ipv6);
+    return (flags & BEGIN_FLAG_IPV6_PREFERRED) &&
+      !router_compare_to_my_exit_policy(&a6, conn->base_.port);
+  }
+
+  return 0;
+}
+
+/** We just got one of the answers for the pending cached_resolve_t
+ * <b>resolve</b>, but others are still in flight.  Let every connection
+ * that doesn't need those other answers go ahead, rather than making it
+ * wait for the slowest of the lookups.
+ */
+static void
+inform_pending_connections_early(cached_resolve_t *resolve)
+{
+  pending_connection_t **pendp = &resolve->pending_connections;
+
+  while (*pendp) {
+    pending_connection_t *pend = *pendp;
+    if (pend->conn->base_.marked_for_close ||
+        !pending_connection_can_use_partial_answer(resolve, pend->conn)) {
+      pendp = &pend->next;
+      continue;
+    }
+    log_debug(LD_EXIT, "Answering a stream for %s before all our lookups "
+              "are done.", escaped_safe_str(resolve->address));
+    inform_pending_connection(resolve, pend->conn);
+    *pendp = pend->next;
+    tor_free(pend);
   }
 }
 
@@ -1298,6 +1569,7 @@ make_pending_resolve_cached(cached_resolve_t *resolve)
         tor_strdup(resolve->result_ptr.hostname);
 
     new_resolve->state = CACHE_STATE_CACHED;
+    new_resolve->on_lru = 0;
 
     assert_resolve_ok(new_resolve);
     HT_INSERT(cache_map, &cache_root, new_resolve);
@@ -1318,6 +1590,8 @@ make_pending_resolve_cached(cached_resolve_t *resolve)
       ttl = resolve->ttl_hostname;
 
     set_expiry(new_resolve, time(NULL) + dns_get_expiry_ttl(ttl));
+    cached_resolve_lru_add(new_resolve);
+    dns_cache_enforce_limits();
   }
 
   assert_cache_ok();
@@ -1482,6 +1756,7 @@ evdns_callback(int result, char type, int count, int ttl, void *addresses,
   const char *hostname = NULL;
   int was_wildcarded = 0;
 
+  monotime_coarse_cache_clear();
   tor_addr_make_unspec(&addr);
 
   /* Keep track of whether IPv6 is working */
@@ -2055,6 +2330,14 @@ dump_dns_mem_usage(int severity)
   tor_log(severity, LD_MM, "Our DNS cache has %d entries.", hash_count);
   tor_log(severity, LD_MM, "Our DNS cache size is approximately %u bytes.",
       (unsigned)hash_mem);
+  tor_log(severity, LD_MM, "Our DNS cache holds %d successful and %d failed "
+          "answers, using %lu bytes.", n_positive_cached, n_negative_cached,
+          (unsigned long)dns_cache_allocation);
+  tor_log(severity, LD_MM, "Our DNS cache has had "U64_FORMAT" hits ("
+          U64_FORMAT" of them failed answers), "U64_FORMAT" misses, and "
+          U64_FORMAT" evictions.",
+          U64_PRINTF_ARG(n_cache_hits), U64_PRINTF_ARG(n_cache_negative_hits),
+          U64_PRINTF_ARG(n_cache_misses), U64_PRINTF_ARG(n_cache_evictions));
 }
 
 #ifdef DEBUG_DNS_CACHE
@@ -2104,5 +2387,11 @@ void
 dns_insert_cache_entry(cached_resolve_t *new_entry)
 {
   HT_INSERT(cache_map, &cache_root, new_entry);
+  if (new_entry->state == CACHE_STATE_CACHED) {
+    time_t expires = new_entry->expire;
+    new_entry->expire = 0;
+    set_expiry(new_entry, expires);
+    cached_resolve_lru_add(new_entry);
+  }
 }
 
@@ -27,6 +27,8 @@ int dns_seems_to_be_broken(void);
 int dns_seems_to_be_broken_for_ipv6(void);
 void dns_reset_correctness_checks(void);
 void dump_dns_mem_usage(int severity);
+size_t dns_cache_get_total_allocation(void);
+size_t dns_cache_handle_oom(time_t now, size_t min_remove_bytes);
 
 #ifdef DNS_PRIVATE
 #include "dns_structs.h"
@@ -54,6 +56,10 @@ set_exitconn_info_from_resolve,(edge_connection_t *exitconn,
 MOCK_DECL(STATIC int,
 launch_resolve,(cached_resolve_t *resolve));
 
+STATIC int pending_connection_can_use_partial_answer(
+                                         const cached_resolve_t *resolve,
+                                         const edge_connection_t *conn);
+
 #endif
 
 #endif
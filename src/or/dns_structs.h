@@ -96,6 +96,14 @@ typedef struct cached_resolve_t {
   pending_connection_t *pending_connections;
   /** Position of this element in the heap*/
   int minheap_idx;
+  /** Links for the LRU list of cached answers that this resolve is on.  Only
+   * used in state CACHED. */
+  TOR_TAILQ_ENTRY(cached_resolve_t) lru_link;
+  /** True iff this resolve is on one of the LRU lists of cached answers. */
+  unsigned int on_lru : 1;
+  /** True iff none of the lookups for this resolve succeeded, so that it's
+   * on the LRU list of negative answers. */
+  unsigned int is_negative : 1;
 } cached_resolve_t;
 
 #endif
@@ -0,0 +1,218 @@
+/* Copyright (c) 2016, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file dos.c
+ * \brief Per-address limits on OR connections and CREATE cells.
+ *
+ * A handful of addresses that open many connections, or send CREATE cells
+ * as fast as they can, can keep a relay busy with TLS handshakes and onion
+ * skins.  When DoSConnectionMaxConcurrentCount or DoSCircuitCreationRate
+ * is set, we keep some state for each address that connects to us, and
+ * refuse connections and CREATE cells from addresses over their limits
+ * before we spend any crypto on them.
+ *
+ * The state lives in a fixed-size, set-associative table, so memory use
+ * doesn't depend on how many addresses there are.  When a set is full, we
+ * evict the entry that was idle for longest, preferring ones with no open
+ * connections.  An evicted address starts over with a full bucket, and
+ * forgets its open connections; that's the price of bounded memory.
+ **/
+
+#define DOS_PRIVATE
+#include "or.h"
+#include "channel.h"
+#include "config.h"
+#include "dos.h"
+
+/** The table of addresses; NULL while every limit is off. */
+static dos_addr_entry_t *dos_table = NULL;
+
+/** Largest number of open OR connections we accept from one address, or 0
+ * for no limit. */
+static uint32_t dos_max_conns = 0;
+/** How many CREATE cells per second an address may send on average, or 0
+ * for no limit. */
+static uint32_t dos_create_rate = 0;
+/** How many CREATE cells an address may send in a burst. */
+static uint32_t dos_create_burst = 0;
+
+/** How many connections and CREATE cells have we refused? */
+static uint64_t dos_n_conns_refused = 0;
+static uint64_t dos_n_creates_refused = 0;
+
+/** Configure our limits from <b>options</b>, allocating or freeing the
+ * address table as needed. */
+void
+dos_set_options(const or_options_t *options)
+{
+  dos_max_conns = options->DoSConnectionMaxConcurrentCount;
+  dos_create_rate = options->DoSCircuitCreationRate;
+  dos_create_burst = options->DoSCircuitCreationBurst;
+  if (dos_create_burst < dos_create_rate)
+    dos_create_burst = dos_create_rate;
+
+  if (dos_enabled()) {
+    if (!dos_table)
+      dos_table = tor_calloc(DOS_TABLE_SIZE, sizeof(dos_addr_entry_t));
+  } else {
+    tor_free(dos_table);
+  }
+}
+
+/** Return true iff we are enforcing any per-address limit. */
+int
+dos_enabled(void)
+{
+  return dos_max_conns || dos_create_rate;
+}
+
+/** Return true iff we would rather reuse the slot <b>a</b> than <b>b</b>
+ * for a new address: empty slots first, then the ones with no open
+ * connections, then the ones idle for longest. */
+static int
+dos_entry_is_better_victim(const dos_addr_entry_t *a,
+                           const dos_addr_entry_t *b)
+{
+  if (!a->in_use || !b->in_use)
+    return !a->in_use && b->in_use;
+  if ((a->n_conns == 0) != (b->n_conns == 0))
+    return a->n_conns == 0;
+  return a->last_seen < b->last_seen;
+}
+
+/** Return the entry for <b>addr</b>, or NULL if there is none.  If
+ * <b>create</b> is true and there is none, make one, evicting another
+ * address if we must.  Return NULL if we can't track <b>addr</b>. */
+STATIC dos_addr_entry_t *
+dos_addr_lookup(const tor_addr_t *addr, int create, time_t now)
+{
+  uint8_t key[16];
+  dos_addr_entry_t *set, *victim = NULL;
+  unsigned i;
+
+  if (!dos_table)
+    return NULL;
+
+  if (tor_addr_family(addr) == AF_INET) {
+    memset(key, 0, 10);
+    key[10] = key[11] = 0xff;
+    set_uint32(key + 12, tor_addr_to_ipv4n(addr));
+  } else if (tor_addr_family(addr) == AF_INET6) {
+    memcpy(key, tor_addr_to_in6_addr8(addr), 16);
+  } else {
+    return NULL;
+  }
+
+  set = dos_table + DOS_TABLE_WAYS *
+    (tor_addr_hash(addr) % (DOS_TABLE_SIZE / DOS_TABLE_WAYS));
+  for (i = 0; i < DOS_TABLE_WAYS; ++i) {
+    dos_addr_entry_t *ent = &set[i];
+    if (ent->in_use && fast_memeq(ent->addr, key, 16)) {
+      ent->last_seen = (uint32_t)now;
+      return ent;
+    }
+    if (!victim || dos_entry_is_better_victim(ent, victim))
+      victim = ent;
+  }
+
+  if (!create)
+    return NULL;
+
+  memset(victim, 0, sizeof(*victim));
+  memcpy(victim->addr, key, 16);
+  victim->in_use = 1;
+  victim->last_seen = (uint32_t)now;
+  victim->create_refilled_at = (uint32_t)now;
+  victim->create_tokens = dos_create_burst;
+  return victim;
+}
+
+/** Called when a new OR connection arrives from <b>addr</b>.  Return -1 if
+ * it would take <b>addr</b> over its connection limit and we should refuse
+ * it.  Otherwise, count it, and return 0 if we should call
+ * dos_conn_note_closed() when it closes, or 1 if we aren't counting. */
+int
+dos_conn_note_new(const tor_addr_t *addr)
+{
+  dos_addr_entry_t *ent;
+
+  if (!dos_max_conns)
+    return 1;
+  ent = dos_addr_lookup(addr, 1, approx_time());
+  if (!ent)
+    return 1;
+
+  if (ent->n_conns >= dos_max_conns) {
+    ++dos_n_conns_refused;
+    return -1;
+  }
+  if (ent->n_conns < UINT16_MAX)
+    ++ent->n_conns;
+  return 0;
+}
+
+/** Called when an OR connection from <b>addr</b> that
+ * dos_conn_note_new() counted is closed. */
+void
+dos_conn_note_closed(const tor_addr_t *addr)
+{
+  dos_addr_entry_t *ent = dos_addr_lookup(addr, 0, approx_time());
+  if (ent && ent->n_conns)
+    --ent->n_conns;
+}
+
+/** Called when we get a CREATE cell on <b>chan</b>.  Return true iff its
+ * remote address has used up its CREATE allowance, and we should refuse
+ * the cell. */
+int
+dos_create_should_refuse(channel_t *chan)
+{
+  tor_addr_t addr;
+  dos_addr_entry_t *ent;
+  time_t now = approx_time();
+
+  if (!dos_create_rate)
+    return 0;
+  if (!channel_get_addr_if_possible(chan, &addr))
+    return 0;
+  ent = dos_addr_lookup(&addr, 1, now);
+  if (!ent)
+    return 0;
+
+  if ((uint32_t)now > ent->create_refilled_at) {
+    uint64_t tokens = ent->create_tokens +
+      (uint64_t)dos_create_rate * ((uint32_t)now - ent->create_refilled_at);
+    ent->create_tokens = (uint32_t)MIN(tokens, dos_create_burst);
+    ent->create_refilled_at = (uint32_t)now;
+  }
+
+  if (ent->create_tokens == 0) {
+    ++dos_n_creates_refused;
+    return 1;
+  }
+  --ent->create_tokens;
+  return 0;
+}
+
+/** Log how much we have refused, if we're enforcing any limit. */
+void
+dos_log_heartbeat(void)
+{
+  if (!dos_enabled())
+    return;
+  log_notice(LD_HEARTBEAT, "Per-address limits have refused "U64_FORMAT
+             " OR connections and "U64_FORMAT" CREATE cells since startup.",
+             U64_PRINTF_ARG(dos_n_conns_refused),
+             U64_PRINTF_ARG(dos_n_creates_refused));
+}
+
+/** Release all storage held by the per-address limits. */
+void
+dos_free_all(void)
+{
+  tor_free(dos_table);
+  dos_max_conns = dos_create_rate = dos_create_burst = 0;
+  dos_n_conns_refused = dos_n_creates_refused = 0;
+}
+
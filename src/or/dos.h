@@ -0,0 +1,49 @@
+/* Copyright (c) 2016, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file dos.h
+ * \brief Header file for dos.c.
+ **/
+
+#ifndef TOR_DOS_H
+#define TOR_DOS_H
+
+void dos_set_options(const or_options_t *options);
+int dos_enabled(void);
+int dos_conn_note_new(const tor_addr_t *addr);
+void dos_conn_note_closed(const tor_addr_t *addr);
+int dos_create_should_refuse(channel_t *chan);
+void dos_log_heartbeat(void);
+void dos_free_all(void);
+
+#ifdef DOS_PRIVATE
+/** One source address we're keeping track of.  Kept small, since we have
+ * DOS_TABLE_SIZE of these whenever a limit is on. */
+typedef struct dos_addr_entry_t {
+  /** The address, IPv4 addresses mapped into IPv6. */
+  uint8_t addr[16];
+  /** When did we last hear from this address? */
+  uint32_t last_seen;
+  /** When did we last refill create_tokens? */
+  uint32_t create_refilled_at;
+  /** How many more CREATE cells may this address send right now? */
+  uint32_t create_tokens;
+  /** How many OR connections from this address are open? */
+  uint16_t n_conns;
+  /** True iff this slot holds an address. */
+  uint8_t in_use;
+} dos_addr_entry_t;
+
+/** How many addresses we can keep track of at once. */
+#define DOS_TABLE_SIZE (1<<16)
+/** How many slots an address may live in; the table is set-associative,
+ * so that we can evict the least useful of them when it's full. */
+#define DOS_TABLE_WAYS 8
+
+STATIC dos_addr_entry_t *dos_addr_lookup(const tor_addr_t *addr,
+                                         int create, time_t now);
+#endif
+
+#endif
+
@@ -82,6 +82,14 @@ struct guard_selection_s {
    */
   smartlist_t *chosen_entry_guards;
 
+  /**
+   * A map from identity digest to the entry_guard_t in chosen_entry_guards
+   * with that identity, so that we don't have to walk the list every time
+   * we hear about a connection or add a guard.  Must be kept in sync with
+   * chosen_entry_guards.
+   */
+  digestmap_t *entry_guards_by_id;
+
   /**
    * When we try to choose an entry guard, should we parse and add
    * config's EntryNodes first?  This was formerly a global.
@@ -118,10 +126,35 @@ guard_selection_new(void)
 
   gs = tor_malloc_zero(sizeof(*gs));
   gs->chosen_entry_guards = smartlist_new();
+  gs->entry_guards_by_id = digestmap_new();
 
   return gs;
 }
 
+/** Rebuild the identity index of <b>gs</b> from scratch, after we've
+ * replaced the contents of its chosen_entry_guards list.  If a digest
+ * appears more than once, index its first appearance, as a walk over the
+ * list would find it. */
+static void
+guard_selection_reindex(guard_selection_t *gs)
+{
+  digestmap_free(gs->entry_guards_by_id, NULL);
+  gs->entry_guards_by_id = digestmap_new();
+  SMARTLIST_FOREACH_BEGIN(gs->chosen_entry_guards, entry_guard_t *, e) {
+    if (!digestmap_get(gs->entry_guards_by_id, e->identity))
+      digestmap_set(gs->entry_guards_by_id, e->identity, e);
+  } SMARTLIST_FOREACH_END(e);
+}
+
+/** Remove <b>entry</b>, which is about to leave the chosen_entry_guards
+ * list of <b>gs</b>, from the identity index of <b>gs</b>. */
+static void
+guard_selection_unindex(guard_selection_t *gs, const entry_guard_t *entry)
+{
+  if (digestmap_get(gs->entry_guards_by_id, entry->identity) == entry)
+    digestmap_remove(gs->entry_guards_by_id, entry->identity);
+}
+
 /** Get current default guard_selection_t, creating it if necessary */
 guard_selection_t *
 get_guard_selection_info(void)
@@ -398,11 +431,7 @@ entry_guard_get_by_id_digest_for_guard_selection(guard_selection_t *gs,
 {
   tor_assert(gs != NULL);
 
-  SMARTLIST_FOREACH(gs->chosen_entry_guards, entry_guard_t *, entry,
-                    if (tor_memeq(digest, entry->identity, DIGEST_LEN))
-                      return entry;
-                   );
-  return NULL;
+  return digestmap_get(gs->entry_guards_by_id, digest);
 }
 
 /** If <b>digest</b> matches the identity of any node in the
@@ -574,6 +603,8 @@ add_an_entry_guard(guard_selection_t *gs,
     smartlist_insert(gs->chosen_entry_guards, 0, entry);
   else
     smartlist_add(gs->chosen_entry_guards, entry);
+  if (!digestmap_get(gs->entry_guards_by_id, entry->identity))
+    digestmap_set(gs->entry_guards_by_id, entry->identity, entry);
 
   control_event_guard(entry->nickname, entry->identity, "NEW");
   control_event_guard_deferred();
@@ -711,6 +742,7 @@ remove_obsolete_entry_guards(guard_selection_t *gs, time_t now)
              "Entry guard '%s' (%s) %s. (Version=%s.) Replacing it.",
              entry->nickname, dbuf, msg, ver?escaped(ver):"none");
       control_event_guard(entry->nickname, entry->identity, "DROPPED");
+      guard_selection_unindex(gs, entry);
       entry_guard_free(entry);
       smartlist_del_keeporder(gs->chosen_entry_guards, i--);
       log_entry_guards_for_guard_selection(gs, LOG_INFO);
@@ -748,6 +780,7 @@ remove_dead_entry_guards(guard_selection_t *gs, time_t now)
                "since %s local time; removing.",
                entry->nickname, dbuf, tbuf);
       control_event_guard(entry->nickname, entry->identity, "DROPPED");
+      guard_selection_unindex(gs, entry);
       entry_guard_free(entry);
       smartlist_del_keeporder(gs->chosen_entry_guards, i);
       log_entry_guards_for_guard_selection(gs, LOG_INFO);
@@ -779,6 +812,7 @@ remove_all_entry_guards_for_guard_selection(guard_selection_t *gs)
       entry_guard_free(entry);
       smartlist_del(gs->chosen_entry_guards, 0);
     }
+    guard_selection_reindex(gs);
   }
 
   log_entry_guards_for_guard_selection(gs, LOG_INFO);
@@ -897,22 +931,13 @@ entry_guard_register_connect_status_for_guard_selection(
   int refuse_conn = 0;
   int first_contact = 0;
   entry_guard_t *entry = NULL;
-  int idx = -1;
   char buf[HEX_DIGEST_LEN+1];
 
   if (!(gs) || !(gs->chosen_entry_guards)) {
     return 0;
   }
 
-  SMARTLIST_FOREACH_BEGIN(gs->chosen_entry_guards, entry_guard_t *, e) {
-    tor_assert(e);
-    if (tor_memeq(e->identity, digest, DIGEST_LEN)) {
-      entry = e;
-      idx = e_sl_idx;
-      break;
-    }
-  } SMARTLIST_FOREACH_END(e);
-
+  entry = digestmap_get(gs->entry_guards_by_id, digest);
   if (!entry)
     return 0;
 
@@ -942,8 +967,10 @@ entry_guard_register_connect_status_for_guard_selection(
                num_live_entry_guards_for_guard_selection(gs, 0) - 1,
                smartlist_len(gs->chosen_entry_guards)-1);
       control_event_guard(entry->nickname, entry->identity, "DROPPED");
+      guard_selection_unindex(gs, entry);
+      smartlist_del_keeporder(gs->chosen_entry_guards,
+                              smartlist_pos(gs->chosen_entry_guards, entry));
       entry_guard_free(entry);
-      smartlist_del_keeporder(gs->chosen_entry_guards, idx);
       log_entry_guards_for_guard_selection(gs, LOG_INFO);
       changed = 1;
     } else if (!entry->unreachable_since) {
@@ -1114,6 +1141,7 @@ entry_guards_set_from_config(guard_selection_t *gs,
   smartlist_clear(gs->chosen_entry_guards);
   /* First, the previously configured guards that are in EntryNodes. */
   smartlist_add_all(gs->chosen_entry_guards, old_entry_guards_on_list);
+  guard_selection_reindex(gs);
   /* Next, scramble the rest of EntryNodes, putting the guards first. */
   smartlist_shuffle(entry_nodes);
   smartlist_shuffle(worse_entry_nodes);
@@ -1651,6 +1679,7 @@ entry_guards_parse_state_for_guard_selection(
       smartlist_free(gs->chosen_entry_guards);
     }
     gs->chosen_entry_guards = new_entry_guards;
+    guard_selection_reindex(gs);
     gs->dirty = 0;
     /* XXX hand new_entry_guards to this func, and move it up a
      * few lines, so we don't have to re-dirty it */
@@ -1733,6 +1762,8 @@ entry_guards_update_state(or_state_t *state)
   tor_assert(gs != NULL);
   tor_assert(gs->chosen_entry_guards != NULL);
 
+  pathbias_fold_use_attempts();
+
   if (!gs->dirty)
     return;
 
@@ -2439,24 +2470,31 @@ retry_bridge_descriptor_fetch_directly(const char *digest)
 
 /** For each bridge in our list for which we don't currently have a
  * descriptor, fetch a new copy of its descriptor -- either directly
- * from the bridge or via a bridge authority. */
+ * from the bridge or via a bridge authority.
+ *
+ * While some managed proxies are still being configured, skip only the
+ * bridges whose transport isn't registered yet: plain bridges, and bridges
+ * whose proxy is already up, don't need to wait for the slowest proxy. */
 void
 fetch_bridge_descriptors(const or_options_t *options, time_t now)
 {
   int num_bridge_auths = get_n_authorities(BRIDGE_DIRINFO);
   int ask_bridge_directly;
   int can_use_bridge_authority;
+  int proxies_pending;
 
   if (!bridge_list)
     return;
 
-  /* If we still have unconfigured managed proxies, don't go and
-     connect to a bridge. */
-  if (pt_proxies_configuration_pending())
-    return;
+  proxies_pending = pt_proxies_configuration_pending();
 
   SMARTLIST_FOREACH_BEGIN(bridge_list, bridge_info_t *, bridge)
     {
+      /* If its managed proxy isn't configured yet, don't go and connect
+       * to this bridge. */
+      if (proxies_pending && bridge->transport_name &&
+          !transport_get_by_name(bridge->transport_name))
+        continue;
       if (!download_status_is_ready(&bridge->fetch_status, now,
                                     IMPOSSIBLE_TO_DOWNLOAD))
         continue; /* don't bother, no need to retry yet */
@@ -2789,6 +2827,7 @@ guard_selection_free(guard_selection_t *gs)
     smartlist_free(gs->chosen_entry_guards);
     gs->chosen_entry_guards = NULL;
   }
+  digestmap_free(gs->entry_guards_by_id, NULL);
 
   tor_free(gs);
 }
@@ -71,6 +71,9 @@ typedef struct entry_guard_t {
   double use_attempts; /**< Number of circuits we tried to use with streams */
   double use_successes; /**< Number of successfully used circuits using
                                * this guard as first hop. */
+  unsigned int pending_use_attempts; /**< Number of use attempts not yet
+                                      * added to use_attempts; see
+                                      * pathbias_fold_use_attempts(). */
 } entry_guard_t;
 
 entry_guard_t *entry_guard_get_by_id_digest_for_guard_selection(
@@ -68,6 +68,15 @@ static strmap_t *country_idxplus1_by_lc_code = NULL;
  * by their respective ip_low. */
 static smartlist_t *geoip_ipv4_entries = NULL, *geoip_ipv6_entries = NULL;
 
+/** Number of distinct 16-bit IPv4 prefixes. */
+#define GEOIP_IPV4_N_PREFIXES (1<<16)
+/** Index into geoip_ipv4_entries by the top 16 bits of an IPv4 address:
+ * element P holds the position of the first entry that ends at or after the
+ * start of the /16 P.  The extra element at the end holds the number of
+ * entries.  Built on demand by geoip_ipv4_build_index(); NULL if the entry
+ * list has changed since we last built it. */
+static int *geoip_ipv4_prefix_idx = NULL;
+
 /** SHA1 digest of the GeoIP files to include in extra-info descriptors. */
 static char geoip_digest[DIGEST_LEN];
 static char geoip6_digest[DIGEST_LEN];
@@ -126,6 +135,7 @@ geoip_add_entry(const tor_addr_t *low, const tor_addr_t *high,
     ent->ip_high = tor_addr_to_ipv4h(high);
     ent->country = idx;
     smartlist_add(geoip_ipv4_entries, ent);
+    tor_free(geoip_ipv4_prefix_idx);
   } else if (tor_addr_family(low) == AF_INET6) {
     geoip_ipv6_entry_t *ent = tor_malloc_zero(sizeof(geoip_ipv6_entry_t));
     ent->ip_low = *tor_addr_to_in6_assert(low);
@@ -218,22 +228,6 @@ geoip_ipv4_compare_entries_(const void **_a, const void **_b)
     return 0;
 }
 
-/** bsearch helper: return -1, 1, or 0 based on comparison of an IP (a pointer
- * to a uint32_t in host order) to a geoip_ipv4_entry_t */
-static int
-geoip_ipv4_compare_key_to_entry_(const void *_key, const void **_member)
-{
-  /* No alignment issue here, since _key really is a pointer to uint32_t */
-  const uint32_t addr = *(uint32_t *)_key;
-  const geoip_ipv4_entry_t *entry = *_member;
-  if (addr < entry->ip_low)
-    return -1;
-  else if (addr > entry->ip_high)
-    return 1;
-  else
-    return 0;
-}
-
 /** Sorting helper: return -1, 1, or 0 based on comparison of two
  * geoip_ipv6_entry_t */
 static int
@@ -332,6 +326,7 @@ geoip_load_file(sa_family_t family, const char *filename)
       smartlist_free(geoip_ipv4_entries);
     }
     geoip_ipv4_entries = smartlist_new();
+    tor_free(geoip_ipv4_prefix_idx);
   } else { /* AF_INET6 */
     if (geoip_ipv6_entries) {
       SMARTLIST_FOREACH(geoip_ipv6_entries, geoip_ipv6_entry_t *, e,
@@ -374,21 +369,74 @@ geoip_load_file(sa_family_t family, const char *filename)
   return 0;
 }
 
+/** Build geoip_ipv4_prefix_idx from the (sorted, non-overlapping)
+ * geoip_ipv4_entries. */
+static void
+geoip_ipv4_build_index(void)
+{
+  const int n = smartlist_len(geoip_ipv4_entries);
+  int i = 0;
+  uint32_t prefix;
+
+  tor_free(geoip_ipv4_prefix_idx);
+  geoip_ipv4_prefix_idx =
+    tor_malloc(sizeof(int) * (GEOIP_IPV4_N_PREFIXES + 1));
+  for (prefix = 0; prefix < GEOIP_IPV4_N_PREFIXES; ++prefix) {
+    while (i < n) {
+      const geoip_ipv4_entry_t *ent = smartlist_get(geoip_ipv4_entries, i);
+      if (ent->ip_high >= (prefix << 16))
+        break;
+      ++i;
+    }
+    geoip_ipv4_prefix_idx[prefix] = i;
+  }
+  geoip_ipv4_prefix_idx[GEOIP_IPV4_N_PREFIXES] = n;
+}
+
 /** Given an IP address in host order, return a number representing the
  * country to which that address belongs, -1 for "No geoip information
  * available", or 0 for the 'unknown country'.  The return value will always
  * be less than geoip_get_n_countries().  To decode it, call
  * geoip_get_country_name().
+ *
+ * The only entries that can hold <b>ipaddr</b> are the ones that overlap its
+ * /16, so we use geoip_ipv4_prefix_idx to narrow the search to those before
+ * bisecting.
  */
 STATIC int
 geoip_get_country_by_ipv4(uint32_t ipaddr)
 {
-  geoip_ipv4_entry_t *ent;
+  const geoip_ipv4_entry_t *ent;
+  const uint32_t prefix = ipaddr >> 16;
+  int lo, hi;
+
   if (!geoip_ipv4_entries)
     return -1;
-  ent = smartlist_bsearch(geoip_ipv4_entries, &ipaddr,
-                          geoip_ipv4_compare_key_to_entry_);
-  return ent ? (int)ent->country : 0;
+  if (!geoip_ipv4_prefix_idx)
+    geoip_ipv4_build_index();
+
+  /* The last candidate is the first entry that reaches into the next /16,
+   * since it might start inside this one. */
+  lo = geoip_ipv4_prefix_idx[prefix];
+  hi = geoip_ipv4_prefix_idx[prefix + 1];
+  if (hi >= smartlist_len(geoip_ipv4_entries))
+    hi = smartlist_len(geoip_ipv4_entries) - 1;
+  if (lo > hi)
+    return 0;
+
+  /* Find the last candidate that starts at or before ipaddr. */
+  while (lo < hi) {
+    int mid = lo + (hi - lo + 1) / 2;
+    ent = smartlist_get(geoip_ipv4_entries, mid);
+    if (ent->ip_low <= ipaddr)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  ent = smartlist_get(geoip_ipv4_entries, lo);
+  if (ent->ip_low <= ipaddr && ipaddr <= ent->ip_high)
+    return (int)ent->country;
+  return 0;
 }
 
 /** Given an IPv6 address, return a number representing the country to
@@ -477,6 +525,8 @@ geoip_db_digest(sa_family_t family)
  * countries have them blocked. */
 typedef struct clientmap_entry_t {
   HT_ENTRY(clientmap_entry_t) node;
+  /** Links for client_history_lru. */
+  TOR_TAILQ_ENTRY(clientmap_entry_t) lru_link;
   tor_addr_t addr;
  /* Name of pluggable transport used by this client. NULL if no
     pluggable transport was used. */
@@ -499,6 +549,23 @@ typedef struct clientmap_entry_t {
 static HT_HEAD(clientmap, clientmap_entry_t) client_history =
      HT_INITIALIZER();
 
+/** Every entry in client_history, in ascending order of
+ * last_seen_in_minutes, so that we can expire old clients without looking
+ * at the ones we are keeping. */
+static TOR_TAILQ_HEAD(clientmap_lru, clientmap_entry_t) client_history_lru =
+  TOR_TAILQ_HEAD_INITIALIZER(client_history_lru);
+
+/** Approximate number of bytes held by the entries in client_history. */
+static size_t client_history_allocation = 0;
+
+/** Return the approximate number of bytes held by <b>ent</b>. */
+static size_t
+clientmap_entry_get_allocation(const clientmap_entry_t *ent)
+{
+  return sizeof(*ent) +
+    (ent->transport_name ? strlen(ent->transport_name) + 1 : 0);
+}
+
 /** Hashtable helper: compute a hash of a clientmap_entry_t. */
 static inline unsigned
 clientmap_entry_hash(const clientmap_entry_t *a)
@@ -537,21 +604,50 @@ clientmap_entry_free(clientmap_entry_t *ent)
   tor_free(ent);
 }
 
-/** Clear history of connecting clients used by entry and bridge stats. */
+/** Add <b>ent</b> to client_history_lru after every entry seen no later
+ * than it.  Since we usually see clients in time order, this is almost
+ * always the tail. */
 static void
-client_history_clear(void)
+client_history_lru_insert(clientmap_entry_t *ent)
 {
-  clientmap_entry_t **ent, **next, *this;
-  for (ent = HT_START(clientmap, &client_history); ent != NULL;
-       ent = next) {
-    if ((*ent)->action == GEOIP_CLIENT_CONNECT) {
-      this = *ent;
-      next = HT_NEXT_RMV(clientmap, &client_history, ent);
-      clientmap_entry_free(this);
-    } else {
-      next = HT_NEXT(clientmap, &client_history, ent);
+  clientmap_entry_t *prev;
+  TOR_TAILQ_FOREACH_REVERSE(prev, &client_history_lru, clientmap_lru,
+                            lru_link) {
+    if (prev->last_seen_in_minutes <= ent->last_seen_in_minutes) {
+      TOR_TAILQ_INSERT_AFTER(&client_history_lru, prev, ent, lru_link);
+      return;
     }
   }
+  TOR_TAILQ_INSERT_HEAD(&client_history_lru, ent, lru_link);
+}
+
+/** Remove <b>ent</b> from client_history and client_history_lru, and free
+ * it. */
+static void
+client_history_remove(clientmap_entry_t *ent)
+{
+  HT_REMOVE(clientmap, &client_history, ent);
+  TOR_TAILQ_REMOVE(&client_history_lru, ent, lru_link);
+  client_history_allocation -= clientmap_entry_get_allocation(ent);
+  clientmap_entry_free(ent);
+}
+
+/** Forget every client we remember seeing for <b>action</b>. */
+static void
+client_history_clear_action(geoip_client_action_t action)
+{
+  clientmap_entry_t *ent, *next;
+  TOR_TAILQ_FOREACH_SAFE(ent, &client_history_lru, lru_link, next) {
+    if (ent->action == (unsigned)action)
+      client_history_remove(ent);
+  }
+}
+
+/** Clear history of connecting clients used by entry and bridge stats. */
+static void
+client_history_clear(void)
+{
+  client_history_clear_action(GEOIP_CLIENT_CONNECT);
 }
 
 /** Note that we've seen a client connect from the IP <b>addr</b>
@@ -595,11 +691,15 @@ geoip_note_client_seen(geoip_client_action_t action,
       ent->transport_name = tor_strdup(transport_name);
     ent->action = (int)action;
     HT_INSERT(clientmap, &client_history, ent);
+    client_history_allocation += clientmap_entry_get_allocation(ent);
+  } else {
+    TOR_TAILQ_REMOVE(&client_history_lru, ent, lru_link);
   }
   if (now / 60 <= (int)MAX_LAST_SEEN_IN_MINUTES && now >= 0)
     ent->last_seen_in_minutes = (unsigned)(now/60);
   else
     ent->last_seen_in_minutes = 0;
+  client_history_lru_insert(ent);
 
   if (action == GEOIP_CLIENT_NETWORKSTATUS) {
     int country_idx = geoip_get_country_by_addr(addr);
@@ -612,27 +712,47 @@ geoip_note_client_seen(geoip_client_action_t action,
   }
 }
 
-/** HT_FOREACH helper: remove a clientmap_entry_t from the hashtable if it's
- * older than a certain time. */
-static int
-remove_old_client_helper_(struct clientmap_entry_t *ent, void *_cutoff)
+/** Forget about all clients that haven't connected since <b>cutoff</b>. */
+void
+geoip_remove_old_clients(time_t cutoff)
 {
-  time_t cutoff = *(time_t*)_cutoff / 60;
-  if (ent->last_seen_in_minutes < cutoff) {
-    clientmap_entry_free(ent);
-    return 1;
-  } else {
-    return 0;
+  const time_t cutoff_in_minutes = cutoff / 60;
+  clientmap_entry_t *ent;
+
+  while ((ent = TOR_TAILQ_FIRST(&client_history_lru)) &&
+         ent->last_seen_in_minutes < cutoff_in_minutes) {
+    client_history_remove(ent);
   }
 }
 
-/** Forget about all clients that haven't connected since <b>cutoff</b>. */
-void
-geoip_remove_old_clients(time_t cutoff)
+/** Return the approximate number of bytes held by our history of the
+ * clients we've seen. */
+size_t
+geoip_client_cache_total_allocation(void)
 {
-  clientmap_HT_FOREACH_FN(&client_history,
-                          remove_old_client_helper_,
-                          &cutoff);
+  return client_history_allocation;
+}
+
+/** We're out of memory: forget the clients we've seen least recently
+ * until we've freed at least <b>min_remove_bytes</b> bytes.  Return the
+ * number of bytes freed.  (Our client statistics will undercount for the
+ * rest of the period, but that beats killing circuits.) */
+size_t
+geoip_client_cache_handle_oom(time_t now, size_t min_remove_bytes)
+{
+  const size_t start = client_history_allocation;
+  clientmap_entry_t *ent;
+  (void) now;
+
+  while (start - client_history_allocation < min_remove_bytes &&
+         (ent = TOR_TAILQ_FIRST(&client_history_lru))) {
+    client_history_remove(ent);
+  }
+
+  log_notice(LD_GENERAL, "We're low on memory. Removed %lu bytes of "
+             "client history.",
+             (unsigned long)(start - client_history_allocation));
+  return start - client_history_allocation;
 }
 
 /** How many responses are we giving to clients requesting v3 network
@@ -655,6 +775,24 @@ geoip_note_ns_response(geoip_ns_response_t response)
   ns_v3_responses[response]++;
 }
 
+/** How many on-the-fly compressed responses have we sent at each
+ * compression level? */
+static uint32_t dirreq_compression_levels[LOW_COMPRESSION+1];
+/** How many microseconds had we spent compressing when the current dirreq
+ * stats period started? */
+static uint64_t dirreq_compression_usec_at_start;
+
+/** Note that we're about to compress a directory response on the fly at
+ * <b>level</b>. */
+void
+geoip_note_dirreq_compression(zlib_compression_level_t level)
+{
+  if (!get_options()->DirReqStatistics)
+    return;
+  tor_assert(level <= LOW_COMPRESSION);
+  dirreq_compression_levels[level]++;
+}
+
 /** Do not mention any country from which fewer than this number of IPs have
  * connected.  This conceivably avoids reporting information that could
  * deanonymize users, though analysis is lacking. */
@@ -1173,6 +1311,7 @@ void
 geoip_dirreq_stats_init(time_t now)
 {
   start_of_dirreq_stats_interval = now;
+  dirreq_compression_usec_at_start = tor_zlib_get_total_compression_usec();
 }
 
 /** Reset counters for dirreq stats. */
@@ -1182,20 +1321,10 @@ geoip_reset_dirreq_stats(time_t now)
   SMARTLIST_FOREACH(geoip_countries, geoip_country_t *, c, {
       c->n_v3_ns_requests = 0;
   });
-  {
-    clientmap_entry_t **ent, **next, *this;
-    for (ent = HT_START(clientmap, &client_history); ent != NULL;
-         ent = next) {
-      if ((*ent)->action == GEOIP_CLIENT_NETWORKSTATUS) {
-        this = *ent;
-        next = HT_NEXT_RMV(clientmap, &client_history, ent);
-        clientmap_entry_free(this);
-      } else {
-        next = HT_NEXT(clientmap, &client_history, ent);
-      }
-    }
-  }
+  client_history_clear_action(GEOIP_CLIENT_NETWORKSTATUS);
   memset(ns_v3_responses, 0, sizeof(ns_v3_responses));
+  memset(dirreq_compression_levels, 0, sizeof(dirreq_compression_levels));
+  dirreq_compression_usec_at_start = tor_zlib_get_total_compression_usec();
   {
     dirreq_map_entry_t **ent, **next, *this;
     for (ent = HT_START(dirreqmap, &dirreq_map); ent != NULL; ent = next) {
@@ -1224,7 +1353,8 @@ geoip_format_dirreq_stats(time_t now)
   char t[ISO_TIME_LEN+1];
   int i;
   char *v3_ips_string = NULL, *v3_reqs_string = NULL,
-       *v3_direct_dl_string = NULL, *v3_tunneled_dl_string = NULL;
+       *v3_direct_dl_string = NULL, *v3_tunneled_dl_string = NULL,
+       *compression_string = NULL;
   char *result = NULL;
 
   if (!start_of_dirreq_stats_interval)
@@ -1246,6 +1376,24 @@ geoip_format_dirreq_stats(time_t now)
   v3_direct_dl_string = geoip_get_dirreq_history(DIRREQ_DIRECT);
   v3_tunneled_dl_string = geoip_get_dirreq_history(DIRREQ_TUNNELED);
 
+  /* Only relays that compressed something have a compression line. */
+  if (dirreq_compression_levels[HIGH_COMPRESSION] ||
+      dirreq_compression_levels[MEDIUM_COMPRESSION] ||
+      dirreq_compression_levels[LOW_COMPRESSION]) {
+    const uint64_t usec = tor_zlib_get_total_compression_usec() -
+      dirreq_compression_usec_at_start;
+    tor_asprintf(&compression_string,
+                 "dirreq-v3-compression high=%u,medium=%u,low=%u,"
+                 "cpu-ms="U64_FORMAT"\n",
+                 round_uint32_to_next_multiple_of(
+                      dirreq_compression_levels[HIGH_COMPRESSION], 8),
+                 round_uint32_to_next_multiple_of(
+                      dirreq_compression_levels[MEDIUM_COMPRESSION], 8),
+                 round_uint32_to_next_multiple_of(
+                      dirreq_compression_levels[LOW_COMPRESSION], 8),
+                 U64_PRINTF_ARG(usec / 1000));
+  }
+
   /* Put everything together into a single string. */
   tor_asprintf(&result, "dirreq-stats-end %s (%d s)\n"
               "dirreq-v3-ips %s\n"
@@ -1253,7 +1401,8 @@ geoip_format_dirreq_stats(time_t now)
               "dirreq-v3-resp ok=%u,not-enough-sigs=%u,unavailable=%u,"
                    "not-found=%u,not-modified=%u,busy=%u\n"
               "dirreq-v3-direct-dl %s\n"
-              "dirreq-v3-tunneled-dl %s\n",
+              "dirreq-v3-tunneled-dl %s\n"
+              "%s",
               t,
               (unsigned) (now - start_of_dirreq_stats_interval),
               v3_ips_string ? v3_ips_string : "",
@@ -1265,13 +1414,15 @@ geoip_format_dirreq_stats(time_t now)
               ns_v3_responses[GEOIP_REJECT_NOT_MODIFIED],
               ns_v3_responses[GEOIP_REJECT_BUSY],
               v3_direct_dl_string ? v3_direct_dl_string : "",
-              v3_tunneled_dl_string ? v3_tunneled_dl_string : "");
+              v3_tunneled_dl_string ? v3_tunneled_dl_string : "",
+              compression_string ? compression_string : "");
 
   /* Free partial strings. */
   tor_free(v3_ips_string);
   tor_free(v3_reqs_string);
   tor_free(v3_direct_dl_string);
   tor_free(v3_tunneled_dl_string);
+  tor_free(compression_string);
 
   return result;
 }
@@ -1301,7 +1452,8 @@ geoip_dirreq_stats_write(time_t now)
 
   /* Write dirreq-stats string to disk. */
   if (!check_or_create_data_subdir("stats")) {
-    write_to_data_subdir("stats", "dirreq-stats", str, "dirreq statistics");
+    write_to_data_subdir_async("stats", "dirreq-stats", str,
+                               "dirreq statistics");
     /* Reset measurement interval start. */
     geoip_reset_dirreq_stats(now);
   }
@@ -1513,8 +1665,8 @@ geoip_bridge_stats_write(time_t now)
 
   /* Write it to disk. */
   if (!check_or_create_data_subdir("stats")) {
-    write_to_data_subdir("stats", "bridge-stats",
-                         bridge_stats_extrainfo, "bridge statistics");
+    write_to_data_subdir_async("stats", "bridge-stats",
+                               bridge_stats_extrainfo, "bridge statistics");
 
     /* Tell the controller, "hey, there are clients!" */
     {
@@ -1642,7 +1794,8 @@ geoip_entry_stats_write(time_t now)
 
   /* Write entry-stats string to disk. */
   if (!check_or_create_data_subdir("stats")) {
-    write_to_data_subdir("stats", "entry-stats", str, "entry statistics");
+    write_to_data_subdir_async("stats", "entry-stats", str,
+                               "entry statistics");
 
     /* Reset measurement interval start. */
     geoip_reset_entry_stats(now);
@@ -1703,6 +1856,7 @@ clear_geoip_db(void)
                       tor_free(ent));
     smartlist_free(geoip_ipv6_entries);
   }
+  tor_free(geoip_ipv4_prefix_idx);
   geoip_countries = NULL;
   country_idxplus1_by_lc_code = NULL;
   geoip_ipv4_entries = NULL;
@@ -1714,12 +1868,9 @@ void
 geoip_free_all(void)
 {
   {
-    clientmap_entry_t **ent, **next, *this;
-    for (ent = HT_START(clientmap, &client_history); ent != NULL; ent = next) {
-      this = *ent;
-      next = HT_NEXT_RMV(clientmap, &client_history, ent);
-      clientmap_entry_free(this);
-    }
+    clientmap_entry_t *ent;
+    while ((ent = TOR_TAILQ_FIRST(&client_history_lru)))
+      client_history_remove(ent);
     HT_CLEAR(clientmap, &client_history);
   }
   {
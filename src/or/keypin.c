@@ -60,6 +60,12 @@
  * Empty lines, misformed lines, and lines beginning with # are
  * ignored. Lines beginning with @ are reserved for future extensions.
  *
+ * We only ever append to the journal while we're running, so it fills up
+ * with duplicate and superseded entries over time.  When it gets much
+ * bigger than the set of entries it describes, we rewrite it at startup
+ * with one line per live entry, in the same format, so that older Tor
+ * versions can still read it.
+ *
  * The dirserv.c module is the main user of these functions.
  */
 
@@ -330,6 +336,30 @@ keypin_close_journal(void)
 /** Length of a keypinning journal line, including terminating newline. */
 #define JOURNAL_LINE_LEN (BASE64_DIGEST_LEN + BASE64_DIGEST256_LEN + 2)
 
+/** Don't bother compacting a journal with fewer entry lines than this. */
+#define KEYPIN_COMPACT_MIN_LINES 1024
+/** Compact the journal when it has more than this many entry lines for
+ * every live entry. */
+#define KEYPIN_COMPACT_RATIO 2
+
+/** Number of entry lines, good or bad, that we found in the last journal we
+ * loaded. */
+static int keypin_journal_n_lines = 0;
+
+/** Write the journal line mapping <b>rsa_id_digest</b> and
+ * <b>ed25519_id_key</b>, including its terminating newline, into the
+ * JOURNAL_LINE_LEN bytes at <b>line</b>. */
+static void
+keypin_format_journal_line(char *line, const uint8_t *rsa_id_digest,
+                           const uint8_t *ed25519_id_key)
+{
+  digest_to_base64(line, (const char*)rsa_id_digest);
+  line[BASE64_DIGEST_LEN] = ' ';
+  digest256_to_base64(line + BASE64_DIGEST_LEN + 1,
+                      (const char*)ed25519_id_key);
+  line[BASE64_DIGEST_LEN+1+BASE64_DIGEST256_LEN] = '\n';
+}
+
 /** Add an entry to the keypinning journal to map <b>rsa_id_digest</b> and
  * <b>ed25519_id_key</b>. */
 static int
@@ -339,11 +369,7 @@ keypin_journal_append_entry(const uint8_t *rsa_id_digest,
   if (keypin_journal_fd == -1)
     return -1;
   char line[JOURNAL_LINE_LEN];
-  digest_to_base64(line, (const char*)rsa_id_digest);
-  line[BASE64_DIGEST_LEN] = ' ';
-  digest256_to_base64(line + BASE64_DIGEST_LEN + 1,
-                      (const char*)ed25519_id_key);
-  line[BASE64_DIGEST_LEN+1+BASE64_DIGEST256_LEN] = '\n';
+  keypin_format_journal_line(line, rsa_id_digest, ed25519_id_key);
 
   if (write_all(keypin_journal_fd, line, JOURNAL_LINE_LEN, 0)<0) {
     log_warn(LD_DIRSERV, "Error while adding a line to the key-pinning "
@@ -417,6 +443,8 @@ keypin_load_journal_impl(const char *data, size_t size)
     ++n_entries;
   }
 
+  keypin_journal_n_lines = n_entries + n_corrupt_lines;
+
   int severity = (n_corrupt_lines || n_duplicates) ? LOG_WARN : LOG_INFO;
   tor_log(severity, LD_DIRSERV,
           "Loaded %d entries from keypin journal. "
@@ -445,6 +473,51 @@ keypin_load_journal(const char *fname)
   return r;
 }
 
+/**
+ * If the journal we last loaded has many more lines than we have live
+ * entries, replace the file called <b>fname</b> with one line for each of
+ * our entries.  Must be called after keypin_load_journal() and before
+ * keypin_open_journal().  Return 1 if we compacted the journal, 0 if it
+ * didn't need compacting, and -1 on failure.
+ */
+int
+keypin_compact_journal(const char *fname)
+{
+  const int n_live = HT_SIZE(&the_rsa_map);
+  keypin_ent_t **ent;
+  char tbuf[ISO_TIME_LEN+1];
+  char *buf, *cp;
+  size_t buflen;
+  int r;
+
+  tor_assert(keypin_journal_fd == -1);
+  if (keypin_journal_n_lines < KEYPIN_COMPACT_MIN_LINES ||
+      keypin_journal_n_lines <= n_live * KEYPIN_COMPACT_RATIO)
+    return 0;
+
+  buflen = 80 + (size_t)n_live * JOURNAL_LINE_LEN;
+  buf = tor_malloc(buflen);
+  format_iso_time(tbuf, approx_time());
+  tor_snprintf(buf, buflen, "@compacted-at %s\n", tbuf);
+  cp = buf + strlen(buf);
+  HT_FOREACH(ent, rsamap, &the_rsa_map) {
+    keypin_format_journal_line(cp, (*ent)->rsa_id, (*ent)->ed25519_key);
+    cp += JOURNAL_LINE_LEN;
+  }
+
+  r = write_bytes_to_file(fname, buf, cp - buf, 1);
+  tor_free(buf);
+
+  if (r < 0) {
+    log_warn(LD_DIRSERV, "Couldn't compact the key-pinning journal.");
+    return -1;
+  }
+  log_notice(LD_DIRSERV, "Compacted the key-pinning journal from %d lines "
+             "to %d entries.", keypin_journal_n_lines, n_live);
+  keypin_journal_n_lines = n_live;
+  return 1;
+}
+
 /** Parse a single keypinning journal line entry from <b>cp</b>.  The input
  * does not need to be NUL-terminated, but it <em>does</em> need to have
  * KEYPIN_JOURNAL_LINE_LEN -1 bytes available to read.  Return a new entry
@@ -17,9 +17,11 @@
 #include "buffers.h"
 #include "channel.h"
 #include "channeltls.h"
+#include "circpathbias.h"
 #include "circuitbuild.h"
 #include "circuitlist.h"
 #include "circuituse.h"
+#include "clientdns.h"
 #include "command.h"
 #include "config.h"
 #include "confparse.h"
@@ -34,10 +36,12 @@
 #include "dirvote.h"
 #include "dns.h"
 #include "dnsserv.h"
+#include "dos.h"
 #include "entrynodes.h"
 #include "geoip.h"
 #include "hibernate.h"
 #include "keypin.h"
+#include "latency_trace.h"
 #include "main.h"
 #include "microdesc.h"
 #include "networkstatus.h"
@@ -47,6 +51,7 @@
 #include "periodic.h"
 #include "policies.h"
 #include "protover.h"
+#include "pubsub.h"
 #include "transports.h"
 #include "relay.h"
 #include "rendclient.h"
@@ -61,7 +66,9 @@
 #include "shared_random.h"
 #include "statefile.h"
 #include "status.h"
+#include "timers.h"
 #include "util_process.h"
+#include "watchdog.h"
 #include "ext_orport.h"
 #ifdef USE_DMALLOC
 #include <dmalloc.h>
@@ -138,6 +145,11 @@ static unsigned newnym_epoch = 0;
 
 /** Smartlist of all open connections. */
 static smartlist_t *connection_array = NULL;
+/** For each connection type, the connections in connection_array that have
+ * that type.  A connection's conn_type_index is its position in the list
+ * for its type.  Since a connection's type never changes, we can use these
+ * to find connections of one type without looking at all the others. */
+static smartlist_t *connections_by_type[CONN_TYPE_MAX_+1];
 /** List of connections that have been marked for close and need to be freed
  * and removed from connection_array. */
 static smartlist_t *closeable_connection_lst = NULL;
@@ -204,6 +216,20 @@ note_that_we_maybe_cant_complete_circuits(void)
   can_complete_circuits = 0;
 }
 
+/** Return true iff <b>conn</b> should get a single edge-triggered
+ * registration for its socket instead of having its events added and
+ * removed every time we change our mind about reading or writing.  Linked
+ * connections never touch their events, and listeners are cheap enough
+ * that we leave them alone. */
+static int
+connection_should_be_edge_triggered(connection_t *conn)
+{
+  if (!SOCKET_OK(conn->s) || conn->linked || connection_is_listener(conn))
+    return 0;
+  return get_options()->EdgeTriggeredIO &&
+    tor_libevent_supports_edge_triggered();
+}
+
 /** Add <b>conn</b> to the array of connections that we can poll on.  The
  * connection's socket must be set; the connection starts out
  * non-reading and non-writing.
@@ -220,10 +246,28 @@ connection_add_impl(connection_t *conn, int is_connecting)
   tor_assert(conn->conn_array_index == -1); /* can only connection_add once */
   conn->conn_array_index = smartlist_len(connection_array);
   smartlist_add(connection_array, conn);
+  {
+    smartlist_t *by_type = get_connection_array_by_type(conn->type);
+    conn->conn_type_index = smartlist_len(by_type);
+    smartlist_add(by_type, conn);
+  }
 
   (void) is_connecting;
 
-  if (SOCKET_OK(conn->s) || conn->linked) {
+  if (connection_should_be_edge_triggered(conn)) {
+    /* Register both directions once, for the lifetime of the connection;
+     * connection_{start,stop}_{reading,writing} only flip bits from now on.
+     */
+    conn->edge_triggered = 1;
+    conn->read_event = tor_event_new(tor_libevent_get_base(),
+         conn->s, EV_READ|EV_PERSIST|EV_ET, conn_read_callback, conn);
+    conn->write_event = tor_event_new(tor_libevent_get_base(),
+         conn->s, EV_WRITE|EV_PERSIST|EV_ET, conn_write_callback, conn);
+    if (event_add(conn->read_event, NULL) ||
+        event_add(conn->write_event, NULL))
+      log_warn(LD_NET, "Error from libevent registering edge-triggered "
+               "events for %d", (int)conn->s);
+  } else if (SOCKET_OK(conn->s) || conn->linked) {
     conn->read_event = tor_event_new(tor_libevent_get_base(),
          conn->s, EV_READ|EV_PERSIST, conn_read_callback, conn);
     conn->write_event = tor_event_new(tor_libevent_get_base(),
@@ -231,6 +275,8 @@ connection_add_impl(connection_t *conn, int is_connecting)
     /* XXXX CHECK FOR NULL RETURN! */
   }
 
+  connection_schedule_housekeeping(conn);
+
   log_debug(LD_NET,"new conn type %s, socket %d, address %s, n_conns %d.",
             conn_type_to_string(conn->type), (int)conn->s, conn->address,
             smartlist_len(connection_array));
@@ -266,6 +312,7 @@ connection_remove(connection_t *conn)
 {
   int current_index;
   connection_t *tmp;
+  smartlist_t *by_type;
 
   tor_assert(conn);
 
@@ -280,6 +327,19 @@ connection_remove(connection_t *conn)
   control_event_conn_bandwidth(conn);
 
   tor_assert(conn->conn_array_index >= 0);
+  tor_assert(conn->conn_type_index >= 0);
+
+  /* Remove it from the list for its type the same way we remove it from
+   * connection_array below. */
+  by_type = get_connection_array_by_type(conn->type);
+  tor_assert(smartlist_get(by_type, conn->conn_type_index) == conn);
+  smartlist_del(by_type, conn->conn_type_index);
+  if (conn->conn_type_index < smartlist_len(by_type)) {
+    tmp = smartlist_get(by_type, conn->conn_type_index);
+    tmp->conn_type_index = conn->conn_type_index;
+  }
+  conn->conn_type_index = -1;
+
   current_index = conn->conn_array_index;
   connection_unregister_events(conn); /* This is redundant, but cheap. */
   if (current_index == smartlist_len(connection_array)-1) { /* at the end */
@@ -344,7 +404,7 @@ connection_unlink(connection_t *conn)
 
 /** Initialize the global connection list, closeable connection list,
  * and active connection list. */
-STATIC void
+void
 init_connection_lists(void)
 {
   if (!connection_array)
@@ -390,6 +450,17 @@ get_connection_array, (void))
   return connection_array;
 }
 
+/** Return the list of all connections of type <b>type</b> in
+ * get_connection_array().  The list must not be modified. */
+smartlist_t *
+get_connection_array_by_type(int type)
+{
+  tor_assert(type >= CONN_TYPE_MIN_ && type <= CONN_TYPE_MAX_);
+  if (!connections_by_type[type])
+    connections_by_type[type] = smartlist_new();
+  return connections_by_type[type];
+}
+
 /** Provides the traffic read and written over the life of the process. */
 
 MOCK_IMPL(uint64_t,
@@ -428,10 +499,22 @@ connection_is_reading(connection_t *conn)
 {
   tor_assert(conn);
 
+  if (conn->edge_triggered)
+    return conn->want_read;
+
   return conn->reading_from_linked_conn ||
     (conn->read_event && event_pending(conn->read_event, EV_READ, NULL));
 }
 
+/** Return true iff <b>conn</b> is a TLS connection whose TLS object holds
+ * input that it has taken from the socket and we haven't read yet. */
+static int
+connection_has_buffered_tls_input(connection_t *conn)
+{
+  return connection_speaks_cells(conn) && TO_OR_CONN(conn)->tls &&
+    tor_tls_has_buffered_input(TO_OR_CONN(conn)->tls);
+}
+
 /** Check whether <b>conn</b> is correct in having (or not having) a
  * read/write event (passed in <b>ev</b>). On success, return 0. On failure,
  * log a warning and return -1. */
@@ -482,7 +565,9 @@ connection_stop_reading,(connection_t *conn))
     return;
   }
 
-  if (conn->linked) {
+  if (conn->edge_triggered) {
+    conn->want_read = 0;
+  } else if (conn->linked) {
     conn->reading_from_linked_conn = 0;
     connection_stop_reading_from_linked_conn(conn);
   } else {
@@ -504,7 +589,13 @@ connection_start_reading,(connection_t *conn))
     return;
   }
 
-  if (conn->linked) {
+  if (conn->edge_triggered) {
+    /* If the socket became readable while we weren't interested, the kernel
+     * won't tell us again: run the callback ourselves. */
+    if (!conn->want_read && conn->read_ready)
+      event_active(conn->read_event, EV_READ, 1);
+    conn->want_read = 1;
+  } else if (conn->linked) {
     conn->reading_from_linked_conn = 1;
     if (connection_should_read_from_linked_conn(conn))
       connection_start_reading_from_linked_conn(conn);
@@ -514,6 +605,10 @@ connection_start_reading,(connection_t *conn))
                "to watched: %s",
                (int)conn->s,
                tor_socket_strerror(tor_socket_errno(conn->s)));
+    /* The socket won't wake us for input that TLS has already taken from
+     * it. */
+    if (connection_has_buffered_tls_input(conn))
+      event_active(conn->read_event, EV_READ, 1);
   }
 }
 
@@ -523,6 +618,9 @@ connection_is_writing(connection_t *conn)
 {
   tor_assert(conn);
 
+  if (conn->edge_triggered)
+    return conn->want_write;
+
   return conn->writing_to_linked_conn ||
     (conn->write_event && event_pending(conn->write_event, EV_WRITE, NULL));
 }
@@ -537,7 +635,9 @@ connection_stop_writing,(connection_t *conn))
     return;
   }
 
-  if (conn->linked) {
+  if (conn->edge_triggered) {
+    conn->want_write = 0;
+  } else if (conn->linked) {
     conn->writing_to_linked_conn = 0;
     if (conn->linked_conn)
       connection_stop_reading_from_linked_conn(conn->linked_conn);
@@ -560,7 +660,11 @@ connection_start_writing,(connection_t *conn))
     return;
   }
 
-  if (conn->linked) {
+  if (conn->edge_triggered) {
+    if (!conn->want_write && conn->write_ready)
+      event_active(conn->write_event, EV_WRITE, 1);
+    conn->want_write = 1;
+  } else if (conn->linked) {
     conn->writing_to_linked_conn = 1;
     if (conn->linked_conn &&
         connection_should_read_from_linked_conn(conn->linked_conn))
@@ -574,6 +678,23 @@ connection_start_writing,(connection_t *conn))
   }
 }
 
+/** Note that a read on <b>conn</b> came back short or would have blocked,
+ * so the socket has no more data for us until libevent says otherwise. */
+void
+connection_note_read_blocked(connection_t *conn)
+{
+  conn->read_ready = 0;
+}
+
+/** Note that a write on <b>conn</b> came back short or would have blocked.
+ * Only edge-triggered connections look at the flag this clears, so this is
+ * harmless to call on any connection. */
+void
+connection_note_write_blocked(connection_t *conn)
+{
+  conn->write_ready = 0;
+}
+
 /** Return true iff <b>conn</b> is linked conn, and reading from the conn
  * linked to it would be good and feasible.  (Reading is "feasible" if the
  * other conn exists and has data in its outbuf, and is "good" if we have our
@@ -680,6 +801,13 @@ conn_read_callback(evutil_socket_t fd, short event, void *_conn)
 
   log_debug(LD_NET,"socket %d wants to read.",(int)conn->s);
 
+  /* Remember the edge even if we don't want it yet; see
+   * connection_start_reading(). */
+  conn->read_ready = 1;
+  if (conn->edge_triggered && !conn->want_read)
+    return;
+
+  LATENCY_TRACE_START(trace_start);
   /* assert_connection_ok(conn, time(NULL)); */
 
   if (connection_handle_read(conn) < 0) {
@@ -697,8 +825,22 @@ conn_read_callback(evutil_socket_t fd, short event, void *_conn)
   }
   assert_connection_ok(conn, time(NULL));
 
+  /* Without evidence that we drained the socket, behave like a
+   * level-triggered event and come back on the next pass. */
+  if (conn->edge_triggered && !conn->marked_for_close &&
+      conn->want_read && conn->read_ready && conn->read_event)
+    event_active(conn->read_event, EV_READ, 1);
+  /* Likewise if TLS read ahead of what we took from it, unless the read
+   * stopped because it needs more from the socket.  Each pass goes through
+   * the token buckets as usual. */
+  else if (!conn->edge_triggered && !conn->marked_for_close &&
+           conn->read_ready && connection_is_reading(conn) &&
+           connection_has_buffered_tls_input(conn))
+    event_active(conn->read_event, EV_READ, 1);
+
   if (smartlist_len(closeable_connection_lst))
     close_closeable_connections();
+  LATENCY_TRACE_END(trace_start, LT_CONN_READ);
 }
 
 /** Libevent callback: this gets invoked when (connection_t*)<b>conn</b> has
@@ -713,6 +855,13 @@ conn_write_callback(evutil_socket_t fd, short events, void *_conn)
   LOG_FN_CONN(conn, (LOG_DEBUG, LD_NET, "socket %d wants to write.",
                      (int)conn->s));
 
+  if (conn->edge_triggered) {
+    conn->write_ready = 1;
+    if (!conn->want_write)
+      return;
+  }
+
+  LATENCY_TRACE_START(trace_start);
   /* assert_connection_ok(conn, time(NULL)); */
 
   if (connection_handle_write(conn, 0) < 0) {
@@ -735,8 +884,13 @@ conn_write_callback(evutil_socket_t fd, short events, void *_conn)
   }
   assert_connection_ok(conn, time(NULL));
 
+  if (conn->edge_triggered && !conn->marked_for_close &&
+      conn->want_write && conn->write_ready && conn->write_event)
+    event_active(conn->write_event, EV_WRITE, 1);
+
   if (smartlist_len(closeable_connection_lst))
     close_closeable_connections();
+  LATENCY_TRACE_END(trace_start, LT_CONN_WRITE);
 }
 
 /** If the connection at connection_array[i] is marked for close, then:
@@ -825,6 +979,7 @@ conn_close_if_marked(int i)
          */
         if (connection_is_writing(conn)) {
           conn->write_blocked_on_bw = 1;
+          connection_bucket_note_blocked(conn);
           connection_stop_writing(conn);
         }
         if (connection_is_reading(conn)) {
@@ -835,6 +990,7 @@ conn_close_if_marked(int i)
            * connection_handle_read_impl, or to just stop reading in
            * mark_and_flush */
           conn->read_blocked_on_bw = 1;
+          connection_bucket_note_blocked(conn);
           connection_stop_reading(conn);
         }
       }
@@ -910,6 +1066,33 @@ directory_all_unreachable(time_t now)
   event_active(directory_all_unreachable_cb_event, EV_READ, 1);
 }
 
+/** Event that delivers deferred pubsub notifications. */
+static struct event *pubsub_flush_event = NULL;
+
+/** Libevent callback: deliver the pubsub notifications that have been
+ * deferred since we last ran. */
+static void
+pubsub_flush_cb(evutil_socket_t fd, short event, void *arg)
+{
+  (void)fd;
+  (void)event;
+  (void)arg;
+  pubsub_flush_deferred();
+}
+
+/** Called by pubsub when a deferred notification is pending: deliver it
+ * once the events that are active now have run. */
+static void
+schedule_pubsub_flush(void)
+{
+  if (!pubsub_flush_event) {
+    pubsub_flush_event = tor_event_new(tor_libevent_get_base(),
+                                       -1, EV_READ, pubsub_flush_cb, NULL);
+    tor_assert(pubsub_flush_event);
+  }
+  event_active(pubsub_flush_event, EV_READ, 1);
+}
+
 /** This function is called whenever we successfully pull down some new
  * network statuses or server descriptors. */
 void
@@ -945,13 +1128,14 @@ directory_info_has_arrived(time_t now, int from_cache, int suppress_logs)
 }
 
 /** Perform regular maintenance tasks for a single connection.  This
- * function gets run once per second per connection by run_scheduled_events.
+ * function gets run whenever the connection's housekeeping timer fires (see
+ * connection_schedule_housekeeping()), and once per second per connection
+ * by run_scheduled_events while we're hibernating.
  */
 static void
-run_connection_housekeeping(int i, time_t now)
+run_connection_housekeeping(connection_t *conn, time_t now)
 {
   cell_t cell;
-  connection_t *conn = smartlist_get(connection_array, i);
   const or_options_t *options = get_options();
   or_connection_t *or_conn;
   channel_t *chan = NULL;
@@ -964,7 +1148,8 @@ run_connection_housekeeping(int i, time_t now)
     TO_OR_CONN(conn)->timestamp_lastempty = now;
 
   if (conn->marked_for_close) {
-    /* nothing to do here */
+    /* nothing to do here but give up on flushing, maybe */
+    connection_expire_held_open(conn, now);
     return;
   }
 
@@ -992,6 +1177,12 @@ run_connection_housekeeping(int i, time_t now)
     return;
   }
 
+  /* Give up on or retry streams that have waited too long. */
+  if (conn->type == CONN_TYPE_AP) {
+    connection_ap_check_expiry(TO_ENTRY_CONN(conn), now);
+    return;
+  }
+
   if (!connection_speaks_cells(conn))
     return; /* we're all done here, the rest is just for OR conns */
 
@@ -1068,6 +1259,120 @@ run_connection_housekeeping(int i, time_t now)
   }
 }
 
+/** Return the next time at which run_connection_housekeeping() might
+ * find something to do for <b>conn</b>, assuming nothing about it changes
+ * in the meantime, or 0 if only a change of state could give it work.
+ * Deadlines that have already passed without anything happening (say, a
+ * keepalive we couldn't send because there was data to flush) come back as
+ * one second from <b>now</b>, so we keep an eye on the connection the way
+ * the old once-a-second scan did. */
+STATIC time_t
+connection_housekeeping_deadline(connection_t *conn, time_t now)
+{
+  const or_options_t *options = get_options();
+  time_t when = 0;
+#define CONSIDER(t) STMT_BEGIN                  \
+    time_t t_ = (t);                            \
+    if (!when || t_ < when)                     \
+      when = t_;                                \
+  STMT_END
+
+  if (conn->marked_for_close) {
+    CONSIDER(conn->timestamp_lastwritten + CONN_HOLD_OPEN_TIMEOUT);
+  } else if (conn->type == CONN_TYPE_AP) {
+    time_t deadline = connection_ap_expiry_deadline(TO_ENTRY_CONN(conn));
+    if (deadline)
+      CONSIDER(deadline);
+  } else if (conn->type == CONN_TYPE_DIR) {
+    if (DIR_CONN_IS_SERVER(conn))
+      CONSIDER(conn->timestamp_lastwritten +
+               options->TestingDirConnectionMaxStall + 1);
+    else
+      CONSIDER(conn->timestamp_lastread +
+               options->TestingDirConnectionMaxStall + 1);
+  } else if (connection_speaks_cells(conn)) {
+    or_connection_t *or_conn = TO_OR_CONN(conn);
+    channel_t *chan = or_conn->chan ? TLS_CHAN_TO_BASE(or_conn->chan) : NULL;
+
+    CONSIDER(conn->timestamp_lastwritten + options->KeepalivePeriod);
+    if (connection_state_is_open(conn) && chan) {
+      /* While there are circuits, the idle clock can't start running any
+       * sooner than now. */
+      if (channel_num_circuits(chan))
+        CONSIDER(now + or_conn->idle_timeout);
+      else
+        CONSIDER(chan->timestamp_last_had_circuits + or_conn->idle_timeout);
+      CONSIDER(MAX(or_conn->timestamp_lastempty,
+                   conn->timestamp_lastwritten) +
+               options->KeepalivePeriod*10);
+    }
+  }
+#undef CONSIDER
+
+  if (when && when <= now)
+    when = now + 1;
+  return when;
+}
+
+/** Timer callback: run housekeeping on the connection in <b>arg</b>, and
+ * decide when to look at it next. */
+static void
+connection_housekeeping_cb(tor_timer_t *timer, void *arg,
+                           const struct monotime_t *now_mono)
+{
+  connection_t *conn = arg;
+  (void)timer;
+  (void)now_mono;
+
+  run_connection_housekeeping(conn, time(NULL));
+  connection_schedule_housekeeping(conn);
+
+  if (smartlist_len(closeable_connection_lst))
+    close_closeable_connections();
+}
+
+/** Arrange for run_connection_housekeeping() to look at <b>conn</b> at its
+ * next deadline.  Call this whenever something happens that could bring
+ * that deadline closer than the one we last scheduled; deadlines that move
+ * later take care of themselves, since the callback reschedules. */
+void
+connection_schedule_housekeeping(connection_t *conn)
+{
+  time_t now = time(NULL);
+  time_t when;
+  struct timeval delay;
+
+  if (conn->conn_array_index < 0)
+    return; /* connection_add() will take care of it */
+
+  when = connection_housekeeping_deadline(conn, now);
+  if (!when) {
+    if (conn->housekeeping_timer)
+      timer_disable(conn->housekeeping_timer);
+    return;
+  }
+  if (!conn->housekeeping_timer)
+    conn->housekeeping_timer = timer_new(connection_housekeeping_cb, conn);
+
+  delay.tv_sec = when - now;
+  delay.tv_usec = 0;
+  timer_schedule(conn->housekeeping_timer, &delay);
+}
+
+/** Arrange for run_connection_housekeeping() to look at <b>conn</b> as soon
+ * as we're back in the main loop. */
+void
+connection_schedule_housekeeping_now(connection_t *conn)
+{
+  const struct timeval no_delay = { 0, 0 };
+
+  if (conn->conn_array_index < 0)
+    return;
+  if (!conn->housekeeping_timer)
+    conn->housekeeping_timer = timer_new(connection_housekeeping_cb, conn);
+  timer_schedule(conn->housekeeping_timer, &no_delay);
+}
+
 /** Honor a NEWNYM request: make future requests unlinkable to past
  * requests. */
 static void
@@ -1082,6 +1387,7 @@ signewnym_impl(time_t now)
 
   circuit_mark_all_dirty_circs_as_unusable();
   addressmap_clear_transient();
+  client_dns_cache_clear();
   rend_client_purge_state();
   time_of_last_signewnym = now;
   signewnym_is_pending = 0;
@@ -1126,6 +1432,7 @@ CALLBACK(check_for_reachability_bw);
 CALLBACK(fetch_networkstatus);
 CALLBACK(retry_listeners);
 CALLBACK(expire_old_ciruits_serverside);
+CALLBACK(expire_exit_preconnect);
 CALLBACK(check_dns_honesty);
 CALLBACK(write_bridge_ns);
 CALLBACK(check_fw_helper_app);
@@ -1157,6 +1464,7 @@ static periodic_event_item_t periodic_events[] = {
   CALLBACK(fetch_networkstatus),
   CALLBACK(retry_listeners),
   CALLBACK(expire_old_ciruits_serverside),
+  CALLBACK(expire_exit_preconnect),
   CALLBACK(check_dns_honesty),
   CALLBACK(write_bridge_ns),
   CALLBACK(check_fw_helper_app),
@@ -1219,6 +1527,19 @@ initialize_periodic_events_cb(evutil_socket_t fd, short events, void *data)
   }
 }
 
+/** Libevent callback: load the extra-info documents that do_main_loop()
+ * left for later. */
+static void
+reload_extrainfo_cb(evutil_socket_t fd, short events, void *data)
+{
+  (void) fd;
+  (void) events;
+  (void) data;
+  if (router_reload_extrainfo_list()) {
+    log_warn(LD_DIR, "Couldn't load cached extra-info documents.");
+  }
+}
+
 /** Set up all the members of periodic_events[], and configure them all to be
  * launched from a callback. */
 STATIC void
@@ -1350,16 +1671,13 @@ run_scheduled_events(time_t now)
    * it can't, currently), we should do this more often.) */
   circuit_expire_building();
 
-  /* 3b. Also look at pending streams and prune the ones that 'began'
-   *     a long time ago but haven't gotten a 'connected' yet.
-   *     Do this before step 4, so we can put them back into pending
-   *     state to be picked up by the new circuit.
-   */
-  connection_ap_expire_beginning();
+  /* 3b. Pending streams that 'began' a long time ago but haven't gotten a
+   *     'connected' yet get pruned or retried from their own housekeeping
+   *     timers; see connection_ap_expiry_deadline(). */
 
-  /* 3c. And expire connections that we've held open for too long.
-   */
-  connection_expire_held_open();
+  /* 3c. Fold the path bias use attempts counted since last time into our
+   *     guard statistics. */
+  pathbias_fold_use_attempts();
 
   /* 4. Every second, we try a new circuit if there are no valid
    *    circuits. Every NewCircuitPeriod seconds, we expire circuits
@@ -1373,11 +1691,14 @@ run_scheduled_events(time_t now)
     circuit_expire_old_circs_as_needed(now);
   }
 
-  /* 5. We do housekeeping for each connection... */
+  /* 5. We do housekeeping for each connection when its own timer says so
+   *    (see connection_schedule_housekeeping()); but whether we're
+   *    hibernating can change at any time, so in that case we check them
+   *    all. */
   connection_or_set_bad_connections(NULL, 0);
-  int i;
-  for (i=0;i<smartlist_len(connection_array);i++) {
-    run_connection_housekeeping(i, now);
+  if (we_are_hibernating()) {
+    SMARTLIST_FOREACH(connection_array, connection_t *, conn,
+                      run_connection_housekeeping(conn, now));
   }
 
   /* 6. And remove any marked circuits... */
@@ -1653,6 +1974,7 @@ clean_caches_callback(time_t now, const or_options_t *options)
   rend_cache_clean(now, REND_CACHE_TYPE_CLIENT);
   rend_cache_clean(now, REND_CACHE_TYPE_SERVICE);
   rend_cache_clean_v2_descs_as_dir(now, 0);
+  rend_cache_client_save(now);
   microdesc_cache_rebuild(NULL, 0);
 #define CLEAN_CACHES_INTERVAL (30*60)
   return CLEAN_CACHES_INTERVAL;
@@ -1795,6 +2117,15 @@ expire_old_ciruits_serverside_callback(time_t now, const or_options_t *options)
   return 11;
 }
 
+static int
+expire_exit_preconnect_callback(time_t now, const or_options_t *options)
+{
+  (void)options;
+  /* Close preconnected exit sockets that have waited too long. */
+  connection_exit_preconnect_expire(now);
+  return 5;
+}
+
 static int
 check_dns_honesty_callback(time_t now, const or_options_t *options)
 {
@@ -1893,12 +2224,14 @@ second_elapsed_callback(periodic_timer_t *timer, void *arg)
   const or_options_t *options = get_options();
   (void)timer;
   (void)arg;
+  monotime_coarse_cache_clear();
 
   n_libevent_errors = 0;
 
   /* log_notice(LD_GENERAL, "Tick."); */
   now = time(NULL);
   update_approx_time(now);
+  connection_flush_bandwidth_history();
 
   /* the second has rolled over. check more stuff. */
   seconds_elapsed = current_second ? (int)(now - current_second) : 0;
@@ -1912,6 +2245,9 @@ second_elapsed_callback(periodic_timer_t *timer, void *arg)
   control_event_conn_bandwidth_used();
   control_event_circ_bandwidth_used();
   control_event_circuit_cell_stats();
+  control_event_queue_delay();
+  control_event_cpuworker_timing();
+  control_event_chan_stats();
 
   if (server_mode(options) &&
       !net_is_disabled() &&
@@ -2202,6 +2538,8 @@ do_main_loop(void)
 
   handle_signals(1);
 
+  pubsub_set_deferred_scheduler(schedule_pubsub_flush);
+
   /* load the private keys, if we're supposed to have them, and set up the
    * TLS context. */
   if (! client_identity_key_is_set()) {
@@ -2227,6 +2565,9 @@ do_main_loop(void)
       log_err(LD_DIR, "Error loading key-pinning journal: %s",strerror(errno));
       r = -1;
     }
+    /* If compaction fails, we just keep appending to the old journal. */
+    if (r == 0)
+      keypin_compact_journal(fname);
     if (keypin_open_journal(fname)<0) {
       log_err(LD_DIR, "Error opening key-pinning journal: %s",strerror(errno));
       r = -1;
@@ -2258,16 +2599,28 @@ do_main_loop(void)
   if (router_reload_router_list()) {
     return -1;
   }
+  /* Extra-info documents aren't needed to bootstrap: parse them from the
+   * main loop, once we're up and running, rather than before it starts. */
+  {
+    struct timeval no_delay = { 0, 0 };
+    if (event_base_once(tor_libevent_get_base(), -1, EV_TIMEOUT,
+                        reload_extrainfo_cb, NULL, &no_delay) < 0) {
+      reload_extrainfo_cb(-1, 0, NULL);
+    }
+  }
   /* load the networkstatuses. (This launches a download for new routers as
    * appropriate.)
    */
   now = time(NULL);
   directory_info_has_arrived(now, 1, 0);
 
-  if (server_mode(get_options())) {
-    /* launch cpuworkers. Need to do this *after* we've read the onion key. */
-    cpu_init();
-  }
+  /* launch cpuworkers. Need to do this *after* we've read the onion key.
+   * Clients use them too, to precompute the keys for their ntor handshakes.
+   */
+  cpu_init();
+
+  /* Start watching for main loop stalls, if we've been asked to. */
+  watchdog_set_threshold(get_options()->MainLoopStallThreshold);
 
   /* Setup shared random protocol subsystem. */
   if (authdir_mode_publishes_statuses(get_options())) {
@@ -2342,6 +2695,35 @@ do_main_loop(void)
   return run_main_loop_until_done();
 }
 
+/** How many times will run_linked_connection_handoffs() go over the active
+ * linked connections before leaving the rest to libevent? */
+#define MAX_LINKED_HANDOFF_PASSES 8
+
+/** Let every linked connection whose partner has data waiting for it read
+ * that data right now, instead of waiting for its read event to come round
+ * on the next trip through the event loop.  Since one handoff often makes
+ * the partner ready in turn (a BEGIN_DIR request becomes a directory
+ * response), go around a few times. */
+static void
+run_linked_connection_handoffs(void)
+{
+  smartlist_t *todo = smartlist_new();
+  int pass;
+
+  for (pass = 0; pass < MAX_LINKED_HANDOFF_PASSES &&
+         smartlist_len(active_linked_connection_lst); ++pass) {
+    smartlist_add_all(todo, active_linked_connection_lst);
+    SMARTLIST_FOREACH_BEGIN(todo, connection_t *, conn) {
+      /* An earlier handoff on this pass may have closed and freed it. */
+      if (!smartlist_contains(active_linked_connection_lst, conn))
+        continue;
+      conn_read_callback(conn->s, EV_READ, conn);
+    } SMARTLIST_FOREACH_END(conn);
+    smartlist_clear(todo);
+  }
+  smartlist_free(todo);
+}
+
 /**
  * Run the main loop a single time. Return 0 for "exit"; -1 for "exit with
  * error", and 1 for "run this again."
@@ -2358,7 +2740,9 @@ run_main_loop_once(void)
   /* Make it easier to tell whether libevent failure is our fault or not. */
   errno = 0;
 #endif
-  /* All active linked conns should get their read events activated. */
+  /* Hand data across linked connections directly, and then have libevent
+   * activate the read events of any that are still active. */
+  run_linked_connection_handoffs();
   SMARTLIST_FOREACH(active_linked_connection_lst, connection_t *, conn,
                     event_active(conn->read_event, EV_READ, 1));
   called_loop_once = smartlist_len(active_linked_connection_lst) ? 1 : 0;
@@ -2500,6 +2884,7 @@ process_signal(int sig)
     }
     case SIGCLEARDNSCACHE:
       addressmap_clear_transient();
+      client_dns_cache_clear();
       control_event_signal(sig);
       break;
     case SIGHEARTBEAT:
@@ -2527,6 +2912,8 @@ dumpmemusage(int severity)
       U64_PRINTF_ARG(rephist_total_alloc), rephist_total_num);
   dump_routerlist_mem_usage(severity);
   dump_cell_pool_usage(severity);
+  dump_circuit_mem_usage(severity);
+  buf_dump_freelist_sizes(severity);
   dump_dns_mem_usage(severity);
   tor_log_mallinfo(severity);
 }
@@ -2612,6 +2999,7 @@ dumpstats(int severity)
 
   cpuworker_log_onionskin_overhead(severity, ONION_HANDSHAKE_TYPE_TAP, "TAP");
   cpuworker_log_onionskin_overhead(severity, ONION_HANDSHAKE_TYPE_NTOR,"ntor");
+  cpuworker_log_reply_stats(severity);
 
   if (now - time_of_process_start >= 0)
     elapsed = now - time_of_process_start;
@@ -2638,6 +3026,7 @@ dumpstats(int severity)
   rend_service_dump_stats(severity);
   dump_pk_ops(severity);
   dump_distinct_digest_count(severity);
+  dump_signature_cache_stats(severity);
 }
 
 /** Called by exit() as we shut down the process.
@@ -2952,19 +3341,26 @@ tor_free_all(int postfork)
   routerlist_free_all();
   networkstatus_free_all();
   addressmap_free_all();
+  client_dns_cache_free_all();
   dirserv_free_all();
+  dir_mirror_throughput_free_all();
   rend_service_free_all();
   rend_cache_free_all();
   rend_service_authorization_free_all();
   rep_hist_free_all();
   dns_free_all();
+  dos_free_all();
   clear_pending_onions();
   circuit_free_all();
+  relay_free_all();
   entry_guards_free_all();
   pt_free_all();
   channel_tls_free_all();
   channel_free_all();
   connection_free_all();
+  buf_freelists_clear();
+  memarea_clear_freelist();
+  timers_shutdown();
   connection_edge_free_all();
   scheduler_free_all();
   nodelist_free_all();
@@ -2974,6 +3370,7 @@ tor_free_all(int postfork)
   control_free_all();
   sandbox_free_getaddrinfo_cache();
   protover_free_all();
+  watchdog_free_all(postfork);
   if (!postfork) {
     config_free_all();
     or_state_free_all();
@@ -2990,11 +3387,21 @@ tor_free_all(int postfork)
   /* stuff in main.c */
 
   smartlist_free(connection_array);
+  {
+    int i;
+    for (i = 0; i <= CONN_TYPE_MAX_; ++i) {
+      smartlist_free(connections_by_type[i]);
+      connections_by_type[i] = NULL;
+    }
+  }
   smartlist_free(closeable_connection_lst);
   smartlist_free(active_linked_connection_lst);
   periodic_timer_free(second_timer);
   teardown_periodic_events();
   periodic_timer_free(refill_timer);
+  pubsub_set_deferred_scheduler(NULL);
+  tor_event_free(pubsub_flush_event);
+  pubsub_flush_event = NULL;
 
   if (!postfork) {
     release_lockfile();
@@ -3031,8 +3438,12 @@ tor_cleanup(void)
     }
     if (accounting_is_enabled(options))
       accounting_record_bandwidth_usage(now, get_or_state());
+    /* We won't wait for the cpuworkers: finish any queued writes here, and
+     * do the ones below synchronously. */
+    file_writes_flush_and_set_synchronous();
     or_state_mark_dirty(get_or_state(), 0); /* force an immediate save. */
     or_state_save(now);
+    rend_cache_client_save(now);
     if (authdir_mode(options)) {
       sr_save_and_cleanup();
     }
@@ -3193,6 +3604,7 @@ sandbox_init_filter(void)
   OPEN_DATADIR_SUFFIX("cached-extrainfo", ".tmp");
   OPEN_DATADIR_SUFFIX("cached-extrainfo.new", ".tmp");
   OPEN_DATADIR("cached-extrainfo.tmp.tmp");
+  OPEN_DATADIR_SUFFIX("cached-rend-client", ".tmp");
   OPEN_DATADIR_SUFFIX("state", ".tmp");
   OPEN_DATADIR_SUFFIX("sr-state", ".tmp");
   OPEN_DATADIR_SUFFIX("unparseable-desc", ".tmp");
@@ -3246,6 +3658,7 @@ sandbox_init_filter(void)
   RENAME_SUFFIX("cached-extrainfo", ".tmp");
   RENAME_SUFFIX("cached-extrainfo", ".new");
   RENAME_SUFFIX("cached-extrainfo.new", ".tmp");
+  RENAME_SUFFIX("cached-rend-client", ".tmp");
   RENAME_SUFFIX("state", ".tmp");
   RENAME_SUFFIX("sr-state", ".tmp");
   RENAME_SUFFIX("unparseable-desc", ".tmp");
@@ -3427,6 +3840,7 @@ tor_main(int argc, char *argv[])
 
   update_approx_time(time(NULL));
   tor_threads_init();
+  memarea_init_freelists();
   init_logging(0);
 #ifdef USE_DMALLOC
   {
@@ -26,6 +26,7 @@ void add_connection_to_closeable_list(connection_t *conn);
 int connection_is_on_closeable_list(connection_t *conn);
 
 MOCK_DECL(smartlist_t *, get_connection_array, (void));
+smartlist_t *get_connection_array_by_type(int type);
 MOCK_DECL(uint64_t,get_bytes_read,(void));
 MOCK_DECL(uint64_t,get_bytes_written,(void));
 
@@ -46,6 +47,10 @@ MOCK_DECL(void,connection_stop_writing,(connection_t *conn));
 MOCK_DECL(void,connection_start_writing,(connection_t *conn));
 
 void connection_stop_reading_from_linked_conn(connection_t *conn);
+void connection_schedule_housekeeping(connection_t *conn);
+void connection_schedule_housekeeping_now(connection_t *conn);
+void connection_note_read_blocked(connection_t *conn);
+void connection_note_write_blocked(connection_t *conn);
 
 MOCK_DECL(int, connection_count_moribund, (void));
 
@@ -76,6 +81,7 @@ int tor_main(int argc, char *argv[]);
 
 int do_main_loop(void);
 int tor_init(int argc, char **argv);
+void init_connection_lists(void);
 
 extern time_t time_of_process_start;
 extern long stats_n_seconds_working;
@@ -86,10 +92,11 @@ extern int global_relayed_read_bucket;
 extern int global_relayed_write_bucket;
 
 #ifdef MAIN_PRIVATE
-STATIC void init_connection_lists(void);
 STATIC void close_closeable_connections(void);
 STATIC void initialize_periodic_events(void);
 STATIC void teardown_periodic_events(void);
+STATIC time_t connection_housekeeping_deadline(connection_t *conn,
+                                               time_t now);
 #endif
 
 #endif
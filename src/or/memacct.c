@@ -0,0 +1,218 @@
+/* Copyright (c) 2016, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file memacct.c
+ * \brief Account for the memory that each of Tor's subsystems holds.
+ *
+ * Each subsystem that can hold a lot of memory keeps a cheap estimate of
+ * its allocation, and we list them all in one table here.  The table tells
+ * us which allocations count against MaxMemInQueues, and which of those
+ * come from caches that can give memory back when we're low on it, before
+ * we start killing circuits.
+ *
+ * The estimates are approximate: they count the structures and bodies we
+ * allocate, but not malloc overhead, and not memory shared with the mmap'd
+ * cache files.
+ **/
+
+#define TOR_CHANNEL_INTERNAL_
+#include "or.h"
+#include "buffers.h"
+#include "channel.h"
+#include "channeltls.h"
+#include "circuitlist.h"
+#include "config.h"
+#include "connection.h"
+#include "control.h"
+#include "dns.h"
+#include "geoip.h"
+#include "memacct.h"
+#include "microdesc.h"
+#include "nodelist.h"
+#include "relay.h"
+#include "rendcache.h"
+#include "replaycache.h"
+#include "routerlist.h"
+#include "torgzip.h"
+
+/** Add lines to <b>lines</b> about our mapped cache files: how big they
+ * are, how much of them is in memory, and how often we have waited on the
+ * disk for a page of memory. */
+static void
+memacct_add_mmap_lines(smartlist_t *lines)
+{
+  smartlist_t *mmaps = smartlist_new();
+  const tor_mmap_t *md_mmap = microdesc_cache_get_mmap();
+  size_t mapped = 0, resident = 0;
+  int resident_known = 1;
+  uint64_t faults;
+
+  router_get_store_mmaps(mmaps);
+  if (md_mmap)
+    smartlist_add(mmaps, (void*)md_mmap);
+  SMARTLIST_FOREACH_BEGIN(mmaps, const tor_mmap_t *, mm) {
+    size_t n;
+    mapped += mm->size;
+    if (tor_mmap_get_resident(mm, &n) < 0)
+      resident_known = 0;
+    else
+      resident += n;
+  } SMARTLIST_FOREACH_END(mm);
+  smartlist_free(mmaps);
+
+  smartlist_add_asprintf(lines, "cache-files-mapped=%lu",
+                         (unsigned long)mapped);
+  if (resident_known)
+    smartlist_add_asprintf(lines, "cache-files-resident=%lu",
+                           (unsigned long)resident);
+  if (tor_get_major_page_faults(&faults) == 0)
+    smartlist_add_asprintf(lines, "major-page-faults="U64_FORMAT,
+                           U64_PRINTF_ARG(faults));
+}
+
+/** Return the approximate number of bytes held by our circuit
+ * structures, not counting their cell queues. */
+static size_t
+circuits_get_total_allocation(void)
+{
+  size_t total = 0;
+  SMARTLIST_FOREACH(circuit_get_global_list(), const circuit_t *, circ,
+    total += CIRCUIT_IS_ORIGIN(circ) ? sizeof(origin_circuit_t)
+                                     : sizeof(or_circuit_t));
+  return total;
+}
+
+/** Return the approximate number of bytes held by our channel
+ * structures.  (All our channels are TLS channels.) */
+static size_t
+channels_get_total_allocation(void)
+{
+  const smartlist_t *chans = channel_list_get_all();
+  return chans ? smartlist_len(chans) * sizeof(channel_tls_t) : 0;
+}
+
+/** Return the approximate number of bytes held by our node_t
+ * structures. */
+static size_t
+nodelist_get_total_allocation(void)
+{
+  return smartlist_len(nodelist_get_list()) * sizeof(node_t);
+}
+
+/** One subsystem whose memory we account for. */
+typedef struct memacct_entry_t {
+  /** Name of the subsystem, as used in the "memory/breakdown" GETINFO
+   * key. */
+  const char *name;
+  /** Function to return the subsystem's current allocation. */
+  size_t (*get_allocation)(void);
+  /** If nonnull, a function to free at least the given number of bytes
+   * from this subsystem when we're low on memory, least valuable data
+   * first; it returns the number of bytes freed. */
+  size_t (*handle_oom)(time_t now, size_t min_remove_bytes);
+  /** True iff this allocation counts against MaxMemInQueues. */
+  int counts_toward_limit;
+} memacct_entry_t;
+
+/** Every subsystem we account for, indexed by memacct_category_t. */
+static const memacct_entry_t memacct_table[MEMACCT_N_CATEGORIES] = {
+  { "cell-queues", cell_queues_get_total_allocation, NULL, 1 },
+  { "buffers", buf_get_total_allocation, NULL, 1 },
+  { "buffer-freelists", buf_get_freelist_allocation, NULL, 1 },
+  { "compression", tor_zlib_get_total_allocation, NULL, 1 },
+  { "rend-cache", rend_cache_get_total_allocation,
+    rend_cache_clean_v2_descs_as_dir, 1 },
+  { "dns-cache", dns_cache_get_total_allocation, dns_cache_handle_oom, 1 },
+  { "geoip-clients", geoip_client_cache_total_allocation,
+    geoip_client_cache_handle_oom, 1 },
+  { "circuits", circuits_get_total_allocation, NULL, 0 },
+  { "channels", channels_get_total_allocation, NULL, 0 },
+  { "connections", connection_get_total_allocation, NULL, 0 },
+  { "nodelist", nodelist_get_total_allocation, NULL, 0 },
+  { "microdescs", microdesc_cache_get_total_allocation, NULL, 0 },
+  { "routerlist", routerlist_get_total_allocation, NULL, 0 },
+  { "controller-events", control_get_queued_event_allocation, NULL, 0 },
+  { "replay-caches", replaycache_get_total_allocation, NULL, 0 },
+};
+
+/** Return the name of the subsystem <b>cat</b>. */
+const char *
+memacct_get_name(memacct_category_t cat)
+{
+  tor_assert((int)cat >= 0 && cat < MEMACCT_N_CATEGORIES);
+  return memacct_table[cat].name;
+}
+
+/** Return the approximate number of bytes that subsystem <b>cat</b> is
+ * holding. */
+size_t
+memacct_get_allocation(memacct_category_t cat)
+{
+  tor_assert((int)cat >= 0 && cat < MEMACCT_N_CATEGORIES);
+  return memacct_table[cat].get_allocation();
+}
+
+/** Return the approximate number of bytes held by all the subsystems that
+ * count against MaxMemInQueues. */
+size_t
+memacct_get_limited_allocation(void)
+{
+  size_t total = 0;
+  int i;
+  for (i = 0; i < MEMACCT_N_CATEGORIES; ++i) {
+    if (memacct_table[i].counts_toward_limit)
+      total += memacct_table[i].get_allocation();
+  }
+  return total;
+}
+
+/** We're low on memory, with a limit of <b>limit</b> bytes.  Every cache
+ * that can give memory back and is using more than a fifth of that limit
+ * must shrink to a tenth of it.  Return the number of bytes freed. */
+size_t
+memacct_handle_oom(time_t now, uint64_t limit)
+{
+  size_t freed = 0;
+  int i;
+  for (i = 0; i < MEMACCT_N_CATEGORIES; ++i) {
+    const memacct_entry_t *ent = &memacct_table[i];
+    size_t alloc;
+    if (!ent->handle_oom)
+      continue;
+    alloc = ent->get_allocation();
+    if (alloc > limit / 5)
+      freed += ent->handle_oom(now, alloc - (size_t)(limit / 10));
+  }
+  return freed;
+}
+
+/** Return a newly allocated string listing how many bytes each subsystem
+ * holds, for the "memory/breakdown" GETINFO key. */
+char *
+memacct_format_breakdown(void)
+{
+  smartlist_t *lines = smartlist_new();
+  size_t total = 0, limited = 0;
+  char *result;
+  int i;
+
+  for (i = 0; i < MEMACCT_N_CATEGORIES; ++i) {
+    size_t n = memacct_table[i].get_allocation();
+    total += n;
+    if (memacct_table[i].counts_toward_limit)
+      limited += n;
+    smartlist_add_asprintf(lines, "%s=%lu", memacct_table[i].name,
+                           (unsigned long)n);
+  }
+  smartlist_add_asprintf(lines, "total=%lu", (unsigned long)total);
+  smartlist_add_asprintf(lines, "max-mem-in-queues-total=%lu",
+                         (unsigned long)limited);
+  memacct_add_mmap_lines(lines);
+
+  result = smartlist_join_strings(lines, "\n", 0, NULL);
+  SMARTLIST_FOREACH(lines, char *, cp, tor_free(cp));
+  smartlist_free(lines);
+  return result;
+}
+
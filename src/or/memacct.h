@@ -0,0 +1,39 @@
+/* Copyright (c) 2016, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file memacct.h
+ * \brief Header file for memacct.c.
+ **/
+
+#ifndef TOR_MEMACCT_H
+#define TOR_MEMACCT_H
+
+/** Subsystems whose memory we account for. */
+typedef enum memacct_category_t {
+  MEMACCT_CELL_QUEUES = 0,
+  MEMACCT_BUFFERS,
+  MEMACCT_BUFFER_FREELISTS,
+  MEMACCT_COMPRESSION,
+  MEMACCT_REND_CACHE,
+  MEMACCT_DNS_CACHE,
+  MEMACCT_GEOIP_CLIENTS,
+  MEMACCT_CIRCUITS,
+  MEMACCT_CHANNELS,
+  MEMACCT_CONNECTIONS,
+  MEMACCT_NODELIST,
+  MEMACCT_MICRODESCS,
+  MEMACCT_ROUTERLIST,
+  MEMACCT_CONTROLLER_EVENTS,
+  MEMACCT_REPLAY_CACHES,
+} memacct_category_t;
+#define MEMACCT_N_CATEGORIES (MEMACCT_REPLAY_CACHES + 1)
+
+const char *memacct_get_name(memacct_category_t cat);
+size_t memacct_get_allocation(memacct_category_t cat);
+size_t memacct_get_limited_allocation(void);
+size_t memacct_handle_oom(time_t now, uint64_t limit);
+char *memacct_format_breakdown(void);
+
+#endif
+
@@ -149,6 +149,13 @@ get_microdesc_cache_noload(void)
   return the_microdesc_cache;
 }
 
+/** Return the mapping of the microdescriptor cache file, if we have one. */
+const tor_mmap_t *
+microdesc_cache_get_mmap(void)
+{
+  return the_microdesc_cache ? the_microdesc_cache->cache_content : NULL;
+}
+
 /* There are three sources of microdescriptors:
    1) Generated by us while acting as a directory authority.
    2) Loaded from the cache on disk.
@@ -180,9 +187,15 @@ microdescs_add_to_cache(microdesc_cache_t *cache,
   const int allow_annotations = (where != SAVED_NOWHERE);
   smartlist_t *invalid_digests = smartlist_new();
 
-  descriptors = microdescs_parse_from_string(s, eos,
-                                             allow_annotations,
-                                             where, invalid_digests);
+  if (where == SAVED_IN_CACHE) {
+    /* The cache file holds only microdescs that we parsed before we stored
+     * them; we can wait to parse them again until we actually use them. */
+    descriptors = microdescs_parse_lazily_from_string(s, eos, where);
+  } else {
+    descriptors = microdescs_parse_from_string(s, eos,
+                                               allow_annotations,
+                                               where, invalid_digests);
+  }
   if (listed_at != (time_t)-1) {
     SMARTLIST_FOREACH(descriptors, microdesc_t *, md,
                       md->last_listed = listed_at);
@@ -382,12 +395,14 @@ microdesc_cache_reload(microdesc_cache_t *cache)
 
   mm = cache->cache_content = tor_mmap_file(cache->cache_fname);
   if (mm) {
+    cache_file_mmap_advise(mm, 1);
     added = microdescs_add_to_cache(cache, mm->data, mm->data+mm->size,
                                     SAVED_IN_CACHE, 0, -1, NULL);
     if (added) {
       total += smartlist_len(added);
       smartlist_free(added);
     }
+    cache_file_mmap_advise(mm, 0);
   }
 
   journal_content = read_file_to_str(cache->journal_fname,
@@ -441,7 +456,7 @@ microdesc_cache_clean(microdesc_cache_t *cache, time_t cutoff, int force)
   for (mdp = HT_START(microdesc_map, &cache->map); mdp != NULL; ) {
     const int is_old = (*mdp)->last_listed < cutoff;
     const unsigned held_by_nodes = (*mdp)->held_by_nodes;
-    if (is_old && !held_by_nodes) {
+    if ((is_old || (*mdp)->unparseable) && !held_by_nodes) {
       ++dropped;
       victim = *mdp;
       mdp = HT_NEXT_RMV(microdesc_map, &cache->map, mdp);
@@ -650,6 +665,7 @@ microdesc_cache_rebuild(microdesc_cache_t *cache, int force)
   }
 
   cache->cache_content = tor_mmap_file(cache->cache_fname);
+  cache_file_mmap_advise(cache->cache_content, 0);
 
   if (!cache->cache_content && smartlist_len(wrote)) {
     log_err(LD_DIR, "Couldn't map file that we just wrote to %s!",
@@ -747,6 +763,8 @@ microdesc_free_(microdesc_t *md, const char *fname, int lineno)
           node->md = NULL;
         }
       });
+    if (found)
+      nodelist_invalidate_node_summaries();
     if (found) {
       log_warn(LD_BUG, "microdesc_free() called from %s:%d, but md was still "
                "referenced %d node(s); held_by_nodes == %u, ht_badness == %d",
@@ -764,6 +782,7 @@ microdesc_free_(microdesc_t *md, const char *fname, int lineno)
 
   if (md->onion_pkey)
     crypto_pk_free(md->onion_pkey);
+  tor_free(md->onion_pkey_der);
   tor_free(md->onion_curve25519_pkey);
   tor_free(md->ed25519_identity_pkey);
   if (md->body && md->saved_location != SAVED_IN_CACHE)
@@ -804,6 +823,43 @@ microdesc_cache_lookup_by_digest256(microdesc_cache_t *cache, const char *d)
   return md;
 }
 
+/** Make sure that the fields of <b>md</b> are set, parsing them from its
+ * body if we loaded it lazily from disk.  Return 0 if <b>md</b> is usable,
+ * and -1 if it turned out to be unparseable. */
+int
+microdesc_ensure_parsed(microdesc_t *md)
+{
+  if (PREDICT_LIKELY(! md->body_unparsed))
+    return 0;
+  if (md->unparseable)
+    return -1;
+  if (microdesc_parse_fields(md) < 0) {
+    log_warn(LD_DIR, "Couldn't parse a microdescriptor from our cache; "
+             "discarding it.");
+    md->unparseable = 1;
+    return -1;
+  }
+  return 0;
+}
+
+/** Return the RSA onion key of <b>md</b>, decoding it first if we haven't
+ * done so yet.  Return NULL if <b>md</b> has no usable onion key. */
+crypto_pk_t *
+microdesc_get_onion_pkey(microdesc_t *md)
+{
+  if (PREDICT_LIKELY(md->onion_pkey != NULL))
+    return md->onion_pkey;
+  if (microdesc_ensure_parsed(md) < 0 || !md->onion_pkey_der)
+    return md->onion_pkey;
+  md->onion_pkey = crypto_pk_asn1_decode(md->onion_pkey_der,
+                                         md->onion_pkey_der_len);
+  if (!md->onion_pkey)
+    log_warn(LD_BUG, "Couldn't decode an onion key that we parsed earlier.");
+  tor_free(md->onion_pkey_der);
+  md->onion_pkey_der_len = 0;
+  return md->onion_pkey;
+}
+
 /** Return the mean size of decriptors added to <b>cache</b> since it was last
  * cleared.  Used to estimate the size of large downloads. */
 size_t
@@ -816,6 +872,23 @@ microdesc_average_size(microdesc_cache_t *cache)
   return (size_t)(cache->total_len_seen / cache->n_seen);
 }
 
+/** Return the approximate number of heap bytes held by the microdescriptor
+ * cache.  Bodies that live in the mmap'd cache file don't count. */
+size_t
+microdesc_cache_get_total_allocation(void)
+{
+  microdesc_cache_t *cache = get_microdesc_cache_noload();
+  microdesc_t **mdp;
+  size_t total = 0;
+
+  HT_FOREACH(mdp, microdesc_map, &cache->map) {
+    total += sizeof(microdesc_t);
+    if ((*mdp)->saved_location != SAVED_IN_CACHE)
+      total += (*mdp)->bodylen;
+  }
+  return total;
+}
+
 /** Return a smartlist of all the sha256 digest of the microdescriptors that
  * are listed in <b>ns</b> but not present in <b>cache</b>. Returns pointers
  * to internals of <b>ns</b>; you should not free the members of the resulting
@@ -828,7 +901,9 @@ microdesc_list_missing_digest256(networkstatus_t *ns, microdesc_cache_t *cache,
   time_t now = time(NULL);
   tor_assert(ns->flavor == FLAV_MICRODESC);
   SMARTLIST_FOREACH_BEGIN(ns->routerstatus_list, routerstatus_t *, rs) {
-    if (microdesc_cache_lookup_by_digest256(cache, rs->descriptor_digest))
+    const microdesc_t *md =
+      microdesc_cache_lookup_by_digest256(cache, rs->descriptor_digest);
+    if (md && !md->unparseable)
       continue;
     if (downloadable_only &&
         !download_status_is_ready(&rs->dl_status, now,
@@ -873,6 +948,8 @@ update_microdesc_downloads(time_t now)
   if (!we_fetch_microdescriptors(options))
     return;
 
+  relaunch_straggling_microdesc_downloads();
+
   pending = digest256map_new();
   list_pending_microdesc_downloads(pending);
 
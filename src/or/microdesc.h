@@ -13,6 +13,7 @@
 #define TOR_MICRODESC_H
 
 microdesc_cache_t *get_microdesc_cache(void);
+const tor_mmap_t *microdesc_cache_get_mmap(void);
 
 void microdesc_check_counts(void);
 
@@ -31,8 +32,11 @@ void microdesc_cache_clear(microdesc_cache_t *cache);
 
 microdesc_t *microdesc_cache_lookup_by_digest256(microdesc_cache_t *cache,
                                                  const char *d);
+int microdesc_ensure_parsed(microdesc_t *md);
+crypto_pk_t *microdesc_get_onion_pkey(microdesc_t *md);
 
 size_t microdesc_average_size(microdesc_cache_t *cache);
+size_t microdesc_cache_get_total_allocation(void);
 
 smartlist_t *microdesc_list_missing_digest256(networkstatus_t *ns,
                                               microdesc_cache_t *cache,
@@ -19,6 +19,7 @@
 #include "config.h"
 #include "connection.h"
 #include "connection_or.h"
+#include "consdiff.h"
 #include "control.h"
 #include "directory.h"
 #include "dirserv.h"
@@ -106,6 +107,11 @@ static download_status_t
       DL_SCHED_INCREMENT_ATTEMPT, DL_SCHED_RANDOM_EXPONENTIAL, 0, 0 },
   };
 
+/** For each flavor of consensus, true iff a consensus diff that we fetched
+ * failed to apply.  While this is set, we ask for full consensuses of that
+ * flavor rather than diffs. */
+static int consensus_diff_failed[N_CONSENSUS_FLAVORS];
+
 /** True iff we have logged a warning about this OR's version being older than
  * listed by the authorities. */
 static int have_warned_about_old_version = 0;
@@ -324,6 +330,15 @@ networkstatus_vote_free(networkstatus_t *ns)
   }
 
   digestmap_free(ns->desc_digest_map, NULL);
+  if (ns->id_index) {
+    tor_free(ns->id_index->slots);
+    tor_free(ns->id_index);
+  }
+  if (ns->hsdir_ring) {
+    tor_free(ns->hsdir_ring->ids);
+    tor_free(ns->hsdir_ring->rs_idx);
+    tor_free(ns->hsdir_ring);
+  }
 
   if (ns->sr_info.commits) {
     SMARTLIST_FOREACH(ns->sr_info.commits, sr_commit_t *, c,
@@ -363,8 +378,6 @@ networkstatus_check_document_signature(const networkstatus_t *consensus,
 {
   char key_digest[DIGEST_LEN];
   const int dlen = sig->alg == DIGEST_SHA1 ? DIGEST_LEN : DIGEST256_LEN;
-  char *signed_digest;
-  size_t signed_digest_len;
 
   if (crypto_pk_get_digest(cert->signing_key, key_digest)<0)
     return -1;
@@ -384,20 +397,14 @@ networkstatus_check_document_signature(const networkstatus_t *consensus,
     return 0;
   }
 
-  signed_digest_len = crypto_pk_keysize(cert->signing_key);
-  signed_digest = tor_malloc(signed_digest_len);
-  if (crypto_pk_public_checksig(cert->signing_key,
-                                signed_digest,
-                                signed_digest_len,
-                                sig->signature,
-                                sig->signature_len) < dlen ||
-      tor_memneq(signed_digest, consensus->digests.d[sig->alg], dlen)) {
+  if (check_signed_digest(cert->signing_key,
+                          consensus->digests.d[sig->alg], dlen,
+                          sig->signature, sig->signature_len) < 0) {
     log_warn(LD_DIR, "Got a bad signature on a networkstatus vote");
     sig->bad_signature = 1;
   } else {
     sig->good_signature = 1;
   }
-  tor_free(signed_digest);
   return 0;
 }
 
@@ -610,12 +617,60 @@ compare_digest_to_vote_routerstatus_entry(const void *_key,
   return tor_memcmp(key, vrs->status.identity_digest, DIGEST_LEN);
 }
 
+/** Return the identity index of the consensus <b>ns</b>, building it if
+ * we haven't yet.  The index has at least twice as many slots as there are
+ * routerstatuses, so probe sequences stay short. */
+static const rs_id_index_t *
+networkstatus_get_id_index(networkstatus_t *ns)
+{
+  if (!ns->id_index) {
+    rs_id_index_t *index = tor_malloc_zero(sizeof(rs_id_index_t));
+    unsigned n_slots = 16;
+    while (n_slots < 2 * (unsigned)smartlist_len(ns->routerstatus_list))
+      n_slots <<= 1;
+    index->mask = n_slots - 1;
+    index->slots = tor_calloc(n_slots, sizeof(int));
+    SMARTLIST_FOREACH_BEGIN(ns->routerstatus_list,
+                            const routerstatus_t *, rs) {
+      unsigned i = (unsigned) siphash24g(rs->identity_digest, DIGEST_LEN);
+      for (i &= index->mask; index->slots[i]; i = (i + 1) & index->mask)
+        ;
+      index->slots[i] = rs_sl_idx + 1;
+    } SMARTLIST_FOREACH_END(rs);
+    ns->id_index = index;
+  }
+  return ns->id_index;
+}
+
+/** Return the index in the routerstatus_list of the consensus <b>ns</b> of
+ * the entry whose identity digest is <b>digest</b>, or -1 if there is
+ * none. */
+static int
+networkstatus_consensus_find_idx(networkstatus_t *ns, const char *digest)
+{
+  const rs_id_index_t *index = networkstatus_get_id_index(ns);
+  unsigned i = (unsigned) siphash24g(digest, DIGEST_LEN) & index->mask;
+  int slot;
+  while ((slot = index->slots[i])) {
+    const routerstatus_t *rs = smartlist_get(ns->routerstatus_list, slot-1);
+    if (fast_memeq(rs->identity_digest, digest, DIGEST_LEN))
+      return slot - 1;
+    i = (i + 1) & index->mask;
+  }
+  return -1;
+}
+
 /** As networkstatus_find_entry, but do not return a const pointer */
 routerstatus_t *
 networkstatus_vote_find_mutable_entry(networkstatus_t *ns, const char *digest)
 {
-  return smartlist_bsearch(ns->routerstatus_list, digest,
-                           compare_digest_to_routerstatus_entry);
+  if (ns->type == NS_TYPE_CONSENSUS) {
+    int idx = networkstatus_consensus_find_idx(ns, digest);
+    return idx < 0 ? NULL : smartlist_get(ns->routerstatus_list, idx);
+  }
+  return smartlist_bsearch_digest(ns->routerstatus_list, digest,
+                                  STRUCT_OFFSET(routerstatus_t,
+                                                identity_digest));
 }
 
 /** Return the entry in <b>ns</b> for the identity digest <b>digest</b>, or
@@ -634,9 +689,18 @@ int
 networkstatus_vote_find_entry_idx(networkstatus_t *ns,
                                   const char *digest, int *found_out)
 {
-  return smartlist_bsearch_idx(ns->routerstatus_list, digest,
-                               compare_digest_to_routerstatus_entry,
-                               found_out);
+  if (ns->type == NS_TYPE_CONSENSUS) {
+    int idx = networkstatus_consensus_find_idx(ns, digest);
+    if (idx >= 0) {
+      *found_out = 1;
+      return idx;
+    }
+    /* Not there; the caller wants to know where it would go. */
+  }
+  return smartlist_bsearch_digest_idx(ns->routerstatus_list, digest,
+                                      STRUCT_OFFSET(routerstatus_t,
+                                                    identity_digest),
+                                      found_out);
 }
 
 /** As router_get_consensus_status_by_descriptor_digest, but does not return
@@ -661,6 +725,32 @@ router_get_mutable_consensus_status_by_descriptor_digest,(
   return digestmap_get(consensus->desc_digest_map, digest);
 }
 
+/** Return the HSDirs of <b>consensus</b>, in identity order.  The ring is
+ * built on first use and kept until the consensus is freed. */
+const hsdir_ring_t *
+networkstatus_get_hsdir_ring(networkstatus_t *consensus)
+{
+  tor_assert(consensus);
+  if (!consensus->hsdir_ring) {
+    hsdir_ring_t *ring = tor_malloc_zero(sizeof(hsdir_ring_t));
+    int n = 0;
+    SMARTLIST_FOREACH(consensus->routerstatus_list, const routerstatus_t *,
+                      rs, n += rs->is_hs_dir);
+    ring->ids = tor_malloc(MAX(n, 1) * DIGEST_LEN);
+    ring->rs_idx = tor_malloc(MAX(n, 1) * sizeof(int));
+    SMARTLIST_FOREACH_BEGIN(consensus->routerstatus_list,
+                            const routerstatus_t *, rs) {
+      if (!rs->is_hs_dir)
+        continue;
+      memcpy(ring->ids + ring->n_hsdirs * DIGEST_LEN,
+             rs->identity_digest, DIGEST_LEN);
+      ring->rs_idx[ring->n_hsdirs++] = rs_sl_idx;
+    } SMARTLIST_FOREACH_END(rs);
+    consensus->hsdir_ring = ring;
+  }
+  return consensus->hsdir_ring;
+}
+
 /** Return the consensus view of the status of the router whose current
  * <i>descriptor</i> digest in <b>consensus</b> is <b>digest</b>, or NULL if
  * no such router is known. */
@@ -728,12 +818,10 @@ router_get_dl_status_by_descriptor_digest,(const char *d))
 routerstatus_t *
 router_get_mutable_consensus_status_by_id(const char *digest)
 {
-  const networkstatus_t *ns = networkstatus_get_latest_consensus();
+  networkstatus_t *ns = networkstatus_get_latest_consensus();
   if (!ns)
     return NULL;
-  smartlist_t *rslist = ns->routerstatus_list;
-  return smartlist_bsearch(rslist, digest,
-                           compare_digest_to_routerstatus_entry);
+  return networkstatus_vote_find_mutable_entry(ns, digest);
 }
 
 /** Return the consensus view of the status of the router whose identity
@@ -1612,6 +1700,72 @@ handle_missing_protocol_warning(const networkstatus_t *c,
     handle_missing_protocol_warning_impl(c, 1);
 }
 
+/** Return the text of the current consensus of flavor <b>flav</b>, as a
+ * newly allocated string, or NULL if we don't have it.  Directory caches
+ * keep it in memory; everyone else reads it back from the disk cache. */
+static char *
+networkstatus_get_consensus_text(int flav)
+{
+  const char *flavor = networkstatus_get_flavor_name(flav);
+  cached_dir_t *cached = dirserv_get_consensus(flavor);
+  char *fname, *text;
+  char buf[128];
+
+  if (cached)
+    return tor_strdup(cached->dir);
+
+  if (flav == FLAV_NS) {
+    fname = get_datadir_fname("cached-consensus");
+  } else {
+    tor_snprintf(buf, sizeof(buf), "cached-%s-consensus", flavor);
+    fname = get_datadir_fname(buf);
+  }
+  text = read_file_to_str(fname, RFTS_IGNORE_MISSING, NULL);
+  tor_free(fname);
+  return text;
+}
+
+/** If we would like a diff from our current consensus of flavor
+ * <b>flavor</b> rather than a whole new consensus, set
+ * <b>digest_out</b> to the SHA256 digest of the signed part of our current
+ * consensus and return 0.  Otherwise return -1. */
+int
+networkstatus_get_diff_base_digest(const char *flavor, uint8_t *digest_out)
+{
+  int flav = networkstatus_parse_flavor_name(flavor);
+  const networkstatus_t *c;
+
+  if (flav < 0 || consensus_diff_failed[flav])
+    return -1;
+  c = networkstatus_get_latest_consensus_by_flavor(flav);
+  if (!c)
+    return -1;
+  memcpy(digest_out, c->digests.d[DIGEST_SHA256], DIGEST256_LEN);
+  return 0;
+}
+
+/** Apply the consensus diff <b>diff</b> to our current consensus of flavor
+ * <b>flav</b>, and return the resulting consensus as a newly allocated
+ * string.  On failure, remember not to ask for diffs of this flavor until we
+ * have loaded a full consensus, and return NULL. */
+static char *
+networkstatus_apply_consensus_diff(const char *diff, int flav)
+{
+  char *base = networkstatus_get_consensus_text(flav);
+  char *result = NULL;
+
+  if (base)
+    result = consdiff_apply_diff(base, diff);
+  if (!result) {
+    log_info(LD_DIR, "Couldn't apply a %s consensus diff to the consensus "
+             "we have. Asking for the whole thing next time.",
+             networkstatus_get_flavor_name(flav));
+    consensus_diff_failed[flav] = 1;
+  }
+  tor_free(base);
+  return result;
+}
+
 /** Try to replace the current cached v3 networkstatus with the one in
  * <b>consensus</b>.  If we don't have enough certificates to validate it,
  * store it in consensus_waiting_for_certs and launch a certificate fetch.
@@ -1627,6 +1781,9 @@ handle_missing_protocol_warning(const networkstatus_t *c,
  * we've just successfully retrieved a consensus or certificates from, so try
  * it first to fetch any missing certificates.
  *
+ * If <b>consensus</b> is a consensus diff, apply it to our current consensus
+ * of the same flavor first.
+ *
  * Return 0 on success, <0 on failure.  On failure, caller should increment
  * the failure count as appropriate.
  *
@@ -1654,8 +1811,9 @@ networkstatus_set_current_consensus(const char *consensus,
   consensus_waiting_for_certs_t *waiting = NULL;
   time_t current_valid_after = 0;
   int free_consensus = 1; /* Free 'c' at the end of the function */
-  int old_ewma_enabled;
+  circuitmux_policy_t *old_cmux_policy;
   int checked_protocols_already = 0;
+  char *expanded = NULL;
 
   if (flav < 0) {
     /* XXXX we don't handle unrecognized flavors yet. */
@@ -1663,6 +1821,15 @@ networkstatus_set_current_consensus(const char *consensus,
     return -2;
   }
 
+  if (consdiff_looks_like_diff(consensus)) {
+    expanded = networkstatus_apply_consensus_diff(consensus, flav);
+    if (!expanded) {
+      result = -2;
+      goto done;
+    }
+    consensus = expanded;
+  }
+
   /* Make sure it's parseable. */
   c = networkstatus_parse_vote_from_string(consensus, NULL, NS_TYPE_CONSENSUS);
   if (!c) {
@@ -1870,15 +2037,12 @@ networkstatus_set_current_consensus(const char *consensus,
     routerstatus_list_update_named_server_map();
 
     /* Update ewma and adjust policy if needed; first cache the old value */
-    old_ewma_enabled = cell_ewma_enabled();
+    old_cmux_policy = channel_get_default_cmux_policy();
     /* Change the cell EWMA settings */
     cell_ewma_set_scale_factor(options, c);
-    /* If we just enabled ewma, set the cmux policy on all active channels */
-    if (cell_ewma_enabled() && !old_ewma_enabled) {
-      channel_set_cmux_policy_everywhere(&ewma_policy);
-    } else if (!cell_ewma_enabled() && old_ewma_enabled) {
-      /* Turn it off everywhere */
-      channel_set_cmux_policy_everywhere(NULL);
+    /* If that changed the cmux policy, set it on all active channels */
+    if (channel_get_default_cmux_policy() != old_cmux_policy) {
+      channel_set_cmux_policy_everywhere(channel_get_default_cmux_policy());
     }
 
     /* XXXX this call might be unnecessary here: can changing the
@@ -1928,12 +2092,16 @@ networkstatus_set_current_consensus(const char *consensus,
 
   router_dir_info_changed();
 
+  /* We have a full consensus again; diffs from it should work. */
+  consensus_diff_failed[flav] = 0;
+
   result = 0;
  done:
   if (free_consensus)
     networkstatus_vote_free(c);
   tor_free(consensus_fname);
   tor_free(unverified_fname);
+  tor_free(expanded);
   return result;
 }
 
@@ -2519,5 +2687,7 @@ networkstatus_free_all(void)
 
   strmap_free(named_server_map, tor_free_);
   strmap_free(unnamed_server_map, NULL);
+  named_server_map = NULL;
+  unnamed_server_map = NULL;
 }
 
@@ -37,6 +37,8 @@ routerstatus_t *networkstatus_vote_find_mutable_entry(networkstatus_t *ns,
                                               const char *digest);
 int networkstatus_vote_find_entry_idx(networkstatus_t *ns,
                                       const char *digest, int *found_out);
+const hsdir_ring_t *networkstatus_get_hsdir_ring(
+                                               networkstatus_t *consensus);
 
 MOCK_DECL(download_status_t *,
   networkstatus_get_dl_status_by_flavor,
@@ -66,6 +68,8 @@ const routerstatus_t *router_get_consensus_status_by_nickname(
                                    int warn_if_unnamed);
 const char *networkstatus_get_router_digest_by_nickname(const char *nickname);
 int networkstatus_nickname_is_unnamed(const char *nickname);
+int networkstatus_get_diff_base_digest(const char *flavor,
+                                       uint8_t *digest_out);
 void networkstatus_consensus_download_failed(int status_code,
                                              const char *flavname);
 void update_consensus_networkstatus_fetch_time(time_t now);
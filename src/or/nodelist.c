@@ -31,6 +31,7 @@
 #include <string.h>
 
 static void nodelist_drop_node(node_t *node, int remove_from_ht);
+static void nodelist_clear_families(void);
 static void node_free(node_t *node);
 
 /** count_usable_descriptors counts descriptors with these flag(s)
@@ -53,6 +54,10 @@ static void update_router_have_minimum_dir_info(void);
 static double get_frac_paths_needed_for_circs(const or_options_t *options,
                                               const networkstatus_t *ns);
 
+/** How many of the routersets in our options do we precompute node
+ * membership for? */
+#define NODELIST_N_MEMBER_SETS 5
+
 /** A nodelist_t holds a node_t object for every router we're "willing to use
  * for something".  Specifically, it should hold a node_t for every node that
  * is currently in the routerlist, or currently in the consensus we're using.
@@ -62,6 +67,30 @@ typedef struct nodelist_t {
   smartlist_t *nodes;
   /* Hash table to map from node ID digest to node. */
   HT_HEAD(nodelist_map, node_t) nodes_by_id;
+  /* Incremented each time we set a new consensus; a node whose
+   * consensus_gen matches this value is listed in the current consensus. */
+  unsigned int consensus_gen;
+
+  /* Packed NODE_SUMMARY_* bits for each node, indexed by nodelist_idx. */
+  uint8_t *summaries;
+  /* The /16 network of each node's primary IPv4 address, indexed by
+   * nodelist_idx.  Only meaningful for nodes with NODE_SUMMARY_HAS_IPV4. */
+  uint16_t *subnets;
+  /* For each node, indexed by nodelist_idx, the list of nodes that agree
+   * with it about being in the same family, or NULL if we haven't resolved
+   * it yet. */
+  smartlist_t **families;
+  /* For each node, indexed by nodelist_idx, a bit for each routerset in
+   * member_sets, set iff the node is in that routerset. */
+  uint8_t *member_bits;
+  /* The routersets from our options that member_bits describes.  Only valid
+   * while summaries_dirty is false. */
+  const routerset_t *member_sets[NODELIST_N_MEMBER_SETS];
+  /* Number of elements allocated for summaries, subnets, families, and
+   * member_bits. */
+  int summaries_alloc;
+  /* True iff summaries needs to be recomputed before it is next used. */
+  int summaries_dirty;
 
 } nodelist_t;
 
@@ -136,6 +165,7 @@ node_get_or_create(const char *identity_digest)
 
   smartlist_add(the_nodelist->nodes, node);
   node->nodelist_idx = smartlist_len(the_nodelist->nodes) - 1;
+  the_nodelist->summaries_dirty = 1;
 
   node->country = -1;
 
@@ -147,9 +177,25 @@ static void
 node_addrs_changed(node_t *node)
 {
   node->last_reachable = node->last_reachable6 = 0;
+  node->last_reachability_test = 0;
+  node->reachability_test_started_msec = 0;
   node->country = -1;
 }
 
+/** Incremented whenever a node's name might have changed: see
+ * nodelist_get_names_generation(). */
+static unsigned int nodelist_names_gen = 0;
+
+/** Return a number that changes whenever the names we give nodes might
+ * have changed, because a node got a new routerinfo or consensus entry or
+ * went away.  Callers who cache strings built from node names can compare
+ * this to decide whether to rebuild them. */
+unsigned int
+nodelist_get_names_generation(void)
+{
+  return nodelist_names_gen;
+}
+
 /** Add <b>ri</b> to an appropriate node in the nodelist.  If we replace an
  * old routerinfo, and <b>ri_old_out</b> is not NULL, set *<b>ri_old_out</b>
  * to the previous routerinfo.
@@ -163,6 +209,7 @@ nodelist_set_routerinfo(routerinfo_t *ri, routerinfo_t **ri_old_out)
   tor_assert(ri);
 
   init_nodelist();
+  ++nodelist_names_gen;
   id_digest = ri->cache_info.identity_digest;
   node = node_get_or_create(id_digest);
 
@@ -178,6 +225,7 @@ nodelist_set_routerinfo(routerinfo_t *ri, routerinfo_t **ri_old_out)
       *ri_old_out = NULL;
   }
   node->ri = ri;
+  the_nodelist->summaries_dirty = 1;
 
   if (node->country == -1)
     node_set_country(node);
@@ -212,37 +260,59 @@ nodelist_add_microdesc(microdesc_t *md)
   rs = router_get_consensus_status_by_descriptor_digest(ns, md->digest);
   if (rs == NULL)
     return NULL;
+  if (microdesc_ensure_parsed(md) < 0)
+    return NULL;
   node = node_get_mutable_by_id(rs->identity_digest);
   if (node) {
     if (node->md)
       node->md->held_by_nodes--;
     node->md = md;
     md->held_by_nodes++;
+    the_nodelist->summaries_dirty = 1;
   }
   return node;
 }
 
+/** Helper: return true iff a node has a usable amount of information*/
+static inline int
+node_is_usable(const node_t *node)
+{
+  return (node->rs) || (node->ri);
+}
+
 /** Tell the nodelist that the current usable consensus is <b>ns</b>.
  * This makes the nodelist change all of the routerstatus entries for
  * the nodes, drop nodes that no longer have enough info to get used,
  * and grab microdescriptors into nodes as appropriate.
+ *
+ * Only the nodes that actually changed are given extra work: we keep
+ * microdescriptors whose digest is unchanged, only redo the GeoIP lookup
+ * for nodes whose address moved, and only consider for removal the nodes
+ * that were not listed in <b>ns</b>.
  */
 void
 nodelist_set_consensus(networkstatus_t *ns)
 {
   const or_options_t *options = get_options();
   int authdir = authdir_mode_v3(options);
+  unsigned int gen;
+  int n_added = 0, n_dropped = 0, n_purged = 0, idx;
 
   init_nodelist();
   if (ns->flavor == FLAV_MICRODESC)
     (void) get_microdesc_cache(); /* Make sure it exists first. */
 
-  SMARTLIST_FOREACH(the_nodelist->nodes, node_t *, node,
-                    node->rs = NULL);
+  gen = ++the_nodelist->consensus_gen;
+  ++nodelist_names_gen;
+  routerlist_clear_bandwidth_choice_cache();
+  the_nodelist->summaries_dirty = 1;
 
   SMARTLIST_FOREACH_BEGIN(ns->routerstatus_list, routerstatus_t *, rs) {
     node_t *node = node_get_or_create(rs->identity_digest);
+    if (! node->rs)
+      ++n_added;
     node->rs = rs;
+    node->consensus_gen = gen;
     if (ns->flavor == FLAV_MICRODESC) {
       if (node->md == NULL ||
           tor_memneq(node->md->digest,rs->descriptor_digest,DIGEST256_LEN)) {
@@ -250,12 +320,15 @@ nodelist_set_consensus(networkstatus_t *ns)
           node->md->held_by_nodes--;
         node->md = microdesc_cache_lookup_by_digest256(NULL,
                                                        rs->descriptor_digest);
+        if (node->md && microdesc_ensure_parsed(node->md) < 0)
+          node->md = NULL;
         if (node->md)
           node->md->held_by_nodes++;
       }
     }
 
-    node_set_country(node);
+    if (node->country == -1 || node->country_addr != rs->addr)
+      node_set_country(node);
 
     /* If we're not an authdir, believe others. */
     if (!authdir) {
@@ -276,32 +349,48 @@ nodelist_set_consensus(networkstatus_t *ns)
 
   } SMARTLIST_FOREACH_END(rs);
 
-  nodelist_purge();
+  /* Now handle the nodes that aren't in this consensus.  Their rs pointers
+   * (if any) pointed into the old consensus, which is already gone.  We walk
+   * backwards so that nodelist_drop_node() only ever moves a node we have
+   * already looked at into the current slot. */
+  for (idx = smartlist_len(the_nodelist->nodes) - 1; idx >= 0; --idx) {
+    node_t *node = smartlist_get(the_nodelist->nodes, idx);
+    if (node->consensus_gen == gen)
+      continue;
+    if (node->rs)
+      ++n_dropped;
+    node->rs = NULL;
+
+    if (node->md) {
+      /* An md is only useful if there is an rs. */
+      node->md->held_by_nodes--;
+      node->md = NULL;
+    }
 
-  if (! authdir) {
-    SMARTLIST_FOREACH_BEGIN(the_nodelist->nodes, node_t *, node) {
-      /* We have no routerstatus for this router. Clear flags so we can skip
-       * it, maybe.*/
-      if (!node->rs) {
-        tor_assert(node->ri); /* if it had only an md, or nothing, purge
-                               * would have removed it. */
-        if (node->ri->purpose == ROUTER_PURPOSE_GENERAL) {
-          /* Clear all flags. */
-          node->is_valid = node->is_running = node->is_hs_dir =
-            node->is_fast = node->is_stable =
-            node->is_possible_guard = node->is_exit =
-            node->is_bad_exit = node->ipv6_preferred = 0;
-        }
-      }
-    } SMARTLIST_FOREACH_END(node);
+    if (! node_is_usable(node)) {
+      nodelist_drop_node(node, 1);
+      node_free(node);
+      ++n_purged;
+      continue;
+    }
+
+    /* We have no routerstatus for this router. Clear flags so we can skip
+     * it, maybe.*/
+    if (!authdir && node->ri->purpose == ROUTER_PURPOSE_GENERAL) {
+      /* Clear all flags. */
+      node->is_valid = node->is_running = node->is_hs_dir =
+        node->is_fast = node->is_stable =
+        node->is_possible_guard = node->is_exit =
+        node->is_bad_exit = node->ipv6_preferred = 0;
+    }
   }
-}
 
-/** Helper: return true iff a node has a usable amount of information*/
-static inline int
-node_is_usable(const node_t *node)
-{
-  return (node->rs) || (node->ri);
+  nodelist_assert_ok();
+
+  log_info(LD_DIR, "New consensus lists %d nodes: %d newly listed, %d no "
+           "longer listed, %d dropped from the nodelist.",
+           smartlist_len(ns->routerstatus_list), n_added, n_dropped,
+           n_purged);
 }
 
 /** Tell the nodelist that <b>md</b> is no longer a microdescriptor for the
@@ -313,6 +402,7 @@ nodelist_remove_microdesc(const char *identity_digest, microdesc_t *md)
   if (node && node->md == md) {
     node->md = NULL;
     md->held_by_nodes--;
+    the_nodelist->summaries_dirty = 1;
   }
 }
 
@@ -323,6 +413,8 @@ nodelist_remove_routerinfo(routerinfo_t *ri)
   node_t *node = node_get_mutable_by_id(ri->cache_info.identity_digest);
   if (node && node->ri == ri) {
     node->ri = NULL;
+    ++nodelist_names_gen;
+    the_nodelist->summaries_dirty = 1;
     if (! node_is_usable(node)) {
       nodelist_drop_node(node, 1);
       node_free(node);
@@ -337,6 +429,7 @@ nodelist_drop_node(node_t *node, int remove_from_ht)
 {
   node_t *tmp;
   int idx;
+  ++nodelist_names_gen;
   if (remove_from_ht) {
     tmp = HT_REMOVE(nodelist_map, &the_nodelist->nodes_by_id, node);
     tor_assert(tmp == node);
@@ -352,6 +445,7 @@ nodelist_drop_node(node_t *node, int remove_from_ht)
     tmp->nodelist_idx = idx;
   }
   node->nodelist_idx = -1;
+  the_nodelist->summaries_dirty = 1;
 }
 
 /** Return a newly allocated smartlist of the nodes that have <b>md</b> as
@@ -382,6 +476,9 @@ node_free(node_t *node)
   if (node->md)
     node->md->held_by_nodes--;
   tor_assert(node->nodelist_idx == -1);
+  /* A cached alias table might otherwise match a new node that happens to
+   * get the same address. */
+  routerlist_clear_bandwidth_choice_cache();
   tor_free(node);
 }
 
@@ -402,6 +499,7 @@ nodelist_purge(void)
       /* An md is only useful if there is an rs. */
       node->md->held_by_nodes--;
       node->md = NULL;
+      the_nodelist->summaries_dirty = 1;
     }
 
     if (node_is_usable(node)) {
@@ -423,6 +521,11 @@ nodelist_free_all(void)
     return;
 
   HT_CLEAR(nodelist_map, &the_nodelist->nodes_by_id);
+  nodelist_clear_families();
+  tor_free(the_nodelist->summaries);
+  tor_free(the_nodelist->subnets);
+  tor_free(the_nodelist->families);
+  tor_free(the_nodelist->member_bits);
   SMARTLIST_FOREACH_BEGIN(the_nodelist->nodes, node_t *, node) {
     node->nodelist_idx = -1;
     node_free(node);
@@ -473,6 +576,8 @@ nodelist_assert_ok(void)
          */
         microdesc_t *md =
           microdesc_cache_lookup_by_digest256(NULL, rs->descriptor_digest);
+        if (md && md->unparseable)
+          md = NULL;
         tor_assert(md == node->md);
         if (md)
           tor_assert(md->held_by_nodes >= 1);
@@ -503,6 +608,152 @@ nodelist_get_list,(void))
   return the_nodelist->nodes;
 }
 
+/** Free every resolved family list in the nodelist. */
+static void
+nodelist_clear_families(void)
+{
+  int i;
+  for (i = 0; i < the_nodelist->summaries_alloc; ++i) {
+    smartlist_free(the_nodelist->families[i]);
+    the_nodelist->families[i] = NULL;
+  }
+}
+
+/** Return the NODE_SUMMARY_* bits describing <b>node</b>.  If it has
+ * NODE_SUMMARY_HAS_IPV4, set *<b>subnet_out</b> to the /16 network of its
+ * primary address; otherwise set it to 0. */
+static uint8_t
+node_compute_summary(const node_t *node, uint16_t *subnet_out)
+{
+  uint8_t summary = 0;
+  tor_addr_port_t ap;
+  if (node_has_descriptor(node))
+    summary |= NODE_SUMMARY_HAS_DESC;
+  if (node->ri && node->ri->purpose != ROUTER_PURPOSE_GENERAL)
+    summary |= NODE_SUMMARY_NOT_GENERAL;
+  if (node_has_curve25519_onion_key(node))
+    summary |= NODE_SUMMARY_HAS_NTOR_KEY;
+  if ((node->rs && !routerstatus_version_supports_ntor(node->rs, 1)) ||
+      ((node->ri || node->md) && !(summary & NODE_SUMMARY_HAS_NTOR_KEY)))
+    summary |= NODE_SUMMARY_NO_NTOR;
+  *subnet_out = 0;
+  if (node_get_prim_orport(node, &ap) == 0 &&
+      tor_addr_family(&ap.addr) == AF_INET) {
+    summary |= NODE_SUMMARY_HAS_IPV4;
+    *subnet_out = (uint16_t)(tor_addr_to_ipv4h(&ap.addr) >> 16);
+  }
+  return summary;
+}
+
+/** Set <b>sets_out</b> to the routersets in our options that path
+ * selection checks nodes against. */
+static void
+nodelist_get_member_sets(const routerset_t **sets_out)
+{
+  const or_options_t *options = get_options();
+  sets_out[0] = options->ExcludeNodes;
+  sets_out[1] = options->ExcludeExitNodes;
+  sets_out[2] = options->ExcludeExitNodesUnion_;
+  sets_out[3] = options->ExitNodes;
+  sets_out[4] = options->EntryNodes;
+}
+
+/** Return a bit for each routerset in the nodelist's member_sets, set iff
+ * <b>node</b> is in that routerset. */
+static uint8_t
+node_compute_member_bits(const node_t *node)
+{
+  uint8_t bits = 0;
+  int i;
+  for (i = 0; i < NODELIST_N_MEMBER_SETS; ++i) {
+    const routerset_t *set = the_nodelist->member_sets[i];
+    if (set && routerset_contains_node(set, node))
+      bits |= (1u << i);
+  }
+  return bits;
+}
+
+/** Return an array holding the NODE_SUMMARY_* bits for every node in
+ * nodelist_get_list(), indexed by each node's position in that list.
+ *
+ * Path selection uses this to filter the whole nodelist without following
+ * each node's routerstatus, routerinfo, and microdescriptor pointers.  The
+ * array is only valid until the nodelist next changes.  Recomputing it also
+ * recomputes the nodes' subnets and their membership in the routersets from
+ * our options, and forgets their resolved families. */
+const uint8_t *
+nodelist_get_node_summaries(void)
+{
+  int n;
+  init_nodelist();
+  n = smartlist_len(the_nodelist->nodes);
+  if (n > the_nodelist->summaries_alloc) {
+    int old_alloc = the_nodelist->summaries_alloc;
+    the_nodelist->summaries_alloc = n + n / 8 + 16;
+    the_nodelist->summaries = tor_realloc(the_nodelist->summaries,
+                                          the_nodelist->summaries_alloc);
+    the_nodelist->subnets = tor_reallocarray(the_nodelist->subnets,
+                                             the_nodelist->summaries_alloc,
+                                             sizeof(uint16_t));
+    the_nodelist->families = tor_reallocarray(the_nodelist->families,
+                                              the_nodelist->summaries_alloc,
+                                              sizeof(smartlist_t *));
+    memset(the_nodelist->families + old_alloc, 0,
+           (the_nodelist->summaries_alloc - old_alloc) *
+           sizeof(smartlist_t *));
+    the_nodelist->member_bits = tor_realloc(the_nodelist->member_bits,
+                                            the_nodelist->summaries_alloc);
+    the_nodelist->summaries_dirty = 1;
+  }
+  if (the_nodelist->summaries_dirty) {
+    nodelist_clear_families();
+    /* While summaries_dirty is set, routerset_contains_node() does full
+     * matching, so it's safe to call here. */
+    nodelist_get_member_sets(the_nodelist->member_sets);
+    SMARTLIST_FOREACH_BEGIN(the_nodelist->nodes, const node_t *, node) {
+      the_nodelist->summaries[node_sl_idx] =
+        node_compute_summary(node, &the_nodelist->subnets[node_sl_idx]);
+      the_nodelist->member_bits[node_sl_idx] =
+        node_compute_member_bits(node);
+    } SMARTLIST_FOREACH_END(node);
+    the_nodelist->summaries_dirty = 0;
+  }
+  return the_nodelist->summaries;
+}
+
+/** If we have precomputed whether <b>node</b> is in <b>set</b>, return 1 if
+ * it is and 0 if it isn't.  Otherwise return -1.
+ *
+ * We precompute membership for the routersets in our options when we
+ * recompute the node summaries; this never triggers a recomputation. */
+int
+nodelist_node_in_routerset(const node_t *node, const routerset_t *set)
+{
+  int idx, i;
+  if (!the_nodelist || the_nodelist->summaries_dirty || !set)
+    return -1;
+  idx = node->nodelist_idx;
+  if (idx < 0 || idx >= smartlist_len(the_nodelist->nodes) ||
+      smartlist_get(the_nodelist->nodes, idx) != node)
+    return -1;
+  for (i = 0; i < NODELIST_N_MEMBER_SETS; ++i) {
+    if (the_nodelist->member_sets[i] == set)
+      return (the_nodelist->member_bits[idx] >> i) & 1;
+  }
+  return -1;
+}
+
+/** Tell the nodelist that some node's routerstatus, routerinfo, or
+ * microdescriptor has changed without going through this module, or that
+ * the routersets in our options have changed, so the packed node summaries
+ * must be recomputed. */
+void
+nodelist_invalidate_node_summaries(void)
+{
+  if (the_nodelist)
+    the_nodelist->summaries_dirty = 1;
+}
+
 /** Given a hex-encoded nickname of the format DIGEST, $DIGEST, $DIGEST=name,
  * or $DIGEST~name, return the node with the matching identity digest and
  * nickname (if any).  Return NULL if no such node exists, or if <b>hex_id</b>
@@ -1223,6 +1474,7 @@ node_set_country(node_t *node)
     tor_addr_from_ipv4h(&addr, node->ri->addr);
 
   node->country = geoip_get_country_by_addr(&addr);
+  node->country_addr = tor_addr_to_ipv4h(&addr);
 }
 
 /** Set the country code of all routers in the routerlist. */
@@ -1310,6 +1562,34 @@ nodes_in_same_family(const node_t *node1, const node_t *node2)
   return 0;
 }
 
+/** Add to <b>sl</b> every node in the declared family of <b>node</b> that
+ * also declares <b>node</b> to be in its family. */
+static void
+node_add_mutual_family(smartlist_t *sl, const node_t *node)
+{
+  const smartlist_t *declared_family = node_get_declared_family(node);
+
+  if (!declared_family)
+    return;
+
+  /* Add every r such that router declares familyness with node, and node
+   * declares familyhood with router. */
+  SMARTLIST_FOREACH_BEGIN(declared_family, const char *, name) {
+    const node_t *node2;
+    const smartlist_t *family2;
+    if (!(node2 = node_get_by_nickname(name, 0)))
+      continue;
+    if (!(family2 = node_get_declared_family(node2)))
+      continue;
+    SMARTLIST_FOREACH_BEGIN(family2, const char *, name2) {
+        if (node_nickname_matches(node, name2)) {
+          smartlist_add(sl, (void*)node2);
+          break;
+        }
+    } SMARTLIST_FOREACH_END(name2);
+  } SMARTLIST_FOREACH_END(name);
+}
+
 /**
  * Add all the family of <b>node</b>, including <b>node</b> itself, to
  * the smartlist <b>sl</b>.
@@ -1323,52 +1603,58 @@ void
 nodelist_add_node_and_family(smartlist_t *sl, const node_t *node)
 {
   const smartlist_t *all_nodes = nodelist_get_list();
-  const smartlist_t *declared_family;
+  const uint8_t *summaries = nodelist_get_node_summaries();
+  const node_t *real_node;
   const or_options_t *options = get_options();
 
   tor_assert(node);
 
-  declared_family = node_get_declared_family(node);
-
   /* Let's make sure that we have the node itself, if it's a real node. */
-  {
-    const node_t *real_node = node_get_by_id(node->identity);
-    if (real_node)
-      smartlist_add(sl, (node_t*)real_node);
-  }
+  real_node = node_get_by_id(node->identity);
+  if (real_node)
+    smartlist_add(sl, (node_t*)real_node);
 
   /* First, add any nodes with similar network addresses. */
   if (options->EnforceDistinctSubnets) {
-    tor_addr_t node_addr;
-    node_get_addr(node, &node_addr);
-
-    SMARTLIST_FOREACH_BEGIN(all_nodes, const node_t *, node2) {
-      tor_addr_t a;
-      node_get_addr(node2, &a);
-      if (addrs_in_same_network_family(&a, &node_addr))
-        smartlist_add(sl, (void*)node2);
-    } SMARTLIST_FOREACH_END(node2);
+    if (real_node == node) {
+      /* We know the node's subnet already, so we can just compare it with
+       * everybody else's. */
+      const int idx = node->nodelist_idx;
+      const int n = smartlist_len(all_nodes);
+      const uint16_t subnet = the_nodelist->subnets[idx];
+      int i;
+      if (summaries[idx] & NODE_SUMMARY_HAS_IPV4) {
+        for (i = 0; i < n; ++i) {
+          if ((summaries[i] & NODE_SUMMARY_HAS_IPV4) &&
+              the_nodelist->subnets[i] == subnet)
+            smartlist_add(sl, smartlist_get(all_nodes, i));
+        }
+      }
+    } else {
+      tor_addr_t node_addr;
+      node_get_addr(node, &node_addr);
+
+      SMARTLIST_FOREACH_BEGIN(all_nodes, const node_t *, node2) {
+        tor_addr_t a;
+        node_get_addr(node2, &a);
+        if (addrs_in_same_network_family(&a, &node_addr))
+          smartlist_add(sl, (void*)node2);
+      } SMARTLIST_FOREACH_END(node2);
+    }
   }
 
   /* Now, add all nodes in the declared_family of this node, if they
-   * also declare this node to be in their family. */
-  if (declared_family) {
-    /* Add every r such that router declares familyness with node, and node
-     * declares familyhood with router. */
-    SMARTLIST_FOREACH_BEGIN(declared_family, const char *, name) {
-      const node_t *node2;
-      const smartlist_t *family2;
-      if (!(node2 = node_get_by_nickname(name, 0)))
-        continue;
-      if (!(family2 = node_get_declared_family(node2)))
-        continue;
-      SMARTLIST_FOREACH_BEGIN(family2, const char *, name2) {
-          if (node_nickname_matches(node, name2)) {
-            smartlist_add(sl, (void*)node2);
-            break;
-          }
-      } SMARTLIST_FOREACH_END(name2);
-    } SMARTLIST_FOREACH_END(name);
+   * also declare this node to be in their family.  For nodes in the
+   * nodelist, we remember the answer until the nodelist changes. */
+  if (real_node == node) {
+    smartlist_t **familyp = &the_nodelist->families[node->nodelist_idx];
+    if (! *familyp) {
+      *familyp = smartlist_new();
+      node_add_mutual_family(*familyp, node);
+    }
+    smartlist_add_all(sl, *familyp);
+  } else {
+    node_add_mutual_family(sl, node);
   }
 
   /* If the user declared any families locally, honor those too. */
@@ -1558,6 +1844,8 @@ router_dir_info_changed(void)
 {
   need_to_update_have_min_dir_info = 1;
   rend_hsdir_routers_changed();
+  routerlist_clear_bandwidth_choice_cache();
+  nodelist_invalidate_node_summaries();
 }
 
 /** Return a string describing what we're missing before we have enough
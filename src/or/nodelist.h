@@ -19,6 +19,7 @@
 node_t *node_get_mutable_by_id(const char *identity_digest);
 MOCK_DECL(const node_t *, node_get_by_id, (const char *identity_digest));
 const node_t *node_get_by_hex_id(const char *identity_digest);
+unsigned int nodelist_get_names_generation(void);
 node_t *nodelist_set_routerinfo(routerinfo_t *ri, routerinfo_t **ri_old_out);
 node_t *nodelist_add_microdesc(microdesc_t *md);
 void nodelist_set_consensus(networkstatus_t *ns);
@@ -31,6 +32,24 @@ smartlist_t *nodelist_find_nodes_with_microdesc(const microdesc_t *md);
 void nodelist_free_all(void);
 void nodelist_assert_ok(void);
 
+/** Flag for nodelist_get_node_summaries(): node_has_descriptor() is true. */
+#define NODE_SUMMARY_HAS_DESC     (1u<<0)
+/** Flag for nodelist_get_node_summaries(): the node has a routerinfo whose
+ * purpose is not ROUTER_PURPOSE_GENERAL. */
+#define NODE_SUMMARY_NOT_GENERAL  (1u<<1)
+/** Flag for nodelist_get_node_summaries(): node_has_curve25519_onion_key()
+ * is true. */
+#define NODE_SUMMARY_HAS_NTOR_KEY (1u<<2)
+/** Flag for nodelist_get_node_summaries(): we are certain that the node
+ * can't do ntor. */
+#define NODE_SUMMARY_NO_NTOR      (1u<<3)
+/** Flag for nodelist_get_node_summaries(): the node has a valid primary
+ * IPv4 OR address. */
+#define NODE_SUMMARY_HAS_IPV4     (1u<<4)
+const uint8_t *nodelist_get_node_summaries(void);
+void nodelist_invalidate_node_summaries(void);
+int nodelist_node_in_routerset(const node_t *node, const routerset_t *set);
+
 MOCK_DECL(const node_t *, node_get_by_nickname,
     (const char *nickname, int warn_if_unnamed));
 void node_get_verbose_nickname(const node_t *node,
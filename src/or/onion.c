@@ -50,7 +50,9 @@
  *  <li> Queueing incoming onionskins on the relay side before passing
  *      them to worker threads.
  *   <li>Expiring onionskins on the relay side if they have waited for
- *     too long.
+ *     too long, and refusing new ones when we couldn't answer them in time.
+ *     Channels that have been open for a while, and channels that are not
+ *     using more than their share of the queue, get more room than others.
  *   <li>Packaging private keys on the server side in order to pass
  *     them to worker threads.
  *   <li>Encoding and decoding CREATE, CREATED, CREATE2, and CREATED2 cells.
@@ -63,6 +65,7 @@
  **/
 
 #include "or.h"
+#include "channel.h"
 #include "circuitbuild.h"
 #include "circuitlist.h"
 #include "config.h"
@@ -83,12 +86,70 @@ typedef struct onion_queue_t {
   or_circuit_t *circ;
   uint16_t handshake_type;
   create_cell_t *onionskin;
-  time_t when_added;
+  /** When did we add this entry, in msec on the coarse monotonic clock? */
+  uint64_t when_added_msec;
+  /** The global_identifier of the channel the create cell arrived on, or 0
+   * if it had none. */
+  uint64_t chan_id;
 } onion_queue_t;
 
 /** 5 seconds on the onion queue til we just send back a destroy */
 #define ONIONQUEUE_WAIT_CUTOFF 5
 
+/** A channel must have been open for this many seconds before we give its
+ * create cells the full queue delay budget. */
+#define ONIONQUEUE_ESTABLISHED_CHANNEL_AGE 60
+
+/** How many recent queue delays do we remember for the controller? */
+#define ONIONQUEUE_N_DELAY_SAMPLES 1024
+
+/** An entry in onion_source_map: how many onionskins from a single channel
+ * are waiting in ol_list[]. */
+typedef struct onion_source_t {
+  HT_ENTRY(onion_source_t) node;
+  /** The global_identifier of the channel. */
+  uint64_t chan_id;
+  /** How many entries in ol_list[] came from this channel? */
+  int n_queued;
+} onion_source_t;
+
+/** Helper for onion_source_map: hash the channel identifier. */
+static inline unsigned int
+onion_source_hash(const onion_source_t *a)
+{
+  return (unsigned) siphash24g(&a->chan_id, sizeof(a->chan_id));
+}
+
+/** Helper for onion_source_map: return true iff a and b are for the same
+ * channel. */
+static inline int
+onion_source_eq(const onion_source_t *a, const onion_source_t *b)
+{
+  return a->chan_id == b->chan_id;
+}
+
+/** Map from channel identifier to the number of onionskins that channel has
+ * waiting. Channels with nothing waiting have no entry. */
+static HT_HEAD(onion_source_map, onion_source_t)
+     onion_source_map = HT_INITIALIZER();
+HT_PROTOTYPE(onion_source_map, onion_source_t, node,
+             onion_source_hash, onion_source_eq)
+HT_GENERATE2(onion_source_map, onion_source_t, node,
+             onion_source_hash, onion_source_eq, 0.6,
+             tor_reallocarray_, tor_free_)
+
+/** Ring buffer of how long, in msec, the most recently processed onionskins
+ * waited on the queue. */
+static uint32_t ol_delay_samples[ONIONQUEUE_N_DELAY_SAMPLES];
+/** How many onionskins have we ever taken off the queue for processing?
+ * The next delay sample goes at this index modulo
+ * ONIONQUEUE_N_DELAY_SAMPLES. */
+static uint64_t ol_n_processed = 0;
+/** How many onionskins have we refused to queue? */
+static uint64_t ol_n_rejected = 0;
+/** How many queued onionskins have we dropped for waiting too long? */
+static uint64_t ol_n_expired = 0;
+
 /** Array of queues of circuits waiting for CPU workers. An element is NULL
  * if that queue is empty.*/
 static TOR_TAILQ_HEAD(onion_queue_head_t, onion_queue_t)
@@ -103,6 +164,39 @@ static int ol_entries[MAX_ONION_HANDSHAKE_TYPE+1];
 
 static int num_ntors_per_tap(void);
 static void onion_queue_entry_remove(onion_queue_t *victim);
+static void onion_queue_cull_expired(uint16_t type, uint64_t now_msec);
+
+/** Return the onion_source_map entry for the channel with global identifier
+ * <b>chan_id</b>, creating it if <b>create</b> is true. Otherwise return NULL
+ * if there isn't one. */
+static onion_source_t *
+onion_source_get(uint64_t chan_id, int create)
+{
+  onion_source_t search, *src;
+  search.chan_id = chan_id;
+  src = HT_FIND(onion_source_map, &onion_source_map, &search);
+  if (!src && create) {
+    src = tor_malloc_zero(sizeof(onion_source_t));
+    src->chan_id = chan_id;
+    HT_INSERT(onion_source_map, &onion_source_map, src);
+  }
+  return src;
+}
+
+/** Return true iff the channel with global identifier <b>chan_id</b> has
+ * more than its fair share of the entries in ol_list[]. */
+static int
+onion_source_over_fair_share(uint64_t chan_id)
+{
+  const onion_source_t *src = onion_source_get(chan_id, 0);
+  unsigned n_sources = HT_SIZE(&onion_source_map);
+  int total = 0, i;
+  if (!src || n_sources < 2)
+    return 0;
+  for (i = 0; i <= MAX_ONION_HANDSHAKE_TYPE; ++i)
+    total += ol_entries[i];
+  return (uint64_t)src->n_queued * n_sources > (uint64_t)total;
+}
 
 /* XXXX Check lengths vs MAX_ONIONSKIN_{CHALLENGE,REPLY}_LEN.
  *
@@ -112,18 +206,32 @@ static void onion_queue_entry_remove(onion_queue_t *victim);
  * over-large values via EXTEND2/EXTENDED2, for future-compatibility.*/
 
 /** Return true iff we have room to queue another onionskin of type
- * <b>type</b>. */
+ * <b>type</b>, arriving on <b>chan</b> (which may be NULL).
+ *
+ * We refuse an onionskin if we don't expect to get to it within
+ * MaxOnionQueueDelay.  Onionskins from channels that have only just opened,
+ * or from channels that already have more than their share of the queue,
+ * get a smaller budget, so that a flood from a few channels crowds out
+ * its senders before it crowds out anybody else. */
 static int
-have_room_for_onionskin(uint16_t type)
+have_room_for_onionskin(uint16_t type, const channel_t *chan)
 {
   const or_options_t *options = get_options();
   int num_cpus;
   uint64_t tap_usec, ntor_usec;
   uint64_t ntor_during_tap_usec, tap_during_ntor_usec;
+  uint64_t max_delay = options->MaxOnionQueueDelay;
 
   /* If we've got fewer than 50 entries, we always have room for one more. */
   if (ol_entries[type] < 50)
     return 1;
+
+  if (chan && chan->timestamp_created + ONIONQUEUE_ESTABLISHED_CHANNEL_AGE >
+      approx_time())
+    max_delay = max_delay * 3 / 4;
+  if (onion_source_over_fair_share(chan ? chan->global_identifier : 0))
+    max_delay = max_delay / 2;
+
   num_cpus = get_num_cpus(options);
   /* Compute how many microseconds we'd expect to need to clear all
    * onionskins in various combinations of the queues. */
@@ -155,19 +263,17 @@ have_room_for_onionskin(uint16_t type)
   /* See whether that exceeds MaxOnionQueueDelay. If so, we can't queue
    * this. */
   if (type == ONION_HANDSHAKE_TYPE_NTOR &&
-      (ntor_usec + tap_during_ntor_usec) / 1000 >
-       (uint64_t)options->MaxOnionQueueDelay)
+      (ntor_usec + tap_during_ntor_usec) / 1000 > max_delay)
     return 0;
 
   if (type == ONION_HANDSHAKE_TYPE_TAP &&
-      (tap_usec + ntor_during_tap_usec) / 1000 >
-       (uint64_t)options->MaxOnionQueueDelay)
+      (tap_usec + ntor_during_tap_usec) / 1000 > max_delay)
     return 0;
 
   /* If we support the ntor handshake, then don't let TAP handshakes use
    * more than 2/3 of the space on the queue. */
   if (type == ONION_HANDSHAKE_TYPE_TAP &&
-      tap_usec / 1000 > (uint64_t)options->MaxOnionQueueDelay * 2 / 3)
+      tap_usec / 1000 > max_delay * 2 / 3)
     return 0;
 
   return 1;
@@ -180,7 +286,8 @@ int
 onion_pending_add(or_circuit_t *circ, create_cell_t *onionskin)
 {
   onion_queue_t *tmp;
-  time_t now = time(NULL);
+  uint64_t now_msec = monotime_coarse_absolute_msec_cached();
+  onion_source_t *src;
 
   if (onionskin->handshake_type > MAX_ONION_HANDSHAKE_TYPE) {
     /* LCOV_EXCL_START
@@ -195,9 +302,10 @@ onion_pending_add(or_circuit_t *circ, create_cell_t *onionskin)
   tmp->circ = circ;
   tmp->handshake_type = onionskin->handshake_type;
   tmp->onionskin = onionskin;
-  tmp->when_added = now;
+  tmp->when_added_msec = now_msec;
+  tmp->chan_id = circ->p_chan ? circ->p_chan->global_identifier : 0;
 
-  if (!have_room_for_onionskin(onionskin->handshake_type)) {
+  if (!have_room_for_onionskin(onionskin->handshake_type, circ->p_chan)) {
 #define WARN_TOO_MANY_CIRC_CREATIONS_INTERVAL (60)
     static ratelim_t last_warned =
       RATELIM_INIT(WARN_TOO_MANY_CIRC_CREATIONS_INTERVAL);
@@ -211,10 +319,13 @@ onion_pending_add(or_circuit_t *circ, create_cell_t *onionskin)
                "restricted exit policy.%s",m);
       tor_free(m);
     }
+    ++ol_n_rejected;
     tor_free(tmp);
     return -1;
   }
 
+  src = onion_source_get(tmp->chan_id, 1);
+  ++src->n_queued;
   ++ol_entries[onionskin->handshake_type];
   log_info(LD_OR, "New create (%s). Queues now ntor=%d and tap=%d.",
     onionskin->handshake_type == ONION_HANDSHAKE_TYPE_NTOR ? "ntor" : "tap",
@@ -225,19 +336,31 @@ onion_pending_add(or_circuit_t *circ, create_cell_t *onionskin)
   TOR_TAILQ_INSERT_TAIL(&ol_list[onionskin->handshake_type], tmp, next);
 
   /* cull elderly requests. */
-  while (1) {
-    onion_queue_t *head = TOR_TAILQ_FIRST(&ol_list[onionskin->handshake_type]);
-    if (now - head->when_added < (time_t)ONIONQUEUE_WAIT_CUTOFF)
+  onion_queue_cull_expired(onionskin->handshake_type, now_msec);
+  return 0;
+}
+
+/** Drop every request at the front of the <b>type</b> queue that has been
+ * waiting for ONIONQUEUE_WAIT_CUTOFF or longer as of <b>now_msec</b>: its
+ * client has probably given up on it already. */
+static void
+onion_queue_cull_expired(uint16_t type, uint64_t now_msec)
+{
+  onion_queue_t *head;
+  while ((head = TOR_TAILQ_FIRST(&ol_list[type]))) {
+    or_circuit_t *circ;
+    if (now_msec - head->when_added_msec <
+        (uint64_t)ONIONQUEUE_WAIT_CUTOFF * 1000)
       break;
 
     circ = head->circ;
     circ->onionqueue_entry = NULL;
     onion_queue_entry_remove(head);
+    ++ol_n_expired;
     log_info(LD_CIRC,
              "Circuit create request is too old; canceling due to overload.");
     circuit_mark_for_close(TO_CIRCUIT(circ), END_CIRC_REASON_RESOURCELIMIT);
   }
-  return 0;
 }
 
 /** Return a fairness parameter, to prefer processing NTOR style
@@ -304,7 +427,12 @@ onion_next_task(create_cell_t **onionskin_out)
 {
   or_circuit_t *circ;
   uint16_t handshake_to_choose = decide_next_handshake_type();
-  onion_queue_t *head = TOR_TAILQ_FIRST(&ol_list[handshake_to_choose]);
+  uint64_t now_msec = monotime_coarse_absolute_msec_cached();
+  onion_queue_t *head;
+
+  /* Don't spend a CPU worker on anything we couldn't answer in time. */
+  onion_queue_cull_expired(handshake_to_choose, now_msec);
+  head = TOR_TAILQ_FIRST(&ol_list[handshake_to_choose]);
 
   if (!head)
     return NULL; /* no onions pending, we're done */
@@ -322,6 +450,9 @@ onion_next_task(create_cell_t **onionskin_out)
     ol_entries[ONION_HANDSHAKE_TYPE_NTOR],
     ol_entries[ONION_HANDSHAKE_TYPE_TAP]);
 
+  ol_delay_samples[ol_n_processed++ % ONIONQUEUE_N_DELAY_SAMPLES] =
+    (uint32_t) MIN(now_msec - head->when_added_msec, UINT32_MAX);
+
   *onionskin_out = head->onionskin;
   head->onionskin = NULL; /* prevent free. */
   circ->onionqueue_entry = NULL;
@@ -337,6 +468,38 @@ onion_num_pending(uint16_t handshake_type)
   return ol_entries[handshake_type];
 }
 
+/** Return a newly allocated string describing the onion queues for the
+ * controller: how many onionskins of each type are waiting, how many we
+ * have processed, refused and expired, and percentiles of how long the
+ * most recently processed ones waited, in msec. */
+char *
+onion_queue_get_stats(void)
+{
+  uint32_t *delays;
+  int n = (int) MIN(ol_n_processed, ONIONQUEUE_N_DELAY_SAMPLES);
+  uint32_t p50 = 0, p90 = 0, p99 = 0, max = 0;
+  char *result = NULL;
+
+  if (n) {
+    delays = tor_memdup(ol_delay_samples, n * sizeof(uint32_t));
+    p50 = find_nth_uint32(delays, n, (n-1)/2);
+    p90 = find_nth_uint32(delays, n, (n-1)*9/10);
+    p99 = find_nth_uint32(delays, n, (n-1)*99/100);
+    max = find_nth_uint32(delays, n, n-1);
+    tor_free(delays);
+  }
+
+  tor_asprintf(&result,
+               "ntor=%d tap=%d processed="U64_FORMAT" rejected="U64_FORMAT
+               " expired="U64_FORMAT" delay-p50=%u delay-p90=%u"
+               " delay-p99=%u delay-max=%u",
+               ol_entries[ONION_HANDSHAKE_TYPE_NTOR],
+               ol_entries[ONION_HANDSHAKE_TYPE_TAP],
+               U64_PRINTF_ARG(ol_n_processed), U64_PRINTF_ARG(ol_n_rejected),
+               U64_PRINTF_ARG(ol_n_expired), p50, p90, p99, max);
+  return result;
+}
+
 /** Go through ol_list, find the onion_queue_t element which points to
  * circ, remove and free that element. Leave circ itself alone.
  */
@@ -378,6 +541,14 @@ onion_queue_entry_remove(onion_queue_t *victim)
   if (victim->onionskin)
     --ol_entries[victim->handshake_type];
 
+  {
+    onion_source_t *src = onion_source_get(victim->chan_id, 0);
+    if (src && --src->n_queued <= 0) {
+      HT_REMOVE(onion_source_map, &onion_source_map, src);
+      tor_free(src);
+    }
+  }
+
   tor_free(victim->onionskin);
   tor_free(victim);
 }
@@ -396,6 +567,16 @@ clear_pending_onions(void)
     tor_assert(TOR_TAILQ_EMPTY(&ol_list[i]));
   }
   memset(ol_entries, 0, sizeof(ol_entries));
+  {
+    onion_source_t **src, **next_src, *this_src;
+    for (src = HT_START(onion_source_map, &onion_source_map); src;
+         src = next_src) {
+      this_src = *src;
+      next_src = HT_NEXT_RMV(onion_source_map, &onion_source_map, src);
+      tor_free(this_src);
+    }
+    HT_CLEAR(onion_source_map, &onion_source_map);
+  }
 }
 
 /* ============================================================ */
@@ -413,9 +594,34 @@ server_onion_keys_new(void)
   keys->curve25519_key_map = construct_ntor_key_map();
   keys->junk_keypair = tor_malloc_zero(sizeof(curve25519_keypair_t));
   curve25519_keypair_generate(keys->junk_keypair, 0);
+  keys->tap_dh_pool = smartlist_new();
   return keys;
 }
 
+/** Generate up to <b>max_new</b> DH keys for the TAP handshake, and add
+ * them to the pool in <b>keys</b>, without letting it grow past
+ * TAP_DH_POOL_SIZE.  Return the number of keys we generated. */
+int
+server_onion_keys_refill_tap_dh_pool(server_onion_keys_t *keys, int max_new)
+{
+  int n = 0;
+  tor_assert(keys);
+  while (n < max_new && smartlist_len(keys->tap_dh_pool) < TAP_DH_POOL_SIZE) {
+    crypto_dh_t *dh = crypto_dh_new(DH_TYPE_CIRCUIT);
+    if (!dh)
+      break; // LCOV_EXCL_LINE
+    if (crypto_dh_generate_public(dh) < 0) {
+      /* LCOV_EXCL_START */
+      crypto_dh_free(dh);
+      break;
+      /* LCOV_EXCL_STOP */
+    }
+    smartlist_add(keys->tap_dh_pool, dh);
+    ++n;
+  }
+  return n;
+}
+
 /** Release all storage held in <b>keys</b>. */
 void
 server_onion_keys_free(server_onion_keys_t *keys)
@@ -427,6 +633,11 @@ server_onion_keys_free(server_onion_keys_t *keys)
   crypto_pk_free(keys->last_onion_key);
   ntor_key_map_free(keys->curve25519_key_map);
   tor_free(keys->junk_keypair);
+  if (keys->tap_dh_pool) {
+    SMARTLIST_FOREACH(keys->tap_dh_pool, crypto_dh_t *, dh,
+                      crypto_dh_free(dh));
+    smartlist_free(keys->tap_dh_pool);
+  }
   memwipe(keys, 0, sizeof(server_onion_keys_t));
   tor_free(keys);
 }
@@ -493,11 +704,24 @@ onion_skin_create(int type,
   case ONION_HANDSHAKE_TYPE_NTOR:
     if (!extend_info_supports_ntor(node))
       return -1;
-    if (onion_skin_ntor_create((const uint8_t*)node->identity_digest,
-                               &node->curve25519_onion_key,
-                               &state_out->u.ntor,
-                               onion_skin_out) < 0)
-      return -1;
+    {
+      curve25519_keypair_t keypair_x;
+      int ok;
+      if (cpuworker_take_ntor_keypair(&keypair_x) == 0) {
+        ok = onion_skin_ntor_create_with_keypair(
+                                  (const uint8_t*)node->identity_digest,
+                                  &node->curve25519_onion_key, &keypair_x,
+                                  &state_out->u.ntor, onion_skin_out) == 0;
+        memwipe(&keypair_x, 0, sizeof(keypair_x));
+      } else {
+        ok = onion_skin_ntor_create((const uint8_t*)node->identity_digest,
+                                    &node->curve25519_onion_key,
+                                    &state_out->u.ntor,
+                                    onion_skin_out) == 0;
+      }
+      if (!ok)
+        return -1;
+    }
 
     r = NTOR_ONIONSKIN_LEN;
     break;
@@ -539,6 +763,7 @@ onion_skin_server_handshake(int type,
       return -1;
     if (onion_skin_TAP_server_handshake((const char*)onion_skin,
                                         keys->onion_key, keys->last_onion_key,
+                                        keys->tap_dh_pool,
                                         (char*)reply_out,
                                         (char*)keys_out, keys_out_len)<0)
       return -1;
@@ -16,6 +16,7 @@ struct create_cell_t;
 int onion_pending_add(or_circuit_t *circ, struct create_cell_t *onionskin);
 or_circuit_t *onion_next_task(struct create_cell_t **onionskin_out);
 int onion_num_pending(uint16_t handshake_type);
+char *onion_queue_get_stats(void);
 void onion_pending_remove(or_circuit_t *circ);
 void clear_pending_onions(void);
 
@@ -25,13 +26,22 @@ typedef struct server_onion_keys_t {
   crypto_pk_t *last_onion_key;
   di_digest256_map_t *curve25519_key_map;
   curve25519_keypair_t *junk_keypair;
+  /** DH keys with precomputed public halves, for TAP handshakes.  Only the
+   * thread that owns these keys may touch them. */
+  smartlist_t *tap_dh_pool;
 } server_onion_keys_t;
 
+/** How many precomputed DH keys do we keep for TAP, per set of server onion
+ * keys? */
+#define TAP_DH_POOL_SIZE 32
+
 #define MAX_ONIONSKIN_CHALLENGE_LEN 255
 #define MAX_ONIONSKIN_REPLY_LEN 255
 
 server_onion_keys_t *server_onion_keys_new(void);
 void server_onion_keys_free(server_onion_keys_t *keys);
+int server_onion_keys_refill_tap_dh_pool(server_onion_keys_t *keys,
+                                         int max_new);
 
 void onion_handshake_state_release(onion_handshake_state_t *state);
 
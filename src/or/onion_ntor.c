@@ -88,23 +88,48 @@ onion_skin_ntor_create(const uint8_t *router_id,
                        ntor_handshake_state_t **handshake_state_out,
                        uint8_t *onion_skin_out)
 {
-  ntor_handshake_state_t *state;
-  uint8_t *op;
+  curve25519_keypair_t keypair_x;
+  int r;
 
-  state = tor_malloc_zero(sizeof(ntor_handshake_state_t));
-
-  memcpy(state->router_id, router_id, DIGEST_LEN);
-  memcpy(&state->pubkey_B, router_key, sizeof(curve25519_public_key_t));
-  if (curve25519_secret_key_generate(&state->seckey_x, 0) < 0) {
+  if (curve25519_keypair_generate(&keypair_x, 0) < 0) {
     /* LCOV_EXCL_START
      * Secret key generation should be unable to fail when the key isn't
      * marked as "extra-strong" */
     tor_assert_nonfatal_unreached();
-    tor_free(state);
     return -1;
     /* LCOV_EXCL_STOP */
   }
-  curve25519_public_key_generate(&state->pubkey_X, &state->seckey_x);
+  r = onion_skin_ntor_create_with_keypair(router_id, router_key, &keypair_x,
+                                          handshake_state_out,
+                                          onion_skin_out);
+  memwipe(&keypair_x, 0, sizeof(keypair_x));
+  return r;
+}
+
+/**
+ * As onion_skin_ntor_create(), but use the freshly generated ephemeral
+ * keypair <b>keypair_x</b> rather than generating one.  The caller must not
+ * use <b>keypair_x</b> for anything else afterwards.
+ */
+int
+onion_skin_ntor_create_with_keypair(const uint8_t *router_id,
+                                    const curve25519_public_key_t *router_key,
+                                    const curve25519_keypair_t *keypair_x,
+                                    ntor_handshake_state_t
+                                      **handshake_state_out,
+                                    uint8_t *onion_skin_out)
+{
+  ntor_handshake_state_t *state;
+  uint8_t *op;
+
+  state = tor_malloc_zero(sizeof(ntor_handshake_state_t));
+
+  memcpy(state->router_id, router_id, DIGEST_LEN);
+  memcpy(&state->pubkey_B, router_key, sizeof(curve25519_public_key_t));
+  memcpy(&state->seckey_x, &keypair_x->seckey,
+         sizeof(curve25519_secret_key_t));
+  memcpy(&state->pubkey_X, &keypair_x->pubkey,
+         sizeof(curve25519_public_key_t));
 
   op = onion_skin_out;
   APPEND(op, router_id, DIGEST_LEN);
@@ -23,6 +23,12 @@ int onion_skin_ntor_create(const uint8_t *router_id,
                            const curve25519_public_key_t *router_key,
                            ntor_handshake_state_t **handshake_state_out,
                            uint8_t *onion_skin_out);
+int onion_skin_ntor_create_with_keypair(const uint8_t *router_id,
+                                    const curve25519_public_key_t *router_key,
+                                    const curve25519_keypair_t *keypair_x,
+                                    ntor_handshake_state_t
+                                      **handshake_state_out,
+                                    uint8_t *onion_skin_out);
 
 int onion_skin_ntor_server_handshake(const uint8_t *onion_skin,
                                  const di_digest256_map_t *private_keys,
@@ -99,6 +99,10 @@ onion_skin_TAP_create(crypto_pk_t *dest_router_key,
  * and the private key for this onion router, generate the reply (128-byte
  * DH plus the first 20 bytes of shared key material), and store the
  * next key_out_len bytes of key material in key_out.
+ *
+ * If <b>dh_pool</b> is provided, it holds DH keys whose public halves we
+ * have already generated: once the onion skin decrypts, we take one of
+ * them instead of generating our own.
  */
 int
 onion_skin_TAP_server_handshake(
@@ -106,6 +110,7 @@ onion_skin_TAP_server_handshake(
                             const char *onion_skin,
                             crypto_pk_t *private_key,
                             crypto_pk_t *prev_private_key,
+                            smartlist_t *dh_pool,
                             /*TAP_ONIONSKIN_REPLY_LEN*/
                             char *handshake_reply_out,
                             char *key_out,
@@ -144,7 +149,10 @@ onion_skin_TAP_server_handshake(
     goto err;
   }
 
-  dh = crypto_dh_new(DH_TYPE_CIRCUIT);
+  if (dh_pool)
+    dh = smartlist_pop_last(dh_pool);
+  if (!dh)
+    dh = crypto_dh_new(DH_TYPE_CIRCUIT);
   if (!dh) {
     /* LCOV_EXCL_START
      * Failure to allocate a DH key should be impossible.
@@ -24,6 +24,7 @@ int onion_skin_TAP_create(crypto_pk_t *router_key,
 int onion_skin_TAP_server_handshake(const char *onion_skin,
                                 crypto_pk_t *private_key,
                                 crypto_pk_t *prev_private_key,
+                                smartlist_t *dh_pool,
                                 char *handshake_reply_out,
                                 char *key_out,
                                 size_t key_out_len);
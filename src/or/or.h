@@ -336,12 +336,16 @@ typedef enum {
 /** State for a transparent natd connection: waiting for original
  * destination. */
 #define AP_CONN_STATE_NATD_WAIT 12
-#define AP_CONN_STATE_MAX_ 12
+/** State for a resolve request: waiting for the answer to an identical
+ * lookup that is already in flight. */
+#define AP_CONN_STATE_DNS_CACHE_WAIT 13
+#define AP_CONN_STATE_MAX_ 13
 
 /** True iff the AP_CONN_STATE_* value <b>s</b> means that the corresponding
  * edge connection is not attached to any circuit. */
 #define AP_CONN_STATE_IS_UNATTACHED(s) \
-  ((s) <= AP_CONN_STATE_CIRCUIT_WAIT || (s) == AP_CONN_STATE_NATD_WAIT)
+  ((s) <= AP_CONN_STATE_CIRCUIT_WAIT || (s) == AP_CONN_STATE_NATD_WAIT || \
+   (s) == AP_CONN_STATE_DNS_CACHE_WAIT)
 
 #define DIR_CONN_STATE_MIN_ 1
 /** State for connection to directory server: waiting for connect(). */
@@ -835,6 +839,9 @@ typedef enum {
 #define STREAMWINDOW_START 500
 /** Amount to increment a stream window when we get a stream SENDME. */
 #define STREAMWINDOW_INCREMENT 50
+/** Smallest stream-level deliver window that AdaptiveStreamWindows will
+ * shrink a stream to.  Measured in cells. */
+#define STREAMWINDOW_ADAPTIVE_MIN 100
 
 /** Maximum number of queued cells on a circuit for which we are the
  * midpoint before we give up and kill it.  This must be >= circwindow
@@ -1071,6 +1078,10 @@ typedef enum {
 
 typedef struct channel_tls_s channel_tls_t;
 
+/* Datagram channel stuff */
+
+typedef struct channel_dgram_s channel_dgram_t;
+
 /* circuitmux_t typedef; struct circuitmux_s is in circuitmux.h */
 
 typedef struct circuitmux_s circuitmux_t;
@@ -1227,6 +1238,10 @@ typedef struct connection_t {
   unsigned int write_blocked_on_bw:1; /**< Boolean: should we start writing
                              * again once the bandwidth throttler allows
                              * writes? */
+  /** True iff this connection is on the list of connections that
+   * connection_bucket_refill() should consider waking up; see
+   * bw_blocked_idx. */
+  unsigned int on_bw_blocked_list:1;
   unsigned int hold_open_until_flushed:1; /**< Despite this connection's being
                                       * marked for close, do we flush it
                                       * before closing it? */
@@ -1254,6 +1269,22 @@ typedef struct connection_t {
    * connection. */
   unsigned int linked_conn_is_closed:1;
 
+  /* For edge-triggered connections (see EdgeTriggeredIO):
+   */
+  /** True iff read_event and write_event were added once with EV_ET, and
+   * stay added until the connection is closed. */
+  unsigned int edge_triggered:1;
+  /** True iff we'd like to be notified about read events. */
+  unsigned int want_read:1;
+  /** True iff we'd like to be notified about write events. */
+  unsigned int want_write:1;
+  /** True iff libevent has told us the socket is readable, and no read has
+   * come back short since. */
+  unsigned int read_ready:1;
+  /** True iff libevent has told us the socket is writable, and no write has
+   * come back short since. */
+  unsigned int write_ready:1;
+
   /** CONNECT/SOCKS proxy client handshake state (for outgoing connections). */
   unsigned int proxy_state:4;
 
@@ -1261,9 +1292,16 @@ typedef struct connection_t {
    * or has no socket. */
   tor_socket_t s;
   int conn_array_index; /**< Index into the global connection array. */
+  int conn_type_index; /**< Index into the array of connections of this
+                        * connection's type. */
+  int bw_blocked_idx; /**< Index into the list of connections blocked on
+                      * bandwidth, if on_bw_blocked_list is set. */
 
   struct event *read_event; /**< Libevent event structure. */
   struct event *write_event; /**< Libevent event structure. */
+  /** Timer that runs housekeeping on this connection at its next deadline;
+   * see connection_schedule_housekeeping(). NULL until first needed. */
+  struct timeout *housekeeping_timer;
   buf_t *inbuf; /**< Buffer holding data read over this connection. */
   buf_t *outbuf; /**< Buffer holding data to write over this connection. */
   size_t outbuf_flushlen; /**< How much data should we try to flush from the
@@ -1497,6 +1535,9 @@ typedef struct or_connection_t {
   /** True iff this connection has had its bootstrap failure logged with
    * control_event_bootstrap_problem. */
   unsigned int have_noted_bootstrap_problem:1;
+  /** True iff this incoming connection counts against its address's
+   * DoSConnectionMaxConcurrentCount, and must be uncounted when freed. */
+  unsigned int counted_for_dos:1;
 
   uint16_t link_proto; /**< What protocol version are we using? 0 for
                         * "none negotiated yet." */
@@ -1525,6 +1566,18 @@ typedef struct or_connection_t {
   /** Last emptied write token bucket in msec since midnight; only used if
    * TB_EMPTY events are enabled. */
   uint32_t write_emptied_time;
+  /** True iff this connection is on the list of OR connections whose
+   * token buckets are below their burst and need refilling. */
+  unsigned int on_refill_list:1;
+  int refill_idx; /**< Index into that list, if on_refill_list is set. */
+  /** True iff the other side was a known relay when we last set up our
+   * token buckets.  Other connections are from clients or bridges. */
+  unsigned int is_known_relay:1;
+  /** The refill interval for which fair_read_used counts bytes. */
+  uint32_t fair_share_epoch;
+  /** How many bytes have we read in the current refill interval?  Only
+   * kept for client connections while BandwidthFairShare is set. */
+  int fair_read_used;
 
   /*
    * Count the number of bytes flushed out on this orconn, and the number of
@@ -1544,6 +1597,27 @@ typedef struct edge_connection_t {
                        * circuit? */
   int deliver_window; /**< How many more relay cells can end at me? */
 
+  /** True iff this stream may shrink its deliver window below
+   * STREAMWINDOW_START based on measured sendme round trips. */
+  unsigned int adaptive_window:1;
+  /** How large a deliver window we try to keep open on this stream. Only
+   * meaningful if adaptive_window is set. */
+  int deliver_window_target;
+  /** How many data cells have been delivered on this stream. */
+  uint32_t n_data_cells_delivered;
+  /** If nonzero, the index of the first data cell that the exit could not
+   * have sent before receiving our last timed sendme. */
+  uint32_t sendme_probe_cell;
+  /** Monotonic time in msec at which we sent our last timed sendme. */
+  uint64_t sendme_probe_sent_msec;
+  /** Smallest sendme round trip we have seen on this stream, in msec, or 0
+   * if we have no sample yet. */
+  uint32_t min_sendme_rtt_msec;
+  /** How many bytes this stream may still package, beyond its share, the
+   * next time its circuit resumes packaging: deficit round-robin state.
+   * Reset whenever the stream has nothing left to package. */
+  int package_deficit;
+
   struct circuit_t *on_circuit; /**< The circuit (if any) that this edge
                                  * connection is using. */
 
@@ -1608,6 +1682,11 @@ typedef struct entry_connection_t {
 
   /** AP only: The original requested address before we rewrote it. */
   char *original_dest_address;
+
+  /** AP only: if the client DNS cache is tracking this resolve request,
+   * either as the lookup in flight or as a request waiting for it, the
+   * cache key for it.  See clientdns.c. */
+  uint8_t *dns_cache_key;
   /* Other fields to isolate on already exist.  The ClientAddr is addr.  The
      ClientProtocol is a combination of type and socks_request->
      socks_version.  SocksAuth is socks_request->username/password.
@@ -1702,6 +1781,9 @@ typedef struct dir_connection_t {
    * to append everything to the outbuf in one enormous chunk. */
   /** What exactly are we spooling right now? */
   dir_spool_source_bitfield_t  dir_spool_src : 3;
+  /** When spooling cached_dir_t objects, how does the client want them
+   * compressed? */
+  compress_method_t spool_compress_method;
 
   /** If we're fetching descriptors, what router purpose shall we assign
    * to them? */
@@ -1718,6 +1800,19 @@ typedef struct dir_connection_t {
   /** What rendezvous service are we querying for? */
   rend_data_t *rend_data;
 
+  /** If we're parsing a descriptor download as it arrives, our state for
+   * doing so. */
+  struct dir_stream_t *stream;
+  /** True iff we've decided whether to parse this response as it
+   * arrives. */
+  unsigned int stream_checked:1;
+  /** True iff this download was slow enough that we've asked another
+   * mirror for the same descriptors. */
+  unsigned int straggler_relaunched:1;
+  /** When did we launch this request, in msec on the coarse monotonic
+   * clock? */
+  uint64_t request_started_msec;
+
   char identity_digest[DIGEST_LEN]; /**< Hash of the public RSA key for
                                      * the directory server's signing key. */
 
@@ -1866,8 +1961,10 @@ typedef struct addr_policy_t {
 typedef struct cached_dir_t {
   char *dir; /**< Contents of this object, NUL-terminated. */
   char *dir_z; /**< Compressed contents of this object. */
+  char *dir_lzma; /**< LZMA-compressed contents of this object, if any. */
   size_t dir_len; /**< Length of <b>dir</b> (not counting its NUL). */
   size_t dir_z_len; /**< Length of <b>dir_z</b>. */
+  size_t dir_lzma_len; /**< Length of <b>dir_lzma</b>. */
   time_t published; /**< When was this object published. */
   common_digests_t digests; /**< Digests of this object (networkstatus only) */
   int refcnt; /**< Reference count for this cached_dir_t. */
@@ -2073,10 +2170,14 @@ typedef struct {
    * routerinfo? */
   time_t cert_expiration_time;
 
-  char *platform; /**< What software/operating system is this OR using? */
+  /* The strings below, and the strings in declared_family, are interned
+   * with tor_intern_string(), since many routers share them. */
 
-  char *protocol_list; /**< Encoded list of subprotocol versions supported
-                        * by this OR */
+  /** What software/operating system is this OR using? */
+  const char *platform;
+
+  /** Encoded list of subprotocol versions supported by this OR */
+  const char *protocol_list;
 
   /* link info */
   uint32_t bandwidthrate; /**< How many bytes does this OR add to its token
@@ -2086,13 +2187,16 @@ typedef struct {
   uint32_t bandwidthcapacity;
   smartlist_t *exit_policy; /**< What streams will this OR permit
                              * to exit on IPv4?  NULL for 'reject *:*'. */
+  /** exit_policy, compiled for quick lookups.  Built the first time we need
+   * it, by routerinfo_get_compiled_exit_policy(). */
+  struct compiled_policy_t *compiled_exit_policy;
   /** What streams will this OR permit to exit on IPv6?
    * NULL for 'reject *:*' */
   struct short_policy_t *ipv6_exit_policy;
   long uptime; /**< How many seconds the router claims to have been up */
   smartlist_t *declared_family; /**< Nicknames of router which this router
                                  * claims are its family. */
-  char *contact_info; /**< Declared contact info for this router. */
+  const char *contact_info; /**< Declared contact info for this router. */
   unsigned int is_hibernating:1; /**< Whether the router claims to be
                                   * hibernating */
   unsigned int caches_extra_info:1; /**< Whether the router says it caches and
@@ -2268,6 +2372,14 @@ typedef struct microdesc_t {
   unsigned int no_save : 1;
   /** If true, this microdesc has an entry in the microdesc_map */
   unsigned int held_in_map : 1;
+  /** If true, we read this microdesc from disk and have only located its
+   * body and annotations: none of the "fields in the microdescriptor" below
+   * are set yet.  Call microdesc_ensure_parsed() before using them. */
+  unsigned int body_unparsed : 1;
+  /** If true, we tried to parse the fields of this body_unparsed
+   * microdesc, and failed.  We won't use it, and we'll drop it from the cache
+   * on the next clean. */
+  unsigned int unparseable : 1;
   /** Reference count: how many node_ts have a reference to this microdesc? */
   unsigned int held_by_nodes;
 
@@ -2289,8 +2401,15 @@ typedef struct microdesc_t {
 
   /* Fields in the microdescriptor. */
 
-  /** As routerinfo_t.onion_pkey */
+  /** As routerinfo_t.onion_pkey.  May be NULL until the key is first
+   * needed; use microdesc_get_onion_pkey() rather than reading this
+   * directly. */
   crypto_pk_t *onion_pkey;
+  /** If we haven't yet decoded <b>onion_pkey</b>, its DER encoding, as
+   * taken from the microdescriptor. */
+  char *onion_pkey_der;
+  /** Length of <b>onion_pkey_der</b>. */
+  size_t onion_pkey_der_len;
   /** As routerinfo_t.onion_curve25519_pkey */
   curve25519_public_key_t *onion_curve25519_pkey;
   /** Ed25519 identity key, if included. */
@@ -2374,6 +2493,14 @@ typedef struct node_t {
   /** According to the geoip db what country is this router in? */
   /* XXXprop186 what is this suppose to mean with multiple OR ports? */
   country_t country;
+  /** The IPv4 address, in host order, that we looked up <b>country</b>
+   * for. */
+  uint32_t country_addr;
+
+  /** The value of the nodelist's consensus generation counter when this
+   * node was last listed in a consensus; used to notice which nodes dropped
+   * out of the consensus without rescanning the whole nodelist twice. */
+  unsigned int consensus_gen;
 
   /* The below items are used only by authdirservers for
    * reachability testing. */
@@ -2381,6 +2508,12 @@ typedef struct node_t {
   /** When was the last time we could reach this OR? */
   time_t last_reachable;        /* IPv4. */
   time_t last_reachable6;       /* IPv6. */
+  /** When did we last launch a reachability test to this OR?  Zero if we
+   * have not tested it since learning its current address. */
+  time_t last_reachability_test;
+  /** Monotonic time, in msec, at which we launched the IPv4 reachability
+   * test that has not yet completed; zero if no test is outstanding. */
+  uint64_t reachability_test_started_msec;
 
 } node_t;
 
@@ -2412,10 +2545,6 @@ typedef struct vote_routerstatus_t {
   /** True iff the vote included an entry for ed25519 ID, or included
    * "id ed25519 none" to indicate that there was no ed25519 ID. */
   unsigned int has_ed25519_listing:1;
-  /** True if the Ed25519 listing here is the consensus-opinion for the
-   * Ed25519 listing; false if there was no consensus on Ed25519 key status,
-   * or if this VRS doesn't reflect it. */
-  unsigned int ed25519_reflects_consensus:1;
   uint32_t measured_bw_kb; /**< Measured bandwidth (capacity) of the router */
   /** The hash or hashes that the authority claims this microdesc has. */
   vote_microdesc_hash_t *microdesc;
@@ -2491,6 +2620,28 @@ typedef enum {
 /** How many different consensus flavors are there? */
 #define N_CONSENSUS_FLAVORS ((int)(FLAV_MICRODESC)+1)
 
+/** The routerstatuses in a consensus that have the HSDir flag, in
+ * identity order, laid out flat so that we can binary-search them. */
+typedef struct hsdir_ring_t {
+  /** How many HSDirs are in the ring? */
+  int n_hsdirs;
+  /** Their identity digests, DIGEST_LEN bytes each. */
+  char *ids;
+  /** Their positions in the consensus's routerstatus_list. */
+  int *rs_idx;
+} hsdir_ring_t;
+
+/** An open-addressed hash table from identity digest to position in a
+ * consensus's routerstatus_list, so that we can find an entry without
+ * binary-searching the list. */
+typedef struct rs_id_index_t {
+  /** One less than the number of slots, which is a power of two. */
+  unsigned mask;
+  /** For each slot, one more than the index in routerstatus_list of the
+   * entry stored there, or 0 if the slot is empty. */
+  int *slots;
+} rs_id_index_t;
+
 /** A common structure to hold a v3 network status vote, or a v3 network
  * status consensus. */
 typedef struct networkstatus_t {
@@ -2566,6 +2717,14 @@ typedef struct networkstatus_t {
    * routerstatus_list. */
   digestmap_t *desc_digest_map;
 
+  /** If present, an index of routerstatus_list by identity digest.  For a
+   * consensus only. */
+  rs_id_index_t *id_index;
+
+  /** If present, the HSDirs among the elements of routerstatus_list.  For a
+   * consensus only. */
+  hsdir_ring_t *hsdir_ring;
+
   /** Contains the shared random protocol data from a vote or consensus. */
   networkstatus_sr_info_t sr_info;
 } networkstatus_t;
@@ -2790,6 +2949,9 @@ typedef struct {
   unsigned int need_capacity : 1;
   /** Whether the last hop was picked with exiting in mind. */
   unsigned int is_internal : 1;
+  /** Is this a preemptive stem: an internal circuit one hop shorter than
+   * usual, waiting to be extended to whatever exit a new stream needs? */
+  unsigned int is_stem : 1;
   /** Did we pick this as a one-hop tunnel (not safe for other streams)?
    * These are for encrypted dir conns that exit to this router, not
    * for arbitrary exits from the circuit. */
@@ -2803,6 +2965,9 @@ typedef struct {
   int failure_count;
   /** At what time should we give up on this task? */
   time_t expiry_time;
+  /** On the service side, when did we receive the INTRODUCE2 cell that
+   * made us launch this rendezvous circuit? */
+  monotime_t service_intro_received;
 } cpath_build_state_t;
 
 /** "magic" value for an origin_circuit_t */
@@ -2856,9 +3021,6 @@ typedef struct circuit_t {
   uint32_t magic; /**< For memory and type debugging: must equal
                    * ORIGIN_CIRCUIT_MAGIC or OR_CIRCUIT_MAGIC. */
 
-  /** The channel that is next in this circuit. */
-  channel_t *n_chan;
-
   /**
    * The circuit_id used in the next (forward) hop of this circuit;
    * this is unique to n_chan, but this ordered pair is globally
@@ -2868,6 +3030,9 @@ typedef struct circuit_t {
    */
   circid_t n_circ_id;
 
+  /** The channel that is next in this circuit. */
+  channel_t *n_chan;
+
   /**
    * Circuit mux associated with n_chan to which this circuit is attached;
    * NULL if we have no n_chan.
@@ -2877,6 +3042,15 @@ typedef struct circuit_t {
   /** Queue of cells waiting to be transmitted on n_chan */
   cell_queue_t n_chan_cells;
 
+  /** Next circuit in the doubly-linked ring of circuits waiting to add
+   * cells to n_conn.  NULL if we have no cells pending, or if we're not
+   * linked to an OR connection. */
+  struct circuit_t *next_active_on_n_chan;
+  /** Previous circuit in the doubly-linked ring of circuits waiting to add
+   * cells to n_conn.  NULL if we have no cells pending, or if we're not
+   * linked to an OR connection. */
+  struct circuit_t *prev_active_on_n_chan;
+
   /**
    * The hop to which we want to extend this circuit.  Should be NULL if
    * the circuit has attached to a channel.
@@ -2912,9 +3086,21 @@ typedef struct circuit_t {
    * circuit-level sendme cells to indicate that we're willing to accept
    * more. */
   int deliver_window;
+  /** Stream ID of the last stream we packaged from when this circuit's
+   * package window reopened, so that the next time it reopens we carry on
+   * with the stream after it. */
+  streamid_t last_resumed_stream_id;
 
   /** Temporary field used during circuits_handle_oom. */
   uint32_t age_tmp;
+  /** While this circuit is in the OOM index: the insertion time (truncated
+   * monotonic msec) of a cell at least as old as its oldest queued cell. */
+  uint32_t oom_cell_time;
+  /** Index of this circuit in the OOM index, or -1 if it is not there. */
+  int oom_index_idx;
+
+  /** Index in smartlist of all circuits (global_circuitlist). */
+  int global_circuitlist_idx;
 
   /** For storage while n_chan is pending (state CIRCUIT_STATE_CHAN_WAIT). */
   struct create_cell_t *n_chan_create_cell;
@@ -2953,11 +3139,11 @@ typedef struct circuit_t {
    */
   time_t timestamp_dirty;
 
+  const char *marked_for_close_file; /**< For debugging: in which file was this
+                                      * circuit marked for close? */
   uint16_t marked_for_close; /**< Should we close this circuit at the end of
                               * the main loop? (If true, holds the line number
                               * where this circuit was marked.) */
-  const char *marked_for_close_file; /**< For debugging: in which file was this
-                                      * circuit marked for close? */
   /** For what reason (See END_CIRC_REASON...) is this circuit being closed?
    * This field is set in circuit_mark_for_close and used later in
    * circuit_about_to_free. */
@@ -2970,18 +3156,6 @@ typedef struct circuit_t {
   /** Unique ID for measuring tunneled network status requests. */
   uint64_t dirreq_id;
 
-  /** Index in smartlist of all circuits (global_circuitlist). */
-  int global_circuitlist_idx;
-
-  /** Next circuit in the doubly-linked ring of circuits waiting to add
-   * cells to n_conn.  NULL if we have no cells pending, or if we're not
-   * linked to an OR connection. */
-  struct circuit_t *next_active_on_n_chan;
-  /** Previous circuit in the doubly-linked ring of circuits waiting to add
-   * cells to n_conn.  NULL if we have no cells pending, or if we're not
-   * linked to an OR connection. */
-  struct circuit_t *prev_active_on_n_chan;
-
   /** Various statistics about cells being added to or removed from this
    * circuit's queues; used only if CELL_STATS events are enabled and
    * cleared after being sent to control port. */
@@ -3068,6 +3242,11 @@ typedef struct origin_circuit_t {
    * to emit CIRC_BW events. */
   uint32_t n_written_circ_bw;
 
+  /** If we are a hidden service, bytes read from and written to any
+   * attached stream; counted toward the service's statistics when the
+   * circuit closes. */
+  uint64_t n_service_stream_bytes;
+
   /** Build state for this circuit. It includes the intended path
    * length, the chosen exit router, rendezvous information, etc.
    */
@@ -3079,6 +3258,13 @@ typedef struct origin_circuit_t {
    */
   crypt_path_t *cpath;
 
+  /** The path we last reported to controllers, as a comma-separated list
+   * of verbose nicknames, or NULL if we haven't made it since the path
+   * last changed.  See circuit_get_path_for_controller(). */
+  char *controller_path;
+  /** The nodelist names generation at which we made controller_path. */
+  unsigned int controller_path_names_gen;
+
   /** Holds all rendezvous data on either client or service side. */
   rend_data_t *rend_data;
 
@@ -3168,11 +3354,21 @@ typedef struct origin_circuit_t {
    * S_ESTABLISH_INTRO or S_INTRO, provided that no unversioned rendezvous
    * descriptor is used. */
   crypto_pk_t *intro_key;
+  /** How many INTRODUCE2 cells that arrived on this circuit are being
+   * handled by the cpuworkers. */
+  unsigned int n_pending_intro_jobs;
 
   /** Quasi-global identifier for this circuit; used for control.c */
   /* XXXX NM This can get re-used after 2**32 circuits. */
   uint32_t global_identifier;
 
+  /** Index of this circuit in the list of client circuits with purpose
+   * indexed_purpose, or -1 if it is in no such list. */
+  int purpose_list_idx;
+  /** The purpose under which this circuit was added to the client circuit
+   * index; only meaningful when purpose_list_idx is not -1. */
+  uint8_t indexed_purpose;
+
   /** True if we have associated one stream to this circuit, thereby setting
    * the isolation paramaters for this circuit.  Note that this doesn't
    * necessarily mean that we've <em>attached</em> any streams to the circuit:
@@ -3234,26 +3430,14 @@ struct onion_queue_t;
 typedef struct or_circuit_t {
   circuit_t base_;
 
-  /** Next circuit in the doubly-linked ring of circuits waiting to add
-   * cells to p_chan.  NULL if we have no cells pending, or if we're not
-   * linked to an OR connection. */
-  struct circuit_t *next_active_on_p_chan;
-  /** Previous circuit in the doubly-linked ring of circuits waiting to add
-   * cells to p_chan.  NULL if we have no cells pending, or if we're not
-   * linked to an OR connection. */
-  struct circuit_t *prev_active_on_p_chan;
-  /** Pointer to an entry on the onion queue, if this circuit is waiting for a
-   * chance to give an onionskin to a cpuworker. Used only in onion.c */
-  struct onion_queue_t *onionqueue_entry;
-  /** Pointer to a workqueue entry, if this circuit has given an onionskin to
-   * a cpuworker and is waiting for a response. Used to decide whether it is
-   * safe to free a circuit or if it is still in use by a cpuworker. */
-  struct workqueue_entry_s *workqueue_entry;
-
   /** The circuit_id used in the previous (backward) hop of this circuit. */
   circid_t p_circ_id;
-  /** Queue of cells waiting to be transmitted on p_conn. */
-  cell_queue_t p_chan_cells;
+  /** Maximum cell queue size for a middle relay; this is stored per circuit
+   * so append_cell_to_circuit_queue() can adjust it if it changes.  If set
+   * to zero, it is initialized to the default value.
+   */
+  uint32_t max_middle_cells;
+
   /** The channel that is previous in this circuit. */
   channel_t *p_chan;
   /**
@@ -3261,11 +3445,17 @@ typedef struct or_circuit_t {
    * NULL if we have no p_chan.
    */
   circuitmux_t *p_mux;
-  /** Linked list of Exit streams associated with this circuit. */
-  edge_connection_t *n_streams;
-  /** Linked list of Exit streams associated with this circuit that are
-   * still being resolved. */
-  edge_connection_t *resolving_streams;
+  /** Queue of cells waiting to be transmitted on p_conn. */
+  cell_queue_t p_chan_cells;
+  /** Next circuit in the doubly-linked ring of circuits waiting to add
+   * cells to p_chan.  NULL if we have no cells pending, or if we're not
+   * linked to an OR connection. */
+  struct circuit_t *next_active_on_p_chan;
+  /** Previous circuit in the doubly-linked ring of circuits waiting to add
+   * cells to p_chan.  NULL if we have no cells pending, or if we're not
+   * linked to an OR connection. */
+  struct circuit_t *prev_active_on_p_chan;
+
   /** The cipher used by intermediate hops for cells heading toward the
    * OP. */
   crypto_cipher_t *p_crypto;
@@ -3282,12 +3472,30 @@ typedef struct or_circuit_t {
    */
   crypto_digest_t *n_digest;
 
+  /** Linked list of Exit streams associated with this circuit. */
+  edge_connection_t *n_streams;
+  /** Linked list of Exit streams associated with this circuit that are
+   * still being resolved. */
+  edge_connection_t *resolving_streams;
+
+  /** Pointer to an entry on the onion queue, if this circuit is waiting for a
+   * chance to give an onionskin to a cpuworker. Used only in onion.c */
+  struct onion_queue_t *onionqueue_entry;
+  /** Pointer to a workqueue entry, if this circuit has given an onionskin to
+   * a cpuworker and is waiting for a response. Used to decide whether it is
+   * safe to free a circuit or if it is still in use by a cpuworker. */
+  struct workqueue_entry_s *workqueue_entry;
+
   /** Points to spliced circuit if purpose is REND_ESTABLISHED, and circuit
    * is not marked for close. */
   struct or_circuit_t *rend_splice;
 
   struct or_circuit_rendinfo_s *rendinfo;
 
+  /** Cell queueing statistics for this circuit, allocated the first time we
+   * record any; used only if CellStatistics is set. */
+  struct or_circuit_buffer_stats_s *buffer_stats;
+
   /** Stores KH for the handshake. */
   char rend_circ_nonce[DIGEST_LEN];/* KH in tor-spec.txt */
 
@@ -3304,21 +3512,6 @@ typedef struct or_circuit_t {
   /** If set, this circuit carries HS traffic. Consider it in any HS
    *  statistics. */
   unsigned int circuit_carries_hs_traffic_stats : 1;
-
-  /** Number of cells that were removed from circuit queue; reset every
-   * time when writing buffer stats to disk. */
-  uint32_t processed_cells;
-
-  /** Total time in milliseconds that cells spent in both app-ward and
-   * exit-ward queues of this circuit; reset every time when writing
-   * buffer stats to disk. */
-  uint64_t total_cell_waiting_time;
-
-  /** Maximum cell queue size for a middle relay; this is stored per circuit
-   * so append_cell_to_circuit_queue() can adjust it if it changes.  If set
-   * to zero, it is initialized to the default value.
-   */
-  uint32_t max_middle_cells;
 } or_circuit_t;
 
 typedef struct or_circuit_rendinfo_s {
@@ -3340,6 +3533,19 @@ typedef struct or_circuit_rendinfo_s {
 
 } or_circuit_rendinfo_t;
 
+/** Cell queueing statistics that we keep for an or_circuit_t when
+ * CellStatistics is set. */
+typedef struct or_circuit_buffer_stats_s {
+  /** Number of cells that were removed from circuit queue; reset every
+   * time when writing buffer stats to disk. */
+  uint32_t processed_cells;
+
+  /** Total time in milliseconds that cells spent in both app-ward and
+   * exit-ward queues of this circuit; reset every time when writing
+   * buffer stats to disk. */
+  uint64_t total_cell_waiting_time;
+} or_circuit_buffer_stats_t;
+
 /** Convert a circuit subtype to a circuit_t. */
 #define TO_CIRCUIT(x)  (&((x)->base_))
 
@@ -3499,6 +3705,11 @@ typedef struct {
                           * each log message occurs? */
   int TruncateLogFile; /**< Boolean: Should we truncate the log file
                             before we start writing? */
+  int AsyncLogging; /**< Boolean: Should a separate thread write our file
+                     * and console logs? */
+  int AsyncLoggingDropWhenFull; /**< Boolean: Should we drop log messages,
+                                 * rather than wait, when the asynchronous
+                                 * log writer falls behind? */
   char *SyslogIdentityTag; /**< Identity tag to add for syslog logging. */
 
   char *DebugLogFile; /**< Where to send verbose log messages. */
@@ -3710,10 +3921,19 @@ typedef struct {
    * an INTRODUCE1 cell on its way to the service. */
   int CloseHSClientCircuitsImmediatelyOnTimeout;
 
+  /** If true, when an introduction circuit is slow to build, build
+   * another one to a different introduction point, and use whichever
+   * opens first. */
+  int HSClientRaceIntroPoints;
+
   /** Close hidden-service-side rendezvous circuits immediately when
    * they reach the normal circuit-build timeout. */
   int CloseHSServiceRendCircuitsImmediatelyOnTimeout;
 
+  /** Save our client-side hidden service descriptors and intro point
+   * failures to disk, and reload them after a restart. */
+  int PersistHSClientCache;
+
   /** Onion Services in HiddenServiceSingleHopMode make one-hop (direct)
    * circuits between the onion service server, and the introduction and
    * rendezvous points. (Onion service descriptors are still posted using
@@ -3726,6 +3946,9 @@ typedef struct {
    * rend_service_reveal_startup_time() instead of using this option directly.
    */
   int HiddenServiceSingleHopMode;
+  /** If true, hidden services use Bloom filters rather than digest maps to
+   * recognize replayed INTRODUCE2 cells. */
+  int HiddenServiceReplayFilter;
   /* Makes hidden service clients and servers non-anonymous on this tor
    * instance. Allows the non-anonymous HiddenServiceSingleHopMode. Enables
    * non-anonymous behaviour in the hidden service protocol.
@@ -3805,6 +4028,9 @@ typedef struct {
                          * a new one? */
   int MaxCircuitDirtiness; /**< Never use circs that were first used more than
                                 this interval ago. */
+  /** How many preemptive circuit stems should a client keep ready to
+   * extend to a new exit? */
+  int PreemptiveCircuitStems;
   int PredictedPortsRelevanceTime; /** How long after we've requested a
                                     * connection for a given port, do we want
                                     * to continue to pick exits that support
@@ -3821,7 +4047,19 @@ typedef struct {
                                  * use in a second for all relayed conns? */
   uint64_t PerConnBWRate; /**< Long-term bw on a single TLS conn, if set. */
   uint64_t PerConnBWBurst; /**< Allowed burst on a single TLS conn, if set. */
+  /** If true, when our read bandwidth runs out, limit each client
+   * connection to an equal share of what we can read. */
+  int BandwidthFairShare;
   int NumCPUs; /**< How many CPUs should we try to use? */
+  /** If nonzero, let idle cpuworker threads exit until this many are left,
+   * and start them again up to NumCPUs when work has to wait. */
+  int NumCPUsMin;
+  /** CPUs to bind the main thread (first entry) and the cpuworkers (the
+   * rest) to; empty for no binding. */
+  smartlist_t *CPUAffinity;
+  /** If nonzero, report every time the main loop stalls for at least this
+   * many msec, with a stack trace of what it was doing. */
+  int MainLoopStallThreshold;
 //int RunTesting; /**< If true, create testing circuits to measure how well the
 //                 * other ORs are running. */
   config_line_t *RendConfigLines; /**< List of configuration lines
@@ -3972,6 +4210,9 @@ typedef struct {
                   * log whether it was DNS-leaking or not? */
   int HardwareAccel; /**< Boolean: Should we enable OpenSSL hardware
                       * acceleration where available? */
+  /** Boolean: Should cpuworkers run onion handshakes as OpenSSL async jobs,
+   * so that an async engine can work on several at once? */
+  int HardwareAccelAsync;
   /** Token Bucket Refill resolution in milliseconds. */
   int TokenBucketRefillInterval;
   char *AccelName; /**< Optional hardware acceleration engine name. */
@@ -4007,6 +4248,12 @@ typedef struct {
   /** Should we fetch our dir info at the start of the consensus period? */
   int FetchDirInfoExtraEarly;
 
+  /** Should we read our cached descriptor files into memory as soon as we
+   * map them? */
+  int CacheFilePrefetch;
+  /** Should we ask for huge pages for our cached descriptor files? */
+  int CacheFileHugePages;
+
   int DirCache; /**< Cache all directory documents and accept requests via
                  * tunnelled dir conns from clients. If 1, enabled (default);
                  * If 0, disabled. */
@@ -4107,6 +4354,12 @@ typedef struct {
    * Helps avoid some cross-site attacks. */
   int ClientDNSRejectInternalAddresses;
 
+#define MAX_CLIENT_DNS_CACHE_SIZE (1<<20)
+  /** How many answers to RESOLVE requests should we remember, for answering
+   * repeated requests from the same isolation context?  0 to remember
+   * none. */
+  int ClientDNSCacheSize;
+
   /** If true, do not accept any requests to connect to internal addresses
    * over randomly chosen exits. */
   int ClientRejectInternalAddresses;
@@ -4342,6 +4595,20 @@ typedef struct {
    */
   double CircuitPriorityHalflife;
 
+  /** If set, share each channel between traffic classes (directory, onion
+   * service, and general circuits) in proportion to these weights, instead
+   * of using cell-EWMA.  A string like "dir=8,onion=4,general=1". */
+  char *CircuitPriorityWeights;
+
+  /** Largest number of OR connections we accept at once from one address;
+   * 0 for no limit. */
+  int DoSConnectionMaxConcurrentCount;
+  /** How many CREATE cells per second one address may send on average; 0
+   * for no limit. */
+  int DoSCircuitCreationRate;
+  /** How many CREATE cells one address may send in a burst. */
+  int DoSCircuitCreationBurst;
+
   /** Set to true if the TestingTorNetwork configuration option is set.
    * This is used so that options_validate() has a chance to realize that
    * the defaults have changed. */
@@ -4365,10 +4632,18 @@ typedef struct {
    * never use it.  If -1, we do what the consensus says. */
   int OptimisticData;
 
+  /** If 1, let client streams keep their receive windows below
+   * STREAMWINDOW_START while measured sendme round trips show queueing. */
+  int AdaptiveStreamWindows;
+
   /** If 1, we accept and launch no external network connections, except on
    * control ports. */
   int DisableNetwork;
 
+  /** If 1, register each new connection's socket once with edge-triggered
+   * events where Libevent supports them, and track readiness ourselves. */
+  int EdgeTriggeredIO;
+
   /**
    * Parameters for path-bias detection.
    * @{
@@ -4428,8 +4703,20 @@ typedef struct {
 
   int IPv6Exit; /**< Do we support exiting to IPv6 addresses? */
 
+  /** If true, and we are an exit, keep a few preconnected sockets open to
+   * destinations that recent streams have used heavily. */
+  int ExitPreconnect;
+
   char *TLSECGroup; /**< One of "P256", "P224", or nil for auto */
 
+  /** If true, let clients resume recent TLS sessions with us, and try to
+   * resume our own recent TLS sessions with relays. */
+  int TLSSessionResumption;
+
+  /** If true, let OpenSSL read as much as each socket has ready, rather
+   * than one TLS record at a time. */
+  int TLSReadAhead;
+
   /** Fraction: */
   double PathsNeededToBuildCircuits;
 
@@ -4452,6 +4739,9 @@ typedef struct {
    * when sending.
    */
   int SchedulerMaxFlushCells__;
+  /** Names of the schedulers we'd like to use, in order of preference.  We
+   * use the first one that works on this platform. */
+  smartlist_t *Schedulers;
 
   /** Is this an exit node?  This is a tristate, where "1" means "yes, and use
    * the default exit policy if none is given" and "0" means "no; exit policy
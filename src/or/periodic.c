@@ -46,6 +46,7 @@ periodic_event_dispatch(evutil_socket_t fd, short what, void *data)
   (void)what;
   periodic_event_item_t *event = data;
 
+  monotime_coarse_cache_clear();
   time_t now = time(NULL);
   const or_options_t *options = get_options();
 //  log_debug(LD_GENERAL, "Dispatching %s", event->name);
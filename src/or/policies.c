@@ -1264,25 +1264,33 @@ policy_eq(policy_map_ent_t *a, policy_map_ent_t *b)
   return cmp_single_addr_policy(a->policy, b->policy) == 0;
 }
 
-/** Return a hashcode for <b>ent</b> */
-static unsigned int
-policy_hash(const policy_map_ent_t *ent)
+/** Set *<b>out</b> to a copy of <b>a</b> that has only the fields that
+ * make it what it is, with everything else (including padding) zeroed, so
+ * that equal policies have identical bytes. */
+static void
+addr_policy_normalize(addr_policy_t *out, const addr_policy_t *a)
 {
-  const addr_policy_t *a = ent->policy;
-  addr_policy_t aa;
-  memset(&aa, 0, sizeof(aa));
+  memset(out, 0, sizeof(*out));
 
-  aa.prt_min = a->prt_min;
-  aa.prt_max = a->prt_max;
-  aa.maskbits = a->maskbits;
-  aa.policy_type = a->policy_type;
-  aa.is_private = a->is_private;
+  out->prt_min = a->prt_min;
+  out->prt_max = a->prt_max;
+  out->maskbits = a->maskbits;
+  out->policy_type = a->policy_type;
+  out->is_private = a->is_private;
 
   if (a->is_private) {
-    aa.is_private = 1;
+    out->is_private = 1;
   } else {
-    tor_addr_copy_tight(&aa.addr, &a->addr);
+    tor_addr_copy_tight(&out->addr, &a->addr);
   }
+}
+
+/** Return a hashcode for <b>ent</b> */
+static unsigned int
+policy_hash(const policy_map_ent_t *ent)
+{
+  addr_policy_t aa;
+  addr_policy_normalize(&aa, ent->policy);
 
   return (unsigned) siphash24g(&aa, sizeof(aa));
 }
@@ -1462,6 +1470,462 @@ compare_tor_addr_to_addr_policy,(const tor_addr_t *addr, uint16_t port,
   }
 }
 
+/** One entry of a compiled_policy_t.  This holds the parts of an
+ * addr_policy_t we still need once the address has been used to place
+ * the entry in a trie. */
+typedef struct compiled_policy_rule_t {
+  uint16_t prt_min; /**< Lowest port number to accept/reject. */
+  uint16_t prt_max; /**< Highest port number to accept/reject. */
+  maskbits_t maskbits; /**< Accept/reject all addresses that match this
+                        * many bits. */
+  unsigned int is_accept:1; /**< True iff this entry is an "accept". */
+} compiled_policy_rule_t;
+
+/** A node in the address prefix trie of a compiled_policy_t.  The trie is
+ * path-compressed: a node exists only for a prefix that some policy entry
+ * uses, or where two such prefixes branch. */
+typedef struct policy_trie_node_t {
+  /** The first <b>bits</b> bits of this node's prefix, in network order.
+   * All later bits are zero. */
+  uint8_t prefix[16];
+  /** Length of this node's prefix, in bits. */
+  int bits;
+  /** Child nodes for prefixes whose next bit is 0 or 1, respectively. */
+  struct policy_trie_node_t *child[2];
+  /** Bitmap of the 1024-port blocks that any of this node's entries
+   * covers.  Lets us skip a node without looking at its entries. */
+  uint64_t port_blocks;
+  /** Indices into the compiled_policy_t's rules of the entries whose
+   * address is exactly this node's prefix, in policy order. */
+  int *rule_idx;
+  /** Number of elements in rule_idx. */
+  int n_rules;
+  /** Number of elements allocated for rule_idx. */
+  int rules_allocated;
+} policy_trie_node_t;
+
+/** An address policy compiled for quick lookups.  Policy entries are
+ * placed in one prefix trie per address family, so that matching an
+ * address only looks at entries on the path to that address. */
+struct compiled_policy_t {
+  /** Every entry of the policy, in order. */
+  compiled_policy_rule_t *rules;
+  /** Number of entries in rules. */
+  int n_rules;
+  /** Roots of the trie for IPv4 and IPv6 entries.  Entries for other
+   * address families never match a known address, so they only appear in
+   * rules. */
+  policy_trie_node_t *ipv4_root;
+  policy_trie_node_t *ipv6_root;
+  /** Cached results of policy_is_reject_star() for AF_INET, AF_INET6 and
+   * AF_UNSPEC on the policy we were compiled from. */
+  unsigned int is_reject_star_ipv4:1;
+  unsigned int is_reject_star_ipv6:1;
+  unsigned int is_reject_star_unspec:1;
+};
+
+/** Longest prefix of an entry in the trie for <b>family</b>. */
+#define POLICY_TRIE_MAX_BITS(family) ((family) == AF_INET ? 32 : 128)
+
+/** Return bit <b>n</b> of the network-order <b>key</b>. */
+static inline int
+policy_trie_get_bit(const uint8_t *key, int n)
+{
+  return (key[n >> 3] >> (7 - (n & 7))) & 1;
+}
+
+/** Return the number of leading bits, up to <b>maxbits</b>, that
+ * <b>a</b> and <b>b</b> have in common. */
+static int
+policy_trie_common_bits(const uint8_t *a, const uint8_t *b, int maxbits)
+{
+  int n = 0;
+  while (n + 8 <= maxbits && a[n >> 3] == b[n >> 3])
+    n += 8;
+  while (n < maxbits && policy_trie_get_bit(a, n) == policy_trie_get_bit(b, n))
+    ++n;
+  return n;
+}
+
+/** Return true iff the first <b>bits</b> bits of <b>a</b> and <b>b</b> are
+ * the same. */
+static inline int
+policy_trie_prefix_matches(const uint8_t *a, const uint8_t *b, int bits)
+{
+  const int bytes = bits >> 3;
+  const int leftover_bits = bits & 7;
+  if (bytes && fast_memneq(a, b, bytes))
+    return 0;
+  if (leftover_bits)
+    return (a[bytes] >> (8-leftover_bits)) == (b[bytes] >> (8-leftover_bits));
+  return 1;
+}
+
+/** Set <b>key</b> to the network-order bytes of <b>addr</b>, which must be
+ * an IPv4 or IPv6 address. */
+static void
+policy_trie_key_from_addr(uint8_t *key, const tor_addr_t *addr)
+{
+  memset(key, 0, 16);
+  if (tor_addr_family(addr) == AF_INET) {
+    set_uint32(key, tor_addr_to_ipv4n(addr));
+  } else {
+    memcpy(key, tor_addr_to_in6_addr8(addr), 16);
+  }
+}
+
+/** Allocate and return a new trie node for the first <b>bits</b> bits of
+ * <b>key</b>. */
+static policy_trie_node_t *
+policy_trie_node_new(const uint8_t *key, int bits)
+{
+  policy_trie_node_t *node = tor_malloc_zero(sizeof(policy_trie_node_t));
+  memcpy(node->prefix, key, (bits + 7) >> 3);
+  if (bits & 7)
+    node->prefix[bits >> 3] &= (uint8_t)(0xff << (8 - (bits & 7)));
+  node->bits = bits;
+  return node;
+}
+
+/** Return the node for the first <b>bits</b> bits of <b>key</b> in the trie
+ * at *<b>rootp</b>, adding it (and splitting existing nodes) if needed. */
+static policy_trie_node_t *
+policy_trie_find_or_insert(policy_trie_node_t **rootp, const uint8_t *key,
+                           int bits)
+{
+  policy_trie_node_t **nodep = rootp;
+
+  while (1) {
+    policy_trie_node_t *node = *nodep, *branch, *leaf;
+    int common;
+    if (!node) {
+      *nodep = policy_trie_node_new(key, bits);
+      return *nodep;
+    }
+
+    common = policy_trie_common_bits(node->prefix, key,
+                                     MIN(node->bits, bits));
+    if (common == node->bits) {
+      if (common == bits)
+        return node;
+      nodep = &node->child[policy_trie_get_bit(key, node->bits)];
+      continue;
+    }
+
+    if (common == bits) {
+      /* The new prefix is a proper prefix of this node's. */
+      leaf = policy_trie_node_new(key, bits);
+      leaf->child[policy_trie_get_bit(node->prefix, bits)] = node;
+      *nodep = leaf;
+      return leaf;
+    }
+
+    /* The prefixes differ at bit <b>common</b>: add a node to branch on
+     * it. */
+    branch = policy_trie_node_new(key, common);
+    leaf = policy_trie_node_new(key, bits);
+    branch->child[policy_trie_get_bit(node->prefix, common)] = node;
+    branch->child[policy_trie_get_bit(key, common)] = leaf;
+    *nodep = branch;
+    return leaf;
+  }
+}
+
+/** Add the entry at index <b>idx</b> of <b>cp</b> to <b>node</b>. */
+static void
+policy_trie_node_add_rule(policy_trie_node_t *node,
+                          const compiled_policy_t *cp, int idx)
+{
+  const compiled_policy_rule_t *rule = &cp->rules[idx];
+  int block;
+
+  if (node->n_rules == node->rules_allocated) {
+    node->rules_allocated = node->rules_allocated ?
+      node->rules_allocated * 2 : 4;
+    node->rule_idx = tor_reallocarray(node->rule_idx,
+                                      node->rules_allocated, sizeof(int));
+  }
+  node->rule_idx[node->n_rules++] = idx;
+
+  for (block = rule->prt_min >> 10; block <= rule->prt_max >> 10; ++block)
+    node->port_blocks |= U64_LITERAL(1) << block;
+}
+
+/** Release all storage held by the trie rooted at <b>node</b>. */
+static void
+policy_trie_free(policy_trie_node_t *node)
+{
+  if (!node)
+    return;
+  policy_trie_free(node->child[0]);
+  policy_trie_free(node->child[1]);
+  tor_free(node->rule_idx);
+  tor_free(node);
+}
+
+/** Build and return a compiled_policy_t that gives the same answers as
+ * <b>policy</b> does.  The result does not refer to <b>policy</b>, so
+ * <b>policy</b> may be freed afterwards.  Return NULL if <b>policy</b> is
+ * NULL. */
+compiled_policy_t *
+compiled_policy_new(const smartlist_t *policy)
+{
+  compiled_policy_t *cp;
+
+  if (!policy)
+    return NULL;
+
+  cp = tor_malloc_zero(sizeof(compiled_policy_t));
+  cp->n_rules = smartlist_len(policy);
+  cp->rules = tor_calloc(MAX(cp->n_rules, 1), sizeof(compiled_policy_rule_t));
+
+  SMARTLIST_FOREACH_BEGIN(policy, const addr_policy_t *, p) {
+    const sa_family_t family = tor_addr_family(&p->addr);
+    compiled_policy_rule_t *rule = &cp->rules[p_sl_idx];
+    policy_trie_node_t **rootp;
+    uint8_t key[16];
+
+    rule->prt_min = p->prt_min;
+    rule->prt_max = p->prt_max;
+    rule->maskbits = p->maskbits;
+    rule->is_accept = p->policy_type == ADDR_POLICY_ACCEPT;
+
+    if (family == AF_INET) {
+      rootp = &cp->ipv4_root;
+    } else if (family == AF_INET6) {
+      rootp = &cp->ipv6_root;
+    } else {
+      if (family == AF_UNSPEC) {
+        log_warn(LD_BUG, "Policy contains an AF_UNSPEC address, which only "
+                 "matches other AF_UNSPEC addresses.");
+      }
+      continue;
+    }
+
+    policy_trie_key_from_addr(key, &p->addr);
+    policy_trie_node_add_rule(
+         policy_trie_find_or_insert(rootp, key,
+                          MIN(p->maskbits, POLICY_TRIE_MAX_BITS(family))),
+         cp, p_sl_idx);
+  } SMARTLIST_FOREACH_END(p);
+
+  cp->is_reject_star_ipv4 = policy_is_reject_star(policy, AF_INET);
+  cp->is_reject_star_ipv6 = policy_is_reject_star(policy, AF_INET6);
+  cp->is_reject_star_unspec = policy_is_reject_star(policy, AF_UNSPEC);
+
+  return cp;
+}
+
+/** Release all storage held by <b>cp</b>. */
+void
+compiled_policy_free(compiled_policy_t *cp)
+{
+  if (!cp)
+    return;
+  policy_trie_free(cp->ipv4_root);
+  policy_trie_free(cp->ipv6_root);
+  tor_free(cp->rules);
+  tor_free(cp);
+}
+
+/** Set <b>path</b> to the nodes of the trie for <b>addr</b>'s family in
+ * <b>cp</b> whose prefixes match <b>addr</b>, from shortest to longest
+ * prefix, and return how many there are.  <b>path</b> must have room for
+ * 129 nodes. */
+static int
+compiled_policy_get_path(const compiled_policy_t *cp, const tor_addr_t *addr,
+                         const policy_trie_node_t **path)
+{
+  const sa_family_t family = tor_addr_family(addr);
+  const policy_trie_node_t *node;
+  uint8_t key[16];
+  int n = 0;
+
+  if (family == AF_INET)
+    node = cp->ipv4_root;
+  else if (family == AF_INET6)
+    node = cp->ipv6_root;
+  else
+    return 0;
+
+  policy_trie_key_from_addr(key, addr);
+  while (node && policy_trie_prefix_matches(node->prefix, key, node->bits)) {
+    path[n++] = node;
+    if (node->bits == POLICY_TRIE_MAX_BITS(family))
+      break;
+    node = node->child[policy_trie_get_bit(key, node->bits)];
+  }
+  return n;
+}
+
+/** Helper for compare_tor_addr_to_compiled_policy.  Implements the case
+ * where addr and port are both known. */
+static addr_policy_result_t
+compare_known_tor_addr_to_compiled_policy(const tor_addr_t *addr,
+                                          uint16_t port,
+                                          const compiled_policy_t *cp)
+{
+  const policy_trie_node_t *path[129];
+  const uint64_t port_block = U64_LITERAL(1) << (port >> 10);
+  int n_path, i, j, best = cp->n_rules;
+
+  /* The first entry that matches is the one with the lowest index among
+   * the matching entries of every node on the path. */
+  n_path = compiled_policy_get_path(cp, addr, path);
+  for (i = 0; i < n_path; ++i) {
+    const policy_trie_node_t *node = path[i];
+    if (!(node->port_blocks & port_block))
+      continue;
+    for (j = 0; j < node->n_rules && node->rule_idx[j] < best; ++j) {
+      const compiled_policy_rule_t *rule = &cp->rules[node->rule_idx[j]];
+      if (port >= rule->prt_min && port <= rule->prt_max) {
+        best = node->rule_idx[j];
+        break;
+      }
+    }
+  }
+
+  if (best < cp->n_rules) {
+    return cp->rules[best].is_accept ?
+      ADDR_POLICY_ACCEPTED : ADDR_POLICY_REJECTED;
+  }
+  /* accept all by default. */
+  return ADDR_POLICY_ACCEPTED;
+}
+
+/** Helper for compare_tor_addr_to_compiled_policy.  Implements the case
+ * where addr is known but port is not. */
+static addr_policy_result_t
+compare_known_tor_addr_to_compiled_policy_noport(const tor_addr_t *addr,
+                                                 const compiled_policy_t *cp)
+{
+  const policy_trie_node_t *path[129];
+  int n_path, i, j, definite = cp->n_rules;
+  int maybe_accept = 0, maybe_reject = 0;
+
+  /* Find the first matching entry that covers all ports... */
+  n_path = compiled_policy_get_path(cp, addr, path);
+  for (i = 0; i < n_path; ++i) {
+    const policy_trie_node_t *node = path[i];
+    for (j = 0; j < node->n_rules && node->rule_idx[j] < definite; ++j) {
+      const compiled_policy_rule_t *rule = &cp->rules[node->rule_idx[j]];
+      if (rule->prt_min <= 1 && rule->prt_max >= 65535) {
+        definite = node->rule_idx[j];
+        break;
+      }
+    }
+  }
+
+  /* ...and then look at the matching entries before it, all of which
+   * might match. */
+  for (i = 0; i < n_path; ++i) {
+    const policy_trie_node_t *node = path[i];
+    for (j = 0; j < node->n_rules && node->rule_idx[j] < definite; ++j) {
+      if (cp->rules[node->rule_idx[j]].is_accept)
+        maybe_accept = 1;
+      else
+        maybe_reject = 1;
+    }
+  }
+
+  if (definite < cp->n_rules) {
+    if (cp->rules[definite].is_accept) {
+      return maybe_reject ? ADDR_POLICY_PROBABLY_ACCEPTED :
+        ADDR_POLICY_ACCEPTED;
+    } else {
+      return maybe_accept ? ADDR_POLICY_PROBABLY_REJECTED :
+        ADDR_POLICY_REJECTED;
+    }
+  }
+  /* accept all by default. */
+  return maybe_reject ? ADDR_POLICY_PROBABLY_ACCEPTED : ADDR_POLICY_ACCEPTED;
+}
+
+/** Helper for compare_tor_addr_to_compiled_policy.  Implements the case
+ * where port is known but address is not. */
+static addr_policy_result_t
+compare_unknown_tor_addr_to_compiled_policy(uint16_t port,
+                                            const compiled_policy_t *cp)
+{
+  int maybe_accept = 0, maybe_reject = 0, i;
+
+  /* Without an address the trie can't help us, so this is
+   * compare_unknown_tor_addr_to_addr_policy() over the compact entries. */
+  for (i = 0; i < cp->n_rules; ++i) {
+    const compiled_policy_rule_t *rule = &cp->rules[i];
+    if (rule->prt_min <= port && port <= rule->prt_max) {
+      if (rule->maskbits == 0) {
+        if (rule->is_accept) {
+          return maybe_reject ? ADDR_POLICY_PROBABLY_ACCEPTED :
+            ADDR_POLICY_ACCEPTED;
+        } else {
+          return maybe_accept ? ADDR_POLICY_PROBABLY_REJECTED :
+            ADDR_POLICY_REJECTED;
+        }
+      } else if (rule->is_accept) {
+        maybe_accept = 1;
+      } else {
+        maybe_reject = 1;
+      }
+    }
+  }
+
+  /* accept all by default. */
+  return maybe_reject ? ADDR_POLICY_PROBABLY_ACCEPTED : ADDR_POLICY_ACCEPTED;
+}
+
+/** As compare_tor_addr_to_addr_policy(), but look at the compiled policy
+ * <b>cp</b>.  Gives the same answer as compare_tor_addr_to_addr_policy()
+ * does for the policy that <b>cp</b> was compiled from. */
+addr_policy_result_t
+compare_tor_addr_to_compiled_policy(const tor_addr_t *addr, uint16_t port,
+                                    const compiled_policy_t *cp)
+{
+  if (!cp) {
+    /* no policy? accept all. */
+    return ADDR_POLICY_ACCEPTED;
+  } else if (addr == NULL || tor_addr_is_null(addr)) {
+    if (port == 0) {
+      log_info(LD_BUG, "Rejecting null address with 0 port (family %d)",
+               addr ? tor_addr_family(addr) : -1);
+      return ADDR_POLICY_REJECTED;
+    }
+    return compare_unknown_tor_addr_to_compiled_policy(port, cp);
+  } else if (port == 0) {
+    return compare_known_tor_addr_to_compiled_policy_noport(addr, cp);
+  } else {
+    return compare_known_tor_addr_to_compiled_policy(addr, port, cp);
+  }
+}
+
+/** As policy_is_reject_star(), for the policy that <b>cp</b> was compiled
+ * from. */
+int
+compiled_policy_is_reject_star(const compiled_policy_t *cp,
+                               sa_family_t family)
+{
+  if (!cp)
+    return 1;
+  if (family == AF_INET)
+    return cp->is_reject_star_ipv4;
+  else if (family == AF_INET6)
+    return cp->is_reject_star_ipv6;
+  else if (family == AF_UNSPEC)
+    return cp->is_reject_star_unspec;
+  return 1;
+}
+
+/** Return the compiled form of <b>router</b>'s exit policy, compiling it
+ * the first time we're asked.  Return NULL if <b>router</b> has no exit
+ * policy. */
+const compiled_policy_t *
+routerinfo_get_compiled_exit_policy(routerinfo_t *router)
+{
+  if (!router->compiled_exit_policy)
+    router->compiled_exit_policy = compiled_policy_new(router->exit_policy);
+  return router->compiled_exit_policy;
+}
+
 /** Return true iff the address policy <b>a</b> covers every case that
  * would be covered by <b>b</b>, so that a,b is redundant. */
 static int
@@ -2411,15 +2875,9 @@ policy_summary_add_item(smartlist_t *summary, addr_policy_t *p)
 }
 
 /** Create a string representing a summary for an exit policy.
- * The summary will either be an "accept" plus a comma-separated list of port
- * ranges or a "reject" plus port-ranges, depending on which is shorter.
- *
- * If no exits are allowed at all then "reject 1-65535" is returned. If no
- * ports are blocked instead of "reject " we return "accept 1-65535". (These
- * are an exception to the shorter-representation-wins rule).
- */
-char *
-policy_summarize(smartlist_t *policy, sa_family_t family)
+ * Helper for policy_summarize(), which caches the results. */
+static char *
+policy_summarize_uncached(smartlist_t *policy, sa_family_t family)
 {
   smartlist_t *summary = policy_summary_create();
   smartlist_t *accepts, *rejects;
@@ -2529,6 +2987,110 @@ policy_summarize(smartlist_t *policy, sa_family_t family)
   return result;
 }
 
+/** A summary we've computed for some policy and address family. */
+typedef struct policy_summary_cache_ent_t {
+  /** The summary, as returned by policy_summarize_uncached(). */
+  char *summary;
+  /** When did we last use this summary? */
+  time_t last_used;
+} policy_summary_cache_ent_t;
+
+/** Map from the digest of a policy and address family (as computed by
+ * policy_summary_digest()) to policy_summary_cache_ent_t.  Authorities
+ * summarize every relay's policy for every vote and every microdescriptor,
+ * and hardly any of those policies change between one vote and the next. */
+static digest256map_t *policy_summary_cache = NULL;
+/** When should we next remove stale entries from policy_summary_cache? */
+static time_t policy_summary_cache_next_clean = 0;
+/** How long do we keep a summary that nobody has asked for? */
+#define POLICY_SUMMARY_CACHE_MAX_AGE (3*60*60)
+/** Number of times policy_summarize() found its answer in the cache. */
+STATIC uint64_t n_policy_summary_cache_hits = 0;
+
+/** Set <b>digest_out</b> to a digest of everything about <b>policy</b>
+ * that matters when we summarize it for <b>family</b>. */
+static void
+policy_summary_digest(uint8_t *digest_out, const smartlist_t *policy,
+                      sa_family_t family)
+{
+  crypto_digest_t *d = crypto_digest256_new(DIGEST_SHA256);
+  uint8_t fam = (uint8_t) family;
+  addr_policy_t aa;
+
+  crypto_digest_add_bytes(d, (const char *)&fam, 1);
+  SMARTLIST_FOREACH_BEGIN(policy, const addr_policy_t *, p) {
+    addr_policy_normalize(&aa, p);
+    crypto_digest_add_bytes(d, (const char *)&aa, sizeof(aa));
+  } SMARTLIST_FOREACH_END(p);
+  crypto_digest_get_digest(d, (char *)digest_out, DIGEST256_LEN);
+  crypto_digest_free(d);
+}
+
+/** Helper: free a policy_summary_cache_ent_t. */
+static void
+policy_summary_cache_ent_free_(void *arg)
+{
+  policy_summary_cache_ent_t *ent = arg;
+  if (!ent)
+    return;
+  tor_free(ent->summary);
+  tor_free(ent);
+}
+
+/** Remove every summary from policy_summary_cache that we haven't used
+ * since <b>cutoff</b>. */
+static void
+policy_summary_cache_clean(time_t cutoff)
+{
+  DIGEST256MAP_FOREACH_MODIFY(policy_summary_cache, k,
+                              policy_summary_cache_ent_t *, ent) {
+    if (ent->last_used < cutoff) {
+      policy_summary_cache_ent_free_(ent);
+      MAP_DEL_CURRENT(k);
+    }
+  } DIGEST256MAP_FOREACH_END;
+}
+
+/** Create a string representing a summary for an exit policy.
+ * The summary will either be an "accept" plus a comma-separated list of port
+ * ranges or a "reject" plus port-ranges, depending on which is shorter.
+ *
+ * If no exits are allowed at all then "reject 1-65535" is returned. If no
+ * ports are blocked instead of "reject " we return "accept 1-65535". (These
+ * are an exception to the shorter-representation-wins rule).
+ *
+ * We remember the summaries we compute for a few hours, keyed by a digest
+ * of the policy, so that summarizing an unchanged policy again is cheap.
+ */
+char *
+policy_summarize(smartlist_t *policy, sa_family_t family)
+{
+  uint8_t digest[DIGEST256_LEN];
+  policy_summary_cache_ent_t *ent;
+  const time_t now = approx_time();
+
+  tor_assert(policy);
+
+  if (!policy_summary_cache)
+    policy_summary_cache = digest256map_new();
+  if (now >= policy_summary_cache_next_clean) {
+    policy_summary_cache_clean(now - POLICY_SUMMARY_CACHE_MAX_AGE);
+    policy_summary_cache_next_clean = now + POLICY_SUMMARY_CACHE_MAX_AGE;
+  }
+
+  policy_summary_digest(digest, policy, family);
+  ent = digest256map_get(policy_summary_cache, digest);
+  if (ent) {
+    ++n_policy_summary_cache_hits;
+  } else {
+    ent = tor_malloc_zero(sizeof(policy_summary_cache_ent_t));
+    ent->summary = policy_summarize_uncached(policy, family);
+    digest256map_set(policy_summary_cache, digest, ent);
+  }
+  ent->last_used = now;
+  return tor_strdup(ent->summary);
+}
+
 /** Convert a summarized policy string into a short_policy_t.  Return NULL
  * if the string is not well-formed. */
 short_policy_t *
@@ -2750,7 +3312,9 @@ compare_tor_addr_to_node_policy(const tor_addr_t *addr, uint16_t port,
   }
 
   if (node->ri) {
-    return compare_tor_addr_to_addr_policy(addr, port, node->ri->exit_policy);
+    const compiled_policy_t *cp =
+      routerinfo_get_compiled_exit_policy(node->ri);
+    return compare_tor_addr_to_compiled_policy(addr, port, cp);
   } else if (node->md) {
     if (node->md->exit_policy == NULL)
       return ADDR_POLICY_REJECTED;
@@ -2953,6 +3517,9 @@ policies_free_all(void)
   authdir_invalid_policy = NULL;
   addr_policy_list_free(authdir_badexit_policy);
   authdir_badexit_policy = NULL;
+  digest256map_free(policy_summary_cache, policy_summary_cache_ent_free_);
+  policy_summary_cache = NULL;
+  policy_summary_cache_next_clean = 0;
 
   if (!HT_EMPTY(&policy_root)) {
     policy_map_ent_t **ent;
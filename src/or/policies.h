@@ -30,6 +30,10 @@ typedef enum firewall_connection_t {
 
 typedef int exit_policy_parser_cfg_t;
 
+/** An address policy compiled into prefix tries for quick lookups; see
+ * compiled_policy_new(). */
+typedef struct compiled_policy_t compiled_policy_t;
+
 int firewall_is_fascist_or(void);
 int firewall_is_fascist_dir(void);
 int fascist_firewall_use_ipv6(const or_options_t *options);
@@ -101,6 +105,16 @@ void addr_policy_append_reject_addr_list(smartlist_t **dest,
 void policies_set_node_exitpolicy_to_reject_all(node_t *exitrouter);
 int exit_policy_is_general_exit(smartlist_t *policy);
 int policy_is_reject_star(const smartlist_t *policy, sa_family_t family);
+
+compiled_policy_t *compiled_policy_new(const smartlist_t *policy);
+void compiled_policy_free(compiled_policy_t *cp);
+addr_policy_result_t compare_tor_addr_to_compiled_policy(
+                          const tor_addr_t *addr, uint16_t port,
+                          const compiled_policy_t *cp);
+int compiled_policy_is_reject_star(const compiled_policy_t *cp,
+                                   sa_family_t family);
+const compiled_policy_t *routerinfo_get_compiled_exit_policy(
+                                                   routerinfo_t *router);
 char * policy_dump_to_string(const smartlist_t *policy_list,
                              int include_ipv4,
                              int include_ipv6);
@@ -137,6 +151,9 @@ STATIC const tor_addr_port_t * fascist_firewall_choose_address(
                                           firewall_connection_t fw_connection,
                                           int pref_only, int pref_ipv6);
 
+#ifdef TOR_UNIT_TESTS
+extern uint64_t n_policy_summary_cache_hits;
+#endif
 #endif
 
 #endif
@@ -257,6 +257,92 @@ protover_is_supported_here(protocol_type_t pr, uint32_t ver)
   return protocol_list_contains(ours, pr, ver);
 }
 
+/** A cached protover_bitmask_t for a single protocol list string. */
+typedef struct protover_bitmask_ent_t {
+  /** True iff the string parsed successfully. */
+  int ok;
+  protover_bitmask_t mask;
+} protover_bitmask_ent_t;
+
+/** Map from protocol list string to protover_bitmask_ent_t.  Nearly all
+ * relays advertise one of a handful of protocol lists, so this lets us
+ * parse each distinct list once, however many routerstatuses carry it. */
+static strmap_t *protover_bitmask_cache = NULL;
+
+/** Parse <b>list</b> into a new cache entry. */
+static protover_bitmask_ent_t *
+protover_bitmask_ent_new(const char *list)
+{
+  protover_bitmask_ent_t *ent = tor_malloc_zero(sizeof(*ent));
+  smartlist_t *protocols = parse_protocol_list(list);
+  if (!protocols)
+    return ent;
+
+  ent->ok = 1;
+  SMARTLIST_FOREACH_BEGIN(protocols, const proto_entry_t *, pe) {
+    unsigned i;
+    for (i = 0; i < N_PROTOCOL_NAMES; ++i) {
+      /* Compare names as protocol_list_contains() does. */
+      if (strcasecmp(pe->name, PROTOCOL_NAMES[i].name))
+        continue;
+      SMARTLIST_FOREACH_BEGIN(pe->ranges, const proto_range_t *, range) {
+        uint32_t v;
+        for (v = range->low;
+             v <= range->high && v <= PROTOVER_BITMASK_MAX_VERSION; ++v) {
+          ent->mask.versions[PROTOCOL_NAMES[i].protover_type] |=
+            UINT64_C(1) << v;
+        }
+      } SMARTLIST_FOREACH_END(range);
+    }
+  } SMARTLIST_FOREACH_END(pe);
+
+  SMARTLIST_FOREACH(protocols, proto_entry_t *, pe, proto_entry_free(pe));
+  smartlist_free(protocols);
+  return ent;
+}
+
+/** Return the cache entry for <b>list</b>, parsing it if we haven't seen
+ * it before. */
+static const protover_bitmask_ent_t *
+protover_bitmask_lookup(const char *list)
+{
+  protover_bitmask_ent_t *ent;
+
+  if (!protover_bitmask_cache)
+    protover_bitmask_cache = strmap_new();
+  ent = strmap_get(protover_bitmask_cache, list);
+  if (ent)
+    return ent;
+
+  /* Nobody holds pointers to cache entries, so if something feeds us lots
+   * of distinct lists, we can just start over. */
+  if (strmap_size(protover_bitmask_cache) >= MAX_PROTOVER_BITMASK_CACHE_LEN) {
+    strmap_free(protover_bitmask_cache, tor_free_);
+    protover_bitmask_cache = strmap_new();
+  }
+
+  ent = protover_bitmask_ent_new(list);
+  strmap_set(protover_bitmask_cache, list, ent);
+  return ent;
+}
+
+/**
+ * Set *<b>mask_out</b> to the versions of each recognized protocol that
+ * the protocol list <b>list</b> supports, up to
+ * PROTOVER_BITMASK_MAX_VERSION.  Return 0 on success, or -1 (with an empty
+ * mask) if <b>list</b> doesn't parse.
+ *
+ * We parse each distinct list only once, so this is cheap to call for every
+ * routerstatus in a consensus.
+ */
+int
+protover_get_bitmask(const char *list, protover_bitmask_t *mask_out)
+{
+  const protover_bitmask_ent_t *ent = protover_bitmask_lookup(list);
+  memcpy(mask_out, &ent->mask, sizeof(*mask_out));
+  return ent->ok ? 0 : -1;
+}
+
 /**
  * Return true iff "list" encodes a protocol list that includes support for
  * the indicated protocol and version.
@@ -265,9 +351,12 @@ int
 protocol_list_supports_protocol(const char *list, protocol_type_t tp,
                                 uint32_t version)
 {
-  /* NOTE: This is a pretty inefficient implementation. If it ever shows
-   * up in profiles, we should memoize it.
-   */
+  if (PREDICT_LIKELY(version <= PROTOVER_BITMASK_MAX_VERSION)) {
+    const protover_bitmask_ent_t *ent = protover_bitmask_lookup(list);
+    return protover_bitmask_supports(&ent->mask, tp, version);
+  }
+
+  /* Versions this large don't fit in a bitmask; parse the list. */
   smartlist_t *protocols = parse_protocol_list(list);
   if (!protocols) {
     return 0;
@@ -732,5 +821,16 @@ protover_free_all(void)
     smartlist_free(entries);
     supported_protocol_list = NULL;
   }
+  strmap_free(protover_bitmask_cache, tor_free_);
+  protover_bitmask_cache = NULL;
+}
+
+#ifdef TOR_UNIT_TESTS
+/** Return the number of protocol lists in the bitmask cache. */
+int
+protover_bitmask_cache_len(void)
+{
+  return protover_bitmask_cache ? strmap_size(protover_bitmask_cache) : 0;
 }
+#endif
 
@@ -31,6 +31,30 @@ typedef enum protocol_type_t {
   PRT_CONS,
 } protocol_type_t;
 
+/** Number of recognized subprotocols. */
+#define N_PROTOCOL_TYPES (PRT_CONS + 1)
+
+/** Largest protocol version that a protover_bitmask_t can represent. */
+#define PROTOVER_BITMASK_MAX_VERSION 63
+
+/** The versions of each recognized subprotocol that a protocol list
+ * supports, as bitmasks: bit <b>v</b> of versions[<b>pr</b>] is set iff the
+ * list includes version v of pr. */
+typedef struct protover_bitmask_t {
+  uint64_t versions[N_PROTOCOL_TYPES];
+} protover_bitmask_t;
+
+/** Return true iff <b>mask</b> includes version <b>ver</b> of
+ * <b>pr</b>. */
+static inline int
+protover_bitmask_supports(const protover_bitmask_t *mask,
+                          protocol_type_t pr, uint32_t ver)
+{
+  if (ver > PROTOVER_BITMASK_MAX_VERSION || (unsigned)pr >= N_PROTOCOL_TYPES)
+    return 0;
+  return (mask->versions[pr] >> ver) & 1;
+}
+
 int protover_all_supported(const char *s, char **missing);
 int protover_is_supported_here(protocol_type_t pr, uint32_t ver);
 const char *protover_get_supported_protocols(void);
@@ -40,6 +64,7 @@ char *protover_compute_vote(const smartlist_t *list_of_proto_strings,
 const char *protover_compute_for_old_tor(const char *version);
 int protocol_list_supports_protocol(const char *list, protocol_type_t tp,
                                     uint32_t version);
+int protover_get_bitmask(const char *list, protover_bitmask_t *mask_out);
 
 void protover_free_all(void);
 
@@ -68,6 +93,13 @@ STATIC void proto_entry_free(proto_entry_t *entry);
 STATIC char *encode_protocol_list(const smartlist_t *sl);
 STATIC const char *protocol_type_to_str(protocol_type_t pr);
 STATIC int str_to_protocol_type(const char *s, protocol_type_t *pr_out);
+
+/** Once the bitmask cache holds this many distinct protocol lists, we clear
+ * it and start over. */
+#define MAX_PROTOVER_BITMASK_CACHE_LEN 1024
+#ifdef TOR_UNIT_TESTS
+int protover_bitmask_cache_len(void);
+#endif
 #endif
 
 #endif
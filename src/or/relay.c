@@ -24,8 +24,11 @@
 #include "connection_edge.h"
 #include "connection_or.h"
 #include "control.h"
+#include "dns.h"
 #include "geoip.h"
+#include "latency_trace.h"
 #include "main.h"
+#include "memacct.h"
 #include "networkstatus.h"
 #include "nodelist.h"
 #include "onion.h"
@@ -39,6 +42,11 @@
 #include "routerparse.h"
 #include "scheduler.h"
 
+static void circuit_queue_note_cells_added(circuit_t *circ, channel_t *chan,
+                                           cell_queue_t *queue,
+                                           cell_direction_t direction,
+                                           int streams_blocked,
+                                           streamid_t fromstream);
 static edge_connection_t *relay_lookup_conn(circuit_t *circ, cell_t *cell,
                                             cell_direction_t cell_direction,
                                             crypt_path_t *layer_hint);
@@ -112,9 +120,9 @@ relay_digest_matches(crypto_digest_t *digest, cell_t *cell)
 {
   uint32_t received_integrity, calculated_integrity;
   relay_header_t rh;
-  crypto_digest_t *backup_digest=NULL;
+  crypto_digest_checkpoint_t backup_digest;
 
-  backup_digest = crypto_digest_dup(digest);
+  crypto_digest_checkpoint(&backup_digest, digest);
 
   relay_header_unpack(&rh, cell->payload);
   memcpy(&received_integrity, rh.integrity, 4);
@@ -132,14 +140,14 @@ relay_digest_matches(crypto_digest_t *digest, cell_t *cell)
 //    log_fn(LOG_INFO,"Recognized=0 but bad digest. Not recognizing.");
 // (%d vs %d).", received_integrity, calculated_integrity);
     /* restore digest to its old form */
-    crypto_digest_assign(digest, backup_digest);
+    crypto_digest_restore(digest, &backup_digest);
     /* restore the relay header */
     memcpy(rh.integrity, &received_integrity, 4);
     relay_header_pack(cell->payload, &rh);
-    crypto_digest_free(backup_digest);
+    memwipe(&backup_digest, 0, sizeof(backup_digest));
     return 0;
   }
-  crypto_digest_free(backup_digest);
+  memwipe(&backup_digest, 0, sizeof(backup_digest));
   return 1;
 }
 
@@ -371,6 +379,42 @@ relay_crypt(circuit_t *circ, cell_t *cell, cell_direction_t cell_direction,
   return 0;
 }
 
+/** Set the digest on the relay cell <b>cell</b>, which we are about to
+ * send on <b>circ</b> in direction <b>cell_direction</b>, and encrypt it:
+ * with every layer from <b>layer_hint</b> back to the first hop if it is
+ * outbound from an origin circuit, or with our own layer if it is inbound
+ * from a relay.  Return 0 on success, -1 on failure. */
+static int
+relay_crypt_cell_for_sending(cell_t *cell, circuit_t *circ,
+                             cell_direction_t cell_direction,
+                             crypt_path_t *layer_hint)
+{
+  if (cell_direction == CELL_DIRECTION_OUT) {
+    crypt_path_t *thishop; /* counter for repeated crypts */
+
+    relay_set_digest(layer_hint->f_digest, cell);
+
+    thishop = layer_hint;
+    /* moving from farthest to nearest hop */
+    do {
+      tor_assert(thishop);
+      /* XXXX RD This is a bug, right? */
+      log_debug(LD_OR,"crypting a layer of the relay cell.");
+      if (relay_crypt_one_payload(thishop->f_crypto, cell->payload, 1) < 0) {
+        return -1;
+      }
+
+      thishop = thishop->prev;
+    } while (thishop != TO_ORIGIN_CIRCUIT(circ)->cpath->prev);
+  } else {
+    or_circuit_t *or_circ = TO_OR_CIRCUIT(circ);
+    relay_set_digest(or_circ->p_digest, cell);
+    if (relay_crypt_one_payload(or_circ->p_crypto, cell->payload, 1) < 0)
+      return -1;
+  }
+  return 0;
+}
+
 /** Package a relay cell from an edge:
  *  - Encrypt it to the right layer
  *  - Append it to the appropriate cell_queue on <b>circ</b>.
@@ -384,7 +428,6 @@ circuit_package_relay_cell(cell_t *cell, circuit_t *circ,
   channel_t *chan; /* where to send the cell */
 
   if (cell_direction == CELL_DIRECTION_OUT) {
-    crypt_path_t *thishop; /* counter for repeated crypts */
     chan = circ->n_chan;
     if (!chan) {
       log_warn(LD_BUG,"outgoing relay cell sent from %s:%d has n_chan==NULL."
@@ -397,23 +440,7 @@ circuit_package_relay_cell(cell_t *cell, circuit_t *circ,
       return 0; /* just drop it */
     }
 
-    relay_set_digest(layer_hint->f_digest, cell);
-
-    thishop = layer_hint;
-    /* moving from farthest to nearest hop */
-    do {
-      tor_assert(thishop);
-      /* XXXX RD This is a bug, right? */
-      log_debug(LD_OR,"crypting a layer of the relay cell.");
-      if (relay_crypt_one_payload(thishop->f_crypto, cell->payload, 1) < 0) {
-        return -1;
-      }
-
-      thishop = thishop->prev;
-    } while (thishop != TO_ORIGIN_CIRCUIT(circ)->cpath->prev);
-
   } else { /* incoming cell */
-    or_circuit_t *or_circ;
     if (CIRCUIT_IS_ORIGIN(circ)) {
       /* We should never package an _incoming_ cell from the circuit
        * origin; that means we messed up somewhere. */
@@ -421,12 +448,11 @@ circuit_package_relay_cell(cell_t *cell, circuit_t *circ,
       assert_circuit_ok(circ);
       return 0; /* just drop it */
     }
-    or_circ = TO_OR_CIRCUIT(circ);
-    chan = or_circ->p_chan;
-    relay_set_digest(or_circ->p_digest, cell);
-    if (relay_crypt_one_payload(or_circ->p_crypto, cell->payload, 1) < 0)
-      return -1;
+    chan = TO_OR_CIRCUIT(circ)->p_chan;
   }
+  if (relay_crypt_cell_for_sending(cell, circ, cell_direction,
+                                   layer_hint) < 0)
+    return -1;
   ++stats_n_relay_cells_relayed;
 
   append_cell_to_circuit_queue(circ, chan, cell, cell_direction, on_stream);
@@ -1544,6 +1570,9 @@ connection_edge_process_relay_cell(cell_t *cell, circuit_t *circ,
                "(relay data) conn deliver_window below 0. Killing.");
         return -END_CIRC_REASON_TORPROTOCOL;
       }
+      ++conn->n_data_cells_delivered;
+      if (conn->adaptive_window)
+        stream_window_note_data_cell(conn, monotime_coarse_absolute_msec());
 
       stats_n_data_bytes_received += rh.length;
       connection_write_to_buf((char*)(cell->payload + RELAY_HEADER_SIZE),
@@ -1661,8 +1690,7 @@ connection_edge_process_relay_cell(cell_t *cell, circuit_t *circ,
       if (circ->n_hop) {
         if (circ->n_chan)
           log_warn(LD_BUG, "n_chan and n_hop set on the same circuit!");
-        extend_info_free(circ->n_hop);
-        circ->n_hop = NULL;
+        circuit_set_n_hop(circ, NULL);
         tor_free(circ->n_chan_create_cell);
         circuit_set_state(circ, CIRCUIT_STATE_OPEN);
       }
@@ -1814,6 +1842,151 @@ uint64_t stats_n_data_cells_received = 0;
  * ever received were completely full of data. */
 uint64_t stats_n_data_bytes_received = 0;
 
+/** Largest number of data cells we package from a stream's inbuf in a
+ * single batch. */
+#define RELAY_PACKAGE_BATCH_MAX 32
+
+/** As relay_crypt_cell_for_sending(), but for the <b>n_cells</b> cells in
+ * <b>cells</b>, which we are about to send in that order.  We set every
+ * cell's digest first, and then run each layer's cipher over all of their
+ * payloads at once, so that it sees a few long runs of keystream rather than
+ * one short run per cell. */
+static void
+relay_crypt_cells_for_sending(cell_t *cells, int n_cells, circuit_t *circ,
+                              cell_direction_t cell_direction,
+                              crypt_path_t *layer_hint)
+{
+  char *payloads[RELAY_PACKAGE_BATCH_MAX];
+  int i;
+
+  tor_assert(n_cells <= RELAY_PACKAGE_BATCH_MAX);
+  for (i = 0; i < n_cells; ++i)
+    payloads[i] = (char*)cells[i].payload;
+
+  if (cell_direction == CELL_DIRECTION_OUT) {
+    crypt_path_t *thishop;
+
+    for (i = 0; i < n_cells; ++i)
+      relay_set_digest(layer_hint->f_digest, &cells[i]);
+
+    thishop = layer_hint;
+    /* moving from farthest to nearest hop */
+    do {
+      tor_assert(thishop);
+      crypto_cipher_crypt_inplace_multi(thishop->f_crypto, payloads, n_cells,
+                                        CELL_PAYLOAD_SIZE);
+      thishop = thishop->prev;
+    } while (thishop != TO_ORIGIN_CIRCUIT(circ)->cpath->prev);
+  } else {
+    or_circuit_t *or_circ = TO_OR_CIRCUIT(circ);
+    for (i = 0; i < n_cells; ++i)
+      relay_set_digest(or_circ->p_digest, &cells[i]);
+    crypto_cipher_crypt_inplace_multi(or_circ->p_crypto, payloads, n_cells,
+                                      CELL_PAYLOAD_SIZE);
+  }
+}
+
+/** Try to package several full RELAY_DATA cells at once from the inbuf of
+ * <b>conn</b>, which has <b>bytes_to_process</b> bytes waiting, onto its
+ * circuit <b>circ</b>.  We take as many full cells as the stream and
+ * circuit package windows, *<b>max_cells</b> (if provided), and
+ * RELAY_PACKAGE_BATCH_MAX allow, encrypt them together, and append them
+ * all to the circuit's queue before telling the circuitmux and the
+ * scheduler about them once.
+ *
+ * This function does not touch any package window or *<b>max_cells</b>;
+ * the caller accounts for the cells.  Return the number of cells packaged,
+ * which is 0 if a batch isn't possible or worthwhile here (the caller then
+ * takes the one-cell path), or -1 if we had to mark the circuit for close.
+ */
+static int
+connection_edge_package_data_cells(edge_connection_t *conn, circuit_t *circ,
+                                   size_t bytes_to_process,
+                                   const int *max_cells)
+{
+  crypt_path_t *cpath_layer = conn->cpath_layer;
+  cell_direction_t cell_direction;
+  channel_t *chan;
+  cell_queue_t *queue;
+  int streams_blocked;
+  int n_cells, i;
+  cell_t cells[RELAY_PACKAGE_BATCH_MAX];
+  relay_header_t rh;
+
+  n_cells = (int)MIN(bytes_to_process / RELAY_PAYLOAD_SIZE,
+                     RELAY_PACKAGE_BATCH_MAX);
+  n_cells = MIN(n_cells, conn->package_window);
+  n_cells = MIN(n_cells, cpath_layer ? cpath_layer->package_window
+                                     : circ->package_window);
+  if (max_cells)
+    n_cells = MIN(n_cells, *max_cells);
+  if (n_cells < 2 || circ->marked_for_close)
+    return 0;
+
+  if (cpath_layer) {
+    origin_circuit_t *origin_circ;
+    if (!CIRCUIT_IS_ORIGIN(circ) || !circ->n_chan)
+      return 0;
+    origin_circ = TO_ORIGIN_CIRCUIT(circ);
+    /* Leave cells that need to become RELAY_EARLY to the one-cell path. */
+    if (origin_circ->remaining_relay_early_cells > 0 &&
+        cpath_layer != origin_circ->cpath)
+      return 0;
+    cell_direction = CELL_DIRECTION_OUT;
+    chan = circ->n_chan;
+    queue = &circ->n_chan_cells;
+    streams_blocked = circ->streams_blocked_on_n_chan;
+    /* if we're using relaybandwidthrate, this conn wants priority */
+    channel_timestamp_client(chan);
+  } else {
+    if (CIRCUIT_IS_ORIGIN(circ) || !TO_OR_CIRCUIT(circ)->p_chan)
+      return 0;
+    cell_direction = CELL_DIRECTION_IN;
+    chan = TO_OR_CIRCUIT(circ)->p_chan;
+    queue = &TO_OR_CIRCUIT(circ)->p_chan_cells;
+    streams_blocked = circ->streams_blocked_on_p_chan;
+  }
+
+  log_debug(conn->base_.type == CONN_TYPE_AP ? LD_APP : LD_EXIT,
+            TOR_SOCKET_T_FORMAT": Packaging %d cells at once (%d bytes "
+            "waiting).", conn->base_.s, n_cells, (int)bytes_to_process);
+
+  memset(&rh, 0, sizeof(rh));
+  rh.command = RELAY_COMMAND_DATA;
+  rh.stream_id = conn->stream_id;
+  rh.length = RELAY_PAYLOAD_SIZE;
+
+  for (i = 0; i < n_cells; ++i) {
+    cell_t *cell = &cells[i];
+    memset(cell, 0, sizeof(*cell));
+    cell->command = CELL_RELAY;
+    cell->circ_id = (cell_direction == CELL_DIRECTION_OUT) ?
+      circ->n_circ_id : TO_OR_CIRCUIT(circ)->p_circ_id;
+    relay_header_pack(cell->payload, &rh);
+    connection_fetch_from_buf((char*)cell->payload + RELAY_HEADER_SIZE,
+                              RELAY_PAYLOAD_SIZE, TO_CONN(conn));
+  }
+
+  relay_crypt_cells_for_sending(cells, n_cells, circ, cell_direction,
+                                cpath_layer);
+
+  for (i = 0; i < n_cells; ++i) {
+    cell_queue_append_packed_copy(circ, queue,
+                                  cell_direction == CELL_DIRECTION_OUT,
+                                  &cells[i], chan->wide_circ_ids, 1);
+  }
+
+  stats_n_relay_cells_relayed += n_cells;
+  stats_n_data_cells_packaged += n_cells;
+  stats_n_data_bytes_packaged += n_cells * RELAY_PAYLOAD_SIZE;
+
+  circuit_queue_note_cells_added(circ, chan, queue, cell_direction,
+                                 streams_blocked, conn->stream_id);
+  if (circ->marked_for_close)
+    return -1;
+  return n_cells;
+}
+
 /** If <b>conn</b> has an entire relay payload of bytes on its inbuf (or
  * <b>package_partial</b> is true), and the appropriate package windows aren't
  * empty, grab a cell and send it down the circuit.
@@ -1831,6 +2004,7 @@ connection_edge_package_raw_inbuf(edge_connection_t *conn, int package_partial,
   size_t bytes_to_process, length;
   char payload[CELL_PAYLOAD_SIZE];
   circuit_t *circ;
+  int n_packaged;
   const unsigned domain = conn->base_.type == CONN_TYPE_AP ? LD_APP : LD_EXIT;
   int sending_from_optimistic = 0;
   entry_connection_t *entry_conn =
@@ -1892,6 +2066,16 @@ connection_edge_package_raw_inbuf(edge_connection_t *conn, int package_partial,
   if (!package_partial && bytes_to_process < RELAY_PAYLOAD_SIZE)
     return 0;
 
+  if (!sending_from_optimistic && !sending_optimistically) {
+    n_packaged = connection_edge_package_data_cells(conn, circ,
+                                                    bytes_to_process,
+                                                    max_cells);
+    if (n_packaged < 0)
+      return 0; /* circuit got marked for close */
+    if (n_packaged > 0)
+      goto account_for_packaged_cells;
+  }
+
   if (bytes_to_process > RELAY_PAYLOAD_SIZE) {
     length = RELAY_PAYLOAD_SIZE;
   } else {
@@ -1929,16 +2113,19 @@ connection_edge_package_raw_inbuf(edge_connection_t *conn, int package_partial,
                                    payload, length) < 0 )
     /* circuit got marked for close, don't continue, don't need to mark conn */
     return 0;
+  n_packaged = 1;
 
+ account_for_packaged_cells:
   if (!cpath_layer) { /* non-rendezvous exit */
-    tor_assert(circ->package_window > 0);
-    circ->package_window--;
+    tor_assert(circ->package_window >= n_packaged);
+    circ->package_window -= n_packaged;
   } else { /* we're an AP, or an exit on a rendezvous circ */
-    tor_assert(cpath_layer->package_window > 0);
-    cpath_layer->package_window--;
+    tor_assert(cpath_layer->package_window >= n_packaged);
+    cpath_layer->package_window -= n_packaged;
   }
 
-  if (--conn->package_window <= 0) { /* is it 0 after decrement? */
+  conn->package_window -= n_packaged;
+  if (conn->package_window <= 0) { /* is it 0 after decrement? */
     connection_stop_reading(TO_CONN(conn));
     log_debug(domain,"conn->package_window reached 0.");
     circuit_consider_stop_edge_reading(circ, cpath_layer);
@@ -1947,7 +2134,7 @@ connection_edge_package_raw_inbuf(edge_connection_t *conn, int package_partial,
   log_debug(domain,"conn->package_window is now %d",conn->package_window);
 
   if (max_cells) {
-    *max_cells -= 1;
+    *max_cells -= n_packaged;
     if (*max_cells <= 0)
       return 0;
   }
@@ -1956,6 +2143,46 @@ connection_edge_package_raw_inbuf(edge_connection_t *conn, int package_partial,
   goto repeat_connection_edge_package_raw_inbuf;
 }
 
+/** Called when data cell number <b>conn</b>-\>n_data_cells_delivered has
+ * arrived at <b>now_msec</b> on the adaptive-window stream <b>conn</b>.  If
+ * it completes a sendme round trip, use the sample to move the stream's
+ * deliver window target between STREAMWINDOW_ADAPTIVE_MIN and
+ * STREAMWINDOW_START: shrink it once round trips show queueing or we are
+ * low on memory; grow it back while round trips stay near the fastest one
+ * we have seen. */
+STATIC void
+stream_window_note_data_cell(edge_connection_t *conn, uint64_t now_msec)
+{
+  uint32_t rtt;
+
+  if (!conn->sendme_probe_cell ||
+      conn->n_data_cells_delivered < conn->sendme_probe_cell)
+    return;
+
+  conn->sendme_probe_cell = 0;
+  if (now_msec < conn->sendme_probe_sent_msec)
+    return;
+  rtt = (uint32_t) MIN(now_msec - conn->sendme_probe_sent_msec, UINT32_MAX);
+  if (rtt == 0)
+    rtt = 1;
+  if (!conn->min_sendme_rtt_msec || rtt < conn->min_sendme_rtt_msec)
+    conn->min_sendme_rtt_msec = rtt;
+
+  if (relay_under_memory_pressure()) {
+    conn->deliver_window_target = STREAMWINDOW_ADAPTIVE_MIN;
+  } else if (rtt <= conn->min_sendme_rtt_msec +
+                    conn->min_sendme_rtt_msec / 2) {
+    conn->deliver_window_target = MIN(STREAMWINDOW_START,
+                     conn->deliver_window_target + STREAMWINDOW_INCREMENT);
+  } else if (rtt > conn->min_sendme_rtt_msec * 2) {
+    conn->deliver_window_target = MAX(STREAMWINDOW_ADAPTIVE_MIN,
+                     conn->deliver_window_target - STREAMWINDOW_INCREMENT);
+  }
+  log_debug(LD_APP, "Stream sendme rtt %u msec (min %u); window target "
+            "now %d.", (unsigned)rtt, (unsigned)conn->min_sendme_rtt_msec,
+            conn->deliver_window_target);
+}
+
 /** Called when we've just received a relay data cell, when
  * we've just finished flushing all bytes to stream <b>conn</b>,
  * or when we've flushed *some* bytes to the stream <b>conn</b>.
@@ -1967,6 +2194,7 @@ void
 connection_edge_consider_sending_sendme(edge_connection_t *conn)
 {
   circuit_t *circ;
+  int target;
 
   if (connection_outbuf_too_full(TO_CONN(conn)))
     return;
@@ -1979,10 +2207,20 @@ connection_edge_consider_sending_sendme(edge_connection_t *conn)
     return;
   }
 
-  while (conn->deliver_window <= STREAMWINDOW_START - STREAMWINDOW_INCREMENT) {
+  target = conn->adaptive_window ? conn->deliver_window_target
+                                 : STREAMWINDOW_START;
+
+  while (conn->deliver_window <= target - STREAMWINDOW_INCREMENT) {
     log_debug(conn->base_.type == CONN_TYPE_AP ?LD_APP:LD_EXIT,
               "Outbuf %d, Queuing stream sendme.",
               (int)conn->base_.outbuf_flushlen);
+    if (conn->adaptive_window && !conn->sendme_probe_cell) {
+      /* Time this sendme: the first cell that needs its credit is the one
+       * after everything our current window already allows. */
+      conn->sendme_probe_cell = conn->n_data_cells_delivered +
+        conn->deliver_window + 1;
+      conn->sendme_probe_sent_msec = monotime_coarse_absolute_msec();
+    }
     conn->deliver_window += STREAMWINDOW_INCREMENT;
     if (connection_edge_send_command(conn, RELAY_COMMAND_SENDME,
                                      NULL, 0) < 0) {
@@ -2020,6 +2258,87 @@ stream_choice_seed_weak_rng(void)
   crypto_seed_weak_rng(&stream_choice_rng);
 }
 
+/** Most bytes of unused share a stream may carry from one resume of its
+ * circuit to the next. */
+#define STREAM_PACKAGE_DEFICIT_MAX (CIRCWINDOW_INCREMENT*RELAY_PAYLOAD_SIZE)
+
+/** Package data from the streams in <b>active</b>, all of which are
+ * attached to <b>circ</b> (at hop <b>layer_hint</b>, if we're the OP) and
+ * have data on their inbufs, onto <b>circ</b>, using no more than
+ * <b>max_to_package</b> cells.
+ *
+ * We use deficit round-robin, starting with the stream at index
+ * <b>start</b>: on each round every stream earns an equal share of the
+ * remaining cells, counted in bytes, and spends it on what it actually
+ * packages, so that streams sending short cells are not penalized.
+ * Streams leave the ring once they have nothing left to package.
+ *
+ * Return -1 if the circuit's package window closed while we were
+ * packaging, and 0 otherwise.
+ */
+STATIC int
+circuit_package_active_streams(circuit_t *circ, crypt_path_t *layer_hint,
+                               smartlist_t *active, int start,
+                               int max_to_package)
+{
+  smartlist_t *ring = smartlist_new();
+  int i, n_active, r = 0;
+
+  n_active = smartlist_len(active);
+  for (i = 0; i < n_active; ++i)
+    smartlist_add(ring, smartlist_get(active, (start + i) % n_active));
+
+  while (smartlist_len(ring) && max_to_package > 0) {
+    const int quantum = CEIL_DIV(max_to_package, smartlist_len(ring)) *
+      RELAY_PAYLOAD_SIZE;
+    int packaged_this_round = 0;
+
+    SMARTLIST_FOREACH_BEGIN(ring, edge_connection_t *, conn) {
+      size_t inbuf_len = connection_get_inbuf_len(TO_CONN(conn));
+      int max_cells, n;
+
+      if (packaged_this_round >= max_to_package)
+        break;
+      conn->package_deficit = MIN(conn->package_deficit + quantum,
+                                  STREAM_PACKAGE_DEFICIT_MAX);
+      max_cells = MIN(conn->package_deficit / RELAY_PAYLOAD_SIZE,
+                      max_to_package - packaged_this_round);
+      n = max_cells;
+      r = connection_edge_package_raw_inbuf(conn, 1, &n);
+      packaged_this_round += max_cells - n;
+      conn->package_deficit -=
+        (int)(inbuf_len - connection_get_inbuf_len(TO_CONN(conn)));
+      circ->last_resumed_stream_id = conn->stream_id;
+
+      if (r < 0) {
+        /* Problem while packaging. (We already sent an end cell if
+         * possible) */
+        connection_mark_for_close(TO_CONN(conn));
+      }
+      if (r < 0 || conn->package_window <= 0 ||
+          !connection_get_inbuf_len(TO_CONN(conn))) {
+        conn->package_deficit = 0;
+        SMARTLIST_DEL_CURRENT_KEEPORDER(ring, conn);
+      }
+
+      /* If the circuit won't accept any more data, return without looking
+       * at any more of the streams. Any connections that should be stopped
+       * have already been stopped by connection_edge_package_raw_inbuf. */
+      if (circuit_consider_stop_edge_reading(circ, layer_hint)) {
+        smartlist_free(ring);
+        return -1;
+      }
+    } SMARTLIST_FOREACH_END(conn);
+
+    if (!packaged_this_round)
+      break;
+    max_to_package -= packaged_this_round;
+  }
+
+  smartlist_free(ring);
+  return 0;
+}
+
 /** A helper function for circuit_resume_edge_reading() above.
  * The arguments are the same, except that <b>conn</b> is the head
  * of a linked list of edge streams that should each be considered.
@@ -2030,12 +2349,10 @@ circuit_resume_edge_reading_helper(edge_connection_t *first_conn,
                                    crypt_path_t *layer_hint)
 {
   edge_connection_t *conn;
-  int n_packaging_streams, n_streams_left;
-  int packaged_this_round;
+  smartlist_t *active;
   int cells_on_queue;
-  int cells_per_conn;
-  edge_connection_t *chosen_stream = NULL;
   int max_to_package;
+  int start = -1, r;
 
   if (first_conn == NULL) {
     /* Don't bother to try to do the rest of this if there are no connections
@@ -2056,122 +2373,42 @@ circuit_resume_edge_reading_helper(edge_connection_t *first_conn,
   if (CELL_QUEUE_HIGHWATER_SIZE - cells_on_queue < max_to_package)
     max_to_package = CELL_QUEUE_HIGHWATER_SIZE - cells_on_queue;
 
-  /* Once we used to start listening on the streams in the order they
-   * appeared in the linked list.  That leads to starvation on the
-   * streams that appeared later on the list, since the first streams
-   * would always get to read first.  Instead, we just pick a random
-   * stream on the list, and enable reading for streams starting at that
-   * point (and wrapping around as if the list were circular).  It would
-   * probably be better to actually remember which streams we've
-   * serviced in the past, but this is simple and effective. */
-
-  /* Select a stream uniformly at random from the linked list.  We
-   * don't need cryptographic randomness here. */
-  {
-    int num_streams = 0;
-    for (conn = first_conn; conn; conn = conn->next_stream) {
-      num_streams++;
-      if (tor_weak_random_one_in_n(&stream_choice_rng, num_streams)) {
-        chosen_stream = conn;
-      }
-      /* Invariant: chosen_stream has been chosen uniformly at random from
-       * among the first num_streams streams on first_conn.
-       *
-       * (Note that we iterate over every stream on the circuit, so that after
-       * we've considered the first stream, we've chosen it with P=1; and
-       * after we consider the second stream, we've switched to it with P=1/2
-       * and stayed with the first stream with P=1/2; and after we've
-       * considered the third stream, we've switched to it with P=1/3 and
-       * remained with one of the first two streams with P=(2/3), giving each
-       * one P=(1/2)(2/3) )=(1/3).) */
-    }
-  }
-
-  /* Count how many non-marked streams there are that have anything on
-   * their inbuf, and enable reading on all of the connections. */
-  n_packaging_streams = 0;
-  /* Activate reading starting from the chosen stream */
-  for (conn=chosen_stream; conn; conn = conn->next_stream) {
-    /* Start reading for the streams starting from here */
-    if (conn->base_.marked_for_close || conn->package_window <= 0)
-      continue;
-    if (!layer_hint || conn->cpath_layer == layer_hint) {
-      connection_start_reading(TO_CONN(conn));
-
-      if (connection_get_inbuf_len(TO_CONN(conn)) > 0)
-        ++n_packaging_streams;
-    }
-  }
-  /* Go back and do the ones we skipped, circular-style */
-  for (conn = first_conn; conn != chosen_stream; conn = conn->next_stream) {
+  /* Enable reading on all of the streams, and collect the ones that
+   * already have something on their inbuf: those are the only ones we
+   * need to package from here.  The rest will package as data arrives. */
+  active = smartlist_new();
+  for (conn = first_conn; conn; conn = conn->next_stream) {
     if (conn->base_.marked_for_close || conn->package_window <= 0)
       continue;
     if (!layer_hint || conn->cpath_layer == layer_hint) {
       connection_start_reading(TO_CONN(conn));
 
       if (connection_get_inbuf_len(TO_CONN(conn)) > 0)
-        ++n_packaging_streams;
+        smartlist_add(active, conn);
+      else
+        conn->package_deficit = 0;
     }
+    /* Pick up after the stream we serviced last time. */
+    if (conn->stream_id == circ->last_resumed_stream_id)
+      start = smartlist_len(active);
   }
 
-  if (n_packaging_streams == 0) /* avoid divide-by-zero */
+  if (smartlist_len(active) == 0) {
+    smartlist_free(active);
     return 0;
-
- again:
-
-  cells_per_conn = CEIL_DIV(max_to_package, n_packaging_streams);
-
-  packaged_this_round = 0;
-  n_streams_left = 0;
-
-  /* Iterate over all connections.  Package up to cells_per_conn cells on
-   * each.  Update packaged_this_round with the total number of cells
-   * packaged, and n_streams_left with the number that still have data to
-   * package.
-   */
-  for (conn=first_conn; conn; conn=conn->next_stream) {
-    if (conn->base_.marked_for_close || conn->package_window <= 0)
-      continue;
-    if (!layer_hint || conn->cpath_layer == layer_hint) {
-      int n = cells_per_conn, r;
-      /* handle whatever might still be on the inbuf */
-      r = connection_edge_package_raw_inbuf(conn, 1, &n);
-
-      /* Note how many we packaged */
-      packaged_this_round += (cells_per_conn-n);
-
-      if (r<0) {
-        /* Problem while packaging. (We already sent an end cell if
-         * possible) */
-        connection_mark_for_close(TO_CONN(conn));
-        continue;
-      }
-
-      /* If there's still data to read, we'll be coming back to this stream. */
-      if (connection_get_inbuf_len(TO_CONN(conn)))
-          ++n_streams_left;
-
-      /* If the circuit won't accept any more data, return without looking
-       * at any more of the streams. Any connections that should be stopped
-       * have already been stopped by connection_edge_package_raw_inbuf. */
-      if (circuit_consider_stop_edge_reading(circ, layer_hint))
-        return -1;
-      /* XXXX should we also stop immediately if we fill up the cell queue?
-       * Probably. */
-    }
   }
 
-  /* If we made progress, and we are willing to package more, and there are
-   * any streams left that want to package stuff... try again!
-   */
-  if (packaged_this_round && packaged_this_round < max_to_package &&
-      n_streams_left) {
-    max_to_package -= packaged_this_round;
-    n_packaging_streams = n_streams_left;
-    goto again;
-  }
-
-  return 0;
+  /* If we don't know where we left off, start from a stream chosen at
+   * random, so that the streams early on the list aren't favored.  We
+   * don't need cryptographic randomness here. */
+  if (start < 0)
+    start = tor_weak_random_range(&stream_choice_rng, smartlist_len(active));
+
+  r = circuit_package_active_streams(circ, layer_hint, active,
+                                     start % smartlist_len(active),
+                                     max_to_package);
+  smartlist_free(active);
+  return r;
 }
 
 /** Check if the package window for <b>circ</b> is empty (at
@@ -2250,22 +2487,79 @@ circuit_consider_sending_sendme(circuit_t *circ, crypt_path_t *layer_hint)
 /** The total number of cells we have allocated. */
 static size_t total_cells_allocated = 0;
 
+/** The largest number of freed packed cells that we keep around for reuse.
+ * 1024 cells is about half a megabyte. */
+#define MAX_PACKED_CELL_FREELIST_LEN 1024
+
+/** Stack of freed packed cells, linked through their <b>next</b> fields,
+ * which we hand out again before going back to the allocator.  Relays
+ * allocate and free cells at a high rate, and reusing them keeps the heap
+ * from fragmenting.  Only touched from the main thread. */
+static packed_cell_t *packed_cell_freelist = NULL;
+/** The number of cells on packed_cell_freelist. */
+static size_t n_packed_cells_on_freelist = 0;
+/** The number of packed_cell_new() calls satisfied from the freelist, and
+ * the number that went to the allocator. */
+static uint64_t n_packed_cells_reused = 0, n_packed_cells_malloced = 0;
+
 /** Release storage held by <b>cell</b>. */
 static inline void
 packed_cell_free_unchecked(packed_cell_t *cell)
 {
   --total_cells_allocated;
-  tor_free(cell);
+  if (n_packed_cells_on_freelist < MAX_PACKED_CELL_FREELIST_LEN &&
+      ! relay_under_memory_pressure()) {
+    TOR_SIMPLEQ_NEXT(cell, next) = packed_cell_freelist;
+    packed_cell_freelist = cell;
+    ++n_packed_cells_on_freelist;
+  } else {
+    tor_free(cell);
+  }
 }
 
 /** Allocate and return a new packed_cell_t. */
 STATIC packed_cell_t *
 packed_cell_new(void)
 {
+  packed_cell_t *cell;
   ++total_cells_allocated;
+  if (packed_cell_freelist) {
+    cell = packed_cell_freelist;
+    packed_cell_freelist = TOR_SIMPLEQ_NEXT(cell, next);
+    --n_packed_cells_on_freelist;
+    ++n_packed_cells_reused;
+    memset(cell, 0, sizeof(packed_cell_t));
+    return cell;
+  }
+  ++n_packed_cells_malloced;
   return tor_malloc_zero(sizeof(packed_cell_t));
 }
 
+/** Set *<b>n_reused_out</b> and *<b>n_malloced_out</b> to the number of
+ * packed cells we have taken from the freelist and from the allocator,
+ * respectively, since startup. */
+void
+packed_cell_get_alloc_stats(uint64_t *n_reused_out, uint64_t *n_malloced_out)
+{
+  *n_reused_out = n_packed_cells_reused;
+  *n_malloced_out = n_packed_cells_malloced;
+}
+
+/** Return every cell on the packed cell freelist to the allocator. Return
+ * the number of bytes released. */
+STATIC size_t
+packed_cell_freelist_clear(void)
+{
+  size_t n = n_packed_cells_on_freelist;
+  while (packed_cell_freelist) {
+    packed_cell_t *cell = packed_cell_freelist;
+    packed_cell_freelist = TOR_SIMPLEQ_NEXT(cell, next);
+    tor_free(cell);
+  }
+  n_packed_cells_on_freelist = 0;
+  return n * packed_cell_mem_cost();
+}
+
 /** Return a packed cell used outside by channel_t lower layer */
 void
 packed_cell_free(packed_cell_t *cell)
@@ -2292,6 +2586,12 @@ dump_cell_pool_usage(int severity)
   tor_log(severity, LD_MM,
           "%d cells allocated on %d circuits. %d cells leaked.",
           n_cells, n_circs, (int)total_cells_allocated - n_cells);
+  tor_log(severity, LD_MM,
+          "%d cells kept for reuse. "U64_FORMAT" cells reused, "
+          U64_FORMAT" newly allocated.",
+          (int)n_packed_cells_on_freelist,
+          U64_PRINTF_ARG(n_packed_cells_reused),
+          U64_PRINTF_ARG(n_packed_cells_malloced));
 }
 
 /** Allocate a new copy of packed <b>cell</b>. */
@@ -2321,13 +2621,14 @@ cell_queue_append_packed_copy(circuit_t *circ, cell_queue_t *queue,
                               int wide_circ_ids, int use_stats)
 {
   packed_cell_t *copy = packed_cell_copy(cell, wide_circ_ids);
-  (void)circ;
   (void)exitward;
   (void)use_stats;
 
-  copy->inserted_time = (uint32_t) monotime_coarse_absolute_msec();
+  copy->inserted_time = (uint32_t) monotime_coarse_absolute_msec_cached();
 
   cell_queue_append(queue, copy);
+  if (circ)
+    circuit_note_cell_queued(circ, copy);
 }
 
 /** Initialize <b>queue</b> as an empty cell queue. */
@@ -2372,11 +2673,13 @@ packed_cell_mem_cost(void)
   return sizeof(packed_cell_t);
 }
 
-/* DOCDOC */
-STATIC size_t
+/** Return the number of bytes allocated for packed cells, including the
+ * ones we're keeping around for reuse. */
+size_t
 cell_queues_get_total_allocation(void)
 {
-  return total_cells_allocated * packed_cell_mem_cost();
+  return (total_cells_allocated + n_packed_cells_on_freelist) *
+    packed_cell_mem_cost();
 }
 
 /** How long after we've been low on memory should we try to conserve it? */
@@ -2390,24 +2693,20 @@ static time_t last_time_under_memory_pressure = 0;
 STATIC int
 cell_queues_check_size(void)
 {
-  size_t alloc = cell_queues_get_total_allocation();
-  alloc += buf_get_total_allocation();
-  alloc += tor_zlib_get_total_allocation();
-  const size_t rend_cache_total = rend_cache_get_total_allocation();
-  alloc += rend_cache_total;
+  size_t alloc = memacct_get_limited_allocation();
   if (alloc >= get_options()->MaxMemInQueues_low_threshold) {
     last_time_under_memory_pressure = approx_time();
+    /* Our spare cells and buffer chunks are the cheapest things to give
+     * back. */
+    alloc -= packed_cell_freelist_clear();
+    alloc -= buf_freelists_clear();
     if (alloc >= get_options()->MaxMemInQueues) {
-      /* If we're spending over 20% of the memory limit on hidden service
-       * descriptors, free them until we're down to 10%.
-       */
-      if (rend_cache_total > get_options()->MaxMemInQueues / 5) {
-        const size_t bytes_to_remove =
-          rend_cache_total - (size_t)(get_options()->MaxMemInQueues / 10);
-        rend_cache_clean_v2_descs_as_dir(time(NULL), bytes_to_remove);
-        alloc -= rend_cache_total;
-        alloc += rend_cache_get_total_allocation();
-      }
+      /* If we're spending over 20% of the memory limit on any cache that
+       * can give memory back (hidden service descriptors, exit DNS
+       * answers, client history), shrink it to 10% before we kill any
+       * circuits. */
+      alloc -= memacct_handle_oom(time(NULL),
+                                  get_options()->MaxMemInQueues);
       circuits_handle_oom(alloc);
       return 1;
     }
@@ -2415,6 +2714,24 @@ cell_queues_check_size(void)
   return 0;
 }
 
+/** Return true if we've been low on memory in the last
+ * MEMORY_PRESSURE_INTERVAL seconds, and so shouldn't keep any spare
+ * cells or buffer chunks around. */
+MOCK_IMPL(int,
+relay_under_memory_pressure,(void))
+{
+  return last_time_under_memory_pressure &&
+    last_time_under_memory_pressure + MEMORY_PRESSURE_INTERVAL
+    >= approx_time();
+}
+
+/** Release all storage held by relay.c. */
+void
+relay_free_all(void)
+{
+  packed_cell_freelist_clear();
+}
+
 /** Return true if we've been under memory pressure in the last
  * MEMORY_PRESSURE_INTERVAL seconds. */
 int
@@ -2630,18 +2947,28 @@ channel_flush_from_first_active_circuit, (channel_t *chan, int max))
      * has more than one.
      */
     cell = cell_queue_pop(queue);
+    tor_assert(cell);
 
     /* Calculate the exact time that this cell has spent in the queue. */
-    if (get_options()->CellStatistics ||
-        get_options()->TestingEnableCellStatsEvent) {
-      uint32_t msec_waiting;
-      uint32_t msec_now = (uint32_t)monotime_coarse_absolute_msec();
-      msec_waiting = msec_now - cell->inserted_time;
+    {
+      uint32_t msec_now = (uint32_t)monotime_coarse_absolute_msec_cached();
+      uint32_t msec_waiting = msec_now - cell->inserted_time;
+
+      queue_delay_note(QUEUE_DELAY_CIRCUIT, msec_waiting);
+      if (control_event_is_interesting(EVENT_QUEUE_DELAY)) {
+        if (!chan->circ_queue_delay)
+          chan->circ_queue_delay = tor_malloc_zero(sizeof(latency_hist_t));
+        latency_hist_add(chan->circ_queue_delay,
+                         ((uint64_t)msec_waiting) * 1000000);
+      }
 
       if (get_options()->CellStatistics && !CIRCUIT_IS_ORIGIN(circ)) {
         or_circ = TO_OR_CIRCUIT(circ);
-        or_circ->total_cell_waiting_time += msec_waiting;
-        or_circ->processed_cells++;
+        if (!or_circ->buffer_stats)
+          or_circ->buffer_stats =
+            tor_malloc_zero(sizeof(or_circuit_buffer_stats_t));
+        or_circ->buffer_stats->total_cell_waiting_time += msec_waiting;
+        or_circ->buffer_stats->processed_cells++;
       }
 
       if (get_options()->TestingEnableCellStatsEvent) {
@@ -2717,6 +3044,48 @@ get_max_middle_cells(void)
 }
 #endif
 
+/** Histograms of how long cells and bytes have waited in each kind of
+ * queue since the last call to queue_delay_reset(). */
+static latency_hist_t queue_delay_hists[QUEUE_DELAY_N_KINDS];
+
+/** Note that a cell or chunk spent <b>msec</b> milliseconds in a queue of
+ * kind <b>kind</b>. */
+void
+queue_delay_note(queue_delay_kind_t kind, uint32_t msec)
+{
+  latency_hist_add(&queue_delay_hists[kind], ((uint64_t)msec) * 1000000);
+}
+
+/** Return the histogram of waiting times for queues of kind
+ * <b>kind</b>. */
+latency_hist_t *
+queue_delay_get_hist(queue_delay_kind_t kind)
+{
+  tor_assert((int)kind >= 0 && kind < QUEUE_DELAY_N_KINDS);
+  return &queue_delay_hists[kind];
+}
+
+/** Return the name we use for queues of kind <b>kind</b> in control
+ * events. */
+const char *
+queue_delay_kind_name(queue_delay_kind_t kind)
+{
+  switch (kind) {
+    case QUEUE_DELAY_CIRCUIT: return "circuit";
+    case QUEUE_DELAY_CHANNEL: return "channel";
+    case QUEUE_DELAY_OUTBUF: return "outbuf";
+  }
+  tor_assert_unreached();
+  return NULL;
+}
+
+/** Forget all the queue waiting times we've recorded. */
+void
+queue_delay_reset(void)
+{
+  memset(queue_delay_hists, 0, sizeof(queue_delay_hists));
+}
+
 /** Add <b>cell</b> to the queue of <b>circ</b> writing to <b>chan</b>
  * transmitting in <b>direction</b>. */
 void
@@ -2830,6 +3199,23 @@ append_cell_to_circuit_queue(circuit_t *circ, channel_t *chan,
   cell_queue_append_packed_copy(circ, queue, exitward, cell,
                                 chan->wide_circ_ids, 1);
 
+  circuit_queue_note_cells_added(circ, chan, queue, direction,
+                                 streams_blocked, fromstream);
+}
+
+/** Called after one or more cells have been added to <b>queue</b>, the
+ * queue of <b>circ</b> writing to <b>chan</b> in <b>direction</b>.
+ * <b>streams_blocked</b> is whether the edge streams on that side were
+ * already blocked before the cells were added; <b>fromstream</b> is the
+ * stream that sent them, or 0.  Run the OOM handler if needed, block the
+ * circuit's streams if the queue is too long, and tell the circuitmux and
+ * the scheduler about the new cells. */
+static void
+circuit_queue_note_cells_added(circuit_t *circ, channel_t *chan,
+                               cell_queue_t *queue,
+                               cell_direction_t direction,
+                               int streams_blocked, streamid_t fromstream)
+{
   if (PREDICT_UNLIKELY(cell_queues_check_size())) {
     /* We ran the OOM handler */
     if (circ->marked_for_close)
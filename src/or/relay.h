@@ -43,12 +43,35 @@ extern uint64_t stats_n_data_cells_received;
 extern uint64_t stats_n_data_bytes_received;
 
 void dump_cell_pool_usage(int severity);
+void relay_free_all(void);
 size_t packed_cell_mem_cost(void);
 
 int have_been_under_memory_pressure(void);
+MOCK_DECL(int, relay_under_memory_pressure, (void));
 
 /* For channeltls.c */
 void packed_cell_free(packed_cell_t *cell);
+void packed_cell_get_alloc_stats(uint64_t *n_reused_out,
+                                 uint64_t *n_malloced_out);
+
+/** Queues whose cells' waiting times we keep histograms of. */
+typedef enum queue_delay_kind_t {
+  /** Circuit cell queues, between relay crypto and the circuitmux. */
+  QUEUE_DELAY_CIRCUIT = 0,
+  /** Channel outgoing queues, for cells the lower layer wasn't ready
+   * for. */
+  QUEUE_DELAY_CHANNEL,
+  /** Connection outbufs, until the bytes are written to the network. */
+  QUEUE_DELAY_OUTBUF,
+} queue_delay_kind_t;
+#define QUEUE_DELAY_N_KINDS (QUEUE_DELAY_OUTBUF + 1)
+
+size_t cell_queues_get_total_allocation(void);
+
+void queue_delay_note(queue_delay_kind_t kind, uint32_t msec);
+struct latency_hist_t *queue_delay_get_hist(queue_delay_kind_t kind);
+const char *queue_delay_kind_name(queue_delay_kind_t kind);
+void queue_delay_reset(void);
 
 void cell_queue_init(cell_queue_t *queue);
 void cell_queue_clear(cell_queue_t *queue);
@@ -98,9 +121,15 @@ STATIC int connection_edge_process_resolved_cell(edge_connection_t *conn,
                                                  const cell_t *cell,
                                                  const relay_header_t *rh);
 STATIC packed_cell_t *packed_cell_new(void);
+STATIC size_t packed_cell_freelist_clear(void);
 STATIC packed_cell_t *cell_queue_pop(cell_queue_t *queue);
-STATIC size_t cell_queues_get_total_allocation(void);
 STATIC int cell_queues_check_size(void);
+STATIC void stream_window_note_data_cell(edge_connection_t *conn,
+                                         uint64_t now_msec);
+STATIC int circuit_package_active_streams(circuit_t *circ,
+                                          crypt_path_t *layer_hint,
+                                          smartlist_t *active, int start,
+                                          int max_to_package);
 #endif
 
 #endif
@@ -10,6 +10,7 @@
 #include "rendcache.h"
 
 #include "config.h"
+#include "rendclient.h"
 #include "rephist.h"
 #include "routerlist.h"
 #include "routerparse.h"
@@ -22,10 +23,32 @@ STATIC strmap_t *rend_cache = NULL;
 /** Map from service id to rend_cache_entry_t; only for hidden services. */
 static strmap_t *rend_cache_local_service = NULL;
 
-/** Map from descriptor id to rend_cache_entry_t; only for hidden service
+/** Map from descriptor id to rend_cache_dir_entry_t; only for hidden service
  * directories. */
 STATIC digestmap_t *rend_cache_v2_dir = NULL;
 
+/** Every entry of rend_cache_v2_dir, as a priority queue ordered by
+ * descriptor publication time, oldest first. */
+static smartlist_t *rend_cache_v2_dir_pqueue = NULL;
+
+/** Type of a least-recently-served list of HSDir descriptors. */
+TOR_TAILQ_HEAD(rend_cache_dir_lru_t, rend_cache_dir_entry_t);
+
+/** HSDir descriptors that have been uploaded but never served, in the order
+ * we stored them. */
+static struct rend_cache_dir_lru_t rend_cache_v2_dir_unserved_lru =
+  TOR_TAILQ_HEAD_INITIALIZER(rend_cache_v2_dir_unserved_lru);
+/** HSDir descriptors that have been served at least once, least recently
+ * served first. */
+static struct rend_cache_dir_lru_t rend_cache_v2_dir_served_lru =
+  TOR_TAILQ_HEAD_INITIALIZER(rend_cache_v2_dir_served_lru);
+/** Total bytes held by the entries of rend_cache_v2_dir. */
+static size_t rend_cache_v2_dir_allocation = 0;
+
+/** Treat something just uploaded as having been served this many seconds
+ * ago, so that flooding with new descriptors doesn't help too much. */
+#define REND_CACHE_DIR_UPLOAD_PENALTY 3600
+
 /** (Client side only) Map from service id to rend_cache_failure_t. This
  * cache is used to track intro point(IP) failures so we know when to keep
  * or discard a new descriptor we just fetched. Here is a description of the
@@ -56,6 +79,17 @@ STATIC strmap_t *rend_cache_failure = NULL;
 /* DOCDOC */
 STATIC size_t rend_cache_total_allocation = 0;
 
+/** Name of the file in our data directory that holds our client-side
+ * descriptors and intro point failures across restarts, when
+ * PersistHSClientCache is set. */
+#define REND_CACHE_CLIENT_FNAME "cached-rend-client"
+
+/** True iff we have loaded our saved client-side cache, or found that we
+ * shouldn't. */
+static int rend_cache_client_loaded = 0;
+
+static void rend_cache_client_load_if_needed(void);
+
 /** Initializes the service descriptor cache.
 */
 void
@@ -63,6 +97,7 @@ rend_cache_init(void)
 {
   rend_cache = strmap_new();
   rend_cache_v2_dir = digestmap_new();
+  rend_cache_v2_dir_pqueue = smartlist_new();
   rend_cache_local_service = strmap_new();
   rend_cache_failure = strmap_new();
 }
@@ -78,7 +113,23 @@ rend_cache_entry_allocation(const rend_cache_entry_t *e)
   return sizeof(*e) + e->len + sizeof(*e->parsed);
 }
 
-/* DOCDOC */
+/** Return the number of bytes used by the HSDir cache entry <b>e</b>. */
+STATIC size_t
+rend_cache_dir_entry_allocation(const rend_cache_dir_entry_t *e)
+{
+  return STRUCT_OFFSET(rend_cache_dir_entry_t, desc) + e->len + 1;
+}
+
+#ifdef TOR_UNIT_TESTS
+/** Return the number of bytes held by the HSDir descriptor cache. */
+STATIC size_t
+rend_cache_v2_dir_get_allocation(void)
+{
+  return rend_cache_v2_dir_allocation;
+}
+#endif
+
+/** Return the total number of bytes attributed to the rendezvous caches. */
 size_t
 rend_cache_get_total_allocation(void)
 {
@@ -227,14 +278,20 @@ void
 rend_cache_free_all(void)
 {
   strmap_free(rend_cache, rend_cache_entry_free_);
-  digestmap_free(rend_cache_v2_dir, rend_cache_entry_free_);
+  digestmap_free(rend_cache_v2_dir, tor_free_);
+  smartlist_free(rend_cache_v2_dir_pqueue);
   strmap_free(rend_cache_local_service, rend_cache_entry_free_);
   strmap_free(rend_cache_failure, rend_cache_failure_entry_free_);
   rend_cache = NULL;
   rend_cache_v2_dir = NULL;
+  rend_cache_v2_dir_pqueue = NULL;
+  TOR_TAILQ_INIT(&rend_cache_v2_dir_unserved_lru);
+  TOR_TAILQ_INIT(&rend_cache_v2_dir_served_lru);
+  rend_cache_v2_dir_allocation = 0;
   rend_cache_local_service = NULL;
   rend_cache_failure = NULL;
   rend_cache_total_allocation = 0;
+  rend_cache_client_loaded = 0;
 }
 
 /** Remove all entries that re REND_CACHE_FAILURE_MAX_AGE old. This is
@@ -452,6 +509,7 @@ rend_cache_intro_failure_note(rend_intro_point_failure_t failure,
   int found;
   rend_cache_failure_intro_t *entry;
 
+  rend_cache_client_load_if_needed();
   found = cache_failure_intro_lookup(identity, service_id, &entry);
   if (!found) {
     cache_failure_intro_add(identity, service_id, failure);
@@ -461,46 +519,145 @@ rend_cache_intro_failure_note(rend_intro_point_failure_t failure,
   }
 }
 
+/** Helper: compare two HSDir cache entries by publication time. */
+static int
+compare_dir_entries_by_timestamp_(const void *_a, const void *_b)
+{
+  const rend_cache_dir_entry_t *a = _a, *b = _b;
+  if (a->timestamp < b->timestamp)
+    return -1;
+  else if (a->timestamp == b->timestamp)
+    return 0;
+  else
+    return 1;
+}
+
+/** Return the LRU list that holds (or should hold) <b>e</b>. */
+static struct rend_cache_dir_lru_t *
+rend_cache_dir_entry_lru(const rend_cache_dir_entry_t *e)
+{
+  return e->served ? &rend_cache_v2_dir_served_lru
+                   : &rend_cache_v2_dir_unserved_lru;
+}
+
+/** Remove <b>e</b> from the HSDir cache and free it. Return the number of
+ * bytes freed. */
+static size_t
+rend_cache_dir_entry_remove(rend_cache_dir_entry_t *e)
+{
+  const size_t n = rend_cache_dir_entry_allocation(e);
+  if (digestmap_get(rend_cache_v2_dir, e->desc_id) == e)
+    digestmap_remove(rend_cache_v2_dir, e->desc_id);
+  TOR_TAILQ_REMOVE(rend_cache_dir_entry_lru(e), e, lru_link);
+  smartlist_pqueue_remove(rend_cache_v2_dir_pqueue,
+                          compare_dir_entries_by_timestamp_,
+                          STRUCT_OFFSET(rend_cache_dir_entry_t, minheap_idx),
+                          e);
+  rend_cache_v2_dir_allocation -= n;
+  rend_cache_decrement_allocation(n);
+  tor_free(e);
+  return n;
+}
+
+/** Remove <b>e</b> from the HSDir cache with a log message, and return the
+ * number of bytes freed. */
+static size_t
+rend_cache_dir_entry_evict(rend_cache_dir_entry_t *e)
+{
+  char key_base32[REND_DESC_ID_V2_LEN_BASE32 + 1];
+  base32_encode(key_base32, sizeof(key_base32), e->desc_id, DIGEST_LEN);
+  log_info(LD_REND, "Removing descriptor with ID '%s' from cache",
+           safe_str_client(key_base32));
+  return rend_cache_dir_entry_remove(e);
+}
+
+/** Return the HSDir cache entry that was served least recently, or NULL if
+ * the cache is empty. */
+static rend_cache_dir_entry_t *
+rend_cache_dir_lru_head(void)
+{
+  rend_cache_dir_entry_t *unserved =
+    TOR_TAILQ_FIRST(&rend_cache_v2_dir_unserved_lru);
+  rend_cache_dir_entry_t *served =
+    TOR_TAILQ_FIRST(&rend_cache_v2_dir_served_lru);
+  if (!unserved)
+    return served;
+  if (!served)
+    return unserved;
+  return served->last_served < unserved->last_served ? served : unserved;
+}
+
+/** Store a copy of the <b>len</b>-byte encoded descriptor <b>desc</b>,
+ * published at <b>timestamp</b>, under <b>desc_id</b> in the HSDir cache,
+ * replacing any entry already stored under that ID. Return the new
+ * entry. */
+STATIC rend_cache_dir_entry_t *
+rend_cache_dir_entry_add(const char *desc_id, const char *desc, size_t len,
+                         time_t timestamp)
+{
+  rend_cache_dir_entry_t *e, *old;
+  size_t n;
+
+  e = tor_malloc_zero(STRUCT_OFFSET(rend_cache_dir_entry_t, desc) + len + 1);
+  memcpy(e->desc_id, desc_id, DIGEST_LEN);
+  memcpy(e->desc, desc, len);
+  e->desc[len] = '\0';
+  e->len = len;
+  e->timestamp = timestamp;
+  e->minheap_idx = -1;
+
+  old = digestmap_set(rend_cache_v2_dir, desc_id, e);
+  if (old) {
+    /* A replacement keeps its predecessor's place in the LRU order. */
+    e->served = old->served;
+    e->last_served = old->last_served;
+    TOR_TAILQ_INSERT_AFTER(rend_cache_dir_entry_lru(old), old, e, lru_link);
+    rend_cache_dir_entry_remove(old);
+  } else {
+    e->last_served = approx_time() - REND_CACHE_DIR_UPLOAD_PENALTY;
+    TOR_TAILQ_INSERT_TAIL(&rend_cache_v2_dir_unserved_lru, e, lru_link);
+  }
+  smartlist_pqueue_add(rend_cache_v2_dir_pqueue,
+                       compare_dir_entries_by_timestamp_,
+                       STRUCT_OFFSET(rend_cache_dir_entry_t, minheap_idx),
+                       e);
+  n = rend_cache_dir_entry_allocation(e);
+  rend_cache_v2_dir_allocation += n;
+  rend_cache_increment_allocation(n);
+  return e;
+}
+
 /** Remove all old v2 descriptors and those for which this hidden service
  * directory is not responsible for any more.
  *
- * If at all possible, remove at least <b>force_remove</b> bytes of data.
+ * If at all possible, remove at least <b>force_remove</b> bytes of data,
+ * starting with the least recently served descriptors. Return the number
+ * of bytes removed.
  */
-void
+size_t
 rend_cache_clean_v2_descs_as_dir(time_t now, size_t force_remove)
 {
-  digestmap_iter_t *iter;
   time_t cutoff = now - REND_CACHE_MAX_AGE - REND_CACHE_MAX_SKEW;
-  const int LAST_SERVED_CUTOFF_STEP = 1800;
-  time_t last_served_cutoff = cutoff;
+  rend_cache_dir_entry_t *e;
   size_t bytes_removed = 0;
-  do {
-    for (iter = digestmap_iter_init(rend_cache_v2_dir);
-         !digestmap_iter_done(iter); ) {
-      const char *key;
-      void *val;
-      rend_cache_entry_t *ent;
-      digestmap_iter_get(iter, &key, &val);
-      ent = val;
-      if (ent->parsed->timestamp < cutoff ||
-          ent->last_served < last_served_cutoff) {
-        char key_base32[REND_DESC_ID_V2_LEN_BASE32 + 1];
-        base32_encode(key_base32, sizeof(key_base32), key, DIGEST_LEN);
-        log_info(LD_REND, "Removing descriptor with ID '%s' from cache",
-                 safe_str_client(key_base32));
-        bytes_removed += rend_cache_entry_allocation(ent);
-        iter = digestmap_iter_next_rmv(rend_cache_v2_dir, iter);
-        rend_cache_entry_free(ent);
-      } else {
-        iter = digestmap_iter_next(rend_cache_v2_dir, iter);
-      }
-    }
 
-    /* In case we didn't remove enough bytes, advance the cutoff a little. */
-    last_served_cutoff += LAST_SERVED_CUTOFF_STEP;
-    if (last_served_cutoff > now)
+  /* Descriptors published too long ago. */
+  while (smartlist_len(rend_cache_v2_dir_pqueue)) {
+    e = smartlist_get(rend_cache_v2_dir_pqueue, 0);
+    if (e->timestamp >= cutoff)
+      break;
+    bytes_removed += rend_cache_dir_entry_evict(e);
+  }
+
+  /* Descriptors nobody has asked for in too long, then anything else we
+   * need to drop to free enough memory. */
+  while ((e = rend_cache_dir_lru_head()) != NULL) {
+    if (e->last_served >= cutoff && bytes_removed >= force_remove)
       break;
-  } while (bytes_removed < force_remove);
+    bytes_removed += rend_cache_dir_entry_evict(e);
+  }
+
+  return bytes_removed;
 }
 
 /** Lookup in the client cache the given service ID <b>query</b> for
@@ -521,6 +678,7 @@ rend_cache_lookup_entry(const char *query, int version, rend_cache_entry_t **e)
   tor_assert(rend_cache);
   tor_assert(query);
 
+  rend_cache_client_load_if_needed();
   if (!rend_valid_service_id(query)) {
     ret = -EINVAL;
     goto end;
@@ -594,7 +752,7 @@ rend_cache_lookup_v2_desc_as_service(const char *query, rend_cache_entry_t **e)
 int
 rend_cache_lookup_v2_desc_as_dir(const char *desc_id, const char **desc)
 {
-  rend_cache_entry_t *e;
+  rend_cache_dir_entry_t *e;
   char desc_id_digest[DIGEST_LEN];
   tor_assert(rend_cache_v2_dir);
   if (base32_decode(desc_id_digest, DIGEST_LEN,
@@ -610,6 +768,9 @@ rend_cache_lookup_v2_desc_as_dir(const char *desc_id, const char **desc)
   if (e) {
     *desc = e->desc;
     e->last_served = approx_time();
+    TOR_TAILQ_REMOVE(rend_cache_dir_entry_lru(e), e, lru_link);
+    e->served = 1;
+    TOR_TAILQ_INSERT_TAIL(&rend_cache_v2_dir_served_lru, e, lru_link);
     return 1;
   }
   return 0;
@@ -639,7 +800,7 @@ rend_cache_store_v2_desc_as_dir(const char *desc)
   int number_parsed = 0, number_stored = 0;
   const char *current_desc = desc;
   const char *next_desc;
-  rend_cache_entry_t *e;
+  rend_cache_dir_entry_t *e;
   time_t now = time(NULL);
   tor_assert(rend_cache_v2_dir);
   tor_assert(desc);
@@ -667,49 +828,33 @@ rend_cache_store_v2_desc_as_dir(const char *desc)
     }
     /* Do we already have a newer descriptor? */
     e = digestmap_get(rend_cache_v2_dir, desc_id);
-    if (e && e->parsed->timestamp > parsed->timestamp) {
+    if (e && e->timestamp > parsed->timestamp) {
       log_info(LD_REND, "We already have a newer service descriptor with the "
                "same desc ID %s and version.",
                safe_str(desc_id_base32));
       goto skip;
     }
     /* Do we already have this descriptor? */
-    if (e && !strcmp(desc, e->desc)) {
+    if (e && e->len == encoded_size &&
+        fast_memeq(current_desc, e->desc, encoded_size)) {
       log_info(LD_REND, "We already have this service descriptor with desc "
                "ID %s.", safe_str(desc_id_base32));
       goto skip;
     }
     /* Store received descriptor. */
-    if (!e) {
-      e = tor_malloc_zero(sizeof(rend_cache_entry_t));
-      digestmap_set(rend_cache_v2_dir, desc_id, e);
-      /* Treat something just uploaded as having been served a little
-       * while ago, so that flooding with new descriptors doesn't help
-       * too much.
-       */
-      e->last_served = approx_time() - 3600;
-    } else {
-      rend_cache_decrement_allocation(rend_cache_entry_allocation(e));
-      rend_service_descriptor_free(e->parsed);
-      tor_free(e->desc);
-    }
-    e->parsed = parsed;
-    e->desc = tor_strndup(current_desc, encoded_size);
-    e->len = encoded_size;
-    rend_cache_increment_allocation(rend_cache_entry_allocation(e));
+    rend_cache_dir_entry_add(desc_id, current_desc, encoded_size,
+                             parsed->timestamp);
     log_info(LD_REND, "Successfully stored service descriptor with desc ID "
              "'%s' and len %d.",
              safe_str(desc_id_base32), (int)encoded_size);
     /* Statistics: Note down this potentially new HS. */
     if (options->HiddenServiceStatistics) {
-      rep_hist_stored_maybe_new_hs(e->parsed->pk);
+      rep_hist_stored_maybe_new_hs(parsed->pk);
     }
-
     number_stored++;
-    goto advance;
  skip:
+    /* We only keep the encoded descriptor. */
     rend_service_descriptor_free(parsed);
- advance:
     /* advance to next descriptor, if available. */
     current_desc = next_desc;
     /* check if there is a next descriptor. */
@@ -717,6 +862,13 @@ rend_cache_store_v2_desc_as_dir(const char *desc)
         strcmpstart(current_desc, "rendezvous-service-descriptor "))
       break;
   }
+  /* Don't let a flood of uploads push us into the OOM handler: keep the
+   * cache below the share of MaxMemInQueues that would trigger it there. */
+  if (number_stored && options->MaxMemInQueues &&
+      rend_cache_v2_dir_allocation > options->MaxMemInQueues / 5) {
+    rend_cache_clean_v2_descs_as_dir(now, rend_cache_v2_dir_allocation -
+                                     (size_t)(options->MaxMemInQueues / 5));
+  }
   if (!number_parsed) {
     log_info(LD_REND, "Could not parse any descriptor.");
     return -1;
@@ -852,6 +1004,7 @@ rend_cache_store_v2_desc_as_client(const char *desc,
   tor_assert(rend_cache);
   tor_assert(desc);
   tor_assert(desc_id_base32);
+  rend_cache_client_load_if_needed();
   memset(want_desc_id, 0, sizeof(want_desc_id));
   if (entry) {
     *entry = NULL;
@@ -1009,3 +1162,201 @@ rend_cache_store_v2_desc_as_client(const char *desc,
   return retval;
 }
 
+/** Return a newly allocated string holding every client-side descriptor
+ * and intro point failure that is still valid at <b>now</b>, in the format
+ * of REND_CACHE_CLIENT_FNAME:
+ *
+ *   "failure" SP service-id SP identity-hex SP failure-type SP created NL
+ *   "descriptor" SP length NL descriptor NL
+ *
+ * Failures come first, so that they apply to the descriptors as we reload
+ * them. */
+STATIC char *
+rend_cache_client_encode(time_t now)
+{
+  smartlist_t *chunks = smartlist_new();
+  const time_t cutoff = now - REND_CACHE_MAX_AGE - REND_CACHE_MAX_SKEW;
+  char *out;
+
+  if (rend_cache_failure) {
+    STRMAP_FOREACH(rend_cache_failure, service_id,
+                   const rend_cache_failure_t *, ent) {
+      DIGESTMAP_FOREACH(ent->intro_failures, identity,
+                        const rend_cache_failure_intro_t *, intro) {
+        char hex[HEX_DIGEST_LEN+1];
+        if (intro->created_ts + REND_CACHE_FAILURE_MAX_AGE < now)
+          continue;
+        base16_encode(hex, sizeof(hex), identity, DIGEST_LEN);
+        smartlist_add_asprintf(chunks, "failure %s %s %d %ld\n",
+                               service_id, hex, (int)intro->failure_type,
+                               (long)intro->created_ts);
+      } DIGESTMAP_FOREACH_END;
+    } STRMAP_FOREACH_END;
+  }
+  if (rend_cache) {
+    STRMAP_FOREACH(rend_cache, key, const rend_cache_entry_t *, e) {
+      if (e->parsed->timestamp < cutoff)
+        continue;
+      smartlist_add_asprintf(chunks, "descriptor %lu\n%s\n",
+                             (unsigned long)e->len, e->desc);
+    } STRMAP_FOREACH_END;
+  }
+  out = smartlist_join_strings(chunks, "", 0, NULL);
+  SMARTLIST_FOREACH(chunks, char *, cp, tor_free(cp));
+  smartlist_free(chunks);
+  return out;
+}
+
+/** Store the saved client-side descriptor <b>desc</b> in the client cache,
+ * unless it has expired by <b>now</b>. Return 0 if we stored it, -1
+ * otherwise. */
+static int
+rend_cache_client_load_desc(const char *desc, time_t now)
+{
+  rend_service_descriptor_t *parsed = NULL;
+  const rend_service_authorization_t *auth;
+  rend_data_t query;
+  char desc_id[DIGEST_LEN];
+  char desc_id_base32[REND_DESC_ID_V2_LEN_BASE32 + 1];
+  char *intro_content = NULL;
+  size_t intro_size, encoded_size;
+  const char *next_desc;
+  int r = -1;
+
+  memset(&query, 0, sizeof(query));
+  if (rend_parse_v2_service_descriptor(&parsed, desc_id, &intro_content,
+                                       &intro_size, &encoded_size,
+                                       &next_desc, desc, 0) < 0 ||
+      rend_get_service_id(parsed->pk, query.onion_address) < 0)
+    goto done;
+  if (parsed->timestamp < now - REND_CACHE_MAX_AGE - REND_CACHE_MAX_SKEW) {
+    log_info(LD_REND, "Saved descriptor for a hidden service has expired.");
+    goto done;
+  }
+  /* We never save cookies; look them up from our configuration again. */
+  auth = rend_client_lookup_service_authorization(query.onion_address);
+  if (auth) {
+    memcpy(query.descriptor_cookie, auth->descriptor_cookie,
+           sizeof(query.descriptor_cookie));
+    query.auth_type = auth->auth_type;
+  }
+  base32_encode(desc_id_base32, sizeof(desc_id_base32), desc_id, DIGEST_LEN);
+  r = rend_cache_store_v2_desc_as_client(desc, desc_id_base32, &query, NULL);
+
+ done:
+  memwipe(&query, 0, sizeof(query));
+  rend_service_descriptor_free(parsed);
+  tor_free(intro_content);
+  return r;
+}
+
+/** Load the <b>len</b>-byte client-side cache snapshot <b>body</b>, as
+ * written by rend_cache_client_encode(), skipping whatever has expired by
+ * <b>now</b>. Return the number of descriptors loaded. */
+STATIC int
+rend_cache_client_decode(const char *body, size_t len, time_t now)
+{
+  const char *cp = body, *eos = body + len;
+  int n_loaded = 0;
+
+  while (cp < eos) {
+    const char *eol = memchr(cp, '\n', eos - cp);
+    char *line;
+    if (!eol)
+      break;
+    line = tor_strndup(cp, eol - cp);
+    cp = eol + 1;
+
+    if (!strcmpstart(line, "failure ")) {
+      char service_id[REND_SERVICE_ID_LEN_BASE32+1];
+      char hex[HEX_DIGEST_LEN+1];
+      char identity[DIGEST_LEN];
+      unsigned failure;
+      long created;
+      rend_cache_failure_intro_t *intro;
+      if (tor_sscanf(line, "failure %16s %40s %u %ld", service_id, hex,
+                     &failure, &created) == 4 &&
+          rend_valid_service_id(service_id) &&
+          base16_decode(identity, sizeof(identity), hex, strlen(hex)) ==
+            DIGEST_LEN &&
+          failure <= INTRO_POINT_FAILURE_UNREACHABLE &&
+          created <= now && created + REND_CACHE_FAILURE_MAX_AGE >= now) {
+        cache_failure_intro_add((const uint8_t *) identity, service_id,
+                                (rend_intro_point_failure_t) failure);
+        if (cache_failure_intro_lookup((const uint8_t *) identity,
+                                       service_id, &intro))
+          intro->created_ts = (time_t) created;
+      }
+    } else if (!strcmpstart(line, "descriptor ")) {
+      unsigned long desc_len;
+      char *desc;
+      if (tor_sscanf(line, "descriptor %lu", &desc_len) != 1 ||
+          desc_len > (unsigned long)(eos - cp)) {
+        log_warn(LD_REND, "Truncated hidden service client cache; "
+                 "ignoring the rest of it.");
+        tor_free(line);
+        break;
+      }
+      desc = tor_strndup(cp, desc_len);
+      cp += desc_len;
+      if (cp < eos && *cp == '\n')
+        ++cp;
+      if (rend_cache_client_load_desc(desc, now) == 0)
+        ++n_loaded;
+      tor_free(desc);
+    }
+    tor_free(line);
+  }
+  return n_loaded;
+}
+
+/** If PersistHSClientCache is set and we haven't done so yet, load our
+ * saved client-side descriptors and intro point failures. We do this the
+ * first time we need the client cache, rather than at startup. */
+static void
+rend_cache_client_load_if_needed(void)
+{
+  char *fname, *body;
+  struct stat st;
+  int n;
+
+  if (rend_cache_client_loaded)
+    return;
+  rend_cache_client_loaded = 1;
+  if (!get_options()->PersistHSClientCache)
+    return;
+
+  fname = get_datadir_fname(REND_CACHE_CLIENT_FNAME);
+  body = read_file_to_str(fname, RFTS_IGNORE_MISSING, &st);
+  if (body) {
+    n = rend_cache_client_decode(body, strlen(body), approx_time());
+    log_info(LD_REND, "Loaded %d saved hidden service descriptor%s.",
+             n, n == 1 ? "" : "s");
+    tor_free(body);
+  }
+  tor_free(fname);
+}
+
+/** If PersistHSClientCache is set, save our client-side descriptors and
+ * intro point failures that are still valid at <b>now</b>. */
+void
+rend_cache_client_save(time_t now)
+{
+  char *fname, *body;
+
+  if (!get_options()->PersistHSClientCache || !rend_cache)
+    return;
+  /* Don't overwrite what we saved last time before we have read it. */
+  rend_cache_client_load_if_needed();
+
+  fname = get_datadir_fname(REND_CACHE_CLIENT_FNAME);
+  body = rend_cache_client_encode(now);
+  if (write_str_to_file(fname, body, 0) < 0) {
+    log_warn(LD_FS, "Couldn't save hidden service client cache to %s.",
+             escaped(fname));
+  }
+  memwipe(body, 0, strlen(body));
+  tor_free(body);
+  tor_free(fname);
+}
+
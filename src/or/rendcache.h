@@ -34,6 +34,23 @@ typedef struct rend_cache_entry_t {
   rend_service_descriptor_t *parsed; /**< Parsed value of 'desc' */
 } rend_cache_entry_t;
 
+/** A v2 descriptor stored on an HSDir. We never need the parsed form again
+ * after storing it, so we keep only the few fields we index on and the
+ * encoded descriptor itself, all in a single allocation. */
+typedef struct rend_cache_dir_entry_t {
+  /** Links for the LRU list holding this entry. */
+  TOR_TAILQ_ENTRY(rend_cache_dir_entry_t) lru_link;
+  /** Position of this entry in rend_cache_v2_dir_pqueue. */
+  int minheap_idx;
+  /** True iff we have served this descriptor since storing it. */
+  unsigned int served : 1;
+  time_t timestamp; /**< Publication time of the descriptor. */
+  time_t last_served; /**< When did we last write this one to somebody? */
+  size_t len; /**< Length of <b>desc</b>, not counting the NUL. */
+  char desc_id[DIGEST_LEN]; /**< Descriptor ID; key in rend_cache_v2_dir. */
+  char desc[FLEXIBLE_ARRAY_MEMBER]; /**< NUL-terminated descriptor. */
+} rend_cache_dir_entry_t;
+
 /* Introduction point failure type. */
 typedef struct rend_cache_failure_intro_t {
   /* When this intro point failure occured thus we allocated this object and
@@ -56,7 +73,7 @@ typedef enum {
 void rend_cache_init(void);
 void rend_cache_clean(time_t now, rend_cache_type_t cache_type);
 void rend_cache_failure_clean(time_t now);
-void rend_cache_clean_v2_descs_as_dir(time_t now, size_t min_to_remove);
+size_t rend_cache_clean_v2_descs_as_dir(time_t now, size_t min_to_remove);
 void rend_cache_purge(void);
 void rend_cache_free_all(void);
 int rend_cache_lookup_entry(const char *query, int version,
@@ -77,6 +94,7 @@ void rend_cache_intro_failure_note(rend_intro_point_failure_t failure,
                                    const uint8_t *identity,
                                    const char *service_id);
 void rend_cache_failure_purge(void);
+void rend_cache_client_save(time_t now);
 
 #ifdef RENDCACHE_PRIVATE
 
@@ -103,6 +121,18 @@ STATIC void validate_intro_point_failure(const rend_service_descriptor_t *desc,
 
 STATIC void rend_cache_failure_entry_free_(void *entry);
 
+STATIC size_t rend_cache_dir_entry_allocation(const rend_cache_dir_entry_t *e);
+STATIC rend_cache_dir_entry_t *rend_cache_dir_entry_add(const char *desc_id,
+                                                        const char *desc,
+                                                        size_t len,
+                                                        time_t timestamp);
+#ifdef TOR_UNIT_TESTS
+STATIC size_t rend_cache_v2_dir_get_allocation(void);
+#endif
+STATIC char *rend_cache_client_encode(time_t now);
+STATIC int rend_cache_client_decode(const char *body, size_t len,
+                                    time_t now);
+
 #ifdef TOR_UNIT_TESTS
 extern strmap_t *rend_cache;
 extern strmap_t *rend_cache_failure;
@@ -30,7 +30,10 @@
 
 static extend_info_t *rend_client_get_random_intro_impl(
                           const rend_cache_entry_t *rend_query,
-                          const int strict, const int warnings);
+                          const int strict, const int warnings,
+                          const smartlist_t *exclude_ids);
+static void rend_client_close_other_intros(const char *onion_address,
+                                           const origin_circuit_t *keep);
 
 /** Purge all potentially remotely-detectable state held in the hidden
  * service client code.  Called on SIGNAL NEWNYM. */
@@ -320,6 +323,11 @@ rend_client_send_introduction(origin_circuit_t *introcirc,
   /* Now, we wait for an ACK or NAK on this circuit. */
   circuit_change_purpose(TO_CIRCUIT(introcirc),
                          CIRCUIT_PURPOSE_C_INTRODUCE_ACK_WAIT);
+  /* If we were racing this circuit against another intro point, this one
+   * won: we won't need the other. */
+  if (options->HSClientRaceIntroPoints)
+    rend_client_close_other_intros(introcirc->rend_data->onion_address,
+                                   introcirc);
   /* Set timestamp_dirty, because circuit_expire_building expects it
    * to specify when a circuit entered the _C_INTRODUCE_ACK_WAIT
    * state. */
@@ -356,16 +364,19 @@ rend_client_rendcirc_has_opened(origin_circuit_t *circ)
 }
 
 /**
- * Called to close other intro circuits we launched in parallel.
+ * Called to close other intro circuits we launched in parallel, except for
+ * <b>keep</b>.
  */
 static void
-rend_client_close_other_intros(const char *onion_address)
+rend_client_close_other_intros(const char *onion_address,
+                               const origin_circuit_t *keep)
 {
   /* abort parallel intro circs, if any */
   SMARTLIST_FOREACH_BEGIN(circuit_get_global_list(), circuit_t *, c) {
     if ((c->purpose == CIRCUIT_PURPOSE_C_INTRODUCING ||
         c->purpose == CIRCUIT_PURPOSE_C_INTRODUCE_ACK_WAIT) &&
-        !c->marked_for_close && CIRCUIT_IS_ORIGIN(c)) {
+        !c->marked_for_close && CIRCUIT_IS_ORIGIN(c) &&
+        TO_ORIGIN_CIRCUIT(c) != keep) {
       origin_circuit_t *oc = TO_ORIGIN_CIRCUIT(c);
       if (oc->rend_data &&
           !rend_cmp_service_ids(onion_address,
@@ -431,7 +442,7 @@ rend_client_introduction_acked(origin_circuit_t *circ,
     circuit_mark_for_close(TO_CIRCUIT(circ), END_CIRC_REASON_FINISHED);
 
     /* close any other intros launched in parallel */
-    rend_client_close_other_intros(circ->rend_data->onion_address);
+    rend_client_close_other_intros(circ->rend_data->onion_address, circ);
   } else {
     /* It's a NAK; the introduction point didn't relay our request. */
     circuit_change_purpose(TO_CIRCUIT(circ), CIRCUIT_PURPOSE_C_INTRODUCING);
@@ -1188,6 +1199,7 @@ rend_client_receive_rendezvous(origin_circuit_t *circ, const uint8_t *request,
   circ->hs_circ_has_timed_out = 0;
 
   onion_append_to_cpath(&circ->cpath, hop);
+  circuit_clear_path_for_controller(circ);
   circ->build_state->pending_final_cpath = NULL; /* prevent double-free */
 
   circuit_try_attaching_streams(circ);
@@ -1297,6 +1309,15 @@ rend_client_note_connection_attempt_ended(const rend_data_t *rend_data)
  */
 extend_info_t *
 rend_client_get_random_intro(const rend_data_t *rend_query)
+{
+  return rend_client_get_random_intro_excluding(rend_query, NULL);
+}
+
+/** As rend_client_get_random_intro(), but never choose an introduction
+ * point whose identity digest is in <b>exclude_ids</b>, if it is set. */
+extend_info_t *
+rend_client_get_random_intro_excluding(const rend_data_t *rend_query,
+                                       const smartlist_t *exclude_ids)
 {
   int ret;
   extend_info_t *result;
@@ -1313,23 +1334,26 @@ rend_client_get_random_intro(const rend_data_t *rend_query)
   }
 
   /* See if we can get a node that complies with ExcludeNodes */
-  if ((result = rend_client_get_random_intro_impl(entry, 1, 1)))
+  if ((result = rend_client_get_random_intro_impl(entry, 1, 1,
+                                                   exclude_ids)))
     return result;
   /* If not, and StrictNodes is not set, see if we can return any old node
    */
   if (!get_options()->StrictNodes)
-    return rend_client_get_random_intro_impl(entry, 0, 1);
+    return rend_client_get_random_intro_impl(entry, 0, 1, exclude_ids);
   return NULL;
 }
 
-/** As rend_client_get_random_intro, except assume that StrictNodes is set
- * iff <b>strict</b> is true. If <b>warnings</b> is false, don't complain
- * to the user when we're out of nodes, even if StrictNodes is true.
+/** As rend_client_get_random_intro_excluding, except assume that
+ * StrictNodes is set iff <b>strict</b> is true. If <b>warnings</b> is
+ * false, don't complain to the user when we're out of nodes, even if
+ * StrictNodes is true.
  */
 static extend_info_t *
 rend_client_get_random_intro_impl(const rend_cache_entry_t *entry,
                                   const int strict,
-                                  const int warnings)
+                                  const int warnings,
+                                  const smartlist_t *exclude_ids)
 {
   int i;
 
@@ -1349,6 +1373,14 @@ rend_client_get_random_intro_impl(const rend_cache_entry_t *entry,
                     if (ip->timed_out) {
                       SMARTLIST_DEL_CURRENT(usable_nodes, ip);
                     });
+  /* And the ones we were asked not to use. */
+  if (exclude_ids) {
+    SMARTLIST_FOREACH(usable_nodes, rend_intro_point_t *, ip,
+      if (smartlist_contains_digest(exclude_ids,
+                                    ip->extend_info->identity_digest)) {
+        SMARTLIST_DEL_CURRENT(usable_nodes, ip);
+      });
+  }
 
  again:
   if (smartlist_len(usable_nodes) == 0) {
@@ -1399,7 +1431,8 @@ int
 rend_client_any_intro_points_usable(const rend_cache_entry_t *entry)
 {
   extend_info_t *extend_info =
-    rend_client_get_random_intro_impl(entry, get_options()->StrictNodes, 0);
+    rend_client_get_random_intro_impl(entry, get_options()->StrictNodes, 0,
+                                      NULL);
 
   int rv = (extend_info != NULL);
 
@@ -41,6 +41,9 @@ void rend_client_desc_trynow(const char *query);
 void rend_client_note_connection_attempt_ended(const rend_data_t *rend_data);
 
 extend_info_t *rend_client_get_random_intro(const rend_data_t *rend_query);
+extend_info_t *rend_client_get_random_intro_excluding(
+                                       const rend_data_t *rend_query,
+                                       const smartlist_t *exclude_ids);
 int rend_client_any_intro_points_usable(const rend_cache_entry_t *entry);
 
 int rend_client_send_introduction(origin_circuit_t *introcirc,
@@ -447,7 +447,10 @@ rend_intro_point_free(rend_intro_point_t *intro)
  * authorization is performed), and <b>period</b> (e.g. 0 for the current
  * period, 1 for the next period, etc.) and add them to the existing list
  * <b>descs_out</b>; return the number of seconds that the descriptors will
- * be found by clients, or -1 if the encoding was not successful. */
+ * be found by clients, or -1 if the encoding was not successful.
+ *
+ * Also store the descriptors in the local service's descriptor cache, and
+ * tell the controller about them. */
 int
 rend_encode_v2_descriptors(smartlist_t *descs_out,
                            rend_service_descriptor_t *desc, time_t now,
@@ -455,8 +458,55 @@ rend_encode_v2_descriptors(smartlist_t *descs_out,
                            crypto_pk_t *client_key,
                            smartlist_t *client_cookies)
 {
-  char service_id[DIGEST_LEN];
   char service_id_base32[REND_SERVICE_ID_LEN_BASE32+1];
+  const int first = smartlist_len(descs_out);
+  int seconds_valid;
+
+  seconds_valid = rend_encode_v2_descriptors_threadsafe(descs_out, desc, now,
+                                                        period, auth_type,
+                                                        client_key,
+                                                        client_cookies);
+  if (seconds_valid < 0)
+    return seconds_valid;
+  rend_get_service_id(auth_type == REND_STEALTH_AUTH ? client_key : desc->pk,
+                      service_id_base32);
+  rend_note_encoded_v2_descriptors(descs_out, first, service_id_base32);
+  return seconds_valid;
+}
+
+/** Store the descriptors in <b>descs</b> from index <b>first</b> on, all
+ * replicas of one descriptor for the service <b>service_id_base32</b>, in
+ * the local service's descriptor cache, and tell the controller that we
+ * created them. */
+void
+rend_note_encoded_v2_descriptors(const smartlist_t *descs, int first,
+                                 const char *service_id_base32)
+{
+  int k;
+  for (k = 0; first + k < smartlist_len(descs); k++) {
+    const rend_encoded_v2_service_descriptor_t *enc =
+      smartlist_get(descs, first + k);
+    char desc_id_base32[REND_DESC_ID_V2_LEN_BASE32 + 1];
+    /* Add the uploaded descriptor to the local service's descriptor cache */
+    rend_cache_store_v2_desc_as_service(enc->desc_str);
+    base32_encode(desc_id_base32, sizeof(desc_id_base32),
+                  enc->desc_id, DIGEST_LEN);
+    control_event_hs_descriptor_created(service_id_base32, desc_id_base32, k);
+  }
+}
+
+/** As rend_encode_v2_descriptors(), but touch no global state, so that a
+ * cpuworker can call this. The caller should pass the descriptors to
+ * rend_note_encoded_v2_descriptors() once it has them. */
+int
+rend_encode_v2_descriptors_threadsafe(smartlist_t *descs_out,
+                                      rend_service_descriptor_t *desc,
+                                      time_t now, uint8_t period,
+                                      rend_auth_type_t auth_type,
+                                      crypto_pk_t *client_key,
+                                      smartlist_t *client_cookies)
+{
+  char service_id[DIGEST_LEN];
   uint32_t time_period;
   char *ipos_base64 = NULL, *ipos = NULL, *ipos_encrypted = NULL,
        *descriptor_cookie = NULL;
@@ -651,11 +701,6 @@ rend_encode_v2_descriptors(smartlist_t *descs_out,
       goto err;
     }
     smartlist_add(descs_out, enc);
-    /* Add the uploaded descriptor to the local service's descriptor cache */
-    rend_cache_store_v2_desc_as_service(enc->desc_str);
-    base32_encode(service_id_base32, sizeof(service_id_base32),
-          service_id, REND_SERVICE_ID_LEN);
-    control_event_hs_descriptor_created(service_id_base32, desc_id_base32, k);
   }
 
   log_info(LD_REND, "Successfully encoded a v2 descriptor and "
@@ -930,7 +975,8 @@ int
 hid_serv_get_responsible_directories(smartlist_t *responsible_dirs,
                                      const char *id)
 {
-  int start, found, n_added = 0, i;
+  int lo, hi, i, n_wanted;
+  const hsdir_ring_t *ring;
   networkstatus_t *c = networkstatus_get_latest_consensus();
   if (!c || !smartlist_len(c->routerstatus_list)) {
     log_warn(LD_REND, "We don't have a consensus, so we can't perform v2 "
@@ -938,23 +984,30 @@ hid_serv_get_responsible_directories(smartlist_t *responsible_dirs,
     return -1;
   }
   tor_assert(id);
-  start = networkstatus_vote_find_entry_idx(c, id, &found);
-  if (start == smartlist_len(c->routerstatus_list)) start = 0;
-  i = start;
-  do {
-    routerstatus_t *r = smartlist_get(c->routerstatus_list, i);
-    if (r->is_hs_dir) {
-      smartlist_add(responsible_dirs, r);
-      if (++n_added == REND_NUMBER_OF_CONSECUTIVE_REPLICAS)
-        return 0;
-    }
-    if (++i == smartlist_len(c->routerstatus_list))
-      i = 0;
-  } while (i != start);
+  ring = networkstatus_get_hsdir_ring(c);
+  if (!ring->n_hsdirs)
+    return -1;
 
-  /* Even though we don't have the desired number of hidden service
+  /* Find the first HSDir whose identity is at or after <b>id</b>. */
+  lo = 0;
+  hi = ring->n_hsdirs;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (tor_memcmp(ring->ids + mid * DIGEST_LEN, id, DIGEST_LEN) < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  /* Even if we don't have the desired number of hidden service
    * directories, be happy if we got any. */
-  return smartlist_len(responsible_dirs) ? 0 : -1;
+  n_wanted = MIN(ring->n_hsdirs, REND_NUMBER_OF_CONSECUTIVE_REPLICAS);
+  for (i = 0; i < n_wanted; ++i) {
+    int pos = (lo + i) % ring->n_hsdirs;
+    smartlist_add(responsible_dirs,
+                  smartlist_get(c->routerstatus_list, ring->rs_idx[pos]));
+  }
+  return 0;
 }
 
 /* Length of the 'extended' auth cookie used to encode auth type before
@@ -51,6 +51,14 @@ int rend_encode_v2_descriptors(smartlist_t *descs_out,
                                uint8_t period, rend_auth_type_t auth_type,
                                crypto_pk_t *client_key,
                                smartlist_t *client_cookies);
+int rend_encode_v2_descriptors_threadsafe(smartlist_t *descs_out,
+                                          rend_service_descriptor_t *desc,
+                                          time_t now, uint8_t period,
+                                          rend_auth_type_t auth_type,
+                                          crypto_pk_t *client_key,
+                                          smartlist_t *client_cookies);
+void rend_note_encoded_v2_descriptors(const smartlist_t *descs, int first,
+                                      const char *service_id_base32);
 int rend_compute_v2_desc_id(char *desc_id_out, const char *service_id,
                             const char *descriptor_cookie,
                             time_t now, uint8_t replica);
@@ -16,6 +16,7 @@
 #include "circuituse.h"
 #include "config.h"
 #include "control.h"
+#include "cpuworker.h"
 #include "directory.h"
 #include "main.h"
 #include "networkstatus.h"
@@ -43,16 +44,18 @@ static extend_info_t *find_rp_for_intro(
     const rend_intro_cell_t *intro,
     char **err_msg_out);
 
+static void rend_service_forget_upload_jobs(struct rend_service_t *service);
 static int intro_point_accepted_intro_count(rend_intro_point_t *intro);
 static int intro_point_should_expire_now(rend_intro_point_t *intro,
                                          time_t now);
 static int rend_service_derive_key_digests(struct rend_service_t *s);
+static int rend_service_check_dir(const struct rend_service_t *s);
+static void rend_service_load_private_keys(smartlist_t *services);
 static int rend_service_load_keys(struct rend_service_t *s);
 static int rend_service_load_auth_keys(struct rend_service_t *s,
                                        const char *hfname);
 static struct rend_service_t *rend_service_get_by_pk_digest(
     const char* digest);
-static struct rend_service_t *rend_service_get_by_service_id(const char *id);
 static const char *rend_service_escaped_dir(
     const struct rend_service_t *s);
 
@@ -128,6 +131,48 @@ rend_service_escaped_dir(const struct rend_service_t *s)
  */
 static smartlist_t *rend_service_list = NULL;
 
+/** Maps from public key digest and from service ID to the services in
+ * rend_service_list that have keys. */
+static digestmap_t *rend_service_pk_digest_map = NULL;
+static strmap_t *rend_service_id_map = NULL;
+/** True iff rend_service_list or a service's keys have changed since we
+ * last built rend_service_pk_digest_map and rend_service_id_map. */
+static int rend_service_maps_dirty = 1;
+
+/** Note that rend_service_list, or the keys of one of its services, have
+ * changed, so that the lookup maps must be rebuilt before they are used. */
+static void
+rend_service_list_changed(void)
+{
+  rend_service_maps_dirty = 1;
+}
+
+/** Make sure that rend_service_pk_digest_map and rend_service_id_map match
+ * rend_service_list. */
+static void
+rend_service_maps_update(void)
+{
+  if (!rend_service_maps_dirty && rend_service_pk_digest_map)
+    return;
+  digestmap_free(rend_service_pk_digest_map, NULL);
+  strmap_free(rend_service_id_map, NULL);
+  rend_service_pk_digest_map = digestmap_new();
+  rend_service_id_map = strmap_new();
+  if (rend_service_list) {
+    SMARTLIST_FOREACH_BEGIN(rend_service_list, rend_service_t *, s) {
+      if (!s->private_key)
+        continue;
+      /* If two services share a key, the first one wins, as it always
+       * has. */
+      if (!digestmap_get(rend_service_pk_digest_map, s->pk_digest))
+        digestmap_set(rend_service_pk_digest_map, s->pk_digest, s);
+      if (!strmap_get(rend_service_id_map, s->service_id))
+        strmap_set(rend_service_id_map, s->service_id, s);
+    } SMARTLIST_FOREACH_END(s);
+  }
+  rend_service_maps_dirty = 0;
+}
+
 /** Return the number of rendezvous services we have configured. */
 int
 num_rend_services(void)
@@ -137,6 +182,194 @@ num_rend_services(void)
   return smartlist_len(rend_service_list);
 }
 
+/** Length, in seconds, of the intervals over which we count the circuits
+ * our services launch, to size our pool of prebuilt internal circuits. */
+#define REND_CIRC_RATE_INTERVAL 60
+/** Keep enough prebuilt internal circuits around to cover this many
+ * seconds of circuit launches at the recent rate. */
+#define REND_PREBUILT_CIRCS_HORIZON 10
+/** Fewest and most clean internal circuits to keep around for our
+ * services. */
+#define MIN_REND_PREBUILT_CIRCS 3
+#define MAX_REND_PREBUILT_CIRCS 10
+
+/** When did the current REND_CIRC_RATE_INTERVAL start? */
+static time_t rend_circ_rate_interval_start = 0;
+/** How many introduction and rendezvous circuits have our services
+ * launched in the current interval, and in the one before it? */
+static int n_rend_circs_this_interval = 0;
+static int n_rend_circs_last_interval = 0;
+
+/** Move the counts of launched service circuits forward to the interval
+ * containing <b>now</b>. */
+static void
+rend_circ_rate_update(time_t now)
+{
+  if (now < rend_circ_rate_interval_start + REND_CIRC_RATE_INTERVAL)
+    return;
+  if (now < rend_circ_rate_interval_start + 2*REND_CIRC_RATE_INTERVAL)
+    n_rend_circs_last_interval = n_rend_circs_this_interval;
+  else
+    n_rend_circs_last_interval = 0;
+  n_rend_circs_this_interval = 0;
+  rend_circ_rate_interval_start = now - (now % REND_CIRC_RATE_INTERVAL);
+}
+
+/** Note that one of our services launched an introduction or rendezvous
+ * circuit at <b>now</b>; such a circuit can use one of our prebuilt
+ * internal circuits. */
+STATIC void
+rend_service_note_circ_launched(time_t now)
+{
+  rend_circ_rate_update(now);
+  ++n_rend_circs_this_interval;
+}
+
+/** Return how many clean internal circuits we should keep prebuilt for
+ * our services at <b>now</b>, given how fast they have been launching
+ * circuits recently. */
+STATIC int
+rend_service_prebuilt_circs_for_rate(time_t now)
+{
+  int n_recent, n;
+  rend_circ_rate_update(now);
+  n_recent = MAX(n_rend_circs_this_interval, n_rend_circs_last_interval);
+  n = MIN_REND_PREBUILT_CIRCS +
+    CEIL_DIV(n_recent * REND_PREBUILT_CIRCS_HORIZON, REND_CIRC_RATE_INTERVAL);
+  return MIN(n, MAX_REND_PREBUILT_CIRCS);
+}
+
+/** Return how many clean internal circuits we should keep prebuilt for our
+ * services at <b>now</b>: none if we have no services. */
+int
+rend_service_get_n_prebuilt_circs_wanted(time_t now)
+{
+  if (!num_rend_services())
+    return 0;
+  return rend_service_prebuilt_circs_for_rate(now);
+}
+
+/** Add the time since <b>started</b> to the CPU time <b>service</b> has
+ * cost us. */
+static void
+rend_service_note_cpu(rend_service_t *service, const monotime_t *started)
+{
+  monotime_t now;
+  monotime_get(&now);
+  service->stats.cpu_usec += monotime_diff_usec(started, &now);
+}
+
+/** Record in <b>service</b>'s histogram that a rendezvous took
+ * <b>msec</b> milliseconds from INTRODUCE2 to joining. */
+STATIC void
+rend_service_note_rend_latency(rend_service_t *service, int64_t msec)
+{
+  int i;
+  for (i = 0; i < REND_SERVICE_N_LATENCY_BUCKETS - 1; ++i) {
+    if (msec < (INT64_C(250) << i))
+      break;
+  }
+  ++service->stats.rend_latency[i];
+}
+
+/** Called when <b>circ</b>, a joined rendezvous circuit, is about to be
+ * freed: credit the stream bytes it carried to its service. */
+void
+rend_service_note_rend_circ_closed(origin_circuit_t *circ)
+{
+  rend_service_t *service;
+  if (!circ->n_service_stream_bytes || !circ->rend_data)
+    return;
+  service = rend_service_get_by_pk_digest(circ->rend_data->rend_pk_digest);
+  if (service)
+    service->stats.n_stream_bytes += circ->n_service_stream_bytes;
+  circ->n_service_stream_bytes = 0;
+}
+
+/** Return a newly allocated string describing what each of our hidden
+ * services has cost us, one line per service, for the "onions/stats"
+ * GETINFO key.  Return NULL if we have no services. */
+char *
+rend_service_get_stats_string(void)
+{
+  smartlist_t *lines;
+  char *result;
+
+  if (!num_rend_services())
+    return NULL;
+
+  lines = smartlist_new();
+  SMARTLIST_FOREACH_BEGIN(rend_service_list, const rend_service_t *, s) {
+    const rend_service_stats_t *st = &s->stats;
+    char latency[REND_SERVICE_N_LATENCY_BUCKETS * 11];
+    size_t off = 0;
+    int i;
+    for (i = 0; i < REND_SERVICE_N_LATENCY_BUCKETS; ++i) {
+      off += tor_snprintf(latency + off, sizeof(latency) - off, "%s%u",
+                          i ? "," : "", (unsigned)st->rend_latency[i]);
+    }
+    smartlist_add_asprintf(lines,
+                           "%s IntrosReceived="U64_FORMAT
+                           " IntrosDropped="U64_FORMAT
+                           " RendJoined="U64_FORMAT
+                           " RendLatency=%s"
+                           " StreamBytes="U64_FORMAT
+                           " CPUUsec="U64_FORMAT,
+                           s->service_id,
+                           U64_PRINTF_ARG(st->n_intros_received),
+                           U64_PRINTF_ARG(st->n_intros_dropped),
+                           U64_PRINTF_ARG(st->n_rend_joined),
+                           latency,
+                           U64_PRINTF_ARG(st->n_stream_bytes),
+                           U64_PRINTF_ARG(st->cpu_usec));
+  } SMARTLIST_FOREACH_END(s);
+
+  result = smartlist_join_strings(lines, "\r\n", 0, NULL);
+  SMARTLIST_FOREACH(lines, char *, cp, tor_free(cp));
+  smartlist_free(lines);
+  return result;
+}
+
+/** Return a newly allocated heartbeat message summarizing what our hidden
+ * services have cost us, or NULL if we have none. */
+char *
+rend_service_format_stats_heartbeat(void)
+{
+  rend_service_stats_t total;
+  const rend_service_t *busiest = NULL;
+  char *msg = NULL;
+
+  if (!num_rend_services())
+    return NULL;
+
+  memset(&total, 0, sizeof(total));
+  SMARTLIST_FOREACH_BEGIN(rend_service_list, const rend_service_t *, s) {
+    total.n_intros_received += s->stats.n_intros_received;
+    total.n_intros_dropped += s->stats.n_intros_dropped;
+    total.n_rend_joined += s->stats.n_rend_joined;
+    total.n_stream_bytes += s->stats.n_stream_bytes;
+    total.cpu_usec += s->stats.cpu_usec;
+    if (!busiest || s->stats.cpu_usec > busiest->stats.cpu_usec)
+      busiest = s;
+  } SMARTLIST_FOREACH_END(s);
+  tor_assert(busiest);
+
+  tor_asprintf(&msg, "Heartbeat: Our %d onion service(s) have received "
+               U64_FORMAT" introductions (dropping "U64_FORMAT"), joined "
+               U64_FORMAT" rendezvous circuits, and carried "U64_FORMAT
+               " kB, costing "U64_FORMAT" msec of public-key work. "
+               "The busiest, %s, cost "U64_FORMAT" msec.",
+               num_rend_services(),
+               U64_PRINTF_ARG(total.n_intros_received),
+               U64_PRINTF_ARG(total.n_intros_dropped),
+               U64_PRINTF_ARG(total.n_rend_joined),
+               U64_PRINTF_ARG(total.n_stream_bytes >> 10),
+               U64_PRINTF_ARG(total.cpu_usec / 1000),
+               safe_str_client(busiest->service_id),
+               U64_PRINTF_ARG(busiest->stats.cpu_usec / 1000));
+  return msg;
+}
+
 /** Helper: free storage held by a single service authorized client entry. */
 void
 rend_authorized_client_free(rend_authorized_client_t *client)
@@ -167,6 +400,8 @@ rend_service_free(rend_service_t *service)
   if (!service)
     return;
 
+  if (service->upload_job_pending)
+    rend_service_forget_upload_jobs(service);
   tor_free(service->directory);
   if (service->ports) {
     SMARTLIST_FOREACH(service->ports, rend_service_port_config_t*, p,
@@ -210,6 +445,11 @@ rend_service_free_all(void)
                     rend_service_free(ptr));
   smartlist_free(rend_service_list);
   rend_service_list = NULL;
+  digestmap_free(rend_service_pk_digest_map, NULL);
+  rend_service_pk_digest_map = NULL;
+  strmap_free(rend_service_id_map, NULL);
+  rend_service_id_map = NULL;
+  rend_service_list_changed();
 }
 
 /** Validate <b>service</b> and add it to rend_service_list if possible.
@@ -286,6 +526,7 @@ rend_add_service(rend_service_t *service)
       }
     }
     smartlist_add(rend_service_list, service);
+    rend_service_list_changed();
     log_debug(LD_REND,"Configuring service with directory \"%s\"",
               service->directory);
     for (i = 0; i < smartlist_len(service->ports); ++i) {
@@ -457,6 +698,7 @@ rend_config_services(const or_options_t *options, int validate_only)
   if (!validate_only) {
     old_service_list = rend_service_list;
     rend_service_list = smartlist_new();
+    rend_service_list_changed();
   }
 
   for (line = options->RendConfigLines; line; line = line->next) {
@@ -714,6 +956,7 @@ rend_config_services(const or_options_t *options, int validate_only)
         SMARTLIST_DEL_CURRENT(old_service_list, old);
         smartlist_add(surviving_services, old);
         smartlist_add(rend_service_list, old);
+        rend_service_list_changed();
       }
     });
 
@@ -895,6 +1138,7 @@ rend_service_del_ephemeral(const char *service_id)
     }
   } SMARTLIST_FOREACH_END(circ);
   smartlist_remove(rend_service_list, s);
+  rend_service_list_changed();
   rend_service_free(s);
 
   log_debug(LD_CONFIG, "Removed ephemeral Onion Service: %s", service_id);
@@ -1176,6 +1420,8 @@ int
 rend_service_load_all_keys(const smartlist_t *service_list)
 {
   const smartlist_t *s_list;
+  smartlist_t *to_load = smartlist_new();
+  int r = -1;
   /* If no special service list is provided, then just use the global one. */
   if (!service_list) {
     tor_assert(rend_service_list);
@@ -1184,17 +1430,30 @@ rend_service_load_all_keys(const smartlist_t *service_list)
     s_list = service_list;
   }
 
+  /* Check the directories first, since the key files live in them. */
   SMARTLIST_FOREACH_BEGIN(s_list, rend_service_t *, s) {
     if (s->private_key)
       continue;
     log_info(LD_REND, "Loading hidden-service keys from \"%s\"",
              s->directory);
+    if (rend_service_check_dir(s) < 0)
+      goto done;
+    smartlist_add(to_load, s);
+  } SMARTLIST_FOREACH_END(s);
 
+  /* Generating and parsing RSA keys is the slow part, so when there are
+   * many services, do it on several threads at once. */
+  rend_service_load_private_keys(to_load);
+
+  SMARTLIST_FOREACH_BEGIN(to_load, rend_service_t *, s) {
     if (rend_service_load_keys(s) < 0)
-      return -1;
+      goto done;
   } SMARTLIST_FOREACH_END(s);
 
-  return 0;
+  r = 0;
+ done:
+  smartlist_free(to_load);
+  return r;
 }
 
 /** Add to <b>lst</b> every filename used by <b>s</b>. */
@@ -1241,18 +1500,16 @@ rend_service_derive_key_digests(struct rend_service_t *s)
     log_warn(LD_BUG, "Couldn't compute hash of public key.");
     return -1;
   }
+  rend_service_list_changed();
 
   return 0;
 }
 
-/** Load and/or generate private keys for the hidden service <b>s</b>,
- * possibly including keys for client authorization.  Return 0 on success, -1
- * on failure. */
+/** Check, and create if necessary, the directory for the hidden service
+ * <b>s</b>.  Return 0 on success, -1 on failure. */
 static int
-rend_service_load_keys(rend_service_t *s)
+rend_service_check_dir(const rend_service_t *s)
 {
-  char *fname = NULL;
-  char buf[128];
   cpd_check_t  check_opts = CPD_CREATE;
 
   if (s->dir_group_readable) {
@@ -1260,7 +1517,7 @@ rend_service_load_keys(rend_service_t *s)
   }
   /* Check/create directory */
   if (check_private_dir(s->directory, check_opts, get_options()->User) < 0) {
-    goto err;
+    return -1;
   }
 #ifndef _WIN32
   if (s->dir_group_readable) {
@@ -1270,11 +1527,117 @@ rend_service_load_keys(rend_service_t *s)
     }
   }
 #endif
+  return 0;
+}
 
-  /* Load key */
+/** Load, or generate and save, the private key of the hidden service
+ * <b>s</b>, if it doesn't have one yet.  Safe to call from any thread,
+ * once we hold the lock on our data directory. */
+static void
+rend_service_load_private_key(rend_service_t *s)
+{
+  char *fname;
+  if (s->private_key)
+    return;
   fname = rend_service_path(s, private_key_fname);
   s->private_key = init_key_from_file(fname, 1, LOG_ERR, 0);
+  tor_free(fname);
+}
 
+/** Most threads rend_service_load_private_keys() will use. */
+#define MAX_KEY_LOADING_THREADS 16
+
+/** Work shared by the threads of rend_service_load_private_keys(). */
+typedef struct rend_key_load_batch_t {
+  tor_mutex_t lock;
+  tor_cond_t cond;
+  /** The services whose keys we are loading. */
+  smartlist_t *services;
+  /** Index in <b>services</b> of the next one that needs a thread. */
+  int next_idx;
+  /** Number of threads that have not yet finished. */
+  int n_threads_running;
+} rend_key_load_batch_t;
+
+/** Thread body for rend_service_load_private_keys(): load keys for
+ * services from the batch <b>arg</b> until there are none left. */
+static void
+rend_service_key_load_threadfn(void *arg)
+{
+  rend_key_load_batch_t *batch = arg;
+  while (1) {
+    rend_service_t *s = NULL;
+    tor_mutex_acquire(&batch->lock);
+    if (batch->next_idx < smartlist_len(batch->services))
+      s = smartlist_get(batch->services, batch->next_idx++);
+    tor_mutex_release(&batch->lock);
+    if (!s)
+      break;
+    rend_service_load_private_key(s);
+  }
+  tor_mutex_acquire(&batch->lock);
+  --batch->n_threads_running;
+  tor_cond_signal_all(&batch->cond);
+  tor_mutex_release(&batch->lock);
+}
+
+/** Load or generate the private keys for every service in
+ * <b>services</b>, using several threads if there are enough services to be
+ * worth it.  Services whose keys we couldn't load are left without one. */
+static void
+rend_service_load_private_keys(smartlist_t *services)
+{
+  rend_key_load_batch_t batch;
+  int n_threads, i;
+
+  n_threads = MIN(get_num_cpus(get_options()), MAX_KEY_LOADING_THREADS);
+  n_threads = MIN(n_threads, smartlist_len(services));
+  /* init_key_from_file() takes our data directory lock itself if it has to
+   * make a key, which only the main thread may do. */
+  if (n_threads < 2 || !have_lockfile()) {
+    SMARTLIST_FOREACH(services, rend_service_t *, s,
+                      rend_service_load_private_key(s));
+    return;
+  }
+
+  memset(&batch, 0, sizeof(batch));
+  tor_mutex_init_for_cond(&batch.lock);
+  tor_cond_init(&batch.cond);
+  batch.services = services;
+
+  tor_mutex_acquire(&batch.lock);
+  for (i = 0; i < n_threads; ++i) {
+    ++batch.n_threads_running;
+    if (spawn_func(rend_service_key_load_threadfn, &batch) < 0) {
+      --batch.n_threads_running;
+      break;
+    }
+  }
+  log_info(LD_REND, "Loading keys for %d hidden services on %d threads.",
+           smartlist_len(services), batch.n_threads_running);
+  while (batch.n_threads_running)
+    tor_cond_wait(&batch.cond, &batch.lock, NULL);
+  tor_mutex_release(&batch.lock);
+
+  tor_cond_uninit(&batch.cond);
+  tor_mutex_uninit(&batch.lock);
+
+  /* If we couldn't start any threads, do the work here. */
+  for (i = batch.next_idx; i < smartlist_len(services); ++i)
+    rend_service_load_private_key(smartlist_get(services, i));
+}
+
+/** Load and/or generate private keys for the hidden service <b>s</b>,
+ * whose directory we have checked, possibly including keys for client
+ * authorization.  Return 0 on success, -1 on failure. */
+static int
+rend_service_load_keys(rend_service_t *s)
+{
+  char *fname = NULL;
+  char buf[128];
+
+  /* Load key, unless rend_service_load_private_keys() already has. */
+  rend_service_load_private_key(s);
   if (!s->private_key)
     goto err;
 
@@ -1506,24 +1869,19 @@ rend_service_load_auth_keys(rend_service_t *s, const char *hfname)
 static rend_service_t *
 rend_service_get_by_pk_digest(const char* digest)
 {
-  SMARTLIST_FOREACH(rend_service_list, rend_service_t*, s,
-                    if (tor_memeq(s->pk_digest,digest,DIGEST_LEN))
-                        return s);
-  return NULL;
+  rend_service_maps_update();
+  return digestmap_get(rend_service_pk_digest_map, digest);
 }
 
 /** Return the service whose service id is <b>id</b>, or NULL if no such
  * service exists.
  */
-static struct rend_service_t *
+struct rend_service_t *
 rend_service_get_by_service_id(const char *id)
 {
   tor_assert(strlen(id) == REND_SERVICE_ID_LEN_BASE32);
-  SMARTLIST_FOREACH(rend_service_list, rend_service_t*, s, {
-    if (tor_memeq(s->service_id, id, REND_SERVICE_ID_LEN_BASE32))
-      return s;
-  });
-  return NULL;
+  rend_service_maps_update();
+  return strmap_get(rend_service_id_map, id);
 }
 
 /** Return 1 if any virtual port in <b>service</b> wants a circuit
@@ -1621,8 +1979,458 @@ rend_service_use_direct_connection_node(const or_options_t* options,
  * Handle cells
  ******/
 
+/** When HiddenServiceReplayFilter is set: how many INTRODUCE2 cells each
+ * time bucket of a DH replay filter is sized for, and the chance of a false
+ * replay we accept once a filter is that full. */
+#define REND_REPLAY_FILTER_BUCKET_SIZE 16384
+#define REND_REPLAY_FILTER_FP_RATE 0.001
+
+/** Most INTRODUCE2 cells we will have waiting on the cpuworkers at once.
+ * Past this, we process them on the main thread as they arrive. */
+#define MAX_PENDING_INTRO_JOBS 256
+
+/** An INTRODUCE2 cell whose decryption and DH handshake we have handed to
+ * a cpuworker. */
+typedef struct rend_intro_job_t {
+  /** The introduction circuit the cell arrived on, or NULL if it has been
+   * freed since. */
+  origin_circuit_t *circ;
+  /** The circuit's n_circ_id, for logging from the worker. */
+  uint32_t circ_id;
+  /** A copy of the introduction key, for the worker's use alone. */
+  crypto_pk_t *intro_key;
+  /** The cell, early-parsed by the main thread; decrypted and fully parsed
+   * by the worker. */
+  rend_intro_cell_t *parsed_req;
+  /** Set by the worker: 0 on success, -1 on failure. */
+  int status;
+  /** Set by the worker on failure: a description of what went wrong, and
+   * the stage at which it did. */
+  char *err_msg;
+  const char *stage_descr;
+  /** Set by the worker on success: our half of the DH handshake, and the
+   * key material it yielded. */
+  crypto_dh_t *dh;
+  char keys[DIGEST_LEN+CPATH_KEY_MATERIAL_LEN];
+  /** When the cell arrived. */
+  monotime_t received;
+  /** Set by the worker: how long it spent on the cell, in usec. */
+  int64_t cpu_usec;
+} rend_intro_job_t;
+
+/** List of rend_intro_job_t that are queued or running on a cpuworker. */
+static smartlist_t *pending_intro_jobs = NULL;
+
+/** Do the expensive part of handling an INTRODUCE2 cell: decrypt
+ * <b>parsed_req</b> with <b>intro_key</b>, parse and validate the
+ * plaintext, and complete a DH handshake with the client, putting our DH
+ * state in *<b>dh_out</b> and the key material in <b>keys_out</b>.
+ *
+ * This touches no global state, so that it can run on a cpuworker.
+ * <b>circ_id</b> is used only for logging.
+ *
+ * Return 0 on success.  On failure, return -1 and set *<b>err_msg_out</b>
+ * and *<b>stage_out</b> to describe what went wrong.
+ */
+STATIC int
+rend_service_intro_handshake(rend_intro_cell_t *parsed_req,
+                             crypto_pk_t *intro_key, uint32_t circ_id,
+                             crypto_dh_t **dh_out, char *keys_out,
+                             char **err_msg_out, const char **stage_out)
+{
+  char *err_msg = NULL;
+  crypto_dh_t *dh = NULL;
+  int result;
+
+  *stage_out = "decryption";
+  /* Now try to decrypt it */
+  result = rend_service_decrypt_intro(parsed_req, intro_key, &err_msg);
+  if (result < 0) {
+    goto err;
+  } else if (err_msg) {
+    log_info(LD_REND, "%s on circ %u.", err_msg, (unsigned)circ_id);
+    tor_free(err_msg);
+  }
+
+  *stage_out = "late parsing";
+  /* Parse the plaintext */
+  result = rend_service_parse_intro_plaintext(parsed_req, &err_msg);
+  if (result < 0) {
+    goto err;
+  } else if (err_msg) {
+    log_info(LD_REND, "%s on circ %u.", err_msg, (unsigned)circ_id);
+    tor_free(err_msg);
+  }
+
+  *stage_out = "late validation";
+  /* Validate the parsed plaintext parts */
+  result = rend_service_validate_intro_late(parsed_req, &err_msg);
+  if (result < 0) {
+    goto err;
+  } else if (err_msg) {
+    log_info(LD_REND, "%s on circ %u.", err_msg, (unsigned)circ_id);
+    tor_free(err_msg);
+  }
+
+  *stage_out = "DH handshake";
+  /* Try DH handshake... */
+  dh = crypto_dh_new(DH_TYPE_REND);
+  if (!dh || crypto_dh_generate_public(dh)<0) {
+    err_msg = tor_strdup("Internal error: couldn't build DH state "
+                         "or generate public key");
+    goto err;
+  }
+  if (crypto_dh_compute_secret(LOG_PROTOCOL_WARN, dh,
+                               (char *)(parsed_req->dh),
+                               DH_KEY_LEN, keys_out,
+                               DIGEST_LEN+CPATH_KEY_MATERIAL_LEN)<0) {
+    err_msg = tor_strdup("Internal error: couldn't complete DH handshake");
+    goto err;
+  }
+
+  *stage_out = NULL;
+  *dh_out = dh;
+  return 0;
+
+ err:
+  if (dh)
+    crypto_dh_free(dh);
+  *err_msg_out = err_msg;
+  return -1;
+}
+
+/** Finish handling an INTRODUCE2 cell that arrived on <b>circuit</b> for
+ * <b>service</b> at <b>intro_point</b> at time <b>received</b>, once
+ * <b>parsed_req</b> has been decrypted and we have completed the DH
+ * handshake with the client: check the DH replay cache and client
+ * authorization, and launch a circuit to the rendezvous point.  On
+ * success, take ownership of *<b>dh</b> and set it to NULL.  Return 0 on
+ * success, -1 on failure.
+ */
+static int
+rend_service_intro_finish(origin_circuit_t *circuit,
+                          rend_service_t *service,
+                          rend_intro_point_t *intro_point,
+                          rend_intro_cell_t *parsed_req,
+                          const monotime_t *received,
+                          crypto_dh_t **dh, const char *keys)
+{
+  int status = 0;
+  const or_options_t *options = get_options();
+  char *err_msg = NULL;
+  int reason = END_CIRC_REASON_TORPROTOCOL;
+  char serviceid[REND_SERVICE_ID_LEN_BASE32+1];
+  /* Rendezvous point */
+  extend_info_t *rp = NULL;
+  int i;
+  origin_circuit_t *launched = NULL;
+  crypt_path_t *cpath = NULL;
+  char hexcookie[9];
+  int circ_needs_uptime;
+  time_t now = time(NULL);
+  time_t elapsed;
+  int replay;
+
+  base32_encode(serviceid, REND_SERVICE_ID_LEN_BASE32+1,
+                circuit->rend_data->rend_pk_digest, REND_SERVICE_ID_LEN);
+
+  /* Increment INTRODUCE2 counter */
+  ++(intro_point->accepted_introduce2_count);
+
+  /* Find the rendezvous point */
+  rp = find_rp_for_intro(parsed_req, &err_msg);
+  if (!rp) {
+    log_fn(LOG_PROTOCOL_WARN, LD_REND, "%s on circ %u",
+           err_msg ? err_msg : "unknown error for INTRODUCE2",
+           (unsigned)circuit->base_.n_circ_id);
+    goto err;
+  }
+
+  /* Check if we'd refuse to talk to this router */
+  if (options->StrictNodes &&
+      routerset_contains_extendinfo(options->ExcludeNodes, rp)) {
+    log_warn(LD_REND, "Client asked to rendezvous at a relay that we "
+             "exclude, and StrictNodes is set. Refusing service.");
+    reason = END_CIRC_REASON_INTERNAL; /* XXX might leak why we refused */
+    goto err;
+  }
+
+  base16_encode(hexcookie, 9, (const char *)(parsed_req->rc), 4);
+
+  /* Check whether there is a past request with the same Diffie-Hellman,
+   * part 1. */
+  replay = replaycache_add_test_and_elapsed(
+      service->accepted_intro_dh_parts,
+      parsed_req->dh, DH_KEY_LEN,
+      &elapsed);
+
+  if (replay) {
+    /* A Tor client will send a new INTRODUCE1 cell with the same rend
+     * cookie and DH public key as its previous one if its intro circ
+     * times out while in state CIRCUIT_PURPOSE_C_INTRODUCE_ACK_WAIT .
+     * If we received the first INTRODUCE1 cell (the intro-point relay
+     * converts it into an INTRODUCE2 cell), we are already trying to
+     * connect to that rend point (and may have already succeeded);
+     * drop this cell. */
+    log_info(LD_REND, "We received an "
+             "INTRODUCE2 cell with same first part of "
+             "Diffie-Hellman handshake %d seconds ago. Dropping "
+             "cell.",
+             (int) elapsed);
+    goto err;
+  }
+
+  /* If the service performs client authorization, check included auth data. */
+  if (service->clients) {
+    if (parsed_req->version == 3 && parsed_req->u.v3.auth_len > 0) {
+      if (rend_check_authorization(service,
+                                   (const char*)parsed_req->u.v3.auth_data,
+                                   parsed_req->u.v3.auth_len)) {
+        log_info(LD_REND, "Authorization data in INTRODUCE2 cell are valid.");
+      } else {
+        log_info(LD_REND, "The authorization data that are contained in "
+                 "the INTRODUCE2 cell are invalid. Dropping cell.");
+        reason = END_CIRC_REASON_CONNECTFAILED;
+        goto err;
+      }
+    } else {
+      log_info(LD_REND, "INTRODUCE2 cell does not contain authentication "
+               "data, but we require client authorization. Dropping cell.");
+      reason = END_CIRC_REASON_CONNECTFAILED;
+      goto err;
+    }
+  }
+
+  circ_needs_uptime = rend_service_requires_uptime(service);
+
+  /* help predict this next time */
+  rep_hist_note_used_internal(now, circ_needs_uptime, 1);
+  rend_service_note_circ_launched(now);
+
+  /* Launch a circuit to the client's chosen rendezvous point.
+   */
+  for (i=0;i<MAX_REND_FAILURES;i++) {
+    int flags = CIRCLAUNCH_NEED_CAPACITY | CIRCLAUNCH_IS_INTERNAL;
+    if (circ_needs_uptime) flags |= CIRCLAUNCH_NEED_UPTIME;
+    /* A Single Onion Service only uses a direct connection if its
+     * firewall rules permit direct connections to the address. */
+    if (rend_service_use_direct_connection(options, rp)) {
+      flags = flags | CIRCLAUNCH_ONEHOP_TUNNEL;
+    }
+    launched = circuit_launch_by_extend_info(
+                        CIRCUIT_PURPOSE_S_CONNECT_REND, rp, flags);
+
+    if (launched)
+      break;
+  }
+  if (!launched) { /* give up */
+    log_warn(LD_REND, "Giving up launching first hop of circuit to rendezvous "
+             "point %s for service %s.",
+             safe_str_client(extend_info_describe(rp)),
+             serviceid);
+    reason = END_CIRC_REASON_CONNECTFAILED;
+    goto err;
+  }
+  log_info(LD_REND,
+           "Accepted intro; launching circuit to %s "
+           "(cookie %s) for service %s.",
+           safe_str_client(extend_info_describe(rp)),
+           hexcookie, serviceid);
+  tor_assert(launched->build_state);
+  /* Fill in the circuit's state. */
+
+  launched->rend_data =
+    rend_data_service_create(service->service_id,
+                             circuit->rend_data->rend_pk_digest,
+                             parsed_req->rc, service->auth_type);
+
+  launched->build_state->service_pending_final_cpath_ref =
+    tor_malloc_zero(sizeof(crypt_path_reference_t));
+  launched->build_state->service_pending_final_cpath_ref->refcount = 1;
+
+  launched->build_state->service_pending_final_cpath_ref->cpath = cpath =
+    tor_malloc_zero(sizeof(crypt_path_t));
+  cpath->magic = CRYPT_PATH_MAGIC;
+  launched->build_state->expiry_time = now + MAX_REND_TIMEOUT;
+  launched->build_state->service_intro_received = *received;
+
+  cpath->rend_dh_handshake_state = *dh;
+  *dh = NULL;
+  if (circuit_init_cpath_crypto(cpath,keys+DIGEST_LEN,1)<0)
+    goto err;
+  memcpy(cpath->rend_circ_nonce, keys, DIGEST_LEN);
+
+  goto done;
+
+ err:
+  status = -1;
+  if (launched) {
+    circuit_mark_for_close(TO_CIRCUIT(launched), reason);
+  }
+
+ done:
+  tor_free(err_msg);
+  memwipe(serviceid, 0, sizeof(serviceid));
+  memwipe(hexcookie, 0, sizeof(hexcookie));
+
+  /* Free rp */
+  extend_info_free(rp);
+
+  return status;
+}
+
+/** Free <b>job</b> and everything it holds. */
+static void
+rend_intro_job_free(rend_intro_job_t *job)
+{
+  if (!job)
+    return;
+  crypto_pk_free(job->intro_key);
+  rend_service_free_intro(job->parsed_req);
+  if (job->dh)
+    crypto_dh_free(job->dh);
+  tor_free(job->err_msg);
+  memwipe(job, 0, sizeof(*job));
+  tor_free(job);
+}
+
+/** Worker function: do the expensive part of a rend_intro_job_t. */
+static workqueue_reply_t
+rend_intro_job_threadfn(void *state_, void *work_)
+{
+  rend_intro_job_t *job = work_;
+  monotime_t started, finished;
+  (void) state_;
+  monotime_get(&started);
+  job->status = rend_service_intro_handshake(job->parsed_req, job->intro_key,
+                                             job->circ_id, &job->dh,
+                                             job->keys, &job->err_msg,
+                                             &job->stage_descr);
+  monotime_get(&finished);
+  job->cpu_usec = monotime_diff_usec(&started, &finished);
+  return WQ_RPL_REPLY;
+}
+
+/** Reply function: finish handling the INTRODUCE2 cell in a
+ * rend_intro_job_t, if its introduction circuit is still around. */
+static void
+rend_intro_job_replyfn(void *work_)
+{
+  rend_intro_job_t *job = work_;
+  origin_circuit_t *circuit = job->circ;
+  rend_service_t *service;
+  rend_intro_point_t *intro_point;
+  monotime_t started;
+
+  monotime_get(&started);
+  smartlist_remove(pending_intro_jobs, job);
+
+  if (!circuit) {
+    log_info(LD_REND, "Introduction circuit %u closed while we were "
+             "handling an INTRODUCE2 cell on it. Dropping cell.",
+             (unsigned)job->circ_id);
+    goto done;
+  }
+  tor_assert(circuit->n_pending_intro_jobs > 0);
+  --circuit->n_pending_intro_jobs;
+  if (circuit->base_.marked_for_close ||
+      circuit->base_.purpose != CIRCUIT_PURPOSE_S_INTRO)
+    goto done;
+
+  /* The service or the intro point may have gone away meanwhile. */
+  service =
+    rend_service_get_by_pk_digest(circuit->rend_data->rend_pk_digest);
+  if (!service)
+    goto done;
+  service->stats.cpu_usec += job->cpu_usec;
+  intro_point = find_intro_point(circuit);
+  if (!intro_point)
+    intro_point = find_expiring_intro_point(service, circuit);
+  if (!intro_point) {
+    ++service->stats.n_intros_dropped;
+    goto done;
+  }
+
+  if (job->status < 0) {
+    if (job->stage_descr && !job->err_msg)
+      tor_asprintf(&job->err_msg,
+                   "unknown %s error for INTRODUCE2", job->stage_descr);
+    log_warn(LD_REND, "%s on circ %u",
+             job->err_msg ? job->err_msg : "unknown error for INTRODUCE2",
+             (unsigned)circuit->base_.n_circ_id);
+    ++service->stats.n_intros_dropped;
+  } else if (rend_service_intro_finish(circuit, service, intro_point,
+                                       job->parsed_req, &job->received,
+                                       &job->dh, job->keys) < 0) {
+    ++service->stats.n_intros_dropped;
+  }
+  rend_service_note_cpu(service, &started);
+
+ done:
+  rend_intro_job_free(job);
+}
+
+/** Try to hand the decryption and DH handshake for the INTRODUCE2 cell
+ * <b>parsed_req</b>, which arrived on <b>circuit</b> at time
+ * <b>received</b>, to a cpuworker.  On
+ * success, take ownership of <b>parsed_req</b> and return 0; the cell will
+ * be finished from rend_intro_job_replyfn().  Otherwise return -1. */
+static int
+rend_service_queue_intro_job(origin_circuit_t *circuit,
+                             rend_intro_cell_t *parsed_req,
+                             const monotime_t *received)
+{
+  rend_intro_job_t *job;
+  char key_digest[DIGEST_LEN];
+
+  if (!pending_intro_jobs)
+    pending_intro_jobs = smartlist_new();
+  if (smartlist_len(pending_intro_jobs) >= MAX_PENDING_INTRO_JOBS)
+    return -1;
+
+  /* A cell for the wrong key fails at once; let the main thread say so,
+   * rather than have a worker call escaped() while describing it. */
+  if (crypto_pk_get_digest(circuit->intro_key, key_digest) < 0 ||
+      tor_memneq(key_digest, parsed_req->pk, DIGEST_LEN))
+    return -1;
+
+  job = tor_malloc_zero(sizeof(rend_intro_job_t));
+  job->circ = circuit;
+  job->circ_id = circuit->base_.n_circ_id;
+  job->intro_key = crypto_pk_copy_full(circuit->intro_key);
+  job->parsed_req = parsed_req;
+  job->received = *received;
+  if (!cpuworker_queue_work(WQ_PRI_HIGH, rend_intro_job_threadfn,
+                            rend_intro_job_replyfn, job)) {
+    job->parsed_req = NULL;
+    rend_intro_job_free(job);
+    return -1;
+  }
+  smartlist_add(pending_intro_jobs, job);
+  ++circuit->n_pending_intro_jobs;
+  return 0;
+}
+
+/** Called when <b>circ</b>, which has INTRODUCE2 cells waiting on the
+ * cpuworkers, is about to be freed: make sure that their replies don't
+ * touch it. */
+void
+rend_service_intro_circ_free(origin_circuit_t *circ)
+{
+  if (!pending_intro_jobs)
+    return;
+  SMARTLIST_FOREACH(pending_intro_jobs, rend_intro_job_t *, job,
+                    if (job->circ == circ) job->circ = NULL);
+  circ->n_pending_intro_jobs = 0;
+}
+
 /** Respond to an INTRODUCE2 cell by launching a circuit to the chosen
  * rendezvous point.
+ *
+ * We check the cell against the replay cache for its intro point here;
+ * if we can, we then leave decryption and the DH handshake to a
+ * cpuworker, and finish once it is done.  Return 0 if the cell is still
+ * being processed, or was processed successfully; return -1 otherwise.
  */
 int
 rend_service_receive_introduction(origin_circuit_t *circuit,
@@ -1635,7 +2443,6 @@ rend_service_receive_introduction(origin_circuit_t *circuit,
   char *err_msg = NULL;
   int err_msg_severity = LOG_WARN;
   const char *stage_descr = NULL;
-  int reason = END_CIRC_REASON_TORPROTOCOL;
   /* Service/circuit/key stuff we can learn before parsing */
   char serviceid[REND_SERVICE_ID_LEN_BASE32+1];
   rend_service_t *service = NULL;
@@ -1643,20 +2450,13 @@ rend_service_receive_introduction(origin_circuit_t *circuit,
   crypto_pk_t *intro_key = NULL;
   /* Parsed cell */
   rend_intro_cell_t *parsed_req = NULL;
-  /* Rendezvous point */
-  extend_info_t *rp = NULL;
-  /* XXX not handled yet */
-  char buf[RELAY_PAYLOAD_SIZE];
   char keys[DIGEST_LEN+CPATH_KEY_MATERIAL_LEN]; /* Holds KH, Df, Db, Kf, Kb */
-  int i;
   crypto_dh_t *dh = NULL;
-  origin_circuit_t *launched = NULL;
-  crypt_path_t *cpath = NULL;
-  char hexcookie[9];
-  int circ_needs_uptime;
-  time_t now = time(NULL);
   time_t elapsed;
   int replay;
+  monotime_t received;
+
+  monotime_get(&received);
 
   /* Do some initial validation and logging before we parse the cell */
   if (circuit->base_.purpose != CIRCUIT_PURPOSE_S_INTRO) {
@@ -1683,6 +2483,7 @@ rend_service_receive_introduction(origin_circuit_t *circuit,
              escaped(serviceid));
     goto err;
   }
+  ++service->stats.n_intros_received;
 
   intro_point = find_intro_point(circuit);
   if (intro_point == NULL) {
@@ -1700,222 +2501,78 @@ rend_service_receive_introduction(origin_circuit_t *circuit,
   log_info(LD_REND, "Received INTRODUCE2 cell for service %s on circ %u.",
            escaped(serviceid), (unsigned)circuit->base_.n_circ_id);
 
-  /* use intro key instead of service key. */
-  intro_key = circuit->intro_key;
-
-  tor_free(err_msg);
-  stage_descr = NULL;
-
-  stage_descr = "early parsing";
-  /* Early parsing pass (get pk, ciphertext); type 2 is INTRODUCE2 */
-  parsed_req =
-    rend_service_begin_parse_intro(request, request_len, 2, &err_msg);
-  if (!parsed_req) {
-    goto log_error;
-  } else if (err_msg) {
-    log_info(LD_REND, "%s on circ %u.", err_msg,
-             (unsigned)circuit->base_.n_circ_id);
-    tor_free(err_msg);
-  }
-
-  /* make sure service replay caches are present */
-  if (!service->accepted_intro_dh_parts) {
-    service->accepted_intro_dh_parts =
-      replaycache_new(REND_REPLAY_TIME_INTERVAL,
-                      REND_REPLAY_TIME_INTERVAL);
-  }
-
-  if (!intro_point->accepted_intro_rsa_parts) {
-    intro_point->accepted_intro_rsa_parts = replaycache_new(0, 0);
-  }
-
-  /* check for replay of PK-encrypted portion. */
-  replay = replaycache_add_test_and_elapsed(
-    intro_point->accepted_intro_rsa_parts,
-    parsed_req->ciphertext, parsed_req->ciphertext_len,
-    &elapsed);
-
-  if (replay) {
-    log_warn(LD_REND,
-             "Possible replay detected! We received an "
-             "INTRODUCE2 cell with same PK-encrypted part %d "
-             "seconds ago.  Dropping cell.",
-             (int)elapsed);
-    goto err;
-  }
-
-  stage_descr = "decryption";
-  /* Now try to decrypt it */
-  result = rend_service_decrypt_intro(parsed_req, intro_key, &err_msg);
-  if (result < 0) {
-    goto log_error;
-  } else if (err_msg) {
-    log_info(LD_REND, "%s on circ %u.", err_msg,
-             (unsigned)circuit->base_.n_circ_id);
-    tor_free(err_msg);
-  }
-
-  stage_descr = "late parsing";
-  /* Parse the plaintext */
-  result = rend_service_parse_intro_plaintext(parsed_req, &err_msg);
-  if (result < 0) {
-    goto log_error;
-  } else if (err_msg) {
-    log_info(LD_REND, "%s on circ %u.", err_msg,
-             (unsigned)circuit->base_.n_circ_id);
-    tor_free(err_msg);
-  }
+  /* use intro key instead of service key. */
+  intro_key = circuit->intro_key;
 
-  stage_descr = "late validation";
-  /* Validate the parsed plaintext parts */
-  result = rend_service_validate_intro_late(parsed_req, &err_msg);
-  if (result < 0) {
+  tor_free(err_msg);
+  stage_descr = NULL;
+
+  stage_descr = "early parsing";
+  /* Early parsing pass (get pk, ciphertext); type 2 is INTRODUCE2 */
+  parsed_req =
+    rend_service_begin_parse_intro(request, request_len, 2, &err_msg);
+  if (!parsed_req) {
     goto log_error;
   } else if (err_msg) {
     log_info(LD_REND, "%s on circ %u.", err_msg,
              (unsigned)circuit->base_.n_circ_id);
     tor_free(err_msg);
   }
-  stage_descr = NULL;
-
-  /* Increment INTRODUCE2 counter */
-  ++(intro_point->accepted_introduce2_count);
 
-  /* Find the rendezvous point */
-  rp = find_rp_for_intro(parsed_req, &err_msg);
-  if (!rp) {
-    err_msg_severity = LOG_PROTOCOL_WARN;
-    goto log_error;
+  /* make sure service replay caches are present */
+  if (!service->accepted_intro_dh_parts) {
+    if (options->HiddenServiceReplayFilter)
+      service->accepted_intro_dh_parts =
+        replaycache_new_filter(REND_REPLAY_TIME_INTERVAL,
+                               REND_REPLAY_FILTER_BUCKET_SIZE,
+                               REND_REPLAY_FILTER_FP_RATE);
+    else
+      service->accepted_intro_dh_parts =
+        replaycache_new(REND_REPLAY_TIME_INTERVAL,
+                        REND_REPLAY_TIME_INTERVAL);
   }
 
-  /* Check if we'd refuse to talk to this router */
-  if (options->StrictNodes &&
-      routerset_contains_extendinfo(options->ExcludeNodes, rp)) {
-    log_warn(LD_REND, "Client asked to rendezvous at a relay that we "
-             "exclude, and StrictNodes is set. Refusing service.");
-    reason = END_CIRC_REASON_INTERNAL; /* XXX might leak why we refused */
-    goto err;
+  if (!intro_point->accepted_intro_rsa_parts) {
+    /* An intro point expires after a bounded number of introductions, so
+     * one never-expiring filter of that size will do. */
+    if (options->HiddenServiceReplayFilter)
+      intro_point->accepted_intro_rsa_parts =
+        replaycache_new_filter(0, INTRO_POINT_MAX_LIFETIME_INTRODUCTIONS,
+                               REND_REPLAY_FILTER_FP_RATE);
+    else
+      intro_point->accepted_intro_rsa_parts = replaycache_new(0, 0);
   }
 
-  base16_encode(hexcookie, 9, (const char *)(parsed_req->rc), 4);
-
-  /* Check whether there is a past request with the same Diffie-Hellman,
-   * part 1. */
+  /* check for replay of PK-encrypted portion. */
   replay = replaycache_add_test_and_elapsed(
-      service->accepted_intro_dh_parts,
-      parsed_req->dh, DH_KEY_LEN,
-      &elapsed);
+    intro_point->accepted_intro_rsa_parts,
+    parsed_req->ciphertext, parsed_req->ciphertext_len,
+    &elapsed);
 
   if (replay) {
-    /* A Tor client will send a new INTRODUCE1 cell with the same rend
-     * cookie and DH public key as its previous one if its intro circ
-     * times out while in state CIRCUIT_PURPOSE_C_INTRODUCE_ACK_WAIT .
-     * If we received the first INTRODUCE1 cell (the intro-point relay
-     * converts it into an INTRODUCE2 cell), we are already trying to
-     * connect to that rend point (and may have already succeeded);
-     * drop this cell. */
-    log_info(LD_REND, "We received an "
-             "INTRODUCE2 cell with same first part of "
-             "Diffie-Hellman handshake %d seconds ago. Dropping "
-             "cell.",
-             (int) elapsed);
-    goto err;
-  }
-
-  /* If the service performs client authorization, check included auth data. */
-  if (service->clients) {
-    if (parsed_req->version == 3 && parsed_req->u.v3.auth_len > 0) {
-      if (rend_check_authorization(service,
-                                   (const char*)parsed_req->u.v3.auth_data,
-                                   parsed_req->u.v3.auth_len)) {
-        log_info(LD_REND, "Authorization data in INTRODUCE2 cell are valid.");
-      } else {
-        log_info(LD_REND, "The authorization data that are contained in "
-                 "the INTRODUCE2 cell are invalid. Dropping cell.");
-        reason = END_CIRC_REASON_CONNECTFAILED;
-        goto err;
-      }
-    } else {
-      log_info(LD_REND, "INTRODUCE2 cell does not contain authentication "
-               "data, but we require client authorization. Dropping cell.");
-      reason = END_CIRC_REASON_CONNECTFAILED;
-      goto err;
-    }
-  }
-
-  /* Try DH handshake... */
-  dh = crypto_dh_new(DH_TYPE_REND);
-  if (!dh || crypto_dh_generate_public(dh)<0) {
-    log_warn(LD_BUG,"Internal error: couldn't build DH state "
-             "or generate public key.");
-    reason = END_CIRC_REASON_INTERNAL;
-    goto err;
-  }
-  if (crypto_dh_compute_secret(LOG_PROTOCOL_WARN, dh,
-                               (char *)(parsed_req->dh),
-                               DH_KEY_LEN, keys,
-                               DIGEST_LEN+CPATH_KEY_MATERIAL_LEN)<0) {
-    log_warn(LD_BUG, "Internal error: couldn't complete DH handshake");
-    reason = END_CIRC_REASON_INTERNAL;
+    log_warn(LD_REND,
+             "Possible replay detected! We received an "
+             "INTRODUCE2 cell with same PK-encrypted part %d "
+             "seconds ago.  Dropping cell.",
+             (int)elapsed);
     goto err;
   }
 
-  circ_needs_uptime = rend_service_requires_uptime(service);
-
-  /* help predict this next time */
-  rep_hist_note_used_internal(now, circ_needs_uptime, 1);
-
-  /* Launch a circuit to the client's chosen rendezvous point.
-   */
-  for (i=0;i<MAX_REND_FAILURES;i++) {
-    int flags = CIRCLAUNCH_NEED_CAPACITY | CIRCLAUNCH_IS_INTERNAL;
-    if (circ_needs_uptime) flags |= CIRCLAUNCH_NEED_UPTIME;
-    /* A Single Onion Service only uses a direct connection if its
-     * firewall rules permit direct connections to the address. */
-    if (rend_service_use_direct_connection(options, rp)) {
-      flags = flags | CIRCLAUNCH_ONEHOP_TUNNEL;
-    }
-    launched = circuit_launch_by_extend_info(
-                        CIRCUIT_PURPOSE_S_CONNECT_REND, rp, flags);
-
-    if (launched)
-      break;
-  }
-  if (!launched) { /* give up */
-    log_warn(LD_REND, "Giving up launching first hop of circuit to rendezvous "
-             "point %s for service %s.",
-             safe_str_client(extend_info_describe(rp)),
-             serviceid);
-    reason = END_CIRC_REASON_CONNECTFAILED;
-    goto err;
+  /* Leave the public-key work to a cpuworker if we can. */
+  if (rend_service_queue_intro_job(circuit, parsed_req, &received) == 0) {
+    parsed_req = NULL;
+    goto done;
   }
-  log_info(LD_REND,
-           "Accepted intro; launching circuit to %s "
-           "(cookie %s) for service %s.",
-           safe_str_client(extend_info_describe(rp)),
-           hexcookie, serviceid);
-  tor_assert(launched->build_state);
-  /* Fill in the circuit's state. */
-
-  launched->rend_data =
-    rend_data_service_create(service->service_id,
-                             circuit->rend_data->rend_pk_digest,
-                             parsed_req->rc, service->auth_type);
-
-  launched->build_state->service_pending_final_cpath_ref =
-    tor_malloc_zero(sizeof(crypt_path_reference_t));
-  launched->build_state->service_pending_final_cpath_ref->refcount = 1;
 
-  launched->build_state->service_pending_final_cpath_ref->cpath = cpath =
-    tor_malloc_zero(sizeof(crypt_path_t));
-  cpath->magic = CRYPT_PATH_MAGIC;
-  launched->build_state->expiry_time = now + MAX_REND_TIMEOUT;
+  result = rend_service_intro_handshake(parsed_req, intro_key,
+                                        circuit->base_.n_circ_id,
+                                        &dh, keys, &err_msg, &stage_descr);
+  if (result < 0)
+    goto log_error;
 
-  cpath->rend_dh_handshake_state = dh;
-  dh = NULL;
-  if (circuit_init_cpath_crypto(cpath,keys+DIGEST_LEN,1)<0)
+  if (rend_service_intro_finish(circuit, service, intro_point, parsed_req,
+                                &received, &dh, keys) < 0)
     goto err;
-  memcpy(cpath->rend_circ_nonce, keys, DIGEST_LEN);
 
   goto done;
 
@@ -1933,24 +2590,20 @@ rend_service_receive_introduction(origin_circuit_t *circuit,
            (unsigned)circuit->base_.n_circ_id);
  err:
   status = -1;
-  if (dh) crypto_dh_free(dh);
-  if (launched) {
-    circuit_mark_for_close(TO_CIRCUIT(launched), reason);
-  }
   tor_free(err_msg);
+  if (service)
+    ++service->stats.n_intros_dropped;
 
  done:
+  if (service)
+    rend_service_note_cpu(service, &received);
+  if (dh) crypto_dh_free(dh);
   memwipe(keys, 0, sizeof(keys));
-  memwipe(buf, 0, sizeof(buf));
   memwipe(serviceid, 0, sizeof(serviceid));
-  memwipe(hexcookie, 0, sizeof(hexcookie));
 
   /* Free the parsed cell */
   rend_service_free_intro(parsed_req);
 
-  /* Free rp */
-  extend_info_free(rp);
-
   return status;
 }
 
@@ -2797,6 +3450,7 @@ rend_service_relaunch_rendezvous(origin_circuit_t *oldcirc)
    * using a direct connection. But if it's blocked by a firewall, or the
    * service is IPv6-only, or the rend point avoiding becoming a one-hop
    * proxy, we need a 3-hop connection. */
+  rend_service_note_circ_launched(time(NULL));
   newcirc = circuit_launch_by_extend_info(CIRCUIT_PURPOSE_S_CONNECT_REND,
                             oldstate->chosen_exit,
                             CIRCLAUNCH_NEED_CAPACITY|CIRCLAUNCH_IS_INTERNAL);
@@ -2810,6 +3464,7 @@ rend_service_relaunch_rendezvous(origin_circuit_t *oldcirc)
   tor_assert(newstate);
   newstate->failure_count = oldstate->failure_count+1;
   newstate->expiry_time = oldstate->expiry_time;
+  newstate->service_intro_received = oldstate->service_intro_received;
   newstate->service_pending_final_cpath_ref =
     oldstate->service_pending_final_cpath_ref;
   ++(newstate->service_pending_final_cpath_ref->refcount);
@@ -2874,6 +3529,7 @@ rend_service_launch_establish_intro(rend_service_t *service,
            service->service_id);
 
   rep_hist_note_used_internal(time(NULL), 1, 0);
+  rend_service_note_circ_launched(time(NULL));
 
   ++service->n_intro_circuits_launched;
   launched = circuit_launch_by_extend_info(CIRCUIT_PURPOSE_S_ESTABLISH_INTRO,
@@ -2955,6 +3611,7 @@ rend_service_intro_has_opened(origin_circuit_t *circuit)
   char auth[DIGEST_LEN + 9];
   char serviceid[REND_SERVICE_ID_LEN_BASE32+1];
   int reason = END_CIRC_REASON_TORPROTOCOL;
+  monotime_t started;
 
   tor_assert(circuit->base_.purpose == CIRCUIT_PURPOSE_S_ESTABLISH_INTRO);
   assert_circ_anonymity_ok(circuit, get_options());
@@ -3045,8 +3702,10 @@ rend_service_intro_has_opened(origin_circuit_t *circuit)
     goto err;
   len += 20;
   note_crypto_pk_op(REND_SERVER);
+  monotime_get(&started);
   r = crypto_pk_private_sign_digest(intro_key, buf+len, sizeof(buf)-len,
                                     buf, len);
+  rend_service_note_cpu(service, &started);
   if (r<0) {
     log_warn(LD_BUG, "Internal error: couldn't sign introduction request.");
     reason = END_CIRC_REASON_INTERNAL;
@@ -3144,12 +3803,15 @@ rend_service_intro_established(origin_circuit_t *circuit,
 void
 rend_service_rendezvous_has_opened(origin_circuit_t *circuit)
 {
-  rend_service_t *service;
+  rend_service_t *service = NULL;
   char buf[RELAY_PAYLOAD_SIZE];
   crypt_path_t *hop;
   char serviceid[REND_SERVICE_ID_LEN_BASE32+1];
   char hexcookie[9];
   int reason;
+  monotime_t started, now;
+
+  monotime_get(&started);
 
   tor_assert(circuit->base_.purpose == CIRCUIT_PURPOSE_S_CONNECT_REND);
   tor_assert(circuit->cpath);
@@ -3239,16 +3901,25 @@ rend_service_rendezvous_has_opened(origin_circuit_t *circuit)
   hop->deliver_window = CIRCWINDOW_START;
 
   onion_append_to_cpath(&circuit->cpath, hop);
+  circuit_clear_path_for_controller(circuit);
   circuit->build_state->pending_final_cpath = NULL; /* prevent double-free */
 
   /* Change the circuit purpose. */
   circuit_change_purpose(TO_CIRCUIT(circuit), CIRCUIT_PURPOSE_S_REND_JOINED);
 
+  ++service->stats.n_rend_joined;
+  monotime_get(&now);
+  rend_service_note_rend_latency(service,
+      monotime_diff_msec(&circuit->build_state->service_intro_received,
+                         &now));
+
   goto done;
 
  err:
   circuit_mark_for_close(TO_CIRCUIT(circuit), reason);
  done:
+  if (service)
+    rend_service_note_cpu(service, &started);
   memwipe(buf, 0, sizeof(buf));
   memwipe(serviceid, 0, sizeof(serviceid));
   memwipe(hexcookie, 0, sizeof(hexcookie));
@@ -3453,123 +4124,281 @@ directory_post_to_hs_dir(rend_service_descriptor_t *renddesc,
   smartlist_free(successful_uploads);
 }
 
-/** Encode and sign an up-to-date service descriptor for <b>service</b>,
- * and upload it/them to the responsible hidden service directories.
- */
+/** Most descriptor uploads we will have waiting on the cpuworkers at
+ * once. Past this, we encode descriptors on the main thread. */
+#define MAX_PENDING_UPLOAD_JOBS 32
+
+/** List of rend_upload_job_t that are queued or running on a cpuworker. */
+static smartlist_t *pending_upload_jobs = NULL;
+
+/** Free <b>batch</b> and the descriptors it holds. */
 static void
-upload_service_descriptor(rend_service_t *service)
+rend_upload_batch_free(rend_upload_batch_t *batch)
 {
-  time_t now = time(NULL);
-  int rendpostperiod;
-  char serviceid[REND_SERVICE_ID_LEN_BASE32+1];
-  int uploaded = 0;
+  if (!batch)
+    return;
+  SMARTLIST_FOREACH(batch->descs, rend_encoded_v2_service_descriptor_t *, d,
+                    rend_encoded_v2_service_descriptor_free(d));
+  smartlist_free(batch->descs);
+  tor_free(batch);
+}
 
-  rendpostperiod = get_options()->RendPostPeriod;
+/** Free <b>job</b> and everything it holds. */
+STATIC void
+rend_upload_job_free(rend_upload_job_t *job)
+{
+  if (!job)
+    return;
+  rend_service_descriptor_free(job->desc);
+  SMARTLIST_FOREACH(job->client_cookies, char *, c,
+                    memwipe(c, 0, REND_DESC_COOKIE_LEN); tor_free(c));
+  smartlist_free(job->client_cookies);
+  SMARTLIST_FOREACH(job->client_keys, crypto_pk_t *, k, crypto_pk_free(k));
+  smartlist_free(job->client_keys);
+  SMARTLIST_FOREACH(job->batches, rend_upload_batch_t *, b,
+                    rend_upload_batch_free(b));
+  smartlist_free(job->batches);
+  tor_free(job);
+}
 
-  networkstatus_t *c = networkstatus_get_latest_consensus();
-  if (c && smartlist_len(c->routerstatus_list) > 0) {
-    int seconds_valid, i, j, num_descs;
-    smartlist_t *descs = smartlist_new();
-    smartlist_t *client_cookies = smartlist_new();
-    /* Either upload a single descriptor (including replicas) or one
-     * descriptor for each authorized client in case of authorization
-     * type 'stealth'. */
-    num_descs = service->auth_type == REND_STEALTH_AUTH ?
-                    smartlist_len(service->clients) : 1;
-    for (j = 0; j < num_descs; j++) {
-      crypto_pk_t *client_key = NULL;
-      rend_authorized_client_t *client = NULL;
-      smartlist_clear(client_cookies);
-      switch (service->auth_type) {
-        case REND_NO_AUTH:
-          /* Do nothing here. */
-          break;
-        case REND_BASIC_AUTH:
-          SMARTLIST_FOREACH(service->clients, rend_authorized_client_t *,
-              cl, smartlist_add(client_cookies, cl->descriptor_cookie));
-          break;
-        case REND_STEALTH_AUTH:
-          client = smartlist_get(service->clients, j);
-          client_key = client->client_key;
-          smartlist_add(client_cookies, client->descriptor_cookie);
-          break;
-      }
-      /* Encode the current descriptor. */
-      seconds_valid = rend_encode_v2_descriptors(descs, service->desc,
-                                                 now, 0,
-                                                 service->auth_type,
-                                                 client_key,
-                                                 client_cookies);
-      if (seconds_valid < 0) {
+/** Return a new rend_upload_job_t for encoding the descriptor of
+ * <b>service</b> at <b>now</b>. Every key in it is a full copy, so that
+ * a worker can use it while the main thread carries on with the
+ * originals. */
+STATIC rend_upload_job_t *
+rend_upload_job_new(rend_service_t *service, time_t now)
+{
+  rend_upload_job_t *job = tor_malloc_zero(sizeof(rend_upload_job_t));
+  rend_service_descriptor_t *d;
+
+  job->service = service;
+  job->now = now;
+  job->auth_type = service->auth_type;
+  job->client_cookies = smartlist_new();
+  job->client_keys = smartlist_new();
+  job->batches = smartlist_new();
+
+  d = job->desc = tor_malloc_zero(sizeof(rend_service_descriptor_t));
+  d->pk = crypto_pk_copy_full(service->desc->pk);
+  d->timestamp = service->desc->timestamp;
+  d->protocols = service->desc->protocols;
+  d->intro_nodes = smartlist_new();
+  SMARTLIST_FOREACH_BEGIN(service->desc->intro_nodes,
+                          const rend_intro_point_t *, intro) {
+    rend_intro_point_t *copy = tor_malloc_zero(sizeof(rend_intro_point_t));
+    copy->extend_info = extend_info_dup(intro->extend_info);
+    if (copy->extend_info->onion_key) {
+      crypto_pk_t *onion_key = copy->extend_info->onion_key;
+      copy->extend_info->onion_key = crypto_pk_copy_full(onion_key);
+      crypto_pk_free(onion_key);
+    }
+    if (intro->intro_key)
+      copy->intro_key = crypto_pk_copy_full(intro->intro_key);
+    smartlist_add(d->intro_nodes, copy);
+  } SMARTLIST_FOREACH_END(intro);
+
+  if (service->auth_type != REND_NO_AUTH) {
+    SMARTLIST_FOREACH_BEGIN(service->clients,
+                            const rend_authorized_client_t *, client) {
+      smartlist_add(job->client_cookies,
+                    tor_memdup(client->descriptor_cookie,
+                               REND_DESC_COOKIE_LEN));
+      if (service->auth_type == REND_STEALTH_AUTH)
+        smartlist_add(job->client_keys,
+                      crypto_pk_copy_full(client->client_key));
+    } SMARTLIST_FOREACH_END(client);
+  }
+  return job;
+}
+
+/** Encode and sign every descriptor that <b>job</b> calls for: one set of
+ * replicas, or with stealth authorization one per client, for the current
+ * time period and, near its end, the next one. Return 0 on success, -1 on
+ * failure.
+ *
+ * This touches no global state, so that it can run on a cpuworker. */
+STATIC int
+rend_upload_job_encode(rend_upload_job_t *job)
+{
+  smartlist_t *client_cookies = smartlist_new();
+  int j, num_descs, r = -1;
+  uint8_t period;
+
+  /* Either encode a single descriptor (including replicas) or one
+   * descriptor for each authorized client in case of authorization
+   * type 'stealth'. */
+  num_descs = job->auth_type == REND_STEALTH_AUTH ?
+                  smartlist_len(job->client_keys) : 1;
+  for (j = 0; j < num_descs; j++) {
+    crypto_pk_t *client_key = NULL;
+    smartlist_clear(client_cookies);
+    switch (job->auth_type) {
+      case REND_NO_AUTH:
+        /* Do nothing here. */
+        break;
+      case REND_BASIC_AUTH:
+        smartlist_add_all(client_cookies, job->client_cookies);
+        break;
+      case REND_STEALTH_AUTH:
+        client_key = smartlist_get(job->client_keys, j);
+        smartlist_add(client_cookies, smartlist_get(job->client_cookies, j));
+        break;
+    }
+    for (period = 0; period < 2; period++) {
+      rend_upload_batch_t *batch = tor_malloc_zero(sizeof(*batch));
+      batch->descs = smartlist_new();
+      batch->period = period;
+      smartlist_add(job->batches, batch);
+      batch->seconds_valid =
+        rend_encode_v2_descriptors_threadsafe(batch->descs, job->desc,
+                                              job->now, period,
+                                              job->auth_type, client_key,
+                                              client_cookies);
+      if (batch->seconds_valid < 0 ||
+          rend_get_service_id(client_key ? client_key : job->desc->pk,
+                              batch->service_id) < 0) {
         log_warn(LD_BUG, "Internal error: couldn't encode service "
                  "descriptor; not uploading.");
-        smartlist_free(descs);
-        smartlist_free(client_cookies);
-        return;
-      }
-      rend_get_service_id(service->desc->pk, serviceid);
-      if (get_options()->PublishHidServDescriptors) {
-        /* Post the current descriptors to the hidden service directories. */
-        log_info(LD_REND, "Launching upload for hidden service %s",
-                     serviceid);
-        directory_post_to_hs_dir(service->desc, descs, NULL, serviceid,
-                                 seconds_valid);
-      }
-      /* Free memory for descriptors. */
-      for (i = 0; i < smartlist_len(descs); i++)
-        rend_encoded_v2_service_descriptor_free(smartlist_get(descs, i));
-      smartlist_clear(descs);
-      /* Update next upload time. */
-      if (seconds_valid - REND_TIME_PERIOD_OVERLAPPING_V2_DESCS
-          > rendpostperiod)
-        service->next_upload_time = now + rendpostperiod;
-      else if (seconds_valid < REND_TIME_PERIOD_OVERLAPPING_V2_DESCS)
-        service->next_upload_time = now + seconds_valid + 1;
-      else
-        service->next_upload_time = now + seconds_valid -
-            REND_TIME_PERIOD_OVERLAPPING_V2_DESCS + 1;
-      /* Post also the next descriptors, if necessary. */
-      if (seconds_valid < REND_TIME_PERIOD_OVERLAPPING_V2_DESCS) {
-        seconds_valid = rend_encode_v2_descriptors(descs, service->desc,
-                                                   now, 1,
-                                                   service->auth_type,
-                                                   client_key,
-                                                   client_cookies);
-        if (seconds_valid < 0) {
-          log_warn(LD_BUG, "Internal error: couldn't encode service "
-                   "descriptor; not uploading.");
-          smartlist_free(descs);
-          smartlist_free(client_cookies);
-          return;
-        }
-        if (get_options()->PublishHidServDescriptors) {
-          directory_post_to_hs_dir(service->desc, descs, NULL, serviceid,
-                                   seconds_valid);
-        }
-        /* Free memory for descriptors. */
-        for (i = 0; i < smartlist_len(descs); i++)
-          rend_encoded_v2_service_descriptor_free(smartlist_get(descs, i));
-        smartlist_clear(descs);
+        goto done;
       }
+      /* Encode the next descriptors too, if necessary. */
+      if (batch->seconds_valid >= REND_TIME_PERIOD_OVERLAPPING_V2_DESCS)
+        break;
     }
-    smartlist_free(descs);
-    smartlist_free(client_cookies);
-    uploaded = 1;
+  }
+  r = 0;
+ done:
+  smartlist_free(client_cookies);
+  job->status = r;
+  return r;
+}
+
+/** Post the descriptors that <b>job</b> encoded for <b>service</b> to the
+ * responsible hidden service directories, and schedule the service's next
+ * upload. */
+static void
+rend_upload_job_finish(rend_service_t *service, rend_upload_job_t *job)
+{
+  const int rendpostperiod = get_options()->RendPostPeriod;
+  const time_t now = job->now;
+
+  if (job->status < 0)
+    return;
+
+  SMARTLIST_FOREACH_BEGIN(job->batches, rend_upload_batch_t *, batch) {
+    const int seconds_valid = batch->seconds_valid;
+    rend_note_encoded_v2_descriptors(batch->descs, 0, batch->service_id);
     if (get_options()->PublishHidServDescriptors) {
-      log_info(LD_REND, "Successfully uploaded v2 rend descriptors!");
-    } else {
-      log_info(LD_REND, "Successfully stored created v2 rend descriptors!");
+      /* Post the descriptors to the hidden service directories. */
+      if (batch->period == 0)
+        log_info(LD_REND, "Launching upload for hidden service %s",
+                 service->service_id);
+      directory_post_to_hs_dir(service->desc, batch->descs, NULL,
+                               service->service_id, seconds_valid);
     }
+    if (batch->period != 0)
+      continue;
+    /* Update next upload time. */
+    if (seconds_valid - REND_TIME_PERIOD_OVERLAPPING_V2_DESCS
+        > rendpostperiod)
+      service->next_upload_time = now + rendpostperiod;
+    else if (seconds_valid < REND_TIME_PERIOD_OVERLAPPING_V2_DESCS)
+      service->next_upload_time = now + seconds_valid + 1;
+    else
+      service->next_upload_time = now + seconds_valid -
+          REND_TIME_PERIOD_OVERLAPPING_V2_DESCS + 1;
+  } SMARTLIST_FOREACH_END(batch);
+
+  if (get_options()->PublishHidServDescriptors) {
+    log_info(LD_REND, "Successfully uploaded v2 rend descriptors!");
+  } else {
+    log_info(LD_REND, "Successfully stored created v2 rend descriptors!");
   }
 
-  /* If not uploaded, try again in one minute. */
-  if (!uploaded)
-    service->next_upload_time = now + 60;
-
   /* Unmark dirty flag of this service. */
   service->desc_is_dirty = 0;
 }
 
+/** Worker function: encode and sign the descriptors of a
+ * rend_upload_job_t. */
+static workqueue_reply_t
+rend_upload_job_threadfn(void *state_, void *work_)
+{
+  rend_upload_job_t *job = work_;
+  (void) state_;
+  rend_upload_job_encode(job);
+  return WQ_RPL_REPLY;
+}
+
+/** Reply function: upload the descriptors of a rend_upload_job_t, if its
+ * service is still around. */
+static void
+rend_upload_job_replyfn(void *work_)
+{
+  rend_upload_job_t *job = work_;
+  rend_service_t *service = job->service;
+
+  smartlist_remove(pending_upload_jobs, job);
+  if (service) {
+    service->upload_job_pending = 0;
+    rend_upload_job_finish(service, job);
+  }
+  rend_upload_job_free(job);
+}
+
+/** Called when <b>service</b>, which may have a descriptor being encoded on
+ * the cpuworkers, is about to be freed: make sure that the reply doesn't
+ * touch it. */
+static void
+rend_service_forget_upload_jobs(rend_service_t *service)
+{
+  if (!pending_upload_jobs)
+    return;
+  SMARTLIST_FOREACH(pending_upload_jobs, rend_upload_job_t *, job,
+                    if (job->service == service) job->service = NULL);
+}
+
+/** Encode and sign an up-to-date service descriptor for <b>service</b>,
+ * and upload it/them to the responsible hidden service directories.
+ *
+ * If we can, we leave the encoding and signing to a cpuworker, and upload
+ * once it is done; until then, the service's descriptor stays as it is.
+ */
+static void
+upload_service_descriptor(rend_service_t *service)
+{
+  time_t now = time(NULL);
+  rend_upload_job_t *job;
+
+  if (service->upload_job_pending)
+    return;
+
+  networkstatus_t *c = networkstatus_get_latest_consensus();
+  if (!c || smartlist_len(c->routerstatus_list) == 0) {
+    /* If not uploaded, try again in one minute. */
+    service->next_upload_time = now + 60;
+    /* Unmark dirty flag of this service. */
+    service->desc_is_dirty = 0;
+    return;
+  }
+
+  job = rend_upload_job_new(service, now);
+  if (!pending_upload_jobs)
+    pending_upload_jobs = smartlist_new();
+  if (smartlist_len(pending_upload_jobs) < MAX_PENDING_UPLOAD_JOBS &&
+      cpuworker_queue_work(WQ_PRI_LOW, rend_upload_job_threadfn,
+                           rend_upload_job_replyfn, job)) {
+    smartlist_add(pending_upload_jobs, job);
+    service->upload_job_pending = 1;
+    return;
+  }
+
+  /* No cpuworker to take it; do it all here. */
+  rend_upload_job_encode(job);
+  rend_upload_job_finish(service, job);
+  rend_upload_job_free(job);
+}
+
 /** Return the number of INTRODUCE2 cells this hidden service has received
  * from this intro point. */
 static int
@@ -3905,6 +4734,11 @@ rend_consider_services_intro_points(void)
 #define MIN_REND_INITIAL_POST_DELAY (30)
 #define MIN_REND_INITIAL_POST_DELAY_TESTING (5)
 
+/** Most services whose descriptors we start uploading in one call to
+ * rend_consider_services_upload(), so that a host with many services
+ * spreads its uploads over several seconds. */
+#define MAX_REND_UPLOADS_PER_CALL 8
+
 /** Regenerate and upload rendezvous service descriptors for all
  * services, if necessary. If the descriptor has been dirty enough
  * for long enough, definitely upload; else only upload when the
@@ -3916,7 +4750,7 @@ rend_consider_services_intro_points(void)
 void
 rend_consider_services_upload(time_t now)
 {
-  int i;
+  int i, n_uploads = 0;
   rend_service_t *service;
   const or_options_t *options = get_options();
   int rendpostperiod = options->RendPostPeriod;
@@ -3938,6 +4772,9 @@ rend_consider_services_upload(time_t now)
         service->next_upload_time = now + rendinitialpostdelay;
       }
     }
+    /* Is this service's last upload still being encoded? */
+    if (service->upload_job_pending)
+      continue;
     /* Does every introduction points have been established? */
     unsigned int intro_points_ready =
       count_established_intro_points(service) >=
@@ -3948,7 +4785,10 @@ rend_consider_services_upload(time_t now)
          service->desc_is_dirty < now-rendinitialpostdelay))) {
       /* if it's time, or if the directory servers have a wrong service
        * descriptor and ours has been stable for rendinitialpostdelay seconds,
-       * upload a new one of each format. */
+       * upload a new one of each format.  Leave the rest for later if we
+       * have started enough uploads for now. */
+      if (n_uploads++ >= MAX_REND_UPLOADS_PER_CALL)
+        break;
       rend_service_update_descriptor(service);
       upload_service_descriptor(service);
     }
@@ -63,6 +63,30 @@ struct rend_intro_cell_s {
   uint8_t dh[DH_KEY_LEN];
 };
 
+/** How many buckets rend_service_stats_t.rend_latency has.  Bucket
+ * <b>i</b> counts rendezvous that took less than 250 * 2^<b>i</b> msec;
+ * the last one counts all the rest. */
+#define REND_SERVICE_N_LATENCY_BUCKETS 8
+
+/** Running totals of the work a single hidden service has made us do. */
+typedef struct rend_service_stats_t {
+  /** How many INTRODUCE2 cells have we received for this service? */
+  uint64_t n_intros_received;
+  /** How many of those did we drop, as replays or because they were
+   * malformed? */
+  uint64_t n_intros_dropped;
+  /** How many rendezvous circuits have we joined for this service? */
+  uint64_t n_rend_joined;
+  /** Histogram of the time from receiving an INTRODUCE2 cell to joining
+   * the rendezvous circuit it asked for. */
+  uint32_t rend_latency[REND_SERVICE_N_LATENCY_BUCKETS];
+  /** Bytes read from and written to the streams on the service's
+   * rendezvous circuits that have closed. */
+  uint64_t n_stream_bytes;
+  /** Microseconds spent on the public-key work for this service. */
+  uint64_t cpu_usec;
+} rend_service_stats_t;
+
 /** Represents a single hidden service running at this OP. */
 typedef struct rend_service_t {
   /* Fields specified in config file */
@@ -99,6 +123,11 @@ typedef struct rend_service_t {
                          * up-to-date. */
   time_t next_upload_time; /**< Scheduled next hidden service descriptor
                             * upload time. */
+  /** True iff a cpuworker is encoding this service's descriptor for
+   * upload. While it is, we leave <b>desc</b> alone. */
+  int upload_job_pending;
+  /** What this service has cost us so far. */
+  rend_service_stats_t stats;
   /** Replay cache for Diffie-Hellman values of INTRODUCE2 cells, to
    * detect repeats.  Clients may send INTRODUCE1 cells for the same
    * rendezvous point through two or more different introduction points;
@@ -117,12 +146,64 @@ typedef struct rend_service_t {
   int max_streams_close_circuit;
 } rend_service_t;
 
+/** One set of encoded descriptors produced by a rend_upload_job_t. */
+typedef struct rend_upload_batch_t {
+  /** List of rend_encoded_v2_service_descriptor_t. */
+  smartlist_t *descs;
+  /** How many seconds clients will find these descriptors for. */
+  int seconds_valid;
+  /** 0 for the current time period, 1 for the next one. */
+  uint8_t period;
+  /** Service ID that the descriptors were encoded under; with stealth
+   * authorization, this comes from the client key. */
+  char service_id[REND_SERVICE_ID_LEN_BASE32+1];
+} rend_upload_batch_t;
+
+/** A service descriptor whose encoding, encryption and signing we have
+ * handed to a cpuworker. The worker only touches the copies held here. */
+typedef struct rend_upload_job_t {
+  /** The service we are uploading for, or NULL if it has been freed
+   * since. */
+  rend_service_t *service;
+  /** A private copy of the service's descriptor. */
+  rend_service_descriptor_t *desc;
+  /** When we decided to upload. */
+  time_t now;
+  /** The service's client authorization type. */
+  rend_auth_type_t auth_type;
+  /** Copies of the descriptor cookies of the service's authorized
+   * clients, and for stealth authorization, of their keys. */
+  smartlist_t *client_cookies;
+  smartlist_t *client_keys;
+  /** Set by the worker: 0 on success, -1 on failure. */
+  int status;
+  /** Set by the worker: list of rend_upload_batch_t, in the order in which
+   * upload_service_descriptor() used to post them. */
+  smartlist_t *batches;
+} rend_upload_job_t;
+
 STATIC void rend_service_free(rend_service_t *service);
 STATIC char *rend_service_sos_poison_path(const rend_service_t *service);
+STATIC int rend_service_intro_handshake(rend_intro_cell_t *parsed_req,
+                                        crypto_pk_t *intro_key,
+                                        uint32_t circ_id,
+                                        crypto_dh_t **dh_out, char *keys_out,
+                                        char **err_msg_out,
+                                        const char **stage_out);
+STATIC rend_upload_job_t *rend_upload_job_new(rend_service_t *service,
+                                              time_t now);
+STATIC int rend_upload_job_encode(rend_upload_job_t *job);
+STATIC void rend_upload_job_free(rend_upload_job_t *job);
+STATIC void rend_service_note_circ_launched(time_t now);
+STATIC int rend_service_prebuilt_circs_for_rate(time_t now);
+STATIC void rend_service_note_rend_latency(rend_service_t *service,
+                                           int64_t msec);
 
 #endif
 
 int num_rend_services(void);
+struct rend_service_t *rend_service_get_by_service_id(const char *id);
+int rend_service_get_n_prebuilt_circs_wanted(time_t now);
 int rend_config_services(const or_options_t *options, int validate_only);
 int rend_service_load_all_keys(const smartlist_t *service_list);
 void rend_services_add_filenames_to_lists(smartlist_t *open_lst,
@@ -140,6 +221,10 @@ void rend_service_rendezvous_has_opened(origin_circuit_t *circuit);
 int rend_service_receive_introduction(origin_circuit_t *circuit,
                                       const uint8_t *request,
                                       size_t request_len);
+void rend_service_intro_circ_free(origin_circuit_t *circ);
+void rend_service_note_rend_circ_closed(origin_circuit_t *circ);
+char *rend_service_get_stats_string(void);
+char *rend_service_format_stats_heartbeat(void);
 int rend_service_decrypt_intro(rend_intro_cell_t *request,
                                crypto_pk_t *key,
                                char **err_msg_out);
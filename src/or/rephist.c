@@ -74,6 +74,7 @@
  * (The "rephist" name originally stood for "reputation and history". )
  **/
 
+#define REPHIST_PRIVATE
 #include "or.h"
 #include "circuitlist.h"
 #include "circuituse.h"
@@ -106,6 +107,11 @@ uint32_t rephist_total_num=0;
  * 20X as much as one that ended a month ago, and routers that have had no
  * uptime data for about half a year will get forgotten.) */
 
+/** Largest number of OR-\>OR link histories we remember for any one OR;
+ * this keeps the storage for each OR's history bounded no matter how many
+ * relays we extend to from it. */
+#define MAX_LINK_HISTORIES_PER_OR 64
+
 /** History of an OR-\>OR link. */
 typedef struct link_history_t {
   /** When did we start tracking this list? */
@@ -159,6 +165,19 @@ typedef struct or_history_t {
   time_t start_of_downtime;
   unsigned long weighted_uptime;
   unsigned long total_weighted_time;
+  /** The value of stability_downrate_epoch when we last discounted this
+   * OR's weighted_run_length, total_run_weights, weighted_uptime, and
+   * total_weighted_time. */
+  unsigned int downrate_epoch;
+
+  /* === For reachability latency tracking: */
+  /** How many reachability tests to this OR have completed? */
+  unsigned long n_reachability_tests_ok;
+  /** How long, in msec, did the most recent reachability test take? */
+  uint32_t last_reachability_latency_msec;
+  /** Exponentially weighted moving average of the time, in msec, that our
+   * reachability tests to this OR took to complete. */
+  double mean_reachability_latency_msec;
 
   /** Map from hex OR2 identity digest to a link_history_t for the link
    * from this OR to OR2. */
@@ -169,14 +188,43 @@ typedef struct or_history_t {
  * total_run_weights by STABILITY_ALPHA? */
 static time_t stability_last_downrated = 0;
 
+/** How many times have we discounted all old MTBF data by STABILITY_ALPHA?
+ * Rather than touching every or_history_t at each discount, we apply the
+ * discounts that an entry has missed the next time we look at it; see
+ * or_history_apply_downrate(). */
+static unsigned int stability_downrate_epoch = 0;
+
 /**  */
 static time_t started_tracking_stability = 0;
 
 /** Map from hex OR identity digest to or_history_t. */
 static digestmap_t *history_map = NULL;
 
+/** Multiply <b>hist</b>'s weighted MTBF and WFU totals by STABILITY_ALPHA
+ * once for every discount we have made since we last updated it. */
+static void
+or_history_apply_downrate(or_history_t *hist)
+{
+  double alpha = 1.0;
+
+  if (hist->downrate_epoch == stability_downrate_epoch)
+    return;
+  while (hist->downrate_epoch != stability_downrate_epoch) {
+    ++hist->downrate_epoch;
+    alpha *= STABILITY_ALPHA;
+  }
+
+  hist->weighted_run_length =
+    (unsigned long)(hist->weighted_run_length * alpha);
+  hist->total_run_weights *= alpha;
+
+  hist->weighted_uptime = (unsigned long)(hist->weighted_uptime * alpha);
+  hist->total_weighted_time = (unsigned long)
+    (hist->total_weighted_time * alpha);
+}
+
 /** Return the or_history_t for the OR with identity digest <b>id</b>,
- * creating it if necessary. */
+ * creating it if necessary.  Its MTBF data is discounted up to date. */
 static or_history_t *
 get_or_history(const char* id)
 {
@@ -192,15 +240,41 @@ get_or_history(const char* id)
     rephist_total_num++;
     hist->link_history_map = digestmap_new();
     hist->since = hist->changed = time(NULL);
+    hist->downrate_epoch = stability_downrate_epoch;
     tor_addr_make_unspec(&hist->last_reached_addr);
     digestmap_set(history_map, id, hist);
+  } else {
+    or_history_apply_downrate(hist);
   }
   return hist;
 }
 
+/** Remove the least recently changed entry from <b>orhist</b>'s map of
+ * link histories. */
+static void
+evict_oldest_link_history(or_history_t *orhist)
+{
+  const char *oldest_id = NULL;
+  time_t oldest = 0;
+
+  DIGESTMAP_FOREACH(orhist->link_history_map, to_id, link_history_t *, l) {
+    if (!oldest_id || l->changed < oldest) {
+      oldest_id = to_id;
+      oldest = l->changed;
+    }
+  } DIGESTMAP_FOREACH_END;
+
+  if (oldest_id) {
+    link_history_t *l = digestmap_remove(orhist->link_history_map, oldest_id);
+    rephist_total_alloc -= sizeof(link_history_t);
+    tor_free(l);
+  }
+}
+
 /** Return the link_history_t for the link from the first named OR to
  * the second, creating it if necessary. (ORs are identified by
- * identity digest.)
+ * identity digest.)  Each OR keeps at most MAX_LINK_HISTORIES_PER_OR link
+ * histories; making room for a new one forgets the least recently changed.
  */
 static link_history_t *
 get_link_history(const char *from_id, const char *to_id)
@@ -214,6 +288,8 @@ get_link_history(const char *from_id, const char *to_id)
     return NULL;
   lhist = digestmap_get(orhist->link_history_map, to_id);
   if (!lhist) {
+    if (digestmap_size(orhist->link_history_map) >= MAX_LINK_HISTORIES_PER_OR)
+      evict_oldest_link_history(orhist);
     lhist = tor_malloc_zero(sizeof(link_history_t));
     rephist_total_alloc += sizeof(link_history_t);
     lhist->since = lhist->changed = time(NULL);
@@ -487,6 +563,49 @@ rep_hist_note_router_unreachable(const char *id, time_t when)
   }
 }
 
+/** Weight given to the newest sample in each OR's moving average of
+ * reachability test latency. */
+#define REACHABILITY_LATENCY_ALPHA 0.25
+
+/** We (as an authority) have just completed a reachability test to the
+ * router with identity digest <b>id</b>: it took <b>msec</b> milliseconds
+ * from launching the connection to finishing the TLS handshake. */
+void
+rep_hist_note_router_reachability_latency(const char *id, uint32_t msec)
+{
+  or_history_t *hist = get_or_history(id);
+  if (!hist)
+    return;
+
+  if (hist->n_reachability_tests_ok == 0) {
+    hist->mean_reachability_latency_msec = msec;
+  } else {
+    hist->mean_reachability_latency_msec +=
+      REACHABILITY_LATENCY_ALPHA *
+      (msec - hist->mean_reachability_latency_msec);
+  }
+  hist->last_reachability_latency_msec = msec;
+  ++hist->n_reachability_tests_ok;
+}
+
+/** If we have completed any reachability tests to the router with identity
+ * digest <b>id</b>, set *<b>last_out</b> to the latency of the most recent
+ * one and *<b>mean_out</b> to the moving average of all of them (both in
+ * msec), and return 0.  Otherwise return -1. */
+int
+rep_hist_get_reachability_latency(const char *id, uint32_t *last_out,
+                                  double *mean_out)
+{
+  or_history_t *hist = digestmap_get(history_map, id);
+  if (!hist || !hist->n_reachability_tests_ok)
+    return -1;
+  if (last_out)
+    *last_out = hist->last_reachability_latency_msec;
+  if (mean_out)
+    *mean_out = hist->mean_reachability_latency_msec;
+  return 0;
+}
+
 /** Mark a router with ID <b>id</b> as non-Running, and retroactively declare
  * that it has never been running: give it no stability and no WFU. */
 void
@@ -507,10 +626,7 @@ rep_hist_make_router_pessimal(const char *id, time_t when)
 time_t
 rep_hist_downrate_old_runs(time_t now)
 {
-  digestmap_iter_t *orhist_it;
-  const char *digest1;
-  or_history_t *hist;
-  void *hist_p;
+  unsigned int n_intervals = 0;
   double alpha = 1.0;
 
   if (!history_map)
@@ -524,26 +640,15 @@ rep_hist_downrate_old_runs(time_t now)
   while (stability_last_downrated + STABILITY_INTERVAL < now) {
     stability_last_downrated += STABILITY_INTERVAL;
     alpha *= STABILITY_ALPHA;
+    ++n_intervals;
   }
 
   log_info(LD_HIST, "Discounting all old stability info by a factor of %f",
            alpha);
 
-  /* Multiply every w_r_l, t_r_w pair by alpha. */
-  for (orhist_it = digestmap_iter_init(history_map);
-       !digestmap_iter_done(orhist_it);
-       orhist_it = digestmap_iter_next(history_map,orhist_it)) {
-    digestmap_iter_get(orhist_it, &digest1, &hist_p);
-    hist = hist_p;
-
-    hist->weighted_run_length =
-      (unsigned long)(hist->weighted_run_length * alpha);
-    hist->total_run_weights *= alpha;
-
-    hist->weighted_uptime = (unsigned long)(hist->weighted_uptime * alpha);
-    hist->total_weighted_time = (unsigned long)
-      (hist->total_weighted_time * alpha);
-  }
+  /* Each entry multiplies its w_r_l, t_r_w pair by alpha the next time we
+   * look at it. */
+  stability_downrate_epoch += n_intervals;
 
   return stability_last_downrated + STABILITY_INTERVAL;
 }
@@ -705,6 +810,17 @@ rep_hist_note_extend_failed(const char *from_id, const char *to_id)
   hist->changed = time(NULL);
 }
 
+#ifdef TOR_UNIT_TESTS
+/** Return the number of link histories we remember for extends from the OR
+ * with identity digest <b>from_id</b>. */
+STATIC int
+rep_hist_get_n_link_histories(const char *from_id)
+{
+  or_history_t *orhist = digestmap_get(history_map, from_id);
+  return orhist ? digestmap_size(orhist->link_history_map) : 0;
+}
+#endif
+
 /** Log all the reliability data we have remembered, with the chosen
  * severity.
  */
@@ -737,6 +853,7 @@ rep_hist_dump_stats(time_t now, int severity)
     long stability;
     digestmap_iter_get(orhist_it, &digest1, &or_history_p);
     or_history = (or_history_t*) or_history_p;
+    or_history_apply_downrate(or_history);
 
     if ((node = node_get_by_id(digest1)) && node_get_nickname(node))
       name1 = node_get_nickname(node);
@@ -810,6 +927,7 @@ rep_history_clean(time_t before)
     int should_remove;
     digestmap_iter_get(orhist_it, &d1, &or_history_p);
     or_history = or_history_p;
+    or_history_apply_downrate(or_history);
 
     should_remove = authority ?
                        (or_history->total_run_weights < STABILITY_EPSILON &&
@@ -901,6 +1019,7 @@ rep_hist_record_mtbf_data(time_t now, int missing_means_down)
     const char *t = NULL;
     digestmap_iter_get(orhist_it, &digest, &or_history_p);
     hist = (or_history_t*) or_history_p;
+    or_history_apply_downrate(hist);
 
     base16_encode(dbuf, sizeof(dbuf), digest, DIGEST_LEN);
 
@@ -2292,7 +2411,8 @@ rep_hist_exit_stats_write(time_t now)
 
   /* Try to write to disk. */
   if (!check_or_create_data_subdir("stats")) {
-    write_to_data_subdir("stats", "exit-stats", str, "exit port statistics");
+    write_to_data_subdir_async("stats", "exit-stats", str,
+                               "exit port statistics");
   }
 
  done:
@@ -2385,7 +2505,7 @@ rep_hist_buffer_stats_add_circ(circuit_t *circ, time_t end_of_interval)
   if (CIRCUIT_IS_ORIGIN(circ))
     return;
   orcirc = TO_OR_CIRCUIT(circ);
-  if (!orcirc->processed_cells)
+  if (!orcirc->buffer_stats || !orcirc->buffer_stats->processed_cells)
     return;
   start_of_interval = (circ->timestamp_created.tv_sec >
                        start_of_buffer_stats_interval) ?
@@ -2394,15 +2514,16 @@ rep_hist_buffer_stats_add_circ(circuit_t *circ, time_t end_of_interval)
   interval_length = (int) (end_of_interval - start_of_interval);
   if (interval_length <= 0)
     return;
-  processed_cells = orcirc->processed_cells;
+  processed_cells = orcirc->buffer_stats->processed_cells;
   /* 1000.0 for s -> ms; 2.0 because of app-ward and exit-ward queues */
-  mean_num_cells_in_queue = (double) orcirc->total_cell_waiting_time /
+  mean_num_cells_in_queue =
+      (double) orcirc->buffer_stats->total_cell_waiting_time /
       (double) interval_length / 1000.0 / 2.0;
   mean_time_cells_in_queue =
-      (double) orcirc->total_cell_waiting_time /
-      (double) orcirc->processed_cells;
-  orcirc->total_cell_waiting_time = 0;
-  orcirc->processed_cells = 0;
+      (double) orcirc->buffer_stats->total_cell_waiting_time /
+      (double) processed_cells;
+  orcirc->buffer_stats->total_cell_waiting_time = 0;
+  orcirc->buffer_stats->processed_cells = 0;
   rep_hist_add_buffer_stats(mean_num_cells_in_queue,
                             mean_time_cells_in_queue,
                             processed_cells);
@@ -2573,7 +2694,8 @@ rep_hist_buffer_stats_write(time_t now)
 
   /* Try to write to disk. */
   if (!check_or_create_data_subdir("stats")) {
-    write_to_data_subdir("stats", "buffer-stats", str, "buffer statistics");
+    write_to_data_subdir_async("stats", "buffer-stats", str,
+                               "buffer statistics");
   }
 
  done:
@@ -2943,7 +3065,8 @@ rep_hist_conn_stats_write(time_t now)
 
   /* Try to write to disk. */
   if (!check_or_create_data_subdir("stats")) {
-    write_to_data_subdir("stats", "conn-stats", str, "connection statistics");
+    write_to_data_subdir_async("stats", "conn-stats", str,
+                               "connection statistics");
   }
 
  done:
@@ -3201,8 +3324,8 @@ rep_hist_hs_stats_write(time_t now)
 
   /* Try to write to disk. */
   if (!check_or_create_data_subdir("stats")) {
-    write_to_data_subdir("stats", "hidserv-stats", str,
-                         "hidden service stats");
+    write_to_data_subdir_async("stats", "hidserv-stats", str,
+                               "hidden service stats");
   }
 
  done:
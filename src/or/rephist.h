@@ -38,6 +38,10 @@ void rep_history_clean(time_t before);
 void rep_hist_note_router_reachable(const char *id, const tor_addr_t *at_addr,
                                     const uint16_t at_port, time_t when);
 void rep_hist_note_router_unreachable(const char *id, time_t when);
+void rep_hist_note_router_reachability_latency(const char *id,
+                                               uint32_t msec);
+int rep_hist_get_reachability_latency(const char *id, uint32_t *last_out,
+                                      double *mean_out);
 int rep_hist_record_mtbf_data(time_t now, int missing_means_down);
 int rep_hist_load_mtbf_data(time_t now);
 
@@ -112,6 +116,12 @@ void rep_hist_note_negotiated_link_proto(unsigned link_proto,
                                          int started_here);
 void rep_hist_log_link_protocol_counts(void);
 
+#ifdef REPHIST_PRIVATE
+#ifdef TOR_UNIT_TESTS
+STATIC int rep_hist_get_n_link_histories(const char *from_id);
+#endif
+#endif
+
 extern uint64_t rephist_total_alloc;
 extern uint32_t rephist_total_num;
 #ifdef TOR_UNIT_TESTS
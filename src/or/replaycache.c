@@ -16,6 +16,15 @@
  * RSA-encrypted portion of the handshake, since the rest of the handshake is
  * malleable.)
  *
+ * Digests are kept either exactly, in a map that is scrubbed of old entries
+ * now and then, or approximately, in a ring of time-bucketed Bloom filters.
+ * The filters take a few bytes per digest rather than the map's hundred or
+ * so, and age out a whole bucket at a time; in exchange, a small fraction
+ * of cells that are not replays will look like them.  Each bucket is a
+ * scalable Bloom filter: when its newest filter is full, we add one twice
+ * as large and with half the false-positive rate, so a flood of cells can
+ * cost us memory but can't make us reject real ones.
+ *
  * This module is used from rendservice.c.
  */
 
@@ -24,6 +33,101 @@
 #include "or.h"
 #include "replaycache.h"
 
+#include <math.h>
+
+/** How many buckets of filters cover the horizon of a filter-backed
+ * replaycache_t. */
+#define REPLAYCACHE_FILTER_BUCKETS 4
+/** Most filters we keep in one bucket.  The last one keeps taking digests
+ * past its capacity, getting less accurate; we only reach it after about
+ * 2^REPLAYCACHE_MAX_FILTERS_PER_BUCKET times the design load. */
+#define REPLAYCACHE_MAX_FILTERS_PER_BUCKET 20
+
+/** Approximate cost in bytes of each digest in a map-backed cache: the
+ * value we allocate for it, plus the map entry that points to it. */
+#define REPLAYCACHE_ENTRY_COST \
+  (sizeof(time_t) + DIGEST256_LEN + 3*sizeof(void *))
+
+/** Approximate number of bytes held by all the replay caches. */
+static size_t replaycache_total_allocation = 0;
+
+/** Return the number of bytes held by the Bloom filter <b>ds</b>. */
+static size_t
+replaycache_filter_allocation(const digestset_t *ds)
+{
+  if (!ds)
+    return 0;
+  return sizeof(*ds) +
+    ((size_t)ds->mask + 1) * DIGESTSET_BLOCK_WORDS * sizeof(uint64_t);
+}
+
+/** Free the Bloom filters in slot <b>i</b> of <b>r</b>, if there are
+ * any. */
+static void
+replaycache_free_filter(replaycache_t *r, int i)
+{
+  if (!r->filters[i])
+    return;
+  SMARTLIST_FOREACH_BEGIN(r->filters[i], digestset_t *, ds) {
+    replaycache_total_allocation -= replaycache_filter_allocation(ds);
+    digestset_free(ds);
+  } SMARTLIST_FOREACH_END(ds);
+  smartlist_free(r->filters[i]);
+  r->filters[i] = NULL;
+  r->filter_n_added[i] = 0;
+}
+
+/** Return how many digests the <b>idx</b>th filter in a slot of <b>r</b>
+ * takes before we start another: each one takes twice as many as the one
+ * before. */
+static int
+replaycache_filter_capacity(const replaycache_t *r, int idx)
+{
+  if (idx >= 30 || r->filter_capacity > (INT_MAX >> idx))
+    return INT_MAX;
+  return r->filter_capacity << idx;
+}
+
+/** Start a new Bloom filter in slot <b>i</b> of <b>r</b>.  The filters in
+ * a slot get twice as accurate each time, so that however many there are,
+ * their false positives add up to less than r->filter_fp_rate. */
+static void
+replaycache_add_filter(replaycache_t *r, int i)
+{
+  int idx, n_elements;
+  double fp_rate, bits;
+  digestset_t *ds;
+
+  if (!r->filters[i])
+    r->filters[i] = smartlist_new();
+  idx = smartlist_len(r->filters[i]);
+  fp_rate = ldexp(r->filter_fp_rate, -(idx + 1));
+
+  /* A digestset_t has at least 16 bits for each element it is sized for.
+   * It is at least as accurate as a plain Bloom filter with four hash
+   * functions, where n elements in m bits give false positives with
+   * probability (1 - exp(-4n/m))^4; solve for m. */
+  bits = -4.0 * replaycache_filter_capacity(r, idx) /
+    log(1.0 - pow(fp_rate, 0.25));
+  if (bits / 16 >= INT_MAX / 32)
+    n_elements = INT_MAX / 32;
+  else
+    n_elements = MAX((int)(bits / 16) + 1, r->filter_capacity);
+
+  ds = digestset_new(n_elements);
+  replaycache_total_allocation += replaycache_filter_allocation(ds);
+  smartlist_add(r->filters[i], ds);
+  r->filter_n_added[i] = 0;
+}
+
+/** Return the approximate number of bytes held by all the replay caches
+ * we have. */
+size_t
+replaycache_get_total_allocation(void)
+{
+  return replaycache_total_allocation;
+}
+
 /** Free the replaycache r and all of its entries.
  */
 
@@ -35,7 +139,19 @@ replaycache_free(replaycache_t *r)
     return;
   }
 
-  if (r->digests_seen) digest256map_free(r->digests_seen, tor_free_);
+  if (r->digests_seen) {
+    replaycache_total_allocation -=
+      digest256map_size(r->digests_seen) * REPLAYCACHE_ENTRY_COST;
+    digest256map_free(r->digests_seen, tor_free_);
+  }
+  if (r->filters) {
+    int i;
+    for (i = 0; i < r->n_filters; ++i)
+      replaycache_free_filter(r, i);
+    tor_free(r->filters);
+    tor_free(r->filter_bucket);
+    tor_free(r->filter_n_added);
+  }
 
   tor_free(r);
 }
@@ -62,7 +178,7 @@ replaycache_new(time_t horizon, time_t interval)
     interval = 0;
   }
 
-  r = tor_malloc(sizeof(*r));
+  r = tor_malloc_zero(sizeof(*r));
   r->scrub_interval = interval;
   r->scrubbed = 0;
   r->horizon = horizon;
@@ -72,6 +188,114 @@ replaycache_new(time_t horizon, time_t interval)
   return r;
 }
 
+/** Allocate a new, empty replay detection cache that keeps digests in Bloom
+ * filters rather than in a map.  Entries age out after <b>horizon</b>
+ * seconds, a bucket's worth at a time, or never if <b>horizon</b> is zero.
+ * Each bucket starts out with room for <b>max_per_bucket</b> entries, and
+ * grows when it needs more; either way, it falsely reports a replay with
+ * probability less than about <b>fp_rate</b>.
+ */
+
+replaycache_t *
+replaycache_new_filter(time_t horizon, int max_per_bucket, double fp_rate)
+{
+  replaycache_t *r = NULL;
+  int i;
+
+  if (horizon < 0 || max_per_bucket <= 0 ||
+      !(fp_rate > 0.0 && fp_rate < 1.0)) {
+    log_info(LD_BUG, "replaycache_new_filter() called with bad"
+        " parameters");
+    goto err;
+  }
+
+  r = tor_malloc_zero(sizeof(*r));
+  r->horizon = horizon;
+  if (horizon) {
+    r->n_filters = REPLAYCACHE_FILTER_BUCKETS + 1;
+    r->bucket_width = CEIL_DIV(horizon, REPLAYCACHE_FILTER_BUCKETS);
+  } else {
+    r->n_filters = 1;
+    r->bucket_width = 0;
+  }
+  r->filters = tor_calloc(r->n_filters, sizeof(smartlist_t *));
+  r->filter_bucket = tor_calloc(r->n_filters, sizeof(time_t));
+  r->filter_n_added = tor_calloc(r->n_filters, sizeof(int));
+  for (i = 0; i < r->n_filters; ++i)
+    r->filter_bucket[i] = -1;
+  r->filter_capacity = max_per_bucket;
+  r->filter_fp_rate = fp_rate;
+
+ err:
+  return r;
+}
+
+/** Return the bucket of <b>r</b> that covers the time <b>t</b>. */
+static inline time_t
+replaycache_bucket(const replaycache_t *r, time_t t)
+{
+  if (!r->bucket_width || t < 0)
+    return 0;
+  return t / r->bucket_width;
+}
+
+/** Implementation of replaycache_add_and_test_internal() for filter-backed
+ * caches: the same, but for the <b>digest</b> of the data.  The elapsed
+ * time we report is measured from the start of the bucket that held the
+ * digest, so it may be up to a bucket's width too long. */
+
+static int
+replaycache_filter_add_and_test(time_t present, replaycache_t *r,
+                                const uint8_t *digest, time_t *elapsed)
+{
+  const time_t current = replaycache_bucket(r, present);
+  const time_t oldest = r->horizon ?
+    replaycache_bucket(r, present - r->horizon) : 0;
+  time_t hit_bucket = -1;
+  int i, slot;
+
+  /* Look through every bucket inside the horizon, newest hit first. */
+  for (i = 0; i < r->n_filters; ++i) {
+    if (!r->filters[i] || r->filter_bucket[i] <= hit_bucket ||
+        r->filter_bucket[i] < oldest)
+      continue;
+    SMARTLIST_FOREACH_BEGIN(r->filters[i], const digestset_t *, ds) {
+      if (digestset_contains(ds, (const char *)digest)) {
+        hit_bucket = r->filter_bucket[i];
+        break;
+      }
+    } SMARTLIST_FOREACH_END(ds);
+  }
+
+  if (hit_bucket >= 0 && elapsed) {
+    time_t seen = hit_bucket * r->bucket_width;
+    /* We shouldn't really be seeing hits from the future, but... (And if
+     * nothing ever expires, we don't know when we saw it.) */
+    *elapsed = (r->bucket_width && present > seen) ? present - seen : 0;
+  }
+
+  /* Add it to the current bucket, replacing the oldest one if this is a new
+   * bucket, and growing it if its newest filter is full. */
+  slot = (int)(current % r->n_filters);
+  if (r->filter_bucket[slot] < current || !r->filters[slot]) {
+    replaycache_free_filter(r, slot);
+    replaycache_add_filter(r, slot);
+    r->filter_bucket[slot] = current;
+  } else {
+    const int idx = smartlist_len(r->filters[slot]) - 1;
+    if (r->filter_n_added[slot] >= replaycache_filter_capacity(r, idx) &&
+        idx + 1 < REPLAYCACHE_MAX_FILTERS_PER_BUCKET)
+      replaycache_add_filter(r, slot);
+  }
+  digestset_add(smartlist_get(r->filters[slot],
+                              smartlist_len(r->filters[slot]) - 1),
+                (const char *)digest);
+  if (r->filter_n_added[slot] < INT_MAX)
+    ++r->filter_n_added[slot];
+
+  return hit_bucket >= 0;
+}
+
 /** See documentation for replaycache_add_and_test()
  */
 
@@ -94,6 +318,12 @@ replaycache_add_and_test_internal(
   /* compute digest */
   crypto_digest256((char *)digest, (const char *)data, len, DIGEST_SHA256);
 
+  if (r->filters) {
+    rv = replaycache_filter_add_and_test(present, r, digest, elapsed);
+    replaycache_scrub_if_needed_internal(present, r);
+    goto done;
+  }
+
   /* check map */
   access_time = digest256map_get(r->digests_seen, digest);
 
@@ -127,6 +357,7 @@ replaycache_add_and_test_internal(
     access_time = tor_malloc(sizeof(*access_time));
     *access_time = present;
     digest256map_set(r->digests_seen, digest, access_time);
+    replaycache_total_allocation += REPLAYCACHE_ENTRY_COST;
   }
 
   /* now scrub the cache if it's time */
@@ -148,12 +379,28 @@ replaycache_scrub_if_needed_internal(time_t present, replaycache_t *r)
   time_t *access_time;
 
   /* sanity check */
-  if (!r || !(r->digests_seen)) {
+  if (!r || !(r->digests_seen || r->filters)) {
     log_info(LD_BUG, "replaycache_scrub_if_needed_internal() called with"
         " stupid parameters; please fix this.");
     return;
   }
 
+  if (r->filters) {
+    /* Filters expire a bucket at a time: just drop the ones that have
+     * aged out, to give their memory back. */
+    if (r->horizon) {
+      const time_t oldest = replaycache_bucket(r, present - r->horizon);
+      int i;
+      for (i = 0; i < r->n_filters; ++i) {
+        if (r->filters[i] && r->filter_bucket[i] < oldest) {
+          replaycache_free_filter(r, i);
+          r->filter_bucket[i] = -1;
+        }
+      }
+    }
+    return;
+  }
+
   /* scrub time yet? (scrubbed == 0 indicates never scrubbed before) */
   if (present - r->scrubbed < r->scrub_interval && r->scrubbed > 0) return;
 
@@ -171,6 +418,7 @@ replaycache_scrub_if_needed_internal(time_t present, replaycache_t *r)
       itr = digest256map_iter_next_rmv(r->digests_seen, itr);
       /* Free the value removed */
       tor_free(access_time);
+      replaycache_total_allocation -= REPLAYCACHE_ENTRY_COST;
     } else {
       /* Just advance the iterator */
       itr = digest256map_iter_next(r->digests_seen, itr);
@@ -24,9 +24,29 @@ struct replaycache_s {
    */
   time_t horizon;
   /*
-   * Digest map: keys are digests, values are times the digest was last seen
+   * Digest map: keys are digests, values are times the digest was last seen.
+   * NULL if this cache uses filters instead.
    */
   digest256map_t *digests_seen;
+  /*
+   * Filter backend: a ring of n_filters slots, each holding the digests
+   * first seen during one bucket of bucket_width seconds.
+   * filter_bucket[i] is the bucket (time / bucket_width) that slot i
+   * holds.  filters[i] is a list of Bloom filters for that bucket, oldest
+   * first, or NULL until something is added to it; once the newest one has
+   * taken as many digests as it was sized for, we start another.  If the
+   * horizon is zero, there is one slot and it never expires.
+   */
+  int n_filters;
+  time_t bucket_width;
+  smartlist_t **filters;
+  time_t *filter_bucket;
+  /* How many digests we have added to the newest filter in each slot */
+  int *filter_n_added;
+  /* How many digests the first filter in each slot is sized for */
+  int filter_capacity;
+  /* The chance of a false replay we accept from each slot */
+  double filter_fp_rate;
 };
 
 #endif /* REPLAYCACHE_PRIVATE */
@@ -34,7 +54,10 @@ struct replaycache_s {
 /* replaycache_t free/new */
 
 void replaycache_free(replaycache_t *r);
+size_t replaycache_get_total_allocation(void);
 replaycache_t * replaycache_new(time_t horizon, time_t interval);
+replaycache_t * replaycache_new_filter(time_t horizon, int max_per_bucket,
+                                       double fp_rate);
 
 #ifdef REPLAYCACHE_PRIVATE
 
@@ -699,6 +699,8 @@ router_initialize_tls_context(void)
     else if (!strcasecmp(options->TLSECGroup, "P224"))
       flags |= TOR_TLS_CTX_USE_ECDHE_P224;
   }
+  if (options->TLSSessionResumption)
+    flags |= TOR_TLS_CTX_ALLOW_RESUMPTION;
   if (!lifetime) { /* we should guess a good ssl cert lifetime */
 
     /* choose between 5 and 365 days, and round to the day */
@@ -1840,8 +1842,8 @@ router_compare_to_my_exit_policy(const tor_addr_t *addr, uint16_t port)
    * summary. */
   if ((tor_addr_family(addr) == AF_INET ||
        tor_addr_family(addr) == AF_INET6)) {
-    return compare_tor_addr_to_addr_policy(addr, port,
-                               me->exit_policy) != ADDR_POLICY_ACCEPTED;
+    return compare_tor_addr_to_compiled_policy(addr, port,
+                        me->compiled_exit_policy) != ADDR_POLICY_ACCEPTED;
 #if 0
   } else if (tor_addr_family(addr) == AF_INET6) {
     return get_options()->IPv6Exit &&
@@ -2138,9 +2140,9 @@ router_build_fresh_descriptor(routerinfo_t **r, extrainfo_t **e)
     tor_cert_dup(get_master_signing_key_cert());
 
   get_platform_str(platform, sizeof(platform));
-  ri->platform = tor_strdup(platform);
+  ri->platform = tor_intern_string(platform);
 
-  ri->protocol_list = tor_strdup(protover_get_supported_protocols());
+  ri->protocol_list = tor_intern_string(protover_get_supported_protocols());
 
   /* compute ri->bandwidthrate as the min of various options */
   ri->bandwidthrate = get_effective_bwrate(options);
@@ -2157,9 +2159,12 @@ router_build_fresh_descriptor(routerinfo_t **r, extrainfo_t **e)
     policies_parse_exit_policy_from_options(options,ri->addr,&ri->ipv6_addr,
                                             &ri->exit_policy);
   }
+  /* We look at our exit policy for every stream we're asked to open, so
+   * compile it now. */
+  ri->compiled_exit_policy = compiled_policy_new(ri->exit_policy);
   ri->policy_is_reject_star =
-    policy_is_reject_star(ri->exit_policy, AF_INET) &&
-    policy_is_reject_star(ri->exit_policy, AF_INET6);
+    compiled_policy_is_reject_star(ri->compiled_exit_policy, AF_INET) &&
+    compiled_policy_is_reject_star(ri->compiled_exit_policy, AF_INET6);
 
   if (options->IPv6Exit) {
     char *p_tmp = policy_summarize(ri->exit_policy, AF_INET6);
@@ -2220,6 +2225,11 @@ router_build_fresh_descriptor(routerinfo_t **r, extrainfo_t **e)
     /* remove duplicates from the list */
     smartlist_sort_strings(ri->declared_family);
     smartlist_uniq_strings(ri->declared_family);
+    SMARTLIST_FOREACH_BEGIN(ri->declared_family, char *, member) {
+      smartlist_set(ri->declared_family, member_sl_idx,
+                    (char *) tor_intern_string(member));
+      tor_free(member);
+    } SMARTLIST_FOREACH_END(member);
 
     smartlist_free(family);
   }
@@ -2627,7 +2637,7 @@ router_dump_router_to_string(routerinfo_t *router,
   char *family_line = NULL;
   char *extra_or_address = NULL;
   const or_options_t *options = get_options();
-  smartlist_t *chunks = NULL;
+  strbuf_t *sb = NULL;
   char *output = NULL;
   const int emit_ed_sigs = signing_keypair &&
     router->cache_info.signing_key_cert;
@@ -2806,10 +2816,10 @@ router_dump_router_to_string(routerinfo_t *router,
   }
 
   address = tor_dup_ip(router->addr);
-  chunks = smartlist_new();
+  sb = strbuf_new(4096);
 
   /* Generate the easy portion of the router descriptor. */
-  smartlist_add_asprintf(chunks,
+  strbuf_add_printf(sb,
                     "router %s %s %d 0 %d\n"
                     "%s"
                     "%s"
@@ -2853,7 +2863,7 @@ router_dump_router_to_string(routerinfo_t *router,
     const char *ci = options->ContactInfo;
     if (strchr(ci, '\n') || strchr(ci, '\r'))
       ci = escaped(ci);
-    smartlist_add_asprintf(chunks, "contact %s\n", ci);
+    strbuf_add_printf(sb, "contact %s\n", ci);
   }
 
   if (router->onion_curve25519_pkey) {
@@ -2861,7 +2871,7 @@ router_dump_router_to_string(routerinfo_t *router,
     base64_encode(kbuf, sizeof(kbuf),
                   (const char *)router->onion_curve25519_pkey->public_key,
                   CURVE25519_PUBKEY_LEN, BASE64_ENCODE_MULTILINE);
-    smartlist_add_asprintf(chunks, "ntor-onion-key %s", kbuf);
+    strbuf_add_printf(sb, "ntor-onion-key %s", kbuf);
   } else {
     /* Authorities will start rejecting relays without ntor keys in 0.2.9 */
     log_err(LD_BUG, "A relay must have an ntor onion key");
@@ -2870,37 +2880,40 @@ router_dump_router_to_string(routerinfo_t *router,
 
   /* Write the exit policy to the end of 's'. */
   if (!router->exit_policy || !smartlist_len(router->exit_policy)) {
-    smartlist_add(chunks, tor_strdup("reject *:*\n"));
+    strbuf_add(sb, "reject *:*\n");
   } else if (router->exit_policy) {
     char *exit_policy = router_dump_exit_policy_to_string(router,1,0);
 
     if (!exit_policy)
       goto err;
 
-    smartlist_add_asprintf(chunks, "%s\n", exit_policy);
+    strbuf_add(sb, exit_policy);
+    strbuf_add(sb, "\n");
     tor_free(exit_policy);
   }
 
   if (router->ipv6_exit_policy) {
     char *p6 = write_short_policy(router->ipv6_exit_policy);
     if (p6 && strcmp(p6, "reject 1-65535")) {
-      smartlist_add_asprintf(chunks,
-                            "ipv6-policy %s\n", p6);
+      strbuf_add_printf(sb, "ipv6-policy %s\n", p6);
     }
     tor_free(p6);
   }
 
   if (decide_to_advertise_begindir(options,
                                    router->supports_tunnelled_dir_requests)) {
-    smartlist_add(chunks, tor_strdup("tunnelled-dir-server\n"));
+    strbuf_add(sb, "tunnelled-dir-server\n");
   }
 
   /* Sign the descriptor with Ed25519 */
   if (emit_ed_sigs)  {
-    smartlist_add(chunks, tor_strdup("router-sig-ed25519 "));
-    crypto_digest_smartlist_prefix(digest, DIGEST256_LEN,
-                                   ED_DESC_SIGNATURE_PREFIX,
-                                   chunks, "", DIGEST_SHA256);
+    crypto_digest_t *d = crypto_digest256_new(DIGEST_SHA256);
+    strbuf_add(sb, "router-sig-ed25519 ");
+    crypto_digest_add_bytes(d, ED_DESC_SIGNATURE_PREFIX,
+                            strlen(ED_DESC_SIGNATURE_PREFIX));
+    crypto_digest_add_bytes(d, strbuf_get(sb), strbuf_len(sb));
+    crypto_digest_get_digest(d, digest, DIGEST256_LEN);
+    crypto_digest_free(d);
     ed25519_signature_t sig;
     char buf[ED25519_SIG_BASE64_LEN+1];
     if (ed25519_sign(&sig, (const uint8_t*)digest, DIGEST256_LEN,
@@ -2909,13 +2922,13 @@ router_dump_router_to_string(routerinfo_t *router,
     if (ed25519_signature_to_base64(buf, &sig) < 0)
       goto err;
 
-    smartlist_add_asprintf(chunks, "%s\n", buf);
+    strbuf_add_printf(sb, "%s\n", buf);
   }
 
   /* Sign the descriptor with RSA */
-  smartlist_add(chunks, tor_strdup("router-signature\n"));
+  strbuf_add(sb, "router-signature\n");
 
-  crypto_digest_smartlist(digest, DIGEST_LEN, chunks, "", DIGEST_SHA1);
+  crypto_digest(digest, strbuf_get(sb), strbuf_len(sb));
 
   note_crypto_pk_op(SIGN_RTR);
   {
@@ -2924,13 +2937,15 @@ router_dump_router_to_string(routerinfo_t *router,
       log_warn(LD_BUG, "Couldn't sign router descriptor");
       goto err;
     }
-    smartlist_add(chunks, sig);
+    strbuf_add(sb, sig);
+    tor_free(sig);
   }
 
   /* include a last '\n' */
-  smartlist_add(chunks, tor_strdup("\n"));
+  strbuf_add(sb, "\n");
 
-  output = smartlist_join_strings(chunks, "", 0, NULL);
+  output = strbuf_extract(sb, NULL);
+  sb = NULL;
 
 #ifdef DEBUG_ROUTER_DUMP_ROUTER_TO_STRING
   {
@@ -2955,10 +2970,7 @@ router_dump_router_to_string(routerinfo_t *router,
  err:
   tor_free(output); /* sets output to NULL */
  done:
-  if (chunks) {
-    SMARTLIST_FOREACH(chunks, char *, cp, tor_free(cp));
-    smartlist_free(chunks);
-  }
+  strbuf_free(sb);
   tor_free(address);
   tor_free(family_line);
   tor_free(onion_pkey);
@@ -3022,6 +3034,97 @@ router_has_orport(const routerinfo_t *router, const tor_addr_port_t *orport)
      orport->port == router->ipv6_orport);
 }
 
+/** What we found the last time we read one of our stats files. */
+typedef struct stats_file_cache_ent_t {
+  /** 1 if we found a block starting with the end line, 0 if the file was
+   * missing or empty, and -1 if it had no well-formed block. */
+  int status;
+  /** If <b>status</b> is 1, the file's contents starting with the last
+   * end line. */
+  char *block;
+  /** If <b>status</b> is 1, the time in the last end line. */
+  time_t written;
+} stats_file_cache_ent_t;
+
+/** Map from the full name of a stats file to the stats_file_cache_ent_t
+ * describing its contents.  Stats files change at most once a day or so,
+ * but we rebuild our extra-info descriptor much more often than that:
+ * remember what's in them until router_forget_stats_file() tells us that
+ * one has changed. */
+static strmap_t *stats_file_cache = NULL;
+
+/** Helper: free a stats_file_cache_ent_t. */
+static void
+stats_file_cache_ent_free_(void *arg)
+{
+  stats_file_cache_ent_t *ent = arg;
+  if (!ent)
+    return;
+  tor_free(ent->block);
+  tor_free(ent);
+}
+
+/** Note that the stats file called <b>fname</b> (a full pathname) has
+ * changed, so that we read it again the next time we need it. */
+void
+router_forget_stats_file(const char *fname)
+{
+  if (!stats_file_cache)
+    return;
+  stats_file_cache_ent_free_(strmap_remove(stats_file_cache, fname));
+}
+
+/** Read the stats file called <b>fname</b> (a full pathname) and find the
+ * last line starting with <b>end_line</b>.  Return a newly allocated
+ * stats_file_cache_ent_t describing what we found, or NULL if we couldn't
+ * read the file. */
+static stats_file_cache_ent_t *
+stats_file_cache_ent_load(const char *fname, const char *end_line)
+{
+  stats_file_cache_ent_t *ent;
+  char *contents, *start = NULL, *tmp, timestr[ISO_TIME_LEN+1];
+
+  switch (file_status(fname)) {
+    case FN_FILE:
+      break;
+    /* treat empty stats files as if the file doesn't exist */
+    case FN_NOENT:
+    case FN_EMPTY:
+      ent = tor_malloc_zero(sizeof(stats_file_cache_ent_t));
+      ent->status = 0;
+      return ent;
+    case FN_ERROR:
+    case FN_DIR:
+    default:
+      return NULL;
+  }
+
+  /* X022 Find an alternative to reading the whole file to memory. */
+  if (!(contents = read_file_to_str(fname, 0, NULL)))
+    return NULL;
+
+  ent = tor_malloc_zero(sizeof(stats_file_cache_ent_t));
+  ent->status = -1;
+  tmp = strstr(contents, end_line);
+  /* Find last block starting with end_line */
+  while (tmp) {
+    start = tmp;
+    tmp = strstr(tmp + 1, end_line);
+  }
+  if (!start)
+    goto notfound;
+  if (strlen(start) < strlen(end_line) + 1 + sizeof(timestr))
+    goto notfound;
+  strlcpy(timestr, start + 1 + strlen(end_line), sizeof(timestr));
+  if (parse_iso_time(timestr, &ent->written) < 0)
+    goto notfound;
+  ent->block = tor_strdup(start);
+  ent->status = 1;
+ notfound:
+  tor_free(contents);
+  return ent;
+}
+
 /** Load the contents of <b>filename</b>, find the last line starting with
  * <b>end_line</b>, ensure that its timestamp is not more than 25 hours in
  * the past or more than 1 hour in the future with respect to <b>now</b>,
@@ -3029,48 +3132,32 @@ router_has_orport(const routerinfo_t *router, const tor_addr_port_t *orport)
  * Return 1 for success, 0 if the file does not exist or is empty, or -1
  * if the file does not contain a line matching these criteria or other
  * failure. */
-static int
+STATIC int
 load_stats_file(const char *filename, const char *end_line, time_t now,
                 char **out)
 {
   int r = -1;
   char *fname = get_datadir_fname(filename);
-  char *contents, *start = NULL, *tmp, timestr[ISO_TIME_LEN+1];
-  time_t written;
-  switch (file_status(fname)) {
-    case FN_FILE:
-      /* X022 Find an alternative to reading the whole file to memory. */
-      if ((contents = read_file_to_str(fname, 0, NULL))) {
-        tmp = strstr(contents, end_line);
-        /* Find last block starting with end_line */
-        while (tmp) {
-          start = tmp;
-          tmp = strstr(tmp + 1, end_line);
-        }
-        if (!start)
-          goto notfound;
-        if (strlen(start) < strlen(end_line) + 1 + sizeof(timestr))
-          goto notfound;
-        strlcpy(timestr, start + 1 + strlen(end_line), sizeof(timestr));
-        if (parse_iso_time(timestr, &written) < 0)
-          goto notfound;
-        if (written < now - (25*60*60) || written > now + (1*60*60))
-          goto notfound;
-        *out = tor_strdup(start);
-        r = 1;
-      }
-     notfound:
-      tor_free(contents);
-      break;
-    /* treat empty stats files as if the file doesn't exist */
-    case FN_NOENT:
-    case FN_EMPTY:
-      r = 0;
-      break;
-    case FN_ERROR:
-    case FN_DIR:
-    default:
-      break;
+  stats_file_cache_ent_t *ent = NULL;
+
+  if (stats_file_cache)
+    ent = strmap_get(stats_file_cache, fname);
+  if (!ent && (ent = stats_file_cache_ent_load(fname, end_line))) {
+    if (!stats_file_cache)
+      stats_file_cache = strmap_new();
+    strmap_set(stats_file_cache, fname, ent);
+  }
+
+  if (!ent) {
+    r = -1;
+  } else if (ent->status != 1) {
+    r = ent->status;
+  } else if (ent->written < now - (25*60*60) ||
+             ent->written > now + (1*60*60)) {
+    r = -1;
+  } else {
+    *out = tor_strdup(ent->block);
+    r = 1;
   }
   tor_free(fname);
   return r;
@@ -3600,7 +3687,8 @@ router_free_all(void)
   if (warned_nonexistent_family) {
     SMARTLIST_FOREACH(warned_nonexistent_family, char *, cp, tor_free(cp));
     smartlist_free(warned_nonexistent_family);
-  }
+  }  strmap_free(stats_file_cache, stats_file_cache_ent_free_);
+  stats_file_cache = NULL;
 }
 
 /** Return a smartlist of tor_addr_port_t's with all the OR ports of
@@ -145,6 +145,7 @@ const char *extend_info_describe(const extend_info_t *ei);
 void router_get_verbose_nickname(char *buf, const routerinfo_t *router);
 void router_reset_warnings(void);
 void router_reset_reachability(void);
+void router_forget_stats_file(const char *fname);
 void router_free_all(void);
 
 const char *router_purpose_to_string(uint8_t p);
@@ -156,6 +157,8 @@ smartlist_t *router_get_all_orports(const routerinfo_t *ri);
 /* Used only by router.c and test.c */
 STATIC void get_platform_str(char *platform, size_t len);
 STATIC int router_write_fingerprint(int hashed);
+STATIC int load_stats_file(const char *filename, const char *end_line,
+                           time_t now, char **out);
 #endif
 
 #endif
@@ -94,6 +94,7 @@
 #include "or.h"
 #include "backtrace.h"
 #include "crypto_ed25519.h"
+#include "crypto_rand_fast.h"
 #include "circuitstats.h"
 #include "config.h"
 #include "connection.h"
@@ -1297,7 +1298,9 @@ authority_certs_fetch_missing(networkstatus_t *status, time_t now,
  *
  * From time to time, we replace "cached-descriptors" with a new file
  * containing only the live, non-superseded descriptors, and clear
- * cached-routers.new.
+ * cached-routers.new.  If "cached-descriptors" doesn't hold much garbage
+ * yet, we instead append the live descriptors from the journal to it, so
+ * that we don't rewrite the whole store every time the journal fills up.
  *
  * On startup, we read both files.
  */
@@ -1360,16 +1363,123 @@ compare_signed_descriptors_by_age_(const void **_a, const void **_b)
   return (int)(r1->published_on - r2->published_on);
 }
 
-#define RRS_FORCE 1
-#define RRS_DONT_REMOVE_OLD 2
+/** Add every descriptor that belongs in <b>store</b> to <b>out</b>, sorted
+ * by age. */
+static void
+desc_store_get_descriptors(const desc_store_t *store, smartlist_t *out)
+{
+  if (store->type == EXTRAINFO_STORE) {
+    eimap_iter_t *iter;
+    for (iter = eimap_iter_init(routerlist->extra_info_map);
+         !eimap_iter_done(iter);
+         iter = eimap_iter_next(routerlist->extra_info_map, iter)) {
+      const char *key;
+      extrainfo_t *ei;
+      eimap_iter_get(iter, &key, &ei);
+      smartlist_add(out, &ei->cache_info);
+    }
+  } else {
+    SMARTLIST_FOREACH(routerlist->old_routers, signed_descriptor_t *, sd,
+                      smartlist_add(out, sd));
+    SMARTLIST_FOREACH(routerlist->routers, routerinfo_t *, ri,
+                      smartlist_add(out, &ri->cache_info));
+  }
+
+  /* We sort the routers by age to enhance locality on disk. */
+  smartlist_sort(out, compare_signed_descriptors_by_age_);
+}
+
+/** Return true iff we should fold the journal of <b>store</b> into the
+ * store by appending to it, rather than rewriting the whole store: that
+ * is, if the store is big, and not yet half garbage. */
+static int
+router_should_merge_journal(const desc_store_t *store)
+{
+  return store->mmap &&
+    store->store_len > (1<<16) &&
+    store->store_len == store->mmap->size &&
+    store->bytes_dropped <= store->store_len / 2;
+}
+
+/** Append every live descriptor from the journal of <b>store</b> to the end
+ * of the store, remap the store, and clear the journal.  Descriptors
+ * already in the store keep their offsets.  Return 0 on success, -1 on
+ * failure. */
+static int
+router_merge_journal_into_store(desc_store_t *store)
+{
+  smartlist_t *chunk_list = smartlist_new();
+  smartlist_t *signed_descriptors = smartlist_new();
+  smartlist_t *journaled = smartlist_new();
+  char *fname = get_datadir_fname(store->fname_base);
+  off_t offset = (off_t) store->store_len;
+  int r = -1;
+
+  desc_store_get_descriptors(store, signed_descriptors);
+  SMARTLIST_FOREACH_BEGIN(signed_descriptors, signed_descriptor_t *, sd) {
+    sized_chunk_t *c;
+    if (sd->saved_location != SAVED_IN_JOURNAL || sd->do_not_cache)
+      continue;
+    c = tor_malloc(sizeof(sized_chunk_t));
+    c->bytes = signed_descriptor_get_body_impl(sd, 1);
+    c->len = sd->signed_descriptor_len + sd->annotations_len;
+    smartlist_add(chunk_list, c);
+    smartlist_add(journaled, sd);
+  } SMARTLIST_FOREACH_END(sd);
+
+  log_info(LD_DIR, "Appending %d journaled descriptors to %s cache",
+           smartlist_len(journaled), store->description);
+
+  if (append_chunks_to_file(fname, chunk_list, 1) < 0) {
+    log_warn(LD_FS, "Error appending to router store on disk.");
+    goto done;
+  }
+
+  /* The store grew, so our mmap of it is too short. */
+  if (tor_munmap_file(store->mmap) != 0) {
+    log_warn(LD_FS, "Unable to munmap route store in %s", fname);
+  }
+  store->mmap = tor_mmap_file(fname);
+  if (! store->mmap) {
+    log_warn(LD_FS, "Unable to mmap descriptor file at '%s'.", fname);
+  }
+  cache_file_mmap_advise(store->mmap, 0);
+
+  SMARTLIST_FOREACH_BEGIN(journaled, signed_descriptor_t *, sd) {
+    sd->saved_location = SAVED_IN_CACHE;
+    if (store->mmap) {
+      tor_free(sd->signed_descriptor_body); // sets it to null
+      sd->saved_offset = offset;
+    }
+    offset += sd->signed_descriptor_len + sd->annotations_len;
+    signed_descriptor_get_body(sd); /* reconstruct and assert */
+  } SMARTLIST_FOREACH_END(sd);
+
+  tor_free(fname);
+  fname = get_datadir_fname_suffix(store->fname_base, ".new");
+  write_str_to_file(fname, "", 1);
+
+  r = 0;
+  store->store_len = (size_t) offset;
+  store->journal_len = 0;
+ done:
+  SMARTLIST_FOREACH(chunk_list, sized_chunk_t *, c, tor_free(c));
+  smartlist_free(chunk_list);
+  smartlist_free(signed_descriptors);
+  smartlist_free(journaled);
+  tor_free(fname);
+  return r;
+}
 
 /** If the journal of <b>store</b> is too long, or if RRS_FORCE is set in
  * <b>flags</b>, then atomically replace the saved router store with the
- * routers currently in our routerlist, and clear the journal.  Unless
- * RRS_DONT_REMOVE_OLD is set in <b>flags</b>, delete expired routers before
- * rebuilding the store.  Return 0 on success, -1 on failure.
+ * routers currently in our routerlist, and clear the journal.  (If the
+ * journal is too long but the store is mostly live, just append the
+ * journal to the store instead.)  Unless RRS_DONT_REMOVE_OLD is set in
+ * <b>flags</b>, delete expired routers before rebuilding the store.  Return
+ * 0 on success, -1 on failure.
  */
-static int
+STATIC int
 router_rebuild_store(int flags, desc_store_t *store)
 {
   smartlist_t *chunk_list = NULL;
@@ -1391,6 +1501,12 @@ router_rebuild_store(int flags, desc_store_t *store)
     goto done;
   }
 
+  if (!force && router_should_merge_journal(store) &&
+      router_merge_journal_into_store(store) == 0) {
+    r = 0;
+    goto done;
+  }
+
   if (store->type == EXTRAINFO_STORE)
     had_any = !eimap_isempty(routerlist->extra_info_map);
   else
@@ -1408,26 +1524,8 @@ router_rebuild_store(int flags, desc_store_t *store)
 
   chunk_list = smartlist_new();
 
-  /* We sort the routers by age to enhance locality on disk. */
   signed_descriptors = smartlist_new();
-  if (store->type == EXTRAINFO_STORE) {
-    eimap_iter_t *iter;
-    for (iter = eimap_iter_init(routerlist->extra_info_map);
-         !eimap_iter_done(iter);
-         iter = eimap_iter_next(routerlist->extra_info_map, iter)) {
-      const char *key;
-      extrainfo_t *ei;
-      eimap_iter_get(iter, &key, &ei);
-      smartlist_add(signed_descriptors, &ei->cache_info);
-    }
-  } else {
-    SMARTLIST_FOREACH(routerlist->old_routers, signed_descriptor_t *, sd,
-                      smartlist_add(signed_descriptors, sd));
-    SMARTLIST_FOREACH(routerlist->routers, routerinfo_t *, ri,
-                      smartlist_add(signed_descriptors, &ri->cache_info));
-  }
-
-  smartlist_sort(signed_descriptors, compare_signed_descriptors_by_age_);
+  desc_store_get_descriptors(store, signed_descriptors);
 
   /* Now, add the appropriate members to chunk_list */
   SMARTLIST_FOREACH_BEGIN(signed_descriptors, signed_descriptor_t *, sd) {
@@ -1469,6 +1567,7 @@ router_rebuild_store(int flags, desc_store_t *store)
 
   errno = 0;
   store->mmap = tor_mmap_file(fname);
+  cache_file_mmap_advise(store->mmap, 0);
   if (! store->mmap) {
     if (errno == ERANGE) {
       /* empty store.*/
@@ -1520,6 +1619,41 @@ router_rebuild_store(int flags, desc_store_t *store)
   return r;
 }
 
+/** Tell the kernel how we'll use <b>mm</b>, a mapping of one of our cached
+ * descriptor files: once from start to end if <b>parsing</b> is true, or
+ * else in small pieces at random, to serve descriptors from it. */
+void
+cache_file_mmap_advise(const tor_mmap_t *mm, int parsing)
+{
+  const or_options_t *options = get_options();
+  unsigned flags = parsing ? TOR_MMAP_ADVISE_SEQUENTIAL
+                           : TOR_MMAP_ADVISE_RANDOM;
+
+  if (!mm)
+    return;
+  /* We only need to start the read once; when we parse, that's then. */
+  if (options->CacheFilePrefetch)
+    flags |= TOR_MMAP_ADVISE_WILLNEED;
+  if (options->CacheFileHugePages)
+    flags |= TOR_MMAP_ADVISE_HUGEPAGE;
+  if (tor_mmap_advise(mm, flags) < 0)
+    log_debug(LD_FS, "Couldn't pass all our access hints for a cache file "
+              "to the kernel: %s", strerror(errno));
+}
+
+/** Add the mappings of our router descriptor and extra-info stores, if
+ * any, to <b>out</b>. */
+void
+router_get_store_mmaps(smartlist_t *out)
+{
+  if (!routerlist)
+    return;
+  if (routerlist->desc_store.mmap)
+    smartlist_add(out, routerlist->desc_store.mmap);
+  if (routerlist->extrainfo_store.mmap)
+    smartlist_add(out, routerlist->extrainfo_store.mmap);
+}
+
 /** Helper: Reload a cache file and its associated journal, setting metadata
  * appropriately.  If <b>extrainfo</b> is true, reload the extrainfo store;
  * else reload the router descriptor store. */
@@ -1547,6 +1681,7 @@ router_reload_router_list_impl(desc_store_t *store)
   store->mmap = tor_mmap_file(fname);
   if (store->mmap) {
     store->store_len = store->mmap->size;
+    cache_file_mmap_advise(store->mmap, 1);
     if (extrainfo)
       router_load_extrainfo_from_string(store->mmap->data,
                                         store->mmap->data+store->mmap->size,
@@ -1555,6 +1690,7 @@ router_reload_router_list_impl(desc_store_t *store)
       router_load_routers_from_string(store->mmap->data,
                                       store->mmap->data+store->mmap->size,
                                       SAVED_IN_CACHE, NULL, 0, NULL);
+    cache_file_mmap_advise(store->mmap, 0);
   }
 
   tor_free(fname);
@@ -1587,8 +1723,9 @@ router_reload_router_list_impl(desc_store_t *store)
   return 0;
 }
 
-/** Load all cached router descriptors and extra-info documents from the
- * store. Return 0 on success and -1 on failure.
+/** Load all cached router descriptors from the store. Return 0 on success
+ * and -1 on failure.  Extra-info documents are loaded separately, by
+ * router_reload_extrainfo_list(), since we don't need them to bootstrap.
  */
 int
 router_reload_router_list(void)
@@ -1596,6 +1733,17 @@ router_reload_router_list(void)
   routerlist_t *rl = router_get_routerlist();
   if (router_reload_router_list_impl(&rl->desc_store))
     return -1;
+  return 0;
+}
+
+/** Load all cached extra-info documents from the store, attaching them to
+ * the router descriptors we already have. Return 0 on success and -1 on
+ * failure.
+ */
+int
+router_reload_extrainfo_list(void)
+{
+  routerlist_t *rl = router_get_routerlist();
   if (router_reload_router_list_impl(&rl->extrainfo_store))
     return -1;
   return 0;
@@ -2333,22 +2481,22 @@ router_add_running_nodes_to_smartlist(smartlist_t *sl, int allow_invalid,
 {
   const int check_reach = !router_skip_or_reachability(get_options(),
                                                        pref_addr);
+  const smartlist_t *nodes = nodelist_get_list();
+  const uint8_t *summaries = nodelist_get_node_summaries();
   /* XXXX MOVE */
-  SMARTLIST_FOREACH_BEGIN(nodelist_get_list(), const node_t *, node) {
+  SMARTLIST_FOREACH_BEGIN(nodes, const node_t *, node) {
+    const uint8_t summary = summaries[node_sl_idx];
     if (!node->is_running ||
         (!node->is_valid && !allow_invalid))
       continue;
-    if (need_desc && !(node->ri || (node->rs && node->md)))
+    if (need_desc && !(summary & NODE_SUMMARY_HAS_DESC))
       continue;
-    if (node->ri && node->ri->purpose != ROUTER_PURPOSE_GENERAL)
+    /* Don't choose non-general nodes, or nodes we are certain can't do
+     * ntor. */
+    if (summary & (NODE_SUMMARY_NOT_GENERAL|NODE_SUMMARY_NO_NTOR))
       continue;
     if (node_is_unreliable(node, need_uptime, need_capacity, need_guard))
       continue;
-    /* Don't choose nodes if we are certain they can't do ntor */
-    if (node->rs && !routerstatus_version_supports_ntor(node->rs, 1))
-      continue;
-    if ((node->ri || node->md) && !node_has_curve25519_onion_key(node))
-      continue;
     /* Choose a node with an OR address that matches the firewall rules */
     if (direct_conn && check_reach &&
         !fascist_firewall_allows_node(node,
@@ -2450,16 +2598,117 @@ choose_array_element_by_weight(const uint64_t *entries, int n_entries)
     return -1;
 
   if (total == 0)
-    return crypto_rand_int(n_entries);
+    return crypto_fast_rand_int(n_entries);
 
   tor_assert(total < INT64_MAX);
 
-  rand_val = crypto_rand_uint64(total);
+  rand_val = crypto_fast_rand_uint64(total);
 
   return select_array_member_cumulative_timei(
                            entries, n_entries, total, rand_val);
 }
 
+/** Build and return a new alias table for choosing among the
+ * <b>n</b> entries of <b>weights</b>, each with probability proportional to
+ * its weight.  If all weights are 0, the table chooses uniformly.  The
+ * caller must have <b>n</b> \>= 1.
+ *
+ * We scale the weights to integers first, so that the construction below is
+ * exact.  This means that an entry of weight 0 can never be chosen. */
+STATIC alias_table_t *
+alias_table_new(const double *weights, int n)
+{
+  alias_table_t *table;
+  uint64_t *scaled;
+  int *small, *large;
+  int n_small = 0, n_large = 0, i;
+  double total_dbl = 0.0, scale_factor = 0.0;
+  uint64_t total = 0;
+
+  tor_assert(n >= 1);
+
+  table = tor_malloc_zero(sizeof(alias_table_t));
+  table->n = n;
+  table->threshold = tor_calloc(n, sizeof(uint64_t));
+  table->alias = tor_calloc(n, sizeof(int));
+  scaled = table->threshold;
+
+  for (i = 0; i < n; ++i)
+    total_dbl += weights[i];
+
+  /* Scale so that the sum of the weights, multiplied by n, still stays far
+   * away from overflowing. */
+  if (total_dbl > 0.0)
+    scale_factor = (((double)INT64_MAX) / 4.0) / n / total_dbl;
+  for (i = 0; i < n; ++i) {
+    uint64_t w = tor_llround(weights[i] * scale_factor);
+    total += w;
+    scaled[i] = w * n;
+  }
+
+  if (total == 0) {
+    /* Nothing has any weight: every slot keeps its own entry. */
+    table->total = 1;
+    for (i = 0; i < n; ++i) {
+      table->threshold[i] = 1;
+      table->alias[i] = i;
+    }
+    return table;
+  }
+  table->total = total;
+
+  /* Every slot has capacity <b>total</b>; the entries with less than that
+   * borrow the rest of their slot from entries with more. */
+  small = tor_calloc(n, sizeof(int));
+  large = tor_calloc(n, sizeof(int));
+  for (i = 0; i < n; ++i) {
+    table->alias[i] = i;
+    if (scaled[i] < total)
+      small[n_small++] = i;
+    else
+      large[n_large++] = i;
+  }
+  while (n_small && n_large) {
+    int s = small[--n_small];
+    int l = large[n_large - 1];
+    table->alias[s] = l;
+    scaled[l] -= total - scaled[s];
+    if (scaled[l] < total) {
+      --n_large;
+      small[n_small++] = l;
+    }
+  }
+  /* Because the arithmetic above is exact, whatever is left is full. */
+  while (n_small)
+    tor_assert(scaled[small[--n_small]] == total);
+  while (n_large)
+    tor_assert(scaled[large[--n_large]] == total);
+
+  tor_free(small);
+  tor_free(large);
+  return table;
+}
+
+/** Choose a random index from the alias table <b>table</b>. */
+STATIC int
+alias_table_choose(const alias_table_t *table)
+{
+  int idx = crypto_fast_rand_int(table->n);
+  uint64_t rand_val = crypto_fast_rand_uint64(table->total);
+  return rand_val < table->threshold[idx] ? idx : table->alias[idx];
+}
+
+/** Release all storage held by <b>table</b>. */
+STATIC void
+alias_table_free(alias_table_t *table)
+{
+  if (!table)
+    return;
+  tor_free(table->threshold);
+  tor_free(table->alias);
+  tor_free(table);
+}
+
 /** When weighting bridges, enforce these values as lower and upper
  * bound for believable bandwidth, because there is no way for us
  * to verify a bridge's bandwidth currently. */
@@ -2491,6 +2740,47 @@ kb_to_bytes(uint32_t bw)
   return (bw > (INT32_MAX/1000)) ? INT32_MAX : bw*1000;
 }
 
+/** How many weighted node lists do we remember alias tables for? */
+#define BW_CHOICE_CACHE_SIZE 8
+
+/** An alias table for choosing from one particular list of nodes with one
+ * bandwidth weighting rule. */
+typedef struct bw_choice_cache_entry_t {
+  bandwidth_weight_rule_t rule;
+  /** A copy of the list of node pointers that <b>table</b> was built for. */
+  void **nodes;
+  alias_table_t *table;
+} bw_choice_cache_entry_t;
+
+/** Alias tables for the lists of nodes we have chosen from most recently.
+ * Path selection keeps choosing from the same few lists between consensus
+ * and descriptor changes, so this lets us skip recomputing the weights of
+ * every node on every choice. */
+static bw_choice_cache_entry_t bw_choice_cache[BW_CHOICE_CACHE_SIZE];
+/** Index of the bw_choice_cache entry we will replace next. */
+static int bw_choice_cache_next = 0;
+
+/** Release the storage held by <b>ent</b>, and mark it unused. */
+static void
+bw_choice_cache_entry_clear(bw_choice_cache_entry_t *ent)
+{
+  tor_free(ent->nodes);
+  alias_table_free(ent->table);
+  ent->table = NULL;
+}
+
+/** Forget every alias table we have built for choosing nodes by bandwidth.
+ * Called whenever the consensus, the nodelist, or the descriptors that the
+ * node weights depend on may have changed. */
+void
+routerlist_clear_bandwidth_choice_cache(void)
+{
+  int i;
+  for (i = 0; i < BW_CHOICE_CACHE_SIZE; ++i)
+    bw_choice_cache_entry_clear(&bw_choice_cache[i]);
+  bw_choice_cache_next = 0;
+}
+
 /** Helper function:
  * choose a random element of smartlist <b>sl</b> of nodes, weighted by
  * the advertised bandwidth of each element using the consensus
@@ -2504,28 +2794,38 @@ kb_to_bytes(uint32_t bw)
  * Exit-to-total bandwidth.  If <b>rule</b>==WEIGHT_FOR_GUARD, we're picking a
  * guard node: consider all guard's bandwidth equally. Otherwise, weight
  * guards proportionally less.
+ *
+ * If we have recently chosen from the same list with the same rule, reuse
+ * the alias table we built then from bw_choice_cache.
  */
 static const node_t *
 smartlist_choose_node_by_bandwidth_weights(const smartlist_t *sl,
                                            bandwidth_weight_rule_t rule)
 {
+  bw_choice_cache_entry_t *ent;
   double *bandwidths_dbl=NULL;
-  uint64_t *bandwidths_u64=NULL;
+  int n = smartlist_len(sl);
+  int i;
+
+  for (i = 0; i < BW_CHOICE_CACHE_SIZE; ++i) {
+    ent = &bw_choice_cache[i];
+    if (ent->table && ent->rule == rule && ent->table->n == n &&
+        fast_memeq(ent->nodes, sl->list, n * sizeof(void *)))
+      return smartlist_get(sl, alias_table_choose(ent->table));
+  }
 
   if (compute_weighted_bandwidths(sl, rule, &bandwidths_dbl) < 0)
     return NULL;
 
-  bandwidths_u64 = tor_calloc(smartlist_len(sl), sizeof(uint64_t));
-  scale_array_elements_to_u64(bandwidths_u64, bandwidths_dbl,
-                              smartlist_len(sl), NULL);
+  ent = &bw_choice_cache[bw_choice_cache_next];
+  bw_choice_cache_next = (bw_choice_cache_next + 1) % BW_CHOICE_CACHE_SIZE;
+  bw_choice_cache_entry_clear(ent);
+  ent->rule = rule;
+  ent->nodes = tor_memdup(sl->list, n * sizeof(void *));
+  ent->table = alias_table_new(bandwidths_dbl, n);
+  tor_free(bandwidths_dbl);
 
-  {
-    int idx = choose_array_element_by_weight(bandwidths_u64,
-                                             smartlist_len(sl));
-    tor_free(bandwidths_dbl);
-    tor_free(bandwidths_u64);
-    return idx < 0 ? NULL : smartlist_get(sl, idx);
-  }
+  return smartlist_get(sl, alias_table_choose(ent->table));
 }
 
 /** Given a list of routers and a weighting rule as in
@@ -3185,9 +3485,9 @@ routerinfo_free(routerinfo_t *router)
 
   tor_free(router->cache_info.signed_descriptor_body);
   tor_free(router->nickname);
-  tor_free(router->platform);
-  tor_free(router->protocol_list);
-  tor_free(router->contact_info);
+  tor_intern_string_release(router->platform);
+  tor_intern_string_release(router->protocol_list);
+  tor_intern_string_release(router->contact_info);
   if (router->onion_pkey)
     crypto_pk_free(router->onion_pkey);
   tor_free(router->onion_curve25519_pkey);
@@ -3195,10 +3495,12 @@ routerinfo_free(routerinfo_t *router)
     crypto_pk_free(router->identity_pkey);
   tor_cert_free(router->cache_info.signing_key_cert);
   if (router->declared_family) {
-    SMARTLIST_FOREACH(router->declared_family, char *, s, tor_free(s));
+    SMARTLIST_FOREACH(router->declared_family, const char *, s,
+                      tor_intern_string_release(s));
     smartlist_free(router->declared_family);
   }
   addr_policy_list_free(router->exit_policy);
+  compiled_policy_free(router->compiled_exit_policy);
   short_policy_free(router->ipv6_exit_policy);
 
   memset(router, 77, sizeof(routerinfo_t));
@@ -3268,6 +3570,38 @@ extrainfo_free_(void *e)
   extrainfo_free(e);
 }
 
+/** Return the approximate number of heap bytes held by the bodies of
+ * <b>sd</b>, when they aren't in an mmap'd cache file. */
+static size_t
+signed_descriptor_get_body_allocation(const signed_descriptor_t *sd)
+{
+  if (sd->saved_location == SAVED_IN_CACHE || !sd->signed_descriptor_body)
+    return 0;
+  return sd->signed_descriptor_len + sd->annotations_len;
+}
+
+/** Return the approximate number of heap bytes held by our current and
+ * old router descriptors and extra-info documents. */
+size_t
+routerlist_get_total_allocation(void)
+{
+  size_t total = 0;
+
+  if (!routerlist)
+    return 0;
+  SMARTLIST_FOREACH(routerlist->routers, const routerinfo_t *, ri,
+    total += sizeof(*ri) +
+      signed_descriptor_get_body_allocation(&ri->cache_info));
+  SMARTLIST_FOREACH(routerlist->old_routers, const signed_descriptor_t *, sd,
+    total += sizeof(*sd) + signed_descriptor_get_body_allocation(sd));
+  EIMAP_FOREACH(routerlist->extra_info_map, key, ei) {
+    (void)key;
+    total += sizeof(*ei) +
+      signed_descriptor_get_body_allocation(&ei->cache_info);
+  } DIGESTMAP_FOREACH_END;
+  return total;
+}
+
 /** Free all storage held by a routerlist <b>rl</b>. */
 void
 routerlist_free(routerlist_t *rl)
@@ -3759,6 +4093,7 @@ routerlist_free_all(void)
 {
   routerlist_free(routerlist);
   routerlist = NULL;
+  routerlist_clear_bandwidth_choice_cache();
   if (warned_nicknames) {
     SMARTLIST_FOREACH(warned_nicknames, char *, cp, tor_free(cp));
     smartlist_free(warned_nicknames);
@@ -4792,7 +5127,7 @@ list_pending_downloads(digestmap_t *result, digest256map_t *result256,
 {
   const size_t p_len = strlen(prefix);
   smartlist_t *tmp = smartlist_new();
-  smartlist_t *conns = get_connection_array();
+  smartlist_t *conns = get_connection_array_by_type(CONN_TYPE_DIR);
   int flags = DSR_HEX;
   if (purpose == DIR_PURPOSE_FETCH_MICRODESC)
     flags = DSR_DIGEST256|DSR_BASE64;
@@ -4800,8 +5135,7 @@ list_pending_downloads(digestmap_t *result, digest256map_t *result256,
   tor_assert(result || result256);
 
   SMARTLIST_FOREACH_BEGIN(conns, connection_t *, conn) {
-    if (conn->type == CONN_TYPE_DIR &&
-        conn->purpose == purpose &&
+    if (conn->purpose == purpose &&
         !conn->marked_for_close) {
       const char *resource = TO_DIR_CONN(conn)->requested_resource;
       if (!strcmpstart(resource, prefix))
@@ -4860,11 +5194,10 @@ list_pending_fpsk_downloads(fp_pair_map_t *result)
   tor_assert(result);
 
   tmp = smartlist_new();
-  conns = get_connection_array();
+  conns = get_connection_array_by_type(CONN_TYPE_DIR);
 
   SMARTLIST_FOREACH_BEGIN(conns, connection_t *, conn) {
-    if (conn->type == CONN_TYPE_DIR &&
-        conn->purpose == DIR_PURPOSE_FETCH_CERTIFICATE &&
+    if (conn->purpose == DIR_PURPOSE_FETCH_CERTIFICATE &&
         !conn->marked_for_close) {
       resource = TO_DIR_CONN(conn)->requested_resource;
       if (!strcmpstart(resource, pfx))
@@ -4989,6 +5322,56 @@ max_dl_per_request(const or_options_t *options, int purpose)
 /** If we want fewer than this many descriptors, wait until we
  * want more, or until TestingClientMaxIntervalWithoutRequest has passed. */
 #define MAX_DL_TO_DELAY 16
+/** When we size a microdescriptor request by how fast its mirror has been,
+ * never make it more than this many times larger than usual (or this many
+ * times smaller).  That way, even a very fast mirror doesn't get all of a
+ * download. */
+#define MAX_DL_THROUGHPUT_SCALE 2.0
+
+/** Launch requests for the microdescriptors in <b>downloadable</b>, which
+ * must be sorted, picking each mirror before deciding how many to ask it
+ * for.  A mirror that has been faster than average gets a proportionally
+ * larger request, and a slower one gets a smaller request; one we haven't
+ * measured gets <b>n_per_request</b>.  Never ask for fewer than
+ * MIN_DL_PER_REQUEST or more than <b>max_dl_per_req</b> at once.  Return
+ * the number of requests we launched. */
+STATIC int
+launch_adaptive_microdesc_downloads(smartlist_t *downloadable,
+                                    int n_per_request, int max_dl_per_req,
+                                    int pds_flags)
+{
+  const double mean = dir_mirror_get_mean_throughput();
+  const int n_downloadable = smartlist_len(downloadable);
+  int i = 0, n_requests = 0;
+
+  while (i < n_downloadable) {
+    const routerstatus_t *rs =
+      directory_pick_mirror_for_fetch(DIR_PURPOSE_FETCH_MICRODESC, pds_flags);
+    int n = n_per_request;
+    double rate = rs ? dir_mirror_get_throughput(rs->identity_digest) : 0;
+
+    if (rate > 0 && mean > 0) {
+      double scale = rate / mean;
+      if (scale > MAX_DL_THROUGHPUT_SCALE)
+        scale = MAX_DL_THROUGHPUT_SCALE;
+      else if (scale < 1.0 / MAX_DL_THROUGHPUT_SCALE)
+        scale = 1.0 / MAX_DL_THROUGHPUT_SCALE;
+      n = (int)(n_per_request * scale + 0.5);
+    }
+    if (n > max_dl_per_req)
+      n = max_dl_per_req;
+    if (n < MIN_DL_PER_REQUEST)
+      n = MIN_DL_PER_REQUEST;
+
+    /* If we couldn't pick a mirror, let directory_get_from_dirserver()
+     * decide where to go. */
+    initiate_descriptor_downloads(rs, DIR_PURPOSE_FETCH_MICRODESC,
+                                  downloadable, i, i+n, pds_flags);
+    i += n;
+    ++n_requests;
+  }
+  return n_requests;
+}
 
 /** Given a <b>purpose</b> (FETCH_MICRODESC or FETCH_SERVERDESC) and a list of
  * router descriptor digests or microdescriptor digest256s in
@@ -5073,6 +5456,19 @@ launch_descriptor_downloads(int purpose,
   else if (n_downloadable > 1)
     rtr_plural = "s";
 
+  if (fetch_microdesc && !source && dir_mirror_get_mean_throughput() > 0) {
+    /* We know how fast some mirrors are: size each request to suit the
+     * mirror it goes to. */
+    smartlist_sort_digests(downloadable);
+    i = launch_adaptive_microdesc_downloads(downloadable, n_per_request,
+                                            max_dl_per_req, pds_flags);
+    log_info(LD_DIR, "Launched %d request%s for %d %s%s, about %d at a "
+             "time, sized by mirror throughput", i, i > 1 ? "s" : "",
+             n_downloadable, descname, rtr_plural, n_per_request);
+    last_descriptor_download_attempted = now;
+    return;
+  }
+
   log_info(LD_DIR,
            "Launching %d request%s for %d %s%s, %d at a time",
            CEIL_DIV(n_downloadable, n_per_request), req_plural,
@@ -5086,6 +5482,103 @@ launch_descriptor_downloads(int purpose,
   last_descriptor_download_attempted = now;
 }
 
+/** A microdescriptor request is a straggler if it has been running for at
+ * least this many msec... */
+#define STRAGGLER_MIN_MSEC (10*1000)
+/** ...and for this many times as long as we'd expect from its mirror's
+ * measured throughput. */
+#define STRAGGLER_EXPECTED_TIME_FACTOR 3
+
+/** Look for microdescriptor requests that have been running much longer
+ * than we would expect.  For each one, ask the fastest other mirror we've
+ * measured for whichever of its microdescriptors we still don't have.
+ * Whichever copy arrives first, directory.c closes the other request once
+ * it has nothing left to give us. */
+void
+relaunch_straggling_microdesc_downloads(void)
+{
+  microdesc_cache_t *cache;
+  smartlist_t *stragglers;
+  uint64_t now_msec;
+  int i;
+
+  if (dir_mirror_get_mean_throughput() <= 0)
+    return;
+
+  cache = get_microdesc_cache();
+  stragglers = smartlist_new();
+  now_msec = monotime_coarse_absolute_msec();
+
+  SMARTLIST_FOREACH_BEGIN(get_connection_array_by_type(CONN_TYPE_DIR),
+                          connection_t *, conn) {
+    dir_connection_t *dir_conn;
+    smartlist_t *wanted;
+    uint64_t elapsed, threshold = STRAGGLER_MIN_MSEC;
+    double rate;
+    if (conn->purpose != DIR_PURPOSE_FETCH_MICRODESC ||
+        conn->marked_for_close ||
+        conn->state >= DIR_CONN_STATE_CLIENT_FINISHED)
+      continue;
+    dir_conn = TO_DIR_CONN(conn);
+    if (dir_conn->straggler_relaunched || !dir_conn->requested_resource ||
+        strcmpstart(dir_conn->requested_resource, "d/"))
+      continue;
+    elapsed = now_msec - dir_conn->request_started_msec;
+    if (elapsed < threshold)
+      continue;
+
+    wanted = smartlist_new();
+    dir_split_resource_into_fingerprints(dir_conn->requested_resource+2,
+                                         wanted, NULL,
+                                         DSR_DIGEST256|DSR_BASE64);
+    rate = dir_mirror_get_throughput(dir_conn->identity_digest);
+    if (rate > 0) {
+      uint64_t expected = (uint64_t)(smartlist_len(wanted) * 1000.0 / rate);
+      if (expected * STRAGGLER_EXPECTED_TIME_FACTOR > threshold)
+        threshold = expected * STRAGGLER_EXPECTED_TIME_FACTOR;
+    }
+    SMARTLIST_FOREACH_BEGIN(wanted, char *, d) {
+      if (elapsed < threshold ||
+          microdesc_cache_lookup_by_digest256(cache, d)) {
+        /* Not slow yet, or we already have this one. */
+        SMARTLIST_DEL_CURRENT(wanted, d);
+        tor_free(d);
+      }
+    } SMARTLIST_FOREACH_END(d);
+    if (smartlist_len(wanted)) {
+      const routerstatus_t *rs =
+        dir_mirror_pick_fastest(dir_conn->identity_digest, rate);
+      if (rs) {
+        log_info(LD_DIR, "Our request to %s:%d for microdescriptors has "
+                 "taken %d msec; asking %s for the %d we still want.",
+                 conn->address, (int)conn->port, (int)elapsed,
+                 routerstatus_describe(rs), smartlist_len(wanted));
+        dir_conn->straggler_relaunched = 1;
+        smartlist_sort_digests256(wanted);
+        smartlist_add(stragglers, (void*)rs);
+        smartlist_add(stragglers, wanted);
+        wanted = NULL;
+      }
+    }
+    if (wanted) {
+      SMARTLIST_FOREACH(wanted, char *, d, tor_free(d));
+      smartlist_free(wanted);
+    }
+  } SMARTLIST_FOREACH_END(conn);
+
+  /* Launch the new requests only once we're done looking at the connection
+   * array, since launching them adds to it. */
+  for (i = 0; i < smartlist_len(stragglers); i += 2) {
+    const routerstatus_t *rs = smartlist_get(stragglers, i);
+    smartlist_t *wanted = smartlist_get(stragglers, i+1);
+    initiate_descriptor_downloads(rs, DIR_PURPOSE_FETCH_MICRODESC, wanted,
+                                  0, smartlist_len(wanted), 0);
+    SMARTLIST_FOREACH(wanted, char *, d, tor_free(d));
+    smartlist_free(wanted);
+  }
+  smartlist_free(stragglers);
+}
+
 /** For any descriptor that we want that's currently listed in
  * <b>consensus</b>, download it as appropriate. */
 void
@@ -5776,5 +6269,6 @@ refresh_all_country_info(void)
     routerset_refresh_countries(options->ExcludeExitNodesUnion_);
 
   nodelist_refresh_countries();
+  nodelist_invalidate_node_summaries();
 }
 
@@ -40,7 +40,10 @@ void authority_cert_dl_failed(const char *id_digest,
                               const char *signing_key_digest, int status);
 void authority_certs_fetch_missing(networkstatus_t *status, time_t now,
                                    const char *dir_hint);
+void cache_file_mmap_advise(const tor_mmap_t *mm, int parsing);
+void router_get_store_mmaps(smartlist_t *out);
 int router_reload_router_list(void);
+int router_reload_extrainfo_list(void);
 int authority_cert_dl_looks_uncertain(const char *id_digest);
 const smartlist_t *router_get_trusted_dir_servers(void);
 const smartlist_t *router_get_fallback_dir_servers(void);
@@ -73,6 +76,7 @@ uint32_t router_get_advertised_bandwidth_capped(const routerinfo_t *router);
 
 const node_t *node_sl_choose_by_bandwidth(const smartlist_t *sl,
                                           bandwidth_weight_rule_t rule);
+void routerlist_clear_bandwidth_choice_cache(void);
 double frac_nodes_with_descriptors(const smartlist_t *sl,
                                    bandwidth_weight_rule_t rule);
 
@@ -100,6 +104,7 @@ routerlist_t *router_get_routerlist(void);
 void routerinfo_free(routerinfo_t *router);
 void extrainfo_free(extrainfo_t *extrainfo);
 void routerlist_free(routerlist_t *rl);
+size_t routerlist_get_total_allocation(void);
 void dump_routerlist_mem_usage(int severity);
 void routerlist_remove(routerlist_t *rl, routerinfo_t *ri, int make_old,
                        time_t now);
@@ -221,6 +226,7 @@ void launch_descriptor_downloads(int purpose,
                                  smartlist_t *downloadable,
                                  const routerstatus_t *source,
                                  time_t now);
+void relaunch_straggling_microdesc_downloads(void);
 
 int hex_digest_nickname_decode(const char *hexdigest,
                                char *digest_out,
@@ -237,6 +243,23 @@ STATIC void scale_array_elements_to_u64(uint64_t *entries_out,
                                         const double *entries_in,
                                         int n_entries,
                                         uint64_t *total_out);
+
+/** A Walker alias table: a structure for choosing an index among
+ * <b>n</b> weighted entries in constant time. */
+typedef struct alias_table_t {
+  /** Number of entries in the table. */
+  int n;
+  /** Every slot has this capacity. */
+  uint64_t total;
+  /** We keep slot <b>i</b> with probability threshold[i] / total... */
+  uint64_t *threshold;
+  /** ...and otherwise choose the entry alias[i]. */
+  int *alias;
+} alias_table_t;
+
+STATIC alias_table_t *alias_table_new(const double *weights, int n);
+STATIC int alias_table_choose(const alias_table_t *table);
+STATIC void alias_table_free(alias_table_t *table);
 STATIC const routerstatus_t *router_pick_directory_server_impl(
                                            dirinfo_type_t auth, int flags,
                                            int *n_busy_out);
@@ -249,9 +272,17 @@ MOCK_DECL(STATIC was_router_added_t, extrainfo_insert,
 MOCK_DECL(STATIC void, initiate_descriptor_downloads,
           (const routerstatus_t *source, int purpose, smartlist_t *digests,
            int lo, int hi, int pds_flags));
+STATIC int launch_adaptive_microdesc_downloads(smartlist_t *downloadable,
+                                               int n_per_request,
+                                               int max_dl_per_req,
+                                               int pds_flags);
 STATIC int router_is_already_dir_fetching(const tor_addr_port_t *ap,
                                           int serverdesc, int microdesc);
 
+#define RRS_FORCE 1
+#define RRS_DONT_REMOVE_OLD 2
+STATIC int router_rebuild_store(int flags, desc_store_t *store);
+
 #endif
 
 #endif
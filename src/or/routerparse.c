@@ -58,6 +58,7 @@
 #include "or.h"
 #include "config.h"
 #include "circuitstats.h"
+#include "cpuworker.h"
 #include "dirserv.h"
 #include "dirvote.h"
 #include "policies.h"
@@ -270,6 +271,8 @@ typedef enum {
   NEED_SKEY_1024,/**< Object is required, and must be a 1024 bit private key */
   NEED_KEY_1024, /**< Object is required, and must be a 1024 bit public key */
   NEED_KEY,      /**< Object is required, and must be a public key. */
+  NEED_RAW_KEY,  /**< Object is required, and must be a public key; leave it
+                  * undecoded in object_body. */
   OBJ_OK,        /**< Object is optional. */
 } obj_syntax;
 
@@ -280,6 +283,9 @@ typedef enum {
 typedef struct token_rule_t {
   /** The string value of the keyword identifying the type of item. */
   const char *t;
+  /** The length of <b>t</b>, so that the tokenizer can pass over keywords
+   * of the wrong length without comparing them. */
+  size_t t_len;
   /** The corresponding directory_keyword enum. */
   directory_keyword v;
   /** Minimum number of arguments for this item */
@@ -312,23 +318,23 @@ typedef struct token_rule_t {
 /**@{*/
 
 /** Appears to indicate the end of a table. */
-#define END_OF_TABLE { NULL, NIL_, 0,0,0, NO_OBJ, 0, INT_MAX, 0, 0 }
+#define END_OF_TABLE { NULL, 0, NIL_, 0,0,0, NO_OBJ, 0, INT_MAX, 0, 0 }
 /** An item with no restrictions: used for obsolete document types */
-#define T(s,t,a,o)    { s, t, a, o, 0, INT_MAX, 0, 0 }
+#define T(s,t,a,o)    { s, sizeof(s)-1, t, a, o, 0, INT_MAX, 0, 0 }
 /** An item with no restrictions on multiplicity or location. */
-#define T0N(s,t,a,o)  { s, t, a, o, 0, INT_MAX, 0, 0 }
+#define T0N(s,t,a,o)  { s, sizeof(s)-1, t, a, o, 0, INT_MAX, 0, 0 }
 /** An item that must appear exactly once */
-#define T1(s,t,a,o)   { s, t, a, o, 1, 1, 0, 0 }
+#define T1(s,t,a,o)   { s, sizeof(s)-1, t, a, o, 1, 1, 0, 0 }
 /** An item that must appear exactly once, at the start of the document */
-#define T1_START(s,t,a,o)   { s, t, a, o, 1, 1, AT_START, 0 }
+#define T1_START(s,t,a,o)   { s, sizeof(s)-1, t, a, o, 1, 1, AT_START, 0 }
 /** An item that must appear exactly once, at the end of the document */
-#define T1_END(s,t,a,o)   { s, t, a, o, 1, 1, AT_END, 0 }
+#define T1_END(s,t,a,o)   { s, sizeof(s)-1, t, a, o, 1, 1, AT_END, 0 }
 /** An item that must appear one or more times */
-#define T1N(s,t,a,o)  { s, t, a, o, 1, INT_MAX, 0, 0 }
+#define T1N(s,t,a,o)  { s, sizeof(s)-1, t, a, o, 1, INT_MAX, 0, 0 }
 /** An item that must appear no more than once */
-#define T01(s,t,a,o)  { s, t, a, o, 0, 1, 0, 0 }
+#define T01(s,t,a,o)  { s, sizeof(s)-1, t, a, o, 0, 1, 0, 0 }
 /** An annotation that must appear no more than once */
-#define A01(s,t,a,o)  { s, t, a, o, 0, 1, 0, 1 }
+#define A01(s,t,a,o)  { s, sizeof(s)-1, t, a, o, 0, 1, 0, 1 }
 
 /** Argument multiplicity: any number of arguments. */
 #define ARGS        0,INT_MAX,0
@@ -597,7 +603,7 @@ static token_rule_t networkstatus_detached_signature_token_table[] = {
 
 /** List of tokens recognized in microdescriptors */
 static token_rule_t microdesc_token_table[] = {
-  T1_START("onion-key",        K_ONION_KEY,        NO_ARGS,     NEED_KEY_1024),
+  T1_START("onion-key",        K_ONION_KEY,        NO_ARGS,     NEED_RAW_KEY),
   T01("ntor-onion-key",        K_ONION_KEY_NTOR,   GE(1),       NO_OBJ ),
   T0N("id",                    K_ID,               GE(2),       NO_OBJ ),
   T0N("a",                     K_A,                GE(1),       NO_OBJ ),
@@ -658,6 +664,47 @@ static int check_signature_token(const char *digest,
                                  crypto_pk_t *pkey,
                                  int flags,
                                  const char *doctype);
+/** The ed25519 signatures from one router or extra-info descriptor, whose
+ * checking router_parse_list_from_string() has put off so that it can check
+ * the signatures from every descriptor in a single batch. */
+typedef struct deferred_ed_checks_t {
+  /** The signatures to check.  The messages and keys point into the
+   * descriptor's signing cert, <b>ntor_cc_cert</b>, and this structure. */
+  ed25519_checkable_t check[3];
+  /** How many entries of <b>check</b> are in use? */
+  int n_checks;
+  /** The digest that the descriptor's own ed25519 signature covers. */
+  uint8_t d256[DIGEST256_LEN];
+  /** The ed25519 form of the router's ntor onion key. */
+  ed25519_public_key_t ntor_cc_pk;
+  /** The ntor onion key cross-certificate, if any. */
+  tor_cert_t *ntor_cc_cert;
+  /** The routerinfo_t or extrainfo_t that we parsed, and its type. */
+  void *elt;
+  int is_extrainfo;
+  /** Where the descriptor starts, for dump_desc(). */
+  const char *desc;
+  /** The descriptor's digest, if we could compute one. */
+  char raw_digest[DIGEST_LEN];
+  int have_raw_digest;
+} deferred_ed_checks_t;
+
+static routerinfo_t *router_parse_entry_impl(const char *s, const char *end,
+                                   int cache_copy, int allow_annotations,
+                                   const char *prepend_annotations,
+                                   int *can_dl_again_out,
+                                   deferred_ed_checks_t **deferred_out);
+static extrainfo_t *extrainfo_parse_entry_impl(const char *s,
+                           const char *end, int cache_copy,
+                           struct digest_ri_map_t *routermap,
+                           int *can_dl_again_out,
+                           deferred_ed_checks_t **deferred_out);
+static routerstatus_t *routerstatus_parse_entry_from_tokens(
+                                     const char *s_dup, smartlist_t *tokens,
+                                     networkstatus_t *vote,
+                                     vote_routerstatus_t *vote_rs,
+                                     int consensus_method,
+                                     consensus_flavor_t flav);
 
 #undef DEBUG_AREA_ALLOC
 
@@ -681,6 +728,9 @@ STATIC uint64_t len_descs_dumped = 0;
 /** Directory to stash dumps in */
 static int have_dump_desc_dir = 0;
 static int problem_with_dump_desc_dir = 0;
+/** True iff we found a dump directory at startup, and haven't yet loaded
+ * the dumps in it into the FIFO. */
+static int dump_desc_fifo_needs_populate = 0;
 
 #define DESC_DUMP_DATADIR_SUBDIR "unparseable-descs"
 #define DESC_DUMP_BASE_FILENAME "unparseable-desc"
@@ -737,13 +787,31 @@ dump_desc_init(void)
       problem_with_dump_desc_dir = 1;
   }
 
+  /* Reading and hashing every old dump can take a while, and most of the
+   * time we never dump anything; wait until we do before loading them. */
   if (have_dump_desc_dir && !problem_with_dump_desc_dir) {
-    dump_desc_populate_fifo_from_directory(dump_desc_dir);
+    dump_desc_fifo_needs_populate = 1;
   }
 
   tor_free(dump_desc_dir);
 }
 
+/** If we haven't yet loaded the dumps that were in the dump directory at
+ * startup into the FIFO, do so now. */
+static void
+dump_desc_populate_fifo_if_needed(void)
+{
+  char *dump_desc_dir;
+
+  if (!dump_desc_fifo_needs_populate)
+    return;
+  dump_desc_fifo_needs_populate = 0;
+
+  dump_desc_dir = get_datadir_fname(DESC_DUMP_DATADIR_SUBDIR);
+  dump_desc_populate_fifo_from_directory(dump_desc_dir);
+  tor_free(dump_desc_dir);
+}
+
 /** Create the dump directory if needed and possible */
 static void
 dump_desc_create_dir(void)
@@ -775,10 +843,10 @@ dump_desc_create_dir(void)
 /** Dump desc FIFO/cleanup; take ownership of the given filename, add it to
  * the FIFO, and clean up the oldest entries to the extent they exceed the
  * configured cap.  If any old entries with a matching hash existed, they
- * just got overwritten right before this was called and we should adjust
- * the total size counter without deleting them.
+ * are about to be overwritten and we should adjust the total size counter
+ * without deleting them.  Return the new entry.
  */
-static void
+static dumped_desc_t *
 dump_desc_fifo_add_and_clean(char *filename, const uint8_t *digest_sha256,
                              size_t len)
 {
@@ -815,8 +883,10 @@ dump_desc_fifo_add_and_clean(char *filename, const uint8_t *digest_sha256,
      * something we just emitted if we get repeated identical descriptors.
      */
     if (strcmp(tmp->filename, filename) != 0) {
-      /* Delete it and adjust the length counter */
-      tor_unlink(tmp->filename);
+      /* Delete it and adjust the length counter.  If a cpuworker is still
+       * writing it, dump_desc_write_replyfn() will delete it instead. */
+      if (!tmp->pending_write)
+        tor_unlink(tmp->filename);
       tor_assert(len_descs_dumped >= tmp->len);
       len_descs_dumped -= tmp->len;
       log_info(LD_DIR,
@@ -844,6 +914,7 @@ dump_desc_fifo_add_and_clean(char *filename, const uint8_t *digest_sha256,
   /* Append our entry to the end of the list and bump the counter */
   smartlist_add(descs_dumped, ent);
   len_descs_dumped += len;
+  return ent;
 }
 
 /** Check if we already have a descriptor for this hash and move it to the
@@ -1140,6 +1211,89 @@ dump_desc_populate_fifo_from_directory(const char *dirname)
   smartlist_free(files);
 }
 
+/** A descriptor dump we've handed to a cpuworker to write out. */
+typedef struct dump_desc_write_t {
+  /** The file to write. */
+  char *filename;
+  /** The descriptor to write to it. */
+  char *desc;
+  /** SHA-256 of <b>desc</b>, so we can find its FIFO entry again. */
+  uint8_t digest_sha256[DIGEST256_LEN];
+  /** 0 if we wrote the file, -1 if we failed. */
+  int status;
+} dump_desc_write_t;
+
+/** Cpuworker callback: write out the dump for <b>job_</b>. */
+static workqueue_reply_t
+dump_desc_write_threadfn(void *state_, void *job_)
+{
+  dump_desc_write_t *job = job_;
+  (void)state_;
+  job->status = write_str_to_file(job->filename, job->desc, 1);
+  return WQ_RPL_REPLY;
+}
+
+/** Main-thread callback for a dump written by dump_desc_write_threadfn().
+ * If its FIFO entry went away in the meantime, delete the file we just
+ * wrote; if we couldn't write it, forget the entry. Release <b>job_</b>. */
+static void
+dump_desc_write_replyfn(void *job_)
+{
+  dump_desc_write_t *job = job_;
+  dumped_desc_t *match = NULL;
+  int match_idx = -1;
+
+  if (descs_dumped) {
+    SMARTLIST_FOREACH_BEGIN(descs_dumped, dumped_desc_t *, ent) {
+      if (tor_memeq(ent->digest_sha256, job->digest_sha256, DIGEST256_LEN)) {
+        match = ent;
+        match_idx = ent_sl_idx;
+        break;
+      }
+    } SMARTLIST_FOREACH_END(ent);
+  }
+
+  if (!match) {
+    /* It was cleaned out of the FIFO while we were writing it. */
+    if (job->status == 0)
+      tor_unlink(job->filename);
+  } else if (match->pending_write == job) {
+    match->pending_write = NULL;
+    if (job->status < 0) {
+      log_info(LD_DIR, "Couldn't write unparseable descriptor dump %s",
+               job->filename);
+      smartlist_del_keeporder(descs_dumped, match_idx);
+      tor_assert(len_descs_dumped >= match->len);
+      len_descs_dumped -= match->len;
+      tor_free(match->filename);
+      tor_free(match);
+    }
+  }
+
+  tor_free(job->filename);
+  tor_free(job->desc);
+  tor_free(job);
+}
+
+/** Write <b>desc</b> out to the dump file for <b>ent</b>, on a cpuworker if
+ * we have them, so that a burst of bad descriptors doesn't stall the main
+ * thread on disk I/O. */
+static void
+dump_desc_write(dumped_desc_t *ent, const char *desc, size_t len)
+{
+  dump_desc_write_t *job = tor_malloc_zero(sizeof(*job));
+  job->filename = tor_strdup(ent->filename);
+  job->desc = tor_memdup_nulterm(desc, len);
+  memcpy(job->digest_sha256, ent->digest_sha256, DIGEST256_LEN);
+  ent->pending_write = job;
+
+  if (!cpuworker_queue_work(WQ_PRI_LOW, dump_desc_write_threadfn,
+                            dump_desc_write_replyfn, job)) {
+    dump_desc_write_threadfn(NULL, job);
+    dump_desc_write_replyfn(job);
+  }
+}
+
 /** For debugging purposes, dump unparseable descriptor *<b>desc</b> of
  * type *<b>type</b> to file $DATADIR/unparseable-desc. Do not write more
  * than one descriptor to disk per minute. If there is already such a
@@ -1183,19 +1337,21 @@ dump_desc(const char *desc, const char *type)
    */
   if (!(sandbox_is_active() || get_options()->Sandbox)) {
     if (len <= get_options()->MaxUnparseableDescSizeToLog) {
+      dump_desc_populate_fifo_if_needed();
       if (!dump_desc_fifo_bump_hash(digest_sha256)) {
         /* Create the directory if needed */
         dump_desc_create_dir();
         /* Make sure we've got it */
         if (have_dump_desc_dir && !problem_with_dump_desc_dir) {
-          /* Write it, and tell the main log about it */
-          write_str_to_file(debugfile, desc, 1);
+          dumped_desc_t *ent;
+          /* Tell the main log about it, and queue the write */
           log_info(LD_DIR,
                    "Unable to parse descriptor of type %s with hash %s and "
                    "length %lu. See file %s in data directory for details.",
                    type, digest_sha256_hex, (unsigned long)len,
                    debugfile_base);
-          dump_desc_fifo_add_and_clean(debugfile, digest_sha256, len);
+          ent = dump_desc_fifo_add_and_clean(debugfile, digest_sha256, len);
+          dump_desc_write(ent, desc, len);
           /* Since we handed ownership over, don't free debugfile later */
           debugfile = NULL;
         } else {
@@ -1471,6 +1627,84 @@ dir_signing_key_is_trusted(crypto_pk_t *key)
   return 1;
 }
 
+/** How many good RSA signatures does check_signed_digest() remember?  Must
+ * be a power of two. */
+#define SIGNATURE_CACHE_SIZE 1024
+/** A direct-mapped table of the signatures that check_signed_digest() has
+ * found good, each identified by the SHA256 of the key digest, the signed
+ * digest, and the signature. */
+static uint8_t signature_cache[SIGNATURE_CACHE_SIZE][DIGEST256_LEN];
+/** How many checks were answered from signature_cache? */
+static uint64_t n_signature_cache_hits = 0;
+/** How many checks did we actually have to do? */
+static uint64_t n_signature_cache_misses = 0;
+
+/** Check whether the <b>sig_len</b>-byte RSA signature <b>sig</b> is a good
+ * signature for the <b>digest_len</b>-byte <b>digest</b> using the key
+ * <b>pkey</b>.  Return 0 if it is, -1 if the signature can't be read with
+ * the key, and -2 if it was made over something else.
+ *
+ * We see the same signed documents over and over (certificates and
+ * consensuses reloaded from disk, detached signatures fetched again), so
+ * remember recent good signatures rather than redoing the public key
+ * operation every time. */
+int
+check_signed_digest(crypto_pk_t *pkey, const char *digest, size_t digest_len,
+                    const char *sig, size_t sig_len)
+{
+  char key_digest[DIGEST_LEN];
+  uint8_t cache_key[DIGEST256_LEN];
+  uint8_t len_byte = (uint8_t) digest_len;
+  crypto_digest_t *d;
+  char *signed_digest;
+  size_t keysize;
+  int idx, r;
+
+  tor_assert(digest_len <= DIGEST256_LEN);
+
+  if (crypto_pk_get_digest(pkey, key_digest) < 0)
+    return -1;
+  d = crypto_digest256_new(DIGEST_SHA256);
+  crypto_digest_add_bytes(d, key_digest, DIGEST_LEN);
+  crypto_digest_add_bytes(d, (const char *)&len_byte, 1);
+  crypto_digest_add_bytes(d, digest, digest_len);
+  crypto_digest_add_bytes(d, sig, sig_len);
+  crypto_digest_get_digest(d, (char *)cache_key, sizeof(cache_key));
+  crypto_digest_free(d);
+
+  idx = get_uint32(cache_key) & (SIGNATURE_CACHE_SIZE - 1);
+  if (fast_memeq(signature_cache[idx], cache_key, DIGEST256_LEN)) {
+    ++n_signature_cache_hits;
+    return 0;
+  }
+  ++n_signature_cache_misses;
+
+  keysize = crypto_pk_keysize(pkey);
+  signed_digest = tor_malloc(keysize);
+  if (crypto_pk_public_checksig(pkey, signed_digest, keysize,
+                                sig, sig_len) < (int)digest_len) {
+    r = -1;
+  } else if (tor_memneq(digest, signed_digest, digest_len)) {
+    r = -2;
+  } else {
+    memcpy(signature_cache[idx], cache_key, DIGEST256_LEN);
+    r = 0;
+  }
+  tor_free(signed_digest);
+  return r;
+}
+
+/** Log how well check_signed_digest()'s cache is working, at log level
+ * <b>severity</b>. */
+void
+dump_signature_cache_stats(int severity)
+{
+  tor_log(severity, LD_MM, "RSA signature cache: "U64_FORMAT" hits, "
+          U64_FORMAT" misses.",
+          U64_PRINTF_ARG(n_signature_cache_hits),
+          U64_PRINTF_ARG(n_signature_cache_misses));
+}
+
 /** Check whether the object body of the token in <b>tok</b> has a good
  * signature for <b>digest</b> using key <b>pkey</b>.  If
  * <b>CST_CHECK_AUTHORITY</b> is set, make sure that <b>pkey</b> is the key of
@@ -1487,8 +1721,7 @@ check_signature_token(const char *digest,
                       int flags,
                       const char *doctype)
 {
-  char *signed_digest;
-  size_t keysize;
+  int r;
   const int check_authority = (flags & CST_CHECK_AUTHORITY);
   const int check_objtype = ! (flags & CST_NO_CHECK_OBJTYPE);
 
@@ -1510,23 +1743,15 @@ check_signature_token(const char *digest,
     }
   }
 
-  keysize = crypto_pk_keysize(pkey);
-  signed_digest = tor_malloc(keysize);
-  if (crypto_pk_public_checksig(pkey, signed_digest, keysize,
-                                tok->object_body, tok->object_size)
-      < digest_len) {
+  r = check_signed_digest(pkey, digest, digest_len,
+                          tok->object_body, tok->object_size);
+  if (r == -1) {
     log_warn(LD_DIR, "Error reading %s: invalid signature.", doctype);
-    tor_free(signed_digest);
     return -1;
-  }
-  //  log_debug(LD_DIR,"Signed %s hash starts %s", doctype,
-  //            hex_str(signed_digest,4));
-  if (tor_memneq(digest, signed_digest, digest_len)) {
+  } else if (r < 0) {
     log_warn(LD_DIR, "Error reading %s: signature does not match.", doctype);
-    tor_free(signed_digest);
     return -1;
   }
-  tor_free(signed_digest);
   return 0;
 }
 
@@ -1568,28 +1793,143 @@ find_start_of_next_router_or_extrainfo(const char **s_ptr,
   return -1;
 }
 
-/** Given a string *<b>s</b> containing a concatenated sequence of router
- * descriptors (or extra-info documents if <b>is_extrainfo</b> is set), parses
- * them and stores the result in <b>dest</b>.  All routers are marked running
- * and valid.  Advances *s to a point immediately following the last router
- * entry.  Ignore any trailing router entries that are not complete.
- *
- * If <b>saved_location</b> isn't SAVED_IN_CACHE, make a local copy of each
- * descriptor in the signed_descriptor_body field of each routerinfo_t.  If it
- * isn't SAVED_NOWHERE, remember the offset of each descriptor.
- *
- * Returns 0 on success and -1 on failure.  Adds a digest to
- * <b>invalid_digests_out</b> for every entry that was unparseable or
- * invalid. (This may cause duplicate entries.)
- */
+/** Allocate and return a deferred_ed_checks_t holding a copy of the
+ * <b>n_checks</b> checks in <b>checks</b>, where any check of the digest
+ * <b>d256</b> is redirected to a copy of it.  Other pointers in the checks
+ * must stay valid as long as the result does. */
+static deferred_ed_checks_t *
+deferred_ed_checks_new(const ed25519_checkable_t *checks, int n_checks,
+                       const uint8_t *d256)
+{
+  deferred_ed_checks_t *d = tor_malloc_zero(sizeof(deferred_ed_checks_t));
+  int i;
+  tor_assert(n_checks <= (int)ARRAY_LENGTH(d->check));
+  memcpy(d->check, checks, n_checks * sizeof(ed25519_checkable_t));
+  d->n_checks = n_checks;
+  memcpy(d->d256, d256, DIGEST256_LEN);
+  for (i = 0; i < n_checks; ++i) {
+    if (d->check[i].msg == d256)
+      d->check[i].msg = d->d256;
+  }
+  return d;
+}
+
+/** Release storage held by <b>d</b>, but not d-\>elt. */
+static void
+deferred_ed_checks_free(deferred_ed_checks_t *d)
+{
+  if (!d)
+    return;
+  tor_cert_free(d->ntor_cc_cert);
+  tor_free(d);
+}
+
+/** The ed25519 signature checks from a run of descriptors, which
+ * router_parse_list_from_string_unchecked() has left for later. */
+struct desc_sig_checks_t {
+  /** A list of deferred_ed_checks_t, one for each descriptor with ed25519
+   * signatures. */
+  smartlist_t *deferred;
+  /** The total number of signatures to check. */
+  int n_checks;
+  /** Once desc_sig_checks_run() is done, oks[i] is true iff the i'th
+   * signature was good. */
+  int *oks;
+  /** True iff desc_sig_checks_run() found every signature good. */
+  int all_ok;
+};
+
+/** Check all the signatures in <b>c</b>, in one batch.  This touches
+ * nothing but <b>c</b> and the descriptors it refers to, so it is safe to
+ * call from a cpuworker thread while the main thread leaves those
+ * descriptors alone. */
+void
+desc_sig_checks_run(desc_sig_checks_t *c)
+{
+  ed25519_checkable_t *checks;
+  int idx = 0;
+
+  tor_assert(c);
+  c->all_ok = 1;
+  if (!c->n_checks)
+    return;
+
+  checks = tor_calloc(c->n_checks, sizeof(ed25519_checkable_t));
+  c->oks = tor_calloc(c->n_checks, sizeof(int));
+  SMARTLIST_FOREACH_BEGIN(c->deferred, deferred_ed_checks_t *, d) {
+    memcpy(checks + idx, d->check, d->n_checks * sizeof(ed25519_checkable_t));
+    idx += d->n_checks;
+  } SMARTLIST_FOREACH_END(d);
+
+  /* The batch verifier checks each signature on its own when a batch
+   * fails, so oks tells us exactly which ones were bad. */
+  if (ed25519_checksig_batch(c->oks, checks, c->n_checks) < 0)
+    c->all_ok = 0;
+  tor_free(checks);
+}
+
+/** Given the checks <b>c</b> for the descriptors in <b>dest</b>, after
+ * desc_sig_checks_run(): remove every descriptor with a bad signature from
+ * <b>dest</b> and free it, noting its digest in <b>invalid_digests_out</b>
+ * if provided, just as if it had failed to parse.  Frees <b>c</b>.  Main
+ * thread only. */
+void
+desc_sig_checks_finish(desc_sig_checks_t *c, smartlist_t *dest,
+                       smartlist_t *invalid_digests_out)
+{
+  int idx = 0;
+
+  if (!c)
+    return;
+
+  if (!c->all_ok) {
+    SMARTLIST_FOREACH_BEGIN(c->deferred, deferred_ed_checks_t *, d) {
+      int i, all_ok = 1, pos;
+      for (i = 0; i < d->n_checks; ++i) {
+        if (!c->oks[idx + i])
+          all_ok = 0;
+      }
+      idx += d->n_checks;
+      if (all_ok)
+        continue;
+
+      log_warn(LD_DIR, "Incorrect ed25519 signature(s)");
+      dump_desc(d->desc, d->is_extrainfo ? "extra-info descriptor" :
+                "router descriptor");
+      if (d->have_raw_digest && invalid_digests_out)
+        smartlist_add(invalid_digests_out,
+                      tor_memdup(d->raw_digest, DIGEST_LEN));
+      pos = smartlist_pos(dest, d->elt);
+      tor_assert(pos >= 0);
+      smartlist_del_keeporder(dest, pos);
+      if (d->is_extrainfo)
+        extrainfo_free(d->elt);
+      else
+        routerinfo_free(d->elt);
+    } SMARTLIST_FOREACH_END(d);
+  }
+
+  SMARTLIST_FOREACH(c->deferred, deferred_ed_checks_t *, d,
+                    deferred_ed_checks_free(d));
+  smartlist_free(c->deferred);
+  tor_free(c->oks);
+  tor_free(c);
+}
+
+/** As router_parse_list_from_string(), but don't check any of the ed25519
+ * signatures: put off those checks to *<b>checks_out</b>, for the caller to
+ * pass to desc_sig_checks_run() and then, with <b>dest</b>, to
+ * desc_sig_checks_finish().  Until then, the caller must not touch the
+ * descriptors in <b>dest</b>, or the string they came from. */
 int
-router_parse_list_from_string(const char **s, const char *eos,
-                              smartlist_t *dest,
-                              saved_location_t saved_location,
-                              int want_extrainfo,
-                              int allow_annotations,
-                              const char *prepend_annotations,
-                              smartlist_t *invalid_digests_out)
+router_parse_list_from_string_unchecked(const char **s, const char *eos,
+                                        smartlist_t *dest,
+                                        saved_location_t saved_location,
+                                        int want_extrainfo,
+                                        int allow_annotations,
+                                        const char *prepend_annotations,
+                                        smartlist_t *invalid_digests_out,
+                                        desc_sig_checks_t **checks_out)
 {
   routerinfo_t *router;
   extrainfo_t *extrainfo;
@@ -1597,10 +1937,13 @@ router_parse_list_from_string(const char **s, const char *eos,
   void *elt;
   const char *end, *start;
   int have_extrainfo;
+  desc_sig_checks_t *checks = tor_malloc_zero(sizeof(desc_sig_checks_t));
+  smartlist_t *deferred_checks = checks->deferred = smartlist_new();
 
   tor_assert(s);
   tor_assert(*s);
   tor_assert(dest);
+  tor_assert(checks_out);
 
   start = *s;
   if (!eos)
@@ -1612,6 +1955,7 @@ router_parse_list_from_string(const char **s, const char *eos,
     char raw_digest[DIGEST_LEN];
     int have_raw_digest = 0;
     int dl_again = 0;
+    deferred_ed_checks_t *deferred = NULL;
     if (find_start_of_next_router_or_extrainfo(s, eos, &have_extrainfo) < 0)
       break;
 
@@ -1629,19 +1973,21 @@ router_parse_list_from_string(const char **s, const char *eos,
     if (have_extrainfo && want_extrainfo) {
       routerlist_t *rl = router_get_routerlist();
       have_raw_digest = router_get_extrainfo_hash(*s, end-*s, raw_digest) == 0;
-      extrainfo = extrainfo_parse_entry_from_string(*s, end,
+      extrainfo = extrainfo_parse_entry_impl(*s, end,
                                        saved_location != SAVED_IN_CACHE,
-                                       rl->identity_map, &dl_again);
+                                       rl->identity_map, &dl_again,
+                                       &deferred);
       if (extrainfo) {
         signed_desc = &extrainfo->cache_info;
         elt = extrainfo;
       }
     } else if (!have_extrainfo && !want_extrainfo) {
       have_raw_digest = router_get_router_hash(*s, end-*s, raw_digest) == 0;
-      router = router_parse_entry_from_string(*s, end,
-                                              saved_location != SAVED_IN_CACHE,
-                                              allow_annotations,
-                                              prepend_annotations, &dl_again);
+      router = router_parse_entry_impl(*s, end,
+                                       saved_location != SAVED_IN_CACHE,
+                                       allow_annotations,
+                                       prepend_annotations, &dl_again,
+                                       &deferred);
       if (router) {
         log_debug(LD_DIR, "Read router '%s', purpose '%s'",
                   router_describe(router),
@@ -1662,13 +2008,59 @@ router_parse_list_from_string(const char **s, const char *eos,
       signed_desc->saved_location = saved_location;
       signed_desc->saved_offset = *s - start;
     }
+    if (deferred) {
+      deferred->elt = elt;
+      deferred->is_extrainfo = have_extrainfo;
+      deferred->desc = *s;
+      memcpy(deferred->raw_digest, raw_digest, DIGEST_LEN);
+      deferred->have_raw_digest = have_raw_digest;
+      smartlist_add(deferred_checks, deferred);
+      checks->n_checks += deferred->n_checks;
+    }
     *s = end;
     smartlist_add(dest, elt);
   }
 
+  *checks_out = checks;
   return 0;
 }
 
+/** Given a string *<b>s</b> containing a concatenated sequence of router
+ * descriptors (or extra-info documents if <b>is_extrainfo</b> is set), parses
+ * them and stores the result in <b>dest</b>.  All routers are marked running
+ * and valid.  Advances *s to a point immediately following the last router
+ * entry.  Ignore any trailing router entries that are not complete.
+ *
+ * If <b>saved_location</b> isn't SAVED_IN_CACHE, make a local copy of each
+ * descriptor in the signed_descriptor_body field of each routerinfo_t.  If it
+ * isn't SAVED_NOWHERE, remember the offset of each descriptor.
+ *
+ * Returns 0 on success and -1 on failure.  Adds a digest to
+ * <b>invalid_digests_out</b> for every entry that was unparseable or
+ * invalid. (This may cause duplicate entries.)
+ */
+int
+router_parse_list_from_string(const char **s, const char *eos,
+                              smartlist_t *dest,
+                              saved_location_t saved_location,
+                              int want_extrainfo,
+                              int allow_annotations,
+                              const char *prepend_annotations,
+                              smartlist_t *invalid_digests_out)
+{
+  desc_sig_checks_t *checks = NULL;
+  int r = router_parse_list_from_string_unchecked(s, eos, dest,
+                                                  saved_location,
+                                                  want_extrainfo,
+                                                  allow_annotations,
+                                                  prepend_annotations,
+                                                  invalid_digests_out,
+                                                  &checks);
+  desc_sig_checks_run(checks);
+  desc_sig_checks_finish(checks, dest, invalid_digests_out);
+  return r;
+}
+
 /* For debugging: define to count every descriptor digest we've seen so we
  * know if we need to try harder to avoid duplicate verifies. */
 #undef COUNT_DISTINCT_DIGESTS
@@ -1757,6 +2149,22 @@ router_parse_entry_from_string(const char *s, const char *end,
                                int cache_copy, int allow_annotations,
                                const char *prepend_annotations,
                                int *can_dl_again_out)
+{
+  return router_parse_entry_impl(s, end, cache_copy, allow_annotations,
+                                 prepend_annotations, can_dl_again_out,
+                                 NULL);
+}
+
+/** As router_parse_entry_from_string(), but if <b>deferred_out</b> is
+ * provided, don't check the descriptor's ed25519 signatures: set
+ * *<b>deferred_out</b> to the checks that the caller must make before
+ * trusting the result, or leave it NULL if there are none. */
+static routerinfo_t *
+router_parse_entry_impl(const char *s, const char *end,
+                        int cache_copy, int allow_annotations,
+                        const char *prepend_annotations,
+                        int *can_dl_again_out,
+                        deferred_ed_checks_t **deferred_out)
 {
   routerinfo_t *router = NULL;
   char digest[128];
@@ -1768,6 +2176,7 @@ router_parse_entry_from_string(const char *s, const char *end,
   int ok = 1;
   memarea_t *area = NULL;
   tor_cert_t *ntor_cc_cert = NULL;
+  deferred_ed_checks_t *deferred = NULL;
   /* Do not set this to '1' until we have parsed everything that we intend to
    * parse that's covered by the hash. */
   int can_dl_again = 0;
@@ -2119,7 +2528,12 @@ router_parse_entry_from_string(const char *s, const char *end,
       check[2].msg = d256;
       check[2].len = DIGEST256_LEN;
 
-      if (ed25519_checksig_batch(check_ok, check, 3) < 0) {
+      if (deferred_out) {
+        /* Our caller will check these along with everybody else's. */
+        deferred = deferred_ed_checks_new(check, 3, d256);
+        deferred->ntor_cc_pk = ntor_cc_pk;
+        deferred->check[1].pubkey = &deferred->ntor_cc_pk;
+      } else if (ed25519_checksig_batch(check_ok, check, 3) < 0) {
         log_warn(LD_DIR, "Incorrect ed25519 signature(s)");
         goto err;
       }
@@ -2161,15 +2575,15 @@ router_parse_entry_from_string(const char *s, const char *end,
   }
 
   if ((tok = find_opt_by_keyword(tokens, K_PLATFORM))) {
-    router->platform = tor_strdup(tok->args[0]);
+    router->platform = tor_intern_string(tok->args[0]);
   }
 
   if ((tok = find_opt_by_keyword(tokens, K_PROTO))) {
-    router->protocol_list = tor_strdup(tok->args[0]);
+    router->protocol_list = tor_intern_string(tok->args[0]);
   }
 
   if ((tok = find_opt_by_keyword(tokens, K_CONTACT))) {
-    router->contact_info = tor_strdup(tok->args[0]);
+    router->contact_info = tor_intern_string(tok->args[0]);
   }
 
   if (find_opt_by_keyword(tokens, K_REJECT6) ||
@@ -2220,7 +2634,8 @@ router_parse_entry_from_string(const char *s, const char *end,
                  escaped(tok->args[i]));
         goto err;
       }
-      smartlist_add(router->declared_family, tor_strdup(tok->args[i]));
+      smartlist_add(router->declared_family,
+                    (char *) tor_intern_string(tok->args[i]));
     }
   }
 
@@ -2280,7 +2695,7 @@ router_parse_entry_from_string(const char *s, const char *end,
     goto err;
 
   if (!router->platform) {
-    router->platform = tor_strdup("<unknown>");
+    router->platform = tor_intern_string("<unknown>");
   }
   goto done;
 
@@ -2289,6 +2704,16 @@ router_parse_entry_from_string(const char *s, const char *end,
   routerinfo_free(router);
   router = NULL;
  done:
+  if (deferred) {
+    if (router) {
+      /* The ntor cross-cert's body is one of the signed messages. */
+      deferred->ntor_cc_cert = ntor_cc_cert;
+      ntor_cc_cert = NULL;
+      *deferred_out = deferred;
+    } else {
+      deferred_ed_checks_free(deferred);
+    }
+  }
   tor_cert_free(ntor_cc_cert);
   if (tokens) {
     SMARTLIST_FOREACH(tokens, directory_token_t *, t, token_clear(t));
@@ -2319,6 +2744,19 @@ extrainfo_t *
 extrainfo_parse_entry_from_string(const char *s, const char *end,
                             int cache_copy, struct digest_ri_map_t *routermap,
                             int *can_dl_again_out)
+{
+  return extrainfo_parse_entry_impl(s, end, cache_copy, routermap,
+                                    can_dl_again_out, NULL);
+}
+
+/** As extrainfo_parse_entry_from_string(), but defer checking ed25519
+ * signatures if <b>deferred_out</b> is provided, as for
+ * router_parse_entry_impl(). */
+static extrainfo_t *
+extrainfo_parse_entry_impl(const char *s, const char *end,
+                           int cache_copy, struct digest_ri_map_t *routermap,
+                           int *can_dl_again_out,
+                           deferred_ed_checks_t **deferred_out)
 {
   extrainfo_t *extrainfo = NULL;
   char digest[128];
@@ -2328,6 +2766,7 @@ extrainfo_parse_entry_from_string(const char *s, const char *end,
   routerinfo_t *router = NULL;
   memarea_t *area = NULL;
   const char *s_dup = s;
+  deferred_ed_checks_t *deferred = NULL;
   /* Do not set this to '1' until we have parsed everything that we intend to
    * parse that's covered by the hash. */
   int can_dl_again = 0;
@@ -2466,7 +2905,9 @@ extrainfo_parse_entry_from_string(const char *s, const char *end,
       check[1].msg = d256;
       check[1].len = DIGEST256_LEN;
 
-      if (ed25519_checksig_batch(check_ok, check, 2) < 0) {
+      if (deferred_out) {
+        deferred = deferred_ed_checks_new(check, 2, d256);
+      } else if (ed25519_checksig_batch(check_ok, check, 2) < 0) {
         log_warn(LD_DIR, "Incorrect ed25519 signature(s)");
         goto err;
       }
@@ -2512,6 +2953,12 @@ extrainfo_parse_entry_from_string(const char *s, const char *end,
   extrainfo_free(extrainfo);
   extrainfo = NULL;
  done:
+  if (deferred) {
+    if (extrainfo)
+      *deferred_out = deferred;
+    else
+      deferred_ed_checks_free(deferred);
+  }
   if (tokens) {
     SMARTLIST_FOREACH(tokens, directory_token_t *, t, token_clear(t));
     smartlist_free(tokens);
@@ -2816,24 +3263,52 @@ routerstatus_parse_entry_from_string(memarea_t *area,
                                      consensus_flavor_t flav)
 {
   const char *eos, *s_dup = *s;
+  routerstatus_t *rs = NULL;
+  tor_assert(tokens);
+
+  eos = find_start_of_next_routerstatus(*s);
+
+  if (tokenize_string(area,*s, eos, tokens, rtrstatus_token_table,0)) {
+    log_warn(LD_DIR, "Error tokenizing router status");
+    dump_desc(s_dup, "routerstatus entry");
+  } else {
+    rs = routerstatus_parse_entry_from_tokens(s_dup, tokens, vote, vote_rs,
+                                              consensus_method, flav);
+  }
+
+  SMARTLIST_FOREACH(tokens, directory_token_t *, t, token_clear(t));
+  smartlist_clear(tokens);
+  if (area) {
+    DUMP_AREA(area, "routerstatus entry");
+    memarea_clear(area);
+  }
+  *s = eos;
+
+  return rs;
+}
+
+/** Given the <b>tokens</b> of the router status object that starts at
+ * <b>s_dup</b>, build and return the router status.  Return NULL on error.
+ * Arguments are as for routerstatus_parse_entry_from_string(); the caller
+ * keeps ownership of <b>tokens</b>. */
+static routerstatus_t *
+routerstatus_parse_entry_from_tokens(const char *s_dup, smartlist_t *tokens,
+                                     networkstatus_t *vote,
+                                     vote_routerstatus_t *vote_rs,
+                                     int consensus_method,
+                                     consensus_flavor_t flav)
+{
   routerstatus_t *rs = NULL;
   directory_token_t *tok;
   char timebuf[ISO_TIME_LEN+1];
   struct in_addr in;
   int offset = 0;
-  tor_assert(tokens);
   tor_assert(bool_eq(vote, vote_rs));
 
   if (!consensus_method)
     flav = FLAV_NS;
   tor_assert(flav == FLAV_NS || flav == FLAV_MICRODESC);
 
-  eos = find_start_of_next_routerstatus(*s);
-
-  if (tokenize_string(area,*s, eos, tokens, rtrstatus_token_table,0)) {
-    log_warn(LD_DIR, "Error tokenizing router status");
-    goto err;
-  }
   if (smartlist_len(tokens) < 1) {
     log_warn(LD_DIR, "Impossibly short router status");
     goto err;
@@ -2962,8 +3437,10 @@ routerstatus_parse_entry_from_string(memarea_t *area,
   if ((tok = find_opt_by_keyword(tokens, K_PROTO))) {
     found_protocol_list = 1;
     rs->protocols_known = 1;
+    protover_bitmask_t protos;
+    protover_get_bitmask(tok->args[0], &protos);
     rs->supports_extend2_cells =
-      protocol_list_supports_protocol(tok->args[0], PRT_RELAY, 2);
+      protover_bitmask_supports(&protos, PRT_RELAY, 2);
   }
   if ((tok = find_opt_by_keyword(tokens, K_V))) {
     tor_assert(tok->n_args == 1);
@@ -3081,22 +3558,225 @@ routerstatus_parse_entry_from_string(memarea_t *area,
   if (!strcasecmp(rs->nickname, UNNAMED_ROUTER_NICKNAME))
     rs->is_named = 0;
 
-  goto done;
+  return rs;
  err:
   dump_desc(s_dup, "routerstatus entry");
   if (rs && !vote_rs)
     routerstatus_free(rs);
-  rs = NULL;
- done:
-  SMARTLIST_FOREACH(tokens, directory_token_t *, t, token_clear(t));
-  smartlist_clear(tokens);
-  if (area) {
-    DUMP_AREA(area, "routerstatus entry");
-    memarea_clear(area);
+  return NULL;
+}
+
+/** Don't bother sending routerstatus entries to the cpuworkers unless a
+ * document has at least this many of them. */
+#define MIN_ENTRIES_FOR_THREADED_TOKENIZE 512
+/** Don't give a cpuworker fewer than this many bytes of routerstatus
+ * entries to tokenize at once. */
+#define MIN_BYTES_PER_TOKENIZE_SLICE (64*1024)
+
+/** Worker function: tokenize every routerstatus entry in the rs_tokenize_job_t
+ * <b>job_</b>.  Runs on a cpuworker thread, so it must not touch anything
+ * but the job and the (immutable) document. */
+static workqueue_reply_t
+rs_tokenize_threadfn(void *state_, void *job_)
+{
+  rs_tokenize_job_t *job = job_;
+  const char *s = job->start;
+  (void)state_;
+
+  while (s < job->end) {
+    const char *eos = find_start_of_next_routerstatus(s);
+    smartlist_t *tokens = smartlist_new();
+    if (eos > job->end)
+      eos = job->end;
+    if (tokenize_string(job->area, s, eos, tokens, rtrstatus_token_table, 0)) {
+      SMARTLIST_FOREACH(tokens, directory_token_t *, t, token_clear(t));
+      smartlist_free(tokens);
+      tokens = NULL;
+    }
+    smartlist_add(job->entries, (void*)s);
+    smartlist_add(job->token_lists, tokens);
+    s = eos;
+  }
+
+  if (job->batch) {
+    rs_tokenize_batch_t *batch = job->batch;
+    tor_mutex_acquire(&batch->lock);
+    --batch->n_pending;
+    tor_cond_signal_one(&batch->cond);
+    tor_mutex_release(&batch->lock);
+  }
+  return WQ_RPL_REPLY;
+}
+
+/** Main-thread callback for rs_tokenize_threadfn(): the results were
+ * collected long ago, so just release the job. */
+static void
+rs_tokenize_replyfn(void *job_)
+{
+  tor_free(job_);
+}
+
+/** Release everything the main thread holds from <b>job</b>. */
+static void
+rs_tokenize_job_clear(rs_tokenize_job_t *job)
+{
+  SMARTLIST_FOREACH(job->token_lists, smartlist_t *, tokens, {
+    if (tokens) {
+      SMARTLIST_FOREACH(tokens, directory_token_t *, t, token_clear(t));
+      smartlist_free(tokens);
+    }
+  });
+  smartlist_free(job->token_lists);
+  smartlist_free(job->entries);
+  memarea_drop_all(job->area);
+}
+
+/** Given a string <b>s</b> at the first of a run of routerstatus entries,
+ * tokenize all of the entries, splitting the work across the cpuworkers.
+ * On success, return a list of finished rs_tokenize_job_t, in document
+ * order, and set *<b>end_out</b> to just past the last entry.  Return NULL
+ * if the document is too small to be worth splitting, or if we have no
+ * cpuworkers; the caller should parse it the ordinary way.
+ *
+ * This blocks until the workers are done, but the main thread takes a
+ * share of the entries itself while it waits. */
+STATIC smartlist_t *
+routerstatus_tokenize_entries_threaded(const char *s, const char **end_out)
+{
+  const char *end, *footer, *sig, *pos;
+  size_t len, slice_len;
+  int n_entries = 0, n_slices, n_cpus;
+  rs_tokenize_batch_t batch;
+  rs_tokenize_job_t *local_job = NULL;
+  smartlist_t *jobs;
+
+  if (strcmpstart(s, "r "))
+    return NULL;
+
+  /* Where do the entries stop?  This mirrors
+   * find_start_of_next_routerstatus(). */
+  footer = strstr(s, "\ndirectory-footer");
+  sig = strstr(s, "\ndirectory-signature");
+  if (footer && sig)
+    end = MIN(footer, sig) + 1;
+  else if (footer)
+    end = footer + 1;
+  else if (sig)
+    end = sig + 1;
+  else
+    end = s + strlen(s);
+  len = end - s;
+
+  /* Count the entries, and don't bother for small documents. */
+  for (pos = s; (pos = tor_memstr(pos, end-pos, "\nr ")); ++pos)
+    ++n_entries;
+  n_cpus = get_num_cpus(get_options());
+  if (n_entries < MIN_ENTRIES_FOR_THREADED_TOKENIZE || n_cpus < 2)
+    return NULL;
+
+  n_slices = n_cpus + 1;
+  slice_len = len / n_slices;
+  if (slice_len < MIN_BYTES_PER_TOKENIZE_SLICE)
+    slice_len = MIN_BYTES_PER_TOKENIZE_SLICE;
+
+  tor_mutex_init_for_cond(&batch.lock);
+  tor_cond_init(&batch.cond);
+  batch.n_pending = 0;
+
+  jobs = smartlist_new();
+  pos = s;
+  while (pos < end) {
+    rs_tokenize_job_t *job = tor_malloc_zero(sizeof(rs_tokenize_job_t));
+    const char *next = NULL;
+    /* Each slice ends at the start of an entry. */
+    if ((size_t)(end - pos) > slice_len)
+      next = tor_memstr(pos + slice_len, end - (pos + slice_len), "\nr ");
+    job->start = pos;
+    job->end = next ? next + 1 : end;
+    job->area = memarea_new();
+    job->entries = smartlist_new();
+    job->token_lists = smartlist_new();
+    smartlist_add(jobs, job);
+    pos = job->end;
+
+    if (!local_job) {
+      /* The first slice is ours. */
+      local_job = job;
+      continue;
+    }
+    job->batch = &batch;
+    tor_mutex_acquire(&batch.lock);
+    ++batch.n_pending;
+    tor_mutex_release(&batch.lock);
+    /* We wait for this below, so it can't sit behind background work. */
+    if (!cpuworker_queue_work(WQ_PRI_HIGH, rs_tokenize_threadfn,
+                              rs_tokenize_replyfn, job)) {
+      /* No worker threads (or we couldn't queue): do it right here. */
+      job->batch = NULL;
+      tor_mutex_acquire(&batch.lock);
+      --batch.n_pending;
+      tor_mutex_release(&batch.lock);
+      rs_tokenize_threadfn(NULL, job);
+    }
   }
-  *s = eos;
 
-  return rs;
+  rs_tokenize_threadfn(NULL, local_job);
+
+  tor_mutex_acquire(&batch.lock);
+  while (batch.n_pending > 0)
+    tor_cond_wait(&batch.cond, &batch.lock, NULL);
+  tor_mutex_release(&batch.lock);
+  tor_cond_uninit(&batch.cond);
+  tor_mutex_uninit(&batch.lock);
+
+  *end_out = end;
+  return jobs;
+}
+
+/** Helper for networkstatus_parse_vote_from_string(): free every job in
+ * the list <b>jobs</b> from routerstatus_tokenize_entries_threaded(), and
+ * the list itself. */
+STATIC void
+rs_tokenize_jobs_free(smartlist_t *jobs)
+{
+  SMARTLIST_FOREACH_BEGIN(jobs, rs_tokenize_job_t *, job) {
+    rs_tokenize_job_clear(job);
+    /* Jobs that went to a cpuworker are freed by rs_tokenize_replyfn(). */
+    if (!job->batch)
+      tor_free(job);
+  } SMARTLIST_FOREACH_END(job);
+  smartlist_free(jobs);
+}
+
+/** Helper for networkstatus_parse_vote_from_string(): build a routerstatus
+ * of the appropriate kind for <b>ns</b> from the <b>tokens</b> of the entry
+ * at <b>entry</b>, and add it to ns-\>routerstatus_list unless it is
+ * malformed. */
+static void
+networkstatus_add_routerstatus_from_tokens(networkstatus_t *ns,
+                                           consensus_flavor_t flav,
+                                           const char *entry,
+                                           smartlist_t *tokens)
+{
+  if (ns->type != NS_TYPE_CONSENSUS) {
+    vote_routerstatus_t *rs = tor_malloc_zero(sizeof(vote_routerstatus_t));
+    if (routerstatus_parse_entry_from_tokens(entry, tokens, ns, rs, 0, 0))
+      smartlist_add(ns->routerstatus_list, rs);
+    else {
+      tor_free(rs->version);
+      tor_free(rs);
+    }
+  } else {
+    routerstatus_t *rs;
+    if ((rs = routerstatus_parse_entry_from_tokens(entry, tokens,
+                                                   NULL, NULL,
+                                                   ns->consensus_method,
+                                                   flav))) {
+      /* Use exponential-backoff scheduling when downloading microdescs */
+      rs->dl_status.backoff = DL_SCHED_RANDOM_EXPONENTIAL;
+      smartlist_add(ns->routerstatus_list, rs);
+    }
+  }
 }
 
 int
@@ -3635,7 +4315,7 @@ networkstatus_parse_vote_from_string(const char *s, const char **eos_out,
                                      networkstatus_type_t ns_type)
 {
   smartlist_t *tokens = smartlist_new();
-  smartlist_t *rs_tokens = NULL, *footer_tokens = NULL;
+  smartlist_t *rs_tokens = NULL, *footer_tokens = NULL, *rs_jobs = NULL;
   networkstatus_voter_info_t *voter = NULL;
   networkstatus_t *ns = NULL;
   common_digests_t ns_digests;
@@ -4007,6 +4687,24 @@ networkstatus_parse_vote_from_string(const char *s, const char **eos_out,
   s = end_of_header;
   ns->routerstatus_list = smartlist_new();
 
+  if ((rs_jobs = routerstatus_tokenize_entries_threaded(s, &s))) {
+    SMARTLIST_FOREACH_BEGIN(rs_jobs, rs_tokenize_job_t *, job) {
+      SMARTLIST_FOREACH_BEGIN(job->entries, const char *, entry) {
+        smartlist_t *entry_tokens =
+          smartlist_get(job->token_lists, entry_sl_idx);
+        if (!entry_tokens) {
+          log_warn(LD_DIR, "Error tokenizing router status");
+          dump_desc(entry, "routerstatus entry");
+          continue;
+        }
+        networkstatus_add_routerstatus_from_tokens(ns, flav, entry,
+                                                   entry_tokens);
+      } SMARTLIST_FOREACH_END(entry);
+    } SMARTLIST_FOREACH_END(job);
+    rs_tokenize_jobs_free(rs_jobs);
+    rs_jobs = NULL;
+  }
+
   while (!strcmpstart(s, "r ")) {
     if (ns->type != NS_TYPE_CONSENSUS) {
       vote_routerstatus_t *rs = tor_malloc_zero(sizeof(vote_routerstatus_t));
@@ -4822,6 +5520,12 @@ token_check_object(memarea_t *area, const char *kwd,
         }
       }
       break;
+    case NEED_RAW_KEY: /* There must be an undecoded public key. */
+      if (!tok->object_body || strcmp(tok->object_type, "RSA PUBLIC KEY")) {
+        tor_snprintf(ebuf, sizeof(ebuf), "Missing public key for %s", kwd);
+        RET_ERR(ebuf);
+      }
+      break;
     case OBJ_OK:
       /* Anything goes with this token. */
       break;
@@ -4878,7 +5582,7 @@ get_next_token(memarea_t *area,
 #define MAX_LINE_LENGTH (128*1024)
 
   const char *next, *eol, *obstart;
-  size_t obname_len;
+  size_t obname_len, kwd_len;
   int i;
   directory_token_t *tok;
   obj_syntax o_syn = NO_OBJ;
@@ -4910,9 +5614,13 @@ get_next_token(memarea_t *area,
   }
 
   /* Search the table for the appropriate entry.  (I tried a binary search
-   * instead, but it wasn't any faster.) */
+   * instead, but it wasn't any faster.)  Most entries differ from the
+   * keyword in length or in their first character, so check those before
+   * comparing the whole thing. */
+  kwd_len = next - *s;
   for (i = 0; table[i].t ; ++i) {
-    if (!strcmp_len(*s, table[i].t, next-*s)) {
+    if (table[i].t_len == kwd_len && table[i].t[0] == **s &&
+        fast_memeq(*s, table[i].t, kwd_len)) {
       /* We've found the keyword. */
       kwd = table[i].t;
       tok->tp = table[i].v;
@@ -4994,7 +5702,8 @@ get_next_token(memarea_t *area,
   if (next - *s > MAX_UNPARSED_OBJECT_SIZE)
     RET_ERR("Couldn't parse object: missing footer or object much too big.");
 
-  if (!strcmp(tok->object_type, "RSA PUBLIC KEY")) { /* If it's a public key */
+  if (!strcmp(tok->object_type, "RSA PUBLIC KEY") &&
+      o_syn != NEED_RAW_KEY) { /* If it's a public key */
     tok->key = crypto_pk_new();
     if (crypto_pk_read_public_key_from_string(tok->key, obstart, eol-obstart))
       RET_ERR("Couldn't parse public key.");
@@ -5340,22 +6049,197 @@ find_start_of_next_microdesc(const char *s, const char *eos)
 #undef NEXT_LINE
 }
 
-/** Parse as many microdescriptors as are found from the string starting at
- * <b>s</b> and ending at <b>eos</b>.  If allow_annotations is set, read any
- * annotations we recognize and ignore ones we don't.
- *
- * If <b>saved_location</b> isn't SAVED_IN_CACHE, make a local copy of each
- * descriptor in the body field of each microdesc_t.
- *
- * Return all newly parsed microdescriptors in a newly allocated
- * smartlist_t. If <b>invalid_disgests_out</b> is provided, add a SHA256
- * microdesc digest to it for every microdesc that we found to be badly
- * formed. (This may cause duplicates) */
-smartlist_t *
-microdescs_parse_from_string(const char *s, const char *eos,
-                             int allow_annotations,
-                             saved_location_t where,
-                             smartlist_t *invalid_digests_out)
+/** Return true iff the <b>len</b>-byte DER string <b>der</b> is the
+ * encoding of a 1024-bit RSA public key with exponent 65537, in the one form
+ * that every such key takes.  Any key this accepts would also pass the
+ * size and exponent checks that we apply to decoded onion keys. */
+static int
+rsa_der_is_plain_onion_key(const char *der, size_t len)
+{
+  /* SEQUENCE { INTEGER (129 bytes, leading zero), INTEGER 65537 } */
+  static const uint8_t prefix[] = { 0x30, 0x81, 0x89, 0x02, 0x81, 0x81, 0x00 };
+  static const uint8_t suffix[] = { 0x02, 0x03, 0x01, 0x00, 0x01 };
+  const uint8_t *d = (const uint8_t *)der;
+  if (len != sizeof(prefix) + PK_BYTES + sizeof(suffix))
+    return 0;
+  if (fast_memneq(d, prefix, sizeof(prefix)))
+    return 0;
+  /* The modulus must really be 1024 bits long. */
+  if (!(d[sizeof(prefix)] & 0x80))
+    return 0;
+  if (fast_memneq(d + sizeof(prefix) + PK_BYTES, suffix, sizeof(suffix)))
+    return 0;
+  return 1;
+}
+
+/** Helper: set the fields of <b>md</b> from the microdescriptor
+ * <b>tokens</b>.  Return 0 on success, -1 on failure.  On failure, some
+ * fields may already be set; the caller should discard <b>md</b>. */
+static int
+microdesc_set_fields_from_tokens(microdesc_t *md, smartlist_t *tokens)
+{
+  directory_token_t *tok;
+
+  tok = find_by_keyword(tokens, K_ONION_KEY);
+  if (rsa_der_is_plain_onion_key(tok->object_body, tok->object_size)) {
+    /* Nearly every onion key looks like this; we can tell it's acceptable
+     * without decoding it, so wait until somebody wants to use it. */
+    md->onion_pkey_der = tor_memdup(tok->object_body, tok->object_size);
+    md->onion_pkey_der_len = tok->object_size;
+  } else {
+    crypto_pk_t *key = crypto_pk_asn1_decode(tok->object_body,
+                                             tok->object_size);
+    if (!key) {
+      log_warn(LD_DIR, "Couldn't parse relay's onion key.");
+      return -1;
+    }
+    if (crypto_pk_num_bits(key) != PK_BYTES*8) {
+      log_warn(LD_DIR, "Wrong size on relay's onion key: %d bits",
+               crypto_pk_num_bits(key));
+      crypto_pk_free(key);
+      return -1;
+    }
+    if (!crypto_pk_public_exponent_ok(key)) {
+      log_warn(LD_DIR,
+               "Relay's onion key had invalid exponent.");
+      crypto_pk_free(key);
+      return -1;
+    }
+    md->onion_pkey = key;
+  }
+
+  if ((tok = find_opt_by_keyword(tokens, K_ONION_KEY_NTOR))) {
+    curve25519_public_key_t k;
+    tor_assert(tok->n_args >= 1);
+    if (curve25519_public_from_base64(&k, tok->args[0]) < 0) {
+      log_warn(LD_DIR, "Bogus ntor-onion-key in microdesc");
+      return -1;
+    }
+    md->onion_curve25519_pkey =
+      tor_memdup(&k, sizeof(curve25519_public_key_t));
+  }
+
+  smartlist_t *id_lines = find_all_by_keyword(tokens, K_ID);
+  if (id_lines) {
+    SMARTLIST_FOREACH_BEGIN(id_lines, directory_token_t *, t) {
+      tor_assert(t->n_args >= 2);
+      if (!strcmp(t->args[0], "ed25519")) {
+        if (md->ed25519_identity_pkey) {
+          log_warn(LD_DIR, "Extra ed25519 key in microdesc");
+          smartlist_free(id_lines);
+          return -1;
+        }
+        ed25519_public_key_t k;
+        if (ed25519_public_from_base64(&k, t->args[1])<0) {
+          log_warn(LD_DIR, "Bogus ed25519 key in microdesc");
+          smartlist_free(id_lines);
+          return -1;
+        }
+        md->ed25519_identity_pkey = tor_memdup(&k, sizeof(k));
+      }
+    } SMARTLIST_FOREACH_END(t);
+    smartlist_free(id_lines);
+  }
+
+  {
+    smartlist_t *a_lines = find_all_by_keyword(tokens, K_A);
+    if (a_lines) {
+      find_single_ipv6_orport(a_lines, &md->ipv6_addr, &md->ipv6_orport);
+      smartlist_free(a_lines);
+    }
+  }
+
+  if ((tok = find_opt_by_keyword(tokens, K_FAMILY))) {
+    int i;
+    md->family = smartlist_new();
+    for (i=0;i<tok->n_args;++i) {
+      if (!is_legal_nickname_or_hexdigest(tok->args[i])) {
+        log_warn(LD_DIR, "Illegal nickname %s in family line",
+                 escaped(tok->args[i]));
+        return -1;
+      }
+      smartlist_add(md->family, tor_strdup(tok->args[i]));
+    }
+  }
+
+  if ((tok = find_opt_by_keyword(tokens, K_P))) {
+    md->exit_policy = parse_short_policy(tok->args[0]);
+  }
+  if ((tok = find_opt_by_keyword(tokens, K_P6))) {
+    md->ipv6_exit_policy = parse_short_policy(tok->args[0]);
+  }
+
+  return 0;
+}
+
+/** Parse the fields of <b>md</b>, which has the body_unparsed flag set,
+ * from its body.  Return 0 and clear body_unparsed on success.  Return -1
+ * on failure; in that case, some fields may already be set, and the caller
+ * should not use <b>md</b>. */
+int
+microdesc_parse_fields(microdesc_t *md)
+{
+  smartlist_t *tokens = smartlist_new();
+  memarea_t *area = memarea_new();
+  int r = -1;
+
+  tor_assert(md->body_unparsed);
+
+  if (tokenize_string(area, md->body, md->body + md->bodylen, tokens,
+                      microdesc_token_table, 0)) {
+    log_warn(LD_DIR, "Unparseable microdescriptor");
+    goto done;
+  }
+  if (microdesc_set_fields_from_tokens(md, tokens) < 0)
+    goto done;
+
+  md->body_unparsed = 0;
+  r = 0;
+ done:
+  SMARTLIST_FOREACH(tokens, directory_token_t *, t, token_clear(t));
+  smartlist_free(tokens);
+  memarea_drop_all(area);
+  return r;
+}
+
+/** Helper for microdescs_parse_from_string() when parsing lazily: set
+ * <b>md</b>->last_listed from any @last-listed annotation in the annotation
+ * lines between <b>s</b> and <b>eos</b>, and ignore every other annotation.
+ * Return 0 on success, -1 if the annotation was malformed. */
+static int
+microdesc_parse_annotations(microdesc_t *md, const char *s, const char *eos)
+{
+  static const char LAST_LISTED[] = "@last-listed ";
+  while (s < eos && *s == '@') {
+    const char *eol = memchr(s, '\n', eos - s);
+    if (!eol)
+      eol = eos;
+    if ((size_t)(eol - s) > strlen(LAST_LISTED) &&
+        fast_memeq(s, LAST_LISTED, strlen(LAST_LISTED))) {
+      char tbuf[ISO_TIME_LEN+1];
+      const char *cp = s + strlen(LAST_LISTED);
+      if (eol - cp != ISO_TIME_LEN)
+        return -1;
+      memcpy(tbuf, cp, ISO_TIME_LEN);
+      tbuf[ISO_TIME_LEN] = '\0';
+      if (parse_iso_time(tbuf, &md->last_listed))
+        return -1;
+    }
+    s = eat_whitespace_eos(eol, eos);
+  }
+  return 0;
+}
+
+/** Helper: as microdescs_parse_from_string(), but if <b>lazy</b> is set,
+ * only find each microdescriptor's body, digest, and @last-listed
+ * annotation, and mark it body_unparsed so that its other fields are parsed
+ * when it is first used. */
+static smartlist_t *
+microdescs_parse_impl(const char *s, const char *eos,
+                      int allow_annotations,
+                      saved_location_t where,
+                      int lazy,
+                      smartlist_t *invalid_digests_out)
 {
   smartlist_t *tokens;
   smartlist_t *result;
@@ -5404,6 +6288,18 @@ microdescs_parse_from_string(const char *s, const char *eos,
         log_fn(LOG_PROTOCOL_WARN, LD_DIR, "Malformed or truncated descriptor");
         goto next;
       }
+
+      if (lazy) {
+        if (microdesc_parse_annotations(md, s, cp) < 0) {
+          log_warn(LD_DIR, "Bad last-listed time in microdescriptor");
+          goto next;
+        }
+        md->body_unparsed = 1;
+        smartlist_add(result, md);
+        md = NULL;
+        s = start_of_next_microdesc;
+        continue;
+      }
     }
 
     if (tokenize_string(area, s, start_of_next_microdesc, tokens,
@@ -5419,73 +6315,8 @@ microdescs_parse_from_string(const char *s, const char *eos,
       }
     }
 
-    tok = find_by_keyword(tokens, K_ONION_KEY);
-    if (!crypto_pk_public_exponent_ok(tok->key)) {
-      log_warn(LD_DIR,
-               "Relay's onion key had invalid exponent.");
+    if (microdesc_set_fields_from_tokens(md, tokens) < 0)
       goto next;
-    }
-    md->onion_pkey = tok->key;
-    tok->key = NULL;
-
-    if ((tok = find_opt_by_keyword(tokens, K_ONION_KEY_NTOR))) {
-      curve25519_public_key_t k;
-      tor_assert(tok->n_args >= 1);
-      if (curve25519_public_from_base64(&k, tok->args[0]) < 0) {
-        log_warn(LD_DIR, "Bogus ntor-onion-key in microdesc");
-        goto next;
-      }
-      md->onion_curve25519_pkey =
-        tor_memdup(&k, sizeof(curve25519_public_key_t));
-    }
-
-    smartlist_t *id_lines = find_all_by_keyword(tokens, K_ID);
-    if (id_lines) {
-      SMARTLIST_FOREACH_BEGIN(id_lines, directory_token_t *, t) {
-        tor_assert(t->n_args >= 2);
-        if (!strcmp(t->args[0], "ed25519")) {
-          if (md->ed25519_identity_pkey) {
-            log_warn(LD_DIR, "Extra ed25519 key in microdesc");
-            goto next;
-          }
-          ed25519_public_key_t k;
-          if (ed25519_public_from_base64(&k, t->args[1])<0) {
-            log_warn(LD_DIR, "Bogus ed25519 key in microdesc");
-            goto next;
-          }
-          md->ed25519_identity_pkey = tor_memdup(&k, sizeof(k));
-        }
-      } SMARTLIST_FOREACH_END(t);
-      smartlist_free(id_lines);
-    }
-
-    {
-      smartlist_t *a_lines = find_all_by_keyword(tokens, K_A);
-      if (a_lines) {
-        find_single_ipv6_orport(a_lines, &md->ipv6_addr, &md->ipv6_orport);
-        smartlist_free(a_lines);
-      }
-    }
-
-    if ((tok = find_opt_by_keyword(tokens, K_FAMILY))) {
-      int i;
-      md->family = smartlist_new();
-      for (i=0;i<tok->n_args;++i) {
-        if (!is_legal_nickname_or_hexdigest(tok->args[i])) {
-          log_warn(LD_DIR, "Illegal nickname %s in family line",
-                   escaped(tok->args[i]));
-          goto next;
-        }
-        smartlist_add(md->family, tor_strdup(tok->args[i]));
-      }
-    }
-
-    if ((tok = find_opt_by_keyword(tokens, K_P))) {
-      md->exit_policy = parse_short_policy(tok->args[0]);
-    }
-    if ((tok = find_opt_by_keyword(tokens, K_P6))) {
-      md->ipv6_exit_policy = parse_short_policy(tok->args[0]);
-    }
 
     smartlist_add(result, md);
     okay = 1;
@@ -5512,6 +6343,41 @@ microdescs_parse_from_string(const char *s, const char *eos,
   return result;
 }
 
+/** Parse as many microdescriptors as are found from the string starting at
+ * <b>s</b> and ending at <b>eos</b>.  If allow_annotations is set, read any
+ * annotations we recognize and ignore ones we don't.
+ *
+ * If <b>saved_location</b> isn't SAVED_IN_CACHE, make a local copy of each
+ * descriptor in the body field of each microdesc_t.
+ *
+ * Return all newly parsed microdescriptors in a newly allocated
+ * smartlist_t. If <b>invalid_disgests_out</b> is provided, add a SHA256
+ * microdesc digest to it for every microdesc that we found to be badly
+ * formed. (This may cause duplicates) */
+smartlist_t *
+microdescs_parse_from_string(const char *s, const char *eos,
+                             int allow_annotations,
+                             saved_location_t where,
+                             smartlist_t *invalid_digests_out)
+{
+  return microdescs_parse_impl(s, eos, allow_annotations, where, 0,
+                               invalid_digests_out);
+}
+
+/** As microdescs_parse_from_string() with annotations allowed, but only find
+ * each microdescriptor's body, digest, and @last-listed annotation.  The
+ * returned microdescriptors have body_unparsed set; their other fields are
+ * parsed by microdesc_parse_fields() when they are first needed.
+ *
+ * Only use this for microdescriptors that we have already parsed once, such
+ * as the ones we read back from our own cache. */
+smartlist_t *
+microdescs_parse_lazily_from_string(const char *s, const char *eos,
+                                    saved_location_t where)
+{
+  return microdescs_parse_impl(s, eos, 1, where, 1, NULL);
+}
+
 /** Parse the Tor version of the platform string <b>platform</b>,
  * and compare it to the version in <b>cutoff</b>. Return 1 if
  * the router is at least as new as the cutoff, else return 0.
@@ -6304,5 +7170,6 @@ void
 routerparse_free_all(void)
 {
   dump_desc_fifo_cleanup();
+  memwipe(signature_cache, 0, sizeof(signature_cache));
 }
 
@@ -32,6 +32,18 @@ int router_parse_list_from_string(const char **s, const char *eos,
                                   int allow_annotations,
                                   const char *prepend_annotations,
                                   smartlist_t *invalid_digests_out);
+typedef struct desc_sig_checks_t desc_sig_checks_t;
+int router_parse_list_from_string_unchecked(const char **s, const char *eos,
+                                  smartlist_t *dest,
+                                  saved_location_t saved_location,
+                                  int is_extrainfo,
+                                  int allow_annotations,
+                                  const char *prepend_annotations,
+                                  smartlist_t *invalid_digests_out,
+                                  desc_sig_checks_t **checks_out);
+void desc_sig_checks_run(desc_sig_checks_t *c);
+void desc_sig_checks_finish(desc_sig_checks_t *c, smartlist_t *dest,
+                            smartlist_t *invalid_digests_out);
 
 routerinfo_t *router_parse_entry_from_string(const char *s, const char *end,
                                              int cache_copy,
@@ -52,6 +64,9 @@ int tor_version_same_series(tor_version_t *a, tor_version_t *b);
 void sort_version_list(smartlist_t *lst, int remove_duplicates);
 void assert_addr_policy_ok(smartlist_t *t);
 void dump_distinct_digest_count(int severity);
+int check_signed_digest(crypto_pk_t *pkey, const char *digest,
+                        size_t digest_len, const char *sig, size_t sig_len);
+void dump_signature_cache_stats(int severity);
 
 int compare_vote_routerstatus_entries(const void **_a, const void **_b);
 int networkstatus_verify_bw_weights(networkstatus_t *ns, int);
@@ -65,6 +80,10 @@ smartlist_t *microdescs_parse_from_string(const char *s, const char *eos,
                                           int allow_annotations,
                                           saved_location_t where,
                                           smartlist_t *invalid_digests_out);
+smartlist_t *microdescs_parse_lazily_from_string(const char *s,
+                                                 const char *eos,
+                                                 saved_location_t where);
+int microdesc_parse_fields(microdesc_t *md);
 
 authority_cert_t *authority_cert_parse_from_string(const char *s,
                                                    const char **end_of_string);
@@ -99,6 +118,9 @@ typedef struct {
   size_t len;
   uint8_t digest_sha256[DIGEST256_LEN];
   time_t when;
+  /** The latest write of this dump still waiting on a cpuworker, or NULL
+   * if the file is on disk. */
+  struct dump_desc_write_t *pending_write;
 } dumped_desc_t;
 
 EXTERN(uint64_t, len_descs_dumped)
@@ -120,6 +142,33 @@ STATIC routerstatus_t *routerstatus_parse_entry_from_string(
                                      vote_routerstatus_t *vote_rs,
                                      int consensus_method,
                                      consensus_flavor_t flav);
+
+/** Shared state for a set of rs_tokenize_job_t that the main thread is
+ * waiting on. */
+typedef struct rs_tokenize_batch_t {
+  tor_mutex_t lock; /**< Protects n_pending. */
+  tor_cond_t cond; /**< Signalled whenever n_pending drops. */
+  int n_pending; /**< How many jobs haven't finished yet? */
+} rs_tokenize_batch_t;
+
+/** A run of consecutive routerstatus entries to be tokenized by
+ * rs_tokenize_threadfn(), possibly on a cpuworker thread.  Everything but
+ * the job itself belongs to the main thread once the job is done; the
+ * job is freed by rs_tokenize_replyfn(). */
+typedef struct rs_tokenize_job_t {
+  rs_tokenize_batch_t *batch; /**< The batch to report to when done, or NULL
+                               * if we ran on the main thread. */
+  const char *start; /**< The first entry in this run. */
+  const char *end; /**< Just past the last entry in this run. */
+  struct memarea_t *area; /**< Holds the tokens of every entry in this run. */
+  smartlist_t *entries; /**< The start of each entry in this run. */
+  smartlist_t *token_lists; /**< For each entry, a smartlist_t of its
+                             * tokens, or NULL if it didn't tokenize. */
+} rs_tokenize_job_t;
+
+STATIC smartlist_t *routerstatus_tokenize_entries_threaded(const char *s,
+                                                    const char **end_out);
+STATIC void rs_tokenize_jobs_free(smartlist_t *jobs);
 #endif
 
 #define ED_DESC_SIGNATURE_PREFIX "Tor router descriptor signature v1"
@@ -326,6 +326,9 @@ routerset_contains_routerstatus(const routerset_t *set,
 int
 routerset_contains_node(const routerset_t *set, const node_t *node)
 {
+  int r = nodelist_node_in_routerset(node, set);
+  if (r >= 0)
+    return r;
   if (node->rs)
     return routerset_contains_routerstatus(set, node->rs, node->country);
   else if (node->ri)
@@ -6,12 +6,21 @@
 #define TOR_CHANNEL_INTERNAL_ /* For channel_flush_some_cells() */
 #include "channel.h"
 
+#include "channeltls.h"
 #include "compat_libevent.h"
+#include "connection.h"
+#include "latency_trace.h"
 #define SCHEDULER_PRIVATE_
 #include "scheduler.h"
 
 #include <event2/event.h>
 
+#ifdef HAVE_KIST_SUPPORT
+#include <netinet/tcp.h>
+#include <linux/sockios.h>
+#include <sys/ioctl.h>
+#endif
+
 /*
  * Scheduler high/low watermarks
  */
@@ -130,6 +139,22 @@ static uint32_t sched_max_flush_cells = 16;
  * other states.  The scheduler_run() function gives us the opportunity to do
  * scheduling work, and is called from other scheduler functions whenever a
  * state transition occurs, and periodically from the main event loop.
+ *
+ * The bookkeeping above is shared by every scheduler.  What differs between
+ * schedulers -- how many cells to write, and to which pending channels, each
+ * time scheduler_run() is called -- lives behind a scheduler_t, which is
+ * selected at runtime with the Schedulers option.  The default is the
+ * "Vanilla" scheduler implemented in this file, which limits writes with a
+ * global queue-size heuristic.
+ *
+ * The "KIST" scheduler (Kernel-Informed Socket Transport) instead asks the
+ * kernel how much each channel's TCP socket could send right now, and
+ * writes no more than that.  It runs at most every
+ * KIST_SCHED_RUN_INTERVAL_MSEC, so that cells from many channels collect in
+ * channels_pending and get written in circuitmux priority order across all
+ * channels, rather than in the order in which they happened to arrive.
+ * Anything the kernel can't send yet stays in our queues, where a better
+ * cell can still overtake it.
  */
 
 /* Scheduler global data structures */
@@ -169,6 +194,69 @@ static void scheduler_evt_callback(evutil_socket_t fd,
                                    short events, void *arg);
 static int scheduler_more_work(void);
 static void scheduler_retrigger(void);
+
+static int vanilla_scheduler_more_work(void);
+static void vanilla_scheduler_run(void);
+static void vanilla_scheduler_adjust_queue_size(channel_t *chan, int dir,
+                                                uint64_t adj);
+
+static int kist_scheduler_is_available(void);
+static int kist_scheduler_more_work(void);
+static void kist_scheduler_run(void);
+static void kist_scheduler_schedule(void);
+
+/** The default scheduler: flush cells until a global estimate of how much
+ * data is queued on all channels reaches the high-water mark. */
+static const scheduler_t vanilla_scheduler = {
+  /*.name =*/ "Vanilla",
+  /*.is_available =*/ NULL,
+  /*.on_enable =*/ NULL,
+  /*.on_disable =*/ NULL,
+  /*.more_work =*/ vanilla_scheduler_more_work,
+  /*.run =*/ vanilla_scheduler_run,
+  /*.schedule =*/ NULL,
+  /*.on_queue_size_adjusted =*/ vanilla_scheduler_adjust_queue_size,
+  /*.on_channel_released =*/ NULL,
+};
+
+/** The KIST scheduler: flush cells in priority order across all channels,
+ * but only as many as each channel's socket can send right away.  We keep
+ * the queue heuristic up to date in case we switch back to Vanilla. */
+static const scheduler_t kist_scheduler = {
+  /*.name =*/ "KIST",
+  /*.is_available =*/ kist_scheduler_is_available,
+  /*.on_enable =*/ NULL,
+  /*.on_disable =*/ NULL,
+  /*.more_work =*/ kist_scheduler_more_work,
+  /*.run =*/ kist_scheduler_run,
+  /*.schedule =*/ kist_scheduler_schedule,
+  /*.on_queue_size_adjusted =*/ vanilla_scheduler_adjust_queue_size,
+  /*.on_channel_released =*/ NULL,
+};
+
+/** Every scheduler we know about, NULL-terminated. */
+static const scheduler_t *const known_schedulers[] = {
+  &vanilla_scheduler,
+  &kist_scheduler,
+  NULL
+};
+
+/** How often, in msec, does the KIST scheduler run while there are pending
+ * channels? */
+#define KIST_SCHED_RUN_INTERVAL_MSEC 10
+
+/** About how many bytes does TLS add to each cell that we write? */
+#define KIST_TLS_PER_CELL_OVERHEAD 29
+
+/** How many times has the KIST scheduler run?  A channel's socket limit is
+ * only good for the run in which we computed it. */
+static uint64_t kist_run_number = 0;
+
+/** When did the KIST scheduler last run? */
+static monotime_t kist_last_run;
+
+/** The scheduler that we're currently using. */
+static const scheduler_t *the_scheduler = &vanilla_scheduler;
 #if 0
 static void scheduler_trigger(void);
 #endif
@@ -194,6 +282,77 @@ scheduler_free_all(void)
     smartlist_free(channels_pending);
     channels_pending = NULL;
   }
+
+  if (the_scheduler->on_disable)
+    the_scheduler->on_disable();
+  the_scheduler = &vanilla_scheduler;
+}
+
+/** Return the scheduler named <b>name</b> (case-insensitive), or NULL if
+ * there is no such scheduler. */
+const scheduler_t *
+scheduler_get_by_name(const char *name)
+{
+  int i;
+  tor_assert(name);
+  for (i = 0; known_schedulers[i]; ++i) {
+    if (!strcasecmp(known_schedulers[i]->name, name))
+      return known_schedulers[i];
+  }
+  return NULL;
+}
+
+/** Return true iff <b>sched</b> can run on this platform. */
+static int
+scheduler_is_available(const scheduler_t *sched)
+{
+  return sched->is_available == NULL || sched->is_available();
+}
+
+/** Return the scheduler that we're currently using. */
+const scheduler_t *
+scheduler_get_current(void)
+{
+  return the_scheduler;
+}
+
+/** Switch to the first available scheduler named in <b>names</b>, a list of
+ * scheduler names in order of preference.  If none of them is available,
+ * use the Vanilla scheduler.  Channels that are already pending stay
+ * pending across the switch. */
+void
+scheduler_set_schedulers(const smartlist_t *names)
+{
+  const scheduler_t *chosen = NULL;
+
+  if (names) {
+    SMARTLIST_FOREACH_BEGIN(names, const char *, name) {
+      const scheduler_t *sched = scheduler_get_by_name(name);
+      if (sched && scheduler_is_available(sched)) {
+        chosen = sched;
+        break;
+      }
+      log_info(LD_SCHED, "Scheduler %s is not available here; skipping it.",
+               escaped(name));
+    } SMARTLIST_FOREACH_END(name);
+  }
+  if (!chosen)
+    chosen = &vanilla_scheduler;
+
+  if (chosen == the_scheduler)
+    return;
+
+  log_notice(LD_SCHED, "Switching from the %s scheduler to the %s scheduler.",
+             the_scheduler->name, chosen->name);
+  if (the_scheduler->on_disable)
+    the_scheduler->on_disable();
+  the_scheduler = chosen;
+  if (the_scheduler->on_enable)
+    the_scheduler->on_enable();
+
+  /* The new scheduler may be willing to write where the old one wasn't. */
+  if (run_sched_ev && scheduler_more_work())
+    scheduler_retrigger();
 }
 
 /**
@@ -258,7 +417,9 @@ scheduler_evt_callback(evutil_socket_t fd, short events, void *arg)
   tor_assert(run_sched_ev);
 
   /* Run the scheduler */
+  LATENCY_TRACE_START(trace_start);
   scheduler_run();
+  LATENCY_TRACE_END(trace_start, LT_SCHEDULER);
 
   /* Do we have more work to do? */
   if (scheduler_more_work()) scheduler_retrigger();
@@ -376,8 +537,19 @@ scheduler_more_work(void)
 {
   tor_assert(channels_pending);
 
-  return ((scheduler_get_queue_heuristic() < sched_q_low_water) &&
-          ((smartlist_len(channels_pending) > 0))) ? 1 : 0;
+  if (smartlist_len(channels_pending) == 0)
+    return 0;
+
+  return the_scheduler->more_work();
+}
+
+/** Vanilla scheduler: we have more work to do if the queue heuristic is
+ * below the low-water mark. */
+
+static int
+vanilla_scheduler_more_work(void)
+{
+  return scheduler_get_queue_heuristic() < sched_q_low_water;
 }
 
 /** Retrigger the scheduler in a way safe to use from the callback */
@@ -386,7 +558,10 @@ static void
 scheduler_retrigger(void)
 {
   tor_assert(run_sched_ev);
-  event_active(run_sched_ev, EV_TIMEOUT, 1);
+  if (the_scheduler->schedule)
+    the_scheduler->schedule();
+  else
+    event_active(run_sched_ev, EV_TIMEOUT, 1);
 }
 
 /** Notify the scheduler of a channel being closed */
@@ -404,6 +579,9 @@ scheduler_release_channel,(channel_t *chan))
                             chan);
   }
 
+  if (the_scheduler->on_channel_released)
+    the_scheduler->on_channel_released(chan);
+
   chan->scheduler_state = SCHED_CHAN_IDLE;
 }
 
@@ -411,6 +589,16 @@ scheduler_release_channel,(channel_t *chan))
 
 MOCK_IMPL(void,
 scheduler_run, (void))
+{
+  the_scheduler->run();
+}
+
+/** Vanilla scheduler: while the queue heuristic is below the high-water
+ * mark, take channels from the front of the pending queue and flush up to
+ * sched_max_flush_cells cells from each at a time. */
+
+static void
+vanilla_scheduler_run(void)
 {
   int n_cells, n_chans_before, n_chans_after;
   uint64_t q_len_before, q_heur_before, q_len_after, q_heur_after;
@@ -550,6 +738,201 @@ scheduler_run, (void))
   }
 }
 
+/** KIST scheduler: we can run wherever the kernel will tell us about the
+ * state of a TCP socket's send queue. */
+
+static int
+kist_scheduler_is_available(void)
+{
+#ifdef HAVE_KIST_SUPPORT
+  return 1;
+#else
+  return 0;
+#endif
+}
+
+/** KIST scheduler: any pending channel is more work for the next run;
+ * kist_scheduler_schedule() decides when that is. */
+
+static int
+kist_scheduler_more_work(void)
+{
+  return 1;
+}
+
+/** KIST scheduler: run the scheduler once KIST_SCHED_RUN_INTERVAL_MSEC has
+ * passed since the last run, or right away if it already has. */
+
+static void
+kist_scheduler_schedule(void)
+{
+  monotime_t now;
+  int64_t msec_since_run;
+  struct timeval tv;
+
+  if (event_pending(run_sched_ev, EV_TIMEOUT, NULL))
+    return;
+
+  monotime_get(&now);
+  if (kist_run_number == 0)
+    msec_since_run = KIST_SCHED_RUN_INTERVAL_MSEC;
+  else
+    msec_since_run = monotime_diff_msec(&kist_last_run, &now);
+
+  if (msec_since_run >= KIST_SCHED_RUN_INTERVAL_MSEC ||
+      msec_since_run < 0) {
+    event_active(run_sched_ev, EV_TIMEOUT, 1);
+  } else {
+    tv.tv_sec = 0;
+    tv.tv_usec = (KIST_SCHED_RUN_INTERVAL_MSEC - msec_since_run) * 1000;
+    event_add(run_sched_ev, &tv);
+  }
+}
+
+/** Return how many more bytes we should write to a TCP socket whose
+ * congestion window is <b>cwnd</b> segments of <b>mss</b> bytes, with
+ * <b>unacked</b> segments in flight, <b>outq</b> bytes sitting in the
+ * kernel's send queue (sent or not), and <b>outbuf_len</b> bytes more in
+ * our own outbuf.  That's whatever the congestion window has room for,
+ * less what's already waiting to go out. */
+
+STATIC int64_t
+kist_compute_socket_limit(uint32_t cwnd, uint32_t unacked, uint32_t mss,
+                          uint32_t outq, size_t outbuf_len)
+{
+  int64_t tcp_space, notsent, limit;
+
+  if (cwnd <= unacked)
+    return 0;
+
+  tcp_space = ((int64_t)cwnd - unacked) * mss;
+  notsent = (int64_t)outq - (int64_t)unacked * mss;
+  if (notsent < 0)
+    notsent = 0;
+
+  limit = tcp_space - notsent - (int64_t)outbuf_len;
+  return limit > 0 ? limit : 0;
+}
+
+/** Ask the kernel how much <b>chan</b>'s socket can send right now, and set
+ * its socket limit for this run.  If we can't tell, don't limit it. */
+
+static void
+kist_update_socket_limit(channel_t *chan)
+{
+  chan->sched_kist_run = kist_run_number;
+  chan->sched_kist_limit = INT64_MAX;
+
+#ifdef HAVE_KIST_SUPPORT
+  channel_tls_t *tlschan;
+  connection_t *conn;
+  struct tcp_info ti;
+  socklen_t ti_len = sizeof(ti);
+  int outq = 0;
+
+  if (chan->magic != TLS_CHAN_MAGIC)
+    return;
+  tlschan = BASE_CHAN_TO_TLS(chan);
+  if (!tlschan->conn)
+    return;
+  conn = TO_CONN(tlschan->conn);
+  if (!SOCKET_OK(conn->s))
+    return;
+
+  if (getsockopt(conn->s, SOL_TCP, TCP_INFO, (void *)&ti, &ti_len) < 0 ||
+      ioctl(conn->s, SIOCOUTQ, &outq) < 0) {
+    log_info(LD_SCHED, "Couldn't get the send queue state for the socket "
+             "of channel " U64_FORMAT ": %s. Not limiting it.",
+             U64_PRINTF_ARG(chan->global_identifier),
+             tor_socket_strerror(tor_socket_errno(conn->s)));
+    return;
+  }
+
+  chan->sched_kist_limit =
+    kist_compute_socket_limit(ti.tcpi_snd_cwnd, ti.tcpi_unacked,
+                              ti.tcpi_snd_mss, outq > 0 ? (uint32_t)outq : 0,
+                              connection_get_outbuf_len(conn));
+#endif
+}
+
+/** KIST scheduler: flush one cell at a time from whichever pending channel
+ * has the best circuit, until every pending channel is out of cells or
+ * socket space.  Channels that still have cells but no socket space wait
+ * for the next run. */
+
+static void
+kist_scheduler_run(void)
+{
+  smartlist_t *to_readd = NULL;
+  channel_t *chan = NULL;
+  ssize_t flushed;
+  int n_chans_before = smartlist_len(channels_pending);
+
+  ++kist_run_number;
+  monotime_get(&kist_last_run);
+
+  while (smartlist_len(channels_pending) > 0) {
+    chan = smartlist_pqueue_pop(channels_pending,
+                                scheduler_compare_channels,
+                                STRUCT_OFFSET(channel_t, sched_heap_idx));
+    tor_assert(chan);
+
+    if (chan->sched_kist_run != kist_run_number)
+      kist_update_socket_limit(chan);
+
+    if (chan->sched_kist_limit <= 0) {
+      /* The kernel couldn't send anything more yet; try next time. */
+      if (!to_readd) to_readd = smartlist_new();
+      smartlist_add(to_readd, chan);
+      continue;
+    }
+
+    if (channel_num_cells_writeable(chan) <= 0) {
+      chan->scheduler_state = SCHED_CHAN_WAITING_TO_WRITE;
+      continue;
+    }
+
+    flushed = channel_flush_some_cells(chan, 1);
+    if (flushed <= 0) {
+      /* We ran out of cells to flush */
+      chan->scheduler_state = SCHED_CHAN_WAITING_FOR_CELLS;
+      continue;
+    }
+    chan->sched_kist_limit -= flushed *
+      (get_cell_network_size(chan->wide_circ_ids) +
+       KIST_TLS_PER_CELL_OVERHEAD);
+
+    if (!channel_more_to_flush(chan)) {
+      chan->scheduler_state = (channel_num_cells_writeable(chan) > 0) ?
+        SCHED_CHAN_WAITING_FOR_CELLS : SCHED_CHAN_IDLE;
+    } else if (channel_num_cells_writeable(chan) <= 0) {
+      chan->scheduler_state = SCHED_CHAN_WAITING_TO_WRITE;
+    } else {
+      /* Still pending; it competes with every other channel again. */
+      smartlist_pqueue_add(channels_pending,
+                           scheduler_compare_channels,
+                           STRUCT_OFFSET(channel_t, sched_heap_idx),
+                           chan);
+    }
+  }
+
+  if (to_readd) {
+    SMARTLIST_FOREACH_BEGIN(to_readd, channel_t *, readd_chan) {
+      readd_chan->scheduler_state = SCHED_CHAN_PENDING;
+      smartlist_pqueue_add(channels_pending,
+                           scheduler_compare_channels,
+                           STRUCT_OFFSET(channel_t, sched_heap_idx),
+                           readd_chan);
+    } SMARTLIST_FOREACH_END(readd_chan);
+    smartlist_free(to_readd);
+  }
+
+  log_debug(LD_SCHED,
+            "KIST scheduler handled %d pending channels; %d are waiting "
+            "for socket space",
+            n_chans_before, smartlist_len(channels_pending));
+}
+
 /** Trigger the scheduling event so we run the scheduler later */
 
 #if 0
@@ -641,6 +1024,16 @@ scheduler_touch_channel(channel_t *chan)
 
 void
 scheduler_adjust_queue_size(channel_t *chan, int dir, uint64_t adj)
+{
+  if (the_scheduler->on_queue_size_adjusted)
+    the_scheduler->on_queue_size_adjusted(chan, dir, adj);
+}
+
+/** Vanilla scheduler: fold a queue size adjustment into the queue
+ * heuristic. */
+
+static void
+vanilla_scheduler_adjust_queue_size(channel_t *chan, int dir, uint64_t adj)
 {
   time_t now = approx_time();
 
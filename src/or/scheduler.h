@@ -13,8 +13,41 @@
 #include "channel.h"
 #include "testsupport.h"
 
+/** A scheduler_t decides how many cells to write, and to which pending
+ * channels, each time the scheduler runs.  Keeping track of which channels
+ * are pending is common to all schedulers; see scheduler.c. */
+typedef struct scheduler_s {
+  /** The name of this scheduler, as given in the Schedulers option. */
+  const char *name;
+  /** Return true iff this scheduler can run on this platform.  If NULL, it
+   * can always run. */
+  int (*is_available)(void);
+  /** Called when we start or stop using this scheduler.  May be NULL. */
+  void (*on_enable)(void);
+  void (*on_disable)(void);
+  /** Return true iff we should run again soon, given that there are pending
+   * channels. */
+  int (*more_work)(void);
+  /** Write cells from pending channels. */
+  void (*run)(void);
+  /** Arrange for run() to be called soon.  If NULL, we call it at the next
+   * chance the main loop gives us. */
+  void (*schedule)(void);
+  /** Called when the amount of data queued on a channel changes by
+   * <b>adj</b> bytes, increasing if <b>dir</b> is nonnegative.  May be
+   * NULL. */
+  void (*on_queue_size_adjusted)(channel_t *chan, int dir, uint64_t adj);
+  /** Called when a channel is closed or freed.  May be NULL. */
+  void (*on_channel_released)(channel_t *chan);
+} scheduler_t;
+
 /* Global-visibility scheduler functions */
 
+/* Choose among schedulers */
+const scheduler_t *scheduler_get_by_name(const char *name);
+const scheduler_t *scheduler_get_current(void);
+void scheduler_set_schedulers(const smartlist_t *names);
+
 /* Set up and shut down the scheduler from main.c */
 void scheduler_free_all(void);
 void scheduler_init(void);
@@ -44,6 +77,9 @@ MOCK_DECL(STATIC int, scheduler_compare_channels,
           (const void *c1_v, const void *c2_v));
 STATIC uint64_t scheduler_get_queue_heuristic(void);
 STATIC void scheduler_update_queue_heuristic(time_t now);
+STATIC int64_t kist_compute_socket_limit(uint32_t cwnd, uint32_t unacked,
+                                         uint32_t mss, uint32_t outq,
+                                         size_t outbuf_len);
 
 #ifdef TOR_UNIT_TESTS
 extern smartlist_t *channels_pending;
@@ -35,6 +35,18 @@ static sr_state_t *sr_state = NULL;
  * translate the sr_state to this sr_disk_state. */
 static sr_disk_state_t *sr_disk_state = NULL;
 
+/* True iff the state file on disk holds a complete state that we can append
+ * commits to. */
+static int sr_disk_state_is_on_disk = 0;
+/* How many commit lines have we appended to the state file since we last
+ * wrote it out whole? */
+static int sr_disk_state_n_appended = 0;
+
+/* Once we have appended this many commit lines to the state file, write it
+ * out whole again so that it doesn't keep growing.  A protocol run needs
+ * at most two per authority: one for its commit, one for its reveal. */
+#define SR_DISK_STATE_MAX_APPENDED 64
+
 /* Disk state file keys. */
 static const char dstate_commit_key[] = "Commit";
 static const char dstate_prev_srv_key[] = "SharedRandPreviousValue";
@@ -414,6 +426,9 @@ disk_state_parse_commits(sr_state_t *state,
     /* We consider parseable commit from our disk state to be valid because
      * they need to be in the first place to get in there. */
     commit->valid = 1;
+    /* A later line for the same authority was appended after we learned
+     * more about its commit, such as its reveal value: it wins. */
+    sr_commit_free(digestmap_remove(state->commits, commit->rsa_identity));
     /* Add commit to our state pointer. */
     commit_add_to_state(commit, state);
 
@@ -724,6 +739,8 @@ disk_state_load_from_disk_impl(const char *fname)
   }
   state_set(parsed_state);
   disk_state_set(disk_state);
+  sr_disk_state_is_on_disk = 1;
+  sr_disk_state_n_appended = 0;
   tor_free(content);
   log_info(LD_DIR, "SR: State loaded successfully from file %s", fname);
   return 0;
@@ -770,6 +787,8 @@ disk_state_save_to_disk(void)
     goto done;
   }
   ret = 0;
+  sr_disk_state_is_on_disk = 1;
+  sr_disk_state_n_appended = 0;
   log_debug(LD_DIR, "SR: Saved state to file %s", fname);
 
  done:
@@ -778,6 +797,56 @@ disk_state_save_to_disk(void)
   return ret;
 }
 
+/* Record on disk that <b>commit</b> was added to our state or changed in
+ * it. Rather than rewrite the whole state file, append a Commit line for
+ * it: when we load the file, a later line for an authority replaces any
+ * earlier one. Fall back to a full save if there is no complete state file
+ * to append to, or if we have appended too much already. Return 0 on
+ * success else -1. */
+static int
+disk_state_append_commit_to_disk(const sr_commit_t *commit)
+{
+  config_line_t line;
+  char *content = NULL, *fname = NULL;
+  int ret;
+
+  tor_assert(commit);
+
+  /* If we didn't have the opportunity to setup an internal disk state,
+   * don't bother saving something to disk. */
+  if (sr_disk_state == NULL) {
+    return 0;
+  }
+  if (!sr_disk_state_is_on_disk ||
+      sr_disk_state_n_appended >= SR_DISK_STATE_MAX_APPENDED) {
+    return disk_state_save_to_disk();
+  }
+
+  memset(&line, 0, sizeof(line));
+  disk_state_put_commit_line(commit, &line);
+  tor_asprintf(&content, "%s %s\n", dstate_commit_key, line.value);
+  memwipe(line.value, 0, strlen(line.value));
+  tor_free(line.value);
+
+  fname = get_datadir_fname(default_fname);
+  if (append_bytes_to_file(fname, content, strlen(content), 0) < 0) {
+    log_warn(LD_FS, "SR: Unable to append to SR state file %s. Writing "
+             "it out whole.", fname);
+    ret = disk_state_save_to_disk();
+    goto done;
+  }
+  ++sr_disk_state_n_appended;
+  ret = 0;
+  log_debug(LD_DIR, "SR: Appended commit from %s to file %s",
+            sr_commit_get_rsa_fpr(commit), fname);
+
+ done:
+  memwipe(content, 0, strlen(content));
+  tor_free(content);
+  tor_free(fname);
+  return ret;
+}
+
 /* Reset our state to prepare for a new protocol run. Once this returns, all
  * commits in the state will be removed and freed. */
 STATIC void
@@ -998,8 +1067,15 @@ state_query(sr_state_action_t action, sr_state_object_t obj_type,
   }
 
   /* If the action actually changes the state, immediately save it to disk.
-   * The following will sync the state -> disk state and then save it. */
-  if (action != SR_STATE_ACTION_GET) {
+   * A single commit added or updated is appended to the state file; for
+   * anything else, sync the state -> disk state and then save it whole. */
+  if (action == SR_STATE_ACTION_GET) {
+    return;
+  }
+  if (obj_type == SR_STATE_OBJ_COMMIT && data != NULL &&
+      (action == SR_STATE_ACTION_PUT || action == SR_STATE_ACTION_SAVE)) {
+    disk_state_append_commit_to_disk(data);
+  } else {
     disk_state_save_to_disk();
   }
 }
@@ -1221,7 +1297,7 @@ sr_state_copy_reveal_info(sr_commit_t *saved_commit, const sr_commit_t *commit)
 
   strlcpy(saved_commit->encoded_reveal, commit->encoded_reveal,
           sizeof(saved_commit->encoded_reveal));
-  state_query(SR_STATE_ACTION_SAVE, 0, NULL, NULL);
+  state_query(SR_STATE_ACTION_SAVE, SR_STATE_OBJ_COMMIT, saved_commit, NULL);
   log_debug(LD_DIR, "SR: Reveal value learned %s (for commit %s) from %s",
             saved_commit->encoded_reveal, saved_commit->encoded_commit,
             sr_commit_get_rsa_fpr(saved_commit));
@@ -1259,6 +1335,8 @@ sr_state_free(void)
   /* Nullify our global state. */
   sr_state = NULL;
   sr_disk_state = NULL;
+  sr_disk_state_is_on_disk = 0;
+  sr_disk_state_n_appended = 0;
 }
 
 /* Save our current state in memory to disk. */
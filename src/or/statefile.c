@@ -446,7 +446,32 @@ did_last_state_file_write_fail(void)
  * bandwidth used, per-country user stats, etc. */
 #define STATE_RELAY_CHECKPOINT_INTERVAL (12*60*60)
 
-/** Write the persistent state to disk. Return 0 for success, <0 on failure. */
+/** Callback for write_str_to_file_async(): note whether we managed to write
+ * the state file <b>fname</b>. */
+static void
+or_state_save_done_cb(const char *fname, int status, void *arg)
+{
+  (void)arg;
+  if (status < 0) {
+    log_warn(LD_FS, "Unable to write state to file \"%s\"; "
+             "will try again later", fname);
+    last_state_file_write_failed = 1;
+    /* Try again after STATE_WRITE_RETRY_INTERVAL (or sooner, if the state
+     * changes sooner). */
+    if (global_state) {
+      time_t retry = time(NULL) + STATE_WRITE_RETRY_INTERVAL;
+      if (global_state->next_write > retry)
+        global_state->next_write = retry;
+    }
+    return;
+  }
+
+  last_state_file_write_failed = 0;
+  log_info(LD_GENERAL, "Saved state to \"%s\"", fname);
+}
+
+/** Write the persistent state to disk, or start doing so on a cpuworker.
+ * Return 0 for success, <0 on failure. */
 int
 or_state_save(time_t now)
 {
@@ -462,6 +487,7 @@ or_state_save(time_t now)
   /* Call everything else that might dirty the state even more, in order
    * to avoid redundant writes. */
   entry_guards_update_state(global_state);
+  connection_flush_bandwidth_history();
   rep_hist_update_state(global_state);
   circuit_build_times_update_state(get_circuit_build_times(), global_state);
   if (accounting_is_enabled(get_options()))
@@ -480,29 +506,17 @@ or_state_save(time_t now)
                "# You *do not* need to edit this file.\n\n%s",
                tbuf, state);
   tor_free(state);
-  fname = get_datadir_fname("state");
-  if (write_str_to_file(fname, contents, 0)<0) {
-    log_warn(LD_FS, "Unable to write state to file \"%s\"; "
-             "will try again later", fname);
-    last_state_file_write_failed = 1;
-    tor_free(fname);
-    tor_free(contents);
-    /* Try again after STATE_WRITE_RETRY_INTERVAL (or sooner, if the state
-     * changes sooner). */
-    global_state->next_write = now + STATE_WRITE_RETRY_INTERVAL;
-    return -1;
-  }
-
-  last_state_file_write_failed = 0;
-  log_info(LD_GENERAL, "Saved state to \"%s\"", fname);
-  tor_free(fname);
-  tor_free(contents);
-
   if (server_mode(get_options()))
     global_state->next_write = now + STATE_RELAY_CHECKPOINT_INTERVAL;
   else
     global_state->next_write = TIME_MAX;
 
+  fname = get_datadir_fname("state");
+  /* The write happens on a cpuworker if we have any: we learn how it went,
+   * and reschedule it if it failed, in or_state_save_done_cb(). */
+  write_str_to_file_async(fname, contents, or_state_save_done_cb, NULL);
+  tor_free(fname);
+
   return 0;
 }
 
@@ -17,6 +17,7 @@
 #include "or.h"
 #include "circuituse.h"
 #include "config.h"
+#include "dos.h"
 #include "status.h"
 #include "nodelist.h"
 #include "relay.h"
@@ -25,8 +26,10 @@
 #include "main.h"
 #include "rephist.h"
 #include "hibernate.h"
+#include "latency_trace.h"
 #include "rephist.h"
 #include "statefile.h"
+#include "rendservice.h"
 
 static void log_accounting(const time_t now, const or_options_t *options);
 #include "geoip.h"
@@ -145,10 +148,21 @@ log_heartbeat(time_t now)
   if (public_server_mode(options)) {
     rep_hist_log_circuit_handshake_stats(now);
     rep_hist_log_link_protocol_counts();
+    dos_log_heartbeat();
+  }
+
+  if (options->TLSSessionResumption) {
+    uint64_t attempted, resumed;
+    tor_tls_get_session_resumption_counts(&attempted, &resumed);
+    log_notice(LD_HEARTBEAT, "TLS session resumption: resumed "U64_FORMAT
+               " of "U64_FORMAT" offered sessions since startup.",
+               U64_PRINTF_ARG(resumed), U64_PRINTF_ARG(attempted));
   }
 
   circuit_log_ancient_one_hop_circuits(1800);
 
+  latency_trace_log(LOG_NOTICE);
+
   if (options->BridgeRelay) {
     char *msg = NULL;
     msg = format_client_stats_heartbeat(now);
@@ -157,6 +171,13 @@ log_heartbeat(time_t now)
     tor_free(msg);
   }
 
+  {
+    char *msg = rend_service_format_stats_heartbeat();
+    if (msg)
+      log_notice(LD_HEARTBEAT, "%s", msg);
+    tor_free(msg);
+  }
+
   tor_free(uptime);
   tor_free(bw_sent);
   tor_free(bw_rcvd);
@@ -557,6 +557,7 @@ void
 pt_configure_remaining_proxies(void)
 {
   int at_least_a_proxy_config_finished = 0;
+  int at_least_a_client_proxy_config_finished = 0;
   smartlist_t *tmp = smartlist_new();
 
   log_debug(LD_CONFIG, "Configuring remaining managed proxies (%d)!",
@@ -592,9 +593,15 @@ pt_configure_remaining_proxies(void)
 
     /* If the proxy is not fully configured, try to configure it
        futher. */
-    if (!proxy_configuration_finished(mp))
-      if (configure_proxy(mp) == 1)
+    if (!proxy_configuration_finished(mp)) {
+      /* configure_proxy() frees mp if the proxy broke. */
+      int is_server = mp->is_server;
+      if (configure_proxy(mp) == 1) {
         at_least_a_proxy_config_finished = 1;
+        if (!is_server)
+          at_least_a_client_proxy_config_finished = 1;
+      }
+    }
 
   } SMARTLIST_FOREACH_END(mp);
 
@@ -604,6 +611,15 @@ pt_configure_remaining_proxies(void)
 
   if (at_least_a_proxy_config_finished)
     mark_my_descriptor_dirty("configured managed proxies");
+
+  /* Bridges that were waiting for these transports can go now (or, if a
+   * proxy broke, fail now): don't make them wait for the next second's
+   * tick. */
+  if (at_least_a_client_proxy_config_finished) {
+    const or_options_t *options = get_options();
+    if (options->UseBridges && !net_is_disabled())
+      fetch_bridge_descriptors(options, time(NULL));
+  }
 }
 
 /** Attempt to continue configuring managed proxy <b>mp</b>.
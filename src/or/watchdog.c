@@ -0,0 +1,292 @@
+/* Copyright (c) 2016, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file watchdog.c
+ * \brief Notice when the main event loop stops running for too long.
+ *
+ * When MainLoopStallThreshold is set, the main loop runs a timer that
+ * fires several times per threshold and notes the time.  If the timer
+ * fires late by more than the threshold, some callback kept the loop busy
+ * for that long: we count that as a stall, and remember how long it was.
+ *
+ * Counting stalls after the fact doesn't tell us what caused them, so we
+ * also run a watchdog thread that checks the timer's progress.  When it
+ * sees the main loop stuck in the middle of a stall, it interrupts the
+ * main thread with log_sampled_backtrace() and logs what the main thread
+ * was running at the time.
+ **/
+
+#define WATCHDOG_PRIVATE
+#include "or.h"
+#include "backtrace.h"
+#include "compat_libevent.h"
+#include "sandbox.h"
+#include "watchdog.h"
+
+/** How often do we log the stack of a stalled main loop, at most? */
+#define WATCHDOG_SAMPLE_LOG_INTERVAL (10*60)
+/** How often do we log about stalls that have ended, at most? */
+#define WATCHDOG_STALL_LOG_INTERVAL (60)
+
+/** Protects all the watchdog state below that the watchdog thread reads. */
+static tor_mutex_t watchdog_lock;
+/** Signalled when the threshold changes, or when the thread should exit. */
+static tor_cond_t watchdog_cond;
+/** True iff we have initialized watchdog_lock and watchdog_cond. */
+static int watchdog_initialized = 0;
+/** True iff the watchdog thread is running. */
+static int watchdog_thread_running = 0;
+/** True iff the watchdog thread should exit. */
+static int watchdog_thread_should_exit = 0;
+/** Current stall threshold in msec, or 0 if we're not watching. */
+static int watchdog_threshold_msec = 0;
+/** How often the progress timer fires, in msec. */
+static int watchdog_interval_msec = 0;
+/** Monotonic time in msec when the progress timer last fired, or 0 if it
+ * hasn't fired since we started watching. */
+static uint64_t watchdog_last_beat_msec = 0;
+/** True iff the watchdog thread has already sampled the current stall. */
+static int watchdog_sampled_this_stall = 0;
+/** Statistics about the stalls we've seen. */
+static watchdog_stats_t watchdog_stats;
+
+/** Timer that notes main loop progress. */
+static periodic_timer_t *watchdog_timer = NULL;
+
+/** Record that the progress timer fired at <b>now_msec</b>.  If it fired
+ * late by more than the threshold, record a stall.  Return the length of
+ * the stall in msec, or 0 if there was none.  The lock must not be
+ * held. */
+STATIC uint64_t
+watchdog_note_progress(uint64_t now_msec)
+{
+  uint64_t stall = 0;
+
+  tor_mutex_acquire(&watchdog_lock);
+  if (watchdog_last_beat_msec &&
+      now_msec > watchdog_last_beat_msec + watchdog_interval_msec) {
+    uint64_t late = now_msec - watchdog_last_beat_msec -
+      watchdog_interval_msec;
+    if (watchdog_threshold_msec && late >= (uint64_t)watchdog_threshold_msec)
+      stall = late;
+  }
+  if (stall) {
+    ++watchdog_stats.n_stalls;
+    watchdog_stats.total_stall_msec += stall;
+    if (stall > watchdog_stats.max_stall_msec)
+      watchdog_stats.max_stall_msec = stall;
+  }
+  watchdog_last_beat_msec = now_msec;
+  watchdog_sampled_this_stall = 0;
+  tor_mutex_release(&watchdog_lock);
+
+  return stall;
+}
+
+/** Return true iff the watchdog thread, checking at <b>now_msec</b>,
+ * should sample the main thread's stack.  If so, note that it has
+ * sampled the current stall.  The lock must be held. */
+STATIC int
+watchdog_should_sample(uint64_t now_msec)
+{
+  if (!watchdog_threshold_msec || !watchdog_last_beat_msec ||
+      watchdog_sampled_this_stall)
+    return 0;
+  if (now_msec < watchdog_last_beat_msec + watchdog_interval_msec +
+      watchdog_threshold_msec)
+    return 0;
+  watchdog_sampled_this_stall = 1;
+  return 1;
+}
+
+/** Libevent callback: note that the main loop is making progress. */
+static void
+watchdog_timer_cb(periodic_timer_t *timer, void *arg)
+{
+  static ratelim_t stall_limit = RATELIM_INIT(WATCHDOG_STALL_LOG_INTERVAL);
+  uint64_t stall;
+  (void) timer;
+  (void) arg;
+
+  stall = watchdog_note_progress(monotime_absolute_msec());
+  if (stall) {
+    log_fn_ratelim(&stall_limit, LOG_NOTICE, LD_GENERAL,
+                   "The main event loop stalled for "U64_FORMAT" msec.",
+                   U64_PRINTF_ARG(stall));
+  }
+}
+
+/** Body of the watchdog thread: wake up twice per threshold, and sample
+ * the main thread's stack once per stall. */
+static void
+watchdog_thread_main(void *arg)
+{
+  static ratelim_t sample_limit = RATELIM_INIT(WATCHDOG_SAMPLE_LOG_INTERVAL);
+  (void) arg;
+
+  tor_mutex_acquire(&watchdog_lock);
+  while (!watchdog_thread_should_exit) {
+    struct timeval tv;
+    uint64_t now, since;
+    char *m;
+
+    if (!watchdog_threshold_msec) {
+      tor_cond_wait(&watchdog_cond, &watchdog_lock, NULL);
+      continue;
+    }
+    tv.tv_sec = (watchdog_threshold_msec / 2) / 1000;
+    tv.tv_usec = ((watchdog_threshold_msec / 2) % 1000) * 1000;
+    tor_cond_wait(&watchdog_cond, &watchdog_lock, &tv);
+
+    now = monotime_absolute_msec();
+    if (!watchdog_should_sample(now))
+      continue;
+    since = now - watchdog_last_beat_msec;
+    ++watchdog_stats.n_samples;
+    tor_mutex_release(&watchdog_lock);
+
+    if ((m = rate_limit_log(&sample_limit, approx_time()))) {
+      char *msg = NULL;
+      tor_asprintf(&msg, "The main event loop has not run for "U64_FORMAT
+                   " msec%s", U64_PRINTF_ARG(since), m);
+      if (sandbox_is_active())
+        log_warn(LD_GENERAL, "%s. (Stack trace not available with "
+                 "Sandbox enabled)", msg);
+      else
+        log_sampled_backtrace(LOG_WARN, LD_GENERAL, msg);
+      tor_free(msg);
+      tor_free(m);
+    }
+
+    tor_mutex_acquire(&watchdog_lock);
+  }
+  watchdog_thread_running = 0;
+  tor_cond_signal_all(&watchdog_cond);
+  tor_mutex_release(&watchdog_lock);
+}
+
+/** Start watching for main loop stalls of at least <b>threshold_msec</b>
+ * msec, or stop watching if <b>threshold_msec</b> is 0.  Must be called
+ * from the main thread, once its event loop exists. */
+void
+watchdog_set_threshold(int threshold_msec)
+{
+  struct timeval interval;
+  int start_thread = 0;
+
+  tor_assert(threshold_msec >= 0);
+  if (!watchdog_initialized) {
+    if (!threshold_msec)
+      return;
+    tor_mutex_init_for_cond(&watchdog_lock);
+    tor_cond_init(&watchdog_cond);
+    watchdog_initialized = 1;
+  }
+
+  periodic_timer_free(watchdog_timer);
+  watchdog_timer = NULL;
+
+  tor_mutex_acquire(&watchdog_lock);
+  watchdog_threshold_msec = threshold_msec;
+  watchdog_interval_msec = MAX(threshold_msec / 4, 1);
+  watchdog_last_beat_msec = 0;
+  watchdog_sampled_this_stall = 0;
+  if (threshold_msec && !watchdog_thread_running) {
+    watchdog_thread_running = 1;
+    watchdog_thread_should_exit = 0;
+    start_thread = 1;
+  }
+  tor_cond_signal_all(&watchdog_cond);
+  tor_mutex_release(&watchdog_lock);
+
+  if (!threshold_msec)
+    return;
+
+  if (configure_backtrace_sampling() < 0) {
+    log_info(LD_GENERAL, "Can't sample the main thread's stack on this "
+             "platform; stall reports won't include stack traces.");
+  }
+  if (start_thread && spawn_func(watchdog_thread_main, NULL) < 0) {
+    /* LCOV_EXCL_START */
+    log_warn(LD_GENERAL, "Unable to start the main loop watchdog thread; "
+             "stall reports won't include stack traces.");
+    tor_mutex_acquire(&watchdog_lock);
+    watchdog_thread_running = 0;
+    tor_mutex_release(&watchdog_lock);
+    /* LCOV_EXCL_STOP */
+  }
+
+  interval.tv_sec = watchdog_interval_msec / 1000;
+  interval.tv_usec = (watchdog_interval_msec % 1000) * 1000;
+  watchdog_timer = periodic_timer_new(tor_libevent_get_base(), &interval,
+                                      watchdog_timer_cb, NULL);
+  tor_assert(watchdog_timer);
+}
+
+/** Copy our statistics about main loop stalls into *<b>out</b>. */
+void
+watchdog_get_stats(watchdog_stats_t *out)
+{
+  if (!watchdog_initialized) {
+    memset(out, 0, sizeof(*out));
+    return;
+  }
+  tor_mutex_acquire(&watchdog_lock);
+  memcpy(out, &watchdog_stats, sizeof(*out));
+  tor_mutex_release(&watchdog_lock);
+}
+
+/** Return a newly allocated string describing our main loop stall
+ * statistics, for the "mainloop/stalls" GETINFO key. */
+char *
+watchdog_format_stats(void)
+{
+  watchdog_stats_t st;
+  char *result = NULL;
+
+  watchdog_get_stats(&st);
+  tor_asprintf(&result, "threshold-msec=%d count="U64_FORMAT
+               " total-msec="U64_FORMAT" max-msec="U64_FORMAT
+               " sampled="U64_FORMAT,
+               watchdog_threshold_msec,
+               U64_PRINTF_ARG(st.n_stalls),
+               U64_PRINTF_ARG(st.total_stall_msec),
+               U64_PRINTF_ARG(st.max_stall_msec),
+               U64_PRINTF_ARG(st.n_samples));
+  return result;
+}
+
+/** Stop the watchdog thread and release all storage held by the
+ * watchdog.  If <b>postfork</b>, we're in a child process that has no
+ * watchdog thread, and whose copy of the lock may be held: just forget
+ * everything. */
+void
+watchdog_free_all(int postfork)
+{
+  if (!watchdog_initialized)
+    return;
+
+  periodic_timer_free(watchdog_timer);
+  watchdog_timer = NULL;
+
+  if (!postfork) {
+    tor_mutex_acquire(&watchdog_lock);
+    watchdog_thread_should_exit = 1;
+    tor_cond_signal_all(&watchdog_cond);
+    while (watchdog_thread_running)
+      tor_cond_wait(&watchdog_cond, &watchdog_lock, NULL);
+    tor_mutex_release(&watchdog_lock);
+
+    tor_cond_uninit(&watchdog_cond);
+    tor_mutex_uninit(&watchdog_lock);
+  }
+  memset(&watchdog_stats, 0, sizeof(watchdog_stats));
+  watchdog_threshold_msec = 0;
+  watchdog_interval_msec = 0;
+  watchdog_last_beat_msec = 0;
+  watchdog_thread_running = 0;
+  watchdog_thread_should_exit = 0;
+  watchdog_initialized = 0;
+}
+
@@ -0,0 +1,37 @@
+/* Copyright (c) 2016, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file watchdog.h
+ * \brief Header file for watchdog.c.
+ **/
+
+#ifndef TOR_WATCHDOG_H
+#define TOR_WATCHDOG_H
+
+#include "testsupport.h"
+
+/** Statistics about main loop stalls. */
+typedef struct watchdog_stats_t {
+  /** Number of times the main loop has stalled for at least the
+   * threshold. */
+  uint64_t n_stalls;
+  /** Total and longest duration of those stalls, in msec. */
+  uint64_t total_stall_msec;
+  uint64_t max_stall_msec;
+  /** Number of stalls during which we sampled the main thread's stack. */
+  uint64_t n_samples;
+} watchdog_stats_t;
+
+void watchdog_set_threshold(int threshold_msec);
+void watchdog_get_stats(watchdog_stats_t *out);
+char *watchdog_format_stats(void);
+void watchdog_free_all(int postfork);
+
+#ifdef WATCHDOG_PRIVATE
+STATIC uint64_t watchdog_note_progress(uint64_t now_msec);
+STATIC int watchdog_should_sample(uint64_t now_msec);
+#endif
+
+#endif
+
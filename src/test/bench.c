@@ -15,19 +15,57 @@ const char tor_git_revision[] = "";
 
 #include "orconfig.h"
 
+#define RENDSERVICE_PRIVATE
+#define TOR_CHANNEL_INTERNAL_
 #include "or.h"
+#include "buffers.h"
+#include "channel.h"
+#include "circuitbuild.h"
+#include "circuitlist.h"
+#include "circuitmux.h"
+#include "circuitmux_ewma.h"
+#include "command.h"
+#include "compat_libevent.h"
+#include "connection.h"
+#include "connection_or.h"
+#include "cpuworker.h"
+#include "directory.h"
+#include "dirserv.h"
+#include "entrynodes.h"
+#include "handoffqueue.h"
+#include "main.h"
+#include "memacct.h"
+#include "microdesc.h"
+#include "networkstatus.h"
+#include "nodelist.h"
 #include "onion_tap.h"
 #include "relay.h"
+#include "rendcommon.h"
+/* We need rend_service_t, but we aren't built with TOR_UNIT_TESTS, so the
+ * private functions that rendservice.h declares are static and undefined
+ * here. */
+DISABLE_GCC_WARNING(unused-function)
+#include "rendservice.h"
+#include "rephist.h"
+#include "routerlist.h"
+#include "routerparse.h"
+#include "routerset.h"
+#include "scheduler.h"
+#include "statefile.h"
 #include <openssl/opensslv.h>
 #include <openssl/evp.h>
 #include <openssl/ec.h>
 #include <openssl/ecdh.h>
 #include <openssl/obj_mac.h>
+#ifdef HAVE_SYS_RESOURCE_H
+#include <sys/resource.h>
+#endif
 
 #include "config.h"
 #include "crypto_curve25519.h"
 #include "onion_ntor.h"
 #include "crypto_ed25519.h"
+#include "crypto_format.h"
 
 #if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_PROCESS_CPUTIME_ID)
 static uint64_t nanostart;
@@ -142,7 +180,7 @@ bench_onion_TAP(void)
   start = perftime();
   for (i = 0; i < iters; ++i) {
     char key_out[CPATH_KEY_MATERIAL_LEN];
-    onion_skin_TAP_server_handshake(os, key, NULL, or,
+    onion_skin_TAP_server_handshake(os, key, NULL, NULL, or,
                                     key_out, sizeof(key_out));
   }
   end = perftime();
@@ -152,7 +190,7 @@ bench_onion_TAP(void)
   start = perftime();
   for (i = 0; i < iters; ++i) {
     char key_out[CPATH_KEY_MATERIAL_LEN];
-    onion_skin_TAP_server_handshake(os, key2, key, or,
+    onion_skin_TAP_server_handshake(os, key2, key, NULL, or,
                                     key_out, sizeof(key_out));
   }
   end = perftime();
@@ -345,6 +383,22 @@ bench_cell_aes(void)
            NANOCOUNT(start, end, iters*len));
   }
 
+  {
+    const int n_cells = 8;
+    char *cells[8];
+    for (i = 0; i < n_cells; ++i)
+      cells[i] = tor_malloc(len);
+    start = perftime();
+    for (i = 0; i < iters / n_cells; ++i) {
+      crypto_cipher_crypt_inplace_multi(c, cells, n_cells, len);
+    }
+    end = perftime();
+    printf("%d bytes, batches of %d: %.2f nsec per byte\n", len, n_cells,
+           NANOCOUNT(start, end, (iters / n_cells) * n_cells * len));
+    for (i = 0; i < n_cells; ++i)
+      tor_free(cells[i]);
+  }
+
   crypto_cipher_free(c);
   tor_free(b);
 }
@@ -372,7 +426,7 @@ bench_dmap(void)
     crypto_rand(d, 20);
     smartlist_add(sl2, tor_memdup(d, 20));
   }
-  printf("nbits=%d\n", ds->mask+1);
+  printf("nbits=%d\n", (ds->mask+1) * DIGESTSET_BLOCK_WORDS * 64);
 
   reset_perftime();
 
@@ -424,6 +478,48 @@ bench_dmap(void)
   smartlist_free(sl2);
 }
 
+/** Run digestset_contains() on a set too large to stay in cache, where
+ * each lookup is dominated by memory latency. */
+static void
+bench_digestset(void)
+{
+  const int elts = 1<<20;
+  const int lookups = 1<<23;
+  char *digests = tor_malloc(elts * DIGEST_LEN);
+  char d[DIGEST_LEN];
+  digestset_t *ds = digestset_new(elts);
+  uint64_t start, end;
+  int i, n = 0, fp = 0;
+
+  crypto_rand(digests, elts * DIGEST_LEN);
+  for (i = 0; i < elts; ++i)
+    digestset_add(ds, digests + i * DIGEST_LEN);
+  printf("nbits=%d\n", (ds->mask+1) * DIGESTSET_BLOCK_WORDS * 64);
+
+  reset_perftime();
+  start = perftime();
+  for (i = 0; i < lookups; ++i)
+    n += digestset_contains(ds, digests + (i % elts) * DIGEST_LEN);
+  end = perftime();
+  printf("digestset_contains (present): %.2f ns per element\n",
+         NANOCOUNT(start, end, lookups));
+
+  memset(d, 0, sizeof(d));
+  start = perftime();
+  for (i = 0; i < lookups; ++i) {
+    set_uint32(d, (uint32_t)i);
+    fp += digestset_contains(ds, d);
+  }
+  end = perftime();
+  printf("digestset_contains (absent): %.2f ns per element\n",
+         NANOCOUNT(start, end, lookups));
+  printf("Hits == %d; false positive rate: %.4f%%\n", n,
+         (fp/(double)lookups)*100);
+
+  digestset_free(ds);
+  tor_free(digests);
+}
+
 static void
 bench_siphash(void)
 {
@@ -485,6 +581,84 @@ bench_digest(void)
   }
 }
 
+/** Helper for bench_codecs: print the time taken by <b>iters</b> calls
+ * to a codec on <b>len</b> bytes of binary data. */
+static void
+bench_codecs_report(const char *name, int len, int iters,
+                    uint64_t start, uint64_t end)
+{
+  double ns = NANOCOUNT(start, end, iters);
+  printf("%s(%d): %.2f ns per call; %.2f ns per byte; %.1f MB/s\n",
+         name, len, ns, ns / len, len / ns * 1000.0);
+}
+
+static void
+bench_codecs(void)
+{
+  const int lens[] = { 20, 32, 256, 4096, 65536, -1 };
+  const int total = 1<<24;
+  char *buf = tor_malloc(65536);
+  char *enc = tor_malloc(65536 * 2 + 2048);
+  char *dec = tor_malloc(65536 * 2);
+  uint64_t start, end;
+  int i, j, iters, enclen, n = 0;
+
+  crypto_rand(buf, 65536);
+
+  for (i = 0; lens[i] > 0; ++i) {
+    const int len = lens[i];
+    iters = total / len;
+
+    reset_perftime();
+    start = perftime();
+    for (j = 0; j < iters; ++j)
+      n += base64_encode(enc, len * 2 + 2048, buf, len, 0);
+    end = perftime();
+    bench_codecs_report("base64_encode", len, iters, start, end);
+
+    start = perftime();
+    for (j = 0; j < iters; ++j)
+      n += base64_encode(enc, len * 2 + 2048, buf, len,
+                         BASE64_ENCODE_MULTILINE);
+    end = perftime();
+    bench_codecs_report("base64_encode/multiline", len, iters, start, end);
+
+    enclen = (int)strlen(enc);
+    start = perftime();
+    for (j = 0; j < iters; ++j)
+      n += base64_decode(dec, len * 2, enc, enclen);
+    end = perftime();
+    bench_codecs_report("base64_decode/multiline", len, iters, start, end);
+    tor_assert(fast_memeq(dec, buf, len));
+
+    start = perftime();
+    for (j = 0; j < iters; ++j)
+      base16_encode(enc, len * 2 + 1, buf, len);
+    end = perftime();
+    bench_codecs_report("base16_encode", len, iters, start, end);
+
+    start = perftime();
+    for (j = 0; j < iters; ++j)
+      n += base16_decode(dec, len, enc, len * 2);
+    end = perftime();
+    bench_codecs_report("base16_decode", len, iters, start, end);
+    tor_assert(fast_memeq(dec, buf, len));
+
+    start = perftime();
+    for (j = 0; j < iters; ++j)
+      base32_encode(enc, base32_encoded_size(len), buf, len);
+    end = perftime();
+    bench_codecs_report("base32_encode", len, iters, start, end);
+  }
+  /* Keep the compiler from optimizing away the calls we're timing. */
+  if (n == 0)
+    puts("");
+
+  tor_free(buf);
+  tor_free(enc);
+  tor_free(dec);
+}
+
 static void
 bench_cell_ops(void)
 {
@@ -537,6 +711,234 @@ bench_cell_ops(void)
   tor_free(cell);
 }
 
+/** How many cells has a bench_cell_path() fake channel written? */
+static uint64_t bench_chan_cells_written = 0;
+
+static void
+bench_chan_close(channel_t *chan)
+{
+  (void)chan;
+}
+
+static const char *
+bench_chan_describe_transport(channel_t *chan)
+{
+  (void)chan;
+  return "benchmark channel";
+}
+
+static const char *
+bench_chan_get_remote_descr(channel_t *chan, int flags)
+{
+  (void)chan;
+  (void)flags;
+  return "fake";
+}
+
+static size_t
+bench_chan_num_bytes_queued(channel_t *chan)
+{
+  (void)chan;
+  return 0;
+}
+
+static int
+bench_chan_has_queued_writes(channel_t *chan)
+{
+  (void)chan;
+  return 0;
+}
+
+static int
+bench_chan_num_cells_writeable(channel_t *chan)
+{
+  (void)chan;
+  return INT_MAX;
+}
+
+static int
+bench_chan_write_cell(channel_t *chan, cell_t *cell)
+{
+  (void)chan;
+  tor_free(cell);
+  ++bench_chan_cells_written;
+  return 1;
+}
+
+static int
+bench_chan_write_packed_cell(channel_t *chan, packed_cell_t *packed_cell)
+{
+  (void)chan;
+  packed_cell_free(packed_cell);
+  ++bench_chan_cells_written;
+  return 1;
+}
+
+static int
+bench_chan_write_var_cell(channel_t *chan, var_cell_t *var_cell)
+{
+  (void)chan;
+  var_cell_free(var_cell);
+  ++bench_chan_cells_written;
+  return 1;
+}
+
+/** Return a new open channel, with an EWMA circuitmux, that accepts and
+ * discards every cell written to it. */
+static channel_t *
+bench_chan_new(void)
+{
+  channel_t *chan = tor_malloc_zero(sizeof(channel_t));
+  channel_init(chan);
+
+  chan->close = bench_chan_close;
+  chan->describe_transport = bench_chan_describe_transport;
+  chan->get_remote_descr = bench_chan_get_remote_descr;
+  chan->has_queued_writes = bench_chan_has_queued_writes;
+  chan->num_bytes_queued = bench_chan_num_bytes_queued;
+  chan->num_cells_writeable = bench_chan_num_cells_writeable;
+  chan->write_cell = bench_chan_write_cell;
+  chan->write_packed_cell = bench_chan_write_packed_cell;
+  chan->write_var_cell = bench_chan_write_var_cell;
+  chan->wide_circ_ids = 1;
+  chan->state = CHANNEL_STATE_OPEN;
+  chan->cmux = circuitmux_alloc();
+  circuitmux_set_policy(chan->cmux, &ewma_policy);
+
+  return chan;
+}
+
+#define CELL_PATH_N_CIRCS 128
+#define CELL_PATH_N_ROUNDS 256
+
+/** Push CELL_PATH_N_ROUNDS cells on each of CELL_PATH_N_CIRCS circuits
+ * through the whole relay cell path: command_process_cell(), relay
+ * crypto, the circuit's cell queue, the circuitmux, and
+ * channel_flush_from_first_active_circuit() onto a fake channel.
+ *
+ * We do this for cells that we relay away from the client, cells that we
+ * relay towards the client, and cells that are addressed to us (as they
+ * would be at an exit; we use DROP cells, so there's no stream to deliver
+ * them to). */
+static void
+bench_cell_path(void)
+{
+  const int n_cells = CELL_PATH_N_CIRCS * CELL_PATH_N_ROUNDS;
+  channel_t *p_chan = NULL, *n_chan = NULL;
+  crypto_cipher_t *client_ciphers[CELL_PATH_N_CIRCS];
+  crypto_digest_t *client_digests[CELL_PATH_N_CIRCS];
+  cell_t *exit_cells = NULL;
+  cell_t template, cell;
+  uint64_t start, end, reused_before, malloced_before, reused, malloced;
+  int i, round, pass;
+
+  /* options_validate() never ran, so pick queue limits ourselves. */
+  get_options_mutable()->MaxMemInQueues = UINT64_C(1) << 30;
+  get_options_mutable()->MaxMemInQueues_low_threshold = UINT64_C(3) << 28;
+  scheduler_init();
+  p_chan = bench_chan_new();
+  n_chan = bench_chan_new();
+
+  /* Build the circuits, and the client's half of each circuit's crypto */
+  for (i = 0; i < CELL_PATH_N_CIRCS; ++i) {
+    char n_key[CIPHER_KEY_LEN], p_key[CIPHER_KEY_LEN];
+    or_circuit_t *or_circ = or_circuit_new(i + 1, p_chan);
+    circuit_set_n_circid_chan(TO_CIRCUIT(or_circ), i + 1, n_chan);
+    or_circ->base_.state = CIRCUIT_STATE_OPEN;
+    or_circ->base_.purpose = CIRCUIT_PURPOSE_OR;
+
+    crypto_rand(n_key, sizeof(n_key));
+    crypto_rand(p_key, sizeof(p_key));
+    or_circ->n_crypto = crypto_cipher_new(n_key);
+    or_circ->p_crypto = crypto_cipher_new(p_key);
+    or_circ->n_digest = crypto_digest_new();
+    or_circ->p_digest = crypto_digest_new();
+    client_ciphers[i] = crypto_cipher_new(n_key);
+    client_digests[i] = crypto_digest_new();
+  }
+
+  /* Encrypt the cells addressed to us ahead of time, in the order that
+   * we'll receive them on each circuit. */
+  exit_cells = tor_calloc(n_cells, sizeof(cell_t));
+  for (round = 0; round < CELL_PATH_N_ROUNDS; ++round) {
+    for (i = 0; i < CELL_PATH_N_CIRCS; ++i) {
+      cell_t *c = &exit_cells[round * CELL_PATH_N_CIRCS + i];
+      relay_header_t rh;
+      char integrity[4];
+      memset(&rh, 0, sizeof(rh));
+      rh.command = RELAY_COMMAND_DROP;
+      c->circ_id = i + 1;
+      c->command = CELL_RELAY;
+      relay_header_pack(c->payload, &rh);
+      crypto_digest_add_bytes(client_digests[i], (char*)c->payload,
+                              CELL_PAYLOAD_SIZE);
+      crypto_digest_get_digest(client_digests[i], integrity, 4);
+      memcpy(c->payload + 5, integrity, 4);
+      crypto_cipher_crypt_inplace(client_ciphers[i], (char*)c->payload,
+                                  CELL_PAYLOAD_SIZE);
+    }
+  }
+
+  memset(&template, 0, sizeof(template));
+  template.command = CELL_RELAY;
+  crypto_rand((char*)template.payload, sizeof(template.payload));
+
+  /* The delivered cells go first, while each circuit's crypto state still
+   * matches the client's. */
+  for (pass = 0; pass < 3; ++pass) {
+    const char *name[] = { "Delivered (exit)", "Relayed outbound",
+                           "Relayed inbound" };
+    channel_t *in_chan = (pass == 2) ? n_chan : p_chan;
+    channel_t *out_chan = (pass == 2) ? p_chan : n_chan;
+
+    bench_chan_cells_written = 0;
+    packed_cell_get_alloc_stats(&reused_before, &malloced_before);
+    reset_perftime();
+    start = perftime();
+    for (round = 0; round < CELL_PATH_N_ROUNDS; ++round) {
+      for (i = 0; i < CELL_PATH_N_CIRCS; ++i) {
+        if (pass == 0) {
+          command_process_cell(in_chan,
+                               &exit_cells[round * CELL_PATH_N_CIRCS + i]);
+        } else {
+          memcpy(&cell, &template, sizeof(cell));
+          cell.circ_id = i + 1;
+          command_process_cell(in_chan, &cell);
+        }
+      }
+      if (pass != 0)
+        channel_flush_from_first_active_circuit(out_chan, CELL_PATH_N_CIRCS);
+    }
+    end = perftime();
+    packed_cell_get_alloc_stats(&reused, &malloced);
+
+    printf("%s cells: %.2f ns per cell (%.0f cells/sec); "
+           "%.3f packed cell mallocs and %.3f reuses per cell. "
+           "%d of %d cells written.\n",
+           name[pass],
+           NANOCOUNT(start, end, n_cells),
+           1.0e9 * n_cells / (double)(end - start + 1),
+           (double)(malloced - malloced_before) / n_cells,
+           (double)(reused - reused_before) / n_cells,
+           (int)bench_chan_cells_written,
+           pass == 0 ? 0 : n_cells);
+  }
+
+  for (i = 0; i < CELL_PATH_N_CIRCS; ++i) {
+    crypto_cipher_free(client_ciphers[i]);
+    crypto_digest_free(client_digests[i]);
+  }
+  tor_free(exit_cells);
+  circuit_free_all();
+  scheduler_release_channel(p_chan);
+  scheduler_release_channel(n_chan);
+  circuitmux_free(p_chan->cmux);
+  circuitmux_free(n_chan->cmux);
+  tor_free(p_chan);
+  tor_free(n_chan);
+  scheduler_free_all();
+}
+
 static void
 bench_dh(void)
 {
@@ -622,6 +1024,1462 @@ bench_ecdh_p224(void)
   bench_ecdh_impl(NID_secp224r1, "P-224");
 }
 
+/** State shared between the two threads of bench_handoff(). */
+typedef struct handoff_bench_t {
+  handoff_queue_t *q;
+  /** Items the producer sends. */
+  int n_items;
+  /** Items the consumer has received so far. */
+  int n_received;
+  /** If true, send one timestamped item at a time, waiting for each to
+   * arrive before sending the next. */
+  int latency_mode;
+  /** In latency mode, protects n_received and signals its changes. */
+  tor_mutex_t lock;
+  tor_cond_t cond;
+  /** True once the producer thread is finished with the queue. */
+  int producer_done;
+  /** Total nanoseconds from push to pop, in latency mode. */
+  uint64_t total_latency_nsec;
+  /** Consumer's buffer for popped items. */
+  char *buf;
+} handoff_bench_t;
+
+#define HANDOFF_BENCH_ITEM_SIZE CELL_MAX_NETWORK_SIZE
+#define HANDOFF_BENCH_BATCH 64
+
+static void
+handoff_bench_producer_(void *arg)
+{
+  handoff_bench_t *hb = arg;
+  char *items = tor_calloc(HANDOFF_BENCH_BATCH, HANDOFF_BENCH_ITEM_SIZE);
+  int i;
+
+  if (hb->latency_mode) {
+    for (i = 0; i < hb->n_items; ++i) {
+      uint64_t now = monotime_absolute_nsec();
+      memcpy(items, &now, sizeof(now));
+      handoff_queue_push_wait(hb->q, items, 1);
+      tor_mutex_acquire(&hb->lock);
+      while (hb->n_received <= i)
+        tor_cond_wait(&hb->cond, &hb->lock, NULL);
+      tor_mutex_release(&hb->lock);
+    }
+  } else {
+    for (i = 0; i < hb->n_items; i += HANDOFF_BENCH_BATCH)
+      handoff_queue_push_wait(hb->q, items, HANDOFF_BENCH_BATCH);
+  }
+  tor_free(items);
+
+  tor_mutex_acquire(&hb->lock);
+  hb->producer_done = 1;
+  tor_cond_signal_one(&hb->cond);
+  tor_mutex_release(&hb->lock);
+}
+
+static void
+handoff_bench_consumer_cb_(evutil_socket_t sock, short events, void *arg)
+{
+  handoff_bench_t *hb = arg;
+  int i, n;
+  (void)sock;
+  (void)events;
+
+  handoff_queue_clear_alert(hb->q);
+  do {
+    n = handoff_queue_pop(hb->q, hb->buf, HANDOFF_BENCH_BATCH);
+    if (hb->latency_mode) {
+      uint64_t now = monotime_absolute_nsec();
+      for (i = 0; i < n; ++i) {
+        uint64_t then;
+        memcpy(&then, hb->buf + i * HANDOFF_BENCH_ITEM_SIZE, sizeof(then));
+        hb->total_latency_nsec += now - then;
+      }
+    }
+    tor_mutex_acquire(&hb->lock);
+    hb->n_received += n;
+    tor_cond_signal_one(&hb->cond);
+    tor_mutex_release(&hb->lock);
+  } while (n == HANDOFF_BENCH_BATCH);
+
+  if (hb->n_received >= hb->n_items)
+    event_base_loopexit(tor_libevent_get_base(), NULL);
+}
+
+/** Run one handoff_queue_t benchmark pass. */
+static void
+bench_handoff_impl(handoff_bench_t *hb)
+{
+  struct event *ev;
+
+  hb->q = handoff_queue_new(HANDOFF_BENCH_ITEM_SIZE, 4096, 0);
+  hb->buf = tor_calloc(HANDOFF_BENCH_BATCH, HANDOFF_BENCH_ITEM_SIZE);
+  tor_mutex_init_for_cond(&hb->lock);
+  tor_cond_init(&hb->cond);
+  ev = tor_event_new(tor_libevent_get_base(),
+                     handoff_queue_get_socket(hb->q),
+                     EV_READ|EV_PERSIST, handoff_bench_consumer_cb_, hb);
+  event_add(ev, NULL);
+
+  spawn_func(handoff_bench_producer_, hb);
+  event_base_loop(tor_libevent_get_base(), 0);
+
+  tor_event_free(ev);
+  tor_free(hb->buf);
+  /* Don't let the caller free the queue under the producer's feet. */
+  tor_mutex_acquire(&hb->lock);
+  while (!hb->producer_done)
+    tor_cond_wait(&hb->cond, &hb->lock, NULL);
+  tor_mutex_release(&hb->lock);
+  tor_cond_uninit(&hb->cond);
+  tor_mutex_uninit(&hb->lock);
+}
+
+/** Measure how fast cell-sized items move from a worker thread to an event
+ * loop through a handoff_queue_t, how many wakeups that costs, and how long
+ * a single item takes to arrive. */
+static void
+bench_handoff(void)
+{
+  handoff_bench_t hb;
+  monotime_t start, end;
+  int64_t nsec;
+  uint64_t n_alerts;
+
+  memset(&hb, 0, sizeof(hb));
+  hb.n_items = 1<<20;
+  monotime_get(&start);
+  bench_handoff_impl(&hb);
+  monotime_get(&end);
+  nsec = monotime_diff_nsec(&start, &end);
+  n_alerts = handoff_queue_get_n_alerts(hb.q);
+  printf("handoff_queue: %.2f million cells/sec, "
+         "%.2f cells per wakeup\n",
+         hb.n_received * 1000.0 / nsec,
+         hb.n_received / (double)n_alerts);
+  handoff_queue_free(hb.q);
+
+  memset(&hb, 0, sizeof(hb));
+  hb.n_items = 500;
+  hb.latency_mode = 1;
+  bench_handoff_impl(&hb);
+  printf("handoff_queue: %.2f usec wakeup latency\n",
+         hb.total_latency_nsec / 1000.0 / hb.n_received);
+  handoff_queue_free(hb.q);
+}
+
+/** Directory holding a cached-microdesc-consensus and cached-microdescs for
+ * bench_dirserv() to serve, or NULL to make up our own. */
+static const char *bench_datadir = NULL;
+/** How many simulated clients bench_dirserv() keeps busy at once. */
+static int bench_n_dir_clients = 64;
+
+/** How many microdescriptors we make up when we have no real ones; about
+ * as many as there are relays in the network. */
+#define DIRSERV_BENCH_N_FAKE_MDS 7000
+/** How many microdescriptors a client asks for per request. */
+#define DIRSERV_BENCH_MDS_PER_REQUEST 90
+/** How many bytes we "write to the network" for each client on each
+ * pass. */
+#define DIRSERV_BENCH_WRITE_SIZE 16384
+
+/** Return a newly allocated string holding <b>n</b> made-up
+ * microdescriptors.  If <b>family_size</b> is more than 1, put every other
+ * block of <b>family_size</b> relays in a family, naming them as
+ * bench_fake_consensus() does.  If <b>digests_out</b> is provided, add the
+ * sha256 digest of each one to it. */
+static char *
+bench_fake_microdescs(int n, int family_size, smartlist_t *digests_out)
+{
+  smartlist_t *chunks = smartlist_new();
+  crypto_pk_t *pk = crypto_pk_new();
+  char *pem = NULL, *body;
+  size_t pem_len;
+  int i;
+
+  tor_assert(crypto_pk_generate_key(pk) == 0);
+  tor_assert(crypto_pk_write_public_key_to_string(pk, &pem, &pem_len) == 0);
+  for (i = 0; i < n; ++i) {
+    char ntor_key[DIGEST256_LEN], ntor_key64[BASE64_DIGEST256_LEN+1];
+    char *md, *family = NULL;
+    crypto_rand(ntor_key, sizeof(ntor_key));
+    digest256_to_base64(ntor_key64, ntor_key);
+    if (family_size > 1 && (i / family_size) % 2 == 0) {
+      smartlist_t *members = smartlist_new();
+      int j, first = i - i % family_size;
+      for (j = first; j < first + family_size && j < n; ++j) {
+        if (j != i)
+          smartlist_add_asprintf(members, "Relay%d", j);
+      }
+      family = smartlist_join_strings(members, " ", 0, NULL);
+      SMARTLIST_FOREACH(members, char *, cp, tor_free(cp));
+      smartlist_free(members);
+    }
+    tor_asprintf(&md, "onion-key\n%sntor-onion-key %s\n%s%s%s"
+                 "p accept 20-23,43,53,79-81,88,110,143,194,"
+                 "220,389,443,464-465,531,543-544,554,563,636,"
+                 "706,749,873,902-904,981,989-995\n",
+                 pem, ntor_key64, family ? "family " : "",
+                 family ? family : "", family ? "\n" : "");
+    tor_free(family);
+    if (digests_out) {
+      char *d = tor_malloc(DIGEST256_LEN);
+      crypto_digest256(d, md, strlen(md), DIGEST_SHA256);
+      smartlist_add(digests_out, d);
+    }
+    smartlist_add(chunks, md);
+  }
+  body = smartlist_join_strings(chunks, "", 0, NULL);
+
+  SMARTLIST_FOREACH(chunks, char *, cp, tor_free(cp));
+  smartlist_free(chunks);
+  tor_free(pem);
+  crypto_pk_free(pk);
+  return body;
+}
+
+/** Make up DIRSERV_BENCH_N_FAKE_MDS microdescriptors, and add them to the
+ * microdescriptor cache.  Return a list of the ones we added. */
+static smartlist_t *
+bench_dirserv_fake_microdescs(void)
+{
+  char *body = bench_fake_microdescs(DIRSERV_BENCH_N_FAKE_MDS, 0, NULL);
+  smartlist_t *added = microdescs_add_to_cache(get_microdesc_cache(), body,
+                                               NULL, SAVED_NOWHERE, 1,
+                                               time(NULL), NULL);
+  tor_free(body);
+  return added;
+}
+
+/** Make up a microdesc-flavored consensus listing the microdescriptors in
+ * <b>mds</b>, and start serving it. */
+static void
+bench_dirserv_fake_consensus(const smartlist_t *mds)
+{
+  smartlist_t *chunks = smartlist_new();
+  common_digests_t digests;
+  char *body;
+  int i = 0;
+
+  smartlist_add(chunks, tor_strdup("network-status-version 3 microdesc\n"
+                                   "vote-status consensus\n"));
+  SMARTLIST_FOREACH_BEGIN(mds, const microdesc_t *, md) {
+    char id[DIGEST_LEN], id64[BASE64_DIGEST_LEN+1];
+    char md64[BASE64_DIGEST256_LEN+1];
+    ++i;
+    crypto_rand(id, sizeof(id));
+    digest_to_base64(id64, id);
+    digest256_to_base64(md64, md->digest);
+    smartlist_add_asprintf(chunks,
+                           "r Relay%d %s 2016-11-01 00:00:00 10.%d.%d.%d "
+                           "9001 0\nm %s\ns Fast Guard Running Stable V2Dir "
+                           "Valid\nv Tor 0.2.9.8\nw Bandwidth=%d\n",
+                           i, id64, (i >> 16) & 0xff, (i >> 8) & 0xff,
+                           i & 0xff, md64, crypto_rand_int(100000));
+  } SMARTLIST_FOREACH_END(md);
+  body = smartlist_join_strings(chunks, "", 0, NULL);
+  crypto_common_digests(&digests, body, strlen(body));
+  dirserv_set_cached_consensus_networkstatus(body, "microdesc", &digests,
+                                             time(NULL));
+
+  SMARTLIST_FOREACH(chunks, char *, cp, tor_free(cp));
+  smartlist_free(chunks);
+  tor_free(body);
+}
+
+/** Load the microdesc consensus and microdescriptors from bench_datadir,
+ * and start serving them.  Return a list of the microdescriptors, or NULL
+ * on failure. */
+static smartlist_t *
+bench_dirserv_load(void)
+{
+  static const char *md_fnames[] = { "cached-microdescs",
+                                     "cached-microdescs.new" };
+  smartlist_t *mds = smartlist_new();
+  networkstatus_t *ns = NULL;
+  char *fname = NULL, *body = NULL;
+  unsigned i;
+
+  tor_asprintf(&fname, "%s"PATH_SEPARATOR"cached-microdesc-consensus",
+               bench_datadir);
+  body = read_file_to_str(fname, 0, NULL);
+  if (body)
+    ns = networkstatus_parse_vote_from_string(body, NULL, NS_TYPE_CONSENSUS);
+  if (!ns) {
+    printf("Couldn't load a consensus from %s\n", fname);
+    goto err;
+  }
+  dirserv_set_cached_consensus_networkstatus(body, "microdesc", &ns->digests,
+                                             ns->valid_after);
+  networkstatus_vote_free(ns);
+  tor_free(body);
+  tor_free(fname);
+
+  for (i = 0; i < ARRAY_LENGTH(md_fnames); ++i) {
+    smartlist_t *added;
+    tor_asprintf(&fname, "%s"PATH_SEPARATOR"%s", bench_datadir,
+                 md_fnames[i]);
+    body = read_file_to_str(fname, RFTS_IGNORE_MISSING, NULL);
+    if (body) {
+      /* Keep the annotations, but don't write anything back. */
+      added = microdescs_add_to_cache(get_microdesc_cache(), body, NULL,
+                                      SAVED_IN_JOURNAL, 1, -1, NULL);
+      smartlist_add_all(mds, added);
+      smartlist_free(added);
+    }
+    tor_free(body);
+    tor_free(fname);
+  }
+  if (!smartlist_len(mds)) {
+    printf("Couldn't load any microdescriptors from %s\n", bench_datadir);
+    goto err;
+  }
+  return mds;
+
+ err:
+  tor_free(body);
+  tor_free(fname);
+  smartlist_free(mds);
+  return NULL;
+}
+
+/** Return a new directory connection from a simulated client, which has
+ * just asked us for <b>url</b>.  Return NULL if we didn't answer with a
+ * 200 response. */
+static dir_connection_t *
+bench_dirserv_request(const char *url)
+{
+  dir_connection_t *conn = dir_connection_new(AF_INET);
+  char *request = NULL;
+  char status[12];
+
+  /* A local address, so that bandwidth limits don't apply. */
+  tor_addr_from_ipv4h(&conn->base_.addr, 0x7f000001);
+  conn->base_.address = tor_strdup("127.0.0.1");
+  conn->base_.purpose = DIR_PURPOSE_SERVER;
+  conn->base_.state = DIR_CONN_STATE_SERVER_COMMAND_WAIT;
+
+  tor_asprintf(&request, "GET %s HTTP/1.0\r\n\r\n", url);
+  write_to_buf(request, strlen(request), conn->base_.inbuf);
+  tor_free(request);
+  if (connection_dir_process_inbuf(conn) < 0 ||
+      connection_get_outbuf_len(TO_CONN(conn)) < sizeof(status) ||
+      fetch_from_buf(status, sizeof(status), conn->base_.outbuf) < 0 ||
+      fast_memneq(status, "HTTP/1.0 200", sizeof(status))) {
+    connection_free(TO_CONN(conn));
+    return NULL;
+  }
+  return conn;
+}
+
+/** Serve <b>n_requests</b> requests, taking their URLs from <b>urls</b> in
+ * turn, to bench_n_dir_clients simulated clients at once.  We drain each
+ * client's outbuf a bit at a time, as if we were writing to its socket,
+ * and refill it the way the main loop would. */
+static void
+bench_dirserv_run(const char *name, const smartlist_t *urls, int n_requests)
+{
+  dir_connection_t **conns;
+  char *scratch = tor_malloc(DIRSERV_BENCH_WRITE_SIZE);
+  int i, n_started = 0, n_finished = 0, n_active = 0;
+  uint64_t n_bytes = 0, start, end;
+  size_t peak = 0;
+  monotime_t wall_start, wall_end;
+  double secs;
+
+  conns = tor_calloc(bench_n_dir_clients, sizeof(dir_connection_t *));
+  reset_perftime();
+  start = perftime();
+  monotime_get(&wall_start);
+
+  for (i = 0; i < bench_n_dir_clients && n_started < n_requests; ++i) {
+    const char *url = smartlist_get(urls, n_started++ % smartlist_len(urls));
+    if (!(conns[i] = bench_dirserv_request(url))) {
+      printf("%s: the request for %s failed.\n", name, url);
+      goto done;
+    }
+    ++n_active;
+  }
+
+  while (n_active) {
+    size_t held = memacct_get_allocation(MEMACCT_BUFFERS) +
+      memacct_get_allocation(MEMACCT_COMPRESSION);
+    if (held > peak)
+      peak = held;
+
+    for (i = 0; i < bench_n_dir_clients; ++i) {
+      dir_connection_t *conn = conns[i];
+      size_t n;
+      if (!conn)
+        continue;
+      n = MIN(connection_get_outbuf_len(TO_CONN(conn)),
+              DIRSERV_BENCH_WRITE_SIZE);
+      fetch_from_buf(scratch, n, conn->base_.outbuf);
+      n_bytes += n;
+      if (conn->dir_spool_src != DIR_SPOOL_NONE) {
+        connection_dirserv_flushed_some(conn);
+      } else if (!connection_get_outbuf_len(TO_CONN(conn))) {
+        connection_free(TO_CONN(conn));
+        conns[i] = NULL;
+        --n_active;
+        ++n_finished;
+        if (n_started < n_requests) {
+          conns[i] = bench_dirserv_request(smartlist_get(urls,
+                                       n_started++ % smartlist_len(urls)));
+          if (conns[i])
+            ++n_active;
+        }
+      }
+    }
+  }
+
+  end = perftime();
+  monotime_get(&wall_end);
+  secs = monotime_diff_usec(&wall_start, &wall_end) / 1.0e6;
+  printf("%s: %d requests, %.1f requests/sec, %.2f MB/sec, "
+         "%.1f usec CPU per request, %.1f KB peak buffer memory\n",
+         name, n_finished, n_finished / secs,
+         n_bytes / secs / (1<<20),
+         MICROCOUNT(start, end, n_finished),
+         peak / 1024.0);
+
+ done:
+  for (i = 0; i < bench_n_dir_clients; ++i) {
+    if (conns[i])
+      connection_free(TO_CONN(conns[i]));
+  }
+  tor_free(conns);
+  tor_free(scratch);
+}
+
+/** Measure how fast we serve the consensus and microdescriptors, with and
+ * without compression, to many clients at once.  With --datadir, we serve
+ * the real documents from that directory's caches; otherwise we make up
+ * documents of about the right size. */
+static void
+bench_dirserv(void)
+{
+  smartlist_t *mds, *urls = smartlist_new(), *fps = smartlist_new();
+  int n_mds, i, compressed;
+
+  /* Don't keep per-request statistics: they would grow as we run. */
+  get_options_mutable()->DirReqStatistics = 0;
+  init_connection_lists();
+
+  if (bench_datadir) {
+    if (!(mds = bench_dirserv_load()))
+      goto done;
+  } else {
+    mds = bench_dirserv_fake_microdescs();
+    bench_dirserv_fake_consensus(mds);
+  }
+  n_mds = smartlist_len(mds);
+  printf("Serving %d microdescriptors to %d clients at once.\n",
+         n_mds, bench_n_dir_clients);
+
+  for (compressed = 0; compressed < 2; ++compressed) {
+    const char *z = compressed ? ".z" : "";
+    char *cp;
+
+    tor_asprintf(&cp, "/tor/status-vote/current/consensus-microdesc%s", z);
+    smartlist_add(urls, cp);
+    bench_dirserv_run(compressed ? "Compressed consensus" : "Consensus",
+                      urls, 200);
+    SMARTLIST_FOREACH(urls, char *, u, tor_free(u));
+    smartlist_clear(urls);
+
+    for (i = 0; i < n_mds; ++i) {
+      char *md64 = tor_malloc(BASE64_DIGEST256_LEN+1);
+      const microdesc_t *md = smartlist_get(mds, i);
+      digest256_to_base64(md64, md->digest);
+      smartlist_add(fps, md64);
+      if (smartlist_len(fps) == DIRSERV_BENCH_MDS_PER_REQUEST ||
+          i == n_mds - 1) {
+        char *joined = smartlist_join_strings(fps, "-", 0, NULL);
+        smartlist_add_asprintf(urls, "/tor/micro/d/%s%s", joined, z);
+        tor_free(joined);
+        SMARTLIST_FOREACH(fps, char *, fp, tor_free(fp));
+        smartlist_clear(fps);
+      }
+    }
+    bench_dirserv_run(compressed ? "Compressed microdescriptors" :
+                      "Microdescriptors", urls, 2000);
+    SMARTLIST_FOREACH(urls, char *, u, tor_free(u));
+    smartlist_clear(urls);
+  }
+  smartlist_free(mds);
+
+#ifdef HAVE_SYS_RESOURCE_H
+  {
+    struct rusage ru;
+    if (getrusage(RUSAGE_SELF, &ru) == 0)
+      printf("Peak resident memory: %ld KB\n", (long)ru.ru_maxrss);
+  }
+#endif
+
+ done:
+  smartlist_free(urls);
+  smartlist_free(fps);
+}
+
+/** How many relays are in each of the networks that bench_consensus()
+ * makes up. */
+static const int consensus_bench_sizes[] = { 10000, 20000 };
+
+/** When the phase we're timing started, and how much heap we had then. */
+static uint64_t consensus_phase_start;
+static size_t consensus_phase_heap;
+
+/** Start timing a phase of loading a consensus. */
+static void
+consensus_phase_begin(void)
+{
+  consensus_phase_heap = tor_get_malloc_in_use();
+  reset_perftime();
+  consensus_phase_start = perftime();
+}
+
+/** Report how long the phase called <b>name</b> took, and how much it
+ * grew the heap. */
+static void
+consensus_phase_end(const char *name)
+{
+  uint64_t end = perftime();
+  size_t heap = tor_get_malloc_in_use();
+  printf("  %-32s %10.2f msec, %+9.1f KB heap\n", name,
+         NANOCOUNT(consensus_phase_start, end, 1) / 1e6,
+         ((double)heap - (double)consensus_phase_heap) / 1024);
+}
+
+/** Load <b>consensus</b>, a microdesc consensus, and the microdescriptors
+ * in <b>mds</b>, as a client would.  Time each phase. */
+static void
+bench_consensus_load(const char *name, const char *consensus,
+                     const char *mds)
+{
+  networkstatus_t *ns;
+  smartlist_t *added;
+  int r;
+
+  /* Start from nothing, as at startup. */
+  networkstatus_free_all();
+  nodelist_free_all();
+  microdesc_free_all();
+
+  printf("%s:\n", name);
+  consensus_phase_begin();
+  ns = networkstatus_parse_vote_from_string(consensus, NULL,
+                                            NS_TYPE_CONSENSUS);
+  consensus_phase_end("networkstatus_parse_vote");
+  if (!ns) {
+    printf("  Couldn't parse the consensus.\n");
+    return;
+  }
+  printf("  (%d routerstatus entries)\n",
+         smartlist_len(ns->routerstatus_list));
+
+  consensus_phase_begin();
+  r = networkstatus_check_consensus_signature(ns, -1);
+  consensus_phase_end("check signatures");
+  networkstatus_vote_free(ns);
+  if (r < 0)
+    printf("  The consensus isn't signed enough; we'll keep going.\n");
+
+  /* This parses and checks the consensus again, then applies it. */
+  consensus_phase_begin();
+  r = networkstatus_set_current_consensus(consensus, "microdesc",
+                                          NSSET_FROM_CACHE |
+                                          NSSET_DONT_DOWNLOAD_CERTS |
+                                          NSSET_ACCEPT_OBSOLETE, NULL);
+  consensus_phase_end("networkstatus_set_current");
+  if (r < 0 || !networkstatus_get_latest_consensus_by_flavor(FLAV_MICRODESC)) {
+    printf("  We didn't accept the consensus.\n");
+    return;
+  }
+
+  consensus_phase_begin();
+  added = microdescs_add_to_cache(get_microdesc_cache(), mds, NULL,
+                                  SAVED_IN_JOURNAL, 1, -1, NULL);
+  consensus_phase_end("microdescs_add_to_cache");
+  printf("  (%d microdescriptors)\n", smartlist_len(added));
+  smartlist_free(added);
+
+  /* As when we load a new consensus with the microdescriptors cached. */
+  nodelist_free_all();
+  consensus_phase_begin();
+  nodelist_set_consensus(
+              networkstatus_get_latest_consensus_by_flavor(FLAV_MICRODESC));
+  consensus_phase_end("nodelist_set_consensus");
+}
+
+/** Load the microdesc consensus, certificates, and microdescriptors from
+ * bench_datadir, and time loading them. */
+static void
+bench_consensus_fixture(void)
+{
+  static const char *fnames[] = { "cached-microdesc-consensus",
+                                  "cached-certs",
+                                  "cached-microdescs",
+                                  "cached-microdescs.new" };
+  char *bodies[ARRAY_LENGTH(fnames)];
+  char *mds = NULL;
+  unsigned i;
+
+  for (i = 0; i < ARRAY_LENGTH(fnames); ++i) {
+    char *fname = NULL;
+    tor_asprintf(&fname, "%s"PATH_SEPARATOR"%s", bench_datadir, fnames[i]);
+    bodies[i] = read_file_to_str(fname, RFTS_IGNORE_MISSING, NULL);
+    tor_free(fname);
+  }
+  if (!bodies[0]) {
+    printf("No cached-microdesc-consensus in %s\n", bench_datadir);
+    goto done;
+  }
+  if (bodies[1])
+    trusted_dirs_load_certs_from_string(bodies[1],
+                                 TRUSTED_DIRS_CERTS_SRC_FROM_STORE, 0, NULL);
+  tor_asprintf(&mds, "%s%s", bodies[2] ? bodies[2] : "",
+               bodies[3] ? bodies[3] : "");
+
+  bench_consensus_load(bench_datadir, bodies[0], mds);
+
+ done:
+  for (i = 0; i < ARRAY_LENGTH(fnames); ++i)
+    tor_free(bodies[i]);
+  tor_free(mds);
+}
+
+/** Return a newly allocated v3 authority certificate for <b>id_key</b>
+ * and <b>signing_key</b>. */
+static char *
+bench_fake_authority_cert(crypto_pk_t *id_key, crypto_pk_t *signing_key)
+{
+  char fp[HEX_DIGEST_LEN+1], id_digest[DIGEST_LEN], digest[DIGEST_LEN];
+  char published[ISO_TIME_LEN+1], expires[ISO_TIME_LEN+1];
+  char *id_pem = NULL, *sk_pem = NULL, *crosscert, *sig, *body, *cert;
+  size_t len;
+  time_t now = time(NULL);
+
+  crypto_pk_get_fingerprint(id_key, fp, 0);
+  crypto_pk_get_digest(id_key, id_digest);
+  format_iso_time(published, now - 3600);
+  format_iso_time(expires, now + 365*86400);
+  crypto_pk_write_public_key_to_string(id_key, &id_pem, &len);
+  crypto_pk_write_public_key_to_string(signing_key, &sk_pem, &len);
+  crosscert = router_get_dirobj_signature(id_digest, DIGEST_LEN, signing_key);
+
+  tor_asprintf(&body, "dir-key-certificate-version 3\n"
+               "fingerprint %s\n"
+               "dir-key-published %s\n"
+               "dir-key-expires %s\n"
+               "dir-identity-key\n%s"
+               "dir-signing-key\n%s"
+               "dir-key-crosscert\n%s"
+               "dir-key-certification\n",
+               fp, published, expires, id_pem, sk_pem, crosscert);
+  crypto_digest(digest, body, strlen(body));
+  sig = router_get_dirobj_signature(digest, DIGEST_LEN, id_key);
+  tor_asprintf(&cert, "%s%s", body, sig);
+
+  tor_free(id_pem);
+  tor_free(sk_pem);
+  tor_free(crosscert);
+  tor_free(body);
+  tor_free(sig);
+  return cert;
+}
+
+/** Return a newly allocated microdesc consensus with <b>n_relays</b>
+ * relays, which use the microdescriptors whose digests are in
+ * <b>md_digests</b>.  Sign it as the only authority, with <b>id_key</b>
+ * and <b>signing_key</b>. */
+static char *
+bench_fake_consensus(int n_relays, const smartlist_t *md_digests,
+                     crypto_pk_t *id_key, crypto_pk_t *signing_key)
+{
+  smartlist_t *chunks = smartlist_new(), *ids = smartlist_new();
+  char id_hex[HEX_DIGEST_LEN+1], sk_hex[HEX_DIGEST_LEN+1];
+  char vote_digest[DIGEST_LEN], vote_hex[HEX_DIGEST_LEN+1];
+  char va[ISO_TIME_LEN+1], fu[ISO_TIME_LEN+1], vu[ISO_TIME_LEN+1];
+  char pub[ISO_TIME_LEN+1];
+  char digest[DIGEST256_LEN];
+  char *signed_part, *sig, *result;
+  time_t now = time(NULL);
+  int i;
+
+  crypto_pk_get_fingerprint(id_key, id_hex, 0);
+  crypto_pk_get_fingerprint(signing_key, sk_hex, 0);
+  crypto_rand(vote_digest, sizeof(vote_digest));
+  base16_encode(vote_hex, sizeof(vote_hex), vote_digest, DIGEST_LEN);
+  format_iso_time(va, now - 60);
+  format_iso_time(fu, now + 3600);
+  format_iso_time(vu, now + 3*3600);
+  format_iso_time(pub, now - 2*3600);
+
+  smartlist_add_asprintf(chunks,
+                 "network-status-version 3 microdesc\n"
+                 "vote-status consensus\n"
+                 "consensus-method 25\n"
+                 "valid-after %s\n"
+                 "fresh-until %s\n"
+                 "valid-until %s\n"
+                 "voting-delay 300 300\n"
+                 "client-versions 0.2.9.8,0.3.0.1-alpha\n"
+                 "server-versions 0.2.9.8,0.3.0.1-alpha\n"
+                 "known-flags Exit Fast Guard HSDir Running Stable V2Dir "
+                 "Valid\n"
+                 "params CircuitPriorityHalflifeMsec=30000 "
+                 "NumDirectoryGuards=3 NumEntryGuards=1\n"
+                 "dir-source bench %s 127.0.0.1 127.0.0.1 80 443\n"
+                 "contact bench\n"
+                 "vote-digest %s\n",
+                 va, fu, vu, id_hex, vote_hex);
+
+  /* Routerstatus entries must be sorted by identity. */
+  for (i = 0; i < n_relays; ++i) {
+    char *id = tor_malloc(DIGEST_LEN);
+    crypto_rand(id, DIGEST_LEN);
+    smartlist_add(ids, id);
+  }
+  smartlist_sort_digests(ids);
+  for (i = 0; i < n_relays; ++i) {
+    char id64[BASE64_DIGEST_LEN+1], md64[BASE64_DIGEST256_LEN+1];
+    digest_to_base64(id64, smartlist_get(ids, i));
+    digest256_to_base64(md64, smartlist_get(md_digests, i));
+    smartlist_add_asprintf(chunks,
+                 "r Relay%d %s %s 10.%d.%d.%d 9001 0\n"
+                 "m %s\n"
+                 "s %s\n"
+                 "v Tor 0.2.9.8\n"
+                 "pr Cons=1-2 Desc=1-2 DirCache=1 HSDir=1 HSIntro=3 "
+                 "HSRend=1-2 Link=1-4 LinkAuth=1 Microdesc=1-2 Relay=1-2\n"
+                 "w Bandwidth=%d\n",
+                 i, id64, pub, i & 0xff, (i >> 8) & 0xff, 1 + (i >> 16), md64,
+                 (i % 4) ? "Fast Guard HSDir Running Stable V2Dir Valid" :
+                           "Exit Fast Running V2Dir Valid",
+                 1 + crypto_rand_int(100000));
+  }
+  smartlist_add(chunks, tor_strdup("directory-footer\n"
+                 "bandwidth-weights Wbd=0 Wbe=0 Wbg=4194 Wbm=10000 "
+                 "Wdb=10000 Web=10000 Wed=10000 Wee=10000 Weg=10000 "
+                 "Wem=10000 Wgb=10000 Wgd=0 Wgg=5806 Wgm=5806 Wmb=10000 "
+                 "Wmd=0 Wme=0 Wmg=4194 Wmm=10000\n"
+                 "directory-signature "));
+
+  /* The signature covers everything up to "directory-signature ". */
+  signed_part = smartlist_join_strings(chunks, "", 0, NULL);
+  crypto_digest256(digest, signed_part, strlen(signed_part), DIGEST_SHA256);
+  sig = router_get_dirobj_signature(digest, DIGEST256_LEN, signing_key);
+  tor_asprintf(&result, "%ssha256 %s %s\n%s", signed_part, id_hex, sk_hex,
+               sig);
+
+  SMARTLIST_FOREACH(ids, char *, cp, tor_free(cp));
+  smartlist_free(ids);
+  SMARTLIST_FOREACH(chunks, char *, cp, tor_free(cp));
+  smartlist_free(chunks);
+  tor_free(signed_part);
+  tor_free(sig);
+  return result;
+}
+
+/** Make up a v3 authority, and make it our only trusted directory
+ * server, so that we can sign made-up consensuses.  Set *<b>id_key_out</b>
+ * and *<b>signing_key_out</b> to its keys. */
+static void
+bench_fake_authority_new(crypto_pk_t **id_key_out,
+                         crypto_pk_t **signing_key_out)
+{
+  crypto_pk_t *id_key = crypto_pk_new(), *signing_key = crypto_pk_new();
+  char id_digest[DIGEST_LEN];
+  char *cert;
+
+  tor_assert(crypto_pk_generate_key_with_bits(id_key, 2048) == 0);
+  tor_assert(crypto_pk_generate_key_with_bits(signing_key, 2048) == 0);
+  crypto_pk_get_digest(id_key, id_digest);
+  clear_dir_servers();
+  dir_server_add(trusted_dir_server_new("bench", "127.0.0.1", 80, 443, NULL,
+                                        id_digest, id_digest, V3_DIRINFO,
+                                        1.0));
+  cert = bench_fake_authority_cert(id_key, signing_key);
+  tor_assert(trusted_dirs_load_certs_from_string(cert,
+                         TRUSTED_DIRS_CERTS_SRC_FROM_STORE, 0, NULL) == 0);
+  tor_free(cert);
+  *id_key_out = id_key;
+  *signing_key_out = signing_key;
+}
+
+/** Measure how long the main thread spends parsing and applying a new
+ * consensus and its microdescriptors, for the recorded documents in
+ * --datadir if we have them, and for made-up networks of several sizes. */
+static void
+bench_consensus(void)
+{
+  crypto_pk_t *id_key = NULL, *signing_key = NULL;
+  unsigned i;
+
+  /* We aren't a cache: don't keep the documents around to serve. */
+  get_options_mutable()->DirCache = 0;
+
+  if (bench_datadir)
+    bench_consensus_fixture();
+
+  bench_fake_authority_new(&id_key, &signing_key);
+
+  for (i = 0; i < ARRAY_LENGTH(consensus_bench_sizes); ++i) {
+    const int n = consensus_bench_sizes[i];
+    smartlist_t *md_digests = smartlist_new();
+    char *mds = bench_fake_microdescs(n, 0, md_digests);
+    char *consensus = bench_fake_consensus(n, md_digests, id_key,
+                                           signing_key);
+    char *name = NULL;
+    tor_asprintf(&name, "Made-up network of %d relays", n);
+    bench_consensus_load(name, consensus, mds);
+    tor_free(name);
+    tor_free(consensus);
+    tor_free(mds);
+    SMARTLIST_FOREACH(md_digests, char *, cp, tor_free(cp));
+    smartlist_free(md_digests);
+  }
+
+  networkstatus_free_all();
+  nodelist_free_all();
+  microdesc_free_all();
+  crypto_pk_free(id_key);
+  crypto_pk_free(signing_key);
+}
+
+/** How many relays are in each of the networks that
+ * bench_path_selection() makes up. */
+static const int path_bench_sizes[] = { 7000, 20000, 50000 };
+/** How many times we make each choice. */
+#define PATH_BENCH_ITERATIONS 200
+/** How many relays are in each family in the made-up networks.  Half the
+ * relays are in a family. */
+#define PATH_BENCH_FAMILY_SIZE 4
+/** What we exclude in the ExcludeNodes scenario: about one relay in
+ * sixteen. */
+#define PATH_BENCH_EXCLUDED_NODES \
+  "10.0.0.0/12,10.16.0.0/15,10.32.0.0/14"
+
+/** Make <b>n</b> choices of one kind, and report how long each took.
+ * <b>choose</b> makes one choice, and returns 0 if it failed. */
+static void
+bench_path_time(const char *name, int (*choose)(void))
+{
+  uint64_t start, end;
+  int i, n_failed = 0;
+  reset_perftime();
+  start = perftime();
+  for (i = 0; i < PATH_BENCH_ITERATIONS; ++i) {
+    if (!choose())
+      ++n_failed;
+  }
+  end = perftime();
+  printf("    %-40s %9.2f usec/choice", name,
+         MICROCOUNT(start, end, PATH_BENCH_ITERATIONS));
+  if (n_failed)
+    printf(" (%d failed)", n_failed);
+  puts("");
+}
+
+/** A made-up circuit, whose exit is the first hop chosen. */
+static cpath_build_state_t *path_bench_state = NULL;
+/** A guard for path_bench_state. */
+static const node_t *path_bench_guard = NULL;
+/** Running nodes, to choose among by bandwidth. */
+static smartlist_t *path_bench_running = NULL;
+
+/** Choose an exit as circuit_establish_circuit() does. */
+static int
+bench_path_choose_exit(void)
+{
+  extend_info_t *ei = circuit_choose_general_exit(0);
+  extend_info_free(ei);
+  return ei != NULL;
+}
+
+/** Choose a middle for path_bench_state as choose_good_middle_server()
+ * does: excluding the exit, the guard, and their families. */
+static int
+bench_path_choose_middle(void)
+{
+  const node_t *exit_node = build_state_get_exit_node(path_bench_state);
+  smartlist_t *excluded = smartlist_new();
+  const node_t *node;
+  if (exit_node)
+    nodelist_add_node_and_family(excluded, exit_node);
+  if (path_bench_guard)
+    nodelist_add_node_and_family(excluded, path_bench_guard);
+  node = router_choose_random_node(excluded, get_options()->ExcludeNodes,
+                                   CRN_NEED_DESC);
+  smartlist_free(excluded);
+  return node != NULL;
+}
+
+/** Choose an entry for path_bench_state from our guards. */
+static int
+bench_path_choose_guard(void)
+{
+  return choose_random_entry(path_bench_state) != NULL;
+}
+
+/** Choose an entry for path_bench_state without entry guards. */
+static int
+bench_path_choose_entry(void)
+{
+  const node_t *node;
+  get_options_mutable()->UseEntryGuards = 0;
+  node = choose_good_entry_server(CIRCUIT_PURPOSE_C_GENERAL,
+                                  path_bench_state);
+  get_options_mutable()->UseEntryGuards = 1;
+  return node != NULL;
+}
+
+/** Choose a middle by bandwidth from path_bench_running, reusing the
+ * cached alias table. */
+static int
+bench_path_choose_by_bw(void)
+{
+  return node_sl_choose_by_bandwidth(path_bench_running,
+                                     WEIGHT_FOR_MID) != NULL;
+}
+
+/** As bench_path_choose_by_bw(), but rebuild the alias table each time. */
+static int
+bench_path_choose_by_bw_uncached(void)
+{
+  routerlist_clear_bandwidth_choice_cache();
+  return bench_path_choose_by_bw();
+}
+
+/** Time every kind of choice we make when building a circuit, on the
+ * network that we've loaded, with the options we have now. */
+static void
+bench_path_scenario(const char *name)
+{
+  extend_info_t *ei;
+
+  printf("  %s:\n", name);
+  /* Start with a new guard list, picked with these options. */
+  entry_guards_free_all();
+  routerlist_clear_bandwidth_choice_cache();
+
+  path_bench_running = smartlist_new();
+  router_add_running_nodes_to_smartlist(path_bench_running, 0, 0, 0, 0, 1,
+                                        0, 0);
+  path_bench_state = tor_malloc_zero(sizeof(cpath_build_state_t));
+  ei = circuit_choose_general_exit(0);
+  if (!ei) {
+    printf("    Couldn't choose an exit.\n");
+    goto done;
+  }
+  path_bench_state->chosen_exit = ei;
+  path_bench_guard = choose_random_entry(path_bench_state);
+
+  bench_path_time("circuit_choose_general_exit", bench_path_choose_exit);
+  bench_path_time("middle (as choose_good_middle_server)",
+                  bench_path_choose_middle);
+  bench_path_time("choose_random_entry", bench_path_choose_guard);
+  bench_path_time("choose_good_entry_server, no guards",
+                  bench_path_choose_entry);
+  bench_path_time("node_sl_choose_by_bandwidth", bench_path_choose_by_bw);
+  bench_path_time("node_sl_choose_by_bandwidth, uncached",
+                  bench_path_choose_by_bw_uncached);
+
+ done:
+  extend_info_free(path_bench_state->chosen_exit);
+  tor_free(path_bench_state);
+  smartlist_free(path_bench_running);
+  path_bench_running = NULL;
+  path_bench_guard = NULL;
+}
+
+/** Give ourselves an empty data directory, and load a new state file into
+ * it.  (Choosing guards changes the state file, so we need one; we never
+ * save it.)  Return the directory, or NULL if we couldn't make it. */
+static char *
+bench_state_dir_new(void)
+{
+  or_options_t *options = get_options_mutable();
+  const char *tmp = getenv("TMPDIR");
+  char *datadir = NULL;
+
+  tor_asprintf(&datadir, "%s"PATH_SEPARATOR"tor-bench-%d",
+               tmp ? tmp : "/tmp", (int)getpid());
+  if (check_private_dir(datadir, CPD_CREATE, NULL) < 0) {
+    printf("Couldn't create %s\n", datadir);
+    tor_free(datadir);
+    return NULL;
+  }
+  tor_free(options->DataDirectory);
+  options->DataDirectory = tor_strdup(datadir);
+  rep_hist_init();
+  tor_assert(or_state_load() == 0);
+  return datadir;
+}
+
+/** Forget the state that bench_state_dir_new() loaded, and remove
+ * <b>datadir</b>. */
+static void
+bench_state_dir_free(char *datadir)
+{
+  if (!datadir)
+    return;
+  static const char *files[] = {
+    "state", "cached-certs", "cached-microdesc-consensus",
+    "cached-microdescs", "cached-microdescs.new",
+  };
+  unsigned i;
+  entry_guards_free_all();
+  or_state_free_all();
+  for (i = 0; i < ARRAY_LENGTH(files); ++i) {
+    char *fname = NULL;
+    tor_asprintf(&fname, "%s"PATH_SEPARATOR"%s", datadir, files[i]);
+    unlink(fname);
+    tor_free(fname);
+  }
+  rmdir(datadir);
+  tor_free(datadir);
+}
+
+/** Replace our directory information with a made-up network of <b>n</b>
+ * relays, as made by bench_fake_microdescs() and bench_fake_consensus(),
+ * signed with <b>id_key</b> and <b>signing_key</b>.  Return the number of
+ * microdescriptors we accepted. */
+static int
+bench_load_fake_network(int n, int family_size, crypto_pk_t *id_key,
+                        crypto_pk_t *signing_key)
+{
+  smartlist_t *md_digests = smartlist_new(), *added;
+  char *mds = bench_fake_microdescs(n, family_size, md_digests);
+  char *consensus = bench_fake_consensus(n, md_digests, id_key, signing_key);
+  int r;
+
+  networkstatus_free_all();
+  nodelist_free_all();
+  microdesc_free_all();
+  r = networkstatus_set_current_consensus(consensus, "microdesc",
+                                          NSSET_FROM_CACHE |
+                                          NSSET_DONT_DOWNLOAD_CERTS, NULL);
+  tor_assert(r == 0);
+  added = microdescs_add_to_cache(get_microdesc_cache(), mds, NULL,
+                                  SAVED_NOWHERE, 1, -1, NULL);
+  r = smartlist_len(added);
+
+  smartlist_free(added);
+  tor_free(consensus);
+  tor_free(mds);
+  SMARTLIST_FOREACH(md_digests, char *, cp, tor_free(cp));
+  smartlist_free(md_digests);
+  return r;
+}
+
+/** Measure how long it takes to choose each hop of a circuit, on made-up
+ * networks of several sizes, with some typical options. */
+static void
+bench_path_selection(void)
+{
+  or_options_t *options = get_options_mutable();
+  crypto_pk_t *id_key = NULL, *signing_key = NULL;
+  char *datadir;
+  unsigned i;
+
+  if (!(datadir = bench_state_dir_new()))
+    return;
+  options->DirCache = 0;
+  options->UseEntryGuards = 1;
+  bench_fake_authority_new(&id_key, &signing_key);
+
+  for (i = 0; i < ARRAY_LENGTH(path_bench_sizes); ++i) {
+    const int n = path_bench_sizes[i];
+    int n_mds = bench_load_fake_network(n, PATH_BENCH_FAMILY_SIZE, id_key,
+                                        signing_key);
+    printf("Made-up network of %d relays (%d with microdescriptors):\n",
+           n, n_mds);
+
+    bench_path_scenario("Default options");
+
+    options->ExcludeNodes = routerset_new();
+    routerset_parse(options->ExcludeNodes, PATH_BENCH_EXCLUDED_NODES,
+                    "ExcludeNodes");
+    options->ExcludeExitNodesUnion_ = routerset_new();
+    routerset_union(options->ExcludeExitNodesUnion_, options->ExcludeNodes);
+    bench_path_scenario("ExcludeNodes "PATH_BENCH_EXCLUDED_NODES);
+    routerset_free(options->ExcludeNodes);
+    routerset_free(options->ExcludeExitNodesUnion_);
+    options->ExcludeNodes = options->ExcludeExitNodesUnion_ = NULL;
+
+    options->EnforceDistinctSubnets = 0;
+    bench_path_scenario("EnforceDistinctSubnets 0");
+    options->EnforceDistinctSubnets = 1;
+  }
+
+  networkstatus_free_all();
+  nodelist_free_all();
+  microdesc_free_all();
+  bench_state_dir_free(datadir);
+  crypto_pk_free(id_key);
+  crypto_pk_free(signing_key);
+}
+
+/** How many relays are in the network that bench_intro() makes up. */
+#define INTRO_BENCH_N_RELAYS 1000
+/** For how long do we offer INTRODUCE2 cells at each rate? */
+#define INTRO_BENCH_SECONDS 2
+/** After we stop offering cells, how long do we wait for the ones we
+ * offered to be handled? */
+#define INTRO_BENCH_DRAIN_SECONDS 10
+/** How often do we offer a batch of cells, in msec? */
+#define INTRO_BENCH_TICK_MSEC 10
+/** What percentage of the cells we offer are replays of earlier ones? */
+#define INTRO_BENCH_REPLAY_PERCENT 5
+/** The rates at which we offer cells, per second. */
+static const int intro_bench_rates[] = { 100, 500, 2000, 10000 };
+
+/** State for one run of bench_intro() at one rate. */
+typedef struct intro_bench_t {
+  /** The introduction circuit we deliver cells on. */
+  origin_circuit_t *circ;
+  /** Every INTRODUCE2 cell we'll offer, made ahead of time. */
+  uint8_t **cells;
+  size_t *cell_lens;
+  /** When we offered each cell. */
+  struct timeval *offered_at;
+  /** The first cell of this run, and the one after the last. */
+  int first_cell, end_cell;
+  /** The next cell to offer. */
+  int next_cell;
+  /** How many cells a second we offer in this run. */
+  int rate;
+  /** When this run started. */
+  monotime_t start;
+  /** How many cells have we offered, counting replays? */
+  int n_offered;
+  /** How many replays did we offer, and how many of those were refused
+   * at once? */
+  int n_replays, n_replays_refused;
+  /** How many new cells were refused at once? */
+  int n_refused;
+} intro_bench_t;
+
+static int
+bench_chan_is_canonical(channel_t *chan, int req)
+{
+  (void)chan;
+  (void)req;
+  return 1;
+}
+
+static int
+bench_chan_matches_target(channel_t *chan, const tor_addr_t *target)
+{
+  (void)chan;
+  (void)target;
+  return 1;
+}
+
+/** Return a newly allocated INTRODUCE2 cell for a service with
+ * introduction key <b>intro_key</b>, in *<b>cell_out</b>, and return its
+ * length.  The client asks to meet at <b>rp</b>, with a rendezvous cookie
+ * that starts with <b>idx</b>. */
+static size_t
+bench_intro_make_cell(crypto_pk_t *intro_key, const node_t *rp, int idx,
+                      uint8_t **cell_out)
+{
+  uint8_t plaintext[1024], *cp = plaintext;
+  char *cell;
+  size_t cell_size;
+  tor_addr_port_t ap;
+  int key_len, r;
+
+  node_get_prim_orport(rp, &ap);
+  *cp++ = 3; /* Version */
+  *cp++ = 0; /* No authorization */
+  set_uint32(cp, htonl((uint32_t)time(NULL)));
+  cp += 4;
+  set_uint32(cp, tor_addr_to_ipv4n(&ap.addr));
+  cp += 4;
+  set_uint16(cp, htons(ap.port));
+  cp += 2;
+  memcpy(cp, rp->identity, DIGEST_LEN);
+  cp += DIGEST_LEN;
+  key_len = crypto_pk_asn1_encode(microdesc_get_onion_pkey(rp->md),
+                                  (char*)cp + 2,
+                                  sizeof(plaintext) - (cp + 2 - plaintext));
+  tor_assert(key_len > 0);
+  set_uint16(cp, htons(key_len));
+  cp += 2 + key_len;
+  /* The rendezvous cookie tells us which cell a circuit is for. */
+  set_uint32(cp, htonl(idx));
+  crypto_rand((char*)cp + 4, REND_COOKIE_LEN - 4);
+  cp += REND_COOKIE_LEN;
+  /* Nobody will ever finish the handshake, so any valid value will do. */
+  crypto_rand((char*)cp, DH_KEY_LEN);
+  cp[0] = 0x7f;
+  cp += DH_KEY_LEN;
+
+  cell_size = DIGEST_LEN + PKCS1_OAEP_PADDING_OVERHEAD +
+    crypto_pk_keysize(intro_key) + CIPHER_KEY_LEN + (cp - plaintext);
+  cell = tor_malloc(cell_size);
+  crypto_pk_get_digest(intro_key, cell);
+  r = crypto_pk_public_hybrid_encrypt(intro_key, cell + DIGEST_LEN,
+                                      cell_size - DIGEST_LEN,
+                                      (char*)plaintext, cp - plaintext,
+                                      PK_PKCS1_OAEP_PADDING, 0);
+  tor_assert(r > 0);
+  *cell_out = (uint8_t*)cell;
+  return DIGEST_LEN + r;
+}
+
+/** Timer callback: offer as many cells as the rate of run <b>arg</b> calls
+ * for by now. */
+static void
+bench_intro_tick(periodic_timer_t *timer, void *arg)
+{
+  intro_bench_t *ib = arg;
+  monotime_t now;
+  int64_t due;
+  (void)timer;
+
+  monotime_get(&now);
+  due = monotime_diff_usec(&ib->start, &now) * ib->rate / 1000000;
+  due = MIN(due, (int64_t)ib->rate * INTRO_BENCH_SECONDS);
+  while (ib->n_offered < due && ib->next_cell < ib->end_cell) {
+    int idx, replay, r;
+    replay = ib->next_cell > ib->first_cell &&
+      crypto_rand_int(100) < INTRO_BENCH_REPLAY_PERCENT;
+    if (replay) {
+      idx = ib->first_cell + crypto_rand_int(ib->next_cell - ib->first_cell);
+    } else {
+      idx = ib->next_cell++;
+      tor_gettimeofday(&ib->offered_at[idx]);
+    }
+    r = rend_service_receive_introduction(ib->circ, ib->cells[idx],
+                                          ib->cell_lens[idx]);
+    ++ib->n_offered;
+    if (replay) {
+      ++ib->n_replays;
+      if (r < 0)
+        ++ib->n_replays_refused;
+    } else if (r < 0) {
+      ++ib->n_refused;
+    }
+  }
+}
+
+/** Return the number of rendezvous circuits that we've launched. */
+static int
+bench_intro_count_launched(void)
+{
+  int n = 0;
+  SMARTLIST_FOREACH(circuit_get_global_list(), circuit_t *, c,
+    if (c->purpose == CIRCUIT_PURPOSE_S_CONNECT_REND && !c->marked_for_close)
+      ++n);
+  return n;
+}
+
+/** Comparison function for qsort on doubles. */
+static int
+compare_doubles_(const void *a_, const void *b_)
+{
+  double a = *(const double*)a_, b = *(const double*)b_;
+  return a < b ? -1 : (a > b ? 1 : 0);
+}
+
+/** Offer cells to the service behind <b>ib</b>-&gt;circ at <b>ib</b>-&gt;rate
+ * per second, wait for them to be handled, and report what happened. */
+static void
+bench_intro_run(intro_bench_t *ib, rend_service_t *service)
+{
+  struct event_base *base = tor_libevent_get_base();
+  struct timeval tick = { 0, INTRO_BENCH_TICK_MSEC * 1000 };
+  periodic_timer_t *timer;
+  rend_service_stats_t before = service->stats;
+  double *latency, last_msec = 0;
+  int n_fresh, n_launched = 0, n_dropped, n_lat = 0;
+  monotime_t now;
+
+  monotime_get(&ib->start);
+  timer = periodic_timer_new(base, &tick, bench_intro_tick, ib);
+  /* Offer the cells, then drain whatever's still queued. */
+  do {
+    event_base_loop(base, EVLOOP_ONCE);
+    monotime_get(&now);
+    if (monotime_diff_msec(&ib->start, &now) < INTRO_BENCH_SECONDS * 1000)
+      continue;
+    n_fresh = ib->next_cell - ib->first_cell;
+    n_dropped = (int)(service->stats.n_intros_dropped -
+                      before.n_intros_dropped) - ib->n_replays_refused;
+    n_launched = bench_intro_count_launched();
+    if (n_launched + n_dropped >= n_fresh)
+      break;
+  } while (monotime_diff_msec(&ib->start, &now) <
+           (INTRO_BENCH_SECONDS + INTRO_BENCH_DRAIN_SECONDS) * 1000);
+  periodic_timer_free(timer);
+
+  /* How long did each cell wait before we launched its circuit? */
+  latency = tor_calloc(n_launched + 1, sizeof(double));
+  SMARTLIST_FOREACH_BEGIN(circuit_get_global_list(), circuit_t *, c) {
+    origin_circuit_t *oc;
+    int idx;
+    if (c->purpose != CIRCUIT_PURPOSE_S_CONNECT_REND || c->marked_for_close)
+      continue;
+    oc = TO_ORIGIN_CIRCUIT(c);
+    idx = (int)ntohl(get_uint32(oc->rend_data->rend_cookie));
+    if (idx >= ib->first_cell && idx < ib->next_cell && n_lat < n_launched) {
+      latency[n_lat] = tv_udiff(&ib->offered_at[idx],
+                                &c->timestamp_created) / 1000.0;
+      last_msec = MAX(last_msec,
+                      tv_udiff(&ib->offered_at[ib->first_cell],
+                               &c->timestamp_created) / 1000.0);
+      ++n_lat;
+    }
+    /* Close it quietly: don't relaunch it or blame its guard. */
+    oc->hs_service_side_rend_circ_has_been_relaunched = 1;
+    c->received_destroy = 1;
+    circuit_mark_for_close(c, END_CIRC_REASON_FINISHED);
+  } SMARTLIST_FOREACH_END(c);
+  circuit_close_all_marked();
+  qsort(latency, n_lat, sizeof(double), compare_doubles_);
+
+  n_fresh = ib->next_cell - ib->first_cell;
+  n_dropped = (int)(service->stats.n_intros_dropped -
+                    before.n_intros_dropped) - ib->n_replays_refused;
+  printf("  Offered %d/sec: %d cells and %d replays\n",
+         ib->rate, n_fresh, ib->n_replays);
+  printf("    Launched %d rendezvous circuits: %.1f/sec sustained\n",
+         n_lat, last_msec > 0 ? n_lat * 1000.0 / last_msec : 0.0);
+  if (n_lat) {
+    printf("    Delay to launch: median %.1f msec, 99%% %.1f msec, "
+           "max %.1f msec\n", latency[n_lat / 2],
+           latency[(int)(n_lat * 0.99)], latency[n_lat - 1]);
+  }
+  printf("    Dropped %d (%d at once); %d of %d replays caught; "
+         "%d still pending\n",
+         n_dropped, ib->n_refused, ib->n_replays_refused, ib->n_replays,
+         n_fresh - n_lat - n_dropped);
+  printf("    "U64_FORMAT" usec of CPU per cell\n",
+         U64_PRINTF_ARG(n_fresh ? (service->stats.cpu_usec -
+                                   before.cpu_usec) / n_fresh : 0));
+  tor_free(latency);
+}
+
+/** Measure how many INTRODUCE2 cells a second an onion service can handle,
+ * without a live network: offer made-up cells at several rates to an
+ * ephemeral service on a made-up network, and see how many rendezvous
+ * circuits it launches, how long the cells wait first, and how many it
+ * drops.  Each circuit's first hop is a fake open channel that discards
+ * what we send it. */
+static void
+bench_intro(void)
+{
+  or_options_t *options = get_options_mutable();
+  crypto_pk_t *id_key = NULL, *signing_key = NULL;
+  crypto_pk_t *service_key = crypto_pk_new(), *intro_key = crypto_pk_new();
+  smartlist_t *ports = smartlist_new(), *chans = smartlist_new();
+  rend_service_t *service;
+  rend_intro_point_t *intro;
+  intro_bench_t ib;
+  const smartlist_t *nodes;
+  char *service_id = NULL, *datadir, *err = NULL;
+  int i, n_cells = 0;
+  unsigned r;
+
+  memset(&ib, 0, sizeof(ib));
+  if (!(datadir = bench_state_dir_new()))
+    return;
+  options->DirCache = 0;
+  options->UseEntryGuards = 1;
+  /* Our made-up relays are all on 10.0.0.0/8. */
+  options->ExtendAllowPrivateAddresses = 1;
+  options->MaxMemInQueues = UINT64_C(1) << 30;
+  options->MaxMemInQueues_low_threshold = UINT64_C(3) << 28;
+  bench_fake_authority_new(&id_key, &signing_key);
+  bench_load_fake_network(INTRO_BENCH_N_RELAYS, 0, id_key, signing_key);
+  nodes = nodelist_get_list();
+  scheduler_init();
+  cpu_init();
+
+  /* Pretend that we're connected to every relay. */
+  SMARTLIST_FOREACH_BEGIN(nodes, const node_t *, node) {
+    channel_t *chan = bench_chan_new();
+    chan->is_canonical = bench_chan_is_canonical;
+    chan->matches_target = bench_chan_matches_target;
+    channel_set_identity_digest(chan, node->identity);
+    channel_register(chan);
+    smartlist_add(chans, chan);
+  } SMARTLIST_FOREACH_END(node);
+
+  /* Set up the service, with one intro point and its circuit. */
+  tor_assert(crypto_pk_generate_key(service_key) == 0);
+  tor_assert(crypto_pk_generate_key(intro_key) == 0);
+  tor_assert(rend_config_services(options, 0) == 0);
+  smartlist_add(ports, rend_service_parse_port_config("80", " ", &err));
+  tor_assert(rend_service_add_ephemeral(service_key, ports, 0, 0,
+                                        REND_NO_AUTH, NULL, &service_id)
+             == RSAE_OKAY);
+  service = rend_service_get_by_service_id(service_id);
+  intro = tor_malloc_zero(sizeof(rend_intro_point_t));
+  intro->extend_info = extend_info_from_node(smartlist_get(nodes, 0), 0);
+  intro->intro_key = crypto_pk_dup_key(intro_key);
+  intro->time_published = time(NULL);
+  smartlist_add(service->intro_nodes, intro);
+
+  ib.circ = origin_circuit_new();
+  ib.circ->base_.purpose = CIRCUIT_PURPOSE_S_INTRO;
+  ib.circ->base_.state = CIRCUIT_STATE_OPEN;
+  ib.circ->build_state = tor_malloc_zero(sizeof(cpath_build_state_t));
+  ib.circ->rend_data = rend_data_service_create(service_id,
+                                                service->pk_digest, NULL,
+                                                REND_NO_AUTH);
+  ib.circ->intro_key = crypto_pk_dup_key(intro_key);
+
+  /* Make every cell ahead of time, each asking for a random relay. */
+  for (r = 0; r < ARRAY_LENGTH(intro_bench_rates); ++r)
+    n_cells += intro_bench_rates[r] * INTRO_BENCH_SECONDS;
+  ib.cells = tor_calloc(n_cells, sizeof(uint8_t *));
+  ib.cell_lens = tor_calloc(n_cells, sizeof(size_t));
+  ib.offered_at = tor_calloc(n_cells, sizeof(struct timeval));
+  for (i = 0; i < n_cells; ++i) {
+    ib.cell_lens[i] = bench_intro_make_cell(intro_key,
+                                            smartlist_choose(nodes), i,
+                                            &ib.cells[i]);
+  }
+
+  for (r = 0; r < ARRAY_LENGTH(intro_bench_rates); ++r) {
+    ib.rate = intro_bench_rates[r];
+    ib.first_cell = ib.next_cell = ib.end_cell;
+    ib.end_cell = ib.first_cell + ib.rate * INTRO_BENCH_SECONDS;
+    ib.n_offered = ib.n_replays = ib.n_replays_refused = ib.n_refused = 0;
+    bench_intro_run(&ib, service);
+  }
+
+  for (i = 0; i < n_cells; ++i)
+    tor_free(ib.cells[i]);
+  tor_free(ib.cells);
+  tor_free(ib.cell_lens);
+  tor_free(ib.offered_at);
+  circuit_free_all();
+  rend_service_free_all();
+  SMARTLIST_FOREACH_BEGIN(chans, channel_t *, chan) {
+    scheduler_release_channel(chan);
+    channel_unregister(chan);
+    circuitmux_free(chan->cmux);
+    tor_free(chan);
+  } SMARTLIST_FOREACH_END(chan);
+  smartlist_free(chans);
+  scheduler_free_all();
+  networkstatus_free_all();
+  nodelist_free_all();
+  microdesc_free_all();
+  bench_state_dir_free(datadir);
+  tor_free(service_id);
+  tor_free(err);
+  crypto_pk_free(intro_key);
+  crypto_pk_free(id_key);
+  crypto_pk_free(signing_key);
+}
+
 typedef void (*bench_fn)(void);
 
 typedef struct benchmark_t {
@@ -634,8 +2492,10 @@ typedef struct benchmark_t {
 
 static struct benchmark_t benchmarks[] = {
   ENT(dmap),
+  ENT(digestset),
   ENT(siphash),
   ENT(digest),
+  ENT(codecs),
   ENT(aes),
   ENT(onion_TAP),
   ENT(onion_ntor),
@@ -643,9 +2503,15 @@ static struct benchmark_t benchmarks[] = {
 
   ENT(cell_aes),
   ENT(cell_ops),
+  ENT(cell_path),
   ENT(dh),
   ENT(ecdh_p256),
   ENT(ecdh_p224),
+  ENT(handoff),
+  ENT(dirserv),
+  ENT(consensus),
+  ENT(path_selection),
+  ENT(intro),
   {NULL,NULL,0}
 };
 
@@ -676,6 +2542,12 @@ main(int argc, const char **argv)
   for (i = 1; i < argc; ++i) {
     if (!strcmp(argv[i], "--list")) {
       list = 1;
+    } else if (!strcmp(argv[i], "--datadir") && i+1 < argc) {
+      bench_datadir = argv[++i];
+    } else if (!strcmp(argv[i], "--clients") && i+1 < argc) {
+      bench_n_dir_clients = atoi(argv[++i]);
+      if (bench_n_dir_clients < 1)
+        bench_n_dir_clients = 1;
     } else {
       benchmark_t *benchmark = find_benchmark(argv[i]);
       ++n_enabled;
@@ -689,6 +2561,11 @@ main(int argc, const char **argv)
 
   reset_perftime();
 
+  monotime_init();
+  struct tor_libevent_cfg cfg;
+  memset(&cfg, 0, sizeof(cfg));
+  tor_libevent_initialize(&cfg);
+
   if (crypto_seed_rng() < 0) {
     printf("Couldn't seed RNG; exiting.\n");
     return 1;
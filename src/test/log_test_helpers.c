@@ -27,6 +27,7 @@ static int echo_to_real_logs = 1;
 static int record_logs_at_level = LOG_ERR;
 
 static int saved_log_level = 0;
+static log_domain_mask_t saved_domain_masks[LOG_DEBUG-LOG_ERR+1];
 
 /**
  * As setup_capture_of_logs, but do not relay log messages into the main
@@ -64,6 +65,10 @@ setup_capture_of_logs(int new_level)
    */
   if (log_global_min_severity_ < new_level)
     log_global_min_severity_ = new_level;
+  /* Likewise, capture messages in every domain. */
+  memcpy(saved_domain_masks, log_global_domain_masks_,
+         sizeof(saved_domain_masks));
+  memset(log_global_domain_masks_, 0xff, sizeof(log_global_domain_masks_));
 
   record_logs_at_level = new_level;
   mock_clean_saved_logs();
@@ -81,8 +86,11 @@ void
 teardown_capture_of_logs(void)
 {
   UNMOCK(logv);
-  if (saved_log_level)
+  if (saved_log_level) {
     log_global_min_severity_ = saved_log_level;
+    memcpy(log_global_domain_masks_, saved_domain_masks,
+           sizeof(saved_domain_masks));
+  }
   saved_log_level = 0;
   mock_clean_saved_logs();
 }
@@ -0,0 +1,319 @@
+/* Copyright (c) 2016, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file netsim_test_helpers.c
+ * \brief A deterministic, discrete-event simulation of datagram links, for
+ * repeatable experiments with channels, schedulers and flow control.
+ *
+ * While a netsim_t exists, monotonic time and approx_time() are mocked and
+ * follow the simulation's clock, which only moves when netsim_run_until()
+ * jumps it to the next event.  So a run takes as long as its events take
+ * to process, not as long as the time it simulates, and a given seed
+ * always gives the same losses, the same order of events and the same
+ * results.
+ *
+ * Each link carries datagrams one way, with a fixed latency, a bandwidth
+ * (a datagram occupies the link for len/bandwidth before it starts its
+ * trip), a drop-tail queue, and random loss.  Two links and
+ * netsim_link_get_dgram_transport() make the transport for a pair of
+ * channel_dgram_t objects.
+ */
+
+#include "orconfig.h"
+#define TOR_CHANNEL_INTERNAL_
+#include "or.h"
+#ifdef ENABLE_DGRAM_CHANNELS
+#include "channeldgram.h"
+#endif
+#include "netsim_test_helpers.h"
+
+/** Wall-clock time at which every simulation starts, so that approx_time()
+ * doesn't depend on when the test runs. */
+#define NETSIM_START_TIME 1483228800 /* 2017-01-01 */
+/** Simulated monotonic time at which every simulation starts, in usec.
+ * Not zero, so that nothing mistakes a timestamp for "unset". */
+#define NETSIM_START_USEC 1000000
+
+/** A datagram on its way across a link. */
+typedef struct netsim_event_t {
+  /** When it arrives, and when it was sent, in simulated usec. */
+  uint64_t when_usec;
+  uint64_t sent_usec;
+  /** Order of creation, to break ties between events at the same time. */
+  uint64_t seq;
+  /** Position in the simulation's event queue. */
+  int heap_idx;
+  netsim_link_t *link;
+  size_t len;
+  uint8_t buf[FLEXIBLE_ARRAY_MEMBER];
+} netsim_event_t;
+
+/** A function to call every <b>interval_usec</b>. */
+typedef struct netsim_ticker_t {
+  uint32_t interval_usec;
+  uint64_t next_usec;
+  netsim_tick_fn_t fn;
+  void *arg;
+} netsim_ticker_t;
+
+struct netsim_link_t {
+  netsim_t *sim;
+  uint32_t latency_usec;
+  /** Bandwidth in bytes per second, or 0 for no limit. */
+  uint64_t bytes_per_sec;
+  /** Chance that any one datagram is lost, in millionths. */
+  uint32_t loss_per_million;
+  /** Largest number of bytes that may wait to go onto the link, or 0 for
+   * no limit. */
+  size_t queue_limit;
+  /** Time at which the link finishes sending what's queued on it. */
+  uint64_t busy_until_usec;
+  netsim_deliver_fn_t deliver;
+  void *deliver_arg;
+  netsim_link_stats_t stats;
+};
+
+struct netsim_t {
+  uint64_t now_usec;
+  uint64_t next_seq;
+  /** Heap of netsim_event_t, soonest first. */
+  smartlist_t *events;
+  /** List of netsim_ticker_t. */
+  smartlist_t *tickers;
+  /** List of netsim_link_t. */
+  smartlist_t *links;
+  tor_weak_rng_t rng;
+};
+
+/** Compare two netsim_event_t by time, then by creation order. */
+static int
+compare_netsim_events_(const void *a_, const void *b_)
+{
+  const netsim_event_t *a = a_, *b = b_;
+  if (a->when_usec != b->when_usec)
+    return a->when_usec < b->when_usec ? -1 : 1;
+  if (a->seq != b->seq)
+    return a->seq < b->seq ? -1 : 1;
+  return 0;
+}
+
+/** Point the mocked clocks at <b>sim</b>'s current time. */
+static void
+netsim_set_clocks(const netsim_t *sim)
+{
+  monotime_set_mock_time_nsec((int64_t)sim->now_usec * 1000);
+  monotime_coarse_set_mock_time_nsec((int64_t)sim->now_usec * 1000);
+  update_approx_time((time_t)(NETSIM_START_TIME +
+                              sim->now_usec / 1000000));
+}
+
+/** Create a new simulation whose random choices come from <b>seed</b>, and
+ * start mocking time to follow it.  Only one may exist at a time. */
+netsim_t *
+netsim_new(unsigned seed)
+{
+  netsim_t *sim = tor_malloc_zero(sizeof(*sim));
+  sim->now_usec = NETSIM_START_USEC;
+  sim->events = smartlist_new();
+  sim->tickers = smartlist_new();
+  sim->links = smartlist_new();
+  tor_init_weak_random(&sim->rng, seed);
+  monotime_enable_test_mocking();
+  netsim_set_clocks(sim);
+  return sim;
+}
+
+/** Free <b>sim</b>, its links, and the datagrams still on them, and stop
+ * mocking time. */
+void
+netsim_free(netsim_t *sim)
+{
+  if (!sim)
+    return;
+  SMARTLIST_FOREACH(sim->events, netsim_event_t *, ev, tor_free(ev));
+  smartlist_free(sim->events);
+  SMARTLIST_FOREACH(sim->tickers, netsim_ticker_t *, t, tor_free(t));
+  smartlist_free(sim->tickers);
+  SMARTLIST_FOREACH(sim->links, netsim_link_t *, l, tor_free(l));
+  smartlist_free(sim->links);
+  monotime_disable_test_mocking();
+  tor_free(sim);
+}
+
+/** Return the simulated monotonic time, in usec. */
+uint64_t
+netsim_now_usec(const netsim_t *sim)
+{
+  return sim->now_usec;
+}
+
+/** Arrange for <b>fn</b>(<b>arg</b>, now) to be called every
+ * <b>interval_usec</b> of simulated time, starting one interval from now.
+ */
+void
+netsim_add_ticker(netsim_t *sim, uint32_t interval_usec,
+                  netsim_tick_fn_t fn, void *arg)
+{
+  netsim_ticker_t *t = tor_malloc_zero(sizeof(*t));
+  tor_assert(interval_usec > 0);
+  t->interval_usec = interval_usec;
+  t->next_usec = sim->now_usec + interval_usec;
+  t->fn = fn;
+  t->arg = arg;
+  smartlist_add(sim->tickers, t);
+}
+
+/** Run <b>sim</b> until its clock reaches <b>end_usec</b>: deliver every
+ * datagram and run every ticker due by then, in time order. */
+void
+netsim_run_until(netsim_t *sim, uint64_t end_usec)
+{
+  while (1) {
+    netsim_event_t *ev = NULL;
+    netsim_ticker_t *ticker = NULL;
+    uint64_t next = UINT64_MAX;
+
+    if (smartlist_len(sim->events)) {
+      ev = smartlist_get(sim->events, 0);
+      next = ev->when_usec;
+    }
+    SMARTLIST_FOREACH_BEGIN(sim->tickers, netsim_ticker_t *, t) {
+      /* Datagrams go before tickers due at the same time. */
+      if (t->next_usec < next) {
+        next = t->next_usec;
+        ticker = t;
+      }
+    } SMARTLIST_FOREACH_END(t);
+    if (next > end_usec)
+      break;
+
+    sim->now_usec = next;
+    netsim_set_clocks(sim);
+    if (ticker) {
+      ticker->next_usec += ticker->interval_usec;
+      ticker->fn(ticker->arg, sim->now_usec);
+    } else {
+      netsim_link_t *link = ev->link;
+      uint64_t delay = sim->now_usec - ev->sent_usec;
+      smartlist_pqueue_pop(sim->events, compare_netsim_events_,
+                           STRUCT_OFFSET(netsim_event_t, heap_idx));
+      ++link->stats.n_delivered;
+      link->stats.bytes_delivered += ev->len;
+      link->stats.total_delay_usec += delay;
+      if (delay > link->stats.max_delay_usec)
+        link->stats.max_delay_usec = delay;
+      if (link->deliver)
+        link->deliver(link->deliver_arg, ev->buf, ev->len);
+      tor_free(ev);
+    }
+  }
+  sim->now_usec = MAX(sim->now_usec, end_usec);
+  netsim_set_clocks(sim);
+}
+
+/** Create a one-way link in <b>sim</b> with the given latency, bandwidth
+ * (0 for unlimited), loss rate in millionths, and queue limit in bytes (0
+ * for unlimited). */
+netsim_link_t *
+netsim_link_new(netsim_t *sim, uint32_t latency_usec, uint64_t bytes_per_sec,
+                uint32_t loss_per_million, size_t queue_limit)
+{
+  netsim_link_t *link = tor_malloc_zero(sizeof(*link));
+  link->sim = sim;
+  link->latency_usec = latency_usec;
+  link->bytes_per_sec = bytes_per_sec;
+  link->loss_per_million = loss_per_million;
+  link->queue_limit = queue_limit;
+  smartlist_add(sim->links, link);
+  return link;
+}
+
+/** Make <b>link</b> hand the datagrams it delivers to <b>fn</b>. */
+void
+netsim_link_set_receiver(netsim_link_t *link, netsim_deliver_fn_t fn,
+                         void *arg)
+{
+  link->deliver = fn;
+  link->deliver_arg = arg;
+}
+
+/** Send the <b>len</b>-byte datagram <b>buf</b> on <b>link</b>.  Always
+ * return 0: as with UDP, the sender can't tell whether it was lost. */
+int
+netsim_link_send(netsim_link_t *link, const uint8_t *buf, size_t len)
+{
+  netsim_t *sim = link->sim;
+  netsim_event_t *ev;
+  uint64_t start, tx_usec = 0;
+
+  ++link->stats.n_sent;
+  if (link->loss_per_million &&
+      tor_weak_random_range(&sim->rng, 1000000) <
+      (int32_t)link->loss_per_million) {
+    ++link->stats.n_lost;
+    return 0;
+  }
+
+  start = MAX(sim->now_usec, link->busy_until_usec);
+  if (link->bytes_per_sec) {
+    if (link->queue_limit &&
+        (start - sim->now_usec) * link->bytes_per_sec / 1000000 >
+        link->queue_limit) {
+      ++link->stats.n_queue_drops;
+      return 0;
+    }
+    tx_usec = (uint64_t)len * 1000000 / link->bytes_per_sec;
+  }
+  link->busy_until_usec = start + tx_usec;
+
+  ev = tor_malloc_zero(offsetof(netsim_event_t, buf) + len);
+  ev->when_usec = link->busy_until_usec + link->latency_usec;
+  ev->sent_usec = sim->now_usec;
+  ev->seq = sim->next_seq++;
+  ev->link = link;
+  ev->len = len;
+  memcpy(ev->buf, buf, len);
+  smartlist_pqueue_add(sim->events, compare_netsim_events_,
+                       STRUCT_OFFSET(netsim_event_t, heap_idx), ev);
+  return 0;
+}
+
+/** Return the counters for <b>link</b>. */
+const netsim_link_stats_t *
+netsim_link_get_stats(const netsim_link_t *link)
+{
+  return &link->stats;
+}
+
+#ifdef ENABLE_DGRAM_CHANNELS
+/** Adapter from the datagram channel's send callback to
+ * netsim_link_send(). */
+static int
+netsim_dgram_send_(void *arg, const uint8_t *buf, size_t len)
+{
+  return netsim_link_send(arg, buf, len);
+}
+
+/** Fill in <b>out</b> with a transport for a channel_dgram_t that sends
+ * on <b>link</b>. */
+void
+netsim_link_get_dgram_transport(netsim_link_t *link,
+                                channel_dgram_transport_t *out)
+{
+  memset(out, 0, sizeof(*out));
+  out->send = netsim_dgram_send_;
+  out->name = "simulated link";
+  out->arg = link;
+}
+
+/** A netsim_deliver_fn_t that hands each datagram to the datagram channel
+ * <b>arg</b>. */
+void
+netsim_deliver_to_dgram_channel(void *arg, const uint8_t *buf, size_t len)
+{
+  channel_dgram_handle_datagram(BASE_CHAN_TO_DGRAM((channel_t *)arg),
+                                buf, len);
+}
+#endif
+
@@ -0,0 +1,61 @@
+/* Copyright (c) 2016, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+#ifndef TOR_NETSIM_TEST_HELPERS_H
+#define TOR_NETSIM_TEST_HELPERS_H
+
+#include "or.h"
+#ifdef ENABLE_DGRAM_CHANNELS
+#include "channeldgram.h"
+#endif
+
+typedef struct netsim_t netsim_t;
+typedef struct netsim_link_t netsim_link_t;
+
+/** Counters for one simulated link. */
+typedef struct netsim_link_stats_t {
+  /** Datagrams handed to the link. */
+  uint64_t n_sent;
+  /** Datagrams that reached the far end, and their total size. */
+  uint64_t n_delivered;
+  uint64_t bytes_delivered;
+  /** Datagrams lost at random. */
+  uint64_t n_lost;
+  /** Datagrams dropped because the link's queue was full. */
+  uint64_t n_queue_drops;
+  /** Total and largest time from send to delivery, in usec. */
+  uint64_t total_delay_usec;
+  uint64_t max_delay_usec;
+} netsim_link_stats_t;
+
+/** Called with each datagram a link delivers. */
+typedef void (*netsim_deliver_fn_t)(void *arg, const uint8_t *buf,
+                                    size_t len);
+/** Called every so often as simulated time passes. */
+typedef void (*netsim_tick_fn_t)(void *arg, uint64_t now_usec);
+
+netsim_t *netsim_new(unsigned seed);
+void netsim_free(netsim_t *sim);
+uint64_t netsim_now_usec(const netsim_t *sim);
+void netsim_add_ticker(netsim_t *sim, uint32_t interval_usec,
+                       netsim_tick_fn_t fn, void *arg);
+void netsim_run_until(netsim_t *sim, uint64_t end_usec);
+
+netsim_link_t *netsim_link_new(netsim_t *sim, uint32_t latency_usec,
+                               uint64_t bytes_per_sec,
+                               uint32_t loss_per_million,
+                               size_t queue_limit);
+void netsim_link_set_receiver(netsim_link_t *link, netsim_deliver_fn_t fn,
+                              void *arg);
+int netsim_link_send(netsim_link_t *link, const uint8_t *buf, size_t len);
+const netsim_link_stats_t *netsim_link_get_stats(const netsim_link_t *link);
+
+#ifdef ENABLE_DGRAM_CHANNELS
+void netsim_link_get_dgram_transport(netsim_link_t *link,
+                                     channel_dgram_transport_t *out);
+void netsim_deliver_to_dgram_channel(void *arg, const uint8_t *buf,
+                                     size_t len);
+#endif
+
+#endif
+
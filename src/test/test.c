@@ -30,6 +30,7 @@
 #define CIRCUITLIST_PRIVATE
 #define MAIN_PRIVATE
 #define STATEFILE_PRIVATE
+#define REPHIST_PRIVATE
 
 /*
  * Linux doesn't provide lround in math.h by default, but mac os does...
@@ -42,6 +43,7 @@ double fabs(double x);
 #include "or.h"
 #include "backtrace.h"
 #include "buffers.h"
+#include "channel.h"
 #include "circuitlist.h"
 #include "circuitstats.h"
 #include "config.h"
@@ -76,6 +78,7 @@ test_onion_handshake(void *arg)
   char s_buf[TAP_ONIONSKIN_REPLY_LEN];
   char s_keys[40];
   int i;
+  server_onion_keys_t *keys = NULL;
   /* shared */
   crypto_pk_t *pk = NULL, *pk2 = NULL;
 
@@ -102,7 +105,7 @@ test_onion_handshake(void *arg)
 
     memset(s_buf, 0, TAP_ONIONSKIN_REPLY_LEN);
     memset(s_keys, 0, 40);
-    tt_assert(! onion_skin_TAP_server_handshake(c_buf, k1, k2,
+    tt_assert(! onion_skin_TAP_server_handshake(c_buf, k1, k2, NULL,
                                                   s_buf, s_keys, 40));
 
     /* client handshake 2 */
@@ -114,7 +117,31 @@ test_onion_handshake(void *arg)
     memset(s_buf, 0, 40);
     tt_mem_op(c_keys,OP_NE, s_buf, 40);
   }
+
+  /* server handshake with a precomputed DH key. */
+  keys = tor_malloc_zero(sizeof(server_onion_keys_t));
+  keys->tap_dh_pool = smartlist_new();
+  tt_int_op(2, OP_EQ, server_onion_keys_refill_tap_dh_pool(keys, 2));
+  tt_int_op(TAP_DH_POOL_SIZE - 2, OP_EQ,
+            server_onion_keys_refill_tap_dh_pool(keys, 1000));
+  tt_int_op(0, OP_EQ, server_onion_keys_refill_tap_dh_pool(keys, 1));
+  /* A challenge we can't decrypt doesn't use up a key... */
+  tt_int_op(-1, OP_EQ, onion_skin_TAP_server_handshake(c_buf, pk2, NULL,
+                                           keys->tap_dh_pool,
+                                           s_buf, s_keys, 40));
+  tt_int_op(smartlist_len(keys->tap_dh_pool), OP_EQ, TAP_DH_POOL_SIZE);
+  /* ...but a good one does. */
+  tt_assert(! onion_skin_TAP_server_handshake(c_buf, pk, NULL,
+                                              keys->tap_dh_pool,
+                                              s_buf, s_keys, 40));
+  tt_int_op(smartlist_len(keys->tap_dh_pool), OP_EQ, TAP_DH_POOL_SIZE - 1);
+  memset(c_keys, 0, 40);
+  tt_assert(! onion_skin_TAP_client_handshake(c_dh, s_buf, c_keys,
+                                              40, NULL));
+  tt_mem_op(c_keys,OP_EQ, s_keys, 40);
+
  done:
+  server_onion_keys_free(keys);
   crypto_dh_free(c_dh);
   crypto_pk_free(pk);
   crypto_pk_free(pk2);
@@ -145,7 +172,7 @@ test_bad_onion_handshake(void *arg)
   crypto_pk_public_hybrid_encrypt(pk, junk_buf2, TAP_ONIONSKIN_CHALLENGE_LEN,
                                junk_buf, DH_KEY_LEN, PK_PKCS1_OAEP_PADDING, 1);
   tt_int_op(-1, OP_EQ,
-            onion_skin_TAP_server_handshake(junk_buf2, pk, NULL,
+            onion_skin_TAP_server_handshake(junk_buf2, pk, NULL, NULL,
                                             s_buf, s_keys, 40));
 
   /* Server: Case 2: the encrypted data is not long enough. */
@@ -154,7 +181,7 @@ test_bad_onion_handshake(void *arg)
   crypto_pk_public_encrypt(pk, junk_buf2, sizeof(junk_buf2),
                                junk_buf, 48, PK_PKCS1_OAEP_PADDING);
   tt_int_op(-1, OP_EQ,
-            onion_skin_TAP_server_handshake(junk_buf2, pk, NULL,
+            onion_skin_TAP_server_handshake(junk_buf2, pk, NULL, NULL,
                                             s_buf, s_keys, 40));
 
   /* client handshake 1: do it straight. */
@@ -163,19 +190,19 @@ test_bad_onion_handshake(void *arg)
 
   /* Server: Case 3: we just don't have the right key. */
   tt_int_op(-1, OP_EQ,
-            onion_skin_TAP_server_handshake(c_buf, pk2, NULL,
+            onion_skin_TAP_server_handshake(c_buf, pk2, NULL, NULL,
                                             s_buf, s_keys, 40));
 
   /* Server: Case 4: The RSA-encrypted portion is corrupt. */
   c_buf[64] ^= 33;
   tt_int_op(-1, OP_EQ,
-            onion_skin_TAP_server_handshake(c_buf, pk, NULL,
+            onion_skin_TAP_server_handshake(c_buf, pk, NULL, NULL,
                                             s_buf, s_keys, 40));
   c_buf[64] ^= 33;
 
   /* (Let the server procede) */
   tt_int_op(0, OP_EQ,
-            onion_skin_TAP_server_handshake(c_buf, pk, NULL,
+            onion_skin_TAP_server_handshake(c_buf, pk, NULL, NULL,
                                             s_buf, s_keys, 40));
 
   /* Client: Case 1: The server sent back junk. */
@@ -267,6 +294,48 @@ test_ntor_handshake(void *arg)
   dimap_free(s_keymap, NULL);
 }
 
+/** Run a full ntor handshake where the client uses a keypair it generated
+ * ahead of time. */
+static void
+test_ntor_handshake_precomputed(void *arg)
+{
+  ntor_handshake_state_t *c_state = NULL;
+  uint8_t c_buf[NTOR_ONIONSKIN_LEN];
+  uint8_t c_keys[400];
+  curve25519_keypair_t c_keypair;
+
+  di_digest256_map_t *s_keymap=NULL;
+  curve25519_keypair_t s_keypair;
+  uint8_t s_buf[NTOR_REPLY_LEN];
+  uint8_t s_keys[400];
+
+  uint8_t node_id[20] = "abcdefghijklmnopqrst";
+
+  (void) arg;
+
+  tt_int_op(0, OP_EQ, curve25519_keypair_generate(&s_keypair, 0));
+  dimap_add_entry(&s_keymap, s_keypair.pubkey.public_key, &s_keypair);
+  tt_int_op(0, OP_EQ, curve25519_keypair_generate(&c_keypair, 0));
+
+  tt_int_op(0, OP_EQ, onion_skin_ntor_create_with_keypair(node_id,
+                                   &s_keypair.pubkey, &c_keypair,
+                                   &c_state, c_buf));
+  /* The onionskin carries the keypair we gave it. */
+  tt_mem_op(c_buf + DIGEST_LEN + CURVE25519_PUBKEY_LEN, OP_EQ,
+            c_keypair.pubkey.public_key, CURVE25519_PUBKEY_LEN);
+
+  tt_int_op(0, OP_EQ, onion_skin_ntor_server_handshake(c_buf, s_keymap, NULL,
+                                                    node_id,
+                                                    s_buf, s_keys, 400));
+  tt_int_op(0, OP_EQ, onion_skin_ntor_client_handshake(c_state, s_buf,
+                                                       c_keys, 400, NULL));
+  tt_mem_op(c_keys,OP_EQ, s_keys, 400);
+
+ done:
+  ntor_handshake_state_free(c_state);
+  dimap_free(s_keymap, NULL);
+}
+
 static void
 test_fast_handshake(void *arg)
 {
@@ -351,6 +420,97 @@ test_onion_queues(void *arg)
   tor_free(onionskin);
 }
 
+static or_options_t *mock_onion_queue_options = NULL;
+static const or_options_t *
+mock_get_onion_queue_options(void)
+{
+  return mock_onion_queue_options;
+}
+
+/** Add an ntor create request from <b>chan</b> to the onion queues, and
+ * return the result of onion_pending_add(). */
+static int
+add_ntor_onionskin(smartlist_t *circs, channel_t *chan)
+{
+  uint8_t buf[NTOR_ONIONSKIN_LEN] = {0};
+  or_circuit_t *circ = or_circuit_new(0, NULL);
+  create_cell_t *create = tor_malloc_zero(sizeof(create_cell_t));
+  int r;
+  create_cell_init(create, CELL_CREATE2, ONION_HANDSHAKE_TYPE_NTOR,
+                   NTOR_ONIONSKIN_LEN, buf);
+  circ->p_chan = chan;
+  smartlist_add(circs, circ);
+  r = onion_pending_add(circ, create);
+  if (r < 0)
+    tor_free(create);
+  return r;
+}
+
+/** Make sure that a flood of create cells from one channel keeps its own
+ * requests off the onion queues before anybody else's. */
+static void
+test_onion_queue_fairness(void *arg)
+{
+  smartlist_t *circs = smartlist_new();
+  channel_t *flooder = tor_malloc_zero(sizeof(channel_t));
+  channel_t *newbie = tor_malloc_zero(sizeof(channel_t));
+  channel_t *other = tor_malloc_zero(sizeof(channel_t));
+  create_cell_t *onionskin = NULL;
+  char *stats = NULL;
+  int i;
+  (void)arg;
+
+  mock_onion_queue_options = tor_malloc_zero(sizeof(or_options_t));
+  mock_onion_queue_options->NumCPUs = 1;
+  /* Until there are measurements, each onionskin is assumed to take 1 msec,
+   * so this is room for 100 entries. */
+  mock_onion_queue_options->MaxOnionQueueDelay = 100;
+  MOCK(get_options, mock_get_onion_queue_options);
+
+  update_approx_time(time(NULL));
+  flooder->global_identifier = 1;
+  flooder->timestamp_created = approx_time() - 3600;
+  newbie->global_identifier = 2;
+  newbie->timestamp_created = approx_time();
+  other->global_identifier = 3;
+  other->timestamp_created = approx_time() - 3600;
+
+  /* One channel on its own can fill the queue. */
+  for (i = 0; i < 80; ++i)
+    tt_int_op(0, OP_EQ, add_ntor_onionskin(circs, flooder));
+  tt_int_op(80, OP_EQ, onion_num_pending(ONION_HANDSHAKE_TYPE_NTOR));
+
+  /* A channel that only just opened gets less room... */
+  tt_int_op(-1, OP_EQ, add_ntor_onionskin(circs, newbie));
+  /* ... but an established one still gets in. */
+  tt_int_op(0, OP_EQ, add_ntor_onionskin(circs, other));
+
+  /* Now the flooder has more than its share, so it's the one we refuse. */
+  tt_int_op(-1, OP_EQ, add_ntor_onionskin(circs, flooder));
+  tt_int_op(0, OP_EQ, add_ntor_onionskin(circs, other));
+  tt_int_op(82, OP_EQ, onion_num_pending(ONION_HANDSHAKE_TYPE_NTOR));
+
+  tt_ptr_op(smartlist_get(circs, 0), OP_EQ, onion_next_task(&onionskin));
+  stats = onion_queue_get_stats();
+  tt_assert(!strcmpstart(stats, "ntor=81 tap=0 processed="));
+  tt_assert(strstr(stats, " rejected=2 expired=0 delay-p50="));
+
+ done:
+  clear_pending_onions();
+  UNMOCK(get_options);
+  SMARTLIST_FOREACH(circs, or_circuit_t *, circ, {
+      circ->p_chan = NULL;
+      circuit_free(TO_CIRCUIT(circ));
+  });
+  smartlist_free(circs);
+  tor_free(flooder);
+  tor_free(newbie);
+  tor_free(other);
+  tor_free(mock_onion_queue_options);
+  tor_free(onionskin);
+  tor_free(stats);
+}
+
 static void
 test_circuit_timeout(void *arg)
 {
@@ -516,6 +676,60 @@ test_circuit_timeout(void *arg)
   teardown_periodic_events();
 }
 
+/** Check that the incrementally maintained build time histogram matches
+ * one rebuilt from scratch after the circular array wraps around. */
+static void
+test_circuit_timeout_histogram(void *arg)
+{
+  circuit_build_times_t cbt, rebuilt;
+  const uint32_t *hist, *hist2;
+  build_time_t nbins, nbins2, i;
+  int n, abandoned = 0;
+  (void)arg;
+
+  memset(&rebuilt, 0, sizeof(rebuilt));
+  circuit_build_times_init(&cbt);
+  circuitbuild_running_unit_tests();
+
+  for (n = 0; n < CBT_NCIRCUITS_TO_OBSERVE*3/2; n++) {
+    if (n % 17 == 0) {
+      circuit_build_times_add_time(&cbt, CBT_BUILD_ABANDONED);
+    } else {
+      circuit_build_times_add_time(&cbt,
+                                   (build_time_t)(100 + (n*37) % 20000));
+    }
+    /* Start keeping the histogram partway through, and discard it once
+     * more, so we cover both the rebuild and the update paths. */
+    if (n == 10 || n == CBT_NCIRCUITS_TO_OBSERVE + 10)
+      tt_assert(circuit_build_times_get_histogram(&cbt, &nbins));
+    if (n == CBT_NCIRCUITS_TO_OBSERVE/2)
+      circuit_build_times_free_timeouts(&cbt);
+  }
+
+  for (n = 0; n < CBT_NCIRCUITS_TO_OBSERVE; n++) {
+    if (cbt.circuit_build_times[n] == CBT_BUILD_ABANDONED)
+      abandoned++;
+  }
+  tt_int_op(cbt.num_abandoned, OP_EQ, abandoned);
+  tt_double_op(fabs(circuit_build_times_close_rate(&cbt) -
+                    ((double)abandoned)/CBT_NCIRCUITS_TO_OBSERVE), OP_LT,
+               1e-9);
+
+  memcpy(&rebuilt, &cbt, sizeof(rebuilt));
+  rebuilt.histogram = NULL;
+  rebuilt.liveness.timeouts_after_firsthop = NULL;
+  hist = circuit_build_times_get_histogram(&cbt, &nbins);
+  hist2 = circuit_build_times_get_histogram(&rebuilt, &nbins2);
+  tt_uint_op(nbins, OP_GE, nbins2);
+  for (i = 0; i < nbins; i++) {
+    tt_uint_op(hist[i], OP_EQ, i < nbins2 ? hist2[i] : 0);
+  }
+
+ done:
+  tor_free(rebuilt.histogram);
+  circuit_build_times_free_timeouts(&cbt);
+}
+
 /** Test encoding and parsing of rendezvous service descriptors. */
 static void
 test_rend_fns(void *arg)
@@ -717,6 +931,15 @@ test_geoip(void *arg)
           "not-modified=0,busy=0\n"
       "dirreq-v3-direct-dl complete=0,timeout=0,running=0\n"
       "dirreq-v3-tunneled-dl complete=0,timeout=0,running=4\n",
+  *dirreq_stats_5 =
+      "dirreq-stats-end 2010-08-12 13:27:30 (86400 s)\n"
+      "dirreq-v3-ips \n"
+      "dirreq-v3-reqs \n"
+      "dirreq-v3-resp ok=8,not-enough-sigs=0,unavailable=0,not-found=0,"
+          "not-modified=0,busy=0\n"
+      "dirreq-v3-direct-dl complete=0,timeout=0,running=0\n"
+      "dirreq-v3-tunneled-dl complete=0,timeout=0,running=0\n"
+      "dirreq-v3-compression high=8,medium=0,low=8,cpu-ms=0\n",
   *entry_stats_1 =
       "entry-stats-end 2010-08-12 13:27:30 (86400 s)\n"
       "entry-ips ab=8\n",
@@ -872,6 +1095,14 @@ test_geoip(void *arg)
   tt_str_op(dirreq_stats_4,OP_EQ, s);
   tor_free(s);
 
+  /* Note some compressed responses. */
+  geoip_note_dirreq_compression(HIGH_COMPRESSION);
+  geoip_note_dirreq_compression(LOW_COMPRESSION);
+  geoip_note_dirreq_compression(LOW_COMPRESSION);
+  s = geoip_format_dirreq_stats(now + 86400);
+  tt_str_op(dirreq_stats_5,OP_EQ, s);
+  tor_free(s);
+
   /* Stop collecting directory request statistics and start gathering
    * entry stats. */
   geoip_dirreq_stats_term();
@@ -1157,6 +1388,169 @@ test_stats(void *arg)
   tor_free(s);
 }
 
+/** Look up IPv4 addresses whose ranges span several /16 prefixes. */
+static void
+test_geoip_ipv4_index(void *arg)
+{
+  (void)arg;
+
+  clear_geoip_db();
+  /* 10.0.0.0/16, 10.1.0.0 - 10.3.255.255, and 192.168.0.0/24. */
+  tt_int_op(0,OP_EQ, geoip_parse_entry("167772160,167837695,AB", AF_INET));
+  tt_int_op(0,OP_EQ, geoip_parse_entry("167837696,168034303,XY", AF_INET));
+  tt_int_op(0,OP_EQ, geoip_parse_entry("3232235520,3232235775,ZZ",
+                                       AF_INET));
+
+  tt_str_op("ab",OP_EQ,
+            geoip_get_country_name(geoip_get_country_by_ipv4(0x0a000505)));
+  tt_str_op("xy",OP_EQ,
+            geoip_get_country_name(geoip_get_country_by_ipv4(0x0a010000)));
+  tt_str_op("xy",OP_EQ,
+            geoip_get_country_name(geoip_get_country_by_ipv4(0x0a020001)));
+  tt_str_op("xy",OP_EQ,
+            geoip_get_country_name(geoip_get_country_by_ipv4(0x0a03ffff)));
+  tt_str_op("zz",OP_EQ,
+            geoip_get_country_name(geoip_get_country_by_ipv4(0xc0a80001)));
+  tt_int_op(0,OP_EQ, geoip_get_country_by_ipv4(0x0a040000));
+  tt_int_op(0,OP_EQ, geoip_get_country_by_ipv4(0xc0a80100));
+  tt_int_op(0,OP_EQ, geoip_get_country_by_ipv4(0));
+  tt_int_op(0,OP_EQ, geoip_get_country_by_ipv4(0xffffffff));
+
+  /* Adding an entry makes us rebuild the index. */
+  tt_int_op(0,OP_EQ, geoip_parse_entry("4294967040,4294967295,AB", AF_INET));
+  tt_str_op("ab",OP_EQ,
+            geoip_get_country_name(geoip_get_country_by_ipv4(0xffffffff)));
+  tt_str_op("zz",OP_EQ,
+            geoip_get_country_name(geoip_get_country_by_ipv4(0xc0a800ff)));
+
+ done:
+  ;
+}
+
+/** Expire remembered clients in order of when we last saw them, even if we
+ * didn't see them in that order. */
+static void
+test_geoip_client_expiry(void *arg)
+{
+  const time_t now = 1281533250; /* 2010-08-11 13:27:30 UTC */
+  tor_addr_t addr;
+  char *s = NULL;
+  (void)arg;
+
+  /* Start from an empty database and client history. */
+  geoip_free_all();
+  tt_int_op(0,OP_EQ, geoip_parse_entry("1,1,AB", AF_INET));
+  tt_int_op(0,OP_EQ, geoip_parse_entry("2,2,XY", AF_INET));
+  tt_int_op(0,OP_EQ, geoip_parse_entry("3,3,ZZ", AF_INET));
+  get_options_mutable()->EntryStatistics = 1;
+
+  tor_addr_from_ipv4h(&addr, 2);
+  geoip_note_client_seen(GEOIP_CLIENT_CONNECT, &addr, NULL, now-3600);
+  tor_addr_from_ipv4h(&addr, 1);
+  geoip_note_client_seen(GEOIP_CLIENT_CONNECT, &addr, NULL, now-7200);
+  tor_addr_from_ipv4h(&addr, 3);
+  geoip_note_client_seen(GEOIP_CLIENT_CONNECT, &addr, NULL, now-7200);
+  geoip_note_client_seen(GEOIP_CLIENT_CONNECT, &addr, NULL, now);
+
+  geoip_get_client_history(GEOIP_CLIENT_CONNECT, &s, NULL);
+  tt_str_op("ab=8,xy=8,zz=8",OP_EQ, s);
+  tor_free(s);
+
+  geoip_remove_old_clients(now-6000);
+  geoip_get_client_history(GEOIP_CLIENT_CONNECT, &s, NULL);
+  tt_str_op("xy=8,zz=8",OP_EQ, s);
+  tor_free(s);
+
+  geoip_remove_old_clients(now-60);
+  geoip_get_client_history(GEOIP_CLIENT_CONNECT, &s, NULL);
+  tt_str_op("zz=8",OP_EQ, s);
+  tor_free(s);
+
+ done:
+  tor_free(s);
+  get_options_mutable()->EntryStatistics = 0;
+}
+
+/** Make sure that we only remember a bounded number of link histories for
+ * each OR. */
+static void
+test_rephist_link_history(void *arg)
+{
+  char from_id[DIGEST_LEN], to_id[DIGEST_LEN];
+  uint64_t alloc_before;
+  int i;
+  (void)arg;
+
+  memset(from_id, 0x11, DIGEST_LEN);
+  memset(to_id, 0, DIGEST_LEN);
+  rep_hist_note_extend_failed(from_id, to_id); /* zero digest: ignored */
+  tt_int_op(rep_hist_get_n_link_histories(from_id), OP_EQ, 0);
+
+  for (i = 1; i <= 200; ++i) {
+    set_uint32(to_id, htonl(i));
+    rep_hist_note_extend_succeeded(from_id, to_id);
+  }
+  tt_int_op(rep_hist_get_n_link_histories(from_id), OP_EQ, 64);
+
+  /* Noting an extend to a remembered link doesn't evict anything. */
+  alloc_before = rephist_total_alloc;
+  rep_hist_note_extend_failed(from_id, to_id);
+  tt_int_op(rep_hist_get_n_link_histories(from_id), OP_EQ, 64);
+  tt_u64_op(rephist_total_alloc, OP_EQ, alloc_before);
+
+  /* Nor does replacing a link we forgot. */
+  set_uint32(to_id, htonl(1));
+  rep_hist_note_extend_failed(from_id, to_id);
+  tt_int_op(rep_hist_get_n_link_histories(from_id), OP_EQ, 64);
+  tt_u64_op(rephist_total_alloc, OP_EQ, alloc_before);
+
+ done:
+  ;
+}
+
+/** Make sure that discounting old MTBF data reaches every router, even
+ * though it is applied lazily. */
+static void
+test_rephist_downrate(void *arg)
+{
+  char id1[DIGEST_LEN], id2[DIGEST_LEN];
+  const time_t start = 1000000000;
+  const time_t interval = 12*60*60;
+  (void)arg;
+
+  memset(id1, 0x21, DIGEST_LEN);
+  memset(id2, 0x22, DIGEST_LEN);
+  rep_hist_note_router_reachable(id1, NULL, 0, start);
+  rep_hist_note_router_unreachable(id1, start + 10000);
+  rep_hist_note_router_reachable(id2, NULL, 0, start);
+  rep_hist_note_router_unreachable(id2, start + 20000);
+  tt_int_op(rep_hist_get_weighted_time_known(id1, start+20000), OP_EQ,
+            20000);
+  tt_int_op(rep_hist_get_weighted_time_known(id2, start+20000), OP_EQ,
+            20000);
+
+  /* Nothing to discount yet. */
+  tt_int_op(rep_hist_downrate_old_runs(start), OP_EQ, start + interval);
+  /* Two intervals have passed: discount by 0.95 * 0.95. */
+  tt_int_op(rep_hist_downrate_old_runs(start + 2*interval + 1), OP_EQ,
+            start + 3*interval);
+  tt_int_op(rep_hist_get_weighted_time_known(id1, start+10000), OP_EQ,
+            9025);
+  /* Asking again doesn't discount again. */
+  tt_int_op(rep_hist_get_weighted_time_known(id1, start+10000), OP_EQ,
+            9025);
+  /* One more interval: id2 catches up on all three discounts at once. */
+  tt_int_op(rep_hist_downrate_old_runs(start + 3*interval + 1), OP_EQ,
+            start + 4*interval);
+  tt_int_op(rep_hist_get_weighted_time_known(id1, start+10000), OP_EQ,
+            8573);
+  tt_int_op(rep_hist_get_weighted_time_known(id2, start+20000), OP_EQ,
+            17147);
+
+ done:
+  ;
+}
+
 #define ENT(name)                                                       \
   { #name, test_ ## name , 0, NULL, NULL }
 #define FORK(name)                                                      \
@@ -1166,13 +1560,21 @@ static struct testcase_t test_array[] = {
   ENT(onion_handshake),
   { "bad_onion_handshake", test_bad_onion_handshake, 0, NULL, NULL },
   ENT(onion_queues),
+  FORK(onion_queue_fairness),
   { "ntor_handshake", test_ntor_handshake, 0, NULL, NULL },
+  { "ntor_handshake_precomputed", test_ntor_handshake_precomputed, 0,
+    NULL, NULL },
   { "fast_handshake", test_fast_handshake, 0, NULL, NULL },
   FORK(circuit_timeout),
+  FORK(circuit_timeout_histogram),
   FORK(rend_fns),
   ENT(geoip),
   FORK(geoip_with_pt),
+  FORK(geoip_ipv4_index),
+  FORK(geoip_client_expiry),
   FORK(stats),
+  FORK(rephist_link_history),
+  FORK(rephist_downrate),
 
   END_OF_TESTCASES
 };
@@ -1186,6 +1588,9 @@ struct testgroup_t testgroups[] = {
   { "cellfmt/", cell_format_tests },
   { "cellqueue/", cell_queue_tests },
   { "channel/", channel_tests },
+#ifdef ENABLE_DGRAM_CHANNELS
+  { "channeldgram/", channeldgram_tests },
+#endif
   { "channeltls/", channeltls_tests },
   { "checkdir/", checkdir_tests },
   { "circuitlist/", circuitlist_tests },
@@ -1193,6 +1598,7 @@ struct testgroup_t testgroups[] = {
   { "compat/libevent/", compat_libevent_tests },
   { "config/", config_tests },
   { "connection/", connection_tests },
+  { "consdiff/", consdiff_tests },
   { "container/", container_tests },
   { "control/", controller_tests },
   { "control/event/", controller_event_tests },
@@ -1200,6 +1606,7 @@ struct testgroup_t testgroups[] = {
   { "dir/", dir_tests },
   { "dir_handle_get/", dir_handle_get_tests },
   { "dir/md/", microdesc_tests },
+  { "dos/", dos_tests },
   { "entryconn/", entryconn_tests },
   { "entrynodes/", entrynodes_tests },
   { "guardfraction/", guardfraction_tests },
@@ -1208,6 +1615,9 @@ struct testgroup_t testgroups[] = {
   { "introduce/", introduce_tests },
   { "keypin/", keypin_tests },
   { "link-handshake/", link_handshake_tests },
+#ifdef ENABLE_DGRAM_CHANNELS
+  { "netsim/", netsim_tests },
+#endif
   { "nodelist/", nodelist_tests },
   { "oom/", oom_tests },
   { "oos/", oos_tests },
@@ -1235,6 +1645,7 @@ struct testgroup_t testgroups[] = {
   { "util/pubsub/", pubsub_tests },
   { "util/thread/", thread_tests },
   { "util/handle/", handle_tests },
+  { "watchdog/", watchdog_tests },
   { "dns/", dns_tests },
   END_OF_GROUPS
 };
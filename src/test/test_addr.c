@@ -908,6 +908,69 @@ test_virtaddrmap(void *data)
   ;
 }
 
+static void
+test_virtaddr_bitmap(void *data)
+{
+  bitarray_t *used = NULL;
+  tor_addr_t a;
+  smartlist_t *seen = smartlist_new();
+  char buf[TOR_ADDR_BUF_LEN];
+  int i;
+  const uint32_t size = 1u << 16;
+
+  (void)data;
+
+  tt_int_op(0, OP_EQ, parse_virtual_addr_network("127.192.0.0/16", AF_INET,
+                                                 0, NULL));
+
+  /* With only one free address, we find it wherever we start. */
+  used = bitarray_init_zero(size);
+  memset(used, 0xff, size / 8);
+  bitarray_clear(used, 0x1234);
+  for (i = 0; i < 32; ++i) {
+    tt_int_op(0, OP_EQ, virtaddr_ipv4_pick_unused(used, &a));
+    tt_str_op(fmt_addr(&a), OP_EQ, "127.192.18.52");
+  }
+  bitarray_set(used, 0x1234);
+  tt_int_op(-1, OP_EQ, virtaddr_ipv4_pick_unused(used, &a));
+
+  /* Virtual addresses we hand out are distinct, in range, and never end in
+   * .0 or .255. */
+  addressmap_init();
+  for (i = 0; i < 2000; ++i) {
+    const char *va;
+    tor_snprintf(buf, sizeof(buf), "host%d.example.com", i);
+    va = addressmap_register_virtual_address(RESOLVED_TYPE_IPV4,
+                                             tor_strdup(buf));
+    tt_assert(va);
+    tt_assert(!strcmpstart(va, "127.192."));
+    tt_assert(strcmpend(va, ".0"));
+    tt_assert(strcmpend(va, ".255"));
+    tt_assert(!smartlist_contains_string(seen, va));
+    smartlist_add(seen, tor_strdup(va));
+  }
+
+  /* Wildcard mappings still match superdomains, case-insensitively. */
+  addressmap_register("example.org", tor_strdup("example.net"), 0,
+                      ADDRMAPSRC_TORRC, 1, 1);
+  strlcpy(buf, "www.EXAMPLE.org", sizeof(buf));
+  tt_assert(addressmap_rewrite(buf, sizeof(buf), ~0, NULL, NULL));
+  tt_str_op(buf, OP_EQ, "www.example.net");
+  strlcpy(buf, "www.example.com", sizeof(buf));
+  tt_assert(!addressmap_rewrite(buf, sizeof(buf), ~0, NULL, NULL));
+
+  /* Once the wildcard is gone, nothing matches. */
+  addressmap_register("example.org", NULL, 0, ADDRMAPSRC_TORRC, 1, 1);
+  strlcpy(buf, "www.example.org", sizeof(buf));
+  tt_assert(!addressmap_rewrite(buf, sizeof(buf), ~0, NULL, NULL));
+
+ done:
+  bitarray_free(used);
+  SMARTLIST_FOREACH(seen, char *, cp, tor_free(cp));
+  smartlist_free(seen);
+  addressmap_free_all();
+}
+
 static void
 test_addr_localname(void *arg)
 {
@@ -1062,6 +1125,7 @@ struct testcase_t addr_tests[] = {
   ADDR_LEGACY(ip6_helpers),
   ADDR_LEGACY(parse),
   { "virtaddr", test_virtaddrmap, 0, NULL, NULL },
+  { "virtaddr_bitmap", test_virtaddr_bitmap, TT_FORK, NULL, NULL },
   { "localname", test_addr_localname, 0, NULL, NULL },
   { "dup_ip", test_addr_dup_ip, 0, NULL, NULL },
   { "sockaddr_to_str", test_addr_sockaddr_to_str, 0, NULL, NULL },
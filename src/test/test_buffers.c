@@ -300,6 +300,103 @@ test_buffer_pullup(void *arg)
   tor_free(tmp);
 }
 
+static void
+test_buffer_http_split(void *arg)
+{
+  buf_t *buf = NULL;
+  char *filler = NULL, *headers = NULL, *body = NULL;
+  char *msg = NULL;
+  const char *cp;
+  size_t sz, body_used = 0, msglen;
+  const char *hdrs = "GET /tor/server/all HTTP/1.0\r\n"
+    "X-Padding: aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa\r\n"
+    "Content-Length: 11\r\n\r\n";
+  (void)arg;
+
+  /* Start the request near the end of the first chunk, so that the
+   * Content-Length header and the body land in the next one. */
+  filler = tor_malloc_zero(4000);
+  tor_asprintf(&msg, "%shello world", hdrs);
+  msglen = strlen(msg);
+  buf = buf_new_with_capacity(3000); /* rounds up to next power of 2. */
+  write_to_buf(filler, 4000, buf);
+  write_to_buf(msg, msglen - 1, buf);
+  tt_int_op(fetch_from_buf(filler, 4000, buf), OP_EQ, (int)msglen - 1);
+  buf_get_first_chunk_data(buf, &cp, &sz);
+  tt_uint_op(sz, OP_LT, strlen(hdrs));
+
+  /* One byte of body is still missing. */
+  tt_int_op(0, OP_EQ, fetch_from_buf_http(buf, &headers, 1024,
+                                          &body, &body_used, 1024, 0));
+  tt_ptr_op(headers, OP_EQ, NULL);
+  tt_int_op(buf_datalen(buf), OP_EQ, msglen - 1);
+  buf_get_first_chunk_data(buf, &cp, &sz);
+  tt_uint_op(sz, OP_LT, strlen(hdrs));
+
+  write_to_buf(msg + msglen - 1, 1, buf);
+  tt_int_op(1, OP_EQ, fetch_from_buf_http(buf, &headers, 1024,
+                                          &body, &body_used, 1024, 0));
+  tt_str_op(headers, OP_EQ, hdrs);
+  tt_str_op(body, OP_EQ, "hello world");
+  tt_uint_op(body_used, OP_EQ, 11);
+  tt_int_op(buf_datalen(buf), OP_EQ, 0);
+
+ done:
+  buf_free(buf);
+  tor_free(filler);
+  tor_free(msg);
+  tor_free(headers);
+  tor_free(body);
+}
+
+/** Make a buffer that holds <b>n_x</b> 'x' characters and then
+ * <b>s</b>, written a byte at a time, so that every chunk is full. */
+static buf_t *
+buf_with_filler(size_t n_x, const char *s)
+{
+  buf_t *buf = buf_new_with_capacity(3000);
+  size_t i;
+  for (i = 0; i < n_x; ++i)
+    write_to_buf("x", 1, buf);
+  for ( ; *s; ++s)
+    write_to_buf(s, 1, buf);
+  return buf;
+}
+
+static void
+test_buffer_find_string_boundary(void *arg)
+{
+  buf_t *buf = NULL;
+  const char *cp;
+  size_t cap, k;
+  (void)arg;
+
+  buf = buf_with_filler(10000, "");
+  buf_get_first_chunk_data(buf, &cp, &cap);
+  tt_uint_op(cap, OP_LT, 10000);
+  buf_free(buf);
+
+  /* Put the end of the headers at every offset across the end of the
+   * first chunk, with a near-miss just before the boundary. */
+  for (k = 0; k <= 6; ++k) {
+    buf = buf_with_filler(cap - k - 8, "\r\n\rx\r\nx\r\n\r\nbody");
+    tt_int_op(buf_find_string_offset(buf, "\r\n\r\n", 4), OP_EQ,
+              (int)(cap - k - 8 + 7));
+    tt_int_op(buf_find_string_offset(buf, "\r\nx", 3), OP_EQ,
+              (int)(cap - k - 8 + 4));
+    tt_int_op(buf_find_string_offset(buf, "body", 4), OP_EQ,
+              (int)(cap - k - 8 + 11));
+    tt_int_op(buf_find_string_offset(buf, "bodyx", 5), OP_EQ, -1);
+    tt_int_op(buf_find_string_offset(buf, "xx\r", 3), OP_EQ,
+              (int)(cap - k - 8 - 2));
+    buf_free(buf);
+    buf = NULL;
+  }
+
+ done:
+  buf_free(buf);
+}
+
 static void
 test_buffer_copy(void *arg)
 {
@@ -438,6 +535,51 @@ test_buffer_ext_or_cmd(void *arg)
   tor_free(tmp);
 }
 
+static void
+test_buffer_fixed_cell(void *arg)
+{
+  buf_t *buf = NULL;
+  cell_t cell;
+  char packed[CELL_MAX_NETWORK_SIZE];
+  int i;
+  (void)arg;
+
+  /* Narrow circuit IDs, with the cell split across two chunks. */
+  buf = buf_new_with_capacity(256);
+  memset(packed, 0, sizeof(packed));
+  set_uint16(packed, htons(0x1234));
+  packed[2] = CELL_RELAY;
+  for (i = 0; i < CELL_PAYLOAD_SIZE; ++i)
+    packed[3+i] = (char)i;
+  write_to_buf(packed, 100, buf);
+  tt_int_op(0, OP_EQ, fetch_cell_from_buf(buf, &cell, 0));
+  tt_int_op(100, OP_EQ, buf_datalen(buf));
+  write_to_buf(packed+100, CELL_MAX_NETWORK_SIZE - 2 - 100, buf);
+  write_to_buf("xy", 2, buf);
+  tt_int_op(1, OP_EQ, fetch_cell_from_buf(buf, &cell, 0));
+  tt_uint_op(cell.circ_id, OP_EQ, 0x1234);
+  tt_int_op(cell.command, OP_EQ, CELL_RELAY);
+  tt_mem_op(cell.payload, OP_EQ, packed+3, CELL_PAYLOAD_SIZE);
+  tt_int_op(2, OP_EQ, buf_datalen(buf));
+  buf_free(buf);
+
+  /* Wide circuit IDs. */
+  buf = buf_new();
+  set_uint32(packed, htonl(0x80001234));
+  packed[4] = CELL_DESTROY;
+  write_to_buf(packed, CELL_MAX_NETWORK_SIZE - 1, buf);
+  tt_int_op(0, OP_EQ, fetch_cell_from_buf(buf, &cell, 1));
+  write_to_buf(packed + CELL_MAX_NETWORK_SIZE - 1, 1, buf);
+  tt_int_op(1, OP_EQ, fetch_cell_from_buf(buf, &cell, 1));
+  tt_uint_op(cell.circ_id, OP_EQ, 0x80001234);
+  tt_int_op(cell.command, OP_EQ, CELL_DESTROY);
+  tt_mem_op(cell.payload, OP_EQ, packed+5, CELL_PAYLOAD_SIZE);
+  tt_int_op(0, OP_EQ, buf_datalen(buf));
+
+ done:
+  buf_free(buf);
+}
+
 static void
 test_buffer_allocation_tracking(void *arg)
 {
@@ -506,6 +648,103 @@ test_buffer_allocation_tracking(void *arg)
   tor_free(junk);
 }
 
+static void
+test_buffer_freelists(void *arg)
+{
+  char *junk = tor_malloc_zero(4000);
+  buf_t *buf = NULL;
+
+  (void)arg;
+
+  /* Earlier tests in this process may have left chunks behind. */
+  buf_freelists_clear();
+  tt_int_op(buf_get_freelist_allocation(), OP_EQ, 0);
+  buf = buf_new();
+  write_to_buf(junk, 4000, buf);
+  write_to_buf(junk, 4000, buf);
+  tt_int_op(buf_get_total_allocation(), OP_EQ, 8192);
+
+  /* Freed chunks are kept for reuse, and don't count as in use. */
+  buf_clear(buf);
+  tt_int_op(buf_get_total_allocation(), OP_EQ, 0);
+  tt_int_op(buf_get_freelist_allocation(), OP_EQ, 8192);
+
+  /* New chunks of the same size come off the freelist. */
+  write_to_buf(junk, 4000, buf);
+  tt_int_op(buf_get_total_allocation(), OP_EQ, 4096);
+  tt_int_op(buf_get_freelist_allocation(), OP_EQ, 4096);
+
+  /* Odd sizes go straight back to the allocator. */
+  write_to_buf(junk, 4000, buf);
+  buf_pullup(buf, 8000);
+  tt_int_op(buf_get_freelist_allocation(), OP_EQ, 4096);
+
+  /* And clearing the freelists gives everything back. */
+  tt_int_op(buf_freelists_clear(), OP_EQ, 4096);
+  tt_int_op(buf_get_freelist_allocation(), OP_EQ, 0);
+
+ done:
+  buf_free(buf);
+  buf_freelists_clear();
+  tor_free(junk);
+}
+
+static void
+test_buffer_move_splice(void *arg)
+{
+  char *junk = tor_malloc(16384);
+  char *out = tor_malloc(16384);
+  buf_t *buf1 = NULL, *buf2 = NULL;
+  size_t flushlen;
+
+  (void)arg;
+
+  crypto_rand(junk, 16384);
+  buf1 = buf_new();
+  buf2 = buf_new();
+  write_to_buf(junk, 10, buf2);
+  write_to_buf(junk+10, 4000, buf1);
+  tt_int_op(buf_get_total_allocation(), OP_EQ, 2*4096);
+
+  /* Moving a whole chunk hands it over, even though buf2 had room for it:
+   * nothing gets allocated or freed. */
+  flushlen = 4000;
+  tt_int_op(move_buf_to_buf(buf2, buf1, &flushlen), OP_EQ, 4000);
+  tt_int_op(flushlen, OP_EQ, 0);
+  tt_int_op(buf_allocation(buf1), OP_EQ, 0);
+  tt_int_op(buf_allocation(buf2), OP_EQ, 2*4096);
+  tt_int_op(buf_get_total_allocation(), OP_EQ, 2*4096);
+  tt_int_op(buf_datalen(buf1), OP_EQ, 0);
+  tt_int_op(buf_datalen(buf2), OP_EQ, 4010);
+
+  /* Small chunks get packed onto the end of the last chunk instead. */
+  write_to_buf(junk+4010, 16, buf1);
+  flushlen = 16;
+  tt_int_op(move_buf_to_buf(buf2, buf1, &flushlen), OP_EQ, 16);
+  tt_int_op(buf_allocation(buf1), OP_EQ, 0);
+  tt_int_op(buf_allocation(buf2), OP_EQ, 2*4096);
+
+  /* Partial moves copy just what was asked for. */
+  write_to_buf(junk+4026, 4000, buf1);
+  flushlen = 1000;
+  tt_int_op(move_buf_to_buf(buf2, buf1, &flushlen), OP_EQ, 1000);
+  tt_int_op(flushlen, OP_EQ, 0);
+  tt_int_op(buf_datalen(buf1), OP_EQ, 3000);
+  tt_int_op(buf_datalen(buf2), OP_EQ, 5026);
+  flushlen = 10000;
+  tt_int_op(move_buf_to_buf(buf2, buf1, &flushlen), OP_EQ, 3000);
+  tt_int_op(flushlen, OP_EQ, 7000);
+  tt_int_op(buf_datalen(buf2), OP_EQ, 8026);
+  fetch_from_buf(out, 8026, buf2);
+  tt_mem_op(out, OP_EQ, junk, 8026);
+
+ done:
+  buf_free(buf1);
+  buf_free(buf2);
+  tor_free(junk);
+  tor_free(out);
+}
+
 static void
 test_buffer_time_tracking(void *arg)
 {
@@ -744,6 +983,146 @@ test_buffers_tls_read_mocked(void *arg)
   buf_free(buf);
 }
 
+/** Move the ciphertext that each of the memory-BIO TLS objects <b>a</b>
+ * and <b>b</b> has produced over to the other one, through <b>wire</b>. */
+static void
+shuttle_tls_membio(tor_tls_t *a, tor_tls_t *b, buf_t *wire)
+{
+  move_tls_membio_to_buf(wire, a);
+  move_buf_to_tls_membio(b, wire, buf_datalen(wire));
+  move_tls_membio_to_buf(wire, b);
+  move_buf_to_tls_membio(a, wire, buf_datalen(wire));
+}
+
+static void
+test_buffers_tls_membio(void *arg)
+{
+  crypto_pk_t *key1 = NULL, *key2 = NULL;
+  tor_tls_t *client = NULL, *server = NULL;
+  buf_t *wire = NULL, *out = NULL, *in = NULL;
+  int client_done = 0, server_done = 0, i, r;
+  char msg[3000], got[3000];
+  size_t flushlen, n;
+  (void)arg;
+
+  key1 = pk_generate(2);
+  key2 = pk_generate(3);
+  tt_int_op(tor_tls_context_init(TOR_TLS_CTX_IS_PUBLIC_SERVER,
+                                 key1, key2, 86400), OP_EQ, 0);
+  client = tor_tls_new_membio(0);
+  server = tor_tls_new_membio(1);
+  tt_assert(client);
+  tt_assert(server);
+  tt_assert(tor_tls_uses_membio(client));
+  wire = buf_new();
+  out = buf_new();
+  in = buf_new();
+
+  /* Handshake entirely in memory.  Neither side ever has to wait to
+   * write. */
+  for (i = 0; i < 10 && !(client_done && server_done); ++i) {
+    if (!client_done) {
+      r = tor_tls_handshake(client);
+      tt_assert(r == TOR_TLS_DONE || r == TOR_TLS_WANTREAD);
+      client_done = (r == TOR_TLS_DONE);
+    }
+    if (!server_done) {
+      r = tor_tls_handshake(server);
+      tt_assert(r == TOR_TLS_DONE || r == TOR_TLS_WANTREAD);
+      server_done = (r == TOR_TLS_DONE);
+    }
+    shuttle_tls_membio(client, server, wire);
+  }
+  tt_assert(client_done);
+  tt_assert(server_done);
+  tt_int_op(buf_datalen(wire), OP_EQ, 0);
+
+  /* Encrypt a buffer's worth of plaintext into the wire buffer. */
+  crypto_rand(msg, sizeof(msg));
+  write_to_buf(msg, sizeof(msg), out);
+  flushlen = buf_datalen(out);
+  tt_int_op(flush_buf_tls(client, out, flushlen, &flushlen), OP_EQ,
+            sizeof(msg));
+  tt_int_op(buf_datalen(out), OP_EQ, 0);
+  tt_int_op(move_tls_membio_to_buf(wire, client), OP_GT, sizeof(msg));
+  tt_int_op(tor_tls_membio_output_len(client), OP_EQ, 0);
+
+  /* Hand it over in two parts: with only part of the record, the server
+   * has nothing to decrypt yet. */
+  n = buf_datalen(wire);
+  tt_int_op(move_buf_to_tls_membio(server, wire, 100), OP_EQ, 100);
+  tt_int_op(buf_datalen(wire), OP_EQ, n - 100);
+  tt_int_op(read_to_buf_tls(server, sizeof(msg), in), OP_EQ,
+            TOR_TLS_WANTREAD);
+  tt_int_op(move_buf_to_tls_membio(server, wire, n), OP_EQ, n - 100);
+  tt_int_op(read_to_buf_tls(server, sizeof(msg), in), OP_EQ, sizeof(msg));
+  fetch_from_buf(got, sizeof(got), in);
+  tt_mem_op(got, OP_EQ, msg, sizeof(msg));
+
+  /* Once the network has closed, the server stops asking for more. */
+  tor_tls_membio_note_eof(server);
+  r = read_to_buf_tls(server, sizeof(msg), in);
+  tt_int_op(r, OP_LT, 0);
+  tt_int_op(r, OP_NE, TOR_TLS_WANTREAD);
+
+ done:
+  tor_tls_free(client);
+  tor_tls_free(server);
+  buf_free(wire);
+  buf_free(out);
+  buf_free(in);
+  crypto_pk_free(key1);
+  crypto_pk_free(key2);
+  tor_tls_free_all();
+}
+
+static void
+test_buffers_tls_record_coalescing(void *arg)
+{
+  char *mem, *got = NULL;
+  const char *cp;
+  buf_t *buf;
+  size_t sz, n, total = 40 * CELL_MAX_NETWORK_SIZE;
+  int n_records = 0;
+  (void)arg;
+
+  mem = tor_malloc(total);
+  crypto_rand(mem, total);
+  got = tor_malloc(total);
+  buf = buf_new();
+
+  /* Queue 40 cells, the way connection_write_to_buf() would: they land in
+   * 4K chunks. */
+  for (n = 0; n < 40; ++n)
+    write_to_buf(mem + n * CELL_MAX_NETWORK_SIZE, CELL_MAX_NETWORK_SIZE, buf);
+  buf_get_first_chunk_data(buf, &cp, &sz);
+  tt_int_op(sz, OP_LT, 4096);
+
+  /* Flushing part of a chunk writes just that part. */
+  tt_int_op(buf_prepare_tls_record(buf, 1000), OP_EQ, 1000);
+  tt_int_op(buf_prepare_tls_record(buf, 0), OP_EQ, 0);
+
+  /* Flushing everything fills whole TLS records, not one per chunk. */
+  for (n = 0; n < total; ) {
+    sz = buf_prepare_tls_record(buf, total - n);
+    tt_int_op(sz, OP_EQ, MIN(total - n, 16384));
+    ++n_records;
+    fetch_from_buf(got + n, sz, buf);
+    n += sz;
+  }
+  tt_int_op(n_records, OP_EQ, 2);
+  tt_int_op(buf_datalen(buf), OP_EQ, 0);
+  tt_int_op(buf_prepare_tls_record(buf, 0), OP_EQ, 0);
+
+  /* And the data came out in order. */
+  tt_mem_op(got, OP_EQ, mem, total);
+
+ done:
+  tor_free(mem);
+  tor_free(got);
+  buf_free(buf);
+}
+
 static void
 test_buffers_chunk_size(void *arg)
 {
@@ -765,13 +1144,112 @@ test_buffers_chunk_size(void *arg)
   ;
 }
 
+static void
+test_buffers_socket_iovec(void *arg)
+{
+  tor_socket_t fds[2] = { TOR_INVALID_SOCKET, TOR_INVALID_SOCKET };
+  buf_t *out = NULL, *in = NULL, *small = NULL;
+  char *msg = NULL, *got = NULL;
+  const size_t msglen = 40000;
+  size_t flushlen, alloc_before;
+  int reached_eof = 0, socket_error = 0;
+  int r;
+  unsigned i;
+  (void)arg;
+
+  tt_int_op(tor_socketpair(AF_UNIX, SOCK_STREAM, 0, fds), OP_EQ, 0);
+  tt_int_op(set_socket_nonblocking(fds[0]), OP_EQ, 0);
+  tt_int_op(set_socket_nonblocking(fds[1]), OP_EQ, 0);
+
+  msg = tor_malloc(msglen);
+  for (i = 0; i < msglen; ++i)
+    msg[i] = (char)(i * 7 + i / 251);
+  got = tor_malloc_zero(msglen);
+
+  /* Build an outbuf that spans many chunks, then flush it all at once. */
+  out = buf_new_with_capacity(1000);
+  for (i = 0; i < msglen; i += 1000)
+    write_to_buf(msg + i, 1000, out);
+  tt_int_op(buf_datalen(out), OP_EQ, msglen);
+  tt_ptr_op(out->head->next, OP_NE, NULL);
+  flushlen = msglen;
+  r = flush_buf(fds[0], out, msglen, &flushlen);
+  tt_int_op(r, OP_EQ, msglen);
+  tt_int_op(flushlen, OP_EQ, 0);
+  tt_int_op(buf_datalen(out), OP_EQ, 0);
+
+  /* Leave a little room in the tail of the inbuf so that the read has to
+   * spill into a second chunk. */
+  in = buf_new_with_capacity(1000);
+  write_to_buf("hello", 5, in);
+  r = read_to_buf(fds[1], msglen, in, &reached_eof, &socket_error);
+  tt_int_op(r, OP_GT, 0);
+  tt_int_op(buf_datalen(in), OP_EQ, r + 5);
+  tt_ptr_op(in->head->next, OP_NE, NULL);
+  while (buf_datalen(in) < msglen + 5) {
+    r = read_to_buf(fds[1], msglen, in, &reached_eof, &socket_error);
+    tt_int_op(r, OP_GT, 0);
+  }
+  tt_int_op(reached_eof, OP_EQ, 0);
+  tt_int_op(buf_datalen(in), OP_EQ, msglen + 5);
+  fetch_from_buf(got, 5, in);
+  tt_mem_op(got, OP_EQ, "hello", 5);
+  fetch_from_buf(got, msglen, in);
+  tt_mem_op(got, OP_EQ, msg, msglen);
+
+  /* A short read into a tail with plenty of room to spare shouldn't
+   * allocate a second chunk, even if we were willing to read more. */
+  small = buf_new_with_capacity(8192);
+  write_to_buf("hello", 5, small);
+  tt_int_op(send(fds[0], msg, 100, 0), OP_EQ, 100);
+  buf_freelists_clear();
+  alloc_before = buf_get_total_allocation();
+  r = read_to_buf(fds[1], msglen, small, &reached_eof, &socket_error);
+  tt_int_op(r, OP_EQ, 100);
+  tt_ptr_op(small->head->next, OP_EQ, NULL);
+  tt_int_op(buf_get_total_allocation(), OP_EQ, alloc_before);
+  tt_int_op(buf_get_freelist_allocation(), OP_EQ, 0);
+
+  /* Reading with nothing to read must not leak the spare chunk. */
+  alloc_before = buf_get_total_allocation();
+  r = read_to_buf(fds[1], 8192, in, &reached_eof, &socket_error);
+  tt_int_op(r, OP_EQ, 0);
+  tt_int_op(reached_eof, OP_EQ, 0);
+  tt_int_op(buf_get_total_allocation(), OP_EQ, alloc_before);
+
+  /* And EOF is still noticed. */
+  tor_close_socket(fds[0]);
+  fds[0] = TOR_INVALID_SOCKET;
+  r = read_to_buf(fds[1], 8192, in, &reached_eof, &socket_error);
+  tt_int_op(r, OP_EQ, 0);
+  tt_int_op(reached_eof, OP_EQ, 1);
+  tt_int_op(buf_get_total_allocation(), OP_EQ, alloc_before);
+
+ done:
+  if (SOCKET_OK(fds[0]))
+    tor_close_socket(fds[0]);
+  if (SOCKET_OK(fds[1]))
+    tor_close_socket(fds[1]);
+  buf_free(out);
+  buf_free(in);
+  buf_free(small);
+  tor_free(msg);
+  tor_free(got);
+}
+
 struct testcase_t buffer_tests[] = {
   { "basic", test_buffers_basic, TT_FORK, NULL, NULL },
   { "copy", test_buffer_copy, TT_FORK, NULL, NULL },
   { "pullup", test_buffer_pullup, TT_FORK, NULL, NULL },
+  { "http_split", test_buffer_http_split, TT_FORK, NULL, NULL },
+  { "find_string_boundary", test_buffer_find_string_boundary, 0,
+    NULL, NULL },
   { "ext_or_cmd", test_buffer_ext_or_cmd, TT_FORK, NULL, NULL },
+  { "fixed_cell", test_buffer_fixed_cell, 0, NULL, NULL },
   { "allocation_tracking", test_buffer_allocation_tracking, TT_FORK,
     NULL, NULL },
+  { "freelists", test_buffer_freelists, TT_FORK, NULL, NULL },
+  { "move_splice", test_buffer_move_splice, TT_FORK, NULL, NULL },
   { "time_tracking", test_buffer_time_tracking, TT_FORK, NULL, NULL },
   { "zlib", test_buffers_zlib, TT_FORK, NULL, NULL },
   { "zlib_fin_with_nil", test_buffers_zlib_fin_with_nil, TT_FORK, NULL, NULL },
@@ -779,7 +1257,11 @@ struct testcase_t buffer_tests[] = {
     NULL, NULL},
   { "tls_read_mocked", test_buffers_tls_read_mocked, 0,
     NULL, NULL },
+  { "tls_record_coalescing", test_buffers_tls_record_coalescing, 0,
+    NULL, NULL },
+  { "tls_membio", test_buffers_tls_membio, TT_FORK, NULL, NULL },
   { "chunk_size", test_buffers_chunk_size, 0, NULL, NULL },
+  { "socket_iovec", test_buffers_socket_iovec, TT_FORK, NULL, NULL },
   END_OF_TESTCASES
 };
 
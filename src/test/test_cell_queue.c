@@ -97,6 +97,43 @@ test_cq_manip(void *arg)
   cell_queue_clear(&cq);
 }
 
+static void
+test_cq_freelist(void *arg)
+{
+  packed_cell_t *pc1 = NULL, *pc2 = NULL;
+  size_t base;
+  (void) arg;
+
+  packed_cell_freelist_clear();
+  base = cell_queues_get_total_allocation();
+
+  pc1 = packed_cell_new();
+  pc2 = packed_cell_new();
+  tt_int_op(cell_queues_get_total_allocation(), OP_EQ,
+            base + 2 * packed_cell_mem_cost());
+
+  /* Freed cells stay on the freelist, and still count against us. */
+  memset(pc1->body, 0x7f, sizeof(pc1->body));
+  packed_cell_free(pc1);
+  tt_int_op(cell_queues_get_total_allocation(), OP_EQ,
+            base + 2 * packed_cell_mem_cost());
+
+  /* ... and come back zeroed when we allocate again. */
+  pc1 = packed_cell_new();
+  tt_assert(tor_mem_is_zero(pc1->body, sizeof(pc1->body)));
+  packed_cell_free(pc1);
+  packed_cell_free(pc2);
+  pc1 = pc2 = NULL;
+
+  /* Clearing the freelist gives the memory back. */
+  tt_int_op(packed_cell_freelist_clear(), OP_EQ, 2 * packed_cell_mem_cost());
+  tt_int_op(cell_queues_get_total_allocation(), OP_EQ, base);
+
+ done:
+  packed_cell_free(pc1);
+  packed_cell_free(pc2);
+}
+
 static void
 test_circuit_n_cells(void *arg)
 {
@@ -137,6 +174,7 @@ test_circuit_n_cells(void *arg)
 struct testcase_t cell_queue_tests[] = {
   { "basic", test_cq_manip, TT_FORK, NULL, NULL, },
   { "circ_n_cells", test_circuit_n_cells, TT_FORK, NULL, NULL },
+  { "freelist", test_cq_freelist, TT_FORK, NULL, NULL },
   END_OF_TESTCASES
 };
 
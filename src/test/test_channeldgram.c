@@ -0,0 +1,271 @@
+/* Copyright (c) 2016, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+#include "orconfig.h"
+
+#define TOR_CHANNEL_INTERNAL_
+#include "or.h"
+#include "channel.h"
+#include "channeldgram.h"
+#include "scheduler.h"
+
+/* Test suite stuff */
+#include "test.h"
+
+/** One end of an in-memory datagram link between two test channels. */
+typedef struct fake_dgram_end_t {
+  /** Datagrams sent from this end, waiting for deliver_all(). */
+  smartlist_t *outq;
+  /** The channel at the other end. */
+  channel_t *peer;
+  /** If true, datagrams sent from this end are silently lost. */
+  int drop;
+} fake_dgram_end_t;
+
+typedef struct fake_datagram_t {
+  size_t len;
+  uint8_t buf[DGRAM_FRAME_MAX_LEN];
+} fake_datagram_t;
+
+static fake_dgram_end_t end_a, end_b;
+
+/* What the cell handler on the receiving channel has seen. */
+#define MAX_RECV 512
+static int n_recv = 0;
+static circid_t recv_circ_id[MAX_RECV];
+static uint8_t recv_tag[MAX_RECV];
+
+static int
+fake_dgram_send(void *arg, const uint8_t *buf, size_t len)
+{
+  fake_dgram_end_t *end = arg;
+  fake_datagram_t *d;
+
+  tt_int_op(len, OP_LE, DGRAM_FRAME_MAX_LEN);
+  if (end->drop)
+    return 0;
+  d = tor_malloc_zero(sizeof(*d));
+  d->len = len;
+  memcpy(d->buf, buf, len);
+  smartlist_add(end->outq, d);
+ done:
+  return 0;
+}
+
+/** Hand every datagram queued at either end to the other, until neither
+ * has any left. */
+static void
+deliver_all(void)
+{
+  while (smartlist_len(end_a.outq) || smartlist_len(end_b.outq)) {
+    fake_dgram_end_t *end = smartlist_len(end_a.outq) ? &end_a : &end_b;
+    fake_datagram_t *d = smartlist_get(end->outq, 0);
+    smartlist_del_keeporder(end->outq, 0);
+    channel_dgram_handle_datagram(BASE_CHAN_TO_DGRAM(end->peer),
+                                  d->buf, d->len);
+    tor_free(d);
+  }
+}
+
+static void
+dgram_test_cell_handler(channel_t *chan, cell_t *cell)
+{
+  (void)chan;
+  tt_int_op(n_recv, OP_LT, MAX_RECV);
+  recv_circ_id[n_recv] = cell->circ_id;
+  recv_tag[n_recv] = cell->payload[0];
+  ++n_recv;
+ done:
+  ;
+}
+
+static void
+send_tagged_cell(channel_t *chan, circid_t circ_id, uint8_t tag)
+{
+  cell_t cell;
+  memset(&cell, 0, sizeof(cell));
+  cell.circ_id = circ_id;
+  cell.command = CELL_RELAY;
+  cell.payload[0] = tag;
+  channel_write_cell(chan, &cell);
+}
+
+/** Make a pair of datagram channels joined by end_a and end_b, and store
+ * them in *<b>a_out</b> (the sender) and *<b>b_out</b>. */
+static void
+setup_channel_pair(channel_t **a_out, channel_t **b_out)
+{
+  channel_dgram_transport_t transport;
+  tor_addr_t addr;
+  const char digest_a[DIGEST_LEN] = "aaaaaaaaaaaaaaaaaaa";
+  const char digest_b[DIGEST_LEN] = "bbbbbbbbbbbbbbbbbbb";
+
+  scheduler_init();
+  memset(&end_a, 0, sizeof(end_a));
+  memset(&end_b, 0, sizeof(end_b));
+  end_a.outq = smartlist_new();
+  end_b.outq = smartlist_new();
+  n_recv = 0;
+  tor_addr_from_ipv4h(&addr, 0x01020304);
+
+  memset(&transport, 0, sizeof(transport));
+  transport.send = fake_dgram_send;
+  transport.name = "test";
+  transport.arg = &end_a;
+  *a_out = channel_dgram_new(&transport, &addr, 443, digest_b, 0);
+  transport.arg = &end_b;
+  *b_out = channel_dgram_new(&transport, &addr, 9999, digest_a, 1);
+  end_a.peer = *b_out;
+  end_b.peer = *a_out;
+  channel_set_cell_handlers(*b_out, dgram_test_cell_handler, NULL);
+}
+
+static void
+teardown_channel_pair(void)
+{
+  channel_free_all();
+  SMARTLIST_FOREACH(end_a.outq, fake_datagram_t *, d, tor_free(d));
+  SMARTLIST_FOREACH(end_b.outq, fake_datagram_t *, d, tor_free(d));
+  smartlist_free(end_a.outq);
+  smartlist_free(end_b.outq);
+  scheduler_free_all();
+}
+
+static void
+test_channeldgram_in_order(void *arg)
+{
+  channel_t *a = NULL, *b = NULL;
+  uint8_t junk[DGRAM_FRAME_HEADER_LEN - 1];
+  (void)arg;
+
+  setup_channel_pair(&a, &b);
+  tt_assert(CHANNEL_IS_OPEN(a));
+  tt_assert(channel_is_incoming(b));
+  tt_int_op(channel_num_cells_writeable(a), OP_EQ, DGRAM_CHAN_SEND_WINDOW);
+
+  send_tagged_cell(a, 5, 1);
+  send_tagged_cell(a, 5, 2);
+  send_tagged_cell(a, 5, 3);
+  tt_int_op(BASE_CHAN_TO_DGRAM(a)->n_unacked, OP_EQ, 3);
+  tt_int_op(channel_num_cells_writeable(a), OP_EQ,
+            DGRAM_CHAN_SEND_WINDOW - 3);
+
+  deliver_all();
+  tt_int_op(n_recv, OP_EQ, 3);
+  tt_int_op(recv_circ_id[0], OP_EQ, 5);
+  tt_int_op(recv_tag[0], OP_EQ, 1);
+  tt_int_op(recv_tag[1], OP_EQ, 2);
+  tt_int_op(recv_tag[2], OP_EQ, 3);
+  /* Every cell was acknowledged. */
+  tt_int_op(BASE_CHAN_TO_DGRAM(a)->n_unacked, OP_EQ, 0);
+  tt_int_op(channel_num_cells_writeable(a), OP_EQ, DGRAM_CHAN_SEND_WINDOW);
+
+  /* A runt datagram is ignored. */
+  memset(junk, 0, sizeof(junk));
+  channel_dgram_handle_datagram(BASE_CHAN_TO_DGRAM(b), junk, sizeof(junk));
+  tt_int_op(n_recv, OP_EQ, 3);
+  tt_assert(CHANNEL_IS_OPEN(b));
+
+ done:
+  teardown_channel_pair();
+}
+
+static void
+test_channeldgram_loss_is_per_circuit(void *arg)
+{
+  channel_t *a = NULL, *b = NULL;
+  (void)arg;
+
+  setup_channel_pair(&a, &b);
+
+  /* The first cell on circuit 5 is lost. */
+  end_a.drop = 1;
+  send_tagged_cell(a, 5, 1);
+  end_a.drop = 0;
+  send_tagged_cell(a, 5, 2);
+  send_tagged_cell(a, 7, 3);
+  deliver_all();
+
+  /* Circuit 7 isn't held up; circuit 5 waits for its first cell. */
+  tt_int_op(n_recv, OP_EQ, 1);
+  tt_int_op(recv_circ_id[0], OP_EQ, 7);
+  tt_int_op(recv_tag[0], OP_EQ, 3);
+  tt_int_op(BASE_CHAN_TO_DGRAM(a)->n_unacked, OP_EQ, 2);
+
+  /* Nothing is old enough to retransmit yet. */
+  channel_dgram_retransmit(BASE_CHAN_TO_DGRAM(a),
+                           monotime_coarse_absolute_msec());
+  tt_int_op(smartlist_len(end_a.outq), OP_EQ, 0);
+
+  /* Once the timeout has passed, both unacknowledged cells go again, and
+   * circuit 5 gets them in order. */
+  channel_dgram_retransmit(BASE_CHAN_TO_DGRAM(a),
+                           monotime_coarse_absolute_msec() + 60*1000);
+  tt_u64_op(BASE_CHAN_TO_DGRAM(a)->n_retransmits, OP_EQ, 2);
+  deliver_all();
+  tt_int_op(n_recv, OP_EQ, 3);
+  tt_int_op(recv_circ_id[1], OP_EQ, 5);
+  tt_int_op(recv_tag[1], OP_EQ, 1);
+  tt_int_op(recv_circ_id[2], OP_EQ, 5);
+  tt_int_op(recv_tag[2], OP_EQ, 2);
+  /* The second cell arrived twice, and was delivered once. */
+  tt_u64_op(BASE_CHAN_TO_DGRAM(b)->n_duplicates, OP_EQ, 1);
+  tt_int_op(BASE_CHAN_TO_DGRAM(a)->n_unacked, OP_EQ, 0);
+
+ done:
+  teardown_channel_pair();
+}
+
+static void
+test_channeldgram_send_window(void *arg)
+{
+  channel_t *a = NULL, *b = NULL;
+  /* The channel keeps a pointer to a cell it has to queue, so this one
+   * mustn't live on the stack. */
+  static cell_t queued_cell;
+  int i;
+  (void)arg;
+
+  setup_channel_pair(&a, &b);
+
+  /* Fill the send window with cells that never arrive. */
+  end_a.drop = 1;
+  for (i = 0; i < DGRAM_CHAN_SEND_WINDOW; ++i)
+    send_tagged_cell(a, 5, (uint8_t)(i % 0xff));
+  tt_int_op(channel_num_cells_writeable(a), OP_EQ, 0);
+  tt_int_op(a->num_bytes_queued(a), OP_EQ,
+            DGRAM_CHAN_SEND_WINDOW * DGRAM_FRAME_MAX_LEN);
+
+  /* One more waits in the channel's own queue. */
+  memset(&queued_cell, 0, sizeof(queued_cell));
+  queued_cell.circ_id = 5;
+  queued_cell.command = CELL_RELAY;
+  queued_cell.payload[0] = 0xff;
+  channel_write_cell(a, &queued_cell);
+  tt_assert(! TOR_SIMPLEQ_EMPTY(&a->outgoing_queue));
+  tt_int_op(BASE_CHAN_TO_DGRAM(a)->n_unacked, OP_EQ,
+            DGRAM_CHAN_SEND_WINDOW);
+
+  /* Once the retransmissions are acknowledged, the queued cell goes out
+   * too. */
+  end_a.drop = 0;
+  channel_dgram_retransmit(BASE_CHAN_TO_DGRAM(a),
+                           monotime_coarse_absolute_msec() + 60*1000);
+  deliver_all();
+  tt_assert(TOR_SIMPLEQ_EMPTY(&a->outgoing_queue));
+  tt_int_op(n_recv, OP_EQ, DGRAM_CHAN_SEND_WINDOW + 1);
+  tt_int_op(recv_tag[DGRAM_CHAN_SEND_WINDOW], OP_EQ, 0xff);
+  tt_int_op(channel_num_cells_writeable(a), OP_EQ, DGRAM_CHAN_SEND_WINDOW);
+
+ done:
+  teardown_channel_pair();
+}
+
+struct testcase_t channeldgram_tests[] = {
+  { "in_order", test_channeldgram_in_order, TT_FORK, NULL, NULL },
+  { "loss_is_per_circuit", test_channeldgram_loss_is_per_circuit,
+    TT_FORK, NULL, NULL },
+  { "send_window", test_channeldgram_send_window, TT_FORK, NULL, NULL },
+  END_OF_TESTCASES
+};
+
@@ -6,6 +6,7 @@
 #include <math.h>
 
 #define TOR_CHANNEL_INTERNAL_
+#define CHANNELTLS_PRIVATE
 #include "or.h"
 #include "address.h"
 #include "buffers.h"
@@ -25,6 +26,7 @@
 static void test_channeltls_create(void *arg);
 static void test_channeltls_num_bytes_queued(void *arg);
 static void test_channeltls_overhead_estimate(void *arg);
+static void test_channeltls_stats(void *arg);
 
 /* Mocks used by channeltls unit tests */
 static size_t tlschan_buf_datalen_mock(const buf_t *buf);
@@ -323,12 +325,80 @@ tlschan_is_local_addr_mock(const tor_addr_t *addr)
   return tlschan_local;
 }
 
+static void
+test_channeltls_stats(void *arg)
+{
+  channel_tls_t *tlschan = tor_malloc_zero(sizeof(channel_tls_t));
+  channel_t *chan = TLS_CHAN_TO_BASE(tlschan);
+  channel_tls_stats_sample_t sample;
+  const channel_tls_stats_sample_t *last;
+  char *s = NULL;
+  int i;
+  (void)arg;
+
+  chan->global_identifier = 7;
+  tlschan->stats = tor_malloc_zero(sizeof(channel_tls_stats_t));
+  tt_ptr_op(channel_tls_get_last_sample(tlschan), OP_EQ, NULL);
+  tt_ptr_op(channel_tls_format_stats_history(tlschan), OP_EQ, NULL);
+
+  /* The first sample only sets the baseline. */
+  memset(&sample, 0, sizeof(sample));
+  chan->n_bytes_recved = 1000;
+  chan->n_cells_recved = 2;
+  channel_tls_stats_add_sample(tlschan->stats, chan, 5000, &sample, 3);
+  tt_ptr_op(channel_tls_get_last_sample(tlschan), OP_EQ, NULL);
+
+  /* Half a second later: 2000 bytes read, 5120 written, and two more
+   * segments retransmitted. */
+  chan->n_bytes_recved += 2000;
+  chan->n_cells_recved += 4;
+  chan->n_bytes_xmitted += 5120;
+  chan->n_cells_xmitted += 10;
+  sample.rtt_usec = 40000;
+  sample.outbuf_len = 512;
+  channel_tls_stats_add_sample(tlschan->stats, chan, 5500, &sample, 5);
+  last = channel_tls_get_last_sample(tlschan);
+  tt_assert(last);
+  tt_uint_op(last->msec, OP_EQ, 500);
+  tt_uint_op(last->bytes_read, OP_EQ, 2000);
+  tt_uint_op(last->bytes_written, OP_EQ, 5120);
+  tt_uint_op(last->cells_read, OP_EQ, 4);
+  tt_uint_op(last->cells_written, OP_EQ, 10);
+  tt_uint_op(last->retransmits, OP_EQ, 2);
+  tt_uint_op(last->rtt_usec, OP_EQ, 40000);
+
+  s = channel_tls_format_stats_history(tlschan);
+  tt_str_op(s, OP_EQ, "ChannelID=7 ReadRate=4000 WriteRate=10240 "
+            "OutbufLen=512 KernelOutq=0 RTT=40000 Retransmits=2");
+  tor_free(s);
+
+  /* The ring keeps only the newest samples, oldest first. */
+  for (i = 0; i < CHANNEL_TLS_N_STATS_SAMPLES; ++i) {
+    memset(&sample, 0, sizeof(sample));
+    sample.rtt_usec = i;
+    channel_tls_stats_add_sample(tlschan->stats, chan, 6000 + 1000*i,
+                                 &sample, 5);
+  }
+  tt_int_op(tlschan->stats->n, OP_EQ, CHANNEL_TLS_N_STATS_SAMPLES);
+  tt_uint_op(channel_tls_get_last_sample(tlschan)->rtt_usec, OP_EQ,
+             CHANNEL_TLS_N_STATS_SAMPLES - 1);
+  s = channel_tls_format_stats_history(tlschan);
+  tt_assert(strstr(s, " RTT=0,1,2,"));
+  tt_assert(strstr(s, " Retransmits=0"));
+
+ done:
+  tor_free(s);
+  channel_tls_free_stats(tlschan);
+  tor_free(tlschan);
+}
+
 struct testcase_t channeltls_tests[] = {
   { "create", test_channeltls_create, TT_FORK, NULL, NULL },
   { "num_bytes_queued", test_channeltls_num_bytes_queued,
     TT_FORK, NULL, NULL },
   { "overhead_estimate", test_channeltls_overhead_estimate,
     TT_FORK, NULL, NULL },
+  { "stats", test_channeltls_stats, TT_FORK, NULL, NULL },
   END_OF_TESTCASES
 };
 
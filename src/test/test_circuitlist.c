@@ -4,10 +4,14 @@
 #define TOR_CHANNEL_INTERNAL_
 #define CIRCUITBUILD_PRIVATE
 #define CIRCUITLIST_PRIVATE
+#define RELAY_PRIVATE
 #include "or.h"
 #include "channel.h"
 #include "circuitbuild.h"
 #include "circuitlist.h"
+#include "circuituse.h"
+#include "nodelist.h"
+#include "relay.h"
 #include "test.h"
 #include "log_test_helpers.h"
 
@@ -345,7 +349,12 @@ test_pick_circid(void *arg)
     bitarray_set(ba, circid);
     channel_mark_circid_unusable(chan1, circid);
   }
-  tt_int_op(i, OP_LT, (1<<15));
+  /* Once the space gets crowded we pick from the free IDs directly, so
+   * every last one gets used. */
+  tt_int_op(i, OP_EQ, (1<<15) - 1);
+  /* A freed ID is the only one we can pick. */
+  channel_mark_circid_usable(chan1, 1234);
+  tt_uint_op(get_unique_circ_id_by_chan(chan1), OP_EQ, 1234);
   /* Make sure that being full on chan1 does not interfere with chan2 */
   for (i = 0; i < 100; ++i) {
     circid = get_unique_circ_id_by_chan(chan2);
@@ -357,6 +366,8 @@ test_pick_circid(void *arg)
  done:
   circuitmux_free(chan1->cmux);
   circuitmux_free(chan2->cmux);
+  channel_clear_circid_map(chan1);
+  channel_clear_circid_map(chan2);
   tor_free(chan1);
   tor_free(chan2);
   bitarray_free(ba);
@@ -365,10 +376,381 @@ test_pick_circid(void *arg)
   UNMOCK(channel_dump_statistics);
 }
 
+static void
+test_clist_circid_table(void *arg)
+{
+  channel_t *ch1 = new_fake_channel();
+  channel_t *ch2 = new_fake_channel();
+  or_circuit_t *or_c1 = NULL;
+  circid_t id;
+  int i;
+
+  (void) arg;
+
+  MOCK(circuitmux_attach_circuit, circuitmux_attach_mock);
+  MOCK(circuitmux_detach_circuit, circuitmux_detach_mock);
+  ch1->cmux = tor_malloc(1);
+  ch2->cmux = tor_malloc(1);
+
+  /* Fill both channels with reserved IDs, using strided IDs on ch1 so that
+   * the probe runs get long and wrap around. */
+  for (i = 1; i <= 300; ++i) {
+    channel_mark_circid_unusable(ch1, i * 1024);
+    channel_mark_circid_unusable(ch2, i);
+  }
+  tt_uint_op(ch1->circid_table_n, OP_EQ, 300);
+  tt_uint_op(ch2->circid_table_n, OP_EQ, 300);
+  tt_uint_op(1u << ch1->circid_table_bits, OP_GE, 600);
+  for (i = 1; i <= 300; ++i) {
+    tt_int_op(circuit_id_in_use_on_channel(i * 1024, ch1), OP_EQ, 2);
+    tt_int_op(circuit_id_in_use_on_channel(i, ch2), OP_EQ, 2);
+  }
+  tt_int_op(circuit_id_in_use_on_channel(1024, ch2), OP_EQ, 0);
+  tt_int_op(circuit_id_in_use_on_channel(301, ch2), OP_EQ, 0);
+
+  /* A circuit can take over a reserved ID, and keeps its own entry. */
+  or_c1 = or_circuit_new(7, ch2);
+  tt_uint_op(ch2->circid_table_n, OP_EQ, 300);
+  tt_ptr_op(circuit_get_by_circid_channel(7, ch2), OP_EQ, TO_CIRCUIT(or_c1));
+  circuit_set_n_circid_chan(TO_CIRCUIT(or_c1), 5 * 1024, ch1);
+  tt_ptr_op(circuit_get_by_circid_channel(5 * 1024, ch1), OP_EQ,
+            TO_CIRCUIT(or_c1));
+
+  /* Removing every other entry must leave the rest reachable. */
+  for (i = 2; i <= 300; i += 2) {
+    channel_mark_circid_usable(ch1, i * 1024);
+    channel_mark_circid_usable(ch2, i);
+  }
+  for (i = 1; i <= 300; ++i) {
+    id = i * 1024;
+    if (i == 5) {
+      tt_int_op(circuit_id_in_use_on_channel(id, ch1), OP_EQ, 1);
+    } else {
+      tt_int_op(circuit_id_in_use_on_channel(id, ch1), OP_EQ,
+                (i & 1) ? 2 : 0);
+    }
+  }
+  tt_ptr_op(circuit_get_by_circid_channel(7, ch2), OP_EQ, TO_CIRCUIT(or_c1));
+  tt_uint_op(ch1->circid_table_n, OP_EQ, 150);
+
+  /* The table shrinks as it empties, and goes away when it is empty. */
+  circuit_free(TO_CIRCUIT(or_c1));
+  or_c1 = NULL;
+  for (i = 1; i <= 300; i += 2)
+    channel_mark_circid_usable(ch1, i * 1024);
+  tt_uint_op(ch1->circid_table_n, OP_EQ, 0);
+  tt_ptr_op(ch1->circid_table, OP_EQ, NULL);
+  tt_int_op(circuit_id_in_use_on_channel(1024, ch1), OP_EQ, 0);
+
+  /* Freeing a channel drops whatever it still had reserved. */
+  channel_clear_circid_map(ch2);
+  tt_ptr_op(ch2->circid_table, OP_EQ, NULL);
+  tt_int_op(circuit_id_in_use_on_channel(1, ch2), OP_EQ, 0);
+
+ done:
+  if (or_c1)
+    circuit_free(TO_CIRCUIT(or_c1));
+  channel_clear_circid_map(ch1);
+  channel_clear_circid_map(ch2);
+  tor_free(ch1->cmux);
+  tor_free(ch2->cmux);
+  tor_free(ch1);
+  tor_free(ch2);
+  UNMOCK(circuitmux_attach_circuit);
+  UNMOCK(circuitmux_detach_circuit);
+}
+
+/** Helper: make an open general-purpose circuit with <b>flags</b> and
+ * <b>path_len</b> hops planned, ready to be cannibalized. */
+static origin_circuit_t *
+new_open_general_circ(int flags, int path_len)
+{
+  origin_circuit_t *circ = origin_circuit_init(CIRCUIT_PURPOSE_C_GENERAL,
+                                               flags);
+  circ->build_state->desired_path_len = path_len;
+  circ->remaining_relay_early_cells = MAX_RELAY_EARLY_CELLS_PER_CIRCUIT;
+  circuit_set_state(TO_CIRCUIT(circ), CIRCUIT_STATE_OPEN);
+  return circ;
+}
+
+static void
+test_clist_find_stem(void *arg)
+{
+  origin_circuit_t *internal = NULL, *stem = NULL, *found;
+  int stem_flags = CIRCLAUNCH_NEED_CAPACITY|CIRCLAUNCH_IS_STEM;
+  (void) arg;
+
+  internal = new_open_general_circ(
+                  CIRCLAUNCH_NEED_CAPACITY|CIRCLAUNCH_IS_INTERNAL, 3);
+  tt_ptr_op(circuit_find_to_cannibalize(CIRCUIT_PURPOSE_C_GENERAL, NULL,
+                                        stem_flags), OP_EQ, NULL);
+
+  stem = new_open_general_circ(stem_flags, 2);
+  tt_assert(stem->build_state->is_stem);
+  tt_assert(stem->build_state->is_internal);
+
+  /* Stems are found only when we ask for them... */
+  found = circuit_find_to_cannibalize(CIRCUIT_PURPOSE_C_GENERAL, NULL,
+                                      stem_flags);
+  tt_ptr_op(found, OP_EQ, stem);
+  /* ...and never handed out as ordinary internal circuits. */
+  found = circuit_find_to_cannibalize(CIRCUIT_PURPOSE_C_GENERAL, NULL,
+                         CIRCLAUNCH_NEED_CAPACITY|CIRCLAUNCH_IS_INTERNAL);
+  tt_ptr_op(found, OP_EQ, internal);
+
+  /* A stem we have started using is no longer available. */
+  TO_CIRCUIT(stem)->timestamp_dirty = time(NULL);
+  tt_ptr_op(circuit_find_to_cannibalize(CIRCUIT_PURPOSE_C_GENERAL, NULL,
+                                        stem_flags), OP_EQ, NULL);
+
+ done:
+  circuit_free(TO_CIRCUIT(internal));
+  circuit_free(TO_CIRCUIT(stem));
+}
+
+static void
+test_circuit_mem_usage(void *arg)
+{
+  or_circuit_t *or_c = NULL;
+  origin_circuit_t *origin_c = NULL;
+  (void) arg;
+
+  /* A fresh OR circuit is just its struct. */
+  or_c = or_circuit_new(0, NULL);
+  tt_u64_op(circuit_struct_mem_usage(TO_CIRCUIT(or_c)), OP_EQ,
+            sizeof(or_circuit_t));
+
+  /* Extension blocks are counted once they exist. */
+  or_c->buffer_stats = tor_malloc_zero(sizeof(or_circuit_buffer_stats_t));
+  tt_u64_op(circuit_struct_mem_usage(TO_CIRCUIT(or_c)), OP_EQ,
+            sizeof(or_circuit_t) + sizeof(or_circuit_buffer_stats_t));
+
+  /* So is an origin circuit's path. */
+  origin_c = origin_circuit_new();
+  origin_c->base_.purpose = CIRCUIT_PURPOSE_C_GENERAL;
+  tt_u64_op(circuit_struct_mem_usage(TO_CIRCUIT(origin_c)), OP_EQ,
+            sizeof(origin_circuit_t));
+  origin_c->build_state = tor_malloc_zero(sizeof(cpath_build_state_t));
+  onion_append_to_cpath(&origin_c->cpath,
+                        tor_malloc_zero(sizeof(crypt_path_t)));
+  onion_append_to_cpath(&origin_c->cpath,
+                        tor_malloc_zero(sizeof(crypt_path_t)));
+  tt_u64_op(circuit_struct_mem_usage(TO_CIRCUIT(origin_c)), OP_EQ,
+            sizeof(origin_circuit_t) + sizeof(cpath_build_state_t) +
+            2 * sizeof(crypt_path_t));
+
+ done:
+  circuit_free(TO_CIRCUIT(or_c));
+  circuit_free(TO_CIRCUIT(origin_c));
+}
+
+static void
+test_clist_purpose_index(void *arg)
+{
+  origin_circuit_t *c1 = NULL, *c2 = NULL, *c3 = NULL;
+  const smartlist_t *general, *joined;
+  (void) arg;
+
+  general = circuit_get_client_circuits_by_purpose(CIRCUIT_PURPOSE_C_GENERAL);
+  joined = circuit_get_client_circuits_by_purpose(
+                                            CIRCUIT_PURPOSE_C_REND_JOINED);
+  tt_int_op(smartlist_len(general), OP_EQ, 0);
+
+  c1 = origin_circuit_init(CIRCUIT_PURPOSE_C_GENERAL, 0);
+  c2 = origin_circuit_init(CIRCUIT_PURPOSE_C_GENERAL, 0);
+  c3 = origin_circuit_init(CIRCUIT_PURPOSE_C_ESTABLISH_REND, 0);
+  tt_int_op(smartlist_len(general), OP_EQ, 2);
+  tt_assert(smartlist_contains(general, c1));
+  tt_assert(smartlist_contains(general, c2));
+  tt_int_op(smartlist_len(joined), OP_EQ, 0);
+
+  /* Changing the purpose moves the circuit between lists. */
+  circuit_change_purpose(TO_CIRCUIT(c3), CIRCUIT_PURPOSE_C_REND_JOINED);
+  tt_int_op(smartlist_len(joined), OP_EQ, 1);
+  tt_ptr_op(smartlist_get(joined, 0), OP_EQ, c3);
+  circuit_change_purpose(TO_CIRCUIT(c1), CIRCUIT_PURPOSE_C_REND_JOINED);
+  tt_int_op(smartlist_len(general), OP_EQ, 1);
+  tt_ptr_op(smartlist_get(general, 0), OP_EQ, c2);
+  tt_int_op(c2->purpose_list_idx, OP_EQ, 0);
+  tt_int_op(smartlist_len(joined), OP_EQ, 2);
+
+  /* Non-client purposes aren't indexed. */
+  circuit_change_purpose(TO_CIRCUIT(c2), CIRCUIT_PURPOSE_S_CONNECT_REND);
+  tt_int_op(smartlist_len(general), OP_EQ, 0);
+  tt_int_op(c2->purpose_list_idx, OP_EQ, -1);
+
+  /* Freeing a circuit takes it out, and keeps the others' indices right. */
+  circuit_free(TO_CIRCUIT(c3));
+  c3 = NULL;
+  tt_int_op(smartlist_len(joined), OP_EQ, 1);
+  tt_ptr_op(smartlist_get(joined, 0), OP_EQ, c1);
+  tt_int_op(c1->purpose_list_idx, OP_EQ, 0);
+
+ done:
+  circuit_free(TO_CIRCUIT(c1));
+  circuit_free(TO_CIRCUIT(c2));
+  circuit_free(TO_CIRCUIT(c3));
+}
+
+static void
+test_clist_deferred_free(void *arg)
+{
+  or_circuit_t *circs[40];
+  const size_t cost = packed_cell_mem_cost();
+  int i;
+  (void) arg;
+
+  for (i = 0; i < 40; ++i) {
+    circs[i] = or_circuit_new(0, NULL);
+    circs[i]->base_.purpose = CIRCUIT_PURPOSE_OR;
+    cell_queue_append(&circs[i]->base_.n_chan_cells, packed_cell_new());
+    cell_queue_append(&circs[i]->p_chan_cells, packed_cell_new());
+  }
+  tt_int_op(smartlist_len(circuit_get_global_list()), OP_EQ, 40);
+  packed_cell_freelist_clear();
+
+  for (i = 0; i < 40; ++i)
+    circuit_mark_for_close(TO_CIRCUIT(circs[i]), END_CIRC_REASON_NONE);
+  circuit_close_all_marked();
+
+  /* They're gone from the circuit list at once... */
+  tt_int_op(smartlist_len(circuit_get_global_list()), OP_EQ, 0);
+
+  /* ...but without an event loop, we have to release them at once too. */
+  if (!tor_libevent_get_base()) {
+    tt_u64_op(packed_cell_freelist_clear(), OP_EQ, 80 * cost);
+    goto done;
+  }
+
+  /* With one, we release their cells as time allows: at least a batch of
+   * circuits each time. */
+  tt_u64_op(packed_cell_freelist_clear(), OP_EQ, 0);
+  circuit_reap_unlinked(0);
+  tt_u64_op(packed_cell_freelist_clear(), OP_EQ, 32 * cost);
+  circuit_reap_unlinked(-1);
+  tt_u64_op(packed_cell_freelist_clear(), OP_EQ, 48 * cost);
+
+ done:
+  ;
+}
+
+static void
+test_clist_pending_index(void *arg)
+{
+  or_circuit_t *c1 = NULL, *c2 = NULL;
+  channel_t *chan = NULL;
+  smartlist_t *found = smartlist_new();
+  tor_addr_t addr;
+  char id_a[DIGEST_LEN], id_b[DIGEST_LEN];
+  (void) arg;
+
+  memset(id_a, 'A', DIGEST_LEN);
+  memset(id_b, 'B', DIGEST_LEN);
+  tor_addr_parse(&addr, "127.0.0.1");
+  chan = new_fake_channel();
+  memcpy(chan->identity_digest, id_a, DIGEST_LEN);
+
+  c1 = or_circuit_new(0, NULL);
+  c2 = or_circuit_new(0, NULL);
+  circuit_set_n_hop(TO_CIRCUIT(c1),
+                    extend_info_new(NULL, id_a, NULL, NULL, &addr, 9001));
+  circuit_set_n_hop(TO_CIRCUIT(c2),
+                    extend_info_new(NULL, id_b, NULL, NULL, &addr, 9002));
+  circuit_set_state(TO_CIRCUIT(c1), CIRCUIT_STATE_CHAN_WAIT);
+  circuit_set_state(TO_CIRCUIT(c2), CIRCUIT_STATE_CHAN_WAIT);
+
+  /* Only the circuit waiting for the channel's identity is found. */
+  circuit_get_all_pending_on_channel(found, chan);
+  tt_int_op(smartlist_len(found), OP_EQ, 1);
+  tt_ptr_op(smartlist_get(found, 0), OP_EQ, c1);
+  smartlist_clear(found);
+
+  /* Changing a waiting circuit's next hop moves it to the new identity. */
+  circuit_set_n_hop(TO_CIRCUIT(c2),
+                    extend_info_new(NULL, id_a, NULL, NULL, &addr, 9001));
+  tt_int_op(circuit_count_pending_on_channel(chan), OP_EQ, 2);
+  circuit_set_n_hop(TO_CIRCUIT(c1), NULL);
+  circuit_get_all_pending_on_channel(found, chan);
+  tt_int_op(smartlist_len(found), OP_EQ, 1);
+  tt_ptr_op(smartlist_get(found, 0), OP_EQ, c2);
+  smartlist_clear(found);
+
+  /* Leaving CHAN_WAIT takes a circuit out of the index. */
+  circuit_set_n_hop(TO_CIRCUIT(c2), NULL);
+  circuit_set_state(TO_CIRCUIT(c1), CIRCUIT_STATE_OPEN);
+  circuit_set_state(TO_CIRCUIT(c2), CIRCUIT_STATE_OPEN);
+  tt_int_op(circuit_count_pending_on_channel(chan), OP_EQ, 0);
+
+ done:
+  circuit_free(TO_CIRCUIT(c1));
+  circuit_free(TO_CIRCUIT(c2));
+  smartlist_free(found);
+  tor_free(chan);
+}
+
+static void
+test_clist_controller_path(void *arg)
+{
+  origin_circuit_t *circ = NULL;
+  crypt_path_t *hop;
+  routerinfo_t *ri = NULL;
+  tor_addr_t addr;
+  char id[DIGEST_LEN], hexid[HEX_DIGEST_LEN+1], *expected = NULL;
+  const char *path;
+  (void) arg;
+
+  memset(id, 'Z', DIGEST_LEN);
+  base16_encode(hexid, sizeof(hexid), id, DIGEST_LEN);
+  tor_addr_parse(&addr, "127.0.0.1");
+  circ = origin_circuit_new();
+  circ->base_.purpose = CIRCUIT_PURPOSE_C_GENERAL;
+  hop = tor_malloc_zero(sizeof(crypt_path_t));
+  hop->magic = CRYPT_PATH_MAGIC;
+  hop->extend_info = extend_info_new("bob", id, NULL, NULL, &addr, 9001);
+  onion_append_to_cpath(&circ->cpath, hop);
+
+  /* Hops that aren't open yet aren't listed. */
+  tt_str_op(circuit_get_path_for_controller(circ), OP_EQ, "");
+
+  /* Once the cache is made, we hand out the same string each time. */
+  hop->state = CPATH_STATE_OPEN;
+  circuit_clear_path_for_controller(circ);
+  path = circuit_get_path_for_controller(circ);
+  tor_asprintf(&expected, "$%s~bob", hexid);
+  tt_str_op(path, OP_EQ, expected);
+  tt_ptr_op(circuit_get_path_for_controller(circ), OP_EQ, path);
+  tor_free(expected);
+
+  /* When the nodelist learns a new name, we make the string again. */
+  ri = tor_malloc_zero(sizeof(routerinfo_t));
+  memcpy(ri->cache_info.identity_digest, id, DIGEST_LEN);
+  ri->nickname = tor_strdup("alice");
+  nodelist_set_routerinfo(ri, NULL);
+  tor_asprintf(&expected, "$%s~alice", hexid);
+  tt_str_op(circuit_get_path_for_controller(circ), OP_EQ, expected);
+
+ done:
+  if (ri) {
+    nodelist_remove_routerinfo(ri);
+    tor_free(ri->nickname);
+    tor_free(ri);
+  }
+  nodelist_free_all();
+  circuit_free(TO_CIRCUIT(circ));
+  tor_free(expected);
+}
+
 struct testcase_t circuitlist_tests[] = {
   { "maps", test_clist_maps, TT_FORK, NULL, NULL },
   { "rend_token_maps", test_rend_token_maps, TT_FORK, NULL, NULL },
   { "pick_circid", test_pick_circid, TT_FORK, NULL, NULL },
+  { "circid_table", test_clist_circid_table, TT_FORK, NULL, NULL },
+  { "find_stem", test_clist_find_stem, TT_FORK, NULL, NULL },
+  { "purpose_index", test_clist_purpose_index, TT_FORK, NULL, NULL },
+  { "mem_usage", test_circuit_mem_usage, TT_FORK, NULL, NULL },
+  { "deferred_free", test_clist_deferred_free, TT_FORK, NULL, NULL },
+  { "pending_index", test_clist_pending_index, TT_FORK, NULL, NULL },
+  { "controller_path", test_clist_controller_path, TT_FORK, NULL, NULL },
   END_OF_TESTCASES
 };
 
@@ -1,12 +1,21 @@
 /* Copyright (c) 2013-2016, The Tor Project, Inc. */
 /* See LICENSE for licensing information */
 
+#include <float.h>
+#include <math.h>
+
 #define TOR_CHANNEL_INTERNAL_
 #define CIRCUITMUX_PRIVATE
 #define RELAY_PRIVATE
+#define TOR_CIRCUITMUX_EWMA_C_
+#define TOR_CIRCUITMUX_WFQ_C_
+#define CIRCUITLIST_PRIVATE
 #include "or.h"
 #include "channel.h"
+#include "circuitlist.h"
 #include "circuitmux.h"
+#include "circuitmux_ewma.h"
+#include "circuitmux_wfq.h"
 #include "relay.h"
 #include "scheduler.h"
 #include "test.h"
@@ -77,8 +86,555 @@ test_cmux_destroy_cell_queue(void *arg)
   packed_cell_free(pc);
 }
 
+/** Check that destroy cells get a share of the channel in proportion to how
+ * many of them are waiting. */
+static void
+test_cmux_destroy_cell_burst(void *arg)
+{
+  circuitmux_t *cmux = NULL;
+  channel_t *ch = NULL;
+  circuit_t *circ = NULL, *picked;
+  cell_queue_t *cq = NULL;
+  packed_cell_t *pc;
+  int i, n_destroys;
+
+  (void) arg;
+
+  scheduler_init();
+
+  cmux = circuitmux_alloc();
+  ch = new_fake_channel();
+  ch->has_queued_writes = has_queued_writes;
+  ch->wide_circ_ids = 1;
+
+  circ = TO_CIRCUIT(or_circuit_new(0, NULL));
+  circ->n_chan = ch;
+  circ->n_circ_id = 5;
+  circuitmux_attach_circuit(cmux, circ, CELL_DIRECTION_OUT);
+  circuitmux_set_num_cells(cmux, circ, 10);
+
+  /* With a single destroy waiting, it gets one turn, as before. */
+  circuitmux_append_destroy_cell(ch, cmux, 100, 1);
+  tt_int_op(circuitmux_destroy_burst_limit(cmux), OP_EQ, 1);
+  picked = circuitmux_get_first_active_circuit(cmux, &cq);
+  tt_ptr_op(picked, OP_EQ, NULL);
+  tt_ptr_op(cq, OP_NE, NULL);
+  packed_cell_free(cell_queue_pop(cq));
+  circuitmux_notify_xmit_destroy(cmux);
+  tt_ptr_op(circuitmux_get_first_active_circuit(cmux, &cq), OP_EQ, circ);
+
+  /* With 110 destroys against 10 other cells, they go ten at a time. */
+  for (i = 0; i < 110; ++i)
+    circuitmux_append_destroy_cell(ch, cmux, 1000 + i, 1);
+  tt_int_op(circuitmux_destroy_burst_limit(cmux), OP_EQ, 11);
+  n_destroys = 0;
+  for (;;) {
+    picked = circuitmux_get_first_active_circuit(cmux, &cq);
+    if (picked)
+      break;
+    tt_ptr_op(cq, OP_NE, NULL);
+    pc = cell_queue_pop(cq);
+    packed_cell_free(pc);
+    circuitmux_notify_xmit_destroy(cmux);
+    ++n_destroys;
+  }
+  tt_ptr_op(picked, OP_EQ, circ);
+  tt_int_op(n_destroys, OP_EQ, 10);
+
+  /* However many there are, a burst is capped. */
+  for (i = 0; i < 5000; ++i)
+    circuitmux_append_destroy_cell(ch, cmux, 2000 + i, 1);
+  tt_int_op(circuitmux_destroy_burst_limit(cmux), OP_EQ, 64);
+
+ done:
+  circuitmux_detach_all_circuits(cmux, NULL);
+  circuitmux_free(cmux);
+  if (circ) {
+    circ->n_chan = NULL;
+    circuit_free(circ);
+  }
+  channel_free(ch);
+}
+
+static int n_primes = 0;
+
+static int
+no_queued_writes(channel_t *c)
+{
+  (void) c;
+  return 0;
+}
+
+static int
+mock_channel_flush_from_first_active_circuit(channel_t *chan, int max)
+{
+  (void) chan;
+  (void) max;
+  ++n_primes;
+  return 0;
+}
+
+/** Check that a destroy batch primes each channel once, at its end. */
+static void
+test_cmux_destroy_cell_batch(void *arg)
+{
+  channel_t *ch1 = NULL, *ch2 = NULL;
+  int i;
+
+  (void) arg;
+
+  scheduler_init();
+  MOCK(channel_flush_from_first_active_circuit,
+       mock_channel_flush_from_first_active_circuit);
+
+  ch1 = new_fake_channel();
+  ch2 = new_fake_channel();
+  ch1->state = ch2->state = CHANNEL_STATE_OPENING;
+  ch1->has_queued_writes = ch2->has_queued_writes = no_queued_writes;
+  ch1->cmux = circuitmux_alloc();
+  ch2->cmux = circuitmux_alloc();
+  channel_register(ch1);
+  channel_register(ch2);
+
+  /* Outside a batch, every destroy primes the channel. */
+  circuitmux_append_destroy_cell(ch1, ch1->cmux, 10, 1);
+  circuitmux_append_destroy_cell(ch1, ch1->cmux, 11, 1);
+  tt_int_op(n_primes, OP_EQ, 2);
+
+  n_primes = 0;
+  circuitmux_destroy_batch_begin();
+  for (i = 0; i < 100; ++i) {
+    circuitmux_append_destroy_cell(ch1, ch1->cmux, 100 + i, 1);
+    circuitmux_append_destroy_cell(ch2, ch2->cmux, 100 + i, 1);
+  }
+  /* Batches nest. */
+  circuitmux_destroy_batch_begin();
+  circuitmux_append_destroy_cell(ch2, ch2->cmux, 99, 1);
+  circuitmux_destroy_batch_end();
+  tt_int_op(n_primes, OP_EQ, 0);
+  circuitmux_destroy_batch_end();
+  tt_int_op(n_primes, OP_EQ, 2);
+  tt_int_op(circuitmux_num_cells(ch1->cmux), OP_EQ, 102);
+  tt_int_op(circuitmux_num_cells(ch2->cmux), OP_EQ, 101);
+
+  /* A channel that is closing by the end of the batch isn't primed. */
+  n_primes = 0;
+  circuitmux_destroy_batch_begin();
+  circuitmux_append_destroy_cell(ch1, ch1->cmux, 500, 1);
+  circuitmux_append_destroy_cell(ch2, ch2->cmux, 500, 1);
+  ch2->state = CHANNEL_STATE_CLOSING;
+  circuitmux_destroy_batch_end();
+  tt_int_op(n_primes, OP_EQ, 1);
+
+ done:
+  UNMOCK(channel_flush_from_first_active_circuit);
+  if (ch1) {
+    channel_unregister(ch1);
+    ch1->state = CHANNEL_STATE_CLOSED;
+    channel_free(ch1);
+  }
+  if (ch2) {
+    ch2->state = CHANNEL_STATE_OPENING;
+    channel_unregister(ch2);
+    ch2->state = CHANNEL_STATE_CLOSED;
+    channel_free(ch2);
+  }
+}
+
+static void
+test_cmux_ewma_log_add(void *arg)
+{
+  (void) arg;
+
+  tt_double_op(fabs(cell_ewma_log_add(log(2.0), log(3.0)) - log(5.0)),
+               OP_LT, 1e-9);
+  /* Adding nothing */
+  tt_double_op(fabs(cell_ewma_log_add(-DBL_MAX, 7.0) - 7.0), OP_LT, 1e-9);
+  tt_double_op(fabs(cell_ewma_log_add(7.0, -DBL_MAX) - 7.0), OP_LT, 1e-9);
+  tt_double_op(cell_ewma_log_add(-DBL_MAX, -DBL_MAX), OP_LT, -1e300);
+  /* Big enough that exp() would overflow */
+  tt_double_op(fabs(cell_ewma_log_add(1000.0, 1000.0) - (1000.0 + log(2.0))),
+               OP_LT, 1e-9);
+
+ done:
+  ;
+}
+
+#define N_EWMA_CIRCS 100
+
+/** Return the index in <b>circs</b> of the circuit that <b>pol_data</b>
+ * would send on next, or -1 if there is none. */
+static int
+ewma_pick_idx(circuitmux_t *cmux, circuitmux_policy_data_t *pol_data,
+              circuit_t **circs)
+{
+  circuit_t *circ = ewma_policy.pick_active_circuit(cmux, pol_data);
+  int i;
+  for (i = 0; i < N_EWMA_CIRCS; ++i) {
+    if (circs[i] == circ)
+      return i;
+  }
+  return -1;
+}
+
+/** Check that the EWMA policy always sends on the active circuit that has
+ * sent the fewest cells, while we activate, deactivate, and send on
+ * circuits. */
+static void
+test_cmux_ewma_pick(void *arg)
+{
+  circuitmux_t *cmux = NULL;
+  circuitmux_policy_data_t *pol_data = NULL;
+  circuitmux_policy_circ_data_t *cdata[N_EWMA_CIRCS];
+  circuit_t *circs[N_EWMA_CIRCS];
+  int sent[N_EWMA_CIRCS], active[N_EWMA_CIRCS];
+  or_options_t *options = NULL;
+  struct timeval now;
+  int i, j, pick;
+
+  (void) arg;
+
+  memset(cdata, 0, sizeof(cdata));
+  memset(circs, 0, sizeof(circs));
+
+  /* Stop the clock, so that every cell has the same weight. */
+  tor_gettimeofday(&now);
+  tor_gettimeofday_cache_set(&now);
+
+  cmux = circuitmux_alloc();
+  pol_data = ewma_policy.alloc_cmux_data(cmux);
+  for (i = 0; i < N_EWMA_CIRCS; ++i) {
+    circs[i] = tor_malloc_zero(sizeof(circuit_t));
+    cdata[i] = ewma_policy.alloc_circ_data(cmux, pol_data, circs[i],
+                                           CELL_DIRECTION_OUT, 0);
+    ewma_policy.notify_circ_active(cmux, pol_data, circs[i], cdata[i]);
+    sent[i] = 0;
+    active[i] = 1;
+  }
+
+  for (j = 0; j < 2000; ++j) {
+    pick = ewma_pick_idx(cmux, pol_data, circs);
+    tt_int_op(pick, OP_GE, 0);
+    tt_assert(active[pick]);
+    for (i = 0; i < N_EWMA_CIRCS; ++i) {
+      if (active[i])
+        tt_int_op(sent[pick], OP_LE, sent[i]);
+    }
+
+    ewma_policy.notify_xmit_cells(cmux, pol_data, circs[pick], cdata[pick],
+                                  (pick % 7) + 1);
+    sent[pick] += (pick % 7) + 1;
+
+    /* Now and then, flip a circuit other than the one we just picked. */
+    if (j % 13 == 0) {
+      i = (pick * 31 + j) % N_EWMA_CIRCS;
+      if (active[i])
+        ewma_policy.notify_circ_inactive(cmux, pol_data, circs[i], cdata[i]);
+      else
+        ewma_policy.notify_circ_active(cmux, pol_data, circs[i], cdata[i]);
+      active[i] = !active[i];
+    }
+  }
+
+  /* Changing the scale factor mustn't change which circuit is best. */
+  pick = ewma_pick_idx(cmux, pol_data, circs);
+  options = tor_malloc_zero(sizeof(or_options_t));
+  options->CircuitPriorityHalflife = 30.0;
+  cell_ewma_set_scale_factor(options, NULL);
+  tt_assert(cell_ewma_enabled());
+  tt_int_op(ewma_pick_idx(cmux, pol_data, circs), OP_EQ, pick);
+  ewma_policy.notify_xmit_cells(cmux, pol_data, circs[pick], cdata[pick], 1);
+  sent[pick] += 1;
+  pick = ewma_pick_idx(cmux, pol_data, circs);
+  for (i = 0; i < N_EWMA_CIRCS; ++i) {
+    if (active[i])
+      tt_int_op(sent[pick], OP_LE, sent[i]);
+  }
+
+ done:
+  for (i = 0; i < N_EWMA_CIRCS; ++i) {
+    if (!cdata[i])
+      continue;
+    if (active[i])
+      ewma_policy.notify_circ_inactive(cmux, pol_data, circs[i], cdata[i]);
+    ewma_policy.free_circ_data(cmux, pol_data, circs[i], cdata[i]);
+    tor_free(circs[i]);
+  }
+  if (pol_data)
+    ewma_policy.free_cmux_data(cmux, pol_data);
+  circuitmux_free(cmux);
+  tor_free(options);
+}
+
+/** Check that a circuit that was idle through several changes to the
+ * scale factor still compares correctly with one that was active
+ * throughout. */
+static void
+test_cmux_ewma_rescale(void *arg)
+{
+  circuitmux_t *cmux = NULL;
+  circuitmux_policy_data_t *pol_data = NULL;
+  circuitmux_policy_circ_data_t *cdata[N_EWMA_CIRCS];
+  circuit_t *circs[N_EWMA_CIRCS];
+  or_options_t *options = NULL;
+  struct timeval now;
+  int i;
+  /* Circuit 0 stays active; 1 and 2 go idle, having sent a little more
+   * and a little less than 0; 3 is only there to make the policy rescale
+   * its active circuits. */
+  const int n_sent[3] = { 10, 11, 9 };
+
+  (void) arg;
+
+  memset(cdata, 0, sizeof(cdata));
+  memset(circs, 0, sizeof(circs));
+  options = tor_malloc_zero(sizeof(or_options_t));
+
+  tor_gettimeofday(&now);
+  tor_gettimeofday_cache_set(&now);
+  options->CircuitPriorityHalflife = 30.0;
+  cell_ewma_set_scale_factor(options, NULL);
+
+  cmux = circuitmux_alloc();
+  pol_data = ewma_policy.alloc_cmux_data(cmux);
+  for (i = 0; i < 4; ++i) {
+    circs[i] = tor_malloc_zero(sizeof(circuit_t));
+    cdata[i] = ewma_policy.alloc_circ_data(cmux, pol_data, circs[i],
+                                           CELL_DIRECTION_OUT, 0);
+  }
+  for (i = 0; i < 3; ++i) {
+    ewma_policy.notify_circ_active(cmux, pol_data, circs[i], cdata[i]);
+    ewma_policy.notify_xmit_cells(cmux, pol_data, circs[i], cdata[i],
+                                  n_sent[i]);
+  }
+  ewma_policy.notify_circ_inactive(cmux, pol_data, circs[1], cdata[1]);
+  ewma_policy.notify_circ_inactive(cmux, pol_data, circs[2], cdata[2]);
+
+  /* Change the halflife twice, at different times, bringing circuit 0 up
+   * to date after each change. */
+  for (i = 0; i < 2; ++i) {
+    now.tv_sec += 100;
+    tor_gettimeofday_cache_set(&now);
+    options->CircuitPriorityHalflife = i ? 30.0 : 1.0;
+    cell_ewma_set_scale_factor(options, NULL);
+    ewma_policy.notify_circ_active(cmux, pol_data, circs[3], cdata[3]);
+    ewma_policy.notify_circ_inactive(cmux, pol_data, circs[3], cdata[3]);
+  }
+
+  /* All their cells were sent at the same time, so the idle circuits must
+   * compare with circuit 0 just as their cell counts do. */
+  ewma_policy.notify_circ_active(cmux, pol_data, circs[1], cdata[1]);
+  tt_int_op(ewma_pick_idx(cmux, pol_data, circs), OP_EQ, 0);
+  ewma_policy.notify_circ_inactive(cmux, pol_data, circs[1], cdata[1]);
+  ewma_policy.notify_circ_active(cmux, pol_data, circs[2], cdata[2]);
+  tt_int_op(ewma_pick_idx(cmux, pol_data, circs), OP_EQ, 2);
+  ewma_policy.notify_circ_inactive(cmux, pol_data, circs[2], cdata[2]);
+
+ done:
+  if (cdata[0])
+    ewma_policy.notify_circ_inactive(cmux, pol_data, circs[0], cdata[0]);
+  for (i = 0; i < 4; ++i) {
+    if (cdata[i])
+      ewma_policy.free_circ_data(cmux, pol_data, circs[i], cdata[i]);
+    tor_free(circs[i]);
+  }
+  if (pol_data)
+    ewma_policy.free_cmux_data(cmux, pol_data);
+  circuitmux_free(cmux);
+  tor_free(options);
+}
+
+/** Check that circuits fall into the right traffic classes, and that
+ * CircuitPriorityWeights values parse. */
+static void
+test_cmux_wfq_classify(void *arg)
+{
+  origin_circuit_t *ocirc = NULL;
+  or_circuit_t *orcirc = NULL;
+  uint32_t weights[CMUX_WFQ_N_CLASSES];
+  char *msg = NULL;
+
+  (void) arg;
+
+  ocirc = origin_circuit_new();
+  ocirc->base_.purpose = CIRCUIT_PURPOSE_C_GENERAL;
+  tt_int_op(cell_wfq_classify_circuit(TO_CIRCUIT(ocirc)), OP_EQ,
+            CMUX_WFQ_CLASS_GENERAL);
+  ocirc->build_state = tor_malloc_zero(sizeof(cpath_build_state_t));
+  ocirc->build_state->onehop_tunnel = 1;
+  tt_int_op(cell_wfq_classify_circuit(TO_CIRCUIT(ocirc)), OP_EQ,
+            CMUX_WFQ_CLASS_DIR);
+  ocirc->base_.purpose = CIRCUIT_PURPOSE_S_REND_JOINED;
+  tt_int_op(cell_wfq_classify_circuit(TO_CIRCUIT(ocirc)), OP_EQ,
+            CMUX_WFQ_CLASS_ONION);
+
+  orcirc = or_circuit_new(0, NULL);
+  tt_int_op(cell_wfq_classify_circuit(TO_CIRCUIT(orcirc)), OP_EQ,
+            CMUX_WFQ_CLASS_GENERAL);
+  orcirc->base_.purpose = CIRCUIT_PURPOSE_REND_ESTABLISHED;
+  tt_int_op(cell_wfq_classify_circuit(TO_CIRCUIT(orcirc)), OP_EQ,
+            CMUX_WFQ_CLASS_ONION);
+
+  tt_int_op(cell_wfq_parse_weights("dir=8, onion=4", weights, &msg),
+            OP_EQ, 0);
+  tt_int_op(weights[CMUX_WFQ_CLASS_DIR], OP_EQ, 8);
+  tt_int_op(weights[CMUX_WFQ_CLASS_ONION], OP_EQ, 4);
+  tt_int_op(weights[CMUX_WFQ_CLASS_GENERAL], OP_EQ, 1);
+  tt_int_op(cell_wfq_parse_weights("exit=3", NULL, &msg), OP_EQ, -1);
+  tt_assert(msg);
+  tor_free(msg);
+  tt_int_op(cell_wfq_parse_weights("dir=0", NULL, &msg), OP_EQ, -1);
+  tor_free(msg);
+  tt_int_op(cell_wfq_parse_weights("general=1001", NULL, &msg), OP_EQ, -1);
+
+ done:
+  if (ocirc)
+    circuit_free(TO_CIRCUIT(ocirc));
+  if (orcirc)
+    circuit_free(TO_CIRCUIT(orcirc));
+  tor_free(msg);
+}
+
+#define N_WFQ_CIRCS 6
+
+/** Return the index in <b>circs</b> of the circuit that <b>pol_data</b>
+ * would send on next, or -1 if there is none. */
+static int
+wfq_pick_idx(circuitmux_t *cmux, circuitmux_policy_data_t *pol_data,
+             circuit_t **circs)
+{
+  circuit_t *circ = wfq_policy.pick_active_circuit(cmux, pol_data);
+  int i;
+  for (i = 0; i < N_WFQ_CIRCS; ++i) {
+    if (circs[i] == circ)
+      return i;
+  }
+  return -1;
+}
+
+/** Check that the WFQ policy shares cells between classes by weight, and
+ * between the circuits in a class equally, and that an idle class doesn't
+ * save up credit. */
+static void
+test_cmux_wfq_pick(void *arg)
+{
+  circuitmux_t *cmux = NULL;
+  circuitmux_policy_data_t *pol_data = NULL;
+  circuitmux_policy_circ_data_t *cdata[N_WFQ_CIRCS];
+  circuit_t *circs[N_WFQ_CIRCS];
+  int active[N_WFQ_CIRCS], sent[N_WFQ_CIRCS];
+  /* Two directory circuits, one onion service circuit, three others. */
+  const cmux_wfq_class_t cls[N_WFQ_CIRCS] = {
+    CMUX_WFQ_CLASS_DIR, CMUX_WFQ_CLASS_DIR, CMUX_WFQ_CLASS_ONION,
+    CMUX_WFQ_CLASS_GENERAL, CMUX_WFQ_CLASS_GENERAL, CMUX_WFQ_CLASS_GENERAL
+  };
+  or_options_t *options = NULL;
+  int i, j, pick, n_dir;
+
+  (void) arg;
+
+  memset(cdata, 0, sizeof(cdata));
+  memset(circs, 0, sizeof(circs));
+  memset(sent, 0, sizeof(sent));
+
+  options = tor_malloc_zero(sizeof(or_options_t));
+  options->CircuitPriorityWeights = tor_strdup("dir=6,onion=2,general=3");
+  cell_wfq_set_weights(options);
+  tt_assert(cell_wfq_enabled());
+
+  cmux = circuitmux_alloc();
+  pol_data = wfq_policy.alloc_cmux_data(cmux);
+  for (i = 0; i < N_WFQ_CIRCS; ++i) {
+    if (cls[i] == CMUX_WFQ_CLASS_DIR) {
+      origin_circuit_t *ocirc = origin_circuit_new();
+      ocirc->base_.purpose = CIRCUIT_PURPOSE_C_GENERAL;
+      ocirc->build_state = tor_malloc_zero(sizeof(cpath_build_state_t));
+      ocirc->build_state->onehop_tunnel = 1;
+      circs[i] = TO_CIRCUIT(ocirc);
+    } else {
+      circs[i] = TO_CIRCUIT(or_circuit_new(0, NULL));
+      if (cls[i] == CMUX_WFQ_CLASS_ONION)
+        circs[i]->purpose = CIRCUIT_PURPOSE_REND_ESTABLISHED;
+    }
+    cdata[i] = wfq_policy.alloc_circ_data(cmux, pol_data, circs[i],
+                                          CELL_DIRECTION_OUT, 0);
+    wfq_policy.notify_circ_active(cmux, pol_data, circs[i], cdata[i]);
+    active[i] = 1;
+  }
+
+  /* 11 turns give each class exactly its share: 6, 2 and 3 cells. */
+  for (j = 0; j < 1100; ++j) {
+    pick = wfq_pick_idx(cmux, pol_data, circs);
+    tt_int_op(pick, OP_GE, 0);
+    wfq_policy.notify_xmit_cells(cmux, pol_data, circs[pick], cdata[pick],
+                                 1);
+    ++sent[pick];
+  }
+  tt_int_op(sent[0] + sent[1], OP_EQ, 600);
+  tt_int_op(sent[2], OP_EQ, 200);
+  tt_int_op(sent[3] + sent[4] + sent[5], OP_EQ, 300);
+  /* Circuits in a class take turns. */
+  tt_int_op(sent[0], OP_EQ, 300);
+  tt_int_op(sent[3], OP_EQ, 100);
+  tt_int_op(sent[5], OP_EQ, 100);
+
+  /* With the directory circuits idle, the others get everything. */
+  for (i = 0; i < 2; ++i) {
+    wfq_policy.notify_circ_inactive(cmux, pol_data, circs[i], cdata[i]);
+    active[i] = 0;
+  }
+  for (j = 0; j < 1000; ++j) {
+    pick = wfq_pick_idx(cmux, pol_data, circs);
+    tt_int_op(pick, OP_GE, 2);
+    wfq_policy.notify_xmit_cells(cmux, pol_data, circs[pick], cdata[pick],
+                                 2);
+  }
+
+  /* When they come back, they get their share, not a burst. */
+  for (i = 0; i < 2; ++i) {
+    wfq_policy.notify_circ_active(cmux, pol_data, circs[i], cdata[i]);
+    active[i] = 1;
+  }
+  n_dir = 0;
+  for (j = 0; j < 110; ++j) {
+    pick = wfq_pick_idx(cmux, pol_data, circs);
+    if (pick < 2)
+      ++n_dir;
+    wfq_policy.notify_xmit_cells(cmux, pol_data, circs[pick], cdata[pick],
+                                 1);
+  }
+  /* (Give or take a couple of cells, since a class that wakes up starts
+   * level with the one that was served last.) */
+  tt_int_op(n_dir, OP_GE, 58);
+  tt_int_op(n_dir, OP_LE, 62);
+
+ done:
+  for (i = 0; i < N_WFQ_CIRCS; ++i) {
+    if (!cdata[i])
+      continue;
+    if (active[i])
+      wfq_policy.notify_circ_inactive(cmux, pol_data, circs[i], cdata[i]);
+    wfq_policy.free_circ_data(cmux, pol_data, circs[i], cdata[i]);
+    circuit_free(circs[i]);
+  }
+  if (pol_data)
+    wfq_policy.free_cmux_data(cmux, pol_data);
+  circuitmux_free(cmux);
+  if (options)
+    tor_free(options->CircuitPriorityWeights);
+  tor_free(options);
+  cell_wfq_set_weights(NULL);
+}
+
 struct testcase_t circuitmux_tests[] = {
   { "destroy_cell_queue", test_cmux_destroy_cell_queue, TT_FORK, NULL, NULL },
+  { "destroy_cell_burst", test_cmux_destroy_cell_burst, TT_FORK, NULL, NULL },
+  { "destroy_cell_batch", test_cmux_destroy_cell_batch, TT_FORK, NULL, NULL },
+  { "ewma_log_add", test_cmux_ewma_log_add, TT_FORK, NULL, NULL },
+  { "ewma_pick", test_cmux_ewma_pick, TT_FORK, NULL, NULL },
+  { "ewma_rescale", test_cmux_ewma_rescale, TT_FORK, NULL, NULL },
+  { "wfq_classify", test_cmux_wfq_classify, TT_FORK, NULL, NULL },
+  { "wfq_pick", test_cmux_wfq_pick, TT_FORK, NULL, NULL },
   END_OF_TESTCASES
 };
 
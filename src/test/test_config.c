@@ -345,6 +345,58 @@ test_config_write_to_data_subdir(void *arg)
   tor_free(cp);
 }
 
+static int n_async_writes_done = 0;
+static int last_async_write_status = 1;
+
+static void
+async_write_cb(const char *fname, int status, void *arg)
+{
+  (void)fname;
+  tt_ptr_op(arg, OP_EQ, &n_async_writes_done);
+  ++n_async_writes_done;
+  last_async_write_status = status;
+ done:
+  ;
+}
+
+static void
+test_config_write_str_to_file_async(void *arg)
+{
+  char *fname = tor_strdup(get_fname("async_write"));
+  char *missing = tor_strdup(get_fname("no_such_dir/async_write"));
+  char *cp = NULL;
+  (void)arg;
+
+  /* Without cpuworkers, the write happens before we return. */
+  write_str_to_file_async(fname, tor_strdup("first"),
+                          async_write_cb, &n_async_writes_done);
+  tt_int_op(n_async_writes_done, OP_EQ, 1);
+  tt_int_op(last_async_write_status, OP_EQ, 0);
+  cp = read_file_to_str(fname, 0, NULL);
+  tt_str_op(cp, OP_EQ, "first");
+  tor_free(cp);
+
+  /* Failures get reported to the callback. */
+  write_str_to_file_async(missing, tor_strdup("nope"),
+                          async_write_cb, &n_async_writes_done);
+  tt_int_op(n_async_writes_done, OP_EQ, 2);
+  tt_int_op(last_async_write_status, OP_EQ, -1);
+
+  /* Once we're shutting down, writes are synchronous. */
+  file_writes_flush_and_set_synchronous();
+  write_str_to_file_async(fname, tor_strdup("second"),
+                          async_write_cb, &n_async_writes_done);
+  tt_int_op(n_async_writes_done, OP_EQ, 3);
+  tt_int_op(last_async_write_status, OP_EQ, 0);
+  cp = read_file_to_str(fname, 0, NULL);
+  tt_str_op(cp, OP_EQ, "second");
+
+ done:
+  tor_free(cp);
+  tor_free(fname);
+  tor_free(missing);
+}
+
 /* Test helper function: Make sure that a bridge line gets parsed
  * properly. Also make sure that the resulting bridge_line_t structure
  * has its fields set correctly. */
@@ -4888,6 +4940,135 @@ test_config_parse_port_config__ports__server_options(void *data)
   config_free_lines(config_port_valid); config_port_valid = NULL;
 }
 
+static void
+test_config_dup_and_compare(void *arg)
+{
+  or_options_t *options = options_new(), *defaults = options_new();
+  or_options_t *copy = NULL;
+  config_line_t *lines = NULL;
+  char *msg = NULL, *dump = NULL, *dump_copy = NULL;
+  int i;
+  (void)arg;
+
+  config_init(&options_format, options);
+  config_init(&options_format, defaults);
+  config_get_lines("Nickname Example\n"
+                   "ExcludeNodes {us},1.2.3.4\n"
+                   "LongLivedPorts 22, 80\n"
+                   "TestingClientDownloadSchedule 1, 2 minutes, 3\n"
+                   "MaxMemInQueues 300 MB\n"
+                   "PathsNeededToBuildCircuits 0.7125\n"
+                   "ClientUseIPv6 1\n"
+                   "ExitRelay 0\n"
+                   "HiddenServiceDir /tmp/hs\n"
+                   "HiddenServicePort 80\n"
+                   "Bridge 1.2.3.4:443\n"
+                   "MaxClientCircuitsPending 17\n", &lines, 1);
+  tt_int_op(config_assign(&options_format, options, lines, 0, &msg),
+            OP_EQ, 0);
+
+  copy = config_dup(&options_format, options);
+  for (i = 0; options_format.vars[i].name; ++i) {
+    const config_var_t *var = &options_format.vars[i];
+    if (var->type == CONFIG_TYPE_LINELIST_S ||
+        var->type == CONFIG_TYPE_OBSOLETE)
+      continue;
+    tt_assert(config_var_is_same(&options_format, options, copy, var));
+  }
+  dump = config_dump(&options_format, defaults, options, 1, 0);
+  dump_copy = config_dump(&options_format, defaults, copy, 1, 0);
+  tt_str_op(dump, OP_EQ, dump_copy);
+  tt_assert(strstr(dump, "HiddenServicePort 80"));
+  tt_double_eq(copy->PathsNeededToBuildCircuits, 0.7125);
+
+  /* Changes to a copy are noticed, and don't touch the original. */
+  copy->MaxClientCircuitsPending = 18;
+  tt_assert(!config_is_same(&options_format, options, copy,
+                            "MaxClientCircuitsPending"));
+  tor_free(copy->Nickname);
+  tt_assert(!config_is_same(&options_format, options, copy, "Nickname"));
+  tt_str_op(options->Nickname, OP_EQ, "Example");
+  tor_free(smartlist_get(copy->LongLivedPorts, 1));
+  smartlist_del_keeporder(copy->LongLivedPorts, 1);
+  tt_assert(!config_is_same(&options_format, options, copy,
+                            "LongLivedPorts"));
+  tt_int_op(smartlist_len(options->LongLivedPorts), OP_EQ, 2);
+  tt_assert(config_is_same(&options_format, options, copy,
+                           "HiddenServiceOptions"));
+
+ done:
+  config_free_lines(lines);
+  or_options_free(options);
+  or_options_free(defaults);
+  or_options_free(copy);
+  tor_free(msg);
+  tor_free(dump);
+  tor_free(dump_copy);
+}
+
+static void
+test_config_assign_many_lines(void *arg)
+{
+  or_options_t *options = options_new();
+  config_line_t *lines = NULL;
+  const config_line_t *line;
+  smartlist_t *chunks = smartlist_new();
+  char *conf = NULL, *msg = NULL;
+  int i;
+  (void)arg;
+
+  config_init(&options_format, options);
+
+  /* Lookups ignore case, and still accept a unique prefix. */
+  tt_ptr_op(config_find_option(&options_format, "exitpolicy"), OP_EQ,
+            config_find_option(&options_format, "ExitPolicy"));
+  tt_str_op(config_find_option(&options_format, "EXITPOLICYREJECTPRIVATE")
+            ->name, OP_EQ, "ExitPolicyRejectPrivate");
+  tt_str_op(config_find_option(&options_format, "MaxClientCircuitsPend")
+            ->name, OP_EQ, "MaxClientCircuitsPending");
+  tt_ptr_op(config_find_option(&options_format, "NoSuchOption"), OP_EQ,
+            NULL);
+
+  /* A long list, with a clear part way through, interleaved with options
+   * that share a list. */
+  for (i = 0; i < 20000; ++i) {
+    smartlist_add_asprintf(chunks, "exitpolicy accept *:%d\n", i);
+    if (i == 100)
+      smartlist_add(chunks, tor_strdup("/ExitPolicy\n"));
+    if (i % 1000 == 0)
+      smartlist_add_asprintf(chunks, "HiddenServiceDir /tmp/hs%d\n"
+                             "HiddenServicePort %d\n", i, i);
+  }
+  conf = smartlist_join_strings(chunks, "", 0, NULL);
+  tt_int_op(config_get_lines(conf, &lines, 1), OP_EQ, 0);
+  tt_int_op(config_assign(&options_format, options, lines, 0, &msg),
+            OP_EQ, 0);
+
+  i = 101;
+  for (line = options->ExitPolicy; line; line = line->next) {
+    char expected[32];
+    tor_snprintf(expected, sizeof(expected), "accept *:%d", i++);
+    tt_str_op(line->key, OP_EQ, "ExitPolicy");
+    tt_str_op(line->value, OP_EQ, expected);
+  }
+  tt_int_op(i, OP_EQ, 20000);
+
+  i = 0;
+  for (line = options->RendConfigLines; line; line = line->next, ++i) {
+    tt_str_op(line->key, OP_EQ,
+              (i & 1) ? "HiddenServicePort" : "HiddenServiceDir");
+  }
+  tt_int_op(i, OP_EQ, 40);
+
+ done:
+  config_free_lines(lines);
+  or_options_free(options);
+  SMARTLIST_FOREACH(chunks, char *, cp, tor_free(cp));
+  smartlist_free(chunks);
+  tor_free(conf);
+  tor_free(msg);
+}
+
 #define CONFIG_TEST(name, flags)                          \
   { #name, test_config_ ## name, flags, NULL, NULL }
 
@@ -4907,6 +5088,7 @@ struct testcase_t config_tests[] = {
   CONFIG_TEST(parse_transport_plugin_line, TT_FORK),
   CONFIG_TEST(check_or_create_data_subdir, TT_FORK),
   CONFIG_TEST(write_to_data_subdir, TT_FORK),
+  CONFIG_TEST(write_str_to_file_async, TT_FORK),
   CONFIG_TEST(fix_my_family, 0),
   CONFIG_TEST(directory_fetch, 0),
   CONFIG_TEST(port_cfg_line_extract_addrport, 0),
@@ -4914,6 +5096,8 @@ struct testcase_t config_tests[] = {
   CONFIG_TEST(parse_port_config__ports__no_ports_given, 0),
   CONFIG_TEST(parse_port_config__ports__server_options, 0),
   CONFIG_TEST(parse_port_config__ports__ports_given, 0),
+  CONFIG_TEST(dup_and_compare, 0),
+  CONFIG_TEST(assign_many_lines, 0),
   END_OF_TESTCASES
 };
 
@@ -4,17 +4,22 @@
 #include "orconfig.h"
 
 #define CONNECTION_PRIVATE
+#define CONNECTION_EDGE_PRIVATE
 #define MAIN_PRIVATE
 
 #include "or.h"
 #include "test.h"
 
+#include "config.h"
 #include "connection.h"
+#include "connection_edge.h"
 #include "main.h"
 #include "microdesc.h"
 #include "networkstatus.h"
 #include "rendcache.h"
 #include "directory.h"
+#include "hibernate.h"
+#include "router.h"
 
 static void test_conn_lookup_addr_helper(const char *address,
                                          int family,
@@ -861,6 +866,417 @@ test_conn_download_status(void *arg)
   /* the teardown function removes all the connections in the global list*/;
 }
 
+static void
+test_conn_edge_triggered(void *arg)
+{
+  connection_t *conn = NULL;
+  tor_socket_t fds[2] = { TOR_INVALID_SOCKET, TOR_INVALID_SOCKET };
+  (void)arg;
+
+  if (!tor_libevent_supports_edge_triggered())
+    tt_skip();
+
+  init_connection_lists();
+  get_options_mutable()->EdgeTriggeredIO = 1;
+  tt_int_op(tor_socketpair(AF_UNIX, SOCK_STREAM, 0, fds), OP_EQ, 0);
+  set_socket_nonblocking(fds[0]);
+  conn = connection_new(CONN_TYPE_EXIT, AF_INET);
+  conn->s = fds[0];
+  fds[0] = TOR_INVALID_SOCKET;
+  tt_int_op(connection_add(conn), OP_EQ, 0);
+  tt_assert(conn->edge_triggered);
+  tt_assert(!connection_is_reading(conn));
+  tt_assert(!connection_is_writing(conn));
+
+  /* Changing our interest only flips bits. */
+  connection_start_reading(conn);
+  tt_assert(connection_is_reading(conn));
+  connection_stop_reading(conn);
+  tt_assert(!connection_is_reading(conn));
+
+  /* Edges that arrive while we aren't interested are remembered, but we
+   * don't touch the socket. */
+  tt_int_op(send(fds[1], "x", 1, 0), OP_EQ, 1);
+  event_base_loop(tor_libevent_get_base(), EVLOOP_NONBLOCK);
+  tt_assert(conn->read_ready);
+  tt_assert(conn->write_ready);
+  tt_int_op(buf_datalen(conn->inbuf), OP_EQ, 0);
+
+  connection_note_read_blocked(conn);
+  tt_assert(!conn->read_ready);
+  connection_note_write_blocked(conn);
+  tt_assert(!conn->write_ready);
+
+ done:
+  if (conn) {
+    connection_remove(conn);
+    connection_free(conn);
+  }
+  if (SOCKET_OK(fds[1]))
+    tor_close_socket(fds[1]);
+}
+
+static void
+test_conn_type_index(void *arg)
+{
+  const int types[4] = { CONN_TYPE_DIR, CONN_TYPE_OR, CONN_TYPE_DIR,
+                         CONN_TYPE_DIR };
+  connection_t *conns[4] = { NULL, NULL, NULL, NULL };
+  smartlist_t *dirs;
+  int i;
+  (void)arg;
+
+  init_connection_lists();
+  for (i = 0; i < 4; ++i) {
+    conns[i] = connection_new(types[i], AF_INET);
+    conns[i]->linked = 1;
+    tt_int_op(connection_add(conns[i]), OP_EQ, 0);
+  }
+
+  dirs = get_connection_array_by_type(CONN_TYPE_DIR);
+  tt_int_op(smartlist_len(dirs), OP_EQ, 3);
+  tt_int_op(smartlist_len(get_connection_array_by_type(CONN_TYPE_OR)),
+            OP_EQ, 1);
+  tt_int_op(conns[3]->conn_type_index, OP_EQ, 2);
+  tt_ptr_op(connection_get_by_type(CONN_TYPE_OR), OP_EQ, conns[1]);
+  tt_ptr_op(connection_get_by_type(CONN_TYPE_EXIT), OP_EQ, NULL);
+  conns[0]->marked_for_close = 1;
+  tt_ptr_op(connection_get_by_type(CONN_TYPE_DIR), OP_EQ, conns[2]);
+  conns[0]->marked_for_close = 0;
+
+  /* Removing a connection moves the last one of its type into its place. */
+  connection_remove(conns[0]);
+  tt_int_op(conns[0]->conn_type_index, OP_EQ, -1);
+  tt_int_op(smartlist_len(dirs), OP_EQ, 2);
+  tt_ptr_op(smartlist_get(dirs, 0), OP_EQ, conns[3]);
+  tt_int_op(conns[3]->conn_type_index, OP_EQ, 0);
+  tt_int_op(conns[2]->conn_type_index, OP_EQ, 1);
+  tt_int_op(conns[1]->conn_type_index, OP_EQ, 0);
+
+  connection_remove(conns[2]);
+  tt_int_op(smartlist_len(dirs), OP_EQ, 1);
+  tt_ptr_op(smartlist_get(dirs, 0), OP_EQ, conns[3]);
+
+ done:
+  for (i = 0; i < 4; ++i) {
+    if (!conns[i])
+      continue;
+    if (conns[i]->conn_type_index >= 0)
+      connection_remove(conns[i]);
+    connection_free(conns[i]);
+  }
+}
+
+static int n_start_reading_calls = 0;
+
+static void
+mock_connection_start_reading(connection_t *conn)
+{
+  (void)conn;
+  ++n_start_reading_calls;
+}
+
+static void
+test_conn_bucket_refill_blocked(void *arg)
+{
+  connection_t *idle = NULL, *blocked = NULL, *freed = NULL;
+  (void)arg;
+
+  init_connection_lists();
+  MOCK(connection_start_reading, mock_connection_start_reading);
+  n_start_reading_calls = 0;
+
+  idle = connection_new(CONN_TYPE_EXIT, AF_INET);
+  blocked = connection_new(CONN_TYPE_EXIT, AF_INET);
+  freed = connection_new(CONN_TYPE_EXIT, AF_INET);
+  blocked->read_blocked_on_bw = 1;
+  connection_bucket_note_blocked(blocked);
+  connection_bucket_note_blocked(blocked);
+  freed->read_blocked_on_bw = 1;
+  connection_bucket_note_blocked(freed);
+  tt_assert(blocked->on_bw_blocked_list);
+  tt_assert(freed->on_bw_blocked_list);
+  tt_assert(!idle->on_bw_blocked_list);
+
+  /* Freeing a blocked connection takes it off the list. */
+  connection_free(freed);
+  freed = NULL;
+
+  /* Nothing wakes up while the buckets are still empty. */
+  get_options_mutable()->BandwidthRate = 0;
+  get_options_mutable()->BandwidthBurst = 0;
+  get_options_mutable()->RelayBandwidthRate = 0;
+  global_read_bucket = global_relayed_read_bucket = 0;
+  connection_bucket_refill(100, time(NULL));
+  tt_int_op(n_start_reading_calls, OP_EQ, 0);
+  tt_assert(blocked->read_blocked_on_bw);
+  tt_assert(blocked->on_bw_blocked_list);
+
+  /* Once there are tokens, only the blocked connection is woken, and it
+   * leaves the list. */
+  global_read_bucket = global_relayed_read_bucket = 1000;
+  connection_bucket_refill(100, time(NULL));
+  tt_int_op(n_start_reading_calls, OP_EQ, 1);
+  tt_assert(!blocked->read_blocked_on_bw);
+  tt_assert(!blocked->on_bw_blocked_list);
+
+  connection_bucket_refill(100, time(NULL));
+  tt_int_op(n_start_reading_calls, OP_EQ, 1);
+
+ done:
+  UNMOCK(connection_start_reading);
+  connection_free(idle);
+  connection_free(blocked);
+  connection_free(freed);
+}
+
+static void
+test_conn_bucket_fair_share(void *arg)
+{
+  or_options_t *options = get_options_mutable();
+  or_connection_t a, b;
+  int i;
+  (void)arg;
+
+  memset(&a, 0, sizeof(a));
+  memset(&b, 0, sizeof(b));
+  options->BandwidthFairShare = 1;
+  options->BandwidthRate = options->BandwidthBurst = 100000;
+  options->RelayBandwidthRate = 0;
+
+  tt_int_op(connection_bucket_fair_share(10000, 4), OP_EQ, 2500);
+  tt_int_op(connection_bucket_fair_share(100, 4), OP_EQ,
+            CELL_MAX_NETWORK_SIZE);
+  tt_int_op(connection_bucket_fair_share(10000, 0), OP_EQ, 10000);
+
+  /* No limit until the buckets run dry. */
+  global_read_bucket = global_relayed_read_bucket = 50000;
+  connection_bucket_refill(100, time(NULL));
+  tt_int_op(connection_fair_share_read_left(&a), OP_EQ, -1);
+
+  /* Two clients read until the buckets are empty; after the refill, each
+   * gets half of what we can read. */
+  connection_fair_share_note_read(&a, 30000);
+  connection_fair_share_note_read(&b, 30000);
+  connection_fair_share_note_read(&b, 30000);
+  global_read_bucket = global_relayed_read_bucket = 0;
+  connection_bucket_refill(100, time(NULL));
+  tt_int_op(connection_fair_share_read_left(&a), OP_EQ, 5000);
+  tt_int_op(connection_fair_share_read_left(&b), OP_EQ, 5000);
+  connection_fair_share_note_read(&a, 4000);
+  tt_int_op(connection_fair_share_read_left(&a), OP_EQ, 1000);
+  connection_fair_share_note_read(&a, 4000);
+  tt_int_op(connection_fair_share_read_left(&a), OP_EQ, 0);
+  tt_int_op(connection_fair_share_read_left(&b), OP_EQ, 5000);
+
+  /* Each refill interval starts afresh. */
+  global_read_bucket = global_relayed_read_bucket = 0;
+  connection_bucket_refill(100, time(NULL));
+  tt_int_op(connection_fair_share_read_left(&a), OP_EQ, 10000);
+
+  /* The limit lasts a second after the buckets last ran dry. */
+  for (i = 0; i < 9; ++i) {
+    connection_bucket_refill(100, time(NULL));
+    tt_int_op(connection_fair_share_read_left(&a), OP_GE,
+              CELL_MAX_NETWORK_SIZE);
+  }
+  connection_bucket_refill(100, time(NULL));
+  tt_int_op(connection_fair_share_read_left(&a), OP_EQ, -1);
+
+ done:
+  options->BandwidthFairShare = 0;
+}
+
+static void
+test_conn_housekeeping_deadline(void *arg)
+{
+  connection_t *dirconn = NULL, *exitconn = NULL, *apconn = NULL;
+  const time_t now = 1000000;
+  const int stall = get_options()->TestingDirConnectionMaxStall;
+  const int socks_timeout = get_options()->SocksTimeout;
+  (void)arg;
+
+  init_connection_lists();
+
+  /* Client directory connections expire when they stop reading. */
+  dirconn = connection_new(CONN_TYPE_DIR, AF_INET);
+  dirconn->purpose = DIR_PURPOSE_FETCH_CONSENSUS;
+  dirconn->timestamp_lastread = now - 10;
+  dirconn->timestamp_lastwritten = now - 100;
+  tt_int_op(connection_housekeeping_deadline(dirconn, now), OP_EQ,
+            now - 10 + stall + 1);
+
+  /* A deadline that has passed without anything happening means "soon". */
+  dirconn->timestamp_lastread = now - stall - 100;
+  tt_int_op(connection_housekeeping_deadline(dirconn, now), OP_EQ, now + 1);
+
+  /* Edge connections have nothing to do until they're marked. */
+  exitconn = connection_new(CONN_TYPE_EXIT, AF_INET);
+  tt_int_op(connection_housekeeping_deadline(exitconn, now), OP_EQ, 0);
+  exitconn->marked_for_close = 1;
+  exitconn->timestamp_lastwritten = now;
+  tt_int_op(connection_housekeeping_deadline(exitconn, now), OP_EQ,
+            now + CONN_HOLD_OPEN_TIMEOUT);
+  exitconn->marked_for_close = 0;
+
+  /* Unattached streams give up SocksTimeout seconds after they're born;
+   * streams waiting for a reply get retried after the retry timeout. */
+  apconn = connection_new(CONN_TYPE_AP, AF_INET);
+  apconn->state = AP_CONN_STATE_CIRCUIT_WAIT;
+  apconn->timestamp_created = now - 5;
+  apconn->timestamp_lastread = now - 3;
+  tt_int_op(connection_housekeeping_deadline(apconn, now), OP_EQ,
+            now - 5 + socks_timeout);
+  apconn->state = AP_CONN_STATE_CONNECT_WAIT;
+  tt_int_op(connection_housekeeping_deadline(apconn, now), OP_EQ,
+            now - 3 + 10);
+  apconn->state = AP_CONN_STATE_OPEN;
+  tt_int_op(connection_housekeeping_deadline(apconn, now), OP_EQ, 0);
+
+ done:
+  connection_free(dirconn);
+  connection_free(exitconn);
+  connection_free(apconn);
+}
+
+/** Peer ends of the sockets handed out by mock_connection_preconnect(). */
+static smartlist_t *preconnect_peers = NULL;
+
+static tor_socket_t
+mock_connection_preconnect(const tor_addr_t *addr, uint16_t port,
+                           int *socket_error)
+{
+  tor_socket_t fds[2];
+  (void)addr;
+  (void)port;
+  if (tor_socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+    *socket_error = SOCK_ERRNO(ENOBUFS);
+    return TOR_INVALID_SOCKET;
+  }
+  set_socket_nonblocking(fds[0]);
+  smartlist_add(preconnect_peers, tor_memdup(&fds[1], sizeof(fds[1])));
+  return fds[0];
+}
+
+static int
+mock_router_my_exit_policy_is_reject_star(void)
+{
+  return 0;
+}
+
+static int
+mock_we_are_hibernating(void)
+{
+  return 0;
+}
+
+/** Return the peer end of the <b>idx</b>th preconnected socket. */
+static tor_socket_t
+preconnect_peer(int idx)
+{
+  return *(tor_socket_t *)smartlist_get(preconnect_peers, idx);
+}
+
+static void
+test_conn_exit_preconnect(void *arg)
+{
+  tor_addr_t addr, other;
+  tor_socket_t s = TOR_INVALID_SOCKET;
+  const time_t now = 1000000;
+  (void)arg;
+
+  preconnect_peers = smartlist_new();
+  MOCK(connection_preconnect, mock_connection_preconnect);
+  MOCK(router_my_exit_policy_is_reject_star,
+       mock_router_my_exit_policy_is_reject_star);
+  MOCK(we_are_hibernating, mock_we_are_hibernating);
+  get_options_mutable()->ExitPreconnect = 1;
+  tor_addr_parse(&addr, "192.0.2.7");
+  tor_addr_parse(&other, "192.0.2.8");
+
+  /* A destination isn't preconnected until it has seen enough streams. */
+  exit_preconnect_note_stream(&addr, 443, now);
+  exit_preconnect_note_stream(&addr, 443, now);
+  exit_preconnect_note_stream(&other, 443, now);
+  tt_int_op(smartlist_len(preconnect_peers), OP_EQ, 0);
+  tt_assert(!SOCKET_OK(exit_preconnect_take(&addr, 443, now)));
+
+  exit_preconnect_note_stream(&addr, 443, now);
+  tt_int_op(smartlist_len(preconnect_peers), OP_EQ, 2);
+  /* Other ports and addresses don't get them. */
+  tt_assert(!SOCKET_OK(exit_preconnect_take(&addr, 80, now)));
+  tt_assert(!SOCKET_OK(exit_preconnect_take(&other, 443, now)));
+
+  /* We hand out the newest socket first, and never hand it out twice. */
+  s = exit_preconnect_take(&addr, 443, now);
+  tt_assert(SOCKET_OK(s));
+  tt_assert(send(preconnect_peer(1), "x", 1, 0) == 1);
+  {
+    char c = 0;
+    tt_int_op(1, OP_EQ, tor_socket_recv(s, &c, 1, 0));
+    tt_int_op(c, OP_EQ, 'x');
+  }
+  tor_close_socket(s);
+  s = TOR_INVALID_SOCKET;
+
+  /* A socket the server has closed is thrown away. */
+  tor_close_socket(preconnect_peer(0));
+  *(tor_socket_t *)smartlist_get(preconnect_peers, 0) = TOR_INVALID_SOCKET;
+  tt_assert(!SOCKET_OK(exit_preconnect_take(&addr, 443, now)));
+
+  /* The next stream refills the pool; a socket with data already waiting
+   * from the server is still good, and keeps the data. */
+  exit_preconnect_note_stream(&addr, 443, now);
+  tt_int_op(smartlist_len(preconnect_peers), OP_EQ, 4);
+  tt_assert(send(preconnect_peer(3), "y", 1, 0) == 1);
+  s = exit_preconnect_take(&addr, 443, now);
+  tt_assert(SOCKET_OK(s));
+  {
+    char c = 0;
+    tt_int_op(1, OP_EQ, tor_socket_recv(s, &c, 1, 0));
+    tt_int_op(c, OP_EQ, 'y');
+  }
+  tor_close_socket(s);
+  s = TOR_INVALID_SOCKET;
+
+  /* Sockets that have waited too long are closed. */
+  connection_exit_preconnect_expire(now + 31);
+  tt_assert(!SOCKET_OK(exit_preconnect_take(&addr, 443, now + 31)));
+
+  /* Stream counts decay until the destination is forgotten, and it has to
+   * become hot again before we preconnect to it. */
+  connection_exit_preconnect_expire(now + 100);
+  connection_exit_preconnect_expire(now + 200);
+  connection_exit_preconnect_expire(now + 300);
+  exit_preconnect_note_stream(&addr, 443, now + 300);
+  exit_preconnect_note_stream(&addr, 443, now + 300);
+  tt_int_op(smartlist_len(preconnect_peers), OP_EQ, 4);
+  exit_preconnect_note_stream(&addr, 443, now + 300);
+  tt_int_op(smartlist_len(preconnect_peers), OP_EQ, 6);
+
+  /* Turning the option off drops everything. */
+  get_options_mutable()->ExitPreconnect = 0;
+  connection_exit_preconnect_expire(now + 301);
+  tt_assert(!SOCKET_OK(exit_preconnect_take(&addr, 443, now + 301)));
+
+ done:
+  if (SOCKET_OK(s))
+    tor_close_socket(s);
+  connection_exit_preconnect_free_all();
+  UNMOCK(connection_preconnect);
+  UNMOCK(router_my_exit_policy_is_reject_star);
+  UNMOCK(we_are_hibernating);
+  if (preconnect_peers) {
+    SMARTLIST_FOREACH(preconnect_peers, tor_socket_t *, fd, {
+      if (SOCKET_OK(*fd))
+        tor_close_socket(*fd);
+      tor_free(fd);
+    });
+    smartlist_free(preconnect_peers);
+    preconnect_peers = NULL;
+  }
+}
+
 #define CONNECTION_TESTCASE(name, fork, setup)                           \
   { #name, test_conn_##name, fork, &setup, NULL }
 
@@ -876,6 +1292,14 @@ struct testcase_t connection_tests[] = {
                           test_conn_download_status_st, FLAV_MICRODESC),
   CONNECTION_TESTCASE_ARG(download_status,  TT_FORK,
                           test_conn_download_status_st, FLAV_NS),
+  { "edge_triggered", test_conn_edge_triggered, TT_FORK, NULL, NULL },
+  { "type_index", test_conn_type_index, TT_FORK, NULL, NULL },
+  { "bucket_refill_blocked", test_conn_bucket_refill_blocked, TT_FORK,
+    NULL, NULL },
+  { "bucket_fair_share", test_conn_bucket_fair_share, TT_FORK, NULL, NULL },
+  { "housekeeping_deadline", test_conn_housekeeping_deadline, TT_FORK,
+    NULL, NULL },
+  { "exit_preconnect", test_conn_exit_preconnect, TT_FORK, NULL, NULL },
 //CONNECTION_TESTCASE(func_suffix, TT_FORK, setup_func_pair),
   END_OF_TESTCASES
 };
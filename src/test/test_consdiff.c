@@ -0,0 +1,303 @@
+/* Copyright (c) 2016, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+#define CONSDIFF_PRIVATE
+
+#include "orconfig.h"
+#include "or.h"
+#include "test.h"
+
+#include "consdiff.h"
+#include "dirserv.h"
+#include "routerparse.h"
+
+/* Identities, listed in the order of the digests they encode. */
+#define ID_A "AAAAAAAAAAAAAAAAAAAAAAAAAAA"
+#define ID_B "BBBBBBBBBBBBBBBBBBBBBBBBBBB"
+#define ID_LOWER "aaaaaaaaaaaaaaaaaaaaaaaaaaa"
+#define ID_DIGIT "000000000000000000000000000"
+#define ID_PLUS "+++++++++++++++++++++++++++"
+#define ID_SLASH "///////////////////////////"
+
+/** Return a newly allocated fake consensus valid after <b>valid_after</b>,
+ * with one entry per string in the NULL-terminated <b>routers</b>.  Each
+ * string is "nickname identity flags". */
+static char *
+fake_consensus(const char *valid_after, const char **routers)
+{
+  smartlist_t *out = smartlist_new();
+  char *result;
+  smartlist_add_asprintf(out,
+                         "network-status-version 3\n"
+                         "vote-status consensus\n"
+                         "valid-after %s\n"
+                         "known-flags Fast Running Stable\n", valid_after);
+  for ( ; *routers; ++routers) {
+    char nickname[32], identity[32], flags[64];
+    tor_assert(sscanf(*routers, "%31s %31s %63[^\n]",
+                      nickname, identity, flags) == 3);
+    smartlist_add_asprintf(out,
+                           "r %s %s AAAAAAAAAAAAAAAAAAAAAAAAAAA "
+                           "2016-11-01 00:00:00 10.0.0.1 9001 0\n"
+                           "s %s\n"
+                           "w Bandwidth=20\n", nickname, identity, flags);
+  }
+  smartlist_add(out, tor_strdup("directory-footer\n"
+                                "directory-signature AAAA BBBB\n"
+                                "-----BEGIN SIGNATURE-----\n"
+                                "c2lnbmF0dXJl\n"
+                                "-----END SIGNATURE-----\n"));
+  result = smartlist_join_strings(out, "", 0, NULL);
+  SMARTLIST_FOREACH(out, char *, cp, tor_free(cp));
+  smartlist_free(out);
+  return result;
+}
+
+static const char *base_routers[] = {
+  "alpha " ID_A " Fast Running",
+  "bravo " ID_B " Fast Running",
+  "lower " ID_LOWER " Running",
+  "digit " ID_DIGIT " Running",
+  "plus " ID_PLUS " Fast",
+  NULL
+};
+
+static const char *target_routers[] = {
+  "alpha " ID_A " Fast Running Stable",
+  "lower " ID_LOWER " Running",
+  "digit " ID_DIGIT " Running",
+  "plus " ID_PLUS " Fast",
+  "slash " ID_SLASH " Running",
+  NULL
+};
+
+static void
+free_lines(smartlist_t *lines)
+{
+  if (!lines)
+    return;
+  SMARTLIST_FOREACH(lines, char *, cp, tor_free(cp));
+  smartlist_free(lines);
+}
+
+static void
+test_consdiff_split_lines(void *arg)
+{
+  smartlist_t *lines = NULL;
+  (void)arg;
+
+  tt_ptr_op(consdiff_split_lines(""), OP_EQ, NULL);
+  tt_ptr_op(consdiff_split_lines("no newline"), OP_EQ, NULL);
+
+  lines = consdiff_split_lines("a\n\nbc\n");
+  tt_assert(lines);
+  tt_int_op(smartlist_len(lines), OP_EQ, 3);
+  tt_str_op(smartlist_get(lines, 0), OP_EQ, "a");
+  tt_str_op(smartlist_get(lines, 1), OP_EQ, "");
+  tt_str_op(smartlist_get(lines, 2), OP_EQ, "bc");
+
+ done:
+  free_lines(lines);
+}
+
+static void
+test_consdiff_compare_identities(void *arg)
+{
+  (void)arg;
+
+  /* Base64 digit order, not ASCII order. */
+  tt_int_op(consdiff_compare_identities(ID_A, 27, ID_B, 27), OP_LT, 0);
+  tt_int_op(consdiff_compare_identities(ID_B, 27, ID_LOWER, 27), OP_LT, 0);
+  tt_int_op(consdiff_compare_identities(ID_LOWER, 27, ID_DIGIT, 27), OP_LT, 0);
+  tt_int_op(consdiff_compare_identities(ID_DIGIT, 27, ID_PLUS, 27), OP_LT, 0);
+  tt_int_op(consdiff_compare_identities(ID_PLUS, 27, ID_SLASH, 27), OP_LT, 0);
+  tt_int_op(consdiff_compare_identities(ID_SLASH, 27, ID_A, 27), OP_GT, 0);
+  tt_int_op(consdiff_compare_identities(ID_A, 27, ID_A, 27), OP_EQ, 0);
+  tt_int_op(consdiff_compare_identities(ID_A, 26, ID_A, 27), OP_LT, 0);
+
+ done:
+  ;
+}
+
+static void
+test_consdiff_find_hunks(void *arg)
+{
+  smartlist_t *base = NULL, *target = NULL, *hunks = NULL;
+  const consdiff_hunk_t *h;
+  (void)arg;
+
+  base = consdiff_split_lines("a\nb\nc\nd\n");
+  target = consdiff_split_lines("a\nx\nc\nd\ne\n");
+  hunks = consdiff_find_hunks(base, target);
+  tt_int_op(smartlist_len(hunks), OP_EQ, 2);
+  h = smartlist_get(hunks, 0);
+  tt_int_op(h->base_start, OP_EQ, 1);
+  tt_int_op(h->base_len, OP_EQ, 1);
+  tt_int_op(h->target_start, OP_EQ, 1);
+  tt_int_op(h->target_len, OP_EQ, 1);
+  h = smartlist_get(hunks, 1);
+  tt_int_op(h->base_start, OP_EQ, 4);
+  tt_int_op(h->base_len, OP_EQ, 0);
+  tt_int_op(h->target_start, OP_EQ, 4);
+  tt_int_op(h->target_len, OP_EQ, 1);
+
+ done:
+  free_lines(base);
+  free_lines(target);
+  if (hunks) {
+    SMARTLIST_FOREACH(hunks, consdiff_hunk_t *, hk, tor_free(hk));
+    smartlist_free(hunks);
+  }
+}
+
+static void
+test_consdiff_gen_apply(void *arg)
+{
+  char *base = NULL, *target = NULL, *diff = NULL, *applied = NULL;
+  char *cp;
+  (void)arg;
+
+  base = fake_consensus("2016-11-01 00:00:00", base_routers);
+  target = fake_consensus("2016-11-01 01:00:00", target_routers);
+
+  diff = consdiff_gen_diff(base, target);
+  tt_assert(diff);
+  tt_assert(consdiff_looks_like_diff(diff));
+  tt_assert(! consdiff_looks_like_diff(base));
+
+  /* Routers that didn't change don't appear in the diff, even though they
+   * aren't in ASCII order. */
+  tt_ptr_op(strstr(diff, "r lower "), OP_EQ, NULL);
+  tt_ptr_op(strstr(diff, "r digit "), OP_EQ, NULL);
+  tt_ptr_op(strstr(diff, "r plus "), OP_EQ, NULL);
+  tt_assert(strstr(diff, "Fast Running Stable\n"));
+  tt_assert(strstr(diff, "r slash "));
+
+  applied = consdiff_apply_diff(base, diff);
+  tt_assert(applied);
+  tt_str_op(applied, OP_EQ, target);
+  tor_free(applied);
+
+  /* A diff only applies to the consensus it was made from. */
+  tt_ptr_op(consdiff_apply_diff(target, diff), OP_EQ, NULL);
+
+  /* A tampered diff doesn't produce the consensus it promises. */
+  cp = strstr(diff, "Stable\n");
+  tt_assert(cp);
+  cp[5] = 'a';
+  tt_ptr_op(consdiff_apply_diff(base, diff), OP_EQ, NULL);
+
+ done:
+  tor_free(base);
+  tor_free(target);
+  tor_free(diff);
+  tor_free(applied);
+}
+
+static void
+test_consdiff_apply_bad(void *arg)
+{
+  char *base = NULL, *diff = NULL;
+  common_digests_t digests;
+  char hex[HEX_DIGEST256_LEN+1];
+  (void)arg;
+
+  base = fake_consensus("2016-11-01 00:00:00", base_routers);
+  tt_int_op(router_get_networkstatus_v3_hashes(base, &digests), OP_EQ, 0);
+  base16_encode(hex, sizeof(hex), digests.d[DIGEST_SHA256], DIGEST256_LEN);
+
+#define BAD_DIFF(cmds) STMT_BEGIN                                       \
+    tor_asprintf(&diff, "%s\nhash %s %s\n%s", CONSDIFF_FORMAT_LINE,     \
+                 hex, hex, (cmds));                                     \
+    tt_ptr_op(consdiff_apply_diff(base, diff), OP_EQ, NULL);            \
+    tor_free(diff);                                                     \
+  STMT_END
+
+  /* Commands must run from the end of the document to the start. */
+  BAD_DIFF("1d\n3d\n");
+  BAD_DIFF("3,4d\n4a\nfoo\n.\n");
+  /* Out of range, malformed, or unsupported. */
+  BAD_DIFF("999d\n");
+  BAD_DIFF("0d\n");
+  BAD_DIFF("3,2d\n");
+  BAD_DIFF("3x\n");
+  BAD_DIFF("3dd\n");
+  BAD_DIFF("3s/a/b/\n");
+  /* Unterminated insertion. */
+  BAD_DIFF("1a\nfoo\n");
+  /* Bad hash line. */
+  tor_asprintf(&diff, "%s\nhash %s\n", CONSDIFF_FORMAT_LINE, hex);
+  tt_ptr_op(consdiff_apply_diff(base, diff), OP_EQ, NULL);
+  tor_free(diff);
+  /* An empty diff is fine, and gives back the base. */
+  tor_asprintf(&diff, "%s\nhash %s %s\n", CONSDIFF_FORMAT_LINE, hex, hex);
+  {
+    char *same = consdiff_apply_diff(base, diff);
+    tt_str_op(same, OP_EQ, base);
+    tor_free(same);
+  }
+#undef BAD_DIFF
+
+ done:
+  tor_free(base);
+  tor_free(diff);
+}
+
+static void
+test_consdiff_dirserv_cache(void *arg)
+{
+  char *base = NULL, *target = NULL, *applied = NULL, *list = NULL;
+  common_digests_t base_digests, target_digests;
+  char hex[HEX_DIGEST256_LEN+1];
+  cached_dir_t *diff;
+  (void)arg;
+
+  base = fake_consensus("2016-11-01 00:00:00", base_routers);
+  target = fake_consensus("2016-11-01 01:00:00", target_routers);
+  tt_int_op(router_get_networkstatus_v3_hashes(base, &base_digests),
+            OP_EQ, 0);
+  tt_int_op(router_get_networkstatus_v3_hashes(target, &target_digests),
+            OP_EQ, 0);
+  base16_encode(hex, sizeof(hex), base_digests.d[DIGEST_SHA256],
+                DIGEST256_LEN);
+
+  dirserv_set_cached_consensus_networkstatus(base, "ns", &base_digests,
+                                             1000);
+  tt_ptr_op(dirserv_get_consensus_diff("ns", hex), OP_EQ, NULL);
+
+  /* With no cpuworkers, the diff is built as soon as the new consensus
+   * arrives. */
+  dirserv_set_cached_consensus_networkstatus(target, "ns", &target_digests,
+                                             2000);
+  diff = dirserv_get_consensus_diff("ns", hex);
+  tt_assert(diff);
+  tt_assert(diff->dir_z);
+  applied = consdiff_apply_diff(base, diff->dir);
+  tt_str_op(applied, OP_EQ, target);
+
+  /* Clients may list several digests; unknown ones are ignored. */
+  tor_asprintf(&list, "%s, %s", "00", hex);
+  tt_ptr_op(dirserv_get_consensus_diff("ns", list), OP_EQ, diff);
+  tt_ptr_op(dirserv_get_consensus_diff("microdesc", hex), OP_EQ, NULL);
+  base16_encode(hex, sizeof(hex), target_digests.d[DIGEST_SHA256],
+                DIGEST256_LEN);
+  tt_ptr_op(dirserv_get_consensus_diff("ns", hex), OP_EQ, NULL);
+
+ done:
+  dirserv_free_all();
+  tor_free(base);
+  tor_free(target);
+  tor_free(applied);
+  tor_free(list);
+}
+
+struct testcase_t consdiff_tests[] = {
+  { "split_lines", test_consdiff_split_lines, 0, NULL, NULL },
+  { "compare_identities", test_consdiff_compare_identities, 0, NULL, NULL },
+  { "find_hunks", test_consdiff_find_hunks, 0, NULL, NULL },
+  { "gen_apply", test_consdiff_gen_apply, 0, NULL, NULL },
+  { "apply_bad", test_consdiff_apply_bad, 0, NULL, NULL },
+  { "dirserv_cache", test_consdiff_dirserv_cache, TT_FORK, NULL, NULL },
+  END_OF_TESTCASES
+};
+
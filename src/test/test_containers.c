@@ -441,6 +441,100 @@ test_container_smartlist_digests(void *arg)
   smartlist_free(sl);
 }
 
+/** Helper: compare two DIGEST256_LEN digests for smartlist_sort(). */
+static int
+compare_digests256_for_test_(const void **a, const void **b)
+{
+  return tor_memcmp(*a, *b, DIGEST256_LEN);
+}
+
+/** Helper: compare a DIGEST_LEN key to a member for smartlist_bsearch(). */
+static int
+compare_key_to_digest_for_test_(const void *key, const void **member)
+{
+  return tor_memcmp(key, *member, DIGEST_LEN);
+}
+
+/** Run unit tests for the specialized sort, uniq, and bsearch functions on
+ * large lists of digests, checking them against the generic versions. */
+static void
+test_container_smartlist_digests_bulk(void *arg)
+{
+  smartlist_t *sl = smartlist_new();
+  smartlist_t *expected = smartlist_new();
+  uint8_t d[DIGEST256_LEN];
+  int i, found, found2, idx;
+  (void)arg;
+
+  /* Random digests, plus duplicates and digests with long common
+   * prefixes, so that the sort has to look deep into its keys. */
+  for (i = 0; i < 2000; ++i) {
+    crypto_rand((char*)d, sizeof(d));
+    if (i % 10 == 0)
+      memset(d, 'x', DIGEST256_LEN - 1);
+    smartlist_add(sl, tor_memdup(d, sizeof(d)));
+    smartlist_add(expected, tor_memdup(d, sizeof(d)));
+    if (i % 7 == 0) {
+      smartlist_add(sl, tor_memdup(d, sizeof(d)));
+      smartlist_add(expected, tor_memdup(d, sizeof(d)));
+    }
+  }
+
+  smartlist_sort_digests256(sl);
+  smartlist_sort(expected, compare_digests256_for_test_);
+  tt_int_op(smartlist_len(sl), OP_EQ, smartlist_len(expected));
+  for (i = 0; i < smartlist_len(sl); ++i)
+    tt_mem_op(smartlist_get(sl, i), OP_EQ, smartlist_get(expected, i),
+              DIGEST256_LEN);
+
+  smartlist_uniq_digests256(sl);
+  smartlist_uniq(expected, compare_digests256_for_test_, tor_free_);
+  tt_int_op(smartlist_len(sl), OP_EQ, smartlist_len(expected));
+  tt_int_op(smartlist_len(sl), OP_LT, 2000 + 286);
+  for (i = 0; i < smartlist_len(sl); ++i)
+    tt_mem_op(smartlist_get(sl, i), OP_EQ, smartlist_get(expected, i),
+              DIGEST256_LEN);
+
+  /* The list is sorted by its first DIGEST_LEN bytes too.  Once we remove
+   * members that share those bytes, every member can be found, and other
+   * keys land where smartlist_bsearch_idx() puts them. */
+  smartlist_uniq_digests(sl);
+  for (i = 1; i < smartlist_len(sl); ++i)
+    tt_int_op(tor_memcmp(smartlist_get(sl, i-1), smartlist_get(sl, i),
+                         DIGEST_LEN), OP_LT, 0);
+  for (i = 0; i < smartlist_len(sl); ++i) {
+    idx = smartlist_bsearch_digest_idx(sl, smartlist_get(sl, i), 0, &found);
+    tt_int_op(idx, OP_EQ, i);
+    tt_assert(found);
+  }
+  for (i = 0; i < 1000; ++i) {
+    crypto_rand((char*)d, sizeof(d));
+    if (i % 10 == 0)
+      memset(d, 'x', DIGEST_LEN - 1);
+    idx = smartlist_bsearch_digest_idx(sl, (const char*)d, 0, &found);
+    tt_int_op(idx, OP_EQ,
+              smartlist_bsearch_idx(sl, d, compare_key_to_digest_for_test_,
+                                    &found2));
+    tt_int_op(found, OP_EQ, found2);
+    tt_ptr_op(smartlist_bsearch_digest(sl, (const char*)d, 0), OP_EQ,
+              found ? smartlist_get(sl, idx) : NULL);
+  }
+  /* Keys at an offset into each member work too. */
+  for (i = 0; i < smartlist_len(sl); i += 50) {
+    const char *member = smartlist_get(sl, i);
+    smartlist_t *one = smartlist_new();
+    smartlist_add(one, (void*)member);
+    tt_ptr_op(smartlist_bsearch_digest(one, member + 12, 12), OP_EQ, member);
+    smartlist_free(one);
+  }
+
+ done:
+  SMARTLIST_FOREACH(sl, char *, cp, tor_free(cp));
+  smartlist_free(sl);
+  SMARTLIST_FOREACH(expected, char *, cp, tor_free(cp));
+  smartlist_free(expected);
+}
+
 /** Run unit tests for concatenate-a-smartlist-of-strings functions. */
 static void
 test_container_smartlist_join(void *arg)
@@ -1006,6 +1100,76 @@ test_container_di_map(void *arg)
   dimap_free(map, NULL);
 }
 
+/** Run unit tests for digestmap_t, exercising growth, removal, and
+ * removal while iterating. */
+static void
+test_container_digestmap(void *arg)
+{
+  digestmap_t *map = digestmap_new();
+  char key[DIGEST_LEN];
+  int i, n_seen = 0;
+  (void)arg;
+
+  tt_ptr_op(digestmap_get(map, "01234567890123456789"), OP_EQ, NULL);
+  tt_assert(digestmap_isempty(map));
+
+  /* Fill the map far enough to make it resize several times. */
+  for (i = 0; i < 1000; ++i) {
+    memset(key, 0, sizeof(key));
+    set_uint32(key, (uint32_t)i);
+    tt_ptr_op(digestmap_set(map, key, (void*)(intptr_t)(i+1)), OP_EQ, NULL);
+  }
+  digestmap_assert_ok(map);
+  tt_int_op(digestmap_size(map), OP_EQ, 1000);
+
+  /* Replace a value. */
+  set_uint32(key, 7);
+  tt_ptr_op(digestmap_set(map, key, (void*)(intptr_t)7000), OP_EQ,
+            (void*)(intptr_t)8);
+  tt_ptr_op(digestmap_get(map, key), OP_EQ, (void*)(intptr_t)7000);
+  digestmap_set(map, key, (void*)(intptr_t)8);
+
+  /* Remove every third entry, then put a third of those back. */
+  for (i = 0; i < 1000; i += 3) {
+    set_uint32(key, (uint32_t)i);
+    tt_ptr_op(digestmap_remove(map, key), OP_EQ, (void*)(intptr_t)(i+1));
+    tt_ptr_op(digestmap_remove(map, key), OP_EQ, NULL);
+  }
+  digestmap_assert_ok(map);
+  tt_int_op(digestmap_size(map), OP_EQ, 666);
+  for (i = 0; i < 1000; i += 9) {
+    set_uint32(key, (uint32_t)i);
+    tt_ptr_op(digestmap_set(map, key, (void*)(intptr_t)(i+1)), OP_EQ, NULL);
+  }
+  digestmap_assert_ok(map);
+  tt_int_op(digestmap_size(map), OP_EQ, 778);
+  for (i = 0; i < 1000; ++i) {
+    set_uint32(key, (uint32_t)i);
+    if (i % 3 == 0 && i % 9 != 0)
+      tt_ptr_op(digestmap_get(map, key), OP_EQ, NULL);
+    else
+      tt_ptr_op(digestmap_get(map, key), OP_EQ, (void*)(intptr_t)(i+1));
+  }
+
+  /* Remove the odd values while iterating; every entry is seen once. */
+  DIGESTMAP_FOREACH_MODIFY(map, k, void *, v) {
+    int val = (int)(intptr_t)v;
+    tt_int_op((int)get_uint32(k), OP_EQ, val - 1);
+    ++n_seen;
+    if (val & 1)
+      MAP_DEL_CURRENT(k);
+  } DIGESTMAP_FOREACH_END;
+  tt_int_op(n_seen, OP_EQ, 778);
+  digestmap_assert_ok(map);
+  tt_int_op(digestmap_size(map), OP_EQ, 389);
+  DIGESTMAP_FOREACH(map, k, void *, v) {
+    tt_int_op(((int)(intptr_t)v) & 1, OP_EQ, 0);
+  } DIGESTMAP_FOREACH_END;
+
+ done:
+  digestmap_free(map, NULL);
+}
+
 /** Run unit tests for fp_pair-to-void* map functions */
 static void
 test_container_fp_pair_map(void *arg)
@@ -1226,6 +1390,97 @@ test_container_smartlist_strings_eq(void *arg)
   smartlist_free(sl2);
 }
 
+static void
+test_container_slottable(void *arg)
+{
+  slottable_t *table = slottable_new();
+  int objs[100];
+  uint64_t handles[100], old_handle;
+  int i;
+  (void)arg;
+
+  tt_ptr_op(slottable_get(table, 0), OP_EQ, NULL);
+  tt_ptr_op(slottable_get(table, 12345), OP_EQ, NULL);
+
+  /* Add enough to make the table grow. */
+  for (i = 0; i < 100; ++i) {
+    handles[i] = slottable_add(table, &objs[i]);
+    tt_u64_op(handles[i], OP_NE, 0);
+  }
+  tt_int_op(slottable_size(table), OP_EQ, 100);
+  for (i = 0; i < 100; ++i)
+    tt_ptr_op(slottable_get(table, handles[i]), OP_EQ, &objs[i]);
+
+  /* Removing an object invalidates its handle. */
+  tt_ptr_op(slottable_remove(table, handles[7]), OP_EQ, &objs[7]);
+  tt_ptr_op(slottable_get(table, handles[7]), OP_EQ, NULL);
+  tt_ptr_op(slottable_remove(table, handles[7]), OP_EQ, NULL);
+  tt_int_op(slottable_size(table), OP_EQ, 99);
+
+  /* The slot gets reused, but the old handle still doesn't match. */
+  old_handle = handles[7];
+  handles[7] = slottable_add(table, &objs[7]);
+  tt_u64_op(handles[7], OP_NE, old_handle);
+  tt_u64_op(handles[7] & ((1<<SLOTTABLE_INDEX_BITS)-1), OP_EQ,
+            old_handle & ((1<<SLOTTABLE_INDEX_BITS)-1));
+  tt_ptr_op(slottable_get(table, old_handle), OP_EQ, NULL);
+  tt_ptr_op(slottable_get(table, handles[7]), OP_EQ, &objs[7]);
+
+  /* Remove everything, then fill up again: every handle is new. */
+  for (i = 0; i < 100; ++i)
+    tt_ptr_op(slottable_remove(table, handles[i]), OP_EQ, &objs[i]);
+  tt_int_op(slottable_size(table), OP_EQ, 0);
+  for (i = 0; i < 100; ++i) {
+    tt_ptr_op(slottable_get(table, handles[i]), OP_EQ, NULL);
+    old_handle = slottable_add(table, &objs[i]);
+    tt_u64_op(old_handle, OP_NE, handles[i]);
+    tt_ptr_op(slottable_get(table, old_handle), OP_EQ, &objs[i]);
+  }
+  tt_int_op(slottable_size(table), OP_EQ, 100);
+
+ done:
+  slottable_free(table);
+}
+
+static void
+test_container_intern_string(void *arg)
+{
+  char buf[16];
+  const char *a1 = NULL, *a2 = NULL, *b = NULL;
+  (void)arg;
+
+  tt_int_op(tor_intern_string_n_entries(), OP_EQ, 0);
+  strlcpy(buf, "Tor 0.3.0.1", sizeof(buf));
+  a1 = tor_intern_string(buf);
+  tt_ptr_op(a1, OP_NE, buf);
+  tt_str_op(a1, OP_EQ, "Tor 0.3.0.1");
+
+  /* Equal strings share storage; different ones don't. */
+  a2 = tor_intern_string("Tor 0.3.0.1");
+  tt_ptr_op(a1, OP_EQ, a2);
+  b = tor_intern_string("Tor 0.2.9.8");
+  tt_ptr_op(b, OP_NE, a1);
+  tt_int_op(tor_intern_string_n_entries(), OP_EQ, 2);
+
+  /* A string stays until its last reference is released. */
+  tor_intern_string_release(a2);
+  a2 = NULL;
+  tt_str_op(a1, OP_EQ, "Tor 0.3.0.1");
+  tt_int_op(tor_intern_string_n_entries(), OP_EQ, 2);
+  tor_intern_string_release(a1);
+  a1 = NULL;
+  tt_int_op(tor_intern_string_n_entries(), OP_EQ, 1);
+  tor_intern_string_release(b);
+  b = NULL;
+  tt_int_op(tor_intern_string_n_entries(), OP_EQ, 0);
+  tor_intern_string_release(NULL);
+
+ done:
+  tor_intern_string_release(a1);
+  tor_intern_string_release(a2);
+  tor_intern_string_release(b);
+}
+
 #define CONTAINER_LEGACY(name)                                          \
   { #name, test_container_ ## name , 0, NULL, NULL }
 
@@ -1237,6 +1492,7 @@ struct testcase_t container_tests[] = {
   CONTAINER_LEGACY(smartlist_strings),
   CONTAINER_LEGACY(smartlist_overlap),
   CONTAINER_LEGACY(smartlist_digests),
+  CONTAINER(smartlist_digests_bulk, 0),
   CONTAINER_LEGACY(smartlist_join),
   CONTAINER_LEGACY(smartlist_pos),
   CONTAINER(smartlist_ints_eq, 0),
@@ -1246,10 +1502,13 @@ struct testcase_t container_tests[] = {
   CONTAINER_LEGACY(pqueue),
   CONTAINER_LEGACY(order_functions),
   CONTAINER(di_map, 0),
+  CONTAINER(digestmap, 0),
   CONTAINER_LEGACY(fp_pair_map),
   CONTAINER(smartlist_most_frequent, 0),
   CONTAINER(smartlist_sort_ptrs, 0),
   CONTAINER(smartlist_strings_eq, 0),
+  CONTAINER(slottable, 0),
+  CONTAINER(intern_string, TT_FORK),
   END_OF_TESTCASES
 };
 
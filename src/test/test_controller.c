@@ -1,8 +1,11 @@
 /* Copyright (c) 2015-2016, The Tor Project, Inc. */
 /* See LICENSE for licensing information */
 
+#define CONNECTION_PRIVATE
 #define CONTROL_PRIVATE
 #include "or.h"
+#include "buffers.h"
+#include "connection.h"
 #include "control.h"
 #include "entrynodes.h"
 #include "networkstatus.h"
@@ -1326,6 +1329,60 @@ test_download_status_bridge(void *arg)
   return;
 }
 
+static buf_t *escaped_out = NULL;
+
+static void
+connection_write_to_buf_escaped_mock(const char *string, size_t len,
+                                     connection_t *conn, int zlib)
+{
+  (void)conn;
+  (void)zlib;
+  write_to_buf(string, len, escaped_out);
+}
+
+static void
+test_write_escaped_data_to_conn(void *arg)
+{
+  const char *inputs[] = {
+    "", "a", "\n", "abc\r\n", "abc\n.def\n..\r\n.", "x\ny\n\n",
+  };
+  char *big = NULL, *esc = NULL, *got = NULL;
+  control_connection_t *conn = NULL;
+  size_t esc_len, i;
+  (void)arg;
+
+  escaped_out = buf_new();
+  MOCK(connection_write_to_buf_impl_, connection_write_to_buf_escaped_mock);
+  conn = control_connection_new(AF_INET);
+
+  /* A document larger than the escaping chunk, with lines to stuff. */
+  big = tor_malloc_zero(20001);
+  for (i = 0; i < 20000; ++i)
+    big[i] = (i % 97 == 96) ? '\n' : ((i % 97 == 0) ? '.' : 'r');
+
+  for (i = 0; i <= ARRAY_LENGTH(inputs); ++i) {
+    const char *in = (i < ARRAY_LENGTH(inputs)) ? inputs[i] : big;
+    esc_len = write_escaped_data(in, strlen(in), &esc);
+    write_escaped_data_to_conn(in, strlen(in), conn);
+    tt_int_op(buf_datalen(escaped_out), OP_EQ, esc_len);
+    got = tor_malloc_zero(esc_len + 1);
+    fetch_from_buf(got, esc_len, escaped_out);
+    tt_mem_op(got, OP_EQ, esc, esc_len);
+    tor_free(got);
+    tor_free(esc);
+  }
+
+ done:
+  UNMOCK(connection_write_to_buf_impl_);
+  if (conn)
+    connection_free_(TO_CONN(conn));
+  buf_free(escaped_out);
+  escaped_out = NULL;
+  tor_free(big);
+  tor_free(esc);
+  tor_free(got);
+}
+
 struct testcase_t controller_tests[] = {
   { "add_onion_helper_keyarg", test_add_onion_helper_keyarg, 0, NULL, NULL },
   { "rend_service_parse_port_config", test_rend_service_parse_port_config, 0,
@@ -1338,6 +1395,8 @@ struct testcase_t controller_tests[] = {
     NULL },
   { "download_status_desc", test_download_status_desc, 0, NULL, NULL },
   { "download_status_bridge", test_download_status_bridge, 0, NULL, NULL },
+  { "write_escaped_data_to_conn", test_write_escaped_data_to_conn, 0, NULL,
+    NULL },
   END_OF_TESTCASES
 };
 
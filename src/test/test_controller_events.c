@@ -4,11 +4,16 @@
 #define CONNECTION_PRIVATE
 #define TOR_CHANNEL_INTERNAL_
 #define CONTROL_PRIVATE
+#define CIRCUITLIST_PRIVATE
+#define CPUWORKER_PRIVATE
 #include "or.h"
 #include "channel.h"
 #include "channeltls.h"
+#include "circuitlist.h"
 #include "connection.h"
 #include "control.h"
+#include "cpuworker.h"
+#include "main.h"
 #include "test.h"
 
 static void
@@ -391,6 +396,176 @@ test_cntev_event_mask(void *arg)
   ;
 }
 
+/** Writes recorded by connection_write_to_buf_mock, as
+ * "address-of-conn:text". */
+static smartlist_t *flush_writes = NULL;
+
+static void
+connection_write_to_buf_mock(const char *string, size_t len,
+                             connection_t *conn, int zlib)
+{
+  (void)zlib;
+  smartlist_add_asprintf(flush_writes, "%p:%.*s", conn, (int)len, string);
+}
+
+static void
+test_cntev_flush_batches(void *arg)
+{
+  control_connection_t *conns[3] = { NULL, NULL, NULL };
+  char *expected = NULL;
+  int i;
+  (void)arg;
+
+  flush_writes = smartlist_new();
+  MOCK(connection_write_to_buf_impl_, connection_write_to_buf_mock);
+
+  for (i = 0; i < 3; ++i) {
+    conns[i] = control_connection_new(AF_INET);
+    TO_CONN(conns[i])->state = CONTROL_CONN_STATE_OPEN;
+    smartlist_add(get_connection_array(), conns[i]);
+  }
+  conns[0]->event_mask = conns[1]->event_mask =
+    EVENT_MASK_(EVENT_BANDWIDTH_USED) |
+    EVENT_MASK_(EVENT_STREAM_BANDWIDTH_USED);
+  conns[2]->event_mask = EVENT_MASK_(EVENT_STREAM_BANDWIDTH_USED);
+  control_testing_set_global_event_mask(conns[0]->event_mask);
+
+  queue_control_event_string(EVENT_BANDWIDTH_USED, tor_strdup("650 BW 1\r\n"));
+  queue_control_event_string(EVENT_STREAM_BANDWIDTH_USED,
+                             tor_strdup("650 STREAM_BW 1\r\n"));
+  queue_control_event_string(EVENT_BANDWIDTH_USED, tor_strdup("650 BW 2\r\n"));
+  queued_events_flush_all(0);
+
+  /* One write per controller, with its events in order. */
+  tt_int_op(smartlist_len(flush_writes), OP_EQ, 3);
+  for (i = 0; i < 2; ++i) {
+    tor_asprintf(&expected, "%p:650 BW 1\r\n650 STREAM_BW 1\r\n650 BW 2\r\n",
+                 TO_CONN(conns[i]));
+    tt_str_op(smartlist_get(flush_writes, i), OP_EQ, expected);
+    tor_free(expected);
+  }
+  tor_asprintf(&expected, "%p:650 STREAM_BW 1\r\n", TO_CONN(conns[2]));
+  tt_str_op(smartlist_get(flush_writes, 2), OP_EQ, expected);
+  tor_free(expected);
+
+  /* Nothing queued: nothing written. */
+  SMARTLIST_FOREACH(flush_writes, char *, cp, tor_free(cp));
+  smartlist_clear(flush_writes);
+  queued_events_flush_all(0);
+  tt_int_op(smartlist_len(flush_writes), OP_EQ, 0);
+
+ done:
+  UNMOCK(connection_write_to_buf_impl_);
+  for (i = 0; i < 3; ++i) {
+    if (conns[i]) {
+      smartlist_remove(get_connection_array(), conns[i]);
+      connection_free_(TO_CONN(conns[i]));
+    }
+  }
+  tor_free(expected);
+  SMARTLIST_FOREACH(flush_writes, char *, cp, tor_free(cp));
+  smartlist_free(flush_writes);
+}
+
+/** Events queued by queue_control_event_string_mock. */
+static smartlist_t *queued_strings = NULL;
+
+static void
+queue_control_event_string_mock(uint16_t event, char *msg)
+{
+  (void)event;
+  smartlist_add(queued_strings, msg);
+}
+
+static void
+test_cntev_circ_bw_batched(void *arg)
+{
+  origin_circuit_t *circs[3] = { NULL, NULL, NULL };
+  char *expected = NULL;
+  int i;
+  (void)arg;
+
+  queued_strings = smartlist_new();
+  MOCK(queue_control_event_string, queue_control_event_string_mock);
+  control_testing_set_global_event_mask(
+                                 EVENT_MASK_(EVENT_CIRC_BANDWIDTH_USED));
+
+  for (i = 0; i < 3; ++i) {
+    circs[i] = origin_circuit_new();
+    circs[i]->base_.purpose = CIRCUIT_PURPOSE_C_GENERAL;
+  }
+  circs[0]->n_read_circ_bw = 10;
+  circs[0]->n_written_circ_bw = 20;
+  circs[2]->n_read_circ_bw = 30;
+
+  /* Both circuits with traffic go out as a single queued event. */
+  control_event_circ_bandwidth_used();
+  tt_int_op(smartlist_len(queued_strings), OP_EQ, 1);
+  tor_asprintf(&expected,
+               "650 CIRC_BW ID=%u READ=10 WRITTEN=20\r\n"
+               "650 CIRC_BW ID=%u READ=30 WRITTEN=0\r\n",
+               (unsigned)circs[0]->global_identifier,
+               (unsigned)circs[2]->global_identifier);
+  tt_str_op(smartlist_get(queued_strings, 0), OP_EQ, expected);
+  tt_int_op(circs[0]->n_read_circ_bw, OP_EQ, 0);
+
+  /* No traffic since: nothing queued. */
+  control_event_circ_bandwidth_used();
+  tt_int_op(smartlist_len(queued_strings), OP_EQ, 1);
+
+ done:
+  UNMOCK(queue_control_event_string);
+  for (i = 0; i < 3; ++i)
+    circuit_free(TO_CIRCUIT(circs[i]));
+  tor_free(expected);
+  SMARTLIST_FOREACH(queued_strings, char *, cp, tor_free(cp));
+  smartlist_free(queued_strings);
+}
+
+static void
+test_cntev_cpuworker_timing(void *arg)
+{
+  const char *ev;
+  char *s = NULL;
+  (void)arg;
+
+  queued_strings = smartlist_new();
+  MOCK(queue_control_event_string, queue_control_event_string_mock);
+  control_testing_set_global_event_mask(EVENT_MASK_(EVENT_CPUWORKER_TIMING));
+
+  /* 3 usec waiting, 1 msec running, and a reply handled at once. */
+  cpuworker_note_handshake_timing(ONION_HANDSHAKE_TYPE_NTOR, 3000, 1000000,
+                                  0);
+  control_event_cpuworker_timing();
+  tt_int_op(smartlist_len(queued_strings), OP_EQ, 1);
+  ev = smartlist_get(queued_strings, 0);
+  tt_assert(strstr(ev, "650 CPUWORKER_TIMING Type=ntor Phase=queue "
+                   "Count=1 "));
+  tt_assert(strstr(ev, " Buckets=0,0,1,0,"));
+  tt_assert(strstr(ev, "650 CPUWORKER_TIMING Type=ntor Phase=run "
+                   "Count=1 "));
+  tt_assert(strstr(ev, " Max=1000 Buckets=0,0,0,0,0,0,0,0,0,0,1,"));
+  tt_assert(strstr(ev, "650 CPUWORKER_TIMING Type=ntor Phase=reply "
+                   "Count=1 "));
+  /* We don't report types with nothing to say. */
+  tt_assert(!strstr(ev, "Type=tap"));
+
+  /* Each event covers one interval... */
+  control_event_cpuworker_timing();
+  tt_int_op(smartlist_len(queued_strings), OP_EQ, 1);
+
+  /* ...but GETINFO covers everything. */
+  s = cpuworker_timing_format();
+  tt_assert(strstr(s, "ntor run count=1 mean-usec=1000 "));
+  tt_assert(strstr(s, "tap queue count=0 "));
+
+ done:
+  UNMOCK(queue_control_event_string);
+  tor_free(s);
+  SMARTLIST_FOREACH(queued_strings, char *, cp, tor_free(cp));
+  smartlist_free(queued_strings);
+}
+
 #define TEST(name, flags)                                               \
   { #name, test_cntev_ ## name, flags, 0, NULL }
 
@@ -401,6 +576,9 @@ struct testcase_t controller_event_tests[] = {
   TEST(append_cell_stats, TT_FORK),
   TEST(format_cell_stats, TT_FORK),
   TEST(event_mask, TT_FORK),
+  TEST(flush_batches, TT_FORK),
+  TEST(circ_bw_batched, TT_FORK),
+  TEST(cpuworker_timing, TT_FORK),
   END_OF_TESTCASES
 };
 
@@ -6,6 +6,7 @@
 #include "orconfig.h"
 #define CRYPTO_CURVE25519_PRIVATE
 #define CRYPTO_PRIVATE
+#define CRYPTO_RAND_FAST_PRIVATE
 #include "or.h"
 #include "test.h"
 #include "aes.h"
@@ -13,10 +14,17 @@
 #include "siphash.h"
 #include "crypto_curve25519.h"
 #include "crypto_ed25519.h"
+#include "compat_openssl.h"
+#include "crypto_async.h"
+#include "crypto_rand_fast.h"
 #include "ed25519_vectors.inc"
 
 #include <openssl/evp.h>
 #include <openssl/rand.h>
+#if defined(OPENSSL_1_1_API) && !defined(OPENSSL_NO_ASYNC)
+#define HAVE_OPENSSL_ASYNC
+#include <openssl/async.h>
+#endif
 
 /** Run unit tests for Diffie-Hellman functionality. */
 static void
@@ -331,6 +339,143 @@ test_crypto_rng_strongest(void *arg)
 #undef N
 }
 
+static void
+test_crypto_rng_fast(void *arg)
+{
+#define N 128
+  crypto_fast_rng_t *rng = NULL, *rng2 = NULL;
+  uint8_t combine_and[N];
+  uint8_t combine_or[N];
+  uint8_t out[N], out2[N];
+  int i, j, got_smallest = 0, got_largest = 0;
+  (void)arg;
+
+  memset(combine_and, 0xff, N);
+  memset(combine_or, 0, N);
+
+  rng = crypto_fast_rng_new();
+  rng2 = crypto_fast_rng_new();
+
+  /* Independently seeded generators don't agree. */
+  crypto_fast_rng_getbytes(rng, out, N);
+  crypto_fast_rng_getbytes(rng2, out2, N);
+  tt_mem_op(out, OP_NE, out2, N);
+  tt_u64_op(crypto_fast_rng_bytes_left(rng), OP_EQ, FAST_RNG_BUFLEN - N);
+
+  /* Output looks random, including across refills and reseeds. */
+  for (i = 0; i < (FAST_RNG_BUFLEN / N) * FAST_RNG_RESEED_AFTER; ++i) {
+    crypto_fast_rng_getbytes(rng, out, N);
+    for (j = 0; j < N; ++j) {
+      combine_and[j] &= out[j];
+      combine_or[j] |= out[j];
+    }
+  }
+  for (j = 0; j < N; ++j) {
+    tt_int_op(combine_and[j], OP_EQ, 0);
+    tt_int_op(combine_or[j], OP_EQ, 0xff);
+  }
+  /* That took FAST_RNG_RESEED_AFTER + 1 refills, so we reseeded once. */
+  tt_int_op(crypto_fast_rng_refills_till_reseed(rng), OP_EQ,
+            FAST_RNG_RESEED_AFTER - 1);
+
+  /* Requests that straddle the end of the buffer work too. */
+  crypto_fast_rng_getbytes(rng, out, N - 3);
+  for (i = 0; i < FAST_RNG_BUFLEN / N; ++i)
+    crypto_fast_rng_getbytes(rng, out, N);
+
+  /* The per-thread convenience functions stay in range. */
+  for (i = 0; i < 1000; ++i) {
+    int x = crypto_fast_rand_int(4);
+    uint64_t y = crypto_fast_rand_uint64(UINT64_C(10000000000));
+    tt_int_op(x, OP_GE, 0);
+    tt_int_op(x, OP_LT, 4);
+    tt_u64_op(y, OP_LT, UINT64_C(10000000000));
+    if (x == 0)
+      got_smallest = 1;
+    if (x == 3)
+      got_largest = 1;
+  }
+  tt_assert(got_smallest);
+  tt_assert(got_largest);
+
+ done:
+  crypto_fast_rng_free(rng);
+  crypto_fast_rng_free(rng2);
+#undef N
+}
+
+/** Shared record of events for test_crypto_async_batch. */
+static int async_events[16];
+static int n_async_events = 0;
+
+/** Helper for test_crypto_async_batch: record our start, pause if we are
+ * in an async job, record our end, and return twice our argument. */
+static int
+async_batch_fn(void *arg)
+{
+  int id = *(int *)arg;
+  async_events[n_async_events++] = id * 2;
+#ifdef HAVE_OPENSSL_ASYNC
+  if (ASYNC_get_current_job())
+    ASYNC_pause_job();
+#endif
+  async_events[n_async_events++] = id * 2 + 1;
+  return id * 2;
+}
+
+static void
+test_crypto_async_batch(void *arg)
+{
+  int ids[3] = { 0, 1, 2 };
+  void *args[3] = { &ids[0], &ids[1], &ids[2] };
+  int results[3];
+  (void)arg;
+
+  /* Disabled: the calls run one after another. */
+  tt_int_op(crypto_async_set_enabled(0), OP_EQ, 0);
+  tt_int_op(crypto_async_run_batch(async_batch_fn, args, results, 3),
+            OP_EQ, 0);
+  tt_int_op(n_async_events, OP_EQ, 6);
+  tt_int_op(async_events[0], OP_EQ, 0);
+  tt_int_op(async_events[1], OP_EQ, 1);
+  tt_int_op(async_events[2], OP_EQ, 2);
+  tt_int_op(async_events[5], OP_EQ, 5);
+  tt_int_op(results[0], OP_EQ, 0);
+  tt_int_op(results[2], OP_EQ, 4);
+
+  if (!crypto_async_is_supported()) {
+    tt_int_op(crypto_async_set_enabled(1), OP_EQ, -1);
+    tt_assert(!crypto_async_is_enabled());
+    tt_skip();
+  }
+
+  /* Enabled: every call starts before any of them finishes. */
+  tt_int_op(crypto_async_set_enabled(1), OP_EQ, 0);
+  tt_assert(crypto_async_is_enabled());
+  n_async_events = 0;
+  memset(results, 0, sizeof(results));
+  tt_int_op(crypto_async_run_batch(async_batch_fn, args, results, 3),
+            OP_EQ, 3);
+  tt_int_op(n_async_events, OP_EQ, 6);
+  tt_int_op(async_events[0], OP_EQ, 0);
+  tt_int_op(async_events[1], OP_EQ, 2);
+  tt_int_op(async_events[2], OP_EQ, 4);
+  tt_int_op(async_events[3], OP_EQ, 1);
+  tt_int_op(async_events[5], OP_EQ, 5);
+  tt_int_op(results[1], OP_EQ, 2);
+  tt_int_op(results[2], OP_EQ, 4);
+
+  /* We don't need a result array. */
+  n_async_events = 0;
+  tt_int_op(crypto_async_run_batch(async_batch_fn, args, NULL, 3),
+            OP_EQ, 3);
+  tt_int_op(n_async_events, OP_EQ, 6);
+
+ done:
+  crypto_async_set_enabled(0);
+  crypto_async_thread_cleanup();
+}
+
 /* Test for rectifying openssl RAND engine. */
 static void
 test_crypto_rng_engine(void *arg)
@@ -696,8 +841,21 @@ test_crypto_sha(void *arg)
   crypto_digest_get_digest(d1, d_out1, DIGEST_LEN);
   crypto_digest(d_out2, "abcdef", 6);
   tt_mem_op(d_out1,OP_EQ, d_out2, DIGEST_LEN);
-  crypto_digest_free(d1);
   crypto_digest_free(d2);
+  d2 = NULL;
+
+  /* Checkpoint and restore without allocating. */
+  {
+    crypto_digest_checkpoint_t ck;
+    crypto_digest_checkpoint(&ck, d1);
+    crypto_digest_add_bytes(d1, "ghijkl", 6);
+    crypto_digest_restore(d1, &ck);
+    crypto_digest_add_bytes(d1, "mno", 3);
+    crypto_digest_get_digest(d1, d_out1, DIGEST_LEN);
+    crypto_digest(d_out2, "abcdefmno", 9);
+    tt_mem_op(d_out1,OP_EQ, d_out2, DIGEST_LEN);
+  }
+  crypto_digest_free(d1);
 
   /* Incremental digest code with sha256 */
   d1 = crypto_digest256_new(DIGEST_SHA256);
@@ -717,8 +875,19 @@ test_crypto_sha(void *arg)
   crypto_digest_get_digest(d1, d_out1, DIGEST256_LEN);
   crypto_digest256(d_out2, "abcdef", 6, DIGEST_SHA256);
   tt_mem_op(d_out1,OP_EQ, d_out2, DIGEST256_LEN);
-  crypto_digest_free(d1);
   crypto_digest_free(d2);
+  d2 = NULL;
+  {
+    crypto_digest_checkpoint_t ck;
+    crypto_digest_checkpoint(&ck, d1);
+    crypto_digest_add_bytes(d1, "ghijkl", 6);
+    crypto_digest_restore(d1, &ck);
+    crypto_digest_add_bytes(d1, "mno", 3);
+    crypto_digest_get_digest(d1, d_out1, DIGEST256_LEN);
+    crypto_digest256(d_out2, "abcdefmno", 9, DIGEST_SHA256);
+    tt_mem_op(d_out1,OP_EQ, d_out2, DIGEST256_LEN);
+  }
+  crypto_digest_free(d1);
 
   /* Incremental digest code with sha512 */
   d1 = crypto_digest512_new(DIGEST_SHA512);
@@ -1582,6 +1751,90 @@ test_crypto_formats(void *arg)
   tor_free(data3);
 }
 
+/** Make sure that batched in-place encryption matches encrypting each
+ * buffer in turn. */
+static void
+test_crypto_aes_multi(void *arg)
+{
+  crypto_cipher_t *env1 = NULL, *env2 = NULL;
+  char key[CIPHER_KEY_LEN];
+  char *bufs1[20], *bufs2[20];
+  const size_t lens[] = { 1, 16, 17, 509, 2100 };
+  int i, j;
+  int use_evp = !strcmp(arg,"evp");
+  evaluate_evp_for_aes(use_evp);
+
+  memset(bufs1, 0, sizeof(bufs1));
+  memset(bufs2, 0, sizeof(bufs2));
+  for (i = 0; i < 20; ++i) {
+    bufs1[i] = tor_malloc(2100);
+    bufs2[i] = tor_malloc(2100);
+    crypto_rand(bufs1[i], 2100);
+    memcpy(bufs2[i], bufs1[i], 2100);
+  }
+
+  crypto_rand(key, sizeof(key));
+  env1 = crypto_cipher_new(key);
+  env2 = crypto_cipher_new(key);
+
+  for (j = 0; j < (int)ARRAY_LENGTH(lens); ++j) {
+    for (i = 0; i < 20; ++i)
+      crypto_cipher_crypt_inplace(env1, bufs1[i], lens[j]);
+    crypto_cipher_crypt_inplace_multi(env2, bufs2, 20, lens[j]);
+    for (i = 0; i < 20; ++i)
+      tt_mem_op(bufs1[i], OP_EQ, bufs2[i], 2100);
+  }
+
+  /* An empty batch must leave the stream position alone. */
+  crypto_cipher_crypt_inplace_multi(env2, bufs2, 0, 509);
+  crypto_cipher_crypt_inplace(env1, bufs1[0], 509);
+  crypto_cipher_crypt_inplace_multi(env2, bufs2, 1, 509);
+  tt_mem_op(bufs1[0], OP_EQ, bufs2[0], 509);
+
+ done:
+  crypto_cipher_free(env1);
+  crypto_cipher_free(env2);
+  for (i = 0; i < 20; ++i) {
+    tor_free(bufs1[i]);
+    tor_free(bufs2[i]);
+  }
+}
+
+/** Make sure that whichever AES implementation we pick at startup still
+ * gives the right answers, and that we report what we measured. */
+static void
+test_crypto_aes_select_implementation(void *arg)
+{
+  /* Encrypting an all-zero block with an all-zero 128-bit AES key, twice,
+   * with the counter starting at zero. */
+  static const char expected[] =
+    "66e94bd4ef8a2c3b884cfa59ca342b2e58e2fccefa7e3061367f1d57a4e7455a";
+  const char *name;
+  aes_cnt_cipher_t *cipher = NULL;
+  uint8_t zero[16];
+  char data[32];
+  char *mem_op_hex_tmp = NULL;
+  (void)arg;
+
+  aes_select_implementation();
+  name = aes_get_implementation_name();
+  tt_assert(!strcmp(name, "openssl-aes-block") ||
+            !strcmp(name, "openssl-evp-block") ||
+            !strcmp(name, "openssl-evp-ctr"));
+  tt_u64_op(aes_get_measured_throughput(), OP_GT, 0);
+
+  memset(zero, 0, sizeof(zero));
+  memset(data, 0, sizeof(data));
+  cipher = aes_new_cipher(zero, zero, 128);
+  aes_crypt_inplace(cipher, data, 7);
+  aes_crypt_inplace(cipher, data + 7, sizeof(data) - 7);
+  test_memeq_hex(data, expected);
+
+ done:
+  aes_cipher_free(cipher);
+  tor_free(mem_op_hex_tmp);
+}
+
 /** Test AES-CTR encryption and decryption with IV. */
 static void
 test_crypto_aes_iv(void *arg)
@@ -2894,6 +3147,8 @@ struct testcase_t crypto_tests[] = {
   CRYPTO_LEGACY(rng),
   { "rng_range", test_crypto_rng_range, 0, NULL, NULL },
   { "rng_engine", test_crypto_rng_engine, TT_FORK, NULL, NULL },
+  { "rng_fast", test_crypto_rng_fast, 0, NULL, NULL },
+  { "async_batch", test_crypto_async_batch, TT_FORK, NULL, NULL },
   { "rng_strongest", test_crypto_rng_strongest, TT_FORK, NULL, NULL },
   { "rng_strongest_nosyscall", test_crypto_rng_strongest, TT_FORK,
     &passthrough_setup, (void*)"nosyscall" },
@@ -2904,6 +3159,8 @@ struct testcase_t crypto_tests[] = {
   { "openssl_version", test_crypto_openssl_version, TT_FORK, NULL, NULL },
   { "aes_AES", test_crypto_aes128, TT_FORK, &passthrough_setup, (void*)"aes" },
   { "aes_EVP", test_crypto_aes128, TT_FORK, &passthrough_setup, (void*)"evp" },
+  { "aes_select_implementation", test_crypto_aes_select_implementation,
+    TT_FORK, NULL, NULL },
   { "aes128_ctr_testvec", test_crypto_aes_ctr_testvec, 0,
     &passthrough_setup, (void*)"128" },
   { "aes192_ctr_testvec", test_crypto_aes_ctr_testvec, 0,
@@ -2919,6 +3176,10 @@ struct testcase_t crypto_tests[] = {
   { "sha3", test_crypto_sha3, TT_FORK, NULL, NULL},
   { "sha3_xof", test_crypto_sha3_xof, TT_FORK, NULL, NULL},
   CRYPTO_LEGACY(dh),
+  { "aes_multi_AES", test_crypto_aes_multi, TT_FORK, &passthrough_setup,
+    (void*)"aes" },
+  { "aes_multi_EVP", test_crypto_aes_multi, TT_FORK, &passthrough_setup,
+    (void*)"evp" },
   { "aes_iv_AES", test_crypto_aes_iv, TT_FORK, &passthrough_setup,
     (void*)"aes" },
   { "aes_iv_EVP", test_crypto_aes_iv, TT_FORK, &passthrough_setup,
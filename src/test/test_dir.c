@@ -19,7 +19,9 @@
 #include "or.h"
 #include "confparse.h"
 #include "config.h"
+#include "cpuworker.h"
 #include "crypto_ed25519.h"
+#include "dircollate.h"
 #include "directory.h"
 #include "dirserv.h"
 #include "dirvote.h"
@@ -36,6 +38,7 @@
 #include "test_dir_common.h"
 #include "torcert.h"
 #include "relay.h"
+#include "rephist.h"
 #include "log_test_helpers.h"
 
 #define NS_MODULE dir
@@ -148,7 +151,7 @@ test_dir_formats(void *arg)
   r1->bandwidthcapacity = 10000;
   r1->exit_policy = NULL;
   r1->nickname = tor_strdup("Magri");
-  r1->platform = tor_strdup(platform);
+  r1->platform = tor_intern_string(platform);
 
   ex1 = tor_malloc_zero(sizeof(addr_policy_t));
   ex2 = tor_malloc_zero(sizeof(addr_policy_t));
@@ -174,7 +177,7 @@ test_dir_formats(void *arg)
                                          &kp2.pubkey,
                                          now, 86400,
                                          CERT_FLAG_INCLUDE_SIGNING_KEY);
-  r2->platform = tor_strdup(platform);
+  r2->platform = tor_intern_string(platform);
   r2->cache_info.published_on = 5;
   r2->or_port = 9005;
   r2->dir_port = 0;
@@ -799,6 +802,144 @@ mock_router_get_dl_status(const char *d)
   }
 }
 
+static void
+test_dir_check_signed_digest(void *arg)
+{
+  crypto_pk_t *key = pk_generate(0), *other = pk_generate(1);
+  char digest[DIGEST256_LEN], sig[1024];
+  int siglen;
+  (void) arg;
+
+  crypto_rand(digest, sizeof(digest));
+  siglen = crypto_pk_private_sign(key, sig, sizeof(sig),
+                                  digest, sizeof(digest));
+  tt_int_op(siglen, OP_GT, 0);
+
+  /* Checking twice gives the same answer, whether or not it's cached. */
+  tt_int_op(0, OP_EQ, check_signed_digest(key, digest, sizeof(digest),
+                                           sig, siglen));
+  tt_int_op(0, OP_EQ, check_signed_digest(key, digest, sizeof(digest),
+                                           sig, siglen));
+  /* A shorter digest with the same prefix is a different question. */
+  tt_int_op(0, OP_EQ, check_signed_digest(key, digest, DIGEST_LEN,
+                                           sig, siglen));
+
+  /* A good answer for one key or digest says nothing about another. */
+  tt_int_op(-1, OP_EQ, check_signed_digest(other, digest, sizeof(digest),
+                                            sig, siglen));
+  digest[0] ^= 1;
+  tt_int_op(-2, OP_EQ, check_signed_digest(key, digest, sizeof(digest),
+                                            sig, siglen));
+  tt_int_op(-2, OP_EQ, check_signed_digest(key, digest, sizeof(digest),
+                                            sig, siglen));
+
+ done:
+  crypto_pk_free(key);
+  crypto_pk_free(other);
+}
+
+static void
+test_dir_parse_router_list_ed_batch(void *arg)
+{
+  (void) arg;
+  smartlist_t *invalid = smartlist_new();
+  smartlist_t *dest = smartlist_new();
+  smartlist_t *chunks = smartlist_new();
+  char *list = NULL;
+  const char *cp;
+  char d[DIGEST_LEN];
+
+  /* The ed25519 signatures of these are all checked in one batch; the bad
+   * one must still be picked out and rejected.  (EX_RI_MINIMAL_ED ends with
+   * a blank line that isn't part of the descriptor.) */
+  smartlist_add(chunks, tor_strdup(EX_RI_MINIMAL_ED));
+  smartlist_add(chunks, tor_strdup(EX_RI_ED_BAD_SIG1));
+  smartlist_add(chunks, tor_strdup(EX_RI_MINIMAL));
+  smartlist_add(chunks, tor_strdup(EX_RI_MINIMAL_ED));
+  list = smartlist_join_strings(chunks, "", 0, NULL);
+
+  cp = list;
+  tt_int_op(0,OP_EQ,
+            router_parse_list_from_string(&cp, NULL, dest, SAVED_NOWHERE,
+                                          0, 0, NULL, invalid));
+  tt_int_op(3, OP_EQ, smartlist_len(dest));
+  routerinfo_t *r = smartlist_get(dest, 0);
+  tt_mem_op(r->cache_info.signed_descriptor_body, OP_EQ,
+            EX_RI_MINIMAL_ED, strlen(EX_RI_MINIMAL_ED)-1);
+  r = smartlist_get(dest, 1);
+  tt_mem_op(r->cache_info.signed_descriptor_body, OP_EQ,
+            EX_RI_MINIMAL, strlen(EX_RI_MINIMAL));
+  r = smartlist_get(dest, 2);
+  tt_mem_op(r->cache_info.signed_descriptor_body, OP_EQ,
+            EX_RI_MINIMAL_ED, strlen(EX_RI_MINIMAL_ED)-1);
+
+  tt_int_op(1, OP_EQ, smartlist_len(invalid));
+  tt_int_op(0, OP_EQ, router_get_router_hash(EX_RI_ED_BAD_SIG1,
+                                             strlen(EX_RI_ED_BAD_SIG1), d));
+  tt_mem_op(smartlist_get(invalid, 0), OP_EQ, d, DIGEST_LEN);
+
+ done:
+  tor_free(list);
+  SMARTLIST_FOREACH(dest, routerinfo_t *, rt, routerinfo_free(rt));
+  smartlist_free(dest);
+  SMARTLIST_FOREACH(invalid, uint8_t *, dig, tor_free(dig));
+  smartlist_free(invalid);
+  SMARTLIST_FOREACH(chunks, char *, chunk, tor_free(chunk));
+  smartlist_free(chunks);
+}
+
+static void
+test_dir_parse_router_list_unchecked(void *arg)
+{
+  (void) arg;
+  smartlist_t *invalid = smartlist_new();
+  smartlist_t *dest = smartlist_new();
+  smartlist_t *chunks = smartlist_new();
+  desc_sig_checks_t *checks = NULL;
+  char *list = NULL;
+  const char *cp;
+  char d[DIGEST_LEN];
+
+  smartlist_add(chunks, tor_strdup(EX_RI_MINIMAL_ED));
+  smartlist_add(chunks, tor_strdup(EX_RI_ED_BAD_SIG1));
+  smartlist_add(chunks, tor_strdup(EX_RI_MINIMAL));
+  list = smartlist_join_strings(chunks, "", 0, NULL);
+
+  /* Without the ed25519 checks, the bad one gets through parsing... */
+  cp = list;
+  tt_int_op(0,OP_EQ,
+            router_parse_list_from_string_unchecked(&cp, NULL, dest,
+                                                    SAVED_NOWHERE, 0, 0,
+                                                    NULL, invalid, &checks));
+  tt_assert(checks);
+  tt_int_op(3, OP_EQ, smartlist_len(dest));
+  tt_int_op(0, OP_EQ, smartlist_len(invalid));
+
+  /* ...until we run them and act on the results. */
+  desc_sig_checks_run(checks);
+  desc_sig_checks_finish(checks, dest, invalid);
+  tt_int_op(2, OP_EQ, smartlist_len(dest));
+  routerinfo_t *r = smartlist_get(dest, 0);
+  tt_mem_op(r->cache_info.signed_descriptor_body, OP_EQ,
+            EX_RI_MINIMAL_ED, strlen(EX_RI_MINIMAL_ED)-1);
+  r = smartlist_get(dest, 1);
+  tt_mem_op(r->cache_info.signed_descriptor_body, OP_EQ,
+            EX_RI_MINIMAL, strlen(EX_RI_MINIMAL));
+  tt_int_op(1, OP_EQ, smartlist_len(invalid));
+  tt_int_op(0, OP_EQ, router_get_router_hash(EX_RI_ED_BAD_SIG1,
+                                             strlen(EX_RI_ED_BAD_SIG1), d));
+  tt_mem_op(smartlist_get(invalid, 0), OP_EQ, d, DIGEST_LEN);
+
+ done:
+  tor_free(list);
+  SMARTLIST_FOREACH(dest, routerinfo_t *, rt, routerinfo_free(rt));
+  smartlist_free(dest);
+  SMARTLIST_FOREACH(invalid, uint8_t *, dig, tor_free(dig));
+  smartlist_free(invalid);
+  SMARTLIST_FOREACH(chunks, char *, chunk, tor_free(chunk));
+  smartlist_free(chunks);
+}
+
 static void
 test_dir_load_routers(void *arg)
 {
@@ -1919,6 +2060,7 @@ test_a_networkstatus(
   char *consensus_text2=NULL, *consensus_text3=NULL;
   char *consensus_text_md2=NULL, *consensus_text_md3=NULL;
   char *consensus_text_md=NULL;
+  char *bodies[N_CONSENSUS_FLAVORS] = { NULL, NULL };
   networkstatus_t *con2=NULL, *con_md2=NULL, *con3=NULL, *con_md3=NULL;
   ns_detached_signatures_t *dsig1=NULL, *dsig2=NULL;
 
@@ -2051,6 +2193,13 @@ test_a_networkstatus(
   tt_assert(con_md);
   tt_int_op(con_md->flavor,OP_EQ, FLAV_MICRODESC);
 
+  /* Computing every flavor at once gives the very same documents. */
+  dirvote_compute_consensus_bodies(votes, 3, cert3->identity_key,
+                                   sign_skey_3, "AAAAAAAAAAAAAAAAAAAA",
+                                   sign_skey_leg1, bodies);
+  tt_str_op(bodies[FLAV_NS], OP_EQ, consensus_text);
+  tt_str_op(bodies[FLAV_MICRODESC], OP_EQ, consensus_text_md);
+
   /* Check consensus contents. */
   tt_assert(con->type == NS_TYPE_CONSENSUS);
   tt_int_op(con->published,OP_EQ, 0); /* this field only appears in votes. */
@@ -2257,6 +2406,8 @@ test_a_networkstatus(
   smartlist_free(votes);
   tor_free(consensus_text);
   tor_free(consensus_text_md);
+  tor_free(bodies[FLAV_NS]);
+  tor_free(bodies[FLAV_MICRODESC]);
 
   networkstatus_vote_free(vote);
   networkstatus_vote_free(v1);
@@ -2367,6 +2518,73 @@ test_dir_scale_bw(void *testdata)
   ;
 }
 
+static void
+test_dir_alias_table(void *testdata)
+{
+  int histogram[10];
+  double vals[10] = {3,1,2,4,6,0,7,5,8,9}, total=0;
+  alias_table_t *table = NULL;
+  int i, choice;
+  const int n = 50000;
+  double max_sq_error;
+  (void) testdata;
+
+  /* Same distribution as in random_weighted, but chosen with an alias
+   * table. */
+  memset(histogram,0,sizeof(histogram));
+  for (i=0; i<10; ++i)
+    total += vals[i];
+  table = alias_table_new(vals, 10);
+  tt_int_op(table->n, OP_EQ, 10);
+  tt_u64_op(table->threshold[5], OP_EQ, 0);
+  for (i=0; i<n; ++i) {
+    choice = alias_table_choose(table);
+    tt_int_op(choice, OP_GE, 0);
+    tt_int_op(choice, OP_LT, 10);
+    histogram[choice]++;
+  }
+
+  max_sq_error = 0;
+  for (i=0; i<10; ++i) {
+    int expected = (int)(n*vals[i]/total);
+    double frac_diff = 0, sq;
+    TT_BLATHER(("  %d : %5d vs %5d\n", (int)vals[i], histogram[i], expected));
+    if (expected)
+      frac_diff = (histogram[i] - expected) / ((double)expected);
+    else
+      tt_int_op(histogram[i], OP_EQ, 0);
+
+    sq = frac_diff * frac_diff;
+    if (sq > max_sq_error)
+      max_sq_error = sq;
+  }
+  tt_double_op(max_sq_error, OP_LT, .05);
+  alias_table_free(table);
+
+  /* A singleton is always chosen. */
+  table = alias_table_new(vals, 1);
+  for (i = 0; i < 100; ++i)
+    tt_int_op(alias_table_choose(table), OP_EQ, 0);
+  alias_table_free(table);
+
+  /* All zeros: choose uniformly. */
+  memset(histogram,0,sizeof(histogram));
+  for (i = 0; i < 5; ++i)
+    vals[i] = 0;
+  table = alias_table_new(vals, 5);
+  for (i = 0; i < n; ++i) {
+    choice = alias_table_choose(table);
+    tt_int_op(choice, OP_GE, 0);
+    tt_int_op(choice, OP_LT, 5);
+    histogram[choice]++;
+  }
+  for (i = 0; i < 5; ++i)
+    tt_int_op(histogram[i], OP_GT, n/5 - n/20);
+
+ done:
+  alias_table_free(table);
+}
+
 static void
 test_dir_random_weighted(void *testdata)
 {
@@ -4271,9 +4489,60 @@ test_dir_choose_compression_level(void* data)
   tt_assert(HIGH_COMPRESSION == choose_compression_level(2048-1));
   tt_assert(HIGH_COMPRESSION == choose_compression_level(2048));
 
+  /* When compression keeps the main thread busy, we get cheaper... */
+  tt_int_op(HIGH_COMPRESSION, OP_EQ,
+            compression_level_for_load(HIGH_COMPRESSION, 5, 0));
+  tt_int_op(MEDIUM_COMPRESSION, OP_EQ,
+            compression_level_for_load(HIGH_COMPRESSION, 10, 0));
+  tt_int_op(LOW_COMPRESSION, OP_EQ,
+            compression_level_for_load(HIGH_COMPRESSION, 50, 0));
+  tt_int_op(LOW_COMPRESSION, OP_EQ,
+            compression_level_for_load(LOW_COMPRESSION, 10, 0));
+  /* ...unless bandwidth is what we're short of. */
+  tt_int_op(HIGH_COMPRESSION, OP_EQ,
+            compression_level_for_load(HIGH_COMPRESSION, 50, 1));
+  tt_int_op(MEDIUM_COMPRESSION, OP_EQ,
+            compression_level_for_load(MEDIUM_COMPRESSION, 50, 1));
+
   done: ;
 }
 
+static void
+test_dir_accept_encoding(void *data)
+{
+  static const compress_method_t prefs[] = { ZLIB_METHOD, GZIP_METHOD };
+  unsigned methods;
+  char *accept = NULL;
+  (void)data;
+
+  /* We always offer what we can always decode. */
+  accept = directory_get_accept_encoding();
+  tt_assert(strstr(accept, "deflate"));
+  tt_assert(strstr(accept, "gzip"));
+  tt_assert(!strcmpend(accept, "identity"));
+  tt_int_op(parse_accept_encoding_header(accept) & (1u << ZLIB_METHOD),
+            OP_NE, 0);
+
+  methods = parse_accept_encoding_header("gzip;q=1 , ,x-bogus, identity");
+  tt_int_op(methods, OP_EQ, (1u << GZIP_METHOD) | (1u << NO_METHOD));
+  tt_int_op(GZIP_METHOD, OP_EQ,
+            srv_choose_compression_method(methods, prefs, 2));
+
+  /* If the client accepts nothing we like, a .z URL still means deflate. */
+  tt_int_op(ZLIB_METHOD, OP_EQ,
+            srv_choose_compression_method(1u << NO_METHOD, prefs + 1, 1));
+
+  /* Methods we weren't built with never show up. */
+  methods = parse_accept_encoding_header("x-zstd, x-tor-lzma");
+  tt_int_op(!!(methods & (1u << ZSTD_METHOD)), OP_EQ,
+            tor_compress_supports_method(ZSTD_METHOD));
+  tt_int_op(!!(methods & (1u << LZMA_METHOD)), OP_EQ,
+            tor_compress_supports_method(LZMA_METHOD));
+
+ done:
+  tor_free(accept);
+}
+
 /*
  * Mock check_private_dir(), and always succeed - no need to actually
  * look at or create anything on the filesystem.
@@ -4973,6 +5242,185 @@ test_dir_dump_unparseable_descriptors(void *data)
   return;
 }
 
+/* Work handed to mock_cpuworker_queue_work() and not yet run. */
+#define MAX_MOCK_QUEUED_WORK 4
+static workqueue_reply_t (*queued_work_fn[MAX_MOCK_QUEUED_WORK])(void *,
+                                                                 void *);
+static void (*queued_reply_fn[MAX_MOCK_QUEUED_WORK])(void *);
+static void *queued_work_arg[MAX_MOCK_QUEUED_WORK];
+static int n_queued_work = 0;
+
+static workqueue_entry_t *
+mock_cpuworker_queue_work(workqueue_priority_t priority,
+                          workqueue_reply_t (*fn)(void *, void *),
+                          void (*reply_fn)(void *),
+                          void *arg)
+{
+  (void)priority;
+  if (n_queued_work == MAX_MOCK_QUEUED_WORK)
+    return NULL;
+  queued_work_fn[n_queued_work] = fn;
+  queued_reply_fn[n_queued_work] = reply_fn;
+  queued_work_arg[n_queued_work] = arg;
+  ++n_queued_work;
+  /* Callers only check this for NULL. */
+  return (workqueue_entry_t *)&n_queued_work;
+}
+
+/* Run the <b>idx</b>th piece of queued work, then its reply function, as a
+ * cpuworker and the main loop would. */
+static void
+run_queued_work(int idx)
+{
+  tor_assert(idx < n_queued_work);
+  tor_assert(queued_work_fn[idx]);
+  queued_work_fn[idx](NULL, queued_work_arg[idx]);
+  queued_reply_fn[idx](queued_work_arg[idx]);
+  queued_work_fn[idx] = NULL;
+}
+
+static int write_str_should_fail = 0;
+
+static int
+mock_write_str_to_file_maybe_fail(const char *path, const char *str, int bin)
+{
+  mock_write_str_to_file(path, str, bin);
+  return write_str_should_fail ? -1 : 0;
+}
+
+static void
+test_dir_dump_unparseable_descriptors_async(void *data)
+{
+  const char *test_desc_type = "rugose";
+  const char *test_desc_1 = "It was a terrible, indescribable thing.";
+  const char *test_desc_2 = "Ph'nglui mglw'nafh Cthulhu R'lyeh.";
+  const char *test_desc_3 = "That is not dead which can eternal lie.";
+  uint8_t test_desc_1_hash[DIGEST256_LEN];
+  int i;
+  uint8_t test_desc_2_hash[DIGEST256_LEN];
+  dumped_desc_t *ent;
+  char *desc_1_path = NULL;
+  (void)data;
+
+  /* Room for one of these descriptors in the FIFO, but not two. */
+  mock_options = tor_malloc(sizeof(or_options_t));
+  reset_options(mock_options, &mock_get_options_calls);
+  mock_options->MaxUnparseableDescSizeToLog = 64;
+  MOCK(get_options, mock_get_options);
+  MOCK(check_private_dir, mock_check_private_dir);
+  MOCK(options_get_datadir_fname2_suffix,
+       mock_get_datadir_fname);
+  MOCK(tor_unlink, mock_unlink);
+  mock_unlink_reset();
+  MOCK(write_str_to_file, mock_write_str_to_file_maybe_fail);
+  mock_write_str_to_file_reset();
+  MOCK(cpuworker_queue_work, mock_cpuworker_queue_work);
+  n_queued_work = 0;
+
+  crypto_digest256((char *)test_desc_1_hash, test_desc_1,
+                   strlen(test_desc_1), DIGEST_SHA256);
+  crypto_digest256((char *)test_desc_2_hash, test_desc_2,
+                   strlen(test_desc_2), DIGEST_SHA256);
+
+  dump_desc_fifo_cleanup();
+  tt_u64_op(len_descs_dumped, ==, 0);
+
+  /*
+   * (1) A dump is in the FIFO as soon as we queue it, and the file gets
+   * written when the work runs.
+   */
+  dump_desc(test_desc_1, test_desc_type);
+  tt_int_op(n_queued_work, ==, 1);
+  tt_int_op(write_str_count, ==, 0);
+  tt_u64_op(len_descs_dumped, ==, strlen(test_desc_1));
+  tt_assert(descs_dumped != NULL && smartlist_len(descs_dumped) == 1);
+  ent = smartlist_get(descs_dumped, 0);
+  tt_mem_op(ent->digest_sha256, OP_EQ, test_desc_1_hash, DIGEST256_LEN);
+  tt_ptr_op(ent->pending_write, OP_NE, NULL);
+
+  run_queued_work(0);
+  tt_int_op(write_str_count, ==, 1);
+  tt_mem_op(last_write_str_hash, OP_EQ, test_desc_1_hash, DIGEST256_LEN);
+  tt_str_op(last_write_str_path, OP_EQ, ent->filename);
+  tt_ptr_op(ent->pending_write, OP_EQ, NULL);
+  tt_u64_op(len_descs_dumped, ==, strlen(test_desc_1));
+  tt_int_op(smartlist_len(descs_dumped), ==, 1);
+  tt_int_op(unlinked_count, ==, 0);
+
+  /*
+   * (2) Evicting an entry whose write is still queued doesn't unlink it
+   * right away; the reply does, once the file is there.
+   */
+  dump_desc_fifo_cleanup();
+  mock_write_str_to_file_reset();
+  n_queued_work = 0;
+
+  dump_desc(test_desc_1, test_desc_type);
+  tt_int_op(n_queued_work, ==, 1);
+  desc_1_path = tor_strdup(
+              ((dumped_desc_t *)smartlist_get(descs_dumped, 0))->filename);
+  dump_desc(test_desc_2, test_desc_type);
+  tt_int_op(n_queued_work, ==, 2);
+  tt_u64_op(len_descs_dumped, ==, strlen(test_desc_2));
+  tt_int_op(smartlist_len(descs_dumped), ==, 1);
+  ent = smartlist_get(descs_dumped, 0);
+  tt_mem_op(ent->digest_sha256, OP_EQ, test_desc_2_hash, DIGEST256_LEN);
+  tt_int_op(unlinked_count, ==, 0);
+
+  run_queued_work(0);
+  tt_int_op(write_str_count, ==, 1);
+  tt_int_op(unlinked_count, ==, 1);
+  tt_str_op(last_unlinked_path, OP_EQ, desc_1_path);
+
+  run_queued_work(1);
+  tt_int_op(write_str_count, ==, 2);
+  tt_mem_op(last_write_str_hash, OP_EQ, test_desc_2_hash, DIGEST256_LEN);
+  tt_int_op(unlinked_count, ==, 1);
+  tt_ptr_op(ent->pending_write, OP_EQ, NULL);
+  tt_u64_op(len_descs_dumped, ==, strlen(test_desc_2));
+  tt_int_op(smartlist_len(descs_dumped), ==, 1);
+
+  /*
+   * (3) If the write fails, the entry comes back out of the FIFO.
+   */
+  dump_desc_fifo_cleanup();
+  mock_unlink_reset();
+  mock_write_str_to_file_reset();
+  n_queued_work = 0;
+  write_str_should_fail = 1;
+
+  dump_desc(test_desc_3, test_desc_type);
+  tt_int_op(n_queued_work, ==, 1);
+  tt_u64_op(len_descs_dumped, ==, strlen(test_desc_3));
+  run_queued_work(0);
+  tt_int_op(write_str_count, ==, 1);
+  tt_u64_op(len_descs_dumped, ==, 0);
+  tt_int_op(smartlist_len(descs_dumped), ==, 0);
+  tt_int_op(unlinked_count, ==, 0);
+
+ done:
+  /* Don't leak any work we didn't get around to. */
+  write_str_should_fail = 0;
+  for (i = 0; i < n_queued_work; ++i) {
+    if (queued_work_fn[i])
+      run_queued_work(i);
+  }
+  n_queued_work = 0;
+  dump_desc_fifo_cleanup();
+  tor_free(desc_1_path);
+
+  UNMOCK(cpuworker_queue_work);
+  UNMOCK(tor_unlink);
+  mock_unlink_reset();
+  UNMOCK(write_str_to_file);
+  mock_write_str_to_file_reset();
+  UNMOCK(options_get_datadir_fname2_suffix);
+  UNMOCK(check_private_dir);
+  UNMOCK(get_options);
+  tor_free(mock_options);
+  mock_options = NULL;
+}
+
 /* Variables for reset_read_file_to_str_mock() */
 
 static int enforce_expected_filename = 0;
@@ -5478,6 +5926,299 @@ test_dir_assumed_flags(void *arg)
   routerstatus_free(rs);
 }
 
+static void
+test_dir_tokenize_entries_threaded(void *arg)
+{
+  smartlist_t *chunks = smartlist_new();
+  smartlist_t *jobs = NULL;
+  char *doc = NULL;
+  const char *end = NULL, *expect_start;
+  int i, n_entries = 0, n_good = 0;
+  (void)arg;
+
+  get_options_mutable()->NumCPUs = 4;
+
+  for (i = 0; i < 2000; ++i) {
+    if (i == 1234) {
+      /* Too few arguments to r: this one won't tokenize. */
+      smartlist_add(chunks, tor_strdup("r broken\n"));
+      continue;
+    }
+    smartlist_add_asprintf(chunks,
+        "r router%d hereiswhereyouridentitygoes 2015-08-30 12:00:00 "
+        "192.168.0.1 9001 0\n"
+        "m thisoneislongerbecauseitisa256bitmddigest33\n"
+        "s Fast Guard Stable\n", i);
+  }
+  smartlist_add(chunks, tor_strdup("directory-footer\n"));
+  doc = smartlist_join_strings(chunks, "", 0, NULL);
+
+  /* Small documents aren't worth splitting up. */
+  tt_ptr_op(NULL, OP_EQ, routerstatus_tokenize_entries_threaded(
+                           "r router hereiswhereyouridentitygoes\n"
+                           "directory-footer\n", &end));
+  tt_ptr_op(NULL, OP_EQ, end);
+
+  jobs = routerstatus_tokenize_entries_threaded(doc, &end);
+  tt_assert(jobs);
+  tt_int_op(smartlist_len(jobs), OP_GT, 1);
+  tt_str_op(end, OP_EQ, "directory-footer\n");
+
+  /* The slices cover every entry, in order. */
+  expect_start = doc;
+  SMARTLIST_FOREACH_BEGIN(jobs, rs_tokenize_job_t *, job) {
+    tt_ptr_op(job->start, OP_EQ, expect_start);
+    tt_int_op(smartlist_len(job->entries), OP_EQ,
+              smartlist_len(job->token_lists));
+    SMARTLIST_FOREACH_BEGIN(job->entries, const char *, entry) {
+      smartlist_t *tokens = smartlist_get(job->token_lists, entry_sl_idx);
+      char expect[32];
+      if (n_entries == 1234) {
+        tt_assert(!strcmpstart(entry, "r broken\n"));
+        tt_ptr_op(tokens, OP_EQ, NULL);
+      } else {
+        tor_snprintf(expect, sizeof(expect), "r router%d ", n_entries);
+        tt_assert(!strcmpstart(entry, expect));
+        tt_assert(tokens);
+        tt_int_op(smartlist_len(tokens), OP_EQ, 3);
+        ++n_good;
+      }
+      ++n_entries;
+    } SMARTLIST_FOREACH_END(entry);
+    expect_start = job->end;
+  } SMARTLIST_FOREACH_END(job);
+  tt_ptr_op(expect_start, OP_EQ, end);
+  tt_int_op(n_entries, OP_EQ, 2000);
+  tt_int_op(n_good, OP_EQ, 1999);
+
+ done:
+  if (jobs)
+    rs_tokenize_jobs_free(jobs);
+  SMARTLIST_FOREACH(chunks, char *, c, tor_free(c));
+  smartlist_free(chunks);
+  tor_free(doc);
+}
+
+/** Helper for test_dir_collate: add an entry for the RSA identity whose
+ * digest is all <b>id</b> bytes to <b>vote</b>, listing the ed25519 key
+ * that is all <b>ed</b> bytes, or no ed25519 key if <b>ed</b> is 0. */
+static vote_routerstatus_t *
+collate_test_add_vrs(networkstatus_t *vote, char id, uint8_t ed)
+{
+  vote_routerstatus_t *vrs = tor_malloc_zero(sizeof(vote_routerstatus_t));
+  memset(vrs->status.identity_digest, id, DIGEST_LEN);
+  if (ed) {
+    vrs->has_ed25519_listing = 1;
+    memset(vrs->ed25519_id, ed, ED25519_PUBKEY_LEN);
+  }
+  smartlist_add(vote->routerstatus_list, vrs);
+  return vrs;
+}
+
+static void
+test_dir_collate(void *arg)
+{
+  networkstatus_t votes[3];
+  vote_routerstatus_t *a[3], *b[3], *c[3], *d0;
+  vote_routerstatus_t **lst;
+  dircollator_t *dc = NULL;
+  int i;
+  (void)arg;
+
+  memset(votes, 0, sizeof(votes));
+  for (i = 0; i < 3; ++i) {
+    votes[i].type = NS_TYPE_VOTE;
+    votes[i].routerstatus_list = smartlist_new();
+  }
+  /* Everybody agrees about A. */
+  for (i = 0; i < 3; ++i)
+    a[i] = collate_test_add_vrs(&votes[i], 'A', 1);
+  /* Two votes list B with the same ed25519 key; one lists no key. */
+  b[0] = collate_test_add_vrs(&votes[0], 'B', 2);
+  b[1] = collate_test_add_vrs(&votes[1], 'B', 2);
+  b[2] = collate_test_add_vrs(&votes[2], 'B', 0);
+  /* The votes disagree about C's ed25519 key. */
+  c[0] = collate_test_add_vrs(&votes[0], 'C', 3);
+  c[1] = collate_test_add_vrs(&votes[1], 'C', 4);
+  c[2] = collate_test_add_vrs(&votes[2], 'C', 0);
+  /* Only one vote lists D. */
+  d0 = collate_test_add_vrs(&votes[0], 'D', 0);
+  (void)d0;
+  /* Put the last vote out of order: the collator copes. */
+  smartlist_reverse(votes[2].routerstatus_list);
+
+  /* Collating by ed25519 key. */
+  dc = dircollator_new(3, 3);
+  for (i = 0; i < 3; ++i)
+    dircollator_add_vote(dc, &votes[i]);
+  dircollator_collate(dc, MIN_METHOD_FOR_ED25519_ID_VOTING);
+  tt_int_op(dircollator_n_routers(dc), OP_EQ, 3);
+  lst = dircollator_get_votes_for_router(dc, 0);
+  tt_assert(dircollator_router_is_ed25519_collated(dc, 0));
+  for (i = 0; i < 3; ++i)
+    tt_ptr_op(lst[i], OP_EQ, a[i]);
+  lst = dircollator_get_votes_for_router(dc, 1);
+  tt_assert(dircollator_router_is_ed25519_collated(dc, 1));
+  for (i = 0; i < 3; ++i)
+    tt_ptr_op(lst[i], OP_EQ, b[i]);
+  lst = dircollator_get_votes_for_router(dc, 2);
+  tt_assert(! dircollator_router_is_ed25519_collated(dc, 2));
+  for (i = 0; i < 3; ++i)
+    tt_ptr_op(lst[i], OP_EQ, c[i]);
+  dircollator_free(dc);
+
+  /* Collating by RSA identity alone. */
+  dc = dircollator_new(3, 3);
+  for (i = 0; i < 3; ++i)
+    dircollator_add_vote(dc, &votes[i]);
+  dircollator_collate(dc, MIN_METHOD_FOR_ED25519_ID_VOTING - 1);
+  tt_int_op(dircollator_n_routers(dc), OP_EQ, 3);
+  for (i = 0; i < 3; ++i)
+    tt_assert(! dircollator_router_is_ed25519_collated(dc, i));
+  lst = dircollator_get_votes_for_router(dc, 1);
+  for (i = 0; i < 3; ++i)
+    tt_ptr_op(lst[i], OP_EQ, b[i]);
+
+  /* With more authorities, a single disagreement on the key matters. */
+  dircollator_free(dc);
+  dc = dircollator_new(3, 4);
+  for (i = 0; i < 3; ++i)
+    dircollator_add_vote(dc, &votes[i]);
+  dircollator_collate(dc, MIN_METHOD_FOR_ED25519_ID_VOTING);
+  tt_int_op(dircollator_n_routers(dc), OP_EQ, 3);
+  tt_assert(dircollator_router_is_ed25519_collated(dc, 0));
+  tt_assert(! dircollator_router_is_ed25519_collated(dc, 1));
+  lst = dircollator_get_votes_for_router(dc, 1);
+  for (i = 0; i < 3; ++i)
+    tt_ptr_op(lst[i], OP_EQ, b[i]);
+
+ done:
+  dircollator_free(dc);
+  for (i = 0; i < 3; ++i) {
+    SMARTLIST_FOREACH(votes[i].routerstatus_list, vote_routerstatus_t *, vrs,
+                      tor_free(vrs));
+    smartlist_free(votes[i].routerstatus_list);
+  }
+}
+
+static void
+test_dir_reachability_schedule(void *arg)
+{
+  node_t nodes[6];
+  smartlist_t *lst = smartlist_new(), *out = smartlist_new();
+  const time_t now = 1000000;
+  uint32_t last = 0;
+  double mean = 0;
+  int i;
+  (void)arg;
+
+  memset(nodes, 0, sizeof(nodes));
+  for (i = 0; i < 6; ++i) {
+    memset(nodes[i].identity, 'A' + i, DIGEST_LEN);
+    smartlist_add(lst, &nodes[i]);
+  }
+  /* 0 and 1 were reached on their last tests; 0 was tested more recently. */
+  nodes[0].last_reachability_test = nodes[0].last_reachable = now - 100;
+  nodes[1].last_reachability_test = nodes[1].last_reachable = now - 200;
+  /* 2 failed its last test long enough ago to be retried first. */
+  nodes[2].last_reachability_test = now - 1000;
+  nodes[2].last_reachable = now - 2000;
+  /* 3 failed its last test just now, so it waits its turn. */
+  nodes[3].last_reachability_test = now - 10;
+  /* 4 and 5 have never been tested. */
+
+  tt_int_op(dirserv_reachability_test_priority(&nodes[0], now), OP_EQ,
+            REACHABILITY_PRIO_NORMAL);
+  tt_int_op(dirserv_reachability_test_priority(&nodes[2], now), OP_EQ,
+            REACHABILITY_PRIO_FAILED);
+  tt_int_op(dirserv_reachability_test_priority(&nodes[3], now), OP_EQ,
+            REACHABILITY_PRIO_NORMAL);
+  tt_int_op(dirserv_reachability_test_priority(&nodes[4], now), OP_EQ,
+            REACHABILITY_PRIO_NEW);
+
+  dirserv_select_reachability_tests(lst, 6, now, out);
+  tt_int_op(smartlist_len(out), OP_EQ, 6);
+  tt_ptr_op(smartlist_get(out, 0), OP_EQ, &nodes[4]);
+  tt_ptr_op(smartlist_get(out, 1), OP_EQ, &nodes[5]);
+  tt_ptr_op(smartlist_get(out, 2), OP_EQ, &nodes[2]);
+  tt_ptr_op(smartlist_get(out, 3), OP_EQ, &nodes[1]);
+  tt_ptr_op(smartlist_get(out, 4), OP_EQ, &nodes[0]);
+  tt_ptr_op(smartlist_get(out, 5), OP_EQ, &nodes[3]);
+
+  /* Only the most urgent ones get launched. */
+  smartlist_clear(out);
+  dirserv_select_reachability_tests(lst, 2, now, out);
+  tt_int_op(smartlist_len(out), OP_EQ, 2);
+  tt_ptr_op(smartlist_get(out, 0), OP_EQ, &nodes[4]);
+  tt_ptr_op(smartlist_get(out, 1), OP_EQ, &nodes[5]);
+
+  /* Latency bookkeeping. */
+  tt_int_op(-1, OP_EQ,
+            rep_hist_get_reachability_latency(nodes[0].identity, NULL, NULL));
+  rep_hist_note_router_reachability_latency(nodes[0].identity, 400);
+  tt_int_op(0, OP_EQ,
+            rep_hist_get_reachability_latency(nodes[0].identity,
+                                              &last, &mean));
+  tt_int_op(last, OP_EQ, 400);
+  tt_double_eq(mean, 400.0);
+  rep_hist_note_router_reachability_latency(nodes[0].identity, 800);
+  tt_int_op(0, OP_EQ,
+            rep_hist_get_reachability_latency(nodes[0].identity,
+                                              &last, &mean));
+  tt_int_op(last, OP_EQ, 800);
+  tt_double_op(mean, OP_GT, 400.0);
+  tt_double_op(mean, OP_LT, 800.0);
+
+ done:
+  smartlist_free(lst);
+  smartlist_free(out);
+}
+
+static void
+test_dir_consensus_id_index(void *arg)
+{
+  networkstatus_t *ns = tor_malloc_zero(sizeof(networkstatus_t));
+  char digest[DIGEST_LEN];
+  int i, found, idx;
+  (void) arg;
+
+  ns->type = NS_TYPE_CONSENSUS;
+  ns->routerstatus_list = smartlist_new();
+  for (i = 0; i < 100; ++i) {
+    routerstatus_t *rs = tor_malloc_zero(sizeof(routerstatus_t));
+    /* Every other digest, so that we have some to miss. */
+    memset(rs->identity_digest, 0x5a, DIGEST_LEN);
+    set_uint32(rs->identity_digest, htonl(2 * i + 2));
+    smartlist_add(ns->routerstatus_list, rs);
+  }
+
+  for (i = 0; i < 100; ++i) {
+    const routerstatus_t *rs = smartlist_get(ns->routerstatus_list, i);
+    tt_ptr_op(networkstatus_vote_find_entry(ns, rs->identity_digest),
+              OP_EQ, rs);
+    found = 0;
+    idx = networkstatus_vote_find_entry_idx(ns, rs->identity_digest,
+                                            &found);
+    tt_int_op(idx, OP_EQ, i);
+    tt_int_op(found, OP_EQ, 1);
+  }
+  tt_assert(ns->id_index);
+
+  /* A miss still tells us where the digest would go. */
+  memset(digest, 0x5a, DIGEST_LEN);
+  for (i = 0; i <= 100; ++i) {
+    set_uint32(digest, htonl(2 * i + 1));
+    tt_ptr_op(networkstatus_vote_find_entry(ns, digest), OP_EQ, NULL);
+    found = 1;
+    idx = networkstatus_vote_find_entry_idx(ns, digest, &found);
+    tt_int_op(idx, OP_EQ, i);
+    tt_int_op(found, OP_EQ, 0);
+  }
+
+ done:
+  networkstatus_vote_free(ns);
+}
+
 #define DIR_LEGACY(name)                             \
   { #name, test_dir_ ## name , TT_FORK, NULL, NULL }
 
@@ -5494,6 +6235,9 @@ struct testcase_t dir_tests[] = {
   DIR(routerinfo_parsing, 0),
   DIR(extrainfo_parsing, 0),
   DIR(parse_router_list, TT_FORK),
+  DIR(parse_router_list_ed_batch, TT_FORK),
+  DIR(parse_router_list_unchecked, TT_FORK),
+  DIR(check_signed_digest, 0),
   DIR(load_routers, TT_FORK),
   DIR(load_extrainfo, TT_FORK),
   DIR_LEGACY(versions),
@@ -5505,6 +6249,7 @@ struct testcase_t dir_tests[] = {
   DIR(param_voting_lookup, 0),
   DIR_LEGACY(v3_networkstatus),
   DIR(random_weighted, 0),
+  DIR(alias_table, 0),
   DIR(scale_bw, 0),
   DIR_LEGACY(clip_unmeasured_bw_kb),
   DIR_LEGACY(clip_unmeasured_bw_kb_alt),
@@ -5527,7 +6272,9 @@ struct testcase_t dir_tests[] = {
   DIR(should_not_init_request_to_dir_auths_without_v3_info, 0),
   DIR(should_init_request_to_dir_auths, 0),
   DIR(choose_compression_level, 0),
+  DIR(accept_encoding, 0),
   DIR(dump_unparseable_descriptors, 0),
+  DIR(dump_unparseable_descriptors_async, 0),
   DIR(populate_dump_desc_fifo, 0),
   DIR(populate_dump_desc_fifo_2, 0),
   DIR_ARG(find_dl_schedule, TT_FORK, "bf"),
@@ -5535,6 +6282,10 @@ struct testcase_t dir_tests[] = {
   DIR_ARG(find_dl_schedule, TT_FORK, "cf"),
   DIR_ARG(find_dl_schedule, TT_FORK, "ca"),
   DIR(assumed_flags, 0),
+  DIR(tokenize_entries_threaded, TT_FORK),
+  DIR(collate, 0),
+  DIR(reachability_schedule, TT_FORK),
+  DIR(consensus_id_index, 0),
   END_OF_TESTCASES
 };
 
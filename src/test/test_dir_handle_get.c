@@ -1720,8 +1720,9 @@ NS(geoip_get_country_by_addr)(const tor_addr_t *addr)
 }
 
 static void
-status_vote_current_consensus_ns_test(char **header, char **body,
-                                      size_t *body_len)
+status_vote_current_consensus_ns_test_impl(const char *url,
+                                           char **header, char **body,
+                                           size_t *body_len)
 {
   common_digests_t digests;
   dir_connection_t *conn = NULL;
@@ -1743,23 +1744,31 @@ status_vote_current_consensus_ns_test(char **header, char **body,
   conn = new_dir_conn();
   TO_CONN(conn)->address = tor_strdup("127.0.0.1");
 
-  tt_int_op(0, OP_EQ, directory_handle_command_get(conn,
-    GET("/tor/status-vote/current/consensus-ns"), NULL, 0));
+  tt_int_op(0, OP_EQ, directory_handle_command_get(conn, url, NULL, 0));
 
   fetch_from_buf_http(TO_CONN(conn)->outbuf, header, MAX_HEADERS_SIZE,
-                      body, body_len, strlen(NETWORK_STATUS)+7, 0);
+                      body, body_len, strlen(NETWORK_STATUS)+128, 0);
 
   done:
     UNMOCK(connection_write_to_buf_impl_);
     connection_free_(TO_CONN(conn));
 }
 
+static void
+status_vote_current_consensus_ns_test(char **header, char **body,
+                                      size_t *body_len)
+{
+  status_vote_current_consensus_ns_test_impl(
+                      GET("/tor/status-vote/current/consensus-ns"),
+                      header, body, body_len);
+}
+
 static void
 test_dir_handle_get_status_vote_current_consensus_ns(void* data)
 {
   char *header = NULL;
-  char *body = NULL, *comp_body = NULL;
-  size_t body_used = 0, comp_body_used = 0;
+  char *body = NULL;
+  size_t body_used = 0;
   char *stats = NULL, *hist = NULL;
   (void) data;
 
@@ -1771,7 +1780,7 @@ test_dir_handle_get_status_vote_current_consensus_ns(void* data)
 
   init_mock_options();
 
-  status_vote_current_consensus_ns_test(&header, &comp_body, &comp_body_used);
+  status_vote_current_consensus_ns_test(&header, &body, &body_used);
   tt_assert(header);
 
   tt_ptr_op(strstr(header, "HTTP/1.0 200 OK\r\n"), OP_EQ, header);
@@ -1779,15 +1788,9 @@ test_dir_handle_get_status_vote_current_consensus_ns(void* data)
   tt_assert(strstr(header, "Content-Encoding: identity\r\n"));
   tt_assert(strstr(header, "Pragma: no-cache\r\n"));
 
-  compress_method_t compression = detect_compression_method(comp_body,
-                                                            comp_body_used);
-  tt_int_op(ZLIB_METHOD, OP_EQ, compression);
-
-  tor_gzip_uncompress(&body, &body_used, comp_body, comp_body_used,
-                      compression, 0, LOG_PROTOCOL_WARN);
-
-  tt_str_op(NETWORK_STATUS, OP_EQ, body);
+  /* Uncompressed requests are served straight from the plain body. */
   tt_int_op(strlen(NETWORK_STATUS), OP_EQ, body_used);
+  tt_mem_op(NETWORK_STATUS, OP_EQ, body, body_used);
 
   stats = geoip_format_dirreq_stats(time(NULL));
   tt_assert(stats);
@@ -1806,7 +1809,6 @@ test_dir_handle_get_status_vote_current_consensus_ns(void* data)
     NS_UNMOCK(geoip_get_country_by_addr);
     UNMOCK(get_options);
     tor_free(header);
-    tor_free(comp_body);
     tor_free(body);
     tor_free(stats);
     tor_free(hist);
@@ -1816,6 +1818,108 @@ test_dir_handle_get_status_vote_current_consensus_ns(void* data)
     clear_geoip_db();
 }
 
+static void
+test_dir_handle_get_status_vote_current_consensus_ns_lzma(void* data)
+{
+  char *header = NULL, *encoding_header = NULL;
+  char *body = NULL, *comp_body = NULL;
+  size_t body_used = 0, comp_body_used = 0;
+  const compress_method_t expected =
+    tor_compress_supports_method(LZMA_METHOD) ? LZMA_METHOD : ZLIB_METHOD;
+  (void) data;
+
+  dirserv_free_all();
+  clear_geoip_db();
+
+  NS_MOCK(geoip_get_country_by_addr);
+  MOCK(get_options, mock_get_options);
+
+  init_mock_options();
+
+  status_vote_current_consensus_ns_test_impl(
+                      "GET /tor/status-vote/current/consensus-ns.z HTTP/1.0"
+                      "\r\nAccept-Encoding: x-zstd, x-tor-lzma, deflate"
+                      "\r\n\r\n",
+                      &header, &comp_body, &comp_body_used);
+  tt_assert(header);
+
+  /* The consensus was precompressed with LZMA as soon as we cached it, so
+   * that's what we prefer to send, if we have it. */
+  tt_ptr_op(strstr(header, "HTTP/1.0 200 OK\r\n"), OP_EQ, header);
+  tor_asprintf(&encoding_header, "Content-Encoding: %s\r\n",
+               compression_method_get_name(expected));
+  tt_assert(strstr(header, encoding_header));
+  tt_int_op(expected, OP_EQ,
+            detect_compression_method(comp_body, comp_body_used));
+
+  tt_int_op(0, OP_EQ, tor_gzip_uncompress(&body, &body_used, comp_body,
+                                          comp_body_used, expected, 1,
+                                          LOG_WARN));
+  tt_str_op(NETWORK_STATUS, OP_EQ, body);
+  tt_int_op(strlen(NETWORK_STATUS), OP_EQ, body_used);
+
+ done:
+    NS_UNMOCK(geoip_get_country_by_addr);
+    UNMOCK(get_options);
+    tor_free(header);
+    tor_free(encoding_header);
+    tor_free(comp_body);
+    tor_free(body);
+    or_options_free(mock_options); mock_options = NULL;
+
+    dirserv_free_all();
+    clear_geoip_db();
+}
+
+static void
+test_dir_handle_get_status_vote_current_consensus_ns_compressed(void* data)
+{
+  char *header = NULL;
+  char *body = NULL, *comp_body = NULL;
+  size_t body_used = 0, comp_body_used = 0;
+  (void) data;
+
+  dirserv_free_all();
+  clear_geoip_db();
+
+  NS_MOCK(geoip_get_country_by_addr);
+  MOCK(get_options, mock_get_options);
+
+  init_mock_options();
+
+  status_vote_current_consensus_ns_test_impl(
+                      GET("/tor/status-vote/current/consensus-ns.z"),
+                      &header, &comp_body, &comp_body_used);
+  tt_assert(header);
+
+  tt_ptr_op(strstr(header, "HTTP/1.0 200 OK\r\n"), OP_EQ, header);
+  tt_assert(strstr(header, "Content-Encoding: deflate\r\n"));
+
+  /* With no cpuworkers, the body was compressed as soon as we cached it,
+   * so the precompressed copy is what we send. */
+  tt_assert(dirserv_get_consensus("ns")->dir_z);
+  compress_method_t compression = detect_compression_method(comp_body,
+                                                            comp_body_used);
+  tt_int_op(ZLIB_METHOD, OP_EQ, compression);
+
+  tor_gzip_uncompress(&body, &body_used, comp_body, comp_body_used,
+                      compression, 0, LOG_PROTOCOL_WARN);
+
+  tt_str_op(NETWORK_STATUS, OP_EQ, body);
+  tt_int_op(strlen(NETWORK_STATUS), OP_EQ, body_used);
+
+  done:
+    NS_UNMOCK(geoip_get_country_by_addr);
+    UNMOCK(get_options);
+    tor_free(header);
+    tor_free(comp_body);
+    tor_free(body);
+    or_options_free(mock_options); mock_options = NULL;
+
+    dirserv_free_all();
+    clear_geoip_db();
+}
+
 static void
 test_dir_handle_get_status_vote_current_consensus_ns_busy(void* data)
 {
@@ -2496,6 +2600,8 @@ struct testcase_t dir_handle_get_tests[] = {
   DIR_HANDLE_CMD(status_vote_current_consensus_ns_not_found, 0),
   DIR_HANDLE_CMD(status_vote_current_consensus_ns_busy, 0),
   DIR_HANDLE_CMD(status_vote_current_consensus_ns, 0),
+  DIR_HANDLE_CMD(status_vote_current_consensus_ns_compressed, 0),
+  DIR_HANDLE_CMD(status_vote_current_consensus_ns_lzma, 0),
   DIR_HANDLE_CMD(status_vote_current_d_not_found, 0),
   DIR_HANDLE_CMD(status_vote_next_d_not_found, 0),
   DIR_HANDLE_CMD(status_vote_d, 0),
@@ -4,7 +4,9 @@
 #define DNS_PRIVATE
 
 #include "dns.h"
+#include "config.h"
 #include "connection.h"
+#include "connection_edge.h"
 #include "router.h"
 
 #define NS_MODULE dns
@@ -541,6 +543,7 @@ NS(test_main)(void *arg)
   pending_connection_t *pending_conn = NULL;
 
   edge_connection_t *exitconn = create_valid_exitconn();
+  edge_connection_t *exitconn2 = NULL;
   or_circuit_t *on_circ = tor_malloc_zero(sizeof(or_circuit_t));
 
   cached_resolve_t *cache_entry = tor_malloc_zero(sizeof(cached_resolve_t));
@@ -573,13 +576,30 @@ NS(test_main)(void *arg)
   tt_assert(pending_conn != NULL);
   tt_assert(pending_conn->conn == exitconn);
 
+  /* A second connection for the same address waits behind the first. */
+  exitconn2 = create_valid_exitconn();
+  TO_CONN(exitconn2)->address = tor_strdup("torproject.org");
+  retval = dns_resolve_impl(exitconn2, 1, on_circ, NULL, &made_pending,
+                            NULL);
+
+  tt_int_op(retval,==,0);
+  tt_int_op(made_pending,==,1);
+  tt_assert(cache_entry->pending_connections == pending_conn);
+  tt_assert(pending_conn->next != NULL);
+  tt_assert(pending_conn->next->conn == exitconn2);
+
   done:
   NS_UNMOCK(router_my_exit_policy_is_reject_star);
   tor_free(on_circ);
   tor_free(TO_CONN(exitconn)->address);
+  if (exitconn2)
+    tor_free(TO_CONN(exitconn2)->address);
+  if (cache_entry->pending_connections)
+    tor_free(cache_entry->pending_connections->next);
   tor_free(cache_entry->pending_connections);
   tor_free(cache_entry);
   tor_free(exitconn);
+  tor_free(exitconn2);
   return;
 }
 
@@ -747,6 +767,140 @@ NS(test_main)(void *arg)
 
 #undef NS_SUBMODULE
 
+#define NS_SUBMODULE cache_oom
+
+/* Helper: return a new cached answer for <b>address</b>, whose IPv4 lookup
+ * succeeded iff <b>ok</b>. */
+static cached_resolve_t *
+NS(new_cached_resolve)(const char *address, int ok)
+{
+  cached_resolve_t *resolve = tor_malloc_zero(sizeof(cached_resolve_t));
+  resolve->magic = CACHED_RESOLVE_MAGIC;
+  resolve->state = CACHE_STATE_CACHED;
+  resolve->minheap_idx = -1;
+  resolve->expire = time(NULL) + 60 * 60;
+  strlcpy(resolve->address, address, sizeof(resolve->address));
+  if (ok) {
+    resolve->res_status_ipv4 = RES_STATUS_DONE_OK;
+    resolve->result_ipv4.addr_ipv4 = 0x7f000001;
+  } else {
+    resolve->res_status_ipv4 = RES_STATUS_DONE_ERR;
+  }
+  return resolve;
+}
+
+/* When we're low on memory, we want the DNS cache to give up its least
+ * recently used failed answers before any successful ones. */
+static void
+NS(test_main)(void *arg)
+{
+  cached_resolve_t search;
+  const size_t entry_size = sizeof(cached_resolve_t);
+  (void)arg;
+
+  dns_init();
+  tt_int_op(dns_cache_get_total_allocation(), OP_EQ, 0);
+
+  dns_insert_cache_entry(NS(new_cached_resolve)("good.example.com", 1));
+  dns_insert_cache_entry(NS(new_cached_resolve)("bad1.example.com", 0));
+  dns_insert_cache_entry(NS(new_cached_resolve)("bad2.example.com", 0));
+  tt_int_op(dns_cache_get_total_allocation(), OP_EQ, 3 * entry_size);
+
+  /* Freeing one byte forgets the oldest failed answer. */
+  tt_int_op(dns_cache_handle_oom(time(NULL), 1), OP_EQ, entry_size);
+  strlcpy(search.address, "bad1.example.com", sizeof(search.address));
+  tt_ptr_op(dns_get_cache_entry(&search), OP_EQ, NULL);
+  strlcpy(search.address, "bad2.example.com", sizeof(search.address));
+  tt_ptr_op(dns_get_cache_entry(&search), OP_NE, NULL);
+  strlcpy(search.address, "good.example.com", sizeof(search.address));
+  tt_ptr_op(dns_get_cache_entry(&search), OP_NE, NULL);
+  tt_int_op(dns_cache_get_total_allocation(), OP_EQ, 2 * entry_size);
+
+  /* Freeing two entries' worth takes the other failed answer, and then the
+   * successful one. */
+  tt_int_op(dns_cache_handle_oom(time(NULL), 2 * entry_size), OP_EQ,
+            2 * entry_size);
+  tt_ptr_op(dns_get_cache_entry(&search), OP_EQ, NULL);
+  tt_int_op(dns_cache_get_total_allocation(), OP_EQ, 0);
+
+ done:
+  dns_free_all();
+}
+
+#undef NS_SUBMODULE
+
+#define NS_SUBMODULE partial_answer
+
+/* A BEGIN should only go ahead on one answer if the answer still in flight
+ * couldn't change the address it gets. */
+
+NS_DECL(const or_options_t *, get_options, (void));
+
+static or_options_t *NS(mock_options) = NULL;
+
+static const or_options_t *
+NS(get_options)(void)
+{
+  return NS(mock_options);
+}
+
+static void
+NS(test_main)(void *arg)
+{
+  edge_connection_t *exitconn = create_valid_exitconn();
+  cached_resolve_t *resolve = tor_malloc_zero(sizeof(cached_resolve_t));
+  (void)arg;
+
+  NS(mock_options) = tor_malloc_zero(sizeof(or_options_t));
+  NS(mock_options)->IPv6Exit = 1;
+  NS_MOCK(get_options);
+
+  resolve->res_status_ipv4 = RES_STATUS_DONE_OK;
+  resolve->result_ipv4.addr_ipv4 = 0x01020304;
+  resolve->res_status_ipv6 = RES_STATUS_INFLIGHT;
+
+  /* A RESOLVE wants every answer. */
+  tt_int_op(pending_connection_can_use_partial_answer(resolve, exitconn),
+            OP_EQ, 0);
+
+  /* A BEGIN that can't use IPv6 only needs the IPv4 answer. */
+  TO_CONN(exitconn)->purpose = EXIT_PURPOSE_CONNECT;
+  exitconn->begincell_flags = 0;
+  tt_int_op(pending_connection_can_use_partial_answer(resolve, exitconn),
+            OP_EQ, 1);
+
+  /* A BEGIN that prefers IPv6 has to wait for it. */
+  exitconn->begincell_flags = BEGIN_FLAG_IPV6_OK | BEGIN_FLAG_IPV6_PREFERRED;
+  tt_int_op(pending_connection_can_use_partial_answer(resolve, exitconn),
+            OP_EQ, 0);
+
+  /* A BEGIN that won't take IPv4 only needs the IPv6 answer. */
+  resolve->res_status_ipv4 = RES_STATUS_INFLIGHT;
+  resolve->res_status_ipv6 = RES_STATUS_DONE_OK;
+  exitconn->begincell_flags = BEGIN_FLAG_IPV6_OK | BEGIN_FLAG_IPV4_NOT_OK;
+  tt_int_op(pending_connection_can_use_partial_answer(resolve, exitconn),
+            OP_EQ, 1);
+
+  /* One that would take IPv4 has to wait for it. */
+  exitconn->begincell_flags = BEGIN_FLAG_IPV6_OK;
+  tt_int_op(pending_connection_can_use_partial_answer(resolve, exitconn),
+            OP_EQ, 0);
+
+  /* Unless we don't exit to IPv6 at all. */
+  NS(mock_options)->IPv6Exit = 0;
+  exitconn->begincell_flags = BEGIN_FLAG_IPV6_OK | BEGIN_FLAG_IPV4_NOT_OK;
+  tt_int_op(pending_connection_can_use_partial_answer(resolve, exitconn),
+            OP_EQ, 0);
+
+ done:
+  NS_UNMOCK(get_options);
+  tor_free(NS(mock_options));
+  tor_free(resolve);
+  tor_free(exitconn);
+}
+
+#undef NS_SUBMODULE
+
 struct testcase_t dns_tests[] = {
    TEST_CASE(clip_ttl),
    TEST_CASE(expiry_ttl),
@@ -758,6 +912,8 @@ struct testcase_t dns_tests[] = {
    TEST_CASE_ASPECT(resolve_impl, cache_hit_pending),
    TEST_CASE_ASPECT(resolve_impl, cache_hit_cached),
    TEST_CASE_ASPECT(resolve_impl, cache_miss),
+   TEST_CASE(cache_oom),
+   TEST_CASE(partial_answer),
    END_OF_TESTCASES
 };
 
@@ -0,0 +1,162 @@
+/* Copyright (c) 2016, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+#define DOS_PRIVATE
+#include "or.h"
+#include "channel.h"
+#include "config.h"
+#include "dos.h"
+#include "test.h"
+
+static tor_addr_t fake_remote_addr;
+
+static int
+fake_get_remote_addr(channel_t *chan, tor_addr_t *addr_out)
+{
+  (void)chan;
+  tor_addr_copy(addr_out, &fake_remote_addr);
+  return 1;
+}
+
+static void
+test_dos_conn_limit(void *arg)
+{
+  or_options_t *options = get_options_mutable();
+  tor_addr_t a, b;
+  (void)arg;
+
+  tor_addr_parse(&a, "10.0.0.1");
+  tor_addr_parse(&b, "[2001:db8::1]");
+
+  /* With no limit, we don't count anything. */
+  dos_set_options(options);
+  tt_assert(!dos_enabled());
+  tt_int_op(dos_conn_note_new(&a), OP_EQ, 1);
+
+  options->DoSConnectionMaxConcurrentCount = 2;
+  dos_set_options(options);
+  tt_assert(dos_enabled());
+
+  tt_int_op(dos_conn_note_new(&a), OP_EQ, 0);
+  tt_int_op(dos_conn_note_new(&a), OP_EQ, 0);
+  tt_int_op(dos_conn_note_new(&a), OP_EQ, -1);
+  /* Other addresses have their own count. */
+  tt_int_op(dos_conn_note_new(&b), OP_EQ, 0);
+  tt_int_op(dos_conn_note_new(&b), OP_EQ, 0);
+  tt_int_op(dos_conn_note_new(&b), OP_EQ, -1);
+
+  /* Closing one makes room for another. */
+  dos_conn_note_closed(&a);
+  tt_int_op(dos_conn_note_new(&a), OP_EQ, 0);
+  tt_int_op(dos_conn_note_new(&a), OP_EQ, -1);
+
+  /* Turning the limits off frees the table. */
+  options->DoSConnectionMaxConcurrentCount = 0;
+  dos_set_options(options);
+  tt_ptr_op(dos_addr_lookup(&a, 1, approx_time()), OP_EQ, NULL);
+
+ done:
+  dos_free_all();
+}
+
+static void
+test_dos_create_bucket(void *arg)
+{
+  or_options_t *options = get_options_mutable();
+  channel_t chan;
+  int i;
+  (void)arg;
+
+  memset(&chan, 0, sizeof(chan));
+  chan.get_remote_addr = fake_get_remote_addr;
+  tor_addr_parse(&fake_remote_addr, "10.0.0.2");
+  update_approx_time(1000);
+
+  options->DoSCircuitCreationRate = 2;
+  options->DoSCircuitCreationBurst = 5;
+  dos_set_options(options);
+
+  for (i = 0; i < 5; ++i)
+    tt_assert(!dos_create_should_refuse(&chan));
+  tt_assert(dos_create_should_refuse(&chan));
+
+  /* A second later, we've earned two more. */
+  update_approx_time(1001);
+  tt_assert(!dos_create_should_refuse(&chan));
+  tt_assert(!dos_create_should_refuse(&chan));
+  tt_assert(dos_create_should_refuse(&chan));
+
+  /* The bucket never holds more than the burst. */
+  update_approx_time(2000);
+  for (i = 0; i < 5; ++i)
+    tt_assert(!dos_create_should_refuse(&chan));
+  tt_assert(dos_create_should_refuse(&chan));
+
+  /* Another address has its own bucket. */
+  tor_addr_parse(&fake_remote_addr, "10.0.0.3");
+  tt_assert(!dos_create_should_refuse(&chan));
+
+ done:
+  options->DoSCircuitCreationRate = 0;
+  options->DoSCircuitCreationBurst = 0;
+  dos_free_all();
+}
+
+static void
+test_dos_table_eviction(void *arg)
+{
+  or_options_t *options = get_options_mutable();
+  tor_addr_t addrs[DOS_TABLE_WAYS * 4], *busy = NULL, *idle = NULL;
+  dos_addr_entry_t *ent;
+  int i, j, n_same = 0;
+  unsigned target;
+  (void)arg;
+
+  options->DoSConnectionMaxConcurrentCount = 1;
+  dos_set_options(options);
+
+  /* Find more addresses than one set can hold that all land in it. */
+  tor_addr_from_ipv4h(&addrs[0], 0x0a000000);
+  target = tor_addr_hash(&addrs[0]) % (DOS_TABLE_SIZE / DOS_TABLE_WAYS);
+  n_same = 1;
+  for (i = 1; n_same < (int)ARRAY_LENGTH(addrs) && i < (1<<24); ++i) {
+    tor_addr_t a;
+    tor_addr_from_ipv4h(&a, 0x0a000000 + i);
+    if (tor_addr_hash(&a) % (DOS_TABLE_SIZE / DOS_TABLE_WAYS) == target)
+      tor_addr_copy(&addrs[n_same++], &a);
+  }
+  tt_int_op(n_same, OP_EQ, ARRAY_LENGTH(addrs));
+
+  /* Fill the set; give the oldest entry an open connection. */
+  for (i = 0; i < DOS_TABLE_WAYS; ++i) {
+    ent = dos_addr_lookup(&addrs[i], 1, 100 + i);
+    tt_assert(ent);
+  }
+  busy = &addrs[0];
+  idle = &addrs[1];
+  tt_int_op(dos_conn_note_new(busy), OP_EQ, 0);
+  dos_addr_lookup(busy, 0, 100);
+
+  /* A new address evicts the oldest entry without connections. */
+  tt_assert(dos_addr_lookup(&addrs[DOS_TABLE_WAYS], 1, 200));
+  tt_ptr_op(dos_addr_lookup(idle, 0, 200), OP_EQ, NULL);
+  tt_assert(dos_addr_lookup(busy, 0, 200));
+
+  /* Even a flood of new addresses doesn't push out the busy one while
+   * there are idle entries to take instead. */
+  for (j = DOS_TABLE_WAYS + 1; j < (int)ARRAY_LENGTH(addrs); ++j)
+    tt_assert(dos_addr_lookup(&addrs[j], 1, 300));
+  tt_int_op(dos_conn_note_new(busy), OP_EQ, -1);
+
+ done:
+  options->DoSConnectionMaxConcurrentCount = 0;
+  dos_free_all();
+}
+
+struct testcase_t dos_tests[] = {
+  { "conn_limit", test_dos_conn_limit, TT_FORK, NULL, NULL },
+  { "create_bucket", test_dos_create_bucket, TT_FORK, NULL, NULL },
+  { "table_eviction", test_dos_table_eviction, TT_FORK, NULL, NULL },
+  END_OF_TESTCASES
+};
+
@@ -3,6 +3,7 @@
 
 #include "orconfig.h"
 
+#define CIRCUITLIST_PRIVATE
 #define CONNECTION_PRIVATE
 #define CONNECTION_EDGE_PRIVATE
 
@@ -10,10 +11,13 @@
 #include "test.h"
 
 #include "addressmap.h"
+#include "circuitlist.h"
+#include "clientdns.h"
 #include "config.h"
 #include "confparse.h"
 #include "connection.h"
 #include "connection_edge.h"
+#include "rendcommon.h"
 
 static void *
 entryconn_rewrite_setup(const struct testcase_t *tc)
@@ -743,6 +747,209 @@ test_entryconn_rewrite_mapaddress_automap_onion4(void *arg)
   test_entryconn_rewrite_mapaddress_automap_onion_common(arg, 0, 1);
 }
 
+static int n_resolved = 0;
+static int last_resolved_type = 0;
+static int last_resolved_ttl = 0;
+
+static void
+mock_connection_ap_handshake_socks_resolved(entry_connection_t *conn,
+                                            int answer_type,
+                                            size_t answer_len,
+                                            const uint8_t *answer,
+                                            int ttl,
+                                            time_t expires)
+{
+  (void)expires;
+  ++n_resolved;
+  last_resolved_type = answer_type;
+  last_resolved_ttl = ttl;
+  client_dns_cache_note_answer(conn, answer_type, answer_len, answer, ttl);
+  conn->socks_request->has_finished = 1;
+}
+
+static void
+mock_connection_mark_unattached_ap_(entry_connection_t *conn, int endreason,
+                                    int line, const char *file)
+{
+  (void)endreason;
+  (void)line;
+  (void)file;
+  ENTRY_TO_CONN(conn)->marked_for_close = 1;
+}
+
+/** Return a new entry connection that asks to resolve <b>name</b>, as
+ * user <b>username</b> on a port that isolates by SOCKS auth. */
+static entry_connection_t *
+new_resolve_conn(const char *name, const char *username)
+{
+  entry_connection_t *ec = entry_connection_new(CONN_TYPE_AP, AF_INET);
+  ec->socks_request->command = SOCKS_COMMAND_RESOLVE;
+  strlcpy(ec->socks_request->address, name,
+          sizeof(ec->socks_request->address));
+  ec->entry_cfg.isolation_flags = ISO_SOCKSAUTH;
+  ec->entry_cfg.ipv4_traffic = 1;
+  if (username) {
+    ec->socks_request->username = tor_strdup(username);
+    ec->socks_request->usernamelen = strlen(username);
+  }
+  ENTRY_TO_CONN(ec)->state = AP_CONN_STATE_CIRCUIT_WAIT;
+  return ec;
+}
+
+#define N_DNS_CONNS 8
+
+/* Client DNS cache: answers are shared within an isolation context, and
+ * identical lookups wait for the one in flight. */
+static void
+test_entryconn_client_dns_cache(void *arg)
+{
+  entry_connection_t *ec[N_DNS_CONNS];
+  const uint8_t answer[4] = { 18, 0, 0, 1 };
+  time_t now = time(NULL);
+  int i;
+
+  (void)arg;
+  memset(ec, 0, sizeof(ec));
+  MOCK(connection_ap_handshake_socks_resolved,
+       mock_connection_ap_handshake_socks_resolved);
+  MOCK(connection_mark_unattached_ap_, mock_connection_mark_unattached_ap_);
+  update_approx_time(now);
+
+  /* Off by default. */
+  ec[0] = new_resolve_conn("www.example.com", "alice");
+  tt_int_op(client_dns_cache_lookup(ec[0]), OP_EQ, CLIENT_DNS_CACHE_MISS);
+  tt_ptr_op(ec[0]->dns_cache_key, OP_EQ, NULL);
+
+  client_dns_cache_set_max_entries(2);
+  tt_int_op(client_dns_cache_lookup(ec[0]), OP_EQ, CLIENT_DNS_CACHE_MISS);
+  tt_ptr_op(ec[0]->dns_cache_key, OP_NE, NULL);
+
+  /* The same name from the same context waits; another context doesn't. */
+  ec[1] = new_resolve_conn("WWW.example.com", "alice");
+  tt_int_op(client_dns_cache_lookup(ec[1]), OP_EQ, CLIENT_DNS_CACHE_WAIT);
+  tt_int_op(ENTRY_TO_CONN(ec[1])->state, OP_EQ,
+            AP_CONN_STATE_DNS_CACHE_WAIT);
+  ec[2] = new_resolve_conn("www.example.com", "bob");
+  tt_int_op(client_dns_cache_lookup(ec[2]), OP_EQ, CLIENT_DNS_CACHE_MISS);
+
+  /* The answer goes to the waiting request too, and gets remembered. */
+  mock_connection_ap_handshake_socks_resolved(ec[0], RESOLVED_TYPE_IPV4,
+                                              4, answer, 600, -1);
+  tt_int_op(n_resolved, OP_EQ, 2);
+  tt_int_op(last_resolved_ttl, OP_EQ, 600);
+  tt_int_op(ENTRY_TO_CONN(ec[1])->marked_for_close, OP_EQ, 1);
+  tt_int_op(ENTRY_TO_CONN(ec[2])->marked_for_close, OP_EQ, 0);
+  tt_int_op(client_dns_cache_n_entries(), OP_EQ, 1);
+
+  ec[3] = new_resolve_conn("www.example.com", "alice");
+  tt_int_op(client_dns_cache_lookup(ec[3]), OP_EQ, CLIENT_DNS_CACHE_HIT);
+  tt_int_op(n_resolved, OP_EQ, 3);
+  tt_int_op(last_resolved_type, OP_EQ, RESOLVED_TYPE_IPV4);
+  update_approx_time(now + 100);
+  ec[4] = new_resolve_conn("www.example.com", "alice");
+  tt_int_op(client_dns_cache_lookup(ec[4]), OP_EQ, CLIENT_DNS_CACHE_HIT);
+  tt_int_op(last_resolved_ttl, OP_EQ, 500);
+
+  /* If the lookup fails, the next request in line makes its own. */
+  ec[5] = new_resolve_conn("www.example.org", "alice");
+  tt_int_op(client_dns_cache_lookup(ec[5]), OP_EQ, CLIENT_DNS_CACHE_MISS);
+  ec[6] = new_resolve_conn("www.example.org", "alice");
+  tt_int_op(client_dns_cache_lookup(ec[6]), OP_EQ, CLIENT_DNS_CACHE_WAIT);
+  n_resolved = 0;
+  mock_connection_ap_handshake_socks_resolved(ec[5], RESOLVED_TYPE_ERROR,
+                                              0, NULL, -1, -1);
+  tt_int_op(n_resolved, OP_EQ, 1);
+  tt_int_op(ENTRY_TO_CONN(ec[6])->state, OP_EQ, AP_CONN_STATE_CIRCUIT_WAIT);
+  tt_int_op(ENTRY_TO_CONN(ec[6])->marked_for_close, OP_EQ, 0);
+  connection_ap_mark_as_non_pending_circuit(ec[6]);
+
+  /* Bob's answer fills the cache; the next one pushes out the oldest. */
+  mock_connection_ap_handshake_socks_resolved(ec[2], RESOLVED_TYPE_IPV4,
+                                              4, answer, 600, -1);
+  tt_int_op(client_dns_cache_n_entries(), OP_EQ, 2);
+  mock_connection_ap_handshake_socks_resolved(ec[6], RESOLVED_TYPE_IPV4,
+                                              4, answer, 600, -1);
+  tt_int_op(client_dns_cache_n_entries(), OP_EQ, 2);
+  ec[7] = new_resolve_conn("www.example.com", "alice");
+  tt_int_op(client_dns_cache_lookup(ec[7]), OP_EQ, CLIENT_DNS_CACHE_MISS);
+  client_dns_cache_conn_closed(ec[7]);
+
+  /* Answers run out with their TTL, and NEWNYM forgets them. */
+  update_approx_time(now + 700);
+  tt_int_op(client_dns_cache_lookup(ec[7]), OP_EQ, CLIENT_DNS_CACHE_MISS);
+  client_dns_cache_conn_closed(ec[7]);
+  client_dns_cache_clear();
+  tt_int_op(client_dns_cache_n_entries(), OP_EQ, 0);
+
+ done:
+  UNMOCK(connection_ap_handshake_socks_resolved);
+  UNMOCK(connection_mark_unattached_ap_);
+  client_dns_cache_free_all();
+  for (i = 0; i < N_DNS_CONNS; ++i) {
+    if (ec[i])
+      connection_free_(ENTRY_TO_CONN(ec[i]));
+  }
+}
+
+/* A newly opened circuit only wakes the pending streams that could use
+ * it. */
+static void
+test_entryconn_might_use_circuit(void *arg)
+{
+  entry_connection_t *ec = entry_connection_new(CONN_TYPE_AP, AF_INET);
+  entry_connection_t *hs_ec = entry_connection_new(CONN_TYPE_AP, AF_INET);
+  origin_circuit_t *circ = origin_circuit_new();
+  origin_circuit_t *rend_circ = origin_circuit_new();
+
+  (void)arg;
+  strlcpy(ec->socks_request->address, "www.example.com",
+          sizeof(ec->socks_request->address));
+  ec->socks_request->port = 80;
+  ec->original_dest_address = tor_strdup("www.example.com");
+  strlcpy(hs_ec->socks_request->address, "abcdefghijklmnop.onion",
+          sizeof(hs_ec->socks_request->address));
+  hs_ec->original_dest_address = tor_strdup("abcdefghijklmnop.onion");
+  ENTRY_TO_EDGE_CONN(hs_ec)->rend_data =
+    rend_data_client_create("abcdefghijklmnop", NULL, NULL, REND_NO_AUTH);
+
+  circ->base_.purpose = CIRCUIT_PURPOSE_C_GENERAL;
+  circ->build_state = tor_malloc_zero(sizeof(cpath_build_state_t));
+  rend_circ->base_.purpose = CIRCUIT_PURPOSE_C_REND_JOINED;
+  rend_circ->build_state = tor_malloc_zero(sizeof(cpath_build_state_t));
+
+  /* Exit streams want general circuits, onion streams their own. */
+  tt_assert(connection_ap_might_use_circuit(ec, circ));
+  tt_assert(! connection_ap_might_use_circuit(hs_ec, circ));
+  tt_assert(! connection_ap_might_use_circuit(ec, rend_circ));
+  tt_assert(! connection_ap_might_use_circuit(hs_ec, rend_circ));
+  rend_circ->rend_data =
+    rend_data_client_create("abcdefghijklmnop", NULL, NULL, REND_NO_AUTH);
+  tt_assert(connection_ap_might_use_circuit(hs_ec, rend_circ));
+
+  /* One-hop tunnels are only for streams that want them. */
+  circ->build_state->onehop_tunnel = 1;
+  tt_assert(! connection_ap_might_use_circuit(ec, circ));
+  ec->want_onehop = 1;
+  tt_assert(connection_ap_might_use_circuit(ec, circ));
+  ec->want_onehop = 0;
+  circ->build_state->onehop_tunnel = 0;
+
+  /* Streams isolated by port skip circuits used for another port. */
+  ec->entry_cfg.isolation_flags = ISO_DESTPORT;
+  circ->isolation_values_set = 1;
+  circ->dest_port = 443;
+  circ->dest_address = tor_strdup("www.example.com");
+  tt_assert(! connection_ap_might_use_circuit(ec, circ));
+  circ->dest_port = 80;
+  tt_assert(connection_ap_might_use_circuit(ec, circ));
+
+ done:
+  connection_free_(ENTRY_TO_CONN(ec));
+  connection_free_(ENTRY_TO_CONN(hs_ec));
+  circuit_free(TO_CIRCUIT(circ));
+  circuit_free(TO_CIRCUIT(rend_circ));
+}
+
 #define REWRITE(name)                           \
   { #name, test_entryconn_##name, TT_FORK, &test_rewrite_setup, NULL }
 
@@ -763,6 +970,9 @@ struct testcase_t entryconn_tests[] = {
   REWRITE(rewrite_mapaddress_automap_onion2),
   REWRITE(rewrite_mapaddress_automap_onion3),
   REWRITE(rewrite_mapaddress_automap_onion4),
+  { "client_dns_cache", test_entryconn_client_dns_cache, TT_FORK, NULL, NULL },
+  { "might_use_circuit", test_entryconn_might_use_circuit, TT_FORK,
+    NULL, NULL },
 
   END_OF_TESTCASES
 };
@@ -756,6 +756,62 @@ test_entry_is_live(void *arg)
   ; /* XXX */
 }
 
+/** Make sure that we can find our entry guards by identity, and that we
+ * stop finding them once they're dropped. */
+static void
+test_entry_guard_get_by_id_digest(void *arg)
+{
+  guard_selection_t *gs = get_guard_selection_info();
+  const smartlist_t *all_entry_guards =
+    get_entry_guards_for_guard_selection(gs);
+  entry_guard_t *entry = NULL;
+  char missing[DIGEST_LEN];
+  char dropped[DIGEST_LEN];
+
+  (void) arg;
+
+  SMARTLIST_FOREACH_BEGIN(nodelist_get_list(), const node_t *, node) {
+    tt_assert(add_an_entry_guard(gs, node, 0, 1, 0, 0));
+  } SMARTLIST_FOREACH_END(node);
+  tt_int_op(smartlist_len(all_entry_guards), OP_EQ,
+            HELPER_NUMBER_OF_DESCRIPTORS);
+
+  /* Every guard is found under its own identity. */
+  SMARTLIST_FOREACH(all_entry_guards, entry_guard_t *, e,
+    tt_ptr_op(entry_guard_get_by_id_digest_for_guard_selection(gs,
+                                                               e->identity),
+              OP_EQ, e));
+  memset(missing, 0x5a, sizeof(missing));
+  tt_ptr_op(entry_guard_get_by_id_digest_for_guard_selection(gs, missing),
+            OP_EQ, NULL);
+
+  /* A guard we've never contacted is dropped when we can't reach it. */
+  entry = smartlist_get(all_entry_guards, 2);
+  entry->made_contact = 0;
+  memcpy(dropped, entry->identity, DIGEST_LEN);
+  entry_guard_register_connect_status_for_guard_selection(gs, dropped, 0, 0,
+                                                          time(NULL));
+  tt_int_op(smartlist_len(all_entry_guards), OP_EQ,
+            HELPER_NUMBER_OF_DESCRIPTORS - 1);
+  tt_ptr_op(entry_guard_get_by_id_digest_for_guard_selection(gs, dropped),
+            OP_EQ, NULL);
+  SMARTLIST_FOREACH(all_entry_guards, entry_guard_t *, e,
+    tt_ptr_op(entry_guard_get_by_id_digest_for_guard_selection(gs,
+                                                               e->identity),
+              OP_EQ, e));
+
+  /* And nothing is found once they're all gone. */
+  remove_all_entry_guards_for_guard_selection(gs);
+  tt_int_op(smartlist_len(all_entry_guards), OP_EQ, 0);
+  SMARTLIST_FOREACH(nodelist_get_list(), const node_t *, node,
+    tt_ptr_op(entry_guard_get_by_id_digest_for_guard_selection(gs,
+                                                           node->identity),
+              OP_EQ, NULL));
+
+ done:
+  ;
+}
+
 #define TEST_IPV4_ADDR "123.45.67.89"
 #define TEST_IPV6_ADDR "[1234:5678:90ab:cdef::]"
 
@@ -873,6 +929,9 @@ struct testcase_t entrynodes_tests[] = {
   { "entry_is_live",
     test_entry_is_live,
     TT_FORK, &fake_network, NULL },
+  { "entry_guard_get_by_id_digest",
+    test_entry_guard_get_by_id_digest,
+    TT_FORK, &fake_network, NULL },
   { "node_preferred_orport",
     test_node_preferred_orport,
     0, NULL, NULL },
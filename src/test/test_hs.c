@@ -14,10 +14,13 @@
 #include "test.h"
 #include "control.h"
 #include "config.h"
+#include "main.h"
+#include "rendcache.h"
 #include "rendcommon.h"
 #include "rendservice.h"
 #include "routerset.h"
 #include "circuitbuild.h"
+#include "networkstatus.h"
 #include "test_helpers.h"
 
 /* mock ID digest and longname for node that's in nodelist */
@@ -704,6 +707,392 @@ test_single_onion_poisoning(void *arg)
   tor_free(dir2);
 }
 
+/* Test that keys for many services load correctly on several threads, and
+ * that services can be found by key and by ID. */
+static void
+test_hs_load_keys_in_parallel(void *arg)
+{
+  or_options_t opt;
+  smartlist_t *services = smartlist_new();
+  smartlist_t *ports = smartlist_new();
+  digestmap_t *seen = digestmap_new();
+  char digests[8][DIGEST_LEN];
+  char *service_id = NULL, *contents = NULL, *fname = NULL, *err = NULL;
+  rend_service_t *s;
+  int i;
+  (void) arg;
+
+  mock_options = &opt;
+  reset_options(mock_options, &mock_get_options_calls);
+  MOCK(get_options, mock_get_options);
+  mock_options->NumCPUs = 4;
+  mock_options->DataDirectory = tor_strdup(get_fname("test_par_data_dir"));
+#ifdef _WIN32
+  tt_int_op(mkdir(mock_options->DataDirectory), OP_EQ, 0);
+#else
+  tt_int_op(mkdir(mock_options->DataDirectory, 0700), OP_EQ, 0);
+#endif
+  /* Every service needs a key of its own, not the test suite's cached
+   * one. */
+  UNMOCK(crypto_pk_generate_key_with_bits);
+  /* Threads only make keys while we hold the data directory lock. */
+  tt_int_op(try_locking(mock_options, 0), OP_EQ, 0);
+
+  for (i = 0; i < 8; ++i) {
+    char name[32];
+    s = tor_malloc_zero(sizeof(rend_service_t));
+    tor_snprintf(name, sizeof(name), "test_par_hs_dir%d", i);
+    s->directory = tor_strdup(get_fname(name));
+    smartlist_add(services, s);
+  }
+  tt_int_op(rend_service_load_all_keys(services), OP_EQ, 0);
+
+  /* Every service got its own key, and its hostname file. */
+  i = 0;
+  SMARTLIST_FOREACH_BEGIN(services, rend_service_t *, svc) {
+    tt_assert(svc->private_key);
+    tt_ptr_op(digestmap_get(seen, svc->pk_digest), OP_EQ, NULL);
+    digestmap_set(seen, svc->pk_digest, svc);
+    memcpy(digests[i++], svc->pk_digest, DIGEST_LEN);
+    tor_asprintf(&fname, "%s"PATH_SEPARATOR"hostname", svc->directory);
+    contents = read_file_to_str(fname, 0, NULL);
+    tt_assert(contents);
+    tt_assert(!strcmpstart(contents, svc->service_id));
+    tor_free(contents);
+    tor_free(fname);
+  } SMARTLIST_FOREACH_END(svc);
+
+  /* Loading again reads the same keys back. */
+  SMARTLIST_FOREACH_BEGIN(services, rend_service_t *, svc) {
+    crypto_pk_free(svc->private_key);
+    svc->private_key = NULL;
+    memset(svc->pk_digest, 0, DIGEST_LEN);
+  } SMARTLIST_FOREACH_END(svc);
+  tt_int_op(rend_service_load_all_keys(services), OP_EQ, 0);
+  for (i = 0; i < 8; ++i) {
+    s = smartlist_get(services, i);
+    tt_mem_op(s->pk_digest, OP_EQ, digests[i], DIGEST_LEN);
+  }
+
+  /* Lookups follow services as they come and go. */
+  s = smartlist_get(services, 3);
+  tt_int_op(rend_config_services(mock_options, 0), OP_EQ, 0);
+  tt_ptr_op(rend_service_get_by_service_id(s->service_id), OP_EQ, NULL);
+  smartlist_add(ports, rend_service_parse_port_config("80", " ", &err));
+  tt_int_op(rend_service_add_ephemeral(crypto_pk_dup_key(s->private_key),
+                                       ports, 0, 0, REND_NO_AUTH, NULL,
+                                       &service_id), OP_EQ, RSAE_OKAY);
+  ports = NULL;
+  tt_str_op(service_id, OP_EQ, s->service_id);
+  tt_assert(rend_service_get_by_service_id(service_id));
+  ports = smartlist_new();
+  smartlist_add(ports, rend_service_parse_port_config("80", " ", &err));
+  tt_int_op(rend_service_add_ephemeral(crypto_pk_dup_key(s->private_key),
+                                       ports, 0, 0, REND_NO_AUTH, NULL,
+                                       &contents), OP_EQ, RSAE_ADDREXISTS);
+  ports = NULL;
+  tt_int_op(rend_service_del_ephemeral(service_id), OP_EQ, 0);
+  tt_ptr_op(rend_service_get_by_service_id(service_id), OP_EQ, NULL);
+
+ done:
+  SMARTLIST_FOREACH(services, rend_service_t *, svc, rend_service_free(svc));
+  smartlist_free(services);
+  if (ports) {
+    SMARTLIST_FOREACH(ports, rend_service_port_config_t *, p,
+                      rend_service_port_config_free(p));
+    smartlist_free(ports);
+  }
+  digestmap_free(seen, NULL);
+  rend_service_free_all();
+  release_lockfile();
+  UNMOCK(get_options);
+  tor_free(mock_options->DataDirectory);
+  tor_free(service_id);
+  tor_free(contents);
+  tor_free(fname);
+  tor_free(err);
+}
+
+/** Encoding descriptors through a rend_upload_job_t must give the same
+ * descriptors as encoding them directly, from copies that share no keys
+ * with the service. */
+static void
+test_hs_upload_job(void *arg)
+{
+  rend_service_t *service = NULL;
+  rend_upload_job_t *job = NULL;
+  rend_intro_point_t *intro;
+  rend_upload_batch_t *batch;
+  smartlist_t *descs = smartlist_new();
+  time_t now = time(NULL);
+  int i, seconds_valid;
+
+  (void) arg;
+
+  rend_cache_init();
+  service = tor_malloc_zero(sizeof(rend_service_t));
+  service->private_key = pk_generate(0);
+  service->auth_type = REND_NO_AUTH;
+  service->desc = tor_malloc_zero(sizeof(rend_service_descriptor_t));
+  service->desc->pk = crypto_pk_dup_key(service->private_key);
+  service->desc->timestamp = now - (now % 3600);
+  service->desc->protocols = (1 << 2) + (1 << 3);
+  service->desc->intro_nodes = smartlist_new();
+  intro = tor_malloc_zero(sizeof(rend_intro_point_t));
+  intro->extend_info = tor_malloc_zero(sizeof(extend_info_t));
+  intro->extend_info->onion_key = pk_generate(1);
+  crypto_pk_get_digest(intro->extend_info->onion_key,
+                       intro->extend_info->identity_digest);
+  tor_addr_from_ipv4h(&intro->extend_info->addr, 0x7f000001);
+  intro->extend_info->port = 9001;
+  intro->intro_key = pk_generate(2);
+  smartlist_add(service->desc->intro_nodes, intro);
+
+  job = rend_upload_job_new(service, now);
+  tt_ptr_op(job->service, OP_EQ, service);
+  tt_ptr_op(job->desc->pk, OP_NE, service->desc->pk);
+  tt_assert(crypto_pk_eq_keys(job->desc->pk, service->desc->pk));
+  intro = smartlist_get(job->desc->intro_nodes, 0);
+  tt_ptr_op(intro->intro_key, OP_NE,
+            ((rend_intro_point_t *)
+             smartlist_get(service->desc->intro_nodes, 0))->intro_key);
+  tt_ptr_op(intro->extend_info->onion_key, OP_NE,
+            ((rend_intro_point_t *)
+             smartlist_get(service->desc->intro_nodes, 0))->
+              extend_info->onion_key);
+
+  tt_int_op(rend_upload_job_encode(job), OP_EQ, 0);
+  tt_int_op(job->status, OP_EQ, 0);
+  tt_int_op(smartlist_len(job->batches), OP_GE, 1);
+  tt_int_op(smartlist_len(job->batches), OP_LE, 2);
+
+  for (i = 0; i < smartlist_len(job->batches); ++i) {
+    batch = smartlist_get(job->batches, i);
+    tt_int_op(batch->period, OP_EQ, i);
+    seconds_valid = rend_encode_v2_descriptors(descs, service->desc, now,
+                                               batch->period, REND_NO_AUTH,
+                                               NULL, NULL);
+    tt_int_op(batch->seconds_valid, OP_EQ, seconds_valid);
+    tt_int_op(smartlist_len(batch->descs), OP_EQ, smartlist_len(descs));
+    SMARTLIST_FOREACH_BEGIN(descs, rend_encoded_v2_service_descriptor_t *,
+                            d) {
+      rend_encoded_v2_service_descriptor_t *ours =
+        smartlist_get(batch->descs, d_sl_idx);
+      tt_mem_op(ours->desc_id, OP_EQ, d->desc_id, DIGEST_LEN);
+      tt_str_op(ours->desc_str, OP_EQ, d->desc_str);
+    } SMARTLIST_FOREACH_END(d);
+    SMARTLIST_FOREACH(descs, rend_encoded_v2_service_descriptor_t *, d,
+                      rend_encoded_v2_service_descriptor_free(d));
+    smartlist_clear(descs);
+  }
+  /* We only encode the next period when the current one ends soon. */
+  batch = smartlist_get(job->batches, 0);
+  tt_int_op(smartlist_len(job->batches) == 2, OP_EQ,
+            batch->seconds_valid < REND_TIME_PERIOD_OVERLAPPING_V2_DESCS);
+
+ done:
+  SMARTLIST_FOREACH(descs, rend_encoded_v2_service_descriptor_t *, d,
+                    rend_encoded_v2_service_descriptor_free(d));
+  smartlist_free(descs);
+  rend_upload_job_free(job);
+  rend_service_free(service);
+  rend_cache_free_all();
+}
+
+/** The pool of prebuilt internal circuits for our services should follow
+ * the rate at which they launch circuits. */
+static void
+test_hs_prebuilt_circs(void *arg)
+{
+  const time_t now = 60 * 100000;
+  int i;
+
+  (void) arg;
+
+  tt_int_op(rend_service_prebuilt_circs_for_rate(now), OP_EQ, 3);
+  for (i = 0; i < 30; ++i)
+    rend_service_note_circ_launched(now + 10);
+  tt_int_op(rend_service_prebuilt_circs_for_rate(now + 20), OP_EQ, 8);
+  /* The last interval still counts... */
+  tt_int_op(rend_service_prebuilt_circs_for_rate(now + 70), OP_EQ, 8);
+  /* ...but not the one before it. */
+  tt_int_op(rend_service_prebuilt_circs_for_rate(now + 130), OP_EQ, 3);
+  for (i = 0; i < 100; ++i)
+    rend_service_note_circ_launched(now + 140);
+  tt_int_op(rend_service_prebuilt_circs_for_rate(now + 150), OP_EQ, 10);
+  /* After a quiet spell, we go back to the minimum. */
+  tt_int_op(rend_service_prebuilt_circs_for_rate(now + 1000), OP_EQ, 3);
+
+  /* Without services, we want none. */
+  tt_int_op(rend_service_get_n_prebuilt_circs_wanted(now + 1000), OP_EQ, 0);
+
+ done:
+  ;
+}
+
+static networkstatus_t *mock_ns = NULL;
+
+static networkstatus_t *
+mock_networkstatus_get_latest_consensus(void)
+{
+  return mock_ns;
+}
+
+/* Make sure that we pick the HSDirs that follow a descriptor ID on the
+ * ring, wrapping around at the end. */
+static void
+test_hs_responsible_dirs(void *arg)
+{
+  smartlist_t *dirs = smartlist_new();
+  char id[DIGEST_LEN];
+  routerstatus_t *rs;
+  int i;
+
+  (void) arg;
+
+  MOCK(networkstatus_get_latest_consensus,
+       mock_networkstatus_get_latest_consensus);
+
+  /* Routers 0x10, 0x20, ..., 0x60; all but 0x30 and 0x50 are HSDirs. */
+  mock_ns = tor_malloc_zero(sizeof(networkstatus_t));
+  mock_ns->type = NS_TYPE_CONSENSUS;
+  mock_ns->routerstatus_list = smartlist_new();
+  for (i = 1; i <= 6; ++i) {
+    rs = tor_malloc_zero(sizeof(routerstatus_t));
+    memset(rs->identity_digest, i * 0x10, DIGEST_LEN);
+    rs->is_hs_dir = (i != 3 && i != 5);
+    smartlist_add(mock_ns->routerstatus_list, rs);
+  }
+
+#define CHECK_DIRS(a, b, c) STMT_BEGIN                                  \
+    tt_int_op(hid_serv_get_responsible_directories(dirs, id), OP_EQ, 0); \
+    tt_int_op(smartlist_len(dirs), OP_EQ, 3);                           \
+    rs = smartlist_get(dirs, 0);                                        \
+    tt_int_op((uint8_t)rs->identity_digest[0], OP_EQ, (a));             \
+    rs = smartlist_get(dirs, 1);                                        \
+    tt_int_op((uint8_t)rs->identity_digest[0], OP_EQ, (b));             \
+    rs = smartlist_get(dirs, 2);                                        \
+    tt_int_op((uint8_t)rs->identity_digest[0], OP_EQ, (c));             \
+    smartlist_clear(dirs);                                              \
+  STMT_END
+
+  memset(id, 0x00, sizeof(id));
+  CHECK_DIRS(0x10, 0x20, 0x40);
+  /* An exact match is responsible itself. */
+  memset(id, 0x20, sizeof(id));
+  CHECK_DIRS(0x20, 0x40, 0x60);
+  memset(id, 0x25, sizeof(id));
+  CHECK_DIRS(0x40, 0x60, 0x10);
+  memset(id, 0x61, sizeof(id));
+  CHECK_DIRS(0x10, 0x20, 0x40);
+#undef CHECK_DIRS
+
+  /* With fewer HSDirs than replicas, we take what there is... */
+  networkstatus_vote_free(mock_ns);
+  mock_ns = tor_malloc_zero(sizeof(networkstatus_t));
+  mock_ns->type = NS_TYPE_CONSENSUS;
+  mock_ns->routerstatus_list = smartlist_new();
+  rs = tor_malloc_zero(sizeof(routerstatus_t));
+  memset(rs->identity_digest, 0x10, DIGEST_LEN);
+  rs->is_hs_dir = 1;
+  smartlist_add(mock_ns->routerstatus_list, rs);
+  rs = tor_malloc_zero(sizeof(routerstatus_t));
+  memset(rs->identity_digest, 0x20, DIGEST_LEN);
+  smartlist_add(mock_ns->routerstatus_list, rs);
+  tt_int_op(hid_serv_get_responsible_directories(dirs, id), OP_EQ, 0);
+  tt_int_op(smartlist_len(dirs), OP_EQ, 1);
+  smartlist_clear(dirs);
+
+  /* ...but fail with none at all. */
+  networkstatus_vote_free(mock_ns);
+  mock_ns = tor_malloc_zero(sizeof(networkstatus_t));
+  mock_ns->type = NS_TYPE_CONSENSUS;
+  mock_ns->routerstatus_list = smartlist_new();
+  rs = tor_malloc_zero(sizeof(routerstatus_t));
+  smartlist_add(mock_ns->routerstatus_list, rs);
+  tt_int_op(hid_serv_get_responsible_directories(dirs, id), OP_EQ, -1);
+  tt_int_op(smartlist_len(dirs), OP_EQ, 0);
+
+ done:
+  networkstatus_vote_free(mock_ns);
+  mock_ns = NULL;
+  smartlist_free(dirs);
+  UNMOCK(networkstatus_get_latest_consensus);
+}
+
+static void
+test_hs_service_stats(void *arg)
+{
+  crypto_pk_t *pk = pk_generate(0);
+  smartlist_t *ports = smartlist_new();
+  char *service_id = NULL, *stats = NULL, *msg = NULL;
+  char pk_digest[DIGEST_LEN], cookie[REND_COOKIE_LEN];
+  origin_circuit_t *circ = NULL;
+  rend_service_t service;
+
+  (void) arg;
+
+  /* Latencies land in doubling buckets, starting at 250 msec. */
+  memset(&service, 0, sizeof(service));
+  rend_service_note_rend_latency(&service, 0);
+  rend_service_note_rend_latency(&service, 249);
+  rend_service_note_rend_latency(&service, 250);
+  rend_service_note_rend_latency(&service, 1999);
+  rend_service_note_rend_latency(&service, 1000000);
+  tt_int_op(service.stats.rend_latency[0], OP_EQ, 2);
+  tt_int_op(service.stats.rend_latency[1], OP_EQ, 1);
+  tt_int_op(service.stats.rend_latency[3], OP_EQ, 1);
+  tt_int_op(service.stats.rend_latency[REND_SERVICE_N_LATENCY_BUCKETS-1],
+            OP_EQ, 1);
+
+  /* Nothing to report without services. */
+  tt_ptr_op(rend_service_get_stats_string(), OP_EQ, NULL);
+  tt_ptr_op(rend_service_format_stats_heartbeat(), OP_EQ, NULL);
+
+  tt_int_op(rend_config_services(get_options(), 0), OP_EQ, 0);
+  tt_int_op(crypto_pk_get_digest(pk, pk_digest), OP_EQ, 0);
+  smartlist_add(ports, rend_service_parse_port_config("80", " ", NULL));
+  tt_int_op(rend_service_add_ephemeral(pk, ports, 0, 0, REND_NO_AUTH, NULL,
+                                       &service_id), OP_EQ, RSAE_OKAY);
+  pk = NULL;
+  ports = NULL;
+
+  /* A closing rendezvous circuit credits its stream bytes to the
+   * service. */
+  memset(cookie, 'c', sizeof(cookie));
+  circ = tor_malloc_zero(sizeof(origin_circuit_t));
+  circ->rend_data = rend_data_service_create(service_id, pk_digest,
+                                             (uint8_t *) cookie,
+                                             REND_NO_AUTH);
+  circ->n_service_stream_bytes = 4096;
+  rend_service_note_rend_circ_closed(circ);
+  tt_u64_op(circ->n_service_stream_bytes, OP_EQ, 0);
+
+  stats = rend_service_get_stats_string();
+  tt_assert(stats);
+  tt_assert(!strcmpstart(stats, service_id));
+  tt_assert(strstr(stats, " IntrosReceived=0 IntrosDropped=0 RendJoined=0 "
+                   "RendLatency=0,0,0,0,0,0,0,0 StreamBytes=4096 "));
+  msg = rend_service_format_stats_heartbeat();
+  tt_assert(msg);
+  tt_assert(strstr(msg, "carried 4 kB"));
+
+ done:
+  if (circ)
+    rend_data_free(circ->rend_data);
+  tor_free(circ);
+  crypto_pk_free(pk);
+  if (ports) {
+    SMARTLIST_FOREACH(ports, rend_service_port_config_t *, p,
+                      rend_service_port_config_free(p));
+    smartlist_free(ports);
+  }
+  tor_free(service_id);
+  tor_free(stats);
+  tor_free(msg);
+  rend_service_free_all();
+}
+
 struct testcase_t hs_tests[] = {
   { "hs_rend_data", test_hs_rend_data, TT_FORK,
     NULL, NULL },
@@ -718,6 +1107,16 @@ struct testcase_t hs_tests[] = {
     NULL, NULL },
   { "single_onion_poisoning", test_single_onion_poisoning, TT_FORK,
     NULL, NULL },
+  { "hs_upload_job", test_hs_upload_job, TT_FORK,
+    NULL, NULL },
+  { "hs_load_keys_in_parallel", test_hs_load_keys_in_parallel, TT_FORK,
+    NULL, NULL },
+  { "hs_prebuilt_circs", test_hs_prebuilt_circs, TT_FORK,
+    NULL, NULL },
+  { "hs_service_stats", test_hs_service_stats, TT_FORK,
+    NULL, NULL },
+  { "hs_responsible_dirs", test_hs_responsible_dirs, TT_FORK,
+    NULL, NULL },
   END_OF_TESTCASES
 };
 
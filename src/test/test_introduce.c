@@ -517,6 +517,72 @@ test_introduce_late_parse_v3(void *arg)
       v3_basic_auth_test_plaintext, sizeof(v3_basic_auth_test_plaintext));
 }
 
+/** Test the decrypt-and-handshake stage that we hand to the cpuworkers
+ */
+
+static void
+test_introduce_handshake_v3(void *arg)
+{
+  crypto_pk_t *k = NULL, *other = NULL;
+  ssize_t r;
+  uint8_t *cell = NULL;
+  size_t cell_len;
+  rend_intro_cell_t *parsed_req = NULL;
+  char *err_msg = NULL;
+  const char *stage = "none";
+  crypto_dh_t *dh = NULL;
+  char keys[DIGEST_LEN+CPATH_KEY_MATERIAL_LEN], zero[sizeof(keys)];
+  (void)arg;
+
+  k = crypto_pk_new();
+  tt_assert(!crypto_pk_read_private_key_from_string(k, AUTHORITY_SIGNKEY_1,
+                                                    -1));
+  other = crypto_pk_new();
+  tt_assert(!crypto_pk_read_private_key_from_string(other,
+                                                    AUTHORITY_SIGNKEY_2, -1));
+
+  r = make_intro_from_plaintext(v3_no_auth_test_plaintext,
+                                sizeof(v3_no_auth_test_plaintext),
+                                k, (void **)(&cell));
+  tt_assert(r > 0);
+  cell_len = r;
+
+  /* With the wrong key, we fail at decryption. */
+  parsed_req = rend_service_begin_parse_intro(cell, cell_len, 2, &err_msg);
+  tt_assert(parsed_req);
+  tt_int_op(-1, OP_EQ, rend_service_intro_handshake(parsed_req, other, 7,
+                                                    &dh, keys, &err_msg,
+                                                    &stage));
+  tt_str_op(stage, OP_EQ, "decryption");
+  tt_assert(err_msg);
+  tt_ptr_op(dh, OP_EQ, NULL);
+  tor_free(err_msg);
+  rend_service_free_intro(parsed_req);
+
+  /* With the right one, we get all the way through the DH handshake. */
+  parsed_req = rend_service_begin_parse_intro(cell, cell_len, 2, &err_msg);
+  tt_assert(parsed_req);
+  memset(keys, 0, sizeof(keys));
+  memset(zero, 0, sizeof(zero));
+  tt_int_op(0, OP_EQ, rend_service_intro_handshake(parsed_req, k, 7,
+                                                   &dh, keys, &err_msg,
+                                                   &stage));
+  tt_ptr_op(stage, OP_EQ, NULL);
+  tt_ptr_op(err_msg, OP_EQ, NULL);
+  tt_assert(parsed_req->parsed);
+  tt_assert(dh);
+  tt_mem_op(keys, OP_NE, zero, sizeof(keys));
+
+ done:
+  tor_free(cell);
+  crypto_pk_free(k);
+  crypto_pk_free(other);
+  rend_service_free_intro(parsed_req);
+  if (dh)
+    crypto_dh_free(dh);
+  tor_free(err_msg);
+}
+
 #define INTRODUCE_LEGACY(name) \
   { #name, test_introduce_ ## name , 0, NULL, NULL }
 
@@ -533,6 +599,7 @@ struct testcase_t introduce_tests[] = {
   INTRODUCE_LEGACY(late_parse_v1),
   INTRODUCE_LEGACY(late_parse_v2),
   INTRODUCE_LEGACY(late_parse_v3),
+  INTRODUCE_LEGACY(handshake_v3),
   END_OF_TESTCASES
 };
 
@@ -240,6 +240,74 @@ test_keypin_journal(void *arg)
   keypin_clear();
 }
 
+static void
+test_keypin_compact_journal(void *arg)
+{
+  (void)arg;
+  char *contents = NULL;
+  smartlist_t *lines = smartlist_new();
+  const char *fname = get_fname("keypin-journal-compact");
+  int i;
+
+  /* A short journal doesn't get compacted. */
+  tt_int_op(0, ==, keypin_load_journal(fname));
+  update_approx_time(1217709000);
+  tt_int_op(0, ==, keypin_open_journal(fname));
+  tt_int_op(KEYPIN_ADDED, ==, ADD("king-of-the-herrings",
+                                  "good-for-nothing attorney-at-law"));
+  keypin_close_journal();
+  keypin_clear();
+  tt_int_op(0, ==, keypin_load_journal(fname));
+  tt_int_op(0, ==, keypin_compact_journal(fname));
+  keypin_clear();
+
+  /* A long journal full of duplicates and superseded entries does. */
+  for (i = 0; i < 1500; ++i) {
+    smartlist_add(lines, tor_strdup(
+      "eWVsbG93aXNoLXJlZC15ZWxsb3c "
+      "c2FsdC1hbmQtcGVwcGVyIGhpZ2gtbXVjay1hLW11Y2s"));
+  }
+  smartlist_add(lines, tor_strdup(
+    "dGhlYXRyZS1pbi10aGUtcm91bmQ "
+    "aG9saWVyLXRoYW4tdGhvdSBqYWNrLWluLXRoZS1ib3g"));
+  /* This one supersedes the yellowish-red-yellow entry. */
+  smartlist_add(lines, tor_strdup(
+    "aW50ZWxsZWN0dWFsaXphdGlvbnM "
+    "c2FsdC1hbmQtcGVwcGVyIGhpZ2gtbXVjay1hLW11Y2s"));
+  contents = smartlist_join_strings(lines, "\n", 1, NULL);
+  tt_int_op(0, ==, write_str_to_file(fname, contents, 1));
+  tor_free(contents);
+
+  tt_int_op(0, ==, keypin_load_journal(fname));
+  update_approx_time(1412278354);
+  tt_int_op(1, ==, keypin_compact_journal(fname));
+  keypin_clear();
+
+  contents = read_file_to_str(fname, RFTS_BIN, NULL);
+  tt_assert(contents);
+  tt_int_op(strlen(contents), ==,
+            strlen("@compacted-at 2014-10-02 19:32:34\n") +
+            2 * (BASE64_DIGEST_LEN + BASE64_DIGEST256_LEN + 2));
+  tt_assert(!strcmpstart(contents, "@compacted-at 2014-10-02 19:32:34\n"));
+
+  /* And it still has the same entries. */
+  tt_int_op(0, ==, keypin_load_journal(fname));
+  tt_int_op(0, ==, keypin_compact_journal(fname));
+  tt_int_op(KEYPIN_FOUND, ==, keypin_check(
+            (const uint8_t*)"theatre-in-the-round",
+            (const uint8_t*)"holier-than-thou jack-in-the-box"));
+  tt_int_op(KEYPIN_FOUND, ==, keypin_check(
+            (const uint8_t*)"intellectualizations",
+            (const uint8_t*)"salt-and-pepper high-muck-a-muck"));
+  tt_int_op(KEYPIN_NOT_FOUND, ==, LONE_RSA("yellowish-red-yellow"));
+
+ done:
+  SMARTLIST_FOREACH(lines, char *, cp, tor_free(cp));
+  smartlist_free(lines);
+  tor_free(contents);
+  keypin_clear();
+}
+
 #undef ADD
 #undef LONE_RSA
 
@@ -251,6 +319,7 @@ struct testcase_t keypin_tests[] = {
   TEST( parse_file, TT_FORK ),
   TEST( add_entry, TT_FORK ),
   TEST( journal, TT_FORK ),
+  TEST( compact_journal, TT_FORK ),
   END_OF_TESTCASES
 };
 
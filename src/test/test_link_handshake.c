@@ -192,6 +192,51 @@ test_link_handshake_certs_ok(void *arg)
   crypto_pk_free(key2);
 }
 
+/* We encode each CERTS cell once, and again only when our keys change. */
+static void
+test_link_handshake_certs_cell_cache(void *arg)
+{
+  const tor_x509_cert_t *link_cert = NULL, *id_cert = NULL;
+  const var_cell_t *cell;
+  var_cell_t *old_cell = NULL;
+  crypto_pk_t *key1 = NULL, *key2 = NULL, *key3 = NULL;
+  (void) arg;
+
+  key1 = pk_generate(2);
+  key2 = pk_generate(3);
+  key3 = pk_generate(4);
+  tt_int_op(tor_tls_context_init(TOR_TLS_CTX_IS_PUBLIC_SERVER,
+                                 key1, key2, 86400), ==, 0);
+
+  tt_int_op(tor_tls_get_my_certs(1, &link_cert, &id_cert), ==, 0);
+  cell = connection_or_get_certs_cell(1, link_cert, id_cert);
+  tt_int_op(cell->command, ==, CELL_CERTS);
+  tt_int_op(cell->payload[1], ==, OR_CERT_TYPE_TLS_LINK);
+  tt_ptr_op(cell, ==, connection_or_get_certs_cell(1, link_cert, id_cert));
+  old_cell = var_cell_copy(cell);
+
+  /* The client-side cell is cached separately. */
+  tt_int_op(tor_tls_get_my_certs(0, &link_cert, &id_cert), ==, 0);
+  cell = connection_or_get_certs_cell(0, link_cert, id_cert);
+  tt_int_op(cell->payload[1], ==, OR_CERT_TYPE_AUTH_1024);
+
+  /* New keys make a new cell. */
+  tt_int_op(tor_tls_context_init(TOR_TLS_CTX_IS_PUBLIC_SERVER,
+                                 key3, key2, 86400), ==, 0);
+  tt_int_op(tor_tls_get_my_certs(1, &link_cert, &id_cert), ==, 0);
+  cell = connection_or_get_certs_cell(1, link_cert, id_cert);
+  tt_int_op(cell->payload[1], ==, OR_CERT_TYPE_TLS_LINK);
+  tt_assert(cell->payload_len != old_cell->payload_len ||
+            tor_memneq(cell->payload, old_cell->payload, cell->payload_len));
+
+ done:
+  connection_or_clear_certs_cell_cache();
+  var_cell_free(old_cell);
+  crypto_pk_free(key1);
+  crypto_pk_free(key2);
+  crypto_pk_free(key3);
+}
+
 typedef struct certs_data_s {
   or_connection_t *c;
   channel_tls_t *chan;
@@ -950,6 +995,7 @@ AUTHENTICATE_FAIL(badsig_1,
 
 struct testcase_t link_handshake_tests[] = {
   TEST(certs_ok, TT_FORK),
+  TEST(certs_cell_cache, TT_FORK),
   //TEST(certs_bad, TT_FORK),
   TEST_RCV_CERTS(ok),
   TEST_RCV_CERTS(ok_server),
@@ -164,10 +164,119 @@ test_ratelim(void *arg)
   tor_free(msg);
 }
 
+static void
+test_async(void *arg)
+{
+  const char *fn = get_fname("async_log");
+  char *content = NULL;
+  log_severity_list_t severity;
+  smartlist_t *lines = smartlist_new();
+  int i;
+  (void)arg;
+
+  set_log_severity_config(LOG_INFO, LOG_ERR, &severity);
+
+  init_logging(1);
+  mark_logs_temp();
+  add_file_log(&severity, fn, 0);
+  close_temp_logs();
+
+  tt_int_op(logs_set_async(1, 0), OP_EQ, 0);
+  for (i = 0; i < 2000; ++i)
+    log_info(LD_GENERAL, "Queued message %d", i);
+  /* Errors are written directly, but only after what was queued. */
+  log_err(LD_GENERAL, "Direct error");
+  tt_int_op(logs_set_async(0, 0), OP_EQ, 0);
+  log_info(LD_GENERAL, "After async");
+
+  content = read_file_to_str(fn, 0, NULL);
+  tt_assert(content != NULL);
+  tor_split_lines(lines, content, (int)strlen(content));
+  if (smartlist_len(lines) &&
+      strstr(smartlist_get(lines, 0), "opening new log file"))
+    smartlist_del_keeporder(lines, 0);
+  tt_int_op(smartlist_len(lines), OP_EQ, 2002);
+  for (i = 0; i < 2000; ++i) {
+    char expected[64];
+    tor_snprintf(expected, sizeof(expected), "Queued message %d", i);
+    tt_assert(strstr(smartlist_get(lines, i), expected));
+  }
+  tt_assert(strstr(smartlist_get(lines, 2000), "Direct error"));
+  tt_assert(strstr(smartlist_get(lines, 2001), "After async"));
+
+ done:
+  logs_set_async(0, 0);
+  tor_free(content);
+  smartlist_free(lines);
+}
+
+/** Number of times count_formatting() has been called. */
+static int n_formatted = 0;
+/** Number of messages delivered to counting_cb_fn(). */
+static int n_delivered = 0;
+
+static const char *
+count_formatting(void)
+{
+  ++n_formatted;
+  return "argument";
+}
+
+static void
+counting_cb_fn(int severity, uint32_t domain, const char *msg)
+{
+  (void)severity; (void)domain; (void)msg;
+  ++n_delivered;
+}
+
+static void
+test_domain_filter(void *arg)
+{
+  log_severity_list_t severity;
+  (void)arg;
+
+  set_log_severity_config(LOG_WARN, LOG_ERR, &severity);
+  severity.masks[LOG_INFO - LOG_ERR] = LD_CIRC;
+
+  init_logging(1);
+  mark_logs_temp();
+  add_callback_log(&severity, counting_cb_fn);
+  close_temp_logs();
+
+  tt_int_op(log_global_min_severity_, OP_EQ, LOG_INFO);
+  tt_assert(log_global_wants_(LOG_INFO, LD_CIRC));
+  tt_assert(!log_global_wants_(LOG_INFO, LD_GENERAL));
+  tt_assert(!log_global_wants_(LOG_DEBUG, LD_CIRC));
+  tt_assert(log_global_wants_(LOG_WARN, LD_GENERAL));
+
+  /* Messages that nobody wants don't even get their arguments built. */
+  log_info(LD_GENERAL, "Unwanted %s", count_formatting());
+  log_debug(LD_CIRC, "Unwanted %s", count_formatting());
+  tt_int_op(n_formatted, OP_EQ, 0);
+  tt_int_op(n_delivered, OP_EQ, 0);
+
+  log_info(LD_CIRC, "Wanted %s", count_formatting());
+  tt_int_op(n_formatted, OP_EQ, 1);
+  tt_int_op(n_delivered, OP_EQ, 1);
+
+  /* log_fn() evaluates its arguments, but still skips delivery. */
+  log_fn(LOG_INFO, LD_GENERAL, "Unwanted %s", count_formatting());
+  tt_int_op(n_formatted, OP_EQ, 2);
+  tt_int_op(n_delivered, OP_EQ, 1);
+
+  log_warn(LD_GENERAL, "Wanted %s", count_formatting());
+  tt_int_op(n_delivered, OP_EQ, 2);
+
+ done:
+  ;
+}
+
 struct testcase_t logging_tests[] = {
   { "sigsafe_err_fds", test_get_sigsafe_err_fds, TT_FORK, NULL, NULL },
   { "sigsafe_err", test_sigsafe_err, TT_FORK, NULL, NULL },
   { "ratelim", test_ratelim, 0, NULL, NULL },
+  { "async", test_async, TT_FORK, NULL, NULL },
+  { "domain_filter", test_domain_filter, TT_FORK, NULL, NULL },
   END_OF_TESTCASES
 };
 
@@ -2,9 +2,13 @@
 /* See LICENSE for licensing information */
 
 #include "orconfig.h"
+#define CONNECTION_PRIVATE
 #include "or.h"
 
+#include "buffers.h"
 #include "config.h"
+#include "connection.h"
+#include "directory.h"
 #include "dirvote.h"
 #include "microdesc.h"
 #include "networkstatus.h"
@@ -296,6 +300,85 @@ test_md_cache_broken(void *data)
   microdesc_free_all();
 }
 
+/** Microdescriptors from the cache file should only have their fields
+ * parsed when we first need them; unparseable ones should get dropped. */
+static void
+test_md_cache_lazy(void *data)
+{
+  or_options_t *options;
+  char *fn = NULL, *content = NULL;
+  microdesc_cache_t *mc = NULL;
+  microdesc_t *md3, *md_bad;
+  char d3[DIGEST256_LEN], d_bad[DIGEST256_LEN];
+  const char *test_md3_noannotation = strchr(test_md3, '\n')+1;
+  const char *truncated_md_noannotation = strchr(truncated_md, '\n')+1;
+  time_t listed;
+  (void)data;
+
+  options = get_options_mutable();
+  tt_assert(options);
+  tor_free(options->DataDirectory);
+  options->DataDirectory = tor_strdup(get_fname("md_datadir_test_lazy"));
+
+#ifdef _WIN32
+  tt_int_op(0, OP_EQ, mkdir(options->DataDirectory));
+#else
+  tt_int_op(0, OP_EQ, mkdir(options->DataDirectory, 0700));
+#endif
+
+  crypto_digest256(d3, test_md3_noannotation, strlen(test_md3_noannotation),
+                   DIGEST_SHA256);
+  crypto_digest256(d_bad, truncated_md_noannotation,
+                   strlen(truncated_md_noannotation), DIGEST_SHA256);
+  tt_int_op(0, OP_EQ, parse_iso_time("2013-08-08 19:02:59", &listed));
+
+  tor_asprintf(&fn, "%s"PATH_SEPARATOR"cached-microdescs",
+               options->DataDirectory);
+  tor_asprintf(&content, "@last-listed 2013-08-08 19:02:59\n"
+               "@some-other-annotation foo\n%s%s",
+               test_md3_noannotation, truncated_md);
+  write_str_to_file(fn, content, 1);
+
+  mc = get_microdesc_cache();
+  md3 = microdesc_cache_lookup_by_digest256(mc, d3);
+  md_bad = microdesc_cache_lookup_by_digest256(mc, d_bad);
+  tt_assert(md3);
+  tt_assert(md_bad);
+
+  /* Nothing has been parsed but the annotations. */
+  tt_assert(md3->body_unparsed);
+  tt_assert(md_bad->body_unparsed);
+  tt_int_op(md3->last_listed, OP_EQ, listed);
+  tt_int_op(md_bad->last_listed, OP_EQ, listed);
+  tt_ptr_op(md3->onion_pkey, OP_EQ, NULL);
+  tt_ptr_op(md3->family, OP_EQ, NULL);
+
+  tt_int_op(0, OP_EQ, microdesc_ensure_parsed(md3));
+  tt_assert(! md3->body_unparsed);
+  tt_assert(md3->onion_pkey_der);
+  tt_ptr_op(md3->onion_pkey, OP_EQ, NULL);
+  tt_assert(microdesc_get_onion_pkey(md3));
+  tt_assert(md3->exit_policy);
+  tt_int_op(3, OP_EQ, smartlist_len(md3->family));
+  tt_str_op(smartlist_get(md3->family, 2), OP_EQ, "nodeZ");
+  tt_int_op(0, OP_EQ, microdesc_ensure_parsed(md3));
+
+  /* The broken one is noticed when we try to use it, and then dropped. */
+  tt_int_op(-1, OP_EQ, microdesc_ensure_parsed(md_bad));
+  tt_assert(md_bad->unparseable);
+  tt_int_op(-1, OP_EQ, microdesc_ensure_parsed(md_bad));
+  microdesc_cache_clean(mc, listed - 3600, 1/*force*/);
+  tt_ptr_op(md3, OP_EQ, microdesc_cache_lookup_by_digest256(mc, d3));
+  tt_ptr_op(NULL, OP_EQ, microdesc_cache_lookup_by_digest256(mc, d_bad));
+
+ done:
+  if (options)
+    tor_free(options->DataDirectory);
+  tor_free(fn);
+  tor_free(content);
+  microdesc_free_all();
+}
+
 /* Generated by chutney. */
 static const char test_ri[] =
   "router test005r 127.0.0.1 5005 0 7005\n"
@@ -492,6 +575,73 @@ test_md_generate(void *arg)
   routerinfo_free(ri);
 }
 
+/** Free a list of vote_microdesc_hash_t. */
+static void
+vote_microdesc_hash_list_free(vote_microdesc_hash_t *h)
+{
+  while (h) {
+    vote_microdesc_hash_t *next = h->next;
+    tor_free(h->microdesc_hash_line);
+    tor_free(h);
+    h = next;
+  }
+}
+
+/* Make sure that we don't rebuild microdescriptors that we made for an
+ * earlier vote and that are still in our cache. */
+static void
+test_md_vote_lines_cached(void *arg)
+{
+  routerinfo_t *ri = NULL;
+  or_options_t *options = get_options_mutable();
+  smartlist_t *mds = smartlist_new();
+  smartlist_t *added = NULL;
+  vote_microdesc_hash_t *lines1 = NULL, *lines2 = NULL, *h1, *h2;
+  const time_t now = time(NULL);
+  (void)arg;
+
+  tor_free(options->DataDirectory);
+  options->DataDirectory = tor_strdup(get_fname("md_datadir_test_vote"));
+#ifdef _WIN32
+  tt_int_op(0, OP_EQ, mkdir(options->DataDirectory));
+#else
+  tt_int_op(0, OP_EQ, mkdir(options->DataDirectory, 0700));
+#endif
+
+  ri = router_parse_entry_from_string(test_ri, NULL, 0, 0, NULL, NULL);
+  tt_assert(ri);
+
+  /* The first time, we make the microdescriptors. */
+  lines1 = dirvote_format_all_microdesc_vote_lines(ri, now, mds);
+  tt_assert(lines1);
+  tt_int_op(smartlist_len(mds), OP_GT, 0);
+  added = microdescs_add_list_to_cache(get_microdesc_cache(), mds,
+                                       SAVED_NOWHERE, 1);
+  tt_int_op(smartlist_len(added), OP_EQ, smartlist_len(mds));
+  smartlist_clear(mds);
+
+  /* The next time, we vote for the same ones without making them again. */
+  lines2 = dirvote_format_all_microdesc_vote_lines(ri, now + 3600, mds);
+  tt_int_op(smartlist_len(mds), OP_EQ, 0);
+  for (h1 = lines1, h2 = lines2; h1 && h2; h1 = h1->next, h2 = h2->next)
+    tt_str_op(h1->microdesc_hash_line, OP_EQ, h2->microdesc_hash_line);
+  tt_ptr_op(h1, OP_EQ, NULL);
+  tt_ptr_op(h2, OP_EQ, NULL);
+  SMARTLIST_FOREACH(added, microdesc_t *, md,
+                    tt_int_op(md->last_listed, OP_EQ, now + 3600));
+
+ done:
+  vote_microdesc_hash_list_free(lines1);
+  vote_microdesc_hash_list_free(lines2);
+  SMARTLIST_FOREACH(mds, microdesc_t *, md, microdesc_free(md));
+  smartlist_free(mds);
+  smartlist_free(added);
+  routerinfo_free(ri);
+  microdesc_free_all();
+  dirvote_free_all();
+  tor_free(options->DataDirectory);
+}
+
 #ifdef HAVE_CFLAG_WOVERLENGTH_STRINGS
 DISABLE_GCC_WARNING(overlength-strings)
 /* We allow huge string constants in the unit tests, but not in the code
@@ -723,6 +873,55 @@ test_md_parse(void *arg)
   tor_free(mem_op_hex_tmp);
 }
 
+static void
+test_md_onion_key_lazy(void *arg)
+{
+  (void) arg;
+  smartlist_t *mds = NULL, *invalid = smartlist_new();
+  crypto_pk_t *expected = crypto_pk_new(), *big = crypto_pk_new();
+  microdesc_t *md;
+  char *pem = NULL, *s = NULL;
+  size_t pem_len;
+  const char *key_start = strstr(test_md1, "-----BEGIN");
+
+  /* An ordinary 1024-bit onion key is kept encoded until it's wanted. */
+  tt_int_op(0, OP_EQ, crypto_pk_read_public_key_from_string(expected,
+                                     key_start, strlen(key_start)));
+  mds = microdescs_parse_from_string(test_md1, NULL, 1, SAVED_NOWHERE,
+                                     NULL);
+  tt_int_op(smartlist_len(mds), OP_EQ, 1);
+  md = smartlist_get(mds, 0);
+  tt_ptr_op(md->onion_pkey, OP_EQ, NULL);
+  tt_assert(md->onion_pkey_der);
+  tt_assert(microdesc_get_onion_pkey(md));
+  tt_assert(crypto_pk_eq_keys(md->onion_pkey, expected));
+  tt_ptr_op(md->onion_pkey_der, OP_EQ, NULL);
+  tt_ptr_op(microdesc_get_onion_pkey(md), OP_EQ, md->onion_pkey);
+  SMARTLIST_FOREACH(mds, microdesc_t *, m, microdesc_free(m));
+  smartlist_free(mds);
+
+  /* Anything else is decoded and checked up front, and rejected here. */
+  tt_int_op(0, OP_EQ, crypto_pk_generate_key_with_bits(big, 2048));
+  tt_int_op(0, OP_EQ, crypto_pk_write_public_key_to_string(big, &pem,
+                                                           &pem_len));
+  tor_asprintf(&s, "onion-key\n%s", pem);
+  mds = microdescs_parse_from_string(s, NULL, 1, SAVED_NOWHERE, invalid);
+  tt_int_op(smartlist_len(mds), OP_EQ, 0);
+  tt_int_op(smartlist_len(invalid), OP_EQ, 1);
+
+ done:
+  if (mds) {
+    SMARTLIST_FOREACH(mds, microdesc_t *, m, microdesc_free(m));
+    smartlist_free(mds);
+  }
+  SMARTLIST_FOREACH(invalid, char *, cp, tor_free(cp));
+  smartlist_free(invalid);
+  crypto_pk_free(expected);
+  crypto_pk_free(big);
+  tor_free(pem);
+  tor_free(s);
+}
+
 static int mock_rgsbd_called = 0;
 static routerstatus_t *mock_rgsbd_val_a = NULL;
 static routerstatus_t *mock_rgsbd_val_b = NULL;
@@ -851,11 +1050,97 @@ test_md_corrupt_desc(void *arg)
   smartlist_free(sl);
 }
 
+static void
+mock_connection_mark_for_close_internal_(connection_t *conn,
+                                         int line, const char *file)
+{
+  (void)line;
+  (void)file;
+  conn->marked_for_close = 1;
+}
+
+/** A microdescriptor download should be decompressed and parsed as it
+ * arrives, so that each microdescriptor is usable once it is complete. */
+static void
+test_md_stream_download(void *arg)
+{
+  or_options_t *options = get_options_mutable();
+  dir_connection_t *conn = NULL;
+  microdesc_cache_t *mc;
+  char d1[DIGEST256_LEN], d2[DIGEST256_LEN];
+  char b64_1[BASE64_DIGEST256_LEN+1], b64_2[BASE64_DIGEST256_LEN+1];
+  char *body = NULL, *compressed = NULL;
+  size_t compressed_len = 0;
+  const char headers[] =
+    "HTTP/1.0 200 OK\r\nContent-Encoding: deflate\r\n\r\n";
+  (void)arg;
+
+  tor_free(options->DataDirectory);
+  options->DataDirectory = tor_strdup(get_fname("md_stream_test"));
+#ifdef _WIN32
+  tt_int_op(0, OP_EQ, mkdir(options->DataDirectory));
+#else
+  tt_int_op(0, OP_EQ, mkdir(options->DataDirectory, 0700));
+#endif
+  MOCK(connection_mark_for_close_internal_,
+       mock_connection_mark_for_close_internal_);
+
+  crypto_digest256(d1, test_md1, strlen(test_md1), DIGEST_SHA256);
+  crypto_digest256(d2, test_md2, strlen(test_md2), DIGEST_SHA256);
+  digest256_to_base64(b64_1, d1);
+  digest256_to_base64(b64_2, d2);
+  tor_asprintf(&body, "%s%s", test_md1, test_md2);
+  tt_int_op(0, OP_EQ, tor_gzip_compress(&compressed, &compressed_len,
+                                        body, strlen(body), ZLIB_METHOD));
+  tt_int_op(compressed_len, OP_GT, 40);
+
+  conn = dir_connection_new(AF_INET);
+  conn->base_.purpose = DIR_PURPOSE_FETCH_MICRODESC;
+  conn->base_.state = DIR_CONN_STATE_CLIENT_READING;
+  conn->base_.address = tor_strdup("127.0.0.1");
+  tor_asprintf(&conn->requested_resource, "d/%s-%s", b64_1, b64_2);
+  mc = get_microdesc_cache();
+
+  /* Headers alone aren't enough to start. */
+  write_to_buf(headers, strlen(headers), conn->base_.inbuf);
+  write_to_buf(compressed, 10, conn->base_.inbuf);
+  tt_int_op(0, OP_EQ, connection_dir_process_inbuf(conn));
+  tt_ptr_op(conn->stream, OP_EQ, NULL);
+  tt_assert(! conn->stream_checked);
+
+  /* Once we see the start of the second microdescriptor, the first one is
+   * in the cache. */
+  write_to_buf(compressed + 10, compressed_len - 14, conn->base_.inbuf);
+  tt_int_op(0, OP_EQ, connection_dir_process_inbuf(conn));
+  tt_assert(conn->stream);
+  tt_int_op(buf_datalen(conn->base_.inbuf), OP_EQ, 0);
+  tt_assert(microdesc_cache_lookup_by_digest256(mc, d1));
+  tt_ptr_op(microdesc_cache_lookup_by_digest256(mc, d2), OP_EQ, NULL);
+
+  /* And at EOF, we get the second one. */
+  write_to_buf(compressed + compressed_len - 4, 4, conn->base_.inbuf);
+  tt_int_op(0, OP_EQ, connection_dir_process_inbuf(conn));
+  tt_int_op(0, OP_EQ, connection_dir_reached_eof(conn));
+  tt_int_op(conn->base_.state, OP_EQ, DIR_CONN_STATE_CLIENT_FINISHED);
+  tt_assert(microdesc_cache_lookup_by_digest256(mc, d2));
+
+ done:
+  UNMOCK(connection_mark_for_close_internal_);
+  if (conn)
+    connection_free_(TO_CONN(conn));
+  tor_free(body);
+  tor_free(compressed);
+}
+
 struct testcase_t microdesc_tests[] = {
   { "cache", test_md_cache, TT_FORK, NULL, NULL },
+  { "stream_download", test_md_stream_download, TT_FORK, NULL, NULL },
   { "broken_cache", test_md_cache_broken, TT_FORK, NULL, NULL },
+  { "cache_lazy", test_md_cache_lazy, TT_FORK, NULL, NULL },
   { "generate", test_md_generate, 0, NULL, NULL },
+  { "vote_lines_cached", test_md_vote_lines_cached, TT_FORK, NULL, NULL },
   { "parse", test_md_parse, 0, NULL, NULL },
+  { "onion_key_lazy", test_md_onion_key_lazy, 0, NULL, NULL },
   { "reject_cache", test_md_reject_cache, TT_FORK, NULL, NULL },
   { "corrupt_desc", test_md_corrupt_desc, TT_FORK, NULL, NULL },
   END_OF_TESTCASES
@@ -0,0 +1,194 @@
+/* Copyright (c) 2016, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+#include "orconfig.h"
+
+#define TOR_CHANNEL_INTERNAL_
+#include "or.h"
+#include "channel.h"
+#include "channeldgram.h"
+#include "scheduler.h"
+
+/* Test suite stuff */
+#include "test.h"
+#include "netsim_test_helpers.h"
+
+/** What one run of run_dgram_transfer() measured. */
+typedef struct dgram_transfer_result_t {
+  /** Cells delivered on each of the two circuits. */
+  int n_received[2];
+  /** Total and largest time from handing a cell to the channel to its
+   * delivery, in usec. */
+  uint64_t total_latency_usec;
+  uint64_t max_latency_usec;
+  /** Time of the last delivery, in usec after the run started. */
+  uint64_t finish_usec;
+  uint64_t n_retransmits;
+  netsim_link_stats_t forward;
+} dgram_transfer_result_t;
+
+/** Number of cells each transfer sends, alternating between circuits. */
+#define TRANSFER_CELLS 2000
+
+static netsim_t *sim = NULL;
+static channel_t *sender = NULL, *receiver = NULL;
+static int n_cells_sent = 0;
+static uint64_t start_usec = 0;
+static dgram_transfer_result_t *result = NULL;
+
+/** Ticker: give the sending channel as many cells as it will take. */
+static void
+send_cells_tick(void *arg, uint64_t now_usec)
+{
+  (void)arg;
+  while (n_cells_sent < TRANSFER_CELLS &&
+         channel_num_cells_writeable(sender) > 0) {
+    cell_t cell;
+    memset(&cell, 0, sizeof(cell));
+    cell.circ_id = (n_cells_sent & 1) ? 7 : 5;
+    cell.command = CELL_RELAY;
+    set_uint64(cell.payload, now_usec);
+    channel_write_cell(sender, &cell);
+    ++n_cells_sent;
+  }
+}
+
+/** Ticker: let both channels retransmit. */
+static void
+retransmit_tick(void *arg, uint64_t now_usec)
+{
+  (void)arg;
+  channel_dgram_retransmit(BASE_CHAN_TO_DGRAM(sender), now_usec / 1000);
+  channel_dgram_retransmit(BASE_CHAN_TO_DGRAM(receiver), now_usec / 1000);
+}
+
+static void
+record_cell_handler(channel_t *chan, cell_t *cell)
+{
+  uint64_t now = netsim_now_usec(sim);
+  uint64_t latency = now - get_uint64(cell->payload);
+  (void)chan;
+  ++result->n_received[cell->circ_id == 7];
+  result->total_latency_usec += latency;
+  if (latency > result->max_latency_usec)
+    result->max_latency_usec = latency;
+  result->finish_usec = now - start_usec;
+}
+
+/** Send TRANSFER_CELLS cells over a pair of datagram channels joined by
+ * simulated links with the given one-way latency, bandwidth and loss, and
+ * store what happened in *<b>out</b>. */
+static void
+run_dgram_transfer(unsigned seed, uint32_t latency_usec,
+                   uint64_t bytes_per_sec, uint32_t loss_per_million,
+                   dgram_transfer_result_t *out)
+{
+  channel_dgram_transport_t transport;
+  netsim_link_t *forward, *back;
+  tor_addr_t addr;
+
+  memset(out, 0, sizeof(*out));
+  result = out;
+  n_cells_sent = 0;
+  scheduler_init();
+  sim = netsim_new(seed);
+  start_usec = netsim_now_usec(sim);
+  tor_addr_from_ipv4h(&addr, 0x7f000001);
+
+  forward = netsim_link_new(sim, latency_usec, bytes_per_sec,
+                            loss_per_million, 0);
+  back = netsim_link_new(sim, latency_usec, bytes_per_sec,
+                         loss_per_million, 0);
+  netsim_link_get_dgram_transport(forward, &transport);
+  sender = channel_dgram_new(&transport, &addr, 9001, NULL, 0);
+  netsim_link_get_dgram_transport(back, &transport);
+  receiver = channel_dgram_new(&transport, &addr, 9002, NULL, 1);
+  netsim_link_set_receiver(forward, netsim_deliver_to_dgram_channel,
+                           receiver);
+  netsim_link_set_receiver(back, netsim_deliver_to_dgram_channel, sender);
+  channel_set_cell_handlers(receiver, record_cell_handler, NULL);
+
+  netsim_add_ticker(sim, 1000, send_cells_tick, NULL);
+  netsim_add_ticker(sim, 10000, retransmit_tick, NULL);
+  netsim_run_until(sim, start_usec + 60 * 1000000);
+
+  out->n_retransmits = BASE_CHAN_TO_DGRAM(sender)->n_retransmits;
+  memcpy(&out->forward, netsim_link_get_stats(forward),
+         sizeof(netsim_link_stats_t));
+
+  channel_free_all();
+  netsim_free(sim);
+  sim = NULL;
+  sender = receiver = NULL;
+  scheduler_free_all();
+  result = NULL;
+}
+
+static void
+test_netsim_bandwidth_and_latency(void *arg)
+{
+  dgram_transfer_result_t r;
+  const uint64_t bw = 1000000; /* 1 MB/s */
+  const uint64_t wire_bytes = (uint64_t)TRANSFER_CELLS * DGRAM_FRAME_MAX_LEN;
+  (void)arg;
+
+  run_dgram_transfer(1, 20000, bw, 0, &r);
+
+  tt_int_op(r.n_received[0], OP_EQ, TRANSFER_CELLS / 2);
+  tt_int_op(r.n_received[1], OP_EQ, TRANSFER_CELLS / 2);
+  tt_u64_op(r.n_retransmits, OP_EQ, 0);
+  tt_u64_op(r.forward.n_delivered, OP_EQ, TRANSFER_CELLS);
+  tt_u64_op(r.forward.bytes_delivered, OP_EQ, wire_bytes);
+  /* The link can't go faster than its bandwidth, and no cell arrives
+   * sooner than the link's latency. */
+  tt_u64_op(r.finish_usec, OP_GE, wire_bytes * 1000000 / bw);
+  tt_u64_op(r.forward.total_delay_usec, OP_GE,
+            (uint64_t)TRANSFER_CELLS * 20000);
+  /* A full send window sits in the link's queue, so cells wait behind up
+   * to a window's worth of others. */
+  tt_u64_op(r.max_latency_usec, OP_GE, 20000);
+  tt_u64_op(r.max_latency_usec, OP_LE,
+            20000 + 2 * 1000 +
+            (uint64_t)(DGRAM_CHAN_SEND_WINDOW + 1) * DGRAM_FRAME_MAX_LEN *
+            1000000 / bw);
+
+ done:
+  ;
+}
+
+static void
+test_netsim_reproducible(void *arg)
+{
+  dgram_transfer_result_t r1, r2, r3;
+  (void)arg;
+
+  /* 2% loss each way. */
+  run_dgram_transfer(42, 20000, 1000000, 20000, &r1);
+  run_dgram_transfer(42, 20000, 1000000, 20000, &r2);
+
+  /* Every cell still gets through, after some retransmissions. */
+  tt_int_op(r1.n_received[0], OP_EQ, TRANSFER_CELLS / 2);
+  tt_int_op(r1.n_received[1], OP_EQ, TRANSFER_CELLS / 2);
+  tt_u64_op(r1.forward.n_lost, OP_GT, 0);
+  tt_u64_op(r1.n_retransmits, OP_GE, r1.forward.n_lost);
+
+  /* The same seed gives exactly the same run. */
+  tt_mem_op(&r1, OP_EQ, &r2, sizeof(r1));
+
+  /* A different seed loses different datagrams. */
+  run_dgram_transfer(43, 20000, 1000000, 20000, &r3);
+  tt_int_op(r3.n_received[0] + r3.n_received[1], OP_EQ, TRANSFER_CELLS);
+  tt_assert(r3.forward.n_lost != r1.forward.n_lost ||
+            r3.finish_usec != r1.finish_usec);
+
+ done:
+  ;
+}
+
+struct testcase_t netsim_tests[] = {
+  { "bandwidth_and_latency", test_netsim_bandwidth_and_latency, TT_FORK,
+    NULL, NULL },
+  { "reproducible", test_netsim_reproducible, TT_FORK, NULL, NULL },
+  END_OF_TESTCASES
+};
+
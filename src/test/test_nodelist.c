@@ -7,7 +7,10 @@
  **/
 
 #include "or.h"
+#include "config.h"
+#include "networkstatus.h"
 #include "nodelist.h"
+#include "routerset.h"
 #include "test.h"
 
 /** Test the case when node_get_by_id() returns NULL,
@@ -100,6 +103,341 @@ test_nodelist_node_is_dir(void *arg)
   return;
 }
 
+/** Helper: build a fake consensus listing one routerstatus for each
+ * identity byte in <b>ids</b>. */
+static networkstatus_t *
+fake_consensus_with_ids(const char *ids)
+{
+  networkstatus_t *ns = tor_malloc_zero(sizeof(networkstatus_t));
+  ns->type = NS_TYPE_CONSENSUS;
+  ns->flavor = FLAV_NS;
+  ns->routerstatus_list = smartlist_new();
+  for (; *ids; ++ids) {
+    routerstatus_t *rs = tor_malloc_zero(sizeof(routerstatus_t));
+    memset(rs->identity_digest, *ids, DIGEST_LEN);
+    rs->addr = 0x7f000001;
+    rs->is_flagged_running = rs->is_valid = 1;
+    smartlist_add(ns->routerstatus_list, rs);
+  }
+  return ns;
+}
+
+static networkstatus_t *mock_latest_consensus = NULL;
+
+static networkstatus_t *
+mock_networkstatus_get_latest_consensus(void)
+{
+  return mock_latest_consensus;
+}
+
+static void
+fake_consensus_free(networkstatus_t *ns)
+{
+  if (!ns)
+    return;
+  SMARTLIST_FOREACH(ns->routerstatus_list, routerstatus_t *, rs,
+                    tor_free(rs));
+  smartlist_free(ns->routerstatus_list);
+  tor_free(ns);
+}
+
+/** Setting a new consensus should update the nodes that remain listed,
+ * add the newly listed ones, and drop the nodes that are listed nowhere. */
+static void
+test_nodelist_set_consensus_update(void *arg)
+{
+  networkstatus_t *ns1 = NULL, *ns2 = NULL;
+  char id_a[DIGEST_LEN], id_b[DIGEST_LEN], id_c[DIGEST_LEN];
+  const node_t *node;
+  (void)arg;
+
+  memset(id_a, 'a', DIGEST_LEN);
+  memset(id_b, 'b', DIGEST_LEN);
+  memset(id_c, 'c', DIGEST_LEN);
+
+  MOCK(networkstatus_get_latest_consensus,
+       mock_networkstatus_get_latest_consensus);
+
+  ns1 = fake_consensus_with_ids("ab");
+  mock_latest_consensus = ns1;
+  nodelist_set_consensus(ns1);
+  tt_int_op(smartlist_len(nodelist_get_list()), OP_EQ, 2);
+  node = node_get_by_id(id_b);
+  tt_assert(node);
+  tt_ptr_op(node->rs, OP_EQ, smartlist_get(ns1->routerstatus_list, 1));
+  tt_assert(node->is_running);
+
+  /* The caller frees the old consensus before installing the new one. */
+  fake_consensus_free(ns1);
+  ns1 = NULL;
+  ns2 = fake_consensus_with_ids("bc");
+  ((routerstatus_t *)smartlist_get(ns2->routerstatus_list, 0))
+    ->is_flagged_running = 0;
+  mock_latest_consensus = ns2;
+  nodelist_set_consensus(ns2);
+
+  tt_int_op(smartlist_len(nodelist_get_list()), OP_EQ, 2);
+  tt_ptr_op(node_get_by_id(id_a), OP_EQ, NULL);
+
+  node = node_get_by_id(id_b);
+  tt_assert(node);
+  tt_ptr_op(node->rs, OP_EQ, smartlist_get(ns2->routerstatus_list, 0));
+  tt_assert(! node->is_running);
+  tt_assert(node->is_valid);
+
+  node = node_get_by_id(id_c);
+  tt_assert(node);
+  tt_ptr_op(node->rs, OP_EQ, smartlist_get(ns2->routerstatus_list, 1));
+  tt_assert(node->is_running);
+
+ done:
+  UNMOCK(networkstatus_get_latest_consensus);
+  mock_latest_consensus = NULL;
+  nodelist_free_all();
+  fake_consensus_free(ns1);
+  fake_consensus_free(ns2);
+}
+
+/** The packed node summaries should describe each node's descriptors, and
+ * follow changes to them. */
+static void
+test_nodelist_node_summaries(void *arg)
+{
+  networkstatus_t *ns = NULL;
+  microdesc_t md;
+  curve25519_public_key_t curve_key;
+  routerstatus_t *rs_b;
+  const uint8_t *summaries;
+  node_t *node_a = NULL, *node_b = NULL;
+  char id_a[DIGEST_LEN], id_b[DIGEST_LEN];
+  (void)arg;
+
+  memset(id_a, 'a', DIGEST_LEN);
+  memset(id_b, 'b', DIGEST_LEN);
+  memset(&md, 0, sizeof(md));
+  memset(&curve_key, 0x11, sizeof(curve_key));
+
+  MOCK(networkstatus_get_latest_consensus,
+       mock_networkstatus_get_latest_consensus);
+
+  ns = fake_consensus_with_ids("ab");
+  rs_b = smartlist_get(ns->routerstatus_list, 1);
+  rs_b->protocols_known = 1;
+  rs_b->supports_extend2_cells = 0;
+  mock_latest_consensus = ns;
+  nodelist_set_consensus(ns);
+
+  node_a = node_get_mutable_by_id(id_a);
+  node_b = node_get_mutable_by_id(id_b);
+  tt_assert(node_a);
+  tt_assert(node_b);
+
+  summaries = nodelist_get_node_summaries();
+  tt_int_op(summaries[node_a->nodelist_idx], OP_EQ, 0);
+  tt_int_op(summaries[node_b->nodelist_idx], OP_EQ, NODE_SUMMARY_NO_NTOR);
+
+  /* Give a a microdescriptor without an ntor key. */
+  node_a->md = &md;
+  nodelist_invalidate_node_summaries();
+  summaries = nodelist_get_node_summaries();
+  tt_int_op(summaries[node_a->nodelist_idx], OP_EQ,
+            NODE_SUMMARY_HAS_DESC|NODE_SUMMARY_NO_NTOR);
+
+  /* Now give it a key. */
+  md.onion_curve25519_pkey = &curve_key;
+  nodelist_invalidate_node_summaries();
+  summaries = nodelist_get_node_summaries();
+  tt_int_op(summaries[node_a->nodelist_idx], OP_EQ,
+            NODE_SUMMARY_HAS_DESC|NODE_SUMMARY_HAS_NTOR_KEY);
+  tt_int_op(summaries[node_b->nodelist_idx], OP_EQ, NODE_SUMMARY_NO_NTOR);
+
+ done:
+  if (node_a)
+    node_a->md = NULL;
+  UNMOCK(networkstatus_get_latest_consensus);
+  mock_latest_consensus = NULL;
+  nodelist_free_all();
+  fake_consensus_free(ns);
+}
+
+/** Membership in the routersets from our options should be precomputed
+ * with the node summaries, and routerset_contains_node() should use it. */
+static void
+test_nodelist_node_routersets(void *arg)
+{
+  networkstatus_t *ns = NULL;
+  routerset_t *exclude = routerset_new(), *other = routerset_new();
+  or_options_t *options = get_options_mutable();
+  node_t *node_a = NULL, *node_b = NULL;
+  node_t fake_node;
+  char id[DIGEST_LEN];
+  (void)arg;
+
+  MOCK(networkstatus_get_latest_consensus,
+       mock_networkstatus_get_latest_consensus);
+
+  ns = fake_consensus_with_ids("ab");
+  mock_latest_consensus = ns;
+  nodelist_set_consensus(ns);
+  memset(id, 'a', DIGEST_LEN);
+  node_a = node_get_mutable_by_id(id);
+  memset(id, 'b', DIGEST_LEN);
+  node_b = node_get_mutable_by_id(id);
+  tt_assert(node_a && node_b);
+
+  /* Exclude a by identity. */
+  tt_int_op(routerset_parse(exclude,
+                            "$6161616161616161616161616161616161616161",
+                            "test"), OP_EQ, 0);
+  tt_int_op(routerset_parse(other,
+                            "$6262626262626262626262626262626262626262",
+                            "test"), OP_EQ, 0);
+  options->ExcludeNodes = exclude;
+
+  /* Nothing is precomputed until we recompute the summaries. */
+  nodelist_invalidate_node_summaries();
+  tt_int_op(nodelist_node_in_routerset(node_a, exclude), OP_EQ, -1);
+  tt_assert(routerset_contains_node(exclude, node_a));
+
+  nodelist_get_node_summaries();
+  tt_int_op(nodelist_node_in_routerset(node_a, exclude), OP_EQ, 1);
+  tt_int_op(nodelist_node_in_routerset(node_b, exclude), OP_EQ, 0);
+  tt_assert(routerset_contains_node(exclude, node_a));
+  tt_assert(! routerset_contains_node(exclude, node_b));
+
+  /* Sets that aren't in our options still get full matching. */
+  tt_int_op(nodelist_node_in_routerset(node_b, other), OP_EQ, -1);
+  tt_assert(routerset_contains_node(other, node_b));
+
+  /* So do nodes that aren't in the nodelist. */
+  memcpy(&fake_node, node_a, sizeof(fake_node));
+  tt_int_op(nodelist_node_in_routerset(&fake_node, exclude), OP_EQ, -1);
+  tt_assert(routerset_contains_node(exclude, &fake_node));
+
+  /* The precomputed bits follow changes to our options. */
+  options->ExcludeNodes = other;
+  nodelist_invalidate_node_summaries();
+  nodelist_get_node_summaries();
+  tt_int_op(nodelist_node_in_routerset(node_a, other), OP_EQ, 0);
+  tt_int_op(nodelist_node_in_routerset(node_b, other), OP_EQ, 1);
+  tt_int_op(nodelist_node_in_routerset(node_a, exclude), OP_EQ, -1);
+
+ done:
+  options->ExcludeNodes = NULL;
+  routerset_free(exclude);
+  routerset_free(other);
+  UNMOCK(networkstatus_get_latest_consensus);
+  mock_latest_consensus = NULL;
+  nodelist_free_all();
+  fake_consensus_free(ns);
+}
+
+/** Helper for test_nodelist_node_family: return a newly allocated
+ * single-element family list naming the node whose identity is all
+ * <b>c</b>. */
+static smartlist_t *
+fake_family_naming(char c)
+{
+  char id[DIGEST_LEN];
+  char hex[HEX_DIGEST_LEN+2];
+  smartlist_t *family = smartlist_new();
+  memset(id, c, DIGEST_LEN);
+  hex[0] = '$';
+  base16_encode(hex+1, HEX_DIGEST_LEN+1, id, DIGEST_LEN);
+  smartlist_add(family, tor_strdup(hex));
+  return family;
+}
+
+/** nodelist_add_node_and_family() should find a node's subnet neighbours
+ * and the nodes that agree with it about being in the same family, both
+ * the first time and from its cached answer. */
+static void
+test_nodelist_node_family(void *arg)
+{
+  networkstatus_t *ns = NULL;
+  microdesc_t md_a, md_c, md_d;
+  smartlist_t *sl = smartlist_new();
+  node_t *node_a = NULL, *node_b, *node_c = NULL, *node_d = NULL;
+  char id[DIGEST_LEN];
+  int pass;
+  (void)arg;
+
+  memset(&md_a, 0, sizeof(md_a));
+  memset(&md_c, 0, sizeof(md_c));
+  memset(&md_d, 0, sizeof(md_d));
+  get_options_mutable()->EnforceDistinctSubnets = 1;
+
+  MOCK(networkstatus_get_latest_consensus,
+       mock_networkstatus_get_latest_consensus);
+
+  ns = fake_consensus_with_ids("abcd");
+  SMARTLIST_FOREACH_BEGIN(ns->routerstatus_list, routerstatus_t *, rs) {
+    rs->or_port = 9001;
+    rs->addr = 0x0a000001 + (rs_sl_idx << 24); /* 10.0.0.1, 11.0.0.1, ... */
+  } SMARTLIST_FOREACH_END(rs);
+  /* b shares a's /16. */
+  ((routerstatus_t *)smartlist_get(ns->routerstatus_list, 1))->addr =
+    0x0a00ff01;
+  mock_latest_consensus = ns;
+  nodelist_set_consensus(ns);
+
+  memset(id, 'a', DIGEST_LEN);
+  node_a = node_get_mutable_by_id(id);
+  memset(id, 'b', DIGEST_LEN);
+  node_b = node_get_mutable_by_id(id);
+  memset(id, 'c', DIGEST_LEN);
+  node_c = node_get_mutable_by_id(id);
+  memset(id, 'd', DIGEST_LEN);
+  node_d = node_get_mutable_by_id(id);
+  tt_assert(node_a && node_b && node_c && node_d);
+
+  /* a and c agree that they are family; d claims a, but a doesn't agree. */
+  md_a.family = fake_family_naming('c');
+  md_c.family = fake_family_naming('a');
+  md_d.family = fake_family_naming('a');
+  node_a->md = &md_a;
+  node_c->md = &md_c;
+  node_d->md = &md_d;
+  nodelist_invalidate_node_summaries();
+
+  for (pass = 0; pass < 2; ++pass) {
+    smartlist_clear(sl);
+    nodelist_add_node_and_family(sl, node_a);
+    tt_assert(smartlist_contains(sl, node_a));
+    tt_assert(smartlist_contains(sl, node_b));
+    tt_assert(smartlist_contains(sl, node_c));
+    tt_assert(! smartlist_contains(sl, node_d));
+  }
+
+  smartlist_clear(sl);
+  nodelist_add_node_and_family(sl, node_d);
+  tt_int_op(smartlist_len(sl), OP_EQ, 2); /* d itself, twice. */
+  tt_ptr_op(smartlist_get(sl, 0), OP_EQ, node_d);
+  tt_ptr_op(smartlist_get(sl, 1), OP_EQ, node_d);
+
+ done:
+  if (node_a)
+    node_a->md = NULL;
+  if (node_c)
+    node_c->md = NULL;
+  if (node_d)
+    node_d->md = NULL;
+  if (md_a.family)
+    SMARTLIST_FOREACH(md_a.family, char *, cp, tor_free(cp));
+  smartlist_free(md_a.family);
+  if (md_c.family)
+    SMARTLIST_FOREACH(md_c.family, char *, cp, tor_free(cp));
+  smartlist_free(md_c.family);
+  if (md_d.family)
+    SMARTLIST_FOREACH(md_d.family, char *, cp, tor_free(cp));
+  smartlist_free(md_d.family);
+  smartlist_free(sl);
+  UNMOCK(networkstatus_get_latest_consensus);
+  mock_latest_consensus = NULL;
+  nodelist_free_all();
+  fake_consensus_free(ns);
+}
+
 #define NODE(name, flags) \
   { #name, test_nodelist_##name, (flags), NULL, NULL }
 
@@ -107,6 +445,10 @@ struct testcase_t nodelist_tests[] = {
   NODE(node_get_verbose_nickname_by_id_null_node, TT_FORK),
   NODE(node_get_verbose_nickname_not_named, TT_FORK),
   NODE(node_is_dir, TT_FORK),
+  NODE(set_consensus_update, TT_FORK),
+  NODE(node_summaries, TT_FORK),
+  NODE(node_routersets, TT_FORK),
+  NODE(node_family, TT_FORK),
   END_OF_TESTCASES
 };
 
@@ -13,6 +13,8 @@
 #include "compat_libevent.h"
 #include "connection.h"
 #include "config.h"
+#include "geoip.h"
+#include "memacct.h"
 #include "relay.h"
 #include "test.h"
 
@@ -359,9 +361,134 @@ test_oom_streambuf(void *arg)
   monotime_disable_test_mocking();
 }
 
+/** Check that the OOM index tracks the circuit with the oldest cell as
+ * cells are queued, sent, and cleared. */
+static void
+test_oom_cell_index(void *arg)
+{
+  circuit_t *c1 = NULL, *c2 = NULL, *c3 = NULL;
+  packed_cell_t *cell;
+  uint32_t t, t2;
+  const uint64_t start_ns = 1389641159 * (uint64_t)1000000000;
+  int i;
+
+  (void) arg;
+  monotime_enable_test_mocking();
+  MOCK(circuit_mark_for_close_, circuit_mark_for_close_dummy_);
+
+  tt_ptr_op(circuit_oom_index_get_oldest(), OP_EQ, NULL);
+
+  monotime_coarse_set_mock_time_nsec(start_ns);
+  c1 = dummy_or_circuit_new(2, 0);
+  monotime_coarse_set_mock_time_nsec(start_ns + 100 * 1000000);
+  c2 = dummy_origin_circuit_new(3);
+  monotime_coarse_set_mock_time_nsec(start_ns + 200 * 1000000);
+  c3 = dummy_or_circuit_new(0, 0);
+  tt_int_op(c3->oom_index_idx, OP_EQ, -1);
+  tt_int_op(circuit_oldest_cell_time(c3, &t), OP_EQ, 0);
+
+  tt_ptr_op(circuit_oom_index_get_oldest(), OP_EQ, c1);
+  tt_int_op(circuit_oldest_cell_time(c1, &t), OP_EQ, 1);
+  tt_uint_op(t, OP_EQ, c1->oom_cell_time);
+
+  /* Sending c1's cells leaves a stale key, which gets fixed up lazily. */
+  for (i = 0; i < 2; ++i) {
+    cell = cell_queue_pop(&TO_OR_CIRCUIT(c1)->p_chan_cells);
+    packed_cell_free(cell);
+  }
+  tt_int_op(c1->oom_index_idx, OP_GE, 0);
+  tt_ptr_op(circuit_oom_index_get_oldest(), OP_EQ, c2);
+  tt_int_op(c1->oom_index_idx, OP_EQ, -1);
+
+  /* A cell on c1's other queue puts it back, behind c2. */
+  monotime_coarse_set_mock_time_nsec(start_ns + 300 * 1000000);
+  {
+    cell_t c;
+    memset(&c, 0, sizeof(c));
+    cell_queue_append_packed_copy(c1, &c1->n_chan_cells, 1, &c, 1, 0);
+  }
+  tt_int_op(c1->oom_index_idx, OP_GE, 0);
+  tt_ptr_op(circuit_oom_index_get_oldest(), OP_EQ, c2);
+  t2 = c2->oom_cell_time;
+
+  /* Freeing a circuit takes it out of the index. */
+  circuit_free(c2);
+  c2 = NULL;
+  tt_ptr_op(circuit_oom_index_get_oldest(), OP_EQ, c1);
+  tt_uint_op(c1->oom_cell_time - t2, OP_EQ, 200);
+
+ done:
+  circuit_free(c1);
+  circuit_free(c2);
+  circuit_free(c3);
+  UNMOCK(circuit_mark_for_close_);
+  monotime_disable_test_mocking();
+}
+
+/** Check that the memory accounting registry sees the geoip client cache,
+ * and shrinks it when we're low on memory. */
+static void
+test_oom_memacct(void *arg)
+{
+  or_options_t *options = get_options_mutable();
+  const time_t now = 1389641159;
+  tor_addr_t addr;
+  size_t alloc, limit;
+  char *s = NULL;
+  int i;
+  (void) arg;
+
+  /* Start with an empty client cache. */
+  geoip_free_all();
+  tt_u64_op(geoip_client_cache_total_allocation(), OP_EQ, 0);
+  options->EntryStatistics = 1;
+
+  for (i = 0; i < 1000; ++i) {
+    tor_addr_from_ipv4h(&addr, 0x0a000000 + i);
+    geoip_note_client_seen(GEOIP_CLIENT_CONNECT, &addr, NULL, now + i);
+  }
+  alloc = geoip_client_cache_total_allocation();
+  tt_u64_op(alloc, OP_GT, 0);
+  tt_u64_op(memacct_get_allocation(MEMACCT_GEOIP_CLIENTS), OP_EQ, alloc);
+  tt_u64_op(memacct_get_limited_allocation(), OP_GE, alloc);
+  tt_str_op(memacct_get_name(MEMACCT_GEOIP_CLIENTS), OP_EQ, "geoip-clients");
+
+  s = memacct_format_breakdown();
+  tt_assert(strstr(s, "geoip-clients="));
+  tt_assert(strstr(s, "\ntotal="));
+  tt_assert(strstr(s, "\nmax-mem-in-queues-total="));
+  tt_assert(strstr(s, "\ncache-files-mapped=0"));
+
+  /* A limit that the cache is well under leaves it alone... */
+  tt_u64_op(memacct_handle_oom(now, alloc * 10), OP_EQ, 0);
+  tt_u64_op(geoip_client_cache_total_allocation(), OP_EQ, alloc);
+
+  /* ...but one that it's well over makes it shrink to a tenth of the
+   * limit, starting with the clients we saw longest ago. */
+  limit = alloc;
+  tt_u64_op(memacct_handle_oom(now, limit), OP_GT, 0);
+  tt_u64_op(geoip_client_cache_total_allocation(), OP_LE, limit / 10);
+  alloc = geoip_client_cache_total_allocation();
+  tt_u64_op(alloc, OP_GT, 0);
+  /* We still remember the most recent client, but not the oldest. */
+  tor_addr_from_ipv4h(&addr, 0x0a000000 + 999);
+  geoip_note_client_seen(GEOIP_CLIENT_CONNECT, &addr, NULL, now + 1000);
+  tt_u64_op(geoip_client_cache_total_allocation(), OP_EQ, alloc);
+  tor_addr_from_ipv4h(&addr, 0x0a000000);
+  geoip_note_client_seen(GEOIP_CLIENT_CONNECT, &addr, NULL, now + 1001);
+  tt_u64_op(geoip_client_cache_total_allocation(), OP_GT, alloc);
+
+ done:
+  tor_free(s);
+  geoip_free_all();
+  options->EntryStatistics = 0;
+}
+
 struct testcase_t oom_tests[] = {
   { "circbuf", test_oom_circbuf, TT_FORK, NULL, NULL },
   { "streambuf", test_oom_streambuf, TT_FORK, NULL, NULL },
+  { "cell_index", test_oom_cell_index, TT_FORK, NULL, NULL },
+  { "memacct", test_oom_memacct, TT_FORK, NULL, NULL },
   END_OF_TESTCASES
 };
 
@@ -43,6 +43,8 @@ test_policy_summary_helper(const char *policy_str,
   smartlist_t *policy = smartlist_new();
   char *summary = NULL;
   char *summary_after = NULL;
+  char *summary_again = NULL;
+  uint64_t hits_before;
   int r;
   short_policy_t *short_policy = NULL;
 
@@ -60,6 +62,12 @@ test_policy_summary_helper(const char *policy_str,
   tt_assert(summary != NULL);
   tt_str_op(summary,OP_EQ, expected_summary);
 
+  /* Summarizing the same policy again should come from the cache. */
+  hits_before = n_policy_summary_cache_hits;
+  summary_again = policy_summarize(policy, AF_INET);
+  tt_str_op(summary_again,OP_EQ, expected_summary);
+  tt_u64_op(n_policy_summary_cache_hits,OP_EQ, hits_before + 1);
+
   short_policy = parse_short_policy(summary);
   tt_assert(short_policy);
   summary_after = write_short_policy(short_policy);
@@ -67,6 +75,7 @@ test_policy_summary_helper(const char *policy_str,
 
  done:
   tor_free(summary_after);
+  tor_free(summary_again);
   tor_free(summary);
   if (policy)
     addr_policy_list_free(policy);
@@ -1851,6 +1860,114 @@ test_policies_fascist_firewall_choose_address(void *arg)
   UNMOCK(get_options);
 }
 
+/** Helper: assert that <b>cp</b> gives the same answers as <b>policy</b>
+ * for <b>addr</b> with a few ports, and for no port at all. */
+static void
+test_compiled_policy_matches_helper(const smartlist_t *policy,
+                                    const compiled_policy_t *cp,
+                                    const tor_addr_t *addr)
+{
+  static const uint16_t ports[] = { 0, 1, 22, 25, 80, 443, 1023, 1024,
+                                    6667, 9001, 65534, 65535 };
+  unsigned i;
+
+  for (i = 0; i < ARRAY_LENGTH(ports); ++i) {
+    tt_int_op(compare_tor_addr_to_addr_policy(addr, ports[i], policy), OP_EQ,
+              compare_tor_addr_to_compiled_policy(addr, ports[i], cp));
+  }
+ done:
+  ;
+}
+
+/** Run unit tests for compiled address policies. */
+static void
+test_policies_compiled(void *arg)
+{
+  smartlist_t *policy = NULL;
+  compiled_policy_t *cp = NULL;
+  addr_policy_t *p;
+  tor_addr_t tar;
+  int malformed_list, i, j;
+  static const char *entries[] = {
+    "reject 18.0.0.0/8:*",
+    "accept 18.244.0.0/16:80",
+    "reject 18.244.0.0/15:443",
+    "accept 18.244.1.2:*",
+    "reject 0.0.0.0/0:25",
+    "reject [2001:db8::]/32:*",
+    "accept [2001:db8:1::]/48:443-1024",
+    "reject [2001:db8:1::5]:*",
+    "accept6 *:6667",
+    "reject 128.0.0.0/1:9001",
+    "accept 192.0.2.0/24:1-1023",
+  };
+  static const char *addrs[] = {
+    "18.0.0.1", "18.244.1.2", "18.244.1.3", "18.245.9.9", "19.0.0.1",
+    "192.0.2.77", "200.1.2.3", "1.2.3.4",
+    "[2001:db8::1]", "[2001:db8:1::5]", "[2001:db8:1::6]", "[2002::1]",
+  };
+  (void)arg;
+
+  /* No policy accepts everything. */
+  tt_ptr_op(compiled_policy_new(NULL), OP_EQ, NULL);
+  tor_addr_parse(&tar, "18.0.0.1");
+  tt_int_op(ADDR_POLICY_ACCEPTED, OP_EQ,
+            compare_tor_addr_to_compiled_policy(&tar, 80, NULL));
+  tt_int_op(1, OP_EQ, compiled_policy_is_reject_star(NULL, AF_INET));
+
+  /* Try every prefix of our entries, so that the trie gets built in many
+   * different orders. */
+  for (i = 0; i <= (int)ARRAY_LENGTH(entries); ++i) {
+    policy = smartlist_new();
+    for (j = 0; j < i; ++j) {
+      p = router_parse_addr_policy_item_from_string(entries[j], -1,
+                                                    &malformed_list);
+      tt_assert(p);
+      smartlist_add(policy, p);
+    }
+    cp = compiled_policy_new(policy);
+    tt_assert(cp);
+
+    for (j = 0; j < (int)ARRAY_LENGTH(addrs); ++j) {
+      tt_int_op(tor_addr_parse(&tar, addrs[j]), OP_GE, 0);
+      test_compiled_policy_matches_helper(policy, cp, &tar);
+    }
+    test_compiled_policy_matches_helper(policy, cp, NULL);
+    tt_int_op(policy_is_reject_star(policy, AF_INET), OP_EQ,
+              compiled_policy_is_reject_star(cp, AF_INET));
+    tt_int_op(policy_is_reject_star(policy, AF_INET6), OP_EQ,
+              compiled_policy_is_reject_star(cp, AF_INET6));
+
+    compiled_policy_free(cp);
+    cp = NULL;
+    addr_policy_list_free(policy);
+    policy = NULL;
+  }
+
+  /* The default exit policy, with private addresses rejected. */
+  tt_int_op(0, OP_EQ, policies_parse_exit_policy(NULL, &policy,
+                                              EXIT_POLICY_IPV6_ENABLED |
+                                              EXIT_POLICY_REJECT_PRIVATE |
+                                              EXIT_POLICY_ADD_DEFAULT, NULL));
+  cp = compiled_policy_new(policy);
+  for (j = 0; j < (int)ARRAY_LENGTH(addrs); ++j) {
+    tt_int_op(tor_addr_parse(&tar, addrs[j]), OP_GE, 0);
+    test_compiled_policy_matches_helper(policy, cp, &tar);
+  }
+  tor_addr_parse(&tar, "10.1.2.3");
+  tt_int_op(ADDR_POLICY_REJECTED, OP_EQ,
+            compare_tor_addr_to_compiled_policy(&tar, 80, cp));
+  tor_addr_parse(&tar, "8.8.8.8");
+  tt_int_op(ADDR_POLICY_ACCEPTED, OP_EQ,
+            compare_tor_addr_to_compiled_policy(&tar, 80, cp));
+  tt_int_op(ADDR_POLICY_REJECTED, OP_EQ,
+            compare_tor_addr_to_compiled_policy(&tar, 25, cp));
+
+ done:
+  compiled_policy_free(cp);
+  addr_policy_list_free(policy);
+}
+
 #undef TEST_IPV4_ADDR_STR
 #undef TEST_IPV6_ADDR_STR
 #undef TEST_IPV4_OR_PORT
@@ -1866,6 +1983,7 @@ struct testcase_t policy_tests[] = {
   { "router_dump_exit_policy_to_string", test_dump_exit_policy_to_string, 0,
     NULL, NULL },
   { "general", test_policies_general, 0, NULL, NULL },
+  { "compiled", test_policies_compiled, 0, NULL, NULL },
   { "getinfo_helper_policies", test_policies_getinfo_helper_policies, 0, NULL,
     NULL },
   { "reject_exit_address", test_policies_reject_exit_address, 0, NULL, NULL },
@@ -182,6 +182,55 @@ test_protover_all_supported(void *arg)
   tor_free(msg);
 }
 
+static void
+test_protover_bitmask(void *arg)
+{
+  (void)arg;
+  protover_bitmask_t mask;
+  const char *list = "Link=1-4 Relay=2 HSDir=1 Wombat=9 cons=1-2";
+
+  tt_int_op(protover_get_bitmask(list, &mask), OP_EQ, 0);
+  tt_u64_op(mask.versions[PRT_LINK], OP_EQ, 0x1e);
+  tt_u64_op(mask.versions[PRT_RELAY], OP_EQ, 0x4);
+  tt_u64_op(mask.versions[PRT_DESC], OP_EQ, 0);
+  tt_assert(protover_bitmask_supports(&mask, PRT_HSDIR, 1));
+  tt_assert(! protover_bitmask_supports(&mask, PRT_RELAY, 1));
+  /* Names match case-insensitively, as in
+   * protocol_list_supports_protocol(). */
+  tt_assert(protover_bitmask_supports(&mask, PRT_CONS, 2));
+  tt_assert(! protover_bitmask_supports(&mask, PRT_LINK, 64));
+
+  /* The same list again comes from the cache. */
+  tt_int_op(protover_bitmask_cache_len(), OP_EQ, 1);
+  tt_assert(protocol_list_supports_protocol(list, PRT_LINK, 3));
+  tt_assert(! protocol_list_supports_protocol(list, PRT_LINK, 5));
+  tt_int_op(protover_bitmask_cache_len(), OP_EQ, 1);
+
+  /* Versions that don't fit in a bitmask still work. */
+  tt_assert(protocol_list_supports_protocol("Link=60-100", PRT_LINK, 63));
+  tt_assert(protocol_list_supports_protocol("Link=60-100", PRT_LINK, 99));
+  tt_assert(! protocol_list_supports_protocol("Link=60-100", PRT_LINK, 101));
+
+  /* Bad lists support nothing. */
+  tt_int_op(protover_get_bitmask("Link=4-1", &mask), OP_EQ, -1);
+  tt_u64_op(mask.versions[PRT_LINK], OP_EQ, 0);
+  tt_assert(! protocol_list_supports_protocol("Link=4-1", PRT_LINK, 1));
+  tt_int_op(protover_bitmask_cache_len(), OP_EQ, 3);
+
+  /* Too many distinct lists: we start over. */
+  int i;
+  for (i = 0; i < MAX_PROTOVER_BITMASK_CACHE_LEN; ++i) {
+    char buf[32];
+    tor_snprintf(buf, sizeof(buf), "Link=0-%d", i);
+    tt_assert(protocol_list_supports_protocol(buf, PRT_LINK, 0));
+  }
+  tt_int_op(protover_bitmask_cache_len(), OP_LE,
+            MAX_PROTOVER_BITMASK_CACHE_LEN);
+
+ done:
+  protover_free_all();
+}
+
 #define PV_TEST(name, flags)                       \
   { #name, test_protover_ ##name, (flags), NULL, NULL }
 
@@ -190,6 +239,7 @@ struct testcase_t protover_tests[] = {
   PV_TEST(parse_fail, 0),
   PV_TEST(vote, 0),
   PV_TEST(all_supported, 0),
+  PV_TEST(bitmask, 0),
   END_OF_TESTCASES
 };
 
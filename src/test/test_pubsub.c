@@ -78,8 +78,96 @@ test_pubsub_basic(void *arg)
   foobar_clear();
 }
 
+static int n_schedules = 0;
+
+static void
+count_schedules(void)
+{
+  ++n_schedules;
+}
+
+static void
+test_pubsub_deferred(void *arg)
+{
+  (void)arg;
+  foobar_subscriber_data_t subdata = { "hi", 0 };
+  foobar_event_data_t ed = { 0, "x" };
+  foobar_event_data_t ed2 = { 0, "y" };
+
+  pubsub_set_deferred_scheduler(count_schedules);
+  tt_assert(foobar_subscribe(foobar_sub1, &subdata, 0, 100));
+
+  /* Deferred notifications wait for the flush, and fold together. */
+  tt_int_op(foobar_notify(&ed, NOTIFY_DEFERRED), OP_EQ, 0);
+  tt_int_op(foobar_notify(&ed, NOTIFY_DEFERRED), OP_EQ, 0);
+  tt_int_op(foobar_notify(&ed2, NOTIFY_DEFERRED), OP_EQ, 0);
+  tt_int_op(n_schedules, OP_EQ, 1);
+  tt_int_op(subdata.l, OP_EQ, 0);
+  tt_int_op(foobar_n_deliveries(), OP_EQ, 0);
+
+  tt_int_op(pubsub_flush_deferred(), OP_EQ, 1);
+  tt_int_op(subdata.l, OP_EQ, 100);
+  tt_int_op(foobar_n_deliveries(), OP_EQ, 1);
+  /* The last event data wins. */
+  tt_int_op(ed.u, OP_EQ, 0);
+  tt_int_op(ed2.u, OP_EQ, 10);
+  tt_int_op(pubsub_flush_deferred(), OP_EQ, 0);
+
+  /* Immediate notifications still happen right away. */
+  foobar_notify(&ed, 0);
+  tt_int_op(subdata.l, OP_EQ, 200);
+  tt_int_op(foobar_n_deliveries(), OP_EQ, 2);
+
+  /* Clearing a topic drops its pending notification. */
+  foobar_notify(&ed, NOTIFY_DEFERRED);
+  tt_int_op(n_schedules, OP_EQ, 2);
+  foobar_clear();
+  tt_int_op(pubsub_flush_deferred(), OP_EQ, 0);
+  tt_int_op(subdata.l, OP_EQ, 200);
+
+ done:
+  pubsub_set_deferred_scheduler(NULL);
+  foobar_clear();
+}
+
+static void
+test_pubsub_deferred_early(void *arg)
+{
+  (void)arg;
+  foobar_subscriber_data_t subdata = { "hi", 0 };
+  foobar_event_data_t ed = { 0, "x" };
+
+  n_schedules = 0;
+  tt_assert(foobar_subscribe(foobar_sub1, &subdata, 0, 100));
+
+  /* A deferred notification before there's a scheduler waits... */
+  tt_int_op(foobar_notify(&ed, NOTIFY_DEFERRED), OP_EQ, 0);
+  tt_int_op(n_schedules, OP_EQ, 0);
+
+  /* ...and gets scheduled as soon as there is one. */
+  pubsub_set_deferred_scheduler(count_schedules);
+  tt_int_op(n_schedules, OP_EQ, 1);
+  tt_int_op(foobar_notify(&ed, NOTIFY_DEFERRED), OP_EQ, 0);
+  tt_int_op(n_schedules, OP_EQ, 1);
+  tt_int_op(pubsub_flush_deferred(), OP_EQ, 1);
+  tt_int_op(subdata.l, OP_EQ, 100);
+
+  /* After the flush, the next deferred notification schedules again. */
+  tt_int_op(foobar_notify(&ed, NOTIFY_DEFERRED), OP_EQ, 0);
+  tt_int_op(n_schedules, OP_EQ, 2);
+  tt_int_op(pubsub_flush_deferred(), OP_EQ, 1);
+  tt_int_op(subdata.l, OP_EQ, 200);
+
+ done:
+  pubsub_set_deferred_scheduler(NULL);
+  foobar_clear();
+}
+
 struct testcase_t pubsub_tests[] = {
   { "pubsub_basic", test_pubsub_basic, TT_FORK, NULL, NULL },
+  { "pubsub_deferred", test_pubsub_deferred, TT_FORK, NULL, NULL },
+  { "pubsub_deferred_early", test_pubsub_deferred_early, TT_FORK,
+    NULL, NULL },
   END_OF_TESTCASES
 };
 
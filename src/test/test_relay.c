@@ -6,6 +6,9 @@
 #include "circuitbuild.h"
 #define RELAY_PRIVATE
 #include "relay.h"
+#include "buffers.h"
+#include "latency_trace.h"
+#include "main.h"
 /* For init/free stuff */
 #include "scheduler.h"
 
@@ -126,9 +129,400 @@ test_relay_append_cell_to_circuit_queue(void *arg)
   return;
 }
 
+static void
+test_relay_package_batch(void *arg)
+{
+  channel_t *nchan = NULL, *pchan = NULL;
+  or_circuit_t *orcirc = NULL;
+  edge_connection_t *conn = NULL;
+  crypto_cipher_t *decrypt = NULL;
+  crypto_digest_t *check_digest = NULL;
+  char key[CIPHER_KEY_LEN];
+  char *data = NULL;
+  const size_t datalen = 5*RELAY_PAYLOAD_SIZE + 100;
+  packed_cell_t *packed;
+  relay_header_t rh;
+  int old_count, i;
+  size_t hdrlen;
+
+  (void)arg;
+
+  nchan = new_fake_channel();
+  pchan = new_fake_channel();
+  tt_assert(nchan);
+  tt_assert(pchan);
+  nchan->cmux = circuitmux_alloc();
+  pchan->cmux = circuitmux_alloc();
+
+  orcirc = new_fake_orcirc(nchan, pchan);
+  tt_assert(orcirc);
+  circuitmux_attach_circuit(nchan->cmux, TO_CIRCUIT(orcirc),
+                            CELL_DIRECTION_OUT);
+  circuitmux_attach_circuit(pchan->cmux, TO_CIRCUIT(orcirc),
+                            CELL_DIRECTION_IN);
+  crypto_rand(key, sizeof(key));
+  orcirc->p_crypto = crypto_cipher_new(key);
+  orcirc->p_digest = crypto_digest_new();
+  decrypt = crypto_cipher_new(key);
+  check_digest = crypto_digest_new();
+
+  conn = tor_malloc_zero(sizeof(edge_connection_t));
+  conn->base_.magic = EDGE_CONNECTION_MAGIC;
+  conn->base_.type = CONN_TYPE_EXIT;
+  conn->base_.s = TOR_INVALID_SOCKET;
+  conn->base_.inbuf = buf_new();
+  conn->stream_id = 77;
+  conn->package_window = STREAMWINDOW_START;
+  conn->on_circuit = TO_CIRCUIT(orcirc);
+  orcirc->n_streams = conn;
+
+  data = tor_malloc(datalen);
+  crypto_rand(data, datalen);
+  write_to_buf(data, datalen, conn->base_.inbuf);
+
+  MOCK(scheduler_channel_has_waiting_cells,
+       scheduler_channel_has_waiting_cells_mock);
+
+  /* All five full cells go out in one batch; the partial one waits. */
+  old_count = get_mock_scheduler_has_waiting_cells_count();
+  tt_int_op(0, OP_EQ, connection_edge_package_raw_inbuf(conn, 0, NULL));
+  tt_int_op(get_mock_scheduler_has_waiting_cells_count(), OP_EQ,
+            old_count + 1);
+  tt_int_op(orcirc->p_chan_cells.n, OP_EQ, 5);
+  tt_int_op(buf_datalen(conn->base_.inbuf), OP_EQ, 100);
+  tt_int_op(conn->package_window, OP_EQ, STREAMWINDOW_START - 5);
+  tt_int_op(orcirc->base_.package_window, OP_EQ, CIRCWINDOW_START_MAX - 5);
+
+  /* The cells decrypt, in order, to the data we put on the inbuf, and
+   * each carries the running digest of the plaintext. */
+  hdrlen = pchan->wide_circ_ids ? 5 : 3;
+  i = 0;
+  TOR_SIMPLEQ_FOREACH(packed, &orcirc->p_chan_cells.head, next) {
+    uint8_t *payload = (uint8_t*)packed->body + hdrlen;
+    tt_int_op(packed->body[hdrlen-1], OP_EQ, CELL_RELAY);
+    crypto_cipher_crypt_inplace(decrypt, (char*)payload, CELL_PAYLOAD_SIZE);
+    relay_header_unpack(&rh, payload);
+    tt_int_op(rh.command, OP_EQ, RELAY_COMMAND_DATA);
+    tt_int_op(rh.stream_id, OP_EQ, 77);
+    tt_int_op(rh.length, OP_EQ, RELAY_PAYLOAD_SIZE);
+    tt_mem_op(payload + RELAY_HEADER_SIZE, OP_EQ,
+              data + i*RELAY_PAYLOAD_SIZE, RELAY_PAYLOAD_SIZE);
+    {
+      uint8_t received[4], expected[4];
+      memcpy(received, rh.integrity, 4);
+      memset(rh.integrity, 0, 4);
+      relay_header_pack(payload, &rh);
+      crypto_digest_add_bytes(check_digest, (char*)payload,
+                              CELL_PAYLOAD_SIZE);
+      crypto_digest_get_digest(check_digest, (char*)expected, 4);
+      tt_mem_op(received, OP_EQ, expected, 4);
+    }
+    ++i;
+  }
+  tt_int_op(i, OP_EQ, 5);
+
+  /* With max_cells, we stop where we're told to. */
+  write_to_buf(data, datalen, conn->base_.inbuf);
+  i = 2;
+  tt_int_op(0, OP_EQ, connection_edge_package_raw_inbuf(conn, 0, &i));
+  tt_int_op(i, OP_EQ, 0);
+  tt_int_op(orcirc->p_chan_cells.n, OP_EQ, 7);
+  tt_int_op(conn->package_window, OP_EQ, STREAMWINDOW_START - 7);
+
+ done:
+  UNMOCK(scheduler_channel_has_waiting_cells);
+  if (orcirc) {
+    circuitmux_detach_circuit(nchan->cmux, TO_CIRCUIT(orcirc));
+    circuitmux_detach_circuit(pchan->cmux, TO_CIRCUIT(orcirc));
+    cell_queue_clear(&orcirc->base_.n_chan_cells);
+    cell_queue_clear(&orcirc->p_chan_cells);
+    crypto_cipher_free(orcirc->p_crypto);
+    crypto_digest_free(orcirc->p_digest);
+  }
+  if (conn)
+    buf_free(conn->base_.inbuf);
+  tor_free(conn);
+  tor_free(orcirc);
+  tor_free(data);
+  crypto_cipher_free(decrypt);
+  crypto_digest_free(check_digest);
+  free_fake_channel(nchan);
+  free_fake_channel(pchan);
+}
+
+static int mock_stop_reading_count = 0;
+
+static void
+mock_connection_stop_reading(connection_t *conn)
+{
+  (void)conn;
+  ++mock_stop_reading_count;
+}
+
+static void
+test_relay_package_fairness(void *arg)
+{
+  channel_t *nchan = NULL, *pchan = NULL;
+  or_circuit_t *orcirc = NULL;
+  edge_connection_t *conns[3] = { NULL, NULL, NULL };
+  smartlist_t *active = smartlist_new();
+  char key[CIPHER_KEY_LEN];
+  char *data = NULL;
+  const size_t datalen = 10*RELAY_PAYLOAD_SIZE;
+  int i;
+
+  (void)arg;
+
+  MOCK(scheduler_channel_has_waiting_cells,
+       scheduler_channel_has_waiting_cells_mock);
+  MOCK(connection_stop_reading, mock_connection_stop_reading);
+
+  nchan = new_fake_channel();
+  pchan = new_fake_channel();
+  tt_assert(nchan);
+  tt_assert(pchan);
+  nchan->cmux = circuitmux_alloc();
+  pchan->cmux = circuitmux_alloc();
+
+  orcirc = new_fake_orcirc(nchan, pchan);
+  tt_assert(orcirc);
+  circuitmux_attach_circuit(nchan->cmux, TO_CIRCUIT(orcirc),
+                            CELL_DIRECTION_OUT);
+  circuitmux_attach_circuit(pchan->cmux, TO_CIRCUIT(orcirc),
+                            CELL_DIRECTION_IN);
+  crypto_rand(key, sizeof(key));
+  orcirc->p_crypto = crypto_cipher_new(key);
+  orcirc->p_digest = crypto_digest_new();
+
+  data = tor_malloc_zero(datalen);
+  for (i = 2; i >= 0; --i) {
+    edge_connection_t *conn = tor_malloc_zero(sizeof(edge_connection_t));
+    conn->base_.magic = EDGE_CONNECTION_MAGIC;
+    conn->base_.type = CONN_TYPE_EXIT;
+    conn->base_.s = TOR_INVALID_SOCKET;
+    conn->base_.inbuf = buf_new();
+    conn->stream_id = i + 1;
+    conn->package_window = STREAMWINDOW_START;
+    conn->on_circuit = TO_CIRCUIT(orcirc);
+    conn->next_stream = orcirc->n_streams;
+    orcirc->n_streams = conn;
+    conns[i] = conn;
+  }
+  /* Two streams with ten cells each, and one with a short cell's worth. */
+  write_to_buf(data, datalen, conns[0]->base_.inbuf);
+  write_to_buf(data, datalen, conns[1]->base_.inbuf);
+  write_to_buf(data, 100, conns[2]->base_.inbuf);
+
+  /* Seven cells across three streams: three, three, and the short one. */
+  smartlist_add(active, conns[0]);
+  smartlist_add(active, conns[1]);
+  smartlist_add(active, conns[2]);
+  tt_int_op(0, OP_EQ, circuit_package_active_streams(TO_CIRCUIT(orcirc),
+                                                     NULL, active, 0, 7));
+  tt_int_op(orcirc->p_chan_cells.n, OP_EQ, 7);
+  tt_int_op(buf_datalen(conns[0]->base_.inbuf), OP_EQ, 7*RELAY_PAYLOAD_SIZE);
+  tt_int_op(buf_datalen(conns[1]->base_.inbuf), OP_EQ, 7*RELAY_PAYLOAD_SIZE);
+  tt_int_op(buf_datalen(conns[2]->base_.inbuf), OP_EQ, 0);
+  tt_int_op(conns[0]->package_deficit, OP_EQ, 0);
+  tt_int_op(conns[2]->package_deficit, OP_EQ, 0);
+  tt_int_op(orcirc->base_.last_resumed_stream_id, OP_EQ, 3);
+
+  /* Starting from the second stream, three cells: the first stream runs
+   * out of budget one cell short of its share, and keeps the credit. */
+  smartlist_clear(active);
+  smartlist_add(active, conns[0]);
+  smartlist_add(active, conns[1]);
+  tt_int_op(0, OP_EQ, circuit_package_active_streams(TO_CIRCUIT(orcirc),
+                                                     NULL, active, 1, 3));
+  tt_int_op(orcirc->p_chan_cells.n, OP_EQ, 10);
+  tt_int_op(buf_datalen(conns[0]->base_.inbuf), OP_EQ, 6*RELAY_PAYLOAD_SIZE);
+  tt_int_op(buf_datalen(conns[1]->base_.inbuf), OP_EQ, 5*RELAY_PAYLOAD_SIZE);
+  tt_int_op(conns[0]->package_deficit, OP_EQ, RELAY_PAYLOAD_SIZE);
+  tt_int_op(conns[1]->package_deficit, OP_EQ, 0);
+  tt_int_op(orcirc->base_.last_resumed_stream_id, OP_EQ, 1);
+
+  /* If the circuit window closes, we stop at once and tell the streams. */
+  orcirc->base_.package_window = 1;
+  tt_int_op(-1, OP_EQ, circuit_package_active_streams(TO_CIRCUIT(orcirc),
+                                                      NULL, active, 0, 5));
+  tt_int_op(orcirc->p_chan_cells.n, OP_EQ, 11);
+  tt_int_op(buf_datalen(conns[1]->base_.inbuf), OP_EQ, 5*RELAY_PAYLOAD_SIZE);
+  tt_int_op(mock_stop_reading_count, OP_GE, 3);
+
+ done:
+  UNMOCK(scheduler_channel_has_waiting_cells);
+  UNMOCK(connection_stop_reading);
+  if (orcirc) {
+    circuitmux_detach_circuit(nchan->cmux, TO_CIRCUIT(orcirc));
+    circuitmux_detach_circuit(pchan->cmux, TO_CIRCUIT(orcirc));
+    cell_queue_clear(&orcirc->base_.n_chan_cells);
+    cell_queue_clear(&orcirc->p_chan_cells);
+    crypto_cipher_free(orcirc->p_crypto);
+    crypto_digest_free(orcirc->p_digest);
+  }
+  for (i = 0; i < 3; ++i) {
+    if (conns[i])
+      buf_free(conns[i]->base_.inbuf);
+    tor_free(conns[i]);
+  }
+  smartlist_free(active);
+  tor_free(orcirc);
+  tor_free(data);
+  free_fake_channel(nchan);
+  free_fake_channel(pchan);
+}
+
+static int mock_memory_pressure = 0;
+
+static int
+mock_relay_under_memory_pressure(void)
+{
+  return mock_memory_pressure;
+}
+
+static void
+test_relay_stream_window_adapt(void *arg)
+{
+  edge_connection_t *conn = NULL;
+  (void)arg;
+
+  MOCK(relay_under_memory_pressure, mock_relay_under_memory_pressure);
+  mock_memory_pressure = 0;
+
+  conn = tor_malloc_zero(sizeof(edge_connection_t));
+  conn->adaptive_window = 1;
+  conn->deliver_window_target = STREAMWINDOW_START;
+
+  /* No probe outstanding: nothing changes. */
+  conn->n_data_cells_delivered = 10;
+  stream_window_note_data_cell(conn, 1000);
+  tt_int_op(conn->deliver_window_target, OP_EQ, STREAMWINDOW_START);
+  tt_int_op(conn->min_sendme_rtt_msec, OP_EQ, 0);
+
+  /* A probe that hasn't been reached yet is left alone. */
+  conn->sendme_probe_cell = 20;
+  conn->sendme_probe_sent_msec = 1000;
+  stream_window_note_data_cell(conn, 1100);
+  tt_int_op(conn->sendme_probe_cell, OP_EQ, 20);
+
+  /* First sample sets the minimum; the window is already as big as it
+   * gets. */
+  conn->n_data_cells_delivered = 20;
+  stream_window_note_data_cell(conn, 1100);
+  tt_int_op(conn->sendme_probe_cell, OP_EQ, 0);
+  tt_int_op(conn->min_sendme_rtt_msec, OP_EQ, 100);
+  tt_int_op(conn->deliver_window_target, OP_EQ, STREAMWINDOW_START);
+
+  /* A sample over twice the minimum shrinks it... */
+  conn->sendme_probe_cell = 30;
+  conn->n_data_cells_delivered = 30;
+  conn->sendme_probe_sent_msec = 2000;
+  stream_window_note_data_cell(conn, 2300);
+  tt_int_op(conn->deliver_window_target, OP_EQ,
+            STREAMWINDOW_START - STREAMWINDOW_INCREMENT);
+  tt_int_op(conn->min_sendme_rtt_msec, OP_EQ, 100);
+
+  /* ...one in between leaves it alone... */
+  conn->sendme_probe_cell = 40;
+  conn->n_data_cells_delivered = 40;
+  conn->sendme_probe_sent_msec = 3000;
+  stream_window_note_data_cell(conn, 3180);
+  tt_int_op(conn->deliver_window_target, OP_EQ,
+            STREAMWINDOW_START - STREAMWINDOW_INCREMENT);
+
+  /* ...and one within 1.5x of the minimum grows it back. */
+  conn->sendme_probe_cell = 50;
+  conn->n_data_cells_delivered = 50;
+  conn->sendme_probe_sent_msec = 4000;
+  stream_window_note_data_cell(conn, 4140);
+  tt_int_op(conn->deliver_window_target, OP_EQ, STREAMWINDOW_START);
+
+  /* The target never leaves [STREAMWINDOW_ADAPTIVE_MIN,
+   * STREAMWINDOW_START]. */
+  conn->sendme_probe_cell = 60;
+  conn->n_data_cells_delivered = 60;
+  conn->sendme_probe_sent_msec = 5000;
+  stream_window_note_data_cell(conn, 5100);
+  tt_int_op(conn->deliver_window_target, OP_EQ, STREAMWINDOW_START);
+
+  conn->deliver_window_target = STREAMWINDOW_ADAPTIVE_MIN;
+  conn->sendme_probe_cell = 70;
+  conn->n_data_cells_delivered = 70;
+  conn->sendme_probe_sent_msec = 6000;
+  stream_window_note_data_cell(conn, 7000);
+  tt_int_op(conn->deliver_window_target, OP_EQ, STREAMWINDOW_ADAPTIVE_MIN);
+
+  /* Under memory pressure, even a fast round trip drops us to the
+   * smallest window. */
+  mock_memory_pressure = 1;
+  conn->deliver_window_target = STREAMWINDOW_START;
+  conn->sendme_probe_cell = 80;
+  conn->n_data_cells_delivered = 80;
+  conn->sendme_probe_sent_msec = 8000;
+  stream_window_note_data_cell(conn, 8100);
+  tt_int_op(conn->deliver_window_target, OP_EQ, STREAMWINDOW_ADAPTIVE_MIN);
+
+ done:
+  UNMOCK(relay_under_memory_pressure);
+  tor_free(conn);
+}
+
+static void
+test_relay_queue_delay(void *arg)
+{
+  latency_hist_t *circ_hist, *outbuf_hist;
+  latency_hist_t sum;
+  char *s = NULL;
+  (void)arg;
+
+  queue_delay_reset();
+  circ_hist = queue_delay_get_hist(QUEUE_DELAY_CIRCUIT);
+  outbuf_hist = queue_delay_get_hist(QUEUE_DELAY_OUTBUF);
+  tt_u64_op(circ_hist->n, OP_EQ, 0);
+
+  /* 0 msec lands in bucket 0; 1 msec (1000 usec) in bucket 10; 3 msec in
+   * bucket 12. */
+  queue_delay_note(QUEUE_DELAY_CIRCUIT, 0);
+  queue_delay_note(QUEUE_DELAY_CIRCUIT, 1);
+  queue_delay_note(QUEUE_DELAY_OUTBUF, 3);
+  tt_u64_op(circ_hist->n, OP_EQ, 2);
+  tt_u64_op(circ_hist->buckets[0], OP_EQ, 1);
+  tt_u64_op(circ_hist->buckets[10], OP_EQ, 1);
+  tt_u64_op(circ_hist->max_nsec, OP_EQ, 1000000);
+  tt_u64_op(outbuf_hist->n, OP_EQ, 1);
+  tt_u64_op(outbuf_hist->buckets[12], OP_EQ, 1);
+  tt_u64_op(queue_delay_get_hist(QUEUE_DELAY_CHANNEL)->n, OP_EQ, 0);
+
+  tt_str_op(queue_delay_kind_name(QUEUE_DELAY_CIRCUIT), OP_EQ, "circuit");
+  tt_str_op(queue_delay_kind_name(QUEUE_DELAY_CHANNEL), OP_EQ, "channel");
+  tt_str_op(queue_delay_kind_name(QUEUE_DELAY_OUTBUF), OP_EQ, "outbuf");
+
+  /* Merging adds up counts and keeps the larger maximum. */
+  memset(&sum, 0, sizeof(sum));
+  latency_hist_merge(&sum, circ_hist);
+  latency_hist_merge(&sum, outbuf_hist);
+  tt_u64_op(sum.n, OP_EQ, 3);
+  tt_u64_op(sum.total_nsec, OP_EQ, 4000000);
+  tt_u64_op(sum.max_nsec, OP_EQ, 3000000);
+  s = latency_hist_format_buckets(&sum);
+  tt_str_op(s, OP_EQ, "1,0,0,0,0,0,0,0,0,0,1,0,1,0,0,0,0,0,0,0,0,0,0,0");
+
+  queue_delay_reset();
+  tt_u64_op(circ_hist->n, OP_EQ, 0);
+  tt_u64_op(outbuf_hist->n, OP_EQ, 0);
+
+ done:
+  tor_free(s);
+}
+
 struct testcase_t relay_tests[] = {
   { "append_cell_to_circuit_queue", test_relay_append_cell_to_circuit_queue,
     TT_FORK, NULL, NULL },
+  { "package_batch", test_relay_package_batch, TT_FORK, NULL, NULL },
+  { "package_fairness", test_relay_package_fairness, TT_FORK, NULL, NULL },
+  { "stream_window_adapt", test_relay_stream_window_adapt,
+    TT_FORK, NULL, NULL },
+  { "queue_delay", test_relay_queue_delay, TT_FORK, NULL, NULL },
   END_OF_TESTCASES
 };
 
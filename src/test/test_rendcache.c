@@ -1077,11 +1077,11 @@ test_rend_cache_intro_failure_note(void *data)
 static void
 test_rend_cache_clean_v2_descs_as_dir(void *data)
 {
-  rend_cache_entry_t *e;
+  rend_cache_dir_entry_t *e;
   time_t now;
-  rend_service_descriptor_t *desc;
   now = time(NULL);
   const char key[DIGEST_LEN] = "abcde";
+  const char *body = "descriptor";
 
   (void)data;
 
@@ -1092,45 +1092,91 @@ test_rend_cache_clean_v2_descs_as_dir(void *data)
   tt_int_op(digestmap_size(rend_cache_v2_dir), OP_EQ, 0);
 
   // Test with only one new entry
-  e = tor_malloc_zero(sizeof(rend_cache_entry_t));
+  e = rend_cache_dir_entry_add(key, body, strlen(body), now);
   e->last_served = now;
-  desc = tor_malloc_zero(sizeof(rend_service_descriptor_t));
-  desc->timestamp = now;
-  desc->pk = pk_generate(0);
-  e->parsed = desc;
-  digestmap_set(rend_cache_v2_dir, key, e);
 
   rend_cache_clean_v2_descs_as_dir(now, 0);
   tt_int_op(digestmap_size(rend_cache_v2_dir), OP_EQ, 1);
 
   // Test with one old entry
-  desc->timestamp = now - (REND_CACHE_MAX_AGE + REND_CACHE_MAX_SKEW + 1000);
-  rend_cache_clean_v2_descs_as_dir(now, 0);
+  rend_cache_clean_v2_descs_as_dir(now + REND_CACHE_MAX_AGE +
+                                   REND_CACHE_MAX_SKEW + 1000, 0);
   tt_int_op(digestmap_size(rend_cache_v2_dir), OP_EQ, 0);
 
   // Test with one entry that has an old last served
-  e = tor_malloc_zero(sizeof(rend_cache_entry_t));
+  e = rend_cache_dir_entry_add(key, body, strlen(body), now);
   e->last_served = now - (REND_CACHE_MAX_AGE + REND_CACHE_MAX_SKEW + 1000);
-  desc = tor_malloc_zero(sizeof(rend_service_descriptor_t));
-  desc->timestamp = now;
-  desc->pk = pk_generate(0);
-  e->parsed = desc;
-  digestmap_set(rend_cache_v2_dir, key, e);
 
   rend_cache_clean_v2_descs_as_dir(now, 0);
   tt_int_op(digestmap_size(rend_cache_v2_dir), OP_EQ, 0);
 
   // Test a run through asking for a large force_remove
-  e = tor_malloc_zero(sizeof(rend_cache_entry_t));
+  e = rend_cache_dir_entry_add(key, body, strlen(body), now);
   e->last_served = now;
-  desc = tor_malloc_zero(sizeof(rend_service_descriptor_t));
-  desc->timestamp = now;
-  desc->pk = pk_generate(0);
-  e->parsed = desc;
-  digestmap_set(rend_cache_v2_dir, key, e);
 
-  rend_cache_clean_v2_descs_as_dir(now, 20000);
-  tt_int_op(digestmap_size(rend_cache_v2_dir), OP_EQ, 1);
+  tt_u64_op(rend_cache_clean_v2_descs_as_dir(now, 20000), OP_EQ,
+            rend_cache_dir_entry_allocation(e));
+  tt_int_op(digestmap_size(rend_cache_v2_dir), OP_EQ, 0);
+  tt_u64_op(rend_cache_v2_dir_get_allocation(), OP_EQ, 0);
+
+ done:
+  rend_cache_free_all();
+}
+
+static void
+test_rend_cache_clean_v2_descs_as_dir_lru(void *data)
+{
+  rend_cache_dir_entry_t *e;
+  char key[DIGEST_LEN];
+  char key_base32[REND_DESC_ID_V2_LEN_BASE32 + 1];
+  const char *desc;
+  const char *body = "descriptor";
+  time_t now = time(NULL);
+  size_t one;
+  int i;
+
+  (void)data;
+
+  rend_cache_init();
+  update_approx_time(now);
+
+  for (i = 0; i < 4; ++i) {
+    memset(key, 'a' + i, sizeof(key));
+    e = rend_cache_dir_entry_add(key, body, strlen(body), now);
+  }
+  one = rend_cache_dir_entry_allocation(e);
+  tt_u64_op(rend_cache_v2_dir_get_allocation(), OP_EQ, 4 * one);
+  tt_u64_op(rend_cache_get_total_allocation(), OP_EQ, 4 * one);
+
+  /* Serve 'a' and 'c'; 'b' and 'd' have only been uploaded. */
+  memset(key, 'a', sizeof(key));
+  base32_encode(key_base32, sizeof(key_base32), key, DIGEST_LEN);
+  tt_int_op(rend_cache_lookup_v2_desc_as_dir(key_base32, &desc), OP_EQ, 1);
+  tt_str_op(desc, OP_EQ, body);
+  memset(key, 'c', sizeof(key));
+  base32_encode(key_base32, sizeof(key_base32), key, DIGEST_LEN);
+  tt_int_op(rend_cache_lookup_v2_desc_as_dir(key_base32, &desc), OP_EQ, 1);
+
+  /* Replacing 'b' keeps its place and its accounting exact. */
+  memset(key, 'b', sizeof(key));
+  rend_cache_dir_entry_add(key, "new descriptor", 14, now + 1);
+  tt_int_op(digestmap_size(rend_cache_v2_dir), OP_EQ, 4);
+  tt_u64_op(rend_cache_v2_dir_get_allocation(), OP_EQ, 4 * one + 4);
+
+  /* The unserved entries go first, oldest upload first. */
+  tt_u64_op(rend_cache_clean_v2_descs_as_dir(now, 1), OP_EQ, one + 4);
+  tt_assert(!digestmap_get(rend_cache_v2_dir, key));
+  tt_u64_op(rend_cache_clean_v2_descs_as_dir(now, 1), OP_EQ, one);
+  memset(key, 'd', sizeof(key));
+  tt_assert(!digestmap_get(rend_cache_v2_dir, key));
+
+  /* Then the served ones, least recently served first. */
+  tt_u64_op(rend_cache_clean_v2_descs_as_dir(now, 1), OP_EQ, one);
+  memset(key, 'a', sizeof(key));
+  tt_assert(!digestmap_get(rend_cache_v2_dir, key));
+  memset(key, 'c', sizeof(key));
+  tt_assert(digestmap_get(rend_cache_v2_dir, key));
+  tt_u64_op(rend_cache_get_total_allocation(), OP_EQ, one);
 
  done:
   rend_cache_free_all();
@@ -1225,6 +1271,74 @@ test_rend_cache_validate_intro_point_failure(void *data)
   tor_free(service_id);
 }
 
+static void
+test_rend_cache_client_snapshot(void *data)
+{
+  rend_data_t *mock_rend_query = NULL;
+  char desc_id_base32[REND_DESC_ID_V2_LEN_BASE32 + 1];
+  rend_cache_entry_t *entry = NULL;
+  rend_encoded_v2_service_descriptor_t *desc_holder = NULL;
+  char *service_id = NULL;
+  char *body = NULL;
+  uint8_t identity[DIGEST_LEN];
+  rend_intro_point_t *intro;
+  time_t now = time(NULL);
+  (void)data;
+
+  rend_cache_init();
+
+  generate_desc(RECENT_TIME, &desc_holder, &service_id, 3);
+  mock_rend_query = mock_rend_data(service_id);
+  base32_encode(desc_id_base32, sizeof(desc_id_base32), desc_holder->desc_id,
+                DIGEST_LEN);
+  tt_int_op(rend_cache_store_v2_desc_as_client(desc_holder->desc_str,
+                                               desc_id_base32,
+                                               mock_rend_query, &entry),
+            OP_EQ, 0);
+  /* We only keep failures for intro points that the descriptor lists. */
+  intro = smartlist_get(entry->parsed->intro_nodes, 0);
+  memcpy(identity, intro->extend_info->identity_digest, DIGEST_LEN);
+  rend_cache_intro_failure_note(INTRO_POINT_FAILURE_TIMEOUT, identity,
+                                service_id);
+
+  body = rend_cache_client_encode(now);
+  tt_assert(strstr(body, desc_holder->desc_str));
+  tt_assert(!strcmpstart(body, "failure "));
+
+  // Everything comes back after a restart
+  rend_cache_free_all();
+  rend_cache_init();
+  tt_int_op(rend_cache_client_decode(body, strlen(body), now), OP_EQ, 1);
+  tt_int_op(rend_cache_lookup_entry(service_id, 2, &entry), OP_EQ, 0);
+  tt_str_op(entry->desc, OP_EQ, desc_holder->desc_str);
+  tt_int_op(smartlist_len(entry->parsed->intro_nodes), OP_EQ, 2);
+  tt_int_op(cache_failure_intro_lookup(identity, service_id, NULL), OP_EQ, 1);
+
+  // Nothing comes back once it has expired
+  rend_cache_free_all();
+  rend_cache_init();
+  tt_int_op(rend_cache_client_decode(body, strlen(body),
+                                     now + REND_CACHE_MAX_AGE +
+                                     REND_CACHE_MAX_SKEW + 3600),
+            OP_EQ, 0);
+  tt_int_op(rend_cache_lookup_entry(service_id, 2, NULL), OP_EQ, -ENOENT);
+  tt_int_op(cache_failure_intro_lookup(identity, service_id, NULL), OP_EQ, 0);
+
+  // A truncated snapshot loads what it can
+  rend_cache_free_all();
+  rend_cache_init();
+  tt_int_op(rend_cache_client_decode(body, strlen(body) - 100, now),
+            OP_EQ, 0);
+  tt_int_op(cache_failure_intro_lookup(identity, service_id, NULL), OP_EQ, 1);
+
+ done:
+  tor_free(body);
+  rend_encoded_v2_service_descriptor_free(desc_holder);
+  tor_free(service_id);
+  rend_cache_free_all();
+  rend_data_free(mock_rend_query);
+}
+
 struct testcase_t rend_cache_tests[] = {
   { "init", test_rend_cache_init, 0, NULL, NULL },
   { "decrement_allocation", test_rend_cache_decrement_allocation, 0,
@@ -1234,6 +1348,8 @@ struct testcase_t rend_cache_tests[] = {
   { "clean", test_rend_cache_clean, TT_FORK, NULL, NULL },
   { "clean_v2_descs_as_dir", test_rend_cache_clean_v2_descs_as_dir, 0,
     NULL, NULL },
+  { "clean_v2_descs_as_dir_lru", test_rend_cache_clean_v2_descs_as_dir_lru,
+    0, NULL, NULL },
   { "entry_allocation", test_rend_cache_entry_allocation, 0, NULL, NULL },
   { "entry_free", test_rend_cache_entry_free, 0, NULL, NULL },
   { "failure_intro_entry_free", test_rend_cache_failure_intro_entry_free, 0,
@@ -1268,6 +1384,7 @@ struct testcase_t rend_cache_tests[] = {
     NULL, NULL },
   { "validate_intro_point_failure",
     test_rend_cache_validate_intro_point_failure, 0, NULL, NULL },
+  { "client_snapshot", test_rend_cache_client_snapshot, 0, NULL, NULL },
   END_OF_TESTCASES
 };
 
@@ -201,10 +201,10 @@ test_replaycache_elapsed(void *arg)
   tt_int_op(result,OP_EQ, 0);
 
   result =
-    replaycache_add_and_test_internal(1300, r, test_buffer,
+    replaycache_add_and_test_internal(1400, r, test_buffer,
         strlen(test_buffer), &elapsed);
   tt_int_op(result,OP_EQ, 1);
-  tt_int_op(elapsed,OP_EQ, 100);
+  tt_int_op(elapsed,OP_EQ, 200);
 
  done:
   if (r) replaycache_free(r);
@@ -371,6 +371,123 @@ test_replaycache_realtime(void *arg)
   return;
 }
 
+static void
+test_replaycache_filter(void *arg)
+{
+  replaycache_t *r = NULL;
+  int result;
+  time_t elapsed;
+
+  (void)arg;
+  tt_ptr_op(replaycache_new_filter(-600, 100, 0.001), OP_EQ, NULL);
+  tt_ptr_op(replaycache_new_filter(600, 0, 0.001), OP_EQ, NULL);
+  tt_ptr_op(replaycache_new_filter(600, 100, 0.0), OP_EQ, NULL);
+  tt_ptr_op(replaycache_new_filter(600, 100, 1.0), OP_EQ, NULL);
+
+  r = replaycache_new_filter(600, 100, 0.001);
+  tt_assert(r != NULL);
+
+  result =
+    replaycache_add_and_test_internal(1200, r, test_buffer,
+        strlen(test_buffer), NULL);
+  tt_int_op(result,OP_EQ, 0);
+  result =
+    replaycache_add_and_test_internal(1200, r, test_buffer_2,
+        strlen(test_buffer_2), NULL);
+  tt_int_op(result,OP_EQ, 0);
+
+  /* Seen again within the horizon: a hit, with the time since the start
+   * of the bucket it was seen in. */
+  result =
+    replaycache_add_and_test_internal(1400, r, test_buffer,
+        strlen(test_buffer), &elapsed);
+  tt_int_op(result,OP_EQ, 1);
+  tt_int_op(elapsed,OP_EQ, 200);
+
+  /* Once the bucket holding test_buffer_2 is past the horizon, it's gone;
+   * test_buffer was refreshed at 1400, so it's still there. */
+  result =
+    replaycache_add_and_test_internal(1950, r, test_buffer_2,
+        strlen(test_buffer_2), NULL);
+  tt_int_op(result,OP_EQ, 0);
+  result =
+    replaycache_add_and_test_internal(1950, r, test_buffer,
+        strlen(test_buffer), NULL);
+  tt_int_op(result,OP_EQ, 1);
+
+  /* Scrubbing drops the filters that have aged out. */
+  replaycache_scrub_if_needed_internal(3000, r);
+  {
+    int i, n = 0;
+    for (i = 0; i < r->n_filters; ++i)
+      n += r->filters[i] != NULL;
+    tt_int_op(n,OP_EQ, 0);
+  }
+  replaycache_free(r);
+
+  /* With no horizon, nothing expires. */
+  r = replaycache_new_filter(0, 100, 0.001);
+  tt_assert(r != NULL);
+  result =
+    replaycache_add_and_test_internal(1200, r, test_buffer,
+        strlen(test_buffer), NULL);
+  tt_int_op(result,OP_EQ, 0);
+  result =
+    replaycache_add_and_test_internal(1000000, r, test_buffer,
+        strlen(test_buffer), &elapsed);
+  tt_int_op(result,OP_EQ, 1);
+  tt_int_op(elapsed,OP_EQ, 0);
+
+ done:
+  if (r) replaycache_free(r);
+  return;
+}
+
+/** Check that a filter-backed cache taking far more digests than it was
+ * sized for still seldom mistakes a new digest for a replay, and never
+ * forgets one that it has seen. */
+static void
+test_replaycache_filter_overload(void *arg)
+{
+  replaycache_t *r = NULL;
+  const int capacity = 1000, n = 10 * capacity;
+  int i, n_false = 0;
+  uint32_t buf[2];
+
+  (void)arg;
+
+  r = replaycache_new_filter(600, capacity, 0.001);
+  tt_assert(r != NULL);
+
+  for (i = 0; i < n; ++i) {
+    buf[0] = 0xfeed;
+    buf[1] = i;
+    n_false += replaycache_add_and_test_internal(1200, r, buf, sizeof(buf),
+                                                 NULL);
+  }
+  /* A single filter of the first size would give false replays for about
+   * half of the last few thousand of these. */
+  tt_int_op(n_false, OP_LT, n / 100);
+  tt_int_op(smartlist_len(r->filters[(1200 / r->bucket_width) %
+                                     r->n_filters]), OP_GT, 1);
+
+  for (i = 0; i < n; ++i) {
+    buf[0] = 0xfeed;
+    buf[1] = i;
+    tt_int_op(replaycache_add_and_test_internal(1200, r, buf, sizeof(buf),
+                                                NULL), OP_EQ, 1);
+  }
+
+  /* Freeing the grown bucket gives all its memory back. */
+  replaycache_scrub_if_needed_internal(3000, r);
+  for (i = 0; i < r->n_filters; ++i)
+    tt_ptr_op(r->filters[i], OP_EQ, NULL);
+
+ done:
+  if (r) replaycache_free(r);
+  return;
+}
+
 #define REPLAYCACHE_LEGACY(name) \
   { #name, test_replaycache_ ## name , 0, NULL, NULL }
 
@@ -386,6 +503,8 @@ struct testcase_t replaycache_tests[] = {
   REPLAYCACHE_LEGACY(scrub),
   REPLAYCACHE_LEGACY(future),
   REPLAYCACHE_LEGACY(realtime),
+  REPLAYCACHE_LEGACY(filter),
+  REPLAYCACHE_LEGACY(filter_overload),
   END_OF_TESTCASES
 };
 
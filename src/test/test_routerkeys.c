@@ -81,6 +81,59 @@ test_routerkeys_write_fingerprint(void *arg)
   tor_free(cp2);
 }
 
+static void
+test_routerkeys_load_stats_file(void *arg)
+{
+  or_options_t *options = get_options_mutable();
+  const char *ddir = get_fname("load_stats_file");
+  char *fname = NULL, *cp = NULL;
+  const time_t now = 1281619650; /* 2010-08-12 13:27:30 */
+  (void)arg;
+
+  tor_free(options->DataDirectory);
+  options->DataDirectory = tor_strdup(ddir);
+  tt_int_op(0, OP_EQ, check_private_dir(ddir, CPD_CREATE, NULL));
+  tt_assert(check_or_create_data_subdir("stats") == 0);
+  fname = get_datadir_fname2("stats", "dirreq-stats");
+
+  /* No file yet. */
+  tt_int_op(0, OP_EQ, load_stats_file("stats"PATH_SEPARATOR"dirreq-stats",
+                                      "dirreq-stats-end", now, &cp));
+  tt_ptr_op(cp, OP_EQ, NULL);
+
+  /* We don't notice a new file until somebody tells us about it. */
+  tt_int_op(0, OP_EQ, write_str_to_file(fname,
+            "junk\ndirreq-stats-end 2010-08-12 13:27:30 (86400 s)\n", 0));
+  tt_int_op(0, OP_EQ, load_stats_file("stats"PATH_SEPARATOR"dirreq-stats",
+                                      "dirreq-stats-end", now, &cp));
+  router_forget_stats_file(fname);
+  tt_int_op(1, OP_EQ, load_stats_file("stats"PATH_SEPARATOR"dirreq-stats",
+                                      "dirreq-stats-end", now, &cp));
+  tt_str_op(cp, OP_EQ, "dirreq-stats-end 2010-08-12 13:27:30 (86400 s)\n");
+  tor_free(cp);
+
+  /* Too old a block is no good, even if we remember it. */
+  tt_int_op(-1, OP_EQ, load_stats_file("stats"PATH_SEPARATOR"dirreq-stats",
+                                       "dirreq-stats-end", now + 26*60*60,
+                                       &cp));
+  tt_ptr_op(cp, OP_EQ, NULL);
+
+  /* Writing the file through write_to_data_subdir() replaces what we
+   * remember. */
+  tt_int_op(0, OP_EQ, write_to_data_subdir("stats", "dirreq-stats",
+            "dirreq-stats-end 2010-08-12 14:27:30 (86400 s)\n"
+            "dirreq-v3-ips \n", NULL));
+  tt_int_op(1, OP_EQ, load_stats_file("stats"PATH_SEPARATOR"dirreq-stats",
+                                      "dirreq-stats-end", now, &cp));
+  tt_str_op(cp, OP_EQ, "dirreq-stats-end 2010-08-12 14:27:30 (86400 s)\n"
+            "dirreq-v3-ips \n");
+
+ done:
+  tor_free(cp);
+  tor_free(fname);
+  router_free_all();
+}
+
 static void
 test_routerkeys_ed_certs(void *args)
 {
@@ -619,6 +672,7 @@ test_routerkeys_cross_certify_tap(void *args)
 
 struct testcase_t routerkeys_tests[] = {
   TEST(write_fingerprint, TT_FORK),
+  TEST(load_stats_file, TT_FORK),
   TEST(ed_certs, TT_FORK),
   TEST(ed_key_create, TT_FORK),
   TEST(ed_key_init_basic, TT_FORK),
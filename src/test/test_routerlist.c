@@ -125,6 +125,103 @@ test_routerlist_launch_descriptor_downloads(void *arg)
   smartlist_free(downloadable);
 }
 
+static routerstatus_t mirror_rs[3];
+static int n_mirrors_picked = 0;
+static int batch_lo[8], batch_hi[8];
+static const routerstatus_t *batch_source[8];
+
+static const routerstatus_t *
+mock_directory_pick_mirror_for_fetch(uint8_t dir_purpose, int pds_flags)
+{
+  (void)dir_purpose;
+  (void)pds_flags;
+  return &mirror_rs[n_mirrors_picked++ % 3];
+}
+
+static void
+mock_initiate_descriptor_downloads_record(const routerstatus_t *source,
+                                          int purpose, smartlist_t *digests,
+                                          int lo, int hi, int pds_flags)
+{
+  (void)purpose;
+  (void)digests;
+  (void)pds_flags;
+  if (count < 8) {
+    batch_source[count] = source;
+    batch_lo[count] = lo;
+    batch_hi[count] = hi;
+  }
+  count += 1;
+}
+
+static void
+test_routerlist_adaptive_microdesc_downloads(void *arg)
+{
+  smartlist_t *downloadable = smartlist_new();
+  char *cp;
+  (void)arg;
+
+  memset(mirror_rs, 0, sizeof(mirror_rs));
+  memset(mirror_rs[0].identity_digest, 'A', DIGEST_LEN);
+  memset(mirror_rs[1].identity_digest, 'B', DIGEST_LEN);
+  memset(mirror_rs[2].identity_digest, 'C', DIGEST_LEN);
+  for (int i = 0; i < 100; i++) {
+    cp = tor_malloc(DIGEST256_LEN);
+    crypto_rand(cp, DIGEST256_LEN);
+    smartlist_add(downloadable, cp);
+  }
+
+  /* Throughput is a moving average. */
+  dir_mirror_note_throughput(mirror_rs[0].identity_digest, 200, 1000);
+  tt_double_op(fabs(dir_mirror_get_throughput(mirror_rs[0].identity_digest)
+                    - 200.0), OP_LT, 1e-9);
+  dir_mirror_note_throughput(mirror_rs[1].identity_digest, 100, 1000);
+  dir_mirror_note_throughput(mirror_rs[1].identity_digest, 0, 1000);
+  dir_mirror_note_throughput(mirror_rs[1].identity_digest, 20, 1000);
+  tt_double_op(fabs(dir_mirror_get_throughput(mirror_rs[1].identity_digest)
+                    - 76.0), OP_LT, 1e-9);
+  tt_double_op(dir_mirror_get_throughput(mirror_rs[2].identity_digest),
+               OP_LE, 0.0);
+  tt_double_op(fabs(dir_mirror_get_mean_throughput() - 138.0), OP_LT, 1e-9);
+
+  /* A fast mirror gets a bigger request, a slow one gets a smaller one,
+   * and one we haven't measured gets the usual size. */
+  MOCK(directory_pick_mirror_for_fetch, mock_directory_pick_mirror_for_fetch);
+  MOCK(initiate_descriptor_downloads,
+       mock_initiate_descriptor_downloads_record);
+  count = 0;
+  tt_int_op(5, OP_EQ,
+            launch_adaptive_microdesc_downloads(downloadable, 20, 90, 0));
+  tt_int_op(5, OP_EQ, count);
+  tt_ptr_op(batch_source[0], OP_EQ, &mirror_rs[0]);
+  tt_int_op(batch_lo[0], OP_EQ, 0);
+  tt_int_op(batch_hi[0], OP_EQ, 29);
+  tt_ptr_op(batch_source[1], OP_EQ, &mirror_rs[1]);
+  tt_int_op(batch_hi[1], OP_EQ, 40);
+  tt_ptr_op(batch_source[2], OP_EQ, &mirror_rs[2]);
+  tt_int_op(batch_hi[2], OP_EQ, 60);
+  tt_int_op(batch_hi[3], OP_EQ, 89);
+  tt_int_op(batch_lo[4], OP_EQ, 89);
+
+  /* Batches never get smaller than MIN_DL_PER_REQUEST, or bigger than
+   * the maximum. */
+  count = 0;
+  tt_int_op(25, OP_EQ,
+            launch_adaptive_microdesc_downloads(downloadable, 2, 20, 0));
+  tt_int_op(batch_hi[0] - batch_lo[0], OP_EQ, 4);
+  count = 0;
+  n_mirrors_picked = 0;
+  launch_adaptive_microdesc_downloads(downloadable, 50, 60, 0);
+  tt_int_op(batch_hi[0] - batch_lo[0], OP_EQ, 60);
+
+ done:
+  UNMOCK(directory_pick_mirror_for_fetch);
+  UNMOCK(initiate_descriptor_downloads);
+  dir_mirror_throughput_free_all();
+  SMARTLIST_FOREACH(downloadable, char *, cp1, tor_free(cp1));
+  smartlist_free(downloadable);
+}
+
 void
 construct_consensus(char **consensus_text_md)
 {
@@ -558,6 +655,101 @@ test_routerlist_router_is_already_dir_fetching(void *arg)
 #undef TEST_ADDR_STR
 #undef TEST_DIR_PORT
 
+/** Helper: return a new fake router descriptor, of <b>len</b> bytes,
+ * published at <b>published</b>, and add it to the routerlist's list of
+ * old descriptors. */
+static signed_descriptor_t *
+add_fake_stored_desc(int idx, size_t len, time_t published)
+{
+  signed_descriptor_t *sd = tor_malloc_zero(sizeof(signed_descriptor_t));
+  char *body = tor_malloc(len + 1);
+  tor_snprintf(body, len + 1, "router fake%d ", idx);
+  memset(body + strlen(body), 'x', len - strlen(body));
+  body[len - 1] = '\n';
+  body[len] = '\0';
+  sd->signed_descriptor_body = body;
+  sd->signed_descriptor_len = len;
+  sd->published_on = published;
+  sd->saved_location = SAVED_NOWHERE;
+  smartlist_add(router_get_routerlist()->old_routers, sd);
+  return sd;
+}
+
+static void
+test_routerlist_merge_journal_into_store(void *arg)
+{
+  or_options_t *options = get_options_mutable();
+  routerlist_t *rl;
+  desc_store_t *store;
+  signed_descriptor_t *sds[32];
+  off_t offsets[20];
+  char prefix[32];
+  char *journal = NULL, *journal_fname = NULL;
+  int i;
+  (void)arg;
+
+  tor_free(options->DataDirectory);
+  options->DataDirectory = tor_strdup(get_fname("rl_merge_datadir"));
+#ifdef _WIN32
+  tt_int_op(0, OP_EQ, mkdir(options->DataDirectory));
+#else
+  tt_int_op(0, OP_EQ, mkdir(options->DataDirectory, 0700));
+#endif
+  journal_fname = get_datadir_fname("cached-descriptors.new");
+
+  rl = router_get_routerlist();
+  store = &rl->desc_store;
+
+  /* Build a store of 20 descriptors, big enough to be worth appending to. */
+  for (i = 0; i < 20; ++i)
+    sds[i] = add_fake_stored_desc(i, 4096, 1000 + i);
+  tt_int_op(0, OP_EQ,
+            router_rebuild_store(RRS_FORCE|RRS_DONT_REMOVE_OLD, store));
+  tt_int_op(store->store_len, OP_EQ, 20*4096);
+  for (i = 0; i < 20; ++i) {
+    tt_int_op(sds[i]->saved_location, OP_EQ, SAVED_IN_CACHE);
+    offsets[i] = sds[i]->saved_offset;
+  }
+
+  /* Journal another 12: that's more than half the store, so it's time to
+   * rebuild, but the store has no garbage, so we just append. */
+  for (i = 20; i < 32; ++i) {
+    sds[i] = add_fake_stored_desc(i, 4096, 1000 + i);
+    sds[i]->saved_location = SAVED_IN_JOURNAL;
+    store->journal_len += 4096;
+  }
+  tt_int_op(0, OP_EQ, write_str_to_file(journal_fname, "junk", 1));
+  store->bytes_dropped = 4096;
+  tt_int_op(0, OP_EQ, router_rebuild_store(RRS_DONT_REMOVE_OLD, store));
+  /* A rewrite would have reset bytes_dropped. */
+  tt_int_op(store->bytes_dropped, OP_EQ, 4096);
+  tt_int_op(store->store_len, OP_EQ, 32*4096);
+  tt_int_op(store->journal_len, OP_EQ, 0);
+  tt_int_op(store->mmap->size, OP_EQ, 32*4096);
+  journal = read_file_to_str(journal_fname, RFTS_BIN, NULL);
+  tt_str_op(journal, OP_EQ, "");
+  for (i = 0; i < 20; ++i)
+    tt_int_op(sds[i]->saved_offset, OP_EQ, offsets[i]);
+  for (i = 0; i < 32; ++i) {
+    tt_int_op(sds[i]->saved_location, OP_EQ, SAVED_IN_CACHE);
+    tt_ptr_op(sds[i]->signed_descriptor_body, OP_EQ, NULL);
+    tor_snprintf(prefix, sizeof(prefix), "router fake%d ", i);
+    tt_assert(!strcmpstart(signed_descriptor_get_body(sds[i]), prefix));
+  }
+
+  /* Once the store is mostly garbage, we rewrite it instead. */
+  store->bytes_dropped = store->store_len;
+  store->journal_len = store->store_len;
+  tt_int_op(0, OP_EQ, router_rebuild_store(RRS_DONT_REMOVE_OLD, store));
+  tt_int_op(store->bytes_dropped, OP_EQ, 0);
+  tt_int_op(store->store_len, OP_EQ, 32*4096);
+
+ done:
+  routerlist_free_all();
+  tor_free(journal);
+  tor_free(journal_fname);
+}
+
 #define NODE(name, flags) \
   { #name, test_routerlist_##name, (flags), NULL, NULL }
 #define ROUTER(name,flags) \
@@ -566,7 +758,9 @@ test_routerlist_router_is_already_dir_fetching(void *arg)
 struct testcase_t routerlist_tests[] = {
   NODE(initiate_descriptor_downloads, 0),
   NODE(launch_descriptor_downloads, 0),
+  NODE(adaptive_microdesc_downloads, TT_FORK),
   NODE(router_is_already_dir_fetching, TT_FORK),
+  NODE(merge_journal_into_store, TT_FORK),
   ROUTER(pick_directory_server_impl, TT_FORK),
   END_OF_TESTCASES
 };
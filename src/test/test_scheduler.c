@@ -745,6 +745,71 @@ test_scheduler_queue_heuristic(void *arg)
   return;
 }
 
+static void
+test_scheduler_select(void *arg)
+{
+  smartlist_t *names = smartlist_new();
+  const scheduler_t *vanilla;
+
+  (void)arg;
+
+  vanilla = scheduler_get_by_name("Vanilla");
+  tt_assert(vanilla != NULL);
+  tt_str_op(vanilla->name, ==, "Vanilla");
+  tt_ptr_op(scheduler_get_by_name("vanilla"), ==, vanilla);
+  tt_ptr_op(scheduler_get_by_name("NoSuchScheduler"), ==, NULL);
+  tt_ptr_op(scheduler_get_current(), ==, vanilla);
+
+  /* Unknown names are skipped */
+  smartlist_add(names, (char *)"NoSuchScheduler");
+  smartlist_add(names, (char *)"Vanilla");
+  scheduler_set_schedulers(names);
+  tt_ptr_op(scheduler_get_current(), ==, vanilla);
+
+  /* If nothing works, we fall back to Vanilla */
+  smartlist_clear(names);
+  smartlist_add(names, (char *)"NoSuchScheduler");
+  scheduler_set_schedulers(names);
+  tt_ptr_op(scheduler_get_current(), ==, vanilla);
+  scheduler_set_schedulers(NULL);
+  tt_ptr_op(scheduler_get_current(), ==, vanilla);
+
+ done:
+  smartlist_free(names);
+}
+
+static void
+test_scheduler_kist_limit(void *arg)
+{
+  const scheduler_t *kist;
+
+  (void)arg;
+
+  kist = scheduler_get_by_name("KIST");
+  tt_assert(kist != NULL);
+#ifdef HAVE_KIST_SUPPORT
+  tt_assert(kist->is_available());
+#else
+  tt_assert(! kist->is_available());
+#endif
+
+  /* Empty socket: the whole congestion window is ours */
+  tt_i64_op(kist_compute_socket_limit(10, 0, 1000, 0, 0), ==, 10000);
+  /* Four segments in flight and in the send queue */
+  tt_i64_op(kist_compute_socket_limit(10, 4, 1000, 4000, 0), ==, 6000);
+  /* ... with 1500 more bytes in the send queue that haven't gone out */
+  tt_i64_op(kist_compute_socket_limit(10, 4, 1000, 5500, 0), ==, 4500);
+  /* ... and 500 bytes in our outbuf */
+  tt_i64_op(kist_compute_socket_limit(10, 4, 1000, 5500, 500), ==, 4000);
+  /* Full window, or more queued than it has room for */
+  tt_i64_op(kist_compute_socket_limit(10, 10, 1000, 10000, 0), ==, 0);
+  tt_i64_op(kist_compute_socket_limit(10, 4, 1000, 20000, 0), ==, 0);
+  tt_i64_op(kist_compute_socket_limit(10, 4, 1000, 0, 100000), ==, 0);
+
+ done:
+  ;
+}
+
 struct testcase_t scheduler_tests[] = {
   { "channel_states", test_scheduler_channel_states, TT_FORK, NULL, NULL },
   { "compare_channels", test_scheduler_compare_channels,
@@ -753,6 +818,8 @@ struct testcase_t scheduler_tests[] = {
   { "loop", test_scheduler_loop, TT_FORK, NULL, NULL },
   { "queue_heuristic", test_scheduler_queue_heuristic,
     TT_FORK, NULL, NULL },
+  { "kist_limit", test_scheduler_kist_limit, TT_FORK, NULL, NULL },
+  { "select", test_scheduler_select, TT_FORK, NULL, NULL },
   END_OF_TESTCASES
 };
 
@@ -672,6 +672,88 @@ test_state_load_from_disk(void *arg)
   UNMOCK(trusteddirserver_get_by_v3_auth_digest);
 }
 
+/** Make sure that commits are appended to the state file rather than
+ *  rewriting it, and that the appended lines win when we load it back. */
+static void
+test_state_journal(void *arg)
+{
+  char *dir = tor_strdup(get_fname("test_sr_journal"));
+  char *fname = NULL, *before = NULL, *after = NULL, *line = NULL;
+  sr_commit_t *commit = NULL, *unrevealed, *loaded;
+  or_options_t *options = get_options_mutable();
+  char *old_datadir = options->DataDirectory;
+
+  (void) arg;
+
+  MOCK(trusteddirserver_get_by_v3_auth_digest,
+       trusteddirserver_get_by_v3_auth_digest_m);
+
+#ifdef _WIN32
+  tt_int_op(mkdir(dir), OP_EQ, 0);
+#else
+  tt_int_op(mkdir(dir, 0700), OP_EQ, 0);
+#endif
+  options->DataDirectory = dir;
+  fname = get_datadir_fname("sr-state");
+
+  init_authority_state();
+  sr_state_save();
+  before = read_file_to_str(fname, 0, NULL);
+  tt_assert(before);
+
+  commit = sr_generate_our_commit(time(NULL), mock_cert);
+  tt_assert(commit);
+  tt_assert(commit_has_reveal_value(commit));
+  unrevealed = tor_memdup(commit, sizeof(*commit));
+  memset(unrevealed->encoded_reveal, 0, sizeof(unrevealed->encoded_reveal));
+
+  /* Adding a commit appends one line and leaves the rest alone. */
+  sr_state_add_commit(unrevealed);
+  after = read_file_to_str(fname, 0, NULL);
+  tt_assert(after);
+  tt_assert(!strcmpstart(after, before));
+  tor_asprintf(&line, "Commit 1 sha3-256 %s %s\n",
+               commit->rsa_identity_hex, commit->encoded_commit);
+  tt_str_op(after + strlen(before), OP_EQ, line);
+  tor_free(line);
+  tor_free(after);
+
+  /* So does learning its reveal value. */
+  sr_state_copy_reveal_info(unrevealed, commit);
+  after = read_file_to_str(fname, 0, NULL);
+  tt_assert(after);
+  tt_assert(!strcmpstart(after, before));
+  tt_assert(strstr(after + strlen(before), commit->encoded_reveal));
+
+  /* Loading the state back gives us the commit with its reveal. */
+  sr_state_free();
+  tt_int_op(disk_state_load_from_disk_impl(fname), OP_EQ, 0);
+  tt_int_op(digestmap_size(get_sr_state()->commits), OP_EQ, 1);
+  loaded = sr_state_get_commit(commit->rsa_identity);
+  tt_assert(loaded);
+  tt_str_op(loaded->encoded_reveal, OP_EQ, commit->encoded_reveal);
+
+  /* A full save folds the appended lines back in. */
+  sr_state_save();
+  tor_free(after);
+  after = read_file_to_str(fname, 0, NULL);
+  tt_assert(after);
+  tt_assert(strstr(after, commit->encoded_reveal));
+  tt_assert(strstr(after, "\nCommit "));
+  tt_ptr_op(strstr(strstr(after, "\nCommit ") + 1, "\nCommit "), OP_EQ,
+            NULL);
+
+ done:
+  sr_commit_free(commit);
+  tor_free(fname);
+  tor_free(before);
+  tor_free(after);
+  tor_free(line);
+  options->DataDirectory = old_datadir;
+  tor_free(dir);
+  UNMOCK(trusteddirserver_get_by_v3_auth_digest);
+}
+
 /** Generate three specially crafted commits (based on the test
  *  vector at sr_srv_calc_ref.py). Helper of test_sr_compute_srv(). */
 static void
@@ -1278,6 +1360,8 @@ struct testcase_t sr_tests[] = {
     NULL, NULL },
   { "state_load_from_disk", test_state_load_from_disk, TT_FORK,
     NULL, NULL },
+  { "state_journal", test_state_journal, TT_FORK,
+    NULL, NULL },
   { "sr_compute_srv", test_sr_compute_srv, TT_FORK, NULL, NULL },
   { "sr_get_majority_srv_from_votes", test_sr_get_majority_srv_from_votes,
     TT_FORK, NULL, NULL },
@@ -3,6 +3,7 @@
  * Copyright (c) 2007-2016, The Tor Project, Inc. */
 /* See LICENSE for licensing information */
 
+#define BUFFERS_PRIVATE
 #include "or.h"
 #include "buffers.h"
 #include "config.h"
@@ -492,6 +493,62 @@ test_socks_5_malformed_commands(void *ptr)
   ;
 }
 
+/** Parse SOCKS requests that arrive spread over several buffer chunks. */
+static void
+test_socks_split_across_chunks(void *ptr)
+{
+  SOCKS_TEST_INIT();
+  char req[600], host[201];
+  const char *cp;
+  size_t sz, len;
+
+  memset(host, 'a', 196);
+  memcpy(host+196, ".com", 5);
+
+  /* SOCKS 4a CONNECT with a long user ID and a long hostname. */
+  memcpy(req, "\x04\x01\x11\x12\x00\x00\x00\x02", 8);
+  memset(req+8, 'u', 300);
+  req[308] = '\0';
+  memcpy(req+309, host, 201);
+  len = 309 + 201;
+  write_to_buf(req, 8, buf);
+  write_to_buf(req+8, len-8, buf);
+  buf_get_first_chunk_data(buf, &cp, &sz);
+  tt_uint_op(sz, OP_LT, len);
+
+  tt_int_op(fetch_from_buf_socks(buf, socks, get_options()->TestSocks,
+                                 get_options()->SafeSocks),OP_EQ, 1);
+  tt_int_op(4,OP_EQ, socks->socks_version);
+  tt_str_op(host,OP_EQ, socks->address);
+  tt_int_op(4370,OP_EQ, socks->port);
+  tt_int_op(300,OP_EQ, socks->usernamelen);
+  tt_int_op(0,OP_EQ, buf_datalen(buf));
+  socks_request_clear(socks);
+
+  /* SOCKS 5 CONNECT to a long hostname, starting near the end of a chunk
+   * so that it spills into the next one. */
+  memset(req, 0, 400);
+  write_to_buf(req, 400, buf);
+  memcpy(req, "\x05\x01\x00\x05\x01\x00\x03\xc8", 8);
+  memcpy(req+8, host, 200);
+  memcpy(req+208, "\x11\x11", 2);
+  len = 210;
+  write_to_buf(req, len, buf);
+  tt_int_op(fetch_from_buf(req, 400, buf),OP_EQ, (int)len);
+  buf_get_first_chunk_data(buf, &cp, &sz);
+  tt_uint_op(sz, OP_LT, len);
+
+  tt_int_op(fetch_from_buf_socks(buf, socks, get_options()->TestSocks,
+                                 get_options()->SafeSocks),OP_EQ, 1);
+  tt_int_op(5,OP_EQ, socks->socks_version);
+  tt_str_op(host,OP_EQ, socks->address);
+  tt_int_op(4369,OP_EQ, socks->port);
+  tt_int_op(0,OP_EQ, buf_datalen(buf));
+
+ done:
+  ;
+}
+
 #define SOCKSENT(name)                                  \
   { #name, test_socks_##name, TT_FORK, &socks_setup, NULL }
 
@@ -506,6 +563,7 @@ struct testcase_t socks_tests[] = {
   SOCKSENT(5_authenticate),
   SOCKSENT(5_authenticate_with_data),
   SOCKSENT(5_malformed_commands),
+  SOCKSENT(split_across_chunks),
 
   END_OF_TESTCASES
 };
@@ -6,6 +6,7 @@
 #include "orconfig.h"
 #include "or.h"
 #include "compat_threads.h"
+#include "handoffqueue.h"
 #include "test.h"
 
 /** mutex for thread test to stop the threads hitting data at the same time. */
@@ -290,6 +291,95 @@ test_threads_conditionvar(void *arg)
   cv_testinfo_free(ti);
 }
 
+#define N_HANDOFF_ITEMS 10000
+
+static void
+handoff_producer_fn_(void *arg)
+{
+  handoff_queue_t *q = arg;
+  int items[100];
+  int i, j;
+  for (i = 0; i < N_HANDOFF_ITEMS; i += 100) {
+    for (j = 0; j < 100; ++j)
+      items[j] = i + j;
+    handoff_queue_push_wait(q, items, 100);
+  }
+}
+
+static void
+test_threads_handoff_queue(void *arg)
+{
+  handoff_queue_t *q = NULL;
+  int items[32];
+  int i, n, next, tries;
+  (void)arg;
+
+  q = handoff_queue_new(sizeof(int), 10, 0);
+  tt_assert(q);
+  tt_int_op(handoff_queue_get_capacity(q), OP_EQ, 16);
+  tt_int_op(handoff_queue_pop(q, items, 32), OP_EQ, 0);
+
+  /* A bounded push takes what fits, and wakes the consumer once. */
+  for (i = 0; i < 32; ++i)
+    items[i] = i;
+  tt_int_op(handoff_queue_push(q, items, 20), OP_EQ, 16);
+  tt_int_op(handoff_queue_push(q, items, 1), OP_EQ, 0);
+  tt_int_op(handoff_queue_get_len(q), OP_EQ, 16);
+  tt_u64_op(handoff_queue_get_n_alerts(q), OP_EQ, 1);
+  handoff_queue_clear_alert(q);
+
+  /* Items come out in order, including across the end of the ring. */
+  tt_int_op(handoff_queue_pop(q, items, 5), OP_EQ, 5);
+  for (i = 0; i < 5; ++i)
+    tt_int_op(items[i], OP_EQ, i);
+  for (i = 0; i < 5; ++i)
+    items[i] = 16 + i;
+  tt_int_op(handoff_queue_push(q, items, 5), OP_EQ, 5);
+  tt_u64_op(handoff_queue_get_n_alerts(q), OP_EQ, 1);
+  tt_int_op(handoff_queue_pop(q, items, 32), OP_EQ, 16);
+  for (i = 0; i < 16; ++i)
+    tt_int_op(items[i], OP_EQ, i + 5);
+  tt_int_op(handoff_queue_get_len(q), OP_EQ, 0);
+
+  /* Once it's empty, the next push wakes the consumer again. */
+  tt_int_op(handoff_queue_push(q, items, 1), OP_EQ, 1);
+  tt_u64_op(handoff_queue_get_n_alerts(q), OP_EQ, 2);
+  tt_int_op(handoff_queue_pop(q, items, 32), OP_EQ, 1);
+  handoff_queue_clear_alert(q);
+
+  /* A blocking producer on another thread gets everything through a queue
+   * much smaller than what it sends, in order. */
+  tt_int_op(spawn_func(handoff_producer_fn_, q), OP_EQ, 0);
+  next = 0;
+  for (tries = 0; next < N_HANDOFF_ITEMS && tries < 100000; ++tries) {
+    n = handoff_queue_pop(q, items, 32);
+    for (i = 0; i < n; ++i)
+      tt_int_op(items[i], OP_EQ, next++);
+    if (n == 0)
+      tor_sleep_msec(1);
+  }
+  tt_int_op(next, OP_EQ, N_HANDOFF_ITEMS);
+
+ done:
+  handoff_queue_free(q);
+}
+
+static void
+test_threads_cpu_affinity(void *arg)
+{
+  int cpu;
+  (void)arg;
+
+  cpu = tor_get_current_cpu();
+  if (cpu < 0 || tor_set_current_thread_cpu(cpu) < 0)
+    tt_skip();
+  tt_int_op(tor_get_current_cpu(), OP_EQ, cpu);
+  tt_int_op(tor_set_current_thread_cpu(-1), OP_EQ, 0);
+
+ done:
+  ;
+}
+
 #define THREAD_TEST(name)                                               \
   { #name, test_threads_##name, TT_FORK, NULL, NULL }
 
@@ -299,6 +389,8 @@ struct testcase_t thread_tests[] = {
     &passthrough_setup, (void*)"no-tv" },
   { "conditionvar_timeout", test_threads_conditionvar, TT_FORK,
     &passthrough_setup, (void*)"tv" },
+  THREAD_TEST(handoff_queue),
+  THREAD_TEST(cpu_affinity),
   END_OF_TESTCASES
 };
 
@@ -153,6 +153,117 @@ test_tortls_tor_tls_new(void *data)
   tor_tls_free_all();
 }
 
+static void
+test_tortls_read_ahead(void *data)
+{
+  crypto_pk_t *key1 = NULL, *key2 = NULL;
+  tor_tls_t *tls = NULL;
+  (void) data;
+
+  key1 = pk_generate(2);
+  key2 = pk_generate(3);
+  tt_int_op(tor_tls_context_init(TOR_TLS_CTX_IS_PUBLIC_SERVER,
+                                 key1, key2, 86400), OP_EQ, 0);
+
+  /* Off by default. */
+  tls = tor_tls_new(-1, 0);
+  tt_assert(tls);
+  tt_int_op(SSL_get_read_ahead(tls->ssl), OP_EQ, 0);
+  tt_int_op(tor_tls_has_buffered_input(tls), OP_EQ, 0);
+  tor_tls_free(tls);
+
+#if OPENSSL_VERSION_NUMBER >= OPENSSL_V_SERIES(1,1,0)
+  tt_int_op(tor_tls_set_read_ahead(1), OP_EQ, 0);
+  tls = tor_tls_new(-1, 0);
+  tt_assert(tls);
+  tt_int_op(SSL_get_read_ahead(tls->ssl), OP_EQ, 1);
+  tt_int_op(tor_tls_has_buffered_input(tls), OP_EQ, 0);
+  tor_tls_free(tls);
+#else
+  tt_int_op(tor_tls_set_read_ahead(1), OP_EQ, -1);
+#endif
+
+  /* Turning it off only affects new objects. */
+  tt_int_op(tor_tls_set_read_ahead(0), OP_EQ, 0);
+  tls = tor_tls_new(-1, 0);
+  tt_assert(tls);
+  tt_int_op(SSL_get_read_ahead(tls->ssl), OP_EQ, 0);
+
+ done:
+  tor_tls_set_read_ahead(0);
+  tor_tls_free(tls);
+  crypto_pk_free(key1);
+  crypto_pk_free(key2);
+  tor_tls_free_all();
+}
+
+static void
+test_tortls_session_resumption(void *data)
+{
+  crypto_pk_t *key1 = NULL, *key2 = NULL;
+  tor_tls_t *tls = NULL;
+  SSL_SESSION *session = NULL;
+  uint64_t attempted, resumed;
+  char id1[DIGEST_LEN], id2[DIGEST_LEN], zero_id[DIGEST_LEN];
+  (void) data;
+
+  memset(id1, 1, sizeof(id1));
+  memset(id2, 2, sizeof(id2));
+  memset(zero_id, 0, sizeof(zero_id));
+  key1 = pk_generate(2);
+  key2 = pk_generate(3);
+
+  /* Without the flag, we never remember or offer sessions. */
+  tt_int_op(tor_tls_context_init(TOR_TLS_CTX_IS_PUBLIC_SERVER,
+                                 key1, key2, 86400), OP_EQ, 0);
+  session = SSL_SESSION_new();
+  tls = tor_tls_new(-1, 0);
+  tt_assert(tls);
+  tt_assert(SSL_set_session(tls->ssl, session));
+  tor_tls_remember_session(tls, id1);
+  tor_tls_free(tls);
+  tls = tor_tls_new(-1, 0);
+  tt_int_op(tor_tls_try_resume_session(tls, id1), OP_EQ, 0);
+  tor_tls_free(tls);
+
+  tt_int_op(tor_tls_context_init(TOR_TLS_CTX_IS_PUBLIC_SERVER|
+                                 TOR_TLS_CTX_ALLOW_RESUMPTION,
+                                 key1, key2, 86400), OP_EQ, 0);
+  tls = tor_tls_new(-1, 0);
+  tt_int_op(tor_tls_try_resume_session(tls, id1), OP_EQ, 0);
+  tt_assert(SSL_set_session(tls->ssl, session));
+  tor_tls_remember_session(tls, id1);
+  tor_tls_remember_session(tls, zero_id);
+  tor_tls_free(tls);
+
+  /* We offer the session to the same relay, once. */
+  tls = tor_tls_new(-1, 0);
+  tt_int_op(tor_tls_try_resume_session(tls, id2), OP_EQ, 0);
+  tt_int_op(tor_tls_try_resume_session(tls, zero_id), OP_EQ, 0);
+  tt_int_op(tor_tls_try_resume_session(tls, id1), OP_EQ, 1);
+  tt_int_op(tls->offered_session, OP_EQ, 1);
+  tor_tls_free(tls);
+  tls = tor_tls_new(-1, 0);
+  tt_int_op(tor_tls_try_resume_session(tls, id1), OP_EQ, 0);
+  tor_tls_free(tls);
+  tls = NULL;
+
+  tor_tls_get_session_resumption_counts(&attempted, &resumed);
+  tt_u64_op(attempted, OP_EQ, 1);
+  tt_u64_op(resumed, OP_EQ, 0);
+
+  /* Server-side connections never offer sessions. */
+  tls = tor_tls_new(-1, 1);
+  tt_int_op(tor_tls_try_resume_session(tls, id1), OP_EQ, 0);
+
+ done:
+  SSL_SESSION_free(session);
+  crypto_pk_free(key1);
+  crypto_pk_free(key2);
+  tor_tls_free(tls);
+  tor_tls_free_all();
+}
+
 #define NS_MODULE tortls
 NS_DECL(void, logv, (int severity, log_domain_mask_t domain,
                      const char *funcname, const char *suffix,
@@ -2667,6 +2778,20 @@ test_tortls_cert_is_valid(void *ignored)
   ret = tor_tls_cert_is_valid(LOG_WARN, cert, scert, 0);
   tt_int_op(ret, OP_EQ, 1);
 
+  /* The second time, we remember the signature, but we still check the
+   * rest. */
+  tt_u64_op(n_cert_sig_cache_hits, OP_EQ, 0);
+  ret = tor_tls_cert_is_valid(LOG_WARN, cert, scert, 0);
+  tt_int_op(ret, OP_EQ, 1);
+  tt_u64_op(n_cert_sig_cache_hits, OP_EQ, 1);
+  ret = tor_tls_cert_is_valid(LOG_WARN, cert, scert, 1);
+  tt_int_op(ret, OP_EQ, 1);
+  tt_u64_op(n_cert_sig_cache_hits, OP_EQ, 2);
+  /* A different signer doesn't match the cache. */
+  ret = tor_tls_cert_is_valid(LOG_WARN, cert, cert, 0);
+  tt_int_op(ret, OP_EQ, 0);
+  tt_u64_op(n_cert_sig_cache_hits, OP_EQ, 2);
+
 #ifndef OPENSSL_OPAQUE
   tor_x509_cert_free(cert);
   tor_x509_cert_free(scert);
@@ -2764,6 +2889,8 @@ struct testcase_t tortls_tests[] = {
   LOCAL_TEST_CASE(errno_to_tls_error, 0),
   LOCAL_TEST_CASE(err_to_string, 0),
   LOCAL_TEST_CASE(tor_tls_new, TT_FORK),
+  LOCAL_TEST_CASE(read_ahead, TT_FORK),
+  LOCAL_TEST_CASE(session_resumption, TT_FORK),
   LOCAL_TEST_CASE(tor_tls_get_error, 0),
   LOCAL_TEST_CASE(get_state_description, TT_FORK),
   LOCAL_TEST_CASE(get_by_ssl, TT_FORK),
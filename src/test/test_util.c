@@ -13,6 +13,7 @@
 #include "control.h"
 #include "test.h"
 #include "memarea.h"
+#include "latency_trace.h"
 #include "util_process.h"
 #include "log_test_helpers.h"
 
@@ -937,6 +938,21 @@ test_util_time(void *arg)
   format_rfc1123_time(timestr, (time_t)1091580502UL);
   tt_str_op("Wed, 04 Aug 2004 00:48:22 GMT",OP_EQ, timestr);
 
+  /* We remember the last time we formatted; make sure we only reuse it for
+   * the same time. */
+  memset(timestr, 'x', RFC1123_TIME_LEN+1);
+  format_rfc1123_time(timestr, (time_t)1091580502UL);
+  tt_str_op("Wed, 04 Aug 2004 00:48:22 GMT",OP_EQ, timestr);
+  format_rfc1123_time(timestr, (time_t)1091580503UL);
+  tt_str_op("Wed, 04 Aug 2004 00:48:23 GMT",OP_EQ, timestr);
+  format_iso_time(timestr, (time_t)1091580503UL);
+  tt_str_op("2004-08-04 00:48:23",OP_EQ, timestr);
+  format_iso_time(timestr, (time_t)1091580502UL);
+  tt_str_op("2004-08-04 00:48:22",OP_EQ, timestr);
+  format_iso_time(timestr, (time_t)1091580502UL);
+  tt_str_op("2004-08-04 00:48:22",OP_EQ, timestr);
+  format_rfc1123_time(timestr, (time_t)1091580502UL);
+
   t_res = 0;
   i = parse_rfc1123_time(timestr, &t_res);
   tt_int_op(0,OP_EQ, i);
@@ -2386,6 +2402,101 @@ test_util_gzip_compression_bomb(void *arg)
   tor_zlib_free(state);
 }
 
+/** Run unit tests for the compression backends that we only drive through
+ * tor_zlib_state_t: the method to test is passed as a string in <b>arg</b>.
+ */
+static void
+test_util_compress_backend(void *arg)
+{
+  const compress_method_t method =
+    compression_method_get_by_name((const char *)arg);
+  char *buf1=NULL, *buf2=NULL, *buf3=NULL, *cp1, *cp2;
+  const char *ccp2;
+  size_t len1, len2;
+  tor_zlib_state_t *state = NULL;
+
+  tt_int_op(method, OP_NE, UNKNOWN_METHOD);
+  tt_str_op(compression_method_get_name(method), OP_EQ, (const char *)arg);
+  if (!tor_compress_supports_method(method)) {
+    tt_ptr_op(tor_zlib_new(1, method, HIGH_COMPRESSION), OP_EQ, NULL);
+    tt_skip();
+  }
+
+  buf1 = tor_strdup("AAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAZAAAAAAAAAAAAAAAAAAAZ");
+  tt_assert(!tor_gzip_compress(&buf2, &len1, buf1, strlen(buf1)+1,
+                               method));
+  tt_assert(buf2);
+  tt_int_op(detect_compression_method(buf2, len1), OP_EQ, method);
+
+  tt_assert(!tor_gzip_uncompress(&buf3, &len2, buf2, len1,
+                                 method, 1, LOG_INFO));
+  tt_int_op(strlen(buf1) + 1,OP_EQ, len2);
+  tt_str_op(buf1,OP_EQ, buf3);
+
+  /* Check whether we can uncompress concatenated, compressed strings. */
+  tor_free(buf3);
+  buf2 = tor_reallocarray(buf2, len1, 2);
+  memcpy(buf2+len1, buf2, len1);
+  tt_assert(!tor_gzip_uncompress(&buf3, &len2, buf2, len1*2,
+                                 method, 1, LOG_INFO));
+  tt_int_op((strlen(buf1)+1)*2,OP_EQ, len2);
+  tt_mem_op(buf3,OP_EQ,
+             "AAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAZAAAAAAAAAAAAAAAAAAAZ\0"
+             "AAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAZAAAAAAAAAAAAAAAAAAAZ\0",
+             (strlen(buf1)+1)*2);
+
+  /* A truncated string is only acceptable if we allow partial output. */
+  tor_free(buf3);
+  tt_assert(tor_gzip_uncompress(&buf3, &len2, buf2, len1-4,
+                                method, 1, LOG_INFO));
+  tt_ptr_op(buf3, OP_EQ, NULL);
+  tt_assert(!tor_gzip_uncompress(&buf3, &len2, buf2, len1-4,
+                                 method, 0, LOG_INFO));
+  tt_assert(!strcmpstart(buf1, buf3));
+
+  /* Junk should never uncompress. */
+  tor_free(buf3);
+  memset(buf2 + 8, 'x', len1 - 8);
+  tt_assert(tor_gzip_uncompress(&buf3, &len2, buf2, len1,
+                                method, 1, LOG_INFO));
+  tt_ptr_op(buf3, OP_EQ, NULL);
+
+  /* Now, try streaming compression. */
+  tor_free(buf1);
+  tor_free(buf2);
+  state = tor_zlib_new(1, method, HIGH_COMPRESSION);
+  tt_assert(state);
+  tt_int_op(tor_zlib_state_size(state), OP_GT, 0);
+  tt_int_op(tor_zlib_get_total_allocation(), OP_GE,
+            tor_zlib_state_size(state));
+  cp1 = buf1 = tor_malloc(1024);
+  len1 = 1024;
+  ccp2 = "ABCDEFGHIJABCDEFGHIJ";
+  len2 = 21;
+  tt_int_op(tor_zlib_process(state, &cp1, &len1, &ccp2, &len2, 0),
+            OP_EQ, TOR_ZLIB_OK);
+  tt_int_op(0,OP_EQ, len2); /* Make sure we compressed it all. */
+
+  len2 = 0;
+  cp2 = cp1;
+  tt_int_op(tor_zlib_process(state, &cp1, &len1, &ccp2, &len2, 1),
+            OP_EQ, TOR_ZLIB_DONE);
+  tt_int_op(0,OP_EQ, len2);
+  tt_assert(cp1 > cp2); /* Make sure we really added something. */
+
+  tt_assert(!tor_gzip_uncompress(&buf3, &len2, buf1, 1024-len1,
+                                  method, 1, LOG_WARN));
+  /* Make sure it compressed right. */
+  tt_str_op(buf3, OP_EQ, "ABCDEFGHIJABCDEFGHIJ");
+  tt_int_op(21,OP_EQ, len2);
+
+ done:
+  tor_zlib_free(state);
+  tor_free(buf2);
+  tor_free(buf3);
+  tor_free(buf1);
+}
+
 /** Run unit tests for mmap() wrapper functionality. */
 static void
 test_util_mmap(void *arg)
@@ -2438,6 +2549,22 @@ test_util_mmap(void *arg)
   tt_assert(mapping);
   tt_int_op(mapping->size,OP_EQ, buflen);
   tt_mem_op(mapping->data,OP_EQ, buf, buflen);
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MINCORE)
+  {
+    /* We just read every page, so they're all in memory. */
+    size_t resident = 0;
+    tt_int_op(0, OP_EQ, tor_mmap_get_resident(mapping, &resident));
+    tt_u64_op(resident, OP_EQ, buflen);
+  }
+#endif
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MADVISE)
+  tt_int_op(0, OP_EQ, tor_mmap_advise(mapping, TOR_MMAP_ADVISE_SEQUENTIAL|
+                                               TOR_MMAP_ADVISE_WILLNEED));
+  tt_int_op(0, OP_EQ, tor_mmap_advise(mapping, TOR_MMAP_ADVISE_RANDOM));
+  tt_int_op(0, OP_EQ, tor_mmap_advise(mapping, 0));
+#endif
+  /* Hints never change what we read. */
+  tt_mem_op(mapping->data,OP_EQ, buf, buflen);
   tt_int_op(0, OP_EQ, tor_munmap_file(mapping));
   mapping = NULL;
 
@@ -3431,6 +3558,103 @@ test_util_memarea(void *arg)
   tor_free(malloced_ptr);
 }
 
+/** Run unit tests for reusing memarea chunks through the freelist. */
+static void
+test_util_memarea_freelist(void *arg)
+{
+  memarea_t *area = NULL;
+  size_t held;
+  char *p;
+  int i;
+
+  (void)arg;
+  memarea_clear_freelist();
+  tt_int_op(memarea_get_freelist_size(), OP_EQ, 0);
+
+  /* Use several ordinary chunks and one oversized one. */
+  area = memarea_new();
+  for (i = 0; i < 100; ++i)
+    memarea_alloc(area, 100);
+  memarea_alloc(area, 20000);
+  memarea_drop_all(area);
+  area = NULL;
+
+  /* The ordinary chunks went to the freelist; the big one didn't. */
+  held = memarea_get_freelist_size();
+  tt_int_op(held, OP_GE, 3 * 4096);
+  tt_int_op(held, OP_LT, 20000);
+
+  /* A new area takes its first chunk from the freelist, and works. */
+  area = memarea_new();
+  tt_int_op(memarea_get_freelist_size(), OP_LT, held);
+  p = memarea_strdup(area, "reused");
+  tt_str_op(p, OP_EQ, "reused");
+  tt_assert(memarea_owns_ptr(area, p));
+  memarea_assert_ok(area);
+  memarea_clear(area);
+  memarea_drop_all(area);
+  area = NULL;
+  tt_int_op(memarea_get_freelist_size(), OP_EQ, held);
+
+  memarea_clear_freelist();
+  tt_int_op(memarea_get_freelist_size(), OP_EQ, 0);
+
+ done:
+  if (area)
+    memarea_drop_all(area);
+}
+
+static void
+test_util_latency_trace(void *arg)
+{
+  const latency_hist_t *h;
+  char *s = NULL;
+  (void)arg;
+
+  latency_trace_reset();
+  h = latency_trace_get_hist(LT_CONN_READ);
+  tt_u64_op(h->n, OP_EQ, 0);
+  tt_u64_op(latency_hist_percentile_usec(h, .5), OP_EQ, 0);
+
+  /* 500 nsec goes in bucket 0; 1 usec in bucket 1; 3 usec in bucket 2;
+   * 1000 usec in bucket 10; an hour in the last bucket. */
+  latency_trace_record(LT_CONN_READ, 500);
+  latency_trace_record(LT_CONN_READ, 1000);
+  latency_trace_record(LT_CONN_READ, 3000);
+  latency_trace_record(LT_CONN_READ, 1000000);
+  latency_trace_record(LT_CONN_READ, U64_LITERAL(3600000000000));
+  tt_u64_op(h->n, OP_EQ, 5);
+  tt_u64_op(h->buckets[0], OP_EQ, 1);
+  tt_u64_op(h->buckets[1], OP_EQ, 1);
+  tt_u64_op(h->buckets[2], OP_EQ, 1);
+  tt_u64_op(h->buckets[10], OP_EQ, 1);
+  tt_u64_op(h->buckets[LATENCY_HIST_N_BUCKETS-1], OP_EQ, 1);
+  tt_u64_op(h->max_nsec, OP_EQ, U64_LITERAL(3600000000000));
+
+  /* Percentiles are upper bounds of the bucket they land in. */
+  tt_u64_op(latency_hist_percentile_usec(h, .2), OP_EQ, 1);
+  tt_u64_op(latency_hist_percentile_usec(h, .5), OP_EQ, 4);
+  tt_u64_op(latency_hist_percentile_usec(h, .8), OP_EQ, 1024);
+  tt_u64_op(latency_hist_percentile_usec(h, 1.0), OP_EQ,
+            U64_LITERAL(3600000000));
+
+  /* Other trace points are unaffected. */
+  tt_u64_op(latency_trace_get_hist(LT_CONN_WRITE)->n, OP_EQ, 0);
+
+  s = latency_trace_format();
+  tt_assert(!strcmpstart(s, "conn-read count=5 mean-usec=720000200 "
+                         "p50-usec=4 p99-usec=3600000000 "
+                         "max-usec=3600000000 buckets=1,1,1,0,"));
+  tt_assert(strstr(s, "\nconn-write count=0 "));
+  tt_assert(strstr(s, "\nreplyqueue count=0 "));
+
+  latency_trace_reset();
+  tt_u64_op(h->n, OP_EQ, 0);
+
+ done:
+  tor_free(s);
+}
+
 /** Run unit tests for utility functions to get file names relative to
  * the data directory. */
 static void
@@ -3669,6 +3893,45 @@ test_util_asprintf(void *ptr)
   tor_free(cp2);
 }
 
+static void
+test_util_strbuf(void *ptr)
+{
+  strbuf_t *sb = NULL;
+  char *cp = NULL;
+  size_t len = 0;
+  int i;
+  (void)ptr;
+
+  sb = strbuf_new(0);
+  tt_str_op(strbuf_get(sb), OP_EQ, "");
+  tt_int_op(strbuf_len(sb), OP_EQ, 0);
+
+  strbuf_add(sb, "router ");
+  strbuf_add_printf(sb, "%s %d\n", "bob", 9001);
+  strbuf_add_bytes(sb, "xyz\0", 2);
+  tt_str_op(strbuf_get(sb), OP_EQ, "router bob 9001\nxy");
+  tt_int_op(strbuf_len(sb), OP_EQ, 18);
+
+  /* Formatting past the end of the space we have makes more. */
+  for (i = 0; i < 20; ++i)
+    strbuf_add_printf(sb, "%d: %s\n", i, LOREMIPSUM);
+  tt_int_op(strbuf_len(sb), OP_EQ, strlen(strbuf_get(sb)));
+  tt_assert(strstr(strbuf_get(sb), "19: "LOREMIPSUM"\n"));
+  strbuf_add_printf(sb, "%s%s%s%s%s%s", LOREMIPSUM, LOREMIPSUM, LOREMIPSUM,
+                    LOREMIPSUM, LOREMIPSUM, LOREMIPSUM);
+  tt_int_op(strbuf_len(sb), OP_EQ, strlen(strbuf_get(sb)));
+
+  len = strbuf_len(sb);
+  cp = strbuf_extract(sb, &len);
+  sb = NULL;
+  tt_int_op(len, OP_EQ, strlen(cp));
+  tt_assert(!strcmpstart(cp, "router bob 9001\nxy0: "));
+
+ done:
+  strbuf_free(sb);
+  tor_free(cp);
+}
+
 static void
 test_util_listdir(void *ptr)
 {
@@ -4306,6 +4569,37 @@ test_util_di_ops(void *arg)
     }
   }
 
+  {
+    /* Every length and position, so we cover the word-at-a-time loops
+     * and their tails. */
+    uint8_t buf1[40], buf2[40];
+    size_t len, pos;
+    crypto_rand((char*)buf1, sizeof(buf1));
+    for (len = 0; len <= sizeof(buf1); ++len) {
+      for (pos = 0; pos < len; ++pos) {
+        memcpy(buf2, buf1, sizeof(buf1));
+        tt_int_op(tor_memeq(buf1, buf2, len), OP_EQ, 1);
+        tt_int_op(tor_memcmp(buf1, buf2, len), OP_EQ, 0);
+        buf2[pos] ^= (uint8_t)(1u << (pos % 8));
+        tt_int_op(tor_memeq(buf1, buf2, len), OP_EQ, 0);
+        tt_int_op(tor_memcmp(buf1, buf2, len) < 0, OP_EQ,
+                  fast_memcmp(buf1, buf2, len) < 0);
+        tt_int_op(tor_memcmp(buf2, buf1, len) < 0, OP_EQ,
+                  fast_memcmp(buf2, buf1, len) < 0);
+        /* A later difference doesn't change the result. */
+        if (pos + 1 < len) {
+          buf2[len-1] ^= 0x80;
+          tt_int_op(tor_memcmp(buf1, buf2, len) < 0, OP_EQ,
+                    fast_memcmp(buf1, buf2, len) < 0);
+        }
+        memset(buf2, 0, sizeof(buf2));
+        buf2[pos] = 1;
+        tt_int_op(safe_mem_is_zero(buf2, len), OP_EQ, 0);
+        tt_int_op(safe_mem_is_zero(buf2, pos), OP_EQ, 1);
+      }
+    }
+  }
+
   tt_int_op(1, OP_EQ, safe_mem_is_zero("", 0));
   tt_int_op(1, OP_EQ, safe_mem_is_zero("", 1));
   tt_int_op(0, OP_EQ, safe_mem_is_zero("a", 1));
@@ -5644,8 +5938,14 @@ struct testcase_t util_tests[] = {
   UTIL_LEGACY(pow2),
   UTIL_LEGACY(gzip),
   UTIL_TEST(gzip_compression_bomb, TT_FORK),
+  { "compress_backend/x-zstd", test_util_compress_backend, 0,
+    &passthrough_setup, (void*)"x-zstd" },
+  { "compress_backend/x-tor-lzma", test_util_compress_backend, 0,
+    &passthrough_setup, (void*)"x-tor-lzma" },
   UTIL_LEGACY(datadir),
   UTIL_LEGACY(memarea),
+  UTIL_TEST(memarea_freelist, TT_FORK),
+  UTIL_TEST(latency_trace, TT_FORK),
   UTIL_LEGACY(control_formats),
   UTIL_LEGACY(mmap),
   UTIL_TEST(sscanf, TT_FORK),
@@ -5660,6 +5960,7 @@ struct testcase_t util_tests[] = {
   UTIL_TEST(find_str_at_start_of_line, 0),
   UTIL_TEST(string_is_C_identifier, 0),
   UTIL_TEST(asprintf, 0),
+  UTIL_TEST(strbuf, 0),
   UTIL_TEST(listdir, 0),
   UTIL_TEST(parent_dir, 0),
   UTIL_TEST(ftruncate, 0),
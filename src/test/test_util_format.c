@@ -378,6 +378,101 @@ test_util_format_base32_decode(void *arg)
   tor_free(dst);
 }
 
+/** Helper: return the <b>n</b>-bit big-endian value starting at bit
+ * <b>start</b> of the <b>len</b>-byte buffer <b>data</b>, as if the
+ * buffer were padded with zero bits. */
+static unsigned
+get_bits(const uint8_t *data, size_t len, size_t start, int n)
+{
+  unsigned v = 0;
+  int i;
+  for (i = 0; i < n; ++i) {
+    size_t bit = start + i;
+    v <<= 1;
+    if (bit / 8 < len)
+      v |= (data[bit / 8] >> (7 - bit % 8)) & 1;
+  }
+  return v;
+}
+
+static void
+test_util_format_codecs_all_lengths(void *arg)
+{
+  const char b64chars[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  uint8_t data[200];
+  char enc[600], ref[600], ml[600], dec[600];
+  size_t len, i, j;
+  int r;
+  (void)arg;
+
+  crypto_rand((char *)data, sizeof(data));
+
+  /* The codecs work on whole groups of input when they can, and one
+   * character at a time at the end: compare them against a bit-at-a-time
+   * reference at every length, so that every split gets checked. */
+  for (len = 0; len <= sizeof(data); ++len) {
+    /* base64, with and without newlines. */
+    for (i = 0; i < CEIL_DIV(len * 8, 6); ++i)
+      ref[i] = b64chars[get_bits(data, len, i * 6, 6)];
+    for ( ; i % 4; ++i)
+      ref[i] = '=';
+    ref[i] = '\0';
+    r = base64_encode(enc, sizeof(enc), (const char *)data, len, 0);
+    tt_int_op(r, OP_EQ, strlen(ref));
+    tt_str_op(enc, OP_EQ, ref);
+
+    for (i = j = 0; ref[i]; ++i) {
+      ml[j++] = ref[i];
+      if (i % 64 == 63 || !ref[i+1])
+        ml[j++] = '\n';
+    }
+    ml[j] = '\0';
+    r = base64_encode(enc, sizeof(enc), (const char *)data, len,
+                      BASE64_ENCODE_MULTILINE);
+    tt_int_op(r, OP_EQ, strlen(ml));
+    tt_str_op(enc, OP_EQ, ml);
+
+    r = base64_decode(dec, sizeof(dec), ml, strlen(ml));
+    tt_int_op(r, OP_EQ, len);
+    tt_mem_op(dec, OP_EQ, data, len);
+
+    /* Whitespace in the middle of a group of 4 characters. */
+    if (len >= 3) {
+      memcpy(ml, ref, 5);
+      ml[5] = ' ';
+      strlcpy(ml + 6, ref + 5, sizeof(ml) - 6);
+      r = base64_decode(dec, sizeof(dec), ml, strlen(ml));
+      tt_int_op(r, OP_EQ, len);
+      tt_mem_op(dec, OP_EQ, data, len);
+    }
+
+    /* base16, in both cases. */
+    base16_encode(enc, sizeof(enc), (const char *)data, len);
+    for (i = 0; i < len * 2; ++i)
+      ref[i] = "0123456789ABCDEF"[get_bits(data, len, i * 4, 4)];
+    ref[i] = '\0';
+    tt_str_op(enc, OP_EQ, ref);
+    tor_strlower(enc);
+    r = base16_decode(dec, sizeof(dec), enc, strlen(enc));
+    tt_int_op(r, OP_EQ, len);
+    tt_mem_op(dec, OP_EQ, data, len);
+
+    /* base32. */
+    base32_encode(enc, sizeof(enc), (const char *)data, len);
+    for (i = 0; i < CEIL_DIV(len * 8, 5); ++i)
+      ref[i] = BASE32_CHARS[get_bits(data, len, i * 5, 5)];
+    ref[i] = '\0';
+    tt_str_op(enc, OP_EQ, ref);
+    r = base32_decode(dec, len, enc, strlen(enc));
+    tt_int_op(r, OP_EQ, 0);
+    tt_mem_op(dec, OP_EQ, data, len);
+  }
+
+ done:
+  ;
+}
+
 struct testcase_t util_format_tests[] = {
   { "unaligned_accessors", test_util_format_unaligned_accessors, 0,
     NULL, NULL },
@@ -390,6 +485,8 @@ struct testcase_t util_format_tests[] = {
     NULL, NULL },
   { "base32_decode", test_util_format_base32_decode, 0,
     NULL, NULL },
+  { "codecs_all_lengths", test_util_format_codecs_all_lengths, 0,
+    NULL, NULL },
   END_OF_TESTCASES
 };
 
@@ -0,0 +1,116 @@
+/* Copyright (c) 2016, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+#define WATCHDOG_PRIVATE
+#include "orconfig.h"
+#include "or.h"
+#include "backtrace.h"
+#include "compat_threads.h"
+#include "watchdog.h"
+#include "test.h"
+#include "log_test_helpers.h"
+
+static void
+test_watchdog_stall_accounting(void *arg)
+{
+  watchdog_stats_t st;
+  uint64_t base;
+  char *s = NULL;
+  (void)arg;
+
+  /* Use times far in the future, so that the real watchdog thread never
+   * decides the main loop is stalled while we run. */
+  base = monotime_absolute_msec() + 1000000;
+
+  watchdog_get_stats(&st);
+  tt_u64_op(st.n_stalls, OP_EQ, 0);
+
+  /* 100 msec threshold; the timer fires every 25 msec. */
+  watchdog_set_threshold(100);
+
+  /* The first beat only starts the clock. */
+  tt_u64_op(watchdog_note_progress(base), OP_EQ, 0);
+  /* On time, and late by less than the threshold: no stall. */
+  tt_u64_op(watchdog_note_progress(base + 25), OP_EQ, 0);
+  tt_u64_op(watchdog_note_progress(base + 140), OP_EQ, 0);
+  /* Late by 200 msec, then by exactly the threshold. */
+  tt_u64_op(watchdog_note_progress(base + 365), OP_EQ, 200);
+  tt_u64_op(watchdog_note_progress(base + 490), OP_EQ, 100);
+
+  watchdog_get_stats(&st);
+  tt_u64_op(st.n_stalls, OP_EQ, 2);
+  tt_u64_op(st.total_stall_msec, OP_EQ, 300);
+  tt_u64_op(st.max_stall_msec, OP_EQ, 200);
+
+  /* We sample a stall only once it has lasted the threshold, and only
+   * once per stall.  (The real watchdog thread won't race with us here:
+   * it never gets far enough to modify anything, since our times are all
+   * in its future.) */
+  tt_int_op(watchdog_should_sample(base + 500), OP_EQ, 0);
+  tt_int_op(watchdog_should_sample(base + 615), OP_EQ, 1);
+  tt_int_op(watchdog_should_sample(base + 700), OP_EQ, 0);
+  /* The next beat ends the stall and lets us sample the next one. */
+  tt_u64_op(watchdog_note_progress(base + 800), OP_EQ, 285);
+  tt_int_op(watchdog_should_sample(base + 925), OP_EQ, 1);
+
+  s = watchdog_format_stats();
+  tt_assert(strstr(s, " count=3 total-msec=585 max-msec=285 sampled=0"));
+
+ done:
+  tor_free(s);
+  watchdog_free_all(0);
+}
+
+/** State shared with sampler_thread_main(). */
+static tor_mutex_t *sampler_lock = NULL;
+static int sampler_done = 0;
+
+/** Thread body: log a sample of the main thread's stack. */
+static void
+sampler_thread_main(void *arg)
+{
+  (void)arg;
+  log_sampled_backtrace(LOG_WARN, LD_GENERAL, "Sampling the test thread");
+  tor_mutex_acquire(sampler_lock);
+  sampler_done = 1;
+  tor_mutex_release(sampler_lock);
+}
+
+static void
+test_watchdog_sampled_backtrace(void *arg)
+{
+  int done = 0;
+  (void)arg;
+
+  sampler_lock = tor_mutex_new();
+  setup_full_capture_of_logs(LOG_WARN);
+
+  if (configure_backtrace_sampling() < 0) {
+    log_sampled_backtrace(LOG_WARN, LD_GENERAL, "Can't sample");
+    expect_single_log_msg_containing("Stack trace not available");
+    tt_skip();
+  }
+
+  tt_int_op(spawn_func(sampler_thread_main, NULL), OP_EQ, 0);
+  /* Keep the main thread busy, as it would be in a stall, until the other
+   * thread has sampled it. */
+  while (!done) {
+    tor_mutex_acquire(sampler_lock);
+    done = sampler_done;
+    tor_mutex_release(sampler_lock);
+  }
+  expect_log_msg_containing("Sampling the test thread. Stack trace:");
+
+ done:
+  teardown_capture_of_logs();
+  tor_mutex_free(sampler_lock);
+}
+
+struct testcase_t watchdog_tests[] = {
+  { "stall_accounting", test_watchdog_stall_accounting, TT_FORK,
+    NULL, NULL },
+  { "sampled_backtrace", test_watchdog_sampled_backtrace, TT_FORK,
+    NULL, NULL },
+  END_OF_TESTCASES
+};
+
@@ -18,6 +18,7 @@
 
 static int opt_verbose = 0;
 static int opt_n_threads = 8;
+static int opt_n_min_threads = 0;
 static int opt_n_items = 10000;
 static int opt_n_inflight = 1000;
 static int opt_n_lowwater = 250;
@@ -193,6 +194,8 @@ add_work(threadpool_t *tp)
   int add_rsa =
     opt_ratio_rsa == 0 ||
     tor_weak_random_range(&weak_rng, opt_ratio_rsa) == 0;
+  workqueue_priority_t prio =
+    tor_weak_random_range(&weak_rng, WORKQUEUE_N_PRIORITIES);
 
   if (add_rsa) {
     rsa_work_t *w = tor_malloc_zero(sizeof(*w));
@@ -200,14 +203,16 @@ add_work(threadpool_t *tp)
     crypto_rand((char*)w->msg, 20);
     w->msglen = 20;
     ++rsa_sent;
-    return threadpool_queue_work(tp, workqueue_do_rsa, handle_reply, w);
+    return threadpool_queue_work_priority(tp, prio, workqueue_do_rsa,
+                                          handle_reply, w);
   } else {
     ecdh_work_t *w = tor_malloc_zero(sizeof(*w));
     w->serial = n_sent++;
     /* Not strictly right, but this is just for benchmarks. */
     crypto_rand((char*)w->u.pk.public_key, 32);
     ++ecdh_sent;
-    return threadpool_queue_work(tp, workqueue_do_ecdh, handle_reply, w);
+    return threadpool_queue_work_priority(tp, prio, workqueue_do_ecdh,
+                                          handle_reply, w);
   }
 }
 
@@ -252,6 +257,7 @@ add_n_work_items(threadpool_t *tp, int n)
 }
 
 static int shutting_down = 0;
+static int max_threads_seen = 0;
 
 static void
 replysock_readable_cb(tor_socket_t sock, short what, void *arg)
@@ -267,6 +273,12 @@ replysock_readable_cb(tor_socket_t sock, short what, void *arg)
   if (old_r == n_received)
     return;
 
+  if (! shutting_down) {
+    int n_threads = threadpool_get_n_threads(tp);
+    if (n_threads > max_threads_seen)
+      max_threads_seen = n_threads;
+  }
+
   if (opt_verbose) {
     printf("%d / %d", n_received, n_sent);
     if (opt_n_cancel)
@@ -320,6 +332,7 @@ help(void)
      "  -v            Be verbose\n"
      "  -N <items>    Run this many items of work\n"
      "  -T <threads>  Use this many threads\n"
+     "  -M <threads>  Start this many threads, and grow to -T as needed\n"
      "  -I <inflight> Have no more than this many requests queued at once\n"
      "  -L <lowwater> Add items whenever fewer than this many are pending\n"
      "  -C <cancel>   Try to cancel N items of every batch that we add\n"
@@ -337,12 +350,16 @@ main(int argc, char **argv)
   tor_libevent_cfg evcfg;
   struct event *ev;
   uint32_t as_flags = 0;
+  int depth[WORKQUEUE_N_PRIORITIES];
+  uint64_t n_queued[WORKQUEUE_N_PRIORITIES], n_queued_total = 0;
 
   for (i = 1; i < argc; ++i) {
     if (!strcmp(argv[i], "-v")) {
       opt_verbose = 1;
     } else if (!strcmp(argv[i], "-T") && i+1<argc) {
       opt_n_threads = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "-M") && i+1<argc) {
+      opt_n_min_threads = atoi(argv[++i]);
     } else if (!strcmp(argv[i], "-N") && i+1<argc) {
       opt_n_items = atoi(argv[++i]);
     } else if (!strcmp(argv[i], "-I") && i+1<argc) {
@@ -375,6 +392,7 @@ main(int argc, char **argv)
   if (opt_n_threads < 1 ||
       opt_n_items < 1 || opt_n_inflight < 1 || opt_n_lowwater < 0 ||
       opt_n_cancel > opt_n_inflight || opt_n_inflight > MAX_INFLIGHT ||
+      opt_n_min_threads < 0 || opt_n_min_threads > opt_n_threads ||
       opt_ratio_rsa < 0) {
     help();
     return 1;
@@ -400,9 +418,18 @@ main(int argc, char **argv)
     return 77; // 77 means "skipped".
 
   tor_assert(rq);
-  tp = threadpool_new(opt_n_threads,
-                      rq, new_state, free_state, NULL);
-  tor_assert(tp);
+  if (opt_n_min_threads) {
+    tp = threadpool_new(opt_n_min_threads,
+                        rq, new_state, free_state, NULL);
+    tor_assert(tp);
+    tor_assert(threadpool_set_size_limits(tp, opt_n_min_threads,
+                                          opt_n_threads) == 0);
+  } else {
+    tp = threadpool_new(opt_n_threads,
+                        rq, new_state, free_state, NULL);
+    tor_assert(tp);
+  }
+  threadpool_set_thread_exit_fn(tp, crypto_thread_cleanup);
 
   crypto_seed_weak_rng(&weak_rng);
 
@@ -436,6 +463,10 @@ main(int argc, char **argv)
 
   event_base_loop(tor_libevent_get_base(), 0);
 
+  threadpool_get_queue_stats(tp, depth, n_queued);
+  for (i = 0; i < WORKQUEUE_N_PRIORITIES; ++i)
+    n_queued_total += n_queued[i];
+
   if (n_sent != opt_n_items || n_received+n_successful_cancel != n_sent) {
     printf("%d vs %d\n", n_sent, opt_n_items);
     printf("%d+%d vs %d\n", n_received, n_successful_cancel, n_sent);
@@ -444,7 +475,28 @@ main(int argc, char **argv)
   } else if (no_shutdown) {
     puts("Accepted work after shutdown\n");
     puts("FAIL");
+  } else if (opt_n_min_threads && opt_n_min_threads < opt_n_threads &&
+             max_threads_seen <= opt_n_min_threads) {
+    printf("Never grew past %d threads\n", max_threads_seen);
+    puts("FAIL");
+    return 1;
+  } else if (n_queued_total != (uint64_t)n_sent + 1 ||
+             depth[WQ_PRI_HIGH] != 1 ||
+             depth[WQ_PRI_MED] || depth[WQ_PRI_LOW]) {
+    /* Only the item we added after shutdown should still be waiting. */
+    printf(U64_FORMAT" vs %d+1 queued; %d/%d/%d waiting\n",
+           U64_PRINTF_ARG(n_queued_total), n_sent,
+           depth[WQ_PRI_HIGH], depth[WQ_PRI_MED], depth[WQ_PRI_LOW]);
+    puts("FAIL");
+    return 1;
   } else {
+    if (opt_verbose) {
+      uint64_t n_wakeups, n_replies;
+      replyqueue_get_stats(rq, &n_wakeups, &n_replies);
+      printf("%.2f replies per wakeup\n",
+             U64_TO_DBL(n_replies) / U64_TO_DBL(n_wakeups));
+      printf("at most %d threads\n", max_threads_seen);
+    }
     puts("OK");
     return 0;
   }
@@ -0,0 +1,3 @@
+#!/bin/sh
+
+${builddir:-.}/src/test/test_workqueue -M 1 -T 4
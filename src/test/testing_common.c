@@ -17,10 +17,12 @@ const char tor_git_revision[] = "";
 #include "orconfig.h"
 #include "or.h"
 #include "control.h"
+#include "memarea.h"
 #include "config.h"
 #include "rephist.h"
 #include "backtrace.h"
 #include "test.h"
+#include "timers.h"
 
 #include <stdio.h>
 #ifdef HAVE_FCNTL_H
@@ -279,6 +281,7 @@ main(int c, const char **v)
   update_approx_time(time(NULL));
   options = options_new();
   tor_threads_init();
+  memarea_init_freelists();
 
   network_init();
 
@@ -287,6 +290,7 @@ main(int c, const char **v)
   struct tor_libevent_cfg cfg;
   memset(&cfg, 0, sizeof(cfg));
   tor_libevent_initialize(&cfg);
+  timers_initialize();
 
   control_initialize_event_queue();
   configure_backtrace_handler(get_version());